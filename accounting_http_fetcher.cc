@@ -0,0 +1,94 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/accounting_http_fetcher.h"
+
+#include "update_engine/io_stats.h"
+
+using base::TimeTicks;
+using std::string;
+
+namespace chromeos_update_engine {
+
+AccountingHttpFetcher::AccountingHttpFetcher(HttpFetcher* fetcher,
+                                             const char* subsystem)
+    : HttpFetcher(fetcher->GetSystemState()),
+      fetcher_(fetcher),
+      subsystem_(subsystem),
+      bytes_received_(0) {
+  fetcher_->set_delegate(this);
+}
+
+void AccountingHttpFetcher::BeginTransfer(const string& url) {
+  url_ = url;
+  http_response_code_ = 0;
+  if (post_data_set_) {
+    fetcher_->SetPostData(post_data_.empty() ? NULL : &post_data_[0],
+                          post_data_.size(),
+                          post_content_type_);
+  }
+  fetcher_->set_compress_post_data(compress_post_data_);
+  fetcher_->set_accept_compressed_response(accept_compressed_response_);
+  fetcher_->set_if_none_match(if_none_match_);
+  bytes_received_ = 0;
+  start_time_ = TimeTicks::Now();
+  fetcher_->BeginTransfer(url);
+}
+
+void AccountingHttpFetcher::ReceivedBytes(HttpFetcher* fetcher,
+                                          const char* bytes,
+                                          int length) {
+  bytes_received_ += length;
+  if (delegate_)
+    delegate_->ReceivedBytes(this, bytes, length);
+}
+
+char* AccountingHttpFetcher::GetReceiveBuffer(HttpFetcher* fetcher,
+                                              size_t length) {
+  return delegate_ ? delegate_->GetReceiveBuffer(this, length) : NULL;
+}
+
+void AccountingHttpFetcher::ReceivedBytesInBuffer(HttpFetcher* fetcher,
+                                                  int length) {
+  bytes_received_ += length;
+  if (delegate_)
+    delegate_->ReceivedBytesInBuffer(this, length);
+}
+
+void AccountingHttpFetcher::SeekToOffset(off_t offset) {
+  if (delegate_)
+    delegate_->SeekToOffset(offset);
+}
+
+void AccountingHttpFetcher::ReceivedBytesAhead(HttpFetcher* fetcher,
+                                               off_t offset,
+                                               const char* bytes,
+                                               int length) {
+  // Counted when they're received again.
+  if (delegate_)
+    delegate_->ReceivedBytesAhead(this, offset, bytes, length);
+}
+
+void AccountingHttpFetcher::TransferComplete(HttpFetcher* fetcher,
+                                             bool successful) {
+  TransferEnded();
+  if (delegate_)
+    delegate_->TransferComplete(this, successful);
+}
+
+void AccountingHttpFetcher::TransferTerminated(HttpFetcher* fetcher) {
+  TransferEnded();
+  if (delegate_)
+    delegate_->TransferTerminated(this);
+}
+
+void AccountingHttpFetcher::TransferEnded() {
+  http_response_code_ = fetcher_->http_response_code();
+  response_etag_ = fetcher_->response_etag();
+  response_retry_after_ = fetcher_->response_retry_after();
+  IoStats::AddCalls(subsystem_, 1, bytes_received_,
+                    TimeTicks::Now() - start_time_);
+}
+
+}  // namespace chromeos_update_engine
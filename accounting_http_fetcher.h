@@ -0,0 +1,79 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_ACCOUNTING_HTTP_FETCHER_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_ACCOUNTING_HTTP_FETCHER_H__
+
+#include <string>
+
+#include <base/memory/scoped_ptr.h>
+#include <base/time.h>
+
+#include "update_engine/http_fetcher.h"
+
+// A wrapper around an HttpFetcher that passes everything through to it and
+// counts its transfers in the IoStats of a subsystem: a call per transfer,
+// with the bytes received and the time from BeginTransfer() until the
+// transfer completed or was terminated.
+
+namespace chromeos_update_engine {
+
+class AccountingHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
+ public:
+  // Takes ownership of |fetcher|. |subsystem| must outlive the fetcher.
+  AccountingHttpFetcher(HttpFetcher* fetcher, const char* subsystem);
+  virtual ~AccountingHttpFetcher() {}
+
+  // HttpFetcher overrides.
+  virtual void SetOffset(off_t offset) { fetcher_->SetOffset(offset); }
+  virtual void SetLength(size_t length) { fetcher_->SetLength(length); }
+  virtual void UnsetLength() { fetcher_->UnsetLength(); }
+  virtual void BeginTransfer(const std::string& url);
+  virtual void TerminateTransfer() { fetcher_->TerminateTransfer(); }
+  virtual void Pause() { fetcher_->Pause(); }
+  virtual void Unpause() { fetcher_->Unpause(); }
+  virtual void set_retry_seconds(int seconds) {
+    fetcher_->set_retry_seconds(seconds);
+  }
+  virtual size_t GetBytesDownloaded() {
+    return fetcher_->GetBytesDownloaded();
+  }
+  virtual int GetRetryCount() { return fetcher_->GetRetryCount(); }
+  virtual void SetBuildType(bool is_official) {
+    fetcher_->SetBuildType(is_official);
+  }
+
+ private:
+  // HttpFetcherDelegate overrides, which count the transfer and pass the
+  // calls on to the delegate, as if they came from this fetcher.
+  virtual void ReceivedBytes(HttpFetcher* fetcher,
+                             const char* bytes,
+                             int length);
+  virtual char* GetReceiveBuffer(HttpFetcher* fetcher, size_t length);
+  virtual void ReceivedBytesInBuffer(HttpFetcher* fetcher, int length);
+  virtual void SeekToOffset(off_t offset);
+  virtual void ReceivedBytesAhead(HttpFetcher* fetcher,
+                                  off_t offset,
+                                  const char* bytes,
+                                  int length);
+  virtual void TransferComplete(HttpFetcher* fetcher, bool successful);
+  virtual void TransferTerminated(HttpFetcher* fetcher);
+
+  // Counts the transfer that just ended and takes the response fields of
+  // the wrapped fetcher.
+  void TransferEnded();
+
+  scoped_ptr<HttpFetcher> fetcher_;
+  const char* subsystem_;
+
+  // The bytes received since, and the time of, the last BeginTransfer().
+  uint64_t bytes_received_;
+  base::TimeTicks start_time_;
+
+  DISALLOW_COPY_AND_ASSIGN(AccountingHttpFetcher);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_ACCOUNTING_HTTP_FETCHER_H__
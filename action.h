@@ -91,11 +91,11 @@ class AbstractAction {
     processor_ = processor;
   }
 
-  // Returns true iff the action is the current action of its ActionProcessor.
+  // Returns true iff the action is processing in its ActionProcessor.
   bool IsRunning() const {
     if (!processor_)
       return false;
-    return processor_->current_action() == this;
+    return processor_->IsActionRunning(this);
   }
 
   // Called on asynchronous actions if canceled. Actions may implement if
@@ -105,6 +105,20 @@ class AbstractAction {
   // Only the ActionProcessor should call this.
   virtual void TerminateProcessing() {};
 
+  // Called on a running action once the actions the ActionProcessor started
+  // concurrently before it have all completed successfully, e.g., so that it
+  // can pick up their output. Not called if there were none running when
+  // the action started; see
+  // ActionProcessor::IsRunningEarlierConcurrentActions().
+  virtual void ConcurrentActionsCompleted() {}
+
+  // Called on a running action to hold off its work, e.g., while the
+  // system is under pressure, until ResumeAction() is called. Actions that
+  // do their work in steps may implement these to stop between steps; the
+  // rest keep going. Only the ActionProcessor should call these.
+  virtual void SuspendAction() {}
+  virtual void ResumeAction() {}
+
   // These methods are useful for debugging. TODO(adlr): consider using
   // std::type_info for this?
   // Type() returns a string of the Action type. I.e., for DownloadAction,
@@ -165,6 +179,16 @@ class Action : public AbstractAction {
     return in_pipe_->contents();
   }
 
+  // Takes the object in the input pipe into |*in_obj| without copying it,
+  // leaving the previous contents of |*in_obj| in the pipe. Only for an
+  // action that's the last one to read its input, as the object is then
+  // owned by the action.
+  void SwapInputObject(
+      typename ActionTraits<SubClass>::InputObjectType* in_obj) {
+    CHECK(HasInputObject());
+    in_pipe_->swap_contents(in_obj);
+  }
+
   // Returns true iff there's an output pipe.
   bool HasOutputPipe() const {
     return out_pipe_.get();
@@ -179,6 +203,15 @@ class Action : public AbstractAction {
     out_pipe_->set_contents(out_obj);
   }
 
+  // Hands |*out_obj| over to the next Action without copying it, leaving the
+  // previous contents of the output pipe in |*out_obj|. The object belongs to
+  // the pipe afterwards, so the action mustn't rely on |*out_obj| anymore.
+  void SwapOutputObject(
+      typename ActionTraits<SubClass>::OutputObjectType* out_obj) {
+    CHECK(HasOutputPipe());
+    out_pipe_->swap_contents(out_obj);
+  }
+
   // Returns a reference to the object sitting in the output pipe.
   const typename ActionTraits<SubClass>::OutputObjectType& GetOutputObject() {
     CHECK(HasOutputPipe());
@@ -6,6 +6,7 @@
 #define CHROMEOS_PLATFORM_UPDATE_ENGINE_PIPE_H__
 
 #include <stdio.h>
+#include <algorithm>
 #include <iostream>
 #include <map>
 #include <string>
@@ -51,6 +52,14 @@ class ActionPipe {
   // Stores a copy of the passed object in this pipe.
   void set_contents(const ObjectType& contents) { contents_ = contents; }
 
+  // Exchanges the stored object with |*contents|, handing it over without a
+  // copy. Types with large members, e.g., InstallPlan, provide a swap()
+  // found by argument-dependent lookup; others are swapped by std::swap().
+  void swap_contents(ObjectType* contents) {
+    using std::swap;
+    swap(contents_, *contents);
+  }
+
   // Bonds two Actions together with a new ActionPipe. The ActionPipe is
   // jointly owned by the two Actions and will be automatically destroyed
   // when the last Action is destroyed.
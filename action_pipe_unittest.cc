@@ -43,4 +43,18 @@ TEST(ActionPipeTest, SimpleTest) {
   EXPECT_EQ("foo", b.in_pipe()->contents());
 }
 
+// Objects are handed over without a copy by swapping them with the pipe's.
+TEST(ActionPipeTest, SwapTest) {
+  ActionPipeTestAction a, b;
+  BondActions(&a, &b);
+  string out = "foo";
+  a.SwapOutputObject(&out);
+  EXPECT_EQ("", out);
+  EXPECT_EQ("foo", b.GetInputObject());
+  string in = "bar";
+  b.SwapInputObject(&in);
+  EXPECT_EQ("foo", in);
+  EXPECT_EQ("bar", a.GetOutputObject());
+}
+
 }  // namespace chromeos_update_engine
@@ -3,16 +3,25 @@
 // found in the LICENSE file.
 
 #include "update_engine/action_processor.h"
+#include <algorithm>
 #include <string>
 #include "base/logging.h"
 #include "update_engine/action.h"
+#include "update_engine/memory_tracker.h"
+#include "update_engine/probes.h"
+#include "update_engine/trace.h"
+#include "update_engine/utils.h"
 
 using std::string;
+using std::vector;
 
 namespace chromeos_update_engine {
 
 ActionProcessor::ActionProcessor()
-    : current_action_(NULL), delegate_(NULL) {}
+    : current_action_(NULL),
+      starting_actions_(false),
+      suspended_(false),
+      delegate_(NULL) {}
 
 ActionProcessor::~ActionProcessor() {
   if (IsRunning()) {
@@ -24,50 +33,203 @@ ActionProcessor::~ActionProcessor() {
   }
 }
 
+bool ActionProcessor::IsActionRunning(const AbstractAction* action) const {
+  return action == current_action_ ||
+      std::find(running_concurrent_actions_.begin(),
+                running_concurrent_actions_.end(),
+                action) != running_concurrent_actions_.end();
+}
+
+bool ActionProcessor::IsRunningEarlierConcurrentActions(
+    const AbstractAction* action) const {
+  if (action == current_action_)
+    return !running_concurrent_actions_.empty();
+  // The concurrent Actions are kept in the order they were started in.
+  return !running_concurrent_actions_.empty() &&
+      running_concurrent_actions_.front() != action;
+}
+
+void ActionProcessor::SuspendProcessing() {
+  if (suspended_)
+    return;
+  suspended_ = true;
+  vector<AbstractAction*> actions(running_concurrent_actions_);
+  if (current_action_)
+    actions.push_back(current_action_);
+  for (vector<AbstractAction*>::iterator it = actions.begin();
+       it != actions.end(); ++it) {
+    LOG(INFO) << "ActionProcessor: suspending " << (*it)->Type();
+    (*it)->SuspendAction();
+  }
+}
+
+void ActionProcessor::ResumeProcessing() {
+  if (!suspended_)
+    return;
+  suspended_ = false;
+  vector<AbstractAction*> actions(running_concurrent_actions_);
+  if (current_action_)
+    actions.push_back(current_action_);
+  for (vector<AbstractAction*>::iterator it = actions.begin();
+       it != actions.end(); ++it) {
+    LOG(INFO) << "ActionProcessor: resuming " << (*it)->Type();
+    (*it)->ResumeAction();
+  }
+}
+
 void ActionProcessor::EnqueueAction(AbstractAction* action) {
   actions_.push_back(action);
   action->SetProcessor(this);
 }
 
+void ActionProcessor::EnqueueConcurrentAction(AbstractAction* action) {
+  actions_.push_back(action);
+  action->SetProcessor(this);
+  concurrent_actions_.insert(action);
+}
+
 void ActionProcessor::StartProcessing() {
   CHECK(!IsRunning());
   if (!actions_.empty()) {
-    current_action_ = actions_.front();
     LOG(INFO) << "ActionProcessor::StartProcessing: "
-              << current_action_->Type();
-    actions_.pop_front();
-    current_action_->PerformAction();
+              << actions_.front()->Type();
+    StartNextActions();
   }
 }
 
 void ActionProcessor::StopProcessing() {
   CHECK(IsRunning());
-  CHECK(current_action_);
-  current_action_->TerminateProcessing();
-  CHECK(current_action_);
-  current_action_->SetProcessor(NULL);
-  LOG(INFO) << "ActionProcessor::StopProcessing: aborted "
-            << current_action_->Type();
-  current_action_ = NULL;
+  TerminateActions();
   if (delegate_)
     delegate_->ProcessingStopped(this);
 }
 
+void ActionProcessor::StartNextActions() {
+  // Concurrent Actions that complete right away are only forgotten by
+  // ActionComplete(), so that the Action they run alongside is still
+  // started here. If one fails, processing is aborted and this is reset.
+  starting_actions_ = true;
+  while (starting_actions_ && !actions_.empty() &&
+         concurrent_actions_.count(actions_.front())) {
+    AbstractAction* action = actions_.front();
+    actions_.pop_front();
+    concurrent_actions_.erase(action);
+    running_concurrent_actions_.push_back(action);
+    LOG(INFO) << "ActionProcessor: starting " << action->Type()
+              << " concurrently";
+    PerformAction(action);
+  }
+  if (!starting_actions_)
+    return;
+  starting_actions_ = false;
+  if (!actions_.empty()) {
+    current_action_ = actions_.front();
+    actions_.pop_front();
+    PerformAction(current_action_);
+    return;
+  }
+  if (!IsRunning() && delegate_)
+    delegate_->ProcessingDone(this, kActionCodeSuccess);
+}
+
+void ActionProcessor::PerformAction(AbstractAction* action) {
+  if (Trace::enabled())
+    start_times_[action] = base::Time::Now();
+  UE_PROBE1(action_start, action->Type().c_str());
+  MemoryTracker::SetAction(action->Type());
+  action->PerformAction();
+  // The action may have completed already.
+  if (suspended_ && IsActionRunning(action))
+    action->SuspendAction();
+}
+
+void ActionProcessor::TerminateActions() {
+  vector<AbstractAction*> actions(running_concurrent_actions_);
+  if (current_action_)
+    actions.push_back(current_action_);
+  for (vector<AbstractAction*>::iterator it = actions.begin();
+       it != actions.end(); ++it) {
+    (*it)->TerminateProcessing();
+    (*it)->SetProcessor(NULL);
+    LOG(INFO) << "ActionProcessor: aborted " << (*it)->Type();
+    TraceAction(*it, "aborted");
+    UE_PROBE2(action_end, (*it)->Type().c_str(), -1);
+  }
+  running_concurrent_actions_.clear();
+  current_action_ = NULL;
+  MemoryTracker::SetAction("");
+}
+
+void ActionProcessor::TraceAction(AbstractAction* action,
+                                  const string& result) {
+  std::map<const AbstractAction*, base::Time>::iterator it =
+      start_times_.find(action);
+  if (it == start_times_.end())
+    return;
+  TraceArgs args;
+  args["result"] = result;
+  Trace::AddCompleteEvent("action", action->Type(), it->second, args);
+  start_times_.erase(it);
+}
+
 void ActionProcessor::ActionComplete(AbstractAction* actionptr,
                                      ActionExitCode code) {
-  CHECK_EQ(actionptr, current_action_);
+  CHECK(IsActionRunning(actionptr));
+  TraceAction(actionptr, utils::CodeToString(code));
+  UE_PROBE2(action_end, actionptr->Type().c_str(), static_cast<int>(code));
   if (delegate_)
     delegate_->ActionCompleted(this, actionptr, code);
-  string old_type = current_action_->Type();
-  current_action_->SetProcessor(NULL);
-  current_action_ = NULL;
-  if (actions_.empty()) {
-    LOG(INFO) << "ActionProcessor::ActionComplete: finished last action of"
-                 " type " << old_type;
-  } else if (code != kActionCodeSuccess) {
+  string old_type = actionptr->Type();
+  actionptr->SetProcessor(NULL);
+  // Whether it's the earliest concurrent Action still processing.
+  bool first_concurrent_action = false;
+  if (actionptr == current_action_) {
+    current_action_ = NULL;
+  } else {
+    first_concurrent_action = running_concurrent_actions_.front() == actionptr;
+    running_concurrent_actions_.erase(
+        std::find(running_concurrent_actions_.begin(),
+                  running_concurrent_actions_.end(),
+                  actionptr));
+  }
+  // The memory used from now on is counted for the Action still running,
+  // if any, until the next one starts.
+  MemoryTracker::SetAction(current_action_ ? current_action_->Type() : "");
+  if (code != kActionCodeSuccess) {
     LOG(INFO) << "ActionProcessor::ActionComplete: " << old_type
               << " action failed. Aborting processing.";
+    // The Actions running concurrently with it can't complete either.
+    TerminateActions();
     actions_.clear();
+    concurrent_actions_.clear();
+    starting_actions_ = false;
+    if (delegate_) {
+      delegate_->ProcessingDone(this, code);
+    }
+    return;
+  }
+  if (starting_actions_)
+    return;
+  if (first_concurrent_action && !running_concurrent_actions_.empty()) {
+    LOG(INFO) << "ActionProcessor::ActionComplete: finished " << old_type
+              << " concurrently with "
+              << running_concurrent_actions_.front()->Type();
+    // The Actions started after it keep running, and the current Action
+    // is told once they've all completed.
+    running_concurrent_actions_.front()->ConcurrentActionsCompleted();
+    return;
+  }
+  if (current_action_) {
+    LOG(INFO) << "ActionProcessor::ActionComplete: finished " << old_type
+              << " concurrently with " << current_action_->Type();
+    if (running_concurrent_actions_.empty())
+      current_action_->ConcurrentActionsCompleted();
+    return;
+  }
+  if (!running_concurrent_actions_.empty()) {
+    LOG(INFO) << "ActionProcessor::ActionComplete: finished " << old_type
+              << ", waiting for the actions running concurrently with it";
+    return;
   }
   if (actions_.empty()) {
     LOG(INFO) << "ActionProcessor::ActionComplete: finished last action of"
@@ -77,11 +239,9 @@ void ActionProcessor::ActionComplete(AbstractAction* actionptr,
     }
     return;
   }
-  current_action_ = actions_.front();
-  actions_.pop_front();
   LOG(INFO) << "ActionProcessor::ActionComplete: finished " << old_type
-            << ", starting " << current_action_->Type();
-  current_action_->PerformAction();
+            << ", starting " << actions_.front()->Type();
+  StartNextActions();
 }
 
 }  // namespace chromeos_update_engine
@@ -6,8 +6,13 @@
 #define CHROMEOS_PLATFORM_UPDATE_ENGINE_ACTION_PROCESSOR_H__
 
 #include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
 
 #include "base/basictypes.h"
+#include "base/time.h"
 
 // The structure of these classes (Action, ActionPipe, ActionProcessor, etc.)
 // is based on the KSAction* classes from the Google Update Engine code at
@@ -18,6 +23,9 @@
 // See action.h for an overview of this class and other other Action* classes.
 
 // An ActionProcessor keeps a queue of Actions and processes them in order.
+// An Action enqueued as concurrent runs alongside the Action that follows it
+// in the queue instead: it's started right before that one, and the Action
+// after that one doesn't start until both have completed.
 
 namespace chromeos_update_engine {
 
@@ -120,18 +128,47 @@ class ActionProcessor {
   void StopProcessing();
 
   // Returns true iff an Action is currently processing.
-  bool IsRunning() const { return NULL != current_action_; }
+  bool IsRunning() const {
+    return NULL != current_action_ || !running_concurrent_actions_.empty();
+  }
+
+  // Returns true iff |action| is currently processing.
+  bool IsActionRunning(const AbstractAction* action) const;
+
+  // Suspends the Actions that are processing, and those started later on,
+  // until ResumeProcessing() is called. See AbstractAction::SuspendAction().
+  void SuspendProcessing();
+  void ResumeProcessing();
+  bool suspended() const { return suspended_; }
+
+  // Returns true iff Actions started concurrently with the current one are
+  // still processing. The current Action is told when they've all completed
+  // successfully; see AbstractAction::ConcurrentActionsCompleted().
+  bool IsRunningConcurrentActions() const {
+    return !running_concurrent_actions_.empty();
+  }
 
   // Adds another Action to the end of the queue.
   virtual void EnqueueAction(AbstractAction* action);
 
+  // Returns true iff Actions started concurrently before |action|, which
+  // must be processing, are still processing. For the current Action, these
+  // are all the concurrent Actions.
+  bool IsRunningEarlierConcurrentActions(const AbstractAction* action) const;
+
+  // Adds an Action to the end of the queue that runs concurrently with the
+  // Action enqueued after it, and with the other concurrent Actions enqueued
+  // right before that one, if any. If one fails, the others are terminated.
+  virtual void EnqueueConcurrentAction(AbstractAction* action);
+
   // Sets/gets the current delegate. Set to NULL to remove a delegate.
   ActionProcessorDelegate* delegate() const { return delegate_; }
   void set_delegate(ActionProcessorDelegate *delegate) {
     delegate_ = delegate;
   }
 
-  // Returns a pointer to the current Action that's processing.
+  // Returns a pointer to the current Action that's processing. Actions
+  // running concurrently with it aren't included.
   AbstractAction* current_action() const {
     return current_action_;
   }
@@ -140,13 +177,44 @@ class ActionProcessor {
   void ActionComplete(AbstractAction* actionptr, ActionExitCode code);
 
  private:
+  // Starts the Action at the front of the queue, after the concurrent
+  // Actions in front of it, if any. Calls ProcessingDone() on the delegate
+  // if there's none left to wait for.
+  void StartNextActions();
+
+  // Starts |action|, recording when for the trace.
+  void PerformAction(AbstractAction* action);
+
+  // Terminates the Actions that are processing, and forgets those that
+  // haven't begun processing.
+  void TerminateActions();
+
+  // Adds the trace event of |action|, which ended with |result|.
+  void TraceAction(AbstractAction* action, const std::string& result);
+
   // Actions that have not yet begun processing, in the order in which
   // they'll be processed.
   std::deque<AbstractAction*> actions_;
 
+  // The Actions of |actions_| enqueued as concurrent.
+  std::set<AbstractAction*> concurrent_actions_;
+
   // A pointer to the currrently processing Action, if any.
   AbstractAction* current_action_;
 
+  // The concurrent Actions that are processing.
+  std::vector<AbstractAction*> running_concurrent_actions_;
+
+  // True while StartNextActions() starts concurrent Actions, which may
+  // complete before it's done.
+  bool starting_actions_;
+
+  // True between SuspendProcessing() and ResumeProcessing().
+  bool suspended_;
+
+  // When the processing Actions started, for the trace.
+  std::map<const AbstractAction*, base::Time> start_times_;
+
   // A pointer to the delegate, or NULL if none.
   ActionProcessorDelegate *delegate_;
   DISALLOW_COPY_AND_ASSIGN(ActionProcessor);
@@ -26,14 +26,31 @@ class ActionTraits<ActionProcessorTestAction> {
 struct ActionProcessorTestAction : public Action<ActionProcessorTestAction> {
   typedef string InputObjectType;
   typedef string OutputObjectType;
+  ActionProcessorTestAction()
+      : terminate_count(0),
+        concurrent_actions_completed_count(0),
+        suspend_count(0),
+        resume_count(0) {}
   ActionPipe<string>* in_pipe() { return in_pipe_.get(); }
   ActionPipe<string>* out_pipe() { return out_pipe_.get(); }
   ActionProcessor* processor() { return processor_; }
   void PerformAction() {}
+  void TerminateProcessing() { terminate_count++; }
+  void ConcurrentActionsCompleted() { concurrent_actions_completed_count++; }
+  void SuspendAction() { suspend_count++; }
+  void ResumeAction() { resume_count++; }
   void CompleteAction() {
     ASSERT_TRUE(processor());
     processor()->ActionComplete(this, kActionCodeSuccess);
   }
+  void FailAction() {
+    ASSERT_TRUE(processor());
+    processor()->ActionComplete(this, kActionCodeError);
+  }
+  int terminate_count;
+  int concurrent_actions_completed_count;
+  int suspend_count;
+  int resume_count;
   string Type() const { return "ActionProcessorTestAction"; }
 };
 
@@ -141,6 +158,157 @@ TEST(ActionProcessorTest, ChainActionsTest) {
   EXPECT_FALSE(action_processor.IsRunning());
 }
 
+TEST(ActionProcessorTest, ConcurrentActionsTest) {
+  ActionProcessorTestAction action1, action2, action3;
+  ActionProcessor action_processor;
+  MyActionProcessorDelegate delegate(&action_processor);
+  action_processor.set_delegate(&delegate);
+  action_processor.EnqueueConcurrentAction(&action1);
+  action_processor.EnqueueAction(&action2);
+  action_processor.EnqueueAction(&action3);
+  action_processor.StartProcessing();
+  EXPECT_TRUE(action1.IsRunning());
+  EXPECT_TRUE(action2.IsRunning());
+  EXPECT_FALSE(action3.IsRunning());
+  EXPECT_EQ(&action2, action_processor.current_action());
+  EXPECT_TRUE(action_processor.IsRunningConcurrentActions());
+
+  // The next action waits for the concurrent one.
+  action2.CompleteAction();
+  delegate.action_completed_called_ = false;
+  EXPECT_TRUE(action_processor.IsRunning());
+  EXPECT_EQ(NULL, action_processor.current_action());
+  EXPECT_TRUE(action1.IsRunning());
+  EXPECT_FALSE(action3.IsRunning());
+
+  action1.CompleteAction();
+  delegate.action_completed_called_ = false;
+  EXPECT_FALSE(action1.IsRunning());
+  EXPECT_EQ(&action3, action_processor.current_action());
+  EXPECT_FALSE(action_processor.IsRunningConcurrentActions());
+  EXPECT_EQ(0, action2.concurrent_actions_completed_count);
+  EXPECT_FALSE(delegate.processing_done_called_);
+
+  action3.CompleteAction();
+  EXPECT_FALSE(action_processor.IsRunning());
+  EXPECT_TRUE(delegate.processing_done_called_);
+  EXPECT_EQ(0, action2.terminate_count);
+  action_processor.set_delegate(NULL);
+}
+
+TEST(ActionProcessorTest, ConcurrentActionCompletesFirstTest) {
+  ActionProcessorTestAction action1, action2;
+  ActionProcessor action_processor;
+  action_processor.EnqueueConcurrentAction(&action1);
+  action_processor.EnqueueAction(&action2);
+  action_processor.StartProcessing();
+  action1.CompleteAction();
+  EXPECT_EQ(&action2, action_processor.current_action());
+  EXPECT_FALSE(action_processor.IsRunningConcurrentActions());
+  EXPECT_EQ(1, action2.concurrent_actions_completed_count);
+  action2.CompleteAction();
+  EXPECT_FALSE(action_processor.IsRunning());
+}
+
+TEST(ActionProcessorTest, ConcurrentActionGroupTest) {
+  ActionProcessorTestAction action1, action2, action3;
+  ActionProcessor action_processor;
+  action_processor.EnqueueConcurrentAction(&action1);
+  action_processor.EnqueueConcurrentAction(&action2);
+  action_processor.EnqueueAction(&action3);
+  action_processor.StartProcessing();
+  EXPECT_TRUE(action1.IsRunning());
+  EXPECT_TRUE(action2.IsRunning());
+  EXPECT_EQ(&action3, action_processor.current_action());
+  EXPECT_FALSE(action_processor.IsRunningEarlierConcurrentActions(&action1));
+  EXPECT_TRUE(action_processor.IsRunningEarlierConcurrentActions(&action2));
+  EXPECT_TRUE(action_processor.IsRunningEarlierConcurrentActions(&action3));
+
+  // The concurrent action started next is told first.
+  action1.CompleteAction();
+  EXPECT_EQ(1, action2.concurrent_actions_completed_count);
+  EXPECT_EQ(0, action3.concurrent_actions_completed_count);
+  EXPECT_FALSE(action_processor.IsRunningEarlierConcurrentActions(&action2));
+  EXPECT_TRUE(action_processor.IsRunningEarlierConcurrentActions(&action3));
+
+  action2.CompleteAction();
+  EXPECT_EQ(1, action2.concurrent_actions_completed_count);
+  EXPECT_EQ(1, action3.concurrent_actions_completed_count);
+  EXPECT_FALSE(action_processor.IsRunningConcurrentActions());
+  action3.CompleteAction();
+  EXPECT_FALSE(action_processor.IsRunning());
+}
+
+TEST(ActionProcessorTest, ConcurrentActionFailsTest) {
+  ActionProcessorTestAction action1, action2, action3;
+  ActionProcessor action_processor;
+  MyActionProcessorDelegate delegate(&action_processor);
+  action_processor.set_delegate(&delegate);
+  action_processor.EnqueueConcurrentAction(&action1);
+  action_processor.EnqueueAction(&action2);
+  action_processor.EnqueueAction(&action3);
+  action_processor.StartProcessing();
+
+  // The action running alongside the failed one is terminated.
+  action1.FailAction();
+  EXPECT_FALSE(action_processor.IsRunning());
+  EXPECT_EQ(1, action2.terminate_count);
+  EXPECT_FALSE(action2.IsRunning());
+  EXPECT_EQ(NULL, action2.processor());
+  EXPECT_FALSE(action3.IsRunning());
+  EXPECT_EQ(0, action2.concurrent_actions_completed_count);
+  EXPECT_TRUE(delegate.processing_done_called_);
+  EXPECT_EQ(kActionCodeError, delegate.action_exit_code_);
+  action_processor.set_delegate(NULL);
+}
+
+TEST(ActionProcessorTest, StopConcurrentActionsTest) {
+  ActionProcessorTestAction action1, action2;
+  ActionProcessor action_processor;
+  MyActionProcessorDelegate delegate(&action_processor);
+  action_processor.set_delegate(&delegate);
+  action_processor.EnqueueConcurrentAction(&action1);
+  action_processor.EnqueueAction(&action2);
+  action_processor.StartProcessing();
+  action2.CompleteAction();
+  action_processor.StopProcessing();
+  EXPECT_TRUE(delegate.processing_stopped_called_);
+  EXPECT_FALSE(delegate.processing_done_called_);
+  EXPECT_EQ(1, action1.terminate_count);
+  EXPECT_EQ(NULL, action1.processor());
+  EXPECT_FALSE(action_processor.IsRunning());
+  action_processor.set_delegate(NULL);
+}
+
+TEST(ActionProcessorTest, SuspendTest) {
+  ActionProcessorTestAction action1, action2, action3;
+  ActionProcessor action_processor;
+  action_processor.EnqueueConcurrentAction(&action1);
+  action_processor.EnqueueAction(&action2);
+  action_processor.EnqueueAction(&action3);
+  action_processor.StartProcessing();
+  action_processor.SuspendProcessing();
+  action_processor.SuspendProcessing();
+  EXPECT_TRUE(action_processor.suspended());
+  EXPECT_EQ(1, action1.suspend_count);
+  EXPECT_EQ(1, action2.suspend_count);
+
+  // The actions started while suspended are suspended too.
+  action2.CompleteAction();
+  action1.CompleteAction();
+  EXPECT_EQ(&action3, action_processor.current_action());
+  EXPECT_EQ(1, action3.suspend_count);
+
+  action_processor.ResumeProcessing();
+  action_processor.ResumeProcessing();
+  EXPECT_FALSE(action_processor.suspended());
+  EXPECT_EQ(1, action3.resume_count);
+  EXPECT_EQ(0, action1.resume_count);
+  EXPECT_EQ(0, action2.resume_count);
+  action3.CompleteAction();
+  EXPECT_FALSE(action_processor.IsRunning());
+}
+
 TEST(ActionProcessorTest, DtorTest) {
   ActionProcessorTestAction action1, action2;
   {
@@ -0,0 +1,142 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/aligned_buffer_pool.h"
+
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+
+using std::max;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+const size_t kDirectIOAlignment = 4096;
+const size_t kHugePageSize = 2 * 1024 * 1024;
+const size_t kMaxSharedBufferSize = 16 * 1024 * 1024;
+
+namespace {
+
+// The shared pools, indexed by the base 2 logarithm of their buffer size,
+// created on first use.
+const size_t kSharedPoolCount = 25;  // up to kMaxSharedBufferSize
+AlignedBufferPool* shared_pools[kSharedPoolCount];
+// Guards |shared_pools|.
+GMutex shared_pools_mutex;
+
+}  // namespace {}
+
+AlignedBufferPool::AlignedBufferPool(size_t buffer_size, size_t alignment)
+    : buffer_size_(buffer_size),
+      alignment_(alignment),
+      huge_pages_(false) {
+  CHECK_GT(alignment_, static_cast<size_t>(0));
+  CHECK_EQ(alignment_ & (alignment_ - 1), static_cast<size_t>(0));
+  CHECK_EQ(buffer_size_ % alignment_, static_cast<size_t>(0));
+  g_mutex_init(&mutex_);
+}
+
+AlignedBufferPool::~AlignedBufferPool() {
+  LOG_IF(WARNING, free_buffers_.size() != buffers_.size())
+      << buffers_.size() - free_buffers_.size()
+      << " aligned buffers weren't returned to the pool.";
+  for (vector<char*>::iterator it = buffers_.begin(); it != buffers_.end();
+       ++it) {
+    free(*it);
+  }
+  g_mutex_clear(&mutex_);
+}
+
+char* AlignedBufferPool::Get() {
+  g_mutex_lock(&mutex_);
+  char* buffer = NULL;
+  if (!free_buffers_.empty()) {
+    buffer = free_buffers_.back();
+    free_buffers_.pop_back();
+  } else {
+    void* memory = NULL;
+    const bool huge_pages = huge_pages_ && buffer_size_ % kHugePageSize == 0;
+    int rc = posix_memalign(&memory,
+                            huge_pages ? max(alignment_, kHugePageSize) :
+                            alignment_,
+                            buffer_size_);
+    if (rc == 0) {
+      buffer = reinterpret_cast<char*>(memory);
+      buffers_.push_back(buffer);
+#if defined(MADV_HUGEPAGE)
+      // It's only a hint, which kernels without transparent huge pages
+      // reject.
+      if (huge_pages)
+        madvise(buffer, buffer_size_, MADV_HUGEPAGE);
+#endif
+    } else {
+      LOG(ERROR) << "Unable to allocate an aligned buffer of " << buffer_size_
+                 << " bytes: " << rc;
+    }
+  }
+  g_mutex_unlock(&mutex_);
+  return buffer;
+}
+
+void AlignedBufferPool::Put(char* buffer) {
+  CHECK(buffer);
+  g_mutex_lock(&mutex_);
+  free_buffers_.push_back(buffer);
+  g_mutex_unlock(&mutex_);
+}
+
+void AlignedBufferPool::Trim() {
+  g_mutex_lock(&mutex_);
+  std::sort(free_buffers_.begin(), free_buffers_.end());
+  vector<char*> used_buffers;
+  for (vector<char*>::iterator it = buffers_.begin(); it != buffers_.end();
+       ++it) {
+    if (std::binary_search(free_buffers_.begin(), free_buffers_.end(), *it))
+      free(*it);
+    else
+      used_buffers.push_back(*it);
+  }
+  buffers_.swap(used_buffers);
+  free_buffers_.clear();
+  g_mutex_unlock(&mutex_);
+}
+
+void AlignedBufferPool::set_huge_pages(bool huge_pages) {
+  g_mutex_lock(&mutex_);
+  huge_pages_ = huge_pages;
+  g_mutex_unlock(&mutex_);
+}
+
+AlignedBufferPool* SharedBufferPool(size_t size) {
+  CHECK_LE(size, kMaxSharedBufferSize);
+  size_t index = 0;
+  while ((static_cast<size_t>(1) << index) < max(size, kDirectIOAlignment))
+    index++;
+  g_mutex_lock(&shared_pools_mutex);
+  if (!shared_pools[index]) {
+    // The pools live as long as the process, since their buffers may be put
+    // back from anywhere at any time.
+    shared_pools[index] = new AlignedBufferPool(
+        static_cast<size_t>(1) << index, kDirectIOAlignment);
+    shared_pools[index]->set_huge_pages(true);
+  }
+  AlignedBufferPool* pool = shared_pools[index];
+  g_mutex_unlock(&shared_pools_mutex);
+  return pool;
+}
+
+void TrimSharedBufferPools() {
+  g_mutex_lock(&shared_pools_mutex);
+  for (size_t i = 0; i < kSharedPoolCount; i++) {
+    if (shared_pools[i])
+      shared_pools[i]->Trim();
+  }
+  g_mutex_unlock(&shared_pools_mutex);
+}
+
+}  // namespace chromeos_update_engine
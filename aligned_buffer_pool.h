@@ -0,0 +1,118 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_ALIGNED_BUFFER_POOL_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_ALIGNED_BUFFER_POOL_H__
+
+#include <glib.h>
+#include <string.h>
+
+#include <vector>
+
+#include <base/basictypes.h>
+
+// A pool of equally sized memory buffers whose addresses are aligned as
+// O_DIRECT I/O requires. Buffers are allocated on demand and recycled when
+// they're put back. The pool may be used from several threads at once.
+//
+// The shared pools, one for each power of two size, serve the scratch
+// buffers of the update's hot paths, so that the components using buffers
+// of about the same size in turn reuse the same, already faulted in memory
+// instead of allocating and zeroing their own each time.
+
+namespace chromeos_update_engine {
+
+// The alignment of buffer addresses, file offsets and lengths that works for
+// O_DIRECT I/O on any of the devices we write to.
+extern const size_t kDirectIOAlignment;
+
+// The size of the transparent huge pages buffers may be backed with.
+extern const size_t kHugePageSize;
+
+// The largest size served by SharedBufferPool().
+extern const size_t kMaxSharedBufferSize;
+
+class AlignedBufferPool {
+ public:
+  // |buffer_size| must be a multiple of |alignment|, which must be a power of
+  // two.
+  AlignedBufferPool(size_t buffer_size, size_t alignment);
+
+  // Frees all buffers, including the ones that haven't been put back.
+  ~AlignedBufferPool();
+
+  // Returns a buffer of buffer_size() bytes, or NULL if out of memory.
+  char* Get();
+
+  // Returns |buffer|, obtained from Get(), to the pool.
+  void Put(char* buffer);
+
+  // Frees the buffers that aren't in use.
+  void Trim();
+
+  // Makes the buffers allocated from now on be aligned to kHugePageSize and
+  // backed with transparent huge pages where the kernel supports them, which
+  // cuts the page faults and TLB misses of large buffers. Only takes effect
+  // if buffer_size() is a multiple of kHugePageSize.
+  void set_huge_pages(bool huge_pages);
+
+  size_t buffer_size() const { return buffer_size_; }
+  size_t alignment() const { return alignment_; }
+
+ private:
+  const size_t buffer_size_;
+  const size_t alignment_;
+  bool huge_pages_;
+
+  // Protects the members below.
+  GMutex mutex_;
+  // All buffers allocated by the pool and the ones not in use.
+  std::vector<char*> buffers_;
+  std::vector<char*> free_buffers_;
+
+  DISALLOW_COPY_AND_ASSIGN(AlignedBufferPool);
+};
+
+// Returns the process-wide pool whose buffers are |size| rounded up to a
+// power of two, and at least kDirectIOAlignment, bytes. |size| must be at
+// most kMaxSharedBufferSize. The pools of kHugePageSize and larger buffers
+// are backed with huge pages.
+AlignedBufferPool* SharedBufferPool(size_t size);
+
+// Frees the buffers of the shared pools that aren't in use, e.g., once an
+// update is over, so that the daemon doesn't keep them while it's idle.
+void TrimSharedBufferPools();
+
+// A buffer of at least |size| bytes from SharedBufferPool() that's put back
+// when this goes out of scope. get() is NULL if out of memory.
+class ScopedPoolBuffer {
+ public:
+  explicit ScopedPoolBuffer(size_t size)
+      : pool_(SharedBufferPool(size)), buffer_(pool_->Get()), size_(size) {}
+  ~ScopedPoolBuffer() {
+    if (buffer_)
+      pool_->Put(buffer_);
+  }
+
+  // Zeroes the first size() bytes of the buffer, which may hold anything
+  // when it comes out of the pool.
+  void Clear() {
+    if (buffer_)
+      memset(buffer_, 0, size_);
+  }
+
+  char* get() const { return buffer_; }
+  size_t size() const { return size_; }
+
+ private:
+  AlignedBufferPool* const pool_;
+  char* const buffer_;
+  const size_t size_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedPoolBuffer);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_ALIGNED_BUFFER_POOL_H__
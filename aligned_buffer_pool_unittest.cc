@@ -0,0 +1,90 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stdint.h>
+#include <string.h>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/aligned_buffer_pool.h"
+
+namespace chromeos_update_engine {
+
+TEST(AlignedBufferPoolTest, AlignmentTest) {
+  AlignedBufferPool pool(8192, kDirectIOAlignment);
+  EXPECT_EQ(8192U, pool.buffer_size());
+  EXPECT_EQ(kDirectIOAlignment, pool.alignment());
+  char* buffers[3];
+  for (int i = 0; i < 3; i++) {
+    buffers[i] = pool.Get();
+    ASSERT_TRUE(buffers[i] != NULL);
+    EXPECT_EQ(0U, reinterpret_cast<uintptr_t>(buffers[i]) % kDirectIOAlignment);
+    // The whole buffer is usable.
+    memset(buffers[i], i, pool.buffer_size());
+  }
+  EXPECT_NE(buffers[0], buffers[1]);
+  EXPECT_NE(buffers[1], buffers[2]);
+  for (int i = 0; i < 3; i++)
+    pool.Put(buffers[i]);
+}
+
+TEST(AlignedBufferPoolTest, ReuseTest) {
+  AlignedBufferPool pool(4096, 512);
+  char* buffer = pool.Get();
+  ASSERT_TRUE(buffer != NULL);
+  pool.Put(buffer);
+  EXPECT_EQ(buffer, pool.Get());
+  // Buffers that are still out are freed by the pool's destructor.
+}
+
+TEST(AlignedBufferPoolTest, TrimTest) {
+  AlignedBufferPool pool(4096, 512);
+  char* used = pool.Get();
+  char* unused = pool.Get();
+  ASSERT_TRUE(used != NULL);
+  ASSERT_TRUE(unused != NULL);
+  pool.Put(unused);
+  pool.Trim();
+  // The buffer in use is still valid and can be put back.
+  memset(used, 0, pool.buffer_size());
+  pool.Put(used);
+  EXPECT_EQ(used, pool.Get());
+  pool.Put(used);
+}
+
+TEST(AlignedBufferPoolTest, HugePagesTest) {
+  AlignedBufferPool pool(kHugePageSize, kDirectIOAlignment);
+  pool.set_huge_pages(true);
+  char* buffer = pool.Get();
+  ASSERT_TRUE(buffer != NULL);
+  EXPECT_EQ(0U, reinterpret_cast<uintptr_t>(buffer) % kHugePageSize);
+  memset(buffer, 1, pool.buffer_size());
+  pool.Put(buffer);
+}
+
+TEST(AlignedBufferPoolTest, SharedPoolTest) {
+  EXPECT_EQ(kDirectIOAlignment, SharedBufferPool(1)->buffer_size());
+  EXPECT_EQ(8192U, SharedBufferPool(5000)->buffer_size());
+  EXPECT_EQ(SharedBufferPool(5000), SharedBufferPool(8192));
+  EXPECT_EQ(kMaxSharedBufferSize,
+            SharedBufferPool(kMaxSharedBufferSize)->buffer_size());
+
+  char* first;
+  {
+    ScopedPoolBuffer buffer(5000);
+    ASSERT_TRUE(buffer.get() != NULL);
+    EXPECT_EQ(5000U, buffer.size());
+    memset(buffer.get(), 1, buffer.size());
+    first = buffer.get();
+  }
+  // The buffer was put back, and is reused with whatever it held.
+  ScopedPoolBuffer buffer(6000);
+  EXPECT_EQ(first, buffer.get());
+  buffer.Clear();
+  for (size_t i = 0; i < buffer.size(); i++)
+    ASSERT_EQ(0, buffer.get()[i]);
+  TrimSharedBufferPools();
+}
+
+}  // namespace chromeos_update_engine
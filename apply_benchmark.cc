@@ -0,0 +1,252 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Measures how fast DeltaPerformer applies a recorded payload. The payload is
+// fed to Write() in chunks of each of the given sizes in turn, as if it were
+// being downloaded, onto target partitions that may be files or block
+// devices, e.g., loop devices. Every run reports the apply throughput, the
+// read and write system calls made, the peak resident memory and the time
+// spent on each type of operation.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <base/command_line.h>
+#include <base/file_path.h>
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+#include <base/string_number_conversions.h>
+#include <base/string_split.h>
+#include <base/time.h>
+#include <gflags/gflags.h>
+
+#include "update_engine/delta_diff_generator.h"
+#include "update_engine/delta_performer.h"
+#include "update_engine/install_plan.h"
+#include "update_engine/prefs.h"
+#include "update_engine/terminator.h"
+#include "update_engine/update_metadata.pb.h"
+#include "update_engine/utils.h"
+
+DEFINE_string(payload, "", "Path to the payload to apply");
+DEFINE_string(old_image, "",
+              "Path to the old rootfs a delta payload applies to. It's copied "
+              "to target_image before every run");
+DEFINE_string(old_kernel, "",
+              "Path to the old kernel partition a delta payload applies to. "
+              "It's copied to target_kernel before every run");
+DEFINE_string(target_image, "",
+              "Path to the file or device the new rootfs is written to");
+DEFINE_string(target_kernel, "",
+              "Path to the file or device the new kernel partition is "
+              "written to");
+DEFINE_string(chunk_sizes, "1048576",
+              "Comma-separated sizes of the chunks the payload is passed to "
+              "DeltaPerformer in, one run per size");
+DEFINE_int32(max_concurrent_operations, 1,
+             "Number of install operations applied at the same time");
+DEFINE_bool(direct_io, false, "Write the partitions with O_DIRECT");
+DEFINE_int32(block_cache_mb, 0,
+             "Megabytes of the blocks read and written kept for the "
+             "operations that read them next");
+DEFINE_string(prefs_dir, "/tmp/apply_benchmark_prefs",
+              "Preferences directory the update progress is kept in");
+
+using base::TimeDelta;
+using base::TimeTicks;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+const double kMiB = 1024.0 * 1024.0;
+
+// Reads the number of read and write system calls the process has made from
+// /proc/self/io. Returns true on success.
+bool GetSyscallCounts(uint64_t* reads, uint64_t* writes) {
+  string io;
+  TEST_AND_RETURN_FALSE(utils::ReadFile("/proc/self/io", &io));
+  vector<string> lines;
+  base::SplitString(io, '\n', &lines);
+  bool found_reads = false, found_writes = false;
+  for (vector<string>::const_iterator it = lines.begin(); it != lines.end();
+       ++it) {
+    vector<string> fields;
+    base::SplitString(*it, ':', &fields);
+    if (fields.size() != 2)
+      continue;
+    if (fields[0] == "syscr")
+      found_reads = base::StringToUint64(fields[1], reads);
+    else if (fields[0] == "syscw")
+      found_writes = base::StringToUint64(fields[1], writes);
+  }
+  TEST_AND_RETURN_FALSE(found_reads && found_writes);
+  return true;
+}
+
+// Applies the payload in |chunk_size|-byte chunks and prints the report of
+// the run. Returns true on success.
+bool RunBenchmark(size_t chunk_size, const InstallPlan& plan) {
+  Prefs prefs;
+  TEST_AND_RETURN_FALSE(prefs.Init(FilePath(FLAGS_prefs_dir)));
+  TEST_AND_RETURN_FALSE(DeltaPerformer::ResetUpdateProgress(&prefs, false));
+  InstallPlan install_plan(plan);
+
+  int fd = open(FLAGS_payload.c_str(), O_RDONLY);
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  ScopedFdCloser fd_closer(&fd);
+  vector<char> buf(chunk_size);
+
+  uint64_t start_reads = 0, start_writes = 0;
+  TEST_AND_RETURN_FALSE(GetSyscallCounts(&start_reads, &start_writes));
+
+  DeltaPerformer performer(&prefs, NULL, &install_plan);
+  performer.set_max_concurrent_operations(FLAGS_max_concurrent_operations);
+  performer.set_use_direct_io(FLAGS_direct_io);
+  performer.set_block_cache_size(
+      static_cast<uint64_t>(FLAGS_block_cache_mb) * 1024 * 1024);
+  TEST_AND_RETURN_FALSE(performer.Open(FLAGS_target_image.c_str(), 0, 0) == 0);
+  TEST_AND_RETURN_FALSE(performer.OpenKernel(FLAGS_target_kernel.c_str()));
+  // Only the time spent in the performer counts, not reading the payload.
+  TimeDelta apply_time;
+  uint64_t payload_size = 0;
+  uint64_t payload_reads = 0;
+  for (;;) {
+    ssize_t bytes_read = 0;
+    TEST_AND_RETURN_FALSE(utils::PReadAll(fd, &buf[0], buf.size(),
+                                          payload_size, &bytes_read));
+    // PReadAll() makes one more call after a short read at the end of the
+    // payload.
+    payload_reads +=
+        bytes_read > 0 && static_cast<size_t>(bytes_read) < buf.size() ? 2 : 1;
+    if (bytes_read == 0)
+      break;
+    const TimeTicks start_time = TimeTicks::Now();
+    ActionExitCode error = kActionCodeSuccess;
+    if (!performer.Write(&buf[0], bytes_read, &error)) {
+      LOG(ERROR) << "Failed to apply the payload, error " << error;
+      performer.Close();
+      return false;
+    }
+    apply_time += TimeTicks::Now() - start_time;
+    payload_size += bytes_read;
+  }
+  const TimeTicks close_start_time = TimeTicks::Now();
+  TEST_AND_RETURN_FALSE(performer.Close() == 0);
+  apply_time += TimeTicks::Now() - close_start_time;
+
+  uint64_t end_reads = 0, end_writes = 0;
+  TEST_AND_RETURN_FALSE(GetSyscallCounts(&end_reads, &end_writes));
+  struct rusage usage;
+  TEST_AND_RETURN_FALSE_ERRNO(getrusage(RUSAGE_SELF, &usage) == 0);
+  DeltaPerformer::ResetUpdateProgress(&prefs, false);
+
+  const double seconds = apply_time.InSecondsF();
+  printf("chunk_size %zu: %.1f MiB/s (%.1f MiB in %.3f s), "
+         "%llu read and %llu write syscalls, peak RSS %.1f MiB\n",
+         chunk_size,
+         seconds > 0 ? payload_size / kMiB / seconds : 0.0,
+         payload_size / kMiB,
+         seconds,
+         static_cast<unsigned long long>(
+             end_reads - start_reads - payload_reads),
+         static_cast<unsigned long long>(end_writes - start_writes),
+         usage.ru_maxrss / 1024.0);
+  const DeltaPerformer::OperationStatsMap& stats = performer.operation_stats();
+  for (DeltaPerformer::OperationStatsMap::const_iterator it = stats.begin();
+       it != stats.end(); ++it) {
+    printf("  %-10s %8llu ops %10.3f s %10.1f MiB written\n",
+           DeltaArchiveManifest_InstallOperation_Type_Name(it->first).c_str(),
+           static_cast<unsigned long long>(it->second.count),
+           it->second.time.InSecondsF(),
+           it->second.bytes_written / kMiB);
+  }
+  fflush(stdout);
+  return true;
+}
+
+// Sets the source partitions of |install_plan| to the old ones, if any, and
+// their hashes, which a delta payload is checked against.
+void InitializeInstallPlan(InstallPlan* install_plan) {
+  if (!FLAGS_old_image.empty()) {
+    PartitionInfo info;
+    CHECK(DeltaDiffGenerator::InitializePartitionInfo(false,  // is_kernel
+                                                      FLAGS_old_image,
+                                                      &info));
+    install_plan->source_path = FLAGS_old_image;
+    install_plan->rootfs_hash.assign(info.hash().begin(), info.hash().end());
+  }
+  if (!FLAGS_old_kernel.empty()) {
+    PartitionInfo info;
+    CHECK(DeltaDiffGenerator::InitializePartitionInfo(true,  // is_kernel
+                                                      FLAGS_old_kernel,
+                                                      &info));
+    install_plan->kernel_source_path = FLAGS_old_kernel;
+    install_plan->kernel_hash.assign(info.hash().begin(), info.hash().end());
+  }
+}
+
+int Main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  CommandLine::Init(argc, argv);
+  Terminator::Init();
+  logging::InitLogging("apply_benchmark.log",
+                       logging::LOG_ONLY_TO_SYSTEM_DEBUG_LOG,
+                       logging::DONT_LOCK_LOG_FILE,
+                       logging::APPEND_TO_OLD_LOG_FILE,
+                       logging::DISABLE_DCHECK_FOR_NON_OFFICIAL_RELEASE_BUILDS);
+  CHECK(!FLAGS_payload.empty()) << "Must pass --payload";
+  CHECK(!FLAGS_target_image.empty()) << "Must pass --target_image";
+  CHECK(!FLAGS_target_kernel.empty()) << "Must pass --target_kernel";
+  CHECK_GE(FLAGS_max_concurrent_operations, 1);
+  vector<string> chunk_size_strings;
+  base::SplitString(FLAGS_chunk_sizes, ',', &chunk_size_strings);
+  vector<size_t> chunk_sizes;
+  for (vector<string>::const_iterator it = chunk_size_strings.begin();
+       it != chunk_size_strings.end(); ++it) {
+    uint64_t chunk_size = 0;
+    CHECK(base::StringToUint64(*it, &chunk_size) && chunk_size > 0)
+        << "Bad chunk size " << *it;
+    chunk_sizes.push_back(chunk_size);
+  }
+
+  InstallPlan install_plan;
+  InitializeInstallPlan(&install_plan);
+
+  // Each run is done in a child process of its own, so that its peak memory
+  // use and system calls aren't mixed up with those of the other runs.
+  int ret = 0;
+  for (vector<size_t>::const_iterator it = chunk_sizes.begin();
+       it != chunk_sizes.end(); ++it) {
+    const pid_t pid = fork();
+    PCHECK(pid >= 0) << "fork failed";
+    if (pid == 0)
+      _exit(RunBenchmark(*it, install_plan) ? 0 : 1);
+    int status = 0;
+    PCHECK(HANDLE_EINTR(waitpid(pid, &status, 0)) == pid);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      LOG(ERROR) << "The run with chunk size " << *it << " failed";
+      ret = 1;
+    }
+  }
+  return ret;
+}
+
+}  // namespace {}
+
+}  // namespace chromeos_update_engine
+
+int main(int argc, char** argv) {
+  return chromeos_update_engine::Main(argc, argv);
+}
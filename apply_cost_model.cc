@@ -0,0 +1,76 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/apply_cost_model.h"
+
+#include <limits>
+
+#include <base/logging.h>
+#include <base/stringprintf.h>
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+const uint64_t kMiB = 1024 * 1024;
+}  // namespace {}
+
+ApplyCostModel::ApplyCostModel()
+    : download_rate(1 * kMiB),
+      bzip2_rate(8 * kMiB),
+      xz_rate(24 * kMiB),
+      bspatch_rate(4 * kMiB),
+      bspatch_memory(0),
+      stream_patch_rate(16 * kMiB) {}
+
+double ApplyCostModel::Cost(DeltaArchiveManifest_InstallOperation_Type type,
+                            uint64_t blob_size,
+                            uint64_t src_length,
+                            uint64_t dst_length) const {
+  CHECK_GT(download_rate, static_cast<uint64_t>(0));
+  double cost = static_cast<double>(blob_size) / download_rate;
+  switch (type) {
+    case DeltaArchiveManifest_InstallOperation_Type_REPLACE:
+    case DeltaArchiveManifest_InstallOperation_Type_MOVE:
+    case DeltaArchiveManifest_InstallOperation_Type_ZERO:
+    case DeltaArchiveManifest_InstallOperation_Type_DISCARD:
+      break;
+    case DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ:
+      CHECK_GT(bzip2_rate, static_cast<uint64_t>(0));
+      cost += static_cast<double>(dst_length) / bzip2_rate;
+      break;
+    case DeltaArchiveManifest_InstallOperation_Type_REPLACE_XZ:
+    case DeltaArchiveManifest_InstallOperation_Type_REPLACE_XZ_DICT:
+      CHECK_GT(xz_rate, static_cast<uint64_t>(0));
+      cost += static_cast<double>(dst_length) / xz_rate;
+      break;
+    case DeltaArchiveManifest_InstallOperation_Type_BSDIFF:
+      CHECK_GT(bspatch_rate, static_cast<uint64_t>(0));
+      if (bspatch_memory > 0 && src_length + dst_length > bspatch_memory)
+        return std::numeric_limits<double>::infinity();
+      cost += static_cast<double>(src_length + dst_length) / bspatch_rate;
+      break;
+    case DeltaArchiveManifest_InstallOperation_Type_STREAM_DIFF:
+      CHECK_GT(stream_patch_rate, static_cast<uint64_t>(0));
+      cost += static_cast<double>(dst_length) / stream_patch_rate;
+      break;
+    default:
+      NOTREACHED() << "Unknown operation type " << type;
+  }
+  return cost;
+}
+
+string ApplyCostModel::ToString() const {
+  return StringPrintf("download=%llu,bzip2=%llu,xz=%llu,bspatch=%llu,"
+                      "bspatch_memory=%llu,stream_patch=%llu",
+                      static_cast<unsigned long long>(download_rate),
+                      static_cast<unsigned long long>(bzip2_rate),
+                      static_cast<unsigned long long>(xz_rate),
+                      static_cast<unsigned long long>(bspatch_rate),
+                      static_cast<unsigned long long>(bspatch_memory),
+                      static_cast<unsigned long long>(stream_patch_rate));
+}
+
+}  // namespace chromeos_update_engine
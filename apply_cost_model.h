@@ -0,0 +1,61 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_APPLY_COST_MODEL_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_APPLY_COST_MODEL_H__
+
+#include <string>
+
+#include <base/basictypes.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+// Estimates how long clients take to download and apply an operation, so
+// that the payload generator can choose the encodings that make for the
+// quickest update rather than the smallest payload. On slow clients, a
+// REPLACE_BZ a little bigger than a BSDIFF can apply much faster, as
+// bspatch holds and scans the whole old data.
+
+namespace chromeos_update_engine {
+
+struct ApplyCostModel {
+  // Sets rates typical of ARM clients on a 1 MiB/s connection.
+  ApplyCostModel();
+
+  // Returns the estimated seconds it takes to download the |blob_size|-byte
+  // blob of an operation of type |type| and apply it to |src_length| bytes
+  // of old data, producing |dst_length| bytes. Returns infinity for BSDIFF
+  // operations that take more than |bspatch_memory| bytes to apply. The
+  // time spent writing the new data, which all operations do, isn't
+  // counted.
+  double Cost(DeltaArchiveManifest_InstallOperation_Type type,
+              uint64_t blob_size,
+              uint64_t src_length,
+              uint64_t dst_length) const;
+
+  // Returns a description of the model, which changes with its parameters.
+  std::string ToString() const;
+
+  // Bytes per second clients download at.
+  uint64_t download_rate;
+
+  // Bytes per second of new data clients decompress at.
+  uint64_t bzip2_rate;
+  uint64_t xz_rate;
+
+  // Bytes per second of old and new data clients apply a BSDIFF at.
+  uint64_t bspatch_rate;
+
+  // The most memory a BSDIFF may take to apply, which holds the old and new
+  // data. 0 means unlimited.
+  uint64_t bspatch_memory;
+
+  // Bytes per second of new data clients apply a STREAM_DIFF at. It reads
+  // only the old data it copies, and holds neither the old nor new data.
+  uint64_t stream_patch_rate;
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_APPLY_COST_MODEL_H__
@@ -0,0 +1,54 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <limits>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/apply_cost_model.h"
+
+namespace chromeos_update_engine {
+
+TEST(ApplyCostModelTest, CostTest) {
+  ApplyCostModel model;
+  model.download_rate = 100;
+  model.bzip2_rate = 1000;
+  model.xz_rate = 2000;
+  model.bspatch_rate = 500;
+  model.stream_patch_rate = 4000;
+
+  EXPECT_DOUBLE_EQ(10.0, model.Cost(
+      DeltaArchiveManifest_InstallOperation_Type_REPLACE, 1000, 0, 1000));
+  EXPECT_DOUBLE_EQ(0.0, model.Cost(
+      DeltaArchiveManifest_InstallOperation_Type_MOVE, 0, 1000, 1000));
+  EXPECT_DOUBLE_EQ(3.0, model.Cost(
+      DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ, 200, 0, 1000));
+  EXPECT_DOUBLE_EQ(2.5, model.Cost(
+      DeltaArchiveManifest_InstallOperation_Type_REPLACE_XZ, 200, 0, 1000));
+  EXPECT_DOUBLE_EQ(5.0, model.Cost(
+      DeltaArchiveManifest_InstallOperation_Type_BSDIFF, 100, 1000, 1000));
+  EXPECT_DOUBLE_EQ(2.0, model.Cost(
+      DeltaArchiveManifest_InstallOperation_Type_STREAM_DIFF, 100, 1000,
+      4000));
+
+  model.bspatch_memory = 2000;
+  EXPECT_DOUBLE_EQ(5.0, model.Cost(
+      DeltaArchiveManifest_InstallOperation_Type_BSDIFF, 100, 1000, 1000));
+  EXPECT_EQ(std::numeric_limits<double>::infinity(), model.Cost(
+      DeltaArchiveManifest_InstallOperation_Type_BSDIFF, 100, 1000, 1001));
+  // The memory limit is for bspatch only.
+  EXPECT_DOUBLE_EQ(1.5, model.Cost(
+      DeltaArchiveManifest_InstallOperation_Type_STREAM_DIFF, 100, 1000,
+      2000));
+}
+
+TEST(ApplyCostModelTest, ToStringTest) {
+  ApplyCostModel model;
+  ApplyCostModel other;
+  EXPECT_EQ(model.ToString(), other.ToString());
+  other.bspatch_memory = 1;
+  EXPECT_NE(model.ToString(), other.ToString());
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,136 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/async_hash_calculator.h"
+
+#include <base/logging.h>
+
+#include "update_engine/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+// Update() blocks while this much data is waiting to be hashed.
+const size_t kMaxQueuedBytes = 4 * 1024 * 1024;  // 4 MiB
+// Small updates are merged into chunks of up to this size.
+const size_t kMaxChunkSize = 256 * 1024;  // 256 KiB
+}  // namespace {}
+
+AsyncHashCalculator::AsyncHashCalculator()
+    : thread_(NULL),
+      synchronous_(false),
+      queued_bytes_(0),
+      busy_(false),
+      success_(true),
+      stopping_(false) {
+  g_mutex_init(&mutex_);
+  g_cond_init(&cond_);
+}
+
+AsyncHashCalculator::~AsyncHashCalculator() {
+  StopThread();
+  g_cond_clear(&cond_);
+  g_mutex_clear(&mutex_);
+}
+
+bool AsyncHashCalculator::Update(const char* data, size_t length) {
+  if (length == 0)
+    return true;
+  if (!thread_ && !synchronous_) {
+    thread_ = g_thread_try_new("hash_calculator", ThreadMain, this, NULL);
+    if (!thread_) {
+      LOG(WARNING) << "Unable to start the hashing thread, hashing "
+                   << "synchronously.";
+      synchronous_ = true;
+    }
+  }
+  if (synchronous_) {
+    success_ = calculator_.Update(data, length) && success_;
+    return true;
+  }
+
+  g_mutex_lock(&mutex_);
+  while (queued_bytes_ > 0 && queued_bytes_ + length > kMaxQueuedBytes)
+    g_cond_wait(&cond_, &mutex_);
+  // The thread takes chunks off the front, so the back one is never being
+  // hashed and may still grow.
+  if (chunks_.empty() || chunks_.back().size() + length > kMaxChunkSize)
+    chunks_.push_back(vector<char>());
+  chunks_.back().insert(chunks_.back().end(), data, data + length);
+  queued_bytes_ += length;
+  g_cond_broadcast(&cond_);
+  g_mutex_unlock(&mutex_);
+  return true;
+}
+
+bool AsyncHashCalculator::Finalize() {
+  WaitIdle();
+  StopThread();
+  TEST_AND_RETURN_FALSE(success_);
+  return calculator_.Finalize();
+}
+
+string AsyncHashCalculator::GetContext() {
+  WaitIdle();
+  return calculator_.GetContext();
+}
+
+bool AsyncHashCalculator::SetContext(const string& context) {
+  WaitIdle();
+  return calculator_.SetContext(context);
+}
+
+gpointer AsyncHashCalculator::ThreadMain(gpointer data) {
+  reinterpret_cast<AsyncHashCalculator*>(data)->Run();
+  return NULL;
+}
+
+void AsyncHashCalculator::Run() {
+  g_mutex_lock(&mutex_);
+  for (;;) {
+    while (chunks_.empty() && !stopping_)
+      g_cond_wait(&cond_, &mutex_);
+    if (stopping_)
+      break;
+    vector<char> chunk;
+    chunk.swap(chunks_.front());
+    chunks_.pop_front();
+    busy_ = true;
+    g_mutex_unlock(&mutex_);
+
+    bool success = calculator_.Update(&chunk[0], chunk.size());
+
+    g_mutex_lock(&mutex_);
+    busy_ = false;
+    queued_bytes_ -= chunk.size();
+    success_ = success && success_;
+    g_cond_broadcast(&cond_);
+  }
+  g_mutex_unlock(&mutex_);
+}
+
+void AsyncHashCalculator::StopThread() {
+  if (!thread_)
+    return;
+  g_mutex_lock(&mutex_);
+  stopping_ = true;
+  g_cond_broadcast(&cond_);
+  g_mutex_unlock(&mutex_);
+  g_thread_join(thread_);
+  thread_ = NULL;
+}
+
+void AsyncHashCalculator::WaitIdle() {
+  if (!thread_)
+    return;
+  g_mutex_lock(&mutex_);
+  while (busy_ || !chunks_.empty())
+    g_cond_wait(&cond_, &mutex_);
+  g_mutex_unlock(&mutex_);
+}
+
+}  // namespace chromeos_update_engine
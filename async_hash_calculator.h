@@ -0,0 +1,88 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_ASYNC_HASH_CALCULATOR_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_ASYNC_HASH_CALCULATOR_H__
+
+#include <glib.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <base/basictypes.h>
+
+#include "update_engine/omaha_hash_calculator.h"
+
+// An OmahaHashCalculator that hashes on a thread of its own. Update() only
+// queues a copy of the data, so the caller can go on, e.g., writing the data
+// to disk while it's being hashed. The methods that look at the hash state
+// wait for the queued data to be hashed first, so the results are exactly
+// those of an OmahaHashCalculator fed with the same data.
+
+namespace chromeos_update_engine {
+
+class AsyncHashCalculator {
+ public:
+  AsyncHashCalculator();
+
+  // Discards any data that hasn't been hashed yet and stops the thread.
+  ~AsyncHashCalculator();
+
+  // Queues |length| bytes of |data| to be hashed after the data queued
+  // before. May block while a lot of data is queued already. Returns true on
+  // success; errors hashing the data are reported by Finalize().
+  bool Update(const char* data, size_t length);
+
+  // Waits for the queued data to be hashed, stops the thread and finalizes
+  // the hash. Returns true on success.
+  bool Finalize();
+
+  // Gets the hash. Finalize() must have been called.
+  const std::string& hash() const { return calculator_.hash(); }
+  const std::vector<char>& raw_hash() const { return calculator_.raw_hash(); }
+
+  // Same as the OmahaHashCalculator methods, once the queued data has been
+  // hashed.
+  std::string GetContext();
+  bool SetContext(const std::string& context);
+
+ private:
+  static gpointer ThreadMain(gpointer data);
+  void Run();
+
+  // Tells the thread to exit once it's done with the current chunk and
+  // joins it.
+  void StopThread();
+
+  // Waits until the thread has hashed all the queued data, after which
+  // |calculator_| may be used without holding |mutex_|.
+  void WaitIdle();
+
+  // Used by the thread while it's busy and by the caller otherwise.
+  OmahaHashCalculator calculator_;
+
+  // Started by the first Update(). If that fails, the data is hashed
+  // synchronously instead.
+  GThread* thread_;
+  bool synchronous_;
+
+  GMutex mutex_;
+  // Signalled when data is queued, taken or hashed, and when stopping.
+  GCond cond_;
+  // The data waiting to be hashed and the total size of it.
+  std::deque<std::vector<char> > chunks_;
+  size_t queued_bytes_;
+  // True while the thread is hashing a chunk it took off |chunks_|.
+  bool busy_;
+  // False once updating |calculator_| has failed.
+  bool success_;
+  bool stopping_;
+
+  DISALLOW_COPY_AND_ASSIGN(AsyncHashCalculator);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_ASYNC_HASH_CALCULATOR_H__
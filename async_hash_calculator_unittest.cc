@@ -0,0 +1,68 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+#include "update_engine/async_hash_calculator.h"
+#include "update_engine/omaha_hash_calculator.h"
+#include "update_engine/test_utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+TEST(AsyncHashCalculatorTest, MatchesOmahaHashCalculatorTest) {
+  vector<char> data(10 * 1024 * 1024);
+  FillWithData(&data);
+  OmahaHashCalculator expected;
+  AsyncHashCalculator calc;
+  // Mix small updates, which get merged, with ones bigger than the queue.
+  const size_t kSizes[] = { 1, 100, 4096, 300 * 1024, 5 * 1024 * 1024 };
+  size_t offset = 0;
+  for (size_t i = 0; offset < data.size(); i = (i + 1) % arraysize(kSizes)) {
+    size_t size = std::min(kSizes[i], data.size() - offset);
+    EXPECT_TRUE(expected.Update(&data[offset], size));
+    EXPECT_TRUE(calc.Update(&data[offset], size));
+    offset += size;
+  }
+  EXPECT_TRUE(expected.Finalize());
+  EXPECT_TRUE(calc.Finalize());
+  EXPECT_EQ(expected.hash(), calc.hash());
+  EXPECT_TRUE(expected.raw_hash() == calc.raw_hash());
+}
+
+TEST(AsyncHashCalculatorTest, ContextTest) {
+  const string kFirst = "This is the first part";
+  const string kSecond = " and this is the second one";
+  AsyncHashCalculator calc;
+  EXPECT_TRUE(calc.Update(kFirst.data(), kFirst.size()));
+  // The context includes everything queued so far, so it can be used to
+  // resume hashing with an OmahaHashCalculator, and back.
+  OmahaHashCalculator resumed;
+  EXPECT_TRUE(resumed.SetContext(calc.GetContext()));
+  EXPECT_TRUE(resumed.Update(kSecond.data(), kSecond.size()));
+  AsyncHashCalculator resumed_async;
+  EXPECT_TRUE(resumed_async.SetContext(resumed.GetContext()));
+  EXPECT_TRUE(resumed.Finalize());
+  EXPECT_TRUE(resumed_async.Finalize());
+  EXPECT_EQ(OmahaHashCalculator::OmahaHashOfString(kFirst + kSecond),
+            resumed.hash());
+  EXPECT_EQ(resumed.hash(), resumed_async.hash());
+  EXPECT_TRUE(calc.Update(kSecond.data(), kSecond.size()));
+  EXPECT_TRUE(calc.Finalize());
+  EXPECT_EQ(resumed.hash(), calc.hash());
+}
+
+TEST(AsyncHashCalculatorTest, DestroyWithQueuedDataTest) {
+  vector<char> data(1024 * 1024);
+  FillWithData(&data);
+  AsyncHashCalculator calc;
+  for (int i = 0; i < 8; i++)
+    EXPECT_TRUE(calc.Update(&data[0], data.size()));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,214 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/async_logging.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <base/posix/eintr_wrapper.h>
+#include <base/stringprintf.h>
+
+#include "update_engine/utils.h"
+
+using base::TimeDelta;
+using base::TimeTicks;
+using std::min;
+using std::string;
+
+namespace chromeos_update_engine {
+
+AsyncLogWriter* AsyncLogWriter::writer_ = NULL;
+
+bool AsyncLogWriter::Init(const string& path, size_t buffer_size) {
+  Shutdown();
+  TEST_AND_RETURN_FALSE(buffer_size > 0);
+  int fd = HANDLE_EINTR(open(path.c_str(),
+                             O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                             0644));
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  AsyncLogWriter* writer = new AsyncLogWriter(fd, buffer_size);
+  GError* error = NULL;
+  writer->thread_ = g_thread_try_new("log_writer", WriterThread, writer,
+                                     &error);
+  if (!writer->thread_) {
+    LOG(ERROR) << "Unable to start the log writer: " << error->message;
+    g_error_free(error);
+    delete writer;
+    return false;
+  }
+  writer_ = writer;
+  logging::SetLogMessageHandler(HandleMessage);
+  static bool flush_at_exit_registered = false;
+  if (!flush_at_exit_registered) {
+    atexit(FlushAtExit);
+    flush_at_exit_registered = true;
+  }
+  return true;
+}
+
+void AsyncLogWriter::Shutdown() {
+  if (!writer_)
+    return;
+  logging::SetLogMessageHandler(NULL);
+  AsyncLogWriter* writer = writer_;
+  writer_ = NULL;
+  g_mutex_lock(&writer->mutex_);
+  writer->stopping_ = true;
+  g_cond_signal(&writer->queued_cond_);
+  g_mutex_unlock(&writer->mutex_);
+  g_thread_join(writer->thread_);
+  delete writer;
+}
+
+void AsyncLogWriter::Flush() {
+  if (writer_)
+    writer_->WaitForEmpty();
+}
+
+void AsyncLogWriter::FlushAtExit() {
+  AsyncLogWriter* writer = writer_;
+  if (!writer || !g_mutex_trylock(&writer->mutex_))
+    return;
+  gint64 deadline = g_get_monotonic_time() +
+      kExitFlushTimeoutMs * G_TIME_SPAN_MILLISECOND;
+  while (writer->size_ > 0 &&
+         g_cond_wait_until(&writer->written_cond_, &writer->mutex_,
+                           deadline)) {}
+  g_mutex_unlock(&writer->mutex_);
+}
+
+AsyncLogWriter::AsyncLogWriter(int fd, size_t buffer_size)
+    : fd_(fd),
+      thread_(NULL),
+      buffer_(buffer_size, '\0'),
+      head_(0),
+      size_(0),
+      dropped_(0),
+      stopping_(false) {
+  g_mutex_init(&mutex_);
+  g_cond_init(&queued_cond_);
+  g_cond_init(&written_cond_);
+}
+
+AsyncLogWriter::~AsyncLogWriter() {
+  // Nothing can be logged from here on but through the base logging.
+  if (close(fd_) != 0)
+    PLOG(ERROR) << "Unable to close the log file";
+  g_cond_clear(&written_cond_);
+  g_cond_clear(&queued_cond_);
+  g_mutex_clear(&mutex_);
+}
+
+bool AsyncLogWriter::HandleMessage(int severity,
+                                   const char* file,
+                                   int line,
+                                   size_t message_start,
+                                   const string& str) {
+  AsyncLogWriter* writer = writer_;
+  if (!writer)
+    return false;
+  if (severity >= logging::LOG_ERROR) {
+    // Let the base logging write it once the earlier messages are out.
+    writer->WaitForEmpty();
+    return false;
+  }
+  writer->Enqueue(str);
+  return true;
+}
+
+gpointer AsyncLogWriter::WriterThread(gpointer data) {
+  static_cast<AsyncLogWriter*>(data)->Run();
+  return NULL;
+}
+
+void AsyncLogWriter::Enqueue(const string& str) {
+  g_mutex_lock(&mutex_);
+  if (str.size() > buffer_.size() - size_) {
+    dropped_++;
+    g_mutex_unlock(&mutex_);
+    return;
+  }
+  size_t tail = (head_ + size_) % buffer_.size();
+  size_t first = min(str.size(), buffer_.size() - tail);
+  memcpy(&buffer_[tail], str.data(), first);
+  memcpy(&buffer_[0], str.data() + first, str.size() - first);
+  size_ += str.size();
+  g_cond_signal(&queued_cond_);
+  g_mutex_unlock(&mutex_);
+}
+
+void AsyncLogWriter::Run() {
+  g_mutex_lock(&mutex_);
+  while (true) {
+    while (size_ == 0 && dropped_ == 0 && !stopping_)
+      g_cond_wait(&queued_cond_, &mutex_);
+    if (size_ == 0 && dropped_ == 0)
+      break;
+    uint64_t dropped = dropped_;
+    dropped_ = 0;
+    size_t head = head_;
+    size_t length = min(size_, buffer_.size() - head_);
+    g_mutex_unlock(&mutex_);
+
+    // Errors aren't logged, as that would queue more messages; the base
+    // logging is just as unable to write to the same disk.
+    if (length > 0)
+      utils::WriteAll(fd_, &buffer_[head], length);
+    if (dropped > 0) {
+      string note = StringPrintf("[async_logging] Dropped %" PRIu64
+                                 " log messages, the buffer was full.\n",
+                                 dropped);
+      utils::WriteAll(fd_, note.data(), note.size());
+    }
+
+    g_mutex_lock(&mutex_);
+    head_ = (head_ + length) % buffer_.size();
+    size_ -= length;
+    if (size_ == 0)
+      g_cond_broadcast(&written_cond_);
+  }
+  g_mutex_unlock(&mutex_);
+}
+
+void AsyncLogWriter::WaitForEmpty() {
+  g_mutex_lock(&mutex_);
+  while (size_ > 0)
+    g_cond_wait(&written_cond_, &mutex_);
+  g_mutex_unlock(&mutex_);
+}
+
+GMutex LogRateLimiter::mutex_;
+LogRateLimiter::CallSiteMap LogRateLimiter::call_sites_;
+
+bool LogRateLimiter::ShouldLog(const char* file, int line, int seconds) {
+  TimeTicks now = TimeTicks::Now();
+  g_mutex_lock(&mutex_);
+  CallSite& site = call_sites_[std::make_pair(file, line)];
+  bool should_log = site.last_logged.is_null() ||
+      now - site.last_logged >= TimeDelta::FromSeconds(seconds);
+  if (should_log)
+    site.last_logged = now;
+  else
+    site.suppressed++;
+  g_mutex_unlock(&mutex_);
+  return should_log;
+}
+
+string LogRateLimiter::TakeSuppressedNote(const char* file, int line) {
+  g_mutex_lock(&mutex_);
+  CallSite& site = call_sites_[std::make_pair(file, line)];
+  int suppressed = site.suppressed;
+  site.suppressed = 0;
+  g_mutex_unlock(&mutex_);
+  if (suppressed == 0)
+    return "";
+  return StringPrintf("[%d similar messages suppressed] ", suppressed);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,147 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_ASYNC_LOGGING_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_ASYNC_LOGGING_H__
+
+#include <map>
+#include <string>
+#include <utility>
+
+#include <glib.h>
+
+#include <base/basictypes.h>
+#include <base/logging.h>
+#include <base/time.h>
+
+// Keeps logging off the update pipeline: once AsyncLogWriter::Init() is
+// called, INFO and WARNING messages are copied into a bounded ring buffer
+// and appended to the log file by a background thread, so the threads
+// applying and downloading the payload never wait on the disk to log.
+// Messages that don't fit in the buffer are dropped and counted, and the
+// count is logged once there's room again. ERROR and FATAL messages still
+// go through the base logging synchronously, after the queued messages,
+// so that they're on disk before a crash.
+//
+// LOG_EVERY_N_SEC() logs a message at most once per interval per call site,
+// for the messages of every operation or chunk that would otherwise flood
+// the log.
+
+namespace chromeos_update_engine {
+
+class AsyncLogWriter {
+ public:
+  static const size_t kDefaultBufferSize = 1024 * 1024;
+
+  // Starts appending the INFO and WARNING messages to the file at |path|
+  // through a buffer of |buffer_size| bytes. Starts a thread, so it must be
+  // called after daemon() and the forks that expect a single thread.
+  // Returns true on success.
+  static bool Init(const std::string& path, size_t buffer_size);
+
+  // Writes out the queued messages, stops the thread and hands the logging
+  // back to the base logging. No other thread may be logging.
+  static void Shutdown();
+
+  // Returns once the messages queued so far are written.
+  static void Flush();
+
+  // Returns true if the messages are written asynchronously.
+  static bool enabled() { return writer_ != NULL; }
+
+ private:
+  AsyncLogWriter(int fd, size_t buffer_size);
+  ~AsyncLogWriter();
+
+  // The logging::LogMessageHandler.
+  static bool HandleMessage(int severity,
+                            const char* file,
+                            int line,
+                            size_t message_start,
+                            const std::string& str);
+
+  static gpointer WriterThread(gpointer data);
+
+  // Gives the writer a moment to write out the queued messages when the
+  // daemon exits, e.g., from Terminator's SIGTERM handler. Skipped if the
+  // exiting thread interrupted a logging thread holding the lock.
+  static void FlushAtExit();
+
+  // Queues |str|, or drops it if the buffer is full.
+  void Enqueue(const std::string& str);
+
+  // Writes the buffer out until Shutdown().
+  void Run();
+
+  // Waits for the buffer to be written out.
+  void WaitForEmpty();
+
+  // How long FlushAtExit() waits at most.
+  static const int kExitFlushTimeoutMs = 1000;
+
+  // The writer, or NULL if the logging is synchronous.
+  static AsyncLogWriter* writer_;
+
+  int fd_;
+  GThread* thread_;
+
+  // Guards the members below. It's only held to copy a message in or to
+  // account for a write, never during the write itself.
+  GMutex mutex_;
+  // Signaled when a message is queued or the writer should stop.
+  GCond queued_cond_;
+  // Signaled when the buffer has been written out.
+  GCond written_cond_;
+
+  // The ring buffer: |size_| bytes are queued starting at |head_|. Only
+  // the writer thread moves |head_|, and the producers only copy into the
+  // free part, so the queued bytes are written out without the lock.
+  std::string buffer_;
+  size_t head_;
+  size_t size_;
+  // The number of messages dropped since the last report.
+  uint64_t dropped_;
+  bool stopping_;
+
+  DISALLOW_COPY_AND_ASSIGN(AsyncLogWriter);
+};
+
+// Tracks when each LOG_EVERY_N_SEC() call site last logged. Callable from
+// any thread.
+class LogRateLimiter {
+ public:
+  // Returns true if the call site at |file|:|line| hasn't logged within the
+  // last |seconds|, counting the message as suppressed otherwise.
+  static bool ShouldLog(const char* file, int line, int seconds);
+
+  // Returns a note of the messages suppressed at |file|:|line| since it
+  // last logged, to prefix to the next one, or "" if there were none.
+  static std::string TakeSuppressedNote(const char* file, int line);
+
+ private:
+  struct CallSite {
+    CallSite() : suppressed(0) {}
+    base::TimeTicks last_logged;
+    int suppressed;
+  };
+  typedef std::map<std::pair<const char*, int>, CallSite> CallSiteMap;
+
+  // Guards |call_sites_|.
+  static GMutex mutex_;
+  static CallSiteMap call_sites_;
+
+  DISALLOW_IMPLICIT_CONSTRUCTORS(LogRateLimiter);
+};
+
+}  // namespace chromeos_update_engine
+
+// Logs at |severity| at most once every |seconds| from this call site. The
+// next message that's logged says how many were suppressed in between.
+#define LOG_EVERY_N_SEC(severity, seconds)                                 \
+  LOG_IF(severity, ::chromeos_update_engine::LogRateLimiter::ShouldLog(    \
+      __FILE__, __LINE__, seconds))                                        \
+      << ::chromeos_update_engine::LogRateLimiter::TakeSuppressedNote(     \
+          __FILE__, __LINE__)
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_ASYNC_LOGGING_H__
@@ -0,0 +1,97 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <unistd.h>
+
+#include <string>
+
+#include <base/stringprintf.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/async_logging.h"
+#include "update_engine/utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+class AsyncLogWriterTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    ASSERT_TRUE(utils::MakeTempFile("/tmp/async_log.XXXXXX", &path_, NULL));
+  }
+
+  virtual void TearDown() {
+    AsyncLogWriter::Shutdown();
+    unlink(path_.c_str());
+  }
+
+  string ReadLog() {
+    string contents;
+    EXPECT_TRUE(utils::ReadFile(path_, &contents));
+    return contents;
+  }
+
+  string path_;
+};
+
+TEST_F(AsyncLogWriterTest, WritesInOrderTest) {
+  ASSERT_TRUE(AsyncLogWriter::Init(path_,
+                                   AsyncLogWriter::kDefaultBufferSize));
+  EXPECT_TRUE(AsyncLogWriter::enabled());
+  for (int i = 0; i < 100; i++)
+    LOG(INFO) << "async message " << i << ".";
+  AsyncLogWriter::Flush();
+  string contents = ReadLog();
+  size_t last = 0;
+  for (int i = 0; i < 100; i++) {
+    size_t pos = contents.find(StringPrintf("async message %d.", i));
+    ASSERT_NE(string::npos, pos) << i;
+    EXPECT_LE(last, pos);
+    last = pos;
+  }
+  AsyncLogWriter::Shutdown();
+  EXPECT_FALSE(AsyncLogWriter::enabled());
+}
+
+TEST_F(AsyncLogWriterTest, WrapsAroundTest) {
+  // Each message is longer than half the buffer, so most wrap around.
+  ASSERT_TRUE(AsyncLogWriter::Init(path_, 256));
+  const string filler(100, 'x');
+  for (int i = 0; i < 20; i++) {
+    LOG(INFO) << filler << i << ".";
+    AsyncLogWriter::Flush();
+  }
+  string contents = ReadLog();
+  for (int i = 0; i < 20; i++)
+    EXPECT_NE(string::npos, contents.find(filler + StringPrintf("%d.", i)));
+}
+
+TEST_F(AsyncLogWriterTest, CountsDroppedTest) {
+  ASSERT_TRUE(AsyncLogWriter::Init(path_, 16));
+  LOG(INFO) << "A message longer than the whole buffer.";
+  AsyncLogWriter::Shutdown();
+  string contents = ReadLog();
+  EXPECT_EQ(string::npos, contents.find("longer than the whole buffer"));
+  EXPECT_NE(string::npos, contents.find("Dropped 1 log messages"));
+}
+
+TEST(LogRateLimiterTest, ShouldLogTest) {
+  for (int i = 0; i < 3; i++)
+    EXPECT_TRUE(LogRateLimiter::ShouldLog(__FILE__, 1, 0));
+  EXPECT_EQ("", LogRateLimiter::TakeSuppressedNote(__FILE__, 1));
+
+  EXPECT_TRUE(LogRateLimiter::ShouldLog(__FILE__, 2, 3600));
+  EXPECT_EQ("", LogRateLimiter::TakeSuppressedNote(__FILE__, 2));
+  EXPECT_FALSE(LogRateLimiter::ShouldLog(__FILE__, 2, 3600));
+  EXPECT_FALSE(LogRateLimiter::ShouldLog(__FILE__, 2, 3600));
+  EXPECT_EQ("[2 similar messages suppressed] ",
+            LogRateLimiter::TakeSuppressedNote(__FILE__, 2));
+  EXPECT_EQ("", LogRateLimiter::TakeSuppressedNote(__FILE__, 2));
+
+  // Each call site has its own interval.
+  EXPECT_TRUE(LogRateLimiter::ShouldLog(__FILE__, 3, 3600));
+}
+
+}  // namespace chromeos_update_engine
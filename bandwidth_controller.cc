@@ -0,0 +1,126 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/bandwidth_controller.h"
+
+#include <algorithm>
+
+#include <base/logging.h>
+
+using base::TimeDelta;
+using base::TimeTicks;
+
+namespace chromeos_update_engine {
+
+const int BandwidthController::kTargetDelayMs = 100;
+const uint64_t BandwidthController::kInitialRate = 1024 * 1024;  // 1 MiB/s
+const uint64_t BandwidthController::kMinRate = 32 * 1024;  // 32 KiB/s
+const uint64_t BandwidthController::kMaxAdaptiveRate =
+    100 * 1024 * 1024;  // 100 MiB/s
+const size_t BandwidthController::kBaseHistoryMinutes = 10;
+
+namespace {
+// How many of the last round-trip times the current delay is the smallest
+// of.
+const size_t kRecentRtts = 4;
+
+// The share of the rate by which it changes per second when the queuing
+// delay is off the target by as much as the target. The rate backs off
+// faster than it grows, so the download yields quickly to other traffic.
+const double kIncreaseGain = 0.1;
+const double kDecreaseGain = 0.5;
+
+// The longest gap between samples the adaptive rate is updated for, in
+// seconds, so a transfer resuming after a pause doesn't jump to the bounds.
+const double kMaxUpdateInterval = 1.0;
+}  // namespace {}
+
+BandwidthController::BandwidthController()
+    : adaptive_(false),
+      max_rate_(0),
+      adaptive_rate_(kInitialRate),
+      num_transfers_(0) {}
+
+void BandwidthController::set_adaptive(bool adaptive) {
+  if (adaptive && !adaptive_) {
+    // Start over from the initial rate, but keep the base delay: it belongs
+    // to the network path, not to the download.
+    adaptive_rate_ = kInitialRate;
+    last_update_time_ = TimeTicks();
+  }
+  adaptive_ = adaptive;
+}
+
+void BandwidthController::set_max_rate(uint64_t bytes_per_second) {
+  if (bytes_per_second)
+    LOG(INFO) << "Capping the download rate at " << bytes_per_second
+              << " bytes/s";
+  else
+    LOG(INFO) << "Not capping the download rate";
+  max_rate_ = bytes_per_second;
+}
+
+TimeDelta BandwidthController::BaseRtt() const {
+  return *std::min_element(base_rtts_.begin(), base_rtts_.end());
+}
+
+void BandwidthController::AddRttSample(TimeDelta rtt, TimeTicks now) {
+  if (base_rtts_.empty() ||
+      now - base_rtt_minute_start_ >= TimeDelta::FromMinutes(1)) {
+    base_rtts_.push_back(rtt);
+    if (base_rtts_.size() > kBaseHistoryMinutes)
+      base_rtts_.pop_front();
+    base_rtt_minute_start_ = now;
+  } else {
+    base_rtts_.back() = std::min(base_rtts_.back(), rtt);
+  }
+  recent_rtts_.push_back(rtt);
+  if (recent_rtts_.size() > kRecentRtts)
+    recent_rtts_.pop_front();
+
+  if (!adaptive_)
+    return;
+  if (last_update_time_.is_null()) {
+    last_update_time_ = now;
+    return;
+  }
+  const double interval = std::min((now - last_update_time_).InSecondsF(),
+                                   kMaxUpdateInterval);
+  last_update_time_ = now;
+  if (interval <= 0.0)
+    return;
+
+  const TimeDelta queuing_delay =
+      *std::min_element(recent_rtts_.begin(), recent_rtts_.end()) - BaseRtt();
+  double off_target = (kTargetDelayMs - queuing_delay.InMillisecondsF()) /
+      kTargetDelayMs;
+  off_target = std::max(off_target, -1.0);
+  const double gain = off_target > 0.0 ? kIncreaseGain : kDecreaseGain;
+  adaptive_rate_ *= 1.0 + gain * off_target * interval;
+
+  double max_rate = kMaxAdaptiveRate;
+  if (max_rate_ && max_rate_ < kMaxAdaptiveRate)
+    max_rate = max_rate_;
+  adaptive_rate_ = std::max(std::min(adaptive_rate_, max_rate),
+                            std::min(static_cast<double>(kMinRate), max_rate));
+}
+
+uint64_t BandwidthController::rate() const {
+  if (!adaptive_)
+    return max_rate_;
+  uint64_t rate = static_cast<uint64_t>(adaptive_rate_);
+  if (max_rate_)
+    rate = std::min(rate, max_rate_);
+  return std::max(rate, static_cast<uint64_t>(1));
+}
+
+uint64_t BandwidthController::TransferRate() const {
+  const uint64_t total_rate = rate();
+  if (total_rate == 0)
+    return 0;
+  const uint64_t num_transfers = std::max(num_transfers_, 1);
+  return std::max(total_rate / num_transfers, static_cast<uint64_t>(1));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,100 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_BANDWIDTH_CONTROLLER_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_BANDWIDTH_CONTROLLER_H__
+
+#include <inttypes.h>
+
+#include <deque>
+
+#include <base/basictypes.h>
+#include <base/time.h>
+
+// Limits the rate at which the payload is downloaded by the transfers of the
+// LibcurlHttpFetchers it's given to.
+//
+// In the adaptive mode, used for background updates, the rate yields to the
+// other traffic of the network the way LEDBAT (RFC 6817) does: the smallest
+// round-trip time seen over the last minutes is taken as the base delay, so
+// the amount by which the current round-trip time exceeds it is the delay
+// queued at the bottleneck. The rate grows while that's below a target delay
+// and shrinks, faster, above it, so the download takes the spare bandwidth
+// without building up queues in front of other traffic. Otherwise the
+// downloads run at the maximum rate, unlimited by default.
+
+namespace chromeos_update_engine {
+
+class BandwidthController {
+ public:
+  // The queuing delay adaptive downloads aim for.
+  static const int kTargetDelayMs;
+
+  // The adaptive rate starts at kInitialRate and stays between kMinRate and
+  // kMaxAdaptiveRate, or the maximum rate if that's lower, in bytes per
+  // second.
+  static const uint64_t kInitialRate;
+  static const uint64_t kMinRate;
+  static const uint64_t kMaxAdaptiveRate;
+
+  BandwidthController();
+
+  // Makes the downloads yield to other traffic if |adaptive|, or run at the
+  // maximum rate otherwise.
+  void set_adaptive(bool adaptive);
+  bool adaptive() const { return adaptive_; }
+
+  // Caps the rate of the downloads, adaptive or not, at |bytes_per_second|.
+  // 0, the default, doesn't cap it.
+  void set_max_rate(uint64_t bytes_per_second);
+  uint64_t max_rate() const { return max_rate_; }
+
+  // Adds the round-trip time |rtt| of a connection, as measured at |now|.
+  void AddRttSample(base::TimeDelta rtt, base::TimeTicks now);
+
+  // Returns the limit of the rate of all the transfers together, in bytes
+  // per second, or 0 if it's unlimited.
+  uint64_t rate() const;
+
+  // Counts the transfers running, among which the rate is shared.
+  void TransferStarted() { num_transfers_++; }
+  void TransferEnded() { num_transfers_--; }
+
+  // Returns the limit of the rate of each transfer, or 0 if it's unlimited.
+  uint64_t TransferRate() const;
+
+ private:
+  // The minute-long periods whose smallest round-trip times are kept, the
+  // current one last, and how many are kept.
+  static const size_t kBaseHistoryMinutes;
+
+  // Returns the base delay: the smallest round-trip time kept.
+  base::TimeDelta BaseRtt() const;
+
+  bool adaptive_;
+  uint64_t max_rate_;
+
+  // The adaptive rate, in bytes per second.
+  double adaptive_rate_;
+
+  // The smallest round-trip time of each of the last minutes, and when the
+  // current minute started.
+  std::deque<base::TimeDelta> base_rtts_;
+  base::TimeTicks base_rtt_minute_start_;
+
+  // The last few round-trip times, whose smallest one is taken as the
+  // current delay to filter out noise.
+  std::deque<base::TimeDelta> recent_rtts_;
+
+  // When the adaptive rate was last updated.
+  base::TimeTicks last_update_time_;
+
+  int num_transfers_;
+
+  DISALLOW_COPY_AND_ASSIGN(BandwidthController);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_BANDWIDTH_CONTROLLER_H__
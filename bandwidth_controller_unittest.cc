@@ -0,0 +1,108 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <base/time.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/bandwidth_controller.h"
+
+using base::TimeDelta;
+using base::TimeTicks;
+
+namespace chromeos_update_engine {
+
+class BandwidthControllerTest : public ::testing::Test {
+ protected:
+  BandwidthControllerTest() : now_(TimeTicks::Now()) {}
+
+  // Adds a sample of |rtt_ms| every second for |seconds| seconds.
+  void AddRttSamples(int rtt_ms, int seconds) {
+    for (int i = 0; i < seconds; i++) {
+      now_ = now_ + TimeDelta::FromSeconds(1);
+      controller_.AddRttSample(TimeDelta::FromMilliseconds(rtt_ms), now_);
+    }
+  }
+
+  BandwidthController controller_;
+  TimeTicks now_;
+};
+
+TEST_F(BandwidthControllerTest, NotAdaptiveTest) {
+  EXPECT_EQ(0, controller_.rate());
+  EXPECT_EQ(0, controller_.TransferRate());
+  // The round-trip times don't matter.
+  AddRttSamples(20, 5);
+  AddRttSamples(2000, 5);
+  EXPECT_EQ(0, controller_.rate());
+
+  controller_.set_max_rate(1000);
+  EXPECT_EQ(1000, controller_.rate());
+  controller_.TransferStarted();
+  EXPECT_EQ(1000, controller_.TransferRate());
+  controller_.TransferStarted();
+  EXPECT_EQ(500, controller_.TransferRate());
+  controller_.TransferEnded();
+  EXPECT_EQ(1000, controller_.TransferRate());
+
+  controller_.set_max_rate(0);
+  EXPECT_EQ(0, controller_.TransferRate());
+}
+
+TEST_F(BandwidthControllerTest, AdaptiveTest) {
+  controller_.set_adaptive(true);
+  EXPECT_EQ(BandwidthController::kInitialRate, controller_.rate());
+
+  // Without queuing delay, the rate grows.
+  AddRttSamples(20, 10);
+  const uint64_t grown_rate = controller_.rate();
+  EXPECT_GT(grown_rate, BandwidthController::kInitialRate);
+
+  // At the target delay, it holds steady once the delay is the smallest of
+  // the last few round-trip times.
+  const int target_rtt_ms = 20 + BandwidthController::kTargetDelayMs;
+  AddRttSamples(target_rtt_ms, 4);
+  const uint64_t target_rate = controller_.rate();
+  EXPECT_GE(target_rate, grown_rate);
+  AddRttSamples(target_rtt_ms, 10);
+  EXPECT_EQ(target_rate, controller_.rate());
+
+  // Above it, the rate backs off, down to the minimum.
+  AddRttSamples(20 + 3 * BandwidthController::kTargetDelayMs, 10);
+  EXPECT_LT(controller_.rate(), target_rate);
+  AddRttSamples(20 + 3 * BandwidthController::kTargetDelayMs, 60);
+  EXPECT_EQ(BandwidthController::kMinRate, controller_.rate());
+
+  // An interactive update runs at the maximum rate.
+  controller_.set_adaptive(false);
+  EXPECT_EQ(0, controller_.rate());
+}
+
+TEST_F(BandwidthControllerTest, BaseDelayTest) {
+  controller_.set_adaptive(true);
+  AddRttSamples(20, 10);
+  // A path whose delay went up for good is taken as the new base once the
+  // old minimum is forgotten, and the rate grows again.
+  AddRttSamples(500, 11 * 60);
+  const uint64_t rate = controller_.rate();
+  AddRttSamples(500, 10);
+  EXPECT_GT(controller_.rate(), rate);
+}
+
+TEST_F(BandwidthControllerTest, MaxRateTest) {
+  controller_.set_adaptive(true);
+  controller_.set_max_rate(BandwidthController::kMinRate * 2);
+  EXPECT_EQ(BandwidthController::kMinRate * 2, controller_.rate());
+  AddRttSamples(20, 60);
+  EXPECT_EQ(BandwidthController::kMinRate * 2, controller_.rate());
+
+  // A cap below the minimum rate is obeyed.
+  controller_.set_max_rate(1000);
+  AddRttSamples(1000, 60);
+  EXPECT_EQ(1000, controller_.rate());
+  controller_.TransferStarted();
+  controller_.TransferStarted();
+  EXPECT_EQ(500, controller_.TransferRate());
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,236 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/blake3.h"
+
+#include <endian.h>
+#include <stdint.h>
+#include <string.h>
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace blake3 {
+
+const size_t kHashSize = 32;
+
+namespace {
+
+const size_t kBlockSize = 64;
+const size_t kChunkSize = 1024;
+const size_t kBlocksPerChunk = kChunkSize / kBlockSize;
+
+// The chunks hashed at once, one in each lane of a Lanes vector.
+const size_t kLanes = 4;
+typedef uint32_t Lanes __attribute__((vector_size(16)));
+
+// The flags of the compressions.
+const uint32_t kChunkStart = 1 << 0;
+const uint32_t kChunkEnd = 1 << 1;
+const uint32_t kParent = 1 << 2;
+const uint32_t kRoot = 1 << 3;
+
+const uint32_t kIV[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+  0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+// The order of the message words in each of the 7 rounds.
+const uint8_t kMessageSchedule[7][16] = {
+  { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+  { 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+  { 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+  { 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+  { 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+  { 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+  { 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 },
+};
+
+// The compression function below works on single words as well as on
+// Lanes of words from independent inputs.
+template <typename Word>
+Word Splat(uint32_t value);
+
+template <>
+inline uint32_t Splat<uint32_t>(uint32_t value) {
+  return value;
+}
+
+template <>
+inline Lanes Splat<Lanes>(uint32_t value) {
+  const Lanes lanes = { value, value, value, value };
+  return lanes;
+}
+
+template <typename Word>
+inline Word RotateRight(Word word, int bits) {
+  return (word >> bits) | (word << (32 - bits));
+}
+
+template <typename Word>
+inline void Mix(Word* v, int a, int b, int c, int d, Word x, Word y) {
+  v[a] = v[a] + v[b] + x;
+  v[d] = RotateRight(v[d] ^ v[a], 16);
+  v[c] = v[c] + v[d];
+  v[b] = RotateRight(v[b] ^ v[c], 12);
+  v[a] = v[a] + v[b] + y;
+  v[d] = RotateRight(v[d] ^ v[a], 8);
+  v[c] = v[c] + v[d];
+  v[b] = RotateRight(v[b] ^ v[c], 7);
+}
+
+// Compresses the |message| block into the chaining value |cv|, in place.
+template <typename Word>
+void Compress(Word cv[8],
+              const Word message[16],
+              Word counter_low,
+              Word counter_high,
+              uint32_t block_length,
+              uint32_t flags) {
+  Word v[16] = {
+    cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+    Splat<Word>(kIV[0]), Splat<Word>(kIV[1]),
+    Splat<Word>(kIV[2]), Splat<Word>(kIV[3]),
+    counter_low, counter_high,
+    Splat<Word>(block_length), Splat<Word>(flags)
+  };
+  for (int round = 0; round < 7; round++) {
+    const uint8_t* s = kMessageSchedule[round];
+    Mix(v, 0, 4, 8, 12, message[s[0]], message[s[1]]);
+    Mix(v, 1, 5, 9, 13, message[s[2]], message[s[3]]);
+    Mix(v, 2, 6, 10, 14, message[s[4]], message[s[5]]);
+    Mix(v, 3, 7, 11, 15, message[s[6]], message[s[7]]);
+    Mix(v, 0, 5, 10, 15, message[s[8]], message[s[9]]);
+    Mix(v, 1, 6, 11, 12, message[s[10]], message[s[11]]);
+    Mix(v, 2, 7, 8, 13, message[s[12]], message[s[13]]);
+    Mix(v, 3, 4, 9, 14, message[s[14]], message[s[15]]);
+  }
+  for (int i = 0; i < 8; i++)
+    cv[i] = v[i] ^ v[i + 8];
+}
+
+inline uint32_t LoadWord(const char* bytes) {
+  uint32_t word;
+  memcpy(&word, bytes, sizeof(word));
+  return le32toh(word);
+}
+
+// Sets |cv| to the chaining value of the chunk of |length| bytes at |data|,
+// the chunk number |counter|, with |flags| added to its last block's.
+void HashChunk(const char* data,
+               size_t length,
+               uint64_t counter,
+               uint32_t flags,
+               uint32_t cv[8]) {
+  memcpy(cv, kIV, sizeof(kIV));
+  const size_t blocks = length == 0 ? 1 : (length + kBlockSize - 1) /
+      kBlockSize;
+  for (size_t i = 0; i < blocks; i++) {
+    // The last block is padded with zeros.
+    char block[kBlockSize] = { 0 };
+    const size_t block_length =
+        i + 1 < blocks ? kBlockSize : length - i * kBlockSize;
+    if (block_length > 0)
+      memcpy(block, data + i * kBlockSize, block_length);
+    uint32_t message[16];
+    for (int j = 0; j < 16; j++)
+      message[j] = LoadWord(block + 4 * j);
+    uint32_t block_flags = i == 0 ? kChunkStart : 0;
+    if (i + 1 == blocks)
+      block_flags |= kChunkEnd | flags;
+    Compress<uint32_t>(cv, message, counter, counter >> 32, block_length,
+                       block_flags);
+  }
+}
+
+// Sets the chaining values |cvs| of the kLanes whole chunks at |data|, the
+// first of which is the chunk number |counter|.
+void HashChunkLanes(const char* data, uint64_t counter, uint32_t cvs[][8]) {
+  Lanes cv[8];
+  for (int i = 0; i < 8; i++)
+    cv[i] = Splat<Lanes>(kIV[i]);
+  Lanes counter_low, counter_high;
+  for (size_t lane = 0; lane < kLanes; lane++) {
+    counter_low[lane] = counter + lane;
+    counter_high[lane] = (counter + lane) >> 32;
+  }
+  for (size_t i = 0; i < kBlocksPerChunk; i++) {
+    Lanes message[16];
+    for (int j = 0; j < 16; j++) {
+      for (size_t lane = 0; lane < kLanes; lane++) {
+        message[j][lane] =
+            LoadWord(data + lane * kChunkSize + i * kBlockSize + 4 * j);
+      }
+    }
+    uint32_t flags = i == 0 ? kChunkStart : 0;
+    if (i + 1 == kBlocksPerChunk)
+      flags |= kChunkEnd;
+    Compress<Lanes>(cv, message, counter_low, counter_high, kBlockSize,
+                    flags);
+  }
+  for (size_t lane = 0; lane < kLanes; lane++) {
+    for (int i = 0; i < 8; i++)
+      cvs[lane][i] = cv[i][lane];
+  }
+}
+
+// Sets |cv| to the chaining value of the subtree of the |count| chunks
+// whose chaining values start at |chunk_cvs|, with |flags| added to its
+// root's.
+void HashSubtree(const uint32_t (*chunk_cvs)[8],
+                 size_t count,
+                 uint32_t flags,
+                 uint32_t cv[8]) {
+  if (count == 1) {
+    memcpy(cv, chunk_cvs[0], sizeof(chunk_cvs[0]));
+    return;
+  }
+  // The left subtree is the largest power of two chunks that leaves some for
+  // the right one.
+  size_t left = 1;
+  while (2 * left < count)
+    left *= 2;
+  uint32_t message[16];
+  HashSubtree(chunk_cvs, left, 0, message);
+  HashSubtree(chunk_cvs + left, count - left, 0, message + 8);
+  memcpy(cv, kIV, sizeof(kIV));
+  Compress<uint32_t>(cv, message, 0, 0, kBlockSize, kParent | flags);
+}
+
+}  // namespace {}
+
+bool RawHashOfBytes(const char* data, size_t length, vector<char>* out_hash) {
+  uint32_t hash[8];
+  const size_t chunks =
+      length == 0 ? 1 : (length + kChunkSize - 1) / kChunkSize;
+  if (chunks == 1) {
+    HashChunk(data, length, 0, kRoot, hash);
+  } else {
+    vector<uint32_t> chunk_cvs(8 * chunks);
+    uint32_t (*cvs)[8] = reinterpret_cast<uint32_t (*)[8]>(&chunk_cvs[0]);
+    // The whole chunks are hashed kLanes at a time, and the rest, including
+    // the last one, which may be partial, one at a time.
+    size_t chunk = 0;
+    for (; (chunk + kLanes) * kChunkSize <= length; chunk += kLanes)
+      HashChunkLanes(data + chunk * kChunkSize, chunk, cvs + chunk);
+    for (; chunk < chunks; chunk++) {
+      const size_t offset = chunk * kChunkSize;
+      const size_t chunk_length =
+          length - offset < kChunkSize ? length - offset : kChunkSize;
+      HashChunk(data + offset, chunk_length, chunk, 0, cvs[chunk]);
+    }
+    HashSubtree(cvs, chunks, kRoot, hash);
+  }
+  out_hash->resize(kHashSize);
+  for (int i = 0; i < 8; i++) {
+    const uint32_t word = htole32(hash[i]);
+    memcpy(&(*out_hash)[4 * i], &word, sizeof(word));
+  }
+  return true;
+}
+
+}  // namespace blake3
+
+}  // namespace chromeos_update_engine
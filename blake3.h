@@ -0,0 +1,34 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_BLAKE3_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_BLAKE3_H__
+
+#include <stddef.h>
+
+#include <vector>
+
+// The BLAKE3 hash, which the operations' data blobs may be validated with
+// instead of SHA-256: it's several times faster on CPUs without SHA
+// instructions, as it hashes the 1 KiB chunks of its tree four at a time
+// in the lanes of the SIMD registers.
+
+namespace chromeos_update_engine {
+
+namespace blake3 {
+
+// The size of the hashes, in bytes.
+extern const size_t kHashSize;
+
+// Sets |out_hash| to the BLAKE3 hash of the |length| bytes at |data|. Always
+// returns true, like the other hash functions' RawHashOfBytes().
+bool RawHashOfBytes(const char* data,
+                    size_t length,
+                    std::vector<char>* out_hash);
+
+}  // namespace blake3
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_BLAKE3_H__
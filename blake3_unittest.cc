@@ -0,0 +1,76 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <string>
+#include <vector>
+
+#include <base/basictypes.h>
+#include <base/string_number_conversions.h>
+#include <base/string_util.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/blake3.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+string HexHash(const char* data, size_t length) {
+  vector<char> hash;
+  EXPECT_TRUE(blake3::RawHashOfBytes(data, length, &hash));
+  EXPECT_EQ(blake3::kHashSize, hash.size());
+  return StringToLowerASCII(base::HexEncode(&hash[0], hash.size()));
+}
+
+}  // namespace {}
+
+TEST(Blake3Test, ShortInputTest) {
+  EXPECT_EQ("af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262",
+            HexHash(NULL, 0));
+  EXPECT_EQ("6437b3ac38465133ffb63b75273a8db548c558465d79db03fd359c6cd5bd9d85",
+            HexHash("abc", 3));
+  const char zero = 0;
+  EXPECT_EQ("2d3adedff11b61f14c886e35afa036736dcd87a74d27b5c1510225d0f592e213",
+            HexHash(&zero, 1));
+}
+
+TEST(Blake3Test, TreeTest) {
+  // The input of the official test vectors, hashed in chunks and subtrees of
+  // all shapes.
+  vector<char> input(31744);
+  for (size_t i = 0; i < input.size(); i++)
+    input[i] = i % 251;
+  const struct {
+    size_t length;
+    const char* hash;
+  } kVectors[] = {
+    { 1023,
+      "10108970eeda3eb932baac1428c7a2163b0e924c9a9e25b35bba72b28f70bd11" },
+    { 1024,
+      "42214739f095a406f3fc83deb889744ac00df831c10daa55189b5d121c855af7" },
+    { 1025,
+      "d00278ae47eb27b34faecf67b4fe263f82d5412916c1ffd97c8cb7fb814b8444" },
+    { 2048,
+      "e776b6028c7cd22a4d0ba182a8bf62205d2ef576467e838ed6f2529b85fba24a" },
+    { 2049,
+      "5f4d72f40d7a5f82b15ca2b2e44b1de3c2ef86c426c95c1af0b6879522563030" },
+    { 4096,
+      "015094013f57a5277b59d8475c0501042c0b642e531b0a1c8f58d2163229e969" },
+    { 4097,
+      "9b4052b38f1c5fc8b1f9ff7ac7b27cd242487b3d890d15c96a1c25b8aa0fb995" },
+    { 8193,
+      "bab6c09cb8ce8cf459261398d2e7aef35700bf488116ceb94a36d0f5f1b7bc3b" },
+    { 31744,
+      "62b6960e1a44bcc1eb1a611a8d6235b6b4b78f32e7abc4fb4c6cdcce94895c47" },
+  };
+  for (size_t i = 0; i < arraysize(kVectors); i++) {
+    EXPECT_EQ(kVectors[i].hash, HexHash(&input[0], kVectors[i].length))
+        << "length " << kVectors[i].length;
+  }
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,63 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/blob_spool.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <base/logging.h>
+
+#include "update_engine/utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+BlobSpool::BlobSpool() : fd_(-1), size_(0), length_(0), data_(NULL) {}
+
+BlobSpool::~BlobSpool() {
+  Close();
+}
+
+bool BlobSpool::Open(const string& dir, uint64_t length) {
+  Close();
+  TEST_AND_RETURN_FALSE(length > 0);
+  string path;
+  TEST_AND_RETURN_FALSE(utils::MakeTempFile(dir + "/blob-spool.XXXXXX", &path,
+                                            &fd_));
+  // The blob goes away with the descriptor, even if the process dies.
+  PLOG_IF(WARNING, unlink(path.c_str()) != 0) << "Unable to unlink " << path;
+  size_ = 0;
+  length_ = length;
+  return true;
+}
+
+bool BlobSpool::Append(const char* bytes, size_t count) {
+  TEST_AND_RETURN_FALSE(is_open() && !complete());
+  TEST_AND_RETURN_FALSE(count <= length_ - size_);
+  TEST_AND_RETURN_FALSE(utils::WriteAll(fd_, bytes, count));
+  size_ += count;
+  if (size_ == length_) {
+    void* data = mmap(NULL, length_, PROT_READ, MAP_SHARED, fd_, 0);
+    TEST_AND_RETURN_FALSE_ERRNO(data != MAP_FAILED);
+    data_ = reinterpret_cast<const char*>(data);
+  }
+  return true;
+}
+
+void BlobSpool::Close() {
+  if (data_) {
+    munmap(const_cast<char*>(data_), length_);
+    data_ = NULL;
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+  size_ = 0;
+  length_ = 0;
+}
+
+}  // namespace chromeos_update_engine
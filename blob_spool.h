@@ -0,0 +1,58 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_BLOB_SPOOL_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_BLOB_SPOOL_H__
+
+#include <string>
+
+#include <base/basictypes.h>
+
+// Keeps a data blob that's too big to be held in memory in an unlinked file
+// while it's being downloaded. Once all of it is there, the file is mapped,
+// so the blob can be applied from memory like any other, except that its
+// pages are clean page cache the kernel can drop and read again under
+// memory pressure, rather than anonymous memory.
+
+namespace chromeos_update_engine {
+
+class BlobSpool {
+ public:
+  BlobSpool();
+  ~BlobSpool();
+
+  // Starts spooling a blob of |length| bytes to a new file in |dir|, after
+  // closing the previous one, if any. Returns false on failure.
+  bool Open(const std::string& dir, uint64_t length);
+
+  // Appends the |count| bytes at |bytes| to the blob. Once all its bytes are
+  // in, the blob is mapped. Returns false on failure, or if that's more
+  // bytes than the blob has.
+  bool Append(const char* bytes, size_t count);
+
+  // Unmaps and deletes the blob.
+  void Close();
+
+  bool is_open() const { return fd_ >= 0; }
+  bool complete() const { return data_ != NULL; }
+
+  // The blob, once it's complete.
+  const char* data() const { return data_; }
+
+  // The number of bytes appended so far, and the size of the blob.
+  uint64_t size() const { return size_; }
+  uint64_t length() const { return length_; }
+
+ private:
+  int fd_;
+  uint64_t size_;
+  uint64_t length_;
+  const char* data_;
+
+  DISALLOW_COPY_AND_ASSIGN(BlobSpool);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_BLOB_SPOOL_H__
@@ -0,0 +1,77 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/blob_spool.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+TEST(BlobSpoolTest, SimpleTest) {
+  vector<char> blob(3 * 4096 + 5);
+  for (size_t i = 0; i < blob.size(); i++)
+    blob[i] = i * 13;
+
+  BlobSpool spool;
+  EXPECT_FALSE(spool.is_open());
+  ASSERT_TRUE(spool.Open("/tmp", blob.size()));
+  EXPECT_TRUE(spool.is_open());
+  EXPECT_EQ(blob.size(), spool.length());
+  for (size_t offset = 0; offset < blob.size(); offset += 1000) {
+    EXPECT_FALSE(spool.complete());
+    EXPECT_TRUE(spool.data() == NULL);
+    EXPECT_TRUE(spool.Append(&blob[offset],
+                             std::min<size_t>(1000, blob.size() - offset)));
+  }
+  EXPECT_EQ(blob.size(), spool.size());
+  ASSERT_TRUE(spool.complete());
+  EXPECT_EQ(0, memcmp(&blob[0], spool.data(), blob.size()));
+
+  // Nothing can be appended to a complete blob.
+  EXPECT_FALSE(spool.Append(&blob[0], 1));
+
+  spool.Close();
+  EXPECT_FALSE(spool.is_open());
+  EXPECT_FALSE(spool.complete());
+  EXPECT_EQ(0, spool.size());
+}
+
+TEST(BlobSpoolTest, ReopenTest) {
+  const char kFirst[] = "first blob";
+  const char kSecond[] = "second";
+  BlobSpool spool;
+  ASSERT_TRUE(spool.Open("/tmp", sizeof(kFirst)));
+  EXPECT_TRUE(spool.Append(kFirst, 5));
+
+  // Opening again drops what's been spooled so far.
+  ASSERT_TRUE(spool.Open("/tmp", sizeof(kSecond)));
+  EXPECT_EQ(0, spool.size());
+  EXPECT_TRUE(spool.Append(kSecond, sizeof(kSecond)));
+  ASSERT_TRUE(spool.complete());
+  EXPECT_STREQ(kSecond, spool.data());
+}
+
+TEST(BlobSpoolTest, ErrorTest) {
+  BlobSpool spool;
+  // Nothing can be appended before the spool is opened.
+  EXPECT_FALSE(spool.Append("x", 1));
+  // Empty blobs aren't spooled.
+  EXPECT_FALSE(spool.Open("/tmp", 0));
+  EXPECT_FALSE(spool.Open("/nonexistent-dir", 10));
+  EXPECT_FALSE(spool.is_open());
+
+  ASSERT_TRUE(spool.Open("/tmp", 4));
+  // More bytes than the blob has.
+  EXPECT_FALSE(spool.Append("12345", 5));
+  EXPECT_EQ(0, spool.size());
+}
+
+}  // namespace chromeos_update_engine
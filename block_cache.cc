@@ -0,0 +1,89 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/block_cache.h"
+
+#include <string.h>
+
+using std::make_pair;
+using std::map;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+BlockCache::BlockCache(uint64_t max_blocks, uint32_t block_size)
+    : max_blocks_(max_blocks),
+      block_size_(block_size),
+      hits_(0),
+      misses_(0) {
+  g_mutex_init(&mutex_);
+}
+
+BlockCache::~BlockCache() {
+  g_mutex_clear(&mutex_);
+}
+
+void BlockCache::Put(int fd,
+                     uint64_t start_block,
+                     uint64_t num_blocks,
+                     const char* data) {
+  if (max_blocks_ == 0)
+    return;
+  g_mutex_lock(&mutex_);
+  for (uint64_t i = 0; i < num_blocks; i++, data += block_size_) {
+    const Key key(fd, start_block + i);
+    map<Key, Entry>::iterator it = blocks_.find(key);
+    if (it != blocks_.end()) {
+      lru_.erase(it->second.lru);
+    } else {
+      vector<char> buffer;
+      // The block evicted lends its buffer to the new one.
+      if (blocks_.size() >= max_blocks_) {
+        map<Key, Entry>::iterator oldest = blocks_.find(lru_.back());
+        buffer.swap(oldest->second.data);
+        Erase(oldest);
+      }
+      it = blocks_.insert(make_pair(key, Entry())).first;
+      it->second.data.swap(buffer);
+      it->second.data.resize(block_size_);
+    }
+    memcpy(&it->second.data[0], data, block_size_);
+    lru_.push_front(key);
+    it->second.lru = lru_.begin();
+  }
+  g_mutex_unlock(&mutex_);
+}
+
+bool BlockCache::Get(int fd, uint64_t block, char* data) {
+  g_mutex_lock(&mutex_);
+  map<Key, Entry>::iterator it = blocks_.find(Key(fd, block));
+  const bool found = it != blocks_.end();
+  if (found) {
+    memcpy(data, &it->second.data[0], block_size_);
+    lru_.splice(lru_.begin(), lru_, it->second.lru);
+    hits_++;
+  } else {
+    misses_++;
+  }
+  g_mutex_unlock(&mutex_);
+  return found;
+}
+
+void BlockCache::Invalidate(int fd,
+                            uint64_t start_block,
+                            uint64_t num_blocks) {
+  g_mutex_lock(&mutex_);
+  map<Key, Entry>::iterator it = blocks_.lower_bound(Key(fd, start_block));
+  while (it != blocks_.end() && it->first.first == fd &&
+         it->first.second - start_block < num_blocks)
+    Erase(it++);
+  g_mutex_unlock(&mutex_);
+}
+
+void BlockCache::Erase(map<Key, Entry>::iterator it) {
+  lru_.erase(it->second.lru);
+  blocks_.erase(it);
+}
+
+}  // namespace chromeos_update_engine
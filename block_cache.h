@@ -0,0 +1,177 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_BLOCK_CACHE_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_BLOCK_CACHE_H__
+
+#include <glib.h>
+
+#include <algorithm>
+#include <list>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include <base/basictypes.h>
+
+#include "update_engine/extent_writer.h"
+#include "update_engine/graph_types.h"
+
+// A BlockCache keeps copies of the blocks the install operations wrote or
+// read last, so that the operations after them that read those blocks get
+// them from memory rather than the device: the ones reading the temp blocks
+// the generator cut cycles with, and the ones reading the same source
+// blocks, such as shared metadata or libraries diffed against similar old
+// files. Blocks written with O_DIRECT aren't in the page cache, and the
+// source blocks read long before may have been dropped from it. The cache
+// holds a bounded number of blocks and evicts the least recently used ones.
+// It may be used from several threads at once.
+
+namespace chromeos_update_engine {
+
+class BlockCache {
+ public:
+  // Keeps up to |max_blocks| blocks of |block_size| bytes.
+  BlockCache(uint64_t max_blocks, uint32_t block_size);
+  ~BlockCache();
+
+  // Keeps a copy of the |num_blocks| blocks at |data|, just written to or
+  // read from |start_block| on in |fd|.
+  void Put(int fd, uint64_t start_block, uint64_t num_blocks,
+           const char* data);
+
+  // Copies block |block| of |fd| to the block_size() bytes at |data| and
+  // returns true if it's kept, and returns false otherwise.
+  bool Get(int fd, uint64_t block, char* data);
+
+  // Forgets the |num_blocks| blocks from |start_block| on in |fd|, which
+  // are about to be written.
+  void Invalidate(int fd, uint64_t start_block, uint64_t num_blocks);
+
+  uint32_t block_size() const { return block_size_; }
+
+  // The number of Get() calls that found their block, and that didn't.
+  uint64_t hits() const { return hits_; }
+  uint64_t misses() const { return misses_; }
+
+ private:
+  // A block of a file.
+  typedef std::pair<int, uint64_t> Key;
+
+  struct Entry {
+    std::vector<char> data;
+    // The position of the block in |lru_|.
+    std::list<Key>::iterator lru;
+  };
+
+  // Removes the block at |it| from the cache.
+  void Erase(std::map<Key, Entry>::iterator it);
+
+  const uint64_t max_blocks_;
+  const uint32_t block_size_;
+
+  // Protects the members below.
+  GMutex mutex_;
+  std::map<Key, Entry> blocks_;
+  // The blocks kept, the most recently used first.
+  std::list<Key> lru_;
+  uint64_t hits_;
+  uint64_t misses_;
+
+  DISALLOW_COPY_AND_ASSIGN(BlockCache);
+};
+
+// Takes an underlying ExtentWriter to which all operations are delegated,
+// and puts the whole blocks written through it in |cache|, which must
+// outlive the writer. Placed below a ZeroPadWriter, it sees all the blocks
+// that end up in the extents. As with HashWriter, the underlying writer is
+// of type |Underlying|, or of any type for a CachingExtentWriter.
+
+template <class Underlying>
+class CachingWriter : public ExtentWriter {
+ public:
+  CachingWriter(Underlying* underlying_extent_writer,
+                BlockCache* cache)
+      : underlying_extent_writer_(underlying_extent_writer),
+        cache_(cache),
+        fd_(-1),
+        block_size_(0),
+        extent_index_(0),
+        extent_blocks_written_(0) {}
+  ~CachingWriter() {}
+
+  bool Init(int fd, const std::vector<Extent>& extents, uint32_t block_size) {
+    fd_ = fd;
+    extents_ = extents;
+    block_size_ = block_size;
+    extent_index_ = 0;
+    extent_blocks_written_ = 0;
+    partial_block_.clear();
+    return InitThrough(underlying_extent_writer_, fd, extents, block_size);
+  }
+  bool Write(const void* bytes, size_t count) {
+    TEST_AND_RETURN_FALSE(
+        WriteThrough(underlying_extent_writer_, bytes, count));
+    const char* data = reinterpret_cast<const char*>(bytes);
+    if (!partial_block_.empty()) {
+      const size_t fill =
+          std::min(count, block_size_ - partial_block_.size());
+      partial_block_.insert(partial_block_.end(), data, data + fill);
+      data += fill;
+      count -= fill;
+      if (partial_block_.size() < block_size_)
+        return true;
+      PutBlocks(&partial_block_[0], 1);
+      partial_block_.clear();
+    }
+    const size_t num_blocks = count / block_size_;
+    PutBlocks(data, num_blocks);
+    data += num_blocks * block_size_;
+    count -= num_blocks * block_size_;
+    partial_block_.assign(data, data + count);
+    return true;
+  }
+  bool EndImpl() {
+    return underlying_extent_writer_->End();
+  }
+
+ private:
+  // Puts the |num_blocks| blocks at |data| in the cache as the next blocks
+  // of the extents.
+  void PutBlocks(const char* data, uint64_t num_blocks) {
+    while (num_blocks > 0 && extent_index_ < extents_.size()) {
+      const Extent& extent = extents_[extent_index_];
+      const uint64_t count =
+          std::min(num_blocks, extent.num_blocks() - extent_blocks_written_);
+      if (extent.start_block() != kSparseHole) {
+        cache_->Put(fd_, extent.start_block() + extent_blocks_written_,
+                    count, data);
+      }
+      data += count * block_size_;
+      num_blocks -= count;
+      extent_blocks_written_ += count;
+      if (extent_blocks_written_ == extent.num_blocks()) {
+        extent_index_++;
+        extent_blocks_written_ = 0;
+      }
+    }
+  }
+
+  Underlying* underlying_extent_writer_;  // The underlying ExtentWriter.
+  BlockCache* cache_;
+  int fd_;
+  std::vector<Extent> extents_;
+  size_t block_size_;
+  // The extent the next block goes to, and its blocks written so far.
+  std::vector<Extent>::size_type extent_index_;
+  uint64_t extent_blocks_written_;
+  // The bytes of the block being written, when they don't all come at once.
+  std::vector<char> partial_block_;
+};
+
+typedef CachingWriter<ExtentWriter> CachingExtentWriter;
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_BLOCK_CACHE_H__
@@ -0,0 +1,120 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <string.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/extent_ranges.h"
+#include "update_engine/extent_writer.h"
+#include "update_engine/graph_types.h"
+#include "update_engine/block_cache.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+const uint32_t kCacheBlockSize = 16;
+
+// Returns a block filled with |value|.
+vector<char> Block(char value) {
+  return vector<char>(kCacheBlockSize, value);
+}
+
+// An ExtentWriter that drops the data.
+class NullExtentWriter : public ExtentWriter {
+ public:
+  bool Init(int fd, const vector<Extent>& extents, uint32_t block_size) {
+    return true;
+  }
+  bool Write(const void* bytes, size_t count) { return true; }
+  bool EndImpl() { return true; }
+};
+}  // namespace {}
+
+TEST(BlockCacheTest, SimpleTest) {
+  BlockCache cache(3, kCacheBlockSize);
+  vector<char> data;
+  for (char i = 0; i < 4; i++) {
+    const vector<char> block = Block('a' + i);
+    data.insert(data.end(), block.begin(), block.end());
+  }
+  vector<char> block(kCacheBlockSize);
+  EXPECT_FALSE(cache.Get(1, 10, &block[0]));
+
+  // Only the last three blocks fit.
+  cache.Put(1, 10, 4, &data[0]);
+  EXPECT_FALSE(cache.Get(1, 10, &block[0]));
+  EXPECT_TRUE(cache.Get(1, 11, &block[0]));
+  EXPECT_TRUE(block == Block('b'));
+  EXPECT_TRUE(cache.Get(1, 13, &block[0]));
+  EXPECT_TRUE(block == Block('d'));
+  // The blocks of other files are kept apart.
+  EXPECT_FALSE(cache.Get(2, 11, &block[0]));
+
+  // Block 12 is the least recently used one now, so it's evicted.
+  cache.Put(2, 11, 1, &data[0]);
+  EXPECT_FALSE(cache.Get(1, 12, &block[0]));
+  EXPECT_TRUE(cache.Get(1, 11, &block[0]));
+  EXPECT_TRUE(cache.Get(2, 11, &block[0]));
+  EXPECT_TRUE(block == Block('a'));
+
+  // Writing a block again replaces its copy.
+  cache.Put(1, 13, 1, &data[kCacheBlockSize * 2]);
+  EXPECT_TRUE(cache.Get(1, 13, &block[0]));
+  EXPECT_TRUE(block == Block('c'));
+
+  EXPECT_EQ(5, cache.hits());
+  EXPECT_EQ(4, cache.misses());
+}
+
+TEST(BlockCacheTest, InvalidateTest) {
+  BlockCache cache(10, kCacheBlockSize);
+  const vector<char> data(kCacheBlockSize * 5, 'x');
+  cache.Put(1, 0, 5, &data[0]);
+  cache.Put(2, 0, 5, &data[0]);
+  cache.Invalidate(1, 1, 3);
+  vector<char> block(kCacheBlockSize);
+  EXPECT_TRUE(cache.Get(1, 0, &block[0]));
+  EXPECT_FALSE(cache.Get(1, 1, &block[0]));
+  EXPECT_FALSE(cache.Get(1, 3, &block[0]));
+  EXPECT_TRUE(cache.Get(1, 4, &block[0]));
+  EXPECT_TRUE(cache.Get(2, 2, &block[0]));
+}
+
+TEST(BlockCacheTest, CachingWriterTest) {
+  BlockCache cache(10, kCacheBlockSize);
+  NullExtentWriter null_writer;
+  CachingWriter<NullExtentWriter> writer(&null_writer, &cache);
+  vector<Extent> extents;
+  extents.push_back(ExtentForRange(7, 1));
+  extents.push_back(ExtentForRange(kSparseHole, 1));
+  extents.push_back(ExtentForRange(2, 2));
+  ASSERT_TRUE(writer.Init(3, extents, kCacheBlockSize));
+  vector<char> data;
+  for (char i = 0; i < 4; i++) {
+    const vector<char> block = Block('a' + i);
+    data.insert(data.end(), block.begin(), block.end());
+  }
+  // The blocks are put together across writes of any size.
+  EXPECT_TRUE(writer.Write(&data[0], 5));
+  EXPECT_TRUE(writer.Write(&data[5], kCacheBlockSize * 2));
+  EXPECT_TRUE(writer.Write(&data[5 + kCacheBlockSize * 2],
+                           data.size() - 5 - kCacheBlockSize * 2));
+  EXPECT_TRUE(writer.End());
+
+  vector<char> block(kCacheBlockSize);
+  EXPECT_TRUE(cache.Get(3, 7, &block[0]));
+  EXPECT_TRUE(block == Block('a'));
+  EXPECT_TRUE(cache.Get(3, 2, &block[0]));
+  EXPECT_TRUE(block == Block('c'));
+  EXPECT_TRUE(cache.Get(3, 3, &block[0]));
+  EXPECT_TRUE(block == Block('d'));
+  EXPECT_FALSE(cache.Get(3, 4, &block[0]));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,148 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/block_index.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+
+#include "update_engine/block_scan.h"
+#include "update_engine/utils.h"
+
+using std::lower_bound;
+using std::map;
+using std::max;
+using std::min;
+using std::sort;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+// The number of blocks hashed per read.
+const uint64_t kHashChunkBlocks = 256;
+}  // namespace {}
+
+const uint64_t BlockIndex::kNoBlock = kuint64max;
+
+BlockIndex::BlockIndex() : fd_(-1), block_count_(0), block_size_(0) {}
+
+BlockIndex::~BlockIndex() {
+  if (fd_ >= 0)
+    HANDLE_EINTR(close(fd_));
+}
+
+bool BlockIndex::Init(const string& path,
+                      uint64_t block_count,
+                      size_t block_size) {
+  TEST_AND_RETURN_FALSE(fd_ < 0);
+  TEST_AND_RETURN_FALSE(block_size > 0);
+  fd_ = open(path.c_str(), O_RDONLY);
+  TEST_AND_RETURN_FALSE_ERRNO(fd_ >= 0);
+  block_count_ = block_count;
+  block_size_ = block_size;
+
+  entries_.resize(block_count_);
+  block_hashes_.resize(block_count_);
+  vector<char> buf(kHashChunkBlocks * block_size_);
+  for (uint64_t block = 0; block < block_count_; block += kHashChunkBlocks) {
+    const uint64_t blocks = min(kHashChunkBlocks, block_count_ - block);
+    ssize_t bytes_read = 0;
+    TEST_AND_RETURN_FALSE(utils::PReadAll(fd_,
+                                          &buf[0],
+                                          blocks * block_size_,
+                                          block * block_size_,
+                                          &bytes_read));
+    TEST_AND_RETURN_FALSE(bytes_read ==
+                          static_cast<ssize_t>(blocks * block_size_));
+    for (uint64_t i = 0; i < blocks; i++) {
+      Entry& entry = entries_[block + i];
+      entry.hash = block_scan::HashData(&buf[i * block_size_], block_size_);
+      entry.block = block + i;
+      block_hashes_[block + i] = entry.hash;
+    }
+  }
+  sort(entries_.begin(), entries_.end(), EntryLess);
+  used_.assign(block_count_, false);
+  return true;
+}
+
+uint64_t BlockIndex::Find(const char* data, uint64_t preferred_block) {
+  Entry key;
+  key.hash = block_scan::HashData(data, block_size_);
+  key.block = 0;
+  vector<Entry>::const_iterator begin =
+      lower_bound(entries_.begin(), entries_.end(), key, EntryLess);
+  if (begin == entries_.end() || begin->hash != key.hash)
+    return kNoBlock;
+
+  if (preferred_block < block_count_ && !used_[preferred_block] &&
+      block_hashes_[preferred_block] == key.hash &&
+      BlockEquals(preferred_block, data)) {
+    Use(preferred_block);
+    return preferred_block;
+  }
+
+  // Skips the blocks with this hash that are known to be used.
+  size_t& first_unused = first_unused_[key.hash];
+  size_t i = max(static_cast<size_t>(begin - entries_.begin()), first_unused);
+  for (; i < entries_.size() && entries_[i].hash == key.hash &&
+           used_[entries_[i].block]; i++) {}
+  first_unused = i;
+  for (; i < entries_.size() && entries_[i].hash == key.hash; i++) {
+    const uint64_t block = entries_[i].block;
+    if (!used_[block] && BlockEquals(block, data)) {
+      Use(block);
+      return block;
+    }
+  }
+  return kNoBlock;
+}
+
+void BlockIndex::Use(uint64_t block) {
+  if (block < block_count_)
+    used_[block] = true;
+}
+
+void BlockIndex::Release(uint64_t block) {
+  if (block >= block_count_ || !used_[block])
+    return;
+  used_[block] = false;
+  map<uint64_t, size_t>::iterator it =
+      first_unused_.find(block_hashes_[block]);
+  if (it == first_unused_.end())
+    return;
+  Entry key;
+  key.hash = block_hashes_[block];
+  key.block = block;
+  it->second = min(it->second, static_cast<size_t>(
+      lower_bound(entries_.begin(), entries_.end(), key, EntryLess) -
+      entries_.begin()));
+}
+
+bool BlockIndex::EntryLess(const Entry& a, const Entry& b) {
+  if (a.hash != b.hash)
+    return a.hash < b.hash;
+  return a.block < b.block;
+}
+
+bool BlockIndex::BlockEquals(uint64_t block, const char* data) {
+  vector<char> buf(block_size_);
+  ssize_t bytes_read = 0;
+  if (!utils::PReadAll(fd_, &buf[0], block_size_, block * block_size_,
+                       &bytes_read) ||
+      bytes_read != static_cast<ssize_t>(block_size_)) {
+    PLOG(ERROR) << "Unable to read block " << block;
+    return false;
+  }
+  return block_scan::DataEquals(&buf[0], data, block_size_);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,78 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_BLOCK_INDEX_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_BLOCK_INDEX_H__
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <base/basictypes.h>
+
+// A BlockIndex finds the blocks of an image by their contents. It hashes
+// every block of the image once and keeps the hashes sorted along with
+// the block numbers, so a lookup is a binary search followed by a read of
+// the candidate block to rule out hash collisions. Each block of the image
+// is handed out at most once, as each may only be read by one operation.
+
+namespace chromeos_update_engine {
+
+class BlockIndex {
+ public:
+  static const uint64_t kNoBlock;
+
+  BlockIndex();
+  ~BlockIndex();
+
+  // Hashes the |block_count| blocks of |block_size| bytes of the image at
+  // |path|, which is kept open for the lookups. Returns true on success.
+  bool Init(const std::string& path, uint64_t block_count, size_t block_size);
+
+  // Looks for an unused block of the image with the same contents as the
+  // |block_size| bytes at |data|, preferring |preferred_block| if it's one.
+  // Marks the block found as used and returns it, or returns kNoBlock if
+  // there's none.
+  uint64_t Find(const char* data, uint64_t preferred_block);
+
+  // Marks |block| as used or as available again.
+  void Use(uint64_t block);
+  void Release(uint64_t block);
+
+  uint64_t block_count() const { return block_count_; }
+
+ private:
+  struct Entry {
+    uint64_t hash;
+    uint64_t block;
+  };
+  static bool EntryLess(const Entry& a, const Entry& b);
+
+  // Returns true if |block| of the image holds the |block_size_| bytes at
+  // |data|.
+  bool BlockEquals(uint64_t block, const char* data);
+
+  int fd_;
+  uint64_t block_count_;
+  size_t block_size_;
+
+  // All the blocks of the image, sorted by hash and block.
+  std::vector<Entry> entries_;
+
+  // The hash of each block.
+  std::vector<uint64_t> block_hashes_;
+
+  // Whether each block is used.
+  std::vector<bool> used_;
+
+  // For each hash, the position in |entries_| before which all its blocks
+  // are used.
+  std::map<uint64_t, size_t> first_unused_;
+
+  DISALLOW_COPY_AND_ASSIGN(BlockIndex);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_BLOCK_INDEX_H__
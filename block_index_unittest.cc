@@ -0,0 +1,63 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/block_index.h"
+#include "update_engine/test_utils.h"
+#include "update_engine/utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+class BlockIndexTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    ASSERT_TRUE(utils::MakeTempFile("/tmp/BlockIndexTest.XXXXXX",
+                                    &path_,
+                                    NULL));
+  }
+
+  virtual void TearDown() {
+    unlink(path_.c_str());
+  }
+
+  string path_;
+};
+
+TEST_F(BlockIndexTest, FindTest) {
+  // Blocks of 4 bytes.
+  ASSERT_TRUE(WriteFileString(path_, "aaaabbbbaaaaccccaaaabbbb"));
+  BlockIndex index;
+  ASSERT_TRUE(index.Init(path_, 6, 4));
+  EXPECT_EQ(6, index.block_count());
+
+  EXPECT_EQ(BlockIndex::kNoBlock, index.Find("dddd", BlockIndex::kNoBlock));
+  EXPECT_EQ(0, index.Find("aaaa", BlockIndex::kNoBlock));
+  EXPECT_EQ(1, index.Find("bbbb", 1));
+  EXPECT_EQ(4, index.Find("aaaa", 4));
+  EXPECT_EQ(2, index.Find("aaaa", 1));
+  // The preferred block doesn't match, or is used.
+  EXPECT_EQ(5, index.Find("bbbb", 3));
+  EXPECT_EQ(BlockIndex::kNoBlock, index.Find("aaaa", 0));
+  EXPECT_EQ(BlockIndex::kNoBlock, index.Find("bbbb", BlockIndex::kNoBlock));
+
+  index.Release(2);
+  index.Release(4);
+  EXPECT_EQ(2, index.Find("aaaa", BlockIndex::kNoBlock));
+  index.Use(3);
+  EXPECT_EQ(BlockIndex::kNoBlock, index.Find("cccc", BlockIndex::kNoBlock));
+  EXPECT_EQ(4, index.Find("aaaa", BlockIndex::kNoBlock));
+}
+
+TEST_F(BlockIndexTest, ShortImageTest) {
+  ASSERT_TRUE(WriteFileString(path_, "aaaabb"));
+  BlockIndex index;
+  EXPECT_FALSE(index.Init(path_, 2, 4));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,432 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/block_io.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+#include <glib.h>
+
+#include <base/logging.h>
+#include <base/memory/scoped_ptr.h>
+
+#include "update_engine/io_recorder.h"
+#include "update_engine/thread_pool.h"
+#include "update_engine/utils.h"
+
+#if defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+
+using std::deque;
+using std::max;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The threads of the shared pool, which only block on I/O.
+const unsigned kThreadPoolThreads = 8;
+
+// A queued read or write, |done| bytes of which have been transferred.
+struct Request {
+  int fd;
+  char* buf;
+  size_t count;
+  off64_t offset;
+  bool is_write;
+  size_t done;
+  // The rest of the buffer, as handed to the kernel.
+  struct iovec iov;
+};
+
+Request MakeRequest(int fd, char* buf, size_t count, off64_t offset,
+                    bool is_write) {
+  Request request;
+  request.fd = fd;
+  request.buf = buf;
+  request.count = count;
+  request.offset = offset;
+  request.is_write = is_write;
+  request.done = 0;
+  return request;
+}
+
+#if defined(HAVE_IO_URING)
+
+class UringBlockIo : public BlockIo {
+ public:
+  UringBlockIo()
+      : ring_fd_(-1),
+        sq_ring_(MAP_FAILED),
+        sq_ring_size_(0),
+        cq_ring_(MAP_FAILED),
+        cq_ring_size_(0),
+        sqes_(NULL),
+        sqes_size_(0),
+        sq_entries_(0),
+        in_flight_(0),
+        failed_(false) {}
+
+  virtual ~UringBlockIo() {
+    if (!requests_.empty())
+      Wait();
+    if (sqes_)
+      munmap(sqes_, sqes_size_);
+    if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_)
+      munmap(cq_ring_, cq_ring_size_);
+    if (sq_ring_ != MAP_FAILED)
+      munmap(sq_ring_, sq_ring_size_);
+    if (ring_fd_ >= 0)
+      close(ring_fd_);
+  }
+
+  // Sets up a ring of |entries| entries. Returns true on success.
+  bool Init(unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring_fd_ = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring_fd_ < 0)
+      return false;
+    sq_entries_ = params.sq_entries;
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = false;
+#if defined(IORING_FEAT_SINGLE_MMAP)
+    single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+#endif
+    if (single_mmap)
+      sq_ring_size_ = cq_ring_size_ = max(sq_ring_size_, cq_ring_size_);
+    sq_ring_ = mmap(NULL, sq_ring_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+    TEST_AND_RETURN_FALSE_ERRNO(sq_ring_ != MAP_FAILED);
+    if (single_mmap) {
+      cq_ring_ = sq_ring_;
+    } else {
+      cq_ring_ = mmap(NULL, cq_ring_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+      TEST_AND_RETURN_FALSE_ERRNO(cq_ring_ != MAP_FAILED);
+    }
+    sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+    void* sqes = mmap(NULL, sqes_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+    TEST_AND_RETURN_FALSE_ERRNO(sqes != MAP_FAILED);
+    sqes_ = static_cast<struct io_uring_sqe*>(sqes);
+
+    char* sq = static_cast<char*>(sq_ring_);
+    sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    char* cq = static_cast<char*>(cq_ring_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+    return true;
+  }
+
+  virtual void AddRead(int fd, void* buf, size_t count, off64_t offset) {
+    // The other engine's requests are recorded by utils::PReadAll().
+    IoRecorder::RecordRead(fd, offset, count);
+    Add(MakeRequest(fd, static_cast<char*>(buf), count, offset, false));
+  }
+
+  virtual void AddWrite(int fd,
+                        const void* buf,
+                        size_t count,
+                        off64_t offset) {
+    IoRecorder::RecordWrite(fd, offset, count);
+    Add(MakeRequest(fd, static_cast<char*>(const_cast<void*>(buf)), count,
+                    offset, true));
+  }
+
+  virtual void Submit() {
+    unsigned tail = *sq_tail_;
+    const unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    // Keeping no more requests in flight than the submission queue holds
+    // keeps the completion queue, which is twice as large, from overflowing.
+    while (!queued_.empty() && in_flight_ < sq_entries_ &&
+           tail - head < sq_entries_) {
+      const size_t index = queued_.front();
+      queued_.pop_front();
+      Request& request = requests_[index];
+      request.iov.iov_base = request.buf + request.done;
+      request.iov.iov_len = request.count - request.done;
+      const unsigned slot = tail & sq_mask_;
+      struct io_uring_sqe* sqe = &sqes_[slot];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = request.is_write ? IORING_OP_WRITEV : IORING_OP_READV;
+      sqe->fd = request.fd;
+      sqe->off = request.offset + request.done;
+      sqe->addr = reinterpret_cast<uintptr_t>(&request.iov);
+      sqe->len = 1;
+      sqe->user_data = index;
+      sq_array_[slot] = slot;
+      tail++;
+      in_flight_++;
+    }
+    __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+    Enter(0, 0);
+  }
+
+  virtual bool Wait() {
+    Submit();
+    while (in_flight_ > 0) {
+      if (Reap() == 0)
+        Enter(1, IORING_ENTER_GETEVENTS);
+      // Short transfers are queued again for the rest.
+      Submit();
+    }
+    const bool success = !failed_;
+    requests_.clear();
+    failed_ = false;
+    return success;
+  }
+
+  virtual size_t num_pending() const { return requests_.size(); }
+
+ private:
+  void Add(const Request& request) {
+    if (request.count == 0)
+      return;
+    queued_.push_back(requests_.size());
+    requests_.push_back(request);
+  }
+
+  // Submits the entries the kernel hasn't consumed yet and waits for
+  // |min_complete| completions.
+  void Enter(unsigned min_complete, unsigned flags) {
+    while (true) {
+      const unsigned to_submit =
+          *sq_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+      if (to_submit == 0 && min_complete == 0)
+        return;
+      if (syscall(__NR_io_uring_enter, ring_fd_, to_submit, min_complete,
+                  flags, NULL, 0) >= 0)
+        return;
+      // The kernel may still be writing to the buffers of the requests in
+      // flight, so they can't be given up on.
+      PCHECK(errno == EINTR || errno == EAGAIN || errno == EBUSY)
+          << "io_uring_enter failed";
+      if (errno != EINTR && Reap() > 0)
+        return;
+    }
+  }
+
+  // Accounts for the completed requests. Returns how many there were.
+  unsigned Reap() {
+    unsigned head = *cq_head_;
+    const unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    unsigned reaped = 0;
+    for (; head != tail; head++, reaped++) {
+      const struct io_uring_cqe& cqe = cqes_[head & cq_mask_];
+      const size_t index = cqe.user_data;
+      Request& request = requests_[index];
+      in_flight_--;
+      if (cqe.res == -EINTR || cqe.res == -EAGAIN) {
+        queued_.push_back(index);
+      } else if (cqe.res < 0) {
+        errno = -cqe.res;
+        PLOG(ERROR) << "Unable to " << (request.is_write ? "write" : "read")
+                    << " " << request.count << " bytes at "
+                    << request.offset;
+        failed_ = true;
+      } else if (cqe.res == 0) {
+        LOG(ERROR) << "Unable to " << (request.is_write ? "write" : "read")
+                   << " past " << request.offset + request.done;
+        failed_ = true;
+      } else {
+        request.done += cqe.res;
+        if (request.done < request.count)
+          queued_.push_back(index);
+      }
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    return reaped;
+  }
+
+  int ring_fd_;
+  void* sq_ring_;
+  size_t sq_ring_size_;
+  void* cq_ring_;
+  size_t cq_ring_size_;
+  struct io_uring_sqe* sqes_;
+  size_t sqes_size_;
+
+  // The rings, shared with the kernel.
+  unsigned sq_entries_;
+  unsigned* sq_head_;
+  unsigned* sq_tail_;
+  unsigned sq_mask_;
+  unsigned* sq_array_;
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned cq_mask_;
+  struct io_uring_cqe* cqes_;
+
+  // The requests since the last Wait(), which the kernel refers to by
+  // index. A deque, so that their iovecs don't move as requests are added.
+  deque<Request> requests_;
+  // The requests, or the rest of them, waiting to be submitted.
+  deque<size_t> queued_;
+  unsigned in_flight_;
+  bool failed_;
+
+  DISALLOW_COPY_AND_ASSIGN(UringBlockIo);
+};
+
+#endif  // HAVE_IO_URING
+
+class BlockIoTask : public ThreadPoolTask {
+ public:
+  explicit BlockIoTask(const Request& request) : request_(request) {}
+
+  virtual bool Run() {
+    if (request_.is_write) {
+      return utils::PWriteAll(request_.fd, request_.buf, request_.count,
+                              request_.offset);
+    }
+    ssize_t bytes_read = 0;
+    return utils::PReadAll(request_.fd, request_.buf, request_.count,
+                           request_.offset, &bytes_read) &&
+        bytes_read == static_cast<ssize_t>(request_.count);
+  }
+
+ private:
+  Request request_;
+
+  DISALLOW_COPY_AND_ASSIGN(BlockIoTask);
+};
+
+// Returns the pool shared by the thread pool engines of all threads, started
+// on first use, or NULL if it couldn't be started.
+ThreadPool* GetSharedThreadPool() {
+  static GMutex mutex;
+  static ThreadPool* pool = NULL;
+  static bool tried = false;
+  g_mutex_lock(&mutex);
+  if (!tried) {
+    tried = true;
+    pool = new ThreadPool(kThreadPoolThreads);
+    if (!pool->Init()) {
+      LOG(ERROR) << "Unable to start the block I/O threads.";
+      delete pool;
+      pool = NULL;
+    }
+  }
+  g_mutex_unlock(&mutex);
+  return pool;
+}
+
+class ThreadPoolBlockIo : public BlockIo {
+ public:
+  explicit ThreadPoolBlockIo(ThreadPool* pool)
+      : pool_(pool), num_submitted_(0) {}
+
+  virtual ~ThreadPoolBlockIo() {
+    if (!tasks_.empty())
+      Wait();
+  }
+
+  virtual void AddRead(int fd, void* buf, size_t count, off64_t offset) {
+    tasks_.push_back(new BlockIoTask(
+        MakeRequest(fd, static_cast<char*>(buf), count, offset, false)));
+  }
+
+  virtual void AddWrite(int fd,
+                        const void* buf,
+                        size_t count,
+                        off64_t offset) {
+    tasks_.push_back(new BlockIoTask(
+        MakeRequest(fd, static_cast<char*>(const_cast<void*>(buf)), count,
+                    offset, true)));
+  }
+
+  virtual void Submit() {
+    for (; num_submitted_ < tasks_.size(); num_submitted_++)
+      pool_->Submit(tasks_[num_submitted_]);
+  }
+
+  virtual bool Wait() {
+    Submit();
+    bool success = true;
+    for (size_t i = 0; i < tasks_.size(); i++) {
+      success = pool_->Wait(tasks_[i]) && success;
+      delete tasks_[i];
+    }
+    tasks_.clear();
+    num_submitted_ = 0;
+    return success;
+  }
+
+  virtual size_t num_pending() const { return tasks_.size(); }
+
+ private:
+  ThreadPool* pool_;
+  vector<BlockIoTask*> tasks_;
+  // The first |num_submitted_| tasks have been handed to |pool_|.
+  size_t num_submitted_;
+
+  DISALLOW_COPY_AND_ASSIGN(ThreadPoolBlockIo);
+};
+
+// The engine of a thread, or NULL if none could be set up.
+struct ThreadBlockIo {
+  scoped_ptr<BlockIo> io;
+};
+
+void DestroyThreadBlockIo(gpointer data) {
+  delete static_cast<ThreadBlockIo*>(data);
+}
+
+GPrivate thread_block_io = G_PRIVATE_INIT(DestroyThreadBlockIo);
+
+}  // namespace {}
+
+BlockIo* BlockIo::ForCurrentThread() {
+  ThreadBlockIo* thread_io =
+      static_cast<ThreadBlockIo*>(g_private_get(&thread_block_io));
+  if (!thread_io) {
+    thread_io = new ThreadBlockIo;
+    thread_io->io.reset(CreateUring());
+    if (!thread_io->io.get())
+      thread_io->io.reset(CreateThreadPool());
+    g_private_set(&thread_block_io, thread_io);
+  }
+  return thread_io->io.get();
+}
+
+BlockIo* BlockIo::CreateUring() {
+#if defined(HAVE_IO_URING)
+  scoped_ptr<UringBlockIo> io(new UringBlockIo);
+  if (io->Init(kQueueDepth))
+    return io.release();
+  static bool logged = false;
+  if (!logged) {
+    PLOG(INFO) << "io_uring is unavailable, doing block I/O on threads";
+    logged = true;
+  }
+#endif  // HAVE_IO_URING
+  return NULL;
+}
+
+BlockIo* BlockIo::CreateThreadPool() {
+  ThreadPool* pool = GetSharedThreadPool();
+  return pool ? new ThreadPoolBlockIo(pool) : NULL;
+}
+
+}  // namespace chromeos_update_engine
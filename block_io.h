@@ -0,0 +1,68 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_BLOCK_IO_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_BLOCK_IO_H__
+
+#include <sys/types.h>
+
+#include <base/basictypes.h>
+
+// Positioned reads and writes that are queued, submitted in batches and
+// waited for together, so that a single thread keeps many requests in
+// flight, e.g., the O_DIRECT writes of an operation on an NVMe drive or the
+// reads of the extents of a MOVE. There are two engines: one on io_uring,
+// which submits and reaps a whole batch in a couple of system calls, and
+// one that runs each request with a blocking call on a shared thread pool,
+// for the kernels without io_uring or where it's disabled.
+//
+// An engine is used by one thread at a time. The buffers of the requests
+// must stay valid until Wait() returns.
+
+namespace chromeos_update_engine {
+
+class BlockIo {
+ public:
+  // How many requests the io_uring engine has in flight at most.
+  static const unsigned kQueueDepth = 64;
+
+  virtual ~BlockIo() {}
+
+  // Queues a read of |count| bytes at |offset| in |fd| into |buf|.
+  virtual void AddRead(int fd, void* buf, size_t count, off64_t offset) = 0;
+
+  // Queues a write of the |count| bytes at |buf| at |offset| in |fd|.
+  virtual void AddWrite(int fd,
+                        const void* buf,
+                        size_t count,
+                        off64_t offset) = 0;
+
+  // Starts the queued requests without waiting for them.
+  virtual void Submit() = 0;
+
+  // Submits the queued requests and waits for all the requests added since
+  // the last Wait(). Returns true if all of them transferred all their
+  // bytes; a read past the end of the file fails.
+  virtual bool Wait() = 0;
+
+  // The number of requests added since the last Wait().
+  virtual size_t num_pending() const = 0;
+
+  // Returns the engine of the calling thread, created on first use and
+  // destroyed when the thread exits, or NULL if neither engine could be
+  // set up, in which case the caller should do blocking I/O itself.
+  static BlockIo* ForCurrentThread();
+
+  // Returns a new io_uring engine, or NULL if the kernel doesn't support
+  // io_uring or it's disabled.
+  static BlockIo* CreateUring();
+
+  // Returns a new engine on the shared thread pool, or NULL if the pool
+  // couldn't be started.
+  static BlockIo* CreateThreadPool();
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_BLOCK_IO_H__
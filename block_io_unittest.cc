@@ -0,0 +1,99 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <base/memory/scoped_ptr.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/block_io.h"
+#include "update_engine/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+const size_t kRequestSize = 4096;
+// More requests than the io_uring engine keeps in flight.
+const size_t kNumRequests = BlockIo::kQueueDepth * 3;
+}  // namespace {}
+
+class BlockIoTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    ASSERT_TRUE(utils::MakeTempFile("/tmp/BlockIoTest.XXXXXX", &path_, &fd_));
+  }
+
+  virtual void TearDown() {
+    close(fd_);
+    unlink(path_.c_str());
+  }
+
+  // Writes requests in reverse order and reads them back through |io|.
+  void TestReadWrite(BlockIo* io) {
+    vector<char> data(kRequestSize * kNumRequests);
+    for (size_t i = 0; i < data.size(); i++)
+      data[i] = i * 7 / kRequestSize + i;
+    for (size_t i = kNumRequests; i-- > 0;) {
+      io->AddWrite(fd_, &data[i * kRequestSize], kRequestSize,
+                   i * kRequestSize);
+    }
+    EXPECT_EQ(kNumRequests, io->num_pending());
+    EXPECT_TRUE(io->Wait());
+    EXPECT_EQ(0, io->num_pending());
+
+    vector<char> contents;
+    EXPECT_TRUE(utils::ReadFile(path_, &contents));
+    EXPECT_TRUE(contents == data);
+
+    vector<char> read_data(data.size());
+    for (size_t i = 0; i < kNumRequests; i++) {
+      io->AddRead(fd_, &read_data[i * kRequestSize], kRequestSize,
+                  i * kRequestSize);
+    }
+    EXPECT_TRUE(io->Wait());
+    EXPECT_TRUE(read_data == data);
+
+    // Reading past the end of the file and writing to a bad descriptor fail,
+    // and don't fail the requests that follow.
+    char buf[10];
+    io->AddRead(fd_, buf, sizeof(buf), data.size());
+    EXPECT_FALSE(io->Wait());
+    io->AddWrite(-1, buf, sizeof(buf), 0);
+    EXPECT_FALSE(io->Wait());
+    io->AddRead(fd_, buf, sizeof(buf), 0);
+    EXPECT_TRUE(io->Wait());
+  }
+
+  string path_;
+  int fd_;
+};
+
+TEST_F(BlockIoTest, UringTest) {
+  scoped_ptr<BlockIo> io(BlockIo::CreateUring());
+  if (!io.get()) {
+    LOG(WARNING) << "io_uring is unavailable, skipping.";
+    return;
+  }
+  TestReadWrite(io.get());
+}
+
+TEST_F(BlockIoTest, ThreadPoolTest) {
+  scoped_ptr<BlockIo> io(BlockIo::CreateThreadPool());
+  ASSERT_TRUE(io.get() != NULL);
+  TestReadWrite(io.get());
+}
+
+TEST_F(BlockIoTest, ForCurrentThreadTest) {
+  BlockIo* io = BlockIo::ForCurrentThread();
+  ASSERT_TRUE(io != NULL);
+  EXPECT_EQ(io, BlockIo::ForCurrentThread());
+}
+
+}  // namespace chromeos_update_engine
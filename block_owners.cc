@@ -0,0 +1,122 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/block_owners.h"
+
+#include <algorithm>
+#include <utility>
+
+#include <base/logging.h>
+
+using std::make_pair;
+using std::min;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+bool BlockOwners::SetReader(const Extent& extent,
+                            Vertex::Index vertex,
+                            Vertex::Index* other) {
+  return SetOwner(extent, vertex, &readers_, other);
+}
+
+bool BlockOwners::SetWriter(const Extent& extent,
+                            Vertex::Index vertex,
+                            Vertex::Index* other) {
+  return SetOwner(extent, vertex, &writers_, other);
+}
+
+Vertex::Index BlockOwners::reader(uint64_t block) const {
+  return GetOwner(readers_, block);
+}
+
+Vertex::Index BlockOwners::writer(uint64_t block) const {
+  return GetOwner(writers_, block);
+}
+
+bool BlockOwners::SetOwner(const Extent& extent,
+                           Vertex::Index vertex,
+                           OwnerMap* owners,
+                           Vertex::Index* other) {
+  if (extent.num_blocks() == 0)
+    return true;
+  const uint64_t start = extent.start_block();
+  const uint64_t end = start + extent.num_blocks();
+
+  // Only the last range starting before |end| may overlap the extent.
+  OwnerMap::iterator next = owners->lower_bound(end);
+  OwnerMap::iterator prev = next;
+  if (prev != owners->begin() && (--prev)->second.end > start) {
+    if (other)
+      *other = prev->second.vertex;
+    return false;
+  }
+  if (prev == next)
+    prev = owners->end();
+
+  // Files are mostly contiguous, so merge the extent with the ranges
+  // around it that are owned by the same vertex.
+  uint64_t new_end = end;
+  if (next != owners->end() && next->first == end &&
+      next->second.vertex == vertex) {
+    new_end = next->second.end;
+    owners->erase(next);
+  }
+  if (prev != owners->end() && prev->second.end == start &&
+      prev->second.vertex == vertex) {
+    prev->second.end = new_end;
+  } else {
+    owners->insert(prev == owners->end() ? owners->begin() : prev,
+                   make_pair(start, Owner(new_end, vertex)));
+  }
+  return true;
+}
+
+Vertex::Index BlockOwners::GetOwner(const OwnerMap& owners, uint64_t block) {
+  OwnerMap::const_iterator it = owners.upper_bound(block);
+  if (it == owners.begin() || (--it)->second.end <= block)
+    return Vertex::kInvalidIndex;
+  return it->second.vertex;
+}
+
+vector<BlockOwners::Run> BlockOwners::GetRuns() const {
+  vector<Run> runs;
+  OwnerMap::const_iterator reader_it = readers_.begin();
+  OwnerMap::const_iterator writer_it = writers_.begin();
+  uint64_t block = 0;
+  while (block < block_count_) {
+    Run run;
+    run.start_block = block;
+    run.reader = Vertex::kInvalidIndex;
+    run.writer = Vertex::kInvalidIndex;
+    uint64_t end = block_count_;
+    // The run ends where the reader or the writer changes.
+    while (reader_it != readers_.end() && reader_it->second.end <= block)
+      ++reader_it;
+    if (reader_it != readers_.end()) {
+      if (reader_it->first <= block) {
+        run.reader = reader_it->second.vertex;
+        end = min(end, reader_it->second.end);
+      } else {
+        end = min(end, reader_it->first);
+      }
+    }
+    while (writer_it != writers_.end() && writer_it->second.end <= block)
+      ++writer_it;
+    if (writer_it != writers_.end()) {
+      if (writer_it->first <= block) {
+        run.writer = writer_it->second.vertex;
+        end = min(end, writer_it->second.end);
+      } else {
+        end = min(end, writer_it->first);
+      }
+    }
+    run.num_blocks = end - block;
+    runs.push_back(run);
+    block = end;
+  }
+  return runs;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,82 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_BLOCK_OWNERS_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_BLOCK_OWNERS_H__
+
+#include <map>
+#include <vector>
+
+#include <base/basictypes.h>
+
+#include "update_engine/graph_types.h"
+#include "update_engine/update_metadata.pb.h"
+
+// A BlockOwners object tells which vertex will read and which will write
+// each block of the install partition at install time. The readers and
+// writers are kept as maps from disjoint block ranges to vertexes, so its
+// size depends on the number of extents the operations touch rather than
+// on the size of the partition.
+
+namespace chromeos_update_engine {
+
+class BlockOwners {
+ public:
+  // A maximal run of blocks with the same reader and the same writer.
+  // Either may be Vertex::kInvalidIndex.
+  struct Run {
+    uint64_t start_block;
+    uint64_t num_blocks;
+    Vertex::Index reader;
+    Vertex::Index writer;
+  };
+
+  explicit BlockOwners(uint64_t block_count) : block_count_(block_count) {}
+
+  uint64_t block_count() const { return block_count_; }
+
+  // Records |vertex| as the reader or writer of the blocks of |extent|,
+  // which must be within the partition. If one of them already has one,
+  // returns false and sets |*other|, if it's non-NULL, to it.
+  bool SetReader(const Extent& extent,
+                 Vertex::Index vertex,
+                 Vertex::Index* other);
+  bool SetWriter(const Extent& extent,
+                 Vertex::Index vertex,
+                 Vertex::Index* other);
+
+  // Returns the reader or writer of |block|, or Vertex::kInvalidIndex.
+  Vertex::Index reader(uint64_t block) const;
+  Vertex::Index writer(uint64_t block) const;
+
+  // Returns the runs all the blocks of the partition divide into, in
+  // block order.
+  std::vector<Run> GetRuns() const;
+
+ private:
+  // The blocks [start, end) and their vertex, keyed by start.
+  struct Owner {
+    Owner(uint64_t end_block, Vertex::Index owner)
+        : end(end_block), vertex(owner) {}
+    uint64_t end;
+    Vertex::Index vertex;
+  };
+  typedef std::map<uint64_t, Owner> OwnerMap;
+
+  static bool SetOwner(const Extent& extent,
+                       Vertex::Index vertex,
+                       OwnerMap* owners,
+                       Vertex::Index* other);
+  static Vertex::Index GetOwner(const OwnerMap& owners, uint64_t block);
+
+  const uint64_t block_count_;
+  OwnerMap readers_;
+  OwnerMap writers_;
+
+  DISALLOW_COPY_AND_ASSIGN(BlockOwners);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_BLOCK_OWNERS_H__
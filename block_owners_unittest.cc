@@ -0,0 +1,131 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/block_owners.h"
+#include "update_engine/extent_ranges.h"
+
+using std::min;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class BlockOwnersTest : public ::testing::Test {};
+
+namespace {
+const Vertex::Index kInvalid = Vertex::kInvalidIndex;
+}  // namespace {}
+
+TEST(BlockOwnersTest, SimpleTest) {
+  BlockOwners blocks(10);
+  EXPECT_EQ(10, blocks.block_count());
+  EXPECT_TRUE(blocks.SetReader(ExtentForRange(2, 3), 1, NULL));
+  EXPECT_TRUE(blocks.SetReader(ExtentForRange(5, 1), 1, NULL));
+  EXPECT_TRUE(blocks.SetReader(ExtentForRange(0, 2), 2, NULL));
+  EXPECT_TRUE(blocks.SetWriter(ExtentForRange(4, 4), 2, NULL));
+  EXPECT_TRUE(blocks.SetWriter(ExtentForRange(0, 0), 3, NULL));
+
+  Vertex::Index other = kInvalid;
+  EXPECT_FALSE(blocks.SetReader(ExtentForRange(5, 2), 3, &other));
+  EXPECT_EQ(1, other);
+  EXPECT_FALSE(blocks.SetWriter(ExtentForRange(0, 5), 3, &other));
+  EXPECT_EQ(2, other);
+  EXPECT_TRUE(blocks.SetReader(ExtentForRange(6, 4), 3, NULL));
+
+  const Vertex::Index kReaders[] = { 2, 2, 1, 1, 1, 1, 3, 3, 3, 3 };
+  const Vertex::Index kWriters[] = {
+    kInvalid, kInvalid, kInvalid, kInvalid, 2, 2, 2, 2, kInvalid, kInvalid
+  };
+  for (uint64_t i = 0; i < blocks.block_count(); i++) {
+    EXPECT_EQ(kReaders[i], blocks.reader(i)) << "block " << i;
+    EXPECT_EQ(kWriters[i], blocks.writer(i)) << "block " << i;
+  }
+
+  // Reader 1's extents were merged, so it's one run until the writer
+  // starts.
+  const BlockOwners::Run kRuns[] = {
+    { 0, 2, 2, kInvalid },
+    { 2, 2, 1, kInvalid },
+    { 4, 2, 1, 2 },
+    { 6, 2, 3, 2 },
+    { 8, 2, 3, kInvalid },
+  };
+  vector<BlockOwners::Run> runs = blocks.GetRuns();
+  ASSERT_EQ(arraysize(kRuns), runs.size());
+  for (size_t i = 0; i < runs.size(); i++) {
+    EXPECT_EQ(kRuns[i].start_block, runs[i].start_block) << "run " << i;
+    EXPECT_EQ(kRuns[i].num_blocks, runs[i].num_blocks) << "run " << i;
+    EXPECT_EQ(kRuns[i].reader, runs[i].reader) << "run " << i;
+    EXPECT_EQ(kRuns[i].writer, runs[i].writer) << "run " << i;
+  }
+}
+
+TEST(BlockOwnersTest, EmptyTest) {
+  BlockOwners blocks(5);
+  vector<BlockOwners::Run> runs = blocks.GetRuns();
+  ASSERT_EQ(1, runs.size());
+  EXPECT_EQ(0, runs[0].start_block);
+  EXPECT_EQ(5, runs[0].num_blocks);
+  EXPECT_EQ(kInvalid, runs[0].reader);
+  EXPECT_EQ(kInvalid, runs[0].writer);
+  EXPECT_TRUE(BlockOwners(0).GetRuns().empty());
+}
+
+TEST(BlockOwnersTest, RandomExtentsTest) {
+  // Checks the owners against ones kept per block.
+  const uint64_t kBlockCount = 300;
+  srand(0);
+  BlockOwners blocks(kBlockCount);
+  vector<Vertex::Index> readers(kBlockCount, kInvalid);
+  vector<Vertex::Index> writers(kBlockCount, kInvalid);
+  for (int i = 0; i < 500; i++) {
+    const bool reader = rand() % 2;
+    const Vertex::Index vertex = rand() % 4;
+    const uint64_t start = rand() % kBlockCount;
+    const uint64_t num_blocks = rand() % min<uint64_t>(kBlockCount - start, 8);
+    vector<Vertex::Index>* owners = reader ? &readers : &writers;
+    bool unowned = true;
+    for (uint64_t block = start; block < start + num_blocks; block++)
+      unowned = unowned && (*owners)[block] == kInvalid;
+    Vertex::Index other = kInvalid;
+    EXPECT_EQ(unowned,
+              reader ?
+              blocks.SetReader(ExtentForRange(start, num_blocks), vertex,
+                               &other) :
+              blocks.SetWriter(ExtentForRange(start, num_blocks), vertex,
+                               &other));
+    if (unowned) {
+      for (uint64_t block = start; block < start + num_blocks; block++)
+        (*owners)[block] = vertex;
+    } else {
+      EXPECT_NE(kInvalid, other);
+    }
+  }
+
+  vector<BlockOwners::Run> runs = blocks.GetRuns();
+  uint64_t block = 0;
+  for (size_t i = 0; i < runs.size(); i++) {
+    ASSERT_EQ(block, runs[i].start_block);
+    ASSERT_LT(0, runs[i].num_blocks);
+    for (; block < runs[i].start_block + runs[i].num_blocks; block++) {
+      ASSERT_EQ(readers[block], runs[i].reader);
+      ASSERT_EQ(writers[block], runs[i].writer);
+      EXPECT_EQ(readers[block], blocks.reader(block));
+      EXPECT_EQ(writers[block], blocks.writer(block));
+    }
+    if (i > 0) {
+      EXPECT_TRUE(runs[i].reader != runs[i - 1].reader ||
+                  runs[i].writer != runs[i - 1].writer);
+    }
+  }
+  EXPECT_EQ(kBlockCount, block);
+}
+
+}  // namespace chromeos_update_engine
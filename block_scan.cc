@@ -0,0 +1,381 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/block_scan.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define BLOCK_SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define BLOCK_SCAN_NEON 1
+#include <arm_neon.h>
+#endif
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The hash is computed over stripes of kHashLanes 64-bit words, each word
+// going into the accumulator of its lane, so that the lanes are
+// independent and fit in SIMD registers. A word is mixed with a key that
+// depends on its lane and on the stripe it's in, so that moving data
+// around changes the hash, and accumulated as the product of the two
+// halves of the mixed word, plus the word itself, as the product of two
+// 32-bit numbers is what SSE2, AVX2 and NEON can all multiply. The bytes
+// after the last whole stripe are hashed one by one.
+const size_t kHashLanes = 4;
+const size_t kHashStripeSize = kHashLanes * sizeof(uint64_t);
+const uint64_t kHashLaneKeys[kHashLanes] = {
+  0x243f6a8885a308d3ULL,
+  0x13198a2e03707344ULL,
+  0xa4093822299f31d0ULL,
+  0x082efa98ec4e6c89ULL,
+};
+const uint64_t kHashKeyStep = 0x9e3779b97f4a7c15ULL;
+
+// The finalizer of MurmurHash3, which makes every bit of |x| affect every
+// bit of the result.
+uint64_t Mix64(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb93fe53b34c3ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+// Returns the hash of |size| bytes from the accumulators of their whole
+// stripes and the |tail_size| bytes at |tail| after them.
+uint64_t FinishHash(const uint64_t acc[kHashLanes],
+                    const char* tail,
+                    size_t tail_size,
+                    size_t size) {
+  uint64_t hash = Mix64(size);
+  for (size_t i = 0; i < kHashLanes; i++)
+    hash = Mix64(hash ^ Mix64(acc[i]));
+  // 64-bit FNV-1a.
+  for (size_t i = 0; i < tail_size; i++) {
+    hash ^= static_cast<unsigned char>(tail[i]);
+    hash *= 1099511628211ULL;
+  }
+  return Mix64(hash);
+}
+
+uint64_t LoadWord(const char* data) {
+  uint64_t word;
+  memcpy(&word, data, sizeof(word));
+  return word;
+}
+
+bool ScalarDataEquals(const char* a, const char* b, size_t size) {
+  return memcmp(a, b, size) == 0;
+}
+
+bool ScalarIsZero(const char* data, size_t size) {
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32) {
+    if ((LoadWord(data + i) | LoadWord(data + i + 8) |
+         LoadWord(data + i + 16) | LoadWord(data + i + 24)) != 0)
+      return false;
+  }
+  for (; i < size; i++) {
+    if (data[i] != 0)
+      return false;
+  }
+  return true;
+}
+
+uint64_t ScalarHash(const char* data, size_t size) {
+  uint64_t acc[kHashLanes];
+  uint64_t key[kHashLanes];
+  for (size_t i = 0; i < kHashLanes; i++) {
+    acc[i] = kHashLaneKeys[i];
+    key[i] = kHashLaneKeys[i];
+  }
+  const size_t stripes = size / kHashStripeSize;
+  for (size_t s = 0; s < stripes; s++) {
+    for (size_t i = 0; i < kHashLanes; i++) {
+      const uint64_t word =
+          LoadWord(data + s * kHashStripeSize + i * sizeof(uint64_t));
+      const uint64_t mixed = word ^ key[i];
+      acc[i] += (mixed & 0xffffffffULL) * (mixed >> 32) + word;
+      key[i] += kHashKeyStep;
+    }
+  }
+  const size_t done = stripes * kHashStripeSize;
+  return FinishHash(acc, data + done, size - done, size);
+}
+
+const BlockScanKernels kScalarKernels = {
+  "scalar",
+  ScalarDataEquals,
+  ScalarIsZero,
+  ScalarHash,
+};
+
+#if defined(BLOCK_SCAN_X86)
+
+// Returns true if all the bytes of |v| are zero.
+inline bool Sse2IsZeroVector(__m128i v) {
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) == 0xffff;
+}
+
+inline __m128i Sse2Load(const char* data) {
+  return _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+}
+
+bool Sse2DataEquals(const char* a, const char* b, size_t size) {
+  size_t i = 0;
+  for (; i + 64 <= size; i += 64) {
+    const __m128i diff = _mm_or_si128(
+        _mm_or_si128(_mm_xor_si128(Sse2Load(a + i), Sse2Load(b + i)),
+                     _mm_xor_si128(Sse2Load(a + i + 16),
+                                   Sse2Load(b + i + 16))),
+        _mm_or_si128(_mm_xor_si128(Sse2Load(a + i + 32),
+                                   Sse2Load(b + i + 32)),
+                     _mm_xor_si128(Sse2Load(a + i + 48),
+                                   Sse2Load(b + i + 48))));
+    if (!Sse2IsZeroVector(diff))
+      return false;
+  }
+  return memcmp(a + i, b + i, size - i) == 0;
+}
+
+bool Sse2IsZero(const char* data, size_t size) {
+  size_t i = 0;
+  for (; i + 64 <= size; i += 64) {
+    const __m128i bits = _mm_or_si128(
+        _mm_or_si128(Sse2Load(data + i), Sse2Load(data + i + 16)),
+        _mm_or_si128(Sse2Load(data + i + 32), Sse2Load(data + i + 48)));
+    if (!Sse2IsZeroVector(bits))
+      return false;
+  }
+  return ScalarIsZero(data + i, size - i);
+}
+
+uint64_t Sse2Hash(const char* data, size_t size) {
+  const __m128i step = _mm_set1_epi64x(kHashKeyStep);
+  __m128i key0 = _mm_loadu_si128(
+      reinterpret_cast<const __m128i*>(&kHashLaneKeys[0]));
+  __m128i key1 = _mm_loadu_si128(
+      reinterpret_cast<const __m128i*>(&kHashLaneKeys[2]));
+  __m128i acc0 = key0;
+  __m128i acc1 = key1;
+  const size_t stripes = size / kHashStripeSize;
+  for (size_t s = 0; s < stripes; s++) {
+    const char* stripe = data + s * kHashStripeSize;
+    const __m128i word0 = Sse2Load(stripe);
+    const __m128i word1 = Sse2Load(stripe + 16);
+    const __m128i mixed0 = _mm_xor_si128(word0, key0);
+    const __m128i mixed1 = _mm_xor_si128(word1, key1);
+    acc0 = _mm_add_epi64(acc0, _mm_add_epi64(
+        _mm_mul_epu32(mixed0, _mm_srli_epi64(mixed0, 32)), word0));
+    acc1 = _mm_add_epi64(acc1, _mm_add_epi64(
+        _mm_mul_epu32(mixed1, _mm_srli_epi64(mixed1, 32)), word1));
+    key0 = _mm_add_epi64(key0, step);
+    key1 = _mm_add_epi64(key1, step);
+  }
+  uint64_t acc[kHashLanes];
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(&acc[0]), acc0);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(&acc[2]), acc1);
+  const size_t done = stripes * kHashStripeSize;
+  return FinishHash(acc, data + done, size - done, size);
+}
+
+const BlockScanKernels kSse2Kernels = {
+  "sse2",
+  Sse2DataEquals,
+  Sse2IsZero,
+  Sse2Hash,
+};
+
+#define BLOCK_SCAN_AVX2 __attribute__((target("avx2")))
+
+BLOCK_SCAN_AVX2 inline __m256i Avx2Load(const char* data) {
+  return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+}
+
+BLOCK_SCAN_AVX2 bool Avx2DataEquals(const char* a, const char* b,
+                                    size_t size) {
+  size_t i = 0;
+  for (; i + 128 <= size; i += 128) {
+    const __m256i diff = _mm256_or_si256(
+        _mm256_or_si256(_mm256_xor_si256(Avx2Load(a + i), Avx2Load(b + i)),
+                        _mm256_xor_si256(Avx2Load(a + i + 32),
+                                         Avx2Load(b + i + 32))),
+        _mm256_or_si256(_mm256_xor_si256(Avx2Load(a + i + 64),
+                                         Avx2Load(b + i + 64)),
+                        _mm256_xor_si256(Avx2Load(a + i + 96),
+                                         Avx2Load(b + i + 96))));
+    if (!_mm256_testz_si256(diff, diff))
+      return false;
+  }
+  for (; i + 32 <= size; i += 32) {
+    const __m256i diff = _mm256_xor_si256(Avx2Load(a + i), Avx2Load(b + i));
+    if (!_mm256_testz_si256(diff, diff))
+      return false;
+  }
+  return memcmp(a + i, b + i, size - i) == 0;
+}
+
+BLOCK_SCAN_AVX2 bool Avx2IsZero(const char* data, size_t size) {
+  size_t i = 0;
+  for (; i + 128 <= size; i += 128) {
+    const __m256i bits = _mm256_or_si256(
+        _mm256_or_si256(Avx2Load(data + i), Avx2Load(data + i + 32)),
+        _mm256_or_si256(Avx2Load(data + i + 64), Avx2Load(data + i + 96)));
+    if (!_mm256_testz_si256(bits, bits))
+      return false;
+  }
+  for (; i + 32 <= size; i += 32) {
+    const __m256i bits = Avx2Load(data + i);
+    if (!_mm256_testz_si256(bits, bits))
+      return false;
+  }
+  return ScalarIsZero(data + i, size - i);
+}
+
+BLOCK_SCAN_AVX2 uint64_t Avx2Hash(const char* data, size_t size) {
+  const __m256i step = _mm256_set1_epi64x(kHashKeyStep);
+  __m256i key = _mm256_loadu_si256(
+      reinterpret_cast<const __m256i*>(kHashLaneKeys));
+  __m256i acc = key;
+  const size_t stripes = size / kHashStripeSize;
+  for (size_t s = 0; s < stripes; s++) {
+    const __m256i word = Avx2Load(data + s * kHashStripeSize);
+    const __m256i mixed = _mm256_xor_si256(word, key);
+    acc = _mm256_add_epi64(acc, _mm256_add_epi64(
+        _mm256_mul_epu32(mixed, _mm256_srli_epi64(mixed, 32)), word));
+    key = _mm256_add_epi64(key, step);
+  }
+  uint64_t lanes[kHashLanes];
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), acc);
+  const size_t done = stripes * kHashStripeSize;
+  return FinishHash(lanes, data + done, size - done, size);
+}
+
+const BlockScanKernels kAvx2Kernels = {
+  "avx2",
+  Avx2DataEquals,
+  Avx2IsZero,
+  Avx2Hash,
+};
+
+bool CpuHasAvx2() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+
+#endif  // defined(BLOCK_SCAN_X86)
+
+#if defined(BLOCK_SCAN_NEON)
+
+inline uint8x16_t NeonLoad(const char* data) {
+  return vld1q_u8(reinterpret_cast<const uint8_t*>(data));
+}
+
+// Returns true if all the bytes of |v| are zero.
+inline bool NeonIsZeroVector(uint8x16_t v) {
+  const uint64x2_t words = vreinterpretq_u64_u8(v);
+  return (vgetq_lane_u64(words, 0) | vgetq_lane_u64(words, 1)) == 0;
+}
+
+bool NeonDataEquals(const char* a, const char* b, size_t size) {
+  size_t i = 0;
+  for (; i + 64 <= size; i += 64) {
+    const uint8x16_t diff = vorrq_u8(
+        vorrq_u8(veorq_u8(NeonLoad(a + i), NeonLoad(b + i)),
+                 veorq_u8(NeonLoad(a + i + 16), NeonLoad(b + i + 16))),
+        vorrq_u8(veorq_u8(NeonLoad(a + i + 32), NeonLoad(b + i + 32)),
+                 veorq_u8(NeonLoad(a + i + 48), NeonLoad(b + i + 48))));
+    if (!NeonIsZeroVector(diff))
+      return false;
+  }
+  return memcmp(a + i, b + i, size - i) == 0;
+}
+
+bool NeonIsZero(const char* data, size_t size) {
+  size_t i = 0;
+  for (; i + 64 <= size; i += 64) {
+    const uint8x16_t bits = vorrq_u8(
+        vorrq_u8(NeonLoad(data + i), NeonLoad(data + i + 16)),
+        vorrq_u8(NeonLoad(data + i + 32), NeonLoad(data + i + 48)));
+    if (!NeonIsZeroVector(bits))
+      return false;
+  }
+  return ScalarIsZero(data + i, size - i);
+}
+
+uint64_t NeonHash(const char* data, size_t size) {
+  const uint64x2_t step = vdupq_n_u64(kHashKeyStep);
+  uint64x2_t key0 = vld1q_u64(&kHashLaneKeys[0]);
+  uint64x2_t key1 = vld1q_u64(&kHashLaneKeys[2]);
+  uint64x2_t acc0 = key0;
+  uint64x2_t acc1 = key1;
+  const size_t stripes = size / kHashStripeSize;
+  for (size_t s = 0; s < stripes; s++) {
+    const char* stripe = data + s * kHashStripeSize;
+    const uint64x2_t word0 = vreinterpretq_u64_u8(NeonLoad(stripe));
+    const uint64x2_t word1 = vreinterpretq_u64_u8(NeonLoad(stripe + 16));
+    const uint64x2_t mixed0 = veorq_u64(word0, key0);
+    const uint64x2_t mixed1 = veorq_u64(word1, key1);
+    acc0 = vmlal_u32(vaddq_u64(acc0, word0), vmovn_u64(mixed0),
+                     vshrn_n_u64(mixed0, 32));
+    acc1 = vmlal_u32(vaddq_u64(acc1, word1), vmovn_u64(mixed1),
+                     vshrn_n_u64(mixed1, 32));
+    key0 = vaddq_u64(key0, step);
+    key1 = vaddq_u64(key1, step);
+  }
+  uint64_t acc[kHashLanes];
+  vst1q_u64(&acc[0], acc0);
+  vst1q_u64(&acc[2], acc1);
+  const size_t done = stripes * kHashStripeSize;
+  return FinishHash(acc, data + done, size - done, size);
+}
+
+const BlockScanKernels kNeonKernels = {
+  "neon",
+  NeonDataEquals,
+  NeonIsZero,
+  NeonHash,
+};
+
+#endif  // defined(BLOCK_SCAN_NEON)
+
+}  // namespace {}
+
+namespace block_scan {
+
+const BlockScanKernels& ScalarKernels() {
+  return kScalarKernels;
+}
+
+const BlockScanKernels& BestKernels() {
+  static const BlockScanKernels* best = SupportedKernels().back();
+  return *best;
+}
+
+vector<const BlockScanKernels*> SupportedKernels() {
+  vector<const BlockScanKernels*> kernels;
+  kernels.push_back(&kScalarKernels);
+#if defined(BLOCK_SCAN_X86)
+  kernels.push_back(&kSse2Kernels);
+  if (CpuHasAvx2())
+    kernels.push_back(&kAvx2Kernels);
+#endif
+#if defined(BLOCK_SCAN_NEON)
+  kernels.push_back(&kNeonKernels);
+#endif
+  return kernels;
+}
+
+}  // namespace block_scan
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,62 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_BLOCK_SCAN_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_BLOCK_SCAN_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+// The kernels the payload generator runs over every byte of the images:
+// comparing data, looking for zero blocks and hashing blocks to find them
+// by their contents. Each has a scalar version and SSE2, AVX2 or NEON
+// versions for the CPUs that have them. All the versions of a kernel give
+// the same results, so the fastest one the CPU supports is used.
+
+namespace chromeos_update_engine {
+
+struct BlockScanKernels {
+  const char* name;
+
+  // Returns true if the |size| bytes at |a| and |b| are the same.
+  bool (*data_equals)(const char* a, const char* b, size_t size);
+
+  // Returns true if the |size| bytes at |data| are all zero.
+  bool (*is_zero)(const char* data, size_t size);
+
+  // Returns a 64-bit hash of the |size| bytes at |data|. It isn't
+  // cryptographic, so the data with the same hash must still be compared.
+  uint64_t (*hash)(const char* data, size_t size);
+};
+
+namespace block_scan {
+
+// The scalar kernels, which all CPUs support.
+const BlockScanKernels& ScalarKernels();
+
+// The fastest kernels this CPU supports.
+const BlockScanKernels& BestKernels();
+
+// All the kernels this CPU supports, the scalar ones first.
+std::vector<const BlockScanKernels*> SupportedKernels();
+
+inline bool DataEquals(const char* a, const char* b, size_t size) {
+  return BestKernels().data_equals(a, b, size);
+}
+
+inline bool IsZeroData(const char* data, size_t size) {
+  return BestKernels().is_zero(data, size);
+}
+
+inline uint64_t HashData(const char* data, size_t size) {
+  return BestKernels().hash(data, size);
+}
+
+}  // namespace block_scan
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_BLOCK_SCAN_H__
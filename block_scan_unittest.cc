@@ -0,0 +1,103 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stdlib.h>
+
+#include <vector>
+
+#include <base/basictypes.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/block_scan.h"
+#include "update_engine/test_utils.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Sizes around the widths the kernels work in.
+const size_t kSizes[] = { 0, 1, 7, 8, 31, 32, 33, 63, 64, 65, 127, 128, 129,
+                          300, 4096 };
+
+}  // namespace {}
+
+class BlockScanTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    srandom(1);
+    kernels_ = block_scan::SupportedKernels();
+    ASSERT_FALSE(kernels_.empty());
+    EXPECT_EQ(&block_scan::ScalarKernels(), kernels_.front());
+    EXPECT_EQ(&block_scan::BestKernels(), kernels_.back());
+  }
+
+  vector<const BlockScanKernels*> kernels_;
+};
+
+TEST_F(BlockScanTest, DataEqualsTest) {
+  for (size_t s = 0; s < arraysize(kSizes); s++) {
+    const size_t size = kSizes[s];
+    // The data starts one byte in, so that it isn't aligned.
+    vector<char> a = RandomData(size + 1);
+    vector<char> b = a;
+    for (size_t k = 0; k < kernels_.size(); k++) {
+      SCOPED_TRACE(kernels_[k]->name);
+      EXPECT_TRUE(kernels_[k]->data_equals(&a[1], &b[1], size)) << size;
+      for (size_t i = 0; i < size; i++) {
+        b[i + 1] ^= 0x80;
+        EXPECT_FALSE(kernels_[k]->data_equals(&a[1], &b[1], size))
+            << size << " " << i;
+        b[i + 1] ^= 0x80;
+      }
+    }
+  }
+}
+
+TEST_F(BlockScanTest, IsZeroTest) {
+  for (size_t s = 0; s < arraysize(kSizes); s++) {
+    const size_t size = kSizes[s];
+    vector<char> data(size + 1, 0);
+    for (size_t k = 0; k < kernels_.size(); k++) {
+      SCOPED_TRACE(kernels_[k]->name);
+      EXPECT_TRUE(kernels_[k]->is_zero(&data[1], size)) << size;
+      for (size_t i = 0; i < size; i++) {
+        data[i + 1] = 1;
+        EXPECT_FALSE(kernels_[k]->is_zero(&data[1], size))
+            << size << " " << i;
+        data[i + 1] = 0;
+      }
+    }
+  }
+}
+
+TEST_F(BlockScanTest, HashTest) {
+  for (size_t s = 0; s < arraysize(kSizes); s++) {
+    const size_t size = kSizes[s];
+    vector<char> data = RandomData(size + 1);
+    const uint64_t hash = block_scan::ScalarKernels().hash(&data[1], size);
+    for (size_t k = 0; k < kernels_.size(); k++) {
+      SCOPED_TRACE(kernels_[k]->name);
+      EXPECT_EQ(hash, kernels_[k]->hash(&data[1], size)) << size;
+      for (size_t i = 0; i < size; i++) {
+        data[i + 1] ^= 1;
+        EXPECT_NE(hash, kernels_[k]->hash(&data[1], size))
+            << size << " " << i;
+        data[i + 1] ^= 1;
+      }
+    }
+  }
+  // The same data in another order, or zero-extended, hashes differently.
+  vector<char> data = RandomData(64);
+  vector<char> swapped(data.begin() + 32, data.end());
+  swapped.insert(swapped.end(), data.begin(), data.begin() + 32);
+  EXPECT_NE(block_scan::HashData(&data[0], data.size()),
+            block_scan::HashData(&swapped[0], swapped.size()));
+  vector<char> zeros(64, 0);
+  EXPECT_NE(block_scan::HashData(&zeros[0], 32),
+            block_scan::HashData(&zeros[0], 64));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,516 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// The diffing algorithm is the one from Colin Percival's bsdiff 4.3, which
+// is distributed under a 2-clause BSD license.
+
+#include "update_engine/bsdiff.h"
+
+#include <bzlib.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+#include <base/string_number_conversions.h>
+
+#include "update_engine/bzip.h"
+#include "update_engine/omaha_hash_calculator.h"
+#include "update_engine/utils.h"
+
+using std::min;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+const char kBsdiffMagic[] = "BSDIFF40";
+const size_t kBsdiffMagicSize = 8;
+
+// Returns true if the suffix at |i| is an LMS suffix: an S-type suffix,
+// smaller than the one after it, right after an L-type one.
+inline bool IsLms(const vector<bool>& stype, size_t i) {
+  return i > 0 && stype[i] && !stype[i - 1];
+}
+
+// Sets |buckets| to the start, or the end if |ends|, of the range of the
+// suffix array that the suffixes starting with each of the |k| symbols take.
+template <typename Symbol, typename Index>
+void FillBuckets(const Symbol* s, Index n, Index k, bool ends,
+                 vector<Index>* buckets) {
+  buckets->assign(k, 0);
+  for (Index i = 0; i < n; i++)
+    (*buckets)[s[i]]++;
+  Index sum = 0;
+  for (Index c = 0; c < k; c++) {
+    sum += (*buckets)[c];
+    (*buckets)[c] = ends ? sum : sum - (*buckets)[c];
+  }
+}
+
+// Sorts the L-type suffixes, then the S-type ones, by inducing from the LMS
+// suffixes at the ends of their buckets in |sa|. The sentinel comes first,
+// and the last suffix right after it.
+template <typename Symbol, typename Index>
+void InduceSort(const Symbol* s, Index* sa, Index n, Index k,
+                const vector<bool>& stype, vector<Index>* buckets) {
+  const Index kEmpty = ~static_cast<Index>(0);
+  FillBuckets(s, n, k, false, buckets);
+  sa[(*buckets)[s[n - 1]]++] = n - 1;
+  for (Index i = 0; i < n; i++) {
+    const Index j = sa[i];
+    if (j != kEmpty && j > 0 && !stype[j - 1])
+      sa[(*buckets)[s[j - 1]]++] = j - 1;
+  }
+  FillBuckets(s, n, k, true, buckets);
+  for (Index i = n; i-- > 0;) {
+    const Index j = sa[i];
+    if (j != kEmpty && j > 0 && stype[j - 1])
+      sa[--(*buckets)[s[j - 1]]] = j - 1;
+  }
+}
+
+// Sorts the suffixes of the |n| symbols at |s|, each below |k|, into the |n|
+// entries at |sa|, with SA-IS: Nong, Zhang and Chan, "Two Efficient
+// Algorithms for Linear Time Suffix Array Construction". The end of |s| is
+// taken to be a sentinel smaller than any symbol, which isn't stored. The
+// reduced problem of the recursion is kept in |sa| itself, so only the
+// types of the suffixes and the buckets of a level are allocated besides.
+// |Index| must hold values above |n|.
+template <typename Symbol, typename Index>
+void SortSuffixes(const Symbol* s, Index* sa, Index n, Index k) {
+  if (n == 0)
+    return;
+  if (n == 1) {
+    sa[0] = 0;
+    return;
+  }
+  const Index kEmpty = ~static_cast<Index>(0);
+
+  // The last suffix is L-type, since the sentinel is smaller.
+  vector<bool> stype(n, false);
+  for (Index i = n - 1; i-- > 0;)
+    stype[i] = s[i] < s[i + 1] || (s[i] == s[i + 1] && stype[i + 1]);
+
+  // Sorts the LMS substrings, from an LMS suffix up to the next one, by
+  // inducing from the LMS suffixes in any order.
+  vector<Index> buckets;
+  std::fill(sa, sa + n, kEmpty);
+  FillBuckets(s, n, k, true, &buckets);
+  for (Index i = 1; i < n; i++) {
+    if (IsLms(stype, i))
+      sa[--buckets[s[i]]] = i;
+  }
+  InduceSort(s, sa, n, k, stype, &buckets);
+  vector<Index>().swap(buckets);
+
+  // Names the LMS substrings by their rank, equal substrings alike. At most
+  // every other suffix is LMS, so the names fit in the second half of |sa|,
+  // indexed by half the offset of the substring.
+  Index m = 0;
+  for (Index i = 0; i < n; i++) {
+    if (IsLms(stype, sa[i]))
+      sa[m++] = sa[i];
+  }
+  std::fill(sa + m, sa + n, kEmpty);
+  Index names = 0;
+  Index previous = kEmpty;
+  for (Index i = 0; i < m; i++) {
+    const Index p = sa[i];
+    const Index q = previous;
+    bool equal = q != kEmpty;
+    for (Index d = 0; equal; d++) {
+      if (p + d == n || q + d == n || s[p + d] != s[q + d] ||
+          stype[p + d] != stype[q + d]) {
+        equal = false;
+      } else if (d > 0 && (IsLms(stype, p + d) || IsLms(stype, q + d))) {
+        break;
+      }
+    }
+    if (!equal)
+      names++;
+    previous = p;
+    sa[m + p / 2] = names - 1;
+  }
+
+  // Sorts the LMS suffixes by sorting the suffixes of the string of their
+  // names, in the order of their offsets, which is moved to the end of |sa|.
+  Index* reduced = sa + n - m;
+  for (Index i = n, j = n; i-- > m;) {
+    if (sa[i] != kEmpty)
+      sa[--j] = sa[i];
+  }
+  if (names < m) {
+    SortSuffixes(reduced, sa, m, names);
+  } else {
+    for (Index i = 0; i < m; i++)
+      sa[reduced[i]] = i;
+  }
+  for (Index i = n, j = m; i-- > 1;) {
+    if (IsLms(stype, i))
+      reduced[--j] = i;
+  }
+  for (Index i = 0; i < m; i++)
+    sa[i] = reduced[sa[i]];
+
+  // Sorts all the suffixes by inducing from the sorted LMS suffixes, placed
+  // at the ends of their buckets in order.
+  std::fill(sa + m, sa + n, kEmpty);
+  FillBuckets(s, n, k, true, &buckets);
+  for (Index i = m; i-- > 0;) {
+    const Index j = sa[i];
+    sa[i] = kEmpty;
+    sa[--buckets[s[j]]] = j;
+  }
+  InduceSort(s, sa, n, k, stype, &buckets);
+}
+
+// Builds the suffix array of the |size| bytes at |data| into |sa|, which
+// has room for |size| + 1 offsets, the empty suffix first.
+template <typename Index>
+void BuildOffsets(const char* data, size_t size, Index* sa) {
+  sa[0] = size;
+  SortSuffixes(reinterpret_cast<const unsigned char*>(data), sa + 1,
+               static_cast<Index>(size), static_cast<Index>(256));
+}
+
+int64_t MatchLen(const unsigned char* old, int64_t old_size,
+                 const unsigned char* new_data, int64_t new_size) {
+  int64_t i;
+  for (i = 0; i < old_size && i < new_size; i++) {
+    if (old[i] != new_data[i])
+      break;
+  }
+  return i;
+}
+
+// Binary searches the suffix array |I| for the longest match of |new_data|
+// in |old|. Returns the match length and sets |pos| to its offset in |old|.
+template <typename Index>
+int64_t Search(const Index* I,
+               const unsigned char* old, int64_t old_size,
+               const unsigned char* new_data, int64_t new_size,
+               int64_t st, int64_t en, int64_t* pos) {
+  while (en - st >= 2) {
+    int64_t x = st + (en - st) / 2;
+    if (memcmp(old + I[x], new_data, min(old_size - I[x], new_size)) < 0)
+      st = x;
+    else
+      en = x;
+  }
+  int64_t x = MatchLen(old + I[st], old_size - I[st], new_data, new_size);
+  int64_t y = MatchLen(old + I[en], old_size - I[en], new_data, new_size);
+  if (x > y) {
+    *pos = I[st];
+    return x;
+  }
+  *pos = I[en];
+  return y;
+}
+
+// Appends |x| in the sign-magnitude little-endian encoding bsdiff uses.
+void AppendOff(int64_t x, vector<char>* out) {
+  uint64_t y = x < 0 ? -x : x;
+  char buf[8];
+  for (int i = 0; i < 8; i++) {
+    buf[i] = y & 0xff;
+    y >>= 8;
+  }
+  if (x < 0)
+    buf[7] |= 0x80;
+  out->insert(out->end(), buf, buf + sizeof(buf));
+}
+
+// Like BzipCompress, but also produces a valid bzip2 stream for empty input
+// since the bspatch tool expects one for every block of the patch.
+bool CompressBlock(const vector<char>& in, vector<char>* out) {
+  if (!in.empty())
+    return BzipCompress(in, out);
+  char buf[64];
+  unsigned int length = sizeof(buf);
+  char dummy = 0;
+  TEST_AND_RETURN_FALSE(
+      BZ2_bzBuffToBuffCompress(buf, &length, &dummy, 0, 9, 0, 0) == BZ_OK);
+  out->assign(buf, buf + length);
+  return true;
+}
+
+// Computes the control, diff and extra blocks of the patch that turns the
+// |old_size| bytes at |old_data| into the |new_size| ones at |new_data|,
+// given the suffix array |I| of the former.
+template <typename Index>
+void ComputeBlocks(const Index* I,
+                   const char* old_data,
+                   int64_t old_size,
+                   const char* new_data,
+                   int64_t new_size,
+                   vector<char>* ctrl,
+                   vector<char>* diff,
+                   vector<char>* extra) {
+  const unsigned char* old = reinterpret_cast<const unsigned char*>(old_data);
+  const unsigned char* new_bytes =
+      reinterpret_cast<const unsigned char*>(new_data);
+  int64_t scan = 0, len = 0, pos = 0;
+  int64_t last_scan = 0, last_pos = 0, last_offset = 0;
+  while (scan < new_size) {
+    int64_t old_score = 0;
+    int64_t scsc;
+    for (scsc = scan += len; scan < new_size; scan++) {
+      len = Search(I, old, old_size, new_bytes + scan, new_size - scan,
+                   0, old_size, &pos);
+
+      for (; scsc < scan + len; scsc++) {
+        if (scsc + last_offset < old_size &&
+            old[scsc + last_offset] == new_bytes[scsc])
+          old_score++;
+      }
+
+      if ((len == old_score && len != 0) || len > old_score + 8)
+        break;
+
+      if (scan + last_offset < old_size &&
+          old[scan + last_offset] == new_bytes[scan])
+        old_score--;
+    }
+
+    if (len != old_score || scan == new_size) {
+      // Extend the previous match forwards...
+      int64_t s = 0, sf = 0, lenf = 0;
+      for (int64_t i = 0; last_scan + i < scan && last_pos + i < old_size; ) {
+        if (old[last_pos + i] == new_bytes[last_scan + i])
+          s++;
+        i++;
+        if (s * 2 - i > sf * 2 - lenf) {
+          sf = s;
+          lenf = i;
+        }
+      }
+
+      // ...and the new match backwards...
+      int64_t lenb = 0;
+      if (scan < new_size) {
+        int64_t sb = 0;
+        s = 0;
+        for (int64_t i = 1; scan >= last_scan + i && pos >= i; i++) {
+          if (old[pos - i] == new_bytes[scan - i])
+            s++;
+          if (s * 2 - i > sb * 2 - lenb) {
+            sb = s;
+            lenb = i;
+          }
+        }
+      }
+
+      // ...and split any overlap between the two where it scores best.
+      if (last_scan + lenf > scan - lenb) {
+        const int64_t overlap = (last_scan + lenf) - (scan - lenb);
+        int64_t ss = 0, lens = 0;
+        s = 0;
+        for (int64_t i = 0; i < overlap; i++) {
+          if (new_bytes[last_scan + lenf - overlap + i] ==
+              old[last_pos + lenf - overlap + i])
+            s++;
+          if (new_bytes[scan - lenb + i] == old[pos - lenb + i])
+            s--;
+          if (s > ss) {
+            ss = s;
+            lens = i + 1;
+          }
+        }
+        lenf += lens - overlap;
+        lenb -= lens;
+      }
+
+      for (int64_t i = 0; i < lenf; i++)
+        diff->push_back(new_bytes[last_scan + i] - old[last_pos + i]);
+      const int64_t extra_length = (scan - lenb) - (last_scan + lenf);
+      extra->insert(extra->end(),
+                   new_data + last_scan + lenf,
+                   new_data + last_scan + lenf + extra_length);
+
+      AppendOff(lenf, ctrl);
+      AppendOff(extra_length, ctrl);
+      AppendOff((pos - lenb) - (last_pos + lenf), ctrl);
+
+      last_scan = scan - lenb;
+      last_pos = pos - lenb;
+      last_offset = pos - scan;
+    }
+  }
+}
+
+}  // namespace {}
+
+bool SuffixArray::FitsNarrow(uint64_t data_size) {
+  // The largest value is reserved by SortSuffixes().
+  return data_size < kuint32max;
+}
+
+uint64_t SuffixArray::BuildMemory(uint64_t data_size) {
+  const uint64_t index_size =
+      FitsNarrow(data_size) ? sizeof(uint32_t) : sizeof(int64_t);
+  // The array, the buckets of the recursion, over at most half the suffixes,
+  // and the types of the suffixes of all the levels.
+  return index_size * (data_size + 1) * 3 / 2 + data_size / 4;
+}
+
+void SuffixArray::Build(const char* data, size_t data_size) {
+  if (!FitsNarrow(data_size)) {
+    BuildWide(data, data_size);
+    return;
+  }
+  Resize(data_size);
+  BuildOffsets(data, data_size, &narrow_offsets_[0]);
+}
+
+void SuffixArray::Build(const vector<char>& data) {
+  Build(data.empty() ? NULL : &data[0], data.size());
+}
+
+void SuffixArray::BuildWide(const char* data, size_t data_size) {
+  narrow_ = false;
+  vector<uint32_t>().swap(narrow_offsets_);
+  wide_offsets_.resize(data_size + 1);
+  BuildOffsets(data, data_size, &wide_offsets_[0]);
+}
+
+void SuffixArray::Resize(size_t data_size) {
+  narrow_ = FitsNarrow(data_size);
+  if (narrow_) {
+    vector<int64_t>().swap(wide_offsets_);
+    narrow_offsets_.resize(data_size + 1);
+  } else {
+    vector<uint32_t>().swap(narrow_offsets_);
+    wide_offsets_.resize(data_size + 1);
+  }
+}
+
+char* SuffixArray::bytes() {
+  return narrow_ ? reinterpret_cast<char*>(&narrow_offsets_[0]) :
+      reinterpret_cast<char*>(&wide_offsets_[0]);
+}
+
+size_t SuffixArray::byte_size() const {
+  return narrow_ ? narrow_offsets_.size() * sizeof(uint32_t) :
+      wide_offsets_.size() * sizeof(int64_t);
+}
+
+bool SuffixArray::operator==(const SuffixArray& other) const {
+  return narrow_ == other.narrow_ &&
+      narrow_offsets_ == other.narrow_offsets_ &&
+      wide_offsets_ == other.wide_offsets_;
+}
+
+bool SuffixArrayCache::Get(const vector<char>& old_data,
+                           SuffixArray* suffix_array) {
+  return Get(old_data.empty() ? NULL : &old_data[0], old_data.size(),
+             suffix_array);
+}
+
+bool SuffixArrayCache::Get(const char* old_data,
+                           size_t old_size,
+                           SuffixArray* suffix_array) {
+  vector<char> hash;
+  TEST_AND_RETURN_FALSE(
+      OmahaHashCalculator::RawHashOfBytes(old_data, old_size, &hash));
+  const string path = dir_ + "/" + base::HexEncode(&hash[0], hash.size());
+
+  // The entries of arrays with 64-bit offsets that now take 32 bits don't
+  // have the expected size, so they're replaced.
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    ScopedFdCloser fd_closer(&fd);
+    struct stat stbuf;
+    ssize_t bytes_read = 0;
+    suffix_array->Resize(old_size);
+    const size_t expected_size = suffix_array->byte_size();
+    if (fstat(fd, &stbuf) == 0 &&
+        static_cast<size_t>(stbuf.st_size) == expected_size &&
+        utils::PReadAll(fd, suffix_array->bytes(), expected_size, 0,
+                        &bytes_read) &&
+        static_cast<size_t>(bytes_read) == expected_size) {
+      return true;
+    }
+    LOG(WARNING) << "Ignoring bad suffix array cache entry " << path;
+  }
+
+  suffix_array->Build(old_data, old_size);
+
+  string temp_path;
+  int temp_fd = -1;
+  if (!utils::MakeTempFile(dir_ + "/.sa.XXXXXX", &temp_path, &temp_fd)) {
+    LOG(WARNING) << "Unable to store suffix array in cache " << dir_;
+    return true;
+  }
+  ScopedPathUnlinker temp_unlinker(temp_path);
+  bool success = utils::WriteAll(temp_fd, suffix_array->bytes(),
+                                 suffix_array->byte_size());
+  success = (close(temp_fd) == 0) && success;
+  if (success && rename(temp_path.c_str(), path.c_str()) == 0) {
+    temp_unlinker.set_should_remove(false);
+  } else {
+    PLOG(WARNING) << "Unable to store suffix array in cache " << path;
+  }
+  return true;
+}
+
+bool BsdiffBuffers(const vector<char>& old_data,
+                   const vector<char>& new_data,
+                   SuffixArrayCache* cache,
+                   vector<char>* out_patch) {
+  return BsdiffBuffers(old_data.empty() ? NULL : &old_data[0],
+                       old_data.size(),
+                       new_data.empty() ? NULL : &new_data[0],
+                       new_data.size(),
+                       cache,
+                       out_patch);
+}
+
+bool BsdiffBuffers(const char* old_data,
+                   size_t old_data_size,
+                   const char* new_data,
+                   size_t new_data_size,
+                   SuffixArrayCache* cache,
+                   vector<char>* out_patch) {
+  SuffixArray suffix_array;
+  if (cache) {
+    TEST_AND_RETURN_FALSE(
+        cache->Get(old_data, old_data_size, &suffix_array));
+  } else {
+    suffix_array.Build(old_data, old_data_size);
+  }
+  TEST_AND_RETURN_FALSE(suffix_array.size() == old_data_size + 1);
+
+  vector<char> ctrl, diff, extra;
+  if (suffix_array.narrow()) {
+    ComputeBlocks(&suffix_array.narrow_offsets()[0], old_data, old_data_size,
+                  new_data, new_data_size, &ctrl, &diff, &extra);
+  } else {
+    ComputeBlocks(&suffix_array.wide_offsets()[0], old_data, old_data_size,
+                  new_data, new_data_size, &ctrl, &diff, &extra);
+  }
+
+  vector<char> bz_ctrl, bz_diff, bz_extra;
+  TEST_AND_RETURN_FALSE(CompressBlock(ctrl, &bz_ctrl));
+  TEST_AND_RETURN_FALSE(CompressBlock(diff, &bz_diff));
+  TEST_AND_RETURN_FALSE(CompressBlock(extra, &bz_extra));
+
+  out_patch->assign(kBsdiffMagic, kBsdiffMagic + kBsdiffMagicSize);
+  AppendOff(bz_ctrl.size(), out_patch);
+  AppendOff(bz_diff.size(), out_patch);
+  AppendOff(new_data_size, out_patch);
+  out_patch->insert(out_patch->end(), bz_ctrl.begin(), bz_ctrl.end());
+  out_patch->insert(out_patch->end(), bz_diff.begin(), bz_diff.end());
+  out_patch->insert(out_patch->end(), bz_extra.begin(), bz_extra.end());
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,119 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_BSDIFF_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_BSDIFF_H__
+
+#include <inttypes.h>
+
+#include <string>
+#include <vector>
+
+#include <base/basictypes.h>
+
+// This is an in-process implementation of the bsdiff tool. It produces
+// patches in the BSDIFF40 format understood by bspatch.h and the bspatch
+// tool.
+
+namespace chromeos_update_engine {
+
+// The suffix array of an old file: the offsets of its suffixes, the empty
+// one included, in sorted order. The offsets take 32 bits when the file is
+// under 4 GiB, which halves the memory of the array, and 64 bits otherwise.
+// Arrays are sorted with SA-IS, in linear time, which also only needs half
+// as much memory again while sorting, rather than the array of ranks
+// qsufsort keeps next to the one being sorted.
+class SuffixArray {
+ public:
+  SuffixArray() : narrow_(true) {}
+
+  // Returns true if the offsets into |data_size| bytes fit in 32 bits.
+  static bool FitsNarrow(uint64_t data_size);
+
+  // Returns the most memory Build() takes for |data_size| bytes, the array
+  // included.
+  static uint64_t BuildMemory(uint64_t data_size);
+
+  // Sorts the suffixes of the |data_size| bytes at |data|. BuildWide() uses
+  // 64-bit offsets whatever the size.
+  void Build(const char* data, size_t data_size);
+  void Build(const std::vector<char>& data);
+  void BuildWide(const char* data, size_t data_size);
+
+  // Makes room for the offsets into |data_size| bytes, in the width Build()
+  // uses, to be filled through bytes().
+  void Resize(size_t data_size);
+
+  // The number of offsets, one more than the bytes sorted.
+  size_t size() const {
+    return narrow_ ? narrow_offsets_.size() : wide_offsets_.size();
+  }
+
+  // Returns the offset of the |i|th smallest suffix.
+  uint64_t operator[](size_t i) const {
+    return narrow_ ? narrow_offsets_[i] : wide_offsets_[i];
+  }
+
+  bool narrow() const { return narrow_; }
+  const std::vector<uint32_t>& narrow_offsets() const {
+    return narrow_offsets_;
+  }
+  const std::vector<int64_t>& wide_offsets() const { return wide_offsets_; }
+
+  // The offsets as byte_size() raw bytes, for storing them.
+  char* bytes();
+  size_t byte_size() const;
+
+  bool operator==(const SuffixArray& other) const;
+
+ private:
+  bool narrow_;
+  std::vector<uint32_t> narrow_offsets_;
+  std::vector<int64_t> wide_offsets_;
+
+  DISALLOW_COPY_AND_ASSIGN(SuffixArray);
+};
+
+// Stores the suffix arrays of old files on disk, keyed by the SHA-256 hash
+// of the old data, so that diffing several new images against the same old
+// image only sorts each old file once. Entries are written to a temporary
+// file and renamed into place, so a cache directory may be shared by
+// concurrent generators.
+class SuffixArrayCache {
+ public:
+  explicit SuffixArrayCache(const std::string& dir) : dir_(dir) {}
+
+  // Sets |suffix_array| to the suffix array of |old_data|, either from the
+  // cache or by building it and storing it in the cache. Failing to
+  // read or write the cache is not an error. Returns true on success.
+  bool Get(const std::vector<char>& old_data, SuffixArray* suffix_array);
+  bool Get(const char* old_data,
+           size_t old_size,
+           SuffixArray* suffix_array);
+
+ private:
+  std::string dir_;
+
+  DISALLOW_COPY_AND_ASSIGN(SuffixArrayCache);
+};
+
+// Computes a BSDIFF40 patch that turns |old_data| into |new_data| and stores
+// it in |out_patch|. If |cache| isn't NULL, the suffix array of |old_data| is
+// taken from it. Returns true on success. The second form diffs the
+// |old_size| and |new_size| bytes at |old_data| and |new_data|, which may be
+// memory mapped, without copying them.
+bool BsdiffBuffers(const std::vector<char>& old_data,
+                   const std::vector<char>& new_data,
+                   SuffixArrayCache* cache,
+                   std::vector<char>* out_patch);
+bool BsdiffBuffers(const char* old_data,
+                   size_t old_size,
+                   const char* new_data,
+                   size_t new_size,
+                   SuffixArrayCache* cache,
+                   std::vector<char>* out_patch);
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_BSDIFF_H__
@@ -0,0 +1,172 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <dirent.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+#include "update_engine/bsdiff.h"
+#include "update_engine/bspatch.h"
+#include "update_engine/extent_writer.h"
+#include "update_engine/test_utils.h"
+#include "update_engine/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+// Returns the names of the entries in |dir|, except for "." and "..".
+vector<string> ListDir(const string& dir) {
+  vector<string> entries;
+  DIR* dirp = opendir(dir.c_str());
+  EXPECT_TRUE(dirp != NULL);
+  if (!dirp)
+    return entries;
+  while (struct dirent* entry = readdir(dirp)) {
+    const string name = entry->d_name;
+    if (name != "." && name != "..")
+      entries.push_back(name);
+  }
+  closedir(dirp);
+  return entries;
+}
+
+// Diffs |old_data| against |new_data|, applies the resulting patch and
+// checks that it reproduces |new_data|.
+void ExpectRoundTrip(const vector<char>& old_data,
+                     const vector<char>& new_data,
+                     SuffixArrayCache* cache) {
+  vector<char> patch;
+  EXPECT_TRUE(BsdiffBuffers(old_data, new_data, cache, &patch));
+  MemoryExtentWriter writer;
+  EXPECT_TRUE(BspatchBuffer(old_data.empty() ? NULL : &old_data[0],
+                            old_data.size(),
+                            &patch[0],
+                            patch.size(),
+                            new_data.size(),
+                            &writer));
+  ExpectVectorsEq(new_data, writer.data());
+}
+}  // namespace {}
+
+TEST(BsdiffTest, RoundTripTest) {
+  vector<char> old_data(64 * 1024);
+  FillWithData(&old_data);
+  vector<char> new_data(old_data);
+  // Change a few bytes, insert a run and drop a run.
+  new_data[10] ^= 0x55;
+  new_data[30000] ^= 0x01;
+  new_data.insert(new_data.begin() + 20000, 500, 'z');
+  new_data.erase(new_data.begin() + 40000, new_data.begin() + 41000);
+  ExpectRoundTrip(old_data, new_data, NULL);
+
+  // The patch for a small change should be much smaller than the new data.
+  vector<char> patch;
+  EXPECT_TRUE(BsdiffBuffers(old_data, new_data, NULL, &patch));
+  EXPECT_LT(patch.size(), new_data.size() / 10);
+}
+
+TEST(BsdiffTest, EdgeCasesTest) {
+  vector<char> data(1000);
+  FillWithData(&data);
+  ExpectRoundTrip(vector<char>(), data, NULL);
+  ExpectRoundTrip(data, vector<char>(), NULL);
+  ExpectRoundTrip(data, data, NULL);
+  ExpectRoundTrip(vector<char>(1, 'a'), vector<char>(1, 'b'), NULL);
+  ExpectRoundTrip(vector<char>(5000, 0), vector<char>(7000, 0), NULL);
+}
+
+TEST(BsdiffTest, SuffixArrayTest) {
+  const string str = "banana";
+  vector<char> data(str.begin(), str.end());
+  SuffixArray suffix_array;
+  suffix_array.Build(data);
+  EXPECT_TRUE(suffix_array.narrow());
+  // "", "a", "ana", "anana", "banana", "na", "nana"
+  const uint64_t kExpected[] = { 6, 5, 3, 1, 0, 4, 2 };
+  ASSERT_EQ(arraysize(kExpected), suffix_array.size());
+  for (size_t i = 0; i < arraysize(kExpected); i++)
+    EXPECT_EQ(kExpected[i], suffix_array[i]);
+  EXPECT_EQ(arraysize(kExpected) * sizeof(uint32_t),
+            suffix_array.byte_size());
+}
+
+TEST(BsdiffTest, SuffixArrayOrderTest) {
+  // Runs and repeats recurse through several levels of SA-IS.
+  vector<string> inputs;
+  inputs.push_back("");
+  inputs.push_back("a");
+  inputs.push_back("mississippi");
+  inputs.push_back(string(100, 'a'));
+  inputs.push_back(string(50, 'a') + "b" + string(50, 'a'));
+  string repeats;
+  for (int i = 0; i < 300; i++)
+    repeats += (i % 7 == 3) ? "abcab" : "abcabd";
+  inputs.push_back(repeats);
+  string random_bytes(4000, 0);
+  for (size_t i = 0; i < random_bytes.size(); i++)
+    random_bytes[i] = rand() % 3;
+  inputs.push_back(random_bytes);
+  for (size_t i = 0; i < inputs.size(); i++) {
+    const vector<char> data(inputs[i].begin(), inputs[i].end());
+    SuffixArray narrow, wide;
+    narrow.Build(data);
+    wide.BuildWide(data.empty() ? NULL : &data[0], data.size());
+    EXPECT_FALSE(wide.narrow());
+    ASSERT_EQ(data.size() + 1, narrow.size());
+    ASSERT_EQ(data.size() + 1, wide.size());
+    EXPECT_EQ(data.size(), narrow[0]);
+    for (size_t j = 0; j < narrow.size(); j++)
+      EXPECT_EQ(narrow[j], wide[j]);
+    for (size_t j = 1; j < narrow.size(); j++) {
+      EXPECT_LT(inputs[i].substr(narrow[j - 1]), inputs[i].substr(narrow[j]))
+          << "input " << i << ", offset " << j;
+    }
+  }
+}
+
+TEST(BsdiffTest, SuffixArrayCacheTest) {
+  string cache_dir;
+  ASSERT_TRUE(utils::MakeTempDirectory("/tmp/BsdiffTest-cache.XXXXXX",
+                                       &cache_dir));
+
+  vector<char> old_data(16 * 1024);
+  FillWithData(&old_data);
+  SuffixArray expected;
+  expected.Build(old_data);
+
+  SuffixArrayCache cache(cache_dir);
+  // The first lookup builds and stores the array, the second one reads it
+  // back from the cache directory.
+  SuffixArray suffix_array;
+  EXPECT_TRUE(cache.Get(old_data, &suffix_array));
+  EXPECT_TRUE(expected == suffix_array);
+  vector<string> entries = ListDir(cache_dir);
+  ASSERT_EQ(1U, entries.size());
+  suffix_array.Resize(0);
+  EXPECT_TRUE(cache.Get(old_data, &suffix_array));
+  EXPECT_TRUE(expected == suffix_array);
+
+  // A truncated entry is ignored and replaced.
+  const string entry_path = cache_dir + "/" + entries[0];
+  EXPECT_EQ(0, truncate(entry_path.c_str(), 100));
+  suffix_array.Resize(0);
+  EXPECT_TRUE(cache.Get(old_data, &suffix_array));
+  EXPECT_TRUE(expected == suffix_array);
+  EXPECT_EQ(static_cast<off_t>(expected.size() * sizeof(uint32_t)),
+            utils::FileSize(entry_path));
+
+  vector<char> new_data(old_data);
+  new_data[100] = 'x';
+  ExpectRoundTrip(old_data, new_data, &cache);
+  EXPECT_TRUE(utils::RecursiveUnlinkDir(cache_dir));
+}
+
+}  // namespace chromeos_update_engine
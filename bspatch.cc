@@ -0,0 +1,198 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/bspatch.h"
+
+#include <bzlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <base/logging.h>
+
+#include "update_engine/graph_types.h"
+#include "update_engine/utils.h"
+
+using google::protobuf::RepeatedPtrField;
+using std::min;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+const char kBsdiffMagic[] = "BSDIFF40";
+const size_t kBsdiffMagicSize = 8;
+const size_t kBsdiffHeaderSize = 32;
+
+// The new data is produced and passed to the writer in chunks of this size.
+const size_t kBspatchChunkSize = 128 * 1024;
+
+// Decodes the sign-magnitude little-endian integer bsdiff uses for all its
+// offsets and lengths.
+int64_t OffToInt(const char* buf) {
+  const unsigned char* ubuf = reinterpret_cast<const unsigned char*>(buf);
+  int64_t y = ubuf[7] & 0x7f;
+  for (int i = 6; i >= 0; i--) {
+    y = y * 256 + ubuf[i];
+  }
+  if (ubuf[7] & 0x80)
+    y = -y;
+  return y;
+}
+
+// Decompresses a bzip2 stream that's entirely in memory, a few bytes at a
+// time.
+class BzipMemoryReader {
+ public:
+  BzipMemoryReader() : initialized_(false) {
+    memset(&stream_, 0, sizeof(stream_));
+  }
+  ~BzipMemoryReader() {
+    if (initialized_)
+      BZ2_bzDecompressEnd(&stream_);
+  }
+
+  bool Init(const char* data, size_t size) {
+    TEST_AND_RETURN_FALSE(!initialized_);
+    TEST_AND_RETURN_FALSE(BZ2_bzDecompressInit(&stream_, 0, 0) == BZ_OK);
+    initialized_ = true;
+    stream_.next_in = const_cast<char*>(data);
+    stream_.avail_in = size;
+    return true;
+  }
+
+  // Reads exactly |count| bytes into |out|. Returns false if the stream is
+  // corrupt or ends early.
+  bool Read(char* out, size_t count) {
+    while (count > 0) {
+      stream_.next_out = out;
+      stream_.avail_out = count;
+      int rc = BZ2_bzDecompress(&stream_);
+      TEST_AND_RETURN_FALSE(rc == BZ_OK || rc == BZ_STREAM_END);
+      size_t produced = count - stream_.avail_out;
+      TEST_AND_RETURN_FALSE(produced > 0 || rc == BZ_OK);
+      TEST_AND_RETURN_FALSE(produced > 0 || stream_.avail_in > 0);
+      out += produced;
+      count -= produced;
+    }
+    return true;
+  }
+
+ private:
+  bz_stream stream_;
+  bool initialized_;
+  DISALLOW_COPY_AND_ASSIGN(BzipMemoryReader);
+};
+
+}  // namespace {}
+
+bool BspatchBuffer(const char* old_data,
+                   uint64_t old_size,
+                   const char* patch,
+                   size_t patch_size,
+                   uint64_t new_size,
+                   ExtentWriter* writer) {
+  TEST_AND_RETURN_FALSE(patch_size >= kBsdiffHeaderSize);
+  TEST_AND_RETURN_FALSE(memcmp(patch, kBsdiffMagic, kBsdiffMagicSize) == 0);
+  const int64_t ctrl_len = OffToInt(patch + 8);
+  const int64_t diff_len = OffToInt(patch + 16);
+  const int64_t header_new_size = OffToInt(patch + 24);
+  TEST_AND_RETURN_FALSE(ctrl_len >= 0 && diff_len >= 0);
+  TEST_AND_RETURN_FALSE(static_cast<uint64_t>(ctrl_len) + diff_len <=
+                        patch_size - kBsdiffHeaderSize);
+  TEST_AND_RETURN_FALSE(header_new_size >= 0);
+  TEST_AND_RETURN_FALSE(static_cast<uint64_t>(header_new_size) == new_size);
+
+  const char* ctrl_start = patch + kBsdiffHeaderSize;
+  const char* diff_start = ctrl_start + ctrl_len;
+  const char* extra_start = diff_start + diff_len;
+  BzipMemoryReader ctrl_reader, diff_reader, extra_reader;
+  TEST_AND_RETURN_FALSE(ctrl_reader.Init(ctrl_start, ctrl_len));
+  TEST_AND_RETURN_FALSE(diff_reader.Init(diff_start, diff_len));
+  TEST_AND_RETURN_FALSE(extra_reader.Init(
+      extra_start, patch + patch_size - extra_start));
+
+  vector<char> chunk(min(static_cast<uint64_t>(kBspatchChunkSize), new_size));
+  const int64_t old_end = old_size;
+  int64_t old_pos = 0;
+  uint64_t new_pos = 0;
+  while (new_pos < new_size) {
+    char ctrl_buf[24];
+    TEST_AND_RETURN_FALSE(ctrl_reader.Read(ctrl_buf, sizeof(ctrl_buf)));
+    const int64_t diff_bytes = OffToInt(ctrl_buf);
+    const int64_t extra_bytes = OffToInt(ctrl_buf + 8);
+    const int64_t seek = OffToInt(ctrl_buf + 16);
+    TEST_AND_RETURN_FALSE(diff_bytes >= 0 && extra_bytes >= 0);
+    TEST_AND_RETURN_FALSE(static_cast<uint64_t>(diff_bytes) <=
+                          new_size - new_pos);
+
+    // Add the diff bytes to the old data. Old bytes outside the old buffer
+    // are treated as zeros.
+    for (int64_t done = 0; done < diff_bytes; ) {
+      size_t count = min(static_cast<int64_t>(chunk.size()),
+                         diff_bytes - done);
+      TEST_AND_RETURN_FALSE(diff_reader.Read(&chunk[0], count));
+      for (size_t i = 0; i < count; i++) {
+        if (old_pos >= 0 && old_pos < old_end)
+          chunk[i] += old_data[old_pos];
+        old_pos++;
+      }
+      TEST_AND_RETURN_FALSE(writer->Write(&chunk[0], count));
+      done += count;
+    }
+    new_pos += diff_bytes;
+
+    TEST_AND_RETURN_FALSE(static_cast<uint64_t>(extra_bytes) <=
+                          new_size - new_pos);
+    for (int64_t done = 0; done < extra_bytes; ) {
+      size_t count = min(static_cast<int64_t>(chunk.size()),
+                         extra_bytes - done);
+      TEST_AND_RETURN_FALSE(extra_reader.Read(&chunk[0], count));
+      TEST_AND_RETURN_FALSE(writer->Write(&chunk[0], count));
+      done += count;
+    }
+    new_pos += extra_bytes;
+    old_pos += seek;
+  }
+  return true;
+}
+
+bool BspatchExtents(int fd,
+                    const RepeatedPtrField<Extent>& src_extents,
+                    uint64_t src_length,
+                    uint32_t block_size,
+                    const char* patch,
+                    size_t patch_size,
+                    uint64_t dst_length,
+                    ExtentWriter* writer) {
+  vector<char> old_data(src_length);
+  uint64_t bytes_read = 0;
+  for (int i = 0; i < src_extents.size() && bytes_read < src_length; i++) {
+    const Extent& extent = src_extents.Get(i);
+    const uint64_t length = min(src_length - bytes_read,
+                                extent.num_blocks() * block_size);
+    if (extent.start_block() != kSparseHole) {
+      ssize_t bytes_read_this_iteration = 0;
+      TEST_AND_RETURN_FALSE(utils::PReadAll(fd,
+                                            &old_data[bytes_read],
+                                            length,
+                                            extent.start_block() * block_size,
+                                            &bytes_read_this_iteration));
+      TEST_AND_RETURN_FALSE(
+          bytes_read_this_iteration == static_cast<ssize_t>(length));
+    }
+    bytes_read += length;
+  }
+  TEST_AND_RETURN_FALSE(bytes_read == src_length);
+  return BspatchBuffer(old_data.empty() ? NULL : &old_data[0],
+                       old_data.size(),
+                       patch,
+                       patch_size,
+                       dst_length,
+                       writer);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,49 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_BSPATCH_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_BSPATCH_H__
+
+#include <inttypes.h>
+
+#include <google/protobuf/repeated_field.h>
+
+#include "update_engine/extent_writer.h"
+#include "update_engine/update_metadata.pb.h"
+
+// This is an in-process implementation of the bspatch tool. It understands
+// the BSDIFF40 patch format and, instead of reading and writing whole files,
+// streams the reconstructed data to an ExtentWriter.
+
+namespace chromeos_update_engine {
+
+// Applies the BSDIFF40 patch in |patch| (|patch_size| bytes long) to the
+// |old_size| bytes at |old_data| and passes the resulting bytes to |writer|,
+// which must already be Init()ed. The caller is responsible for calling
+// End() on |writer|. Fails if the patch is malformed or if the size of the
+// new data it describes isn't |new_size|. Returns true on success.
+bool BspatchBuffer(const char* old_data,
+                   uint64_t old_size,
+                   const char* patch,
+                   size_t patch_size,
+                   uint64_t new_size,
+                   ExtentWriter* writer);
+
+// Like BspatchBuffer, but reads the old data from the first |src_length|
+// bytes of |src_extents| in |fd|. Extents starting at kSparseHole read as
+// zeros. All of the old data is read before anything is passed to |writer|,
+// so the source and destination extents may overlap.
+bool BspatchExtents(int fd,
+                    const google::protobuf::RepeatedPtrField<Extent>&
+                        src_extents,
+                    uint64_t src_length,
+                    uint32_t block_size,
+                    const char* patch,
+                    size_t patch_size,
+                    uint64_t dst_length,
+                    ExtentWriter* writer);
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_BSPATCH_H__
@@ -0,0 +1,206 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+#include "update_engine/bspatch.h"
+#include "update_engine/bzip.h"
+#include "update_engine/extent_writer.h"
+#include "update_engine/graph_types.h"
+#include "update_engine/test_utils.h"
+#include "update_engine/utils.h"
+
+using google::protobuf::RepeatedPtrField;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+const char kPathTemplate[] = "./BspatchTest-file.XXXXXX";
+const uint32_t kBlockSize = 4096;
+
+void AppendOff(int64_t value, vector<char>* out) {
+  uint64_t magnitude = value < 0 ? -value : value;
+  for (int i = 0; i < 8; i++) {
+    unsigned char byte = magnitude & 0xff;
+    if (i == 7 && value < 0)
+      byte |= 0x80;
+    out->push_back(byte);
+    magnitude >>= 8;
+  }
+}
+
+// Builds a BSDIFF40 patch out of raw control triples, diff and extra bytes.
+vector<char> MakePatch(const vector<int64_t>& ctrl,
+                       const vector<char>& diff,
+                       const vector<char>& extra,
+                       int64_t new_size) {
+  vector<char> raw_ctrl;
+  for (vector<int64_t>::const_iterator it = ctrl.begin(); it != ctrl.end();
+       ++it)
+    AppendOff(*it, &raw_ctrl);
+  vector<char> bz_ctrl, bz_diff, bz_extra;
+  EXPECT_TRUE(BzipCompress(raw_ctrl, &bz_ctrl));
+  EXPECT_TRUE(BzipCompress(diff, &bz_diff));
+  EXPECT_TRUE(BzipCompress(extra, &bz_extra));
+
+  const char kMagic[] = "BSDIFF40";
+  vector<char> patch(kMagic, kMagic + 8);
+  AppendOff(bz_ctrl.size(), &patch);
+  AppendOff(bz_diff.size(), &patch);
+  AppendOff(new_size, &patch);
+  patch.insert(patch.end(), bz_ctrl.begin(), bz_ctrl.end());
+  patch.insert(patch.end(), bz_diff.begin(), bz_diff.end());
+  patch.insert(patch.end(), bz_extra.begin(), bz_extra.end());
+  return patch;
+}
+
+}  // namespace {}
+
+class BspatchTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    memcpy(path_, kPathTemplate, sizeof(kPathTemplate));
+    fd_ = mkstemp(path_);
+    ASSERT_GE(fd_, 0);
+  }
+  virtual void TearDown() {
+    close(fd_);
+    unlink(path_);
+  }
+  int fd() { return fd_; }
+ private:
+  int fd_;
+  char path_[sizeof(kPathTemplate)];
+};
+
+TEST_F(BspatchTest, BufferTest) {
+  const string old_data = "abcdefgh";
+  // new = "abd" (3 diff bytes), "XYZ" (3 extra bytes), then seek back to
+  // old offset 1 and add 2 more diff bytes: "bd".
+  vector<int64_t> ctrl;
+  ctrl.push_back(3);
+  ctrl.push_back(3);
+  ctrl.push_back(-2);
+  ctrl.push_back(2);
+  ctrl.push_back(0);
+  ctrl.push_back(0);
+  vector<char> diff;
+  diff.push_back(0);
+  diff.push_back(0);
+  diff.push_back('d' - 'c');
+  diff.push_back(0);
+  diff.push_back('d' - 'c');
+  const string extra_str = "XYZ";
+  vector<char> extra(extra_str.begin(), extra_str.end());
+  vector<char> patch = MakePatch(ctrl, diff, extra, 8);
+
+  MemoryExtentWriter writer;
+  EXPECT_TRUE(BspatchBuffer(old_data.data(), old_data.size(),
+                            &patch[0], patch.size(), 8, &writer));
+  EXPECT_EQ("abdXYZbd", string(writer.data().begin(), writer.data().end()));
+
+  // A mismatching expected size or a corrupt magic must be rejected.
+  MemoryExtentWriter bad_size_writer;
+  EXPECT_FALSE(BspatchBuffer(old_data.data(), old_data.size(),
+                             &patch[0], patch.size(), 9, &bad_size_writer));
+  patch[0] = 'X';
+  MemoryExtentWriter bad_magic_writer;
+  EXPECT_FALSE(BspatchBuffer(old_data.data(), old_data.size(),
+                             &patch[0], patch.size(), 8, &bad_magic_writer));
+}
+
+TEST_F(BspatchTest, TruncatedPatchTest) {
+  vector<int64_t> ctrl;
+  ctrl.push_back(0);
+  ctrl.push_back(10);
+  ctrl.push_back(0);
+  // Claims 10 extra bytes but only provides 4.
+  vector<char> extra(4, 'a');
+  vector<char> patch = MakePatch(ctrl, vector<char>(), extra, 10);
+  MemoryExtentWriter writer;
+  EXPECT_FALSE(BspatchBuffer(NULL, 0, &patch[0], patch.size(), 10, &writer));
+}
+
+TEST_F(BspatchTest, InPlaceExtentsTest) {
+  // Two blocks of old data at blocks 0 and 1. The new data swaps them, adds
+  // 100 extra bytes and gets written back over the same blocks, zero padded.
+  vector<char> old_data(2 * kBlockSize);
+  FillWithData(&old_data);
+  ASSERT_TRUE(utils::PWriteAll(fd(), &old_data[0], old_data.size(), 0));
+  // Junk in block 2 that should be overwritten by zero padding.
+  vector<char> junk(kBlockSize, 'j');
+  ASSERT_TRUE(utils::PWriteAll(fd(), &junk[0], junk.size(), 2 * kBlockSize));
+
+  RepeatedPtrField<Extent> src_extents;
+  Extent* extent = src_extents.Add();
+  extent->set_start_block(1);
+  extent->set_num_blocks(1);
+  extent = src_extents.Add();
+  extent->set_start_block(0);
+  extent->set_num_blocks(1);
+
+  // Copy the whole (swapped) old data, then append 100 extra bytes.
+  const uint64_t new_size = 2 * kBlockSize + 100;
+  vector<int64_t> ctrl;
+  ctrl.push_back(2 * kBlockSize);
+  ctrl.push_back(100);
+  ctrl.push_back(0);
+  vector<char> diff(2 * kBlockSize, 0);
+  vector<char> extra(100, 'x');
+  vector<char> patch = MakePatch(ctrl, diff, extra, new_size);
+
+  vector<Extent> dst_extents;
+  Extent dst_extent;
+  dst_extent.set_start_block(0);
+  dst_extent.set_num_blocks(3);
+  dst_extents.push_back(dst_extent);
+
+  DirectExtentWriter direct_writer;
+  ZeroPadExtentWriter zero_pad_writer(&direct_writer);
+  EXPECT_TRUE(zero_pad_writer.Init(fd(), dst_extents, kBlockSize));
+  EXPECT_TRUE(BspatchExtents(fd(), src_extents, 2 * kBlockSize, kBlockSize,
+                             &patch[0], patch.size(), new_size,
+                             &zero_pad_writer));
+  EXPECT_TRUE(zero_pad_writer.End());
+
+  vector<char> expected(old_data.begin() + kBlockSize, old_data.end());
+  expected.insert(expected.end(), old_data.begin(),
+                  old_data.begin() + kBlockSize);
+  expected.insert(expected.end(), 100, 'x');
+  expected.resize(3 * kBlockSize, 0);
+
+  vector<char> actual(3 * kBlockSize);
+  ssize_t bytes_read = 0;
+  EXPECT_TRUE(utils::PReadAll(fd(), &actual[0], actual.size(), 0,
+                              &bytes_read));
+  EXPECT_EQ(static_cast<ssize_t>(actual.size()), bytes_read);
+  ExpectVectorsEq(expected, actual);
+}
+
+TEST_F(BspatchTest, SparseHoleSourceTest) {
+  RepeatedPtrField<Extent> src_extents;
+  Extent* extent = src_extents.Add();
+  extent->set_start_block(kSparseHole);
+  extent->set_num_blocks(1);
+
+  vector<int64_t> ctrl;
+  ctrl.push_back(10);
+  ctrl.push_back(0);
+  ctrl.push_back(0);
+  vector<char> diff(10, 1);
+  vector<char> patch = MakePatch(ctrl, diff, vector<char>(), 10);
+
+  MemoryExtentWriter writer;
+  EXPECT_TRUE(BspatchExtents(fd(), src_extents, 10, kBlockSize,
+                             &patch[0], patch.size(), 10, &writer));
+  ExpectVectorsEq(vector<char>(10, 1), writer.data());
+}
+
+}  // namespace chromeos_update_engine
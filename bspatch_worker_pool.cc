@@ -0,0 +1,343 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/bspatch_worker_pool.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <base/logging.h>
+#include <base/memory/scoped_ptr.h>
+#include <base/posix/eintr_wrapper.h>
+
+#include "update_engine/bspatch.h"
+#include "update_engine/extent_writer.h"
+#include "update_engine/utils.h"
+
+using google::protobuf::RepeatedPtrField;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The writes of a worker are coalesced up to this size, as DeltaPerformer
+// does for its own.
+const size_t kWriteCoalesceSize = 1024 * 1024;  // 1 MiB
+
+// Requests with more extents or a larger patch than these are malformed.
+const uint32_t kMaxRequestExtents = 1024 * 1024;
+const uint64_t kMaxPatchSize = 1024 * 1024 * 1024;  // 1 GiB
+
+// The fixed-size part of a request, which carries the source and destination
+// descriptors. It's followed by the source and destination extents, as pairs
+// of start block and number of blocks, and then by the patch.
+struct PatchRequest {
+  uint64_t src_length;
+  uint64_t dst_length;
+  uint64_t patch_size;
+  uint32_t block_size;
+  uint32_t num_src_extents;
+  uint32_t num_dst_extents;
+};
+
+// Sends all the |size| bytes at |data| on |fd|. Returns true on success.
+bool SendAll(int fd, const void* data, size_t size) {
+  const char* bytes = reinterpret_cast<const char*>(data);
+  while (size > 0) {
+    ssize_t rc = HANDLE_EINTR(send(fd, bytes, size, MSG_NOSIGNAL));
+    TEST_AND_RETURN_FALSE_ERRNO(rc > 0);
+    bytes += rc;
+    size -= rc;
+  }
+  return true;
+}
+
+// Receives exactly |size| bytes from |fd| into |data|. Returns false on error
+// or once the other end is closed.
+bool RecvAll(int fd, void* data, size_t size) {
+  char* bytes = reinterpret_cast<char*>(data);
+  while (size > 0) {
+    ssize_t rc = HANDLE_EINTR(recv(fd, bytes, size, 0));
+    if (rc <= 0)
+      return false;
+    bytes += rc;
+    size -= rc;
+  }
+  return true;
+}
+
+// Sends |request| on |socket_fd| with |src_fd| and |fd| attached.
+bool SendRequest(int socket_fd, const PatchRequest& request, int src_fd,
+                 int fd) {
+  int fds[2] = { src_fd, fd };
+  char control[CMSG_SPACE(sizeof(fds))];
+  memset(control, 0, sizeof(control));
+  struct iovec iov;
+  iov.iov_base = const_cast<PatchRequest*>(&request);
+  iov.iov_len = sizeof(request);
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+  ssize_t rc = HANDLE_EINTR(sendmsg(socket_fd, &msg, MSG_NOSIGNAL));
+  TEST_AND_RETURN_FALSE_ERRNO(rc > 0);
+  // The descriptors went with the first byte, so the rest of the header, if
+  // any, is sent as is.
+  return SendAll(socket_fd,
+                 reinterpret_cast<const char*>(&request) + rc,
+                 sizeof(request) - rc);
+}
+
+// Receives a request from |socket_fd| into |request|, and the descriptors
+// attached to it into |fds|, which are left at -1 if there are none. Returns
+// false on error or once the other end is closed; the descriptors received
+// must be closed either way.
+bool RecvRequest(int socket_fd, PatchRequest* request, int fds[2]) {
+  char control[CMSG_SPACE(2 * sizeof(int))];
+  struct iovec iov;
+  iov.iov_base = request;
+  iov.iov_len = sizeof(*request);
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  ssize_t rc = HANDLE_EINTR(recvmsg(socket_fd, &msg, MSG_CMSG_CLOEXEC));
+  if (rc <= 0)
+    return false;
+  for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(2 * sizeof(int)))
+      memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+  }
+  return RecvAll(socket_fd,
+                 reinterpret_cast<char*>(request) + rc,
+                 sizeof(*request) - rc);
+}
+
+// Appends |extents| to |out| as pairs of start block and number of blocks.
+void AppendExtents(const RepeatedPtrField<Extent>& extents,
+                   vector<uint64_t>* out) {
+  for (int i = 0; i < extents.size(); i++) {
+    out->push_back(extents.Get(i).start_block());
+    out->push_back(extents.Get(i).num_blocks());
+  }
+}
+
+}  // namespace {}
+
+BspatchWorkerPool* BspatchWorkerPool::pool_singleton_ = NULL;
+
+bool BspatchWorkerPool::Init(unsigned num_workers) {
+  CHECK(!pool_singleton_);
+  scoped_ptr<BspatchWorkerPool> pool(new BspatchWorkerPool);
+  for (unsigned i = 0; i < num_workers; i++) {
+    TEST_AND_RETURN_FALSE(pool->StartWorker());
+  }
+  LOG(INFO) << "Started " << num_workers << " bspatch workers.";
+  pool_singleton_ = pool.release();
+  return true;
+}
+
+void BspatchWorkerPool::Shutdown() {
+  delete pool_singleton_;
+  pool_singleton_ = NULL;
+}
+
+BspatchWorkerPool::BspatchWorkerPool() : num_live_workers_(0) {
+  g_mutex_init(&mutex_);
+  g_cond_init(&cond_);
+}
+
+BspatchWorkerPool::~BspatchWorkerPool() {
+  // The workers exit once their socket is closed.
+  for (vector<Worker>::iterator it = workers_.begin(); it != workers_.end();
+       ++it) {
+    if (it->fd < 0)
+      continue;
+    close(it->fd);
+    HANDLE_EINTR(waitpid(it->pid, NULL, 0));
+  }
+  g_cond_clear(&cond_);
+  g_mutex_clear(&mutex_);
+}
+
+bool BspatchWorkerPool::StartWorker() {
+  int fds[2];
+  TEST_AND_RETURN_FALSE_ERRNO(
+      socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == 0);
+  const pid_t parent = getpid();
+  const pid_t pid = fork();
+  if (pid < 0) {
+    PLOG(ERROR) << "Unable to fork a bspatch worker";
+    close(fds[0]);
+    close(fds[1]);
+    return false;
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    // The sockets of the other workers must be closed only by the parent
+    // for them to exit.
+    for (vector<Worker>::iterator it = workers_.begin();
+         it != workers_.end(); ++it) {
+      close(it->fd);
+    }
+    RunWorker(fds[1], parent);
+  }
+  close(fds[1]);
+  Worker worker;
+  worker.pid = pid;
+  worker.fd = fds[0];
+  idle_workers_.push_back(workers_.size());
+  workers_.push_back(worker);
+  num_live_workers_++;
+  return true;
+}
+
+void BspatchWorkerPool::RunWorker(int fd, pid_t parent) {
+  // The worker dies with update_engine, but otherwise leaves it to the
+  // parent to stop it: an operation that blocks exit is finished even when
+  // update_engine is asked to terminate.
+  prctl(PR_SET_PDEATHSIG, SIGKILL);
+  if (getppid() != parent)
+    _exit(0);
+  signal(SIGTERM, SIG_IGN);
+  signal(SIGINT, SIG_IGN);
+  while (ServeRequest(fd)) {}
+  _exit(0);
+}
+
+bool BspatchWorkerPool::ServeRequest(int fd) {
+  PatchRequest request;
+  int fds[2] = { -1, -1 };
+  const bool received = RecvRequest(fd, &request, fds);
+  ScopedFdCloser src_fd_closer(&fds[0]);
+  ScopedFdCloser fd_closer(&fds[1]);
+  if (!received)
+    return false;
+  // A malformed request leaves the stream out of sync, so it isn't answered.
+  if (request.num_src_extents > kMaxRequestExtents ||
+      request.num_dst_extents > kMaxRequestExtents ||
+      request.patch_size > kMaxPatchSize) {
+    LOG(ERROR) << "Malformed bspatch request.";
+    return false;
+  }
+  vector<uint64_t> raw_extents(
+      2 * (request.num_src_extents + request.num_dst_extents));
+  vector<char> patch(request.patch_size);
+  if ((!raw_extents.empty() &&
+       !RecvAll(fd, &raw_extents[0], raw_extents.size() * sizeof(uint64_t))) ||
+      (!patch.empty() && !RecvAll(fd, &patch[0], patch.size())))
+    return false;
+
+  RepeatedPtrField<Extent> src_extents;
+  vector<Extent> dst_extents;
+  for (size_t i = 0; i < raw_extents.size(); i += 2) {
+    Extent extent;
+    extent.set_start_block(raw_extents[i]);
+    extent.set_num_blocks(raw_extents[i + 1]);
+    if (i < 2 * request.num_src_extents)
+      *src_extents.Add() = extent;
+    else
+      dst_extents.push_back(extent);
+  }
+
+  DirectExtentWriter direct_writer;
+  direct_writer.set_coalesce_size(kWriteCoalesceSize);
+  ZeroPadWriter<DirectExtentWriter> zero_pad_writer(&direct_writer);
+  const int32_t status =
+      fds[0] >= 0 && fds[1] >= 0 &&
+      zero_pad_writer.Init(fds[1], dst_extents, request.block_size) &&
+      BspatchExtents(fds[0],
+                     src_extents,
+                     request.src_length,
+                     request.block_size,
+                     patch.empty() ? NULL : &patch[0],
+                     patch.size(),
+                     request.dst_length,
+                     &zero_pad_writer) &&
+      zero_pad_writer.End() ? 1 : 0;
+  return SendAll(fd, &status, sizeof(status));
+}
+
+bool BspatchWorkerPool::Patch(int src_fd,
+                              const RepeatedPtrField<Extent>& src_extents,
+                              uint64_t src_length,
+                              int fd,
+                              const RepeatedPtrField<Extent>& dst_extents,
+                              uint64_t dst_length,
+                              uint32_t block_size,
+                              const char* patch,
+                              size_t patch_size) {
+  g_mutex_lock(&mutex_);
+  while (idle_workers_.empty() && num_live_workers_ > 0)
+    g_cond_wait(&cond_, &mutex_);
+  if (idle_workers_.empty()) {
+    g_mutex_unlock(&mutex_);
+    LOG(ERROR) << "All the bspatch workers have been lost.";
+    return false;
+  }
+  const size_t index = idle_workers_.back();
+  idle_workers_.pop_back();
+  const Worker worker = workers_[index];
+  g_mutex_unlock(&mutex_);
+
+  PatchRequest request;
+  memset(&request, 0, sizeof(request));
+  request.src_length = src_length;
+  request.dst_length = dst_length;
+  request.patch_size = patch_size;
+  request.block_size = block_size;
+  request.num_src_extents = src_extents.size();
+  request.num_dst_extents = dst_extents.size();
+  vector<uint64_t> raw_extents;
+  AppendExtents(src_extents, &raw_extents);
+  AppendExtents(dst_extents, &raw_extents);
+  int32_t status = 0;
+  const bool served =
+      SendRequest(worker.fd, request, src_fd, fd) &&
+      (raw_extents.empty() ||
+       SendAll(worker.fd, &raw_extents[0],
+               raw_extents.size() * sizeof(uint64_t))) &&
+      SendAll(worker.fd, patch, patch_size) &&
+      RecvAll(worker.fd, &status, sizeof(status));
+
+  if (!served) {
+    // The worker crashed or is out of sync; it's not replaced, since forking
+    // now would copy a multithreaded process.
+    LOG(ERROR) << "Lost bspatch worker " << worker.pid << ".";
+    kill(worker.pid, SIGKILL);
+    HANDLE_EINTR(waitpid(worker.pid, NULL, 0));
+    close(worker.fd);
+  }
+  g_mutex_lock(&mutex_);
+  if (served) {
+    idle_workers_.push_back(index);
+  } else {
+    workers_[index].fd = -1;
+    num_live_workers_--;
+  }
+  g_cond_broadcast(&cond_);
+  g_mutex_unlock(&mutex_);
+  TEST_AND_RETURN_FALSE(served);
+  TEST_AND_RETURN_FALSE(status == 1);
+  return true;
+}
+
+}  // namespace chromeos_update_engine
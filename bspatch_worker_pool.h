@@ -0,0 +1,97 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_BSPATCH_WORKER_POOL_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_BSPATCH_WORKER_POOL_H__
+
+#include <sys/types.h>
+
+#include <vector>
+
+#include <base/basictypes.h>
+#include <glib.h>
+#include <google/protobuf/repeated_field.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+// A pool of long-lived processes that apply BSDIFF patches on behalf of
+// update_engine, so that a patch that crashes the patch engine only takes a
+// worker down. Each patch is sent to an idle worker over a socket, along with
+// the descriptors of the partitions to read and write as SCM_RIGHTS, and the
+// worker replies once it has written the new data. The workers are forked
+// once, so no process is started per operation, and patches run on as many
+// workers at once as there are threads asking for them.
+
+namespace chromeos_update_engine {
+
+class BspatchWorkerPool {
+ public:
+  // Starts the |num_workers| workers of the pool that Get() returns. This
+  // forks, so it must be called while the process has a single thread and
+  // a small address space, i.e., early in main(). Returns true on success.
+  static bool Init(unsigned num_workers);
+
+  // Returns the pool started by Init(), or NULL if there's none.
+  static BspatchWorkerPool* Get() { return pool_singleton_; }
+
+  // Stops the workers of the pool started by Init() and deletes it. No
+  // patch may be in progress.
+  static void Shutdown();
+
+  ~BspatchWorkerPool();
+
+  // Like BspatchExtents(), applies the BSDIFF |patch| of |patch_size| bytes
+  // to the first |src_length| bytes of |src_extents| in |src_fd|, but in a
+  // worker, which writes the |dst_length| bytes of new data, zero padded to
+  // whole blocks, to |dst_extents| in |fd|. Blocks until a worker is idle.
+  // Returns true on success.
+  bool Patch(int src_fd,
+             const google::protobuf::RepeatedPtrField<Extent>& src_extents,
+             uint64_t src_length,
+             int fd,
+             const google::protobuf::RepeatedPtrField<Extent>& dst_extents,
+             uint64_t dst_length,
+             uint32_t block_size,
+             const char* patch,
+             size_t patch_size);
+
+ private:
+  struct Worker {
+    pid_t pid;
+    // The parent's end of the socket to the worker, or -1 once the worker
+    // has been lost.
+    int fd;
+  };
+
+  BspatchWorkerPool();
+
+  // Forks a worker, adding it to |workers_|. Returns true on success.
+  bool StartWorker();
+
+  // The main loop of a worker forked by |parent|, serving the requests on
+  // |fd|. Never returns.
+  static void RunWorker(int fd, pid_t parent);
+
+  // Serves one request on |fd|. Returns false once the parent is gone.
+  static bool ServeRequest(int fd);
+
+  // The global instance.
+  static BspatchWorkerPool* pool_singleton_;
+
+  // Protects the members below.
+  GMutex mutex_;
+  // Signaled when a worker becomes idle or is lost.
+  GCond cond_;
+  std::vector<Worker> workers_;
+  // The indexes in |workers_| of the workers waiting for a request.
+  std::vector<size_t> idle_workers_;
+  // The number of workers that haven't been lost.
+  size_t num_live_workers_;
+
+  DISALLOW_COPY_AND_ASSIGN(BspatchWorkerPool);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_BSPATCH_WORKER_POOL_H__
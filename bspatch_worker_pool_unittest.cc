@@ -0,0 +1,117 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/bsdiff.h"
+#include "update_engine/bspatch_worker_pool.h"
+#include "update_engine/test_utils.h"
+#include "update_engine/utils.h"
+
+using google::protobuf::RepeatedPtrField;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+const char kPathTemplate[] = "./BspatchWorkerPoolTest-file.XXXXXX";
+const uint32_t kBlockSize = 4096;
+}  // namespace {}
+
+class BspatchWorkerPoolTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    memcpy(path_, kPathTemplate, sizeof(kPathTemplate));
+    fd_ = mkstemp(path_);
+    ASSERT_GE(fd_, 0);
+    ASSERT_TRUE(BspatchWorkerPool::Init(2));
+    ASSERT_TRUE(BspatchWorkerPool::Get());
+
+    // Two blocks of old data, and a patch to a modified copy of them with
+    // half a block more.
+    old_data_.resize(2 * kBlockSize);
+    FillWithData(&old_data_);
+    ASSERT_TRUE(utils::PWriteAll(fd_, &old_data_[0], old_data_.size(), 0));
+    new_data_ = old_data_;
+    new_data_[10] ^= 0xff;
+    new_data_.insert(new_data_.end(), kBlockSize / 2, 'x');
+    ASSERT_TRUE(BsdiffBuffers(old_data_, new_data_, NULL, &patch_));
+
+    Extent* extent = src_extents_.Add();
+    extent->set_start_block(0);
+    extent->set_num_blocks(2);
+    extent = dst_extents_.Add();
+    extent->set_start_block(2);
+    extent->set_num_blocks(3);
+  }
+
+  virtual void TearDown() {
+    BspatchWorkerPool::Shutdown();
+    EXPECT_FALSE(BspatchWorkerPool::Get());
+    close(fd_);
+    unlink(path_);
+  }
+
+  // Applies |patch| with the pool, from |src_extents_| to |dst_extents_|.
+  bool Patch(const vector<char>& patch) {
+    return BspatchWorkerPool::Get()->Patch(fd_, src_extents_,
+                                           old_data_.size(), fd_,
+                                           dst_extents_, new_data_.size(),
+                                           kBlockSize, &patch[0],
+                                           patch.size());
+  }
+
+  // Returns the new data written to |dst_extents_|, zero padded.
+  vector<char> NewData() {
+    vector<char> data(3 * kBlockSize);
+    ssize_t bytes_read = 0;
+    EXPECT_TRUE(utils::PReadAll(fd_, &data[0], data.size(), 2 * kBlockSize,
+                                &bytes_read));
+    EXPECT_EQ(static_cast<ssize_t>(data.size()), bytes_read);
+    return data;
+  }
+
+  int fd_;
+  char path_[sizeof(kPathTemplate)];
+  vector<char> old_data_;
+  vector<char> new_data_;
+  vector<char> patch_;
+  RepeatedPtrField<Extent> src_extents_;
+  RepeatedPtrField<Extent> dst_extents_;
+};
+
+TEST_F(BspatchWorkerPoolTest, PatchTest) {
+  vector<char> expected = new_data_;
+  expected.resize(3 * kBlockSize, 0);
+  // More patches than workers, so the workers are reused.
+  for (int i = 0; i < 3; i++) {
+    vector<char> junk(3 * kBlockSize, 'j');
+    ASSERT_TRUE(utils::PWriteAll(fd_, &junk[0], junk.size(),
+                                 2 * kBlockSize));
+    EXPECT_TRUE(Patch(patch_));
+    ExpectVectorsEq(expected, NewData());
+  }
+}
+
+TEST_F(BspatchWorkerPoolTest, CorruptPatchTest) {
+  vector<char> corrupt_patch = patch_;
+  corrupt_patch[0] = 'X';
+  EXPECT_FALSE(Patch(corrupt_patch));
+
+  // The worker that rejected the patch is still serving.
+  for (int i = 0; i < 3; i++) {
+    EXPECT_TRUE(Patch(patch_));
+  }
+  vector<char> expected = new_data_;
+  expected.resize(3 * kBlockSize, 0);
+  ExpectVectorsEq(expected, NewData());
+}
+
+}  // namespace chromeos_update_engine
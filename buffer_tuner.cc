@@ -0,0 +1,91 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/buffer_tuner.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <base/logging.h>
+#include <base/string_number_conversions.h>
+#include <base/string_split.h>
+
+#include "update_engine/utils.h"
+
+using base::TimeDelta;
+using std::max;
+using std::min;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+const size_t BufferTuner::kMinReadBufferSize = 16 * 1024;  // 16 KiB
+// libcurl's largest read buffer.
+const size_t BufferTuner::kMaxReadBufferSize = 512 * 1024;  // 512 KiB
+// About a 4 Gbps link with a 100 ms round-trip time.
+const uint64_t BufferTuner::kMaxReceiveBufferSize =
+    64 * 1024 * 1024;  // 64 MiB
+// Linux's default tcp_rmem maximum.
+const uint64_t BufferTuner::kDefaultAutotuneMaxSize = 6 * 1024 * 1024;
+
+namespace {
+// The share of the difference by which the estimate decays towards a
+// smaller sample.
+const double kDecayGain = 0.125;
+
+// The reads take about this share of the bandwidth-delay product, i.e., a
+// few of them per round trip.
+const double kReadShare = 0.125;
+}  // namespace {}
+
+BufferTuner::BufferTuner()
+    : autotune_max_size_(kDefaultAutotuneMaxSize),
+      fixed_receive_buffer_size_(0),
+      fixed_read_buffer_size_(0),
+      bandwidth_delay_product_(0) {}
+
+bool BufferTuner::LoadAutotuneMaxSize(const string& tcp_rmem_path) {
+  // The minimum, default and maximum sizes.
+  string contents;
+  TEST_AND_RETURN_FALSE(utils::ReadFile(tcp_rmem_path, &contents));
+  vector<string> fields;
+  base::SplitStringAlongWhitespace(contents, &fields);
+  uint64_t size = 0;
+  TEST_AND_RETURN_FALSE(fields.size() == 3 &&
+                        base::StringToUint64(fields[2], &size) &&
+                        size > 0);
+  autotune_max_size_ = size;
+  return true;
+}
+
+void BufferTuner::AddSample(TimeDelta rtt, double bytes_per_second) {
+  if (rtt <= TimeDelta() || bytes_per_second <= 0)
+    return;
+  const double sample = bytes_per_second * rtt.InSecondsF();
+  if (sample >= bandwidth_delay_product_) {
+    bandwidth_delay_product_ = sample;
+  } else {
+    bandwidth_delay_product_ -=
+        (bandwidth_delay_product_ - sample) * kDecayGain;
+  }
+}
+
+uint64_t BufferTuner::ReceiveBufferSize() const {
+  if (fixed_receive_buffer_size_ > 0)
+    return fixed_receive_buffer_size_;
+  const uint64_t size = min(static_cast<uint64_t>(2 * bandwidth_delay_product_),
+                            kMaxReceiveBufferSize);
+  return size > autotune_max_size_ ? size : 0;
+}
+
+size_t BufferTuner::ReadBufferSize() const {
+  if (fixed_read_buffer_size_ > 0)
+    return fixed_read_buffer_size_;
+  const size_t size =
+      static_cast<size_t>(bandwidth_delay_product_ * kReadShare);
+  return min(max(size, kMinReadBufferSize), kMaxReadBufferSize);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,84 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_BUFFER_TUNER_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_BUFFER_TUNER_H__
+
+#include <inttypes.h>
+
+#include <string>
+
+#include <base/basictypes.h>
+#include <base/time.h>
+
+// Sizes the buffers of the LibcurlHttpFetcher transfers for the
+// bandwidth-delay product of their connections, so that the transfers on
+// links with a long round-trip time and a high bandwidth aren't held back by
+// the TCP receive window or by small reads.
+//
+// The bandwidth-delay product is estimated from the round-trip time and
+// throughput of the transfers. It grows to a larger sample right away and
+// decays slowly towards smaller ones. The socket receive buffer is sized
+// for twice that, so that the window doesn't cap the throughput it's
+// measured from. It's only set when that's beyond the kernel's own
+// autotuning, since setting it turns the autotuning off. The reads from
+// libcurl, which are the chunks passed to the delegate, grow with it too.
+
+namespace chromeos_update_engine {
+
+class BufferTuner {
+ public:
+  // The bounds of the read buffer size, the smallest being libcurl's
+  // default, and of the receive buffer size, in bytes.
+  static const size_t kMinReadBufferSize;
+  static const size_t kMaxReadBufferSize;
+  static const uint64_t kMaxReceiveBufferSize;
+
+  // The largest receive buffer the kernel autotunes to by default.
+  static const uint64_t kDefaultAutotuneMaxSize;
+
+  BufferTuner();
+
+  // Reads the largest receive buffer the kernel autotunes to from
+  // |tcp_rmem_path|, e.g., /proc/sys/net/ipv4/tcp_rmem. Returns false, and
+  // keeps kDefaultAutotuneMaxSize, if it can't be read.
+  bool LoadAutotuneMaxSize(const std::string& tcp_rmem_path);
+
+  // Fixes the receive and read buffer sizes for environments whose links
+  // are known. 0, the default, sizes them automatically.
+  void set_fixed_receive_buffer_size(uint64_t size) {
+    fixed_receive_buffer_size_ = size;
+  }
+  void set_fixed_read_buffer_size(size_t size) {
+    fixed_read_buffer_size_ = size;
+  }
+
+  // Adds the round-trip time |rtt| and the throughput |bytes_per_second| of
+  // a transfer.
+  void AddSample(base::TimeDelta rtt, double bytes_per_second);
+
+  // Returns the receive buffer size for the next connections, or 0 to leave
+  // it to the kernel.
+  uint64_t ReceiveBufferSize() const;
+
+  // Returns the read buffer size for the next transfers.
+  size_t ReadBufferSize() const;
+
+  // Returns the estimated bandwidth-delay product, in bytes.
+  uint64_t bandwidth_delay_product() const {
+    return static_cast<uint64_t>(bandwidth_delay_product_);
+  }
+
+ private:
+  uint64_t autotune_max_size_;
+  uint64_t fixed_receive_buffer_size_;
+  size_t fixed_read_buffer_size_;
+  double bandwidth_delay_product_;
+
+  DISALLOW_COPY_AND_ASSIGN(BufferTuner);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_BUFFER_TUNER_H__
@@ -0,0 +1,85 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <string>
+
+#include <base/time.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/buffer_tuner.h"
+#include "update_engine/test_utils.h"
+#include "update_engine/utils.h"
+
+using base::TimeDelta;
+using std::string;
+
+namespace chromeos_update_engine {
+
+TEST(BufferTunerTest, DefaultTest) {
+  BufferTuner tuner;
+  EXPECT_EQ(0, tuner.ReceiveBufferSize());
+  EXPECT_EQ(BufferTuner::kMinReadBufferSize, tuner.ReadBufferSize());
+
+  // A link the kernel's autotuning copes with.
+  tuner.AddSample(TimeDelta::FromMilliseconds(20), 10 * 1024 * 1024);
+  EXPECT_EQ(0, tuner.ReceiveBufferSize());
+  EXPECT_EQ(26214, tuner.ReadBufferSize());
+  EXPECT_EQ(209715, tuner.bandwidth_delay_product());
+
+  // Invalid samples are ignored.
+  tuner.AddSample(TimeDelta(), 10 * 1024 * 1024);
+  tuner.AddSample(TimeDelta::FromMilliseconds(20), 0);
+  EXPECT_EQ(209715, tuner.bandwidth_delay_product());
+}
+
+TEST(BufferTunerTest, LongFatLinkTest) {
+  BufferTuner tuner;
+  // 80 MiB/s with a 100 ms round-trip time.
+  tuner.AddSample(TimeDelta::FromMilliseconds(100), 80 * 1024 * 1024);
+  EXPECT_EQ(8 * 1024 * 1024, tuner.bandwidth_delay_product());
+  EXPECT_EQ(16 * 1024 * 1024, tuner.ReceiveBufferSize());
+  EXPECT_EQ(BufferTuner::kMaxReadBufferSize, tuner.ReadBufferSize());
+
+  // The estimate decays slowly.
+  tuner.AddSample(TimeDelta::FromMilliseconds(100), 0.1);
+  EXPECT_EQ(7 * 1024 * 1024, tuner.bandwidth_delay_product());
+  for (int i = 0; i < 50; i++)
+    tuner.AddSample(TimeDelta::FromMilliseconds(100), 0.1);
+  EXPECT_EQ(0, tuner.ReceiveBufferSize());
+
+  // And grows right away.
+  tuner.AddSample(TimeDelta::FromMilliseconds(200), 1024 * 1024 * 1024);
+  EXPECT_EQ(BufferTuner::kMaxReceiveBufferSize, tuner.ReceiveBufferSize());
+}
+
+TEST(BufferTunerTest, FixedSizesTest) {
+  BufferTuner tuner;
+  tuner.set_fixed_receive_buffer_size(1024 * 1024);
+  tuner.set_fixed_read_buffer_size(64 * 1024);
+  EXPECT_EQ(1024 * 1024, tuner.ReceiveBufferSize());
+  EXPECT_EQ(64 * 1024, tuner.ReadBufferSize());
+  tuner.AddSample(TimeDelta::FromMilliseconds(100), 80 * 1024 * 1024);
+  EXPECT_EQ(1024 * 1024, tuner.ReceiveBufferSize());
+  EXPECT_EQ(64 * 1024, tuner.ReadBufferSize());
+}
+
+TEST(BufferTunerTest, AutotuneMaxSizeTest) {
+  string path;
+  ASSERT_TRUE(utils::MakeTempFile("/tmp/BufferTunerTest.XXXXXX", &path,
+                                  NULL));
+  ScopedPathUnlinker path_unlinker(path);
+  BufferTuner tuner;
+  EXPECT_TRUE(WriteFileString(path, "4096\t131072\t33554432\n"));
+  EXPECT_TRUE(tuner.LoadAutotuneMaxSize(path));
+  tuner.AddSample(TimeDelta::FromMilliseconds(100), 80 * 1024 * 1024);
+  EXPECT_EQ(0, tuner.ReceiveBufferSize());
+  tuner.AddSample(TimeDelta::FromMilliseconds(100), 200 * 1024 * 1024);
+  EXPECT_EQ(40 * 1024 * 1024, tuner.ReceiveBufferSize());
+
+  EXPECT_TRUE(WriteFileString(path, "4096 131072\n"));
+  EXPECT_FALSE(tuner.LoadAutotuneMaxSize(path));
+  EXPECT_FALSE(tuner.LoadAutotuneMaxSize(path + ".missing"));
+}
+
+}  // namespace chromeos_update_engine
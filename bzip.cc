@@ -88,6 +88,10 @@ bool BzipCompress(const std::vector<char>& in, std::vector<char>* out) {
   return BzipData<BzipBuffToBuffCompress>(&in[0], in.size(), out);
 }
 
+bool BzipCompressBytes(const char* in, size_t in_size, vector<char>* out) {
+  return BzipData<BzipBuffToBuffCompress>(in, in_size, out);
+}
+
 namespace {
 template<bool F(const char* const in,
                 const int32_t in_size,
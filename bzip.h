@@ -13,4 +13,7 @@ bool BzipCompress(const std::vector<char>& in, std::vector<char>* out);
 bool BzipCompressString(const std::string& str, std::vector<char>* out);
 bool BzipDecompressString(const std::string& str, std::vector<char>* out);
 
+// Bzip2 compresses the |in_size| bytes at |in| to out.
+bool BzipCompressBytes(const char* in, size_t in_size, std::vector<char>* out);
+
 }  // namespace chromeos_update_engine
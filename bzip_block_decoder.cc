@@ -0,0 +1,291 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/bzip_block_decoder.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <tr1/memory>
+#include <vector>
+
+#include <bzlib.h>
+
+#include "update_engine/utils.h"
+
+using std::max;
+using std::tr1::shared_ptr;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The magic numbers that start a block and end the stream. Both are
+// followed by a 32-bit CRC, of the block or of the whole stream.
+const uint64_t kBlockMagic = 0x314159265359ULL;
+const uint64_t kEndMagic = 0x177245385090ULL;
+const int kMagicBits = 48;
+const int kCrcBits = 32;
+
+// "BZh" and the block size digit, after which the first block starts.
+const size_t kStreamHeaderSize = 4;
+
+const size_t kOutputBufferLength = 1024 * 1024;
+
+// Returns the |count| bits of the |size| bytes at |data| from bit |offset|
+// on, the first one being the most significant. |count| is at most 57.
+uint64_t GetBits(const uint8_t* data, size_t size, uint64_t offset,
+                 int count) {
+  const size_t begin = offset / 8;
+  uint64_t window = 0;
+  for (size_t i = begin; i < begin + 8; i++)
+    window = (window << 8) | (i < size ? data[i] : 0);
+  return (window << (offset % 8)) >> (64 - count);
+}
+
+// Appends bits to a byte vector, the first one being the most significant.
+class BitWriter {
+ public:
+  explicit BitWriter(vector<char>* out) : out_(out), bits_(0), num_bits_(0) {}
+
+  // Appends the |count| low bits of |value|. |count| is at most 56.
+  void Put(uint64_t value, int count) {
+    bits_ = (bits_ << count) | (value & ((1ULL << count) - 1));
+    num_bits_ += count;
+    while (num_bits_ >= 8) {
+      num_bits_ -= 8;
+      out_->push_back(static_cast<char>(bits_ >> num_bits_));
+    }
+  }
+
+  // Pads the last byte with zeros.
+  void Flush() {
+    if (num_bits_ > 0)
+      out_->push_back(static_cast<char>(bits_ << (8 - num_bits_)));
+    num_bits_ = 0;
+  }
+
+ private:
+  vector<char>* out_;
+  uint64_t bits_;
+  int num_bits_;
+};
+
+// Finds the blocks of the bzip2 stream of |size| bytes at |data|. Stores the
+// bit offsets they start at in |starts|, and the one of the end of the
+// stream in |end|. Returns false if the stream isn't split that way, e.g.,
+// if it's followed by another stream.
+bool FindBlocks(const uint8_t* data, size_t size, vector<uint64_t>* starts,
+                uint64_t* end) {
+  if (size < kStreamHeaderSize + (kMagicBits + kCrcBits) / 8 ||
+      memcmp(data, "BZh", 3) != 0 || data[3] < '1' || data[3] > '9') {
+    return false;
+  }
+  // The end of stream marker and its CRC are padded to the last byte.
+  const uint64_t size_bits = static_cast<uint64_t>(size) * 8;
+  *end = 0;
+  for (int padding = 0; padding < 8; padding++) {
+    const uint64_t offset = size_bits - kMagicBits - kCrcBits - padding;
+    if (GetBits(data, size, offset, kMagicBits) == kEndMagic) {
+      *end = offset;
+      break;
+    }
+  }
+  if (*end < kStreamHeaderSize * 8)
+    return false;
+
+  // Each byte starts a 64-bit window in which the magic number is looked
+  // for at the 8 bit offsets that fall within the byte.
+  starts->clear();
+  uint64_t window = 0;
+  for (size_t i = kStreamHeaderSize; i < kStreamHeaderSize + 8; i++)
+    window = (window << 8) | (i < size ? data[i] : 0);
+  for (size_t i = kStreamHeaderSize; i * 8 + kMagicBits <= *end; i++) {
+    for (int shift = 0; shift < 8; shift++) {
+      const uint64_t offset = i * 8 + shift;
+      if (offset + kMagicBits > *end)
+        break;
+      if (((window << shift) >> (64 - kMagicBits)) == kBlockMagic)
+        starts->push_back(offset);
+    }
+    window = (window << 8) | (i + 8 < size ? data[i + 8] : 0);
+  }
+  return !starts->empty() && starts->front() == kStreamHeaderSize * 8;
+}
+
+// Makes |stream| a bzip2 stream of the block of the |size| bytes at |data|
+// from bit |begin| to bit |end|, with the header of the original stream.
+void MakeStream(const uint8_t* data, size_t size, uint64_t begin,
+                uint64_t end, vector<char>* stream) {
+  stream->clear();
+  stream->reserve((end - begin) / 8 + kStreamHeaderSize + 16);
+  stream->insert(stream->end(), data, data + kStreamHeaderSize);
+
+  // The block starts right after the header, so it's copied a whole byte at
+  // a time.
+  const size_t first = begin / 8;
+  const int shift = begin % 8;
+  const uint64_t length = end - begin;
+  for (uint64_t i = 0; i < length / 8; i++) {
+    unsigned byte = data[first + i] << shift;
+    if (shift)
+      byte |= data[first + i + 1] >> (8 - shift);
+    stream->push_back(static_cast<char>(byte));
+  }
+  BitWriter writer(stream);
+  const int rest = length % 8;
+  if (rest)
+    writer.Put(GetBits(data, size, end - rest, rest), rest);
+  // The CRC of a stream of a single block is the block's.
+  writer.Put(kEndMagic, kMagicBits);
+  writer.Put(GetBits(data, size, begin + kMagicBits, kCrcBits), kCrcBits);
+  writer.Flush();
+}
+
+// Decompresses the bzip2 stream |in| into |out|. Returns true on success.
+bool DecompressToVector(const vector<char>& in, vector<char>* out) {
+  bz_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  TEST_AND_RETURN_FALSE(BZ2_bzDecompressInit(&stream, 0, 0) == BZ_OK);
+  out->resize(max(in.size() * 4, kOutputBufferLength));
+  stream.next_in = const_cast<char*>(&in[0]);
+  stream.avail_in = in.size();
+  size_t produced = 0;
+  int rc = BZ_OK;
+  while (rc == BZ_OK) {
+    if (produced == out->size())
+      out->resize(out->size() * 2);
+    stream.next_out = &(*out)[produced];
+    stream.avail_out = out->size() - produced;
+    rc = BZ2_bzDecompress(&stream);
+    produced = out->size() - stream.avail_out;
+    // Running out of input before the end of the stream is an error.
+    if (rc == BZ_OK && stream.avail_in == 0 && stream.avail_out > 0)
+      rc = BZ_UNEXPECTED_EOF;
+  }
+  BZ2_bzDecompressEnd(&stream);
+  out->resize(produced);
+  return rc == BZ_STREAM_END && stream.avail_in == 0;
+}
+
+// Decompresses the bzip2 stream of |size| bytes at |data| to |writer| as it
+// goes. Returns true on success.
+bool DecompressToWriter(const char* data, size_t size, ExtentWriter* writer) {
+  bz_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  TEST_AND_RETURN_FALSE(BZ2_bzDecompressInit(&stream, 0, 0) == BZ_OK);
+  vector<char> buffer(kOutputBufferLength);
+  stream.next_in = const_cast<char*>(data);
+  stream.avail_in = size;
+  bool success = false;
+  for (;;) {
+    stream.next_out = &buffer[0];
+    stream.avail_out = buffer.size();
+    int rc = BZ2_bzDecompress(&stream);
+    if (rc != BZ_OK && rc != BZ_STREAM_END)
+      break;
+    const size_t produced = buffer.size() - stream.avail_out;
+    if (produced > 0 && !writer->Write(&buffer[0], produced))
+      break;
+    if (rc == BZ_STREAM_END) {
+      // Data past the end of the stream is an error.
+      success = stream.avail_in == 0;
+      break;
+    }
+    if (stream.avail_in == 0 && stream.avail_out > 0)
+      break;  // The stream is truncated.
+  }
+  BZ2_bzDecompressEnd(&stream);
+  return success;
+}
+
+// Decompresses a stream of blocks of the original one on a worker.
+class BzipBlockTask : public ThreadPoolTask {
+ public:
+  BzipBlockTask() {}
+
+  bool Run() { return DecompressToVector(stream_, &output_); }
+
+  vector<char>* mutable_stream() { return &stream_; }
+  const vector<char>& output() const { return output_; }
+
+ private:
+  vector<char> stream_;
+  vector<char> output_;
+
+  DISALLOW_COPY_AND_ASSIGN(BzipBlockTask);
+};
+
+}  // namespace {}
+
+bool BzipDecompressBlocks(const char* data,
+                          size_t size,
+                          ThreadPool* pool,
+                          ExtentWriter* writer) {
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+  vector<uint64_t> starts;
+  uint64_t end = 0;
+  if (!pool || pool->num_threads() < 2 ||
+      !FindBlocks(bytes, size, &starts, &end) || starts.size() < 2) {
+    return DecompressToWriter(data, size, writer);
+  }
+  const size_t num_blocks = starts.size();
+  starts.push_back(end);
+
+  // A couple of blocks per worker are decompressed ahead of the one that's
+  // written next, which bounds the memory used.
+  const size_t window = pool->num_threads() * 2;
+  vector<shared_ptr<BzipBlockTask> > tasks(num_blocks);
+  size_t next_submitted = 0;
+  size_t next_written = 0;
+  bool success = true;
+  while (next_written < num_blocks && success) {
+    for (; next_submitted < num_blocks &&
+             next_submitted < next_written + window; next_submitted++) {
+      shared_ptr<BzipBlockTask> task(new BzipBlockTask);
+      MakeStream(bytes, size, starts[next_submitted],
+                 starts[next_submitted + 1], task->mutable_stream());
+      pool->Submit(task.get());
+      tasks[next_submitted] = task;
+    }
+    shared_ptr<BzipBlockTask> task = tasks[next_written];
+    tasks[next_written].reset();
+    if (pool->Wait(task.get())) {
+      success = writer->Write(task->output().empty() ? NULL :
+                              &task->output()[0], task->output().size());
+      next_written++;
+      continue;
+    }
+    // The block was cut short by a magic number within it, so it's tried
+    // again along with the next ones until it's whole.
+    success = false;
+    for (size_t last = next_written + 1; last < num_blocks; last++) {
+      if (tasks[last].get()) {
+        pool->Wait(tasks[last].get());
+        tasks[last].reset();
+      }
+      vector<char> stream, output;
+      MakeStream(bytes, size, starts[next_written], starts[last + 1],
+                 &stream);
+      if (DecompressToVector(stream, &output)) {
+        success = writer->Write(output.empty() ? NULL : &output[0],
+                                output.size());
+        next_written = last + 1;
+        next_submitted = max(next_submitted, next_written);
+        break;
+      }
+    }
+    LOG_IF(ERROR, !success) << "Unable to decompress bzip2 block "
+                            << next_written;
+  }
+  // Tasks can't be freed while they're queued.
+  for (size_t i = 0; i < num_blocks; i++) {
+    if (tasks[i].get())
+      pool->Wait(tasks[i].get());
+  }
+  return success;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,34 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_BZIP_BLOCK_DECODER_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_BZIP_BLOCK_DECODER_H__
+
+#include <stddef.h>
+
+#include "update_engine/extent_writer.h"
+#include "update_engine/thread_pool.h"
+
+// A bzip2 stream is a sequence of blocks of up to 900 KB of input each, which
+// are compressed independently. They start at bit offsets marked by a 48-bit
+// magic number, so each one can be cut out of the stream, turned into a
+// stream of its own and decompressed on another core. The magic number may
+// also turn up by chance within a block; a block cut there fails its CRC
+// check and is decompressed again along with the next one.
+
+namespace chromeos_update_engine {
+
+// Decompresses the bzip2 stream of |size| bytes at |data| and passes the
+// decompressed data to |writer|, in order, decompressing its blocks on the
+// workers of |pool|. A stream that can't be split, e.g., because it has a
+// single block, is decompressed on the calling thread. Returns true on
+// success.
+bool BzipDecompressBlocks(const char* data,
+                          size_t size,
+                          ThreadPool* pool,
+                          ExtentWriter* writer);
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_BZIP_BLOCK_DECODER_H__
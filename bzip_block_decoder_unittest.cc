@@ -0,0 +1,101 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stdlib.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/bzip.h"
+#include "update_engine/bzip_block_decoder.h"
+#include "update_engine/test_utils.h"
+#include "update_engine/thread_pool.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Returns |size| bytes that compress to about half their size.
+vector<char> TestData(size_t size) {
+  vector<char> data(size);
+  unsigned int seed = 42;
+  for (size_t i = 0; i < size; i++)
+    data[i] = 'a' + rand_r(&seed) % 16;
+  return data;
+}
+
+}  // namespace {}
+
+class BzipBlockDecoderTest : public ::testing::Test {
+ protected:
+  BzipBlockDecoderTest() : pool_(4) {}
+
+  virtual void SetUp() {
+    ASSERT_TRUE(pool_.Init());
+  }
+
+  // Compresses |data|, decompresses it in blocks and checks it's the same.
+  void TestRoundTrip(const vector<char>& data) {
+    vector<char> compressed;
+    ASSERT_TRUE(BzipCompress(data, &compressed));
+    MemoryExtentWriter writer;
+    EXPECT_TRUE(BzipDecompressBlocks(&compressed[0], compressed.size(),
+                                     &pool_, &writer));
+    EXPECT_TRUE(data == writer.data());
+  }
+
+  ThreadPool pool_;
+};
+
+TEST_F(BzipBlockDecoderTest, SingleBlockTest) {
+  TestRoundTrip(TestData(1000));
+}
+
+TEST_F(BzipBlockDecoderTest, ManyBlocksTest) {
+  // Blocks hold up to 900 KB, so this makes more blocks than the workers
+  // decompress at once.
+  TestRoundTrip(TestData(10 * 1024 * 1024));
+}
+
+TEST_F(BzipBlockDecoderTest, RunsTest) {
+  // The blocks of long runs decompress to much more than 900 KB.
+  vector<char> data(20 * 1024 * 1024, 0);
+  vector<char> random = TestData(2 * 1024 * 1024);
+  for (size_t i = 0; i < random.size(); i++)
+    data[i * 10] = random[i];
+  TestRoundTrip(data);
+}
+
+TEST_F(BzipBlockDecoderTest, NoPoolTest) {
+  const vector<char> data = TestData(2 * 1024 * 1024);
+  vector<char> compressed;
+  ASSERT_TRUE(BzipCompress(data, &compressed));
+  MemoryExtentWriter writer;
+  EXPECT_TRUE(BzipDecompressBlocks(&compressed[0], compressed.size(), NULL,
+                                   &writer));
+  EXPECT_TRUE(data == writer.data());
+}
+
+TEST_F(BzipBlockDecoderTest, CorruptBlockTest) {
+  vector<char> compressed;
+  ASSERT_TRUE(BzipCompress(TestData(3 * 1024 * 1024), &compressed));
+  compressed[compressed.size() / 2] ^= 0x10;
+  MemoryExtentWriter writer;
+  EXPECT_FALSE(BzipDecompressBlocks(&compressed[0], compressed.size(),
+                                    &pool_, &writer));
+}
+
+TEST_F(BzipBlockDecoderTest, TruncatedTest) {
+  vector<char> compressed;
+  ASSERT_TRUE(BzipCompress(TestData(3 * 1024 * 1024), &compressed));
+  compressed.resize(compressed.size() - 100);
+  MemoryExtentWriter writer;
+  EXPECT_FALSE(BzipDecompressBlocks(&compressed[0], compressed.size(),
+                                    &pool_, &writer));
+}
+
+}  // namespace chromeos_update_engine
@@ -9,63 +9,78 @@ using std::vector;
 namespace chromeos_update_engine {
 
 namespace {
-const vector<char>::size_type kOutputBufferLength = 1024 * 1024;
+const size_t kOutputBufferLength = 1024 * 1024;
+const size_t kLowMemoryOutputBufferLength = 64 * 1024;
+}
+
+BzipExtentWriter::~BzipExtentWriter() {
+  if (stream_initialized_)
+    BZ2_bzDecompressEnd(&stream_);
+  if (output_buffer_)
+    output_pool_->Put(output_buffer_);
 }
 
 bool BzipExtentWriter::Init(int fd,
                             const vector<Extent>& extents,
                             uint32_t block_size) {
+  // A stream left behind by a failed operation is dropped.
+  if (stream_initialized_) {
+    BZ2_bzDecompressEnd(&stream_);
+    stream_initialized_ = false;
+  }
   // Init bzip2 stream
   int rc = BZ2_bzDecompressInit(&stream_,
                                 0,  // verbosity. (0 == silent)
-                                0  // 0 = faster algo, more memory
+                                low_memory_  // 0 = faster algo, more memory
                                 );
   TEST_AND_RETURN_FALSE(rc == BZ_OK);
+  stream_initialized_ = true;
+  AlignedBufferPool* pool = SharedBufferPool(
+      low_memory_ ? kLowMemoryOutputBufferLength : kOutputBufferLength);
+  if (pool != output_pool_ || !output_buffer_) {
+    if (output_buffer_)
+      output_pool_->Put(output_buffer_);
+    output_pool_ = pool;
+    output_buffer_ = output_pool_->Get();
+  }
+  TEST_AND_RETURN_FALSE(output_buffer_);
 
   return next_->Init(fd, extents, block_size);
 }
 
 bool BzipExtentWriter::Write(const void* bytes, size_t count) {
-  vector<char> output_buffer(kOutputBufferLength);
+  // The input is decompressed straight from |bytes|, and the output passed
+  // on every time the buffer fills up, so the memory used doesn't depend on
+  // the size of the data.
+  stream_.next_in = const_cast<char*>(reinterpret_cast<const char*>(bytes));
+  stream_.avail_in = count;
 
-  const char* c_bytes = reinterpret_cast<const char*>(bytes);
-
-  input_buffer_.insert(input_buffer_.end(), c_bytes, c_bytes + count);
-  
-  stream_.next_in = &input_buffer_[0];
-  stream_.avail_in = input_buffer_.size();
-  
   for (;;) {
-    stream_.next_out = &output_buffer[0];
-    stream_.avail_out = output_buffer.size();
+    stream_.next_out = output_buffer_;
+    stream_.avail_out = output_pool_->buffer_size();
 
     int rc = BZ2_bzDecompress(&stream_);
     TEST_AND_RETURN_FALSE(rc == BZ_OK || rc == BZ_STREAM_END);
-    
-    if (stream_.avail_out == output_buffer.size())
-      break;  // got no new bytes
-    
-    TEST_AND_RETURN_FALSE(
-        next_->Write(&output_buffer[0],
-                     output_buffer.size() - stream_.avail_out));
-    
-    if (rc == BZ_STREAM_END)
-      CHECK_EQ(stream_.avail_in, static_cast<unsigned int>(0));
-    if (stream_.avail_in == 0)
+
+    size_t produced = output_pool_->buffer_size() - stream_.avail_out;
+    if (produced > 0)
+      TEST_AND_RETURN_FALSE(next_->Write(output_buffer_, produced));
+
+    if (rc == BZ_STREAM_END) {
+      // Data past the end of the stream is an error.
+      TEST_AND_RETURN_FALSE(stream_.avail_in == 0);
+      break;
+    }
+    // A full buffer may leave decompressed data behind in the stream, so
+    // only stop once it's been drained.
+    if (stream_.avail_in == 0 && stream_.avail_out > 0)
       break;  // no more input to process
   }
-
-  // store unconsumed data in input_buffer_.
-  
-  vector<char> new_input_buffer(input_buffer_.end() - stream_.avail_in,
-                                input_buffer_.end());
-  new_input_buffer.swap(input_buffer_);
-  
   return true;
 }
 
 bool BzipExtentWriter::EndImpl() {
-  TEST_AND_RETURN_FALSE(input_buffer_.empty());
+  stream_initialized_ = false;
   TEST_AND_RETURN_FALSE(BZ2_bzDecompressEnd(&stream_) == BZ_OK);
   return next_->End();
 }
@@ -18,19 +18,39 @@ namespace chromeos_update_engine {
 
 class BzipExtentWriter : public ExtentWriter {
  public:
-  BzipExtentWriter(ExtentWriter* next) : next_(next) {
+  BzipExtentWriter(ExtentWriter* next)
+      : next_(next),
+        low_memory_(false),
+        stream_initialized_(false),
+        output_pool_(NULL),
+        output_buffer_(NULL) {
     memset(&stream_, 0, sizeof(stream_));
   }
-  ~BzipExtentWriter() {}
+  ~BzipExtentWriter();
 
   bool Init(int fd, const std::vector<Extent>& extents, uint32_t block_size);
   bool Write(const void* bytes, size_t count);
   bool EndImpl();
 
+  // Makes the writer decompress with libbz2's slower algorithm, which needs
+  // less than half the memory, and pass the output on in smaller pieces.
+  // Must be called before Init().
+  void set_low_memory(bool low_memory) { low_memory_ = low_memory; }
+
+  // Makes the writer pass its output to |next| from the next Init() on. The
+  // writer can be initialized again whether or not it was ended, and keeps
+  // its buffer, which comes from the shared buffer pools, from one stream to
+  // the next.
+  void Reset(ExtentWriter* next) { next_ = next; }
+
  private:
-  ExtentWriter* const next_;  // The underlying ExtentWriter.
+  ExtentWriter* next_;  // The underlying ExtentWriter.
+  bool low_memory_;
   bz_stream stream_;  // the libbz2 stream
-  std::vector<char> input_buffer_;
+  bool stream_initialized_;  // whether |stream_| has to be ended
+  // The fixed-size decompression window and the pool it's put back to.
+  AlignedBufferPool* output_pool_;
+  char* output_buffer_;
 };
 
 }  // namespace chromeos_update_engine
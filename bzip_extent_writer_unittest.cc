@@ -9,6 +9,7 @@
 #include <string>
 #include <vector>
 #include <gtest/gtest.h>
+#include "update_engine/bzip.h"
 #include "update_engine/bzip_extent_writer.h"
 #include "update_engine/test_utils.h"
 #include "update_engine/utils.h"
@@ -118,4 +119,99 @@ TEST_F(BzipExtentWriterTest, ChunkedTest) {
   unlink(kCompressedPath.c_str());
 }
 
+TEST_F(BzipExtentWriterTest, SingleWriteTest) {
+  // Compresses to a few bytes, all of which are decompressed by the one
+  // Write() call, several output buffers at a time.
+  const vector<char>::size_type kDecompressedLength = 8 * 1024 * 1024;
+
+  vector<Extent> extents;
+  Extent extent;
+  extent.set_start_block(0);
+  extent.set_num_blocks(kDecompressedLength / kBlockSize);
+  extents.push_back(extent);
+
+  vector<char> decompressed_data(kDecompressedLength, 'a');
+  vector<char> compressed_data;
+  EXPECT_TRUE(BzipCompress(decompressed_data, &compressed_data));
+
+  DirectExtentWriter direct_writer;
+  BzipExtentWriter bzip_writer(&direct_writer);
+  EXPECT_TRUE(bzip_writer.Init(fd(), extents, kBlockSize));
+  EXPECT_TRUE(bzip_writer.Write(&compressed_data[0], compressed_data.size()));
+  EXPECT_TRUE(bzip_writer.End());
+
+  vector<char> output(kDecompressedLength + 1);
+  ssize_t bytes_read = pread(fd(), &output[0], output.size(), 0);
+  EXPECT_EQ(kDecompressedLength, bytes_read);
+  output.resize(kDecompressedLength);
+  ExpectVectorsEq(decompressed_data, output);
+}
+
+TEST_F(BzipExtentWriterTest, LowMemoryTest) {
+  const vector<char>::size_type kDecompressedLength = 2048 * 1024;  // 2 MiB
+
+  vector<Extent> extents;
+  Extent extent;
+  extent.set_start_block(0);
+  extent.set_num_blocks(kDecompressedLength / kBlockSize);
+  extents.push_back(extent);
+
+  vector<char> decompressed_data(kDecompressedLength);
+  FillWithData(&decompressed_data);
+  vector<char> compressed_data;
+  EXPECT_TRUE(BzipCompress(decompressed_data, &compressed_data));
+
+  DirectExtentWriter direct_writer;
+  BzipExtentWriter bzip_writer(&direct_writer);
+  bzip_writer.set_low_memory(true);
+  EXPECT_TRUE(bzip_writer.Init(fd(), extents, kBlockSize));
+  EXPECT_TRUE(bzip_writer.Write(&compressed_data[0], compressed_data.size()));
+  EXPECT_TRUE(bzip_writer.End());
+
+  vector<char> output(kDecompressedLength + 1);
+  ssize_t bytes_read = pread(fd(), &output[0], output.size(), 0);
+  EXPECT_EQ(kDecompressedLength, bytes_read);
+  output.resize(kDecompressedLength);
+  ExpectVectorsEq(decompressed_data, output);
+}
+
+TEST_F(BzipExtentWriterTest, ReuseTest) {
+  const string kFirst = "first stream\n";
+  const string kSecond = "second stream\n";
+  vector<char> first, second;
+  EXPECT_TRUE(BzipCompressString(kFirst, &first));
+  EXPECT_TRUE(BzipCompressString(kSecond, &second));
+
+  vector<Extent> extents(1);
+  extents[0].set_num_blocks(1);
+
+  // A stream that fails part way doesn't keep the writer from decompressing
+  // the next one.
+  DirectExtentWriter failed_writer;
+  BzipExtentWriter bzip_writer(&failed_writer);
+  extents[0].set_start_block(0);
+  EXPECT_TRUE(bzip_writer.Init(fd(), extents, kBlockSize));
+  EXPECT_TRUE(bzip_writer.Write(&first[0], first.size() / 2));
+  EXPECT_TRUE(failed_writer.End());
+
+  DirectExtentWriter first_writer;
+  bzip_writer.Reset(&first_writer);
+  EXPECT_TRUE(bzip_writer.Init(fd(), extents, kBlockSize));
+  EXPECT_TRUE(bzip_writer.Write(&first[0], first.size()));
+  EXPECT_TRUE(bzip_writer.End());
+
+  DirectExtentWriter second_writer;
+  bzip_writer.Reset(&second_writer);
+  extents[0].set_start_block(1);
+  EXPECT_TRUE(bzip_writer.Init(fd(), extents, kBlockSize));
+  EXPECT_TRUE(bzip_writer.Write(&second[0], second.size()));
+  EXPECT_TRUE(bzip_writer.End());
+
+  char buf[kBlockSize];
+  EXPECT_EQ(kFirst.size(), pread(fd(), buf, kFirst.size(), 0));
+  EXPECT_EQ(kFirst, string(buf, kFirst.size()));
+  EXPECT_EQ(kSecond.size(), pread(fd(), buf, kSecond.size(), kBlockSize));
+  EXPECT_EQ(kSecond, string(buf, kSecond.size()));
+}
+
 }  // namespace chromeos_update_engine
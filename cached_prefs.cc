@@ -0,0 +1,236 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/cached_prefs.h"
+
+#include <base/logging.h>
+#include <base/string_number_conversions.h>
+#include <base/string_util.h>
+
+#include "update_engine/journal_prefs.h"
+#include "update_engine/prefs.h"
+#include "update_engine/utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The key holding the changes of a flush while they're being applied.
+const char kJournalKey[] = "cached-prefs-journal";
+
+// The journal lists the changes as JournalPrefs records, followed by
+// "end\n" so that one that was only partially written can be told apart.
+const char kJournalEnd[] = "end\n";
+
+}  // namespace {}
+
+CachedPrefs::CachedPrefs(PrefsInterface* store)
+    : store_(store),
+      num_dirty_(0),
+      flush_when_idle_(false),
+      flush_source_id_(0) {
+  g_mutex_init(&mutex_);
+}
+
+CachedPrefs::~CachedPrefs() {
+  if (flush_source_id_)
+    g_source_remove(flush_source_id_);
+  LOG_IF(ERROR, !Flush()) << "Unable to flush the cached prefs.";
+  g_mutex_clear(&mutex_);
+}
+
+bool CachedPrefs::Init() {
+  if (!store_->Exists(kJournalKey))
+    return true;
+  string journal;
+  TEST_AND_RETURN_FALSE(store_->GetString(kJournalKey, &journal));
+
+  // A journal that isn't complete hasn't been applied at all, so it's
+  // dropped. A complete one may have been applied partially.
+  EntryMap entries;
+  size_t pos = 0;
+  bool complete = false;
+  for (;;) {
+    if (journal.compare(pos, string::npos, kJournalEnd) == 0) {
+      complete = true;
+      break;
+    }
+    string key;
+    Entry entry;
+    if (!JournalPrefs::ParseRecord(journal, &pos, &key, &entry.exists,
+                                   &entry.value)) {
+      break;
+    }
+    entries[key] = entry;
+  }
+
+  if (complete) {
+    LOG(INFO) << "Completing an interrupted flush of " << entries.size()
+              << " prefs.";
+    TEST_AND_RETURN_FALSE(ApplyEntries(entries));
+  } else {
+    LOG(WARNING) << "Discarding an incomplete prefs journal.";
+  }
+  TEST_AND_RETURN_FALSE(store_->Delete(kJournalKey));
+  return true;
+}
+
+bool CachedPrefs::GetString(const string& key, string* value) {
+  g_mutex_lock(&mutex_);
+  Entry* entry = GetEntry(key);
+  const bool exists = entry && entry->exists;
+  if (exists)
+    *value = entry->value;
+  g_mutex_unlock(&mutex_);
+  return exists;
+}
+
+bool CachedPrefs::SetString(const string& key, const string& value) {
+  g_mutex_lock(&mutex_);
+  Entry* entry = GetEntry(key);
+  if (entry && !(entry->exists && entry->value == value)) {
+    entry->exists = true;
+    entry->value = value;
+    MarkDirty(entry);
+  }
+  g_mutex_unlock(&mutex_);
+  TEST_AND_RETURN_FALSE(entry);
+  return true;
+}
+
+bool CachedPrefs::GetInt64(const string& key, int64_t* value) {
+  string str_value;
+  if (!GetString(key, &str_value))
+    return false;
+  TrimWhitespaceASCII(str_value, TRIM_ALL, &str_value);
+  TEST_AND_RETURN_FALSE(base::StringToInt64(str_value, value));
+  return true;
+}
+
+bool CachedPrefs::SetInt64(const string& key, const int64_t value) {
+  return SetString(key, base::Int64ToString(value));
+}
+
+bool CachedPrefs::Exists(const string& key) {
+  g_mutex_lock(&mutex_);
+  Entry* entry = GetEntry(key);
+  const bool exists = entry && entry->exists;
+  g_mutex_unlock(&mutex_);
+  return exists;
+}
+
+bool CachedPrefs::Delete(const string& key) {
+  g_mutex_lock(&mutex_);
+  Entry* entry = GetEntry(key);
+  if (entry && entry->exists) {
+    entry->exists = false;
+    entry->value.clear();
+    MarkDirty(entry);
+  }
+  g_mutex_unlock(&mutex_);
+  TEST_AND_RETURN_FALSE(entry);
+  return true;
+}
+
+bool CachedPrefs::Flush() {
+  g_mutex_lock(&mutex_);
+  const bool success = FlushLocked();
+  g_mutex_unlock(&mutex_);
+  return success;
+}
+
+bool CachedPrefs::FlushLocked() {
+  if (num_dirty_ == 0)
+    return true;
+  EntryMap dirty;
+  for (EntryMap::const_iterator it = entries_.begin(); it != entries_.end();
+       ++it) {
+    if (it->second.dirty)
+      dirty.insert(*it);
+  }
+
+  if (store_->BeginTransaction()) {
+    if (!ApplyEntries(dirty)) {
+      store_->AbortTransaction();
+      return false;
+    }
+    TEST_AND_RETURN_FALSE(store_->CommitTransaction());
+  } else {
+    TEST_AND_RETURN_FALSE(FlushWithJournal(dirty));
+  }
+
+  for (EntryMap::iterator it = entries_.begin(); it != entries_.end(); ++it)
+    it->second.dirty = false;
+  num_dirty_ = 0;
+  return true;
+}
+
+CachedPrefs::Entry* CachedPrefs::GetEntry(const string& key) {
+  EntryMap::iterator it = entries_.find(key);
+  if (it != entries_.end())
+    return &it->second;
+  if (!Prefs::IsValidKey(key)) {
+    LOG(ERROR) << "Invalid prefs key: " << key;
+    return NULL;
+  }
+  Entry* entry = &entries_[key];
+  entry->exists = store_->GetString(key, &entry->value);
+  return entry;
+}
+
+void CachedPrefs::MarkDirty(Entry* entry) {
+  if (!entry->dirty) {
+    entry->dirty = true;
+    num_dirty_++;
+  }
+  if (flush_when_idle_ && !flush_source_id_)
+    flush_source_id_ = g_idle_add(&CachedPrefs::StaticFlush, this);
+}
+
+bool CachedPrefs::FlushWithJournal(const EntryMap& entries) {
+  // A single change is written as is, as that's no less atomic than
+  // writing the journal.
+  if (entries.size() == 1)
+    return ApplyEntries(entries);
+  string journal;
+  for (EntryMap::const_iterator it = entries.begin(); it != entries.end();
+       ++it) {
+    if (it->second.exists)
+      JournalPrefs::AppendSetRecord(it->first, it->second.value, &journal);
+    else
+      JournalPrefs::AppendDeleteRecord(it->first, &journal);
+  }
+  journal += kJournalEnd;
+  TEST_AND_RETURN_FALSE(store_->SetString(kJournalKey, journal));
+  // On failure the journal is left behind for Init() to apply. The changes
+  // stay dirty, so the next flush writes a new journal covering them.
+  TEST_AND_RETURN_FALSE(ApplyEntries(entries));
+  TEST_AND_RETURN_FALSE(store_->Delete(kJournalKey));
+  return true;
+}
+
+bool CachedPrefs::ApplyEntries(const EntryMap& entries) {
+  for (EntryMap::const_iterator it = entries.begin(); it != entries.end();
+       ++it) {
+    if (it->second.exists)
+      TEST_AND_RETURN_FALSE(store_->SetString(it->first, it->second.value));
+    else
+      TEST_AND_RETURN_FALSE(store_->Delete(it->first));
+  }
+  return true;
+}
+
+gboolean CachedPrefs::StaticFlush(gpointer data) {
+  CachedPrefs* prefs = reinterpret_cast<CachedPrefs*>(data);
+  g_mutex_lock(&prefs->mutex_);
+  prefs->flush_source_id_ = 0;
+  const bool success = prefs->FlushLocked();
+  g_mutex_unlock(&prefs->mutex_);
+  LOG_IF(ERROR, !success) << "Unable to flush the cached prefs.";
+  return FALSE;
+}
+
+}  // namespace chromeos_update_engine
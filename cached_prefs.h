@@ -0,0 +1,112 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_CACHED_PREFS_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_CACHED_PREFS_H__
+
+#include <glib.h>
+
+#include <map>
+#include <string>
+
+#include <base/basictypes.h>
+
+#include "update_engine/prefs_interface.h"
+
+// A write-back cache in front of another preference store, typically a
+// Prefs. Values are kept in memory once read or written, so reads don't
+// touch the file system after the first one, and writes are collected until
+// Flush(). A flush applies the collected changes in a transaction if the
+// store supports them. Otherwise it first writes them to a journal in the
+// store and only then applies them, so a crash in the middle of it is
+// recovered by Init() replaying the journal: the store always ends up with
+// the values as of some flush, never a mix of two. The cache may be used
+// from several threads, e.g., by the DeltaPerformer applying the payload on
+// its own thread.
+
+namespace chromeos_update_engine {
+
+class CachedPrefs : public PrefsInterface {
+ public:
+  // |store| isn't owned and must outlive this object.
+  explicit CachedPrefs(PrefsInterface* store);
+
+  // Flushes any changes still pending.
+  virtual ~CachedPrefs();
+
+  // Completes the flush that was interrupted last time, if any. Must be
+  // called before any other method. Returns true on success.
+  bool Init();
+
+  // If |flush_when_idle| is true, changes are flushed from the glib main
+  // loop once it's idle, so that the changes made while handling an event
+  // are flushed together. Off by default.
+  void set_flush_when_idle(bool flush_when_idle) {
+    flush_when_idle_ = flush_when_idle;
+  }
+
+  // PrefsInterface methods.
+  bool GetString(const std::string& key, std::string* value);
+  bool SetString(const std::string& key, const std::string& value);
+  bool GetInt64(const std::string& key, int64_t* value);
+  bool SetInt64(const std::string& key, const int64_t value);
+
+  bool Exists(const std::string& key);
+  bool Delete(const std::string& key);
+
+  // Writes the changes made since the last flush to the store. Returns true
+  // on success; on failure the changes stay pending.
+  bool Flush();
+
+ private:
+  // The cached state of a key. |exists| is false if the key isn't in the
+  // store, or has been deleted since the last flush.
+  struct Entry {
+    Entry() : exists(false), dirty(false) {}
+    bool exists;
+    std::string value;
+    // True if the entry has changed since the last flush.
+    bool dirty;
+  };
+  typedef std::map<std::string, Entry> EntryMap;
+
+  // Returns the cached entry for |key|, reading it from the store first if
+  // needed. Returns NULL if |key| isn't a valid Prefs key. Called with
+  // |mutex_| held, like the methods below.
+  Entry* GetEntry(const std::string& key);
+
+  // Marks |entry| dirty and schedules a flush if flushing when idle.
+  void MarkDirty(Entry* entry);
+
+  // Applies |entries| to the store through the journal. Returns true on
+  // success.
+  bool FlushWithJournal(const EntryMap& entries);
+
+  // Sets the values of the keys in |entries| in the store, or deletes them
+  // if they don't exist. Returns true on success.
+  bool ApplyEntries(const EntryMap& entries);
+
+  // Flush() with |mutex_| held.
+  bool FlushLocked();
+
+  static gboolean StaticFlush(gpointer data);
+
+  // Guards the members below, and the store.
+  GMutex mutex_;
+
+  PrefsInterface* store_;
+  EntryMap entries_;
+  // The number of dirty entries in |entries_|.
+  size_t num_dirty_;
+
+  bool flush_when_idle_;
+  // The idle source flushing the changes, or 0 if none is scheduled.
+  guint flush_source_id_;
+
+  DISALLOW_COPY_AND_ASSIGN(CachedPrefs);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_CACHED_PREFS_H__
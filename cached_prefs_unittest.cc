@@ -0,0 +1,154 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <map>
+#include <string>
+#include <gtest/gtest.h>
+#include "update_engine/cached_prefs.h"
+
+using std::map;
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+const char kJournalKey[] = "cached-prefs-journal";
+
+// An in-memory store that counts the reads and can be made to fail writes.
+class FakePrefsStore : public PrefsInterface {
+ public:
+  FakePrefsStore() : num_reads_(0), writes_left_(-1) {}
+
+  bool GetString(const string& key, string* value) {
+    num_reads_++;
+    map<string, string>::const_iterator it = values_.find(key);
+    if (it == values_.end())
+      return false;
+    *value = it->second;
+    return true;
+  }
+  bool SetString(const string& key, const string& value) {
+    if (!Write())
+      return false;
+    values_[key] = value;
+    return true;
+  }
+  bool GetInt64(const string& key, int64_t* value) { return false; }
+  bool SetInt64(const string& key, const int64_t value) { return false; }
+  bool Exists(const string& key) {
+    num_reads_++;
+    return values_.count(key) > 0;
+  }
+  bool Delete(const string& key) {
+    if (!Write())
+      return false;
+    values_.erase(key);
+    return true;
+  }
+
+  map<string, string> values_;
+  int num_reads_;
+  // The number of writes that succeed before they start failing, or -1.
+  int writes_left_;
+
+ private:
+  bool Write() {
+    if (writes_left_ == 0)
+      return false;
+    if (writes_left_ > 0)
+      writes_left_--;
+    return true;
+  }
+};
+}  // namespace {}
+
+TEST(CachedPrefsTest, ReadsAreCachedTest) {
+  FakePrefsStore store;
+  store.values_["a"] = "aaa";
+  store.values_["b"] = " 42\n";
+  CachedPrefs prefs(&store);
+  EXPECT_TRUE(prefs.Init());
+  const int kInitReads = store.num_reads_;
+  string value;
+  int64_t int_value = 0;
+  for (int i = 0; i < 3; i++) {
+    EXPECT_TRUE(prefs.GetString("a", &value));
+    EXPECT_EQ("aaa", value);
+    EXPECT_TRUE(prefs.GetInt64("b", &int_value));
+    EXPECT_EQ(42, int_value);
+    EXPECT_FALSE(prefs.Exists("c"));
+    EXPECT_FALSE(prefs.GetString("c", &value));
+  }
+  EXPECT_EQ(kInitReads + 3, store.num_reads_);
+  EXPECT_FALSE(prefs.GetString("bad key", &value));
+  EXPECT_FALSE(prefs.SetString("", "x"));
+}
+
+TEST(CachedPrefsTest, WriteBackTest) {
+  FakePrefsStore store;
+  store.values_["a"] = "aaa";
+  store.values_["b"] = "bbb";
+  CachedPrefs prefs(&store);
+  EXPECT_TRUE(prefs.Init());
+  EXPECT_TRUE(prefs.SetString("a", "new"));
+  EXPECT_TRUE(prefs.SetInt64("c", -5));
+  EXPECT_TRUE(prefs.Delete("b"));
+  // Deleting or setting what's there already isn't a change.
+  EXPECT_TRUE(prefs.Delete("d"));
+  EXPECT_TRUE(prefs.SetString("a", "new"));
+
+  string value;
+  EXPECT_TRUE(prefs.GetString("a", &value));
+  EXPECT_EQ("new", value);
+  EXPECT_FALSE(prefs.Exists("b"));
+  EXPECT_EQ("aaa", store.values_["a"]);
+  EXPECT_EQ(1U, store.values_.count("b"));
+
+  EXPECT_TRUE(prefs.Flush());
+  EXPECT_EQ(2U, store.values_.size());
+  EXPECT_EQ("new", store.values_["a"]);
+  EXPECT_EQ("-5", store.values_["c"]);
+
+  // Nothing is written if nothing has changed.
+  store.writes_left_ = 0;
+  EXPECT_TRUE(prefs.Flush());
+}
+
+TEST(CachedPrefsTest, InterruptedFlushTest) {
+  FakePrefsStore store;
+  store.values_["a"] = "old";
+  {
+    CachedPrefs prefs(&store);
+    EXPECT_TRUE(prefs.Init());
+    EXPECT_TRUE(prefs.SetString("a", "new a"));
+    EXPECT_TRUE(prefs.SetString("b", string("new\nb \0", 7)));
+    EXPECT_TRUE(prefs.Delete("a"));
+    EXPECT_TRUE(prefs.SetString("c", ""));
+    // Only the journal and the first change make it to the store.
+    store.writes_left_ = 2;
+    EXPECT_FALSE(prefs.Flush());
+    EXPECT_EQ(1U, store.values_.count(kJournalKey));
+    EXPECT_EQ(0U, store.values_.count("a"));
+    EXPECT_EQ(0U, store.values_.count("b"));
+  }
+
+  store.writes_left_ = -1;
+  CachedPrefs prefs(&store);
+  EXPECT_TRUE(prefs.Init());
+  EXPECT_EQ(2U, store.values_.size());
+  EXPECT_EQ(string("new\nb \0", 7), store.values_["b"]);
+  EXPECT_EQ("", store.values_["c"]);
+}
+
+TEST(CachedPrefsTest, IncompleteJournalTest) {
+  FakePrefsStore store;
+  store.values_["a"] = "old";
+  store.values_[kJournalKey] = "set a 3\nnew\ndelete b\n";
+  CachedPrefs prefs(&store);
+  EXPECT_TRUE(prefs.Init());
+  EXPECT_EQ(1U, store.values_.size());
+  EXPECT_EQ("old", store.values_["a"]);
+}
+
+}  // namespace chromeos_update_engine
@@ -4,6 +4,7 @@
 
 #include "update_engine/certificate_checker.h"
 
+#include <map>
 #include <string>
 
 #include <base/string_number_conversions.h>
@@ -17,6 +18,7 @@
 #include "update_engine/prefs_interface.h"
 #include "update_engine/utils.h"
 
+using std::map;
 using std::string;
 
 namespace chromeos_update_engine {
@@ -27,6 +29,13 @@ namespace {
 static const char* kReportToSendKey[2] =
     {kPrefsCertificateReportToSendUpdate,
      kPrefsCertificateReportToSendDownload};
+
+// The digests known to be in the prefs, keyed by their storage key, so the
+// certificates of every handshake after the first are checked in memory.
+map<string, string>* KnownDigests() {
+  static map<string, string>* digests = new map<string, string>;
+  return digests;
+}
 }  // namespace {}
 
 bool OpenSSLWrapper::GetCertificateDigest(X509_STORE_CTX* x509_ctx,
@@ -55,6 +64,12 @@ SystemState* CertificateChecker::system_state_ = NULL;
 // static
 OpenSSLWrapper* CertificateChecker::openssl_wrapper_ = NULL;
 
+// static
+void CertificateChecker::set_system_state(SystemState* system_state) {
+  system_state_ = system_state;
+  KnownDigests()->clear();
+}
+
 // static
 CURLcode CertificateChecker::ProcessSSLContext(CURL* curl_handle,
                                                SSL_CTX* ssl_ctx,
@@ -136,12 +151,20 @@ bool CertificateChecker::CheckCertificateChange(
                                     kPrefsUpdateServerCertificate,
                                     server_to_check,
                                     depth);
+  map<string, string>::const_iterator known =
+      KnownDigests()->find(storage_key);
+  if (known != KnownDigests()->end() && known->second == digest_string)
+    return true;
+
   string stored_digest;
   // If there's no stored certificate, we just store the current one and return.
   if (!system_state_->prefs()->GetString(storage_key, &stored_digest)) {
-    LOG_IF(WARNING, !system_state_->prefs()->SetString(storage_key,
-                                                       digest_string))
-        << "Failed to store server certificate on storage key " << storage_key;
+    if (system_state_->prefs()->SetString(storage_key, digest_string)) {
+      (*KnownDigests())[storage_key] = digest_string;
+    } else {
+      LOG(WARNING) << "Failed to store server certificate on storage key "
+                   << storage_key;
+    }
     return true;
   }
 
@@ -152,10 +175,13 @@ bool CertificateChecker::CheckCertificateChange(
         kReportToSendKey[server_to_check], kUMAActionCertChanged))
         << "Failed to store UMA report on a change on the "
         << "certificate from update server.";
-    LOG_IF(WARNING, !system_state_->prefs()->SetString(storage_key,
-                                                       digest_string))
-        << "Failed to store server certificate on storage key " << storage_key;
+    if (!system_state_->prefs()->SetString(storage_key, digest_string)) {
+      LOG(WARNING) << "Failed to store server certificate on storage key "
+                   << storage_key;
+      return true;
+    }
   }
+  (*KnownDigests())[storage_key] = digest_string;
 
   // Since we don't perform actual SSL verification, we return success.
   return true;
@@ -69,10 +69,9 @@ class CertificateChecker {
   // Flushes to UMA any certificate-related report that was persisted.
   static void FlushReport();
 
-  // Setters.
-  static void set_system_state(SystemState* system_state) {
-    system_state_ = system_state;
-  }
+  // Setters. Setting the system state drops the digests known to be in its
+  // prefs.
+  static void set_system_state(SystemState* system_state);
 
   static void set_openssl_wrapper(OpenSSLWrapper* openssl_wrapper) {
     openssl_wrapper_ = openssl_wrapper;
@@ -85,6 +84,7 @@ class CertificateChecker {
   FRIEND_TEST(CertificateCheckerTest, FailedCertificate);
   FRIEND_TEST(CertificateCheckerTest, FlushReport);
   FRIEND_TEST(CertificateCheckerTest, FlushNothingToReport);
+  FRIEND_TEST(CertificateCheckerTest, KnownCertificate);
 
   // These callbacks are called by openssl after initial SSL verification. They
   // are used to perform any additional security verification on the connection,
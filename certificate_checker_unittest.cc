@@ -122,6 +122,37 @@ TEST_F(CertificateCheckerTest, ChangedCertificate) {
       server_to_check_, 1, NULL));
 }
 
+// check certificate change, known from a previous check
+TEST_F(CertificateCheckerTest, KnownCertificate) {
+  EXPECT_CALL(openssl_wrapper_, GetCertificateDigest(NULL, _, _, _))
+      .Times(3)
+      .WillRepeatedly(DoAll(
+          SetArgumentPointee<1>(depth_),
+          SetArgumentPointee<2>(length_),
+          SetArrayArgument<3>(digest_, digest_ + 4),
+          Return(true)));
+  // Only the first check reads the stored digest.
+  EXPECT_CALL(*prefs_, GetString(cert_key_, _))
+      .WillOnce(DoAll(
+          SetArgumentPointee<1>(digest_hex_),
+          Return(true)));
+  EXPECT_CALL(*prefs_, SetString(_, _)).Times(0);
+  ASSERT_TRUE(CertificateChecker::CheckCertificateChange(
+      server_to_check_, 1, NULL));
+  ASSERT_TRUE(CertificateChecker::CheckCertificateChange(
+      server_to_check_, 1, NULL));
+
+  // A new system state may have other prefs.
+  CertificateChecker::set_system_state(&mock_system_state_);
+  EXPECT_CALL(*prefs_, GetString(cert_key_, _))
+      .WillOnce(Return(false))
+      .RetiresOnSaturation();
+  EXPECT_CALL(*prefs_, SetString(cert_key_, digest_hex_))
+      .WillOnce(Return(true));
+  ASSERT_TRUE(CertificateChecker::CheckCertificateChange(
+      server_to_check_, 1, NULL));
+}
+
 // check certificate change, failed
 TEST_F(CertificateCheckerTest, FailedCertificate) {
   EXPECT_CALL(*prefs_, SetString(kPrefsCertificateReportToSendUpdate,
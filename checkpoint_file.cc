@@ -0,0 +1,240 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/checkpoint_file.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+
+#include "update_engine/io_stats.h"
+#include "update_engine/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+const size_t CheckpointFile::kRecordSize = 512;
+const size_t CheckpointFile::kFileSize = 4096;
+
+namespace {
+
+const uint32_t kRecordMagic = 0x4b435545;  // "UECK"
+const uint32_t kRecordVersion = 1;
+
+// The room for each hash context. A SHA256_CTX is 112 bytes.
+const size_t kMaxContextSize = 128;
+
+// The layout of the record, in host byte order.
+const size_t kMagicOffset = 0;
+const size_t kVersionOffset = 4;
+const size_t kNextOperationOffset = 8;
+const size_t kNextDataOffsetOffset = 16;
+const size_t kHashContextSizeOffset = 24;
+const size_t kSignedHashContextSizeOffset = 28;
+const size_t kHashContextOffset = 32;
+const size_t kSignedHashContextOffset = kHashContextOffset + kMaxContextSize;
+const size_t kCrcOffset = kSignedHashContextOffset + kMaxContextSize;
+
+// The payload metadata follows the record area, after a header. The CRC
+// covers the header past itself, and the metadata.
+const uint32_t kMetadataMagic = 0x4d435545;  // "UECM"
+const size_t kMetadataHeaderSize = 128;
+const size_t kMetadataMagicOffset = 0;
+const size_t kMetadataCrcOffset = 4;
+const size_t kMetadataSizeOffset = 8;
+const size_t kMetadataTagSizeOffset = 16;
+const size_t kMetadataTagOffset = 20;
+const size_t kMaxTagSize = kMetadataHeaderSize - kMetadataTagOffset;
+
+// Larger metadata isn't kept, nor read back.
+const uint64_t kMaxMetadataSize = 64 * 1024 * 1024;
+
+template<typename T>
+void Put(char* record, size_t offset, T value) {
+  memcpy(record + offset, &value, sizeof(value));
+}
+
+template<typename T>
+T Get(const char* record, size_t offset) {
+  T value;
+  memcpy(&value, record + offset, sizeof(value));
+  return value;
+}
+
+uint32_t RecordCrc(const char* record) {
+  return crc32(0, reinterpret_cast<const Bytef*>(record), kCrcOffset);
+}
+
+uint32_t MetadataCrc(const char* header_and_metadata, size_t size) {
+  return crc32(0, reinterpret_cast<const Bytef*>(header_and_metadata +
+                                                 kMetadataSizeOffset),
+               kMetadataHeaderSize - kMetadataSizeOffset + size);
+}
+
+}  // namespace {}
+
+CheckpointFile::CheckpointFile(const string& path)
+    : path_(path), fd_(-1), cleared_(false) {}
+
+CheckpointFile::~CheckpointFile() {
+  if (fd_ >= 0)
+    HANDLE_EINTR(close(fd_));
+}
+
+bool CheckpointFile::Open() {
+  if (fd_ >= 0)
+    return true;
+  fd_ = HANDLE_EINTR(open(path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600));
+  TEST_AND_RETURN_FALSE_ERRNO(fd_ >= 0);
+  // The blocks of the record are allocated once, so that a checkpoint only
+  // has to sync its data.
+  struct stat stbuf;
+  if (fstat(fd_, &stbuf) == 0 &&
+      stbuf.st_size >= static_cast<off_t>(kFileSize)) {
+    return true;
+  }
+  int err = posix_fallocate(fd_, 0, kFileSize);
+  if (err != 0 || HANDLE_EINTR(fsync(fd_)) != 0) {
+    errno = err ? err : errno;
+    PLOG(ERROR) << "Unable to preallocate " << path_;
+    HANDLE_EINTR(close(fd_));
+    fd_ = -1;
+    return false;
+  }
+  return true;
+}
+
+bool CheckpointFile::WriteRecord(const char* record) {
+  TEST_AND_RETURN_FALSE(Open());
+  TEST_AND_RETURN_FALSE(utils::PWriteAll(fd_, record, kRecordSize, 0));
+  ScopedIoSync sync("checkpoint");
+  TEST_AND_RETURN_FALSE_ERRNO(HANDLE_EINTR(fdatasync(fd_)) == 0);
+  return true;
+}
+
+bool CheckpointFile::Write(const UpdateCheckpoint& checkpoint) {
+  TEST_AND_RETURN_FALSE(checkpoint.hash_context.size() <= kMaxContextSize);
+  TEST_AND_RETURN_FALSE(
+      checkpoint.signed_hash_context.size() <= kMaxContextSize);
+  char record[kRecordSize];
+  memset(record, 0, sizeof(record));
+  Put<uint32_t>(record, kMagicOffset, kRecordMagic);
+  Put<uint32_t>(record, kVersionOffset, kRecordVersion);
+  Put<int64_t>(record, kNextOperationOffset, checkpoint.next_operation);
+  Put<int64_t>(record, kNextDataOffsetOffset, checkpoint.next_data_offset);
+  Put<uint32_t>(record, kHashContextSizeOffset,
+                checkpoint.hash_context.size());
+  Put<uint32_t>(record, kSignedHashContextSizeOffset,
+                checkpoint.signed_hash_context.size());
+  memcpy(record + kHashContextOffset, checkpoint.hash_context.data(),
+         checkpoint.hash_context.size());
+  memcpy(record + kSignedHashContextOffset,
+         checkpoint.signed_hash_context.data(),
+         checkpoint.signed_hash_context.size());
+  Put<uint32_t>(record, kCrcOffset, RecordCrc(record));
+  cleared_ = false;
+  return WriteRecord(record);
+}
+
+bool CheckpointFile::Read(UpdateCheckpoint* checkpoint) {
+  if (fd_ < 0 && !utils::FileExists(path_.c_str()))
+    return false;
+  TEST_AND_RETURN_FALSE(Open());
+  char record[kRecordSize];
+  ssize_t bytes_read = 0;
+  TEST_AND_RETURN_FALSE(utils::PReadAll(fd_, record, kRecordSize, 0,
+                                        &bytes_read));
+  if (bytes_read != static_cast<ssize_t>(kRecordSize) ||
+      Get<uint32_t>(record, kMagicOffset) != kRecordMagic) {
+    return false;
+  }
+  TEST_AND_RETURN_FALSE(Get<uint32_t>(record, kVersionOffset) ==
+                        kRecordVersion);
+  TEST_AND_RETURN_FALSE(Get<uint32_t>(record, kCrcOffset) ==
+                        RecordCrc(record));
+  const uint32_t hash_context_size =
+      Get<uint32_t>(record, kHashContextSizeOffset);
+  const uint32_t signed_hash_context_size =
+      Get<uint32_t>(record, kSignedHashContextSizeOffset);
+  TEST_AND_RETURN_FALSE(hash_context_size <= kMaxContextSize &&
+                        signed_hash_context_size <= kMaxContextSize);
+  checkpoint->next_operation = Get<int64_t>(record, kNextOperationOffset);
+  checkpoint->next_data_offset = Get<int64_t>(record, kNextDataOffsetOffset);
+  checkpoint->hash_context.assign(record + kHashContextOffset,
+                                  hash_context_size);
+  checkpoint->signed_hash_context.assign(record + kSignedHashContextOffset,
+                                         signed_hash_context_size);
+  return true;
+}
+
+bool CheckpointFile::Clear() {
+  if (cleared_ || (fd_ < 0 && !utils::FileExists(path_.c_str())))
+    return true;
+  char record[kRecordSize];
+  memset(record, 0, sizeof(record));
+  TEST_AND_RETURN_FALSE(WriteRecord(record));
+  cleared_ = true;
+  return true;
+}
+
+bool CheckpointFile::WriteMetadata(const string& tag, const char* metadata,
+                                   size_t size) {
+  TEST_AND_RETURN_FALSE(tag.size() <= kMaxTagSize && size <= kMaxMetadataSize);
+  TEST_AND_RETURN_FALSE(Open());
+  // The header and the metadata go in a single write.
+  vector<char> buf(kMetadataHeaderSize + size, 0);
+  Put<uint32_t>(&buf[0], kMetadataMagicOffset, kMetadataMagic);
+  Put<uint64_t>(&buf[0], kMetadataSizeOffset, size);
+  Put<uint32_t>(&buf[0], kMetadataTagSizeOffset, tag.size());
+  memcpy(&buf[kMetadataTagOffset], tag.data(), tag.size());
+  if (size > 0)
+    memcpy(&buf[kMetadataHeaderSize], metadata, size);
+  Put<uint32_t>(&buf[0], kMetadataCrcOffset, MetadataCrc(&buf[0], size));
+  TEST_AND_RETURN_FALSE(utils::PWriteAll(fd_, &buf[0], buf.size(),
+                                         kFileSize));
+  ScopedIoSync sync("checkpoint");
+  TEST_AND_RETURN_FALSE_ERRNO(HANDLE_EINTR(fdatasync(fd_)) == 0);
+  return true;
+}
+
+bool CheckpointFile::ReadMetadata(const string& tag, vector<char>* metadata) {
+  if (fd_ < 0 && !utils::FileExists(path_.c_str()))
+    return false;
+  TEST_AND_RETURN_FALSE(Open());
+  vector<char> buf(kMetadataHeaderSize);
+  ssize_t bytes_read = 0;
+  TEST_AND_RETURN_FALSE(utils::PReadAll(fd_, &buf[0], buf.size(), kFileSize,
+                                        &bytes_read));
+  if (bytes_read != static_cast<ssize_t>(buf.size()) ||
+      Get<uint32_t>(&buf[0], kMetadataMagicOffset) != kMetadataMagic) {
+    return false;
+  }
+  const uint64_t size = Get<uint64_t>(&buf[0], kMetadataSizeOffset);
+  const uint32_t tag_size = Get<uint32_t>(&buf[0], kMetadataTagSizeOffset);
+  TEST_AND_RETURN_FALSE(size <= kMaxMetadataSize && tag_size <= kMaxTagSize);
+  // Metadata kept for another payload isn't an error.
+  if (string(&buf[kMetadataTagOffset], tag_size) != tag)
+    return false;
+  buf.resize(kMetadataHeaderSize + size);
+  if (size > 0) {
+    TEST_AND_RETURN_FALSE(utils::PReadAll(fd_, &buf[kMetadataHeaderSize], size,
+                                          kFileSize + kMetadataHeaderSize,
+                                          &bytes_read));
+    TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(size));
+  }
+  TEST_AND_RETURN_FALSE(Get<uint32_t>(&buf[0], kMetadataCrcOffset) ==
+                        MetadataCrc(&buf[0], size));
+  metadata->assign(buf.begin() + kMetadataHeaderSize, buf.end());
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,92 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_CHECKPOINT_FILE_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_CHECKPOINT_FILE_H__
+
+#include <string>
+#include <vector>
+
+#include <base/basictypes.h>
+
+// CheckpointFile persists the progress of an update at its checkpoints as a
+// single fixed-layout record, which is written with one pwrite() of a disk
+// sector at the start of a file preallocated once, so that a checkpoint
+// costs a small aligned write and a data sync rather than writes to several
+// preferences. The record ends with a CRC, so a torn write is detected and
+// makes the record read as no checkpoint. The payload metadata of the update
+// is kept after the record, so that a resumed update doesn't download it
+// again.
+
+namespace chromeos_update_engine {
+
+// The progress of an update at a checkpoint, which the update resumes from.
+struct UpdateCheckpoint {
+  UpdateCheckpoint() : next_operation(-1), next_data_offset(-1) {}
+
+  int64_t next_operation;
+  int64_t next_data_offset;
+  // The contexts of the payload hash calculator and of the signed hash, as
+  // returned by OmahaHashCalculator::GetContext(). The latter is empty until
+  // the signature is reached.
+  std::string hash_context;
+  std::string signed_hash_context;
+};
+
+class CheckpointFile {
+ public:
+  // The size of the record, which is written as a whole.
+  static const size_t kRecordSize;
+
+  // The size the file is preallocated to.
+  static const size_t kFileSize;
+
+  // The file at |path| is created when first written.
+  explicit CheckpointFile(const std::string& path);
+  ~CheckpointFile();
+
+  // Replaces the record with |checkpoint| and waits for it to be on disk.
+  // Returns true on success.
+  bool Write(const UpdateCheckpoint& checkpoint);
+
+  // Reads the last record written into |checkpoint|. Returns false if there
+  // is none, or it's invalid.
+  bool Read(UpdateCheckpoint* checkpoint);
+
+  // Invalidates the record, so that the update isn't resumed. Returns true
+  // on success.
+  bool Clear();
+
+  // Replaces the kept payload metadata with the |size| bytes of |metadata|,
+  // of the payload identified by |tag|, and waits for it to be on disk.
+  // Returns true on success.
+  bool WriteMetadata(const std::string& tag, const char* metadata,
+                     size_t size);
+
+  // Reads the payload metadata kept for |tag| into |metadata|. Returns false
+  // if there's none, or it's invalid.
+  bool ReadMetadata(const std::string& tag, std::vector<char>* metadata);
+
+ private:
+  // Opens and preallocates the file, if it isn't open already. Returns true
+  // on success.
+  bool Open();
+
+  // Writes the |kRecordSize| bytes of |record| and syncs them. Returns true
+  // on success.
+  bool WriteRecord(const char* record);
+
+  const std::string path_;
+  int fd_;
+
+  // True if the record on disk is known to be cleared, so that clearing it
+  // again, e.g., before each operation that can't be repeated, is free.
+  bool cleared_;
+
+  DISALLOW_COPY_AND_ASSIGN(CheckpointFile);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_CHECKPOINT_FILE_H__
@@ -0,0 +1,142 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+
+#include "base/file_util.h"
+#include "gtest/gtest.h"
+#include "update_engine/checkpoint_file.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class CheckpointFileTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    ASSERT_TRUE(file_util::CreateNewTempDirectory("auckpt", &dir_));
+    path_ = dir_.Append("checkpoint").value();
+  }
+
+  virtual void TearDown() {
+    file_util::Delete(dir_, true);  // recursive
+  }
+
+  static UpdateCheckpoint TestCheckpoint() {
+    UpdateCheckpoint checkpoint;
+    checkpoint.next_operation = 17;
+    checkpoint.next_data_offset = 123456789012LL;
+    checkpoint.hash_context = string(112, 'h');
+    checkpoint.signed_hash_context = "signed";
+    return checkpoint;
+  }
+
+  FilePath dir_;
+  string path_;
+};
+
+TEST_F(CheckpointFileTest, NoFileTest) {
+  CheckpointFile file(path_);
+  UpdateCheckpoint checkpoint;
+  EXPECT_FALSE(file.Read(&checkpoint));
+  EXPECT_TRUE(file.Clear());
+  EXPECT_FALSE(file_util::PathExists(FilePath(path_)));
+}
+
+TEST_F(CheckpointFileTest, WriteReadTest) {
+  const UpdateCheckpoint written = TestCheckpoint();
+  {
+    CheckpointFile file(path_);
+    EXPECT_TRUE(file.Write(written));
+  }
+  struct stat stbuf;
+  ASSERT_EQ(0, stat(path_.c_str(), &stbuf));
+  EXPECT_EQ(static_cast<off_t>(CheckpointFile::kFileSize), stbuf.st_size);
+
+  CheckpointFile file(path_);
+  UpdateCheckpoint checkpoint;
+  EXPECT_TRUE(file.Read(&checkpoint));
+  EXPECT_EQ(written.next_operation, checkpoint.next_operation);
+  EXPECT_EQ(written.next_data_offset, checkpoint.next_data_offset);
+  EXPECT_EQ(written.hash_context, checkpoint.hash_context);
+  EXPECT_EQ(written.signed_hash_context, checkpoint.signed_hash_context);
+}
+
+TEST_F(CheckpointFileTest, ClearTest) {
+  CheckpointFile file(path_);
+  EXPECT_TRUE(file.Write(TestCheckpoint()));
+  EXPECT_TRUE(file.Clear());
+  UpdateCheckpoint checkpoint;
+  EXPECT_FALSE(file.Read(&checkpoint));
+  // The record can be cleared again, and written after being cleared.
+  EXPECT_TRUE(file.Clear());
+  EXPECT_TRUE(file.Write(TestCheckpoint()));
+  EXPECT_TRUE(file.Read(&checkpoint));
+}
+
+TEST_F(CheckpointFileTest, CorruptRecordTest) {
+  {
+    CheckpointFile file(path_);
+    EXPECT_TRUE(file.Write(TestCheckpoint()));
+  }
+  // Flip a byte of the offset, as a torn write could.
+  string contents;
+  ASSERT_TRUE(file_util::ReadFileToString(FilePath(path_), &contents));
+  contents[16] ^= 0xff;
+  ASSERT_EQ(static_cast<int>(contents.size()),
+            file_util::WriteFile(FilePath(path_), contents.data(),
+                                 contents.size()));
+
+  CheckpointFile file(path_);
+  UpdateCheckpoint checkpoint;
+  EXPECT_FALSE(file.Read(&checkpoint));
+}
+
+TEST_F(CheckpointFileTest, ContextTooLargeTest) {
+  CheckpointFile file(path_);
+  UpdateCheckpoint checkpoint = TestCheckpoint();
+  checkpoint.hash_context = string(CheckpointFile::kRecordSize, 'h');
+  EXPECT_FALSE(file.Write(checkpoint));
+}
+
+TEST_F(CheckpointFileTest, MetadataTest) {
+  const string metadata(100000, 'm');
+  {
+    CheckpointFile file(path_);
+    EXPECT_TRUE(file.WriteMetadata("payload", metadata.data(),
+                                   metadata.size()));
+    // The metadata is kept along with the record.
+    EXPECT_TRUE(file.Write(TestCheckpoint()));
+    EXPECT_TRUE(file.Clear());
+  }
+  CheckpointFile file(path_);
+  vector<char> read_metadata;
+  EXPECT_FALSE(file.ReadMetadata("other-payload", &read_metadata));
+  EXPECT_TRUE(file.ReadMetadata("payload", &read_metadata));
+  EXPECT_EQ(metadata, string(read_metadata.begin(), read_metadata.end()));
+}
+
+TEST_F(CheckpointFileTest, CorruptMetadataTest) {
+  vector<char> metadata;
+  {
+    CheckpointFile file(path_);
+    EXPECT_FALSE(file.ReadMetadata("payload", &metadata));
+    EXPECT_TRUE(file.WriteMetadata("payload", "metadata", 8));
+  }
+  string contents;
+  ASSERT_TRUE(file_util::ReadFileToString(FilePath(path_), &contents));
+  contents[contents.size() - 1] ^= 0xff;
+  ASSERT_EQ(static_cast<int>(contents.size()),
+            file_util::WriteFile(FilePath(path_), contents.data(),
+                                 contents.size()));
+
+  CheckpointFile file(path_);
+  EXPECT_FALSE(file.ReadMetadata("payload", &metadata));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,125 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/chunk_hash_verifier.h"
+
+#include <algorithm>
+#include <tr1/memory>
+
+#include <base/logging.h>
+
+#include "update_engine/omaha_hash_calculator.h"
+#include "update_engine/utils.h"
+
+using std::min;
+using std::tr1::shared_ptr;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class ChunkHashVerifier::ChunkTask : public ThreadPoolTask {
+ public:
+  ChunkTask(size_t index, const vector<char>* expected_hash,
+            vector<char>* data)
+      : index_(index),
+        expected_hash_(expected_hash),
+        matches_(false) {
+    data_.swap(*data);
+  }
+
+  virtual bool Run() {
+    vector<char> hash;
+    TEST_AND_RETURN_FALSE(OmahaHashCalculator::RawHashOfData(data_, &hash));
+    matches_ = hash == *expected_hash_;
+    vector<char>().swap(data_);
+    return true;
+  }
+
+  size_t index() const { return index_; }
+  bool matches() const { return matches_; }
+
+ private:
+  const size_t index_;
+  const vector<char>* const expected_hash_;
+  vector<char> data_;
+  bool matches_;
+
+  DISALLOW_COPY_AND_ASSIGN(ChunkTask);
+};
+
+ChunkHashVerifier::ChunkHashVerifier(
+    ThreadPool* pool,
+    uint64_t chunk_size,
+    const vector<vector<char> >& expected_hashes)
+    : chunk_size_(chunk_size),
+      expected_hashes_(expected_hashes),
+      // Bounds the copies of the data waiting to be hashed.
+      runner_(pool, 2 * pool->num_threads()),
+      next_chunk_(0),
+      success_(true) {
+  CHECK_GT(chunk_size_, static_cast<uint64_t>(0));
+}
+
+ChunkHashVerifier::~ChunkHashVerifier() {}
+
+bool ChunkHashVerifier::IsValid(uint64_t size,
+                                uint64_t chunk_size,
+                                size_t num_hashes) {
+  return chunk_size > 0 &&
+      num_hashes == (size + chunk_size - 1) / chunk_size;
+}
+
+bool ChunkHashVerifier::Update(const char* data, size_t length) {
+  while (success_ && length > 0) {
+    if (chunk_.empty())
+      chunk_.reserve(chunk_size_);
+    const size_t bytes = min<uint64_t>(length, chunk_size_ - chunk_.size());
+    chunk_.insert(chunk_.end(), data, data + bytes);
+    data += bytes;
+    length -= bytes;
+    if (chunk_.size() == chunk_size_)
+      SubmitChunk();
+  }
+  return success_;
+}
+
+bool ChunkHashVerifier::Finalize() {
+  if (success_ && !chunk_.empty())
+    SubmitChunk();
+  while (!runner_.empty())
+    CheckOldestChunk();
+  if (success_ && next_chunk_ != expected_hashes_.size()) {
+    LOG(ERROR) << "Got " << next_chunk_ << " chunks, expected "
+               << expected_hashes_.size() << ".";
+    success_ = false;
+  }
+  return success_;
+}
+
+void ChunkHashVerifier::SubmitChunk() {
+  if (next_chunk_ >= expected_hashes_.size()) {
+    LOG(ERROR) << "Got more than the expected " << expected_hashes_.size()
+               << " chunks.";
+    success_ = false;
+    return;
+  }
+  while (runner_.full())
+    CheckOldestChunk();
+  runner_.Submit(shared_ptr<ChunkTask>(
+      new ChunkTask(next_chunk_, &expected_hashes_[next_chunk_], &chunk_)));
+  next_chunk_++;
+}
+
+void ChunkHashVerifier::CheckOldestChunk() {
+  shared_ptr<ChunkTask> task;
+  if (!runner_.WaitOldest(&task)) {
+    LOG(ERROR) << "Unable to hash chunk " << task->index() << ".";
+    success_ = false;
+  } else if (!task->matches()) {
+    LOG(ERROR) << "Chunk " << task->index() << " doesn't match its hash.";
+    success_ = false;
+  }
+}
+
+}  // namespace chromeos_update_engine
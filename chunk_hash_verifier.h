@@ -0,0 +1,71 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_CHUNK_HASH_VERIFIER_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_CHUNK_HASH_VERIFIER_H__
+
+#include <vector>
+
+#include <base/basictypes.h>
+
+#include "update_engine/thread_pool.h"
+
+// Verifies a stream of data against the SHA-256 hashes of its consecutive
+// chunks, as listed in a PartitionInfo. Unlike a hash of the whole stream,
+// the chunks don't depend on each other, so they are hashed on the workers
+// of a ThreadPool while the caller goes on reading.
+
+namespace chromeos_update_engine {
+
+class ChunkHashVerifier {
+ public:
+  // |pool| and |expected_hashes| aren't owned and must outlive the
+  // verifier. The stream is expected to be |expected_hashes.size()| chunks
+  // of |chunk_size| bytes, the last of which may be shorter.
+  ChunkHashVerifier(ThreadPool* pool,
+                    uint64_t chunk_size,
+                    const std::vector<std::vector<char> >& expected_hashes);
+
+  // Waits for the chunks being hashed.
+  ~ChunkHashVerifier();
+
+  // Returns true if |chunk_size| and |num_hashes| can describe a stream of
+  // |size| bytes.
+  static bool IsValid(uint64_t size, uint64_t chunk_size, size_t num_hashes);
+
+  // Queues a copy of the |length| bytes at |data| to be hashed after the
+  // data passed before. May wait for earlier chunks to be hashed. Returns
+  // false if a chunk is known not to match.
+  bool Update(const char* data, size_t length);
+
+  // Hashes the last chunk and waits for all of them. Returns true if the
+  // stream had all the expected chunks and they all matched.
+  bool Finalize();
+
+ private:
+  class ChunkTask;
+
+  // Queues |chunk_| for hashing and starts a new one.
+  void SubmitChunk();
+
+  // Waits for the oldest queued chunk and checks its hash.
+  void CheckOldestChunk();
+
+  const uint64_t chunk_size_;
+  const std::vector<std::vector<char> >& expected_hashes_;
+  OrderedTaskRunner<ChunkTask> runner_;
+
+  // The chunk being filled, and the index of the next one to queue.
+  std::vector<char> chunk_;
+  size_t next_chunk_;
+
+  // False once a chunk didn't match or couldn't be hashed.
+  bool success_;
+
+  DISALLOW_COPY_AND_ASSIGN(ChunkHashVerifier);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_CHUNK_HASH_VERIFIER_H__
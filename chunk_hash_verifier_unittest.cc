@@ -0,0 +1,94 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <algorithm>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/chunk_hash_verifier.h"
+#include "update_engine/omaha_hash_calculator.h"
+#include "update_engine/test_utils.h"
+#include "update_engine/thread_pool.h"
+
+using std::min;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class ChunkHashVerifierTest : public ::testing::Test {
+ protected:
+  ChunkHashVerifierTest() : pool_(3) {}
+
+  virtual void SetUp() {
+    ASSERT_TRUE(pool_.Init());
+    data_.resize(kChunkSize * 20 + 100);
+    FillWithData(&data_);
+    for (size_t offset = 0; offset < data_.size(); offset += kChunkSize) {
+      hashes_.push_back(vector<char>());
+      ASSERT_TRUE(OmahaHashCalculator::RawHashOfBytes(
+          &data_[offset], min(kChunkSize, data_.size() - offset),
+          &hashes_.back()));
+    }
+  }
+
+  // Feeds |data_| to |verifier| in updates of varying sizes.
+  bool Feed(ChunkHashVerifier* verifier) {
+    const size_t kSizes[] = { 1, 100, 4096, 3 * kChunkSize + 7 };
+    bool success = true;
+    size_t offset = 0;
+    for (size_t i = 0; offset < data_.size();
+         i = (i + 1) % arraysize(kSizes)) {
+      size_t size = min(kSizes[i], data_.size() - offset);
+      success = verifier->Update(&data_[offset], size) && success;
+      offset += size;
+    }
+    return success;
+  }
+
+  static const size_t kChunkSize = 10000;
+
+  ThreadPool pool_;
+  vector<char> data_;
+  vector<vector<char> > hashes_;
+};
+
+const size_t ChunkHashVerifierTest::kChunkSize;
+
+TEST_F(ChunkHashVerifierTest, MatchTest) {
+  ChunkHashVerifier verifier(&pool_, kChunkSize, hashes_);
+  EXPECT_TRUE(Feed(&verifier));
+  EXPECT_TRUE(verifier.Finalize());
+}
+
+TEST_F(ChunkHashVerifierTest, MismatchTest) {
+  data_[kChunkSize * 7 + 5]++;
+  ChunkHashVerifier verifier(&pool_, kChunkSize, hashes_);
+  Feed(&verifier);
+  EXPECT_FALSE(verifier.Finalize());
+}
+
+TEST_F(ChunkHashVerifierTest, ShortStreamTest) {
+  ChunkHashVerifier verifier(&pool_, kChunkSize, hashes_);
+  EXPECT_TRUE(verifier.Update(&data_[0], kChunkSize * 3));
+  EXPECT_FALSE(verifier.Finalize());
+}
+
+TEST_F(ChunkHashVerifierTest, LongStreamTest) {
+  ChunkHashVerifier verifier(&pool_, kChunkSize, hashes_);
+  EXPECT_TRUE(Feed(&verifier));
+  EXPECT_FALSE(verifier.Update(&data_[0], kChunkSize * 2));
+  EXPECT_FALSE(verifier.Finalize());
+}
+
+TEST_F(ChunkHashVerifierTest, IsValidTest) {
+  EXPECT_TRUE(ChunkHashVerifier::IsValid(data_.size(), kChunkSize,
+                                         hashes_.size()));
+  EXPECT_TRUE(ChunkHashVerifier::IsValid(kChunkSize * 2, kChunkSize, 2));
+  EXPECT_FALSE(ChunkHashVerifier::IsValid(kChunkSize * 2, kChunkSize, 3));
+  EXPECT_FALSE(ChunkHashVerifier::IsValid(kChunkSize * 2 + 1, kChunkSize, 2));
+  EXPECT_FALSE(ChunkHashVerifier::IsValid(kChunkSize, 0, 0));
+}
+
+}  // namespace chromeos_update_engine
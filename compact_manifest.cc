@@ -0,0 +1,85 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/compact_manifest.h"
+
+#include "update_engine/utils.h"
+
+using google::protobuf::RepeatedField;
+using google::protobuf::RepeatedPtrField;
+
+namespace chromeos_update_engine {
+
+const uint64_t kCompactManifestVersion = 2;
+
+namespace {
+
+void PackExtents(const RepeatedPtrField<Extent>& extents,
+                 RepeatedField<int64_t>* packed) {
+  packed->Reserve(2 * extents.size());
+  uint64_t end = 0;
+  for (int i = 0; i < extents.size(); i++) {
+    // The difference wraps around like the block numbers.
+    packed->Add(static_cast<int64_t>(extents.Get(i).start_block() - end));
+    packed->Add(static_cast<int64_t>(extents.Get(i).num_blocks()));
+    end = extents.Get(i).start_block() + extents.Get(i).num_blocks();
+  }
+}
+
+bool UnpackExtents(const RepeatedField<int64_t>& packed,
+                   RepeatedPtrField<Extent>* extents) {
+  TEST_AND_RETURN_FALSE(packed.size() % 2 == 0);
+  extents->Reserve(extents->size() + packed.size() / 2);
+  uint64_t end = 0;
+  for (int i = 0; i < packed.size(); i += 2) {
+    TEST_AND_RETURN_FALSE(packed.Get(i + 1) > 0);
+    Extent* extent = extents->Add();
+    extent->set_start_block(end + static_cast<uint64_t>(packed.Get(i)));
+    extent->set_num_blocks(packed.Get(i + 1));
+    end = extent->start_block() + extent->num_blocks();
+  }
+  return true;
+}
+
+void CompactOperations(
+    RepeatedPtrField<DeltaArchiveManifest_InstallOperation>* ops) {
+  for (int i = 0; i < ops->size(); i++) {
+    DeltaArchiveManifest_InstallOperation* op = ops->Mutable(i);
+    PackExtents(op->src_extents(), op->mutable_packed_src_extents());
+    PackExtents(op->dst_extents(), op->mutable_packed_dst_extents());
+    op->clear_src_extents();
+    op->clear_dst_extents();
+  }
+}
+
+bool ExpandOperations(
+    RepeatedPtrField<DeltaArchiveManifest_InstallOperation>* ops) {
+  for (int i = 0; i < ops->size(); i++) {
+    DeltaArchiveManifest_InstallOperation* op = ops->Mutable(i);
+    TEST_AND_RETURN_FALSE(UnpackExtents(op->packed_src_extents(),
+                                        op->mutable_src_extents()));
+    TEST_AND_RETURN_FALSE(UnpackExtents(op->packed_dst_extents(),
+                                        op->mutable_dst_extents()));
+    op->clear_packed_src_extents();
+    op->clear_packed_dst_extents();
+  }
+  return true;
+}
+
+}  // namespace {}
+
+void CompactManifest(DeltaArchiveManifest* manifest) {
+  CompactOperations(manifest->mutable_install_operations());
+  CompactOperations(manifest->mutable_kernel_install_operations());
+}
+
+bool ExpandManifest(DeltaArchiveManifest* manifest) {
+  TEST_AND_RETURN_FALSE(
+      ExpandOperations(manifest->mutable_install_operations()));
+  TEST_AND_RETURN_FALSE(
+      ExpandOperations(manifest->mutable_kernel_install_operations()));
+  return true;
+}
+
+}  // namespace chromeos_update_engine
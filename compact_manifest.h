@@ -0,0 +1,30 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_COMPACT_MANIFEST_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_COMPACT_MANIFEST_H__
+
+#include "update_engine/update_metadata.pb.h"
+
+// Most of the manifest of a large payload is the extents of its operations.
+// Payloads of file format version 2 carry them packed as delta-coded varints,
+// see packed_dst_extents in update_metadata.proto, rather than as Extent
+// messages.
+
+namespace chromeos_update_engine {
+
+// The file format version of payloads whose manifest is compacted.
+extern const uint64_t kCompactManifestVersion;
+
+// Moves the extents of the operations of |manifest| to their packed fields.
+void CompactManifest(DeltaArchiveManifest* manifest);
+
+// Moves the packed extents of the operations of |manifest| back to their
+// src_extents and dst_extents. Returns false if any of them is malformed, in
+// which case |manifest| is left partly expanded.
+bool ExpandManifest(DeltaArchiveManifest* manifest);
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_COMPACT_MANIFEST_H__
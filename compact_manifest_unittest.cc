@@ -0,0 +1,64 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/compact_manifest.h"
+#include "update_engine/extent_ranges.h"
+#include "update_engine/graph_types.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+TEST(CompactManifestTest, RoundTripTest) {
+  DeltaArchiveManifest manifest;
+  DeltaArchiveManifest_InstallOperation* op =
+      manifest.add_install_operations();
+  op->set_type(DeltaArchiveManifest_InstallOperation_Type_MOVE);
+  *op->add_src_extents() = ExtentForRange(100000, 5);
+  *op->add_dst_extents() = ExtentForRange(20, 3);
+  *op->add_dst_extents() = ExtentForRange(kSparseHole, 2);
+  *op->add_dst_extents() = ExtentForRange(7, 1);
+  op = manifest.add_kernel_install_operations();
+  op->set_type(DeltaArchiveManifest_InstallOperation_Type_REPLACE);
+  *op->add_dst_extents() = ExtentForRange(0, 1024);
+  manifest.add_install_operations()->set_type(
+      DeltaArchiveManifest_InstallOperation_Type_REPLACE);
+
+  string serialized;
+  ASSERT_TRUE(manifest.SerializeToString(&serialized));
+  DeltaArchiveManifest compact(manifest);
+  CompactManifest(&compact);
+  EXPECT_EQ(0, compact.install_operations(0).dst_extents_size());
+  EXPECT_EQ(6, compact.install_operations(0).packed_dst_extents_size());
+  string compact_serialized;
+  ASSERT_TRUE(compact.SerializeToString(&compact_serialized));
+  EXPECT_LT(compact_serialized.size(), serialized.size());
+
+  DeltaArchiveManifest expanded;
+  ASSERT_TRUE(expanded.ParseFromString(compact_serialized));
+  EXPECT_TRUE(ExpandManifest(&expanded));
+  string expanded_serialized;
+  ASSERT_TRUE(expanded.SerializeToString(&expanded_serialized));
+  EXPECT_EQ(serialized, expanded_serialized);
+}
+
+TEST(CompactManifestTest, MalformedTest) {
+  DeltaArchiveManifest manifest;
+  DeltaArchiveManifest_InstallOperation* op =
+      manifest.add_install_operations();
+  op->set_type(DeltaArchiveManifest_InstallOperation_Type_REPLACE);
+  // A start block without a number of blocks.
+  op->add_packed_dst_extents(10);
+  EXPECT_FALSE(ExpandManifest(&manifest));
+
+  // An extent of no blocks.
+  op->add_packed_dst_extents(0);
+  EXPECT_FALSE(ExpandManifest(&manifest));
+}
+
+}  // namespace chromeos_update_engine
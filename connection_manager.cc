@@ -8,6 +8,7 @@
 
 #include <base/stl_util.h>
 #include <base/string_util.h>
+#include <base/stringprintf.h>
 #include <chromeos/dbus/service_constants.h>
 #include <dbus/dbus-glib.h>
 #include <glib.h>
@@ -22,6 +23,11 @@ namespace chromeos_update_engine {
 
 namespace {
 
+// The signal of the connection manager's objects when their properties
+// change, such as the list of services of the manager, the first of which
+// is the default one.
+const char kPropertyChangedSignal[] = "PropertyChanged";
+
 // Gets the DbusGProxy for FlimFlam. Must be free'd with ProxyUnref()
 bool GetFlimFlamProxy(DbusGlibInterface* dbus_iface,
                       const char* path,
@@ -147,7 +153,19 @@ bool GetServicePathType(DbusGlibInterface* dbus_iface,
 }  // namespace {}
 
 ConnectionManager::ConnectionManager(SystemState *system_state)
-    :  system_state_(system_state) {}
+    :  system_state_(system_state),
+       watch_dbus_iface_(NULL),
+       watch_connection_(NULL),
+       cached_type_valid_(false),
+       cached_type_(kNetUnknown) {}
+
+ConnectionManager::~ConnectionManager() {
+  if (watch_connection_) {
+    watch_dbus_iface_->DbusConnectionRemoveFilter(watch_connection_,
+                                                  &StaticOnMessage,
+                                                  this);
+  }
+}
 
 bool ConnectionManager::IsUpdateAllowedOver(NetworkConnectionType type) const {
   switch (type) {
@@ -201,13 +219,85 @@ const char* ConnectionManager::StringForConnectionType(
 bool ConnectionManager::GetConnectionType(
     DbusGlibInterface* dbus_iface,
     NetworkConnectionType* out_type) const {
+  if (cached_type_valid_) {
+    *out_type = cached_type_;
+    return true;
+  }
   string default_service_path;
   TEST_AND_RETURN_FALSE(GetDefaultServicePath(dbus_iface,
                                               &default_service_path));
   TEST_AND_RETURN_FALSE(GetServicePathType(dbus_iface,
                                            default_service_path,
                                            out_type));
+  // Without the signals, the type is looked up every time.
+  if (watch_connection_ || WatchConnectionChanges(dbus_iface)) {
+    cached_type_ = *out_type;
+    cached_type_valid_ = true;
+  }
+  return true;
+}
+
+bool ConnectionManager::WatchConnectionChanges(
+    DbusGlibInterface* dbus_iface) const {
+  GError* error = NULL;
+  DBusGConnection* bus = dbus_iface->BusGet(DBUS_BUS_SYSTEM, &error);
+  if (!bus) {
+    LOG(ERROR) << "Failed to get system bus: "
+               << utils::GetAndFreeGError(&error);
+    return false;
+  }
+  DBusConnection* connection = dbus_iface->ConnectionGetConnection(bus);
+  TEST_AND_RETURN_FALSE(connection);
+
+  // The connection manager restarting is watched too, since its properties
+  // start over then.
+  const string rules[] = {
+    StringPrintf("type='signal',interface='%s',member='%s'",
+                 flimflam::kFlimflamManagerInterface,
+                 kPropertyChangedSignal),
+    StringPrintf("type='signal',interface='%s',member='NameOwnerChanged',"
+                 "arg0='%s'",
+                 DBUS_INTERFACE_DBUS,
+                 flimflam::kFlimflamServiceName),
+  };
+  for (size_t i = 0; i < arraysize(rules); i++) {
+    DBusError dbus_error;
+    dbus_error_init(&dbus_error);
+    dbus_iface->DbusBusAddMatch(connection, rules[i].c_str(), &dbus_error);
+    if (dbus_error_is_set(&dbus_error)) {
+      LOG(ERROR) << "Failed to watch the connection manager: "
+                 << dbus_error.name << " (" << dbus_error.message << ")";
+      dbus_error_free(&dbus_error);
+      return false;
+    }
+  }
+  TEST_AND_RETURN_FALSE(dbus_iface->DbusConnectionAddFilter(
+      connection,
+      &StaticOnMessage,
+      const_cast<ConnectionManager*>(this),
+      NULL));
+  watch_dbus_iface_ = dbus_iface;
+  watch_connection_ = connection;
   return true;
 }
 
+// static
+DBusHandlerResult ConnectionManager::StaticOnMessage(
+    DBusConnection* connection,
+    DBusMessage* message,
+    void* data) {
+  ConnectionManager* manager = reinterpret_cast<ConnectionManager*>(data);
+  DbusGlibInterface* dbus_iface = manager->watch_dbus_iface_;
+  if (dbus_iface->DbusMessageIsSignal(message,
+                                      flimflam::kFlimflamManagerInterface,
+                                      kPropertyChangedSignal) ||
+      dbus_iface->DbusMessageIsSignal(message,
+                                      DBUS_INTERFACE_DBUS,
+                                      "NameOwnerChanged")) {
+    manager->cached_type_valid_ = false;
+  }
+  // Others may be interested in the message too.
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
 }  // namespace chromeos_update_engine
@@ -30,10 +30,14 @@ class ConnectionManager {
   // Constructs a new ConnectionManager object initialized with the
   // given system state.
   explicit ConnectionManager(SystemState* system_state);
+  virtual ~ConnectionManager();
 
   // Populates |out_type| with the type of the network connection
   // that we are currently connected. The dbus_iface is used to
-  // query the real connection manager (e.g shill).
+  // query the real connection manager (e.g shill). The type is cached
+  // until the connection manager signals that its properties changed, and
+  // |dbus_iface| is kept to watch the signals, so it must outlive this
+  // object.
   virtual bool GetConnectionType(DbusGlibInterface* dbus_iface,
                                  NetworkConnectionType* out_type) const;
 
@@ -46,9 +50,26 @@ class ConnectionManager {
   virtual const char* StringForConnectionType(NetworkConnectionType type) const;
 
  private:
+  // Starts invalidating the cached connection type on the signals of the
+  // connection manager, through |dbus_iface|. Returns true on success.
+  bool WatchConnectionChanges(DbusGlibInterface* dbus_iface) const;
+
+  // The D-Bus filter that invalidates the cached connection type.
+  static DBusHandlerResult StaticOnMessage(DBusConnection* connection,
+                                           DBusMessage* message,
+                                           void* data);
+
   // The global context for update_engine
   SystemState* system_state_;
 
+  // The interface and connection the signals are watched on, or NULL.
+  mutable DbusGlibInterface* watch_dbus_iface_;
+  mutable DBusConnection* watch_connection_;
+
+  // The connection type, if |cached_type_valid_|.
+  mutable bool cached_type_valid_;
+  mutable NetworkConnectionType cached_type_;
+
   DISALLOW_COPY_AND_ASSIGN(ConnectionManager);
 };
 
@@ -16,6 +16,7 @@ using std::string;
 using testing::_;
 using testing::AnyNumber;
 using testing::Return;
+using testing::SaveArg;
 using testing::SetArgumentPointee;
 using testing::StrEq;
 
@@ -168,6 +169,40 @@ TEST_F(ConnectionManagerTest, SimpleTest) {
   TestWithServiceType(flimflam::kTypeCellular, kNetCellular);
 }
 
+TEST_F(ConnectionManagerTest, CachedTypeTest) {
+  DBusConnection* kMockConnection = reinterpret_cast<DBusConnection*>(4);
+  DBusMessage* kMockMessage = reinterpret_cast<DBusMessage*>(5);
+  EXPECT_CALL(dbus_iface_, ConnectionGetConnection(_))
+      .WillRepeatedly(Return(kMockConnection));
+  EXPECT_CALL(dbus_iface_, DbusBusAddMatch(kMockConnection, _, _)).Times(2);
+  DBusHandleMessageFunction filter = NULL;
+  void* filter_data = NULL;
+  EXPECT_CALL(dbus_iface_, DbusConnectionAddFilter(kMockConnection, _, _, _))
+      .WillOnce(DoAll(SaveArg<1>(&filter),
+                      SaveArg<2>(&filter_data),
+                      Return(TRUE)));
+  TestWithServiceType(flimflam::kTypeWifi, kNetWifi);
+
+  // The type is cached, so the connection manager isn't called again.
+  NetworkConnectionType type = kNetUnknown;
+  EXPECT_TRUE(cmut_.GetConnectionType(&dbus_iface_, &type));
+  EXPECT_EQ(kNetWifi, type);
+
+  // Until its properties change.
+  ASSERT_TRUE(filter != NULL);
+  EXPECT_CALL(dbus_iface_,
+              DbusMessageIsSignal(kMockMessage,
+                                  StrEq(flimflam::kFlimflamManagerInterface),
+                                  StrEq("PropertyChanged")))
+      .WillOnce(Return(TRUE));
+  EXPECT_EQ(DBUS_HANDLER_RESULT_NOT_YET_HANDLED,
+            filter(kMockConnection, kMockMessage, filter_data));
+  TestWithServiceType(flimflam::kTypeEthernet, kNetEthernet);
+
+  EXPECT_CALL(dbus_iface_,
+              DbusConnectionRemoveFilter(kMockConnection, filter, filter_data));
+}
+
 TEST_F(ConnectionManagerTest, UnknownTest) {
   TestWithServiceType("foo", kNetUnknown);
 }
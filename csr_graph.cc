@@ -0,0 +1,83 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/csr_graph.h"
+
+#include <algorithm>
+
+#include <base/logging.h>
+
+using std::lower_bound;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+const CsrGraph::EdgeIndex CsrGraph::kInvalidEdge;
+
+CsrGraph::CsrGraph() : edges_begin_(1, 0), extents_begin_(1, 0) {}
+
+void CsrGraph::Assign(const Graph& graph) {
+  size_t num_edges = 0;
+  size_t num_extents = 0;
+  for (Graph::const_iterator it = graph.begin(); it != graph.end(); ++it) {
+    num_edges += it->out_edges.size();
+    for (Vertex::EdgeMap::const_iterator jt = it->out_edges.begin();
+         jt != it->out_edges.end(); ++jt) {
+      num_extents += jt->second.extents.size();
+    }
+  }
+  // The indexes are kept in 32 bits to halve the size of the arrays.
+  CHECK_LT(graph.size(), static_cast<size_t>(kuint32max));
+  CHECK_LT(num_edges, static_cast<size_t>(kInvalidEdge));
+  CHECK_LT(num_extents, static_cast<size_t>(kuint32max));
+
+  edges_begin_.clear();
+  edges_begin_.reserve(graph.size() + 1);
+  destinations_.clear();
+  destinations_.reserve(num_edges);
+  extents_begin_.clear();
+  extents_begin_.reserve(num_edges + 1);
+  extents_.clear();
+  extents_.reserve(num_extents);
+
+  for (Graph::const_iterator it = graph.begin(); it != graph.end(); ++it) {
+    edges_begin_.push_back(destinations_.size());
+    // EdgeMap is ordered by destination, which keeps each row sorted.
+    for (Vertex::EdgeMap::const_iterator jt = it->out_edges.begin();
+         jt != it->out_edges.end(); ++jt) {
+      destinations_.push_back(jt->first);
+      extents_begin_.push_back(extents_.size());
+      const vector<Extent>& extents = jt->second.extents;
+      for (vector<Extent>::const_iterator kt = extents.begin();
+           kt != extents.end(); ++kt) {
+        FlatExtent extent = { kt->start_block(), kt->num_blocks() };
+        extents_.push_back(extent);
+      }
+    }
+  }
+  edges_begin_.push_back(destinations_.size());
+  extents_begin_.push_back(extents_.size());
+}
+
+CsrGraph::EdgeIndex CsrGraph::FindEdge(Vertex::Index src,
+                                       Vertex::Index dst) const {
+  vector<uint32_t>::const_iterator begin =
+      destinations_.begin() + EdgesBegin(src);
+  vector<uint32_t>::const_iterator end = destinations_.begin() + EdgesEnd(src);
+  vector<uint32_t>::const_iterator it = lower_bound(begin, end, dst);
+  if (it == end || *it != dst)
+    return kInvalidEdge;
+  return it - destinations_.begin();
+}
+
+uint64_t CsrGraph::EdgeWeight(EdgeIndex edge) const {
+  uint64_t weight = 0;
+  for (uint32_t i = extents_begin_[edge]; i < extents_begin_[edge + 1]; i++) {
+    if (extents_[i].start_block != kSparseHole)
+      weight += extents_[i].num_blocks;
+  }
+  return weight;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,77 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_CSR_GRAPH_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_CSR_GRAPH_H__
+
+#include <vector>
+#include "base/basictypes.h"
+#include "update_engine/graph_types.h"
+
+// CsrGraph is a compact, read-only copy of the edges of a Graph in
+// compressed sparse row form: the destinations of the out-edges of all
+// vertices are stored in one array, ordered by source and then by
+// destination, and the read-before extents of all edges in another. The graph
+// algorithms walk it sequentially instead of chasing the nodes of each
+// vertex's EdgeMap, and it doesn't carry the operations and file names, so
+// it's cheap to keep beside the Graph it was built from.
+
+namespace chromeos_update_engine {
+
+class CsrGraph {
+ public:
+  // Edges are referred to by their position in the edge array.
+  typedef uint32_t EdgeIndex;
+  static const EdgeIndex kInvalidEdge = kuint32max;
+
+  CsrGraph();
+
+  // Replaces the contents with the edges of |graph|.
+  void Assign(const Graph& graph);
+
+  // The number of vertices, the same as that of the Graph.
+  Vertex::Index size() const { return edges_begin_.size() - 1; }
+
+  // The out-edges of |vertex| are those in [EdgesBegin(), EdgesEnd()).
+  EdgeIndex EdgesBegin(Vertex::Index vertex) const {
+    return edges_begin_[vertex];
+  }
+  EdgeIndex EdgesEnd(Vertex::Index vertex) const {
+    return edges_begin_[vertex + 1];
+  }
+
+  // Returns the destination vertex of |edge|.
+  Vertex::Index EdgeDestination(EdgeIndex edge) const {
+    return destinations_[edge];
+  }
+
+  // Returns the edge from |src| to |dst|, or kInvalidEdge if there's none.
+  EdgeIndex FindEdge(Vertex::Index src, Vertex::Index dst) const;
+
+  // Returns the number of blocks in the read-before extents of |edge|, not
+  // counting sparse holes.
+  uint64_t EdgeWeight(EdgeIndex edge) const;
+
+ private:
+  // An Extent without the protobuf overhead.
+  struct FlatExtent {
+    uint64_t start_block;
+    uint64_t num_blocks;
+  };
+
+  // The out-edges of vertex v are [edges_begin_[v], edges_begin_[v + 1]).
+  std::vector<EdgeIndex> edges_begin_;
+  std::vector<uint32_t> destinations_;
+
+  // The read-before extents of edge e are
+  // [extents_begin_[e], extents_begin_[e + 1]) in |extents_|.
+  std::vector<uint32_t> extents_begin_;
+  std::vector<FlatExtent> extents_;
+
+  DISALLOW_COPY_AND_ASSIGN(CsrGraph);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_CSR_GRAPH_H__
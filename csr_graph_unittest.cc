@@ -0,0 +1,68 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <utility>
+#include <vector>
+#include <gtest/gtest.h>
+#include "update_engine/csr_graph.h"
+#include "update_engine/extent_ranges.h"
+#include "update_engine/graph_types.h"
+
+using std::make_pair;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class CsrGraphTest : public ::testing::Test {};
+
+TEST(CsrGraphTest, EmptyTest) {
+  CsrGraph csr_graph;
+  EXPECT_EQ(0, csr_graph.size());
+  csr_graph.Assign(Graph(2));
+  EXPECT_EQ(2, csr_graph.size());
+  EXPECT_EQ(csr_graph.EdgesBegin(0), csr_graph.EdgesEnd(0));
+  EXPECT_EQ(csr_graph.EdgesBegin(1), csr_graph.EdgesEnd(1));
+  EXPECT_EQ(CsrGraph::kInvalidEdge, csr_graph.FindEdge(0, 1));
+}
+
+TEST(CsrGraphTest, SimpleTest) {
+  Graph graph(4);
+  EdgeProperties props;
+  props.extents.push_back(ExtentForRange(10, 3));
+  props.extents.push_back(ExtentForRange(kSparseHole, 5));
+  props.extents.push_back(ExtentForRange(20, 1));
+  props.write_extents.push_back(ExtentForRange(30, 7));
+  graph[0].out_edges.insert(make_pair(3, props));
+  graph[0].out_edges.insert(make_pair(1, EdgeProperties()));
+  graph[2].out_edges.insert(make_pair(0, props));
+
+  CsrGraph csr_graph;
+  csr_graph.Assign(graph);
+  EXPECT_EQ(4, csr_graph.size());
+
+  // The edges of each vertex are ordered by destination.
+  ASSERT_EQ(2, csr_graph.EdgesEnd(0) - csr_graph.EdgesBegin(0));
+  EXPECT_EQ(1, csr_graph.EdgeDestination(csr_graph.EdgesBegin(0)));
+  EXPECT_EQ(3, csr_graph.EdgeDestination(csr_graph.EdgesBegin(0) + 1));
+  EXPECT_EQ(csr_graph.EdgesBegin(1), csr_graph.EdgesEnd(1));
+  ASSERT_EQ(1, csr_graph.EdgesEnd(2) - csr_graph.EdgesBegin(2));
+  EXPECT_EQ(0, csr_graph.EdgeDestination(csr_graph.EdgesBegin(2)));
+  EXPECT_EQ(csr_graph.EdgesBegin(3), csr_graph.EdgesEnd(3));
+
+  // Only the read-before blocks count, without the sparse holes.
+  EXPECT_EQ(CsrGraph::kInvalidEdge, csr_graph.FindEdge(1, 0));
+  EXPECT_EQ(CsrGraph::kInvalidEdge, csr_graph.FindEdge(0, 2));
+  EXPECT_EQ(0, csr_graph.EdgeWeight(csr_graph.FindEdge(0, 1)));
+  EXPECT_EQ(4, csr_graph.EdgeWeight(csr_graph.FindEdge(0, 3)));
+  EXPECT_EQ(4, csr_graph.EdgeWeight(csr_graph.FindEdge(2, 0)));
+
+  // Assigning again replaces the edges.
+  graph[0].out_edges.clear();
+  csr_graph.Assign(graph);
+  EXPECT_EQ(csr_graph.EdgesBegin(0), csr_graph.EdgesEnd(0));
+  EXPECT_EQ(CsrGraph::kInvalidEdge, csr_graph.FindEdge(0, 3));
+  EXPECT_EQ(4, csr_graph.EdgeWeight(csr_graph.FindEdge(2, 0)));
+}
+
+}  // namespace chromeos_update_engine
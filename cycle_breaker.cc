@@ -13,20 +13,47 @@
 #include "update_engine/utils.h"
 
 using std::make_pair;
+using std::pair;
 using std::set;
 using std::vector;
 
 namespace chromeos_update_engine {
 
-// This is the outer function from the original paper.
 void CycleBreaker::BreakCycles(const Graph& graph, set<Edge>* out_cut_edges) {
   cut_edges_.clear();
-  
-  // Make a copy, which we will modify by removing edges. Thus, in each
-  // iteration subgraph_ is the current subgraph or the original with
-  // vertices we desire. This variable was "A_K" in the original paper.
-  subgraph_ = graph;
-    
+  skipped_ops_ = 0;
+  graph_.Assign(graph);
+  // All the strongly connected components, found in one pass. Cycles only
+  // ever run within one of them.
+  TarjanAlgorithm tarjan;
+  tarjan.ExecuteAll(graph_, &component_ids_);
+
+  if (algorithm_ == kAlgorithmGreedy)
+    BreakCyclesGreedily();
+  else
+    BreakCyclesByCircuits(graph);
+
+  cut_weight_ = 0;
+  for (set<Edge>::const_iterator it = cut_edges_.begin();
+       it != cut_edges_.end(); ++it) {
+    cut_weight_ += graph_utils::EdgeWeight(graph_, *it);
+  }
+  LOG(INFO) << "Cut " << cut_edges_.size() << " edges weighing "
+            << cut_weight_ << " blocks.";
+  out_cut_edges->swap(cut_edges_);
+}
+
+// This is the outer function from the original paper.
+void CycleBreaker::BreakCyclesByCircuits(const Graph& graph) {
+  // |graph_| is a compact copy of the edges, from which vertices are removed
+  // by marking them in |removed_|. Thus, in each iteration, the vertices that
+  // aren't removed are the current subgraph.
+  removed_.assign(graph.size(), false);
+  in_component_.assign(graph.size(), false);
+  blocked_.assign(graph.size(), false);
+  blocked_graph_.clear();
+  blocked_graph_.resize(graph.size());
+
   // The paper calls for the "adjacency structure (i.e., graph) of
   // strong (-ly connected) component K with least vertex in subgraph
   // induced by {s, s + 1, ..., n}".
@@ -35,55 +62,210 @@ void CycleBreaker::BreakCycles(const Graph& graph, set<Edge>* out_cut_edges) {
   // and looking for the strongly connected component with vertex s.
 
   TarjanAlgorithm tarjan;
-  skipped_ops_ = 0;
     
-  for (Graph::size_type i = 0; i < subgraph_.size(); i++) {
+  for (Graph::size_type i = 0; i < graph.size(); i++) {
     DeltaArchiveManifest_InstallOperation_Type op_type = graph[i].op.type();
     if (op_type == DeltaArchiveManifest_InstallOperation_Type_REPLACE ||
-        op_type == DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ) {
+        op_type == DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ ||
+        op_type == DeltaArchiveManifest_InstallOperation_Type_REPLACE_XZ ||
+        op_type == DeltaArchiveManifest_InstallOperation_Type_REPLACE_XZ_DICT ||
+        op_type == DeltaArchiveManifest_InstallOperation_Type_ZERO) {
       skipped_ops_++;
       continue;
     }
 
     if (i > 0) {
-      // Erase node (i - 1) from subgraph_. First, erase what it points to
-      subgraph_[i - 1].out_edges.clear();
-      // Now, erase any pointers to node (i - 1)
-      for (Graph::size_type j = i; j < subgraph_.size(); j++) {
-        subgraph_[j].out_edges.erase(i - 1);
-      }
+      // Erase node (i - 1) from the subgraph, along with its edges.
+      removed_[i - 1] = true;
     }
 
-    // Calculate SCC (strongly connected component) with vertex i.
-    vector<Vertex::Index> component_indexes;
-    tarjan.Execute(i, &subgraph_, &component_indexes);
-
-    // Set subgraph edges for the components in the SCC.
-    for (vector<Vertex::Index>::iterator it = component_indexes.begin();
-         it != component_indexes.end(); ++it) {
-      subgraph_[*it].subgraph_edges.clear();
-      for (vector<Vertex::Index>::iterator jt = component_indexes.begin();
-           jt != component_indexes.end(); ++jt) {
-        // If there's a link from *it -> *jt in the graph,
-        // add a subgraph_ edge
-        if (utils::MapContainsKey(subgraph_[*it].out_edges, *jt))
-          subgraph_[*it].subgraph_edges.insert(*jt);
-      }        
+    // Calculate SCC (strongly connected component) with vertex i, which is
+    // part of its component in the whole graph. Only the edges within it
+    // are followed below.
+    component_.clear();
+    tarjan.Execute(i, graph_, &removed_, &component_ids_, &component_);
+    for (vector<Vertex::Index>::iterator it = component_.begin();
+         it != component_.end(); ++it) {
+      in_component_[*it] = true;
     }
 
     current_vertex_ = i;
-    blocked_.clear();
-    blocked_.resize(subgraph_.size());
-    blocked_graph_.clear();
-    blocked_graph_.resize(subgraph_.size());
     Circuit(current_vertex_, 0);
+
+    // Only the vertices of the component were blocked and given "B" edges.
+    for (vector<Vertex::Index>::iterator it = component_.begin();
+         it != component_.end(); ++it) {
+      in_component_[*it] = false;
+      blocked_[*it] = false;
+      blocked_graph_[*it].clear();
+    }
   }
-  
-  out_cut_edges->swap(cut_edges_);
+
   LOG(INFO) << "Cycle breaker skipped " << skipped_ops_ << " ops.";
   DCHECK(stack_.empty());
 }
 
+namespace {
+
+// The remaining edges of the vertices that haven't been placed in the order
+// yet, for CycleBreaker::BreakCyclesGreedily().
+struct GreedyVertex {
+  GreedyVertex() : in_degree(0), out_degree(0), delta(0), placed(false) {}
+  Vertex::Index in_degree;
+  Vertex::Index out_degree;
+  // The weight of the outgoing edges minus that of the incoming ones.
+  int64_t delta;
+  bool placed;
+};
+
+// The vertices that are neither sinks nor sources, the one with the highest
+// delta first.
+typedef set<pair<int64_t, Vertex::Index> > DeltaQueue;
+
+// Queues |vertex| as a sink or a source, or else by its delta.
+void QueueGreedyVertex(Vertex::Index vertex,
+                       const GreedyVertex& state,
+                       vector<Vertex::Index>* sinks,
+                       vector<Vertex::Index>* sources,
+                       DeltaQueue* queue) {
+  if (state.out_degree == 0)
+    sinks->push_back(vertex);
+  else if (state.in_degree == 0)
+    sources->push_back(vertex);
+  else
+    queue->insert(make_pair(-state.delta, vertex));
+}
+
+}  // namespace {}
+
+void CycleBreaker::BreakCyclesGreedily() {
+  const Vertex::Index num_vertices = graph_.size();
+  if (num_vertices == 0)
+    return;
+
+  // Only the edges within a strongly connected component can be part of a
+  // cycle, so those between components are left out, and each component is
+  // effectively ordered on its own.
+
+  const CsrGraph::EdgeIndex num_edges = graph_.EdgesBegin(num_vertices);
+  vector<bool> in_cycle(num_edges, false);
+  vector<uint64_t> weights(num_edges, 0);
+  vector<GreedyVertex> vertices(num_vertices);
+  // The incoming edges of vertex v are [in_begin[v], in_begin[v + 1]) in
+  // |in_edges|, as (source, edge) pairs.
+  vector<CsrGraph::EdgeIndex> in_begin(num_vertices + 1, 0);
+  for (Vertex::Index u = 0; u < num_vertices; u++) {
+    for (CsrGraph::EdgeIndex edge = graph_.EdgesBegin(u);
+         edge != graph_.EdgesEnd(u); ++edge) {
+      Vertex::Index v = graph_.EdgeDestination(edge);
+      if (u == v) {
+        cut_edges_.insert(make_pair(u, v));
+        continue;
+      }
+      if (component_ids_[u] != component_ids_[v])
+        continue;
+      in_cycle[edge] = true;
+      weights[edge] = graph_.EdgeWeight(edge);
+      vertices[u].out_degree++;
+      vertices[u].delta += weights[edge];
+      vertices[v].in_degree++;
+      vertices[v].delta -= weights[edge];
+      in_begin[v + 1]++;
+    }
+  }
+  for (Vertex::Index v = 0; v < num_vertices; v++)
+    in_begin[v + 1] += in_begin[v];
+  vector<pair<Vertex::Index, CsrGraph::EdgeIndex> > in_edges(
+      in_begin[num_vertices]);
+  {
+    vector<CsrGraph::EdgeIndex> next(in_begin.begin(), in_begin.end() - 1);
+    for (Vertex::Index u = 0; u < num_vertices; u++) {
+      for (CsrGraph::EdgeIndex edge = graph_.EdgesBegin(u);
+           edge != graph_.EdgesEnd(u); ++edge) {
+        if (in_cycle[edge])
+          in_edges[next[graph_.EdgeDestination(edge)]++] = make_pair(u, edge);
+      }
+    }
+  }
+
+  vector<Vertex::Index> sinks;
+  vector<Vertex::Index> sources;
+  DeltaQueue queue;
+  for (Vertex::Index v = 0; v < num_vertices; v++)
+    QueueGreedyVertex(v, vertices[v], &sinks, &sources, &queue);
+
+  // Sinks are placed from the back of the order, everything else from the
+  // front. A vertex may be queued more than once, but it's only placed the
+  // first time.
+  vector<Vertex::Index> positions(num_vertices);
+  Vertex::Index front = 0;
+  Vertex::Index back = num_vertices;
+  while (front < back) {
+    Vertex::Index vertex;
+    if (!sinks.empty()) {
+      vertex = sinks.back();
+      sinks.pop_back();
+      if (vertices[vertex].placed)
+        continue;
+      positions[vertex] = --back;
+    } else {
+      if (!sources.empty()) {
+        vertex = sources.back();
+        sources.pop_back();
+      } else {
+        CHECK(!queue.empty());
+        vertex = queue.begin()->second;
+        queue.erase(queue.begin());
+      }
+      if (vertices[vertex].placed)
+        continue;
+      positions[vertex] = front++;
+    }
+    vertices[vertex].placed = true;
+
+    // Take the vertex's edges out of its neighbors' counts, requeueing them
+    // if they were queued by delta.
+    for (CsrGraph::EdgeIndex edge = graph_.EdgesBegin(vertex);
+         edge != graph_.EdgesEnd(vertex); ++edge) {
+      Vertex::Index w = graph_.EdgeDestination(edge);
+      GreedyVertex& state = vertices[w];
+      if (!in_cycle[edge] || state.placed)
+        continue;
+      bool queued = state.in_degree > 0 && state.out_degree > 0;
+      if (queued)
+        queue.erase(make_pair(-state.delta, w));
+      state.in_degree--;
+      state.delta += weights[edge];
+      if (queued || state.in_degree == 0)
+        QueueGreedyVertex(w, state, &sinks, &sources, &queue);
+    }
+    for (CsrGraph::EdgeIndex i = in_begin[vertex]; i < in_begin[vertex + 1];
+         i++) {
+      Vertex::Index u = in_edges[i].first;
+      GreedyVertex& state = vertices[u];
+      if (state.placed)
+        continue;
+      bool queued = state.in_degree > 0 && state.out_degree > 0;
+      if (queued)
+        queue.erase(make_pair(-state.delta, u));
+      state.out_degree--;
+      state.delta -= weights[in_edges[i].second];
+      if (queued || state.out_degree == 0)
+        QueueGreedyVertex(u, state, &sinks, &sources, &queue);
+    }
+  }
+
+  // Cut the edges that point backwards in the order.
+  for (Vertex::Index u = 0; u < num_vertices; u++) {
+    for (CsrGraph::EdgeIndex edge = graph_.EdgesBegin(u);
+         edge != graph_.EdgesEnd(u); ++edge) {
+      Vertex::Index v = graph_.EdgeDestination(edge);
+      if (in_cycle[edge] && positions[u] > positions[v])
+        cut_edges_.insert(make_pair(u, v));
+    }
+  }
+}
+
 static const size_t kMaxEdgesToConsider = 2;
 
 void CycleBreaker::HandleCircuit() {
@@ -100,7 +282,7 @@ void CycleBreaker::HandleCircuit() {
       stack_.pop_back();
       return;
     }
-    uint64_t edge_weight = graph_utils::EdgeWeight(subgraph_, edge);
+    uint64_t edge_weight = graph_utils::EdgeWeight(graph_, edge);
     if (edge_weight < min_edge_weight) {
       min_edge_weight = edge_weight;
       min_edge = edge;
@@ -116,12 +298,12 @@ void CycleBreaker::HandleCircuit() {
 void CycleBreaker::Unblock(Vertex::Index u) {
   blocked_[u] = false;
 
-  for (Vertex::EdgeMap::iterator it = blocked_graph_[u].out_edges.begin();
-       it != blocked_graph_[u].out_edges.end(); ) {
-    Vertex::Index w = it->first;
-    blocked_graph_[u].out_edges.erase(it++);
-    if (blocked_[w])
-      Unblock(w);
+  vector<Vertex::Index> edges;
+  edges.swap(blocked_graph_[u]);
+  for (vector<Vertex::Index>::const_iterator it = edges.begin();
+       it != edges.end(); ++it) {
+    if (blocked_[*it])
+      Unblock(*it);
   }
 }
 
@@ -156,17 +338,19 @@ bool CycleBreaker::Circuit(Vertex::Index vertex, Vertex::Index depth) {
     }
   }
 
-  for (Vertex::SubgraphEdgeMap::iterator w =
-           subgraph_[vertex].subgraph_edges.begin();
-       w != subgraph_[vertex].subgraph_edges.end(); ++w) {
-    if (*w == current_vertex_) {
+  for (CsrGraph::EdgeIndex edge = graph_.EdgesBegin(vertex);
+       edge != graph_.EdgesEnd(vertex); ++edge) {
+    Vertex::Index w = graph_.EdgeDestination(edge);
+    if (!in_component_[w])
+      continue;
+    if (w == current_vertex_) {
       // The original paper called for printing stack_ followed by
       // current_vertex_ here, which is a cycle. Instead, we call
       // HandleCircuit() to break it.
       HandleCircuit();
       found = true;
-    } else if (!blocked_[*w]) {
-      if (Circuit(*w, depth + 1)) {
+    } else if (!blocked_[w]) {
+      if (Circuit(w, depth + 1)) {
         found = true;
         if ((depth > kMaxEdgesToConsider) || StackContainsCutEdge())
           break;
@@ -177,13 +361,12 @@ bool CycleBreaker::Circuit(Vertex::Index vertex, Vertex::Index depth) {
   if (found) {
     Unblock(vertex);
   } else {
-    for (Vertex::SubgraphEdgeMap::iterator w =
-             subgraph_[vertex].subgraph_edges.begin();
-         w != subgraph_[vertex].subgraph_edges.end(); ++w) {
-      if (blocked_graph_[*w].out_edges.find(vertex) ==
-          blocked_graph_[*w].out_edges.end()) {
-        blocked_graph_[*w].out_edges.insert(make_pair(vertex,
-                                                      EdgeProperties()));
+    for (CsrGraph::EdgeIndex edge = graph_.EdgesBegin(vertex);
+         edge != graph_.EdgesEnd(vertex); ++edge) {
+      Vertex::Index w = graph_.EdgeDestination(edge);
+      if (in_component_[w] &&
+          !utils::VectorContainsValue(blocked_graph_[w], vertex)) {
+        blocked_graph_[w].push_back(vertex);
       }
     }
   }
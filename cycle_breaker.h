@@ -19,22 +19,45 @@
 // to consider all cycles before cutting any; there are simply too many.
 // In a sample graph representative of a typical workload, I found over
 // 5 * 10^15 cycles.
+//
+// As the enumeration can still take a long time on some graphs, the
+// Eades-Lin-Smyth heuristic for the weighted feedback arc set may be used
+// instead. It orders the vertices by repeatedly taking a sink, a source or
+// else the vertex whose outgoing edges outweigh its incoming ones the most,
+// and cuts the edges that point backwards in that order. It takes
+// O(E log V) time.
 
 #include <set>
 #include <vector>
+#include "update_engine/csr_graph.h"
 #include "update_engine/graph_types.h"
 
 namespace chromeos_update_engine {
 
 class CycleBreaker {
  public:
-  CycleBreaker() : skipped_ops_(0) {}
+  enum Algorithm {
+    kAlgorithmCircuits,  // Johnson's circuit enumeration, the default.
+    kAlgorithmGreedy  // The Eades-Lin-Smyth heuristic.
+  };
+
+  CycleBreaker()
+      : algorithm_(kAlgorithmCircuits), skipped_ops_(0), cut_weight_(0) {}
   // out_cut_edges is replaced with the cut edges.
   void BreakCycles(const Graph& graph, std::set<Edge>* out_cut_edges);
-  
+
+  void set_algorithm(Algorithm algorithm) { algorithm_ = algorithm; }
+
+  // Only counted by the circuit enumeration.
   size_t skipped_ops() const { return skipped_ops_; }
 
+  // The number of blocks in the read-before extents of the cut edges, which
+  // have to be copied to scratch space.
+  uint64_t cut_weight() const { return cut_weight_; }
+
  private:
+  void BreakCyclesByCircuits(const Graph& graph);
+  void BreakCyclesGreedily();
   void HandleCircuit();
   void Unblock(Vertex::Index u);
   bool Circuit(Vertex::Index vertex, Vertex::Index depth);
@@ -43,14 +66,28 @@ class CycleBreaker {
   std::vector<bool> blocked_;  // "blocked" in the paper
   Vertex::Index current_vertex_;  // "s" in the paper
   std::vector<Vertex::Index> stack_;  // the stack variable in the paper
-  Graph subgraph_;  // "A_K" in the paper
-  Graph blocked_graph_;  // "B" in the paper
+
+  // "A_K" in the paper: the edges of |graph_| between the vertices of
+  // |component_| that aren't |removed_|.
+  CsrGraph graph_;
+  // The strongly connected component of each vertex of the whole graph.
+  std::vector<Vertex::Index> component_ids_;
+  std::vector<bool> removed_;
+  std::vector<Vertex::Index> component_;
+  std::vector<bool> in_component_;
+
+  // "B" in the paper.
+  std::vector<std::vector<Vertex::Index> > blocked_graph_;
 
   std::set<Edge> cut_edges_;
-  
+
+  Algorithm algorithm_;
+
   // Number of operations skipped b/c we know they don't have any
   // incoming edges.
   size_t skipped_ops_;
+
+  uint64_t cut_weight_;
 };
 
 }  // namespace chromeos_update_engine
@@ -10,6 +10,7 @@
 #include "base/logging.h"
 #include "update_engine/cycle_breaker.h"
 #include "update_engine/graph_types.h"
+#include "update_engine/tarjan.h"
 #include "update_engine/utils.h"
 
 using std::make_pair;
@@ -87,6 +88,25 @@ uint64_t weight) {
   props.extents[0].set_num_blocks(weight);
   return make_pair(dest, props);
 }
+
+// Returns true if |graph| has no cycles once |cut_edges| are removed.
+bool IsAcyclicWithoutEdges(Graph graph, const set<Edge>& cut_edges) {
+  for (set<Edge>::const_iterator it = cut_edges.begin();
+       it != cut_edges.end(); ++it) {
+    graph[it->first].out_edges.erase(it->second);
+  }
+  for (Vertex::Index i = 0; i < graph.size(); i++) {
+    if (utils::MapContainsKey(graph[i].out_edges, i))
+      return false;
+  }
+  CsrGraph csr_graph;
+  csr_graph.Assign(graph);
+  TarjanAlgorithm tarjan;
+  vector<Vertex::Index> component_ids;
+  tarjan.ExecuteAll(csr_graph, &component_ids);
+  set<Vertex::Index> components(component_ids.begin(), component_ids.end());
+  return components.size() == graph.size();
+}
 }  // namespace {}
 
 
@@ -261,4 +281,54 @@ TEST(CycleBreakerTest, SkipOpsTest) {
   EXPECT_EQ(2, breaker.skipped_ops());
 }
 
+TEST(CycleBreakerTest, GreedyTest) {
+  Graph graph(5);
+  SetOpForNodes(&graph);
+  // Cycles a -> b -> c -> a, b -> d -> b and a self loop on e. Cutting the
+  // light edges c -> a and d -> b is best.
+  graph[0].out_edges.insert(EdgeWithWeight(1, 5));
+  graph[1].out_edges.insert(EdgeWithWeight(2, 5));
+  graph[2].out_edges.insert(EdgeWithWeight(0, 1));
+  graph[1].out_edges.insert(EdgeWithWeight(3, 5));
+  graph[3].out_edges.insert(EdgeWithWeight(1, 2));
+  graph[3].out_edges.insert(EdgeWithWeight(4, 7));
+  graph[4].out_edges.insert(EdgeWithWeight(4, 3));
+
+  CycleBreaker breaker;
+  breaker.set_algorithm(CycleBreaker::kAlgorithmGreedy);
+  set<Edge> broken_edges;
+  breaker.BreakCycles(graph, &broken_edges);
+
+  set<Edge> expected_cuts;
+  expected_cuts.insert(make_pair(2, 0));
+  expected_cuts.insert(make_pair(3, 1));
+  expected_cuts.insert(make_pair(4, 4));
+  EXPECT_TRUE(broken_edges == expected_cuts);
+  EXPECT_EQ(6, breaker.cut_weight());
+}
+
+TEST(CycleBreakerTest, GreedyRandomGraphsTest) {
+  // Both algorithms leave random graphs acyclic.
+  unsigned int seed = 1;
+  for (int i = 0; i < 50; i++) {
+    Graph graph(5 + rand_r(&seed) % 50);
+    SetOpForNodes(&graph);
+    for (Vertex::Index j = 0; j < graph.size(); j++) {
+      for (int k = rand_r(&seed) % 5; k > 0; k--) {
+        graph[j].out_edges.insert(
+            EdgeWithWeight(rand_r(&seed) % graph.size(),
+                           1 + rand_r(&seed) % 10));
+      }
+    }
+    for (int greedy = 0; greedy < 2; greedy++) {
+      CycleBreaker breaker;
+      if (greedy)
+        breaker.set_algorithm(CycleBreaker::kAlgorithmGreedy);
+      set<Edge> broken_edges;
+      breaker.BreakCycles(graph, &broken_edges);
+      EXPECT_TRUE(IsAcyclicWithoutEdges(graph, broken_edges));
+    }
+  }
+}
+
 }  // namespace chromeos_update_engine
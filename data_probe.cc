@@ -0,0 +1,177 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/data_probe.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+using std::max;
+using std::min;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace data_probe {
+
+namespace {
+
+// The bytes an anchor is hashed from.
+const size_t kGramSize = 8;
+
+// At least one gram in this many is an anchor, and fewer in large data so
+// that there are at most about kMaxAnchors of them.
+const size_t kMinAnchorInterval = 64;
+const size_t kMaxAnchors = 64 * 1024;
+
+// Returns the mask of the bits of the hashes of anchors, which are clear,
+// for data of |size| bytes. The interval between anchors is a power of two.
+uint32_t AnchorMask(size_t size) {
+  size_t interval = kMinAnchorInterval;
+  while (interval < size / kMaxAnchors)
+    interval *= 2;
+  return interval - 1;
+}
+
+uint32_t GramHash(const char* gram) {
+  uint64_t value;
+  memcpy(&value, gram, kGramSize);
+  return (value * 0x9e3779b97f4a7c15ULL) >> 32;
+}
+
+// Appends the hashes of the grams of the |size| bytes at |data| whose bits
+// in |mask| are clear to |anchors|.
+void AppendAnchors(const char* data,
+                   size_t size,
+                   uint32_t mask,
+                   vector<uint32_t>* anchors) {
+  for (size_t i = 0; i + kGramSize <= size; i++) {
+    const uint32_t hash = GramHash(data + i);
+    if ((hash & mask) == 0)
+      anchors->push_back(hash);
+  }
+}
+
+}  // namespace {}
+
+double Entropy(const char* data, size_t size) {
+  if (size == 0)
+    return 0;
+  size_t counts[256] = { 0 };
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+  for (size_t i = 0; i < size; i++)
+    counts[bytes[i]]++;
+  double entropy = 0;
+  for (size_t i = 0; i < 256; i++) {
+    if (counts[i] == 0)
+      continue;
+    const double p = static_cast<double>(counts[i]) / size;
+    entropy -= p * log2(p);
+  }
+  return entropy;
+}
+
+double MinSampleEntropy(const char* data,
+                        size_t size,
+                        size_t samples,
+                        size_t sample_size) {
+  if (samples < 2 || size <= samples * sample_size)
+    return Entropy(data, size);
+  const size_t stride = (size - sample_size) / (samples - 1);
+  double entropy = 8;
+  for (size_t i = 0; i < samples; i++)
+    entropy = min(entropy, Entropy(data + i * stride, sample_size));
+  return entropy;
+}
+
+double RepeatedContentFraction(const char* data, size_t size) {
+  vector<uint32_t> anchors;
+  AppendAnchors(data, size, AnchorMask(size), &anchors);
+  if (anchors.empty())
+    return 0;
+  std::sort(anchors.begin(), anchors.end());
+  const size_t distinct =
+      std::unique(anchors.begin(), anchors.end()) - anchors.begin();
+  return static_cast<double>(anchors.size() - distinct) / anchors.size();
+}
+
+double SharedContentFraction(const char* old_data,
+                             size_t old_size,
+                             const char* new_data,
+                             size_t new_size) {
+  const uint32_t mask = AnchorMask(max(old_size, new_size));
+  vector<uint32_t> new_anchors;
+  AppendAnchors(new_data, new_size, mask, &new_anchors);
+  if (new_anchors.empty())
+    return 1;
+  vector<uint32_t> old_anchors;
+  AppendAnchors(old_data, old_size, mask, &old_anchors);
+  std::sort(old_anchors.begin(), old_anchors.end());
+  size_t shared = 0;
+  for (size_t i = 0; i < new_anchors.size(); i++) {
+    if (std::binary_search(old_anchors.begin(), old_anchors.end(),
+                           new_anchors[i]))
+      shared++;
+  }
+  return static_cast<double>(shared) / new_anchors.size();
+}
+
+void Sketch(const char* data,
+            size_t size,
+            size_t count,
+            vector<uint32_t>* sketch) {
+  sketch->clear();
+  if (count == 0)
+    return;
+  // Hashes are collected below the largest of the |count| smallest so far,
+  // and pruned back to those whenever 4 times as many piled up.
+  uint32_t limit = UINT32_MAX;
+  for (size_t i = 0; i + kGramSize <= size; i++) {
+    const uint32_t hash = GramHash(data + i);
+    if (hash > limit)
+      continue;
+    sketch->push_back(hash);
+    if (sketch->size() < 4 * count)
+      continue;
+    std::sort(sketch->begin(), sketch->end());
+    sketch->erase(std::unique(sketch->begin(), sketch->end()), sketch->end());
+    if (sketch->size() >= count) {
+      sketch->resize(count);
+      limit = sketch->back();
+    }
+  }
+  std::sort(sketch->begin(), sketch->end());
+  sketch->erase(std::unique(sketch->begin(), sketch->end()), sketch->end());
+  if (sketch->size() > count)
+    sketch->resize(count);
+}
+
+double SketchSimilarity(const vector<uint32_t>& a,
+                        const vector<uint32_t>& b,
+                        size_t count) {
+  if (a.empty() && b.empty())
+    return 1;
+  size_t taken = 0, shared = 0, i = 0, j = 0;
+  while (taken < count && (i < a.size() || j < b.size())) {
+    if (j == b.size() || (i < a.size() && a[i] < b[j])) {
+      i++;
+    } else if (i == a.size() || b[j] < a[i]) {
+      j++;
+    } else {
+      shared++;
+      i++;
+      j++;
+    }
+    taken++;
+  }
+  return static_cast<double>(shared) / taken;
+}
+
+}  // namespace data_probe
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,72 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_DATA_PROBE_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_DATA_PROBE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+// Cheap looks at data that tell the payload generator when the expensive
+// encoders are bound to be wasted on it: data that's compressed already,
+// which no compressor will shrink, and new data that has nothing in common
+// with the old data it would be diffed against. Both run at memory speed,
+// far faster than the compressors and bsdiff they save.
+
+namespace chromeos_update_engine {
+
+namespace data_probe {
+
+// Returns the order-0 entropy of the |size| bytes at |data|, in bits per
+// byte: 8 for data whose byte values are evenly spread, as compressed or
+// encrypted data's are, and 0 for data of a single byte value.
+double Entropy(const char* data, size_t size);
+
+// Returns the lowest Entropy() of |samples| samples of |sample_size| bytes
+// spread evenly over the |size| bytes at |data|, or the Entropy() of all of
+// them if they're fewer than the samples would take.
+double MinSampleEntropy(const char* data,
+                        size_t size,
+                        size_t samples,
+                        size_t sample_size);
+
+// Returns the fraction of the anchors of the |size| bytes at |data| that
+// repeat an anchor found earlier in it. Data of high Entropy() that repeats
+// itself, which compressors still shrink, has many. Returns 0 if the data
+// is too short or too uniform to have anchors.
+double RepeatedContentFraction(const char* data, size_t size);
+
+// Returns the fraction of the anchors of the |new_size| bytes at |new_data|
+// that are also anchors of the |old_size| bytes at |old_data|. Anchors are
+// short runs of bytes picked by their contents rather than their offsets,
+// so the data shared by both counts wherever it moved to. Returns 1 if the
+// new data is too short or too uniform to have anchors.
+double SharedContentFraction(const char* old_data,
+                             size_t old_size,
+                             const char* new_data,
+                             size_t new_size);
+
+// Sets |sketch| to the MinHash sketch of the |size| bytes at |data|: the
+// |count| smallest distinct hashes of its 8-byte grams, in increasing order,
+// or all of them if there are fewer.
+void Sketch(const char* data,
+            size_t size,
+            size_t count,
+            std::vector<uint32_t>* sketch);
+
+// Returns the estimated Jaccard similarity of the sets of grams of the data
+// sketched in |a| and |b| with the same |count|: the fraction of the |count|
+// smallest hashes of both sketches that are in each. 1 for the same data,
+// and near 0 for unrelated data.
+double SketchSimilarity(const std::vector<uint32_t>& a,
+                        const std::vector<uint32_t>& b,
+                        size_t count);
+
+}  // namespace data_probe
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_DATA_PROBE_H__
@@ -0,0 +1,147 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stdlib.h>
+
+#include <string>
+#include <vector>
+
+#include <base/basictypes.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/data_probe.h"
+#include "update_engine/test_utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Returns |size| bytes of text-like data.
+vector<char> TextData(size_t size) {
+  const string words[] = { "update ", "engine ", "payload ", "block ",
+                           "extent ", "the ", "of ", "and ", "\n" };
+  vector<char> data;
+  while (data.size() < size) {
+    const string& word = words[random() % arraysize(words)];
+    data.insert(data.end(), word.begin(), word.end());
+  }
+  data.resize(size);
+  return data;
+}
+
+}  // namespace {}
+
+TEST(DataProbeTest, EntropyTest) {
+  EXPECT_EQ(0, data_probe::Entropy(NULL, 0));
+  const vector<char> zeros(4096, 0);
+  EXPECT_EQ(0, data_probe::Entropy(&zeros[0], zeros.size()));
+  vector<char> all_values;
+  for (int i = 0; i < 256 * 4; i++)
+    all_values.push_back(i);
+  EXPECT_DOUBLE_EQ(8, data_probe::Entropy(&all_values[0], all_values.size()));
+  vector<char> two_values(1024, 'a');
+  two_values.insert(two_values.end(), 1024, 'b');
+  EXPECT_DOUBLE_EQ(1, data_probe::Entropy(&two_values[0], two_values.size()));
+}
+
+TEST(DataProbeTest, MinSampleEntropyTest) {
+  const vector<char> random_data = RandomData(1024 * 1024);
+  EXPECT_GT(data_probe::MinSampleEntropy(&random_data[0], random_data.size(),
+                                         4, 16 * 1024), 7.95);
+  const vector<char> text = TextData(1024 * 1024);
+  EXPECT_LT(data_probe::MinSampleEntropy(&text[0], text.size(), 4, 16 * 1024),
+            5);
+
+  // A single low entropy sample is enough.
+  vector<char> mixed = random_data;
+  std::copy(text.begin(), text.begin() + 64 * 1024, mixed.end() - 64 * 1024);
+  EXPECT_LT(data_probe::MinSampleEntropy(&mixed[0], mixed.size(), 4,
+                                         16 * 1024), 5);
+
+  // Data smaller than the samples is looked at as a whole.
+  EXPECT_DOUBLE_EQ(data_probe::Entropy(&text[0], 1000),
+                   data_probe::MinSampleEntropy(&text[0], 1000, 4, 16 * 1024));
+}
+
+TEST(DataProbeTest, RepeatedContentFractionTest) {
+  vector<char> data = RandomData(256 * 1024);
+  EXPECT_LT(data_probe::RepeatedContentFraction(&data[0], data.size()), 0.01);
+  data.insert(data.end(), data.begin(), data.end());
+  const double fraction =
+      data_probe::RepeatedContentFraction(&data[0], data.size());
+  EXPECT_GT(fraction, 0.45);
+  EXPECT_LT(fraction, 0.55);
+  EXPECT_EQ(0, data_probe::RepeatedContentFraction(NULL, 0));
+}
+
+TEST(DataProbeTest, SharedContentFractionTest) {
+  const vector<char> old_data = RandomData(256 * 1024);
+  EXPECT_DOUBLE_EQ(1, data_probe::SharedContentFraction(
+      &old_data[0], old_data.size(), &old_data[0], old_data.size()));
+
+  const vector<char> unrelated = RandomData(256 * 1024);
+  EXPECT_LT(data_probe::SharedContentFraction(
+      &old_data[0], old_data.size(), &unrelated[0], unrelated.size()), 0.01);
+
+  // Data moved around and partly changed is still found.
+  vector<char> new_data = RandomData(1000);
+  new_data.insert(new_data.end(), old_data.begin() + 128 * 1024,
+                  old_data.end());
+  new_data.insert(new_data.end(), old_data.begin(),
+                  old_data.begin() + 64 * 1024);
+  const vector<char> tail = RandomData(64 * 1024);
+  new_data.insert(new_data.end(), tail.begin(), tail.end());
+  const double fraction = data_probe::SharedContentFraction(
+      &old_data[0], old_data.size(), &new_data[0], new_data.size());
+  EXPECT_GT(fraction, 0.6);
+  EXPECT_LT(fraction, 0.9);
+
+  // Data without anchors can't be told apart.
+  EXPECT_DOUBLE_EQ(1, data_probe::SharedContentFraction(
+      &old_data[0], old_data.size(), NULL, 0));
+}
+
+TEST(DataProbeTest, SketchTest) {
+  const vector<char> data = RandomData(64 * 1024);
+  vector<uint32_t> sketch;
+  data_probe::Sketch(&data[0], data.size(), 64, &sketch);
+  ASSERT_EQ(64U, sketch.size());
+  for (size_t i = 1; i < sketch.size(); i++)
+    EXPECT_LT(sketch[i - 1], sketch[i]);
+  EXPECT_DOUBLE_EQ(1, data_probe::SketchSimilarity(sketch, sketch, 64));
+
+  // Sketches are of the set of grams, whatever their order and count.
+  vector<char> reordered(data.begin() + 32 * 1024, data.end());
+  reordered.insert(reordered.end(), data.begin(), data.begin() + 32 * 1024);
+  reordered.insert(reordered.end(), data.begin(), data.end());
+  vector<uint32_t> reordered_sketch;
+  data_probe::Sketch(&reordered[0], reordered.size(), 64, &reordered_sketch);
+  EXPECT_GT(data_probe::SketchSimilarity(sketch, reordered_sketch, 64), 0.9);
+
+  // Half the data replaced makes about a third of the grams shared.
+  vector<char> changed(data.begin(), data.begin() + 32 * 1024);
+  const vector<char> tail = RandomData(32 * 1024);
+  changed.insert(changed.end(), tail.begin(), tail.end());
+  vector<uint32_t> changed_sketch;
+  data_probe::Sketch(&changed[0], changed.size(), 256, &changed_sketch);
+  data_probe::Sketch(&data[0], data.size(), 256, &sketch);
+  const double similarity =
+      data_probe::SketchSimilarity(sketch, changed_sketch, 256);
+  EXPECT_GT(similarity, 0.2);
+  EXPECT_LT(similarity, 0.5);
+
+  const vector<char> unrelated = RandomData(64 * 1024);
+  vector<uint32_t> unrelated_sketch;
+  data_probe::Sketch(&unrelated[0], unrelated.size(), 256, &unrelated_sketch);
+  EXPECT_LT(data_probe::SketchSimilarity(sketch, unrelated_sketch, 256), 0.05);
+
+  // Data shorter than a gram has no hashes.
+  data_probe::Sketch(&data[0], 7, 64, &sketch);
+  EXPECT_TRUE(sketch.empty());
+}
+
+}  // namespace chromeos_update_engine
@@ -87,6 +87,17 @@ class DbusGlibInterface {
                                          GType var_arg3, char** var_arg4,
                                          GType var_arg5, char** var_arg6,
                                          GType var_arg7) = 0;
+
+  // wraps dbus_g_method_return with no value
+  virtual void MethodReturn(DBusGMethodInvocation* context) = 0;
+
+  // wraps dbus_g_method_return with a string value
+  virtual void MethodReturnString(DBusGMethodInvocation* context,
+                                  const char* value) = 0;
+
+  // wraps dbus_g_method_return_error
+  virtual void MethodReturnError(DBusGMethodInvocation* context,
+                                 const GError* error) = 0;
 };
 
 class ConcreteDbusGlib : public DbusGlibInterface {
@@ -189,6 +200,20 @@ class ConcreteDbusGlib : public DbusGlibInterface {
                                  var_arg5, var_arg6,
                                  var_arg7);
   }
+
+  virtual void MethodReturn(DBusGMethodInvocation* context) {
+    dbus_g_method_return(context);
+  }
+
+  virtual void MethodReturnString(DBusGMethodInvocation* context,
+                                  const char* value) {
+    dbus_g_method_return(context, value);
+  }
+
+  virtual void MethodReturnError(DBusGMethodInvocation* context,
+                                 const GError* error) {
+    dbus_g_method_return_error(context, error);
+  }
 };
 
 }  // namespace chromeos_update_engine
@@ -7,11 +7,13 @@
 #include <string>
 
 #include <base/logging.h>
+#include <base/memory/scoped_ptr.h>
 
 #include "update_engine/marshal.glibmarshal.h"
 #include "update_engine/omaha_request_params.h"
 #include "update_engine/utils.h"
 
+using chromeos_update_engine::DbusGlibInterface;
 using std::string;
 
 static const char kAUTestURLRequest[] = "autest";
@@ -26,6 +28,10 @@ static const char kAUTestURL[] =
 G_DEFINE_TYPE(UpdateEngineService, update_engine_service, G_TYPE_OBJECT)
 
 static void update_engine_service_finalize(GObject* object) {
+  UpdateEngineService* self = UPDATE_ENGINE_SERVICE(object);
+  DCHECK_EQ(g_hash_table_size(self->pending_calls_), 0U);
+  g_hash_table_destroy(self->pending_calls_);
+  g_mutex_clear(&self->lock_);
   G_OBJECT_CLASS(update_engine_service_parent_class)->finalize(object);
 }
 
@@ -54,6 +60,12 @@ static void update_engine_service_class_init(UpdateEngineServiceClass* klass) {
 }
 
 static void update_engine_service_init(UpdateEngineService* object) {
+  object->system_state_ = NULL;
+  object->dbus_iface_ = NULL;
+  object->dbus_context_ = NULL;
+  g_mutex_init(&object->lock_);
+  object->pending_calls_ = g_hash_table_new(g_direct_hash, g_direct_equal);
+  object->stopping_ = FALSE;
 }
 
 UpdateEngineService* update_engine_service_new(void) {
@@ -61,19 +73,156 @@ UpdateEngineService* update_engine_service_new(void) {
       g_object_new(UPDATE_ENGINE_TYPE_SERVICE, NULL));
 }
 
-gboolean update_engine_service_attempt_update(UpdateEngineService* self,
-                                              GError **error) {
+void update_engine_service_set_dbus_context(UpdateEngineService* self,
+                                            GMainContext* context) {
+  self->dbus_context_ = context;
+}
+
+// A reply to a method call, sent from the context of the connection.
+struct MethodReply {
+  UpdateEngineService* service;
+  DBusGMethodInvocation* context;
+  string error;  // Answers with this error if not empty.
+  bool has_value;
+  string value;  // The string returned if |has_value|.
+};
+
+static gboolean SendReply(gpointer data) {
+  scoped_ptr<MethodReply> reply(reinterpret_cast<MethodReply*>(data));
+  DbusGlibInterface* dbus_iface = reply->service->dbus_iface_;
+  if (!reply->error.empty()) {
+    GError* error = g_error_new_literal(
+        g_quark_from_static_string("update-engine-service-error"),
+        0,
+        reply->error.c_str());
+    dbus_iface->MethodReturnError(reply->context, error);
+    g_error_free(error);
+  } else if (reply->has_value) {
+    dbus_iface->MethodReturnString(reply->context, reply->value.c_str());
+  } else {
+    dbus_iface->MethodReturn(reply->context);
+  }
+  return FALSE;  // Don't call this callback again.
+}
+
+// Answers the call of |context| to |self| from the context of the
+// connection: with |error| if not empty, else with |value| if |has_value|.
+// Sent right away if called from there.
+static void Reply(UpdateEngineService* self,
+                  DBusGMethodInvocation* context,
+                  const string& error,
+                  bool has_value,
+                  const string& value) {
+  MethodReply* reply = new MethodReply;
+  reply->service = self;
+  reply->context = context;
+  reply->error = error;
+  reply->has_value = has_value;
+  reply->value = value;
+  g_main_context_invoke(self->dbus_context_, &SendReply, reply);
+}
+
+static void ReturnOk(UpdateEngineService* self,
+                     DBusGMethodInvocation* context) {
+  Reply(self, context, "", false, "");
+}
+
+static void ReturnString(UpdateEngineService* self,
+                         DBusGMethodInvocation* context,
+                         const string& value) {
+  Reply(self, context, "", true, value);
+}
+
+static void ReturnError(UpdateEngineService* self,
+                        DBusGMethodInvocation* context,
+                        const char* message) {
+  Reply(self, context, message, false, "");
+}
+
+// A method call forwarded to the main loop and answered from there.
+struct MainLoopCall {
+  UpdateEngineService* service;
+  DBusGMethodInvocation* context;
+  gint64 bytes_per_second;  // For SetDownloadRateLimit.
+  guint source_id;  // The idle source running the call.
+};
+
+// Runs |function| with a MainLoopCall for |self| and |context| on the main
+// loop. The calls go ahead of the transfer and apply callbacks waiting
+// there, which run at the default priority. Rejects the call once the
+// pending calls are cancelled.
+static void ForwardToMainLoop(GSourceFunc function,
+                              UpdateEngineService* self,
+                              DBusGMethodInvocation* context,
+                              gint64 bytes_per_second) {
+  g_mutex_lock(&self->lock_);
+  if (self->stopping_) {
+    g_mutex_unlock(&self->lock_);
+    ReturnError(self, context, "The update engine is shutting down");
+    return;
+  }
+  MainLoopCall* call = new MainLoopCall;
+  call->service = self;
+  call->context = context;
+  call->bytes_per_second = bytes_per_second;
+  // Added under the lock so that the call is pending before it may run.
+  call->source_id = g_idle_add_full(G_PRIORITY_HIGH, function, call, NULL);
+  g_hash_table_insert(self->pending_calls_, call, call);
+  g_mutex_unlock(&self->lock_);
+}
+
+// Takes the ownership of the call of |data|, no longer pending.
+static MainLoopCall* TakeMainLoopCall(gpointer data) {
+  MainLoopCall* call = reinterpret_cast<MainLoopCall*>(data);
+  g_mutex_lock(&call->service->lock_);
+  g_hash_table_remove(call->service->pending_calls_, call);
+  g_mutex_unlock(&call->service->lock_);
+  return call;
+}
+
+void update_engine_service_cancel_pending_calls(UpdateEngineService* self) {
+  g_mutex_lock(&self->lock_);
+  self->stopping_ = TRUE;
+  GHashTableIter iter;
+  gpointer key;
+  g_hash_table_iter_init(&iter, self->pending_calls_);
+  while (g_hash_table_iter_next(&iter, &key, NULL)) {
+    scoped_ptr<MainLoopCall> call(reinterpret_cast<MainLoopCall*>(key));
+    g_source_remove(call->source_id);
+    ReturnError(self, call->context, "The update engine is shutting down");
+    g_hash_table_iter_remove(&iter);
+  }
+  g_mutex_unlock(&self->lock_);
+}
+
+static gboolean AttemptUpdateOnMainLoop(gpointer data) {
+  scoped_ptr<MainLoopCall> call(TakeMainLoopCall(data));
   LOG(INFO) << "Attempting interactive update";
-  self->system_state_->update_attempter()->CheckForUpdate(true);
+  call->service->system_state_->update_attempter()->CheckForUpdate(true);
+  ReturnOk(call->service, call->context);
+  return FALSE;  // Don't call this callback again.
+}
+
+gboolean update_engine_service_attempt_update(UpdateEngineService* self,
+                                              DBusGMethodInvocation* context) {
+  ForwardToMainLoop(&AttemptUpdateOnMainLoop, self, context, 0);
   return TRUE;
 }
 
-gboolean update_engine_service_reset_status(UpdateEngineService* self,
-                                            GError **error) {
-  *error = NULL;
-  return self->system_state_->update_attempter()->ResetStatus();
+static gboolean ResetStatusOnMainLoop(gpointer data) {
+  scoped_ptr<MainLoopCall> call(TakeMainLoopCall(data));
+  if (call->service->system_state_->update_attempter()->ResetStatus())
+    ReturnOk(call->service, call->context);
+  else
+    ReturnError(call->service, call->context, "Unable to reset the status");
+  return FALSE;  // Don't call this callback again.
 }
 
+gboolean update_engine_service_reset_status(UpdateEngineService* self,
+                                            DBusGMethodInvocation* context) {
+  ForwardToMainLoop(&ResetStatusOnMainLoop, self, context, 0);
+  return TRUE;
+}
 
 gboolean update_engine_service_get_status(UpdateEngineService* self,
                                           int64_t* last_checked_time,
@@ -85,6 +234,7 @@ gboolean update_engine_service_get_status(UpdateEngineService* self,
   string current_op;
   string new_version_str;
 
+  // Safe off the main loop, as it only reads the status snapshot.
   CHECK(self->system_state_->update_attempter()->GetStatus(last_checked_time,
                                                            progress,
                                                            &current_op,
@@ -100,6 +250,75 @@ gboolean update_engine_service_get_status(UpdateEngineService* self,
   return TRUE;
 }
 
+gboolean update_engine_service_get_update_eta(UpdateEngineService* self,
+                                              int64_t* eta_seconds,
+                                              GError **error) {
+  // Safe off the main loop, as the estimate is read atomically.
+  *eta_seconds = self->system_state_->update_attempter()->GetUpdateEta();
+  return TRUE;
+}
+
+static gboolean GetPerformanceCountersOnMainLoop(gpointer data) {
+  scoped_ptr<MainLoopCall> call(TakeMainLoopCall(data));
+  ReturnString(call->service,
+               call->context,
+               call->service->system_state_->update_attempter()->
+                   GetPerformanceCounters());
+  return FALSE;  // Don't call this callback again.
+}
+
+gboolean update_engine_service_get_performance_counters(
+    UpdateEngineService* self,
+    DBusGMethodInvocation* context) {
+  ForwardToMainLoop(&GetPerformanceCountersOnMainLoop, self, context, 0);
+  return TRUE;
+}
+
+static gboolean SetDownloadRateLimitOnMainLoop(gpointer data) {
+  scoped_ptr<MainLoopCall> call(TakeMainLoopCall(data));
+  call->service->system_state_->update_attempter()->SetDownloadRateLimit(
+      static_cast<uint64_t>(call->bytes_per_second));
+  ReturnOk(call->service, call->context);
+  return FALSE;  // Don't call this callback again.
+}
+
+gboolean update_engine_service_set_download_rate_limit(
+    UpdateEngineService* self,
+    gint64 bytes_per_second,
+    DBusGMethodInvocation* context) {
+  if (bytes_per_second < 0) {
+    ReturnError(self, context, "The rate limit can't be negative");
+    return TRUE;
+  }
+  ForwardToMainLoop(&SetDownloadRateLimitOnMainLoop, self, context,
+                    bytes_per_second);
+  return TRUE;
+}
+
+// A status_update signal, emitted from the context of the connection.
+struct StatusUpdate {
+  UpdateEngineService* service;  // Referenced until the signal is emitted.
+  gint64 last_checked_time;
+  gdouble progress;
+  string current_operation;
+  string new_version;
+  gint64 new_size;
+};
+
+static gboolean EmitStatusUpdate(gpointer data) {
+  scoped_ptr<StatusUpdate> update(reinterpret_cast<StatusUpdate*>(data));
+  g_signal_emit(update->service,
+                status_update_signal,
+                0,
+                update->last_checked_time,
+                update->progress,
+                update->current_operation.c_str(),
+                update->new_version.c_str(),
+                update->new_size);
+  g_object_unref(update->service);
+  return FALSE;  // Don't call this callback again.
+}
+
 gboolean update_engine_service_emit_status_update(
     UpdateEngineService* self,
     gint64 last_checked_time,
@@ -107,13 +326,13 @@ gboolean update_engine_service_emit_status_update(
     const gchar* current_operation,
     const gchar* new_version,
     gint64 new_size) {
-  g_signal_emit(self,
-                status_update_signal,
-                0,
-                last_checked_time,
-                progress,
-                current_operation,
-                new_version,
-                new_size);
+  StatusUpdate* update = new StatusUpdate;
+  update->service = UPDATE_ENGINE_SERVICE(g_object_ref(self));
+  update->last_checked_time = last_checked_time;
+  update->progress = progress;
+  update->current_operation = current_operation;
+  update->new_version = new_version;
+  update->new_size = new_size;
+  g_main_context_invoke(self->dbus_context_, &EmitStatusUpdate, update);
   return TRUE;
 }
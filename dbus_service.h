@@ -11,6 +11,7 @@
 #include <dbus/dbus-glib-lowlevel.h>
 #include <glib-object.h>
 
+#include "update_engine/dbus_interface.h"
 #include "update_engine/update_attempter.h"
 
 // Type macros:
@@ -35,6 +36,23 @@ struct UpdateEngineService {
   GObject parent_instance;
 
   chromeos_update_engine::SystemState* system_state_;
+
+  // Sends the replies to the method calls.
+  chromeos_update_engine::DbusGlibInterface* dbus_iface_;
+
+  // The context the connection is dispatched on, NULL for the default one.
+  // The replies and signals are sent from there only, as dbus-glib isn't
+  // safe to use from two threads at once.
+  GMainContext* dbus_context_;
+
+  // Guards the two fields below, shared with the thread of |dbus_context_|.
+  GMutex lock_;
+
+  // The calls forwarded to the main loop and not answered yet.
+  GHashTable* pending_calls_;
+
+  // Set once the pending calls are cancelled. New calls are rejected then.
+  gboolean stopping_;
 };
 
 struct UpdateEngineServiceClass {
@@ -44,13 +62,30 @@ struct UpdateEngineServiceClass {
 UpdateEngineService* update_engine_service_new(void);
 GType update_engine_service_get_type(void);
 
+// Sends the replies and signals of |self| from |context|, the one its
+// connection is dispatched on. Must be called before the connection is.
+void update_engine_service_set_dbus_context(UpdateEngineService* self,
+                                            GMainContext* context);
+
+// Answers the calls still waiting for the main loop with an error, and
+// rejects those made from now on. Called from the main thread once its loop
+// has quit, and before the thread of the connection is stopped.
+void update_engine_service_cancel_pending_calls(UpdateEngineService* self);
+
 // Methods
+//
+// The service is meant to be registered on a connection served by a thread
+// of its own, so that calls are answered however busy the main loop is.
+// GetStatus is answered right away on that thread from the status snapshot
+// of the update attempter. The other methods are asynchronous: they're
+// forwarded to the main loop ahead of the transfers and apply work waiting
+// there, and answered once done from the thread of the connection.
 
 gboolean update_engine_service_attempt_update(UpdateEngineService* self,
-                                              GError **error);
+                                              DBusGMethodInvocation* context);
 
 gboolean update_engine_service_reset_status(UpdateEngineService* self,
-                                            GError **error);
+                                            DBusGMethodInvocation* context);
 
 gboolean update_engine_service_get_status(UpdateEngineService* self,
                                           int64_t* last_checked_time,
@@ -60,6 +95,27 @@ gboolean update_engine_service_get_status(UpdateEngineService* self,
                                           int64_t* new_size,
                                           GError **error);
 
+// Sets |eta_seconds| to the estimated seconds left until the payload being
+// downloaded is applied, or -1 if unknown. Answered right away like GetStatus.
+gboolean update_engine_service_get_update_eta(UpdateEngineService* self,
+                                              int64_t* eta_seconds,
+                                              GError **error);
+
+// Answers with the "name=value" lines of the performance counters of the
+// update attempts since the daemon started.
+gboolean update_engine_service_get_performance_counters(
+    UpdateEngineService* self,
+    DBusGMethodInvocation* context);
+
+// Caps the rate of the payload downloads at |bytes_per_second|, or lifts the
+// cap if it's 0.
+gboolean update_engine_service_set_download_rate_limit(
+    UpdateEngineService* self,
+    gint64 bytes_per_second,
+    DBusGMethodInvocation* context);
+
+// Emits the status_update signal from the context of the connection. May be
+// called from any thread.
 gboolean update_engine_service_emit_status_update(
     UpdateEngineService* self,
     gint64 last_checked_time,
@@ -0,0 +1,198 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stdint.h>
+
+#include <string>
+
+#include <glib.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/dbus_service.h"
+#include "update_engine/mock_dbus_interface.h"
+#include "update_engine/mock_system_state.h"
+#include "update_engine/update_attempter_mock.h"
+
+using std::string;
+using testing::_;
+using testing::Field;
+using testing::Pointee;
+using testing::Return;
+using testing::StrEq;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The invocations are only handed back to the mock, so any address will do.
+DBusGMethodInvocation* FakeInvocation(intptr_t id) {
+  return reinterpret_cast<DBusGMethodInvocation*>(id);
+}
+
+gboolean QuitMainLoop(gpointer data) {
+  g_main_loop_quit(reinterpret_cast<GMainLoop*>(data));
+  return FALSE;
+}
+
+struct StatusUpdateRecord {
+  int count;
+  gint64 last_checked_time;
+  string current_operation;
+};
+
+void OnStatusUpdate(UpdateEngineService* service,
+                    gint64 last_checked_time,
+                    gdouble progress,
+                    const gchar* current_operation,
+                    const gchar* new_version,
+                    gint64 new_size,
+                    gpointer data) {
+  StatusUpdateRecord* record = reinterpret_cast<StatusUpdateRecord*>(data);
+  record->count++;
+  record->last_checked_time = last_checked_time;
+  record->current_operation = current_operation;
+}
+
+}  // namespace {}
+
+class DbusServiceTest : public ::testing::Test {
+ protected:
+  DbusServiceTest()
+      : service_(update_engine_service_new()),
+        attempter_(static_cast<UpdateAttempterMock*>(
+            mock_system_state_.update_attempter())) {
+    service_->system_state_ = &mock_system_state_;
+    service_->dbus_iface_ = &dbus_;
+  }
+
+  virtual ~DbusServiceTest() {
+    g_object_unref(service_);
+  }
+
+  // Runs the default main loop until the calls forwarded to it are done.
+  void RunMainLoop() {
+    GMainLoop* loop = g_main_loop_new(NULL, FALSE);
+    // Runs after the forwarded calls, which have a higher priority.
+    g_idle_add_full(G_PRIORITY_LOW, &QuitMainLoop, loop, NULL);
+    g_main_loop_run(loop);
+    g_main_loop_unref(loop);
+  }
+
+  MockSystemState mock_system_state_;
+  MockDbusGlib dbus_;
+  UpdateEngineService* service_;
+  UpdateAttempterMock* attempter_;
+};
+
+// The expectations are set after each call is made, so that an answer sent
+// before the main loop runs fails the test.
+
+TEST_F(DbusServiceTest, AttemptUpdateTest) {
+  EXPECT_TRUE(update_engine_service_attempt_update(service_,
+                                                   FakeInvocation(1)));
+  EXPECT_CALL(*attempter_, CheckForUpdate(true)).Times(1);
+  EXPECT_CALL(dbus_, MethodReturn(FakeInvocation(1))).Times(1);
+  RunMainLoop();
+}
+
+TEST_F(DbusServiceTest, ResetStatusTest) {
+  EXPECT_TRUE(update_engine_service_reset_status(service_, FakeInvocation(1)));
+  EXPECT_TRUE(update_engine_service_reset_status(service_, FakeInvocation(2)));
+  EXPECT_CALL(*attempter_, ResetStatus())
+      .WillOnce(Return(true))
+      .WillOnce(Return(false));
+  EXPECT_CALL(dbus_, MethodReturn(FakeInvocation(1))).Times(1);
+  EXPECT_CALL(dbus_, MethodReturnError(
+      FakeInvocation(2),
+      Pointee(Field(&GError::message,
+                    StrEq("Unable to reset the status"))))).Times(1);
+  RunMainLoop();
+}
+
+TEST_F(DbusServiceTest, GetPerformanceCountersTest) {
+  EXPECT_TRUE(update_engine_service_get_performance_counters(
+      service_, FakeInvocation(1)));
+  EXPECT_CALL(*attempter_, GetPerformanceCounters())
+      .WillOnce(Return("downloads=1\n"));
+  EXPECT_CALL(dbus_, MethodReturnString(FakeInvocation(1),
+                                        StrEq("downloads=1\n"))).Times(1);
+  RunMainLoop();
+}
+
+TEST_F(DbusServiceTest, SetDownloadRateLimitTest) {
+  // A negative limit is rejected right away.
+  EXPECT_CALL(dbus_, MethodReturnError(
+      FakeInvocation(1),
+      Pointee(Field(&GError::message,
+                    StrEq("The rate limit can't be negative"))))).Times(1);
+  EXPECT_TRUE(update_engine_service_set_download_rate_limit(
+      service_, -1, FakeInvocation(1)));
+
+  EXPECT_TRUE(update_engine_service_set_download_rate_limit(
+      service_, 1000, FakeInvocation(2)));
+  EXPECT_CALL(*attempter_, SetDownloadRateLimit(1000)).Times(1);
+  EXPECT_CALL(dbus_, MethodReturn(FakeInvocation(2))).Times(1);
+  RunMainLoop();
+}
+
+TEST_F(DbusServiceTest, CancelPendingCallsTest) {
+  EXPECT_TRUE(update_engine_service_attempt_update(service_,
+                                                   FakeInvocation(1)));
+  EXPECT_TRUE(update_engine_service_get_performance_counters(
+      service_, FakeInvocation(2)));
+  EXPECT_CALL(*attempter_, CheckForUpdate(_)).Times(0);
+  EXPECT_CALL(*attempter_, GetPerformanceCounters()).Times(0);
+  EXPECT_CALL(dbus_, MethodReturnError(
+      FakeInvocation(1),
+      Pointee(Field(&GError::message,
+                    StrEq("The update engine is shutting down"))))).Times(1);
+  EXPECT_CALL(dbus_, MethodReturnError(
+      FakeInvocation(2),
+      Pointee(Field(&GError::message,
+                    StrEq("The update engine is shutting down"))))).Times(1);
+  update_engine_service_cancel_pending_calls(service_);
+
+  // The calls made from now on are rejected right away.
+  EXPECT_CALL(dbus_, MethodReturnError(
+      FakeInvocation(3),
+      Pointee(Field(&GError::message,
+                    StrEq("The update engine is shutting down"))))).Times(1);
+  EXPECT_TRUE(update_engine_service_reset_status(service_, FakeInvocation(3)));
+
+  // The cancelled calls never run.
+  RunMainLoop();
+}
+
+TEST_F(DbusServiceTest, RepliesFromDbusContextTest) {
+  GMainContext* dbus_context = g_main_context_new();
+  update_engine_service_set_dbus_context(service_, dbus_context);
+
+  EXPECT_TRUE(update_engine_service_attempt_update(service_,
+                                                   FakeInvocation(1)));
+  EXPECT_CALL(*attempter_, CheckForUpdate(true)).Times(1);
+  RunMainLoop();
+
+  // The reply waits for the context of the connection.
+  EXPECT_CALL(dbus_, MethodReturn(FakeInvocation(1))).Times(1);
+  while (g_main_context_iteration(dbus_context, FALSE)) {}
+
+  // And so does the signal.
+  StatusUpdateRecord record = { 0, 0, "" };
+  gulong handler = g_signal_connect(service_, "status_update",
+                                    G_CALLBACK(&OnStatusUpdate), &record);
+  EXPECT_TRUE(update_engine_service_emit_status_update(
+      service_, 1234, 0.5, "UPDATE_STATUS_DOWNLOADING", "1.2.3", 100));
+  EXPECT_EQ(0, record.count);
+  while (g_main_context_iteration(dbus_context, FALSE)) {}
+  EXPECT_EQ(1, record.count);
+  EXPECT_EQ(1234, record.last_checked_time);
+  EXPECT_EQ("UPDATE_STATUS_DOWNLOADING", record.current_operation);
+  g_signal_handler_disconnect(service_, handler);
+
+  update_engine_service_set_dbus_context(service_, NULL);
+  g_main_context_unref(dbus_context);
+}
+
+}  // namespace chromeos_update_engine
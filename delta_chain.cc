@@ -0,0 +1,138 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/delta_chain.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <base/file_path.h>
+#include <base/logging.h>
+#include <base/string_number_conversions.h>
+
+#include "update_engine/delta_diff_generator.h"
+#include "update_engine/delta_performer.h"
+#include "update_engine/install_plan.h"
+#include "update_engine/prefs.h"
+#include "update_engine/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace delta_chain {
+
+bool ApplyPayload(const string& payload,
+                  const string& source_image,
+                  const string& source_kernel,
+                  const string& image,
+                  const string& kernel,
+                  PrefsInterface* prefs) {
+  LOG(INFO) << "Applying " << payload;
+  PartitionInfo kern_info, root_info;
+  TEST_AND_RETURN_FALSE(DeltaDiffGenerator::InitializePartitionInfo(
+      true, source_kernel, &kern_info));
+  TEST_AND_RETURN_FALSE(DeltaDiffGenerator::InitializePartitionInfo(
+      false, source_image, &root_info));
+  InstallPlan install_plan;
+  install_plan.kernel_hash.assign(kern_info.hash().begin(),
+                                  kern_info.hash().end());
+  install_plan.rootfs_hash.assign(root_info.hash().begin(),
+                                  root_info.hash().end());
+  // The performer copies the source images to the new ones itself if the
+  // payload patches them in place.
+  install_plan.source_path = source_image;
+  install_plan.kernel_source_path = source_kernel;
+  TEST_AND_RETURN_FALSE(utils::WriteFile(image.c_str(), NULL, 0));
+  TEST_AND_RETURN_FALSE(utils::WriteFile(kernel.c_str(), NULL, 0));
+
+  DeltaPerformer performer(prefs, NULL, &install_plan);
+  performer.set_file_target(true);
+  TEST_AND_RETURN_FALSE(performer.Open(image.c_str(), 0, 0) == 0);
+  TEST_AND_RETURN_FALSE(performer.OpenKernel(kernel.c_str()));
+  vector<char> buf(1024 * 1024);
+  int fd = open(payload.c_str(), O_RDONLY, 0);
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  ScopedFdCloser fd_closer(&fd);
+  bool success = true;
+  for (off_t offset = 0; success; offset += buf.size()) {
+    ssize_t bytes_read;
+    success = utils::PReadAll(fd, &buf[0], buf.size(), offset, &bytes_read);
+    if (!success || bytes_read == 0)
+      break;
+    success = performer.Write(&buf[0], bytes_read);
+  }
+  success = performer.Close() == 0 && success;
+  DeltaPerformer::ResetUpdateProgress(prefs, false);
+  TEST_AND_RETURN_FALSE(success);
+
+  // The new images end where the payload says they do, which the next
+  // payload of the chain, and the composed delta, take them to.
+  uint64_t kernel_size, image_size;
+  vector<char> kernel_hash, image_hash;
+  TEST_AND_RETURN_FALSE(performer.GetNewPartitionInfo(&kernel_size,
+                                                      &kernel_hash,
+                                                      &image_size,
+                                                      &image_hash));
+  TEST_AND_RETURN_FALSE_ERRNO(truncate(kernel.c_str(), kernel_size) == 0);
+  TEST_AND_RETURN_FALSE_ERRNO(truncate(image.c_str(), image_size) == 0);
+  TEST_AND_RETURN_FALSE(DeltaDiffGenerator::InitializePartitionInfo(
+      true, kernel, &kern_info));
+  TEST_AND_RETURN_FALSE(DeltaDiffGenerator::InitializePartitionInfo(
+      false, image, &root_info));
+  TEST_AND_RETURN_FALSE(
+      kernel_hash == vector<char>(kern_info.hash().begin(),
+                                  kern_info.hash().end()));
+  TEST_AND_RETURN_FALSE(
+      image_hash == vector<char>(root_info.hash().begin(),
+                                 root_info.hash().end()));
+  return true;
+}
+
+bool GenerateChainedDelta(const vector<string>& payloads,
+                          const string& old_root,
+                          const string& old_image,
+                          const string& old_kernel,
+                          const string& private_key_path,
+                          const string& out_file) {
+  string temp_dir;
+  TEST_AND_RETURN_FALSE(utils::MakeTempDirectory(
+      "/tmp/delta_chain.XXXXXX", &temp_dir));
+  LOG(INFO) << "Composing a delta of " << payloads.size()
+            << " chained payloads in " << temp_dir;
+  Prefs prefs;
+  bool success = prefs.Init(FilePath(temp_dir + "/prefs"));
+  string image = old_image;
+  string kernel = old_kernel;
+  for (size_t i = 0; i < payloads.size() && success; i++) {
+    const string suffix = base::IntToString(i % 2);
+    const string new_image = temp_dir + "/rootfs" + suffix;
+    const string new_kernel = temp_dir + "/kernel" + suffix;
+    success = ApplyPayload(payloads[i], image, kernel, new_image, new_kernel,
+                           &prefs);
+    LOG_IF(ERROR, !success) << "Unable to apply " << payloads[i];
+    image = new_image;
+    kernel = new_kernel;
+  }
+  if (success) {
+    uint64_t metadata_size;
+    success = DeltaDiffGenerator::GenerateDeltaUpdateFile(old_root,
+                                                          old_image,
+                                                          "",
+                                                          image,
+                                                          old_kernel,
+                                                          kernel,
+                                                          out_file,
+                                                          private_key_path,
+                                                          &metadata_size);
+  }
+  LOG_IF(WARNING, !utils::RecursiveUnlinkDir(temp_dir))
+      << "Unable to remove " << temp_dir;
+  return success;
+}
+
+}  // namespace delta_chain
+
+}  // namespace chromeos_update_engine
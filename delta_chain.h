@@ -0,0 +1,50 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_DELTA_CHAIN_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_DELTA_CHAIN_H__
+
+#include <string>
+#include <vector>
+
+// Composes a chain of consecutive delta payloads, N to N+1 to N+2 and so
+// on, into a single delta from the first release to the last, for clients
+// several releases behind.
+
+namespace chromeos_update_engine {
+
+class PrefsInterface;
+
+namespace delta_chain {
+
+// Applies the delta payload at |payload| to the images |source_image| and
+// |source_kernel|, writing the new images to |image| and |kernel|, with the
+// update progress kept in |prefs|. Returns true on success, once the new
+// images match the partition hashes of the payload.
+bool ApplyPayload(const std::string& payload,
+                  const std::string& source_image,
+                  const std::string& source_kernel,
+                  const std::string& image,
+                  const std::string& kernel,
+                  PrefsInterface* prefs);
+
+// Applies |payloads| one after the other, from |old_image| and |old_kernel|
+// on, and generates one delta from those to the result into |out_file|,
+// signed with |private_key_path| unless it's empty, as
+// DeltaDiffGenerator::GenerateDeltaUpdateFile() would. The intermediate
+// images alternate between two pairs of temporary files, and the new
+// images are read as image files, see DeltaDiffGenerator::SetReadImages().
+// Returns true on success.
+bool GenerateChainedDelta(const std::vector<std::string>& payloads,
+                          const std::string& old_root,
+                          const std::string& old_image,
+                          const std::string& old_kernel,
+                          const std::string& private_key_path,
+                          const std::string& out_file);
+
+}  // namespace delta_chain
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_DELTA_CHAIN_H__
@@ -0,0 +1,106 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <base/file_path.h>
+#include <base/string_number_conversions.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/delta_chain.h"
+#include "update_engine/delta_diff_generator.h"
+#include "update_engine/prefs.h"
+#include "update_engine/test_utils.h"
+#include "update_engine/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+const size_t kBlockSize = 4096;
+
+// Overwrites the |num_blocks| blocks of |image| from |start_block| on with
+// random data, growing it if need be.
+void RandomizeBlocks(size_t start_block, size_t num_blocks,
+                     vector<char>* image) {
+  const vector<char> data = RandomData(num_blocks * kBlockSize);
+  const size_t offset = start_block * kBlockSize;
+  if (image->size() < offset + data.size())
+    image->resize(offset + data.size());
+  std::copy(data.begin(), data.end(), image->begin() + offset);
+}
+
+}  // namespace {}
+
+TEST(DeltaChainTest, GenerateChainedDeltaTest) {
+  string dir;
+  ASSERT_TRUE(utils::MakeTempDirectory("/tmp/DeltaChainTest.XXXXXX", &dir));
+  srandom(1);
+
+  // Three releases, each changing the free blocks at the end of the rootfs,
+  // which are sent whether or not files use them, and the kernel, which
+  // grows in the last one.
+  const string images[] = {
+    dir + "/rootfs0", dir + "/rootfs1", dir + "/rootfs2"
+  };
+  const string kernels[] = {
+    dir + "/kernel0", dir + "/kernel1", dir + "/kernel2"
+  };
+  CreateEmptyExtImageAtPath(images[0], 10485759, kBlockSize);
+  vector<char> image_data[3];
+  ASSERT_TRUE(utils::ReadFile(images[0], &image_data[0]));
+  image_data[1] = image_data[0];
+  RandomizeBlocks(2300, 100, &image_data[1]);
+  image_data[2] = image_data[1];
+  RandomizeBlocks(2350, 150, &image_data[2]);
+  vector<char> kernel_data[3];
+  kernel_data[0] = RandomData(3 * kBlockSize + 100);
+  kernel_data[1] = kernel_data[0];
+  RandomizeBlocks(1, 1, &kernel_data[1]);
+  kernel_data[2] = kernel_data[1];
+  RandomizeBlocks(3, 2, &kernel_data[2]);
+  for (int i = 0; i < 3; i++) {
+    ASSERT_TRUE(WriteFileVector(images[i], image_data[i]));
+    ASSERT_TRUE(WriteFileVector(kernels[i], kernel_data[i]));
+  }
+
+  // The deltas from each release to the next, chained into one.
+  DeltaDiffGenerator::SetReadImages(true);
+  vector<string> payloads;
+  for (int i = 0; i < 2; i++) {
+    payloads.push_back(dir + "/delta" + base::IntToString(i));
+    uint64_t metadata_size;
+    EXPECT_TRUE(DeltaDiffGenerator::GenerateDeltaUpdateFile(
+        "", images[i], "", images[i + 1], kernels[i], kernels[i + 1],
+        payloads[i], "", &metadata_size));
+  }
+  const string chained = dir + "/chained";
+  EXPECT_TRUE(delta_chain::GenerateChainedDelta(payloads, "", images[0],
+                                                kernels[0], "", chained));
+  DeltaDiffGenerator::SetReadImages(false);
+
+  // Applied to the first release, the chained delta makes the last one.
+  Prefs prefs;
+  EXPECT_TRUE(prefs.Init(FilePath(dir + "/prefs")));
+  const string image = dir + "/rootfs";
+  const string kernel = dir + "/kernel";
+  EXPECT_TRUE(delta_chain::ApplyPayload(chained, images[0], kernels[0], image,
+                                        kernel, &prefs));
+  vector<char> data;
+  EXPECT_TRUE(utils::ReadFile(image, &data));
+  EXPECT_TRUE(data == image_data[2]);
+  EXPECT_TRUE(utils::ReadFile(kernel, &data));
+  EXPECT_TRUE(data == kernel_data[2]);
+
+  EXPECT_TRUE(utils::RecursiveUnlinkDir(dir));
+}
+
+}  // namespace chromeos_update_engine
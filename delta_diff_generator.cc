@@ -7,39 +7,63 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
 #include <algorithm>
+#include <limits>
 #include <map>
 #include <set>
 #include <string>
 #include <utility>
 #include <vector>
+#include <tr1/memory>
 
 #include <base/logging.h>
 #include <base/memory/scoped_ptr.h>
+#include <base/string_number_conversions.h>
 #include <base/string_util.h>
 #include <base/stringprintf.h>
-#include <bzlib.h>
+#include <base/time.h>
 
+#include "update_engine/apply_cost_model.h"
+#include "update_engine/blake3.h"
+#include "update_engine/block_index.h"
+#include "update_engine/block_scan.h"
+#include "update_engine/bsdiff.h"
 #include "update_engine/bzip.h"
+#include "update_engine/compact_manifest.h"
 #include "update_engine/cycle_breaker.h"
+#include "update_engine/data_probe.h"
+#include "update_engine/delta_performer.h"
+#include "update_engine/dictionary_trainer.h"
 #include "update_engine/extent_mapper.h"
 #include "update_engine/extent_ranges.h"
+#include "update_engine/file_holes.h"
 #include "update_engine/file_writer.h"
-#include "update_engine/filesystem_iterator.h"
 #include "update_engine/full_update_generator.h"
+#include "update_engine/generator_checkpoint.h"
+#include "update_engine/generator_profile.h"
 #include "update_engine/graph_types.h"
 #include "update_engine/graph_utils.h"
+#include "update_engine/image_file_tree.h"
+#include "update_engine/mapped_file.h"
+#include "update_engine/memory_budget.h"
 #include "update_engine/metadata.h"
 #include "update_engine/omaha_hash_calculator.h"
+#include "update_engine/operation_cache.h"
+#include "update_engine/parallel_filesystem_iterator.h"
 #include "update_engine/payload_signer.h"
-#include "update_engine/subprocess.h"
+#include "update_engine/stream_diff.h"
+#include "update_engine/thread_pool.h"
 #include "update_engine/topological_sort.h"
 #include "update_engine/update_metadata.pb.h"
 #include "update_engine/utils.h"
+#include "update_engine/verity_tree_builder.h"
+#include "update_engine/xz.h"
 
+using base::TimeDelta;
 using std::make_pair;
 using std::map;
 using std::max;
@@ -47,11 +71,11 @@ using std::min;
 using std::pair;
 using std::set;
 using std::string;
+using std::tr1::shared_ptr;
 using std::vector;
 
 namespace chromeos_update_engine {
 
-typedef DeltaDiffGenerator::Block Block;
 typedef map<const DeltaArchiveManifest_InstallOperation*,
             const string*> OperationNameMap;
 
@@ -64,45 +88,597 @@ const string kNonexistentPath = "";
 const size_t kRootFSPartitionSize = 1 * 1024 * 1024 * 1024;  // bytes
 const uint64_t kVersionNumber = 1;
 const uint64_t kFullUpdateChunkSize = 1024 * 1024;  // bytes
+// The size of the operations writing blocks that aren't file data.
+const uint64_t kUnwrittenChunkBlocks = 1024;
+// Zero blocks that aren't file data get ZERO operations of their own when
+// there are at least this many in a row. Fewer are left to compress along
+// with the blocks around them.
+const uint64_t kMinZeroRunBlocks = 8;
+// Before compressing the data of a full operation of at least
+// kCompressionSampleMinSize bytes, each compressor is tried on
+// kCompressionSamples samples of kCompressionSampleSize bytes spread over
+// it, see EstimateCompressedSize().
+const size_t kCompressionSampleMinSize = 1024 * 1024;
+const size_t kCompressionSamples = 4;
+const size_t kCompressionSampleSize = 16 * 1024;
+// Data of at least kProbeMinSize bytes is probed before the encoders are
+// run over it, see data_probe.h. It isn't compressed if its samples have at
+// least kIncompressibleEntropy bits per byte and it barely repeats itself,
+// as data that's compressed already. It isn't diffed if it shares less than
+// kUnrelatedSharedContent of its contents with the old data.
+const size_t kProbeMinSize = 64 * 1024;
+const double kIncompressibleEntropy = 7.9;
+const double kIncompressibleRepeatedContent = 0.01;
+const double kUnrelatedSharedContent = 0.01;
+// A new file of at least kSimilarFileMinSize bytes without an old file at
+// its path is diffed against the removed old file whose sketch of
+// kSimilarFileSketchSize hashes is the most similar to its own, if that's
+// at least kSimilarFileMinSimilarity and their sizes are within a factor of
+// kSimilarFileMaxSizeRatio, see DeltaDiffGenerator::SetSimilarFileMatching().
+const off_t kSimilarFileMinSize = 4096;
+const size_t kSimilarFileSketchSize = 128;
+const double kSimilarFileMinSimilarity = 0.2;
+const off_t kSimilarFileMaxSizeRatio = 4;
+// The holes of sparse images are hashed this many zeros at a time.
+const size_t kHoleHashBufferSize = 1024 * 1024;
+// The xz dictionary of a delta is trained on the new files of up to
+// kXzDictionaryMaxFileSize bytes, kXzDictionaryMaxSamplesSize bytes of
+// them at most, and data of up to that size is compressed with it.
+const size_t kXzDictionaryMaxFileSize = 64 * 1024;
+const size_t kXzDictionaryMaxSamplesSize = 64 * 1024 * 1024;
+// DeltaReadFiles() scans the new files this many at a time and diffs each
+// batch in the order of their blocks, see FilesToDiffLister.
+const size_t kDiffOrderWindowFiles = 256;
+
+// Suffix array cache used by the in-process bsdiff, if one was configured
+// through DeltaDiffGenerator::SetSuffixArrayCacheDir().
+SuffixArrayCache* suffix_array_cache = NULL;
+
+// Cache of the encoded operations of file chunks, if one was configured
+// through DeltaDiffGenerator::SetOperationCacheDir().
+OperationCache* operation_cache = NULL;
+
+// Number of threads used to generate operations, see
+// DeltaDiffGenerator::SetNumThreads().
+unsigned num_threads = 0;
+
+// Whether delta payloads are generated to be applied from the source
+// partitions, see DeltaDiffGenerator::SetApplyFromSource().
+bool apply_from_source = false;
+
+// Whether full operations may be xz compressed, see
+// DeltaDiffGenerator::SetXzCompression().
+bool xz_compression = false;
+
+// Whether full operations of zeros are turned into ZERO operations, see
+// DeltaDiffGenerator::SetZeroBlocks().
+bool zero_blocks = false;
+
+// Whether compressors are first tried on samples of large data, see
+// DeltaDiffGenerator::SetSampleCompression().
+bool sample_compression = false;
+
+// Whether the cycle breaker uses its greedy algorithm, see
+// DeltaDiffGenerator::SetGreedyCycleBreaking().
+bool greedy_cycle_breaking = false;
+
+// Whether full operations are deduplicated against the old image, see
+// DeltaDiffGenerator::SetBlockDeduplication().
+bool block_deduplication = false;
+
+// Whether the kernel blobs are interleaved with the rootfs ones, see
+// DeltaDiffGenerator::SetInterleaveKernelBlobs().
+bool interleave_kernel_blobs = false;
+
+// Whether the manifest indexes the data blobs of each partition, see
+// DeltaDiffGenerator::SetPayloadSegments().
+bool payload_segments = false;
+
+// Whether the operations flag the source blocks later ones read again, see
+// DeltaDiffGenerator::SetSourceReuseHints().
+bool source_reuse_hints = false;
+
+// Whether the delta operations are ordered for locality, see
+// DeltaDiffGenerator::SetLocalityOrdering().
+bool locality_ordering = false;
+
+// Whether new files without an old file at their path are diffed against
+// similar removed old files, see DeltaDiffGenerator::SetSimilarFileMatching().
+bool similar_file_matching = false;
+
+// Whether the operations' blobs are hashed with BLAKE3 rather than SHA-256,
+// see DeltaDiffGenerator::SetBlake3OperationHashes().
+bool blake3_operation_hashes = false;
+
+// Writes that start at most this many blocks after the end of the previous
+// one count as sequential for WriteLocality(), since the device merges or
+// reads ahead across such small gaps.
+const uint64_t kLocalityWindowBlocks = 256;  // 1 MiB
+
+// The size of the chunks large files are diffed in, or -1, see
+// DeltaDiffGenerator::SetChunkSize().
+off_t file_chunk_size = -1;
+
+// The size of the chunks the kernel partition is diffed in, or -1, see
+// DeltaDiffGenerator::SetKernelChunkSize().
+off_t kernel_chunk_size = -1;
+
+// The size of the chunks whose hashes partition infos list, or 0, see
+// DeltaDiffGenerator::SetPartitionHashChunkSize().
+uint64_t partition_hash_chunk_size = 0;
+
+// Whether the manifest describes the dm-verity hash tree of the new rootfs,
+// and its salt, see DeltaDiffGenerator::SetRootfsHashTree().
+bool rootfs_hash_tree = false;
+vector<char> rootfs_hash_tree_salt;
+
+// Whether the operations list the hash of the blocks they write, see
+// DeltaDiffGenerator::SetDestinationHashes().
+bool destination_hashes = false;
+
+// The size under which consecutive full operations are merged, or 0, see
+// DeltaDiffGenerator::SetOperationFusionSize().
+uint64_t operation_fusion_size = 0;
+
+// Whether the manifest has its extents packed, see
+// DeltaDiffGenerator::SetCompactManifest().
+bool compact_manifest = false;
+
+// Where the time spent generating is recorded, or NULL, see
+// DeltaDiffGenerator::SetProfile().
+GeneratorProfile* profile = NULL;
+
+// Whether the files are read from the images rather than from where they're
+// mounted, see DeltaDiffGenerator::SetReadImages().
+bool read_images = false;
+
+// The file trees of the images being diffed with read_images, or NULL. The
+// paths of their files start with the paths of the images, which stand in
+// for the mount points.
+const ImageFileTree* old_file_tree = NULL;
+const ImageFileTree* new_file_tree = NULL;
+
+// The model operations are chosen with, or NULL to choose the smallest, see
+// DeltaDiffGenerator::SetApplyCostModel().
+ApplyCostModel* apply_cost_model = NULL;
+
+// How many percent bigger than a BSDIFF a STREAM_DIFF may be and still be
+// chosen, or -1 to not try them, see
+// DeltaDiffGenerator::SetStreamDiffMargin().
+int stream_diff_margin = -1;
+
+// The shard of the file chunks this generator encodes, and the number of
+// shards, 0 if it encodes all of them. See DeltaDiffGenerator::SetDiffShard().
+int diff_shard_index = 0;
+int diff_shard_count = 0;
+
+// The block size of full payloads, see DeltaDiffGenerator::SetBlockSize().
+uint64_t full_block_size = kBlockSize;
+
+// The bounds of the size of the operations of full payloads, see
+// DeltaDiffGenerator::SetFullChunkSizeBounds().
+off_t full_min_chunk_size = kFullUpdateChunkSize;
+off_t full_max_chunk_size = kFullUpdateChunkSize;
+
+// The size of the xz dictionaries trained for deltas, or 0, see
+// DeltaDiffGenerator::SetXzDictionarySize().
+size_t xz_dictionary_size = 0;
+
+// The xz dictionary of the delta being generated and its hash, or empty.
+string xz_dictionary;
+string xz_dictionary_hash;
+
+// Where delta generations are checkpointed, or NULL, see
+// DeltaDiffGenerator::SetCheckpointDir().
+GeneratorCheckpoint* generator_checkpoint = NULL;
+
+// The memory the diffing threads share, or NULL for no limit, see
+// DeltaDiffGenerator::SetMemoryBudget().
+MemoryBudget* memory_budget = NULL;
+
+// Estimates the memory encoding a chunk of |new_size| bytes against
+// |old_size| bytes takes: bsdiff sorts the suffix array of the old data,
+// and the candidate encodings are each about as large as the new data at
+// most.
+uint64_t EncodeMemoryEstimate(uint64_t old_size, uint64_t new_size) {
+  return SuffixArray::BuildMemory(old_size) + 3 * new_size;
+}
+
+// A data blob that's kept in a temporary file rather than in memory while a
+// memory budget is set, so that the blobs of diffed chunks waiting to be
+// added to the payload don't add up.
+class SpillableBlob {
+ public:
+  SpillableBlob() {}
+  ~SpillableBlob() {
+    if (!spill_path_.empty())
+      unlink(spill_path_.c_str());
+  }
+
+  vector<char>* data() { return &data_; }
+  const vector<char>& data() const { return data_; }
+
+  // Moves the data to a temporary file if memory_budget is set. Returns
+  // true on success.
+  bool Spill() {
+    if (!memory_budget || data_.empty())
+      return true;
+    TEST_AND_RETURN_FALSE(utils::MakeTempFile("/tmp/CrAU_spill.XXXXXX",
+                                              &spill_path_,
+                                              NULL));
+    TEST_AND_RETURN_FALSE(utils::WriteFile(spill_path_.c_str(),
+                                           &data_[0],
+                                           data_.size()));
+    vector<char>().swap(data_);
+    return true;
+  }
+
+  // Reads the data back if it was spilled. Returns true on success.
+  bool Load() {
+    if (spill_path_.empty())
+      return true;
+    TEST_AND_RETURN_FALSE(utils::ReadFile(spill_path_, &data_));
+    unlink(spill_path_.c_str());
+    spill_path_.clear();
+    return true;
+  }
+
+ private:
+  vector<char> data_;
+  string spill_path_;
+
+  DISALLOW_COPY_AND_ASSIGN(SpillableBlob);
+};
+
+// The work on the new image that the deltas GenerateDeltaUpdateFiles()
+// generates to it share, since it doesn't depend on the old image: the
+// full operation encodings of the new files' chunks, which are kept in a
+// temporary file, and the partition infos of the new partitions. The
+// operations are looked up and stored from the diffing threads.
+class NewImageCache {
+ public:
+  NewImageCache() : fd_(-1), size_(0) {
+    g_mutex_init(&mutex_);
+  }
+
+  ~NewImageCache() {
+    if (fd_ >= 0) {
+      close(fd_);
+      unlink(path_.c_str());
+    }
+    g_mutex_clear(&mutex_);
+  }
+
+  bool Init() {
+    return utils::MakeTempFile("/tmp/CrAU_new_image_cache.XXXXXX",
+                               &path_,
+                               &fd_);
+  }
+
+  // Sets |data| and |type| to the encoding of the |size| bytes at |offset|
+  // of |path|, if they were stored. Returns true if they were.
+  bool GetFullOperation(const string& path,
+                        off_t offset,
+                        off_t size,
+                        vector<char>* data,
+                        DeltaArchiveManifest_InstallOperation_Type* type) {
+    g_mutex_lock(&mutex_);
+    map<string, Entry>::const_iterator it =
+        entries_.find(OperationKey(path, offset, size));
+    const bool found = it != entries_.end();
+    Entry entry;
+    if (found)
+      entry = it->second;
+    g_mutex_unlock(&mutex_);
+    if (!found)
+      return false;
+    data->resize(entry.length);
+    ssize_t bytes_read = 0;
+    if (entry.length > 0 &&
+        (!utils::PReadAll(fd_, &(*data)[0], entry.length, entry.offset,
+                          &bytes_read) ||
+         bytes_read != static_cast<ssize_t>(entry.length))) {
+      LOG(WARNING) << "Unable to read cached operation of " << path;
+      return false;
+    }
+    *type = entry.type;
+    return true;
+  }
+
+  void PutFullOperation(const string& path,
+                        off_t offset,
+                        off_t size,
+                        const vector<char>& data,
+                        DeltaArchiveManifest_InstallOperation_Type type) {
+    g_mutex_lock(&mutex_);
+    Entry entry;
+    entry.offset = size_;
+    entry.length = data.size();
+    entry.type = type;
+    if (data.empty() ||
+        utils::PWriteAll(fd_, &data[0], data.size(), entry.offset)) {
+      entries_[OperationKey(path, offset, size)] = entry;
+      size_ += data.size();
+    }
+    g_mutex_unlock(&mutex_);
+  }
+
+  // Sets |info| to the stored info of |partition|. Returns true if there's
+  // one. Only called from the main thread, as is PutPartitionInfo().
+  bool GetPartitionInfo(const string& partition, PartitionInfo* info) {
+    map<string, PartitionInfo>::const_iterator it =
+        partition_infos_.find(partition);
+    if (it == partition_infos_.end())
+      return false;
+    *info = it->second;
+    return true;
+  }
+
+  void PutPartitionInfo(const string& partition, const PartitionInfo& info) {
+    partition_infos_[partition] = info;
+  }
+
+ private:
+  struct Entry {
+    off_t offset;
+    size_t length;
+    DeltaArchiveManifest_InstallOperation_Type type;
+  };
+
+  static string OperationKey(const string& path, off_t offset, off_t size) {
+    return StringPrintf("%" PRIi64 ":%" PRIi64 ":",
+                        static_cast<int64_t>(offset),
+                        static_cast<int64_t>(size)) + path;
+  }
+
+  string path_;
+  int fd_;
+
+  // Protects |entries_| and |size_|.
+  GMutex mutex_;
+  map<string, Entry> entries_;
+  off_t size_;
+
+  map<string, PartitionInfo> partition_infos_;
+
+  DISALLOW_COPY_AND_ASSIGN(NewImageCache);
+};
+
+// The cache of the deltas being generated by GenerateDeltaUpdateFiles(),
+// or NULL.
+NewImageCache* new_image_cache = NULL;
 
 static const char* kInstallOperationTypes[] = {
   "REPLACE",
   "REPLACE_BZ",
   "MOVE",
-  "BSDIFF"
+  "BSDIFF",
+  "REPLACE_XZ",
+  "ZERO",
+  "DISCARD",
+  "STREAM_DIFF",
+  "REPLACE_XZ_DICT"
+};
+
+// Sets the image file trees of GenerateDeltaUpdateFile() for its lifetime.
+class ScopedImageFileTrees {
+ public:
+  ScopedImageFileTrees(const ImageFileTree* old_tree,
+                       const ImageFileTree* new_tree) {
+    old_file_tree = old_tree;
+    new_file_tree = new_tree;
+  }
+  ~ScopedImageFileTrees() {
+    old_file_tree = NULL;
+    new_file_tree = NULL;
+  }
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(ScopedImageFileTrees);
 };
 
+// Trains the xz dictionary of GenerateDeltaUpdateFile() on the small files
+// of |new_root|, if dictionaries are trained, and clears it when it's done.
+class ScopedXzDictionary {
+ public:
+  ScopedXzDictionary() {}
+  ~ScopedXzDictionary() {
+    xz_dictionary.clear();
+    xz_dictionary_hash.clear();
+  }
+
+  bool Train(const string& new_root, ThreadPool* pool);
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(ScopedXzDictionary);
+};
+
+// Returns the image file tree whose image path |path| starts with, and sets
+// |partial_path| to the rest of |path|, or returns NULL if there's none.
+const ImageFileTree* FindImageFileTree(const string& path,
+                                       string* partial_path) {
+  const ImageFileTree* trees[] = { old_file_tree, new_file_tree };
+  for (size_t i = 0; i < arraysize(trees); i++) {
+    if (!trees[i])
+      continue;
+    const string& root = trees[i]->image_path();
+    if (StartsWithASCII(path, root, true) &&
+        (path.size() == root.size() || path[root.size()] == '/')) {
+      *partial_path = path.substr(root.size());
+      return trees[i];
+    }
+  }
+  return NULL;
+}
+
+// Like lstat(), but also for the files of the image file trees, of which
+// only the mode, inode number and size are set. Returns true on success.
+bool LstatFile(const string& path, struct stat* stbuf) {
+  string partial_path;
+  const ImageFileTree* tree = FindImageFileTree(path, &partial_path);
+  if (!tree)
+    return lstat(path.c_str(), stbuf) == 0;
+  const ImageFileTree::File* file = tree->Find(partial_path);
+  if (!file) {
+    errno = ENOENT;
+    return false;
+  }
+  memset(stbuf, 0, sizeof(*stbuf));
+  stbuf->st_mode = file->mode;
+  stbuf->st_ino = file->inode;
+  stbuf->st_size = file->size;
+  return true;
+}
+
+// Like MappedFile::Init(), but also for the files of the image file trees,
+// which are read from their images.
+bool MapFile(const string& path, off_t offset, off_t size, MappedFile* out) {
+  string partial_path;
+  const ImageFileTree* tree = FindImageFileTree(path, &partial_path);
+  if (!tree)
+    return out->Init(path, offset, size);
+  const ImageFileTree::File* file = tree->Find(partial_path);
+  TEST_AND_RETURN_FALSE(file && S_ISREG(file->mode));
+  return out->InitFromExtents(tree->image_path(), file->extents,
+                              tree->block_size(), file->size, offset, size);
+}
+
 // Stores all Extents for a file into 'out'. Returns true on success.
 bool GatherExtents(const string& path,
                    google::protobuf::RepeatedPtrField<Extent>* out) {
+  string partial_path;
+  const ImageFileTree* tree = FindImageFileTree(path, &partial_path);
+  if (tree) {
+    const ImageFileTree::File* file = tree->Find(partial_path);
+    TEST_AND_RETURN_FALSE(file && S_ISREG(file->mode));
+    DeltaDiffGenerator::StoreExtents(file->extents, out);
+    return true;
+  }
   vector<Extent> extents;
-  TEST_AND_RETURN_FALSE(extent_mapper::ExtentsForFileFibmap(path, &extents));
+  TEST_AND_RETURN_FALSE(extent_mapper::ExtentsForFile(path, &extents));
   DeltaDiffGenerator::StoreExtents(extents, out);
   return true;
 }
 
-// For a given regular file which must exist at new_root + path, and
-// may exist at old_root + path, creates a new InstallOperation and
-// adds it to the graph. Also, populates the |blocks| array as
-// necessary, if |blocks| is non-NULL.  Also, writes the data
-// necessary to send the file down to the client into data_fd, which
-// has length *data_file_size. *data_file_size is updated
-// appropriately. If |existing_vertex| is no kInvalidIndex, use that
-// rather than allocating a new vertex. Returns true on success.
-bool DeltaReadFile(Graph* graph,
-                   Vertex::Index existing_vertex,
-                   vector<Block>* blocks,
-                   const string& old_root,
-                   const string& new_root,
-                   const string& path,  // within new_root
-                   int data_fd,
-                   off_t* data_file_size) {
-  vector<char> data;
-  DeltaArchiveManifest_InstallOperation operation;
+// Walks the files under |root| like ParallelFilesystemIterator does or, if
+// |root| is the path of an image file tree, the files of the tree.
+class RootIterator {
+ public:
+  RootIterator(const string& root,
+               const set<string>& excl_prefixes,
+               ThreadPool* pool)
+      : excl_prefixes_(excl_prefixes),
+        next_file_(0) {
+    string partial_path;
+    tree_ = FindImageFileTree(root, &partial_path);
+    if (tree_) {
+      CHECK(partial_path.empty());
+      SkipExcluded();
+    } else {
+      fs_iter_.reset(new ParallelFilesystemIterator(root, excl_prefixes,
+                                                    pool));
+    }
+  }
+
+  bool IsEnd() const {
+    return tree_ ? next_file_ == tree_->files().size() : fs_iter_->IsEnd();
+  }
 
-  string old_path = (old_root == kNonexistentPath) ? kNonexistentPath :
-      old_root + path;
+  struct stat GetStat() const {
+    if (!tree_)
+      return fs_iter_->GetStat();
+    const ImageFileTree::File& file = tree_->files()[next_file_];
+    struct stat stbuf;
+    memset(&stbuf, 0, sizeof(stbuf));
+    stbuf.st_mode = file.mode;
+    stbuf.st_ino = file.inode;
+    stbuf.st_size = file.size;
+    return stbuf;
+  }
+
+  string GetPartialPath() const {
+    return tree_ ? tree_->files()[next_file_].path :
+        fs_iter_->GetPartialPath();
+  }
+
+  void Increment() {
+    if (!tree_) {
+      fs_iter_->Increment();
+      return;
+    }
+    next_file_++;
+    SkipExcluded();
+  }
+
+ private:
+  void SkipExcluded() {
+    while (next_file_ < tree_->files().size()) {
+      const string& path = tree_->files()[next_file_].path;
+      bool excluded = false;
+      for (set<string>::const_iterator it = excl_prefixes_.begin();
+           it != excl_prefixes_.end() && !excluded; ++it) {
+        excluded = StartsWithASCII(path, *it, true);
+      }
+      if (!excluded)
+        return;
+      next_file_++;
+    }
+  }
+
+  const ImageFileTree* tree_;
+  scoped_ptr<ParallelFilesystemIterator> fs_iter_;
+  const set<string> excl_prefixes_;
+  size_t next_file_;
+
+  DISALLOW_COPY_AND_ASSIGN(RootIterator);
+};
+
+bool ScopedXzDictionary::Train(const string& new_root, ThreadPool* pool) {
+  if (xz_dictionary_size == 0)
+    return true;
+  vector<string> samples;
+  size_t samples_size = 0;
+  set<ino_t> visited_inodes;
+  for (RootIterator fs_iter(
+           new_root, utils::SetWithValue<string>("/lost+found"), pool);
+       !fs_iter.IsEnd() && samples_size < kXzDictionaryMaxSamplesSize;
+       fs_iter.Increment()) {
+    const struct stat stbuf = fs_iter.GetStat();
+    if (!S_ISREG(stbuf.st_mode) || stbuf.st_size == 0 ||
+        stbuf.st_size > static_cast<off_t>(kXzDictionaryMaxFileSize) ||
+        !visited_inodes.insert(stbuf.st_ino).second)
+      continue;
+    MappedFile file;
+    TEST_AND_RETURN_FALSE(MapFile(new_root + fs_iter.GetPartialPath(),
+                                  0,
+                                  stbuf.st_size,
+                                  &file));
+    samples.push_back(string(file.data(), file.size()));
+    samples_size += file.size();
+  }
+  TEST_AND_RETURN_FALSE(TrainDictionary(samples,
+                                        xz_dictionary_size,
+                                        &xz_dictionary));
+  xz_dictionary_hash = OmahaHashCalculator::OmahaHashOfString(xz_dictionary);
+  LOG(INFO) << "Trained a " << xz_dictionary.size() << "-byte xz dictionary "
+            << "on " << samples.size() << " files";
+  return true;
+}
 
+// For a given regular file which must exist at new_root + path, and may
+// exist at |old_path| (kNonexistentPath if there's no old file to diff it
+// against), determines the best way to send its |chunk_size| bytes from
+// |chunk_offset| on (all of it from there if |chunk_size| is -1) down to the
+// client and stores the operation in |operation| and the data it needs in
+// |data|. This has no side effects, so it may run on any thread. Returns
+// true on success.
+bool DiffFile(const string& old_path,
+              const string& new_root,
+              const string& path,  // within new_root
+              off_t chunk_offset,
+              off_t chunk_size,
+              vector<char>* data,
+              DeltaArchiveManifest_InstallOperation* operation) {
   // If bsdiff breaks again, blacklist the problem file by using:
   //   bsdiff_allowed = (path != "/foo/bar")
   //
@@ -114,13 +690,35 @@ bool DeltaReadFile(Graph* graph,
 
   TEST_AND_RETURN_FALSE(DeltaDiffGenerator::ReadFileToDiff(old_path,
                                                            new_root + path,
+                                                           chunk_offset,
+                                                           chunk_size,
                                                            bsdiff_allowed,
-                                                           &data,
-                                                           &operation,
+                                                           data,
+                                                           operation,
                                                            true));
+  return true;
+}
 
+// Adds |operation|, which was computed by DiffFile() for the chunk of |path|
+// at |chunk_offset| of |chunk_size| bytes, to the
+// graph. Also, populates the |blocks| array as necessary, if |blocks| is
+// non-NULL. Also, writes |data| to data_fd, which has length
+// *data_file_size. *data_file_size is updated appropriately. If
+// |existing_vertex| is no kInvalidIndex, use that rather than allocating a
+// new vertex. Returns true on success.
+bool AddFileOperation(Graph* graph,
+                      Vertex::Index existing_vertex,
+                      BlockOwners* blocks,
+                      const string& path,
+                      off_t chunk_offset,
+                      off_t chunk_size,
+                      const vector<char>& data,
+                      DeltaArchiveManifest_InstallOperation operation,
+                      int data_fd,
+                      off_t* data_file_size) {
   // Write the data
-  if (operation.type() != DeltaArchiveManifest_InstallOperation_Type_MOVE) {
+  if (operation.type() != DeltaArchiveManifest_InstallOperation_Type_MOVE &&
+      operation.type() != DeltaArchiveManifest_InstallOperation_Type_ZERO) {
     operation.set_data_offset(*data_file_size);
     operation.set_data_length(data.size());
   }
@@ -134,9 +732,12 @@ bool DeltaReadFile(Graph* graph,
     graph->resize(graph->size() + 1);
     vertex = graph->size() - 1;
   }
-  (*graph)[vertex].op = operation;
+  // Swapping rather than copying saves allocating every extent again.
+  (*graph)[vertex].op.Swap(&operation);
   CHECK((*graph)[vertex].op.has_type());
   (*graph)[vertex].file_name = path;
+  (*graph)[vertex].chunk_offset = chunk_offset;
+  (*graph)[vertex].chunk_size = chunk_size;
 
   if (blocks)
     TEST_AND_RETURN_FALSE(DeltaDiffGenerator::AddInstallOpToBlocksVector(
@@ -147,62 +748,479 @@ bool DeltaReadFile(Graph* graph,
   return true;
 }
 
+// For a given regular file which must exist at new_root + path, and
+// may exist at |old_path|, creates a new InstallOperation for its
+// chunk at |chunk_offset| of |chunk_size| bytes (-1 for the whole file)
+// and adds it to the graph. Also, populates the |blocks| array as
+// necessary, if |blocks| is non-NULL.  Also, writes the data
+// necessary to send the file down to the client into data_fd, which
+// has length *data_file_size. *data_file_size is updated
+// appropriately. If |existing_vertex| is no kInvalidIndex, use that
+// rather than allocating a new vertex. Returns true on success.
+bool DeltaReadFile(Graph* graph,
+                   Vertex::Index existing_vertex,
+                   BlockOwners* blocks,
+                   const string& old_path,
+                   const string& new_root,
+                   const string& path,  // within new_root
+                   off_t chunk_offset,
+                   off_t chunk_size,
+                   int data_fd,
+                   off_t* data_file_size) {
+  vector<char> data;
+  DeltaArchiveManifest_InstallOperation operation;
+  TEST_AND_RETURN_FALSE(DiffFile(old_path,
+                                 new_root,
+                                 path,
+                                 chunk_offset,
+                                 chunk_size,
+                                 &data,
+                                 &operation));
+  return AddFileOperation(graph,
+                          existing_vertex,
+                          blocks,
+                          path,
+                          chunk_offset,
+                          chunk_size,
+                          data,
+                          operation,
+                          data_fd,
+                          data_file_size);
+}
+
+// Runs DiffFile() for one chunk of a file on a ThreadPool worker.
+class DiffFileTask : public ThreadPoolTask {
+ public:
+  DiffFileTask(const string& old_path,
+               const string& new_root,
+               const string& path,
+               off_t chunk_offset,
+               off_t chunk_size)
+      : old_path_(old_path),
+        new_root_(new_root),
+        path_(path),
+        chunk_offset_(chunk_offset),
+        chunk_size_(chunk_size) {}
+
+  virtual bool Run() {
+    const TimeDelta start_cpu_time = GeneratorProfile::ThreadCpuTime();
+    const bool success = DiffFile(old_path_,
+                                  new_root_,
+                                  path_,
+                                  chunk_offset_,
+                                  chunk_size_,
+                                  data_.data(),
+                                  &operation_);
+    cpu_time_ = GeneratorProfile::ThreadCpuTime() - start_cpu_time;
+    return success && data_.Spill();
+  }
+
+  const string& path() const { return path_; }
+  off_t chunk_offset() const { return chunk_offset_; }
+  off_t chunk_size() const { return chunk_size_; }
+  // The data blob, once LoadData() read it back.
+  const vector<char>& data() const { return data_.data(); }
+  bool LoadData() { return data_.Load(); }
+  const DeltaArchiveManifest_InstallOperation& operation() const {
+    return operation_;
+  }
+  // The CPU time Run() took.
+  TimeDelta cpu_time() const { return cpu_time_; }
+
+ private:
+  const string old_path_;
+  const string new_root_;
+  const string path_;
+  const off_t chunk_offset_;
+  const off_t chunk_size_;
+  SpillableBlob data_;
+  DeltaArchiveManifest_InstallOperation operation_;
+  TimeDelta cpu_time_;
+
+  DISALLOW_COPY_AND_ASSIGN(DiffFileTask);
+};
+
+// Returns true if the chunk of the file at |path| that starts at
+// |chunk_offset| is encoded by this generator, see
+// DeltaDiffGenerator::SetDiffShard().
+bool InDiffShard(const string& path, off_t chunk_offset) {
+  return diff_shard_count == 0 ||
+      DeltaDiffGenerator::DiffShardOf(path, chunk_offset, diff_shard_count) ==
+      diff_shard_index;
+}
+
+// Computes the sketch of a file, see data_probe::Sketch(), on a ThreadPool
+// worker.
+class SketchFileTask : public ThreadPoolTask {
+ public:
+  SketchFileTask(const string& path, ino_t inode, off_t size)
+      : path_(path), inode_(inode), size_(size) {}
+
+  virtual bool Run() {
+    MappedFile file;
+    TEST_AND_RETURN_FALSE(MapFile(path_, 0, -1, &file));
+    data_probe::Sketch(file.data(), file.size(), kSimilarFileSketchSize,
+                       &sketch_);
+    return true;
+  }
+
+  const string& path() const { return path_; }
+  ino_t inode() const { return inode_; }
+  off_t size() const { return size_; }
+  vector<uint32_t>* sketch() { return &sketch_; }
+
+ private:
+  const string path_;
+  const ino_t inode_;
+  const off_t size_;
+  vector<uint32_t> sketch_;
+
+  DISALLOW_COPY_AND_ASSIGN(SketchFileTask);
+};
+
+// The files of an old root that were removed, that is, that have no regular
+// file at their path in the new root, with the sketches of their contents.
+// A new file without an old file at its path may be one of them renamed or
+// with a new version in its name, e.g., a library, and is diffed against
+// the most similar one.
+class RemovedFileIndex {
+ public:
+  RemovedFileIndex() {}
+
+  // Sketches the removed files of |old_root| on |pool|.
+  bool Build(const string& old_root,
+             const string& new_root,
+             ThreadPool* pool) {
+    OrderedTaskRunner<SketchFileTask> runner(pool, 4 * pool->num_threads());
+    set<ino_t> inodes;
+    RootIterator fs_iter(
+        old_root, utils::SetWithValue<string>("/lost+found"), pool);
+    while (!fs_iter.IsEnd() || !runner.empty()) {
+      if (runner.full() || fs_iter.IsEnd()) {
+        shared_ptr<SketchFileTask> task;
+        TEST_AND_RETURN_FALSE(runner.WaitOldest(&task));
+        files_.resize(files_.size() + 1);
+        files_.back().path = task->path();
+        files_.back().inode = task->inode();
+        files_.back().size = task->size();
+        files_.back().sketch.swap(*task->sketch());
+        continue;
+      }
+      const struct stat stbuf = fs_iter.GetStat();
+      const string partial_path = fs_iter.GetPartialPath();
+      fs_iter.Increment();
+      if (!S_ISREG(stbuf.st_mode) || stbuf.st_size < kSimilarFileMinSize ||
+          !inodes.insert(stbuf.st_ino).second)
+        continue;
+      struct stat new_stbuf;
+      if (LstatFile(new_root + partial_path, &new_stbuf) &&
+          S_ISREG(new_stbuf.st_mode))
+        continue;
+      shared_ptr<SketchFileTask> task(new SketchFileTask(
+          old_root + partial_path, stbuf.st_ino, stbuf.st_size));
+      runner.Submit(task);
+    }
+    LOG(INFO) << "Sketched " << files_.size() << " removed old files";
+    return true;
+  }
+
+  // Sets |old_path| and |inode| to those of the removed file most similar
+  // to the |size|-byte file at |path|, among those whose inode isn't in
+  // |used_inodes|. Returns false if none is similar enough.
+  bool FindSimilar(const string& path,
+                   off_t size,
+                   const set<ino_t>& used_inodes,
+                   string* old_path,
+                   ino_t* inode) const {
+    if (files_.empty() || size < kSimilarFileMinSize)
+      return false;
+    MappedFile file;
+    if (!MapFile(path, 0, -1, &file))
+      return false;
+    vector<uint32_t> sketch;
+    data_probe::Sketch(file.data(), file.size(), kSimilarFileSketchSize,
+                       &sketch);
+    const File* best = NULL;
+    double best_similarity = kSimilarFileMinSimilarity;
+    for (vector<File>::const_iterator it = files_.begin();
+         it != files_.end(); ++it) {
+      if (it->size > size * kSimilarFileMaxSizeRatio ||
+          size > it->size * kSimilarFileMaxSizeRatio ||
+          utils::SetContainsKey(used_inodes, it->inode))
+        continue;
+      const double similarity = data_probe::SketchSimilarity(
+          sketch, it->sketch, kSimilarFileSketchSize);
+      if (similarity >= best_similarity) {
+        best = &*it;
+        best_similarity = similarity;
+      }
+    }
+    if (!best)
+      return false;
+    *old_path = best->path;
+    *inode = best->inode;
+    return true;
+  }
+
+ private:
+  struct File {
+    string path;
+    ino_t inode;
+    off_t size;
+    vector<uint32_t> sketch;
+  };
+  vector<File> files_;
+
+  DISALLOW_COPY_AND_ASSIGN(RemovedFileIndex);
+};
+
+// A file DeltaReadFiles() diffs, whole or in chunks.
+struct FileToDiff {
+  // The old file to diff it against, kNonexistentPath if there's none.
+  string old_path;
+  // Its path within the new root.
+  string path;
+  off_t size;
+  // The first blocks of the new and old files in their images, kuint64max
+  // if unknown.
+  uint64_t new_block;
+  uint64_t old_block;
+};
+
+// Returns the first block of the file at |path| in its image, or kuint64max
+// if it has none or it isn't known. Only FIEMAP is tried, as FIBMAP takes a
+// call per block.
+uint64_t FirstBlock(const string& path) {
+  if (path == kNonexistentPath)
+    return kuint64max;
+  vector<Extent> extents;
+  string partial_path;
+  const ImageFileTree* tree = FindImageFileTree(path, &partial_path);
+  if (tree) {
+    const ImageFileTree::File* file = tree->Find(partial_path);
+    if (file)
+      extents = file->extents;
+  } else if (!extent_mapper::ExtentsForFileFiemap(path, &extents)) {
+    return kuint64max;
+  }
+  for (vector<Extent>::const_iterator it = extents.begin();
+       it != extents.end(); ++it) {
+    if (it->start_block() != kSparseHole)
+      return it->start_block();
+  }
+  return kuint64max;
+}
+
+// Returns true if |a| is read before |b|: in the order of their blocks in
+// the new image, then in the old one.
+bool ReadsBefore(const FileToDiff& a, const FileToDiff& b) {
+  if (a.new_block != b.new_block)
+    return a.new_block < b.new_block;
+  return a.old_block < b.old_block;
+}
+
+// Lists the regular files within new_root that DeltaReadFiles() diffs, each
+// with the old file it's diffed against, if any. New files without an old
+// file at their path may be diffed against similar removed old files, see
+// RemovedFileIndex. The files are scanned in windows of |window| files in
+// file system iteration order, and each window is sorted by ReadsBefore(),
+// files whose blocks aren't known staying in iteration order at its end.
+// Only a window is scanned ahead, so the files are diffed while the rest
+// are still scanned. The directories of new_root are read on |pool|.
+class FilesToDiffLister {
+ public:
+  FilesToDiffLister(const string& old_root,
+                    const string& new_root,
+                    size_t window,
+                    ThreadPool* pool)
+      : old_root_(old_root),
+        new_root_(new_root),
+        window_(window),
+        pool_(pool),
+        next_file_(0) {}
+
+  // Sketches the removed old files and starts the scan. Returns true on
+  // success.
+  bool Init() {
+    if (similar_file_matching && old_root_ != kNonexistentPath)
+      TEST_AND_RETURN_FALSE(removed_files_.Build(old_root_, new_root_, pool_));
+    fs_iter_.reset(new RootIterator(
+        new_root_, utils::SetWithValue<string>("/lost+found"), pool_));
+    return true;
+  }
+
+  // Sets |file| to the next file to diff, scanning the next window if the
+  // current one is used up. Returns false once all files are listed.
+  bool Next(FileToDiff* file) {
+    while (next_file_ == files_.size()) {
+      if (fs_iter_->IsEnd())
+        return false;
+      ScanWindow();
+    }
+    *file = files_[next_file_++];
+    return true;
+  }
+
+ private:
+  void ScanWindow() {
+    files_.clear();
+    next_file_ = 0;
+    for (; !fs_iter_->IsEnd() && files_.size() < window_;
+         fs_iter_->Increment()) {
+      const struct stat stbuf = fs_iter_->GetStat();
+      const string partial_path = fs_iter_->GetPartialPath();
+
+      // We never diff symlinks (here, we check that dst file is not a
+      // symlink).
+      if (!S_ISREG(stbuf.st_mode))
+        continue;
+
+      // Make sure we visit each inode only once.
+      if (utils::SetContainsKey(visited_inodes_, stbuf.st_ino))
+        continue;
+      visited_inodes_.insert(stbuf.st_ino);
+      if (stbuf.st_size == 0)
+        continue;
+
+      // We can't visit each dst image inode more than once, as that would
+      // duplicate work. Here, we avoid visiting each source image inode
+      // more than once. Technically, we could have multiple operations
+      // that read the same blocks from the source image for diffing, but
+      // we choose not to to avoid complexity. Eventually we will move away
+      // from using a graph/cycle detection/etc to generate diffs, and at
+      // that time, it will be easy (non-complex) to have many operations
+      // read from the same source blocks. At that time, this code can die.
+      // -adlr
+      bool should_diff_from_source = false;
+      string src_path = old_root_ + partial_path;
+      struct stat src_stbuf;
+      // We never diff symlinks (here, we check that src file is not a
+      // symlink).
+      if (LstatFile(src_path, &src_stbuf) &&
+          S_ISREG(src_stbuf.st_mode)) {
+        should_diff_from_source = !utils::SetContainsKey(visited_src_inodes_,
+                                                         src_stbuf.st_ino);
+        visited_src_inodes_.insert(src_stbuf.st_ino);
+      } else {
+        // The matches are made here, in file system iteration order, so
+        // that they don't depend on the number of threads either.
+        ino_t src_inode;
+        if (removed_files_.FindSimilar(new_root_ + partial_path,
+                                       stbuf.st_size,
+                                       visited_src_inodes_,
+                                       &src_path,
+                                       &src_inode)) {
+          LOG(INFO) << "Diffing " << partial_path << " against "
+                    << src_path.substr(old_root_.size());
+          should_diff_from_source = true;
+          visited_src_inodes_.insert(src_inode);
+        }
+      }
+
+      files_.resize(files_.size() + 1);
+      FileToDiff& file = files_.back();
+      file.old_path = should_diff_from_source ? src_path : kNonexistentPath;
+      file.path = partial_path;
+      file.size = stbuf.st_size;
+      file.new_block = FirstBlock(new_root_ + partial_path);
+      file.old_block = FirstBlock(file.old_path);
+    }
+    std::stable_sort(files_.begin(), files_.end(), ReadsBefore);
+  }
+
+  const string old_root_;
+  const string new_root_;
+  const size_t window_;
+  ThreadPool* pool_;
+  RemovedFileIndex removed_files_;
+  scoped_ptr<RootIterator> fs_iter_;
+  set<ino_t> visited_inodes_;
+  set<ino_t> visited_src_inodes_;
+  // The current window and the next file of it to diff.
+  vector<FileToDiff> files_;
+  size_t next_file_;
+
+  DISALLOW_COPY_AND_ASSIGN(FilesToDiffLister);
+};
+
 // For each regular file within new_root, creates a node in the graph,
 // determines the best way to compress it (REPLACE, REPLACE_BZ, COPY, BSDIFF),
-// and writes any necessary data to the end of data_fd.
+// and writes any necessary data to the end of data_fd. The files, listed by
+// FilesToDiffLister, are diffed in the order of their blocks in the new
+// image, then the old one, within each window of kDiffOrderWindowFiles
+// files, so that both are mostly read sequentially rather than in directory
+// order. They're diffed concurrently on |pool|, but their
+// results are added in that order so that the output doesn't depend on the
+// number of threads.
 bool DeltaReadFiles(Graph* graph,
-                    vector<Block>* blocks,
+                    BlockOwners* blocks,
                     const string& old_root,
                     const string& new_root,
                     int data_fd,
-                    off_t* data_file_size) {
-  set<ino_t> visited_inodes;
-  set<ino_t> visited_src_inodes;
-  for (FilesystemIterator fs_iter(new_root,
-                                  utils::SetWithValue<string>("/lost+found"));
-       !fs_iter.IsEnd(); fs_iter.Increment()) {
-    // We never diff symlinks (here, we check that dst file is not a symlink).
-    if (!S_ISREG(fs_iter.GetStat().st_mode))
-      continue;
-
-    // Make sure we visit each inode only once.
-    if (utils::SetContainsKey(visited_inodes, fs_iter.GetStat().st_ino))
-      continue;
-    visited_inodes.insert(fs_iter.GetStat().st_ino);
-    if (fs_iter.GetStat().st_size == 0)
+                    off_t* data_file_size,
+                    ThreadPool* pool) {
+  FilesToDiffLister lister(old_root, new_root, kDiffOrderWindowFiles, pool);
+  TEST_AND_RETURN_FALSE(lister.Init());
+
+  // Bound the number of diffed files waiting to be added, as each of them
+  // holds its data blob in memory unless there's a memory budget.
+  OrderedTaskRunner<DiffFileTask> runner(pool, 4 * pool->num_threads());
+
+  // The file being diffed and, if it's split into chunks, where its next
+  // chunk starts.
+  FileToDiff file;
+  bool have_file = lister.Next(&file);
+  off_t next_chunk_offset = 0;
+  while (have_file || !runner.empty()) {
+    if (runner.full() || !have_file) {
+      shared_ptr<DiffFileTask> task;
+      TEST_AND_RETURN_FALSE(runner.WaitOldest(&task));
+      TEST_AND_RETURN_FALSE(task->LoadData());
+      // A shard's operations only go to the operation cache.
+      if (diff_shard_count == 0) {
+        TEST_AND_RETURN_FALSE(AddFileOperation(graph,
+                                               Vertex::kInvalidIndex,
+                                               blocks,
+                                               task->path(),
+                                               task->chunk_offset(),
+                                               task->chunk_size(),
+                                               task->data(),
+                                               task->operation(),
+                                               data_fd,
+                                               data_file_size));
+      }
+      if (profile) {
+        string name = task->path();
+        if (task->chunk_size() >= 0)
+          name += StringPrintf("@%jd", static_cast<intmax_t>(
+              task->chunk_offset()));
+        profile->AddOperation(name,
+                              kInstallOperationTypes[task->operation().type()],
+                              task->cpu_time(),
+                              task->operation().dst_length(),
+                              task->data().size());
+      }
       continue;
-
-    LOG(INFO) << "Encoding file " << fs_iter.GetPartialPath();
-
-    // We can't visit each dst image inode more than once, as that would
-    // duplicate work. Here, we avoid visiting each source image inode
-    // more than once. Technically, we could have multiple operations
-    // that read the same blocks from the source image for diffing, but
-    // we choose not to to avoid complexity. Eventually we will move away
-    // from using a graph/cycle detection/etc to generate diffs, and at that
-    // time, it will be easy (non-complex) to have many operations read
-    // from the same source blocks. At that time, this code can die. -adlr
-    bool should_diff_from_source = false;
-    string src_path = old_root + fs_iter.GetPartialPath();
-    struct stat src_stbuf;
-    // We never diff symlinks (here, we check that src file is not a symlink).
-    if (0 == lstat(src_path.c_str(), &src_stbuf) &&
-        S_ISREG(src_stbuf.st_mode)) {
-      should_diff_from_source = !utils::SetContainsKey(visited_src_inodes,
-                                                       src_stbuf.st_ino);
-      visited_src_inodes.insert(src_stbuf.st_ino);
     }
 
-    TEST_AND_RETURN_FALSE(DeltaReadFile(graph,
-                                        Vertex::kInvalidIndex,
-                                        blocks,
-                                        (should_diff_from_source ?
-                                         old_root :
-                                         kNonexistentPath),
-                                        new_root,
-                                        fs_iter.GetPartialPath(),
-                                        data_fd,
-                                        data_file_size));
+    // The chunks of a file are submitted one at a time as the runner has
+    // room.
+    const bool chunked = file_chunk_size >= 0 && file.size > file_chunk_size;
+    const off_t chunk_offset = next_chunk_offset;
+    if (chunk_offset == 0)
+      LOG(INFO) << "Encoding file " << file.path;
+    if (InDiffShard(file.path, chunk_offset)) {
+      shared_ptr<DiffFileTask> task(new DiffFileTask(
+          file.old_path, new_root, file.path, chunk_offset,
+          chunked ? file_chunk_size : -1));
+      runner.Submit(task);
+    }
+    if (chunked && chunk_offset + file_chunk_size < file.size) {
+      next_chunk_offset += file_chunk_size;
+    } else {
+      have_file = lister.Next(&file);
+      next_chunk_offset = 0;
+    }
   }
   return true;
 }
@@ -226,124 +1244,261 @@ class DummyExtentAllocator {
   uint64_t next_block_;
 };
 
-// Reads blocks from image_path that are not yet marked as being written
-// in the blocks array. These blocks that remain are non-file-data blocks.
-// In the future we might consider intelligent diffing between this data
-// and data in the previous image, but for now we just bzip2 compress it
-// and include it in the update.
-// Creates a new node in the graph to write these blocks and writes the
-// appropriate blob to blobs_fd. Reads and updates blobs_length;
-bool ReadUnwrittenBlocks(const vector<Block>& blocks,
-                         int blobs_fd,
-                         off_t* blobs_length,
-                         const string& image_path,
-                         Vertex* vertex) {
-  vertex->file_name = "<rootfs-non-file-data>";
-
-  DeltaArchiveManifest_InstallOperation* out_op = &vertex->op;
-  int image_fd = open(image_path.c_str(), O_RDONLY, 000);
-  TEST_AND_RETURN_FALSE_ERRNO(image_fd >= 0);
-  ScopedFdCloser image_fd_closer(&image_fd);
+// Compresses one chunk of the blocks ReadUnwrittenBlocks() sends on a
+// ThreadPool worker.
+class UnwrittenBlocksTask : public ThreadPoolTask {
+ public:
+  // The blocks of a |zero| chunk are known to be zeros, and aren't read.
+  UnwrittenBlocksTask(const MappedFile* image,
+                      const vector<Extent>& extents,
+                      bool zero)
+      : image_(image),
+        extents_(extents),
+        zero_(zero),
+        type_(DeltaArchiveManifest_InstallOperation_Type_REPLACE) {}
+
+  virtual bool Run() {
+    if (zero_) {
+      type_ = DeltaArchiveManifest_InstallOperation_Type_ZERO;
+      return true;
+    }
+    // A chunk of a single extent is compressed straight from the image.
+    if (extents_.size() == 1) {
+      return DeltaDiffGenerator::CompressReplaceData(
+          image_->data() + extents_[0].start_block() * kBlockSize,
+          extents_[0].num_blocks() * kBlockSize,
+          &data_,
+          &type_);
+    }
+    vector<char> buf;
+    buf.reserve(graph_utils::BlocksInExtents(extents_) * kBlockSize);
+    for (vector<Extent>::const_iterator it = extents_.begin();
+         it != extents_.end(); ++it) {
+      const char* data = image_->data() + it->start_block() * kBlockSize;
+      buf.insert(buf.end(), data, data + it->num_blocks() * kBlockSize);
+    }
+    return DeltaDiffGenerator::CompressReplaceData(buf, &data_, &type_);
+  }
 
-  string temp_file_path;
-  TEST_AND_RETURN_FALSE(utils::MakeTempFile("/tmp/CrAU_temp_data.XXXXXX",
-                                            &temp_file_path,
-                                            NULL));
+  const vector<Extent>& extents() const { return extents_; }
+  const vector<char>& data() const { return data_; }
+  DeltaArchiveManifest_InstallOperation_Type type() const { return type_; }
 
-  FILE* file = fopen(temp_file_path.c_str(), "w");
-  TEST_AND_RETURN_FALSE(file);
-  int err = BZ_OK;
+ private:
+  const MappedFile* image_;
+  const vector<Extent> extents_;
+  const bool zero_;
+  vector<char> data_;
+  DeltaArchiveManifest_InstallOperation_Type type_;
 
-  BZFILE* bz_file = BZ2_bzWriteOpen(&err,
-                                    file,
-                                    9,  // max compression
-                                    0,  // verbosity
-                                    0);  // default work factor
-  TEST_AND_RETURN_FALSE(err == BZ_OK);
+  DISALLOW_COPY_AND_ASSIGN(UnwrittenBlocksTask);
+};
 
-  vector<Extent> extents;
-  vector<Block>::size_type block_count = 0;
+// A piece of the blocks ReadUnwrittenBlocks() sends, all zero or not.
+struct UnwrittenPiece {
+  UnwrittenPiece(uint64_t start_block, uint64_t num_blocks,
+                 Vertex::Index reader, bool zero)
+      : start_block(start_block),
+        num_blocks(num_blocks),
+        reader(reader),
+        zero(zero) {}
+  uint64_t start_block;
+  uint64_t num_blocks;
+  Vertex::Index reader;
+  bool zero;
+};
 
-  LOG(INFO) << "Appending left over blocks to extents";
-  for (vector<Block>::size_type i = 0; i < blocks.size(); i++) {
-    if (blocks[i].writer != Vertex::kInvalidIndex)
-      continue;
-    if (blocks[i].reader != Vertex::kInvalidIndex) {
-      graph_utils::AddReadBeforeDep(vertex, blocks[i].reader, i);
+typedef bool (*CompressBytesFunction)(const char*, size_t, vector<char>*);
+
+// Returns the size |compress| would compress the |size| bytes at |data| to,
+// estimated from the size it compresses samples of it to. As the samples
+// are compressed apart from the rest of the data, the estimate is usually
+// above the actual size. Returns 0 if the samples can't be compressed.
+// |size| is at least kCompressionSampleMinSize.
+uint64_t EstimateCompressedSize(CompressBytesFunction compress,
+                                const char* data,
+                                size_t size) {
+  const size_t stride =
+      (size - kCompressionSampleSize) / (kCompressionSamples - 1);
+  vector<char> samples;
+  samples.reserve(kCompressionSamples * kCompressionSampleSize);
+  for (size_t i = 0; i < kCompressionSamples; i++) {
+    const char* sample = data + i * stride;
+    samples.insert(samples.end(), sample, sample + kCompressionSampleSize);
+  }
+  vector<char> out;
+  if (!compress(&samples[0], samples.size(), &out))
+    return 0;
+  const uint64_t compressed_size = out.size();
+  return compressed_size * size / samples.size();
+}
+
+// Appends the blocks of |run| in |image| to |pieces|. If zero_blocks is set,
+// its runs of at least kMinZeroRunBlocks zero blocks are pieces of their own.
+// The blocks in |holes| are zeros, and aren't read.
+void SplitUnwrittenRun(const MappedFile& image,
+                       const FileHoles& holes,
+                       const BlockOwners::Run& run,
+                       vector<UnwrittenPiece>* pieces) {
+  const uint64_t end_block = run.start_block + run.num_blocks;
+  uint64_t data_start = run.start_block;
+  for (uint64_t block = run.start_block; zero_blocks && block < end_block; ) {
+    uint64_t zero_end = block;
+    while (zero_end < end_block) {
+      const uint64_t hole_blocks = holes.HoleBlocksAt(zero_end);
+      if (hole_blocks > 0) {
+        zero_end = min(end_block, zero_end + hole_blocks);
+        continue;
+      }
+      if (!block_scan::IsZeroData(image.data() + zero_end * kBlockSize,
+                                  kBlockSize))
+        break;
+      zero_end++;
+    }
+    if (zero_end - block >= kMinZeroRunBlocks) {
+      if (block > data_start) {
+        pieces->push_back(UnwrittenPiece(data_start, block - data_start,
+                                         run.reader, false));
+      }
+      pieces->push_back(UnwrittenPiece(block, zero_end - block, run.reader,
+                                       true));
+      data_start = zero_end;
     }
-    graph_utils::AppendBlockToExtents(&extents, i);
-    block_count++;
+    block = zero_end + 1;
+  }
+  if (end_block > data_start) {
+    pieces->push_back(UnwrittenPiece(data_start, end_block - data_start,
+                                     run.reader, false));
   }
+}
 
-  // Code will handle 'buf' at any size that's a multiple of kBlockSize,
-  // so we arbitrarily set it to 1024 * kBlockSize.
-  vector<char> buf(1024 * kBlockSize);
+}  // namespace {}
 
-  LOG(INFO) << "Reading left over blocks";
-  vector<Block>::size_type blocks_copied_count = 0;
+bool DeltaDiffGenerator::ReadUnwrittenBlocks(const BlockOwners& blocks,
+                                             int blobs_fd,
+                                             off_t* blobs_length,
+                                             const string& image_path,
+                                             ThreadPool* pool,
+                                             Graph* graph) {
+  MappedFile image;
+  TEST_AND_RETURN_FALSE(image.Init(image_path, 0, -1));
+  FileHoles holes;
+  if (zero_blocks)
+    TEST_AND_RETURN_FALSE(holes.Init(image_path, image.size(), kBlockSize));
+  const off_t blobs_start = *blobs_length;
 
-  // For each extent in extents, write the data into BZ2_bzWrite which
-  // sends it to an output file.
-  // We use the temporary buffer 'buf' to hold the data, which may be
-  // smaller than the extent, so in that case we have to loop to get
-  // the extent's data (that's the inner while loop).
-  for (vector<Extent>::const_iterator it = extents.begin();
-       it != extents.end(); ++it) {
-    vector<Block>::size_type blocks_read = 0;
-    float printed_progress = -1;
-    while (blocks_read < it->num_blocks()) {
-      const int copy_block_cnt =
-          min(buf.size() / kBlockSize,
-              static_cast<vector<char>::size_type>(
-                  it->num_blocks() - blocks_read));
-      ssize_t rc = pread(image_fd,
-                         &buf[0],
-                         copy_block_cnt * kBlockSize,
-                         (it->start_block() + blocks_read) * kBlockSize);
-      TEST_AND_RETURN_FALSE_ERRNO(rc >= 0);
-      TEST_AND_RETURN_FALSE(static_cast<size_t>(rc) ==
-                            copy_block_cnt * kBlockSize);
-      BZ2_bzWrite(&err, bz_file, &buf[0], copy_block_cnt * kBlockSize);
-      TEST_AND_RETURN_FALSE(err == BZ_OK);
-      blocks_read += copy_block_cnt;
-      blocks_copied_count += copy_block_cnt;
-      float current_progress =
-          static_cast<float>(blocks_copied_count) / block_count;
-      if (printed_progress + 0.1 < current_progress ||
-          blocks_copied_count == block_count) {
-        LOG(INFO) << "progress: " << current_progress;
-        printed_progress = current_progress;
+  LOG(INFO) << "Appending left over blocks to extents";
+  vector<UnwrittenPiece> pieces;
+  const vector<BlockOwners::Run> runs = blocks.GetRuns();
+  for (vector<BlockOwners::Run>::const_iterator it = runs.begin();
+       it != runs.end(); ++it) {
+    if (it->writer != Vertex::kInvalidIndex)
+      continue;
+    TEST_AND_RETURN_FALSE((it->start_block + it->num_blocks) * kBlockSize <=
+                          image.size());
+    SplitUnwrittenRun(image, holes, *it, &pieces);
+  }
+
+  // The extents of each chunk, and the parts of them other vertices read.
+  // The chunks of data come first, then those of zero blocks.
+  vector<vector<Extent> > chunk_extents;
+  vector<vector<pair<Vertex::Index, Extent> > > chunk_reads;
+  size_t first_zero_chunk = 0;
+  uint64_t block_count = 0;
+  for (int zero = 0; zero < 2; zero++) {
+    first_zero_chunk = chunk_extents.size();
+    uint64_t chunk_blocks = kUnwrittenChunkBlocks;
+    for (vector<UnwrittenPiece>::const_iterator it = pieces.begin();
+         it != pieces.end(); ++it) {
+      if (it->zero != (zero == 1))
+        continue;
+      for (uint64_t done = 0; done < it->num_blocks; ) {
+        if (chunk_blocks == kUnwrittenChunkBlocks) {
+          chunk_extents.resize(chunk_extents.size() + 1);
+          chunk_reads.resize(chunk_reads.size() + 1);
+          chunk_blocks = 0;
+        }
+        const uint64_t piece_blocks =
+            min(it->num_blocks - done, kUnwrittenChunkBlocks - chunk_blocks);
+        const Extent extent = ExtentForRange(it->start_block + done,
+                                             piece_blocks);
+        graph_utils::AppendExtentToExtents(&chunk_extents.back(), extent);
+        if (it->reader != Vertex::kInvalidIndex)
+          chunk_reads.back().push_back(make_pair(it->reader, extent));
+        chunk_blocks += piece_blocks;
+        done += piece_blocks;
       }
+      block_count += it->num_blocks;
     }
   }
-  BZ2_bzWriteClose(&err, bz_file, 0, NULL, NULL);
-  TEST_AND_RETURN_FALSE(err == BZ_OK);
-  bz_file = NULL;
-  TEST_AND_RETURN_FALSE_ERRNO(0 == fclose(file));
-  file = NULL;
 
-  vector<char> compressed_data;
-  LOG(INFO) << "Reading compressed data off disk";
-  TEST_AND_RETURN_FALSE(utils::ReadFile(temp_file_path, &compressed_data));
-  TEST_AND_RETURN_FALSE(unlink(temp_file_path.c_str()) == 0);
+  // The readers of the blocks must read them before they're overwritten.
+  const Vertex::Index first_vertex = graph->size();
+  graph->resize(first_vertex + chunk_extents.size());
+  for (size_t i = 0; i < chunk_extents.size(); i++) {
+    Vertex* vertex = &(*graph)[first_vertex + i];
+    vertex->file_name = StringPrintf("<rootfs-non-file-data-%d>",
+                                     static_cast<int>(i));
+    for (vector<pair<Vertex::Index, Extent> >::const_iterator it =
+             chunk_reads[i].begin(); it != chunk_reads[i].end(); ++it) {
+      graph_utils::AddReadBeforeDepExtents(vertex, it->first,
+                                           vector<Extent>(1, it->second));
+    }
+  }
 
-  // Add node to graph to write these blocks
-  out_op->set_type(DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ);
-  out_op->set_data_offset(*blobs_length);
-  out_op->set_data_length(compressed_data.size());
+  LOG(INFO) << "Compressing " << block_count << " left over blocks in "
+            << chunk_extents.size() << " chunks";
+  OrderedTaskRunner<UnwrittenBlocksTask> runner(pool,
+                                                4 * pool->num_threads());
+  size_t next_chunk = 0;
+  uint64_t blocks_copied_count = 0;
+  float printed_progress = -1;
+  for (size_t i = 0; i < chunk_extents.size(); i++) {
+    while (!runner.full() && next_chunk < chunk_extents.size()) {
+      shared_ptr<UnwrittenBlocksTask> task(
+          new UnwrittenBlocksTask(&image, chunk_extents[next_chunk],
+                                  next_chunk >= first_zero_chunk));
+      runner.Submit(task);
+      next_chunk++;
+    }
+    shared_ptr<UnwrittenBlocksTask> task;
+    TEST_AND_RETURN_FALSE(runner.WaitOldest(&task));
+
+    // Add node to graph to write these blocks
+    const vector<char>& data = task->data();
+    DeltaArchiveManifest_InstallOperation* out_op =
+        &(*graph)[first_vertex + i].op;
+    out_op->set_type(task->type());
+    if (task->type() != DeltaArchiveManifest_InstallOperation_Type_ZERO) {
+      out_op->set_data_offset(*blobs_length);
+      out_op->set_data_length(data.size());
+      *blobs_length += data.size();
+    }
+    const uint64_t chunk_block_count =
+        graph_utils::BlocksInExtents(task->extents());
+    out_op->set_dst_length(kBlockSize * chunk_block_count);
+    DeltaDiffGenerator::StoreExtents(task->extents(),
+                                     out_op->mutable_dst_extents());
+    if (!data.empty())
+      TEST_AND_RETURN_FALSE(utils::WriteAll(blobs_fd, &data[0], data.size()));
+
+    blocks_copied_count += chunk_block_count;
+    float current_progress =
+        static_cast<float>(blocks_copied_count) / block_count;
+    if (printed_progress + 0.1 < current_progress ||
+        blocks_copied_count == block_count) {
+      LOG(INFO) << "progress: " << current_progress;
+      printed_progress = current_progress;
+    }
+  }
   LOG(INFO) << "Rootfs non-data blocks compressed take up "
-            << compressed_data.size();
-  *blobs_length += compressed_data.size();
-  out_op->set_dst_length(kBlockSize * block_count);
-  DeltaDiffGenerator::StoreExtents(extents, out_op->mutable_dst_extents());
-
-  TEST_AND_RETURN_FALSE(utils::WriteAll(blobs_fd,
-                                        &compressed_data[0],
-                                        compressed_data.size()));
+            << *blobs_length - blobs_start;
   LOG(INFO) << "done with extra blocks";
   return true;
 }
 
+namespace {
+
 // Writes the uint64_t passed in in host-endian to the file as big-endian.
 // Returns true on success.
 bool WriteUint64AsBigEndian(FileWriter* writer, const uint64_t value) {
@@ -352,37 +1507,37 @@ bool WriteUint64AsBigEndian(FileWriter* writer, const uint64_t value) {
   return true;
 }
 
-// Adds each operation from |graph| to |out_manifest| in the order specified by
-// |order| while building |out_op_name_map| with operation to name
-// mappings. Adds all |kernel_ops| to |out_manifest|. Filters out no-op
-// operations.
+// Moves each operation from |graph| to |out_manifest| in the order specified
+// by |order| while building |out_op_name_map| with operation to name
+// mappings. Moves all |kernel_ops| to |out_manifest|. Filters out no-op
+// operations, unless |keep_noops|: a MOVE onto the same blocks still copies
+// them when the source is another partition. The operations are swapped
+// into the manifest rather than copied, which would allocate each of their
+// extents again, so those of |graph| and |kernel_ops| are left empty.
 void InstallOperationsToManifest(
-    const Graph& graph,
+    Graph* graph,
     const vector<Vertex::Index>& order,
-    const vector<DeltaArchiveManifest_InstallOperation>& kernel_ops,
+    vector<DeltaArchiveManifest_InstallOperation>* kernel_ops,
+    bool keep_noops,
     DeltaArchiveManifest* out_manifest,
     OperationNameMap* out_op_name_map) {
   for (vector<Vertex::Index>::const_iterator it = order.begin();
        it != order.end(); ++it) {
-    const Vertex& vertex = graph[*it];
-    const DeltaArchiveManifest_InstallOperation& add_op = vertex.op;
-    if (DeltaDiffGenerator::IsNoopOperation(add_op)) {
+    Vertex& vertex = (*graph)[*it];
+    if (!keep_noops && DeltaDiffGenerator::IsNoopOperation(vertex.op)) {
       continue;
     }
     DeltaArchiveManifest_InstallOperation* op =
         out_manifest->add_install_operations();
-    *op = add_op;
+    op->Swap(&vertex.op);
     (*out_op_name_map)[op] = &vertex.file_name;
   }
-  for (vector<DeltaArchiveManifest_InstallOperation>::const_iterator it =
-           kernel_ops.begin(); it != kernel_ops.end(); ++it) {
-    const DeltaArchiveManifest_InstallOperation& add_op = *it;
-    if (DeltaDiffGenerator::IsNoopOperation(add_op)) {
+  for (vector<DeltaArchiveManifest_InstallOperation>::iterator it =
+           kernel_ops->begin(); it != kernel_ops->end(); ++it) {
+    if (!keep_noops && DeltaDiffGenerator::IsNoopOperation(*it)) {
       continue;
     }
-    DeltaArchiveManifest_InstallOperation* op =
-        out_manifest->add_kernel_install_operations();
-    *op = add_op;
+    out_manifest->add_kernel_install_operations()->Swap(&*it);
   }
 }
 
@@ -395,39 +1550,108 @@ void CheckGraph(const Graph& graph) {
 // Delta compresses a kernel partition |new_kernel_part| with knowledge of the
 // old kernel partition |old_kernel_part|. If |old_kernel_part| is an empty
 // string, generates a full update of the partition.
+// Runs ReadFileToDiff() for one chunk of the kernel partition on a
+// ThreadPool worker.
+class KernelDiffTask : public ThreadPoolTask {
+ public:
+  KernelDiffTask(const string& old_kernel_part,
+                 const string& new_kernel_part,
+                 off_t chunk_offset,
+                 off_t chunk_size)
+      : old_kernel_part_(old_kernel_part),
+        new_kernel_part_(new_kernel_part),
+        chunk_offset_(chunk_offset),
+        chunk_size_(chunk_size) {}
+
+  virtual bool Run() {
+    return DeltaDiffGenerator::ReadFileToDiff(old_kernel_part_,
+                                              new_kernel_part_,
+                                              chunk_offset_,
+                                              chunk_size_,
+                                              true,  // bsdiff_allowed
+                                              data_.data(),
+                                              &operation_,
+                                              false) &&
+        data_.Spill();
+  }
+
+  // The data blob, once LoadData() read it back.
+  const vector<char>& data() const { return data_.data(); }
+  bool LoadData() { return data_.Load(); }
+  const DeltaArchiveManifest_InstallOperation& operation() const {
+    return operation_;
+  }
+
+ private:
+  const string old_kernel_part_;
+  const string new_kernel_part_;
+  const off_t chunk_offset_;
+  const off_t chunk_size_;
+  SpillableBlob data_;
+  DeltaArchiveManifest_InstallOperation operation_;
+
+  DISALLOW_COPY_AND_ASSIGN(KernelDiffTask);
+};
+
+// Diffs the kernel partition into |ops|, one for each chunk of
+// kernel_chunk_size bytes or a single one for all of it, and appends their
+// data to |blobs_fd|. The chunks are diffed concurrently on |pool|. Each
+// operation only reads and writes the blocks of its own chunk.
 bool DeltaCompressKernelPartition(
     const string& old_kernel_part,
     const string& new_kernel_part,
     vector<DeltaArchiveManifest_InstallOperation>* ops,
     int blobs_fd,
-    off_t* blobs_length) {
+    off_t* blobs_length,
+    ThreadPool* pool) {
   LOG(INFO) << "Delta compressing kernel partition...";
   LOG_IF(INFO, old_kernel_part.empty()) << "Generating full kernel update...";
 
-  // Add a new install operation
-  ops->resize(1);
-  DeltaArchiveManifest_InstallOperation* op = &(*ops)[0];
-
-  vector<char> data;
-  TEST_AND_RETURN_FALSE(
-      DeltaDiffGenerator::ReadFileToDiff(old_kernel_part,
-                                         new_kernel_part,
-                                         true, // bsdiff_allowed
-                                         &data,
-                                         op,
-                                         false));
-
-  // Write the data
-  if (op->type() != DeltaArchiveManifest_InstallOperation_Type_MOVE) {
-    op->set_data_offset(*blobs_length);
-    op->set_data_length(data.size());
+  vector<off_t> chunk_offsets(1, 0);
+  if (kernel_chunk_size > 0) {
+    const off_t kernel_size = utils::FileSize(new_kernel_part);
+    TEST_AND_RETURN_FALSE(kernel_size >= 0);
+    for (off_t offset = kernel_chunk_size; offset < kernel_size;
+         offset += kernel_chunk_size)
+      chunk_offsets.push_back(offset);
   }
 
-  TEST_AND_RETURN_FALSE(utils::WriteAll(blobs_fd, &data[0], data.size()));
-  *blobs_length += data.size();
+  OrderedTaskRunner<KernelDiffTask> runner(pool, 4 * pool->num_threads());
+  ops->clear();
+  size_t next_chunk = 0;
+  while (next_chunk < chunk_offsets.size() || !runner.empty()) {
+    if (!runner.full() && next_chunk < chunk_offsets.size()) {
+      shared_ptr<KernelDiffTask> task(
+          new KernelDiffTask(old_kernel_part,
+                             new_kernel_part,
+                             chunk_offsets[next_chunk],
+                             kernel_chunk_size > 0 ? kernel_chunk_size : -1));
+      runner.Submit(task);
+      next_chunk++;
+      continue;
+    }
+    shared_ptr<KernelDiffTask> task;
+    TEST_AND_RETURN_FALSE(runner.WaitOldest(&task));
+    TEST_AND_RETURN_FALSE(task->LoadData());
+    ops->push_back(task->operation());
+    DeltaArchiveManifest_InstallOperation* op = &ops->back();
+    const vector<char>& data = task->data();
+
+    // Write the data
+    if (op->type() != DeltaArchiveManifest_InstallOperation_Type_MOVE) {
+      op->set_data_offset(*blobs_length);
+      op->set_data_length(data.size());
+    }
+    if (!data.empty()) {
+      TEST_AND_RETURN_FALSE(utils::WriteAll(blobs_fd, &data[0], data.size()));
+      *blobs_length += data.size();
+    }
+    LOG(INFO) << "Kernel operation " << ops->size() - 1 << ": "
+              << kInstallOperationTypes[op->type()];
+  }
 
-  LOG(INFO) << "Done delta compressing kernel partition: "
-            << kInstallOperationTypes[op->type()];
+  LOG(INFO) << "Done delta compressing kernel partition into " << ops->size()
+            << " operations";
   return true;
 }
 
@@ -490,101 +1714,309 @@ void ReportPayloadUsage(const DeltaArchiveManifest& manifest,
   fprintf(stderr, kFormatString, 100.0, total_size, "", "<total>");
 }
 
+// Trims |extents| down to the |num_blocks| blocks that follow the first
+// |skip_blocks| blocks they cover.
+void ClipExtents(uint64_t skip_blocks,
+                 uint64_t num_blocks,
+                 google::protobuf::RepeatedPtrField<Extent>* extents) {
+  google::protobuf::RepeatedPtrField<Extent> clipped;
+  for (int i = 0; i < extents->size() && num_blocks > 0; i++) {
+    const Extent& extent = extents->Get(i);
+    if (extent.num_blocks() <= skip_blocks) {
+      skip_blocks -= extent.num_blocks();
+      continue;
+    }
+    const uint64_t start = extent.start_block() == kSparseHole ?
+        kSparseHole : extent.start_block() + skip_blocks;
+    const uint64_t blocks = min(extent.num_blocks() - skip_blocks, num_blocks);
+    *clipped.Add() = ExtentForRange(start, blocks);
+    num_blocks -= blocks;
+    skip_blocks = 0;
+  }
+  extents->Swap(&clipped);
+}
+
+// Stores in |data| and |type| the cheapest encoding of the |new_data| at
+// |chunk_offset| of |new_filename|, whose size was asked as |chunk_size|:
+// a full operation or, if |old_data| isn't NULL, a BSDIFF or a STREAM_DIFF
+// from it.
+bool EncodeChangedData(const string& new_filename,
+                       off_t chunk_offset,
+                       off_t chunk_size,
+                       const MappedFile& new_data,
+                       const MappedFile* old_data,
+                       vector<char>* data,
+                       DeltaArchiveManifest_InstallOperation_Type* type) {
+  if (!new_image_cache ||
+      !new_image_cache->GetFullOperation(new_filename, chunk_offset,
+                                         chunk_size, data, type)) {
+    TEST_AND_RETURN_FALSE(DeltaDiffGenerator::CompressReplaceData(
+        new_data.data(), new_data.size(), data, type));
+    if (new_image_cache) {
+      new_image_cache->PutFullOperation(new_filename, chunk_offset,
+                                        chunk_size, *data, *type);
+    }
+  }
+  if (!old_data)
+    return true;
+  const DeltaArchiveManifest_InstallOperation_Type full_type = *type;
+  const uint64_t full_size = data->size();
+
+  // Nothing is gained diffing data that has nothing in common with the old
+  // data, e.g., a file compressed again after a small change.
+  if (new_data.size() >= kProbeMinSize &&
+      data_probe::SharedContentFraction(old_data->data(),
+                                        old_data->size(),
+                                        new_data.data(),
+                                        new_data.size()) <
+      kUnrelatedSharedContent) {
+    return true;
+  }
+
+  // A diff that would cost more than the full operation with no blob at
+  // all, e.g., because it takes too much memory to apply, isn't tried.
+  if (DeltaDiffGenerator::IsCheaperOperation(
+          DeltaArchiveManifest_InstallOperation_Type_BSDIFF,
+          0,
+          full_type,
+          full_size,
+          old_data->size(),
+          new_data.size())) {
+    vector<char> bsdiff_delta;
+    TEST_AND_RETURN_FALSE(BsdiffBuffers(old_data->data(),
+                                        old_data->size(),
+                                        new_data.data(),
+                                        new_data.size(),
+                                        suffix_array_cache,
+                                        &bsdiff_delta));
+    CHECK_GT(bsdiff_delta.size(), static_cast<vector<char>::size_type>(0));
+    if (DeltaDiffGenerator::IsCheaperOperation(
+            DeltaArchiveManifest_InstallOperation_Type_BSDIFF,
+            bsdiff_delta.size(),
+            full_type,
+            full_size,
+            old_data->size(),
+            new_data.size())) {
+      *type = DeltaArchiveManifest_InstallOperation_Type_BSDIFF;
+      data->swap(bsdiff_delta);
+    }
+  }
+
+  if (stream_diff_margin < 0 ||
+      !DeltaDiffGenerator::IsCheaperOperation(
+          DeltaArchiveManifest_InstallOperation_Type_STREAM_DIFF,
+          0,
+          full_type,
+          full_size,
+          old_data->size(),
+          new_data.size())) {
+    return true;
+  }
+  vector<char> stream_delta;
+  TEST_AND_RETURN_FALSE(StreamDiffBuffers(old_data->data(),
+                                          old_data->size(),
+                                          new_data.data(),
+                                          new_data.size(),
+                                          &stream_delta));
+  // The STREAM_DIFF replaces a BSDIFF within the margin, and otherwise has
+  // to beat the full operation.
+  const bool chosen =
+      *type == DeltaArchiveManifest_InstallOperation_Type_BSDIFF ?
+      stream_delta.size() * 100 <= data->size() * (100 + stream_diff_margin) :
+      DeltaDiffGenerator::IsCheaperOperation(
+          DeltaArchiveManifest_InstallOperation_Type_STREAM_DIFF,
+          stream_delta.size(),
+          full_type,
+          full_size,
+          old_data->size(),
+          new_data.size());
+  if (chosen) {
+    *type = DeltaArchiveManifest_InstallOperation_Type_STREAM_DIFF;
+    data->swap(stream_delta);
+  }
+  return true;
+}
+
+// Returns the key of the checkpoints of the delta generation from the given
+// images and kernel partitions: their paths, sizes and modification times,
+// and the settings the checkpointed phases depend on.
+string CheckpointKey(const string& old_image,
+                     const string& new_image,
+                     const string& old_kernel_part,
+                     const string& new_kernel_part) {
+  string key;
+  const string* inputs[] = {
+    &old_image, &new_image, &old_kernel_part, &new_kernel_part
+  };
+  for (size_t i = 0; i < arraysize(inputs); i++) {
+    struct stat stbuf;
+    if (inputs[i]->empty() || stat(inputs[i]->c_str(), &stbuf) != 0)
+      memset(&stbuf, 0, sizeof(stbuf));
+    key += StringPrintf("%s:%" PRIi64 ":%" PRIi64 ",",
+                        inputs[i]->c_str(),
+                        static_cast<int64_t>(stbuf.st_size),
+                        static_cast<int64_t>(stbuf.st_mtime));
+  }
+  key += StringPrintf("source=%d,images=%d,xz=%d,zero=%d,stream=%d,greedy=%d,"
+                      "dedup=%d,chunk=%" PRIi64 ",kernel_chunk=%" PRIi64,
+                      apply_from_source, read_images, xz_compression,
+                      zero_blocks, stream_diff_margin, greedy_cycle_breaking,
+                      block_deduplication,
+                      static_cast<int64_t>(file_chunk_size),
+                      static_cast<int64_t>(kernel_chunk_size));
+  if (apply_cost_model)
+    key += ",cost=" + apply_cost_model->ToString();
+  if (xz_dictionary_size > 0)
+    key += StringPrintf(",xz_dict=%" PRIu64,
+                        static_cast<uint64_t>(xz_dictionary_size));
+  if (similar_file_matching)
+    key += ",similar=1";
+  if (blake3_operation_hashes)
+    key += ",blake3=1";
+  return key;
+}
+
+// Checkpoints the generation identified by |key| after |phase|, if
+// checkpoints are kept. Failing to is logged but not an error.
+void CheckpointGeneration(
+    const string& key,
+    GeneratorCheckpoint::Phase phase,
+    const Graph& graph,
+    const BlockOwners& blocks,
+    const vector<DeltaArchiveManifest_InstallOperation>& kernel_ops,
+    Vertex::Index scratch_vertex,
+    const vector<Vertex::Index>& final_order,
+    off_t data_file_size) {
+  if (generator_checkpoint &&
+      !generator_checkpoint->Save(key, phase, graph, blocks, kernel_ops,
+                                  scratch_vertex, final_order,
+                                  data_file_size)) {
+    LOG(WARNING) << "Unable to checkpoint the generation";
+  }
+}
+
 }  // namespace {}
 
 bool DeltaDiffGenerator::ReadFileToDiff(
     const string& old_filename,
     const string& new_filename,
+    off_t chunk_offset,
+    off_t chunk_size,
     bool bsdiff_allowed,
     vector<char>* out_data,
     DeltaArchiveManifest_InstallOperation* out_op,
     bool gather_extents) {
-  // Read new data in
-  vector<char> new_data;
-  TEST_AND_RETURN_FALSE(utils::ReadFile(new_filename, &new_data));
-
-  TEST_AND_RETURN_FALSE(!new_data.empty());
-
-  vector<char> new_data_bz;
-  TEST_AND_RETURN_FALSE(BzipCompress(new_data, &new_data_bz));
-  CHECK(!new_data_bz.empty());
+  TEST_AND_RETURN_FALSE(chunk_offset % kBlockSize == 0);
+  // Map new data in
+  MappedFile new_data;
+  TEST_AND_RETURN_FALSE(MapFile(new_filename, chunk_offset, chunk_size,
+                                &new_data));
 
-  vector<char> data;  // Data blob that will be written to delta file.
-
-  DeltaArchiveManifest_InstallOperation operation;
-  size_t current_best_size = 0;
-  if (new_data.size() <= new_data_bz.size()) {
-    operation.set_type(DeltaArchiveManifest_InstallOperation_Type_REPLACE);
-    current_best_size = new_data.size();
-    data = new_data;
-  } else {
-    operation.set_type(DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ);
-    current_best_size = new_data_bz.size();
-    data = new_data_bz;
-  }
+  TEST_AND_RETURN_FALSE(new_data.size() > 0);
 
   // Do we have an original file to consider?
   struct stat old_stbuf;
   bool original = !old_filename.empty();
-  if (original && 0 != stat(old_filename.c_str(), &old_stbuf)) {
+  if (original && !LstatFile(old_filename, &old_stbuf)) {
     // If stat-ing the old file fails, it should be because it doesn't exist.
     TEST_AND_RETURN_FALSE(errno == ENOTDIR || errno == ENOENT);
     original = false;
   }
 
+  // Map old data. The chunk of a file that grew may not exist in the old
+  // one.
+  MappedFile old_data;
   if (original) {
-    // Read old data
-    vector<char> old_data;
-    TEST_AND_RETURN_FALSE(utils::ReadFile(old_filename, &old_data));
-    if (old_data == new_data) {
-      // No change in data.
-      operation.set_type(DeltaArchiveManifest_InstallOperation_Type_MOVE);
-      current_best_size = 0;
-      data.clear();
-    } else if (bsdiff_allowed) {
-      // If the source file is considered bsdiff safe (no bsdiff bugs
-      // triggered), see if BSDIFF encoding is smaller.
-      vector<char> bsdiff_delta;
-      TEST_AND_RETURN_FALSE(
-          BsdiffFiles(old_filename, new_filename, &bsdiff_delta));
-      CHECK_GT(bsdiff_delta.size(), static_cast<vector<char>::size_type>(0));
-      if (bsdiff_delta.size() < current_best_size) {
-        operation.set_type(DeltaArchiveManifest_InstallOperation_Type_BSDIFF);
-        current_best_size = bsdiff_delta.size();
-        data = bsdiff_delta;
-      }
+    TEST_AND_RETURN_FALSE(
+        MapFile(old_filename, chunk_offset, chunk_size, &old_data));
+    original = old_data.size() > 0 || chunk_offset == 0;
+  }
+
+  vector<char> data;  // Data blob that will be written to delta file.
+
+  DeltaArchiveManifest_InstallOperation operation;
+  if (original && old_data.size() == new_data.size() &&
+      block_scan::DataEquals(old_data.data(), new_data.data(),
+                             new_data.size())) {
+    // No change in data.
+    operation.set_type(DeltaArchiveManifest_InstallOperation_Type_MOVE);
+  } else {
+    // If the source file is considered bsdiff safe (no bsdiff bugs
+    // triggered), BSDIFF encoding is considered too. The encoding may be
+    // in the operation cache from an earlier run.
+    const MappedFile* bsdiff_source =
+        original && bsdiff_allowed ? &old_data : NULL;
+    string cache_key;
+    if (operation_cache) {
+      TEST_AND_RETURN_FALSE(OperationCache::ComputeKey(
+          bsdiff_source ? bsdiff_source->data() : NULL,
+          bsdiff_source ? bsdiff_source->size() : 0,
+          new_data.data(),
+          new_data.size(),
+          StringPrintf("xz=%d,zero=%d,stream=%d%s%s", xz_compression,
+                       zero_blocks, stream_diff_margin,
+                       apply_cost_model ?
+                       (",cost=" + apply_cost_model->ToString()).c_str() :
+                       "",
+                       xz_dictionary.empty() ? "" :
+                       (",xz_dict=" + xz_dictionary_hash).c_str()),
+          &cache_key));
     }
+    DeltaArchiveManifest_InstallOperation_Type type;
+    if (!operation_cache || !operation_cache->Get(cache_key, &data, &type)) {
+      ScopedMemoryReservation reservation(
+          memory_budget,
+          EncodeMemoryEstimate(bsdiff_source ? bsdiff_source->size() : 0,
+                               new_data.size()));
+      TEST_AND_RETURN_FALSE(EncodeChangedData(new_filename,
+                                              chunk_offset,
+                                              chunk_size,
+                                              new_data,
+                                              bsdiff_source,
+                                              &data,
+                                              &type));
+      if (operation_cache)
+        operation_cache->Put(cache_key, data, type);
+    }
+    operation.set_type(type);
   }
 
   // Set parameters of the operations
-  CHECK_EQ(data.size(), current_best_size);
-
+  const uint64_t chunk_start_block = chunk_offset / kBlockSize;
   if (operation.type() == DeltaArchiveManifest_InstallOperation_Type_MOVE ||
-      operation.type() == DeltaArchiveManifest_InstallOperation_Type_BSDIFF) {
+      operation.type() == DeltaArchiveManifest_InstallOperation_Type_BSDIFF ||
+      operation.type() ==
+          DeltaArchiveManifest_InstallOperation_Type_STREAM_DIFF) {
+    const uint64_t src_blocks =
+        (old_data.size() + kBlockSize - 1) / kBlockSize;
     if (gather_extents) {
       TEST_AND_RETURN_FALSE(
           GatherExtents(old_filename, operation.mutable_src_extents()));
+      ClipExtents(chunk_start_block, src_blocks,
+                  operation.mutable_src_extents());
     } else {
       Extent* src_extent = operation.add_src_extents();
-      src_extent->set_start_block(0);
-      src_extent->set_num_blocks(
-          (old_stbuf.st_size + kBlockSize - 1) / kBlockSize);
+      src_extent->set_start_block(chunk_start_block);
+      src_extent->set_num_blocks(src_blocks);
     }
-    operation.set_src_length(old_stbuf.st_size);
+    operation.set_src_length(old_data.size());
   }
 
+  const uint64_t dst_blocks = (new_data.size() + kBlockSize - 1) / kBlockSize;
   if (gather_extents) {
     TEST_AND_RETURN_FALSE(
         GatherExtents(new_filename, operation.mutable_dst_extents()));
+    ClipExtents(chunk_start_block, dst_blocks,
+                operation.mutable_dst_extents());
   } else {
     Extent* dst_extent = operation.add_dst_extents();
-    dst_extent->set_start_block(0);
-    dst_extent->set_num_blocks((new_data.size() + kBlockSize - 1) / kBlockSize);
+    dst_extent->set_start_block(chunk_start_block);
+    dst_extent->set_num_blocks(dst_blocks);
   }
   operation.set_dst_length(new_data.size());
 
   out_data->swap(data);
-  *out_op = operation;
+  out_op->Swap(&operation);
 
   return true;
 }
@@ -604,109 +2036,235 @@ bool DeltaDiffGenerator::InitializePartitionInfo(bool is_kernel,
   }
   TEST_AND_RETURN_FALSE(size > 0);
   info->set_size(size);
+  MappedFile file;
+  TEST_AND_RETURN_FALSE(file.Init(partition, 0, size));
+  TEST_AND_RETURN_FALSE(file.size() == static_cast<uint64_t>(size));
+  // The holes of a sparse image are hashed from a buffer of zeros rather
+  // than read.
+  FileHoles holes;
+  TEST_AND_RETURN_FALSE(holes.Init(partition, size, kBlockSize));
+  const vector<char> zeros(holes.hole_blocks() > 0 ? kHoleHashBufferSize : 0);
   OmahaHashCalculator hasher;
-  TEST_AND_RETURN_FALSE(hasher.UpdateFile(partition, size) == size);
+  for (uint64_t offset = 0; offset < file.size(); ) {
+    const uint64_t block = offset / kBlockSize;
+    uint64_t hole_size = holes.HoleBlocksAt(block) * kBlockSize;
+    if (hole_size > 0) {
+      while (hole_size > 0) {
+        const uint64_t count = min<uint64_t>(hole_size, zeros.size());
+        TEST_AND_RETURN_FALSE(hasher.Update(&zeros[0], count));
+        hole_size -= count;
+        offset += count;
+      }
+      continue;
+    }
+    const uint64_t next_hole = holes.NextHole(block);
+    const uint64_t data_size =
+        next_hole == FileHoles::kNoHole ? file.size() - offset :
+        next_hole * kBlockSize - offset;
+    TEST_AND_RETURN_FALSE(hasher.Update(file.data() + offset, data_size));
+    offset += data_size;
+  }
   TEST_AND_RETURN_FALSE(hasher.Finalize());
   const vector<char>& hash = hasher.raw_hash();
   info->set_hash(hash.data(), hash.size());
   LOG(INFO) << partition << ": size=" << size << " hash=" << hasher.hash();
+
+  info->clear_chunk_size();
+  info->clear_chunk_hashes();
+  if (partition_hash_chunk_size == 0)
+    return true;
+  // The whole chunks in holes share the hash of a chunk of zeros.
+  vector<const char*> chunks;
+  vector<size_t> chunk_lengths;
+  vector<size_t> hash_indexes;
+  vector<char> zero_chunk;
+  size_t zero_chunk_index = 0;
+  for (uint64_t offset = 0; offset < file.size();
+       offset += partition_hash_chunk_size) {
+    const uint64_t length =
+        min<uint64_t>(partition_hash_chunk_size, file.size() - offset);
+    if (length == partition_hash_chunk_size &&
+        offset % kBlockSize == 0 && length % kBlockSize == 0 &&
+        holes.IsHole(offset / kBlockSize, length / kBlockSize)) {
+      if (zero_chunk.empty()) {
+        zero_chunk.resize(length);
+        zero_chunk_index = chunks.size();
+        chunks.push_back(&zero_chunk[0]);
+        chunk_lengths.push_back(length);
+      }
+      hash_indexes.push_back(zero_chunk_index);
+      continue;
+    }
+    hash_indexes.push_back(chunks.size());
+    chunks.push_back(file.data() + offset);
+    chunk_lengths.push_back(length);
+  }
+  ThreadPool pool(num_threads);
+  TEST_AND_RETURN_FALSE(pool.Init());
+  vector<vector<char> > chunk_hashes;
+  TEST_AND_RETURN_FALSE(OmahaHashCalculator::RawHashesOfBytes(
+      chunks, chunk_lengths, &pool, &chunk_hashes));
+  info->set_chunk_size(partition_hash_chunk_size);
+  for (size_t i = 0; i < hash_indexes.size(); i++) {
+    const vector<char>& chunk_hash = chunk_hashes[hash_indexes[i]];
+    info->add_chunk_hashes(chunk_hash.data(), chunk_hash.size());
+  }
+  LOG(INFO) << partition << ": " << hash_indexes.size() << " chunk hashes of "
+            << partition_hash_chunk_size << " bytes";
   return true;
 }
 
-bool InitializePartitionInfos(const string& old_kernel,
-                              const string& new_kernel,
-                              const string& old_rootfs,
-                              const string& new_rootfs,
-                              DeltaArchiveManifest* manifest) {
-  if (!old_kernel.empty()) {
-    TEST_AND_RETURN_FALSE(DeltaDiffGenerator::InitializePartitionInfo(
-        true,
-        old_kernel,
-        manifest->mutable_old_kernel_info()));
-  }
-  if (!new_kernel.empty()) {
-    TEST_AND_RETURN_FALSE(DeltaDiffGenerator::InitializePartitionInfo(
-        true,
-        new_kernel,
-        manifest->mutable_new_kernel_info()));
-  }
-  if (!old_rootfs.empty()) {
-    TEST_AND_RETURN_FALSE(DeltaDiffGenerator::InitializePartitionInfo(
-        false,
-        old_rootfs,
-        manifest->mutable_old_rootfs_info()));
-  }
-  TEST_AND_RETURN_FALSE(DeltaDiffGenerator::InitializePartitionInfo(
-      false,
-      new_rootfs,
-      manifest->mutable_new_rootfs_info()));
+bool DeltaDiffGenerator::InitializeHashTreeInfo(const string& partition,
+                                                uint64_t data_size,
+                                                HashTreeInfo* info) {
+  TEST_AND_RETURN_FALSE(data_size % info->block_size() == 0);
+  const uint64_t data_blocks = data_size / info->block_size();
+  VerityTreeBuilder hash_tree;
+  TEST_AND_RETURN_FALSE(hash_tree.Init(data_blocks, info->block_size(),
+                                       rootfs_hash_tree_salt));
+  int fd = open(partition.c_str(), O_RDONLY);
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  ScopedFdCloser fd_closer(&fd);
+  TEST_AND_RETURN_FALSE(hash_tree.ReadMissingBlocks(fd));
+  // The tree goes right after the data, as the images are built.
+  info->set_data_blocks(data_blocks);
+  info->set_hash_start_block(data_blocks);
+  info->set_salt(rootfs_hash_tree_salt.empty() ? NULL :
+                 &rootfs_hash_tree_salt[0], rootfs_hash_tree_salt.size());
+  const vector<char>& root_hash = hash_tree.root_hash();
+  info->set_root_hash(&root_hash[0], root_hash.size());
+  LOG(INFO) << partition << ": hash tree of " << data_blocks
+            << " blocks, root hash "
+            << base::HexEncode(&root_hash[0], root_hash.size());
   return true;
 }
 
-namespace {
+// Runs DeltaDiffGenerator::InitializePartitionInfo() on a ThreadPool worker.
+class PartitionInfoTask : public ThreadPoolTask {
+ public:
+  PartitionInfoTask(bool is_kernel, const string& partition)
+      : is_kernel_(is_kernel),
+        partition_(partition) {}
+
+  virtual bool Run() {
+    return DeltaDiffGenerator::InitializePartitionInfo(is_kernel_,
+                                                       partition_,
+                                                       &info_);
+  }
 
-// Takes a collection (vector or RepeatedPtrField) of Extent and
-// returns a vector of the blocks referenced, in order.
-template<typename T>
-vector<uint64_t> ExpandExtents(const T& extents) {
-  vector<uint64_t> ret;
-  for (size_t i = 0, e = static_cast<size_t>(extents.size()); i != e; ++i) {
-    const Extent extent = graph_utils::GetElement(extents, i);
-    if (extent.start_block() == kSparseHole) {
-      ret.resize(ret.size() + extent.num_blocks(), kSparseHole);
-    } else {
-      for (uint64_t block = extent.start_block();
-           block < (extent.start_block() + extent.num_blocks()); block++) {
-        ret.push_back(block);
+  const PartitionInfo& info() const { return info_; }
+
+ private:
+  const bool is_kernel_;
+  const string partition_;
+  PartitionInfo info_;
+
+  DISALLOW_COPY_AND_ASSIGN(PartitionInfoTask);
+};
+
+// Computes the infos of the partitions of a delta, each on a thread of its
+// own, while the delta is being generated, so that reading the images to
+// hash them overlaps with the diffing, whose reads of the same images it
+// shares through the page cache, rather than follow it.
+class PartitionInfoHasher {
+ public:
+  enum Partition {
+    kOldKernel,
+    kNewKernel,
+    kOldRootfs,
+    kNewRootfs,
+    kNumPartitions
+  };
+
+  PartitionInfoHasher() : pool_(kNumPartitions) {}
+
+  // Starts hashing the partitions whose path isn't empty. The infos of the
+  // new partitions that were computed for an earlier delta are reused.
+  bool Start(const string& old_kernel,
+             const string& new_kernel,
+             const string& old_rootfs,
+             const string& new_rootfs) {
+    TEST_AND_RETURN_FALSE(pool_.Init());
+    const string paths[kNumPartitions] = {
+      old_kernel, new_kernel, old_rootfs, new_rootfs
+    };
+    for (int i = 0; i < kNumPartitions; i++) {
+      paths_[i] = paths[i];
+      if (paths[i].empty())
+        continue;
+      if ((i == kNewKernel || i == kNewRootfs) && new_image_cache &&
+          new_image_cache->GetPartitionInfo(paths[i], &cached_[i]))
+        continue;
+      tasks_[i].reset(new PartitionInfoTask(i == kOldKernel ||
+                                            i == kNewKernel,
+                                            paths[i]));
+      pool_.Submit(tasks_[i].get());
+    }
+    return true;
+  }
+
+  // Waits for the hashes and sets the partition infos of |manifest|.
+  bool Finish(DeltaArchiveManifest* manifest) {
+    for (int i = 0; i < kNumPartitions; i++) {
+      if (paths_[i].empty())
+        continue;
+      PartitionInfo* info = MutableInfo(manifest, static_cast<Partition>(i));
+      if (!tasks_[i].get()) {
+        *info = cached_[i];
+        continue;
       }
+      TEST_AND_RETURN_FALSE(pool_.Wait(tasks_[i].get()));
+      *info = tasks_[i]->info();
+      if ((i == kNewKernel || i == kNewRootfs) && new_image_cache)
+        new_image_cache->PutPartitionInfo(paths_[i], *info);
     }
+    return true;
   }
-  return ret;
-}
 
-// Takes a vector of blocks and returns an equivalent vector of Extent
-// objects.
-vector<Extent> CompressExtents(const vector<uint64_t>& blocks) {
-  vector<Extent> new_extents;
-  for (vector<uint64_t>::const_iterator it = blocks.begin(), e = blocks.end();
-       it != e; ++it) {
-    graph_utils::AppendBlockToExtents(&new_extents, *it);
+ private:
+  static PartitionInfo* MutableInfo(DeltaArchiveManifest* manifest,
+                                    Partition partition) {
+    switch (partition) {
+      case kOldKernel: return manifest->mutable_old_kernel_info();
+      case kNewKernel: return manifest->mutable_new_kernel_info();
+      case kOldRootfs: return manifest->mutable_old_rootfs_info();
+      default: return manifest->mutable_new_rootfs_info();
+    }
   }
-  return new_extents;
-}
 
-}  // namespace {}
+  string paths_[kNumPartitions];
+  PartitionInfo cached_[kNumPartitions];
+  // The tasks outlive |pool_|, whose destruction waits for them.
+  scoped_ptr<PartitionInfoTask> tasks_[kNumPartitions];
+  ThreadPool pool_;
+
+  DISALLOW_COPY_AND_ASSIGN(PartitionInfoHasher);
+};
+
+bool DeltaDiffGenerator::InitializePartitionInfos(
+    const string& old_kernel,
+    const string& new_kernel,
+    const string& old_rootfs,
+    const string& new_rootfs,
+    DeltaArchiveManifest* manifest) {
+  PartitionInfoHasher hasher;
+  TEST_AND_RETURN_FALSE(hasher.Start(old_kernel, new_kernel, old_rootfs,
+                                     new_rootfs));
+  return hasher.Finish(manifest);
+}
 
 void DeltaDiffGenerator::SubstituteBlocks(
     Vertex* vertex,
     const vector<Extent>& remove_extents,
     const vector<Extent>& replace_extents) {
-  // First, expand out the blocks that op reads from
-  vector<uint64_t> read_blocks = ExpandExtents(vertex->op.src_extents());
-  {
-    // Expand remove_extents and replace_extents
-    vector<uint64_t> remove_extents_expanded =
-        ExpandExtents(remove_extents);
-    vector<uint64_t> replace_extents_expanded =
-        ExpandExtents(replace_extents);
-    CHECK_EQ(remove_extents_expanded.size(), replace_extents_expanded.size());
-    map<uint64_t, uint64_t> conversion;
-    for (vector<uint64_t>::size_type i = 0;
-         i < replace_extents_expanded.size(); i++) {
-      conversion[remove_extents_expanded[i]] = replace_extents_expanded[i];
-    }
-    utils::ApplyMap(&read_blocks, conversion);
-    for (Vertex::EdgeMap::iterator it = vertex->out_edges.begin(),
-             e = vertex->out_edges.end(); it != e; ++it) {
-      vector<uint64_t> write_before_deps_expanded =
-          ExpandExtents(it->second.write_extents);
-      utils::ApplyMap(&write_before_deps_expanded, conversion);
-      it->second.write_extents = CompressExtents(write_before_deps_expanded);
-    }
-  }
-  // Convert read_blocks back to extents
+  for (Vertex::EdgeMap::iterator it = vertex->out_edges.begin(),
+           e = vertex->out_edges.end(); it != e; ++it) {
+    it->second.write_extents = graph_utils::SubstituteExtents(
+        it->second.write_extents, remove_extents, replace_extents);
+  }
+  vector<Extent> new_extents = graph_utils::SubstituteExtents(
+      vertex->op.src_extents(), remove_extents, replace_extents);
   vertex->op.clear_src_extents();
-  vector<Extent> new_extents = CompressExtents(read_blocks);
   DeltaDiffGenerator::StoreExtents(new_extents,
                                    vertex->op.mutable_src_extents());
 }
@@ -792,28 +2350,62 @@ void DeltaDiffGenerator::StoreExtents(
 // Creates all the edges for the graph. Writers of a block point to
 // readers of the same block. This is because for an edge A->B, B
 // must complete before A executes.
-void DeltaDiffGenerator::CreateEdges(Graph* graph,
-                                     const vector<Block>& blocks) {
-  for (vector<Block>::size_type i = 0; i < blocks.size(); i++) {
-    // Blocks with both a reader and writer get an edge
-    if (blocks[i].reader == Vertex::kInvalidIndex ||
-        blocks[i].writer == Vertex::kInvalidIndex)
-      continue;
-    // Don't have a node depend on itself
-    if (blocks[i].reader == blocks[i].writer)
-      continue;
-    // See if there's already an edge we can add onto
-    Vertex::EdgeMap::iterator edge_it =
-        (*graph)[blocks[i].writer].out_edges.find(blocks[i].reader);
-    if (edge_it == (*graph)[blocks[i].writer].out_edges.end()) {
-      // No existing edge. Create one
-      (*graph)[blocks[i].writer].out_edges.insert(
-          make_pair(blocks[i].reader, EdgeProperties()));
-      edge_it = (*graph)[blocks[i].writer].out_edges.find(blocks[i].reader);
-      CHECK(edge_it != (*graph)[blocks[i].writer].out_edges.end());
+namespace {
+
+// Adds the edges of the runs whose writer is the |index|th of every
+// |count| vertices on a ThreadPool worker. Only the vertices of its own
+// writers are touched, so the tasks share nothing, and each edge gets its
+// extents in block order, as if the runs were all walked on one thread.
+class CreateEdgesTask : public ThreadPoolTask {
+ public:
+  CreateEdgesTask(Graph* graph,
+                  const vector<BlockOwners::Run>* runs,
+                  Vertex::Index index,
+                  Vertex::Index count)
+      : graph_(graph), runs_(runs), index_(index), count_(count) {}
+
+  virtual bool Run() {
+    for (vector<BlockOwners::Run>::const_iterator it = runs_->begin();
+         it != runs_->end(); ++it) {
+      // Blocks with both a reader and writer get an edge
+      if (it->reader == Vertex::kInvalidIndex ||
+          it->writer == Vertex::kInvalidIndex)
+        continue;
+      // Don't have a node depend on itself
+      if (it->reader == it->writer || it->writer % count_ != index_)
+        continue;
+      // Adds onto the existing edge, if there's one.
+      graph_utils::AppendExtentToExtents(
+          &(*graph_)[it->writer].out_edges[it->reader].extents,
+          ExtentForRange(it->start_block, it->num_blocks));
     }
-    graph_utils::AppendBlockToExtents(&edge_it->second.extents, i);
+    return true;
+  }
+
+ private:
+  Graph* graph_;
+  const vector<BlockOwners::Run>* runs_;
+  const Vertex::Index index_;
+  const Vertex::Index count_;
+
+  DISALLOW_COPY_AND_ASSIGN(CreateEdgesTask);
+};
+
+}  // namespace {}
+
+void DeltaDiffGenerator::CreateEdges(Graph* graph,
+                                     const BlockOwners& blocks,
+                                     ThreadPool* pool) {
+  const vector<BlockOwners::Run> runs = blocks.GetRuns();
+  const Vertex::Index count = pool->num_threads();
+  vector<shared_ptr<CreateEdgesTask> > tasks;
+  for (Vertex::Index i = 0; i < count; i++) {
+    tasks.push_back(shared_ptr<CreateEdgesTask>(
+        new CreateEdgesTask(graph, &runs, i, count)));
+    pool->Submit(tasks.back().get());
   }
+  for (size_t i = 0; i < tasks.size(); i++)
+    pool->Wait(tasks[i].get());
 }
 
 namespace {
@@ -865,7 +2457,10 @@ void DeltaDiffGenerator::MoveFullOpsToBack(Graph* graph,
     DeltaArchiveManifest_InstallOperation_Type type =
         (*graph)[(*op_indexes)[i]].op.type();
     if (type == DeltaArchiveManifest_InstallOperation_Type_REPLACE ||
-        type == DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ) {
+        type == DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ ||
+        type == DeltaArchiveManifest_InstallOperation_Type_REPLACE_XZ ||
+        type == DeltaArchiveManifest_InstallOperation_Type_REPLACE_XZ_DICT ||
+        type == DeltaArchiveManifest_InstallOperation_Type_ZERO) {
       full_ops.push_back((*op_indexes)[i]);
     } else {
       ret.push_back((*op_indexes)[i]);
@@ -879,6 +2474,119 @@ void DeltaDiffGenerator::MoveFullOpsToBack(Graph* graph,
 
 namespace {
 
+// Returns the first block written by |op|, or 0 if it writes none.
+uint64_t FirstDstBlock(const DeltaArchiveManifest_InstallOperation& op) {
+  for (int i = 0; i < op.dst_extents_size(); i++) {
+    if (op.dst_extents(i).start_block() != kSparseHole)
+      return op.dst_extents(i).start_block();
+  }
+  return 0;
+}
+
+}  // namespace {}
+
+void DeltaDiffGenerator::OrderForLocality(const Graph& graph,
+                                          vector<Vertex::Index>* op_indexes) {
+  // Only the vertices in |op_indexes| are ordered, so edges to the others,
+  // e.g., to cut vertices that were dropped, don't hold anything back.
+  vector<bool> ordered(graph.size(), false);
+  for (vector<Vertex::Index>::const_iterator it = op_indexes->begin();
+       it != op_indexes->end(); ++it)
+    ordered[*it] = true;
+
+  // |waiting[v]| counts the vertices that must be applied before |v|, and
+  // |dependents[u]| lists the vertices waiting for |u|. For an edge A->B, B
+  // must complete before A executes.
+  vector<size_t> waiting(graph.size(), 0);
+  vector<vector<Vertex::Index> > dependents(graph.size());
+  for (vector<Vertex::Index>::const_iterator it = op_indexes->begin();
+       it != op_indexes->end(); ++it) {
+    for (Vertex::EdgeMap::const_iterator edge = graph[*it].out_edges.begin();
+         edge != graph[*it].out_edges.end(); ++edge) {
+      if (edge->first >= graph.size() || !ordered[edge->first])
+        continue;
+      waiting[*it]++;
+      dependents[edge->first].push_back(*it);
+    }
+  }
+
+  // The vertices that can be applied next, by their first written block:
+  // the MOVE operations, then the others.
+  typedef set<pair<uint64_t, Vertex::Index> > ReadySet;
+  ReadySet ready[2];
+  for (vector<Vertex::Index>::const_iterator it = op_indexes->begin();
+       it != op_indexes->end(); ++it) {
+    if (waiting[*it] == 0) {
+      const DeltaArchiveManifest_InstallOperation& op = graph[*it].op;
+      ready[op.type() == DeltaArchiveManifest_InstallOperation_Type_MOVE ?
+            0 : 1].insert(make_pair(FirstDstBlock(op), *it));
+    }
+  }
+
+  vector<Vertex::Index> order;
+  order.reserve(op_indexes->size());
+  uint64_t next_block = 0;
+  while (order.size() < op_indexes->size()) {
+    ReadySet* candidates = ready[0].empty() ? &ready[1] : &ready[0];
+    CHECK(!candidates->empty()) << "The graph has a cycle.";
+    // Sweeps up the partition, and starts over from its lowest ready block
+    // once nothing's left above.
+    ReadySet::iterator next =
+        candidates->lower_bound(make_pair(next_block, Vertex::Index(0)));
+    if (next == candidates->end())
+      next = candidates->begin();
+    const Vertex::Index vertex = next->second;
+    candidates->erase(next);
+    order.push_back(vertex);
+
+    const DeltaArchiveManifest_InstallOperation& op = graph[vertex].op;
+    for (int i = op.dst_extents_size() - 1; i >= 0; i--) {
+      if (op.dst_extents(i).start_block() != kSparseHole) {
+        next_block = op.dst_extents(i).start_block() +
+            op.dst_extents(i).num_blocks();
+        break;
+      }
+    }
+    for (vector<Vertex::Index>::const_iterator it =
+             dependents[vertex].begin();
+         it != dependents[vertex].end(); ++it) {
+      if (--waiting[*it] == 0) {
+        const DeltaArchiveManifest_InstallOperation& dependent_op =
+            graph[*it].op;
+        ready[dependent_op.type() ==
+              DeltaArchiveManifest_InstallOperation_Type_MOVE ? 0 : 1].insert(
+                  make_pair(FirstDstBlock(dependent_op), *it));
+      }
+    }
+  }
+  op_indexes->swap(order);
+}
+
+double DeltaDiffGenerator::WriteLocality(
+    const Graph& graph,
+    const vector<Vertex::Index>& op_indexes) {
+  uint64_t blocks = 0;
+  uint64_t sequential_blocks = 0;
+  uint64_t next_block = 0;
+  for (vector<Vertex::Index>::const_iterator it = op_indexes.begin();
+       it != op_indexes.end(); ++it) {
+    const DeltaArchiveManifest_InstallOperation& op = graph[*it].op;
+    for (int i = 0; i < op.dst_extents_size(); i++) {
+      const Extent& extent = op.dst_extents(i);
+      if (extent.start_block() == kSparseHole)
+        continue;
+      blocks += extent.num_blocks();
+      if (extent.start_block() >= next_block &&
+          extent.start_block() - next_block <= kLocalityWindowBlocks)
+        sequential_blocks += extent.num_blocks();
+      next_block = extent.start_block() + extent.num_blocks();
+    }
+  }
+  return blocks == 0 ? 1.0 : static_cast<double>(sequential_blocks) / blocks;
+}
+
+namespace {
+
 template<typename T>
 bool TempBlocksExistInExtents(const T& extents) {
   for (int i = 0, e = extents.size(); i < e; ++i) {
@@ -901,10 +2609,21 @@ bool TempBlocksExistInExtents(const T& extents) {
   return false;
 }
 
+// What AssignTempBlocks() had to do to find temp blocks for the cuts.
+struct TempBlockStats {
+  TempBlockStats() : freed_blocks(0), converted_cuts(0), converted_bytes(0) {}
+  // The temp blocks that were only free once the nodes reading them had run.
+  uint64_t freed_blocks;
+  // The cuts whose |old_dst| was converted to full for lack of temp blocks,
+  // and how much that grew the data of those nodes.
+  uint64_t converted_cuts;
+  int64_t converted_bytes;
+};
+
 // Convertes the cuts, which must all have the same |old_dst| member,
 // to full. It does this by converting the |old_dst| to REPLACE or
 // REPLACE_BZ, dropping all incoming edges to |old_dst|, and marking
-// all temp nodes invalid.
+// all temp nodes invalid. Adds the conversion to |stats|.
 bool ConvertCutsToFull(
     Graph* graph,
     const string& new_root,
@@ -912,8 +2631,10 @@ bool ConvertCutsToFull(
     off_t* data_file_size,
     vector<Vertex::Index>* op_indexes,
     vector<vector<Vertex::Index>::size_type>* reverse_op_indexes,
-    const vector<CutEdgeVertexes>& cuts) {
+    const vector<CutEdgeVertexes>& cuts,
+    TempBlockStats* stats) {
   CHECK(!cuts.empty());
+  const int64_t old_data_length = (*graph)[cuts[0].old_dst].op.data_length();
   set<Vertex::Index> deleted_nodes;
   for (vector<CutEdgeVertexes>::const_iterator it = cuts.begin(),
            e = cuts.end(); it != e; ++it) {
@@ -926,6 +2647,9 @@ bool ConvertCutsToFull(
     deleted_nodes.insert(it->new_vertex);
   }
   deleted_nodes.insert(cuts[0].old_dst);
+  stats->converted_cuts += cuts.size();
+  stats->converted_bytes +=
+      (*graph)[cuts[0].old_dst].op.data_length() - old_data_length;
 
   vector<Vertex::Index> new_op_indexes;
   new_op_indexes.reserve(op_indexes->size());
@@ -942,11 +2666,26 @@ bool ConvertCutsToFull(
   return true;
 }
 
+// Returns true if |reader|, which reads blocks before another node
+// overwrites them, is done with them before the node at |first_copy| in the
+// order |reverse_op_indexes| maps to runs: if it doesn't run at all, or runs
+// before.
+bool ReadBeforeCopies(
+    const Graph& graph,
+    const vector<vector<Vertex::Index>::size_type>& reverse_op_indexes,
+    Vertex::Index reader,
+    vector<Vertex::Index>::size_type first_copy) {
+  if (!graph[reader].valid)
+    return true;
+  return reader < reverse_op_indexes.size() &&
+      reverse_op_indexes[reader] < first_copy;
+}
+
 // Tries to assign temp blocks for a collection of cuts, all of which share
 // the same old_dst member. If temp blocks can't be found, old_dst will be
 // converted to a REPLACE or REPLACE_BZ operation. Returns true on success,
 // which can happen even if blocks are converted to full. Returns false
-// on exceptional error cases.
+// on exceptional error cases. Adds what it did to |stats|.
 bool AssignBlockForAdjoiningCuts(
     Graph* graph,
     const string& new_root,
@@ -954,9 +2693,18 @@ bool AssignBlockForAdjoiningCuts(
     off_t* data_file_size,
     vector<Vertex::Index>* op_indexes,
     vector<vector<Vertex::Index>::size_type>* reverse_op_indexes,
-    const vector<CutEdgeVertexes>& cuts) {
+    const vector<CutEdgeVertexes>& cuts,
+    TempBlockStats* stats) {
   CHECK(!cuts.empty());
   const Vertex::Index old_dst = cuts[0].old_dst;
+  // The temp blocks are first written by the copies of the cuts. A block
+  // that other nodes read before its supplier overwrites it is free by then
+  // if they all run before the first copy.
+  vector<Vertex::Index>::size_type first_copy = op_indexes->size();
+  for (vector<CutEdgeVertexes>::const_iterator it = cuts.begin(),
+           e = cuts.end(); it != e; ++it) {
+    first_copy = min(first_copy, (*reverse_op_indexes)[it->new_vertex]);
+  }
   // Calculate # of blocks needed
   uint64_t blocks_needed = 0;
   map<const CutEdgeVertexes*, uint64_t> cuts_blocks_needed;
@@ -988,13 +2736,16 @@ bool AssignBlockForAdjoiningCuts(
     ranges.SubtractExtent(ExtentForRange(
         kTempBlockStart, kSparseHole - kTempBlockStart));
     ranges.SubtractRepeatedExtents((*graph)[test_node].op.src_extents());
-    // For now, for simplicity, subtract out all blocks in read-before
-    // dependencies.
+    // Subtract out the blocks in read-before dependencies, unless they're
+    // freed before the first copy.
     for (Vertex::EdgeMap::const_iterator edge_i =
              (*graph)[test_node].out_edges.begin(),
              edge_e = (*graph)[test_node].out_edges.end();
          edge_i != edge_e; ++edge_i) {
-      ranges.SubtractExtents(edge_i->second.extents);
+      if (!ReadBeforeCopies(*graph, *reverse_op_indexes, edge_i->first,
+                            first_copy)) {
+        ranges.SubtractExtents(edge_i->second.extents);
+      }
     }
     if (ranges.blocks() == 0)
       continue;
@@ -1020,19 +2771,47 @@ bool AssignBlockForAdjoiningCuts(
                                             data_file_size,
                                             op_indexes,
                                             reverse_op_indexes,
-                                            cuts));
+                                            cuts,
+                                            stats));
     return true;
   }
   // Use the scratch we found
   TEST_AND_RETURN_FALSE(scratch_ranges.blocks() == scratch_blocks_found);
 
-  // Make all the suppliers depend on this node
+  // Make all the suppliers depend on this node, and all the copies on the
+  // readers of the freed blocks they overwrite.
   for (SupplierVector::iterator it = block_suppliers.begin(),
            e = block_suppliers.end(); it != e; ++it) {
     graph_utils::AddReadBeforeDepExtents(
         &(*graph)[it->first],
         old_dst,
         it->second.GetExtentsForBlockCount(it->second.blocks()));
+    for (Vertex::EdgeMap::const_iterator edge_i =
+             (*graph)[it->first].out_edges.begin(),
+             edge_e = (*graph)[it->first].out_edges.end();
+         edge_i != edge_e; ++edge_i) {
+      if (!(*graph)[edge_i->first].valid ||
+          !ReadBeforeCopies(*graph, *reverse_op_indexes, edge_i->first,
+                            first_copy)) {
+        continue;
+      }
+      ExtentRanges freed;
+      freed.AddExtents(edge_i->second.extents);
+      ExtentRanges unused(freed);
+      unused.SubtractRanges(it->second);
+      freed.SubtractRanges(unused);
+      if (freed.blocks() == 0)
+        continue;
+      const vector<Extent> freed_extents =
+          freed.GetExtentsForBlockCount(freed.blocks());
+      for (vector<CutEdgeVertexes>::const_iterator jt = cuts.begin(),
+               je = cuts.end(); jt != je; ++jt) {
+        graph_utils::AddReadBeforeDepExtents(&(*graph)[jt->new_vertex],
+                                             edge_i->first,
+                                             freed_extents);
+      }
+      stats->freed_blocks += freed.blocks();
+    }
   }
 
   // Replace temp blocks in each cut
@@ -1065,7 +2844,8 @@ bool AssignBlockForAdjoiningCuts(
 bool DeltaDiffGenerator::IsNoopOperation(
     const DeltaArchiveManifest_InstallOperation& op) {
   return (op.type() == DeltaArchiveManifest_InstallOperation_Type_MOVE &&
-          ExpandExtents(op.src_extents()) == ExpandExtents(op.dst_extents()));
+          graph_utils::MergeExtents(op.src_extents()) ==
+          graph_utils::MergeExtents(op.dst_extents()));
 }
 
 bool DeltaDiffGenerator::AssignTempBlocks(
@@ -1080,6 +2860,7 @@ bool DeltaDiffGenerator::AssignTempBlocks(
 
   // group of cuts w/ the same old_dst:
   vector<CutEdgeVertexes> cuts_group;
+  TempBlockStats stats;
 
   for (vector<CutEdgeVertexes>::size_type i = cuts.size() - 1, e = 0;
        true ; --i) {
@@ -1098,7 +2879,8 @@ bool DeltaDiffGenerator::AssignTempBlocks(
                                                         data_file_size,
                                                         op_indexes,
                                                         reverse_op_indexes,
-                                                        cuts_group));
+                                                        cuts_group,
+                                                        &stats));
       cuts_group.clear();
       cuts_group.push_back(cuts[i]);
     }
@@ -1115,7 +2897,13 @@ bool DeltaDiffGenerator::AssignTempBlocks(
                                                     data_file_size,
                                                     op_indexes,
                                                     reverse_op_indexes,
-                                                    cuts_group));
+                                                    cuts_group,
+                                                    &stats));
+  LOG(INFO) << "Found temp blocks for " << cuts.size() - stats.converted_cuts
+            << " of " << cuts.size() << " cuts, using " << stats.freed_blocks
+            << " blocks freed by earlier readers. Converting the other cuts "
+            << "to full grew the payload data by "
+            << stats.converted_bytes << " bytes";
   return true;
 }
 
@@ -1150,51 +2938,142 @@ bool DeltaDiffGenerator::NoTempBlocksRemain(const Graph& graph) {
 bool DeltaDiffGenerator::ReorderDataBlobs(
     DeltaArchiveManifest* manifest,
     const std::string& data_blobs_path,
-    const std::string& new_data_blobs_path) {
-  int in_fd = open(data_blobs_path.c_str(), O_RDONLY, 0);
-  TEST_AND_RETURN_FALSE_ERRNO(in_fd >= 0);
-  ScopedFdCloser in_fd_closer(&in_fd);
+    const std::string& new_data_blobs_path,
+    ThreadPool* pool) {
+  DataBlobRuns runs;
+  TEST_AND_RETURN_FALSE(OrderDataBlobs(manifest, data_blobs_path, pool,
+                                       &runs));
+  int out_fd = open(new_data_blobs_path.c_str(),
+                    O_WRONLY | O_TRUNC | O_CREAT,
+                    0644);
+  TEST_AND_RETURN_FALSE_ERRNO(out_fd >= 0);
+  ScopedFdCloser out_fd_closer(&out_fd);
+  TEST_AND_RETURN_FALSE(CopyDataBlobs(data_blobs_path, runs, out_fd));
+  out_fd_closer.set_should_close(false);
+  TEST_AND_RETURN_FALSE_ERRNO(close(out_fd) == 0);
+  return true;
+}
 
-  DirectFileWriter writer;
-  TEST_AND_RETURN_FALSE(
-      writer.Open(new_data_blobs_path.c_str(),
-                  O_WRONLY | O_TRUNC | O_CREAT,
-                  0644) == 0);
-  ScopedFileWriterCloser writer_closer(&writer);
-  uint64_t out_file_size = 0;
+bool DeltaDiffGenerator::OrderDataBlobs(DeltaArchiveManifest* manifest,
+                                        const std::string& data_blobs_path,
+                                        ThreadPool* pool,
+                                        DataBlobRuns* runs) {
+  // The blobs are hashed from the mapping.
+  MappedFile in_file;
+  TEST_AND_RETURN_FALSE(in_file.Init(data_blobs_path, 0, -1));
 
-  for (int i = 0; i < (manifest->install_operations_size() +
-                       manifest->kernel_install_operations_size()); i++) {
-    DeltaArchiveManifest_InstallOperation* op = NULL;
-    if (i < manifest->install_operations_size()) {
-      op = manifest->mutable_install_operations(i);
-    } else {
-      op = manifest->mutable_kernel_install_operations(
-          i - manifest->install_operations_size());
+  // The operations with a blob, in the order their blobs are laid out.
+  vector<DeltaArchiveManifest_InstallOperation*> ops;
+  {
+    vector<DeltaArchiveManifest_InstallOperation*> rootfs_ops;
+    vector<DeltaArchiveManifest_InstallOperation*> kernel_ops;
+    uint64_t rootfs_length = 0;
+    uint64_t kernel_length = 0;
+    for (int i = 0; i < manifest->install_operations_size(); i++) {
+      DeltaArchiveManifest_InstallOperation* op =
+          manifest->mutable_install_operations(i);
+      if (op->has_data_offset()) {
+        rootfs_ops.push_back(op);
+        rootfs_length += op->data_length();
+      }
     }
-    if (!op->has_data_offset())
-      continue;
-    CHECK(op->has_data_length());
-    vector<char> buf(op->data_length());
-    ssize_t rc = pread(in_fd, &buf[0], buf.size(), op->data_offset());
-    TEST_AND_RETURN_FALSE(rc == static_cast<ssize_t>(buf.size()));
+    for (int i = 0; i < manifest->kernel_install_operations_size(); i++) {
+      DeltaArchiveManifest_InstallOperation* op =
+          manifest->mutable_kernel_install_operations(i);
+      if (op->has_data_offset()) {
+        kernel_ops.push_back(op);
+        kernel_length += op->data_length();
+      }
+    }
+    if (!interleave_kernel_blobs)
+      kernel_length = 0;
+    // Takes the next blob from the partition whose share of its blobs laid
+    // out so far is the smallest. With no kernel length, that's all the
+    // rootfs blobs first.
+    size_t rootfs = 0;
+    size_t kernel = 0;
+    uint64_t rootfs_done = 0;
+    uint64_t kernel_done = 0;
+    while (rootfs < rootfs_ops.size() || kernel < kernel_ops.size()) {
+      if (kernel == kernel_ops.size() ||
+          (rootfs < rootfs_ops.size() &&
+           rootfs_done * kernel_length <= kernel_done * rootfs_length)) {
+        rootfs_done += rootfs_ops[rootfs]->data_length();
+        ops.push_back(rootfs_ops[rootfs++]);
+      } else {
+        kernel_done += kernel_ops[kernel]->data_length();
+        ops.push_back(kernel_ops[kernel++]);
+      }
+    }
+  }
 
-    // Add the hash of the data blobs for this operation
-    TEST_AND_RETURN_FALSE(AddOperationHash(op, buf));
+  // The blobs are independent, so they're all hashed at once.
+  vector<const char*> blobs;
+  vector<size_t> blob_lengths;
+  for (size_t i = 0; i < ops.size(); i++) {
+    DeltaArchiveManifest_InstallOperation* op = ops[i];
+    CHECK(op->has_data_length());
+    TEST_AND_RETURN_FALSE(op->data_offset() <= in_file.size() &&
+                          op->data_length() <=
+                          in_file.size() - op->data_offset());
+    blobs.push_back(in_file.data() + op->data_offset());
+    blob_lengths.push_back(op->data_length());
+  }
+  vector<vector<char> > hashes;
+  TEST_AND_RETURN_FALSE(OmahaHashCalculator::HashesOfBytes(
+      blake3_operation_hashes ? &blake3::RawHashOfBytes :
+      &OmahaHashCalculator::RawHashOfBytes,
+      blobs, blob_lengths, pool, &hashes));
+
+  // Blobs that follow each other in the old file are copied in one go.
+  runs->clear();
+  uint64_t out_file_size = 0;
+  for (size_t i = 0; i < ops.size(); i++) {
+    DeltaArchiveManifest_InstallOperation* op = ops[i];
+    if (blake3_operation_hashes)
+      op->set_data_blake3_hash(hashes[i].data(), hashes[i].size());
+    else
+      op->set_data_sha256_hash(hashes[i].data(), hashes[i].size());
+
+    if (runs->empty() ||
+        op->data_offset() != runs->back().first + runs->back().second) {
+      runs->push_back(std::make_pair(op->data_offset(), 0));
+    }
+    runs->back().second += op->data_length();
 
     op->set_data_offset(out_file_size);
-    TEST_AND_RETURN_FALSE(writer.Write(&buf[0], buf.size()));
-    out_file_size += buf.size();
+    out_file_size += op->data_length();
+  }
+  return true;
+}
+
+bool DeltaDiffGenerator::CopyDataBlobs(const std::string& data_blobs_path,
+                                       const DataBlobRuns& runs,
+                                       int out_fd) {
+  // The blobs are copied by the kernel.
+  int in_fd = open(data_blobs_path.c_str(), O_RDONLY, 0);
+  TEST_AND_RETURN_FALSE_ERRNO(in_fd >= 0);
+  ScopedFdCloser in_fd_closer(&in_fd);
+  for (size_t i = 0; i < runs.size(); i++) {
+    TEST_AND_RETURN_FALSE(utils::SendFileAll(out_fd, in_fd, runs[i].first,
+                                             runs[i].second));
   }
   return true;
 }
 
 bool DeltaDiffGenerator::AddOperationHash(
     DeltaArchiveManifest_InstallOperation* op,
-    const vector<char>& buf) {
+    const char* buf,
+    size_t size) {
+  if (blake3_operation_hashes) {
+    vector<char> hash;
+    TEST_AND_RETURN_FALSE(blake3::RawHashOfBytes(buf, size, &hash));
+    op->set_data_blake3_hash(hash.data(), hash.size());
+    return true;
+  }
   OmahaHashCalculator hasher;
 
-  TEST_AND_RETURN_FALSE(hasher.Update(&buf[0], buf.size()));
+  TEST_AND_RETURN_FALSE(hasher.Update(buf, size));
   TEST_AND_RETURN_FALSE(hasher.Finalize());
 
   const vector<char>& hash = hasher.raw_hash();
@@ -1213,6 +3092,12 @@ bool DeltaDiffGenerator::ConvertCutToFullOp(Graph* graph,
   if ((*graph)[cut.old_dst].op.type() !=
       DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ &&
       (*graph)[cut.old_dst].op.type() !=
+      DeltaArchiveManifest_InstallOperation_Type_REPLACE_XZ &&
+      (*graph)[cut.old_dst].op.type() !=
+      DeltaArchiveManifest_InstallOperation_Type_REPLACE_XZ_DICT &&
+      (*graph)[cut.old_dst].op.type() !=
+      DeltaArchiveManifest_InstallOperation_Type_ZERO &&
+      (*graph)[cut.old_dst].op.type() !=
       DeltaArchiveManifest_InstallOperation_Type_REPLACE) {
     Vertex::EdgeMap out_edges = (*graph)[cut.old_dst].out_edges;
     graph_utils::DropWriteBeforeDeps(&out_edges);
@@ -1223,6 +3108,8 @@ bool DeltaDiffGenerator::ConvertCutToFullOp(Graph* graph,
                                         kNonexistentPath,
                                         new_root,
                                         (*graph)[cut.old_dst].file_name,
+                                        (*graph)[cut.old_dst].chunk_offset,
+                                        (*graph)[cut.old_dst].chunk_size,
                                         data_fd,
                                         data_file_size));
 
@@ -1249,9 +3136,14 @@ bool DeltaDiffGenerator::ConvertGraphToDag(Graph* graph,
                                            vector<Vertex::Index>* final_order,
                                            Vertex::Index scratch_vertex) {
   CycleBreaker cycle_breaker;
+  if (greedy_cycle_breaking)
+    cycle_breaker.set_algorithm(CycleBreaker::kAlgorithmGreedy);
   LOG(INFO) << "Finding cycles...";
   set<Edge> cut_edges;
-  cycle_breaker.BreakCycles(*graph, &cut_edges);
+  {
+    ScopedGeneratorPhase phase(profile, "BreakCycles");
+    cycle_breaker.BreakCycles(*graph, &cut_edges);
+  }
   LOG(INFO) << "done finding cycles";
   CheckGraph(*graph);
 
@@ -1259,13 +3151,19 @@ bool DeltaDiffGenerator::ConvertGraphToDag(Graph* graph,
 
   LOG(INFO) << "Cutting cycles...";
   vector<CutEdgeVertexes> cuts;
-  TEST_AND_RETURN_FALSE(CutEdges(graph, cut_edges, &cuts));
+  {
+    ScopedGeneratorPhase phase(profile, "CutEdges");
+    TEST_AND_RETURN_FALSE(CutEdges(graph, cut_edges, &cuts));
+  }
   LOG(INFO) << "done cutting cycles";
   LOG(INFO) << "There are " << cuts.size() << " cuts.";
   CheckGraph(*graph);
 
   LOG(INFO) << "Creating initial topological order...";
-  TopologicalSort(*graph, final_order);
+  {
+    ScopedGeneratorPhase phase(profile, "TopologicalSort");
+    TopologicalSort(*graph, final_order);
+  }
   LOG(INFO) << "done with initial topo order";
   CheckGraph(*graph);
 
@@ -1278,7 +3176,8 @@ bool DeltaDiffGenerator::ConvertGraphToDag(Graph* graph,
 
   SortCutsByTopoOrder(*final_order, &cuts);
 
-  if (!cuts.empty())
+  if (!cuts.empty()) {
+    ScopedGeneratorPhase phase(profile, "AssignTempBlocks");
     TEST_AND_RETURN_FALSE(AssignTempBlocks(graph,
                                            new_root,
                                            fd,
@@ -1286,6 +3185,7 @@ bool DeltaDiffGenerator::ConvertGraphToDag(Graph* graph,
                                            final_order,
                                            &inverse_final_order,
                                            cuts));
+  }
   LOG(INFO) << "Making sure all temp blocks have been allocated";
 
   // Remove the scratch node, if any
@@ -1302,6 +3202,136 @@ bool DeltaDiffGenerator::ConvertGraphToDag(Graph* graph,
   return true;
 }
 
+bool DeltaDiffGenerator::DeduplicateFullOperations(
+    Graph* graph,
+    BlockOwners* blocks,
+    const string& old_image,
+    uint64_t old_block_count,
+    const string& new_image) {
+  BlockIndex index;
+  TEST_AND_RETURN_FALSE(index.Init(old_image,
+                                   min(old_block_count,
+                                       blocks->block_count()),
+                                   kBlockSize));
+  // Each block may only have one reader.
+  const vector<BlockOwners::Run> runs = blocks->GetRuns();
+  for (vector<BlockOwners::Run>::const_iterator it = runs.begin();
+       it != runs.end(); ++it) {
+    if (it->reader == Vertex::kInvalidIndex)
+      continue;
+    for (uint64_t block = it->start_block,
+             end = min(it->start_block + it->num_blocks, index.block_count());
+         block < end; block++) {
+      index.Use(block);
+    }
+  }
+
+  int new_fd = open(new_image.c_str(), O_RDONLY, 0);
+  TEST_AND_RETURN_FALSE_ERRNO(new_fd >= 0);
+  ScopedFdCloser new_fd_closer(&new_fd);
+
+  uint64_t op_count = 0;
+  uint64_t block_count = 0;
+  vector<char> buf(kBlockSize);
+  for (Vertex::Index i = 0; i < graph->size(); i++) {
+    DeltaArchiveManifest_InstallOperation* op = &(*graph)[i].op;
+    if (!(*graph)[i].valid ||
+        (op->type() != DeltaArchiveManifest_InstallOperation_Type_REPLACE &&
+         op->type() != DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ &&
+         op->type() != DeltaArchiveManifest_InstallOperation_Type_REPLACE_XZ &&
+         op->type() !=
+         DeltaArchiveManifest_InstallOperation_Type_REPLACE_XZ_DICT))
+      continue;
+
+    // Looks up the old blocks one new block at a time, preferring the one
+    // after the last found so that they make up few extents.
+    vector<Extent> src_extents;
+    uint64_t src_block_count = 0;
+    bool found = true;
+    for (int j = 0; found && j < op->dst_extents_size(); j++) {
+      const Extent& extent = op->dst_extents(j);
+      found = extent.start_block() != kSparseHole;
+      for (uint64_t block = extent.start_block(),
+               end = block + extent.num_blocks();
+           found && block < end; block++) {
+        ssize_t bytes_read = 0;
+        TEST_AND_RETURN_FALSE(utils::PReadAll(new_fd,
+                                              &buf[0],
+                                              kBlockSize,
+                                              block * kBlockSize,
+                                              &bytes_read));
+        TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(kBlockSize));
+        const uint64_t src_block = index.Find(
+            &buf[0],
+            src_extents.empty() ? BlockIndex::kNoBlock :
+            src_extents.back().start_block() +
+            src_extents.back().num_blocks());
+        found = src_block != BlockIndex::kNoBlock;
+        if (found) {
+          graph_utils::AppendBlocksToExtents(&src_extents, src_block, 1);
+          src_block_count++;
+        }
+      }
+    }
+    if (!found) {
+      for (vector<Extent>::const_iterator it = src_extents.begin();
+           it != src_extents.end(); ++it) {
+        for (uint64_t block = it->start_block(),
+                 end = block + it->num_blocks(); block < end; block++) {
+          index.Release(block);
+        }
+      }
+      continue;
+    }
+
+    op->set_type(DeltaArchiveManifest_InstallOperation_Type_MOVE);
+    op->clear_data_offset();
+    op->clear_data_length();
+    op->clear_src_extents();
+    StoreExtents(src_extents, op->mutable_src_extents());
+    op->set_src_length(op->dst_length());
+    for (vector<Extent>::const_iterator it = src_extents.begin();
+         it != src_extents.end(); ++it) {
+      TEST_AND_RETURN_FALSE(blocks->SetReader(*it, i, NULL));
+    }
+    op_count++;
+    block_count += src_block_count;
+  }
+  LOG(INFO) << "Turned " << op_count << " full operations writing "
+            << block_count << " blocks into moves.";
+  return true;
+}
+
+bool DeltaDiffGenerator::GenerateDeltaUpdateFiles(
+    const vector<DeltaSource>& sources,
+    const string& new_root,
+    const string& new_image,
+    const string& new_kernel_part,
+    const string& private_key_path) {
+  CHECK(!new_image_cache);
+  NewImageCache cache;
+  TEST_AND_RETURN_FALSE(cache.Init());
+  new_image_cache = &cache;
+  bool success = true;
+  for (vector<DeltaSource>::const_iterator it = sources.begin();
+       it != sources.end() && success; ++it) {
+    LOG(INFO) << "Generating " << it->output_path << " from "
+              << it->old_image;
+    uint64_t metadata_size = 0;
+    success = GenerateDeltaUpdateFile(it->old_root,
+                                      it->old_image,
+                                      new_root,
+                                      new_image,
+                                      it->old_kernel_part,
+                                      new_kernel_part,
+                                      it->output_path,
+                                      private_key_path,
+                                      &metadata_size);
+  }
+  new_image_cache = NULL;
+  return success;
+}
+
 void DeltaDiffGenerator::CreateScratchNode(uint64_t start_block,
                                            uint64_t num_blocks,
                                            Vertex* vertex) {
@@ -1324,6 +3354,7 @@ bool DeltaDiffGenerator::GenerateDeltaUpdateFile(
     const string& output_path,
     const string& private_key_path,
     uint64_t* metadata_size) {
+  ScopedGeneratorPhase generate_phase(profile, "GenerateDeltaUpdateFile");
   int old_image_block_count = 0, old_image_block_size = 0;
   int new_image_block_count = 0, new_image_block_size = 0;
   TEST_AND_RETURN_FALSE(utils::GetFilesystemSize(new_image,
@@ -1343,16 +3374,53 @@ bool DeltaDiffGenerator::GenerateDeltaUpdateFile(
     TEST_AND_RETURN_FALSE(utils::FileSize(new_kernel_part) >= 0);
   }
 
-  vector<Block> blocks(max(old_image_block_count, new_image_block_count));
+  BlockOwners blocks(max(old_image_block_count, new_image_block_count));
   LOG(INFO) << "Invalid block index: " << Vertex::kInvalidIndex;
-  LOG(INFO) << "Block count: " << blocks.size();
-  for (vector<Block>::size_type i = 0; i < blocks.size(); i++) {
-    CHECK(blocks[i].reader == Vertex::kInvalidIndex);
-    CHECK(blocks[i].writer == Vertex::kInvalidIndex);
-  }
+  LOG(INFO) << "Block count: " << blocks.block_count();
   Graph graph;
   CheckGraph(graph);
 
+  // A shard of a delta is only encoded into the operation cache.
+  TEST_AND_RETURN_FALSE(diff_shard_count == 0 ||
+                        (operation_cache && !old_image.empty()));
+
+  ThreadPool pool(num_threads);
+  TEST_AND_RETURN_FALSE(pool.Init());
+  LOG(INFO) << "Using " << pool.num_threads() << " threads";
+
+  // Shards stop after diffing and describe no partitions.
+  PartitionInfoHasher partition_info_hasher;
+  if (diff_shard_count == 0) {
+    TEST_AND_RETURN_FALSE(partition_info_hasher.Start(old_kernel_part,
+                                                      new_kernel_part,
+                                                      old_image,
+                                                      new_image));
+  }
+
+  // With read_images, the files of a delta are read from the images, whose
+  // paths stand in for the mount points. Full updates don't read files.
+  const bool use_file_trees = read_images && !old_image.empty();
+  ImageFileTree old_tree, new_tree;
+  if (use_file_trees) {
+    ScopedGeneratorPhase phase(profile, "ReadImageFileTrees");
+    TEST_AND_RETURN_FALSE(old_tree.Init(old_image));
+    TEST_AND_RETURN_FALSE(new_tree.Init(new_image));
+    TEST_AND_RETURN_FALSE(old_tree.block_size() == kBlockSize &&
+                          new_tree.block_size() == kBlockSize);
+  }
+  ScopedImageFileTrees trees(use_file_trees ? &old_tree : NULL,
+                             use_file_trees ? &new_tree : NULL);
+  const string& old_files = use_file_trees ? old_image : old_root;
+  const string& new_files = use_file_trees ? new_image : new_root;
+
+  // The small files of a delta may be compressed with a dictionary trained
+  // on those of the new image.
+  ScopedXzDictionary dictionary;
+  if (!old_image.empty()) {
+    ScopedGeneratorPhase phase(profile, "TrainXzDictionary");
+    TEST_AND_RETURN_FALSE(dictionary.Train(new_files, &pool));
+  }
+
   const string kTempFileTemplate("/tmp/CrAU_temp_data.XXXXXX");
   string temp_file_path;
   scoped_ptr<ScopedPathUnlinker> temp_file_unlinker;
@@ -1364,76 +3432,191 @@ bool DeltaDiffGenerator::GenerateDeltaUpdateFile(
 
   vector<Vertex::Index> final_order;
   Vertex::Index scratch_vertex = Vertex::kInvalidIndex;
+
+  // Deltas resume from the last phase checkpointed by an earlier run with
+  // the same inputs, whose data blobs are kept with the checkpoint.
+  const bool checkpointed =
+      generator_checkpoint && !old_image.empty() && diff_shard_count == 0;
+  const string checkpoint_key = checkpointed ?
+      CheckpointKey(old_image, new_image, old_kernel_part, new_kernel_part) :
+      "";
+  GeneratorCheckpoint::Phase resumed_phase = GeneratorCheckpoint::kPhaseNone;
+  if (checkpointed) {
+    ScopedGeneratorPhase phase(profile, "LoadCheckpoint");
+    resumed_phase = generator_checkpoint->Load(checkpoint_key,
+                                               &graph,
+                                               &blocks,
+                                               &kernel_ops,
+                                               &scratch_vertex,
+                                               &final_order,
+                                               &data_file_size);
+  }
   {
     int fd;
-    TEST_AND_RETURN_FALSE(
-        utils::MakeTempFile(kTempFileTemplate, &temp_file_path, &fd));
-    temp_file_unlinker.reset(new ScopedPathUnlinker(temp_file_path));
+    if (checkpointed) {
+      temp_file_path = generator_checkpoint->blobs_path(checkpoint_key);
+      fd = open(temp_file_path.c_str(),
+                O_WRONLY | O_CREAT |
+                (resumed_phase == GeneratorCheckpoint::kPhaseNone ?
+                 O_TRUNC : O_APPEND),
+                0644);
+      TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+    } else {
+      TEST_AND_RETURN_FALSE(
+          utils::MakeTempFile(kTempFileTemplate, &temp_file_path, &fd));
+      temp_file_unlinker.reset(new ScopedPathUnlinker(temp_file_path));
+    }
     TEST_AND_RETURN_FALSE(fd >= 0);
     ScopedFdCloser fd_closer(&fd);
     if (!old_image.empty()) {
       // Delta update
+      if (resumed_phase < GeneratorCheckpoint::kPhaseOperations) {
+        {
+          ScopedGeneratorPhase phase(profile, "DeltaReadFiles");
+          TEST_AND_RETURN_FALSE(DeltaReadFiles(&graph,
+                                               &blocks,
+                                               old_files,
+                                               new_files,
+                                               fd,
+                                               &data_file_size,
+                                               &pool));
+        }
+        if (diff_shard_count > 0) {
+          LOG(INFO) << "Encoded the files of shard " << diff_shard_index
+                    << " of " << diff_shard_count
+                    << " into the operation cache";
+          *metadata_size = 0;
+          return true;
+        }
+        LOG(INFO) << "done reading normal files";
+        CheckGraph(graph);
+
+        LOG(INFO) << "Starting metadata processing";
+        {
+          ScopedGeneratorPhase phase(profile, "DeltaReadMetadata");
+          // The metadata diffed in place isn't diffed with bsdiff at all,
+          // so it's only a STREAM_DIFF if BSDIFF ones may be replaced.
+          const bool stream_diff = stream_diff_margin >= 0;
+          TEST_AND_RETURN_FALSE(Metadata::DeltaReadMetadata(&graph,
+                                                            &blocks,
+                                                            old_image,
+                                                            new_image,
+                                                            fd,
+                                                            &data_file_size,
+                                                            stream_diff,
+                                                            &pool));
+        }
+        LOG(INFO) << "Done metadata processing";
+        CheckGraph(graph);
+
+        if (block_deduplication) {
+          LOG(INFO) << "Deduplicating full operations";
+          ScopedGeneratorPhase phase(profile, "DeduplicateFullOperations");
+          TEST_AND_RETURN_FALSE(
+              DeduplicateFullOperations(&graph,
+                                        &blocks,
+                                        old_image,
+                                        old_image_block_count,
+                                        new_image));
+          CheckGraph(graph);
+        }
 
-      TEST_AND_RETURN_FALSE(DeltaReadFiles(&graph,
-                                           &blocks,
-                                           old_root,
-                                           new_root,
-                                           fd,
-                                           &data_file_size));
-      LOG(INFO) << "done reading normal files";
-      CheckGraph(graph);
-
-      LOG(INFO) << "Starting metadata processing";
-      TEST_AND_RETURN_FALSE(Metadata::DeltaReadMetadata(&graph,
-                                                        &blocks,
-                                                        old_image,
-                                                        new_image,
-                                                        fd,
-                                                        &data_file_size));
-      LOG(INFO) << "Done metadata processing";
-      CheckGraph(graph);
+        {
+          ScopedGeneratorPhase phase(profile, "ReadUnwrittenBlocks");
+          TEST_AND_RETURN_FALSE(ReadUnwrittenBlocks(blocks,
+                                                    fd,
+                                                    &data_file_size,
+                                                    new_image,
+                                                    &pool,
+                                                    &graph));
+        }
 
-      graph.resize(graph.size() + 1);
-      TEST_AND_RETURN_FALSE(ReadUnwrittenBlocks(blocks,
-                                                fd,
-                                                &data_file_size,
-                                                new_image,
-                                                &graph.back()));
-
-      // Final scratch block (if there's space)
-      if (blocks.size() < (kRootFSPartitionSize / kBlockSize)) {
-        scratch_vertex = graph.size();
-        graph.resize(graph.size() + 1);
-        CreateScratchNode(blocks.size(),
-                          (kRootFSPartitionSize / kBlockSize) - blocks.size(),
-                          &graph.back());
-      }
+        // Final scratch block (if there's space)
+        if (!apply_from_source &&
+            blocks.block_count() < (kRootFSPartitionSize / kBlockSize)) {
+          scratch_vertex = graph.size();
+          graph.resize(graph.size() + 1);
+          CreateScratchNode(blocks.block_count(),
+                            (kRootFSPartitionSize / kBlockSize) -
+                            blocks.block_count(),
+                            &graph.back());
+        }
 
-      if (!new_kernel_part.empty()) {
-        // Read kernel partition
-        TEST_AND_RETURN_FALSE(DeltaCompressKernelPartition(old_kernel_part,
-                                                         new_kernel_part,
-                                                         &kernel_ops,
-                                                         fd,
-                                                         &data_file_size));
-        LOG(INFO) << "done reading kernel";
+        if (!new_kernel_part.empty()) {
+          // Read kernel partition
+          ScopedGeneratorPhase phase(profile, "DeltaCompressKernelPartition");
+          TEST_AND_RETURN_FALSE(
+              DeltaCompressKernelPartition(old_kernel_part,
+                                           new_kernel_part,
+                                           &kernel_ops,
+                                           fd,
+                                           &data_file_size,
+                                           &pool));
+          LOG(INFO) << "done reading kernel";
+        }
+        CheckpointGeneration(checkpoint_key,
+                             GeneratorCheckpoint::kPhaseOperations,
+                             graph, blocks, kernel_ops, scratch_vertex,
+                             final_order, data_file_size);
       }
 
       CheckGraph(graph);
 
-      LOG(INFO) << "Creating edges...";
-      CreateEdges(&graph, blocks);
-      LOG(INFO) << "Done creating edges";
-      CheckGraph(graph);
+      if (apply_from_source) {
+        // No operation reads what another one writes, so they needn't be
+        // ordered.
+        for (Vertex::Index i = 0; i < graph.size(); i++)
+          final_order.push_back(i);
+      } else {
+        if (resumed_phase < GeneratorCheckpoint::kPhaseEdges) {
+          LOG(INFO) << "Creating edges...";
+          {
+            ScopedGeneratorPhase phase(profile, "CreateEdges");
+            CreateEdges(&graph, blocks, &pool);
+          }
+          LOG(INFO) << "Done creating edges";
+          CheckGraph(graph);
+          CheckpointGeneration(checkpoint_key,
+                               GeneratorCheckpoint::kPhaseEdges,
+                               graph, blocks, kernel_ops, scratch_vertex,
+                               final_order, data_file_size);
+        }
+
+        if (resumed_phase < GeneratorCheckpoint::kPhaseDag) {
+          ScopedGeneratorPhase phase(profile, "ConvertGraphToDag");
+          TEST_AND_RETURN_FALSE(ConvertGraphToDag(&graph,
+                                                  new_files,
+                                                  fd,
+                                                  &data_file_size,
+                                                  &final_order,
+                                                  scratch_vertex));
+          CheckpointGeneration(checkpoint_key,
+                               GeneratorCheckpoint::kPhaseDag,
+                               graph, blocks, kernel_ops, scratch_vertex,
+                               final_order, data_file_size);
+        }
+      }
 
-      TEST_AND_RETURN_FALSE(ConvertGraphToDag(&graph,
-                                              new_root,
-                                              fd,
-                                              &data_file_size,
-                                              &final_order,
-                                              scratch_vertex));
+      LOG(INFO) << "Write locality: "
+                << StringPrintf("%.1f%%",
+                                100 * WriteLocality(graph, final_order));
+      if (locality_ordering) {
+        ScopedGeneratorPhase phase(profile, "OrderForLocality");
+        OrderForLocality(graph, &final_order);
+        LOG(INFO) << "Write locality after ordering: "
+                  << StringPrintf("%.1f%%",
+                                  100 * WriteLocality(graph, final_order));
+      }
+      if (operation_fusion_size > 0) {
+        ScopedGeneratorPhase phase(profile, "FuseSmallOperations");
+        TEST_AND_RETURN_FALSE(FuseSmallOperations(&graph,
+                                                  &final_order,
+                                                  fd,
+                                                  &data_file_size));
+      }
     } else {
       // Full update
+      ScopedGeneratorPhase phase(profile, "FullUpdateGenerator");
       off_t new_image_size =
           static_cast<off_t>(new_image_block_count) * new_image_block_size;
       TEST_AND_RETURN_FALSE(FullUpdateGenerator::Run(&graph,
@@ -1443,9 +3626,12 @@ bool DeltaDiffGenerator::GenerateDeltaUpdateFile(
                                                      fd,
                                                      &data_file_size,
                                                      kFullUpdateChunkSize,
-                                                     kBlockSize,
+                                                     full_min_chunk_size,
+                                                     full_max_chunk_size,
+                                                     full_block_size,
                                                      &kernel_ops,
-                                                     &final_order));
+                                                     &final_order,
+                                                     &pool));
     }
   }
 
@@ -1453,36 +3639,54 @@ bool DeltaDiffGenerator::GenerateDeltaUpdateFile(
   DeltaArchiveManifest manifest;
   OperationNameMap op_name_map;
   CheckGraph(graph);
-  InstallOperationsToManifest(graph,
+  const bool is_delta = !old_image.empty();
+  InstallOperationsToManifest(&graph,
                               final_order,
-                              kernel_ops,
+                              &kernel_ops,
+                              is_delta && apply_from_source,
                               &manifest,
                               &op_name_map);
-  CheckGraph(graph);
-  manifest.set_block_size(kBlockSize);
-
-  // Reorder the data blobs with the newly ordered manifest
-  string ordered_blobs_path;
-  TEST_AND_RETURN_FALSE(utils::MakeTempFile(
-      "/tmp/CrAU_temp_data.ordered.XXXXXX",
-      &ordered_blobs_path,
-      NULL));
-  ScopedPathUnlinker ordered_blobs_unlinker(ordered_blobs_path);
-  TEST_AND_RETURN_FALSE(ReorderDataBlobs(&manifest,
+  manifest.set_block_size(is_delta ? kBlockSize : full_block_size);
+  for (int i = 0; i < manifest.install_operations_size() +
+           manifest.kernel_install_operations_size(); i++) {
+    const DeltaArchiveManifest_InstallOperation& op =
+        i < manifest.install_operations_size() ?
+        manifest.install_operations(i) :
+        manifest.kernel_install_operations(
+            i - manifest.install_operations_size());
+    if (op.type() ==
+        DeltaArchiveManifest_InstallOperation_Type_REPLACE_XZ_DICT) {
+      manifest.set_xz_dictionary(xz_dictionary);
+      break;
+    }
+  }
+  if (is_delta && apply_from_source)
+    manifest.set_apply_from_source(true);
+
+  // Lay out the data blobs in the order of the manifest. They're copied
+  // from the temporary file straight into the payload once the manifest,
+  // which lists their offsets and hashes, is written.
+  DataBlobRuns blob_runs;
+  {
+    ScopedGeneratorPhase phase(profile, "OrderDataBlobs");
+    TEST_AND_RETURN_FALSE(OrderDataBlobs(&manifest,
                                          temp_file_path,
-                                         ordered_blobs_path));
-  temp_file_unlinker.reset();
+                                         &pool,
+                                         &blob_runs));
+  }
 
-  // Check that install op blobs are in order.
+  // Check that install op blobs are in the order clients apply them in.
   uint64_t next_blob_offset = 0;
   {
-    for (int i = 0; i < (manifest.install_operations_size() +
-                         manifest.kernel_install_operations_size()); i++) {
+    vector<size_t> order;
+    DeltaPerformer::GetOperationOrder(manifest, &order);
+    for (size_t i = 0; i < order.size(); i++) {
+      const size_t index = order[i];
       DeltaArchiveManifest_InstallOperation* op =
-          i < manifest.install_operations_size() ?
-          manifest.mutable_install_operations(i) :
+          index < static_cast<size_t>(manifest.install_operations_size()) ?
+          manifest.mutable_install_operations(index) :
           manifest.mutable_kernel_install_operations(
-              i - manifest.install_operations_size());
+              index - manifest.install_operations_size());
       if (op->has_data_offset()) {
         if (op->data_offset() != next_blob_offset) {
           LOG(FATAL) << "bad blob offset! " << op->data_offset() << " != "
@@ -1493,6 +3697,11 @@ bool DeltaDiffGenerator::GenerateDeltaUpdateFile(
     }
   }
 
+  if (payload_segments)
+    AddPayloadSegments(&manifest);
+  if (is_delta && source_reuse_hints)
+    AddSourceReuseHints(&manifest);
+
   // Signatures appear at the end of the blobs. Note the offset in the
   // manifest
   if (!private_key_path.empty()) {
@@ -1503,18 +3712,22 @@ bool DeltaDiffGenerator::GenerateDeltaUpdateFile(
     AddSignatureOp(next_blob_offset, signature_blob_length, &manifest);
   }
 
-  TEST_AND_RETURN_FALSE(InitializePartitionInfos(old_kernel_part,
-                                                 new_kernel_part,
-                                                 old_image,
-                                                 new_image,
-                                                 &manifest));
-
-  // Serialize protobuf
-  string serialized_manifest;
-
-  CheckGraph(graph);
-  TEST_AND_RETURN_FALSE(manifest.AppendToString(&serialized_manifest));
-  CheckGraph(graph);
+  {
+    ScopedGeneratorPhase phase(profile, "InitializePartitionInfos");
+    TEST_AND_RETURN_FALSE(partition_info_hasher.Finish(&manifest));
+  }
+  if (rootfs_hash_tree) {
+    ScopedGeneratorPhase phase(profile, "InitializeHashTreeInfo");
+    TEST_AND_RETURN_FALSE(InitializeHashTreeInfo(
+        new_image, manifest.new_rootfs_info().size(),
+        manifest.mutable_new_rootfs_hash_tree()));
+  }
+  if (destination_hashes) {
+    ScopedGeneratorPhase phase(profile, "AddDestinationHashes");
+    TEST_AND_RETURN_FALSE(AddDestinationHashes(new_kernel_part,
+                                               new_image,
+                                               &manifest));
+  }
 
   LOG(INFO) << "Writing final delta file header...";
   DirectFileWriter writer;
@@ -1522,42 +3735,25 @@ bool DeltaDiffGenerator::GenerateDeltaUpdateFile(
                                           O_WRONLY | O_CREAT | O_TRUNC,
                                           0644) == 0);
   ScopedFileWriterCloser writer_closer(&writer);
-
-  // Write header
-  TEST_AND_RETURN_FALSE(writer.Write(kDeltaMagic, strlen(kDeltaMagic)));
-
-  // Write version number
-  TEST_AND_RETURN_FALSE(WriteUint64AsBigEndian(&writer, kVersionNumber));
-
-  // Write protobuf length
-  TEST_AND_RETURN_FALSE(WriteUint64AsBigEndian(&writer,
-                                               serialized_manifest.size()));
-
-  // Write protobuf
-  LOG(INFO) << "Writing final delta file protobuf... "
-            << serialized_manifest.size();
-  TEST_AND_RETURN_FALSE(writer.Write(serialized_manifest.data(),
-                                     serialized_manifest.size()));
+  TEST_AND_RETURN_FALSE(WritePayloadHeader(manifest,
+                                           compact_manifest,
+                                           &writer,
+                                           metadata_size));
 
   // Append the data blobs
   LOG(INFO) << "Writing final delta file data blobs...";
-  int blobs_fd = open(ordered_blobs_path.c_str(), O_RDONLY, 0);
-  ScopedFdCloser blobs_fd_closer(&blobs_fd);
-  TEST_AND_RETURN_FALSE(blobs_fd >= 0);
-  for (;;) {
-    char buf[kBlockSize];
-    ssize_t rc = read(blobs_fd, buf, sizeof(buf));
-    if (0 == rc) {
-      // EOF
-      break;
-    }
-    TEST_AND_RETURN_FALSE_ERRNO(rc > 0);
-    TEST_AND_RETURN_FALSE(writer.Write(buf, rc));
+  {
+    ScopedGeneratorPhase phase(profile, "WriteDataBlobs");
+    TEST_AND_RETURN_FALSE(CopyDataBlobs(temp_file_path,
+                                        blob_runs,
+                                        writer.fd()));
   }
+  temp_file_unlinker.reset();
 
   // Write signature blob.
   if (!private_key_path.empty()) {
     LOG(INFO) << "Signing the update...";
+    ScopedGeneratorPhase phase(profile, "SignPayload");
     vector<char> signature_blob;
     TEST_AND_RETURN_FALSE(PayloadSigner::SignPayload(
         output_path,
@@ -1567,53 +3763,332 @@ bool DeltaDiffGenerator::GenerateDeltaUpdateFile(
                                        signature_blob.size()));
   }
 
-  *metadata_size =
-      strlen(kDeltaMagic) + 2 * sizeof(uint64_t) + serialized_manifest.size();
   ReportPayloadUsage(manifest, *metadata_size, op_name_map);
 
+  // The payload no longer needs the checkpoint, nor its data blobs.
+  if (checkpointed)
+    generator_checkpoint->Clear(checkpoint_key);
+
   LOG(INFO) << "All done. Successfully created delta file with "
             << "metadata size = " << *metadata_size;
   return true;
 }
 
-// Runs the bsdiff tool on two files and returns the resulting delta in
-// 'out'. Returns true on success.
+void DeltaDiffGenerator::SetNumThreads(unsigned threads) {
+  num_threads = threads;
+}
+
+void DeltaDiffGenerator::SetSuffixArrayCacheDir(const string& dir) {
+  delete suffix_array_cache;
+  suffix_array_cache = dir.empty() ? NULL : new SuffixArrayCache(dir);
+}
+
+void DeltaDiffGenerator::SetOperationCacheDir(const string& dir) {
+  delete operation_cache;
+  operation_cache = dir.empty() ? NULL : new OperationCache(dir);
+}
+
+void DeltaDiffGenerator::SetCheckpointDir(const string& dir) {
+  delete generator_checkpoint;
+  generator_checkpoint = dir.empty() ? NULL : new GeneratorCheckpoint(dir);
+}
+
+void DeltaDiffGenerator::SetMemoryBudget(uint64_t bytes) {
+  delete memory_budget;
+  memory_budget = bytes > 0 ? new MemoryBudget(bytes) : NULL;
+}
+
+void DeltaDiffGenerator::SetApplyFromSource(bool from_source) {
+  apply_from_source = from_source;
+}
+
+void DeltaDiffGenerator::SetXzCompression(bool xz) {
+  xz_compression = xz;
+}
+
+void DeltaDiffGenerator::SetZeroBlocks(bool zero) {
+  zero_blocks = zero;
+}
+
+void DeltaDiffGenerator::SetSampleCompression(bool sample) {
+  sample_compression = sample;
+}
+
+void DeltaDiffGenerator::SetGreedyCycleBreaking(bool greedy) {
+  greedy_cycle_breaking = greedy;
+}
+
+void DeltaDiffGenerator::SetBlockDeduplication(bool deduplicate) {
+  block_deduplication = deduplicate;
+}
+
+void DeltaDiffGenerator::SetInterleaveKernelBlobs(bool interleave) {
+  interleave_kernel_blobs = interleave;
+}
+
+void DeltaDiffGenerator::SetPayloadSegments(bool segments) {
+  payload_segments = segments;
+}
+
+void DeltaDiffGenerator::SetSourceReuseHints(bool hints) {
+  source_reuse_hints = hints;
+}
+
+void DeltaDiffGenerator::SetLocalityOrdering(bool locality) {
+  locality_ordering = locality;
+}
+
+void DeltaDiffGenerator::SetSimilarFileMatching(bool similar) {
+  similar_file_matching = similar;
+}
+
+void DeltaDiffGenerator::SetBlake3OperationHashes(bool blake3) {
+  blake3_operation_hashes = blake3;
+}
+
+void DeltaDiffGenerator::SetChunkSize(off_t chunk_size) {
+  CHECK(chunk_size < 0 || (chunk_size > 0 && chunk_size % kBlockSize == 0))
+      << "Invalid chunk size " << chunk_size;
+  file_chunk_size = chunk_size < 0 ? -1 : chunk_size;
+}
+
+void DeltaDiffGenerator::SetKernelChunkSize(off_t chunk_size) {
+  CHECK(chunk_size < 0 || (chunk_size > 0 && chunk_size % kBlockSize == 0))
+      << "Invalid kernel chunk size " << chunk_size;
+  kernel_chunk_size = chunk_size < 0 ? -1 : chunk_size;
+}
+
+void DeltaDiffGenerator::SetPartitionHashChunkSize(uint64_t chunk_size) {
+  partition_hash_chunk_size = chunk_size;
+}
+
+void DeltaDiffGenerator::SetRootfsHashTree(bool hash_tree,
+                                           const vector<char>& salt) {
+  rootfs_hash_tree = hash_tree;
+  rootfs_hash_tree_salt = salt;
+}
+
+void DeltaDiffGenerator::SetDestinationHashes(bool hashes) {
+  destination_hashes = hashes;
+}
+
+void DeltaDiffGenerator::SetOperationFusionSize(uint64_t size) {
+  CHECK_EQ(size % kBlockSize, 0);
+  operation_fusion_size = size;
+}
+
+void DeltaDiffGenerator::SetCompactManifest(bool compact) {
+  compact_manifest = compact;
+}
+
+void DeltaDiffGenerator::SetProfile(GeneratorProfile* generator_profile) {
+  profile = generator_profile;
+}
+
+void DeltaDiffGenerator::SetApplyCostModel(const ApplyCostModel* model) {
+  delete apply_cost_model;
+  apply_cost_model = model ? new ApplyCostModel(*model) : NULL;
+}
+
+void DeltaDiffGenerator::SetReadImages(bool read) {
+  read_images = read;
+}
+
+void DeltaDiffGenerator::SetStreamDiffMargin(int margin) {
+  stream_diff_margin = margin < 0 ? -1 : margin;
+}
+
+void DeltaDiffGenerator::SetDiffShard(int index, int count) {
+  CHECK_GE(count, 0);
+  CHECK(count == 0 || (index >= 0 && index < count));
+  diff_shard_index = count == 0 ? 0 : index;
+  diff_shard_count = count;
+}
+
+void DeltaDiffGenerator::SetXzDictionarySize(size_t size) {
+  CHECK_LT(size, kXzDictionaryWindowSize - kXzDictionaryMaxFileSize);
+  xz_dictionary_size = size;
+}
+
+void DeltaDiffGenerator::SetBlockSize(uint64_t block_size) {
+  CHECK(block_size >= kBlockSize && block_size <= kFullUpdateChunkSize &&
+        (block_size & (block_size - 1)) == 0)
+      << "Invalid block size " << block_size;
+  full_block_size = block_size;
+}
+
+void DeltaDiffGenerator::SetFullChunkSizeBounds(off_t min_chunk_size,
+                                                off_t max_chunk_size) {
+  CHECK(min_chunk_size > 0 &&
+        min_chunk_size <= static_cast<off_t>(kFullUpdateChunkSize) &&
+        max_chunk_size >= static_cast<off_t>(kFullUpdateChunkSize))
+      << "Invalid chunk size bounds " << min_chunk_size << " and "
+      << max_chunk_size;
+  full_min_chunk_size = min_chunk_size;
+  full_max_chunk_size = max_chunk_size;
+}
+
+int DeltaDiffGenerator::DiffShardOf(const string& path,
+                                    off_t chunk_offset,
+                                    int count) {
+  const string name =
+      StringPrintf("%s@%jd", path.c_str(), static_cast<intmax_t>(chunk_offset));
+  return block_scan::HashData(name.data(), name.size()) % count;
+}
+
+bool DeltaDiffGenerator::ListFilesInDiffOrder(const string& old_root,
+                                              const string& new_root,
+                                              size_t window,
+                                              ThreadPool* pool,
+                                              vector<string>* paths) {
+  FilesToDiffLister lister(old_root, new_root, window, pool);
+  TEST_AND_RETURN_FALSE(lister.Init());
+  paths->clear();
+  FileToDiff file;
+  while (lister.Next(&file))
+    paths->push_back(file.path);
+  return true;
+}
+
+bool DeltaDiffGenerator::IsCheaperOperation(
+    DeltaArchiveManifest_InstallOperation_Type type,
+    uint64_t blob_size,
+    DeltaArchiveManifest_InstallOperation_Type other_type,
+    uint64_t other_blob_size,
+    uint64_t src_length,
+    uint64_t dst_length) {
+  if (!apply_cost_model)
+    return blob_size < other_blob_size;
+  return apply_cost_model->Cost(type, blob_size, src_length, dst_length) <
+      apply_cost_model->Cost(other_type, other_blob_size, src_length,
+                             dst_length);
+}
+
+bool DeltaDiffGenerator::CompressReplaceData(
+    const vector<char>& data,
+    vector<char>* out,
+    DeltaArchiveManifest_InstallOperation_Type* out_type) {
+  return CompressReplaceData(data.empty() ? NULL : &data[0], data.size(), out,
+                             out_type);
+}
+
+bool DeltaDiffGenerator::CompressReplaceData(
+    const char* data,
+    size_t size,
+    vector<char>* out,
+    DeltaArchiveManifest_InstallOperation_Type* out_type) {
+  if (zero_blocks && size > 0 && block_scan::IsZeroData(data, size)) {
+    *out_type = DeltaArchiveManifest_InstallOperation_Type_ZERO;
+    out->clear();
+    return true;
+  }
+  // Data that looks compressed already isn't compressed again. Otherwise,
+  // with sample_compression, the compressors whose samples show they can't
+  // beat sending the data as is aren't run on all of it.
+  const bool incompressible = LooksIncompressible(data, size);
+  const bool sample = sample_compression && size >= kCompressionSampleMinSize;
+  const bool try_bz = !incompressible && (!sample || IsCheaperOperation(
+      DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ,
+      EstimateCompressedSize(BzipCompressBytes, data, size),
+      DeltaArchiveManifest_InstallOperation_Type_REPLACE,
+      size, 0, size));
+  const bool try_xz = xz_compression && !incompressible &&
+      (!sample || IsCheaperOperation(
+          DeltaArchiveManifest_InstallOperation_Type_REPLACE_XZ,
+          EstimateCompressedSize(XzCompressBytes, data, size),
+          DeltaArchiveManifest_InstallOperation_Type_REPLACE,
+          size, 0, size));
+  vector<char> data_bz;
+  if (try_bz)
+    TEST_AND_RETURN_FALSE(BzipCompressBytes(data, size, &data_bz));
+  vector<char> data_xz;
+  if (try_xz)
+    TEST_AND_RETURN_FALSE(XzCompressBytes(data, size, &data_xz));
+
+  if (apply_cost_model) {
+    // Pick the quickest to apply, preferring the first of REPLACE_XZ,
+    // REPLACE_BZ and REPLACE on ties.
+    const double replace_cost = apply_cost_model->Cost(
+        DeltaArchiveManifest_InstallOperation_Type_REPLACE, size, 0, size);
+    const double bz_cost = try_bz ?
+        apply_cost_model->Cost(
+            DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ,
+            data_bz.size(), 0, size) :
+        std::numeric_limits<double>::infinity();
+    const double xz_cost = try_xz ?
+        apply_cost_model->Cost(
+            DeltaArchiveManifest_InstallOperation_Type_REPLACE_XZ,
+            data_xz.size(), 0, size) :
+        std::numeric_limits<double>::infinity();
+    if (xz_cost <= bz_cost && xz_cost <= replace_cost) {
+      *out_type = DeltaArchiveManifest_InstallOperation_Type_REPLACE_XZ;
+      out->swap(data_xz);
+    } else if (bz_cost <= replace_cost) {
+      *out_type = DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ;
+      out->swap(data_bz);
+    } else {
+      *out_type = DeltaArchiveManifest_InstallOperation_Type_REPLACE;
+      out->assign(data, data + size);
+    }
+  } else if (try_xz && (!try_bz || data_xz.size() <= data_bz.size()) &&
+             data_xz.size() < size) {
+    *out_type = DeltaArchiveManifest_InstallOperation_Type_REPLACE_XZ;
+    out->swap(data_xz);
+  } else if (try_bz && data_bz.size() < size) {
+    *out_type = DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ;
+    out->swap(data_bz);
+  } else {
+    *out_type = DeltaArchiveManifest_InstallOperation_Type_REPLACE;
+    out->assign(data, data + size);
+  }
+
+  // Small data, e.g., a config file, may have much in common with the
+  // dictionary of the delta.
+  if (!xz_dictionary.empty() && size > 0 &&
+      size <= kXzDictionaryMaxFileSize) {
+    vector<char> data_dict;
+    TEST_AND_RETURN_FALSE(XzCompressWithDictionary(data, size, xz_dictionary,
+                                                   &data_dict));
+    if (IsCheaperOperation(
+            DeltaArchiveManifest_InstallOperation_Type_REPLACE_XZ_DICT,
+            data_dict.size(), *out_type, out->size(), 0, size)) {
+      *out_type = DeltaArchiveManifest_InstallOperation_Type_REPLACE_XZ_DICT;
+      out->swap(data_dict);
+    }
+  }
+  return true;
+}
+
+bool DeltaDiffGenerator::LooksIncompressible(const char* data, size_t size) {
+  return size >= kProbeMinSize &&
+      data_probe::MinSampleEntropy(data, size, kCompressionSamples,
+                                   kCompressionSampleSize) >=
+      kIncompressibleEntropy &&
+      data_probe::RepeatedContentFraction(data, size) <
+      kIncompressibleRepeatedContent;
+}
+
+// Diffs two files in-process and returns the resulting delta in 'out'.
+// Returns true on success.
 bool DeltaDiffGenerator::BsdiffFiles(const string& old_file,
                                      const string& new_file,
                                      vector<char>* out) {
-  const string kPatchFile = "/tmp/delta.patchXXXXXX";
-  string patch_file_path;
-
-  TEST_AND_RETURN_FALSE(
-      utils::MakeTempFile(kPatchFile, &patch_file_path, NULL));
-
-  vector<string> cmd;
-  cmd.push_back(kBsdiffPath);
-  cmd.push_back(old_file);
-  cmd.push_back(new_file);
-  cmd.push_back(patch_file_path);
-
-  int rc = 1;
-  vector<char> patch_file;
-  TEST_AND_RETURN_FALSE(Subprocess::SynchronousExec(cmd, &rc, NULL));
-  TEST_AND_RETURN_FALSE(rc == 0);
-  TEST_AND_RETURN_FALSE(utils::ReadFile(patch_file_path, out));
-  unlink(patch_file_path.c_str());
-  return true;
+  MappedFile old_data, new_data;
+  TEST_AND_RETURN_FALSE(old_data.Init(old_file, 0, -1));
+  TEST_AND_RETURN_FALSE(new_data.Init(new_file, 0, -1));
+  return BsdiffBuffers(old_data.data(), old_data.size(),
+                       new_data.data(), new_data.size(),
+                       suffix_array_cache, out);
 }
 
-// The |blocks| vector contains a reader and writer for each block on the
-// filesystem that's being in-place updated. We populate the reader/writer
-// fields of |blocks| by calling this function.
-// For each block in |operation| that is read or written, find that block
-// in |blocks| and set the reader/writer field to the vertex passed.
-// |graph| is not strictly necessary, but useful for printing out
-// error messages.
+// Records |vertex| as the reader and writer of the blocks |operation|
+// reads and writes in |blocks|. |graph| is not strictly necessary, but
+// useful for printing out error messages.
 bool DeltaDiffGenerator::AddInstallOpToBlocksVector(
     const DeltaArchiveManifest_InstallOperation& operation,
     const Graph& graph,
     Vertex::Index vertex,
-    vector<Block>* blocks) {
+    BlockOwners* blocks) {
   // See if this is already present.
   TEST_AND_RETURN_FALSE(operation.dst_extents_size() > 0);
 
@@ -1625,8 +4100,10 @@ bool DeltaDiffGenerator::AddInstallOpToBlocksVector(
     const char* past_participle = (field == READER) ? "read" : "written";
     const google::protobuf::RepeatedPtrField<Extent>& extents =
         (field == READER) ? operation.src_extents() : operation.dst_extents();
-    Vertex::Index Block::*access_type =
-        (field == READER) ? &Block::reader : &Block::writer;
+    bool (BlockOwners::*set_owner)(const Extent&,
+                                   Vertex::Index,
+                                   Vertex::Index*) =
+        (field == READER) ? &BlockOwners::SetReader : &BlockOwners::SetWriter;
 
     for (int i = 0; i < extents_size; i++) {
       const Extent& extent = extents.Get(i);
@@ -1634,20 +4111,374 @@ bool DeltaDiffGenerator::AddInstallOpToBlocksVector(
         // Hole in sparse file. skip
         continue;
       }
+      TEST_AND_RETURN_FALSE(extent.start_block() + extent.num_blocks() <=
+                            blocks->block_count());
+      Vertex::Index other = Vertex::kInvalidIndex;
+      if (!(blocks->*set_owner)(extent, vertex, &other)) {
+        LOG(FATAL) << "Extent " << extent.start_block() << "+"
+                   << extent.num_blocks() << " is already "
+                   << past_participle << " by "
+                   << other << "(" << graph[other].file_name
+                   << ") and also " << vertex << "("
+                   << graph[vertex].file_name << ")";
+      }
+    }
+  }
+  return true;
+}
+
+void DeltaDiffGenerator::AddPayloadSegments(DeltaArchiveManifest* manifest) {
+  // The blobs of both partitions, by offset, and whether they're the
+  // kernel's.
+  map<uint64_t, pair<uint64_t, bool> > blobs;
+  for (int i = 0; i < manifest->install_operations_size(); i++) {
+    const DeltaArchiveManifest_InstallOperation& op =
+        manifest->install_operations(i);
+    if (op.has_data_offset() && op.data_length() > 0) {
+      blobs[op.data_offset()] = std::make_pair(op.data_length(), false);
+    }
+  }
+  for (int i = 0; i < manifest->kernel_install_operations_size(); i++) {
+    const DeltaArchiveManifest_InstallOperation& op =
+        manifest->kernel_install_operations(i);
+    if (op.has_data_offset() && op.data_length() > 0) {
+      blobs[op.data_offset()] = std::make_pair(op.data_length(), true);
+    }
+  }
+
+  manifest->clear_segments();
+  PayloadSegment* segment = NULL;
+  bool segment_is_kernel = false;
+  for (map<uint64_t, pair<uint64_t, bool> >::const_iterator it =
+           blobs.begin(); it != blobs.end(); ++it) {
+    const bool is_kernel = it->second.second;
+    if (!segment || is_kernel != segment_is_kernel ||
+        it->first != segment->data_offset() + segment->data_length()) {
+      segment = manifest->add_segments();
+      segment->set_partition(is_kernel ? PayloadSegment::KERNEL :
+                             PayloadSegment::ROOTFS);
+      segment->set_data_offset(it->first);
+      segment->set_data_length(0);
+      segment_is_kernel = is_kernel;
+    }
+    segment->set_data_length(segment->data_length() + it->second.first);
+  }
+  LOG(INFO) << "Indexed the data blobs in " << manifest->segments_size()
+            << " segments";
+}
+
+void DeltaDiffGenerator::AddSourceReuseHints(DeltaArchiveManifest* manifest) {
+  // Going backwards through the order clients apply the operations in, the
+  // blocks of each partition that a later operation reads before any
+  // operation overwrites them.
+  ExtentRanges read_later[2];
+  vector<size_t> order;
+  DeltaPerformer::GetOperationOrder(*manifest, &order);
+  const size_t num_rootfs_operations = manifest->install_operations_size();
+  uint64_t num_reused = 0;
+  for (vector<size_t>::reverse_iterator it = order.rbegin();
+       it != order.rend(); ++it) {
+    const bool is_kernel = *it >= num_rootfs_operations;
+    DeltaArchiveManifest_InstallOperation* op =
+        is_kernel ?
+        manifest->mutable_kernel_install_operations(
+            *it - num_rootfs_operations) :
+        manifest->mutable_install_operations(*it);
+    ExtentRanges* ranges = &read_later[is_kernel];
+    // What the operation writes isn't what the later ones read, unless the
+    // operations read the source partitions, which are never written.
+    if (!manifest->apply_from_source()) {
+      for (int i = 0; i < op->dst_extents_size(); i++) {
+        if (op->dst_extents(i).start_block() != kSparseHole)
+          ranges->SubtractExtent(op->dst_extents(i));
+      }
+    }
+    bool reused = false;
+    for (int i = 0; i < op->src_extents_size(); i++) {
+      const Extent& extent = op->src_extents(i);
+      if (extent.start_block() == kSparseHole)
+        continue;
+      reused = reused || ranges->OverlapsExtent(extent);
+      ranges->AddExtent(extent);
+    }
+    if (reused) {
+      op->set_src_reused(true);
+      num_reused++;
+    } else {
+      op->clear_src_reused();
+    }
+  }
+  manifest->set_src_reuse_hints(true);
+  LOG(INFO) << num_reused << " operations read source blocks a later one "
+            << "reads again";
+}
+
+namespace {
+
+// Sets the destination hashes of the operations on the kernel partition if
+// |is_kernel|, and on the rootfs one otherwise, whose new contents are the
+// |size| bytes of |partition|. See DeltaDiffGenerator::AddDestinationHashes().
+bool AddPartitionDestinationHashes(const string& partition,
+                                   uint64_t size,
+                                   bool is_kernel,
+                                   DeltaArchiveManifest* manifest) {
+  MappedFile file;
+  TEST_AND_RETURN_FALSE(file.Init(partition, 0, size));
+  const uint64_t block_size = manifest->block_size();
+  const uint64_t num_blocks = (size + block_size - 1) / block_size;
+  const int num_operations = is_kernel ?
+      manifest->kernel_install_operations_size() :
+      manifest->install_operations_size();
+
+  // How many operations write each block, counting up to 2.
+  vector<uint8_t> writes(num_blocks, 0);
+  for (int i = 0; i < num_operations; i++) {
+    const DeltaArchiveManifest_InstallOperation& op = is_kernel ?
+        manifest->kernel_install_operations(i) :
+        manifest->install_operations(i);
+    for (int j = 0; j < op.dst_extents_size(); j++) {
+      const Extent& extent = op.dst_extents(j);
+      if (extent.start_block() == kSparseHole)
+        continue;
+      for (uint64_t block = extent.start_block();
+           block < min(extent.start_block() + extent.num_blocks(), num_blocks);
+           block++) {
+        if (writes[block] < 2)
+          writes[block]++;
+      }
+    }
+  }
+
+  const vector<char> zeros(block_size, 0);
+  int hashed = 0;
+  for (int i = 0; i < num_operations; i++) {
+    DeltaArchiveManifest_InstallOperation* op = is_kernel ?
+        manifest->mutable_kernel_install_operations(i) :
+        manifest->mutable_install_operations(i);
+    op->clear_dst_sha256_hash();
+    // A block written more than once, e.g., scratch space for breaking a
+    // cycle, only ends up as in the new image after its last write.
+    bool final_blocks = op->type() !=
+        DeltaArchiveManifest_InstallOperation_Type_DISCARD &&
+        op->dst_extents_size() > 0;
+    for (int j = 0; final_blocks && j < op->dst_extents_size(); j++) {
+      const Extent& extent = op->dst_extents(j);
+      if (extent.start_block() == kSparseHole ||
+          extent.start_block() + extent.num_blocks() > num_blocks) {
+        final_blocks = false;
+        break;
+      }
       for (uint64_t block = extent.start_block();
-           block < (extent.start_block() + extent.num_blocks()); block++) {
-        if ((*blocks)[block].*access_type != Vertex::kInvalidIndex) {
-          LOG(FATAL) << "Block " << block << " is already "
-                     << past_participle << " by "
-                     << (*blocks)[block].*access_type << "("
-                     << graph[(*blocks)[block].*access_type].file_name
-                     << ") and also " << vertex << "("
-                     << graph[vertex].file_name << ")";
+           block < extent.start_block() + extent.num_blocks(); block++) {
+        if (writes[block] != 1) {
+          final_blocks = false;
+          break;
         }
-        (*blocks)[block].*access_type = vertex;
       }
     }
+    if (!final_blocks)
+      continue;
+
+    // The tail of the last block of the partition reads as zeros.
+    OmahaHashCalculator hasher;
+    for (int j = 0; j < op->dst_extents_size(); j++) {
+      const Extent& extent = op->dst_extents(j);
+      const uint64_t offset = extent.start_block() * block_size;
+      const uint64_t length = extent.num_blocks() * block_size;
+      const uint64_t mapped = offset < file.size() ?
+          min<uint64_t>(length, file.size() - offset) : 0;
+      if (mapped > 0)
+        TEST_AND_RETURN_FALSE(hasher.Update(file.data() + offset, mapped));
+      for (uint64_t done = mapped; done < length;) {
+        const uint64_t count = min<uint64_t>(length - done, zeros.size());
+        TEST_AND_RETURN_FALSE(hasher.Update(&zeros[0], count));
+        done += count;
+      }
+    }
+    TEST_AND_RETURN_FALSE(hasher.Finalize());
+    const vector<char>& hash = hasher.raw_hash();
+    op->set_dst_sha256_hash(hash.data(), hash.size());
+    hashed++;
+  }
+  LOG(INFO) << partition << ": destination hashes for " << hashed << " of "
+            << num_operations << " operations";
+  return true;
+}
+
+}  // namespace {}
+
+namespace {
+
+bool IsFullOperation(const DeltaArchiveManifest_InstallOperation& op) {
+  return op.type() == DeltaArchiveManifest_InstallOperation_Type_REPLACE ||
+      op.type() == DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ ||
+      op.type() == DeltaArchiveManifest_InstallOperation_Type_REPLACE_XZ ||
+      op.type() == DeltaArchiveManifest_InstallOperation_Type_REPLACE_XZ_DICT;
+}
+
+// Appends the data the full operation |op| writes, as read from its blob in
+// |data_fd|, to |data|. Unless |last|, the data is zero-padded to the end of
+// the last block |op| writes, as it is when applied.
+bool AppendOperationData(const DeltaArchiveManifest_InstallOperation& op,
+                         int data_fd,
+                         bool last,
+                         vector<char>* data) {
+  vector<char> blob(op.data_length());
+  ssize_t bytes_read = 0;
+  TEST_AND_RETURN_FALSE(utils::PReadAll(data_fd,
+                                        blob.empty() ? NULL : &blob[0],
+                                        blob.size(),
+                                        op.data_offset(),
+                                        &bytes_read));
+  TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(blob.size()));
+  vector<char> op_data;
+  if (op.type() == DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ)
+    TEST_AND_RETURN_FALSE(BzipDecompress(blob, &op_data));
+  else if (op.type() == DeltaArchiveManifest_InstallOperation_Type_REPLACE_XZ)
+    TEST_AND_RETURN_FALSE(XzDecompress(blob, &op_data));
+  else if (op.type() ==
+           DeltaArchiveManifest_InstallOperation_Type_REPLACE_XZ_DICT)
+    TEST_AND_RETURN_FALSE(XzDecompressWithDictionary(blob, xz_dictionary,
+                                                     &op_data));
+  else
+    op_data.swap(blob);
+  const uint64_t size =
+      graph_utils::BlocksInExtents(op.dst_extents()) * kBlockSize;
+  TEST_AND_RETURN_FALSE(op_data.size() <= size);
+  data->insert(data->end(), op_data.begin(), op_data.end());
+  if (!last)
+    data->resize(data->size() + size - op_data.size());
+  return true;
+}
+
+}  // namespace {}
+
+bool DeltaDiffGenerator::FuseSmallOperations(Graph* graph,
+                                             vector<Vertex::Index>* order,
+                                             int data_fd,
+                                             off_t* data_file_size) {
+  if (operation_fusion_size == 0)
+    return true;
+  vector<Vertex::Index> fused_order;
+  uint64_t fused_count = 0;
+  for (size_t i = 0; i < order->size(); ) {
+    // Finds the run of small operations from |i| on.
+    size_t end = i;
+    uint64_t run_size = 0;
+    for (; end < order->size(); end++) {
+      const DeltaArchiveManifest_InstallOperation& op =
+          (*graph)[(*order)[end]].op;
+      const uint64_t size =
+          graph_utils::BlocksInExtents(op.dst_extents()) * kBlockSize;
+      if (!IsFullOperation(op) || size >= operation_fusion_size ||
+          run_size + size > operation_fusion_size)
+        break;
+      run_size += size;
+    }
+    fused_order.push_back((*order)[i]);
+    if (end - i < 2) {
+      i++;
+      continue;
+    }
+
+    vector<char> data;
+    vector<Extent> extents;
+    for (size_t j = i; j < end; j++) {
+      const DeltaArchiveManifest_InstallOperation& op =
+          (*graph)[(*order)[j]].op;
+      TEST_AND_RETURN_FALSE(AppendOperationData(op, data_fd, j + 1 == end,
+                                                &data));
+      for (int k = 0; k < op.dst_extents_size(); k++) {
+        if (op.dst_extents(k).start_block() == kSparseHole)
+          extents.push_back(op.dst_extents(k));
+        else
+          graph_utils::AppendExtentToExtents(&extents, op.dst_extents(k));
+      }
+    }
+    vector<char> blob;
+    DeltaArchiveManifest_InstallOperation_Type type;
+    TEST_AND_RETURN_FALSE(CompressReplaceData(data, &blob, &type));
+
+    Vertex* vertex = &(*graph)[(*order)[i]];
+    DeltaArchiveManifest_InstallOperation* op = &vertex->op;
+    op->set_type(type);
+    op->clear_dst_extents();
+    StoreExtents(extents, op->mutable_dst_extents());
+    op->set_dst_length(data.size());
+    if (blob.empty()) {
+      op->clear_data_offset();
+      op->clear_data_length();
+    } else {
+      TEST_AND_RETURN_FALSE(utils::PWriteAll(data_fd, &blob[0], blob.size(),
+                                             *data_file_size));
+      op->set_data_offset(*data_file_size);
+      op->set_data_length(blob.size());
+      *data_file_size += blob.size();
+    }
+    vertex->chunk_offset = 0;
+    vertex->chunk_size = -1;
+    for (size_t j = i + 1; j < end; j++) {
+      Vertex* fused = &(*graph)[(*order)[j]];
+      vertex->file_name += ", " + fused->file_name;
+      fused->valid = false;
+    }
+    fused_count += end - i - 1;
+    i = end;
+  }
+  LOG(INFO) << "Merged " << fused_count << " small full operations into "
+            << "others, leaving " << fused_order.size() << " operations";
+  order->swap(fused_order);
+  return true;
+}
+
+bool DeltaDiffGenerator::AddDestinationHashes(const string& new_kernel,
+                                              const string& new_rootfs,
+                                              DeltaArchiveManifest* manifest) {
+  if (!new_kernel.empty()) {
+    TEST_AND_RETURN_FALSE(manifest->has_new_kernel_info());
+    TEST_AND_RETURN_FALSE(AddPartitionDestinationHashes(
+        new_kernel, manifest->new_kernel_info().size(), true, manifest));
+  }
+  TEST_AND_RETURN_FALSE(manifest->has_new_rootfs_info());
+  return AddPartitionDestinationHashes(
+      new_rootfs, manifest->new_rootfs_info().size(), false, manifest);
+}
+
+bool DeltaDiffGenerator::WritePayloadHeader(
+    const DeltaArchiveManifest& manifest,
+    bool compact,
+    FileWriter* writer,
+    uint64_t* metadata_size) {
+  // Serialize protobuf
+  string serialized_manifest;
+  uint64_t version = kVersionNumber;
+  if (compact) {
+    DeltaArchiveManifest packed_manifest(manifest);
+    CompactManifest(&packed_manifest);
+    TEST_AND_RETURN_FALSE(
+        packed_manifest.AppendToString(&serialized_manifest));
+    version = kCompactManifestVersion;
+  } else {
+    TEST_AND_RETURN_FALSE(manifest.AppendToString(&serialized_manifest));
   }
+
+  // Write header
+  TEST_AND_RETURN_FALSE(writer->Write(kDeltaMagic, strlen(kDeltaMagic)));
+
+  // Write version number
+  TEST_AND_RETURN_FALSE(WriteUint64AsBigEndian(writer, version));
+
+  // Write protobuf length
+  TEST_AND_RETURN_FALSE(WriteUint64AsBigEndian(writer,
+                                               serialized_manifest.size()));
+
+  // Write protobuf
+  LOG(INFO) << "Writing final delta file protobuf... "
+            << serialized_manifest.size();
+  TEST_AND_RETURN_FALSE(writer->Write(serialized_manifest.data(),
+                                      serialized_manifest.size()));
+  *metadata_size =
+      strlen(kDeltaMagic) + 2 * sizeof(uint64_t) + serialized_manifest.size();
   return true;
 }
 
@@ -1668,11 +4499,11 @@ void DeltaDiffGenerator::AddSignatureOp(uint64_t signature_blob_offset,
   Extent* dummy_extent = dummy_op->add_dst_extents();
   // Tell the dummy op to write this data to a big sparse hole
   dummy_extent->set_start_block(kSparseHole);
-  dummy_extent->set_num_blocks((signature_blob_length + kBlockSize - 1) /
-                               kBlockSize);
+  dummy_extent->set_num_blocks(
+      (signature_blob_length + manifest->block_size() - 1) /
+      manifest->block_size());
 }
 
-const char* const kBsdiffPath = "bsdiff";
 const char* const kBspatchPath = "bspatch";
 const char* const kDeltaMagic = "CrAU";
 
@@ -6,8 +6,10 @@
 #define CHROMEOS_PLATFORM_UPDATE_ENGINE_DELTA_DIFF_GENERATOR_H__
 
 #include <string>
+#include <utility>
 #include <vector>
 #include "base/basictypes.h"
+#include "update_engine/block_owners.h"
 #include "update_engine/graph_types.h"
 #include "update_engine/update_metadata.pb.h"
 
@@ -20,6 +22,11 @@
 
 namespace chromeos_update_engine {
 
+struct ApplyCostModel;
+class FileWriter;
+class GeneratorProfile;
+class ThreadPool;
+
 // This struct stores all relevant info for an edge that is cut between
 // nodes old_src -> old_dst by creating new vertex new_vertex. The new
 // relationship is:
@@ -36,23 +43,17 @@ struct CutEdgeVertexes {
   std::vector<Extent> tmp_extents;
 };
 
+// An old image GenerateDeltaUpdateFiles() generates a delta from, and where
+// the delta goes.
+struct DeltaSource {
+  std::string old_root;
+  std::string old_image;
+  std::string old_kernel_part;
+  std::string output_path;
+};
+
 class DeltaDiffGenerator {
  public:
-  // Represents a disk block on the install partition.
-  struct Block {
-    // During install, each block on the install partition will be written
-    // and some may be read (in all likelihood, many will be read).
-    // The reading and writing will be performed by InstallOperations,
-    // each of which has a corresponding vertex in a graph.
-    // A Block object tells which vertex will read or write this block
-    // at install time.
-    // Generally, there will be a vector of Block objects whose length
-    // is the number of blocks on the install partition.
-    Block() : reader(Vertex::kInvalidIndex), writer(Vertex::kInvalidIndex) {}
-    Vertex::Index reader;
-    Vertex::Index writer;
-  };
-
   // This is the only function that external users of the class should call.
   // old_image and new_image are paths to two image files. They should be
   // mounted read-only at paths old_root and new_root respectively.
@@ -73,6 +74,18 @@ class DeltaDiffGenerator {
                                       const std::string& private_key_path,
                                       uint64_t* metadata_size);
 
+  // Generates a delta from each of |sources| to the same new image, as
+  // GenerateDeltaUpdateFile() would. The deltas share the work that only
+  // depends on the new image: the full encodings of its files and the
+  // hashes of its partitions are computed once. Returns true if all the
+  // deltas were generated, stopping at the first failure.
+  static bool GenerateDeltaUpdateFiles(
+      const std::vector<DeltaSource>& sources,
+      const std::string& new_root,
+      const std::string& new_image,
+      const std::string& new_kernel_part,
+      const std::string& private_key_path);
+
   // These functions are public so that the unit tests can access them:
 
   // Takes a graph, which is not a DAG, which represents the files just
@@ -96,16 +109,33 @@ class DeltaDiffGenerator {
   // necessary data in out_data and fills in out_op.
   // If there's no change in old and new files, it creates a MOVE
   // operation. If there is a change, or the old file doesn't exist,
-  // the smallest of REPLACE, REPLACE_BZ, or BSDIFF wins.
-  // new_filename must contain at least one byte.
+  // the smallest of REPLACE, REPLACE_BZ, REPLACE_XZ or BSDIFF wins.
+  // Only the |chunk_size| bytes from |chunk_offset| on of both files are
+  // considered, or everything from there if |chunk_size| is -1;
+  // |chunk_offset| must be a multiple of the block size.
+  // new_filename must contain at least one byte there.
   // Returns true on success.
   static bool ReadFileToDiff(const std::string& old_filename,
                              const std::string& new_filename,
+                             off_t chunk_offset,
+                             off_t chunk_size,
                              bool bsdiff_allowed,
                              std::vector<char>* out_data,
                              DeltaArchiveManifest_InstallOperation* out_op,
                              bool gather_extents);
 
+  // Turns the full operations in |graph| whose new blocks can all be found
+  // in blocks of the |old_block_count| blocks long |old_image| that no
+  // operation reads, into MOVE operations from those, and records them as
+  // their readers in |blocks|. |new_image| is where their new blocks are
+  // read from. This saves files moved around or shared between files from
+  // being sent down again. Returns true on success.
+  static bool DeduplicateFullOperations(Graph* graph,
+                                        BlockOwners* blocks,
+                                        const std::string& old_image,
+                                        uint64_t old_block_count,
+                                        const std::string& new_image);
+
   // Creates a dummy REPLACE_BZ node in the given |vertex|. This can be used
   // to provide scratch space. The node writes |num_blocks| blocks starting at
   // |start_block|The node should be marked invalid before writing all nodes to
@@ -143,8 +173,28 @@ class DeltaDiffGenerator {
 
   // Creates all the edges for the graph. Writers of a block point to
   // readers of the same block. This is because for an edge A->B, B
-  // must complete before A executes.
-  static void CreateEdges(Graph* graph, const std::vector<Block>& blocks);
+  // must complete before A executes. The edges are added on |pool|, split
+  // by writer, and come out the same for any number of threads.
+  static void CreateEdges(Graph* graph,
+                          const BlockOwners& blocks,
+                          ThreadPool* pool);
+
+  // Adds operations to |graph| that write the blocks of the image at
+  // |image_path| that no vertex in |blocks| writes, i.e., the blocks that
+  // aren't file data. The blocks are split into chunks of up to 1024 blocks,
+  // compressed concurrently on |pool| and added in block order. If
+  // SetZeroBlocks() is on, the runs of zero blocks are chunked on their own,
+  // after the others, so that they make up ZERO operations, and the holes of
+  // a sparse image aren't read at all. Each chunk gets a new vertex, which
+  // the vertices that read its blocks must come before, and its blob, if
+  // any, is appended to |blobs_fd| in order. Reads and updates
+  // |blobs_length|. Returns true on success.
+  static bool ReadUnwrittenBlocks(const BlockOwners& blocks,
+                                  int blobs_fd,
+                                  off_t* blobs_length,
+                                  const std::string& image_path,
+                                  ThreadPool* pool,
+                                  Graph* graph);
 
   // Given a topologically sorted graph |op_indexes| and |graph|, alters
   // |op_indexes| to move all the full operations to the end of the vector.
@@ -152,6 +202,20 @@ class DeltaDiffGenerator {
   static void MoveFullOpsToBack(Graph* graph,
                                 std::vector<Vertex::Index>* op_indexes);
 
+  // Reorders the topologically sorted |op_indexes| of the DAG |graph| so
+  // that clients write the new partition as sequentially as the
+  // dependencies allow: the MOVE operations, which need no data, come
+  // first, and each operation is the ready one that writes the lowest block
+  // at or after where the previous one stopped writing.
+  static void OrderForLocality(const Graph& graph,
+                               std::vector<Vertex::Index>* op_indexes);
+
+  // Returns the share, from 0 to 1, of the blocks written by |op_indexes|
+  // of |graph| in that order that are written close after the previous
+  // ones, which is how sequential the writes of the update are.
+  static double WriteLocality(const Graph& graph,
+                              const std::vector<Vertex::Index>& op_indexes);
+
   // Sorts the vector |cuts| by its |cuts[].old_dest| member. Order is
   // determined by the order of elements in op_indexes.
   static void SortCutsByTopoOrder(std::vector<Vertex::Index>& op_indexes,
@@ -167,19 +231,42 @@ class DeltaDiffGenerator {
   // operations in the manifest. E.g. if manifest[0] has a data blob
   // "X" at offset 1, manifest[1] has a data blob "Y" at offset 0,
   // and data_blobs_path's file contains "YX", new_data_blobs_path
-  // will set to be a file that contains "XY".
+  // will set to be a file that contains "XY". The kernel blobs follow the
+  // rootfs ones, unless SetInterleaveKernelBlobs() was called. The blobs are
+  // hashed on the workers of |pool|, or on the calling thread if |pool| is
+  // NULL.
   static bool ReorderDataBlobs(DeltaArchiveManifest* manifest,
                                const std::string& data_blobs_path,
-                               const std::string& new_data_blobs_path);
-
-  // Computes a SHA256 hash of the given buf and sets the hash value in the
-  // operation so that update_engine could verify. This hash should be set
-  // for all operations that have a non-zero data blob. One exception is the
-  // dummy operation for signature blob because the contents of the signature
-  // blob will not be available at payload creation time. So, update_engine will
-  // gracefully ignore the dummy signature operation.
+                               const std::string& new_data_blobs_path,
+                               ThreadPool* pool);
+
+  // The byte ranges of a data blobs file that make up the reordered blobs,
+  // in order, as (offset, length) pairs.
+  typedef std::vector<std::pair<uint64_t, uint64_t> > DataBlobRuns;
+
+  // ReorderDataBlobs() in two steps, so that the reordered blobs can be
+  // copied straight into the payload after the manifest, whose offsets and
+  // hashes the first step sets: OrderDataBlobs() updates |manifest| and
+  // stores the ranges of data_blobs_path to copy in |runs|, which
+  // CopyDataBlobs() then appends at the current position of |out_fd|.
+  static bool OrderDataBlobs(DeltaArchiveManifest* manifest,
+                             const std::string& data_blobs_path,
+                             ThreadPool* pool,
+                             DataBlobRuns* runs);
+  static bool CopyDataBlobs(const std::string& data_blobs_path,
+                            const DataBlobRuns& runs,
+                            int out_fd);
+
+  // Computes a SHA256 hash, or a BLAKE3 one, see SetBlake3OperationHashes(),
+  // of the |size| bytes at |buf| and sets the hash value in the operation
+  // so that update_engine could verify. This hash
+  // should be set for all operations that have a non-zero data blob. One
+  // exception is the dummy operation for signature blob because the contents
+  // of the signature blob will not be available at payload creation time.
+  // So, update_engine will gracefully ignore the dummy signature operation.
   static bool AddOperationHash(DeltaArchiveManifest_InstallOperation* op,
-                               const std::vector<char>& buf);
+                               const char* buf,
+                               size_t size);
 
   // Handles allocation of temp blocks to a cut edge by converting the
   // dest node to a full op. This removes the need for temp blocks, but
@@ -225,24 +312,359 @@ class DeltaDiffGenerator {
                                       const std::string& partition,
                                       PartitionInfo* info);
 
-  // Runs the bsdiff tool on two files and returns the resulting delta in
-  // |out|. Returns true on success.
+  // Sets the old and new kernel and rootfs infos of |manifest| as
+  // InitializePartitionInfo() does, hashing the partitions concurrently.
+  // The partitions whose path is empty are skipped. Returns true on
+  // success.
+  static bool InitializePartitionInfos(const std::string& old_kernel,
+                                       const std::string& new_kernel,
+                                       const std::string& old_rootfs,
+                                       const std::string& new_rootfs,
+                                       DeltaArchiveManifest* manifest);
+
+  // Sets |info| to the dm-verity hash tree of the first |data_size| bytes of
+  // |partition|, in blocks of |info|'s block size, with the salt passed to
+  // SetRootfsHashTree(). The tree goes right after the data.
+  static bool InitializeHashTreeInfo(const std::string& partition,
+                                     uint64_t data_size,
+                                     HashTreeInfo* info);
+
+  // Diffs two files with the in-process bsdiff and returns the resulting
+  // delta in |out|. Returns true on success.
   static bool BsdiffFiles(const std::string& old_file,
                           const std::string& new_file,
                           std::vector<char>* out);
 
-  // The |blocks| vector contains a reader and writer for each block on the
-  // filesystem that's being in-place updated. We populate the reader/writer
-  // fields of |blocks| by calling this function.
-  // For each block in |operation| that is read or written, find that block
-  // in |blocks| and set the reader/writer field to the vertex passed.
+  // Sets the number of threads used to diff the files of the new image and
+  // to compress full update chunks. A value of 0, the default, means one
+  // thread per online CPU. The generated payload doesn't depend on this
+  // setting. Must not be called while a delta is being generated.
+  static void SetNumThreads(unsigned num_threads);
+
+  // Makes the in-process bsdiff keep the suffix arrays of old files in |dir|
+  // and reuse them across runs. Pass an empty string to disable the cache.
+  // Must not be called while a delta is being generated.
+  static void SetSuffixArrayCacheDir(const std::string& dir);
+
+  // Makes the encoded operations of changed files be kept in |dir|, keyed
+  // by the hashes of their old and new data, and reused across runs. Pass
+  // an empty string to disable the cache. Must not be called while a delta
+  // is being generated.
+  static void SetOperationCacheDir(const std::string& dir);
+
+  // Makes the generation of delta payloads be checkpointed in |dir| once
+  // the operations and their data blobs are generated, once the edges are
+  // created and once the graph is made a DAG. A generation with the same
+  // images, kernel partitions and settings resumes from the last checkpoint,
+  // which is removed once the payload is written. Pass an empty string to
+  // disable checkpoints. Must not be called while a delta is being
+  // generated.
+  static void SetCheckpointDir(const std::string& dir);
+
+  // Bounds the memory the threads diffing the files and kernel chunks of a
+  // delta use together to about |bytes|: a chunk is only encoded once the
+  // memory its encoding is estimated to take fits in what the others left,
+  // and the data blobs of the chunks waiting to be added to the payload are
+  // kept in temporary files. A chunk that needs more than the whole budget
+  // is encoded alone. 0, the default, sets no bound. Must not be called
+  // while a delta is being generated.
+  static void SetMemoryBudget(uint64_t bytes);
+
+  // Makes delta payloads be generated for applying from the source
+  // partitions, which clients then don't have to copy to the new ones first.
+  // Such payloads aren't supported by old clients. Off by default. Must not
+  // be called while a delta is being generated.
+  static void SetApplyFromSource(bool from_source);
+
+  // Makes REPLACE_XZ operations be generated where xz compresses the data
+  // at least as well as bzip2, as it's also faster to decompress. Such
+  // payloads aren't supported by old clients. Off by default. Must not be
+  // called while a delta is being generated.
+  static void SetXzCompression(bool xz_compression);
+
+  // Makes ZERO operations be generated in place of full operations whose
+  // new data is all zeros, such as the free blocks of a freshly made file
+  // system, so that clients zero the blocks without downloading or writing
+  // any data. Such payloads aren't supported by old clients. Off by default.
+  // Must not be called while a delta is being generated.
+  static void SetZeroBlocks(bool zero_blocks);
+
+  // Makes each compressor be tried on samples of the data of full operations
+  // of 1 MiB or more first, and not be run on all the data if the samples
+  // show it can't beat sending the data uncompressed. This saves compressing
+  // data that's compressed already, but as the samples only estimate the
+  // compressed size, some data may be sent less compressed than it could be.
+  // Off by default, which keeps the payloads the same. Must not be called
+  // while a delta is being generated.
+  static void SetSampleCompression(bool sample_compression);
+
+  // Makes cycles in the delta graph be broken with a greedy feedback arc set
+  // heuristic rather than by enumerating them, which can take very long on
+  // some images. Off by default. Must not be called while a delta is being
+  // generated.
+  static void SetGreedyCycleBreaking(bool greedy);
+
+  // Makes full operations whose new blocks are all found in the old image
+  // be turned into MOVE operations from there, see
+  // DeduplicateFullOperations(). Off by default. Must not be called while a
+  // delta is being generated.
+  static void SetBlockDeduplication(bool deduplicate);
+
+  // Makes ReorderDataBlobs() spread the kernel blobs over the payload in
+  // proportion to the rootfs ones, rather than put them after all of them,
+  // so that clients write the kernel partition while the rootfs data comes
+  // in instead of after it. Such payloads aren't supported by old clients,
+  // which apply the rootfs operations first. Off by default. Must not be
+  // called while a delta is being generated.
+  static void SetInterleaveKernelBlobs(bool interleave);
+
+  // Makes GenerateDeltaUpdateFile() index the data blobs of each partition
+  // in the manifest, see AddPayloadSegments(). Old clients ignore the index.
+  // Off by default. Must not be called while a delta is being generated.
+  static void SetPayloadSegments(bool segments);
+
+  // Makes GenerateDeltaUpdateFile() flag the delta operations whose source
+  // blocks a later operation reads again, see AddSourceReuseHints(), so that
+  // clients keep only those in their block cache. Old clients ignore the
+  // hints. Off by default. Must not be called while a delta is being
+  // generated.
+  static void SetSourceReuseHints(bool hints);
+
+  // Makes delta operations be ordered for the locality of their writes, see
+  // OrderForLocality(), rather than in the order that breaks the cycles of
+  // the graph. The blobs follow the operations. Off by default. Must not be
+  // called while a delta is being generated.
+  static void SetLocalityOrdering(bool locality);
+
+  // Makes the new files without an old file at their path be diffed against
+  // the removed old file most similar to them, by the MinHash sketches of
+  // their contents, if any is similar enough, rather than sent whole. That
+  // catches renamed files and those with a version in their name. Off by
+  // default. Must not be called while a delta is being generated.
+  static void SetSimilarFileMatching(bool similar);
+
+  // Makes the operations' blobs be hashed with BLAKE3, into their
+  // data_blake3_hash, rather than with SHA-256. That's cheaper for clients
+  // without SHA-256 instructions to verify, but only clients that know the
+  // field can. The payload's signed hash stays SHA-256. Off by default. Must
+  // not be called while a delta is being generated.
+  static void SetBlake3OperationHashes(bool blake3);
+
+  // Makes files larger than |chunk_size| bytes be diffed in chunks of that
+  // many bytes, each with its own operation, which bounds the memory and
+  // time it takes to diff each of them. |chunk_size| must be a multiple of
+  // the block size; -1, the default, diffs files whole. Must not be called
+  // while a delta is being generated.
+  static void SetChunkSize(off_t chunk_size);
+
+  // Makes the kernel partition be diffed in chunks of |chunk_size| bytes,
+  // concurrently, each with its own operation, rather than whole. Clients
+  // then patch the chunks independently, in bounded memory. |chunk_size|
+  // must be a multiple of the block size; -1, the default, diffs the
+  // partition whole. Must not be called while a delta is being generated.
+  static void SetKernelChunkSize(off_t chunk_size);
+
+  // Makes InitializePartitionInfo() also list the hashes of the consecutive
+  // |chunk_size|-byte chunks of the partitions, which clients can verify in
+  // parallel. 0, the default, lists none. Must not be called while a delta
+  // is being generated.
+  static void SetPartitionHashChunkSize(uint64_t chunk_size);
+
+  // Makes GenerateDeltaUpdateFile() describe the dm-verity hash tree of the
+  // new rootfs, hashed with |salt|, so that clients build it as they write
+  // the partition rather than reading it back. Off by default. Must not be
+  // called while a delta is being generated.
+  static void SetRootfsHashTree(bool hash_tree,
+                                const std::vector<char>& salt);
+
+  // Makes GenerateDeltaUpdateFile() list the hash of the blocks each
+  // operation writes, see AddDestinationHashes(), so that clients can verify
+  // the new partitions as they write them. Old clients ignore the hashes.
+  // Off by default. Must not be called while a delta is being generated.
+  static void SetDestinationHashes(bool hashes);
+
+  // Makes GenerateDeltaUpdateFile() merge the consecutive full operations
+  // that each write less than |size| bytes into operations of up to |size|
+  // bytes, see FuseSmallOperations(). 0, the default, merges none. |size|
+  // must be a multiple of the block size. Must not be called while a delta
+  // is being generated.
+  static void SetOperationFusionSize(uint64_t size);
+
+  // Makes GenerateDeltaUpdateFile() write payloads of file format version
+  // kCompactManifestVersion, whose manifest has its extents packed, see
+  // CompactManifest(). Such payloads are only supported by newer clients.
+  // Off by default. Must not be called while a delta is being generated.
+  static void SetCompactManifest(bool compact);
+
+  // Makes the generator record the time spent in each of its phases and on
+  // encoding each file in |profile|, which isn't owned. Pass NULL, the
+  // default, to record nothing. Must not be called while a delta is being
+  // generated.
+  static void SetProfile(GeneratorProfile* profile);
+
+  // Makes operations be chosen to minimize the time clients are estimated
+  // to take to download and apply them under a copy of |model|, rather than
+  // the size of their blobs. Pass NULL, the default, to choose the smallest
+  // blobs. Must not be called while a delta is being generated.
+  static void SetApplyCostModel(const ApplyCostModel* model);
+
+  // Makes GenerateDeltaUpdateFile() read the files of the old and new images
+  // straight from the images with libext2fs, see ImageFileTree, rather than
+  // from where they're mounted, which then needn't be passed. This takes no
+  // root privileges or loop devices, and the extents of the files are
+  // exact. Off by default. Must not be called while a delta is being
+  // generated.
+  static void SetReadImages(bool read);
+
+  // Makes STREAM_DIFF operations be tried wherever BSDIFF ones are, and be
+  // chosen over a BSDIFF if their blob is at most |margin| percent bigger,
+  // since clients apply them much quicker and in bounded memory. Otherwise
+  // they compete with the full operation like BSDIFF does. Such payloads
+  // aren't supported by old clients. -1, the default, generates none. Must
+  // not be called while a delta is being generated.
+  static void SetStreamDiffMargin(int margin);
+
+  // Makes GenerateDeltaUpdateFile() only encode the changed file chunks of
+  // shard |index| of |count|, into the cache set with SetOperationCacheDir(),
+  // and write no payload. Generators encoding each shard with a shared cache
+  // directory thus split the work of a delta, and an unsharded run then
+  // finds it all in the cache and builds the payload, which doesn't depend
+  // on the sharding. A |count| of 0, the default, encodes all chunks. Must
+  // not be called while a delta is being generated.
+  static void SetDiffShard(int index, int count);
+
+  // Makes full payloads use blocks of |block_size| bytes, a power of two
+  // from 4 KiB to the size of their operations, which cuts the number of
+  // extents in the manifest and the per-block work of clients. Deltas
+  // follow the 4 KiB blocks of the filesystems and ignore it. Must not be
+  // called while a payload is being generated.
+  static void SetBlockSize(uint64_t block_size);
+
+  // Makes full payloads size their operations by the data they write, from
+  // |min_chunk_size| to |max_chunk_size| bytes, see FullUpdateGenerator::Run(),
+  // rather than make them all 1 MiB. Both must be multiples of the block
+  // size, around 1 MiB. The default, 1 MiB for both, sizes all the same. Must
+  // not be called while a payload is being generated.
+  static void SetFullChunkSizeBounds(off_t min_chunk_size,
+                                     off_t max_chunk_size);
+
+  // Makes deltas train an xz dictionary of up to |size| bytes on the small
+  // files of the new image, which is carried once in the manifest, and
+  // compress the small files that have much in common with it into
+  // REPLACE_XZ_DICT operations. Such payloads are only supported by newer
+  // clients. 0, the default, trains none. Must not be called while a delta
+  // is being generated.
+  static void SetXzDictionarySize(size_t size);
+
+  // Returns the shard, of |count|, that encodes the chunk of the file at
+  // |path| starting at |chunk_offset|. Whole files have offset 0.
+  static int DiffShardOf(const std::string& path,
+                         off_t chunk_offset,
+                         int count);
+
+  // Sets |paths| to the regular files within |new_root|, relative to it, in
+  // the order they're diffed against |old_root|: scanned |window| files at
+  // a time, each batch in the order of their blocks. The directories are
+  // read on |pool|. Returns true on success.
+  static bool ListFilesInDiffOrder(const std::string& old_root,
+                                   const std::string& new_root,
+                                   size_t window,
+                                   ThreadPool* pool,
+                                   std::vector<std::string>* paths);
+
+  // Returns true if an operation of type |type| with a |blob_size|-byte
+  // blob should be chosen over one of type |other_type| with an
+  // |other_blob_size|-byte blob, both producing |dst_length| bytes from
+  // |src_length| bytes of old data: if clients are estimated to apply it
+  // quicker under the model set with SetApplyCostModel() or, without one,
+  // if its blob is smaller.
+  static bool IsCheaperOperation(
+      DeltaArchiveManifest_InstallOperation_Type type,
+      uint64_t blob_size,
+      DeltaArchiveManifest_InstallOperation_Type other_type,
+      uint64_t other_blob_size,
+      uint64_t src_length,
+      uint64_t dst_length);
+
+  // Stores the cheapest encoding of the new |data| of a full operation in
+  // |out| and its type (REPLACE, REPLACE_BZ, REPLACE_XZ or REPLACE_XZ_DICT)
+  // in |out_type|: the smallest one, preferring the uncompressed data and
+  // then xz on ties since they're faster to apply. Data that's all zeros is
+  // a ZERO operation with no |out| data instead, see SetZeroBlocks(). With
+  // an apply cost model, the quickest to apply is chosen instead.
+  // With SetSampleCompression(), compressors that samples of large data show
+  // can't beat the uncompressed data aren't tried. Only small data is tried
+  // with the xz dictionary of the delta being generated, see
+  // SetXzDictionarySize(). Returns true on success. The second form takes
+  // the |size| bytes at |data|.
+  static bool CompressReplaceData(
+      const std::vector<char>& data,
+      std::vector<char>* out,
+      DeltaArchiveManifest_InstallOperation_Type* out_type);
+  static bool CompressReplaceData(
+      const char* data,
+      size_t size,
+      std::vector<char>* out,
+      DeltaArchiveManifest_InstallOperation_Type* out_type);
+
+  // Returns true if the |size| bytes at |data| look compressed already, so
+  // that CompressReplaceData() doesn't compress them: samples of them have
+  // a high entropy and they barely repeat themselves. Data too small to be
+  // probed doesn't.
+  static bool LooksIncompressible(const char* data, size_t size);
+
+  // Records |vertex| as the reader and writer of the blocks |operation|
+  // reads and writes in |blocks|, which tells the reader and writer of
+  // each block of the filesystem that's being in-place updated.
   // |graph| is not strictly necessary, but useful for printing out
   // error messages.
   static bool AddInstallOpToBlocksVector(
       const DeltaArchiveManifest_InstallOperation& operation,
       const Graph& graph,
       Vertex::Index vertex,
-      std::vector<DeltaDiffGenerator::Block>* blocks);
+      BlockOwners* blocks);
+
+  // Sets the segments of |manifest| to the runs of consecutive data blobs of
+  // the operations of each partition, in payload order. Must be called once
+  // the blobs are laid out, before AddSignatureOp().
+  static void AddPayloadSegments(DeltaArchiveManifest* manifest);
+
+  // Sets the src_reused flag of the operations of |manifest| that read a
+  // source block that an operation applied after them reads too, before any
+  // overwrites it, and clears it for the others. Also sets src_reuse_hints.
+  // Must be called once the operations are in their final order.
+  static void AddSourceReuseHints(DeltaArchiveManifest* manifest);
+
+  // Merges each run of consecutive full operations in |order| that write
+  // less than the operation fusion size, see SetOperationFusionSize(), into
+  // the first one of the run, as long as the merged operation writes no more
+  // than that. The data of the run is decompressed from |data_fd|, where the
+  // blobs of |graph| are, and compressed again as one blob appended to it at
+  // |*data_file_size|. The operations merged into another are dropped from
+  // |order|. Since the operations of a run are next to each other in the
+  // order, this doesn't change what clients write. Returns true on success.
+  static bool FuseSmallOperations(Graph* graph,
+                                  std::vector<Vertex::Index>* order,
+                                  int data_fd,
+                                  off_t* data_file_size);
+
+  // Sets the destination hash of each operation of |manifest| to the hash of
+  // the blocks it writes, as they are in the new partitions |new_kernel|, if
+  // not empty, and |new_rootfs|, unless some of the blocks are sparse holes
+  // or written by other operations too. DISCARD operations get none. The new
+  // partition infos must be set. Returns true on success.
+  static bool AddDestinationHashes(const std::string& new_kernel,
+                                   const std::string& new_rootfs,
+                                   DeltaArchiveManifest* manifest);
+
+  // Writes the metadata of a payload with |manifest| to |writer|: the magic,
+  // the version and the manifest, packed if |compact|, see
+  // SetCompactManifest(). The data blobs and the signature go after it. Sets
+  // |metadata_size| to the size of the metadata. Returns true on success.
+  static bool WritePayloadHeader(const DeltaArchiveManifest& manifest,
+                                 bool compact,
+                                 FileWriter* writer,
+                                 uint64_t* metadata_size);
 
   // Adds to |manifest| a dummy operation that points to a signature blob
   // located at the specified offset/length.
@@ -255,7 +677,6 @@ class DeltaDiffGenerator {
   DISALLOW_IMPLICIT_CONSTRUCTORS(DeltaDiffGenerator);
 };
 
-extern const char* const kBsdiffPath;
 extern const char* const kBspatchPath;
 extern const char* const kDeltaMagic;
 
@@ -2,33 +2,49 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <sys/mount.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <stdlib.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <set>
 #include <sstream>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include <base/file_path.h>
 #include <base/logging.h>
 #include <base/string_util.h>
+#include <base/stringprintf.h>
 #include <gtest/gtest.h>
 
+#include "update_engine/apply_cost_model.h"
+#include "update_engine/blake3.h"
+#include "update_engine/bzip.h"
 #include "update_engine/cycle_breaker.h"
+#include "update_engine/delta_chain.h"
 #include "update_engine/delta_diff_generator.h"
 #include "update_engine/delta_performer.h"
+#include "update_engine/extent_mapper.h"
 #include "update_engine/extent_ranges.h"
 #include "update_engine/graph_types.h"
 #include "update_engine/graph_utils.h"
+#include "update_engine/omaha_hash_calculator.h"
+#include "update_engine/payload_signer.h"
+#include "update_engine/prefs.h"
 #include "update_engine/subprocess.h"
 #include "update_engine/test_utils.h"
+#include "update_engine/thread_pool.h"
 #include "update_engine/topological_sort.h"
 #include "update_engine/utils.h"
+#include "update_engine/xz.h"
 
 using std::make_pair;
+using std::min;
 using std::set;
 using std::string;
 using std::stringstream;
@@ -36,7 +52,6 @@ using std::vector;
 
 namespace chromeos_update_engine {
 
-typedef DeltaDiffGenerator::Block Block;
 
 namespace {
 int64_t BlocksInExtents(
@@ -49,6 +64,39 @@ int64_t BlocksInExtents(
 }
 }  // namespace {}
 
+namespace {
+// Runs DeltaDiffGenerator::ReadUnwrittenBlocks() on the image at
+// |image_path| with the owners in |blocks| on a pool of |num_threads|
+// threads, and a graph whose only vertex is the one that owns blocks. Sets
+// |graph| to the resulting graph and |blobs| to the blobs it wrote.
+void ReadUnwrittenBlocksWithThreads(const BlockOwners& blocks,
+                                    const string& image_path,
+                                    unsigned num_threads,
+                                    Graph* graph,
+                                    vector<char>* blobs) {
+  string blobs_path;
+  int blobs_fd = -1;
+  ASSERT_TRUE(utils::MakeTempFile("ReadUnwrittenBlocksTest.blobs.XXXXXX",
+                                  &blobs_path,
+                                  &blobs_fd));
+  ScopedPathUnlinker blobs_unlinker(blobs_path);
+  ScopedFdCloser blobs_fd_closer(&blobs_fd);
+  ThreadPool pool(num_threads);
+  ASSERT_TRUE(pool.Init());
+  graph->clear();
+  graph->resize(1);
+  off_t blobs_length = 0;
+  EXPECT_TRUE(DeltaDiffGenerator::ReadUnwrittenBlocks(blocks,
+                                                      blobs_fd,
+                                                      &blobs_length,
+                                                      image_path,
+                                                      &pool,
+                                                      graph));
+  EXPECT_TRUE(utils::ReadFile(blobs_path, blobs));
+  EXPECT_EQ(blobs_length, blobs->size());
+}
+}  // namespace {}
+
 class DeltaDiffGeneratorTest : public ::testing::Test {
  protected:
   const string old_path() { return "DeltaDiffGeneratorTest-old_path"; }
@@ -70,6 +118,8 @@ TEST_F(DeltaDiffGeneratorTest, RunAsRootMoveSmallTest) {
   DeltaArchiveManifest_InstallOperation op;
   EXPECT_TRUE(DeltaDiffGenerator::ReadFileToDiff(old_path(),
                                                  new_path(),
+                                                 0,  // chunk_offset
+                                                 -1,  // chunk_size
                                                  true, // bsdiff_allowed
                                                  &data,
                                                  &op,
@@ -100,6 +150,8 @@ TEST_F(DeltaDiffGeneratorTest, RunAsRootBsdiffSmallTest) {
   DeltaArchiveManifest_InstallOperation op;
   EXPECT_TRUE(DeltaDiffGenerator::ReadFileToDiff(old_path(),
                                                  new_path(),
+                                                 0,  // chunk_offset
+                                                 -1,  // chunk_size
                                                  true, // bsdiff_allowed
                                                  &data,
                                                  &op,
@@ -131,6 +183,8 @@ TEST_F(DeltaDiffGeneratorTest, RunAsRootBsdiffNotAllowedTest) {
 
   EXPECT_TRUE(DeltaDiffGenerator::ReadFileToDiff(old_path(),
                                                  new_path(),
+                                                 0,  // chunk_offset
+                                                 -1,  // chunk_size
                                                  false, // bsdiff_allowed
                                                  &data,
                                                  &op,
@@ -155,6 +209,8 @@ TEST_F(DeltaDiffGeneratorTest, RunAsRootBsdiffNotAllowedMoveTest) {
 
   EXPECT_TRUE(DeltaDiffGenerator::ReadFileToDiff(old_path(),
                                                  new_path(),
+                                                 0,  // chunk_offset
+                                                 -1,  // chunk_size
                                                  false, // bsdiff_allowed
                                                  &data,
                                                  &op,
@@ -180,6 +236,8 @@ TEST_F(DeltaDiffGeneratorTest, RunAsRootReplaceSmallTest) {
     DeltaArchiveManifest_InstallOperation op;
     EXPECT_TRUE(DeltaDiffGenerator::ReadFileToDiff(old_path(),
                                                    new_path(),
+                                                   0,  // chunk_offset
+                                                   -1,  // chunk_size
                                                    true, // bsdiff_allowed
                                                    &data,
                                                    &op,
@@ -212,6 +270,8 @@ TEST_F(DeltaDiffGeneratorTest, RunAsRootBsdiffNoGatherExtentsSmallTest) {
   DeltaArchiveManifest_InstallOperation op;
   EXPECT_TRUE(DeltaDiffGenerator::ReadFileToDiff(old_path(),
                                                  new_path(),
+                                                 0,  // chunk_offset
+                                                 -1,  // chunk_size
                                                  true, // bsdiff_allowed
                                                  &data,
                                                  &op,
@@ -232,6 +292,57 @@ TEST_F(DeltaDiffGeneratorTest, RunAsRootBsdiffNoGatherExtentsSmallTest) {
   EXPECT_EQ(sizeof(kRandomString), op.dst_length());
 }
 
+TEST_F(DeltaDiffGeneratorTest, RunAsRootChunkNoGatherExtentsTest) {
+  // The old file is two blocks, the new one three. The middle chunk is
+  // unchanged and the last one is new.
+  const size_t kBlockSize = 4096;
+  vector<char> old_data(2 * kBlockSize);
+  FillWithData(&old_data);
+  vector<char> new_data(old_data);
+  new_data.insert(new_data.end(), kBlockSize, 'a');
+  EXPECT_TRUE(WriteFileVector(old_path(), old_data));
+  EXPECT_TRUE(WriteFileVector(new_path(), new_data));
+
+  vector<char> data;
+  DeltaArchiveManifest_InstallOperation op;
+  EXPECT_TRUE(DeltaDiffGenerator::ReadFileToDiff(old_path(),
+                                                 new_path(),
+                                                 kBlockSize,  // chunk_offset
+                                                 kBlockSize,  // chunk_size
+                                                 true, // bsdiff_allowed
+                                                 &data,
+                                                 &op,
+                                                 false));
+  EXPECT_TRUE(data.empty());
+  EXPECT_EQ(DeltaArchiveManifest_InstallOperation_Type_MOVE, op.type());
+  EXPECT_EQ(1, op.src_extents_size());
+  EXPECT_EQ(1, op.src_extents().Get(0).start_block());
+  EXPECT_EQ(1, op.src_extents().Get(0).num_blocks());
+  EXPECT_EQ(kBlockSize, op.src_length());
+  EXPECT_EQ(1, op.dst_extents_size());
+  EXPECT_EQ(1, op.dst_extents().Get(0).start_block());
+  EXPECT_EQ(1, op.dst_extents().Get(0).num_blocks());
+  EXPECT_EQ(kBlockSize, op.dst_length());
+
+  op.Clear();
+  EXPECT_TRUE(DeltaDiffGenerator::ReadFileToDiff(old_path(),
+                                                 new_path(),
+                                                 2 * kBlockSize,
+                                                 kBlockSize,
+                                                 true, // bsdiff_allowed
+                                                 &data,
+                                                 &op,
+                                                 false));
+  EXPECT_FALSE(data.empty());
+  EXPECT_NE(DeltaArchiveManifest_InstallOperation_Type_MOVE, op.type());
+  EXPECT_NE(DeltaArchiveManifest_InstallOperation_Type_BSDIFF, op.type());
+  EXPECT_EQ(0, op.src_extents_size());
+  EXPECT_EQ(1, op.dst_extents_size());
+  EXPECT_EQ(2, op.dst_extents().Get(0).start_block());
+  EXPECT_EQ(1, op.dst_extents().Get(0).num_blocks());
+  EXPECT_EQ(kBlockSize, op.dst_length());
+}
+
 namespace {
 void AppendExtent(vector<Extent>* vect, uint64_t start, uint64_t length) {
   vect->resize(vect->size() + 1);
@@ -282,7 +393,7 @@ TEST_F(DeltaDiffGeneratorTest, SubstituteBlocksTest) {
 
 TEST_F(DeltaDiffGeneratorTest, CutEdgesTest) {
   Graph graph;
-  vector<Block> blocks(9);
+  BlockOwners blocks(9);
 
   // Create nodes in graph
   {
@@ -295,9 +406,6 @@ TEST_F(DeltaDiffGeneratorTest, CutEdgesTest) {
     graph_utils::AppendBlockToExtents(&extents, 7);
     DeltaDiffGenerator::StoreExtents(extents,
                                      graph.back().op.mutable_src_extents());
-    blocks[3].reader = graph.size() - 1;
-    blocks[5].reader = graph.size() - 1;
-    blocks[7].reader = graph.size() - 1;
 
     // Writes to blocks 1, 2, 4
     extents.clear();
@@ -306,9 +414,8 @@ TEST_F(DeltaDiffGeneratorTest, CutEdgesTest) {
     graph_utils::AppendBlockToExtents(&extents, 4);
     DeltaDiffGenerator::StoreExtents(extents,
                                      graph.back().op.mutable_dst_extents());
-    blocks[1].writer = graph.size() - 1;
-    blocks[2].writer = graph.size() - 1;
-    blocks[4].writer = graph.size() - 1;
+    EXPECT_TRUE(DeltaDiffGenerator::AddInstallOpToBlocksVector(
+        graph.back().op, graph, graph.size() - 1, &blocks));
   }
   {
     graph.resize(graph.size() + 1);
@@ -320,9 +427,6 @@ TEST_F(DeltaDiffGeneratorTest, CutEdgesTest) {
     graph_utils::AppendBlockToExtents(&extents, 4);
     DeltaDiffGenerator::StoreExtents(extents,
                                      graph.back().op.mutable_src_extents());
-    blocks[1].reader = graph.size() - 1;
-    blocks[2].reader = graph.size() - 1;
-    blocks[4].reader = graph.size() - 1;
 
     // Writes to blocks 3, 5, 6
     extents.clear();
@@ -331,13 +435,14 @@ TEST_F(DeltaDiffGeneratorTest, CutEdgesTest) {
     graph_utils::AppendBlockToExtents(&extents, 6);
     DeltaDiffGenerator::StoreExtents(extents,
                                      graph.back().op.mutable_dst_extents());
-    blocks[3].writer = graph.size() - 1;
-    blocks[5].writer = graph.size() - 1;
-    blocks[6].writer = graph.size() - 1;
+    EXPECT_TRUE(DeltaDiffGenerator::AddInstallOpToBlocksVector(
+        graph.back().op, graph, graph.size() - 1, &blocks));
   }
 
   // Create edges
-  DeltaDiffGenerator::CreateEdges(&graph, blocks);
+  ThreadPool pool(2);
+  ASSERT_TRUE(pool.Init());
+  DeltaDiffGenerator::CreateEdges(&graph, blocks, &pool);
 
   // Find cycles
   CycleBreaker cycle_breaker;
@@ -400,6 +505,51 @@ TEST_F(DeltaDiffGeneratorTest, CutEdgesTest) {
   EXPECT_TRUE(graph[1].out_edges.end() != graph[1].out_edges.find(2));
 }
 
+TEST_F(DeltaDiffGeneratorTest, CreateEdgesThreadsTest) {
+  // Each of the vertices writes and reads three blocks spread over the
+  // partition, so that most of them have edges to several others.
+  const Vertex::Index kVertices = 100;
+  vector<uint64_t> written, read;
+  for (uint64_t i = 0; i < kVertices * 3; i++) {
+    written.push_back(i);
+    read.push_back(i);
+  }
+  srandom(1);
+  std::random_shuffle(written.begin(), written.end());
+  std::random_shuffle(read.begin(), read.end());
+  Graph graph(kVertices);
+  BlockOwners blocks(kVertices * 3);
+  for (Vertex::Index i = 0; i < kVertices; i++) {
+    vector<Extent> extents;
+    for (int j = 0; j < 3; j++)
+      graph_utils::AppendBlockToExtents(&extents, written[i * 3 + j]);
+    DeltaDiffGenerator::StoreExtents(extents,
+                                     graph[i].op.mutable_dst_extents());
+    extents.clear();
+    for (int j = 0; j < 3; j++)
+      graph_utils::AppendBlockToExtents(&extents, read[i * 3 + j]);
+    DeltaDiffGenerator::StoreExtents(extents,
+                                     graph[i].op.mutable_src_extents());
+    EXPECT_TRUE(DeltaDiffGenerator::AddInstallOpToBlocksVector(
+        graph[i].op, graph, i, &blocks));
+  }
+
+  // The edges come out the same whatever the number of threads.
+  Graph single_graph = graph;
+  ThreadPool single_pool(1);
+  ASSERT_TRUE(single_pool.Init());
+  DeltaDiffGenerator::CreateEdges(&single_graph, blocks, &single_pool);
+  ThreadPool pool(4);
+  ASSERT_TRUE(pool.Init());
+  DeltaDiffGenerator::CreateEdges(&graph, blocks, &pool);
+  size_t edges = 0;
+  for (Vertex::Index i = 0; i < kVertices; i++) {
+    EXPECT_TRUE(single_graph[i].out_edges == graph[i].out_edges);
+    edges += graph[i].out_edges.size();
+  }
+  EXPECT_GT(edges, kVertices);
+}
+
 TEST_F(DeltaDiffGeneratorTest, ReorderBlobsTest) {
   string orig_blobs;
   EXPECT_TRUE(
@@ -424,7 +574,8 @@ TEST_F(DeltaDiffGeneratorTest, ReorderBlobsTest) {
 
   EXPECT_TRUE(DeltaDiffGenerator::ReorderDataBlobs(&manifest,
                                                    orig_blobs,
-                                                   new_blobs));
+                                                   new_blobs,
+                                                   NULL));
 
   string new_data;
   EXPECT_TRUE(utils::ReadFile(new_blobs, &new_data));
@@ -439,6 +590,149 @@ TEST_F(DeltaDiffGeneratorTest, ReorderBlobsTest) {
   unlink(new_blobs.c_str());
 }
 
+TEST_F(DeltaDiffGeneratorTest, ReorderAdjacentBlobsTest) {
+  // The first two blobs are copied together.
+  string orig_blobs;
+  EXPECT_TRUE(utils::MakeTempFile("ReorderAdjacentBlobsTest.orig.XXXXXX",
+                                  &orig_blobs,
+                                  NULL));
+  ScopedPathUnlinker orig_blobs_unlinker(orig_blobs);
+  EXPECT_TRUE(WriteFileString(orig_blobs, "abcdefg"));
+  string new_blobs;
+  EXPECT_TRUE(utils::MakeTempFile("ReorderAdjacentBlobsTest.new.XXXXXX",
+                                  &new_blobs,
+                                  NULL));
+  ScopedPathUnlinker new_blobs_unlinker(new_blobs);
+
+  DeltaArchiveManifest manifest;
+  const int kOffsets[] = { 2, 4, 0 };
+  const int kLengths[] = { 2, 3, 2 };
+  for (size_t i = 0; i < arraysize(kOffsets); i++) {
+    DeltaArchiveManifest_InstallOperation* op =
+        manifest.add_install_operations();
+    op->set_data_offset(kOffsets[i]);
+    op->set_data_length(kLengths[i]);
+  }
+  manifest.add_install_operations();
+  ThreadPool pool(2);
+  ASSERT_TRUE(pool.Init());
+  EXPECT_TRUE(DeltaDiffGenerator::ReorderDataBlobs(&manifest,
+                                                   orig_blobs,
+                                                   new_blobs,
+                                                   &pool));
+
+  string new_data;
+  EXPECT_TRUE(utils::ReadFile(new_blobs, &new_data));
+  EXPECT_EQ("cdefgab", new_data);
+  const int kNewOffsets[] = { 0, 2, 5 };
+  for (size_t i = 0; i < arraysize(kNewOffsets); i++) {
+    const DeltaArchiveManifest_InstallOperation& op =
+        manifest.install_operations(i);
+    EXPECT_EQ(kNewOffsets[i], op.data_offset());
+    vector<char> hash;
+    EXPECT_TRUE(OmahaHashCalculator::RawHashOfBytes(
+        new_data.data() + kNewOffsets[i], kLengths[i], &hash));
+    EXPECT_EQ(string(hash.begin(), hash.end()), op.data_sha256_hash());
+  }
+  EXPECT_FALSE(manifest.install_operations(3).has_data_offset());
+}
+
+TEST_F(DeltaDiffGeneratorTest, OrderAndCopyDataBlobsTest) {
+  // The blobs are appended after what's already in the output file.
+  string orig_blobs;
+  EXPECT_TRUE(utils::MakeTempFile("OrderAndCopyDataBlobsTest.orig.XXXXXX",
+                                  &orig_blobs,
+                                  NULL));
+  ScopedPathUnlinker orig_blobs_unlinker(orig_blobs);
+  EXPECT_TRUE(WriteFileString(orig_blobs, "abcdefg"));
+  string payload;
+  int payload_fd = -1;
+  EXPECT_TRUE(utils::MakeTempFile("OrderAndCopyDataBlobsTest.out.XXXXXX",
+                                  &payload,
+                                  &payload_fd));
+  ScopedPathUnlinker payload_unlinker(payload);
+  ScopedFdCloser payload_fd_closer(&payload_fd);
+  EXPECT_TRUE(utils::WriteAll(payload_fd, "header", 6));
+
+  DeltaArchiveManifest manifest;
+  const int kOffsets[] = { 2, 4, 0 };
+  const int kLengths[] = { 2, 3, 2 };
+  for (size_t i = 0; i < arraysize(kOffsets); i++) {
+    DeltaArchiveManifest_InstallOperation* op =
+        manifest.add_install_operations();
+    op->set_data_offset(kOffsets[i]);
+    op->set_data_length(kLengths[i]);
+  }
+  DeltaDiffGenerator::DataBlobRuns runs;
+  EXPECT_TRUE(DeltaDiffGenerator::OrderDataBlobs(&manifest,
+                                                 orig_blobs,
+                                                 NULL,
+                                                 &runs));
+  ASSERT_EQ(2, runs.size());
+  EXPECT_EQ(2, runs[0].first);
+  EXPECT_EQ(5, runs[0].second);
+  EXPECT_EQ(0, runs[1].first);
+  EXPECT_EQ(2, runs[1].second);
+  EXPECT_EQ(0, manifest.install_operations(0).data_offset());
+  EXPECT_EQ(2, manifest.install_operations(1).data_offset());
+  EXPECT_EQ(5, manifest.install_operations(2).data_offset());
+
+  EXPECT_TRUE(DeltaDiffGenerator::CopyDataBlobs(orig_blobs, runs,
+                                                payload_fd));
+  string payload_data;
+  EXPECT_TRUE(utils::ReadFile(payload, &payload_data));
+  EXPECT_EQ("headercdefgab", payload_data);
+}
+
+TEST_F(DeltaDiffGeneratorTest, ReorderInterleavedBlobsTest) {
+  string orig_blobs;
+  EXPECT_TRUE(utils::MakeTempFile("ReorderInterleavedBlobsTest.orig.XXXXXX",
+                                  &orig_blobs,
+                                  NULL));
+  ScopedPathUnlinker orig_blobs_unlinker(orig_blobs);
+  EXPECT_TRUE(WriteFileString(orig_blobs, "aaaabbbbccccddddxxyy"));
+  string new_blobs;
+  EXPECT_TRUE(utils::MakeTempFile("ReorderInterleavedBlobsTest.new.XXXXXX",
+                                  &new_blobs,
+                                  NULL));
+  ScopedPathUnlinker new_blobs_unlinker(new_blobs);
+
+  DeltaArchiveManifest manifest;
+  for (int i = 0; i < 4; i++) {
+    DeltaArchiveManifest_InstallOperation* op =
+        manifest.add_install_operations();
+    op->set_data_offset(i * 4);
+    op->set_data_length(4);
+  }
+  for (int i = 0; i < 2; i++) {
+    DeltaArchiveManifest_InstallOperation* op =
+        manifest.add_kernel_install_operations();
+    op->set_data_offset(16 + i * 2);
+    op->set_data_length(2);
+  }
+  DeltaDiffGenerator::SetInterleaveKernelBlobs(true);
+  EXPECT_TRUE(DeltaDiffGenerator::ReorderDataBlobs(&manifest,
+                                                   orig_blobs,
+                                                   new_blobs,
+                                                   NULL));
+  DeltaDiffGenerator::SetInterleaveKernelBlobs(false);
+
+  // The kernel blobs are spread in proportion to the rootfs ones.
+  string new_data;
+  EXPECT_TRUE(utils::ReadFile(new_blobs, &new_data));
+  EXPECT_EQ("aaaaxxbbbbccccyydddd", new_data);
+  EXPECT_EQ(4, manifest.kernel_install_operations(0).data_offset());
+  EXPECT_EQ(14, manifest.kernel_install_operations(1).data_offset());
+
+  // Clients apply the operations in the order of their blobs.
+  vector<size_t> order;
+  DeltaPerformer::GetOperationOrder(manifest, &order);
+  const size_t kExpectedOrder[] = { 0, 4, 1, 2, 5, 3 };
+  EXPECT_EQ(vector<size_t>(kExpectedOrder,
+                           kExpectedOrder + arraysize(kExpectedOrder)),
+            order);
+}
+
 TEST_F(DeltaDiffGeneratorTest, MoveFullOpsToBackTest) {
   Graph graph(4);
   graph[0].file_name = "A";
@@ -463,6 +757,62 @@ TEST_F(DeltaDiffGeneratorTest, MoveFullOpsToBackTest) {
   EXPECT_EQ(graph[vect[3]].file_name, "C");
 }
 
+TEST_F(DeltaDiffGeneratorTest, OrderForLocalityTest) {
+  Graph graph(5);
+  graph[0].op.set_type(DeltaArchiveManifest_InstallOperation_Type_BSDIFF);
+  *(graph[0].op.add_dst_extents()) = ExtentForRange(40, 10);
+  graph[1].op.set_type(DeltaArchiveManifest_InstallOperation_Type_REPLACE);
+  *(graph[1].op.add_dst_extents()) = ExtentForRange(10, 10);
+  graph[2].op.set_type(DeltaArchiveManifest_InstallOperation_Type_MOVE);
+  *(graph[2].op.add_dst_extents()) = ExtentForRange(60, 10);
+  graph[3].op.set_type(DeltaArchiveManifest_InstallOperation_Type_BSDIFF);
+  *(graph[3].op.add_dst_extents()) = ExtentForRange(20, 10);
+  graph[4].op.set_type(DeltaArchiveManifest_InstallOperation_Type_REPLACE);
+  *(graph[4].op.add_dst_extents()) = ExtentForRange(0, 10);
+  // 3 reads blocks that 4 writes, so 3 must be applied before 4.
+  graph[4].out_edges[3] = EdgeProperties();
+
+  vector<Vertex::Index> order;
+  order.push_back(2);
+  order.push_back(0);
+  order.push_back(3);
+  order.push_back(1);
+  order.push_back(4);
+  const double locality = DeltaDiffGenerator::WriteLocality(graph, order);
+  DeltaDiffGenerator::OrderForLocality(graph, &order);
+
+  // The MOVE comes first, then the writes sweep up from where it stopped
+  // and start over from the lowest block that's been held back.
+  ASSERT_EQ(5, order.size());
+  EXPECT_EQ(2, order[0]);
+  EXPECT_EQ(1, order[1]);
+  EXPECT_EQ(3, order[2]);
+  EXPECT_EQ(0, order[3]);
+  EXPECT_EQ(4, order[4]);
+  EXPECT_GT(DeltaDiffGenerator::WriteLocality(graph, order), locality);
+}
+
+TEST_F(DeltaDiffGeneratorTest, WriteLocalityTest) {
+  Graph graph(3);
+  *(graph[0].op.add_dst_extents()) = ExtentForRange(0, 10);
+  *(graph[1].op.add_dst_extents()) = ExtentForRange(kSparseHole, 10);
+  *(graph[1].op.add_dst_extents()) = ExtentForRange(10, 10);
+  *(graph[2].op.add_dst_extents()) = ExtentForRange(100000, 20);
+
+  vector<Vertex::Index> order;
+  EXPECT_EQ(1.0, DeltaDiffGenerator::WriteLocality(graph, order));
+  order.push_back(0);
+  order.push_back(1);
+  EXPECT_EQ(1.0, DeltaDiffGenerator::WriteLocality(graph, order));
+  order.push_back(2);
+  EXPECT_EQ(0.5, DeltaDiffGenerator::WriteLocality(graph, order));
+  // Going backwards isn't sequential either.
+  order.clear();
+  order.push_back(1);
+  order.push_back(0);
+  EXPECT_EQ(0.5, DeltaDiffGenerator::WriteLocality(graph, order));
+}
+
 namespace {
 
 #define OP_BSDIFF DeltaArchiveManifest_InstallOperation_Type_BSDIFF
@@ -677,6 +1027,724 @@ TEST_F(DeltaDiffGeneratorTest, IsNoopOperationTest) {
   EXPECT_FALSE(DeltaDiffGenerator::IsNoopOperation(op));
 }
 
+TEST_F(DeltaDiffGeneratorTest, CompressReplaceDataTest) {
+  const vector<char> kRandomData(kRandomString,
+                                 kRandomString + sizeof(kRandomString));
+  // Repeats of random data, which xz compresses better than bzip2.
+  vector<char> compressible_data;
+  for (int i = 0; i < 64; i++)
+    compressible_data.insert(compressible_data.end(),
+                             kRandomData.begin(), kRandomData.end());
+  for (int xz = 0; xz < 2; xz++) {
+    DeltaDiffGenerator::SetXzCompression(xz);
+    vector<char> out;
+    DeltaArchiveManifest_InstallOperation_Type type;
+    EXPECT_TRUE(DeltaDiffGenerator::CompressReplaceData(kRandomData, &out,
+                                                        &type));
+    EXPECT_EQ(DeltaArchiveManifest_InstallOperation_Type_REPLACE, type);
+    EXPECT_TRUE(out == kRandomData);
+
+    EXPECT_TRUE(DeltaDiffGenerator::CompressReplaceData(compressible_data,
+                                                        &out, &type));
+    EXPECT_LT(out.size(), compressible_data.size());
+    vector<char> decompressed;
+    if (xz) {
+      EXPECT_EQ(DeltaArchiveManifest_InstallOperation_Type_REPLACE_XZ, type);
+      EXPECT_TRUE(XzDecompress(out, &decompressed));
+    } else {
+      EXPECT_EQ(DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ, type);
+      EXPECT_TRUE(BzipDecompress(out, &decompressed));
+    }
+    EXPECT_TRUE(decompressed == compressible_data);
+  }
+  DeltaDiffGenerator::SetXzCompression(false);
+}
+
+TEST_F(DeltaDiffGeneratorTest, CompressReplaceDataSamplesTest) {
+  // Data that's large enough to be sampled. Random data isn't compressed.
+  DeltaDiffGenerator::SetSampleCompression(true);
+  vector<char> data(2 * 1024 * 1024);
+  unsigned int seed = 42;
+  for (size_t i = 0; i < data.size(); i++)
+    data[i] = rand_r(&seed);
+  for (int xz = 0; xz < 2; xz++) {
+    DeltaDiffGenerator::SetXzCompression(xz);
+    vector<char> out;
+    DeltaArchiveManifest_InstallOperation_Type type;
+    EXPECT_TRUE(DeltaDiffGenerator::CompressReplaceData(data, &out, &type));
+    EXPECT_EQ(DeltaArchiveManifest_InstallOperation_Type_REPLACE, type);
+    EXPECT_TRUE(out == data);
+  }
+
+  // Random data with every other byte zero is, as it is without sampling.
+  for (size_t i = 0; i < data.size(); i += 2)
+    data[i] = 0;
+  vector<char> out;
+  DeltaArchiveManifest_InstallOperation_Type type;
+  EXPECT_TRUE(DeltaDiffGenerator::CompressReplaceData(data, &out, &type));
+  EXPECT_EQ(DeltaArchiveManifest_InstallOperation_Type_REPLACE_XZ, type);
+  vector<char> decompressed;
+  EXPECT_TRUE(XzDecompress(out, &decompressed));
+  EXPECT_TRUE(decompressed == data);
+  DeltaDiffGenerator::SetSampleCompression(false);
+  vector<char> unsampled_out;
+  EXPECT_TRUE(DeltaDiffGenerator::CompressReplaceData(data, &unsampled_out,
+                                                      &type));
+  EXPECT_EQ(DeltaArchiveManifest_InstallOperation_Type_REPLACE_XZ, type);
+  EXPECT_TRUE(unsampled_out == out);
+  DeltaDiffGenerator::SetXzCompression(false);
+}
+
+TEST_F(DeltaDiffGeneratorTest, CompressReplaceDataProbeTest) {
+  // Random data passes for compressed data and isn't compressed, but
+  // random data that repeats itself is.
+  vector<char> data(64 * 1024);
+  unsigned int seed = 42;
+  for (size_t i = 0; i < data.size(); i++)
+    data[i] = rand_r(&seed);
+  vector<char> out;
+  DeltaArchiveManifest_InstallOperation_Type type;
+  EXPECT_TRUE(DeltaDiffGenerator::CompressReplaceData(data, &out, &type));
+  EXPECT_EQ(DeltaArchiveManifest_InstallOperation_Type_REPLACE, type);
+
+  const vector<char> block(data);
+  for (int i = 0; i < 3; i++)
+    data.insert(data.end(), block.begin(), block.end());
+  EXPECT_TRUE(DeltaDiffGenerator::CompressReplaceData(data, &out, &type));
+  EXPECT_EQ(DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ, type);
+  EXPECT_LT(out.size(), data.size() / 2);
+}
+
+TEST_F(DeltaDiffGeneratorTest, Blake3OperationHashTest) {
+  const char kData[] = "operation data";
+  DeltaArchiveManifest_InstallOperation op;
+  EXPECT_TRUE(DeltaDiffGenerator::AddOperationHash(&op, kData,
+                                                   sizeof(kData)));
+  EXPECT_TRUE(op.has_data_sha256_hash());
+  EXPECT_FALSE(op.has_data_blake3_hash());
+
+  op.Clear();
+  DeltaDiffGenerator::SetBlake3OperationHashes(true);
+  EXPECT_TRUE(DeltaDiffGenerator::AddOperationHash(&op, kData,
+                                                   sizeof(kData)));
+  DeltaDiffGenerator::SetBlake3OperationHashes(false);
+  EXPECT_FALSE(op.has_data_sha256_hash());
+  vector<char> hash;
+  EXPECT_TRUE(blake3::RawHashOfBytes(kData, sizeof(kData), &hash));
+  EXPECT_EQ(string(hash.begin(), hash.end()), op.data_blake3_hash());
+}
+
+TEST_F(DeltaDiffGeneratorTest, ZeroBlocksTest) {
+  vector<char> zeros(3 * 4096, 0);
+  vector<char> out(1, 'x');
+  DeltaArchiveManifest_InstallOperation_Type type;
+  EXPECT_TRUE(DeltaDiffGenerator::CompressReplaceData(zeros, &out, &type));
+  EXPECT_EQ(DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ, type);
+
+  DeltaDiffGenerator::SetZeroBlocks(true);
+  EXPECT_TRUE(DeltaDiffGenerator::CompressReplaceData(zeros, &out, &type));
+  EXPECT_EQ(DeltaArchiveManifest_InstallOperation_Type_ZERO, type);
+  EXPECT_TRUE(out.empty());
+
+  // A single byte that isn't zero makes it data again.
+  zeros.back() = 1;
+  EXPECT_TRUE(DeltaDiffGenerator::CompressReplaceData(zeros, &out, &type));
+  EXPECT_EQ(DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ, type);
+  DeltaDiffGenerator::SetZeroBlocks(false);
+}
+
+TEST_F(DeltaDiffGeneratorTest, ReadUnwrittenBlocksTest) {
+  // An image of random blocks, zero blocks and compressible blocks, parts of
+  // which a file writes or reads.
+  const size_t kBlockSize = 4096;
+  const uint64_t kBlockCount = 3000;
+  vector<char> image = RandomData(1000 * kBlockSize);
+  image.resize(2000 * kBlockSize, 0);
+  for (size_t i = image.size(); i < kBlockCount * kBlockSize; i++)
+    image.push_back('a' + i / 1000 % 26);
+  EXPECT_TRUE(WriteFileVector(new_path(), image));
+  BlockOwners blocks(kBlockCount);
+  EXPECT_TRUE(blocks.SetWriter(ExtentForRange(100, 50), 0, NULL));
+  EXPECT_TRUE(blocks.SetWriter(ExtentForRange(1500, 20), 0, NULL));
+  EXPECT_TRUE(blocks.SetWriter(ExtentForRange(2500, 10), 0, NULL));
+  EXPECT_TRUE(blocks.SetReader(ExtentForRange(1990, 20), 0, NULL));
+
+  for (int zero_blocks = 0; zero_blocks < 2; zero_blocks++) {
+    DeltaDiffGenerator::SetZeroBlocks(zero_blocks);
+    Graph graph;
+    vector<char> blobs;
+    ReadUnwrittenBlocksWithThreads(blocks, new_path(), 1, &graph, &blobs);
+    ASSERT_LT(1, graph.size());
+
+    // The operations write each block that no file writes once, in whole
+    // blocks, in chunks of up to 1024 blocks. They're in block order, but
+    // those of zero blocks come last.
+    vector<int> writes(kBlockCount, 0);
+    uint64_t next_data_block = 0;
+    uint64_t next_zero_block = 0;
+    bool seen_zero = false;
+    for (size_t i = 1; i < graph.size(); i++) {
+      const DeltaArchiveManifest_InstallOperation& op = graph[i].op;
+      const bool zero =
+          op.type() == DeltaArchiveManifest_InstallOperation_Type_ZERO;
+      EXPECT_TRUE(!zero || zero_blocks);
+      EXPECT_TRUE(zero || !seen_zero);
+      seen_zero = seen_zero || zero;
+      const uint64_t num_blocks = BlocksInExtents(op.dst_extents());
+      EXPECT_LE(num_blocks, 1024);
+      EXPECT_EQ(num_blocks * kBlockSize, op.dst_length());
+      vector<char> expected;
+      for (int j = 0; j < op.dst_extents_size(); j++) {
+        const Extent& extent = op.dst_extents(j);
+        uint64_t* next_block = zero ? &next_zero_block : &next_data_block;
+        EXPECT_LE(*next_block, extent.start_block());
+        *next_block = extent.start_block() + extent.num_blocks();
+        ASSERT_LE(*next_block, kBlockCount);
+        for (uint64_t block = extent.start_block(); block < *next_block;
+             block++) {
+          writes[block]++;
+        }
+        expected.insert(expected.end(),
+                        image.begin() + extent.start_block() * kBlockSize,
+                        image.begin() + *next_block * kBlockSize);
+      }
+
+      // Their blobs are the blocks they write.
+      if (zero) {
+        EXPECT_FALSE(op.has_data_offset());
+        EXPECT_TRUE(expected == vector<char>(expected.size(), 0));
+        continue;
+      }
+      ASSERT_LE(op.data_offset() + op.data_length(), blobs.size());
+      const vector<char> blob(blobs.begin() + op.data_offset(),
+                              blobs.begin() + op.data_offset() +
+                              op.data_length());
+      vector<char> data;
+      if (op.type() == DeltaArchiveManifest_InstallOperation_Type_REPLACE) {
+        data = blob;
+      } else {
+        ASSERT_EQ(DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ,
+                  op.type());
+        EXPECT_TRUE(BzipDecompress(blob, &data));
+      }
+      EXPECT_TRUE(data == expected);
+    }
+    EXPECT_EQ(zero_blocks == 1, seen_zero);
+    for (uint64_t block = 0; block < kBlockCount; block++) {
+      EXPECT_EQ(blocks.writer(block) == Vertex::kInvalidIndex ? 1 : 0,
+                writes[block]) << "block " << block;
+    }
+
+    // More threads make the same operations and blobs.
+    Graph threaded_graph;
+    vector<char> threaded_blobs;
+    ReadUnwrittenBlocksWithThreads(blocks, new_path(), 4, &threaded_graph,
+                                   &threaded_blobs);
+    ASSERT_EQ(graph.size(), threaded_graph.size());
+    for (size_t i = 1; i < graph.size(); i++) {
+      EXPECT_EQ(graph[i].file_name, threaded_graph[i].file_name);
+      EXPECT_EQ(graph[i].op.SerializeAsString(),
+                threaded_graph[i].op.SerializeAsString());
+    }
+    EXPECT_TRUE(blobs == threaded_blobs);
+  }
+  DeltaDiffGenerator::SetZeroBlocks(false);
+}
+
+TEST_F(DeltaDiffGeneratorTest, ApplyCostModelTest) {
+  const DeltaArchiveManifest_InstallOperation_Type kBsdiff =
+      DeltaArchiveManifest_InstallOperation_Type_BSDIFF;
+  const DeltaArchiveManifest_InstallOperation_Type kReplaceBz =
+      DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ;
+  // Without a model, the smaller blob wins.
+  EXPECT_TRUE(DeltaDiffGenerator::IsCheaperOperation(
+      kBsdiff, 100, kReplaceBz, 110, 1000000, 1000000));
+  EXPECT_FALSE(DeltaDiffGenerator::IsCheaperOperation(
+      kBsdiff, 110, kReplaceBz, 110, 1000000, 1000000));
+
+  // On a fast connection, bspatch's scan of the old data costs more than
+  // the few extra bytes to download.
+  ApplyCostModel model;
+  model.download_rate = 100 * 1024 * 1024;
+  DeltaDiffGenerator::SetApplyCostModel(&model);
+  EXPECT_FALSE(DeltaDiffGenerator::IsCheaperOperation(
+      kBsdiff, 100, kReplaceBz, 110, 1000000, 1000000));
+
+  // A BSDIFF is out of the question if it takes too much memory.
+  model.download_rate = 1;
+  model.bspatch_memory = 1000000;
+  DeltaDiffGenerator::SetApplyCostModel(&model);
+  EXPECT_TRUE(DeltaDiffGenerator::IsCheaperOperation(
+      kBsdiff, 100, kReplaceBz, 110, 400000, 500000));
+  EXPECT_FALSE(DeltaDiffGenerator::IsCheaperOperation(
+      kBsdiff, 100, kReplaceBz, 110, 500000, 600000));
+
+  // Data that decompresses slower than it downloads is sent uncompressed.
+  model.download_rate = 100 * 1024 * 1024;
+  model.bzip2_rate = 1024;
+  DeltaDiffGenerator::SetApplyCostModel(&model);
+  const vector<char> zeros(100000, 0);
+  vector<char> out;
+  DeltaArchiveManifest_InstallOperation_Type type;
+  EXPECT_TRUE(DeltaDiffGenerator::CompressReplaceData(zeros, &out, &type));
+  EXPECT_EQ(DeltaArchiveManifest_InstallOperation_Type_REPLACE, type);
+  EXPECT_TRUE(out == zeros);
+
+  DeltaDiffGenerator::SetApplyCostModel(NULL);
+  EXPECT_TRUE(DeltaDiffGenerator::CompressReplaceData(zeros, &out, &type));
+  EXPECT_EQ(kReplaceBz, type);
+}
+
+TEST_F(DeltaDiffGeneratorTest, PartitionInfoChunkHashesTest) {
+  const size_t kBlockSize = 4096;
+  string kernel;
+  ASSERT_TRUE(utils::MakeTempFile("/tmp/PartitionInfoChunkHashesTest.XXXXXX",
+                                  &kernel,
+                                  NULL));
+  ScopedPathUnlinker kernel_unlinker(kernel);
+  vector<char> data(3 * kBlockSize + 100);
+  FillWithData(&data);
+  ASSERT_TRUE(WriteFileVector(kernel, data));
+
+  PartitionInfo info;
+  EXPECT_TRUE(DeltaDiffGenerator::InitializePartitionInfo(true, kernel,
+                                                          &info));
+  EXPECT_EQ(data.size(), info.size());
+  vector<char> hash;
+  EXPECT_TRUE(OmahaHashCalculator::RawHashOfData(data, &hash));
+  EXPECT_EQ(string(hash.begin(), hash.end()), info.hash());
+  EXPECT_FALSE(info.has_chunk_size());
+  EXPECT_EQ(0, info.chunk_hashes_size());
+
+  DeltaDiffGenerator::SetPartitionHashChunkSize(kBlockSize);
+  EXPECT_TRUE(DeltaDiffGenerator::InitializePartitionInfo(true, kernel,
+                                                          &info));
+  DeltaDiffGenerator::SetPartitionHashChunkSize(0);
+  EXPECT_EQ(string(hash.begin(), hash.end()), info.hash());
+  EXPECT_EQ(kBlockSize, info.chunk_size());
+  ASSERT_EQ(4, info.chunk_hashes_size());
+  for (int i = 0; i < info.chunk_hashes_size(); i++) {
+    const size_t offset = i * kBlockSize;
+    EXPECT_TRUE(OmahaHashCalculator::RawHashOfBytes(
+        &data[offset], min(kBlockSize, data.size() - offset), &hash));
+    EXPECT_EQ(string(hash.begin(), hash.end()), info.chunk_hashes(i));
+  }
+}
+
+namespace {
+// Returns the old kernel, new kernel, old rootfs or new rootfs info of
+// |manifest|, for |i| from 0 to 3.
+const PartitionInfo& PartitionInfoOf(const DeltaArchiveManifest& manifest,
+                                     int i) {
+  switch (i) {
+    case 0: return manifest.old_kernel_info();
+    case 1: return manifest.new_kernel_info();
+    case 2: return manifest.old_rootfs_info();
+    default: return manifest.new_rootfs_info();
+  }
+}
+}  // namespace {}
+
+TEST_F(DeltaDiffGeneratorTest, InitializePartitionInfosTest) {
+  // The old and new kernels, then the old and new rootfs, each pair alike.
+  string paths[4];
+  scoped_ptr<ScopedPathUnlinker> unlinkers[4];
+  for (int i = 0; i < 4; i++) {
+    ASSERT_TRUE(utils::MakeTempFile("/tmp/PartitionInfosTest.XXXXXX",
+                                    &paths[i],
+                                    NULL));
+    unlinkers[i].reset(new ScopedPathUnlinker(paths[i]));
+  }
+  vector<char> kernel(3 * 4096 + 100);
+  FillWithData(&kernel);
+  ASSERT_TRUE(WriteFileVector(paths[0], kernel));
+  ASSERT_TRUE(WriteFileVector(paths[1], kernel));
+  CreateEmptyExtImageAtPath(paths[2], 10485759, 4096);
+  vector<char> rootfs;
+  ASSERT_TRUE(utils::ReadFile(paths[2], &rootfs));
+  ASSERT_TRUE(WriteFileVector(paths[3], rootfs));
+
+  // Alike partitions get the same info, the one each gets on its own.
+  DeltaArchiveManifest manifest;
+  EXPECT_TRUE(DeltaDiffGenerator::InitializePartitionInfos(
+      paths[0], paths[1], paths[2], paths[3], &manifest));
+  for (int i = 0; i < 4; i++) {
+    PartitionInfo info;
+    EXPECT_TRUE(DeltaDiffGenerator::InitializePartitionInfo(i < 2, paths[i],
+                                                            &info));
+    EXPECT_EQ(info.SerializeAsString(),
+              PartitionInfoOf(manifest, i).SerializeAsString()) << i;
+    EXPECT_FALSE(info.hash().empty());
+  }
+  EXPECT_EQ(manifest.old_kernel_info().SerializeAsString(),
+            manifest.new_kernel_info().SerializeAsString());
+  EXPECT_EQ(manifest.old_rootfs_info().SerializeAsString(),
+            manifest.new_rootfs_info().SerializeAsString());
+
+  // Changing a byte of a partition changes the hash of its info alone.
+  for (int i = 0; i < 4; i++) {
+    vector<char> data;
+    ASSERT_TRUE(utils::ReadFile(paths[i], &data));
+    data[data.size() / 2] ^= 1;
+    ASSERT_TRUE(WriteFileVector(paths[i], data));
+    DeltaArchiveManifest changed;
+    EXPECT_TRUE(DeltaDiffGenerator::InitializePartitionInfos(
+        paths[0], paths[1], paths[2], paths[3], &changed));
+    for (int j = 0; j < 4; j++) {
+      const PartitionInfo& info = PartitionInfoOf(changed, j);
+      const PartitionInfo& original = PartitionInfoOf(manifest, j);
+      EXPECT_EQ(original.size(), info.size()) << i << " " << j;
+      if (j == i)
+        EXPECT_NE(original.hash(), info.hash()) << i;
+      else
+        EXPECT_EQ(original.hash(), info.hash()) << i << " " << j;
+    }
+    data[data.size() / 2] ^= 1;
+    ASSERT_TRUE(WriteFileVector(paths[i], data));
+  }
+
+  // The partitions without a path get no info.
+  DeltaArchiveManifest new_only;
+  EXPECT_TRUE(DeltaDiffGenerator::InitializePartitionInfos(
+      "", paths[1], "", paths[3], &new_only));
+  EXPECT_FALSE(new_only.has_old_kernel_info());
+  EXPECT_FALSE(new_only.has_old_rootfs_info());
+  EXPECT_EQ(manifest.new_kernel_info().SerializeAsString(),
+            new_only.new_kernel_info().SerializeAsString());
+  EXPECT_EQ(manifest.new_rootfs_info().SerializeAsString(),
+            new_only.new_rootfs_info().SerializeAsString());
+}
+
+TEST_F(DeltaDiffGeneratorTest, AddDestinationHashesTest) {
+  const size_t kBlockSize = 4096;
+  string rootfs;
+  ASSERT_TRUE(utils::MakeTempFile("/tmp/AddDestinationHashesTest.XXXXXX",
+                                  &rootfs,
+                                  NULL));
+  ScopedPathUnlinker rootfs_unlinker(rootfs);
+  vector<char> data(4 * kBlockSize + 100);
+  FillWithData(&data);
+  ASSERT_TRUE(WriteFileVector(rootfs, data));
+
+  // Blocks 4 (partial), 1 and 0 are written once, block 2 twice and block 3
+  // is discarded. The last operation writes a sparse hole.
+  DeltaArchiveManifest manifest;
+  manifest.mutable_new_rootfs_info()->set_size(data.size());
+  const uint64_t kDstExtents[][2] = {
+    { 4, 1 }, { 1, 1 }, { 2, 1 }, { 2, 1 }, { 3, 1 }, { kSparseHole, 1 }
+  };
+  for (size_t i = 0; i < arraysize(kDstExtents); i++) {
+    DeltaArchiveManifest_InstallOperation* op =
+        manifest.add_install_operations();
+    op->set_type(i == 4 ? DeltaArchiveManifest_InstallOperation_Type_DISCARD :
+                 DeltaArchiveManifest_InstallOperation_Type_MOVE);
+    Extent* extent = op->add_dst_extents();
+    extent->set_start_block(kDstExtents[i][0]);
+    extent->set_num_blocks(kDstExtents[i][1]);
+  }
+  *manifest.mutable_install_operations(1)->add_dst_extents() =
+      ExtentForRange(0, 1);
+
+  EXPECT_TRUE(DeltaDiffGenerator::AddDestinationHashes("", rootfs,
+                                                       &manifest));
+  vector<char> blocks(data.begin() + 4 * kBlockSize, data.end());
+  blocks.resize(kBlockSize);
+  vector<char> hash;
+  EXPECT_TRUE(OmahaHashCalculator::RawHashOfData(blocks, &hash));
+  EXPECT_EQ(string(hash.begin(), hash.end()),
+            manifest.install_operations(0).dst_sha256_hash());
+  blocks.assign(data.begin() + kBlockSize, data.begin() + 2 * kBlockSize);
+  blocks.insert(blocks.end(), data.begin(), data.begin() + kBlockSize);
+  EXPECT_TRUE(OmahaHashCalculator::RawHashOfData(blocks, &hash));
+  EXPECT_EQ(string(hash.begin(), hash.end()),
+            manifest.install_operations(1).dst_sha256_hash());
+  for (int i = 2; i < manifest.install_operations_size(); i++)
+    EXPECT_FALSE(manifest.install_operations(i).has_dst_sha256_hash()) << i;
+}
+
+TEST_F(DeltaDiffGeneratorTest, AddDestinationHashesBlockSizeTest) {
+  const size_t kBlockSize = 16 * 1024;
+  string rootfs;
+  ASSERT_TRUE(utils::MakeTempFile("/tmp/AddDestinationHashesTest.XXXXXX",
+                                  &rootfs,
+                                  NULL));
+  ScopedPathUnlinker rootfs_unlinker(rootfs);
+  vector<char> data(2 * kBlockSize + 100);
+  FillWithData(&data);
+  ASSERT_TRUE(WriteFileVector(rootfs, data));
+
+  // The blocks are as large as the manifest says, as is the zero padding of
+  // the last one.
+  DeltaArchiveManifest manifest;
+  manifest.set_block_size(kBlockSize);
+  manifest.mutable_new_rootfs_info()->set_size(data.size());
+  DeltaArchiveManifest_InstallOperation* op =
+      manifest.add_install_operations();
+  op->set_type(DeltaArchiveManifest_InstallOperation_Type_REPLACE);
+  *op->add_dst_extents() = ExtentForRange(1, 2);
+
+  EXPECT_TRUE(DeltaDiffGenerator::AddDestinationHashes("", rootfs,
+                                                       &manifest));
+  vector<char> blocks(data.begin() + kBlockSize, data.end());
+  blocks.resize(2 * kBlockSize);
+  vector<char> hash;
+  EXPECT_TRUE(OmahaHashCalculator::RawHashOfData(blocks, &hash));
+  EXPECT_EQ(string(hash.begin(), hash.end()),
+            manifest.install_operations(0).dst_sha256_hash());
+}
+
+namespace {
+// Appends |blob| to the file open at |fd|, |*offset| bytes long, as the blob
+// of |op|.
+void AppendBlob(int fd, const vector<char>& blob, off_t* offset,
+                DeltaArchiveManifest_InstallOperation* op) {
+  ASSERT_TRUE(utils::PWriteAll(fd, &blob[0], blob.size(), *offset));
+  op->set_data_offset(*offset);
+  op->set_data_length(blob.size());
+  *offset += blob.size();
+}
+}  // namespace {}
+
+TEST_F(DeltaDiffGeneratorTest, FuseSmallOperationsTest) {
+  const size_t kBlockSize = 4096;
+  string data_path;
+  int fd;
+  ASSERT_TRUE(utils::MakeTempFile("/tmp/FuseSmallOperationsTest.XXXXXX",
+                                  &data_path,
+                                  &fd));
+  ScopedPathUnlinker data_unlinker(data_path);
+  ScopedFdCloser fd_closer(&fd);
+  off_t data_size = 0;
+
+  // 0 and 1 are merged, 2 isn't a full operation, 3 and 4 are merged and 5
+  // is too large to be merged.
+  vector<char> partial(100);
+  FillWithData(&partial);
+  vector<char> block(kBlockSize);
+  FillWithData(&block);
+  vector<char> compressed;
+  ASSERT_TRUE(BzipCompress(block, &compressed));
+  const uint64_t kDstExtents[][2] = {
+    { 10, 1 }, { 11, 1 }, { 0, 1 }, { 20, 1 }, { 30, 1 }, { 40, 3 }
+  };
+  Graph graph(arraysize(kDstExtents));
+  vector<Vertex::Index> order;
+  for (size_t i = 0; i < graph.size(); i++) {
+    DeltaArchiveManifest_InstallOperation* op = &graph[i].op;
+    *op->add_dst_extents() = ExtentForRange(kDstExtents[i][0],
+                                            kDstExtents[i][1]);
+    if (i == 1) {
+      op->set_type(DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ);
+      AppendBlob(fd, compressed, &data_size, op);
+    } else if (i == 2) {
+      op->set_type(DeltaArchiveManifest_InstallOperation_Type_MOVE);
+      *op->add_src_extents() = ExtentForRange(1, 1);
+    } else {
+      op->set_type(DeltaArchiveManifest_InstallOperation_Type_REPLACE);
+      AppendBlob(fd, partial, &data_size, op);
+    }
+    graph[i].file_name = StringPrintf("file%zu", i);
+    order.push_back(i);
+  }
+
+  DeltaDiffGenerator::SetOperationFusionSize(3 * kBlockSize);
+  EXPECT_TRUE(DeltaDiffGenerator::FuseSmallOperations(&graph, &order, fd,
+                                                      &data_size));
+  DeltaDiffGenerator::SetOperationFusionSize(0);
+  ASSERT_EQ(4U, order.size());
+  EXPECT_EQ(0, order[0]);
+  EXPECT_EQ(2, order[1]);
+  EXPECT_EQ(3, order[2]);
+  EXPECT_EQ(5, order[3]);
+  EXPECT_EQ("file0, file1", graph[0].file_name);
+
+  // The data of each merged operation is that of the operations it merges,
+  // block aligned.
+  const DeltaArchiveManifest_InstallOperation& first = graph[0].op;
+  ASSERT_EQ(1, first.dst_extents_size());
+  EXPECT_TRUE(first.dst_extents(0) == ExtentForRange(10, 2));
+  vector<char> expected(partial);
+  expected.resize(kBlockSize);
+  expected.insert(expected.end(), block.begin(), block.end());
+  EXPECT_EQ(expected.size(), first.dst_length());
+  vector<char> blob(first.data_length());
+  ssize_t bytes_read = 0;
+  ASSERT_TRUE(utils::PReadAll(fd, &blob[0], blob.size(), first.data_offset(),
+                              &bytes_read));
+  vector<char> data;
+  if (first.type() == DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ)
+    ASSERT_TRUE(BzipDecompress(blob, &data));
+  else if (first.type() ==
+           DeltaArchiveManifest_InstallOperation_Type_REPLACE_XZ)
+    ASSERT_TRUE(XzDecompress(blob, &data));
+  else
+    data = blob;
+  EXPECT_TRUE(data == expected);
+
+  const DeltaArchiveManifest_InstallOperation& second = graph[3].op;
+  ASSERT_EQ(2, second.dst_extents_size());
+  EXPECT_TRUE(second.dst_extents(0) == ExtentForRange(20, 1));
+  EXPECT_TRUE(second.dst_extents(1) == ExtentForRange(30, 1));
+  EXPECT_EQ(kBlockSize + partial.size(), second.dst_length());
+  EXPECT_TRUE(graph[2].op.dst_extents(0) == ExtentForRange(0, 1));
+  EXPECT_EQ(1, graph[5].op.dst_extents_size());
+}
+
+TEST_F(DeltaDiffGeneratorTest, AddPayloadSegmentsTest) {
+  // Rootfs: blobs at 0 and 10, a move and a blob at 20. Kernel: a blob at
+  // 15 and a move.
+  DeltaArchiveManifest manifest;
+  const int kRootfsBlobs[][2] = { { 0, 10 }, { 10, 5 }, { -1, 0 }, { 20, 10 } };
+  for (size_t i = 0; i < arraysize(kRootfsBlobs); i++) {
+    DeltaArchiveManifest_InstallOperation* op =
+        manifest.add_install_operations();
+    if (kRootfsBlobs[i][0] >= 0) {
+      op->set_data_offset(kRootfsBlobs[i][0]);
+      op->set_data_length(kRootfsBlobs[i][1]);
+    }
+  }
+  manifest.add_kernel_install_operations()->set_data_offset(15);
+  manifest.mutable_kernel_install_operations(0)->set_data_length(5);
+  manifest.add_kernel_install_operations();
+
+  DeltaDiffGenerator::AddPayloadSegments(&manifest);
+  ASSERT_EQ(3, manifest.segments_size());
+  EXPECT_EQ(PayloadSegment::ROOTFS, manifest.segments(0).partition());
+  EXPECT_EQ(0, manifest.segments(0).data_offset());
+  EXPECT_EQ(15, manifest.segments(0).data_length());
+  EXPECT_EQ(PayloadSegment::KERNEL, manifest.segments(1).partition());
+  EXPECT_EQ(15, manifest.segments(1).data_offset());
+  EXPECT_EQ(5, manifest.segments(1).data_length());
+  EXPECT_EQ(PayloadSegment::ROOTFS, manifest.segments(2).partition());
+  EXPECT_EQ(20, manifest.segments(2).data_offset());
+  EXPECT_EQ(10, manifest.segments(2).data_length());
+
+  // A partition without blobs has no segment.
+  manifest.clear_kernel_install_operations();
+  manifest.mutable_install_operations(2)->set_data_offset(15);
+  manifest.mutable_install_operations(2)->set_data_length(5);
+  DeltaDiffGenerator::AddPayloadSegments(&manifest);
+  ASSERT_EQ(1, manifest.segments_size());
+  EXPECT_EQ(PayloadSegment::ROOTFS, manifest.segments(0).partition());
+  EXPECT_EQ(0, manifest.segments(0).data_offset());
+  EXPECT_EQ(30, manifest.segments(0).data_length());
+}
+
+TEST_F(DeltaDiffGeneratorTest, AddSourceReuseHintsTest) {
+  // Rootfs: 0 reads block 0, which 1 then overwrites before 2 reads it, and
+  // 1 and 3 read block 2. Kernel: both operations read block 0.
+  DeltaArchiveManifest manifest;
+  const int kRootfsMoves[][2] = { { 0, 10 }, { 2, 0 }, { 0, 20 }, { 2, 30 } };
+  for (size_t i = 0; i < arraysize(kRootfsMoves); i++) {
+    DeltaArchiveManifest_InstallOperation* op =
+        manifest.add_install_operations();
+    op->set_type(DeltaArchiveManifest_InstallOperation_Type_MOVE);
+    *op->add_src_extents() = ExtentForRange(kRootfsMoves[i][0], 1);
+    *op->add_dst_extents() = ExtentForRange(kRootfsMoves[i][1], 1);
+  }
+  for (int i = 0; i < 2; i++) {
+    DeltaArchiveManifest_InstallOperation* op =
+        manifest.add_kernel_install_operations();
+    op->set_type(DeltaArchiveManifest_InstallOperation_Type_MOVE);
+    *op->add_src_extents() = ExtentForRange(0, 1);
+    *op->add_dst_extents() = ExtentForRange(5 + i, 1);
+  }
+
+  DeltaDiffGenerator::AddSourceReuseHints(&manifest);
+  EXPECT_TRUE(manifest.src_reuse_hints());
+  EXPECT_FALSE(manifest.install_operations(0).src_reused());
+  EXPECT_TRUE(manifest.install_operations(1).src_reused());
+  EXPECT_FALSE(manifest.install_operations(2).src_reused());
+  EXPECT_FALSE(manifest.install_operations(3).src_reused());
+  EXPECT_TRUE(manifest.kernel_install_operations(0).src_reused());
+  EXPECT_FALSE(manifest.kernel_install_operations(1).src_reused());
+
+  // Applied from the source partitions, the blocks read are never
+  // overwritten.
+  manifest.set_apply_from_source(true);
+  DeltaDiffGenerator::AddSourceReuseHints(&manifest);
+  EXPECT_TRUE(manifest.install_operations(0).src_reused());
+  EXPECT_TRUE(manifest.install_operations(1).src_reused());
+  EXPECT_FALSE(manifest.install_operations(2).src_reused());
+  EXPECT_FALSE(manifest.install_operations(3).src_reused());
+}
+
+TEST_F(DeltaDiffGeneratorTest, DiffShardOfTest) {
+  // The chunks are spread over all the shards, each chunk always going to
+  // the same one.
+  const int kShards = 4;
+  vector<int> chunks(kShards);
+  for (int i = 0; i < 100; i++) {
+    const string path = StringPrintf("/dir/file%d", i);
+    for (off_t offset = 0; offset < 4 * 1024 * 1024; offset += 1024 * 1024) {
+      const int shard = DeltaDiffGenerator::DiffShardOf(path, offset, kShards);
+      ASSERT_GE(shard, 0);
+      ASSERT_LT(shard, kShards);
+      EXPECT_EQ(shard, DeltaDiffGenerator::DiffShardOf(path, offset, kShards));
+      chunks[shard]++;
+    }
+  }
+  for (int i = 0; i < kShards; i++)
+    EXPECT_GT(chunks[i], 50);
+  EXPECT_EQ(0, DeltaDiffGenerator::DiffShardOf("/dir/file", 0, 1));
+}
+
+namespace {
+// Returns the first block of the file at |path|, or kuint64max if it has
+// none.
+uint64_t FirstBlockOfFile(const string& path) {
+  vector<Extent> extents;
+  EXPECT_TRUE(extent_mapper::ExtentsForFile(path, &extents)) << path;
+  for (vector<Extent>::const_iterator it = extents.begin();
+       it != extents.end(); ++it) {
+    if (it->start_block() != kSparseHole)
+      return it->start_block();
+  }
+  return kuint64max;
+}
+}  // namespace {}
+
+TEST_F(DeltaDiffGeneratorTest, RunAsRootListFilesInDiffOrderTest) {
+  string image;
+  EXPECT_TRUE(utils::MakeTempFile("/tmp/DiffOrderTest.XXXXXX", &image, NULL));
+  ScopedPathUnlinker image_unlinker(image);
+  CreateExtImageAtPath(image, NULL);
+  string old_root;
+  EXPECT_TRUE(utils::MakeTempDirectory("/tmp/DiffOrderTest.XXXXXX",
+                                       &old_root));
+  ScopedDirRemover old_root_remover(old_root);
+  string new_root;
+  ScopedLoopMounter mounter(image, &new_root, MS_RDONLY);
+  ThreadPool pool(2);
+
+  // With a window holding all the files, they're diffed in the order of
+  // their blocks in the new image.
+  vector<string> paths;
+  EXPECT_TRUE(DeltaDiffGenerator::ListFilesInDiffOrder(old_root, new_root,
+                                                       1000, &pool, &paths));
+  // /hi, /hello, /some_dir/test or /testlink, and one of the srchardlinks.
+  ASSERT_EQ(4, paths.size());
+  for (size_t i = 1; i < paths.size(); i++) {
+    EXPECT_LE(FirstBlockOfFile(new_root + paths[i - 1]),
+              FirstBlockOfFile(new_root + paths[i]))
+        << paths[i - 1] << " " << paths[i];
+  }
+
+  // With smaller windows, the same files are diffed, in that order within
+  // each window.
+  vector<string> window_paths;
+  EXPECT_TRUE(DeltaDiffGenerator::ListFilesInDiffOrder(
+      old_root, new_root, 2, &pool, &window_paths));
+  EXPECT_EQ(set<string>(paths.begin(), paths.end()),
+            set<string>(window_paths.begin(), window_paths.end()));
+  EXPECT_EQ(paths.size(), window_paths.size());
+  for (size_t i = 1; i < window_paths.size(); i += 2) {
+    EXPECT_LE(FirstBlockOfFile(new_root + window_paths[i - 1]),
+              FirstBlockOfFile(new_root + window_paths[i]))
+        << window_paths[i - 1] << " " << window_paths[i];
+  }
+}
+
 TEST_F(DeltaDiffGeneratorTest, RunAsRootAssignTempBlocksReuseTest) {
   // AssignTempBlocks(Graph* graph,
   // const string& new_root,
@@ -785,6 +1853,63 @@ TEST_F(DeltaDiffGeneratorTest, RunAsRootAssignTempBlocksReuseTest) {
   EXPECT_EQ(OP_REPLACE_BZ, graph[5].op.type());
 }
 
+TEST_F(DeltaDiffGeneratorTest, AssignTempBlocksFreedTest) {
+  Graph graph(5);
+  const vector<Extent> empt;
+  const uint64_t tmp = kTempBlockStart;
+
+  // A broken loop, as in RunAsRootAssignTempBlocksReuseTest.
+  GenVertex(&graph[0], VectOfExt(0, 1), VectOfExt(1, 1), "", OP_MOVE);
+  GenVertex(&graph[1], VectOfExt(tmp, 1), VectOfExt(0, 1), "", OP_MOVE);
+  GenVertex(&graph[2], VectOfExt(1, 1), VectOfExt(tmp, 1), "", OP_MOVE);
+  graph[0].out_edges[2] = EdgeWithReadDep(VectOfExt(1, 1));
+  graph[1].out_edges[2] = EdgeWithWriteDep(VectOfExt(tmp, 1));
+  graph[1].out_edges[0] = EdgeWithReadDep(VectOfExt(0, 1));
+  vector<CutEdgeVertexes> cuts(1);
+  cuts[0].old_dst = 1;
+  cuts[0].old_src = 0;
+  cuts[0].new_vertex = 2;
+  cuts[0].tmp_extents = VectOfExt(tmp, 1);
+
+  // The only block written after the loop is read by 4 before that.
+  GenVertex(&graph[3], empt, VectOfExt(5, 1), "", OP_REPLACE);
+  GenVertex(&graph[4], VectOfExt(5, 1), VectOfExt(6, 1), "", OP_MOVE);
+  graph[3].out_edges[4] = EdgeWithReadDep(VectOfExt(5, 1));
+
+  vector<Vertex::Index> op_indexes;
+  op_indexes.push_back(4);
+  op_indexes.push_back(2);
+  op_indexes.push_back(0);
+  op_indexes.push_back(1);
+  op_indexes.push_back(3);
+  vector<vector<Vertex::Index>::size_type> reverse_op_indexes;
+  DeltaDiffGenerator::GenerateReverseTopoOrderMap(op_indexes,
+                                                  &reverse_op_indexes);
+
+  // The block is free by the time the loop is broken, so nothing has to be
+  // converted to full.
+  off_t data_file_size = 0;
+  EXPECT_TRUE(DeltaDiffGenerator::AssignTempBlocks(&graph,
+                                                   "",
+                                                   -1,
+                                                   &data_file_size,
+                                                   &op_indexes,
+                                                   &reverse_op_indexes,
+                                                   cuts));
+  EXPECT_EQ(0, data_file_size);
+  EXPECT_EQ(5U, op_indexes.size());
+  EXPECT_TRUE(graph[2].valid);
+  ASSERT_EQ(1, graph[1].op.src_extents_size());
+  EXPECT_TRUE(graph[1].op.src_extents(0) == ExtentForRange(5, 1));
+  ASSERT_EQ(1, graph[2].op.dst_extents_size());
+  EXPECT_TRUE(graph[2].op.dst_extents(0) == ExtentForRange(5, 1));
+  // The copy runs after 4 has read the block, and 3 after 1 has.
+  ASSERT_TRUE(graph[2].out_edges.count(4));
+  EXPECT_TRUE(graph[2].out_edges[4].extents == VectOfExt(5, 1));
+  ASSERT_TRUE(graph[3].out_edges.count(1));
+  EXPECT_TRUE(graph[3].out_edges[1].extents == VectOfExt(5, 1));
+}
+
 TEST_F(DeltaDiffGeneratorTest, CreateScratchNodeTest) {
   Vertex vertex;
   DeltaDiffGenerator::CreateScratchNode(12, 34, &vertex);
@@ -797,4 +1922,145 @@ TEST_F(DeltaDiffGeneratorTest, CreateScratchNodeTest) {
   EXPECT_EQ(34, vertex.op.dst_extents(0).num_blocks());
 }
 
+TEST_F(DeltaDiffGeneratorTest, KernelChunkSizeTest) {
+  string dir;
+  ASSERT_TRUE(utils::MakeTempDirectory("/tmp/KernelChunkSizeTest.XXXXXX",
+                                       &dir));
+  const size_t kBlockSize = 4096;
+  const string image = dir + "/rootfs";
+  CreateEmptyExtImageAtPath(image, 10485759, kBlockSize);
+
+  // The new kernel changes the second block of the old one, and grows from
+  // 5 blocks and a bit to 9 blocks and a bit, so the last two chunks of two
+  // blocks have no old data.
+  srandom(1);
+  const string old_kernel = dir + "/old_kernel";
+  const string new_kernel = dir + "/new_kernel";
+  const vector<char> old_kernel_data = RandomData(5 * kBlockSize + 100);
+  vector<char> new_kernel_data = old_kernel_data;
+  const vector<char> changed_block = RandomData(kBlockSize);
+  std::copy(changed_block.begin(), changed_block.end(),
+            new_kernel_data.begin() + kBlockSize);
+  const vector<char> tail = RandomData(4 * kBlockSize + 100);
+  new_kernel_data.insert(new_kernel_data.end(), tail.begin(), tail.end());
+  ASSERT_TRUE(WriteFileVector(old_kernel, old_kernel_data));
+  ASSERT_TRUE(WriteFileVector(new_kernel, new_kernel_data));
+
+  const string payload = dir + "/payload";
+  DeltaDiffGenerator::SetReadImages(true);
+  DeltaDiffGenerator::SetKernelChunkSize(2 * kBlockSize);
+  uint64_t metadata_size = 0;
+  EXPECT_TRUE(DeltaDiffGenerator::GenerateDeltaUpdateFile(
+      "", image, "", image, old_kernel, new_kernel, payload, "",
+      &metadata_size));
+  DeltaDiffGenerator::SetKernelChunkSize(-1);
+  DeltaDiffGenerator::SetReadImages(false);
+
+  // One operation for each chunk, which only reads and writes the blocks of
+  // its chunk.
+  vector<char> payload_data;
+  DeltaArchiveManifest manifest;
+  ASSERT_TRUE(PayloadSigner::LoadPayload(payload, &payload_data, &manifest,
+                                         &metadata_size));
+  ASSERT_EQ(5, manifest.kernel_install_operations_size());
+  for (int i = 0; i < manifest.kernel_install_operations_size(); i++) {
+    const DeltaArchiveManifest_InstallOperation& op =
+        manifest.kernel_install_operations(i);
+    const uint64_t chunk_start = 2 * i;
+    const uint64_t chunk_end = chunk_start + 2;
+    for (int j = 0; j < op.src_extents_size(); j++) {
+      const Extent& extent = op.src_extents(j);
+      if (extent.start_block() == kSparseHole)
+        continue;
+      EXPECT_LE(chunk_start, extent.start_block()) << "operation " << i;
+      EXPECT_LE(extent.start_block() + extent.num_blocks(), chunk_end)
+          << "operation " << i;
+    }
+    EXPECT_LT(0, op.dst_extents_size());
+    for (int j = 0; j < op.dst_extents_size(); j++) {
+      const Extent& extent = op.dst_extents(j);
+      EXPECT_LE(chunk_start, extent.start_block()) << "operation " << i;
+      EXPECT_LE(extent.start_block() + extent.num_blocks(), chunk_end)
+          << "operation " << i;
+    }
+    // The chunks past the end of the old kernel are sent whole.
+    if (i >= 3)
+      EXPECT_EQ(0, op.src_extents_size()) << "operation " << i;
+  }
+
+  // Applied to the old kernel, the payload makes the new one.
+  Prefs prefs;
+  EXPECT_TRUE(prefs.Init(FilePath(dir + "/prefs")));
+  const string out_image = dir + "/out_rootfs";
+  const string out_kernel = dir + "/out_kernel";
+  EXPECT_TRUE(delta_chain::ApplyPayload(payload, image, old_kernel,
+                                        out_image, out_kernel, &prefs));
+  vector<char> data;
+  EXPECT_TRUE(utils::ReadFile(out_kernel, &data));
+  EXPECT_TRUE(data == new_kernel_data);
+
+  EXPECT_TRUE(utils::RecursiveUnlinkDir(dir));
+}
+
+TEST_F(DeltaDiffGeneratorTest, RunAsRootGenerateDeltaUpdateFilesTest) {
+  string dir;
+  ASSERT_TRUE(utils::MakeTempDirectory(
+      "/tmp/GenerateDeltaUpdateFilesTest.XXXXXX", &dir));
+  const size_t kBlockSize = 4096;
+
+  // A new image with files and two empty old images, so that the files are
+  // sent whole in both deltas, the second one with the encodings cached
+  // while generating the first.
+  const string new_image = dir + "/new_rootfs";
+  CreateExtImageAtPath(new_image, NULL);
+  srandom(1);
+  const string new_kernel = dir + "/new_kernel";
+  const vector<char> new_kernel_data = RandomData(3 * kBlockSize);
+  ASSERT_TRUE(WriteFileVector(new_kernel, new_kernel_data));
+  vector<DeltaSource> sources(2);
+  for (size_t i = 0; i < sources.size(); i++) {
+    const string suffix = StringPrintf("%zu", i);
+    sources[i].old_image = dir + "/old_rootfs" + suffix;
+    CreateEmptyExtImageAtPath(sources[i].old_image, 10485759, kBlockSize);
+    sources[i].old_kernel_part = dir + "/old_kernel" + suffix;
+    ASSERT_TRUE(WriteFileVector(sources[i].old_kernel_part,
+                                RandomData(2 * kBlockSize)));
+    sources[i].output_path = dir + "/batch_payload" + suffix;
+  }
+
+  DeltaDiffGenerator::SetReadImages(true);
+  EXPECT_TRUE(DeltaDiffGenerator::GenerateDeltaUpdateFiles(
+      sources, "", new_image, new_kernel, ""));
+  for (size_t i = 0; i < sources.size(); i++) {
+    // Each delta is the one generated on its own.
+    const string payload = dir + StringPrintf("/payload%zu", i);
+    uint64_t metadata_size = 0;
+    EXPECT_TRUE(DeltaDiffGenerator::GenerateDeltaUpdateFile(
+        "", sources[i].old_image, "", new_image, sources[i].old_kernel_part,
+        new_kernel, payload, "", &metadata_size));
+    vector<char> batch_data;
+    vector<char> data;
+    EXPECT_TRUE(utils::ReadFile(sources[i].output_path, &batch_data));
+    EXPECT_TRUE(utils::ReadFile(payload, &data));
+    EXPECT_TRUE(batch_data == data) << "delta " << i;
+
+    // And it applies.
+    Prefs prefs;
+    EXPECT_TRUE(prefs.Init(FilePath(dir + StringPrintf("/prefs%zu", i))));
+    const string out_image = dir + "/out_rootfs";
+    const string out_kernel = dir + "/out_kernel";
+    EXPECT_TRUE(delta_chain::ApplyPayload(sources[i].output_path,
+                                          sources[i].old_image,
+                                          sources[i].old_kernel_part,
+                                          out_image,
+                                          out_kernel,
+                                          &prefs));
+    EXPECT_TRUE(utils::ReadFile(out_kernel, &data));
+    EXPECT_TRUE(data == new_kernel_data) << "delta " << i;
+  }
+  DeltaDiffGenerator::SetReadImages(false);
+
+  EXPECT_TRUE(utils::RecursiveUnlinkDir(dir));
+}
+
 }  // namespace chromeos_update_engine
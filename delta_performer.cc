@@ -6,31 +6,63 @@
 
 #include <endian.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #include <algorithm>
 #include <cstring>
+#include <map>
 #include <string>
 #include <vector>
 
 #include <base/memory/scoped_ptr.h>
+#include <base/posix/eintr_wrapper.h>
+#include <base/string_number_conversions.h>
 #include <base/string_util.h>
 #include <base/stringprintf.h>
+#include <glib.h>
 #include <google/protobuf/repeated_field.h>
 
+#include "update_engine/async_logging.h"
+#include "update_engine/blake3.h"
+#include "update_engine/block_cache.h"
+#include "update_engine/block_io.h"
+#include "update_engine/bspatch.h"
+#include "update_engine/bspatch_worker_pool.h"
+#include "update_engine/bzip_block_decoder.h"
 #include "update_engine/bzip_extent_writer.h"
+#include "update_engine/chunk_hash_verifier.h"
+#include "update_engine/compact_manifest.h"
 #include "update_engine/delta_diff_generator.h"
 #include "update_engine/extent_ranges.h"
 #include "update_engine/extent_writer.h"
 #include "update_engine/graph_types.h"
+#include "update_engine/graph_utils.h"
+#include "update_engine/io_recorder.h"
+#include "update_engine/memory_tracker.h"
+#include "update_engine/omaha_hash_calculator.h"
 #include "update_engine/payload_signer.h"
 #include "update_engine/payload_state_interface.h"
+#include "update_engine/probes.h"
 #include "update_engine/prefs_interface.h"
-#include "update_engine/subprocess.h"
+#include "update_engine/stream_diff.h"
+#include "update_engine/queued_extent_writer.h"
 #include "update_engine/terminator.h"
+#include "update_engine/trace.h"
+#include "update_engine/xz_extent_writer.h"
 
+using std::map;
+using std::max;
 using std::min;
 using std::string;
+using std::tr1::shared_ptr;
 using std::vector;
+using google::protobuf::NewPermanentCallback;
 using google::protobuf::RepeatedPtrField;
 
 namespace chromeos_update_engine {
@@ -43,10 +75,60 @@ const unsigned DeltaPerformer::kProgressLogMaxChunks = 10;
 const unsigned DeltaPerformer::kProgressLogTimeoutSeconds = 30;
 const unsigned DeltaPerformer::kProgressDownloadWeight = 50;
 const unsigned DeltaPerformer::kProgressOperationsWeight = 50;
+const unsigned DeltaPerformer::kCheckpointMaxOperations = 64;
+const uint64_t DeltaPerformer::kCheckpointMaxBytes = 4 * 1024 * 1024;  // 4 MiB
+const unsigned DeltaPerformer::kCheckpointMaxSeconds = 10;
+
+CheckpointFile* DeltaPerformer::checkpoint_file_ = NULL;
 
 namespace {
 const int kUpdateStateOperationInvalid = -1;
 const int kMaxResumedUpdateFailures = 10;
+// How often the warnings logged for every operation are logged at most.
+const int kOperationLogIntervalSeconds = 10;
+// Operations write the new data in chunks of this size where they can, rather
+// than in whatever pieces the decompressor or the patch engine produce.
+const size_t kWriteCoalesceSize = 1024 * 1024;  // 1 MiB
+// The blocks of REPLACE_BZ data blobs of at least this size, which hold a
+// couple of bzip2 blocks, are decompressed on all the cores.
+const uint64_t kParallelBzipMinSize = 1024 * 1024;  // 1 MiB
+// The smaller compressed data blobs decompress too quickly for writing them
+// on a thread of their own to pay off.
+const uint64_t kQueuedWriteMinSize = 256 * 1024;  // 256 KiB
+// Source partitions are copied in chunks of this size.
+const size_t kCopyPartitionBufferSize = 1024 * 1024;  // 1 MiB
+// The source blocks of the upcoming operations are prefetched up to this many
+// operations, or bytes of source blocks, ahead of the next one.
+const size_t kPrefetchMaxOperations = 32;
+const uint64_t kPrefetchMaxBytes = 16 * 1024 * 1024;  // 16 MiB
+// Room for at most this much of the metadata is made before it's been
+// received and verified.
+const uint64_t kMaxMetadataReserveSize = 64 * 1024 * 1024;  // 64 MiB
+// Blocks that can't be zeroed in the kernel are written over with zeros in
+// chunks of up to this size.
+const size_t kZeroBufferSize = 1024 * 1024;  // 1 MiB
+// With a memory budget, data blobs bigger than this fraction of it are
+// spooled to disk, and MOVE operations are copied in windows of this size.
+const uint64_t kMemoryBudgetFraction = 4;
+// When a payload is applied again, the destination blocks of the operations
+// stop being checked after this many operations in a row had to be applied.
+const int kFastForwardMissLimit = 64;
+
+// Returns the size of the pieces things are broken into to stay within
+// |memory_budget|, or 0 if there's no budget.
+uint64_t BudgetWindowSize(uint64_t memory_budget) {
+  if (memory_budget == 0)
+    return 0;
+  return max<uint64_t>(memory_budget / kMemoryBudgetFraction, 1);
+}
+
+// Returns the number of blocks of |block_size| bytes MOVE operations copy at
+// a time to stay within |memory_budget|, or 0 to copy all at once.
+uint64_t MoveWindowBlocks(uint64_t memory_budget, uint32_t block_size) {
+  if (memory_budget == 0)
+    return 0;
+  return max<uint64_t>(BudgetWindowSize(memory_budget) / block_size, 1);
+}
 
 // Converts extents to a human-readable string, for use by DumpUpdateProto().
 string ExtentsToString(const RepeatedPtrField<Extent>& extents) {
@@ -116,6 +198,124 @@ bool OpenFile(const char* path, int* fd, int* err) {
   return true;
 }
 
+// Opens |path| for writing with O_DIRECT. Returns the new descriptor, or -1 if
+// the file can't be opened that way, e.g., because the file system doesn't
+// support O_DIRECT.
+int OpenDirectFile(const char* path) {
+  int fd = open(path, O_WRONLY | O_DIRECT, 000);
+  if (fd < 0)
+    PLOG(WARNING) << "Unable to open " << path << " with O_DIRECT, writing "
+                  << "it through the page cache";
+  return fd;
+}
+
+// Returns true if |operation| has a data blob in the payload.
+bool HasDataBlob(const DeltaArchiveManifest_InstallOperation& operation) {
+  switch (operation.type()) {
+    case DeltaArchiveManifest_InstallOperation_Type_MOVE:
+    case DeltaArchiveManifest_InstallOperation_Type_ZERO:
+    case DeltaArchiveManifest_InstallOperation_Type_DISCARD:
+      return false;
+    default:
+      return true;
+  }
+}
+
+// Returns true if any of |operations| reads from the partition, i.e., if
+// it's a MOVE or a BSDIFF operation.
+bool ReadsSource(
+    const RepeatedPtrField<DeltaArchiveManifest_InstallOperation>& operations) {
+  for (int i = 0; i < operations.size(); i++) {
+    if (operations.Get(i).src_extents_size() > 0)
+      return true;
+  }
+  return false;
+}
+
+// Sets |offsets| to the data offset of the first operation with a data blob
+// at or after each of |operations|, or kuint64max if there's none.
+void GetNextBlobOffsets(
+    const RepeatedPtrField<DeltaArchiveManifest_InstallOperation>& operations,
+    vector<uint64_t>* offsets) {
+  offsets->resize(operations.size());
+  uint64_t next_offset = kuint64max;
+  for (int i = operations.size() - 1; i >= 0; i--) {
+    if (operations.Get(i).has_data_offset())
+      next_offset = operations.Get(i).data_offset();
+    (*offsets)[i] = next_offset;
+  }
+}
+
+// The blocks [start_block, end_block) written by an operation.
+struct DestinationRange {
+  bool operator<(const DestinationRange& other) const {
+    return start_block < other.start_block;
+  }
+  uint64_t start_block;
+  uint64_t end_block;
+  size_t operation_num;
+};
+
+bool SegmentStartsAfter(uint64_t offset, const PayloadSegment& segment) {
+  return offset < segment.data_offset();
+}
+
+// Returns true if the data blob of each of |operations| other than the
+// signatures' lies within one of the segments of |manifest| for |partition|.
+bool BlobsInSegments(
+    const RepeatedPtrField<DeltaArchiveManifest_InstallOperation>& operations,
+    PayloadSegment::Partition partition,
+    const DeltaArchiveManifest& manifest) {
+  for (int i = 0; i < operations.size(); i++) {
+    const DeltaArchiveManifest_InstallOperation& op = operations.Get(i);
+    if (!op.has_data_offset() || op.data_length() == 0 ||
+        (manifest.has_signatures_offset() &&
+         op.data_offset() == manifest.signatures_offset())) {
+      continue;
+    }
+    RepeatedPtrField<PayloadSegment>::const_iterator it =
+        std::upper_bound(manifest.segments().begin(),
+                         manifest.segments().end(),
+                         static_cast<uint64_t>(op.data_offset()),
+                         SegmentStartsAfter);
+    if (it == manifest.segments().begin())
+      return false;
+    --it;
+    if (it->partition() != partition ||
+        static_cast<uint64_t>(op.data_offset()) + op.data_length() >
+        it->data_offset() + it->data_length()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Copies the first |size| bytes of the partition at |source|, or all of it if
+// |size| is 0, to the start of |fd|.
+bool CopyPartition(const string& source, int fd, uint64_t size) {
+  int source_fd = open(source.c_str(), O_RDONLY);
+  TEST_AND_RETURN_FALSE_ERRNO(source_fd >= 0);
+  ScopedFdCloser source_fd_closer(&source_fd);
+  ScopedPoolBuffer buf(kCopyPartitionBufferSize);
+  TEST_AND_RETURN_FALSE(buf.get());
+  uint64_t offset = 0;
+  while (size == 0 || offset < size) {
+    size_t count = buf.size();
+    if (size != 0)
+      count = min(static_cast<uint64_t>(count), size - offset);
+    ssize_t bytes_read = 0;
+    TEST_AND_RETURN_FALSE(utils::PReadAll(source_fd, buf.get(), count, offset,
+                                          &bytes_read));
+    if (bytes_read == 0)
+      break;
+    TEST_AND_RETURN_FALSE(utils::PWriteAll(fd, buf.get(), bytes_read, offset));
+    offset += bytes_read;
+  }
+  LOG(INFO) << "Copied " << offset << " bytes from " << source;
+  TEST_AND_RETURN_FALSE(size == 0 || offset == size);
+  return true;
+}
+
 }  // namespace {}
 
 
@@ -201,17 +401,15 @@ void DeltaPerformer::UpdateOverallProgress(bool force_log,
   }
   overall_progress_ = new_overall_progress;
 
-  // Update chunk index, log as needed: if forced by called, or we completed a
-  // progress chunk, or a timeout has expired.
-  base::Time curr_time = base::Time::Now();
-  unsigned curr_progress_chunk =
-      overall_progress_ * kProgressLogMaxChunks / 100;
-  if (force_log || curr_progress_chunk > last_progress_chunk_ ||
-      curr_time > forced_progress_log_time_) {
-    forced_progress_log_time_ = curr_time + forced_progress_log_wait_;
+  // Log as needed: if forced by the caller, or we completed a progress chunk,
+  // or a timeout has expired.
+  if (progress_log_throttle_.ShouldReport(overall_progress_ / 100.0,
+                                          force_log,
+                                          base::TimeTicks::Now()))
     LogProgress(message_prefix);
-  }
-  last_progress_chunk_ = curr_progress_chunk;
+
+  __atomic_store_n(&eta_seconds_, duration_estimator_.SecondsLeft(),
+                   __ATOMIC_RELAXED);
 }
 
 
@@ -233,32 +431,262 @@ bool DeltaPerformer::IsIdempotentOperation(
   return block_count == src_ranges.blocks();
 }
 
+bool DeltaPerformer::CanRepeatOperation(
+    const DeltaArchiveManifest_InstallOperation& op) const {
+  // Operations applied from the source partitions never overwrite what they
+  // read.
+  return manifest_.apply_from_source() || IsIdempotentOperation(op);
+}
+
+DeltaPerformer::~DeltaPerformer() {
+  ClearExitCallback();
+}
+
 int DeltaPerformer::Open(const char* path, int flags, mode_t mode) {
+  if (checkpoint_on_exit_) {
+    exit_callback_.reset(
+        NewPermanentCallback(this, &DeltaPerformer::CheckpointAndExit));
+    Terminator::set_exit_callback(exit_callback_.get());
+  }
   int err;
-  if (OpenFile(path, &fd_, &err))
+  if (OpenFile(path, &fd_, &err)) {
     path_ = path;
+    IoRecorder::TrackFd(fd_, path_);
+    writeback_[0].Init(fd_, IncrementalWriteback::kDefaultChunkSize);
+    if (use_direct_io_)
+      OpenDirectIO(path, &direct_fd_);
+    if (install_plan_ &&
+        !mirrors_[0].Open(fd_, install_plan_->mirror_install_paths))
+      err = EIO;
+  }
+  if (install_plan_ &&
+      ReadLocalMetadata(prefs_, *install_plan_, &local_metadata_)) {
+    LOG(INFO) << "Resuming with the " << local_metadata_.size()
+              << " bytes of payload metadata kept from the last attempt";
+  } else {
+    local_metadata_.clear();
+  }
   return -err;
 }
 
 bool DeltaPerformer::OpenKernel(const char* kernel_path) {
   int err;
   bool success = OpenFile(kernel_path, &kernel_fd_, &err);
-  if (success)
+  if (success) {
     kernel_path_ = kernel_path;
+    IoRecorder::TrackFd(kernel_fd_, kernel_path_);
+    writeback_[1].Init(kernel_fd_, IncrementalWriteback::kDefaultChunkSize);
+    if (use_direct_io_)
+      OpenDirectIO(kernel_path, &kernel_direct_fd_);
+    if (install_plan_)
+      success = mirrors_[1].Open(kernel_fd_,
+                                 install_plan_->kernel_mirror_install_paths);
+  }
   return success;
 }
 
+void DeltaPerformer::OpenDirectIO(const char* path, int* direct_fd) {
+  *direct_fd = OpenDirectFile(path);
+  IoRecorder::TrackFd(*direct_fd, path);
+  if (*direct_fd >= 0 && !direct_io_buffers_.get())
+    direct_io_buffers_.reset(
+        new AlignedBufferPool(kWriteCoalesceSize, kDirectIOAlignment));
+}
+
+bool DeltaPerformer::OpenSourcePartitions() {
+  const bool reads_rootfs = ReadsSource(manifest_.install_operations());
+  const bool reads_kernel = ReadsSource(manifest_.kernel_install_operations());
+  if (!manifest_.apply_from_source()) {
+    // The payload patches the new partitions in place, so they have to start
+    // out as a copy of the source ones. A resumed update has copied them
+    // already. Without a source partition, e.g., when applying a payload
+    // onto an image with delta_generator, the target is taken to hold it.
+    if (next_operation_num_ > 0)
+      return true;
+    if (reads_rootfs && !install_plan_->source_path.empty()) {
+      TEST_AND_RETURN_FALSE(CopyPartition(install_plan_->source_path,
+                                          fd_,
+                                          manifest_.old_rootfs_info().size()));
+      mirrors_[0].AddWrite(0, manifest_.old_rootfs_info().size());
+    }
+    if (reads_kernel && !install_plan_->kernel_source_path.empty()) {
+      TEST_AND_RETURN_FALSE(CopyPartition(install_plan_->kernel_source_path,
+                                          kernel_fd_,
+                                          manifest_.old_kernel_info().size()));
+      mirrors_[1].AddWrite(0, manifest_.old_kernel_info().size());
+    }
+    return true;
+  }
+  if (reads_rootfs) {
+    TEST_AND_RETURN_FALSE(!install_plan_->source_path.empty());
+    source_fd_ = open(install_plan_->source_path.c_str(), O_RDONLY);
+    TEST_AND_RETURN_FALSE_ERRNO(source_fd_ >= 0);
+    IoRecorder::TrackFd(source_fd_, install_plan_->source_path);
+  }
+  if (reads_kernel) {
+    TEST_AND_RETURN_FALSE(!install_plan_->kernel_source_path.empty());
+    kernel_source_fd_ = open(install_plan_->kernel_source_path.c_str(),
+                             O_RDONLY);
+    TEST_AND_RETURN_FALSE_ERRNO(kernel_source_fd_ >= 0);
+    IoRecorder::TrackFd(kernel_source_fd_, install_plan_->kernel_source_path);
+  }
+  return true;
+}
+
+void DeltaPerformer::PrefetchSourceBlocks() {
+  vector<Extent> extents[2];
+  NextPrefetchExtents(&extents[0], &extents[1]);
+  for (int kernel = 0; kernel < 2; kernel++) {
+    const int source_fd = SourceFd(kernel == 1);
+    for (vector<Extent>::const_iterator it = extents[kernel].begin();
+         it != extents[kernel].end(); ++it) {
+      // This only starts reading the blocks into the page cache.
+      posix_fadvise(source_fd,
+                    it->start_block() * block_size_,
+                    it->num_blocks() * block_size_,
+                    POSIX_FADV_WILLNEED);
+    }
+  }
+}
+
+void DeltaPerformer::NextPrefetchExtents(vector<Extent>* rootfs_extents,
+                                         vector<Extent>* kernel_extents) {
+  uint64_t bytes = 0;
+  for (size_t i = next_operation_num_;
+       i < num_total_operations_ &&
+           i < next_operation_num_ + kPrefetchMaxOperations &&
+           bytes < kPrefetchMaxBytes;
+       i++) {
+    bool is_kernel_partition = false;
+    const DeltaArchiveManifest_InstallOperation& op =
+        GetOperation(i, &is_kernel_partition);
+    const bool prefetch = (i >= next_prefetch_operation_num_);
+    for (int j = 0; j < op.src_extents_size(); j++) {
+      const Extent& extent = op.src_extents(j);
+      if (extent.start_block() == kSparseHole)
+        continue;
+      if (prefetch)
+        (is_kernel_partition ? kernel_extents : rootfs_extents)->push_back(
+            extent);
+      // The operations prefetched already still count towards the window.
+      bytes += extent.num_blocks() * block_size_;
+    }
+    if (prefetch)
+      next_prefetch_operation_num_ = i + 1;
+  }
+}
+
+int DeltaPerformer::SourceFd(bool is_kernel_partition) const {
+  const int source_fd = is_kernel_partition ? kernel_source_fd_ : source_fd_;
+  if (source_fd >= 0)
+    return source_fd;
+  return is_kernel_partition ? kernel_fd_ : fd_;
+}
+
+BlockCache* DeltaPerformer::WrittenBlockCache() const {
+  return manifest_.apply_from_source() ? NULL : block_cache_.get();
+}
+
+bool DeltaPerformer::KeepsSourceBlocks(
+    const DeltaArchiveManifest_InstallOperation& operation) const {
+  return !manifest_.src_reuse_hints() || operation.src_reused();
+}
+
+void DeltaPerformer::InvalidateCachedBlocks(
+    const DeltaArchiveManifest_InstallOperation& operation,
+    bool is_kernel_partition) {
+  // The source partitions of a payload applied from them are never written.
+  BlockCache* cache = WrittenBlockCache();
+  if (!cache)
+    return;
+  const int fd = is_kernel_partition ? kernel_fd_ : fd_;
+  for (int i = 0; i < operation.dst_extents_size(); i++) {
+    const Extent& extent = operation.dst_extents(i);
+    if (extent.start_block() != kSparseHole)
+      cache->Invalidate(fd, extent.start_block(), extent.num_blocks());
+  }
+}
+
+void DeltaPerformer::ClearExitCallback() {
+  if (exit_callback_.get()) {
+    Terminator::set_exit_callback(NULL);
+    exit_callback_.reset();
+  }
+}
+
+void DeltaPerformer::CheckpointAndExit() {
+  // Nothing is gained from resuming before the first operation.
+  if (manifest_valid_ && next_operation_num_ > 0) {
+    // The operations applied ahead are replayed on resume, so they only
+    // have to be done with.
+    WaitAheadOperations();
+    if (WaitAllOperations() && CheckpointUpdateProgress()) {
+      LOG(INFO) << "Checkpointed the update at operation "
+                << next_operation_num_ << " before exiting.";
+    } else {
+      LOG(ERROR) << "Unable to checkpoint the update before exiting.";
+    }
+  }
+  Terminator::Exit();
+}
+
 int DeltaPerformer::Close() {
+  ClearExitCallback();
   int err = 0;
 
+  const bool ahead_success = WaitAheadOperations();
+  if (!WaitAllOperations() || !ahead_success) {
+    LOG(ERROR) << "Install operations failed before Close().";
+    err = 1;
+  }
+  // Most of the partitions are on disk already, so this doesn't take long.
+  for (size_t i = 0; i < arraysize(writeback_); i++) {
+    if (!writeback_[i].Finish() && err == 0)
+      err = EIO;
+  }
+  for (size_t i = 0; i < arraysize(mirrors_); i++) {
+    if (!mirrors_[i].Close() && err == 0)
+      err = EIO;
+  }
+  IoRecorder::ForgetFd(fd_);
   if (close(fd_) == -1) {
     err = errno;
     PLOG(ERROR) << "Unable to close rootfs fd:";
   }
+  // Nothing is buffered in the page cache for the O_DIRECT descriptors.
+  if (direct_fd_ >= 0) {
+    IoRecorder::ForgetFd(direct_fd_);
+    close(direct_fd_);
+    direct_fd_ = -1;
+  }
+  if (kernel_direct_fd_ >= 0) {
+    IoRecorder::ForgetFd(kernel_direct_fd_);
+    close(kernel_direct_fd_);
+    kernel_direct_fd_ = -1;
+  }
+  // The source partitions are only read from.
+  if (source_fd_ >= 0) {
+    IoRecorder::ForgetFd(source_fd_);
+    close(source_fd_);
+    source_fd_ = -1;
+  }
+  if (kernel_source_fd_ >= 0) {
+    IoRecorder::ForgetFd(kernel_source_fd_);
+    close(kernel_source_fd_);
+    kernel_source_fd_ = -1;
+  }
+  if (block_cache_.get()) {
+    LOG(INFO) << "The block cache had " << block_cache_->hits()
+              << " of the " << block_cache_->hits() +
+                 block_cache_->misses() << " source blocks read.";
+  }
   LOG_IF(ERROR, !hash_calculator_.Finalize()) << "Unable to finalize the hash.";
+  // The scratch buffers aren't needed until the next update.
+  TrimSharedBufferPools();
   fd_ = -2;  // Set to invalid so that calls to Open() will fail.
   path_ = "";
-  if (!buffer_.empty()) {
+  if (!buffer_.empty() || spool_.is_open()) {
+    spool_.Close();
     LOG(ERROR) << "Called Close() while buffer not empty!";
     if (err >= 0) {
       err = 1;
@@ -310,24 +738,41 @@ DeltaPerformer::MetadataParseResult DeltaPerformer::ParsePayloadMetadata(
     DeltaArchiveManifest* manifest,
     uint64_t* metadata_size,
     ActionExitCode* error) {
+  return ParsePayloadMetadata(payload.empty() ? NULL : &payload[0],
+                              payload.size(),
+                              manifest,
+                              metadata_size,
+                              error);
+}
+
+DeltaPerformer::MetadataParseResult DeltaPerformer::ParsePayloadMetadata(
+    const char* payload,
+    size_t payload_size,
+    DeltaArchiveManifest* manifest,
+    uint64_t* metadata_size,
+    ActionExitCode* error) {
   *error = kActionCodeSuccess;
 
   // manifest_offset is the byte offset where the manifest protobuf begins.
   const uint64_t manifest_offset = GetManifestOffset();
-  if (payload.size() < manifest_offset) {
+  if (payload_size < manifest_offset) {
     // Don't have enough bytes to even know the manifest size.
     return kMetadataParseInsufficientData;
   }
 
   // Validate the magic string.
-  if (memcmp(payload.data(), kDeltaMagic, strlen(kDeltaMagic)) != 0) {
+  if (memcmp(payload, kDeltaMagic, strlen(kDeltaMagic)) != 0) {
     LOG(ERROR) << "Bad payload format -- invalid delta magic.";
     *error = kActionCodeDownloadInvalidMetadataMagicString;
     return kMetadataParseError;
   }
 
-  // TODO(jaysri): Compare the version number and skip unknown manifest
-  // versions. We don't check the version at all today.
+  // TODO(jaysri): Skip unknown manifest versions. Only the version of
+  // compacted manifests is told apart today.
+  uint64_t version;
+  COMPILE_ASSERT(sizeof(version) == kDeltaVersionSize, version_size_mismatch);
+  memcpy(&version, &payload[strlen(kDeltaMagic)], kDeltaVersionSize);
+  version = be64toh(version);
 
   // Next, parse the manifest size.
   uint64_t manifest_size;
@@ -340,7 +785,7 @@ DeltaPerformer::MetadataParseResult DeltaPerformer::ParsePayloadMetadata(
 
   // We should wait for the full metadata to be read in before we can parse it.
   *metadata_size = manifest_offset + manifest_size;
-  if (payload.size() < *metadata_size) {
+  if (payload_size < *metadata_size) {
     return kMetadataParseInsufficientData;
   }
 
@@ -351,9 +796,33 @@ DeltaPerformer::MetadataParseResult DeltaPerformer::ParsePayloadMetadata(
     *error = kActionCodeDownloadManifestParseError;
     return kMetadataParseError;
   }
+  if (version == kCompactManifestVersion && !ExpandManifest(manifest)) {
+    LOG(ERROR) << "Unable to expand the compact manifest in update file.";
+    *error = kActionCodeDownloadManifestParseError;
+    return kMetadataParseError;
+  }
   return kMetadataParseSuccess;
 }
 
+DeltaPerformer::MetadataParseResult DeltaPerformer::PrefetchMetadata(
+    const char* payload,
+    size_t payload_size) {
+  CHECK(!manifest_valid_ && total_bytes_received_ == 0);
+  if (metadata_prefetched_)
+    return kMetadataParseSuccess;
+  ActionExitCode error = kActionCodeSuccess;
+  const MetadataParseResult result = local_metadata_.empty() ?
+      ParsePayloadMetadata(payload, payload_size, &manifest_,
+                           &manifest_metadata_size_, &error) :
+      ParsePayloadMetadata(local_metadata_, &manifest_,
+                           &manifest_metadata_size_, &error);
+  if (result == kMetadataParseSuccess) {
+    LOG(INFO) << "Parsed the " << manifest_metadata_size_
+              << " bytes of payload metadata ahead of the payload.";
+    metadata_prefetched_ = true;
+  }
+  return result;
+}
 
 // Wrapper around write. Returns true if all requested bytes
 // were written, or false on any error, regardless of progress
@@ -363,31 +832,121 @@ bool DeltaPerformer::Write(const void* bytes, size_t count,
   *error = kActionCodeSuccess;
 
   const char* c_bytes = reinterpret_cast<const char*>(bytes);
-  buffer_.insert(buffer_.end(), c_bytes, c_bytes + count);
-  system_state_->payload_state()->DownloadProgress(count);
+  if (!buffer_.Append(c_bytes, count)) {
+    *error = kActionCodeDownloadWriteError;
+    return false;
+  }
+  return ProcessReceivedBytes(count, error);
+}
+
+char* DeltaPerformer::GetWriteBuffer(size_t count) {
+  return buffer_.PrepareAppend(count);
+}
+
+bool DeltaPerformer::CommitWriteBuffer(size_t count, ActionExitCode* error) {
+  *error = kActionCodeSuccess;
+  buffer_.CommitAppend(count);
+  return ProcessReceivedBytes(count, error);
+}
+
+bool DeltaPerformer::GetRepairRange(uint64_t* offset,
+                                    uint64_t* length) const {
+  if (!repair_pending_)
+    return false;
+  bool is_kernel_partition = false;
+  const DeltaArchiveManifest_InstallOperation& op =
+      GetOperation(repair_operation_num_, &is_kernel_partition);
+  *offset = manifest_metadata_size_ + op.data_offset();
+  *length = op.data_length();
+  return true;
+}
+
+bool DeltaPerformer::RepairOperationData(const char* bytes,
+                                         size_t count,
+                                         ActionExitCode* error) {
+  *error = kActionCodeSuccess;
+  CHECK(repair_pending_);
+  repair_pending_ = false;
+  bool is_kernel_partition = false;
+  const DeltaArchiveManifest_InstallOperation& op =
+      GetOperation(repair_operation_num_, &is_kernel_partition);
+  if (!bytes || count != op.data_length() ||
+      !buffer_.Overwrite(op.data_offset() - buffer_offset_, bytes, count)) {
+    LOG(ERROR) << "Unable to fetch the data blob of operation "
+               << repair_operation_num_ << " again.";
+    *error = kActionCodeDownloadOperationHashMismatch;
+    return false;
+  }
+  // The blob is validated again before it's applied.
+  return ProcessReceivedBytes(0, error);
+}
+
+bool DeltaPerformer::ProcessReceivedBytes(size_t count,
+                                          ActionExitCode* error) {
+  if (system_state_ && report_download_progress_)
+    system_state_->payload_state()->DownloadProgress(count);
 
   // Update the total byte downloaded count and the progress logs.
   total_bytes_received_ += count;
+  duration_estimator_.BytesReceived(count, base::TimeTicks::Now());
+  MemoryTracker::SetBufferSize("payload_buffer", buffer_.capacity());
   UpdateOverallProgress(false, "Completed ");
 
-  if (!manifest_valid_) {
-    MetadataParseResult result = ParsePayloadMetadata(buffer_,
-                                                      &manifest_,
-                                                      &manifest_metadata_size_,
-                                                      error);
+  if (!manifest_valid_ && !local_metadata_.empty()) {
+    // The download starts past the metadata, at the checkpoint.
+    if (!metadata_prefetched_ &&
+        ParsePayloadMetadata(local_metadata_, &manifest_,
+                             &manifest_metadata_size_, error) !=
+        kMetadataParseSuccess) {
+      if (*error == kActionCodeSuccess)
+        *error = kActionCodeDownloadManifestParseError;
+      return false;
+    }
+    vector<char>().swap(local_metadata_);
+  } else if (!manifest_valid_) {
+    // Once the header has given the metadata size, the metadata is only
+    // parsed when all of it has been received.
+    if (manifest_metadata_size_ > 0 &&
+        buffer_.size() < manifest_metadata_size_) {
+      return true;
+    }
+    // The metadata prefetched is the head of |buffer_|.
+    MetadataParseResult result = metadata_prefetched_ ?
+        kMetadataParseSuccess :
+        ParsePayloadMetadata(buffer_.data(),
+                             buffer_.size(),
+                             &manifest_,
+                             &manifest_metadata_size_,
+                             error);
     if (result == kMetadataParseError) {
       return false;
     }
     if (result == kMetadataParseInsufficientData) {
+      // Make room for the rest of the metadata, so that a large manifest
+      // isn't moved around while it comes in. The size isn't verified yet,
+      // so a bogus one only costs as much as the largest sane manifest.
+      if (manifest_metadata_size_ > 0) {
+        buffer_.Reserve(std::min(manifest_metadata_size_,
+                                 kMaxMetadataReserveSize));
+      }
       return true;
     }
+    if (checkpoint_file_) {
+      LOG_IF(WARNING, !checkpoint_file_->WriteMetadata(
+          install_plan_->payload_hash, buffer_.data(),
+          manifest_metadata_size_))
+          << "Unable to keep the payload metadata.";
+    }
     // Remove protobuf and header info from buffer_, so buffer_ contains
     // just data blobs
     DiscardBufferHeadBytes(manifest_metadata_size_);
     LOG_IF(WARNING, !prefs_->SetInt64(kPrefsManifestMetadataSize,
                                       manifest_metadata_size_))
         << "Unable to save the manifest metadata size.";
+  }
+  if (!manifest_valid_) {
     manifest_valid_ = true;
+    MemoryTracker::SetBufferSize("manifest", manifest_.SpaceUsed());
 
     LogPartitionInfo(manifest_);
     if (!PrimeUpdateState()) {
@@ -395,85 +954,413 @@ bool DeltaPerformer::Write(const void* bytes, size_t count,
       LOG(ERROR) << "Unable to prime the update state.";
       return false;
     }
+    if (!OpenSourcePartitions()) {
+      *error = kActionCodeDownloadStateInitializationError;
+      LOG(ERROR) << "Unable to set up the source partitions.";
+      return false;
+    }
+    if (block_cache_size_ >= block_size_) {
+      block_cache_.reset(new BlockCache(
+          block_cache_size_ / block_size_, block_size_));
+    }
+    if (!InitHashTree()) {
+      *error = kActionCodeDownloadManifestParseError;
+      LOG(ERROR) << "The rootfs hash tree isn't valid.";
+      return false;
+    }
+    // The partitions of resumed updates have holes punched already.
+    if (file_target_ && next_operation_num_ == 0 &&
+        (!PrepareFileTarget(false) || !PrepareFileTarget(true))) {
+      *error = kActionCodeDownloadStateInitializationError;
+      LOG(ERROR) << "Unable to prepare the partition files.";
+      return false;
+    }
+
+    vector<uint64_t> segment_boundaries;
+    if (manifest_.segments_size() > 0 &&
+        !GetPayloadSegmentBoundaries(manifest_, manifest_metadata_size_,
+                                     &segment_boundaries)) {
+      *error = kActionCodeDownloadManifestParseError;
+      LOG(ERROR) << "The payload segments don't match the operations.";
+      return false;
+    }
 
     num_rootfs_operations_ = manifest_.install_operations_size();
     num_total_operations_ =
         num_rootfs_operations_ + manifest_.kernel_install_operations_size();
-    if (next_operation_num_ > 0)
+    GetOperationOrder(manifest_, &operation_order_);
+    InitApplyAhead();
+    duration_estimator_.Init(manifest_, block_size_,
+                             install_plan_->payload_size,
+                             total_bytes_received_);
+    for (size_t i = 0; i < next_operation_num_; i++) {
+      bool is_kernel_partition = false;
+      duration_estimator_.OperationApplied(
+          GetOperation(i, &is_kernel_partition), base::TimeDelta());
+    }
+    for (int i = 0; i < 2; i++) {
+      dst_hashes_cover_[i] =
+          next_operation_num_ == 0 && DestinationHashesCover(i == 1);
+    }
+    fast_forward_ = next_operation_num_ == 0 && install_plan_ &&
+        install_plan_->is_reapply;
+    if (next_operation_num_ > 0) {
       UpdateOverallProgress(true, "Resuming after ");
+      if (Trace::enabled()) {
+        // Ties the events of the interrupted attempt to this one.
+        TraceArgs args;
+        args["operation"] = base::Uint64ToString(next_operation_num_);
+        args["data_offset"] = base::Uint64ToString(buffer_offset_);
+        args["payload_hash"] = install_plan_->payload_hash;
+        Trace::AddInstantEvent("update", "Resume", args);
+      }
+      ReleaseAppliedOperations();
+    }
     LOG(INFO) << "Starting to apply update payload operations";
   }
 
   while (next_operation_num_ < num_total_operations_) {
-    const bool is_kernel_partition =
-        (next_operation_num_ >= num_rootfs_operations_);
+    // Leaves the rest of the data to the next attempt, after the checkpoint
+    // CheckpointAndExit() takes once this returns to the main loop.
+    if (exit_callback_.get() && Terminator::exit_requested())
+      return true;
+    // The next operation waits for its data blob to be fetched again.
+    if (repair_pending_)
+      return true;
+    PrefetchSourceBlocks();
+    bool is_kernel_partition = false;
     const DeltaArchiveManifest_InstallOperation &op =
-        is_kernel_partition ?
-        manifest_.kernel_install_operations(
-            next_operation_num_ - num_rootfs_operations_) :
-        manifest_.install_operations(next_operation_num_);
-    if (!CanPerformInstallOperation(op)) {
+        GetOperation(next_operation_num_, &is_kernel_partition);
+    if (ShouldSpoolOperation(op)) {
+      if (!SpoolOperationData(op)) {
+        LOG(ERROR) << "Unable to spool the data of operation "
+                   << next_operation_num_;
+        *error = kActionCodeDownloadWriteError;
+        return false;
+      }
+      if (!spool_.complete())
+        return true;
+    } else if (!CanPerformInstallOperation(op)) {
       // This means we don't have enough bytes received yet to carry out the
-      // next operation.
+      // next operation. Make room for the rest of its data blob, so that a
+      // large blob isn't moved around while it comes in.
+      if (op.data_offset() >= buffer_offset_) {
+        buffer_.Reserve(op.data_offset() + op.data_length() -
+                        buffer_offset_);
+      }
       return true;
     }
 
-    // Note: Validate must be called only if CanPerformInstallOperation is
-    // called. Otherwise, we might be failing operations before even if there
-    // isn't sufficient data to compute the proper hash.
-    *error = ValidateOperationHash(op);
-    if (*error != kActionCodeSuccess) {
-      if (install_plan_->hash_checks_mandatory) {
-        LOG(ERROR) << "Mandatory operation hash check failed";
-        return false;
+    // Operations applied ahead had their data blob validated already.
+    map<size_t, shared_ptr<InstallOperationTask> >::iterator ahead =
+        ahead_operations_.find(next_operation_num_);
+    // Skipped operations don't use their data blob, which only goes through
+    // the payload hash.
+    const bool fast_forward = ahead == ahead_operations_.end() &&
+        CanFastForwardOperation(op, is_kernel_partition);
+    if (ahead == ahead_operations_.end()) {
+      if (HasDataBlob(op))
+        ahead_candidates_.erase(op.data_offset());
+      // Note: Validate must be called only if CanPerformInstallOperation is
+      // called. Otherwise, we might be failing operations before even if
+      // there isn't sufficient data to compute the proper hash.
+      *error = fast_forward ? kActionCodeSuccess : ValidateOperationHash(
+          op, next_operation_num_,
+          spool_.is_open() ? spool_.data() : buffer_.data());
+      if (*error == kActionCodeDownloadOperationHashMismatch &&
+          repair_operations_ && !spool_.is_open() &&
+          repair_operation_num_ != static_cast<int64_t>(next_operation_num_)) {
+        LOG(WARNING) << "Fetching the data blob of operation "
+                     << next_operation_num_ << " again.";
+        repair_pending_ = true;
+        repair_operation_num_ = next_operation_num_;
+        *error = kActionCodeSuccess;
+        return true;
+      }
+      if (*error != kActionCodeSuccess) {
+        if (install_plan_->hash_checks_mandatory) {
+          LOG(ERROR) << "Mandatory operation hash check failed";
+          return false;
+        }
+
+        // For non-mandatory cases, just log a warning.
+        LOG_EVERY_N_SEC(WARNING, kOperationLogIntervalSeconds)
+            << "Ignoring operation validation errors";
+        *error = kActionCodeSuccess;
       }
-
-      // For non-mandatory cases, just log a warning.
-      LOG(WARNING) << "Ignoring operation validation errors";
-      *error = kActionCodeSuccess;
     }
 
     // Makes sure we unblock exit when this operation completes.
     ScopedTerminatorExitUnblocker exit_unblocker =
         ScopedTerminatorExitUnblocker();  // Avoids a compiler unused var bug.
-    // Log every thousandth operation, and also the first and last ones
-    if (op.type() == DeltaArchiveManifest_InstallOperation_Type_REPLACE ||
-        op.type() == DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ) {
-      if (!PerformReplaceOperation(op, is_kernel_partition)) {
-        LOG(ERROR) << "Failed to perform replace operation "
-                   << next_operation_num_;
+    if (OverwritesCheckpointReads(op, is_kernel_partition)) {
+      if (!WaitAllOperations()) {
         *error = kActionCodeDownloadOperationExecutionError;
         return false;
       }
-    } else if (op.type() == DeltaArchiveManifest_InstallOperation_Type_MOVE) {
-      if (!PerformMoveOperation(op, is_kernel_partition)) {
-        LOG(ERROR) << "Failed to perform move operation "
-                   << next_operation_num_;
+      if (!CheckpointUpdateProgress()) {
+        // Resuming from the previous checkpoint would replay this operation
+        // out of order, so don't allow resuming until the next checkpoint.
+        ResetUpdateProgress(prefs_, true);
+        ClearCheckpointReads();
+      }
+    }
+
+    const bool is_idempotent = CanRepeatOperation(op);
+    if (ahead != ahead_operations_.end()) {
+      // Its data blob still has to go through the payload hash.
+      shared_ptr<InstallOperationTask> task = ahead->second;
+      ahead_operations_.erase(ahead);
+      if (!thread_pool_->Wait(task.get())) {
+        LOG(ERROR) << "Failed to perform operation " << next_operation_num_;
         *error = kActionCodeDownloadOperationExecutionError;
         return false;
       }
-    } else if (op.type() == DeltaArchiveManifest_InstallOperation_Type_BSDIFF) {
-      if (!PerformBsdiffOperation(op, is_kernel_partition)) {
-        LOG(ERROR) << "Failed to perform bsdiff operation "
-                   << next_operation_num_;
+      AddOperationStats(op, task->run_time());
+      buffer_offset_ += op.data_length();
+      DiscardBufferHeadBytes(op.data_length());
+    } else if (fast_forward) {
+      if (HasDataBlob(op)) {
+        ExtractSignatureMessage(op);
+        const char* data = NULL;
+        if (!TakeOperationData(op, &data)) {
+          LOG(ERROR) << "Failed to skip operation " << next_operation_num_;
+          *error = kActionCodeDownloadOperationExecutionError;
+          return false;
+        }
+        ReleaseOperationData(op);
+      }
+    } else if (max_concurrent_operations_ > 1 && is_idempotent &&
+               !spool_.is_open()) {
+      if (!ScheduleOperation(op, is_kernel_partition)) {
+        LOG(ERROR) << "Failed to schedule operation " << next_operation_num_;
         *error = kActionCodeDownloadOperationExecutionError;
         return false;
       }
+    } else {
+      // Operations applied synchronously, e.g., non-idempotent ones that
+      // overwrite their own source, must see the result of all earlier ones.
+      if (!WaitAllOperations()) {
+        *error = kActionCodeDownloadOperationExecutionError;
+        return false;
+      }
+      InvalidateCachedBlocks(op, is_kernel_partition);
+      ScopedTraceEvent trace_event(
+          "operation", DeltaArchiveManifest_InstallOperation_Type_Name(
+              op.type()));
+      trace_event.AddArg("operation",
+                         base::Uint64ToString(next_operation_num_));
+      const base::TimeTicks start_time = base::TimeTicks::Now();
+      UE_PROBE3(operation_start, next_operation_num_,
+                static_cast<int>(op.type()), op.data_length());
+      MemoryTracker::SetOperation(
+          DeltaArchiveManifest_InstallOperation_Type_Name(op.type()));
+      // Log every thousandth operation, and also the first and last ones
+      if (op.type() == DeltaArchiveManifest_InstallOperation_Type_REPLACE ||
+          op.type() == DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ ||
+          op.type() == DeltaArchiveManifest_InstallOperation_Type_REPLACE_XZ ||
+          op.type() ==
+          DeltaArchiveManifest_InstallOperation_Type_REPLACE_XZ_DICT) {
+        if (!PerformReplaceOperation(op, is_kernel_partition)) {
+          LOG(ERROR) << "Failed to perform replace operation "
+                     << next_operation_num_;
+          *error = kActionCodeDownloadOperationExecutionError;
+          return false;
+        }
+      } else if (op.type() ==
+                 DeltaArchiveManifest_InstallOperation_Type_MOVE) {
+        if (!PerformMoveOperation(op, is_kernel_partition)) {
+          LOG(ERROR) << "Failed to perform move operation "
+                     << next_operation_num_;
+          *error = kActionCodeDownloadOperationExecutionError;
+          return false;
+        }
+      } else if (op.type() ==
+                 DeltaArchiveManifest_InstallOperation_Type_BSDIFF) {
+        if (!PerformBsdiffOperation(op, is_kernel_partition)) {
+          LOG(ERROR) << "Failed to perform bsdiff operation "
+                     << next_operation_num_;
+          *error = kActionCodeDownloadOperationExecutionError;
+          return false;
+        }
+      } else if (op.type() ==
+                 DeltaArchiveManifest_InstallOperation_Type_STREAM_DIFF) {
+        if (!PerformStreamDiffOperation(op, is_kernel_partition)) {
+          LOG(ERROR) << "Failed to perform stream diff operation "
+                     << next_operation_num_;
+          *error = kActionCodeDownloadOperationExecutionError;
+          return false;
+        }
+      } else if (op.type() ==
+                 DeltaArchiveManifest_InstallOperation_Type_ZERO ||
+                 op.type() ==
+                 DeltaArchiveManifest_InstallOperation_Type_DISCARD) {
+        if (!PerformZeroOperation(op, is_kernel_partition)) {
+          LOG(ERROR) << "Failed to perform zero operation "
+                     << next_operation_num_;
+          *error = kActionCodeDownloadOperationExecutionError;
+          return false;
+        }
+      }
+      UE_PROBE3(operation_end, next_operation_num_,
+                static_cast<int>(op.type()),
+                graph_utils::BlocksInExtents(op.dst_extents()) * block_size_);
+      MemoryTracker::SetOperation("");
+      AddOperationStats(op, base::TimeTicks::Now() - start_time);
+    }
+
+    for (int i = 0; i < op.src_extents_size(); i++) {
+      if (op.src_extents(i).start_block() != kSparseHole &&
+          !manifest_.apply_from_source())
+        checkpoint_read_ranges_[is_kernel_partition].AddExtent(
+            op.src_extents(i));
+    }
+
+    for (int i = 0; i < op.dst_extents_size(); i++) {
+      const Extent& extent = op.dst_extents(i);
+      if (extent.start_block() == kSparseHole)
+        continue;
+      writeback_[is_kernel_partition].AddWrite(
+          extent.start_block() * block_size_,
+          extent.num_blocks() * block_size_);
+      mirrors_[is_kernel_partition].AddWrite(
+          extent.start_block() * block_size_,
+          extent.num_blocks() * block_size_);
+      if (hash_tree_.get() && !is_kernel_partition)
+        hash_tree_extents_.push_back(extent);
     }
 
     next_operation_num_++;
     UpdateOverallProgress(false, "Completed ");
-    CheckpointUpdateProgress();
+
+    // A checkpoint claims that all operations before next_operation_num_ have
+    // been applied, so it can only be taken when none is in flight. Draining
+    // the queue once it's full, and after the last operation, bounds the
+    // amount of work that's lost on interruption.
+    const bool is_last_operation =
+        next_operation_num_ == num_total_operations_;
+    if (pending_operations_.size() >= max_concurrent_operations_ ||
+        is_last_operation) {
+      if (!WaitAllOperations()) {
+        *error = kActionCodeDownloadOperationExecutionError;
+        return false;
+      }
+    }
+    // The tree is written out before the last checkpoint, after which the
+    // operations aren't applied again.
+    if (is_last_operation && !FinishHashTree()) {
+      *error = kActionCodeNewRootfsVerificationError;
+      return false;
+    }
+    // The mirrors are brought up to date before any checkpoint too.
+    if (pending_operations_.empty() && !MirrorWrittenBlocks()) {
+      *error = kActionCodeDownloadWriteError;
+      return false;
+    }
+    // Non-idempotent operations clear the update state, so checkpoint right
+    // after them to make the update resumable again.
+    if (pending_operations_.empty() &&
+        (!is_idempotent || is_last_operation || ShouldCheckpoint()))
+      CheckpointUpdateProgress();
+    if (pending_operations_.empty()) {
+      ReleaseAppliedOperations();
+      // The recorded writes have all completed, and are hashed before
+      // they're written back and dropped from the page cache.
+      HashWrittenBlocks();
+      writeback_[is_kernel_partition].Writeback();
+    }
+  }
+  return true;
+}
+
+void DeltaPerformer::ReleaseAppliedOperations() {
+  CHECK(pending_operations_.empty());
+  for (; released_operation_num_ < next_operation_num_;
+       released_operation_num_++) {
+    const size_t index = operation_order_[released_operation_num_];
+    DeltaArchiveManifest_InstallOperation* op =
+        index >= num_rootfs_operations_ ?
+        manifest_.mutable_kernel_install_operations(
+            index - num_rootfs_operations_) :
+        manifest_.mutable_install_operations(index);
+    // Clear() would keep the extents allocated for reuse.
+    DeltaArchiveManifest_InstallOperation released;
+    op->Swap(&released);
+  }
+}
+
+void DeltaPerformer::GetOperationOrder(const DeltaArchiveManifest& manifest,
+                                       vector<size_t>* order) {
+  const size_t num_rootfs_operations = manifest.install_operations_size();
+  const size_t num_kernel_operations =
+      manifest.kernel_install_operations_size();
+  vector<uint64_t> rootfs_blob_offsets;
+  vector<uint64_t> kernel_blob_offsets;
+  GetNextBlobOffsets(manifest.install_operations(), &rootfs_blob_offsets);
+  GetNextBlobOffsets(manifest.kernel_install_operations(),
+                     &kernel_blob_offsets);
+  order->clear();
+  order->reserve(num_rootfs_operations + num_kernel_operations);
+  size_t rootfs = 0;
+  size_t kernel = 0;
+  while (rootfs < num_rootfs_operations || kernel < num_kernel_operations) {
+    // Rootfs operations that are only followed by ones without a blob don't
+    // hold back the kernel ones, but are still applied before them.
+    const bool kernel_next =
+        rootfs == num_rootfs_operations ||
+        (kernel < num_kernel_operations &&
+         rootfs_blob_offsets[rootfs] != kuint64max &&
+         kernel_blob_offsets[kernel] < rootfs_blob_offsets[rootfs]);
+    if (kernel_next)
+      order->push_back(num_rootfs_operations + kernel++);
+    else
+      order->push_back(rootfs++);
+  }
+}
+
+bool DeltaPerformer::GetPayloadSegmentBoundaries(
+    const DeltaArchiveManifest& manifest,
+    uint64_t metadata_size,
+    vector<uint64_t>* boundaries) {
+  boundaries->clear();
+  uint64_t end = 0;
+  for (int i = 0; i < manifest.segments_size(); i++) {
+    const PayloadSegment& segment = manifest.segments(i);
+    if (segment.data_length() == 0 || segment.data_offset() < end ||
+        segment.data_offset() + segment.data_length() < segment.data_offset()) {
+      return false;
+    }
+    if (i == 0 || segment.data_offset() != end)
+      boundaries->push_back(metadata_size + segment.data_offset());
+    end = segment.data_offset() + segment.data_length();
+    boundaries->push_back(metadata_size + end);
+  }
+  if (!BlobsInSegments(manifest.install_operations(), PayloadSegment::ROOTFS,
+                       manifest) ||
+      !BlobsInSegments(manifest.kernel_install_operations(),
+                       PayloadSegment::KERNEL, manifest)) {
+    boundaries->clear();
+    return false;
   }
   return true;
 }
 
+const DeltaArchiveManifest_InstallOperation& DeltaPerformer::GetOperation(
+    size_t operation_num,
+    bool* is_kernel_partition) const {
+  const size_t index = operation_order_[operation_num];
+  *is_kernel_partition = (index >= num_rootfs_operations_);
+  return *is_kernel_partition ?
+      manifest_.kernel_install_operations(index - num_rootfs_operations_) :
+      manifest_.install_operations(index);
+}
+
 bool DeltaPerformer::CanPerformInstallOperation(
     const chromeos_update_engine::DeltaArchiveManifest_InstallOperation&
     operation) {
-  // Move operations don't require any data blob, so they can always
-  // be performed
-  if (operation.type() == DeltaArchiveManifest_InstallOperation_Type_MOVE)
+  // Move, zero and discard operations don't require any data blob, so they
+  // can always be performed
+  if (!HasDataBlob(operation))
     return true;
 
   // See if we have the entire data blob in the buffer
@@ -486,60 +1373,434 @@ bool DeltaPerformer::CanPerformInstallOperation(
       (buffer_offset_ + buffer_.size());
 }
 
-bool DeltaPerformer::PerformReplaceOperation(
-    const DeltaArchiveManifest_InstallOperation& operation,
-    bool is_kernel_partition) {
-  CHECK(operation.type() == \
-        DeltaArchiveManifest_InstallOperation_Type_REPLACE || \
-        operation.type() == \
-        DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ);
+bool DeltaPerformer::ShouldSpoolOperation(
+    const DeltaArchiveManifest_InstallOperation& operation) const {
+  if (memory_budget_ == 0 || !HasDataBlob(operation) ||
+      operation.data_length() <= BudgetWindowSize(memory_budget_))
+    return false;
+  // Only the blob of the next operation is ever spooled.
+  if (spool_.is_open())
+    return true;
+  // The signature blob is kept in |buffer_|, where it's extracted from, and
+  // blobs that don't start at its head would leave bytes before them behind.
+  if (manifest_.has_signatures_offset() &&
+      manifest_.signatures_offset() == operation.data_offset())
+    return false;
+  return operation.data_offset() == buffer_offset_;
+}
+
+bool DeltaPerformer::SpoolOperationData(
+    const DeltaArchiveManifest_InstallOperation& operation) {
+  // |buffer_offset_| stays at the start of the blob until the operation is
+  // applied, so the checkpoints taken before then resume from there.
+  if (!spool_.is_open())
+    TEST_AND_RETURN_FALSE(spool_.Open(spool_dir_, operation.data_length()));
+  const size_t count =
+      min<uint64_t>(buffer_.size(), spool_.length() - spool_.size());
+  TEST_AND_RETURN_FALSE(spool_.Append(buffer_.data(), count));
+  buffer_.Consume(count);
+  return true;
+}
 
+bool DeltaPerformer::TakeOperationData(
+    const DeltaArchiveManifest_InstallOperation& operation,
+    const char** data) {
+  if (spool_.is_open()) {
+    TEST_AND_RETURN_FALSE(spool_.complete());
+    TEST_AND_RETURN_FALSE(spool_.length() == operation.data_length());
+    // A window at a time, since the hash calculator copies what it's given.
+    const uint64_t window = BudgetWindowSize(memory_budget_);
+    for (uint64_t offset = 0; offset < spool_.length(); offset += window) {
+      hash_calculator_.Update(spool_.data() + offset,
+                              min(window, spool_.length() - offset));
+    }
+    *data = spool_.data();
+    return true;
+  }
   // Since we delete data off the beginning of the buffer as we use it,
   // the data we need should be exactly at the beginning of the buffer.
   TEST_AND_RETURN_FALSE(buffer_offset_ == operation.data_offset());
   TEST_AND_RETURN_FALSE(buffer_.size() >= operation.data_length());
+  hash_calculator_.Update(buffer_.data(), operation.data_length());
+  *data = buffer_.data();
+  return true;
+}
 
-  // Extract the signature message if it's in this operation.
-  ExtractSignatureMessage(operation);
-
-  DirectExtentWriter direct_writer;
-  ZeroPadExtentWriter zero_pad_writer(&direct_writer);
-  scoped_ptr<BzipExtentWriter> bzip_writer;
+void DeltaPerformer::ReleaseOperationData(
+    const DeltaArchiveManifest_InstallOperation& operation) {
+  buffer_offset_ += operation.data_length();
+  if (spool_.is_open())
+    spool_.Close();
+  else
+    buffer_.Consume(operation.data_length());
+}
 
-  // Since bzip decompression is optional, we have a variable writer that will
-  // point to one of the ExtentWriter objects above.
-  ExtentWriter* writer = NULL;
-  if (operation.type() == DeltaArchiveManifest_InstallOperation_Type_REPLACE) {
-    writer = &zero_pad_writer;
+uint64_t DeltaPerformer::OperationMemory(
+    const DeltaArchiveManifest_InstallOperation& operation) const {
+  uint64_t memory = operation.data_length();
+  if (operation.type() == DeltaArchiveManifest_InstallOperation_Type_MOVE) {
+    uint64_t num_blocks = 0;
+    for (int i = 0; i < operation.dst_extents_size(); i++)
+      num_blocks += operation.dst_extents(i).num_blocks();
+    const uint64_t window_blocks =
+        MoveWindowBlocks(memory_budget_, block_size_);
+    if (window_blocks > 0)
+      num_blocks = min(num_blocks, window_blocks);
+    memory += num_blocks * block_size_;
   } else if (operation.type() ==
-             DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ) {
-    bzip_writer.reset(new BzipExtentWriter(&zero_pad_writer));
-    writer = bzip_writer.get();
-  } else {
-    NOTREACHED();
+             DeltaArchiveManifest_InstallOperation_Type_BSDIFF) {
+    // The patch engine holds the whole source and destination.
+    memory += operation.src_length() + operation.dst_length();
   }
+  return memory;
+}
 
-  // Create a vector of extents to pass to the ExtentWriter.
-  vector<Extent> extents;
-  for (int i = 0; i < operation.dst_extents_size(); i++) {
-    extents.push_back(operation.dst_extents(i));
+namespace {
+
+// Makes |writer| write through |direct_fd| from buffers in |pool| if both are
+// given, and otherwise coalesce its writes to the regular descriptor.
+void SetUpDirectWriter(DirectExtentWriter* writer,
+                       int direct_fd,
+                       AlignedBufferPool* pool) {
+  if (direct_fd >= 0 && pool) {
+    writer->set_direct_io(direct_fd, pool);
+    // Keeps several buffers in flight to the disk while the next are filled.
+    writer->set_block_io(BlockIo::ForCurrentThread());
+  } else {
+    writer->set_coalesce_size(kWriteCoalesceSize);
   }
+}
 
-  int fd = is_kernel_partition ? kernel_fd_ : fd_;
+// Returns a new calculator for the hash of the blocks |operation| writes if
+// the payload has it, and NULL otherwise. Discarded blocks aren't specified.
+OmahaHashCalculator* NewDestinationHasher(
+    const DeltaArchiveManifest_InstallOperation& operation) {
+  if (!operation.has_dst_sha256_hash() ||
+      operation.type() == DeltaArchiveManifest_InstallOperation_Type_DISCARD)
+    return NULL;
+  return new OmahaHashCalculator;
+}
 
-  TEST_AND_RETURN_FALSE(writer->Init(fd, extents, block_size_));
-  TEST_AND_RETURN_FALSE(writer->Write(&buffer_[0], operation.data_length()));
-  TEST_AND_RETURN_FALSE(writer->End());
+// Zero pads the data of an operation and hashes it on its way to a
+// DirectExtentWriter.
+class HashingZeroPadWriter
+    : public ZeroPadWriter<HashWriter<DirectExtentWriter> > {
+ public:
+  HashingZeroPadWriter(DirectExtentWriter* direct_writer,
+                       OmahaHashCalculator* dst_hasher)
+      : ZeroPadWriter<HashWriter<DirectExtentWriter> >(&hash_writer_),
+        hash_writer_(direct_writer, dst_hasher) {}
+
+ private:
+  HashWriter<DirectExtentWriter> hash_writer_;
+};
+
+// Zero pads the data of an operation and keeps its blocks in a
+// BlockCache on its way to a DirectExtentWriter, hashing it on the
+// way if there's a hasher.
+class CachingZeroPadWriter : public ZeroPadWriter<CachingExtentWriter> {
+ public:
+  CachingZeroPadWriter(DirectExtentWriter* direct_writer,
+                       OmahaHashCalculator* dst_hasher,
+                       BlockCache* cache)
+      : ZeroPadWriter<CachingExtentWriter>(&caching_writer_),
+        hash_writer_(dst_hasher ?
+                     new HashWriter<DirectExtentWriter>(direct_writer,
+                                                        dst_hasher) :
+                     NULL),
+        caching_writer_(hash_writer_.get() ?
+                        hash_writer_.get() :
+                        static_cast<ExtentWriter*>(direct_writer),
+                        cache) {}
+
+ private:
+  scoped_ptr<ExtentWriter> hash_writer_;
+  CachingExtentWriter caching_writer_;
+};
+
+// Returns the writer, kept in |writer|, that zero pads the data of an
+// operation to whole blocks on its way to |direct_writer|, hashes it into
+// |dst_hasher| if it isn't NULL, and keeps the blocks in |cache| if it isn't
+// NULL. Without a cache, the stages are composed at compile time, so the
+// data only goes through the vtable to get to the first one.
+ExtentWriter* DestinationWriter(DirectExtentWriter* direct_writer,
+                                OmahaHashCalculator* dst_hasher,
+                                BlockCache* cache,
+                                scoped_ptr<ExtentWriter>* writer) {
+  if (cache)
+    writer->reset(new CachingZeroPadWriter(direct_writer, dst_hasher, cache));
+  else if (dst_hasher)
+    writer->reset(new HashingZeroPadWriter(direct_writer, dst_hasher));
+  else
+    writer->reset(new ZeroPadWriter<DirectExtentWriter>(direct_writer));
+  return writer->get();
+}
 
-  // Update buffer
-  buffer_offset_ += operation.data_length();
-  DiscardBufferHeadBytes(operation.data_length());
-  return true;
+// Adds |buf| to |dst_hasher|, if it isn't NULL.
+bool HashBuffer(const vector<char>& buf, OmahaHashCalculator* dst_hasher) {
+  return !dst_hasher || buf.empty() || dst_hasher->Update(&buf[0], buf.size());
 }
 
-bool DeltaPerformer::PerformMoveOperation(
+// Reads the destination blocks of |operation| back from |fd| into
+// |dst_hasher|, for the writes that don't go through this process' memory.
+// They're still in the page cache then.
+bool HashDestinationBlocks(
     const DeltaArchiveManifest_InstallOperation& operation,
-    bool is_kernel_partition) {
+    int fd,
+    uint32_t block_size,
+    OmahaHashCalculator* dst_hasher) {
+  const uint64_t chunk_blocks = max<uint64_t>(kWriteCoalesceSize / block_size,
+                                              1);
+  vector<char> buf;
+  for (int i = 0; i < operation.dst_extents_size(); i++) {
+    const Extent& extent = operation.dst_extents(i);
+    TEST_AND_RETURN_FALSE(extent.start_block() != kSparseHole);
+    for (uint64_t done = 0; done < extent.num_blocks();) {
+      const uint64_t num_blocks = min(extent.num_blocks() - done,
+                                      chunk_blocks);
+      buf.resize(num_blocks * block_size);
+      ssize_t bytes_read = 0;
+      TEST_AND_RETURN_FALSE(utils::PReadAll(
+          fd, &buf[0], buf.size(), (extent.start_block() + done) * block_size,
+          &bytes_read));
+      TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(buf.size()));
+      TEST_AND_RETURN_FALSE(dst_hasher->Update(&buf[0], buf.size()));
+      done += num_blocks;
+    }
+  }
+  return true;
+}
+
+// Checks the hash |dst_hasher| computed of the blocks |operation| wrote
+// against the one in the payload. True if there's no |dst_hasher|.
+bool CheckDestinationHash(
+    const DeltaArchiveManifest_InstallOperation& operation,
+    OmahaHashCalculator* dst_hasher) {
+  if (!dst_hasher)
+    return true;
+  TEST_AND_RETURN_FALSE(dst_hasher->Finalize());
+  const vector<char>& hash = dst_hasher->raw_hash();
+  if (string(hash.begin(), hash.end()) != operation.dst_sha256_hash()) {
+    LOG(ERROR) << "The blocks written don't match the destination hash: "
+               << ExtentsToString(operation.dst_extents());
+    return false;
+  }
+  return true;
+}
+
+// The decompressing writers of a thread, kept from one operation to the
+// next so that their buffers and decoders are set up once per thread rather
+// than once per operation.
+struct ThreadDecompressWriters {
+  scoped_ptr<BzipExtentWriter> bzip;
+  scoped_ptr<XzExtentWriter> xz;
+};
+
+void DestroyThreadDecompressWriters(gpointer data) {
+  delete static_cast<ThreadDecompressWriters*>(data);
+}
+
+GPrivate thread_decompress_writers =
+    G_PRIVATE_INIT(DestroyThreadDecompressWriters);
+
+ThreadDecompressWriters* DecompressWritersForCurrentThread() {
+  ThreadDecompressWriters* writers = static_cast<ThreadDecompressWriters*>(
+      g_private_get(&thread_decompress_writers));
+  if (!writers) {
+    writers = new ThreadDecompressWriters;
+    g_private_set(&thread_decompress_writers, writers);
+  }
+  return writers;
+}
+
+// Writes the |operation.data_length()| bytes of the REPLACE, REPLACE_BZ,
+// REPLACE_XZ or REPLACE_XZ_DICT |operation| data blob at |data| to the
+// destination extents in |fd|. See SetUpDirectWriter() for |direct_fd| and
+// |pool|. REPLACE_XZ_DICT blobs are decompressed with |xz_dictionary|. The
+// blocks of a REPLACE_BZ blob are decompressed on |bzip_pool| if it isn't
+// NULL, and otherwise in libbz2's low memory mode if |low_memory|. Blobs
+// decompressed on this thread are written on |write_queue|'s if it isn't
+// NULL, while the rest is decompressed. The blocks written are hashed into
+// |dst_hasher| if it isn't NULL, and kept in |cache| if it isn't NULL.
+// Unless |low_memory|, the decompressing writers of the thread are reused.
+bool ApplyReplaceOperation(
+    const DeltaArchiveManifest_InstallOperation& operation,
+    int fd,
+    int direct_fd,
+    AlignedBufferPool* pool,
+    uint32_t block_size,
+    const char* data,
+    const string& xz_dictionary,
+    ThreadPool* bzip_pool,
+    QueuedExtentWriter* write_queue,
+    bool low_memory,
+    OmahaHashCalculator* dst_hasher,
+    BlockCache* cache) {
+  DirectExtentWriter direct_writer;
+  SetUpDirectWriter(&direct_writer, direct_fd, pool);
+  scoped_ptr<ExtentWriter> dst_writer;
+  ExtentWriter* zero_pad_writer =
+      DestinationWriter(&direct_writer, dst_hasher, cache, &dst_writer);
+  scoped_ptr<ExtentWriter> decompress_writer;
+  ThreadDecompressWriters* writers =
+      low_memory ? NULL : DecompressWritersForCurrentThread();
+  ExtentWriter* output_writer = zero_pad_writer;
+  if (write_queue &&
+      operation.type() != DeltaArchiveManifest_InstallOperation_Type_REPLACE &&
+      !bzip_pool) {
+    write_queue->Reset(zero_pad_writer);
+    output_writer = write_queue;
+  }
+
+  const bool is_xz_dict = operation.type() ==
+      DeltaArchiveManifest_InstallOperation_Type_REPLACE_XZ_DICT;
+  const bool is_xz = is_xz_dict || operation.type() ==
+      DeltaArchiveManifest_InstallOperation_Type_REPLACE_XZ;
+
+  // Since decompression is optional, we have a variable writer that will
+  // point to one of the ExtentWriter objects above.
+  ExtentWriter* writer = NULL;
+  if (operation.type() == DeltaArchiveManifest_InstallOperation_Type_REPLACE) {
+    writer = zero_pad_writer;
+  } else if (operation.type() ==
+             DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ &&
+             bzip_pool) {
+    writer = zero_pad_writer;
+  } else if (operation.type() ==
+             DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ &&
+             writers) {
+    if (!writers->bzip.get())
+      writers->bzip.reset(new BzipExtentWriter(output_writer));
+    writers->bzip->Reset(output_writer);
+    writer = writers->bzip.get();
+  } else if (operation.type() ==
+             DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ) {
+    BzipExtentWriter* bzip_writer = new BzipExtentWriter(output_writer);
+    bzip_writer->set_low_memory(low_memory);
+    decompress_writer.reset(bzip_writer);
+    writer = decompress_writer.get();
+  } else if (is_xz && writers) {
+    if (!writers->xz.get())
+      writers->xz.reset(new XzExtentWriter(output_writer));
+    writers->xz->Reset(output_writer);
+    writers->xz->set_dictionary(is_xz_dict ? &xz_dictionary : NULL);
+    writer = writers->xz.get();
+  } else if (is_xz) {
+    XzExtentWriter* xz_writer = new XzExtentWriter(output_writer);
+    xz_writer->set_dictionary(is_xz_dict ? &xz_dictionary : NULL);
+    decompress_writer.reset(xz_writer);
+    writer = decompress_writer.get();
+  } else {
+    NOTREACHED();
+  }
+
+  // Create a vector of extents to pass to the ExtentWriter.
+  vector<Extent> extents;
+  for (int i = 0; i < operation.dst_extents_size(); i++) {
+    extents.push_back(operation.dst_extents(i));
+  }
+
+  TEST_AND_RETURN_FALSE(writer->Init(fd, extents, block_size));
+  if (writer == zero_pad_writer && bzip_pool) {
+    TEST_AND_RETURN_FALSE(BzipDecompressBlocks(data, operation.data_length(),
+                                               bzip_pool, writer));
+  } else {
+    TEST_AND_RETURN_FALSE(writer->Write(data, operation.data_length()));
+  }
+  TEST_AND_RETURN_FALSE(writer->End());
+  return true;
+}
+
+// Reads the |length| bytes at |offset| in |fd| into |buf|.
+bool ReadRange(int fd, char* buf, uint64_t length, off_t offset) {
+  ssize_t bytes_read = 0;
+  TEST_AND_RETURN_FALSE(
+      utils::PReadAll(fd, buf, length, offset, &bytes_read));
+  return bytes_read == static_cast<ssize_t>(length);
+}
+
+// Reads the |length| bytes |offset| bytes into the extent starting at block
+// |start_block| of |fd| into |buf|, and puts the whole blocks read in |cache|
+// if |keep|.
+bool ReadMissedRange(int fd,
+                     uint64_t start_block,
+                     uint32_t block_size,
+                     uint64_t offset,
+                     uint64_t length,
+                     BlockCache* cache,
+                     bool keep,
+                     char* buf) {
+  TEST_AND_RETURN_FALSE(ReadRange(fd, buf, length,
+                                  start_block * block_size + offset));
+  if (keep && length >= block_size)
+    cache->Put(fd, start_block + offset / block_size, length / block_size, buf);
+  return true;
+}
+
+// Reads the first |length| bytes of |extents| in |fd| into |buf|, taking the
+// blocks |cache| has from there and reading each run of the others at once,
+// which are then kept in |cache| if |keep|. Extents starting at kSparseHole
+// read as zeros.
+bool ReadThroughCache(const RepeatedPtrField<Extent>& extents,
+                      int fd,
+                      uint32_t block_size,
+                      uint64_t length,
+                      BlockCache* cache,
+                      bool keep,
+                      vector<char>* buf) {
+  buf->assign(length, 0);
+  vector<char> block(block_size);
+  uint64_t offset = 0;
+  for (int i = 0; i < extents.size() && offset < length; i++) {
+    const Extent& extent = extents.Get(i);
+    const uint64_t extent_length =
+        min(length - offset, extent.num_blocks() * block_size);
+    if (extent.start_block() == kSparseHole) {
+      offset += extent_length;
+      continue;
+    }
+    // The run of blocks not in the cache, |miss_length| bytes from
+    // |miss_start| on in the extent, is read once it ends.
+    uint64_t miss_start = 0;
+    uint64_t miss_length = 0;
+    for (uint64_t done = 0; done < extent_length; done += block_size) {
+      const uint64_t count = min<uint64_t>(block_size, extent_length - done);
+      if (!cache->Get(fd, extent.start_block() + done / block_size,
+                      &block[0])) {
+        if (miss_length == 0)
+          miss_start = done;
+        miss_length += count;
+        continue;
+      }
+      memcpy(&(*buf)[offset + done], &block[0], count);
+      if (miss_length > 0) {
+        TEST_AND_RETURN_FALSE(ReadMissedRange(fd, extent.start_block(),
+                                              block_size, miss_start,
+                                              miss_length, cache, keep,
+                                              &(*buf)[offset + miss_start]));
+        miss_length = 0;
+      }
+    }
+    if (miss_length > 0) {
+      TEST_AND_RETURN_FALSE(ReadMissedRange(fd, extent.start_block(),
+                                            block_size, miss_start,
+                                            miss_length, cache, keep,
+                                            &(*buf)[offset + miss_start]));
+    }
+    offset += extent_length;
+  }
+  return offset == length;
+}
+
+// Reads the source blocks of the MOVE |operation| from |fd| into |buf|, or
+// from |cache| if it isn't NULL and has them. See ReadThroughCache() for
+// |keep|.
+bool ReadMoveSource(const DeltaArchiveManifest_InstallOperation& operation,
+                    int fd,
+                    uint32_t block_size,
+                    BlockCache* cache,
+                    bool keep,
+                    vector<char>* buf) {
   // Calculate buffer size. Note, this function doesn't do a sliding
   // window to copy in case the source and destination blocks overlap.
   // If we wanted to do a sliding window, we could program the server
@@ -554,47 +1815,786 @@ bool DeltaPerformer::PerformMoveOperation(
     blocks_to_write += operation.dst_extents(i).num_blocks();
 
   DCHECK_EQ(blocks_to_write, blocks_to_read);
-  vector<char> buf(blocks_to_write * block_size_);
-
-  int fd = is_kernel_partition ? kernel_fd_ : fd_;
-
-  // Read in bytes.
+  if (cache) {
+    return ReadThroughCache(operation.src_extents(), fd, block_size,
+                            blocks_to_write * block_size, cache, keep, buf);
+  }
+  buf->resize(blocks_to_write * block_size);
+
+  // Read in bytes, all extents at once if the I/O can be queued.
+  BlockIo* io = BlockIo::ForCurrentThread();
+  if (io) {
+    uint64_t offset = 0;
+    for (int i = 0; i < operation.src_extents_size(); i++) {
+      const Extent& extent = operation.src_extents(i);
+      io->AddRead(fd, &(*buf)[offset], extent.num_blocks() * block_size,
+                  extent.start_block() * block_size);
+      offset += extent.num_blocks() * block_size;
+    }
+    return io->Wait();
+  }
   ssize_t bytes_read = 0;
   for (int i = 0; i < operation.src_extents_size(); i++) {
     ssize_t bytes_read_this_iteration = 0;
     const Extent& extent = operation.src_extents(i);
     TEST_AND_RETURN_FALSE(utils::PReadAll(fd,
-                                          &buf[bytes_read],
-                                          extent.num_blocks() * block_size_,
-                                          extent.start_block() * block_size_,
+                                          &(*buf)[bytes_read],
+                                          extent.num_blocks() * block_size,
+                                          extent.start_block() * block_size,
                                           &bytes_read_this_iteration));
     TEST_AND_RETURN_FALSE(
         bytes_read_this_iteration ==
-        static_cast<ssize_t>(extent.num_blocks() * block_size_));
+        static_cast<ssize_t>(extent.num_blocks() * block_size));
     bytes_read += bytes_read_this_iteration;
   }
+  DCHECK_EQ(bytes_read, static_cast<ssize_t>(buf->size()));
+  return true;
+}
+
+// Writes |buf|, as read by ReadMoveSource(), to the destination blocks of the
+// MOVE |operation| in |fd|.
+bool WriteMoveDestination(
+    const DeltaArchiveManifest_InstallOperation& operation,
+    int fd,
+    uint32_t block_size,
+    const vector<char>& buf) {
+  // Write bytes out, with a single write for extents that follow each other,
+  // all queued at once if possible.
+  BlockIo* io = BlockIo::ForCurrentThread();
+  ssize_t bytes_written = 0;
+  for (int i = 0; i < operation.dst_extents_size();) {
+    const uint64_t start_block = operation.dst_extents(i).start_block();
+    uint64_t num_blocks = operation.dst_extents(i).num_blocks();
+    for (i++; i < operation.dst_extents_size() &&
+             operation.dst_extents(i).start_block() == start_block + num_blocks;
+         i++) {
+      num_blocks += operation.dst_extents(i).num_blocks();
+    }
+    if (io) {
+      io->AddWrite(fd, &buf[bytes_written], num_blocks * block_size,
+                   start_block * block_size);
+    } else {
+      TEST_AND_RETURN_FALSE(utils::PWriteAll(fd,
+                                             &buf[bytes_written],
+                                             num_blocks * block_size,
+                                             start_block * block_size));
+    }
+    bytes_written += num_blocks * block_size;
+  }
+  DCHECK_EQ(bytes_written, static_cast<ssize_t>(buf.size()));
+  return !io || io->Wait();
+}
+
+// Puts |buf|, just written by WriteMoveDestination(), in |cache| if it isn't
+// NULL.
+void CacheMoveDestination(
+    const DeltaArchiveManifest_InstallOperation& operation,
+    int fd,
+    uint32_t block_size,
+    const vector<char>& buf,
+    BlockCache* cache) {
+  if (!cache)
+    return;
+  uint64_t offset = 0;
+  for (int i = 0; i < operation.dst_extents_size(); i++) {
+    const Extent& extent = operation.dst_extents(i);
+    if (extent.start_block() != kSparseHole)
+      cache->Put(fd, extent.start_block(), extent.num_blocks(), &buf[offset]);
+    offset += extent.num_blocks() * block_size;
+  }
+}
+
+// Applies the BSDIFF |operation| with the |operation.data_length()| byte
+// patch at |data| to |fd|, reading the source blocks from |src_fd|. See
+// SetUpDirectWriter() for |direct_fd| and |pool|. The patch is applied by a
+// BspatchWorkerPool worker if there's a pool, which writes to |fd| only. The
+// blocks written are hashed into |dst_hasher| if it isn't NULL. Otherwise,
+// the source blocks are read through |src_cache| if it isn't NULL, and kept
+// there if |keep_source|, and the blocks written are kept in |dst_cache| if
+// it isn't NULL.
+bool ApplyBsdiffOperation(
+    const DeltaArchiveManifest_InstallOperation& operation,
+    int src_fd,
+    int fd,
+    int direct_fd,
+    AlignedBufferPool* pool,
+    uint32_t block_size,
+    const char* data,
+    OmahaHashCalculator* dst_hasher,
+    BlockCache* src_cache,
+    bool keep_source,
+    BlockCache* dst_cache) {
+  BspatchWorkerPool* workers = BspatchWorkerPool::Get();
+  if (workers) {
+    TEST_AND_RETURN_FALSE(workers->Patch(src_fd,
+                                         operation.src_extents(),
+                                         operation.src_length(),
+                                         fd,
+                                         operation.dst_extents(),
+                                         operation.dst_length(),
+                                         block_size,
+                                         data,
+                                         operation.data_length()));
+    return !dst_hasher ||
+        HashDestinationBlocks(operation, fd, block_size, dst_hasher);
+  }
+  // The patch engine zero-pads the tail of the final block, so the whole
+  // destination is written through the extent writer chain.
+  DirectExtentWriter direct_writer;
+  SetUpDirectWriter(&direct_writer, direct_fd, pool);
+  scoped_ptr<ExtentWriter> dst_writer;
+  ExtentWriter* zero_pad_writer =
+      DestinationWriter(&direct_writer, dst_hasher, dst_cache, &dst_writer);
+  vector<Extent> extents;
+  for (int i = 0; i < operation.dst_extents_size(); i++) {
+    extents.push_back(operation.dst_extents(i));
+  }
+  TEST_AND_RETURN_FALSE(zero_pad_writer->Init(fd, extents, block_size));
+  if (src_cache) {
+    // All of the source is read first, since it may overlap the destination.
+    vector<char> old_data;
+    TEST_AND_RETURN_FALSE(ReadThroughCache(operation.src_extents(), src_fd,
+                                           block_size, operation.src_length(),
+                                           src_cache, keep_source, &old_data));
+    TEST_AND_RETURN_FALSE(BspatchBuffer(
+        old_data.empty() ? NULL : &old_data[0], old_data.size(), data,
+        operation.data_length(), operation.dst_length(), zero_pad_writer));
+    return zero_pad_writer->End();
+  }
+  TEST_AND_RETURN_FALSE(BspatchExtents(src_fd,
+                                       operation.src_extents(),
+                                       operation.src_length(),
+                                       block_size,
+                                       data,
+                                       operation.data_length(),
+                                       operation.dst_length(),
+                                       zero_pad_writer));
+  TEST_AND_RETURN_FALSE(zero_pad_writer->End());
+  return true;
+}
+
+// Returns true if any extent in |a| overlaps any extent in |b|.
+bool AnyExtentsOverlap(const RepeatedPtrField<Extent>& a,
+                       const RepeatedPtrField<Extent>& b) {
+  for (int i = 0; i < a.size(); i++) {
+    // Nothing is ever read from or written to a sparse hole.
+    if (a.Get(i).start_block() == kSparseHole)
+      continue;
+    for (int j = 0; j < b.size(); j++) {
+      if (b.Get(j).start_block() != kSparseHole &&
+          ExtentRanges::ExtentsOverlap(a.Get(i), b.Get(j)))
+        return true;
+    }
+  }
+  return false;
+}
+
+// Applies the STREAM_DIFF |operation| with the |operation.data_length()|
+// byte patch at |data| to |fd|, reading the source blocks from |src_fd|. See
+// SetUpDirectWriter() for |direct_fd| and |pool|. The source is read as the
+// patch copies it, unless the operation overwrites its own source in place.
+// The blocks written are hashed into |dst_hasher| if it isn't NULL.
+bool ApplyStreamDiffOperation(
+    const DeltaArchiveManifest_InstallOperation& operation,
+    int src_fd,
+    int fd,
+    int direct_fd,
+    AlignedBufferPool* pool,
+    uint32_t block_size,
+    const char* data,
+    OmahaHashCalculator* dst_hasher) {
+  DirectExtentWriter direct_writer;
+  SetUpDirectWriter(&direct_writer, direct_fd, pool);
+  scoped_ptr<ExtentWriter> dst_writer;
+  ExtentWriter* zero_pad_writer =
+      DestinationWriter(&direct_writer, dst_hasher, NULL, &dst_writer);
+  vector<Extent> extents;
+  for (int i = 0; i < operation.dst_extents_size(); i++) {
+    extents.push_back(operation.dst_extents(i));
+  }
+  const bool in_place = src_fd == fd &&
+      AnyExtentsOverlap(operation.src_extents(), operation.dst_extents());
+  TEST_AND_RETURN_FALSE(zero_pad_writer->Init(fd, extents, block_size));
+  TEST_AND_RETURN_FALSE(StreamPatchExtents(src_fd,
+                                           operation.src_extents(),
+                                           operation.src_length(),
+                                           block_size,
+                                           data,
+                                           operation.data_length(),
+                                           operation.dst_length(),
+                                           in_place,
+                                           zero_pad_writer));
+  TEST_AND_RETURN_FALSE(zero_pad_writer->End());
+  return true;
+}
+
+// Copies |count| bytes at |src_offset| in |src_fd| to |dst_offset| in |dst_fd|
+// with copy_file_range(), which lets the kernel offload the copy to devices
+// that support it. Returns false if the kernel can't copy them this way, e.g.,
+// because it lacks the system call or doesn't support it on block devices.
+// Some of the bytes may have been copied then.
+bool CopyFileRange(int src_fd, off_t src_offset, int dst_fd, off_t dst_offset,
+                   size_t count) {
+#if defined(__NR_copy_file_range)
+  loff_t src_pos = src_offset;
+  loff_t dst_pos = dst_offset;
+  while (count > 0) {
+    ssize_t rc = HANDLE_EINTR(syscall(__NR_copy_file_range, src_fd, &src_pos,
+                                      dst_fd, &dst_pos, count, 0));
+    if (rc <= 0)
+      return false;
+    count -= rc;
+  }
+  return true;
+#else
+  return false;
+#endif
+}
+
+// Makes the |count| bytes at |dst_offset| in |dst_fd| share the storage of
+// those at |src_offset| in |src_fd| with FICLONERANGE, which copy-on-write
+// file systems do without copying anything, e.g., for the disk images of
+// VMs. Returns false if they can't, e.g., because the descriptors aren't of
+// regular files on such a file system, in which case nothing was copied.
+bool CloneFileRange(int src_fd, off_t src_offset, int dst_fd, off_t dst_offset,
+                    size_t count) {
+#if defined(FICLONERANGE)
+  struct file_clone_range range;
+  range.src_fd = src_fd;
+  range.src_offset = src_offset;
+  range.src_length = count;
+  range.dest_offset = dst_offset;
+  return ioctl(dst_fd, FICLONERANGE, &range) == 0;
+#else
+  return false;
+#endif
+}
+
+// Like CopyFileRange() but splices the bytes through the pipe |pipe_fds|,
+// which must be empty.
+bool SpliceRange(int src_fd, off_t src_offset, int dst_fd, off_t dst_offset,
+                 size_t count, const int pipe_fds[2]) {
+  loff_t src_pos = src_offset;
+  loff_t dst_pos = dst_offset;
+  while (count > 0) {
+    ssize_t bytes_in = HANDLE_EINTR(splice(src_fd, &src_pos, pipe_fds[1], NULL,
+                                           count, SPLICE_F_MOVE));
+    if (bytes_in <= 0)
+      return false;
+    for (ssize_t bytes_out = 0; bytes_out < bytes_in;) {
+      ssize_t rc = HANDLE_EINTR(splice(pipe_fds[0], NULL, dst_fd, &dst_pos,
+                                       bytes_in - bytes_out, SPLICE_F_MOVE));
+      if (rc <= 0)
+        return false;
+      bytes_out += rc;
+    }
+    count -= bytes_in;
+  }
+  return true;
+}
+
+// Applies the MOVE |operation|, reading from |src_fd| and writing to |fd|,
+// without bouncing the blocks through user memory: by sharing them with
+// CloneFileRange() on copy-on-write file systems, with copy_file_range()
+// where the kernel supports it, and otherwise by splicing them through a
+// pipe. The extents are copied one after the other, so this is only done if
+// the destination doesn't overlap the source. Returns false if the operation
+// has to be applied through a buffer instead; since nothing it reads has been
+// overwritten then, that's always possible.
+bool MoveInKernel(const DeltaArchiveManifest_InstallOperation& operation,
+                  int src_fd,
+                  int fd,
+                  uint32_t block_size) {
+  if (src_fd == fd &&
+      AnyExtentsOverlap(operation.src_extents(), operation.dst_extents()))
+    return false;
+  for (int i = 0; i < operation.src_extents_size(); i++) {
+    if (operation.src_extents(i).start_block() == kSparseHole)
+      return false;
+  }
+  for (int i = 0; i < operation.dst_extents_size(); i++) {
+    if (operation.dst_extents(i).start_block() == kSparseHole)
+      return false;
+  }
+
+  int pipe_fds[2] = { -1, -1 };
+  ScopedFdCloser pipe_reader_closer(&pipe_fds[0]);
+  ScopedFdCloser pipe_writer_closer(&pipe_fds[1]);
+  // Once a piece can't be cloned, none of the others are tried.
+  bool clone = true;
+  // Copies the pieces that are contiguous in both the source and the
+  // destination.
+  int src_index = 0, dst_index = 0;
+  uint64_t src_blocks_done = 0, dst_blocks_done = 0;
+  while (src_index < operation.src_extents_size() &&
+         dst_index < operation.dst_extents_size()) {
+    const Extent& src_extent = operation.src_extents(src_index);
+    const Extent& dst_extent = operation.dst_extents(dst_index);
+    const uint64_t num_blocks =
+        min(src_extent.num_blocks() - src_blocks_done,
+            dst_extent.num_blocks() - dst_blocks_done);
+    const off_t src_offset =
+        (src_extent.start_block() + src_blocks_done) * block_size;
+    const off_t dst_offset =
+        (dst_extent.start_block() + dst_blocks_done) * block_size;
+    const size_t count = num_blocks * block_size;
+    if (clone)
+      clone = CloneFileRange(src_fd, src_offset, fd, dst_offset, count);
+    if (!clone && pipe_fds[0] < 0 &&
+        !CopyFileRange(src_fd, src_offset, fd, dst_offset, count)) {
+      // Splices this and all the remaining pieces.
+      if (pipe(pipe_fds) != 0)
+        return false;
+    }
+    if (!clone && pipe_fds[0] >= 0 &&
+        !SpliceRange(src_fd, src_offset, fd, dst_offset, count, pipe_fds))
+      return false;
+
+    src_blocks_done += num_blocks;
+    if (src_blocks_done == src_extent.num_blocks()) {
+      src_index++;
+      src_blocks_done = 0;
+    }
+    dst_blocks_done += num_blocks;
+    if (dst_blocks_done == dst_extent.num_blocks()) {
+      dst_index++;
+      dst_blocks_done = 0;
+    }
+  }
+  return true;
+}
+
+// Zeroes the |length| bytes at |offset| in |fd|, a block device if
+// |is_block_device| and otherwise a regular file at least |file_size| bytes
+// long: with BLKZEROOUT on block devices, and by deallocating the range of
+// regular files. Falls back to writing zeros over the range.
+bool ZeroRange(int fd, bool is_block_device, off_t offset, off_t length,
+               off_t file_size) {
+  if (is_block_device) {
+#if defined(BLKZEROOUT)
+    uint64_t range[2] = { static_cast<uint64_t>(offset),
+                          static_cast<uint64_t>(length) };
+    if (ioctl(fd, BLKZEROOUT, range) == 0)
+      return true;
+#endif
+  } else if (offset + length <= file_size) {
+    // Punching a hole keeps the size of the file, so it's only done within
+    // it.
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset,
+                  length) == 0)
+      return true;
+  } else {
+#if defined(FALLOC_FL_ZERO_RANGE)
+    if (fallocate(fd, FALLOC_FL_ZERO_RANGE, offset, length) == 0)
+      return true;
+#endif
+  }
+  ScopedPoolBuffer zeros(min(static_cast<off_t>(kZeroBufferSize), length));
+  TEST_AND_RETURN_FALSE(zeros.get());
+  zeros.Clear();
+  for (off_t done = 0; done < length; done += zeros.size()) {
+    TEST_AND_RETURN_FALSE(utils::PWriteAll(
+        fd, zeros.get(), min(static_cast<off_t>(zeros.size()), length - done),
+        offset + done));
+  }
+  return true;
+}
+
+// Applies the ZERO or DISCARD |operation| to |fd|. Blocks of block devices
+// are discarded with BLKDISCARD, leaving them unspecified, and otherwise
+// zeroed, which is always a valid way to discard them. The zeroed blocks are
+// hashed into |dst_hasher| if it isn't NULL.
+bool ApplyZeroOperation(const DeltaArchiveManifest_InstallOperation& operation,
+                        int fd,
+                        uint32_t block_size,
+                        OmahaHashCalculator* dst_hasher) {
+  struct stat stbuf;
+  TEST_AND_RETURN_FALSE_ERRNO(fstat(fd, &stbuf) == 0);
+  const bool is_block_device = S_ISBLK(stbuf.st_mode);
+  const bool discard = operation.type() ==
+      DeltaArchiveManifest_InstallOperation_Type_DISCARD;
+  for (int i = 0; i < operation.dst_extents_size(); i++) {
+    const Extent& extent = operation.dst_extents(i);
+    if (extent.start_block() == kSparseHole)
+      continue;
+    const off_t offset = extent.start_block() * block_size;
+    const off_t length = extent.num_blocks() * block_size;
+#if defined(BLKDISCARD)
+    uint64_t range[2] = { static_cast<uint64_t>(offset),
+                          static_cast<uint64_t>(length) };
+    if (discard && is_block_device && ioctl(fd, BLKDISCARD, range) == 0)
+      continue;
+#endif
+    TEST_AND_RETURN_FALSE(ZeroRange(fd, is_block_device, offset, length,
+                                    stbuf.st_size));
+  }
+  if (dst_hasher) {
+    uint64_t num_blocks = 0;
+    for (int i = 0; i < operation.dst_extents_size(); i++)
+      num_blocks += operation.dst_extents(i).num_blocks();
+    ScopedPoolBuffer zeros(min<uint64_t>(num_blocks * block_size,
+                                         kWriteCoalesceSize));
+    TEST_AND_RETURN_FALSE(zeros.get());
+    zeros.Clear();
+    for (uint64_t left = num_blocks * block_size; left > 0;) {
+      const size_t count = min<uint64_t>(left, zeros.size());
+      TEST_AND_RETURN_FALSE(dst_hasher->Update(zeros.get(), count));
+      left -= count;
+    }
+  }
+  return true;
+}
+
+// Applies the MOVE |operation|, reading from |src_fd| and writing to |fd|,
+// through a buffer of at most |window_blocks| blocks by copying the extents a
+// piece at a time. This is only done if the destination doesn't overlap the
+// source, since a piece could otherwise overwrite blocks the next ones read.
+// The blocks written are hashed into |dst_hasher| if it isn't NULL. See
+// ApplyBsdiffOperation() for |src_cache|, |keep_source| and |dst_cache|.
+bool MoveInWindows(const DeltaArchiveManifest_InstallOperation& operation,
+                   int src_fd,
+                   int fd,
+                   uint32_t block_size,
+                   uint64_t window_blocks,
+                   OmahaHashCalculator* dst_hasher,
+                   BlockCache* src_cache,
+                   bool keep_source,
+                   BlockCache* dst_cache) {
+  DeltaArchiveManifest_InstallOperation window;
+  vector<char> buf;
+  int src_index = 0, dst_index = 0;
+  uint64_t src_blocks_done = 0, dst_blocks_done = 0;
+  while (src_index < operation.src_extents_size() &&
+         dst_index < operation.dst_extents_size()) {
+    window.Clear();
+    uint64_t window_size = 0;
+    while (window_size < window_blocks &&
+           src_index < operation.src_extents_size() &&
+           dst_index < operation.dst_extents_size()) {
+      const Extent& src_extent = operation.src_extents(src_index);
+      const Extent& dst_extent = operation.dst_extents(dst_index);
+      const uint64_t num_blocks =
+          min(min(src_extent.num_blocks() - src_blocks_done,
+                  dst_extent.num_blocks() - dst_blocks_done),
+              window_blocks - window_size);
+      Extent* src_piece = window.add_src_extents();
+      src_piece->set_start_block(
+          src_extent.start_block() == kSparseHole ? kSparseHole :
+          src_extent.start_block() + src_blocks_done);
+      src_piece->set_num_blocks(num_blocks);
+      Extent* dst_piece = window.add_dst_extents();
+      dst_piece->set_start_block(
+          dst_extent.start_block() == kSparseHole ? kSparseHole :
+          dst_extent.start_block() + dst_blocks_done);
+      dst_piece->set_num_blocks(num_blocks);
+      window_size += num_blocks;
+
+      src_blocks_done += num_blocks;
+      if (src_blocks_done == src_extent.num_blocks()) {
+        src_index++;
+        src_blocks_done = 0;
+      }
+      dst_blocks_done += num_blocks;
+      if (dst_blocks_done == dst_extent.num_blocks()) {
+        dst_index++;
+        dst_blocks_done = 0;
+      }
+    }
+    TEST_AND_RETURN_FALSE(ReadMoveSource(window, src_fd, block_size,
+                                         src_cache, keep_source, &buf));
+    TEST_AND_RETURN_FALSE(WriteMoveDestination(window, fd, block_size, buf));
+    CacheMoveDestination(window, fd, block_size, buf, dst_cache);
+    TEST_AND_RETURN_FALSE(HashBuffer(buf, dst_hasher));
+  }
+  return true;
+}
+
+// Applies the MOVE |operation|, reading from |src_fd| and writing to |fd|,
+// |window_blocks| blocks at a time if it isn't 0 and the operation doesn't
+// overwrite its own source. The blocks written are hashed into |dst_hasher|
+// if it isn't NULL. See ApplyBsdiffOperation() for |src_cache|,
+// |keep_source| and |dst_cache|, which blocks moved in the kernel skip.
+bool ApplyMoveOperation(const DeltaArchiveManifest_InstallOperation& operation,
+                        int src_fd,
+                        int fd,
+                        uint32_t block_size,
+                        uint64_t window_blocks,
+                        OmahaHashCalculator* dst_hasher,
+                        BlockCache* src_cache,
+                        bool keep_source,
+                        BlockCache* dst_cache) {
+  if (MoveInKernel(operation, src_fd, fd, block_size)) {
+    return !dst_hasher ||
+        HashDestinationBlocks(operation, fd, block_size, dst_hasher);
+  }
+  if (window_blocks > 0 &&
+      (src_fd != fd ||
+       !AnyExtentsOverlap(operation.src_extents(), operation.dst_extents())))
+    return MoveInWindows(operation, src_fd, fd, block_size, window_blocks,
+                         dst_hasher, src_cache, keep_source, dst_cache);
+  vector<char> buf;
+  TEST_AND_RETURN_FALSE(ReadMoveSource(operation, src_fd, block_size,
+                                       src_cache, keep_source, &buf));
+  TEST_AND_RETURN_FALSE(WriteMoveDestination(operation, fd, block_size, buf));
+  CacheMoveDestination(operation, fd, block_size, buf, dst_cache);
+  return HashBuffer(buf, dst_hasher);
+}
+
+}  // namespace {}
+
+// An idempotent install operation applied on a worker thread. The task owns a
+// copy of the operation's data blob since the payload buffer moves on as soon
+// as the operation is queued.
+class InstallOperationTask : public ThreadPoolTask {
+ public:
+  InstallOperationTask(const DeltaArchiveManifest_InstallOperation* operation,
+                       size_t operation_num,
+                       bool is_kernel_partition,
+                       int src_fd,
+                       int fd,
+                       int direct_fd,
+                       AlignedBufferPool* pool,
+                       uint32_t block_size,
+                       const string* xz_dictionary)
+      : operation_(operation),
+        operation_num_(operation_num),
+        is_kernel_partition_(is_kernel_partition),
+        src_fd_(src_fd),
+        fd_(fd),
+        direct_fd_(direct_fd),
+        pool_(pool),
+        block_size_(block_size),
+        xz_dictionary_(xz_dictionary),
+        memory_budget_(0),
+        src_cache_(NULL),
+        keep_source_(false),
+        dst_cache_(NULL) {}
+
+  bool Run() {
+    ScopedTraceEvent trace_event(
+        "operation",
+        DeltaArchiveManifest_InstallOperation_Type_Name(operation_->type()));
+    trace_event.AddArg("operation", base::Uint64ToString(operation_num_));
+    const base::TimeTicks start_time = base::TimeTicks::Now();
+    UE_PROBE3(operation_start, operation_num_,
+              static_cast<int>(operation_->type()),
+              operation_->data_length());
+    MemoryTracker::SetOperation(
+        DeltaArchiveManifest_InstallOperation_Type_Name(operation_->type()));
+    scoped_ptr<OmahaHashCalculator> dst_hasher(
+        NewDestinationHasher(*operation_));
+    const bool success = Apply(dst_hasher.get()) &&
+        CheckDestinationHash(*operation_, dst_hasher.get());
+    run_time_ = base::TimeTicks::Now() - start_time;
+    UE_PROBE3(operation_end, operation_num_,
+              static_cast<int>(operation_->type()),
+              graph_utils::BlocksInExtents(operation_->dst_extents()) *
+              block_size_);
+    return success;
+  }
+
+  const DeltaArchiveManifest_InstallOperation& operation() const {
+    return *operation_;
+  }
+  size_t operation_num() const { return operation_num_; }
+  bool is_kernel_partition() const { return is_kernel_partition_; }
+  vector<char>* mutable_data() { return &data_; }
+  base::TimeDelta run_time() const { return run_time_; }
+
+  // See DeltaPerformer::set_memory_budget().
+  void set_memory_budget(uint64_t memory_budget) {
+    memory_budget_ = memory_budget;
+  }
+
+  // See ApplyBsdiffOperation().
+  void set_block_cache(BlockCache* src_cache,
+                       bool keep_source,
+                       BlockCache* dst_cache) {
+    src_cache_ = src_cache;
+    keep_source_ = keep_source;
+    dst_cache_ = dst_cache;
+  }
+
+ private:
+  // Applies the operation, hashing the blocks written into |dst_hasher| if
+  // it isn't NULL.
+  bool Apply(OmahaHashCalculator* dst_hasher) {
+    switch (operation_->type()) {
+      case DeltaArchiveManifest_InstallOperation_Type_REPLACE:
+      case DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ:
+      case DeltaArchiveManifest_InstallOperation_Type_REPLACE_XZ:
+      case DeltaArchiveManifest_InstallOperation_Type_REPLACE_XZ_DICT:
+        return ApplyReplaceOperation(*operation_, fd_, direct_fd_, pool_,
+                                     block_size_,
+                                     data_.empty() ? NULL : &data_[0],
+                                     *xz_dictionary_,
+                                     NULL, NULL, memory_budget_ > 0,
+                                     dst_hasher,
+                                     dst_cache_);
+      case DeltaArchiveManifest_InstallOperation_Type_MOVE:
+        return ApplyMoveOperation(*operation_, src_fd_, fd_, block_size_,
+                                  MoveWindowBlocks(memory_budget_,
+                                                   block_size_),
+                                  dst_hasher, src_cache_, keep_source_,
+                                  dst_cache_);
+      case DeltaArchiveManifest_InstallOperation_Type_BSDIFF:
+        return ApplyBsdiffOperation(*operation_, src_fd_, fd_, direct_fd_,
+                                    pool_, block_size_,
+                                    data_.empty() ? NULL : &data_[0],
+                                    dst_hasher, src_cache_, keep_source_,
+                                    dst_cache_);
+      case DeltaArchiveManifest_InstallOperation_Type_STREAM_DIFF:
+        return ApplyStreamDiffOperation(*operation_, src_fd_, fd_, direct_fd_,
+                                        pool_, block_size_,
+                                        data_.empty() ? NULL : &data_[0],
+                                        dst_hasher);
+      case DeltaArchiveManifest_InstallOperation_Type_ZERO:
+      case DeltaArchiveManifest_InstallOperation_Type_DISCARD:
+        return ApplyZeroOperation(*operation_, fd_, block_size_, dst_hasher);
+    }
+    // Like the synchronous path, skip operation types we don't know about.
+    return true;
+  }
+
+  const DeltaArchiveManifest_InstallOperation* operation_;
+  const size_t operation_num_;
+  const bool is_kernel_partition_;
+  const int src_fd_;
+  const int fd_;
+  const int direct_fd_;
+  AlignedBufferPool* const pool_;
+  const uint32_t block_size_;
+  const string* const xz_dictionary_;
+  uint64_t memory_budget_;
+  BlockCache* src_cache_;
+  bool keep_source_;
+  BlockCache* dst_cache_;
+  vector<char> data_;
+  base::TimeDelta run_time_;
+
+  DISALLOW_COPY_AND_ASSIGN(InstallOperationTask);
+};
+
+bool DeltaPerformer::PerformReplaceOperation(
+    const DeltaArchiveManifest_InstallOperation& operation,
+    bool is_kernel_partition) {
+  CHECK(operation.type() == \
+        DeltaArchiveManifest_InstallOperation_Type_REPLACE || \
+        operation.type() == \
+        DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ || \
+        operation.type() == \
+        DeltaArchiveManifest_InstallOperation_Type_REPLACE_XZ || \
+        operation.type() == \
+        DeltaArchiveManifest_InstallOperation_Type_REPLACE_XZ_DICT);
+
+  // Extract the signature message if it's in this operation.
+  ExtractSignatureMessage(operation);
+
+  // Let the data blob be hashed while it's being written out.
+  const char* data = NULL;
+  TEST_AND_RETURN_FALSE(TakeOperationData(operation, &data));
+
+  // Large bzip2 blobs are decompressed on all the cores, since the
+  // operations are applied one at a time here, unless that would take more
+  // memory than there is.
+  ThreadPool* bzip_pool = NULL;
+  if (operation.type() ==
+      DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ &&
+      operation.data_length() >= kParallelBzipMinSize &&
+      memory_budget_ == 0) {
+    if (!bzip_pool_.get()) {
+      scoped_ptr<ThreadPool> pool(new ThreadPool(0));
+      TEST_AND_RETURN_FALSE(pool->Init());
+      bzip_pool_.swap(pool);
+    }
+    bzip_pool = bzip_pool_.get();
+  }
+
+  // The others are written out on a thread of their own while the next of
+  // the data is decompressed, which then doesn't wait for the disk.
+  QueuedExtentWriter* write_queue = NULL;
+  if (operation.type() !=
+      DeltaArchiveManifest_InstallOperation_Type_REPLACE &&
+      !bzip_pool && operation.data_length() >= kQueuedWriteMinSize &&
+      memory_budget_ == 0) {
+    if (!write_queue_.get())
+      write_queue_.reset(new QueuedExtentWriter(NULL));
+    write_queue = write_queue_.get();
+  }
+
+  int fd = is_kernel_partition ? kernel_fd_ : fd_;
+  int direct_fd = is_kernel_partition ? kernel_direct_fd_ : direct_fd_;
+  scoped_ptr<OmahaHashCalculator> dst_hasher(NewDestinationHasher(operation));
+  TEST_AND_RETURN_FALSE(ApplyReplaceOperation(operation,
+                                              fd,
+                                              direct_fd,
+                                              direct_io_buffers_.get(),
+                                              block_size_,
+                                              data,
+                                              manifest_.xz_dictionary(),
+                                              bzip_pool,
+                                              write_queue,
+                                              memory_budget_ > 0,
+                                              dst_hasher.get(),
+                                              WrittenBlockCache()));
+  TEST_AND_RETURN_FALSE(CheckDestinationHash(operation, dst_hasher.get()));
+  ReleaseOperationData(operation);
+  return true;
+}
+
+bool DeltaPerformer::PerformMoveOperation(
+    const DeltaArchiveManifest_InstallOperation& operation,
+    bool is_kernel_partition) {
+  int fd = is_kernel_partition ? kernel_fd_ : fd_;
+  const int src_fd = SourceFd(is_kernel_partition);
+  scoped_ptr<OmahaHashCalculator> dst_hasher(NewDestinationHasher(operation));
+  // Operations that overwrite their own source are never moved in the
+  // kernel, so only they need the care below.
+  if (MoveInKernel(operation, src_fd, fd, block_size_)) {
+    TEST_AND_RETURN_FALSE(!dst_hasher.get() ||
+                          HashDestinationBlocks(operation, fd, block_size_,
+                                                dst_hasher.get()));
+    return CheckDestinationHash(operation, dst_hasher.get());
+  }
+  // Within a memory budget, the blocks are copied a window at a time, unless
+  // the operation overwrites its own source, which must all be read first.
+  const uint64_t window_blocks = MoveWindowBlocks(memory_budget_, block_size_);
+  if (window_blocks > 0 && CanRepeatOperation(operation)) {
+    TEST_AND_RETURN_FALSE(MoveInWindows(operation, src_fd, fd, block_size_,
+                                        window_blocks, dst_hasher.get(),
+                                        block_cache_.get(),
+                                        KeepsSourceBlocks(operation),
+                                        WrittenBlockCache()));
+    return CheckDestinationHash(operation, dst_hasher.get());
+  }
+  vector<char> buf;
+  TEST_AND_RETURN_FALSE(ReadMoveSource(operation, src_fd, block_size_,
+                                       block_cache_.get(),
+                                       KeepsSourceBlocks(operation), &buf));
 
   // If this is a non-idempotent operation, request a delayed exit and clear the
   // update state in case the operation gets interrupted. Do this as late as
   // possible.
-  if (!IsIdempotentOperation(operation)) {
+  if (!CanRepeatOperation(operation)) {
     Terminator::set_exit_blocked(true);
     ResetUpdateProgress(prefs_, true);
   }
 
-  // Write bytes out.
-  ssize_t bytes_written = 0;
-  for (int i = 0; i < operation.dst_extents_size(); i++) {
-    const Extent& extent = operation.dst_extents(i);
-    TEST_AND_RETURN_FALSE(utils::PWriteAll(fd,
-                                           &buf[bytes_written],
-                                           extent.num_blocks() * block_size_,
-                                           extent.start_block() * block_size_));
-    bytes_written += extent.num_blocks() * block_size_;
-  }
-  DCHECK_EQ(bytes_written, bytes_read);
-  DCHECK_EQ(bytes_written, static_cast<ssize_t>(buf.size()));
-  return true;
+  TEST_AND_RETURN_FALSE(WriteMoveDestination(operation, fd, block_size_, buf));
+  CacheMoveDestination(operation, fd, block_size_, buf, WrittenBlockCache());
+  TEST_AND_RETURN_FALSE(HashBuffer(buf, dst_hasher.get()));
+  return CheckDestinationHash(operation, dst_hasher.get());
+}
+
+bool DeltaPerformer::PerformZeroOperation(
+    const DeltaArchiveManifest_InstallOperation& operation,
+    bool is_kernel_partition) {
+  scoped_ptr<OmahaHashCalculator> dst_hasher(NewDestinationHasher(operation));
+  return ApplyZeroOperation(operation,
+                            is_kernel_partition ? kernel_fd_ : fd_,
+                            block_size_,
+                            dst_hasher.get()) &&
+      CheckDestinationHash(operation, dst_hasher.get());
 }
 
 bool DeltaPerformer::ExtentsToBsdiffPositionsString(
@@ -626,77 +2626,490 @@ bool DeltaPerformer::ExtentsToBsdiffPositionsString(
 bool DeltaPerformer::PerformBsdiffOperation(
     const DeltaArchiveManifest_InstallOperation& operation,
     bool is_kernel_partition) {
-  // Since we delete data off the beginning of the buffer as we use it,
-  // the data we need should be exactly at the beginning of the buffer.
-  TEST_AND_RETURN_FALSE(buffer_offset_ == operation.data_offset());
-  TEST_AND_RETURN_FALSE(buffer_.size() >= operation.data_length());
+  // Let the patch be hashed while it's being applied.
+  const char* data = NULL;
+  TEST_AND_RETURN_FALSE(TakeOperationData(operation, &data));
 
-  string input_positions;
-  TEST_AND_RETURN_FALSE(ExtentsToBsdiffPositionsString(operation.src_extents(),
-                                                       block_size_,
-                                                       operation.src_length(),
-                                                       &input_positions));
-  string output_positions;
-  TEST_AND_RETURN_FALSE(ExtentsToBsdiffPositionsString(operation.dst_extents(),
-                                                       block_size_,
-                                                       operation.dst_length(),
-                                                       &output_positions));
-
-  string temp_filename;
-  TEST_AND_RETURN_FALSE(utils::MakeTempFile("/tmp/au_patch.XXXXXX",
-                                            &temp_filename,
-                                            NULL));
-  ScopedPathUnlinker path_unlinker(temp_filename);
-  {
-    int fd = open(temp_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    ScopedFdCloser fd_closer(&fd);
-    TEST_AND_RETURN_FALSE(
-        utils::WriteAll(fd, &buffer_[0], operation.data_length()));
+  // If this is a non-idempotent operation, request a delayed exit and clear the
+  // update state in case the operation gets interrupted. Do this as late as
+  // possible.
+  if (!CanRepeatOperation(operation)) {
+    Terminator::set_exit_blocked(true);
+    ResetUpdateProgress(prefs_, true);
   }
 
   int fd = is_kernel_partition ? kernel_fd_ : fd_;
-  const string& path = StringPrintf("/dev/fd/%d", fd);
+  int direct_fd = is_kernel_partition ? kernel_direct_fd_ : direct_fd_;
+  scoped_ptr<OmahaHashCalculator> dst_hasher(NewDestinationHasher(operation));
+  TEST_AND_RETURN_FALSE(ApplyBsdiffOperation(operation,
+                                             SourceFd(is_kernel_partition),
+                                             fd,
+                                             direct_fd,
+                                             direct_io_buffers_.get(),
+                                             block_size_,
+                                             data,
+                                             dst_hasher.get(),
+                                             block_cache_.get(),
+                                             KeepsSourceBlocks(operation),
+                                             WrittenBlockCache()));
+  TEST_AND_RETURN_FALSE(CheckDestinationHash(operation, dst_hasher.get()));
+  ReleaseOperationData(operation);
+  return true;
+}
 
-  // If this is a non-idempotent operation, request a delayed exit and clear the
-  // update state in case the operation gets interrupted. Do this as late as
-  // possible.
-  if (!IsIdempotentOperation(operation)) {
+bool DeltaPerformer::PerformStreamDiffOperation(
+    const DeltaArchiveManifest_InstallOperation& operation,
+    bool is_kernel_partition) {
+  // Let the patch be hashed while it's being applied.
+  const char* data = NULL;
+  TEST_AND_RETURN_FALSE(TakeOperationData(operation, &data));
+
+  // Like a BSDIFF, a STREAM_DIFF that overwrites its own source can't be
+  // repeated if it gets interrupted.
+  if (!CanRepeatOperation(operation)) {
     Terminator::set_exit_blocked(true);
     ResetUpdateProgress(prefs_, true);
   }
 
-  vector<string> cmd;
-  cmd.push_back(kBspatchPath);
-  cmd.push_back(path);
-  cmd.push_back(path);
-  cmd.push_back(temp_filename);
-  cmd.push_back(input_positions);
-  cmd.push_back(output_positions);
-  int return_code = 0;
-  TEST_AND_RETURN_FALSE(
-      Subprocess::SynchronousExecFlags(cmd,
-                                       G_SPAWN_LEAVE_DESCRIPTORS_OPEN,
-                                       &return_code,
-                                       NULL));
-  TEST_AND_RETURN_FALSE(return_code == 0);
-
-  if (operation.dst_length() % block_size_) {
-    // Zero out rest of final block.
-    // TODO(adlr): build this into bspatch; it's more efficient that way.
-    const Extent& last_extent =
-        operation.dst_extents(operation.dst_extents_size() - 1);
-    const uint64_t end_byte =
-        (last_extent.start_block() + last_extent.num_blocks()) * block_size_;
-    const uint64_t begin_byte =
-        end_byte - (block_size_ - operation.dst_length() % block_size_);
-    vector<char> zeros(end_byte - begin_byte);
-    TEST_AND_RETURN_FALSE(
-        utils::PWriteAll(fd, &zeros[0], end_byte - begin_byte, begin_byte));
+  int fd = is_kernel_partition ? kernel_fd_ : fd_;
+  int direct_fd = is_kernel_partition ? kernel_direct_fd_ : direct_fd_;
+  scoped_ptr<OmahaHashCalculator> dst_hasher(NewDestinationHasher(operation));
+  TEST_AND_RETURN_FALSE(ApplyStreamDiffOperation(operation,
+                                                 SourceFd(is_kernel_partition),
+                                                 fd,
+                                                 direct_fd,
+                                                 direct_io_buffers_.get(),
+                                                 block_size_,
+                                                 data,
+                                                 dst_hasher.get()));
+  TEST_AND_RETURN_FALSE(CheckDestinationHash(operation, dst_hasher.get()));
+  ReleaseOperationData(operation);
+  return true;
+}
+
+bool DeltaPerformer::OperationsConflict(
+    const DeltaArchiveManifest_InstallOperation& a,
+    const DeltaArchiveManifest_InstallOperation& b) {
+  return AnyExtentsOverlap(a.dst_extents(), b.dst_extents()) ||
+      AnyExtentsOverlap(a.dst_extents(), b.src_extents()) ||
+      AnyExtentsOverlap(a.src_extents(), b.dst_extents());
+}
+
+bool DeltaPerformer::ScheduleOperation(
+    const DeltaArchiveManifest_InstallOperation& operation,
+    bool is_kernel_partition) {
+  CHECK(CanRepeatOperation(operation));
+  TEST_AND_RETURN_FALSE(InitThreadPool());
+
+  // Wait up to the newest in-flight operation this one conflicts with. The
+  // generator orders operations so that every block is read before it's
+  // overwritten and written before it's read, so these are exactly the
+  // read-before and write-before dependencies of |operation|. Operations
+  // applied from the source partitions only write blocks no other one reads,
+  // but a later one may still overwrite some of the same blocks.
+  size_t num_to_wait = 0;
+  for (size_t i = 0; i < pending_operations_.size(); i++) {
+    const InstallOperationTask* task = pending_operations_[i].get();
+    if (task->is_kernel_partition() != is_kernel_partition)
+      continue;
+    if (manifest_.apply_from_source() ?
+        AnyExtentsOverlap(task->operation().dst_extents(),
+                          operation.dst_extents()) :
+        OperationsConflict(task->operation(), operation))
+      num_to_wait = i + 1;
+  }
+  for (; num_to_wait > 0; num_to_wait--)
+    TEST_AND_RETURN_FALSE(WaitOldestOperation());
+  // Operations that would go over the memory budget wait for the ones in
+  // flight, but one is always let through.
+  const uint64_t memory = OperationMemory(operation);
+  while (memory_budget_ > 0 && !pending_operations_.empty() &&
+         pending_memory_ + memory > memory_budget_)
+    TEST_AND_RETURN_FALSE(WaitOldestOperation());
+  InvalidateCachedBlocks(operation, is_kernel_partition);
+
+  shared_ptr<InstallOperationTask> task(
+      new InstallOperationTask(&operation,
+                               next_operation_num_,
+                               is_kernel_partition,
+                               SourceFd(is_kernel_partition),
+                               is_kernel_partition ? kernel_fd_ : fd_,
+                               is_kernel_partition ? kernel_direct_fd_ :
+                                                     direct_fd_,
+                               direct_io_buffers_.get(),
+                               block_size_,
+                               &manifest_.xz_dictionary()));
+  task->set_memory_budget(memory_budget_);
+  task->set_block_cache(block_cache_.get(), KeepsSourceBlocks(operation),
+                        WrittenBlockCache());
+  if (HasDataBlob(operation)) {
+    // Since we delete data off the beginning of the buffer as we use it,
+    // the data we need should be exactly at the beginning of the buffer.
+    TEST_AND_RETURN_FALSE(buffer_offset_ == operation.data_offset());
+    TEST_AND_RETURN_FALSE(buffer_.size() >= operation.data_length());
+
+    // Extract the signature message if it's in this operation.
+    ExtractSignatureMessage(operation);
+
+    task->mutable_data()->assign(buffer_.data(),
+                                 buffer_.data() + operation.data_length());
+    buffer_offset_ += operation.data_length();
+    DiscardBufferHeadBytes(operation.data_length());
   }
+  pending_operations_.push_back(task);
+  pending_memory_ += memory;
+  thread_pool_->Submit(task.get());
+  return true;
+}
 
-  // Update buffer.
-  buffer_offset_ += operation.data_length();
-  DiscardBufferHeadBytes(operation.data_length());
+bool DeltaPerformer::InitThreadPool() {
+  if (!thread_pool_.get()) {
+    scoped_ptr<ThreadPool> thread_pool(
+        new ThreadPool(max_concurrent_operations_));
+    TEST_AND_RETURN_FALSE(thread_pool->Init());
+    thread_pool_.swap(thread_pool);
+  }
+  return true;
+}
+
+void DeltaPerformer::InitApplyAhead() {
+  ahead_candidates_.clear();
+  ahead_data_.clear();
+  // The data passed to WriteAhead() would be kept out of the memory budget.
+  if (!apply_ahead_ || max_concurrent_operations_ <= 1 ||
+      !manifest_.apply_from_source() || memory_budget_ > 0)
+    return;
+
+  // Operations applied from the source partitions only depend on each other
+  // when they write the same blocks, in which case the later one has to win.
+  // Sort the blocks written by each partition and leave out the operations
+  // in any run of overlapping ones.
+  vector<DestinationRange> ranges[2];
+  for (size_t i = next_operation_num_; i < num_total_operations_; i++) {
+    bool is_kernel_partition = false;
+    const DeltaArchiveManifest_InstallOperation& op =
+        GetOperation(i, &is_kernel_partition);
+    for (int j = 0; j < op.dst_extents_size(); j++) {
+      const Extent& extent = op.dst_extents(j);
+      if (extent.start_block() == kSparseHole || extent.num_blocks() == 0)
+        continue;
+      DestinationRange range;
+      range.start_block = extent.start_block();
+      range.end_block = extent.start_block() + extent.num_blocks();
+      range.operation_num = i;
+      ranges[is_kernel_partition].push_back(range);
+    }
+  }
+  vector<bool> overlapping(num_total_operations_, false);
+  for (int partition = 0; partition < 2; partition++) {
+    vector<DestinationRange>& sorted = ranges[partition];
+    std::sort(sorted.begin(), sorted.end());
+    size_t run_start = 0;
+    uint64_t run_end = 0;
+    bool run_overlaps = false;
+    for (size_t i = 0; i <= sorted.size(); i++) {
+      if (i == sorted.size() || sorted[i].start_block >= run_end) {
+        for (size_t j = run_start; run_overlaps && j < i; j++)
+          overlapping[sorted[j].operation_num] = true;
+        if (i == sorted.size())
+          break;
+        run_start = i;
+        run_end = 0;
+        run_overlaps = false;
+      } else if (sorted[i].operation_num !=
+                 sorted[run_start].operation_num) {
+        run_overlaps = true;
+      }
+      run_end = std::max(run_end, sorted[i].end_block);
+    }
+  }
+
+  for (size_t i = next_operation_num_; i < num_total_operations_; i++) {
+    bool is_kernel_partition = false;
+    const DeltaArchiveManifest_InstallOperation& op =
+        GetOperation(i, &is_kernel_partition);
+    if (overlapping[i] || !HasDataBlob(op) || !CanRepeatOperation(op) ||
+        (manifest_.has_signatures_offset() &&
+         manifest_.signatures_offset() == op.data_offset()))
+      continue;
+    ahead_candidates_[op.data_offset()] = i;
+  }
+  LOG(INFO) << ahead_candidates_.size() << " of "
+            << num_total_operations_ - next_operation_num_
+            << " operations may be applied ahead of the payload order.";
+}
+
+void DeltaPerformer::WriteAhead(uint64_t offset,
+                                const char* bytes,
+                                size_t count) {
+  if (ahead_candidates_.empty() || offset < manifest_metadata_size_)
+    return;
+  uint64_t data_offset = offset - manifest_metadata_size_;
+
+  // Write() already has the bytes before the end of |buffer_|.
+  const uint64_t received_end = buffer_offset_ + buffer_.size();
+  if (data_offset < received_end) {
+    const size_t skip = min<uint64_t>(received_end - data_offset, count);
+    data_offset += skip;
+    bytes += skip;
+    count -= skip;
+  }
+  if (count == 0)
+    return;
+  while (!ahead_data_.empty() &&
+         ahead_data_.begin()->first + ahead_data_.begin()->second.size() <=
+         received_end)
+    ahead_data_.erase(ahead_data_.begin());
+
+  // The bytes of a range come in order, so they usually extend a chunk.
+  map<uint64_t, vector<char> >::iterator chunk =
+      ahead_data_.upper_bound(data_offset);
+  if (chunk != ahead_data_.begin()) {
+    --chunk;
+    if (chunk->first + chunk->second.size() != data_offset)
+      chunk = ahead_data_.end();
+  } else {
+    chunk = ahead_data_.end();
+  }
+  if (chunk == ahead_data_.end()) {
+    chunk = ahead_data_.insert(
+        std::make_pair(data_offset, vector<char>())).first;
+    chunk->second.clear();
+  }
+  chunk->second.insert(chunk->second.end(), bytes, bytes + count);
+
+  // The range after this one may have come in first.
+  map<uint64_t, vector<char> >::iterator next =
+      ahead_data_.find(chunk->first + chunk->second.size());
+  if (next != ahead_data_.end()) {
+    chunk->second.insert(chunk->second.end(), next->second.begin(),
+                         next->second.end());
+    ahead_data_.erase(next);
+  }
+  ScheduleAheadOperations(chunk);
+}
+
+void DeltaPerformer::ScheduleAheadOperations(
+    map<uint64_t, vector<char> >::iterator chunk) {
+  const uint64_t start = chunk->first;
+  const uint64_t end = start + chunk->second.size();
+  uint64_t keep = end;
+  map<uint64_t, size_t>::iterator it = ahead_candidates_.lower_bound(start);
+  if (it != ahead_candidates_.begin()) {
+    // The start of a blob may still come in right before |chunk|.
+    map<uint64_t, size_t>::iterator previous = it;
+    --previous;
+    bool is_kernel_partition = false;
+    if (previous->first +
+        GetOperation(previous->second, &is_kernel_partition).data_length() >
+        start)
+      keep = start;
+  }
+  while (it != ahead_candidates_.end() && it->first < end) {
+    const size_t operation_num = it->second;
+    bool is_kernel_partition = false;
+    const DeltaArchiveManifest_InstallOperation& op =
+        GetOperation(operation_num, &is_kernel_partition);
+    if (it->first + op.data_length() > end) {
+      keep = min(keep, it->first);
+      break;
+    }
+    // Operations that fail validation or can't be queued are left to
+    // Write(), which reports them.
+    ahead_candidates_.erase(it++);
+    const char* data = &chunk->second[op.data_offset() - start];
+    if (ValidateOperationHash(op, operation_num, data) != kActionCodeSuccess ||
+        !InitThreadPool())
+      continue;
+    shared_ptr<InstallOperationTask> task(
+        new InstallOperationTask(&op,
+                                 operation_num,
+                                 is_kernel_partition,
+                                 SourceFd(is_kernel_partition),
+                                 is_kernel_partition ? kernel_fd_ : fd_,
+                                 is_kernel_partition ? kernel_direct_fd_ :
+                                                       direct_fd_,
+                                 direct_io_buffers_.get(),
+                                 block_size_,
+                                 &manifest_.xz_dictionary()));
+    task->set_block_cache(block_cache_.get(), KeepsSourceBlocks(op), NULL);
+    task->mutable_data()->assign(data, data + op.data_length());
+    ahead_operations_[operation_num] = task;
+    thread_pool_->Submit(task.get());
+  }
+
+  // Only the start of a blob that's still coming in is kept, and an empty
+  // chunk at the end lets the rest of the range extend it.
+  vector<char> rest(chunk->second.begin() + (keep - start),
+                    chunk->second.end());
+  ahead_data_.erase(chunk);
+  ahead_data_[keep].swap(rest);
+}
+
+bool DeltaPerformer::WaitAheadOperations() {
+  bool success = true;
+  for (map<size_t, shared_ptr<InstallOperationTask> >::iterator it =
+           ahead_operations_.begin(); it != ahead_operations_.end(); ++it) {
+    if (!thread_pool_->Wait(it->second.get())) {
+      LOG(ERROR) << "Failed to perform operation " << it->first;
+      success = false;
+    }
+  }
+  ahead_operations_.clear();
+  ahead_candidates_.clear();
+  ahead_data_.clear();
+  return success;
+}
+
+bool DeltaPerformer::WaitOldestOperation() {
+  CHECK(!pending_operations_.empty());
+  shared_ptr<InstallOperationTask> task = pending_operations_.front();
+  pending_operations_.pop_front();
+  pending_memory_ -= OperationMemory(task->operation());
+  if (!thread_pool_->Wait(task.get())) {
+    LOG(ERROR) << "Failed to perform operation " << task->operation_num();
+    return false;
+  }
+  AddOperationStats(task->operation(), task->run_time());
+  return true;
+}
+
+void DeltaPerformer::AddOperationStats(
+    const DeltaArchiveManifest_InstallOperation& operation,
+    base::TimeDelta time) {
+  OperationTypeStats* stats = &operation_stats_[operation.type()];
+  stats->count++;
+  for (int i = 0; i < operation.dst_extents_size(); i++)
+    stats->bytes_written += operation.dst_extents(i).num_blocks() * block_size_;
+  stats->time += time;
+  duration_estimator_.OperationApplied(operation, time);
+}
+
+bool DeltaPerformer::WaitAllOperations() {
+  bool success = true;
+  while (!pending_operations_.empty())
+    success = WaitOldestOperation() && success;
+  return success;
+}
+
+bool DeltaPerformer::PrepareFileTarget(bool is_kernel_partition) {
+  const int fd = is_kernel_partition ? kernel_fd_ : fd_;
+  struct stat stbuf;
+  if (fd < 0 || fstat(fd, &stbuf) != 0 || !S_ISREG(stbuf.st_mode))
+    return true;
+  const PartitionInfo& info = is_kernel_partition ?
+      manifest_.new_kernel_info() : manifest_.new_rootfs_info();
+  uint64_t size = info.size();
+  if (!is_kernel_partition && manifest_.has_new_rootfs_hash_tree()) {
+    const HashTreeInfo& tree = manifest_.new_rootfs_hash_tree();
+    size = max(size, (tree.hash_start_block() + VerityTreeBuilder::TreeBlocks(
+        tree.data_blocks(), tree.block_size())) * tree.block_size());
+  }
+  if (size > static_cast<uint64_t>(stbuf.st_size))
+    TEST_AND_RETURN_FALSE_ERRNO(ftruncate(fd, size) == 0);
+
+  // MOVE operations may share their source's blocks instead, and ZERO and
+  // DISCARD ones leave holes.
+  const RepeatedPtrField<DeltaArchiveManifest_InstallOperation>& operations =
+      is_kernel_partition ? manifest_.kernel_install_operations() :
+      manifest_.install_operations();
+  ExtentRanges data_blocks;
+  for (int i = 0; i < operations.size(); i++) {
+    const DeltaArchiveManifest_InstallOperation& op = operations.Get(i);
+    if (op.type() == DeltaArchiveManifest_InstallOperation_Type_MOVE ||
+        op.type() == DeltaArchiveManifest_InstallOperation_Type_ZERO ||
+        op.type() == DeltaArchiveManifest_InstallOperation_Type_DISCARD)
+      continue;
+    for (int j = 0; j < op.dst_extents_size(); j++) {
+      if (op.dst_extents(j).start_block() != kSparseHole)
+        data_blocks.AddExtent(op.dst_extents(j));
+    }
+  }
+  const vector<Extent> extents =
+      data_blocks.GetExtentsForBlockCount(data_blocks.blocks());
+  for (size_t i = 0; i < extents.size(); i++) {
+    // Preallocating is only an optimization, which not all file systems
+    // support.
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE,
+                  extents[i].start_block() * block_size_,
+                  extents[i].num_blocks() * block_size_) != 0) {
+      PLOG(WARNING) << "Unable to preallocate "
+                    << (is_kernel_partition ? kernel_path_ : path_);
+      break;
+    }
+  }
+  LOG(INFO) << "Prepared " << (is_kernel_partition ? kernel_path_ : path_)
+            << " with " << data_blocks.blocks() << " blocks of data in "
+            << size << " bytes.";
+  return true;
+}
+
+bool DeltaPerformer::InitHashTree() {
+  hash_tree_.reset();
+  hash_tree_extents_.clear();
+  if (!manifest_.has_new_rootfs_hash_tree())
+    return true;
+  const HashTreeInfo& info = manifest_.new_rootfs_hash_tree();
+  // The tree mustn't overwrite the blocks it's built from, and the blocks
+  // the operations write must be whole blocks of the tree.
+  TEST_AND_RETURN_FALSE(info.hash_start_block() >= info.data_blocks());
+  TEST_AND_RETURN_FALSE(info.block_size() > 0 &&
+                        block_size_ % info.block_size() == 0);
+  scoped_ptr<VerityTreeBuilder> hash_tree(new VerityTreeBuilder);
+  TEST_AND_RETURN_FALSE(hash_tree->Init(
+      info.data_blocks(), info.block_size(),
+      vector<char>(info.salt().begin(), info.salt().end())));
+  hash_tree_.swap(hash_tree);
+  return true;
+}
+
+void DeltaPerformer::HashWrittenBlocks() {
+  if (hash_tree_extents_.empty())
+    return;
+  const uint64_t tree_blocks_per_block =
+      block_size_ / manifest_.new_rootfs_hash_tree().block_size();
+  for (size_t i = 0; i < hash_tree_extents_.size(); i++) {
+    const Extent& extent = hash_tree_extents_[i];
+    // Blocks that can't be read now are read by FinishHashTree().
+    LOG_IF(WARNING, !hash_tree_->ReadBlocks(
+        fd_, extent.start_block() * tree_blocks_per_block,
+        extent.num_blocks() * tree_blocks_per_block))
+        << "Unable to read back rootfs blocks " << extent.start_block()
+        << "+" << extent.num_blocks() << " to hash.";
+  }
+  hash_tree_extents_.clear();
+}
+
+bool DeltaPerformer::FinishHashTree() {
+  if (!hash_tree_.get())
+    return true;
+  HashWrittenBlocks();
+  // E.g., the blocks written before an interrupted update was resumed.
+  const uint64_t missing_blocks = hash_tree_->missing_blocks();
+  TEST_AND_RETURN_FALSE(hash_tree_->ReadMissingBlocks(fd_));
+  const HashTreeInfo& info = manifest_.new_rootfs_hash_tree();
+  if (info.has_root_hash() &&
+      info.root_hash() != string(hash_tree_->root_hash().begin(),
+                                 hash_tree_->root_hash().end())) {
+    LOG(ERROR) << "The rootfs hash tree doesn't match its root hash.";
+    return false;
+  }
+  const off_t offset = info.hash_start_block() * info.block_size();
+  TEST_AND_RETURN_FALSE(hash_tree_->WriteTree(fd_, offset));
+  const uint64_t tree_size =
+      VerityTreeBuilder::TreeBlocks(info.data_blocks(), info.block_size()) *
+      info.block_size();
+  writeback_[0].AddWrite(offset, tree_size);
+  mirrors_[0].AddWrite(offset, tree_size);
+  LOG(INFO) << "Wrote the rootfs hash tree of " << info.data_blocks()
+            << " blocks, " << missing_blocks << " of which were read back.";
+  hash_tree_.reset();
+  return true;
+}
+
+bool DeltaPerformer::MirrorWrittenBlocks() {
+  for (size_t i = 0; i < arraysize(mirrors_); i++)
+    TEST_AND_RETURN_FALSE(mirrors_[i].CopyWrites());
   return true;
 }
 
@@ -713,8 +3126,8 @@ bool DeltaPerformer::ExtractSignatureMessage(
   TEST_AND_RETURN_FALSE(buffer_offset_ == manifest_.signatures_offset());
   TEST_AND_RETURN_FALSE(buffer_.size() >= manifest_.signatures_size());
   signatures_message_data_.assign(
-      buffer_.begin(),
-      buffer_.begin() + manifest_.signatures_size());
+      buffer_.data(),
+      buffer_.data() + manifest_.signatures_size());
 
   // Save the signature blob because if the update is interrupted after the
   // download phase we don't go through this path anymore. Some alternatives to
@@ -742,9 +3155,12 @@ bool DeltaPerformer::ExtractSignatureMessage(
 }
 
 ActionExitCode DeltaPerformer::ValidateOperationHash(
-    const DeltaArchiveManifest_InstallOperation& operation) {
-
-  if (!operation.data_sha256_hash().size()) {
+    const DeltaArchiveManifest_InstallOperation& operation,
+    size_t operation_num,
+    const char* data) {
+  // Operations hashed with BLAKE3 don't have a SHA-256 hash.
+  const bool blake3 = operation.has_data_blake3_hash();
+  if (!blake3 && !operation.data_sha256_hash().size()) {
     if (!operation.data_length()) {
       // Operations that do not have any data blob won't have any operation hash
       // either. So, these operations are always considered validated since the
@@ -765,38 +3181,43 @@ ActionExitCode DeltaPerformer::ValidateOperationHash(
     if (manifest_.signatures_offset() &&
         manifest_.signatures_offset() == operation.data_offset()) {
       LOG(INFO) << "Skipping hash verification for signature operation "
-                << next_operation_num_ + 1;
+                << operation_num + 1;
     } else {
       if (install_plan_->hash_checks_mandatory) {
         LOG(ERROR) << "Missing mandatory operation hash for operation "
-                   << next_operation_num_ + 1;
+                   << operation_num + 1;
         return kActionCodeDownloadOperationHashMissingError;
       }
 
-      // For non-mandatory cases, just log a warning.
-      LOG(WARNING) << "Cannot validate operation " << next_operation_num_ + 1
-                   << " as there's no operation hash in manifest";
+      // For non-mandatory cases, just log a warning, which unsigned payloads
+      // would otherwise log for every operation.
+      LOG_EVERY_N_SEC(WARNING, kOperationLogIntervalSeconds)
+          << "Cannot validate operation " << operation_num + 1
+          << " as there's no operation hash in manifest";
     }
     return kActionCodeSuccess;
   }
 
-  vector<char> expected_op_hash;
-  expected_op_hash.assign(operation.data_sha256_hash().data(),
-                          (operation.data_sha256_hash().data() +
-                           operation.data_sha256_hash().size()));
+  const string& expected_hash = blake3 ? operation.data_blake3_hash() :
+      operation.data_sha256_hash();
+  vector<char> expected_op_hash(expected_hash.begin(), expected_hash.end());
 
-  OmahaHashCalculator operation_hasher;
-  operation_hasher.Update(&buffer_[0], operation.data_length());
-  if (!operation_hasher.Finalize()) {
-    LOG(ERROR) << "Unable to compute actual hash of operation "
-               << next_operation_num_;
-    return kActionCodeDownloadOperationHashVerificationError;
+  vector<char> calculated_op_hash;
+  if (blake3) {
+    blake3::RawHashOfBytes(data, operation.data_length(), &calculated_op_hash);
+  } else {
+    OmahaHashCalculator operation_hasher;
+    operation_hasher.Update(data, operation.data_length());
+    if (!operation_hasher.Finalize()) {
+      LOG(ERROR) << "Unable to compute actual hash of operation "
+                 << operation_num;
+      return kActionCodeDownloadOperationHashVerificationError;
+    }
+    calculated_op_hash = operation_hasher.raw_hash();
   }
-
-  vector<char> calculated_op_hash = operation_hasher.raw_hash();
   if (calculated_op_hash != expected_op_hash) {
     LOG(ERROR) << "Hash verification failed for operation "
-               << next_operation_num_ << ". Expected hash = ";
+               << operation_num << ". Expected hash = ";
     utils::HexDumpVector(expected_op_hash);
     LOG(ERROR) << "Calculated hash over " << operation.data_length()
                << " bytes at offset: " << operation.data_offset() << " = ";
@@ -868,7 +3289,8 @@ ActionExitCode DeltaPerformer::VerifyPayload(
   // errors happen after this, it's likely a problem with the payload itself or
   // the state of the system and not a problem with the URL or network.  So,
   // indicate that to the payload state so that AU can backoff appropriately.
-  system_state_->payload_state()->DownloadComplete();
+  if (system_state_)
+    system_state_->payload_state()->DownloadComplete();
 
   return kActionCodeSuccess;
 }
@@ -895,6 +3317,111 @@ bool DeltaPerformer::GetNewPartitionInfo(uint64_t* kernel_size,
   return true;
 }
 
+namespace {
+// Copies the chunk hashes of |info| if there are valid ones.
+void GetChunkHashes(const PartitionInfo& info,
+                    uint64_t* chunk_size,
+                    vector<vector<char> >* chunk_hashes) {
+  *chunk_size = 0;
+  chunk_hashes->clear();
+  if (!info.has_chunk_size())
+    return;
+  if (!ChunkHashVerifier::IsValid(info.size(), info.chunk_size(),
+                                  info.chunk_hashes_size())) {
+    LOG(WARNING) << "Ignoring " << info.chunk_hashes_size() << " chunk "
+                 << "hashes of " << info.chunk_size() << " bytes for a "
+                 << "partition of " << info.size() << " bytes.";
+    return;
+  }
+  *chunk_size = info.chunk_size();
+  for (int i = 0; i < info.chunk_hashes_size(); i++) {
+    chunk_hashes->push_back(vector<char>(info.chunk_hashes(i).begin(),
+                                         info.chunk_hashes(i).end()));
+  }
+}
+}  // namespace
+
+void DeltaPerformer::GetNewPartitionChunkHashes(
+    uint64_t* kernel_chunk_size,
+    vector<vector<char> >* kernel_chunk_hashes,
+    uint64_t* rootfs_chunk_size,
+    vector<vector<char> >* rootfs_chunk_hashes) {
+  CHECK(manifest_valid_);
+  GetChunkHashes(manifest_.new_kernel_info(), kernel_chunk_size,
+                 kernel_chunk_hashes);
+  GetChunkHashes(manifest_.new_rootfs_info(), rootfs_chunk_size,
+                 rootfs_chunk_hashes);
+}
+
+void DeltaPerformer::GetVerifiedPartitions(bool* kernel_verified,
+                                           bool* rootfs_verified) const {
+  CHECK(manifest_valid_);
+  *kernel_verified = dst_hashes_cover_[1];
+  *rootfs_verified = dst_hashes_cover_[0];
+}
+
+bool DeltaPerformer::DestinationHashesCover(bool is_kernel_partition) const {
+  const PartitionInfo& info = is_kernel_partition ?
+      manifest_.new_kernel_info() : manifest_.new_rootfs_info();
+  const RepeatedPtrField<DeltaArchiveManifest_InstallOperation>& operations =
+      is_kernel_partition ? manifest_.kernel_install_operations() :
+      manifest_.install_operations();
+  if (!info.has_size() || block_size_ == 0)
+    return false;
+  const uint64_t partition_blocks =
+      (info.size() + block_size_ - 1) / block_size_;
+  ExtentRanges written;
+  uint64_t blocks_written = 0;
+  for (int i = 0; i < operations.size(); i++) {
+    const DeltaArchiveManifest_InstallOperation& op = operations.Get(i);
+    for (int j = 0; j < op.dst_extents_size(); j++) {
+      const Extent& extent = op.dst_extents(j);
+      if (extent.start_block() == kSparseHole)
+        continue;
+      if (!op.has_dst_sha256_hash() ||
+          op.type() == DeltaArchiveManifest_InstallOperation_Type_DISCARD ||
+          extent.start_block() + extent.num_blocks() > partition_blocks)
+        return false;
+      written.AddExtent(extent);
+      blocks_written += extent.num_blocks();
+    }
+  }
+  // No block is missed or written twice.
+  return written.blocks() == partition_blocks &&
+      blocks_written == partition_blocks;
+}
+
+bool DeltaPerformer::CanFastForwardOperation(
+    const DeltaArchiveManifest_InstallOperation& op,
+    bool is_kernel_partition) {
+  if (!fast_forward_)
+    return false;
+  scoped_ptr<OmahaHashCalculator> dst_hasher(NewDestinationHasher(op));
+  if (!dst_hasher.get() || op.dst_extents_size() == 0)
+    return false;
+  for (int i = 0; i < op.dst_extents_size(); i++) {
+    if (op.dst_extents(i).start_block() == kSparseHole)
+      return false;
+  }
+  const int fd = is_kernel_partition ? kernel_fd_ : fd_;
+  if (HashDestinationBlocks(op, fd, block_size_, dst_hasher.get()) &&
+      dst_hasher->Finalize()) {
+    const vector<char>& hash = dst_hasher->raw_hash();
+    if (string(hash.begin(), hash.end()) == op.dst_sha256_hash()) {
+      fast_forward_misses_ = 0;
+      fast_forwarded_operations_++;
+      return true;
+    }
+  }
+  if (++fast_forward_misses_ >= kFastForwardMissLimit) {
+    LOG(INFO) << "Skipped " << fast_forwarded_operations_
+              << " operations whose destination blocks were already written,"
+              << " applying the rest from operation " << next_operation_num_;
+    fast_forward_ = false;
+  }
+  return false;
+}
+
 namespace {
 void LogVerifyError(bool is_kern,
                     const string& local_hash,
@@ -978,17 +3505,17 @@ bool DeltaPerformer::VerifySourcePartitions() {
 }
 
 void DeltaPerformer::DiscardBufferHeadBytes(size_t count) {
-  hash_calculator_.Update(&buffer_[0], count);
-  buffer_.erase(buffer_.begin(), buffer_.begin() + count);
+  hash_calculator_.Update(buffer_.data(), count);
+  buffer_.Consume(count);
 }
 
 bool DeltaPerformer::CanResumeUpdate(PrefsInterface* prefs,
                                      string update_check_response_hash) {
-  int64_t next_operation = kUpdateStateOperationInvalid;
-  TEST_AND_RETURN_FALSE(prefs->GetInt64(kPrefsUpdateStateNextOperation,
-                                        &next_operation) &&
-                        next_operation != kUpdateStateOperationInvalid &&
-                        next_operation > 0);
+  UpdateCheckpoint checkpoint;
+  TEST_AND_RETURN_FALSE(LoadCheckpoint(prefs, &checkpoint) &&
+                        checkpoint.next_operation !=
+                        kUpdateStateOperationInvalid &&
+                        checkpoint.next_operation > 0);
 
   string interrupted_hash;
   TEST_AND_RETURN_FALSE(prefs->GetString(kPrefsUpdateCheckResponseHash,
@@ -1002,15 +3529,8 @@ bool DeltaPerformer::CanResumeUpdate(PrefsInterface* prefs,
                         resumed_update_failures <= kMaxResumedUpdateFailures);
 
   // Sanity check the rest.
-  int64_t next_data_offset = -1;
-  TEST_AND_RETURN_FALSE(prefs->GetInt64(kPrefsUpdateStateNextDataOffset,
-                                        &next_data_offset) &&
-                        next_data_offset >= 0);
-
-  string sha256_context;
-  TEST_AND_RETURN_FALSE(
-      prefs->GetString(kPrefsUpdateStateSHA256Context, &sha256_context) &&
-      !sha256_context.empty());
+  TEST_AND_RETURN_FALSE(checkpoint.next_data_offset >= 0 &&
+                        !checkpoint.hash_context.empty());
 
   int64_t manifest_metadata_size = 0;
   TEST_AND_RETURN_FALSE(prefs->GetInt64(kPrefsManifestMetadataSize,
@@ -1021,6 +3541,8 @@ bool DeltaPerformer::CanResumeUpdate(PrefsInterface* prefs,
 }
 
 bool DeltaPerformer::ResetUpdateProgress(PrefsInterface* prefs, bool quick) {
+  if (checkpoint_file_)
+    TEST_AND_RETURN_FALSE(checkpoint_file_->Clear());
   TEST_AND_RETURN_FALSE(prefs->SetInt64(kPrefsUpdateStateNextOperation,
                                         kUpdateStateOperationInvalid));
   if (!quick) {
@@ -1031,13 +3553,74 @@ bool DeltaPerformer::ResetUpdateProgress(PrefsInterface* prefs, bool quick) {
     prefs->SetString(kPrefsUpdateStateSignatureBlob, "");
     prefs->SetInt64(kPrefsManifestMetadataSize, -1);
     prefs->SetInt64(kPrefsResumedUpdateFailures, 0);
+    TEST_AND_RETURN_FALSE(prefs->Flush());
   }
   return true;
 }
 
+bool DeltaPerformer::LoadCheckpoint(PrefsInterface* prefs,
+                                    UpdateCheckpoint* checkpoint) {
+  if (checkpoint_file_)
+    return checkpoint_file_->Read(checkpoint);
+  TEST_AND_RETURN_FALSE(prefs->GetInt64(kPrefsUpdateStateNextOperation,
+                                        &checkpoint->next_operation));
+  // The rest is missing if the update was reset, which makes the checkpoint
+  // invalid anyway.
+  if (checkpoint->next_operation == kUpdateStateOperationInvalid ||
+      checkpoint->next_operation <= 0)
+    return true;
+  prefs->GetInt64(kPrefsUpdateStateNextDataOffset,
+                  &checkpoint->next_data_offset);
+  prefs->GetString(kPrefsUpdateStateSHA256Context, &checkpoint->hash_context);
+  prefs->GetString(kPrefsUpdateStateSignedSHA256Context,
+                   &checkpoint->signed_hash_context);
+  return true;
+}
+
+bool DeltaPerformer::ReadLocalMetadata(PrefsInterface* prefs,
+                                       const InstallPlan& install_plan,
+                                       vector<char>* metadata) {
+  if (!checkpoint_file_ || !install_plan.is_resume)
+    return false;
+  int64_t manifest_metadata_size = 0;
+  UpdateCheckpoint checkpoint;
+  if (!prefs->GetInt64(kPrefsManifestMetadataSize, &manifest_metadata_size) ||
+      manifest_metadata_size <= 0 ||
+      !LoadCheckpoint(prefs, &checkpoint) ||
+      checkpoint.next_operation <= 0 ||
+      checkpoint.next_data_offset < 0) {
+    return false;
+  }
+  // Some data has to be downloaded for the update to go on.
+  if (static_cast<uint64_t>(manifest_metadata_size +
+                            checkpoint.next_data_offset) >=
+      install_plan.payload_size) {
+    return false;
+  }
+  return checkpoint_file_->ReadMetadata(install_plan.payload_hash, metadata) &&
+      metadata->size() == static_cast<uint64_t>(manifest_metadata_size);
+}
+
 bool DeltaPerformer::CheckpointUpdateProgress() {
+  ScopedTraceEvent trace_event("update", "Checkpoint");
+  trace_event.AddArg("operation", base::Uint64ToString(next_operation_num_));
+  trace_event.AddArg("data_offset", base::Uint64ToString(buffer_offset_));
   Terminator::set_exit_blocked(true);
-  if (last_updated_buffer_offset_ != buffer_offset_) {
+  // The operations the checkpoint claims were applied must have been
+  // applied to the mirrors too.
+  TEST_AND_RETURN_FALSE(MirrorWrittenBlocks());
+  if (checkpoint_file_) {
+    // The whole progress goes in a single record, which is on disk once
+    // written, before the operations that follow overwrite the data read
+    // since the last checkpoint.
+    UpdateCheckpoint checkpoint;
+    checkpoint.next_operation = next_operation_num_;
+    checkpoint.next_data_offset = buffer_offset_;
+    checkpoint.hash_context = hash_calculator_.GetContext();
+    checkpoint.signed_hash_context = signed_hash_context_;
+    TEST_AND_RETURN_FALSE(checkpoint_file_->Write(checkpoint));
+    last_updated_buffer_offset_ = buffer_offset_;
+  } else if (last_updated_buffer_offset_ != buffer_offset_) {
     // Resets the progress in case we die in the middle of the state update.
     ResetUpdateProgress(prefs_, true);
     TEST_AND_RETURN_FALSE(
@@ -1047,46 +3630,82 @@ bool DeltaPerformer::CheckpointUpdateProgress() {
                                            buffer_offset_));
     last_updated_buffer_offset_ = buffer_offset_;
   }
-  TEST_AND_RETURN_FALSE(prefs_->SetInt64(kPrefsUpdateStateNextOperation,
-                                         next_operation_num_));
+  if (!checkpoint_file_) {
+    TEST_AND_RETURN_FALSE(prefs_->SetInt64(kPrefsUpdateStateNextOperation,
+                                           next_operation_num_));
+    // The operations that follow may overwrite the data read since the last
+    // checkpoint, so this one has to be persisted before they run.
+    TEST_AND_RETURN_FALSE(prefs_->Flush());
+  }
+  last_checkpoint_operation_num_ = next_operation_num_;
+  last_checkpoint_time_ = base::Time::Now();
+  checkpoint_count_++;
+  ClearCheckpointReads();
+  UE_PROBE2(checkpoint, next_operation_num_, buffer_offset_);
   return true;
 }
 
+void DeltaPerformer::ClearCheckpointReads() {
+  for (size_t i = 0; i < arraysize(checkpoint_read_ranges_); i++)
+    checkpoint_read_ranges_[i] = ExtentRanges();
+}
+
+bool DeltaPerformer::ShouldCheckpoint() const {
+  if (last_updated_buffer_offset_ == kuint64max ||
+      next_operation_num_ - last_checkpoint_operation_num_ >=
+      kCheckpointMaxOperations ||
+      buffer_offset_ - last_updated_buffer_offset_ >= kCheckpointMaxBytes) {
+    return true;
+  }
+  return base::Time::Now() - last_checkpoint_time_ >=
+      base::TimeDelta::FromSeconds(kCheckpointMaxSeconds);
+}
+
+bool DeltaPerformer::OverwritesCheckpointReads(
+    const DeltaArchiveManifest_InstallOperation& operation,
+    bool is_kernel_partition) const {
+  // Nothing written when applying from the source partitions is read again.
+  if (manifest_.apply_from_source())
+    return false;
+  const ExtentRanges& reads = checkpoint_read_ranges_[is_kernel_partition];
+  for (int i = 0; i < operation.dst_extents_size(); i++) {
+    const Extent& extent = operation.dst_extents(i);
+    if (extent.start_block() == kSparseHole)
+      continue;
+    if (reads.OverlapsExtent(extent))
+      return true;
+  }
+  return false;
+}
+
 bool DeltaPerformer::PrimeUpdateState() {
   CHECK(manifest_valid_);
   block_size_ = manifest_.block_size();
 
-  int64_t next_operation = kUpdateStateOperationInvalid;
-  if (!prefs_->GetInt64(kPrefsUpdateStateNextOperation, &next_operation) ||
-      next_operation == kUpdateStateOperationInvalid ||
-      next_operation <= 0) {
+  UpdateCheckpoint checkpoint;
+  if (!LoadCheckpoint(prefs_, &checkpoint) ||
+      checkpoint.next_operation == kUpdateStateOperationInvalid ||
+      checkpoint.next_operation <= 0) {
     // Initiating a new update, no more state needs to be initialized.
     TEST_AND_RETURN_FALSE(VerifySourcePartitions());
     return true;
   }
-  next_operation_num_ = next_operation;
+  next_operation_num_ = checkpoint.next_operation;
 
   // Resuming an update -- load the rest of the update state.
-  int64_t next_data_offset = -1;
-  TEST_AND_RETURN_FALSE(prefs_->GetInt64(kPrefsUpdateStateNextDataOffset,
-                                         &next_data_offset) &&
-                        next_data_offset >= 0);
-  buffer_offset_ = next_data_offset;
+  TEST_AND_RETURN_FALSE(checkpoint.next_data_offset >= 0);
+  buffer_offset_ = checkpoint.next_data_offset;
 
   // The signed hash context and the signature blob may be empty if the
   // interrupted update didn't reach the signature.
-  prefs_->GetString(kPrefsUpdateStateSignedSHA256Context,
-                    &signed_hash_context_);
+  signed_hash_context_ = checkpoint.signed_hash_context;
   string signature_blob;
   if (prefs_->GetString(kPrefsUpdateStateSignatureBlob, &signature_blob)) {
     signatures_message_data_.assign(signature_blob.begin(),
                                     signature_blob.end());
   }
 
-  string hash_context;
-  TEST_AND_RETURN_FALSE(prefs_->GetString(kPrefsUpdateStateSHA256Context,
-                                          &hash_context) &&
-                        hash_calculator_.SetContext(hash_context));
+  TEST_AND_RETURN_FALSE(hash_calculator_.SetContext(checkpoint.hash_context));
 
   int64_t manifest_metadata_size = 0;
   TEST_AND_RETURN_FALSE(prefs_->GetInt64(kPrefsManifestMetadataSize,
@@ -7,20 +7,38 @@
 
 #include <inttypes.h>
 
+#include <deque>
+#include <map>
+#include <tr1/memory>
 #include <vector>
 
+#include <base/memory/scoped_ptr.h>
 #include <base/time.h>
 #include <google/protobuf/repeated_field.h>
 #include <gtest/gtest_prod.h>  // for FRIEND_TEST
 
+#include "update_engine/aligned_buffer_pool.h"
+#include "update_engine/async_hash_calculator.h"
+#include "update_engine/blob_spool.h"
+#include "update_engine/block_cache.h"
+#include "update_engine/checkpoint_file.h"
+#include "update_engine/extent_ranges.h"
 #include "update_engine/file_writer.h"
+#include "update_engine/incremental_writeback.h"
 #include "update_engine/install_plan.h"
-#include "update_engine/omaha_hash_calculator.h"
+#include "update_engine/partition_mirror.h"
+#include "update_engine/payload_buffer.h"
+#include "update_engine/progress_throttle.h"
+#include "update_engine/queued_extent_writer.h"
 #include "update_engine/system_state.h"
+#include "update_engine/thread_pool.h"
+#include "update_engine/update_duration_estimator.h"
 #include "update_engine/update_metadata.pb.h"
+#include "update_engine/verity_tree_builder.h"
 
 namespace chromeos_update_engine {
 
+class InstallOperationTask;
 class PrefsInterface;
 
 // This class performs the actions in a delta update synchronously. The delta
@@ -50,7 +68,28 @@ class DeltaPerformer : public FileWriter {
   // operations. They must add up to one hundred (100).
   static const unsigned kProgressDownloadWeight;
   static const unsigned kProgressOperationsWeight;
+  // The update progress is checkpointed after at most this many operations,
+  // bytes of data blobs or seconds since the previous checkpoint, whichever
+  // comes first, rather than after every operation.
+  static const unsigned kCheckpointMaxOperations;
+  static const uint64_t kCheckpointMaxBytes;
+  static const unsigned kCheckpointMaxSeconds;
+
+  // The number of operations of a type applied, the bytes they wrote and the
+  // time they took. Operations applied at the same time on worker threads
+  // are all counted in full, so the times may add up to more than Write()
+  // took.
+  struct OperationTypeStats {
+    OperationTypeStats() : count(0), bytes_written(0) {}
+    uint64_t count;
+    uint64_t bytes_written;
+    base::TimeDelta time;
+  };
+  typedef std::map<DeltaArchiveManifest_InstallOperation_Type,
+                   OperationTypeStats> OperationStatsMap;
 
+  // |system_state| may be NULL, e.g., when a payload is applied outside of
+  // the update engine daemon.
   DeltaPerformer(PrefsInterface* prefs,
                  SystemState* system_state,
                  InstallPlan* install_plan)
@@ -59,20 +98,49 @@ class DeltaPerformer : public FileWriter {
         install_plan_(install_plan),
         fd_(-1),
         kernel_fd_(-1),
+        file_target_(false),
+        use_direct_io_(false),
+        direct_fd_(-1),
+        kernel_direct_fd_(-1),
+        source_fd_(-1),
+        kernel_source_fd_(-1),
         manifest_valid_(false),
         manifest_metadata_size_(0),
+        metadata_prefetched_(false),
         next_operation_num_(0),
+        next_prefetch_operation_num_(0),
+        released_operation_num_(0),
         buffer_offset_(0),
         last_updated_buffer_offset_(kuint64max),
         block_size_(0),
+        max_concurrent_operations_(1),
+        apply_ahead_(false),
+        memory_budget_(0),
+        pending_memory_(0),
+        block_cache_size_(0),
+        checkpoint_on_exit_(false),
+        report_download_progress_(true),
+        repair_operations_(false),
+        repair_pending_(false),
+        repair_operation_num_(-1),
+        fast_forward_(false),
+        fast_forward_misses_(0),
+        fast_forwarded_operations_(0),
+        last_checkpoint_operation_num_(0),
+        checkpoint_count_(0),
+        eta_seconds_(-1),
         public_key_path_(kUpdatePayloadPublicKeyPath),
         total_bytes_received_(0),
         num_rootfs_operations_(0),
         num_total_operations_(0),
         overall_progress_(0),
-        last_progress_chunk_(0),
-        forced_progress_log_wait_(
-            base::TimeDelta::FromSeconds(kProgressLogTimeoutSeconds)) {}
+        progress_log_throttle_(
+            1.0 / kProgressLogMaxChunks,
+            base::TimeDelta(),
+            base::TimeDelta::FromSeconds(kProgressLogTimeoutSeconds)) {
+    dst_hashes_cover_[0] = dst_hashes_cover_[1] = false;
+  }
+  virtual ~DeltaPerformer();
 
   // Opens the kernel. Should be called before or after Open(), but before
   // Write(). The kernel file will be close()d when Close() is called.
@@ -93,6 +161,11 @@ class DeltaPerformer : public FileWriter {
   // in case of failures in Write operation.
   bool Write(const void* bytes, size_t count, ActionExitCode *error);
 
+  // FileWriter's buffer lending, which lets the data be received straight
+  // into the payload buffer.
+  char* GetWriteBuffer(size_t count);
+  bool CommitWriteBuffer(size_t count, ActionExitCode* error);
+
   // Wrapper around close. Returns 0 on success or -errno on error.
   // Closes both 'path' given to Open() and the kernel path.
   int Close();
@@ -118,6 +191,24 @@ class DeltaPerformer : public FileWriter {
                            uint64_t* rootfs_size,
                            std::vector<char>* rootfs_hash);
 
+  // Reads from the update manifest the optional per-chunk hashes of the
+  // target kernel and rootfs partitions, which can be verified in parallel.
+  // A partition without valid ones gets a chunk size of 0 and no hashes.
+  // Must be called after the update manifest has been parsed.
+  void GetNewPartitionChunkHashes(
+      uint64_t* kernel_chunk_size,
+      std::vector<std::vector<char> >* kernel_chunk_hashes,
+      uint64_t* rootfs_chunk_size,
+      std::vector<std::vector<char> >* rootfs_chunk_hashes);
+
+  // Sets |kernel_verified| and |rootfs_verified| to whether every block of
+  // the new kernel and rootfs partitions was checked against the destination
+  // hashes of the operations as it was written, in which case the partitions
+  // needn't be read back to be verified. Must be called after all the
+  // operations have been applied.
+  void GetVerifiedPartitions(bool* kernel_verified,
+                             bool* rootfs_verified) const;
+
   // Converts an ordered collection of Extent objects which contain data of
   // length full_length to a comma-separated string. For each Extent, the
   // string will have the start offset and then the length in bytes.
@@ -144,6 +235,27 @@ class DeltaPerformer : public FileWriter {
   // success, false otherwise.
   static bool ResetUpdateProgress(PrefsInterface* prefs, bool quick);
 
+  // Reads the progress of the update at its last checkpoint into
+  // |checkpoint|, from the checkpoint file if there's one, or from |prefs|.
+  // Returns false if there's no checkpoint.
+  static bool LoadCheckpoint(PrefsInterface* prefs,
+                             UpdateCheckpoint* checkpoint);
+
+  // Makes the checkpoints go to |checkpoint_file| rather than to the
+  // preferences, or to the preferences again if it's NULL. Not owned; it
+  // must outlive all updates.
+  static void set_checkpoint_file(CheckpointFile* checkpoint_file) {
+    checkpoint_file_ = checkpoint_file;
+  }
+
+  // Reads the payload metadata kept from the interrupted attempt of the
+  // update that |install_plan| resumes into |metadata|. Returns false if it
+  // has to be downloaded again, e.g., because it isn't kept, or because
+  // there's no data left to download past it.
+  static bool ReadLocalMetadata(PrefsInterface* prefs,
+                                const InstallPlan& install_plan,
+                                std::vector<char>* metadata);
+
   // Attempts to parse the update metadata starting from the beginning of
   // |payload| into |manifest|. On success, sets |metadata_size| to the total
   // metadata bytes (including the delta magic and metadata size fields), and
@@ -156,10 +268,178 @@ class DeltaPerformer : public FileWriter {
       uint64_t* metadata_size,
       ActionExitCode* error);
 
+  // Same as above, for the |payload_size| bytes at |payload|.
+  MetadataParseResult ParsePayloadMetadata(
+      const char* payload,
+      size_t payload_size,
+      DeltaArchiveManifest* manifest,
+      uint64_t* metadata_size,
+      ActionExitCode* error);
+
+  // Parses the payload metadata ahead of the payload being written, e.g.,
+  // while its download is held back until the install plan is complete, so
+  // that it's off the critical path then. |payload| holds the first
+  // |payload_size| bytes of the payload that's written later, unless the
+  // metadata was kept from the interrupted attempt that's resumed, which is
+  // parsed instead. Returns the result of parsing it. An error is reported
+  // by the write of the metadata. Must be called between Open() and the
+  // first write.
+  MetadataParseResult PrefetchMetadata(const char* payload,
+                                       size_t payload_size);
+
   void set_public_key_path(const std::string& public_key_path) {
     public_key_path_ = public_key_path;
   }
 
+  // Limits the amount of downloaded payload data held in memory while waiting
+  // to be applied to |max_buffer_size| bytes. Write() fails with
+  // kActionCodeDownloadWriteError if the limit would be exceeded, e.g., by an
+  // operation with a bigger data blob. 0, the default, means no limit.
+  void set_max_buffer_size(size_t max_buffer_size) {
+    buffer_.set_max_size(max_buffer_size);
+  }
+
+  // Lets up to |max_concurrent_operations| idempotent install operations be
+  // applied at the same time on a pool of worker threads, as long as their
+  // extents don't overlap. Operations are still issued in manifest order and
+  // an operation waits for any in-flight one it reads or writes blocks of, so
+  // the outcome is the same as applying them one by one. 1, the default,
+  // applies every operation synchronously in Write(). Must be called before
+  // the first Write().
+  void set_max_concurrent_operations(unsigned max_concurrent_operations) {
+    max_concurrent_operations_ = max_concurrent_operations;
+  }
+
+  // Makes the operations whose data blobs are passed to WriteAhead() be
+  // applied right away, on the workers set up by
+  // set_max_concurrent_operations(), when the payload is applied from the
+  // source partitions and no other operation writes their blocks. They then
+  // don't wait for a slow part of the payload before them. Must be called
+  // before the first Write().
+  void set_apply_ahead(bool apply_ahead) { apply_ahead_ = apply_ahead; }
+
+  // Takes the |count| bytes at |offset| of the payload, received before the
+  // data that comes before them and that Write() still gets later, in order,
+  // with these bytes. See set_apply_ahead(). Operations that fail are
+  // reported by Write() once it gets to them.
+  void WriteAhead(uint64_t offset, const char* bytes, size_t count);
+
+  // Makes Open() and OpenKernel() also open the partitions with O_DIRECT, and
+  // the REPLACE, REPLACE_BZ, REPLACE_XZ and BSDIFF operations write their new
+  // data through those descriptors from aligned buffers, bypassing the page
+  // cache so that the update doesn't evict the running system's working set.
+  // Partitions that don't support O_DIRECT are written as usual. Must be
+  // called before Open().
+  void set_use_direct_io(bool use_direct_io) {
+    use_direct_io_ = use_direct_io;
+  }
+
+  // Makes the performer treat the partitions that are regular files, e.g.,
+  // the raw disk images of VMs, as files rather than devices: once the
+  // manifest is parsed, each is extended to the size of its new partition
+  // without allocating anything, and the blocks the operations write data
+  // to are preallocated with fallocate(), so that they're laid out together
+  // rather than in the order they're written. The blocks zeroed or
+  // discarded, and the runs of zero blocks in the data, are left as holes
+  // either way, and MOVE operations share their blocks on copy-on-write
+  // file systems. Off by default. Must be called before the first Write().
+  void set_file_target(bool file_target) { file_target_ = file_target; }
+
+  // Keeps the memory the payload is applied with to about |memory_budget|
+  // bytes, for devices that would otherwise run out of it on some payloads.
+  // Data blobs bigger than a quarter of the budget are spooled to an unlinked
+  // file in |spool_dir| as they come in, and applied from there. MOVE
+  // operations that don't overwrite their own source copy a quarter of the
+  // budget at a time, REPLACE_BZ blobs are decompressed in libbz2's low
+  // memory mode, and operations wait for those in flight rather than go over
+  // the budget. No operation is applied ahead then. 0, the default, means no
+  // budget. Must be called before the first Write().
+  void set_memory_budget(uint64_t memory_budget,
+                         const std::string& spool_dir) {
+    memory_budget_ = memory_budget;
+    spool_dir_ = spool_dir;
+  }
+
+  // Keeps up to |size| bytes of the blocks the MOVE and BSDIFF operations
+  // read and, unless the payload is applied from the source partitions, of
+  // the blocks the operations write, for the ones after them that read the
+  // same blocks, rather than read them again from the partitions. This saves
+  // the most with set_use_direct_io(), whose writes skip the page cache.
+  // Payloads with source reuse hints only get the source blocks a later
+  // operation reads kept. 0, the default, means no cache. Must be called
+  // before the first Write().
+  void set_block_cache_size(uint64_t size) {
+    block_cache_size_ = size;
+  }
+
+  // Makes a termination request, between Open() and Close(), stop the
+  // performer after the operation being applied, checkpoint its progress
+  // and exit, rather than lose the progress since the last checkpoint. See
+  // Terminator::set_exit_callback(). Needs the glib main loop to be running.
+  // Off by default. Must be called before Open().
+  void set_checkpoint_on_exit(bool checkpoint_on_exit) {
+    checkpoint_on_exit_ = checkpoint_on_exit;
+  }
+
+  // Waits for the operations in flight, checkpoints the update progress and
+  // exits. Run from the main loop on termination requests, see
+  // set_checkpoint_on_exit(), or by the owner's own exit callback when
+  // Write() is called on another thread, once that's done.
+  void CheckpointAndExit();
+
+  // Makes Write() report the bytes received to the payload state, which is
+  // only used from the main loop. On by default; an owner that calls
+  // Write() on another thread reports them itself.
+  void set_report_download_progress(bool report_download_progress) {
+    report_download_progress_ = report_download_progress;
+  }
+
+  // Makes an operation whose data blob fails its hash check, presumably
+  // corrupted on the way, wait for the blob to be fetched again rather than
+  // fail the update. See GetRepairRange(). A blob is fetched again once at
+  // most. Blobs spooled to disk aren't. Off by default.
+  void set_repair_operations(bool repair_operations) {
+    repair_operations_ = repair_operations;
+  }
+
+  // Returns true if an operation waits for its data blob, and sets |offset|
+  // and |length| to the range of the payload it's in. Write() keeps
+  // buffering the data that follows until RepairOperationData() is called.
+  bool GetRepairRange(uint64_t* offset, uint64_t* length) const;
+
+  // Replaces the data blob the operation waits for with the |count| bytes
+  // at |bytes| and carries on applying the operations, like Write(). A NULL
+  // |bytes| gives up on the blob, which fails with the original error.
+  bool RepairOperationData(const char* bytes,
+                           size_t count,
+                           ActionExitCode* error);
+
+  // Returns the stats of the operations applied so far, by type.
+  const OperationStatsMap& operation_stats() const {
+    return operation_stats_;
+  }
+
+  // Returns the number of times the update progress has been checkpointed.
+  int checkpoint_count() const { return checkpoint_count_; }
+
+  // Sets the rates past updates reached, which the estimate of how long the
+  // update takes starts from. See UpdateDurationEstimator.
+  void set_duration_rates(const UpdateDurationEstimator::Rates& rates) {
+    duration_estimator_.set_stored_rates(rates);
+  }
+
+  // Returns the estimated seconds left until the payload is applied, or -1
+  // until its manifest is parsed. May be called from any thread.
+  int64_t eta_seconds() const {
+    return __atomic_load_n(&eta_seconds_, __ATOMIC_RELAXED);
+  }
+
+  // Returns the estimator of how long the update takes, e.g., for the rates
+  // it reached once the payload is applied.
+  const UpdateDurationEstimator& duration_estimator() const {
+    return duration_estimator_;
+  }
+
   // Returns the byte offset at which the manifest protobuf begins in a
   // payload.
   static uint64_t GetManifestOffset();
@@ -169,9 +449,37 @@ class DeltaPerformer : public FileWriter {
   // that's returned by the GetManifestOffset method.
   static uint64_t GetManifestSizeOffset();
 
+  // Sets |order| to the order in which the operations of |manifest| are
+  // applied, as indices into its rootfs operations followed by its kernel
+  // ones. The operations of each partition are applied in manifest order,
+  // and those of the two partitions are merged so that the data blobs are
+  // consumed in payload order: a kernel operation goes first only if the
+  // next blob is one of the kernel's. Payloads with the kernel blobs after
+  // the rootfs ones are thus applied in manifest order, while those that
+  // interleave them write the kernel partition as its data comes in.
+  static void GetOperationOrder(const DeltaArchiveManifest& manifest,
+                                std::vector<size_t>* order);
+
+  // Sets |boundaries| to the payload offsets, in order, where the segments
+  // of |manifest| start and end, given the |metadata_size| bytes of payload
+  // metadata before the data blobs. A segment that starts where the one
+  // before it ends adds a single boundary. Returns false, with no
+  // boundaries, if the segments overlap, are out of order or don't hold the
+  // data blobs of the operations of their partition.
+  static bool GetPayloadSegmentBoundaries(
+      const DeltaArchiveManifest& manifest,
+      uint64_t metadata_size,
+      std::vector<uint64_t>* boundaries);
+
  private:
   friend class DeltaPerformerTest;
+  FRIEND_TEST(DeltaPerformerTest, DestinationHashesCoverTest);
   FRIEND_TEST(DeltaPerformerTest, IsIdempotentOperationTest);
+  FRIEND_TEST(DeltaPerformerTest, NextPrefetchExtentsTest);
+  FRIEND_TEST(DeltaPerformerTest, OperationsConflictTest);
+  FRIEND_TEST(DeltaPerformerTest, OverwritesCheckpointReadsTest);
+  FRIEND_TEST(DeltaPerformerTest, PrefetchMetadataTest);
+  FRIEND_TEST(DeltaPerformerTest, ReleaseAppliedOperationsTest);
 
   // Logs the progress of downloading/applying an update.
   void LogProgress(const char* message_prefix);
@@ -182,27 +490,146 @@ class DeltaPerformer : public FileWriter {
   static bool IsIdempotentOperation(
       const DeltaArchiveManifest_InstallOperation& op);
 
+  // Returns true if |op| can be interrupted and repeated safely in this
+  // payload: if it's idempotent, or the payload is applied from the source
+  // partitions.
+  bool CanRepeatOperation(
+      const DeltaArchiveManifest_InstallOperation& op) const;
+
+  // Returns true if the operations on the kernel partition if
+  // |is_kernel_partition|, and on the rootfs one otherwise, all have
+  // destination hashes, and write each block of the new partition exactly
+  // once.
+  bool DestinationHashesCover(bool is_kernel_partition) const;
+
+  // Returns true if the payload is being applied again, |op| has a
+  // destination hash and its destination blocks already match it, in which
+  // case it needn't be applied. Stops checking once kFastForwardMissLimit
+  // operations in a row didn't match, past where the earlier attempt got.
+  bool CanFastForwardOperation(const DeltaArchiveManifest_InstallOperation& op,
+                               bool is_kernel_partition);
+
+  // Returns true if |a| and |b| can't be applied at the same time because one
+  // of them writes blocks that the other one reads or writes. Both operations
+  // must be on the same partition.
+  static bool OperationsConflict(
+      const DeltaArchiveManifest_InstallOperation& a,
+      const DeltaArchiveManifest_InstallOperation& b);
+
+  // Opens |path| with O_DIRECT into |direct_fd|, leaving it -1 on failure, and
+  // creates |direct_io_buffers_| if needed.
+  void OpenDirectIO(const char* path, int* direct_fd);
+
+  // Sets up the partitions the MOVE and BSDIFF operations read from, once the
+  // manifest is parsed. A payload applied from the source partitions gets
+  // them opened read-only. For one that patches the new partitions in place,
+  // a new update first copies the source partitions of the install plan, if
+  // any, to them. Returns true on success.
+  bool OpenSourcePartitions();
+
+  // Returns the descriptor the operations on the kernel or rootfs partition
+  // read their source blocks from.
+  int SourceFd(bool is_kernel_partition) const;
+
+  // Returns the cache the operations keep the blocks they write in, or NULL
+  // if there's none. Blocks written are only read back by later operations
+  // when the payload patches the new partitions in place.
+  BlockCache* WrittenBlockCache() const;
+
+  // Returns true if the source blocks |operation| reads are worth keeping in
+  // |block_cache_|: either the payload marks the operations whose source
+  // blocks a later one reads, and |operation| is one of them, or it doesn't.
+  bool KeepsSourceBlocks(
+      const DeltaArchiveManifest_InstallOperation& operation) const;
+
+  // Drops the destination blocks of |operation| from |block_cache_|, if any,
+  // before it overwrites them. The in-flight operations that read or write
+  // them must have completed by then.
+  void InvalidateCachedBlocks(
+      const DeltaArchiveManifest_InstallOperation& operation,
+      bool is_kernel_partition);
+
+  // Asks the kernel to read ahead the source blocks of the operations that
+  // follow the next one to apply, if it hasn't been asked to yet, so that
+  // the reads overlap with the download of their data.
+  void PrefetchSourceBlocks();
+
+  // Appends the source extents PrefetchSourceBlocks() reads ahead to
+  // |rootfs_extents| and |kernel_extents|, by the partition they're in, and
+  // marks their operations as prefetched. Those are the extents of the
+  // operations from the next one to apply on, up to kPrefetchMaxOperations
+  // of them or kPrefetchMaxBytes of source blocks, that haven't been
+  // prefetched yet. Sparse holes are left out.
+  void NextPrefetchExtents(std::vector<Extent>* rootfs_extents,
+                           std::vector<Extent>* kernel_extents);
+
+  // Frees the extents and hashes of the operations that have been applied,
+  // which are never looked at again, so that the memory taken by the
+  // manifest shrinks as the update progresses. Operations are only released
+  // when none is in flight, since the tasks refer to them.
+  void ReleaseAppliedOperations();
+
   // Verifies that the expected source partition hashes (if present) match the
   // hashes for the current partitions. Returns true if there're no expected
   // hashes in the payload (e.g., if it's a new-style full update) or if the
   // hashes match; returns false otherwise.
   bool VerifySourcePartitions();
 
+  // Does the work of Write() once the |count| bytes written have been
+  // appended to |buffer_|: parses the metadata and applies the operations
+  // whose data blobs are complete.
+  bool ProcessReceivedBytes(size_t count, ActionExitCode* error);
+
   // Returns true if enough of the delta file has been passed via Write()
   // to be able to perform a given install operation.
   bool CanPerformInstallOperation(
       const DeltaArchiveManifest_InstallOperation& operation);
 
-  // Validates that the hash of the blobs corresponding to the given |operation|
-  // matches what's specified in the manifest in the payload.
-  // Returns kActionCodeSuccess on match or a suitable error code otherwise.
+  // Validates that the hash of |data|, the blob of |operation|, the
+  // |operation_num|th one, matches what's specified in the manifest in the
+  // payload. Returns kActionCodeSuccess on match or a suitable error code
+  // otherwise.
   ActionExitCode ValidateOperationHash(
+      const DeltaArchiveManifest_InstallOperation& operation,
+      size_t operation_num,
+      const char* data);
+
+  // Returns true if the data blob of |operation|, the next one to apply, is
+  // spooled to disk rather than buffered. See set_memory_budget().
+  bool ShouldSpoolOperation(
+      const DeltaArchiveManifest_InstallOperation& operation) const;
+
+  // Moves the received part of the data blob of |operation| from |buffer_|
+  // to |spool_|. Returns false on failure.
+  bool SpoolOperationData(
+      const DeltaArchiveManifest_InstallOperation& operation);
+
+  // Points |data| at the data blob of |operation|, the next one to apply, in
+  // |spool_| if it was spooled and at the head of |buffer_| otherwise, and
+  // passes it to the payload hash. Returns false if it isn't there.
+  bool TakeOperationData(
+      const DeltaArchiveManifest_InstallOperation& operation,
+      const char** data);
+
+  // Drops the data blob of |operation| once it's been applied.
+  void ReleaseOperationData(
       const DeltaArchiveManifest_InstallOperation& operation);
 
+  // Returns about how much memory applying |operation| on a worker takes:
+  // the copy of its data blob and the buffers it's applied through.
+  uint64_t OperationMemory(
+      const DeltaArchiveManifest_InstallOperation& operation) const;
+
   // Returns true on success.
   bool PerformInstallOperation(
       const DeltaArchiveManifest_InstallOperation& operation);
 
+  // Returns the |operation_num|th operation to apply, setting
+  // |is_kernel_partition| to whether it's a kernel operation.
+  const DeltaArchiveManifest_InstallOperation& GetOperation(
+      size_t operation_num,
+      bool* is_kernel_partition) const;
+
   // These perform a specific type of operation and return true on success.
   bool PerformReplaceOperation(
       const DeltaArchiveManifest_InstallOperation& operation,
@@ -213,6 +640,70 @@ class DeltaPerformer : public FileWriter {
   bool PerformBsdiffOperation(
       const DeltaArchiveManifest_InstallOperation& operation,
       bool is_kernel_partition);
+  bool PerformStreamDiffOperation(
+      const DeltaArchiveManifest_InstallOperation& operation,
+      bool is_kernel_partition);
+  bool PerformZeroOperation(
+      const DeltaArchiveManifest_InstallOperation& operation,
+      bool is_kernel_partition);
+
+  // Takes the data blob of |operation|, if any, off the head of |buffer_| and
+  // queues the operation on |thread_pool_|, after waiting for the in-flight
+  // operations that conflict with it. |operation| must be idempotent. Returns
+  // false if the operation can't be queued or a waited-for operation failed.
+  bool ScheduleOperation(
+      const DeltaArchiveManifest_InstallOperation& operation,
+      bool is_kernel_partition);
+
+  // Adds |operation|, which took |time| to apply, to |operation_stats_|.
+  void AddOperationStats(
+      const DeltaArchiveManifest_InstallOperation& operation,
+      base::TimeDelta time);
+
+  // Creates |thread_pool_| if it isn't yet. Returns false on failure.
+  bool InitThreadPool();
+
+  // Sets up |ahead_candidates_| once the manifest is parsed.
+  void InitApplyAhead();
+
+  // Queues the operations whose data blobs are complete in |chunk| of
+  // |ahead_data_| and keeps only the start of the blob it ends in, if any.
+  void ScheduleAheadOperations(
+      std::map<uint64_t, std::vector<char> >::iterator chunk);
+
+  // Waits for the operations queued ahead. Returns false if any failed.
+  bool WaitAheadOperations();
+
+  // Waits for the oldest in-flight operation to complete. Returns false if it
+  // failed.
+  bool WaitOldestOperation();
+
+  // Waits for all in-flight operations to complete. Returns false if any of
+  // them failed.
+  bool WaitAllOperations();
+
+  // Extends the new kernel or rootfs partition, if it's a regular file, to
+  // its new size and preallocates the blocks the operations write data to.
+  // See set_file_target(). Returns false on failure.
+  bool PrepareFileTarget(bool is_kernel_partition);
+
+  // Sets up |hash_tree_| if the payload has a rootfs hash tree. Returns
+  // false if the tree isn't valid.
+  bool InitHashTree();
+
+  // Reads |hash_tree_extents_| back into |hash_tree_|. The operations that
+  // wrote them must have completed.
+  void HashWrittenBlocks();
+
+  // Completes |hash_tree_| once all operations are applied, checks it
+  // against the root hash in the payload, if any, and writes it out.
+  // Returns false on failure.
+  bool FinishHashTree();
+
+  // Copies the blocks written so far to the devices that mirror the
+  // partitions. The operations that wrote them must have completed. Returns
+  // false on failure.
+  bool MirrorWrittenBlocks();
 
   // Returns true if the payload signature message has been extracted from
   // |operation|, false otherwise.
@@ -223,10 +714,29 @@ class DeltaPerformer : public FileWriter {
   // then discards them.
   void DiscardBufferHeadBytes(size_t count);
 
+  // Stops deferring the exit on termination requests to
+  // CheckpointAndExit().
+  void ClearExitCallback();
+
   // Checkpoints the update progress into persistent storage to allow this
   // update attempt to be resumed after reboot.
   bool CheckpointUpdateProgress();
 
+  // Returns true if enough progress has been made since the last checkpoint
+  // to take another one.
+  bool ShouldCheckpoint() const;
+
+  // A resumed update replays all operations since the last checkpoint, which
+  // is only safe if none of them overwrites blocks that an earlier one
+  // reads. Returns true if |operation| would overwrite such blocks, in which
+  // case a checkpoint must be taken before it's applied.
+  bool OverwritesCheckpointReads(
+      const DeltaArchiveManifest_InstallOperation& operation,
+      bool is_kernel_partition) const;
+
+  // Forgets the blocks read since the last checkpoint.
+  void ClearCheckpointReads();
+
   // Primes the required update state. Returns true if the update state was
   // successfully initialized to a saved resume state or if the update is a new
   // update. Returns false otherwise.
@@ -247,21 +757,63 @@ class DeltaPerformer : public FileWriter {
   // File descriptor of the kernel device
   int kernel_fd_;
 
+  // See set_file_target().
+  bool file_target_;
+
+  // Whether to write through O_DIRECT descriptors, and the descriptors, or -1
+  // if not open.
+  bool use_direct_io_;
+  int direct_fd_;
+  int kernel_direct_fd_;
+
+  // Read-only descriptors of the source partitions when the payload is
+  // applied from them, or -1.
+  int source_fd_;
+  int kernel_source_fd_;
+
+  // The aligned buffers used to write through the O_DIRECT descriptors.
+  // Created by the first Open() or OpenKernel() that opens one.
+  scoped_ptr<AlignedBufferPool> direct_io_buffers_;
+
+  // Writes the rootfs ([0]) and kernel ([1]) partitions back to disk as the
+  // operations complete, so that Close() doesn't leave the whole partition
+  // dirty in the page cache.
+  IncrementalWriteback writeback_[2];
+
+  // Copies the writes to the rootfs ([0]) and kernel ([1]) partitions to the
+  // devices that mirror them, if the install plan has any.
+  PartitionMirror mirrors_[2];
+
   std::string path_;  // Path that fd_ refers to.
   std::string kernel_path_;  // Path that kernel_fd_ refers to.
 
   DeltaArchiveManifest manifest_;
   bool manifest_valid_;
   uint64_t manifest_metadata_size_;
+  // Whether |manifest_| was parsed by PrefetchMetadata().
+  bool metadata_prefetched_;
+
+  // The payload metadata of a resumed update, if it isn't downloaded again,
+  // in which case the payload data comes in from the checkpoint.
+  std::vector<char> local_metadata_;
 
-  // Index of the next operation to perform in the manifest.
+  // Index of the next operation to perform in |operation_order_|.
   size_t next_operation_num_;
 
+  // The order the operations are applied in, see GetOperationOrder().
+  std::vector<size_t> operation_order_;
+
+  // Index of the first operation whose source blocks haven't been prefetched.
+  size_t next_prefetch_operation_num_;
+
+  // Index of the first operation that hasn't been released.
+  size_t released_operation_num_;
+
   // buffer_ is a window of the data that's been downloaded. At first,
   // it contains the beginning of the download, but after the protobuf
   // has been downloaded and parsed, it contains a sliding window of
   // data blobs.
-  std::vector<char> buffer_;
+  PayloadBuffer buffer_;
   // Offset of buffer_ in the binary blobs section of the update.
   uint64_t buffer_offset_;
 
@@ -271,12 +823,115 @@ class DeltaPerformer : public FileWriter {
   // The block size (parsed from the manifest).
   uint32_t block_size_;
 
-  // Calculates the payload hash.
-  OmahaHashCalculator hash_calculator_;
+  // The maximum number of operations applied at the same time.
+  unsigned max_concurrent_operations_;
+
+  // Operations queued on |thread_pool_| that haven't been waited for yet, in
+  // manifest order. Declared before |thread_pool_| so that the pool, whose
+  // destructor runs any queued tasks, goes away first.
+  std::deque<std::tr1::shared_ptr<InstallOperationTask> > pending_operations_;
+
+  // Whether operations may be applied as their data is passed to
+  // WriteAhead(), the numbers of those that may be, by the offset of their
+  // data blob, and the data passed to WriteAhead() that may still complete
+  // one of their blobs, by offset into the blobs.
+  bool apply_ahead_;
+  std::map<uint64_t, size_t> ahead_candidates_;
+  std::map<uint64_t, std::vector<char> > ahead_data_;
+
+  // Operations queued on |thread_pool_| by WriteAhead() that Write() hasn't
+  // got to yet, by number. Declared before |thread_pool_| too.
+  std::map<size_t, std::tr1::shared_ptr<InstallOperationTask> >
+      ahead_operations_;
+
+  // See set_memory_budget(). 0 for no budget.
+  uint64_t memory_budget_;
+  std::string spool_dir_;
+  // The data blob of the next operation to apply, while it's spooled.
+  BlobSpool spool_;
+  // The OperationMemory() of |pending_operations_|.
+  uint64_t pending_memory_;
+
+  // See set_block_cache_size(). Created along with the state of the
+  // update, if at all.
+  uint64_t block_cache_size_;
+  scoped_ptr<BlockCache> block_cache_;
+
+  // See set_checkpoint_on_exit(). |exit_callback_| runs
+  // CheckpointAndExit() between Open() and Close().
+  bool checkpoint_on_exit_;
+  scoped_ptr<google::protobuf::Closure> exit_callback_;
+
+  // See set_report_download_progress().
+  bool report_download_progress_;
+
+  // See set_repair_operations(). |repair_pending_| is set while the
+  // |repair_operation_num_|th operation waits for its data blob. That
+  // operation, the last one repaired or -1, isn't repaired again.
+  bool repair_operations_;
+  bool repair_pending_;
+  int64_t repair_operation_num_;
+
+  // Whether the operations whose destination blocks already match are
+  // skipped, when the payload is applied again from the start, the number
+  // of operations in a row that didn't match since the last that did, and
+  // the number skipped.
+  bool fast_forward_;
+  int fast_forward_misses_;
+  uint64_t fast_forwarded_operations_;
+
+  // Runs the queued operations. Created by the first ScheduleOperation().
+  scoped_ptr<ThreadPool> thread_pool_;
+
+  // Decompresses the blocks of the large REPLACE_BZ data blobs, one worker
+  // per core. Created by the first such operation applied synchronously.
+  scoped_ptr<ThreadPool> bzip_pool_;
+
+  // Writes out the data of the compressed REPLACE operations applied
+  // synchronously while it's being decompressed. Created by the first one.
+  scoped_ptr<QueuedExtentWriter> write_queue_;
+
+  // The stats of the operations applied so far, by type.
+  OperationStatsMap operation_stats_;
+
+  // Estimates how long the update takes, refined as the payload is received
+  // and applied. The estimate is published to |eta_seconds_| with the
+  // progress, see eta_seconds().
+  UpdateDurationEstimator duration_estimator_;
+  int64_t eta_seconds_;
+
+  // The |next_operation_num_| and the time of the last checkpoint.
+  size_t last_checkpoint_operation_num_;
+  base::Time last_checkpoint_time_;
+  int checkpoint_count_;
+
+  // The rootfs ([0]) and kernel ([1]) blocks read by the operations applied
+  // since the last checkpoint.
+  ExtentRanges checkpoint_read_ranges_[2];
+
+  // Builds the dm-verity hash tree of the new rootfs, if the payload has
+  // one, from the blocks the operations write, which are read back while
+  // they're still in the page cache, before they're written back. The
+  // rootfs extents written since the operations were last all complete wait
+  // in |hash_tree_extents_|.
+  scoped_ptr<VerityTreeBuilder> hash_tree_;
+  std::vector<Extent> hash_tree_extents_;
+
+  // Whether the new rootfs ([0]) and kernel ([1]) partitions are verified by
+  // the destination hashes checked as the operations are applied. Not so
+  // when resuming, since the operations applied before weren't hashed here.
+  bool dst_hashes_cover_[2];
+
+  // Calculates the payload hash on a thread of its own, so that hashing
+  // overlaps with validating and applying the operations.
+  AsyncHashCalculator hash_calculator_;
 
   // Saves the signed hash context.
   std::string signed_hash_context_;
 
+  // The file the checkpoints are written to, if not the preferences.
+  static CheckpointFile* checkpoint_file_;
+
   // Signatures message blob extracted directly from the payload.
   std::vector<char> signatures_message_data_;
 
@@ -295,13 +950,9 @@ class DeltaPerformer : public FileWriter {
   // and the ratio of applied operations. Range is 0-100.
   unsigned overall_progress_;
 
-  // The last progress chunk recorded.
-  unsigned last_progress_chunk_;
-
-  // The timeout after which we should force emitting a progress log (constant),
-  // and the actual point in time for the next forced log to be emitted.
-  const base::TimeDelta forced_progress_log_wait_;
-  base::Time forced_progress_log_time_;
+  // Limits the progress logs to one per progress chunk, see
+  // kProgressLogMaxChunks, and per kProgressLogTimeoutSeconds otherwise.
+  ProgressThrottle progress_log_throttle_;
 
   DISALLOW_COPY_AND_ASSIGN(DeltaPerformer);
 };
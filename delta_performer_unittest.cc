@@ -2,6 +2,7 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <endian.h>
 #include <sys/mount.h>
 #include <inttypes.h>
 
@@ -16,12 +17,14 @@
 #include <google/protobuf/repeated_field.h>
 #include <gtest/gtest.h>
 
+#include "update_engine/compact_manifest.h"
 #include "update_engine/delta_diff_generator.h"
 #include "update_engine/delta_performer.h"
 #include "update_engine/extent_ranges.h"
 #include "update_engine/full_update_generator.h"
 #include "update_engine/graph_types.h"
 #include "update_engine/mock_system_state.h"
+#include "update_engine/omaha_hash_calculator.h"
 #include "update_engine/payload_signer.h"
 #include "update_engine/prefs_mock.h"
 #include "update_engine/test_utils.h"
@@ -515,13 +518,23 @@ static void ApplyDeltaFile(bool full_kernel, bool full_rootfs, bool noop,
       break;
   }
 
-  // Write at some number of bytes per operation. Arbitrarily chose 5.
+  // Write at some number of bytes per operation. Arbitrarily chose 5. Every
+  // other write goes into the buffer that the performer lends instead.
   const size_t kBytesPerWrite = 5;
   for (size_t i = 0; i < state->delta.size(); i += kBytesPerWrite) {
     size_t count = min(state->delta.size() - i, kBytesPerWrite);
-    bool write_succeeded = ((*performer)->Write(&state->delta[i],
-                                                count,
-                                                &actual_error));
+    char* buffer = NULL;
+    if ((i / kBytesPerWrite) % 2)
+      buffer = (*performer)->GetWriteBuffer(count);
+    bool write_succeeded;
+    if (buffer) {
+      memcpy(buffer, &state->delta[i], count);
+      write_succeeded = (*performer)->CommitWriteBuffer(count, &actual_error);
+    } else {
+      write_succeeded = (*performer)->Write(&state->delta[i],
+                                            count,
+                                            &actual_error);
+    }
     // Normally write_succeeded should be true every time and
     // actual_error should be kActionCodeSuccess. If so, continue the loop.
     // But if we seeded an operation hash error above, then write_succeeded
@@ -719,6 +732,30 @@ TEST(DeltaPerformerTest, BadDeltaMagicTest) {
   EXPECT_LT(performer.Close(), 0);
 }
 
+TEST(DeltaPerformerTest, MetadataParsedWhenCompleteTest) {
+  PrefsMock prefs;
+  InstallPlan install_plan;
+  MockSystemState mock_system_state;
+  DeltaPerformer performer(&prefs, &mock_system_state, &install_plan);
+  EXPECT_EQ(0, performer.Open("/dev/null", 0, 0));
+  EXPECT_TRUE(performer.OpenKernel("/dev/null"));
+
+  // A header announcing a 10-byte manifest, which isn't a valid protobuf.
+  const uint64_t manifest_size = 10;
+  const uint64_t manifest_size_be = htobe64(manifest_size);
+  const vector<char> version(DeltaPerformer::kDeltaVersionSize, 0);
+  EXPECT_TRUE(performer.Write(kDeltaMagic, strlen(kDeltaMagic)));
+  EXPECT_TRUE(performer.Write(&version[0], version.size()));
+  EXPECT_TRUE(performer.Write(&manifest_size_be, sizeof(manifest_size_be)));
+
+  // The manifest is only parsed, and found to be bad, once it's complete.
+  const char junk = '\xff';
+  for (uint64_t i = 0; i < manifest_size - 1; i++)
+    EXPECT_TRUE(performer.Write(&junk, 1));
+  EXPECT_FALSE(performer.Write(&junk, 1));
+  EXPECT_LT(performer.Close(), 0);
+}
+
 TEST(DeltaPerformerTest, IsIdempotentOperationTest) {
   DeltaArchiveManifest_InstallOperation op;
   EXPECT_TRUE(DeltaPerformer::IsIdempotentOperation(op));
@@ -735,6 +772,987 @@ TEST(DeltaPerformerTest, IsIdempotentOperationTest) {
   EXPECT_FALSE(DeltaPerformer::IsIdempotentOperation(op));
 }
 
+TEST(DeltaPerformerTest, OperationsConflictTest) {
+  DeltaArchiveManifest_InstallOperation a;
+  *(a.add_src_extents()) = ExtentForRange(0, 2);
+  *(a.add_dst_extents()) = ExtentForRange(10, 2);
+  DeltaArchiveManifest_InstallOperation b;
+  *(b.add_src_extents()) = ExtentForRange(0, 1);
+  *(b.add_dst_extents()) = ExtentForRange(20, 1);
+  // Reading the same blocks is fine.
+  EXPECT_FALSE(DeltaPerformer::OperationsConflict(a, b));
+  EXPECT_FALSE(DeltaPerformer::OperationsConflict(b, a));
+  // Writing blocks the other operation reads or writes isn't.
+  *(b.add_dst_extents()) = ExtentForRange(1, 1);
+  EXPECT_TRUE(DeltaPerformer::OperationsConflict(a, b));
+  EXPECT_TRUE(DeltaPerformer::OperationsConflict(b, a));
+  b.clear_dst_extents();
+  *(b.add_dst_extents()) = ExtentForRange(11, 3);
+  EXPECT_TRUE(DeltaPerformer::OperationsConflict(a, b));
+  EXPECT_TRUE(DeltaPerformer::OperationsConflict(b, a));
+  // Sparse holes are never read or written.
+  a.clear_dst_extents();
+  *(a.add_dst_extents()) = ExtentForRange(kSparseHole, 4);
+  b.clear_dst_extents();
+  *(b.add_dst_extents()) = ExtentForRange(kSparseHole, 4);
+  EXPECT_FALSE(DeltaPerformer::OperationsConflict(a, b));
+}
+
+TEST(DeltaPerformerTest, GetOperationOrderTest) {
+  // Rootfs: a blob, a move, a blob and a move. Kernel: a move and two blobs.
+  const int kRootfsOffsets[] = { 0, -1, 30, -1 };
+  const int kKernelOffsets[] = { -1, 10, 40 };
+  DeltaArchiveManifest manifest;
+  for (size_t i = 0; i < arraysize(kRootfsOffsets); i++) {
+    DeltaArchiveManifest_InstallOperation* op =
+        manifest.add_install_operations();
+    if (kRootfsOffsets[i] >= 0)
+      op->set_data_offset(kRootfsOffsets[i]);
+  }
+  for (size_t i = 0; i < arraysize(kKernelOffsets); i++) {
+    DeltaArchiveManifest_InstallOperation* op =
+        manifest.add_kernel_install_operations();
+    if (kKernelOffsets[i] >= 0)
+      op->set_data_offset(kKernelOffsets[i]);
+  }
+
+  // Moves go with the next blob of their partition, except for the last
+  // rootfs one, which has none and isn't held back by the kernel blob.
+  vector<size_t> order;
+  DeltaPerformer::GetOperationOrder(manifest, &order);
+  const size_t kInterleavedOrder[] = { 0, 4, 5, 1, 2, 3, 6 };
+  EXPECT_EQ(vector<size_t>(kInterleavedOrder,
+                           kInterleavedOrder + arraysize(kInterleavedOrder)),
+            order);
+
+  // With the kernel blobs last, the operations are applied in manifest
+  // order.
+  manifest.mutable_kernel_install_operations(1)->set_data_offset(50);
+  manifest.mutable_kernel_install_operations(2)->set_data_offset(60);
+  DeltaPerformer::GetOperationOrder(manifest, &order);
+  const size_t kManifestOrder[] = { 0, 1, 2, 3, 4, 5, 6 };
+  EXPECT_EQ(vector<size_t>(kManifestOrder,
+                           kManifestOrder + arraysize(kManifestOrder)),
+            order);
+}
+
+TEST(DeltaPerformerTest, GetPayloadSegmentBoundariesTest) {
+  // Rootfs blobs at 0 and 20, a kernel one at 10 and the signature at 30.
+  DeltaArchiveManifest manifest;
+  DeltaArchiveManifest_InstallOperation* op = manifest.add_install_operations();
+  op->set_data_offset(0);
+  op->set_data_length(10);
+  op = manifest.add_install_operations();
+  op->set_data_offset(20);
+  op->set_data_length(10);
+  op = manifest.add_kernel_install_operations();
+  op->set_data_offset(10);
+  op->set_data_length(5);
+  DeltaDiffGenerator::AddSignatureOp(30, 8, &manifest);
+  const int kSegments[][3] = {
+    { PayloadSegment::ROOTFS, 0, 10 },
+    { PayloadSegment::KERNEL, 10, 5 },
+    { PayloadSegment::ROOTFS, 20, 10 },
+  };
+  for (size_t i = 0; i < arraysize(kSegments); i++) {
+    PayloadSegment* segment = manifest.add_segments();
+    segment->set_partition(
+        static_cast<PayloadSegment::Partition>(kSegments[i][0]));
+    segment->set_data_offset(kSegments[i][1]);
+    segment->set_data_length(kSegments[i][2]);
+  }
+
+  vector<uint64_t> boundaries;
+  EXPECT_TRUE(DeltaPerformer::GetPayloadSegmentBoundaries(manifest, 100,
+                                                          &boundaries));
+  const uint64_t kBoundaries[] = { 100, 110, 115, 120, 130 };
+  EXPECT_EQ(vector<uint64_t>(kBoundaries,
+                             kBoundaries + arraysize(kBoundaries)),
+            boundaries);
+
+  // A blob outside the segments of its partition.
+  manifest.mutable_segments(1)->set_partition(PayloadSegment::ROOTFS);
+  EXPECT_FALSE(DeltaPerformer::GetPayloadSegmentBoundaries(manifest, 100,
+                                                           &boundaries));
+  EXPECT_TRUE(boundaries.empty());
+  manifest.mutable_segments(1)->set_partition(PayloadSegment::KERNEL);
+  manifest.mutable_segments(1)->set_data_length(4);
+  EXPECT_FALSE(DeltaPerformer::GetPayloadSegmentBoundaries(manifest, 100,
+                                                           &boundaries));
+
+  // Overlapping segments.
+  manifest.mutable_segments(1)->set_data_offset(5);
+  manifest.mutable_segments(1)->set_data_length(10);
+  EXPECT_FALSE(DeltaPerformer::GetPayloadSegmentBoundaries(manifest, 100,
+                                                           &boundaries));
+}
+
+namespace {
+// Adds a REPLACE operation writing |count| bytes of |value| to |block| to
+// |manifest| and appends its data blob to |blobs|.
+void AddReplaceOperation(uint64_t block, char value, size_t count,
+                         DeltaArchiveManifest* manifest, vector<char>* blobs) {
+  DeltaArchiveManifest_InstallOperation* op =
+      manifest->add_install_operations();
+  op->set_type(DeltaArchiveManifest_InstallOperation_Type_REPLACE);
+  op->set_data_offset(blobs->size());
+  op->set_data_length(count);
+  *(op->add_dst_extents()) = ExtentForRange(block, 1);
+  blobs->insert(blobs->end(), count, value);
+}
+
+// Adds a MOVE operation copying block |src| to block |dst| to |manifest|.
+void AddMoveOperation(uint64_t src, uint64_t dst,
+                      DeltaArchiveManifest* manifest) {
+  DeltaArchiveManifest_InstallOperation* op =
+      manifest->add_install_operations();
+  op->set_type(DeltaArchiveManifest_InstallOperation_Type_MOVE);
+  *(op->add_src_extents()) = ExtentForRange(src, 1);
+  *(op->add_dst_extents()) = ExtentForRange(dst, 1);
+}
+
+// Sets |payload| to an unsigned payload of |file_format_version| made of
+// |manifest| and |blobs|.
+void BuildTestPayload(const DeltaArchiveManifest& manifest,
+                      const vector<char>& blobs,
+                      vector<char>* payload,
+                      uint64_t file_format_version = 1) {
+  string manifest_data;
+  EXPECT_TRUE(manifest.AppendToString(&manifest_data));
+  payload->assign(kDeltaMagic, kDeltaMagic + strlen(kDeltaMagic));
+  const uint64_t version = htobe64(file_format_version);
+  const uint64_t manifest_size = htobe64(manifest_data.size());
+  payload->insert(payload->end(),
+                  reinterpret_cast<const char*>(&version),
+                  reinterpret_cast<const char*>(&version) + sizeof(version));
+  payload->insert(payload->end(),
+                  reinterpret_cast<const char*>(&manifest_size),
+                  reinterpret_cast<const char*>(&manifest_size) +
+                  sizeof(manifest_size));
+  payload->insert(payload->end(), manifest_data.begin(), manifest_data.end());
+  payload->insert(payload->end(), blobs.begin(), blobs.end());
+}
+
+// Applies an unsigned payload made of |manifest| and |blobs| to the file at
+// |path| from the one at |source_path|, if not empty, |chunk_size| bytes at a
+// time and with up to |max_concurrent| operations in flight. Sets |stats|, if
+// not NULL, to the stats of the applied operations.
+void ApplyTestPayload(const DeltaArchiveManifest& manifest,
+                      const vector<char>& blobs,
+                      const string& source_path,
+                      const string& path,
+                      unsigned max_concurrent,
+                      size_t chunk_size,
+                      PrefsMock* prefs,
+                      DeltaPerformer::OperationStatsMap* stats = NULL) {
+  vector<char> payload;
+  BuildTestPayload(manifest, blobs, &payload);
+
+  InstallPlan install_plan;
+  install_plan.source_path = source_path;
+  MockSystemState mock_system_state;
+  DeltaPerformer performer(prefs, &mock_system_state, &install_plan);
+  performer.set_max_concurrent_operations(max_concurrent);
+  EXPECT_EQ(0, performer.Open(path.c_str(), 0, 0));
+  EXPECT_TRUE(performer.OpenKernel("/dev/null"));
+  for (size_t i = 0; i < payload.size(); i += chunk_size) {
+    EXPECT_TRUE(performer.Write(&payload[i],
+                                min(chunk_size, payload.size() - i)));
+  }
+  EXPECT_EQ(0, performer.Close());
+  if (stats)
+    *stats = performer.operation_stats();
+}
+
+// Builds a payload that writes blocks 0 to 3 of a file with "cbad", with
+// operations that depend on each other.
+void BuildDependentOperations(DeltaArchiveManifest* manifest,
+                              vector<char>* blobs,
+                              vector<char>* expected) {
+  manifest->set_block_size(kBlockSize);
+  AddReplaceOperation(0, 'a', kBlockSize, manifest, blobs);
+  AddReplaceOperation(1, 'b', kBlockSize - 10, manifest, blobs);
+  // Reads the block written by the first operation.
+  AddMoveOperation(0, 2, manifest);
+  // Overwrites the block read by the move.
+  AddReplaceOperation(0, 'c', kBlockSize, manifest, blobs);
+  AddReplaceOperation(3, 'd', kBlockSize, manifest, blobs);
+
+  expected->resize(4 * kBlockSize);
+  memset(&(*expected)[0], 'c', kBlockSize);
+  memset(&(*expected)[kBlockSize], 'b', kBlockSize - 10);
+  memset(&(*expected)[kBlockSize * 2 - 10], 0, 10);
+  memset(&(*expected)[kBlockSize * 2], 'a', kBlockSize);
+  memset(&(*expected)[kBlockSize * 3], 'd', kBlockSize);
+}
+}  // namespace {}
+
+TEST(DeltaPerformerTest, ConcurrentOperationsTest) {
+  DeltaArchiveManifest manifest;
+  vector<char> blobs;
+  vector<char> expected;
+  BuildDependentOperations(&manifest, &blobs, &expected);
+
+  const unsigned kMaxConcurrent[] = { 1, 2, 4 };
+  for (size_t i = 0; i < arraysize(kMaxConcurrent); i++) {
+    string path;
+    ASSERT_TRUE(utils::MakeTempFile("/tmp/DeltaPerformerTest-concurrent.XXXXXX",
+                                    &path,
+                                    NULL));
+    ScopedPathUnlinker path_unlinker(path);
+    EXPECT_TRUE(WriteFileVector(path, vector<char>(4 * kBlockSize, 'x')));
+    PrefsMock prefs;
+    ApplyTestPayload(manifest, blobs, "", path, kMaxConcurrent[i], 1000,
+                     &prefs);
+    vector<char> actual;
+    EXPECT_TRUE(utils::ReadFile(path, &actual));
+    ExpectVectorsEq(expected, actual);
+  }
+}
+
+TEST(DeltaPerformerTest, OperationStatsTest) {
+  DeltaArchiveManifest manifest;
+  vector<char> blobs;
+  vector<char> expected;
+  BuildDependentOperations(&manifest, &blobs, &expected);
+
+  // The stats are the same whether the operations are applied synchronously
+  // or on worker threads.
+  const unsigned kMaxConcurrent[] = { 1, 2 };
+  for (size_t i = 0; i < arraysize(kMaxConcurrent); i++) {
+    string path;
+    ASSERT_TRUE(utils::MakeTempFile("/tmp/DeltaPerformerTest-stats.XXXXXX",
+                                    &path,
+                                    NULL));
+    ScopedPathUnlinker path_unlinker(path);
+    EXPECT_TRUE(WriteFileVector(path, vector<char>(4 * kBlockSize, 'x')));
+    PrefsMock prefs;
+    DeltaPerformer::OperationStatsMap stats;
+    ApplyTestPayload(manifest, blobs, "", path, kMaxConcurrent[i], 1000,
+                     &prefs, &stats);
+    EXPECT_EQ(2, stats.size());
+    const DeltaPerformer::OperationTypeStats& replace =
+        stats[DeltaArchiveManifest_InstallOperation_Type_REPLACE];
+    EXPECT_EQ(4, replace.count);
+    EXPECT_EQ(4 * kBlockSize, replace.bytes_written);
+    EXPECT_GE(replace.time, base::TimeDelta());
+    const DeltaPerformer::OperationTypeStats& move =
+        stats[DeltaArchiveManifest_InstallOperation_Type_MOVE];
+    EXPECT_EQ(1, move.count);
+    EXPECT_EQ(kBlockSize, move.bytes_written);
+  }
+}
+
+TEST(DeltaPerformerTest, CheckpointTest) {
+  DeltaArchiveManifest manifest;
+  vector<char> blobs;
+  vector<char> expected;
+  BuildDependentOperations(&manifest, &blobs, &expected);
+  string path;
+  ASSERT_TRUE(utils::MakeTempFile("/tmp/DeltaPerformerTest-checkpoint.XXXXXX",
+                                  &path,
+                                  NULL));
+  ScopedPathUnlinker path_unlinker(path);
+  EXPECT_TRUE(WriteFileVector(path, vector<char>(4 * kBlockSize, 'x')));
+
+  PrefsMock prefs;
+  EXPECT_CALL(prefs, SetInt64(_, _)).WillRepeatedly(Return(true));
+  EXPECT_CALL(prefs, SetString(_, _)).WillRepeatedly(Return(true));
+  // The first checkpoint is taken right away, the next one before the move
+  // source is overwritten and the last one at the end.
+  EXPECT_CALL(prefs, SetInt64(kPrefsUpdateStateNextOperation, 1))
+      .WillOnce(Return(true));
+  EXPECT_CALL(prefs, SetInt64(kPrefsUpdateStateNextOperation, 2)).Times(0);
+  EXPECT_CALL(prefs, SetInt64(kPrefsUpdateStateNextOperation, 3))
+      .WillOnce(Return(true));
+  EXPECT_CALL(prefs, SetInt64(kPrefsUpdateStateNextOperation, 4)).Times(0);
+  EXPECT_CALL(prefs, SetInt64(kPrefsUpdateStateNextOperation, 5))
+      .WillOnce(Return(true));
+  ApplyTestPayload(manifest, blobs, "", path, 1, 1000, &prefs);
+  vector<char> actual;
+  EXPECT_TRUE(utils::ReadFile(path, &actual));
+  ExpectVectorsEq(expected, actual);
+}
+
+TEST(DeltaPerformerTest, FastForwardTest) {
+  DeltaArchiveManifest manifest;
+  manifest.set_block_size(kBlockSize);
+  vector<char> blobs;
+  AddReplaceOperation(0, 'a', kBlockSize, &manifest, &blobs);
+  AddReplaceOperation(1, 'b', kBlockSize, &manifest, &blobs);
+  AddMoveOperation(0, 2, &manifest);
+  vector<char> expected(3 * kBlockSize, 'a');
+  memset(&expected[kBlockSize], 'b', kBlockSize);
+  for (int i = 0; i < manifest.install_operations_size(); i++) {
+    const uint64_t block =
+        manifest.install_operations(i).dst_extents(0).start_block();
+    vector<char> hash;
+    ASSERT_TRUE(OmahaHashCalculator::RawHashOfBytes(
+        &expected[block * kBlockSize], kBlockSize, &hash));
+    manifest.mutable_install_operations(i)->set_dst_sha256_hash(&hash[0],
+                                                                hash.size());
+  }
+  vector<char> payload;
+  BuildTestPayload(manifest, blobs, &payload);
+
+  // An earlier attempt wrote the first and last blocks, whose operations are
+  // only skipped when the payload is known to be applied again.
+  const bool kIsReapply[] = { false, true };
+  for (size_t i = 0; i < arraysize(kIsReapply); i++) {
+    string path;
+    ASSERT_TRUE(utils::MakeTempFile("/tmp/DeltaPerformerTest-ff.XXXXXX",
+                                    &path,
+                                    NULL));
+    ScopedPathUnlinker path_unlinker(path);
+    vector<char> initial = expected;
+    memset(&initial[kBlockSize], 'x', kBlockSize);
+    EXPECT_TRUE(WriteFileVector(path, initial));
+
+    PrefsMock prefs;
+    InstallPlan install_plan;
+    install_plan.is_reapply = kIsReapply[i];
+    MockSystemState mock_system_state;
+    DeltaPerformer performer(&prefs, &mock_system_state, &install_plan);
+    EXPECT_EQ(0, performer.Open(path.c_str(), 0, 0));
+    EXPECT_TRUE(performer.OpenKernel("/dev/null"));
+    EXPECT_TRUE(performer.Write(&payload[0], payload.size()));
+    EXPECT_EQ(0, performer.Close());
+    vector<char> actual;
+    EXPECT_TRUE(utils::ReadFile(path, &actual));
+    ExpectVectorsEq(expected, actual);
+
+    DeltaPerformer::OperationStatsMap stats = performer.operation_stats();
+    EXPECT_EQ(kIsReapply[i] ? 1 : 2,
+              stats[DeltaArchiveManifest_InstallOperation_Type_REPLACE].count);
+    EXPECT_EQ(kIsReapply[i] ? 0 : 1,
+              stats[DeltaArchiveManifest_InstallOperation_Type_MOVE].count);
+  }
+}
+
+TEST(DeltaPerformerTest, PrefetchMetadataTest) {
+  DeltaArchiveManifest manifest;
+  vector<char> blobs;
+  vector<char> expected;
+  BuildDependentOperations(&manifest, &blobs, &expected);
+  vector<char> payload;
+  BuildTestPayload(manifest, blobs, &payload);
+  string path;
+  ASSERT_TRUE(utils::MakeTempFile("/tmp/DeltaPerformerTest-prefetch.XXXXXX",
+                                  &path,
+                                  NULL));
+  ScopedPathUnlinker path_unlinker(path);
+  EXPECT_TRUE(WriteFileVector(path, vector<char>(4 * kBlockSize, 'x')));
+
+  PrefsMock prefs;
+  InstallPlan install_plan;
+  MockSystemState mock_system_state;
+  DeltaPerformer performer(&prefs, &mock_system_state, &install_plan);
+  EXPECT_EQ(0, performer.Open(path.c_str(), 0, 0));
+  EXPECT_TRUE(performer.OpenKernel("/dev/null"));
+  EXPECT_EQ(DeltaPerformer::kMetadataParseInsufficientData,
+            performer.PrefetchMetadata(NULL, 0));
+  const size_t metadata_size = payload.size() - blobs.size();
+  EXPECT_EQ(DeltaPerformer::kMetadataParseInsufficientData,
+            performer.PrefetchMetadata(&payload[0], metadata_size - 1));
+  EXPECT_EQ(DeltaPerformer::kMetadataParseSuccess,
+            performer.PrefetchMetadata(&payload[0], metadata_size + 10));
+  EXPECT_EQ(metadata_size, performer.manifest_metadata_size_);
+  EXPECT_FALSE(performer.manifest_valid_);
+
+  // The payload is applied as if it hadn't been, with the metadata coming in
+  // a few bytes at a time.
+  const size_t kChunkSize = 10;
+  for (size_t i = 0; i < payload.size(); i += kChunkSize) {
+    EXPECT_TRUE(performer.Write(&payload[i],
+                                min(kChunkSize, payload.size() - i)));
+  }
+  EXPECT_EQ(0, performer.Close());
+  vector<char> actual;
+  EXPECT_TRUE(utils::ReadFile(path, &actual));
+  ExpectVectorsEq(expected, actual);
+}
+
+TEST(DeltaPerformerTest, RepairOperationTest) {
+  DeltaArchiveManifest manifest;
+  vector<char> blobs;
+  vector<char> expected;
+  BuildDependentOperations(&manifest, &blobs, &expected);
+  // The blob of the second operation is corrupted on the way.
+  DeltaArchiveManifest_InstallOperation* op =
+      manifest.mutable_install_operations(1);
+  vector<char> hash;
+  EXPECT_TRUE(OmahaHashCalculator::RawHashOfBytes(
+      &blobs[op->data_offset()], op->data_length(), &hash));
+  op->set_data_sha256_hash(&hash[0], hash.size());
+  vector<char> payload;
+  BuildTestPayload(manifest, blobs, &payload);
+  const uint64_t metadata_size = payload.size() - blobs.size();
+  vector<char> corrupted = payload;
+  corrupted[metadata_size + op->data_offset() + 10] ^= 1;
+
+  for (int repaired = 0; repaired < 2; repaired++) {
+    string path;
+    ASSERT_TRUE(utils::MakeTempFile("/tmp/DeltaPerformerTest-repair.XXXXXX",
+                                    &path,
+                                    NULL));
+    ScopedPathUnlinker path_unlinker(path);
+    EXPECT_TRUE(WriteFileVector(path, vector<char>(4 * kBlockSize, 'x')));
+    PrefsMock prefs;
+    InstallPlan install_plan;
+    MockSystemState mock_system_state;
+    DeltaPerformer performer(&prefs, &mock_system_state, &install_plan);
+    performer.set_repair_operations(true);
+    EXPECT_EQ(0, performer.Open(path.c_str(), 0, 0));
+    EXPECT_TRUE(performer.OpenKernel("/dev/null"));
+    uint64_t offset = 0;
+    uint64_t length = 0;
+    EXPECT_FALSE(performer.GetRepairRange(&offset, &length));
+
+    // The operations after the corrupted one wait for its blob.
+    EXPECT_TRUE(performer.Write(&corrupted[0], corrupted.size()));
+    ASSERT_TRUE(performer.GetRepairRange(&offset, &length));
+    EXPECT_EQ(metadata_size + op->data_offset(), offset);
+    EXPECT_EQ(op->data_length(), length);
+    ActionExitCode error = kActionCodeSuccess;
+    if (!repaired) {
+      EXPECT_FALSE(performer.RepairOperationData(NULL, 0, &error));
+      EXPECT_EQ(kActionCodeDownloadOperationHashMismatch, error);
+      EXPECT_FALSE(performer.GetRepairRange(&offset, &length));
+      performer.Close();
+      continue;
+    }
+    EXPECT_TRUE(performer.RepairOperationData(&payload[offset], length,
+                                              &error));
+    EXPECT_EQ(kActionCodeSuccess, error);
+    EXPECT_FALSE(performer.GetRepairRange(&offset, &length));
+    EXPECT_EQ(0, performer.Close());
+    vector<char> actual;
+    EXPECT_TRUE(utils::ReadFile(path, &actual));
+    ExpectVectorsEq(expected, actual);
+  }
+}
+
+TEST(DeltaPerformerTest, MoveOperationsTest) {
+  DeltaArchiveManifest manifest;
+  manifest.set_block_size(kBlockSize);
+  // Moves blocks 0, 1 and 5 to 3, 7 and 8, with pieces that end at different
+  // blocks in the source and the destination.
+  DeltaArchiveManifest_InstallOperation* op =
+      manifest.add_install_operations();
+  op->set_type(DeltaArchiveManifest_InstallOperation_Type_MOVE);
+  *(op->add_src_extents()) = ExtentForRange(0, 2);
+  *(op->add_src_extents()) = ExtentForRange(5, 1);
+  *(op->add_dst_extents()) = ExtentForRange(3, 1);
+  *(op->add_dst_extents()) = ExtentForRange(7, 2);
+  // Then moves blocks 7 and 8 one block up, which overwrites its own source.
+  op = manifest.add_install_operations();
+  op->set_type(DeltaArchiveManifest_InstallOperation_Type_MOVE);
+  *(op->add_src_extents()) = ExtentForRange(7, 2);
+  *(op->add_dst_extents()) = ExtentForRange(8, 2);
+
+  vector<char> data(10 * kBlockSize);
+  for (size_t i = 0; i < 10; i++)
+    memset(&data[i * kBlockSize], 'a' + i, kBlockSize);
+  vector<char> expected(data);
+  memset(&expected[3 * kBlockSize], 'a', kBlockSize);
+  memset(&expected[7 * kBlockSize], 'b', kBlockSize);
+  memset(&expected[8 * kBlockSize], 'b', kBlockSize);
+  memset(&expected[9 * kBlockSize], 'f', kBlockSize);
+
+  string path;
+  ASSERT_TRUE(utils::MakeTempFile("/tmp/DeltaPerformerTest-move.XXXXXX",
+                                  &path,
+                                  NULL));
+  ScopedPathUnlinker path_unlinker(path);
+  EXPECT_TRUE(WriteFileVector(path, data));
+  PrefsMock prefs;
+  ApplyTestPayload(manifest, vector<char>(), "", path, 1, 1000, &prefs);
+  vector<char> actual;
+  EXPECT_TRUE(utils::ReadFile(path, &actual));
+  ExpectVectorsEq(expected, actual);
+}
+
+TEST(DeltaPerformerTest, CompactManifestTest) {
+  DeltaArchiveManifest manifest;
+  vector<char> blobs;
+  vector<char> expected;
+  BuildDependentOperations(&manifest, &blobs, &expected);
+  DeltaArchiveManifest compact(manifest);
+  CompactManifest(&compact);
+
+  PrefsMock prefs;
+  InstallPlan install_plan;
+  MockSystemState mock_system_state;
+  DeltaPerformer performer(&prefs, &mock_system_state, &install_plan);
+
+  // The extents are only expanded in payloads of the compact version.
+  vector<char> payload;
+  BuildTestPayload(compact, blobs, &payload, kCompactManifestVersion);
+  DeltaArchiveManifest parsed;
+  uint64_t metadata_size = 0;
+  ActionExitCode error;
+  EXPECT_EQ(DeltaPerformer::kMetadataParseSuccess,
+            performer.ParsePayloadMetadata(payload, &parsed, &metadata_size,
+                                           &error));
+  EXPECT_EQ(manifest.SerializeAsString(), parsed.SerializeAsString());
+  BuildTestPayload(compact, blobs, &payload);
+  EXPECT_EQ(DeltaPerformer::kMetadataParseSuccess,
+            performer.ParsePayloadMetadata(payload, &parsed, &metadata_size,
+                                           &error));
+  EXPECT_EQ(0, parsed.install_operations(0).dst_extents_size());
+
+  // Malformed packed extents fail the parse.
+  compact.mutable_install_operations(0)->add_packed_dst_extents(1);
+  BuildTestPayload(compact, blobs, &payload, kCompactManifestVersion);
+  EXPECT_EQ(DeltaPerformer::kMetadataParseError,
+            performer.ParsePayloadMetadata(payload, &parsed, &metadata_size,
+                                           &error));
+  EXPECT_EQ(kActionCodeDownloadManifestParseError, error);
+}
+
+TEST(DeltaPerformerTest, ZeroOperationsTest) {
+  DeltaArchiveManifest manifest;
+  manifest.set_block_size(kBlockSize);
+  vector<char> blobs;
+  AddReplaceOperation(0, 'a', kBlockSize, &manifest, &blobs);
+  // Zeroes blocks 1, 2 and 4, and blocks 6 and 7 past the end of the file.
+  DeltaArchiveManifest_InstallOperation* op =
+      manifest.add_install_operations();
+  op->set_type(DeltaArchiveManifest_InstallOperation_Type_ZERO);
+  *(op->add_dst_extents()) = ExtentForRange(1, 2);
+  *(op->add_dst_extents()) = ExtentForRange(4, 1);
+  *(op->add_dst_extents()) = ExtentForRange(6, 2);
+  // Discards block 3, which zeroes it since the file isn't a block device.
+  op = manifest.add_install_operations();
+  op->set_type(DeltaArchiveManifest_InstallOperation_Type_DISCARD);
+  *(op->add_dst_extents()) = ExtentForRange(3, 1);
+  AddReplaceOperation(5, 'b', kBlockSize, &manifest, &blobs);
+
+  vector<char> expected(8 * kBlockSize, 0);
+  memset(&expected[0], 'a', kBlockSize);
+  memset(&expected[5 * kBlockSize], 'b', kBlockSize);
+
+  const unsigned kMaxConcurrent[] = { 1, 2 };
+  for (size_t i = 0; i < arraysize(kMaxConcurrent); i++) {
+    string path;
+    ASSERT_TRUE(utils::MakeTempFile("/tmp/DeltaPerformerTest-zero.XXXXXX",
+                                    &path,
+                                    NULL));
+    ScopedPathUnlinker path_unlinker(path);
+    EXPECT_TRUE(WriteFileVector(path, vector<char>(6 * kBlockSize, 'x')));
+    PrefsMock prefs;
+    ApplyTestPayload(manifest, blobs, "", path, kMaxConcurrent[i], 1000,
+                     &prefs);
+    vector<char> actual;
+    EXPECT_TRUE(utils::ReadFile(path, &actual));
+    ExpectVectorsEq(expected, actual);
+  }
+}
+
+TEST(DeltaPerformerTest, ApplyFromSourceTest) {
+  // Swaps blocks 0 and 1 and replaces block 2, which a payload patching in
+  // place couldn't do without temporary blocks.
+  DeltaArchiveManifest manifest;
+  vector<char> blobs;
+  manifest.set_block_size(kBlockSize);
+  manifest.set_apply_from_source(true);
+  AddMoveOperation(0, 1, &manifest);
+  AddMoveOperation(1, 0, &manifest);
+  AddReplaceOperation(2, 'c', kBlockSize, &manifest, &blobs);
+
+  string source_path;
+  ASSERT_TRUE(utils::MakeTempFile("/tmp/DeltaPerformerTest-source.XXXXXX",
+                                  &source_path,
+                                  NULL));
+  ScopedPathUnlinker source_path_unlinker(source_path);
+  vector<char> source(3 * kBlockSize, 'a');
+  memset(&source[kBlockSize], 'b', kBlockSize);
+  EXPECT_TRUE(WriteFileVector(source_path, source));
+  vector<char> expected(3 * kBlockSize, 'b');
+  memset(&expected[kBlockSize], 'a', kBlockSize);
+  memset(&expected[kBlockSize * 2], 'c', kBlockSize);
+
+  const unsigned kMaxConcurrent[] = { 1, 4 };
+  for (size_t i = 0; i < arraysize(kMaxConcurrent); i++) {
+    string path;
+    ASSERT_TRUE(utils::MakeTempFile("/tmp/DeltaPerformerTest-target.XXXXXX",
+                                    &path,
+                                    NULL));
+    ScopedPathUnlinker path_unlinker(path);
+    EXPECT_TRUE(WriteFileVector(path, vector<char>(3 * kBlockSize, 'x')));
+    PrefsMock prefs;
+    ApplyTestPayload(manifest, blobs, source_path, path, kMaxConcurrent[i],
+                     1000, &prefs);
+    vector<char> actual, actual_source;
+    EXPECT_TRUE(utils::ReadFile(path, &actual));
+    ExpectVectorsEq(expected, actual);
+    EXPECT_TRUE(utils::ReadFile(source_path, &actual_source));
+    ExpectVectorsEq(source, actual_source);
+  }
+}
+
+TEST(DeltaPerformerTest, ApplyAheadTest) {
+  // Blocks 0 and 1 are written by one operation each, which may be applied
+  // as soon as its data blob is in, and block 2 by two, which may not.
+  DeltaArchiveManifest manifest;
+  vector<char> blobs;
+  manifest.set_block_size(kBlockSize);
+  manifest.set_apply_from_source(true);
+  AddReplaceOperation(0, 'a', kBlockSize, &manifest, &blobs);
+  AddReplaceOperation(2, 'b', kBlockSize, &manifest, &blobs);
+  AddReplaceOperation(1, 'c', kBlockSize, &manifest, &blobs);
+  AddReplaceOperation(2, 'd', kBlockSize, &manifest, &blobs);
+  vector<char> payload;
+  BuildTestPayload(manifest, blobs, &payload);
+  const size_t metadata_size = payload.size() - blobs.size();
+  vector<char> expected(3 * kBlockSize, 'a');
+  memset(&expected[kBlockSize], 'c', kBlockSize);
+  memset(&expected[kBlockSize * 2], 'd', kBlockSize);
+
+  string path;
+  ASSERT_TRUE(utils::MakeTempFile("/tmp/DeltaPerformerTest-ahead.XXXXXX",
+                                  &path,
+                                  NULL));
+  ScopedPathUnlinker path_unlinker(path);
+  EXPECT_TRUE(WriteFileVector(path, vector<char>(3 * kBlockSize, 'x')));
+  PrefsMock prefs;
+  InstallPlan install_plan;
+  MockSystemState mock_system_state;
+  DeltaPerformer performer(&prefs, &mock_system_state, &install_plan);
+  performer.set_max_concurrent_operations(2);
+  performer.set_apply_ahead(true);
+  EXPECT_EQ(0, performer.Open(path.c_str(), 0, 0));
+  EXPECT_TRUE(performer.OpenKernel("/dev/null"));
+
+  // The first data blob is still coming in when the rest, split in two
+  // chunks, arrives out of order.
+  const size_t first_size = metadata_size + 10;
+  const size_t ahead_offset = metadata_size + kBlockSize;
+  const size_t ahead_split = ahead_offset + kBlockSize + 100;
+  EXPECT_TRUE(performer.Write(&payload[0], first_size));
+  performer.WriteAhead(ahead_split, &payload[ahead_split],
+                       payload.size() - ahead_split);
+  performer.WriteAhead(ahead_offset, &payload[ahead_offset],
+                       ahead_split - ahead_offset);
+  // Bytes Write() already has are left alone.
+  performer.WriteAhead(0, &payload[0], first_size);
+  EXPECT_TRUE(performer.Write(&payload[first_size],
+                              payload.size() - first_size));
+  EXPECT_EQ(0, performer.Close());
+  EXPECT_EQ(4, performer.operation_stats().find(
+      DeltaArchiveManifest_InstallOperation_Type_REPLACE)->second.count);
+
+  vector<char> actual;
+  EXPECT_TRUE(utils::ReadFile(path, &actual));
+  ExpectVectorsEq(expected, actual);
+}
+
+TEST(DeltaPerformerTest, MemoryBudgetTest) {
+  DeltaArchiveManifest manifest;
+  vector<char> blobs;
+  vector<char> expected;
+  BuildDependentOperations(&manifest, &blobs, &expected);
+  vector<char> payload;
+  BuildTestPayload(manifest, blobs, &payload);
+
+  // Every data blob is bigger than a quarter of the budget, so they're all
+  // spooled and the buffer never holds one whole, whether the operations
+  // are applied synchronously or on worker threads.
+  const unsigned kMaxConcurrent[] = { 1, 2 };
+  for (size_t i = 0; i < arraysize(kMaxConcurrent); i++) {
+    string path;
+    ASSERT_TRUE(utils::MakeTempFile("/tmp/DeltaPerformerTest-budget.XXXXXX",
+                                    &path,
+                                    NULL));
+    ScopedPathUnlinker path_unlinker(path);
+    EXPECT_TRUE(WriteFileVector(path, vector<char>(4 * kBlockSize, 'x')));
+    PrefsMock prefs;
+    InstallPlan install_plan;
+    MockSystemState mock_system_state;
+    DeltaPerformer performer(&prefs, &mock_system_state, &install_plan);
+    performer.set_max_concurrent_operations(kMaxConcurrent[i]);
+    performer.set_memory_budget(2 * kBlockSize, "/tmp");
+    performer.set_max_buffer_size(kBlockSize / 2);
+    EXPECT_EQ(0, performer.Open(path.c_str(), 0, 0));
+    EXPECT_TRUE(performer.OpenKernel("/dev/null"));
+    const size_t kChunkSize = 1000;
+    for (size_t j = 0; j < payload.size(); j += kChunkSize) {
+      EXPECT_TRUE(performer.Write(&payload[j],
+                                  min(kChunkSize, payload.size() - j)));
+    }
+    EXPECT_EQ(0, performer.Close());
+
+    vector<char> actual;
+    EXPECT_TRUE(utils::ReadFile(path, &actual));
+    ExpectVectorsEq(expected, actual);
+  }
+}
+
+TEST(DeltaPerformerTest, BlockCacheTest) {
+  DeltaArchiveManifest manifest;
+  vector<char> blobs;
+  vector<char> expected;
+  BuildDependentOperations(&manifest, &blobs, &expected);
+  // Moves the block the first move wrote back, and then on.
+  AddMoveOperation(2, 1, &manifest);
+  AddMoveOperation(1, 3, &manifest);
+  memset(&expected[kBlockSize], 'a', kBlockSize);
+  memset(&expected[kBlockSize * 3], 'a', kBlockSize);
+  vector<char> payloads[2];
+  BuildTestPayload(manifest, blobs, &payloads[0]);
+  // No move reads the source blocks of another, so with source reuse hints
+  // only the blocks written are kept.
+  DeltaDiffGenerator::AddSourceReuseHints(&manifest);
+  BuildTestPayload(manifest, blobs, &payloads[1]);
+
+  // The result is the same whether the cache keeps all the blocks read and
+  // written or has to evict some of them, and whatever the operations
+  // applied at the same time.
+  const uint64_t kCacheSizes[] = { kBlockSize, 16 * kBlockSize };
+  const unsigned kMaxConcurrent[] = { 1, 4 };
+  for (size_t i = 0; i < arraysize(payloads); i++) {
+    for (size_t j = 0; j < arraysize(kCacheSizes); j++) {
+      for (size_t k = 0; k < arraysize(kMaxConcurrent); k++) {
+        string path;
+        ASSERT_TRUE(utils::MakeTempFile(
+            "/tmp/DeltaPerformerTest-cache.XXXXXX", &path, NULL));
+        ScopedPathUnlinker path_unlinker(path);
+        EXPECT_TRUE(WriteFileVector(path, vector<char>(4 * kBlockSize, 'x')));
+        PrefsMock prefs;
+        InstallPlan install_plan;
+        MockSystemState mock_system_state;
+        DeltaPerformer performer(&prefs, &mock_system_state, &install_plan);
+        performer.set_block_cache_size(kCacheSizes[j]);
+        performer.set_max_concurrent_operations(kMaxConcurrent[k]);
+        EXPECT_EQ(0, performer.Open(path.c_str(), 0, 0));
+        EXPECT_TRUE(performer.OpenKernel("/dev/null"));
+        const vector<char>& payload = payloads[i];
+        const size_t kChunkSize = 1000;
+        for (size_t offset = 0; offset < payload.size();
+             offset += kChunkSize) {
+          EXPECT_TRUE(performer.Write(&payload[offset],
+                                      min(kChunkSize,
+                                          payload.size() - offset)));
+        }
+        EXPECT_EQ(0, performer.Close());
+
+        vector<char> actual;
+        EXPECT_TRUE(utils::ReadFile(path, &actual));
+        ExpectVectorsEq(expected, actual);
+      }
+    }
+  }
+}
+
+TEST(DeltaPerformerTest, CopySourceBeforePatchingInPlaceTest) {
+  // A payload for patching in place expects the target to start out as a
+  // copy of the source.
+  DeltaArchiveManifest manifest;
+  vector<char> blobs;
+  manifest.set_block_size(kBlockSize);
+  AddMoveOperation(0, 2, &manifest);
+
+  string source_path, path;
+  ASSERT_TRUE(utils::MakeTempFile("/tmp/DeltaPerformerTest-source.XXXXXX",
+                                  &source_path,
+                                  NULL));
+  ScopedPathUnlinker source_path_unlinker(source_path);
+  ASSERT_TRUE(utils::MakeTempFile("/tmp/DeltaPerformerTest-target.XXXXXX",
+                                  &path,
+                                  NULL));
+  ScopedPathUnlinker path_unlinker(path);
+  vector<char> source(3 * kBlockSize, 'a');
+  memset(&source[kBlockSize], 'b', kBlockSize);
+  EXPECT_TRUE(WriteFileVector(source_path, source));
+  EXPECT_TRUE(WriteFileVector(path, vector<char>(3 * kBlockSize, 'x')));
+  vector<char> expected(source);
+  memset(&expected[kBlockSize * 2], 'a', kBlockSize);
+
+  PrefsMock prefs;
+  ApplyTestPayload(manifest, blobs, source_path, path, 1, 1000, &prefs);
+  vector<char> actual;
+  EXPECT_TRUE(utils::ReadFile(path, &actual));
+  ExpectVectorsEq(expected, actual);
+}
+
+TEST(DeltaPerformerTest, OverwritesCheckpointReadsTest) {
+  PrefsMock prefs;
+  InstallPlan install_plan;
+  MockSystemState mock_system_state;
+  DeltaPerformer performer(&prefs, &mock_system_state, &install_plan);
+  performer.checkpoint_read_ranges_[0].AddExtent(ExtentForRange(10, 5));
+  performer.checkpoint_read_ranges_[0].AddExtent(ExtentForRange(30, 1));
+
+  DeltaArchiveManifest_InstallOperation op;
+  *(op.add_dst_extents()) = ExtentForRange(5, 5);
+  *(op.add_dst_extents()) = ExtentForRange(15, 15);
+  *(op.add_dst_extents()) = ExtentForRange(kSparseHole, 100);
+  EXPECT_FALSE(performer.OverwritesCheckpointReads(op, false));
+  *(op.add_dst_extents()) = ExtentForRange(30, 1);
+  EXPECT_TRUE(performer.OverwritesCheckpointReads(op, false));
+  // The kernel blocks are tracked separately.
+  EXPECT_FALSE(performer.OverwritesCheckpointReads(op, true));
+  op.clear_dst_extents();
+  *(op.add_dst_extents()) = ExtentForRange(14, 1);
+  EXPECT_TRUE(performer.OverwritesCheckpointReads(op, false));
+}
+
+TEST(DeltaPerformerTest, DestinationHashesCoverTest) {
+  PrefsMock prefs;
+  InstallPlan install_plan;
+  MockSystemState mock_system_state;
+  DeltaPerformer performer(&prefs, &mock_system_state, &install_plan);
+  performer.block_size_ = 4096;
+  performer.manifest_.mutable_new_rootfs_info()->set_size(3 * 4096 - 10);
+  const uint64_t kDstExtents[][2] = { { 2, 1 }, { 0, 2 }, { kSparseHole, 5 } };
+  for (size_t i = 0; i < arraysize(kDstExtents); i++) {
+    DeltaArchiveManifest_InstallOperation* op =
+        performer.manifest_.add_install_operations();
+    op->set_type(DeltaArchiveManifest_InstallOperation_Type_MOVE);
+    *(op->add_dst_extents()) =
+        ExtentForRange(kDstExtents[i][0], kDstExtents[i][1]);
+    if (kDstExtents[i][0] != kSparseHole)
+      op->set_dst_sha256_hash("hash");
+  }
+  EXPECT_TRUE(performer.DestinationHashesCover(false));
+  // There's no kernel info.
+  EXPECT_FALSE(performer.DestinationHashesCover(true));
+
+  // Discarded blocks aren't verified.
+  performer.manifest_.mutable_install_operations(0)->set_type(
+      DeltaArchiveManifest_InstallOperation_Type_DISCARD);
+  EXPECT_FALSE(performer.DestinationHashesCover(false));
+  performer.manifest_.mutable_install_operations(0)->set_type(
+      DeltaArchiveManifest_InstallOperation_Type_MOVE);
+
+  // Nor are the blocks written without a hash, or written twice.
+  performer.manifest_.mutable_install_operations(1)->clear_dst_sha256_hash();
+  EXPECT_FALSE(performer.DestinationHashesCover(false));
+  performer.manifest_.mutable_install_operations(1)->set_dst_sha256_hash(
+      "hash");
+  *(performer.manifest_.mutable_install_operations(1)->add_dst_extents()) =
+      ExtentForRange(2, 1);
+  EXPECT_FALSE(performer.DestinationHashesCover(false));
+  performer.manifest_.mutable_install_operations(1)->
+      mutable_dst_extents()->RemoveLast();
+
+  // All the blocks of the partition must be written.
+  performer.manifest_.mutable_new_rootfs_info()->set_size(3 * 4096 + 1);
+  EXPECT_FALSE(performer.DestinationHashesCover(false));
+}
+
+TEST(DeltaPerformerTest, NextPrefetchExtentsTest) {
+  PrefsMock prefs;
+  InstallPlan install_plan;
+  MockSystemState mock_system_state;
+  DeltaPerformer performer(&prefs, &mock_system_state, &install_plan);
+  performer.block_size_ = 4096;
+  // 40 rootfs operations that each read a block, the first one also
+  // reading a sparse hole, then a kernel operation that reads 16 MiB and
+  // another that reads a block.
+  for (int i = 0; i < 40; i++) {
+    DeltaArchiveManifest_InstallOperation* op =
+        performer.manifest_.add_install_operations();
+    op->set_type(DeltaArchiveManifest_InstallOperation_Type_MOVE);
+    if (i == 0)
+      *(op->add_src_extents()) = ExtentForRange(kSparseHole, 1);
+    *(op->add_src_extents()) = ExtentForRange(i + 100, 1);
+  }
+  DeltaArchiveManifest_InstallOperation* op =
+      performer.manifest_.add_kernel_install_operations();
+  op->set_type(DeltaArchiveManifest_InstallOperation_Type_MOVE);
+  *(op->add_src_extents()) = ExtentForRange(0, 4096);
+  op = performer.manifest_.add_kernel_install_operations();
+  op->set_type(DeltaArchiveManifest_InstallOperation_Type_MOVE);
+  *(op->add_src_extents()) = ExtentForRange(5000, 1);
+  performer.num_rootfs_operations_ = 40;
+  performer.num_total_operations_ = 42;
+  for (size_t i = 0; i < 42; i++)
+    performer.operation_order_.push_back(i);
+
+  // The window is 32 operations long.
+  vector<Extent> rootfs_extents;
+  vector<Extent> kernel_extents;
+  performer.NextPrefetchExtents(&rootfs_extents, &kernel_extents);
+  ASSERT_EQ(32, rootfs_extents.size());
+  for (size_t i = 0; i < rootfs_extents.size(); i++) {
+    EXPECT_EQ(i + 100, rootfs_extents[i].start_block());
+    EXPECT_EQ(1, rootfs_extents[i].num_blocks());
+  }
+  EXPECT_TRUE(kernel_extents.empty());
+
+  // Nothing is advised twice.
+  rootfs_extents.clear();
+  performer.next_operation_num_ = 1;
+  performer.NextPrefetchExtents(&rootfs_extents, &kernel_extents);
+  ASSERT_EQ(1, rootfs_extents.size());
+  EXPECT_EQ(132, rootfs_extents[0].start_block());
+  EXPECT_EQ(1, rootfs_extents[0].num_blocks());
+  EXPECT_TRUE(kernel_extents.empty());
+
+  // The window ends after the operation that brings it to 16 MiB.
+  rootfs_extents.clear();
+  performer.next_operation_num_ = 20;
+  performer.NextPrefetchExtents(&rootfs_extents, &kernel_extents);
+  ASSERT_EQ(7, rootfs_extents.size());
+  EXPECT_EQ(133, rootfs_extents[0].start_block());
+  EXPECT_EQ(1, rootfs_extents[0].num_blocks());
+  ASSERT_EQ(1, kernel_extents.size());
+  EXPECT_EQ(0, kernel_extents[0].start_block());
+  EXPECT_EQ(4096, kernel_extents[0].num_blocks());
+
+  // The operations prefetched already count towards the 16 MiB, so the last
+  // one is still out of the window.
+  rootfs_extents.clear();
+  kernel_extents.clear();
+  performer.next_operation_num_ = 39;
+  performer.NextPrefetchExtents(&rootfs_extents, &kernel_extents);
+  EXPECT_TRUE(rootfs_extents.empty());
+  EXPECT_TRUE(kernel_extents.empty());
+
+  performer.next_operation_num_ = 41;
+  performer.NextPrefetchExtents(&rootfs_extents, &kernel_extents);
+  EXPECT_TRUE(rootfs_extents.empty());
+  ASSERT_EQ(1, kernel_extents.size());
+  EXPECT_EQ(5000, kernel_extents[0].start_block());
+  EXPECT_EQ(1, kernel_extents[0].num_blocks());
+}
+
+TEST(DeltaPerformerTest, ReleaseAppliedOperationsTest) {
+  PrefsMock prefs;
+  InstallPlan install_plan;
+  MockSystemState mock_system_state;
+  DeltaPerformer performer(&prefs, &mock_system_state, &install_plan);
+  for (int i = 0; i < 3; i++) {
+    DeltaArchiveManifest_InstallOperation* op =
+        i < 2 ? performer.manifest_.add_install_operations() :
+        performer.manifest_.add_kernel_install_operations();
+    op->set_type(DeltaArchiveManifest_InstallOperation_Type_MOVE);
+    *(op->add_src_extents()) = ExtentForRange(i, 1);
+    *(op->add_dst_extents()) = ExtentForRange(i + 10, 1);
+  }
+  performer.num_rootfs_operations_ = 2;
+  performer.num_total_operations_ = 3;
+  // The kernel operation is applied first.
+  performer.operation_order_.push_back(2);
+  performer.operation_order_.push_back(0);
+  performer.operation_order_.push_back(1);
+
+  performer.next_operation_num_ = 2;
+  performer.ReleaseAppliedOperations();
+  EXPECT_EQ(0, performer.manifest_.kernel_install_operations(0)
+               .src_extents_size());
+  EXPECT_EQ(0, performer.manifest_.install_operations(0).dst_extents_size());
+  EXPECT_EQ(1, performer.manifest_.install_operations(1).src_extents_size());
+  EXPECT_EQ(1, performer.manifest_.install_operations(1).dst_extents_size());
+
+  performer.next_operation_num_ = 3;
+  performer.ReleaseAppliedOperations();
+  EXPECT_EQ(0, performer.manifest_.install_operations(1).dst_extents_size());
+  // The operations stay, so the indices don't change.
+  EXPECT_EQ(2, performer.manifest_.install_operations_size());
+}
+
 TEST(DeltaPerformerTest, WriteUpdatesPayloadState) {
   PrefsMock prefs;
   InstallPlan install_plan;
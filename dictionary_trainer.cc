@@ -0,0 +1,152 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/dictionary_trainer.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <queue>
+
+#include "update_engine/utils.h"
+
+using std::min;
+using std::priority_queue;
+using std::sort;
+using std::string;
+using std::unique;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The size of the runs of bytes counted.
+const size_t kGramSize = 8;
+// The size of the segments picked, and how far apart the candidates start.
+const size_t kSegmentSize = 256;
+const size_t kSegmentStep = kSegmentSize / 2;
+// The counts are kept in a table of 2^kTableBits entries indexed by a hash
+// of the runs. The few runs whose hashes collide share a count.
+const int kTableBits = 20;
+
+// A segment of a sample, with its score when it was last computed. Scores
+// only go down as segments are picked, so a candidate whose score is still
+// the highest once it's computed again is the best one.
+struct Candidate {
+  uint64_t score;
+  size_t sample;
+  size_t offset;
+
+  bool operator<(const Candidate& other) const {
+    return score < other.score;
+  }
+};
+
+size_t GramIndex(const char* data) {
+  uint64_t gram;
+  memcpy(&gram, data, sizeof(gram));
+  return (gram * 0x9e3779b97f4a7c15ULL) >> (64 - kTableBits);
+}
+
+// Sets |indexes| to the table indexes of the runs in the |size| bytes at
+// |data|, each once.
+void SegmentGrams(const char* data, size_t size, vector<size_t>* indexes) {
+  indexes->clear();
+  for (size_t i = 0; i + kGramSize <= size; i++)
+    indexes->push_back(GramIndex(data + i));
+  sort(indexes->begin(), indexes->end());
+  indexes->erase(unique(indexes->begin(), indexes->end()), indexes->end());
+}
+
+// Returns the number of samples each run of |indexes| appears in, added up
+// over the runs that appear in more than one sample.
+uint64_t SegmentScore(const vector<size_t>& indexes,
+                      const vector<uint32_t>& counts) {
+  uint64_t score = 0;
+  for (size_t i = 0; i < indexes.size(); i++) {
+    if (counts[indexes[i]] > 1)
+      score += counts[indexes[i]];
+  }
+  return score;
+}
+
+}  // namespace {}
+
+bool TrainDictionary(const vector<string>& samples,
+                     size_t max_size,
+                     string* dictionary) {
+  TEST_AND_RETURN_FALSE(dictionary);
+  dictionary->clear();
+
+  // Counts the samples each run appears in.
+  vector<uint32_t> counts(1 << kTableBits, 0);
+  {
+    // The last sample, plus one, each run was counted for.
+    vector<uint32_t> counted_for(1 << kTableBits, 0);
+    for (size_t i = 0; i < samples.size(); i++) {
+      const string& sample = samples[i];
+      for (size_t j = 0; j + kGramSize <= sample.size(); j++) {
+        const size_t index = GramIndex(sample.data() + j);
+        if (counted_for[index] != i + 1) {
+          counted_for[index] = i + 1;
+          counts[index]++;
+        }
+      }
+    }
+  }
+
+  priority_queue<Candidate> candidates;
+  vector<size_t> indexes;
+  for (size_t i = 0; i < samples.size(); i++) {
+    const string& sample = samples[i];
+    for (size_t offset = 0; offset + kGramSize <= sample.size();
+         offset += kSegmentStep) {
+      const size_t size = min(kSegmentSize, sample.size() - offset);
+      SegmentGrams(sample.data() + offset, size, &indexes);
+      Candidate candidate;
+      candidate.score = SegmentScore(indexes, counts);
+      candidate.sample = i;
+      candidate.offset = offset;
+      if (candidate.score > 0)
+        candidates.push(candidate);
+      if (offset + kSegmentSize >= sample.size())
+        break;
+    }
+  }
+
+  // Picks the best segment until the dictionary is full. The runs of a
+  // segment picked count no more, so that the next segments cover others.
+  vector<string> segments;
+  size_t size = 0;
+  while (!candidates.empty() && size < max_size) {
+    Candidate candidate = candidates.top();
+    candidates.pop();
+    const string& sample = samples[candidate.sample];
+    const size_t segment_size =
+        min(kSegmentSize, sample.size() - candidate.offset);
+    SegmentGrams(sample.data() + candidate.offset, segment_size, &indexes);
+    const uint64_t score = SegmentScore(indexes, counts);
+    if (score == 0)
+      continue;
+    if (!candidates.empty() && score < candidates.top().score) {
+      candidate.score = score;
+      candidates.push(candidate);
+      continue;
+    }
+    segments.push_back(sample.substr(candidate.offset,
+                                     min(segment_size, max_size - size)));
+    size += segments.back().size();
+    for (size_t i = 0; i < indexes.size(); i++)
+      counts[indexes[i]] = 0;
+  }
+
+  dictionary->reserve(size);
+  for (vector<string>::reverse_iterator it = segments.rbegin();
+       it != segments.rend(); ++it)
+    dictionary->append(*it);
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,30 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_DICTIONARY_TRAINER_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_DICTIONARY_TRAINER_H__
+
+#include <string>
+#include <vector>
+
+// Builds the preset dictionary small, similar pieces of data, e.g., the
+// config and text files of an image, are compressed with, so that each of
+// them can refer to what they have in common instead of spelling it out
+// again. Like zstd's COVER trainer, it counts how many of the samples each
+// run of a few bytes appears in, and picks the segments of the samples that
+// cover the most common runs not covered yet, until the dictionary is full.
+
+namespace chromeos_update_engine {
+
+// Sets |dictionary| to at most |max_size| bytes for compressing data like
+// |samples|. The most useful segments end up last, closest to the data the
+// dictionary precedes. The dictionary is empty if the samples have nothing
+// in common. Returns false on error.
+bool TrainDictionary(const std::vector<std::string>& samples,
+                     size_t max_size,
+                     std::string* dictionary);
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_DICTIONARY_TRAINER_H__
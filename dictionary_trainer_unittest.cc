@@ -0,0 +1,63 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <string>
+#include <vector>
+
+#include <base/stringprintf.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/dictionary_trainer.h"
+#include "update_engine/xz.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class DictionaryTrainerTest : public ::testing::Test {};
+
+TEST(DictionaryTrainerTest, SimpleTest) {
+  vector<string> samples;
+  for (int i = 0; i < 200; i++) {
+    samples.push_back(StringPrintf("# Generated config %d\n"
+                                   "[Service]\n"
+                                   "Enabled=true\n"
+                                   "TimeoutSeconds=%d\n"
+                                   "LogLevel=warning\n"
+                                   "Path=/usr/share/service/%d\n",
+                                   i, i * 7, i));
+  }
+  string dictionary;
+  EXPECT_TRUE(TrainDictionary(samples, 4096, &dictionary));
+  EXPECT_FALSE(dictionary.empty());
+  EXPECT_GE(4096, dictionary.size());
+  EXPECT_NE(string::npos, dictionary.find("LogLevel=warning\n"));
+
+  // The samples compress to a fraction of their size without it.
+  size_t with_dictionary = 0, without_dictionary = 0;
+  for (size_t i = 0; i < samples.size(); i++) {
+    vector<char> compressed;
+    EXPECT_TRUE(XzCompressWithDictionary(samples[i].data(),
+                                         samples[i].size(),
+                                         dictionary,
+                                         &compressed));
+    with_dictionary += compressed.size();
+    EXPECT_TRUE(XzCompressString(samples[i], &compressed));
+    without_dictionary += compressed.size();
+  }
+  EXPECT_LT(2 * with_dictionary, without_dictionary);
+}
+
+TEST(DictionaryTrainerTest, NothingInCommonTest) {
+  vector<string> samples;
+  samples.push_back("unique");
+  samples.push_back("0123456789abcdef");
+  samples.push_back("ghijklmnopqrstuv");
+  string dictionary = "stale";
+  EXPECT_TRUE(TrainDictionary(samples, 1024, &dictionary));
+  EXPECT_TRUE(dictionary.empty());
+}
+
+}  // namespace chromeos_update_engine
@@ -10,6 +10,7 @@
 #include <glib.h>
 #include "update_engine/action_pipe.h"
 #include "update_engine/subprocess.h"
+#include "update_engine/terminator.h"
 
 using std::min;
 using std::string;
@@ -20,6 +21,10 @@ namespace chromeos_update_engine {
 // Use a buffer to reduce the number of IOPS on SSD devices.
 const size_t kFileWriterBufferSize = 128 * 1024;  // 128 KiB
 
+// Hashing the source rootfs takes a few seconds, in which a fast connection
+// brings in tens of megabytes.
+const size_t DownloadAction::kMaxSpoolSize = 64 * 1024 * 1024;  // 64 MiB
+
 DownloadAction::DownloadAction(PrefsInterface* prefs,
                                SystemState* system_state,
                                HttpFetcher* http_fetcher)
@@ -29,7 +34,23 @@ DownloadAction::DownloadAction(PrefsInterface* prefs,
       writer_(NULL),
       code_(kActionCodeSuccess),
       delegate_(NULL),
-      bytes_received_(0) {}
+      bytes_received_(0),
+      waiting_for_input_(false),
+      spool_full_(false),
+      prefetching_metadata_(false),
+      suspended_(false),
+      fetcher_paused_(false),
+      transfer_complete_pending_(false),
+      transfer_successful_(false),
+      peer_cache_(NULL),
+      peer_cache_started_(false),
+      spool_only_(false),
+      apply_ahead_operations_(0),
+      memory_budget_(0),
+      apply_on_thread_(false),
+      lent_buffer_(NULL),
+      repair_delegate_(this),
+      repairing_(false) {}
 
 DownloadAction::~DownloadAction() {}
 
@@ -38,11 +59,45 @@ void DownloadAction::PerformAction() {
 
   // Get the InstallPlan and read it
   CHECK(HasInputObject());
-  install_plan_ = GetInputObject();
+  // An incomplete plan is read again, as a whole, in
+  // ConcurrentActionsCompleted().
+  SwapInputObject(&install_plan_);
   bytes_received_ = 0;
+  // The source partitions aren't read until the manifest has been received,
+  // so the download can start while they're being hashed. A payload that's
+  // only spooled doesn't need them.
+  waiting_for_input_ =
+      !spool_only_ && processor_->IsRunningConcurrentActions();
+  spool_.clear();
+  spool_full_ = false;
+  prefetching_metadata_ = false;
+  suspended_ = false;
+  fetcher_paused_ = false;
+  transfer_complete_pending_ = false;
+  peer_cache_started_ = false;
+  repairing_ = false;
+  apply_queue_.reset();
+  if (waiting_for_input_)
+    LOG(INFO) << "Spooling the payload until the install plan is complete.";
 
   install_plan_.Dump();
 
+  if (spool_only_) {
+    CHECK(peer_cache_);
+    if (peer_cache_->HasPayload(install_plan_.payload_hash)) {
+      LOG(INFO) << "The payload is in the peer cache already.";
+      if (HasOutputPipe())
+        SetOutputObject(install_plan_);
+      processor_->ActionComplete(this, kActionCodeSuccess);
+      return;
+    }
+    LOG(INFO) << "Only downloading the payload to the peer cache.";
+    if (delegate_)
+      delegate_->SetDownloadStatus(true);  // Set to active.
+    http_fetcher_->BeginTransfer(install_plan_.download_url);
+    return;
+  }
+
   if (writer_) {
     LOG(INFO) << "Using writer for test.";
   } else {
@@ -50,6 +105,26 @@ void DownloadAction::PerformAction() {
                                               system_state_,
                                               &install_plan_));
     writer_ = delta_performer_.get();
+    if (apply_ahead_operations_ > 1) {
+      delta_performer_->set_max_concurrent_operations(apply_ahead_operations_);
+      delta_performer_->set_apply_ahead(true);
+    }
+    if (memory_budget_ > 0)
+      delta_performer_->set_memory_budget(memory_budget_, spool_dir_);
+    delta_performer_->set_duration_rates(duration_rates_);
+    delta_performer_->set_checkpoint_on_exit(true);
+    if (repair_fetcher_.get()) {
+      delta_performer_->set_repair_operations(true);
+      repair_fetcher_->set_delegate(&repair_delegate_);
+    }
+    if (apply_on_thread_) {
+      // The payload state is reported to as the bytes are received.
+      delta_performer_->set_report_download_progress(false);
+      apply_queue_.reset(new QueuedFileWriter(delta_performer_.get(), this));
+      writer_ = apply_queue_.get();
+    }
+    payload_writer_.reset(new AccountingFileWriter(writer_, "payload"));
+    writer_ = payload_writer_.get();
   }
   int rc = writer_->Open(install_plan_.install_path.c_str(),
                          O_TRUNC | O_WRONLY | O_CREAT | O_LARGEFILE,
@@ -60,6 +135,19 @@ void DownloadAction::PerformAction() {
     processor_->ActionComplete(this, kActionCodeInstallDeviceOpenError);
     return;
   }
+  if (waiting_for_input_ && delta_performer_.get()) {
+    // The metadata kept from an interrupted attempt is parsed right away.
+    prefetching_metadata_ = delta_performer_->PrefetchMetadata(NULL, 0) ==
+        DeltaPerformer::kMetadataParseInsufficientData;
+  }
+  if (apply_queue_.get()) {
+    // Replaces the performer's exit callback, which mustn't run while the
+    // performer applies the payload on the other thread. Cleared again when
+    // the performer is closed.
+    exit_callback_.reset(
+        NewPermanentCallback(this, &DownloadAction::StopApplyingAndExit));
+    Terminator::set_exit_callback(exit_callback_.get());
+  }
 
   if (delegate_) {
     delegate_->SetDownloadStatus(true);  // Set to active.
@@ -68,6 +156,20 @@ void DownloadAction::PerformAction() {
 }
 
 void DownloadAction::TerminateProcessing() {
+  CloseWriter();
+  // What's been copied is kept for the download to resume.
+  if (peer_cache_)
+    peer_cache_->EndPayload(false);
+  if (repairing_) {
+    repairing_ = false;
+    repair_fetcher_->TerminateTransfer();
+  }
+  // Terminates the transfer. The action is terminated, if necessary, when the
+  // TransferTerminated callback is received.
+  http_fetcher_->TerminateTransfer();
+}
+
+void DownloadAction::CloseWriter() {
   if (writer_) {
     LOG_IF(WARNING, writer_->Close() != 0) << "Error closing the writer.";
     writer_ = NULL;
@@ -75,9 +177,61 @@ void DownloadAction::TerminateProcessing() {
   if (delegate_) {
     delegate_->SetDownloadStatus(false);  // Set to inactive.
   }
-  // Terminates the transfer. The action is terminated, if necessary, when the
-  // TransferTerminated callback is received.
-  http_fetcher_->TerminateTransfer();
+}
+
+void DownloadAction::ConcurrentActionsCompleted() {
+  if (!waiting_for_input_)
+    return;
+  waiting_for_input_ = false;
+  prefetching_metadata_ = false;
+  // Picks up the source partitions and their hashes. The rest of the plan is
+  // already in use.
+  const InstallPlan& plan = GetInputObject();
+  install_plan_.source_path = plan.source_path;
+  install_plan_.kernel_source_path = plan.kernel_source_path;
+  install_plan_.rootfs_hash = plan.rootfs_hash;
+  install_plan_.kernel_hash = plan.kernel_hash;
+  LOG(INFO) << "Applying the " << spool_.size() << " spooled payload bytes.";
+
+  vector<char> spool;
+  spool.swap(spool_);
+  if (writer_ && !spool.empty() &&
+      !writer_->Write(&spool[0], spool.size(), &code_)) {
+    LOG(ERROR) << "Error " << code_ << " in DeltaPerformer's Write method when "
+               << "processing the spooled payload -- Terminating processing";
+    WriterFailed();
+    return;
+  }
+  spool_full_ = false;
+  ContinueApplying();
+}
+
+void DownloadAction::SuspendAction() {
+  suspended_ = true;
+  UpdatePause();
+}
+
+void DownloadAction::ResumeAction() {
+  suspended_ = false;
+  UpdatePause();
+}
+
+void DownloadAction::UpdatePause() {
+  // A transfer that's complete or being terminated has nothing left to
+  // pause.
+  if (code_ != kActionCodeSuccess)
+    return;
+  const bool queue_full = apply_queue_.get() && apply_queue_->full();
+  const bool pause = (spool_full_ || queue_full || repairing_ || suspended_) &&
+      !transfer_complete_pending_;
+  if (pause == fetcher_paused_)
+    return;
+  fetcher_paused_ = pause;
+  if (pause) {
+    http_fetcher_->Pause();
+  } else {
+    http_fetcher_->Unpause();
+  }
 }
 
 void DownloadAction::SeekToOffset(off_t offset) {
@@ -87,10 +241,85 @@ void DownloadAction::SeekToOffset(off_t offset) {
 void DownloadAction::ReceivedBytes(HttpFetcher *fetcher,
                                    const char* bytes,
                                    int length) {
+  WriteReceivedBytes(bytes, length);
+}
+
+char* DownloadAction::GetReceiveBuffer(HttpFetcher* fetcher, size_t length) {
+  char* buffer = writer_ && !waiting_for_input_ ?
+      writer_->GetWriteBuffer(length) : NULL;
+  lent_buffer_ = buffer;
+  return buffer;
+}
+
+void DownloadAction::ReceivedBytesInBuffer(HttpFetcher* fetcher, int length) {
+  WriteReceivedBytes(NULL, length);
+}
+
+void DownloadAction::ReceivedBytesAhead(HttpFetcher* fetcher,
+                                        off_t offset,
+                                        const char* bytes,
+                                        int length) {
+  // The spooled bytes are written once the install plan is complete, and
+  // these are passed to Write() again anyway. The performer may only be
+  // used here while the apply queue is idle.
+  if (writer_ && delta_performer_.get() && !waiting_for_input_ &&
+      (!apply_queue_.get() || apply_queue_->idle()))
+    delta_performer_->WriteAhead(offset, bytes, length);
+}
+
+void DownloadAction::CopyToPeerCache(off_t offset,
+                                     const char* bytes,
+                                     int length) {
+  if (!peer_cache_started_) {
+    peer_cache_started_ = true;
+    peer_cache_->BeginPayload(install_plan_.payload_hash, offset);
+  }
+  peer_cache_->WritePayload(offset, bytes, length);
+}
+
+void DownloadAction::WriteReceivedBytes(const char* bytes, int length) {
+  if (peer_cache_ && (writer_ || spool_only_))
+    CopyToPeerCache(bytes_received_, bytes ? bytes : lent_buffer_, length);
   bytes_received_ += length;
   if (delegate_)
     delegate_->BytesReceived(bytes_received_, install_plan_.payload_size);
-  if (writer_ && !writer_->Write(bytes, length, &code_)) {
+  if (spool_only_) {
+    // Nothing is gained by downloading what isn't copied.
+    if (!peer_cache_->copying() && code_ == kActionCodeSuccess) {
+      LOG(ERROR) << "Unable to copy the payload to the peer cache -- "
+                 << "Terminating processing";
+      code_ = kActionCodeDownloadWriteError;
+      TerminateProcessing();
+    }
+    return;
+  }
+  if (!writer_)
+    return;
+  if (apply_queue_.get() && system_state_)
+    system_state_->payload_state()->DownloadProgress(length);
+  if (waiting_for_input_) {
+    // GetReceiveBuffer() hands out no buffers while spooling.
+    CHECK(bytes);
+    spool_.insert(spool_.end(), bytes, bytes + length);
+    // Nothing's been written to the performer yet, even if it applies the
+    // payload on a thread of its own.
+    if (prefetching_metadata_) {
+      prefetching_metadata_ =
+          delta_performer_->PrefetchMetadata(&spool_[0], spool_.size()) ==
+          DeltaPerformer::kMetadataParseInsufficientData;
+    }
+    const uint64_t max_spool_size = memory_budget_ > 0 ?
+        min<uint64_t>(kMaxSpoolSize, memory_budget_ / 2) : kMaxSpoolSize;
+    if (!spool_full_ && spool_.size() >= max_spool_size) {
+      LOG(INFO) << "Pausing the download until the install plan is complete.";
+      spool_full_ = true;
+      UpdatePause();
+    }
+    return;
+  }
+  bool success = bytes ? writer_->Write(bytes, length, &code_) :
+      writer_->CommitWriteBuffer(length, &code_);
+  if (!success) {
     LOG(ERROR) << "Error " << code_ << " in DeltaPerformer's Write method when "
                << "processing the received payload -- Terminating processing";
     // Don't tell the action processor that the action is complete until we get
@@ -99,16 +328,109 @@ void DownloadAction::ReceivedBytes(HttpFetcher *fetcher,
     TerminateProcessing();
     return;
   }
+  ContinueApplying();
+}
+
+void DownloadAction::QueuedWriterUpdated(QueuedFileWriter* writer) {
+  // Nothing is left to do once the processing is being terminated.
+  if (!writer_ || code_ != kActionCodeSuccess)
+    return;
+  if (writer->failed(&code_)) {
+    LOG(ERROR) << "Error " << code_ << " in DeltaPerformer's Write method when "
+               << "applying the queued payload -- Terminating processing";
+    WriterFailed();
+    return;
+  }
+  ContinueApplying();
+}
+
+void DownloadAction::ContinueApplying() {
+  if (apply_queue_.get() && !apply_queue_->idle()) {
+    UpdatePause();
+    return;
+  }
+  StartRepair();
+  if (repairing_)
+    return;
+  if (transfer_complete_pending_ && !waiting_for_input_) {
+    transfer_complete_pending_ = false;
+    TransferComplete(http_fetcher_.get(), transfer_successful_);
+    return;
+  }
+  UpdatePause();
+}
+
+void DownloadAction::WriterFailed() {
+  if (transfer_complete_pending_) {
+    // There's no transfer left to terminate.
+    CloseWriter();
+    processor_->ActionComplete(this, code_);
+  } else {
+    TerminateProcessing();
+  }
+}
+
+void DownloadAction::StopApplyingAndExit() {
+  // The data left in the queue is downloaded again on resume.
+  apply_queue_->Stop();
+  delta_performer_->CheckpointAndExit();
+}
+
+void DownloadAction::StartRepair() {
+  uint64_t offset = 0;
+  uint64_t length = 0;
+  if (repairing_ || !writer_ || !delta_performer_.get() ||
+      !delta_performer_->GetRepairRange(&offset, &length))
+    return;
+  const string& url = install_plan_.repair_url.empty() ?
+      install_plan_.download_url : install_plan_.repair_url;
+  LOG(INFO) << "Fetching the " << length << " bytes at " << offset
+            << " of the payload again from " << url;
+  repairing_ = true;
+  UpdatePause();
+  repair_delegate_.data()->clear();
+  repair_fetcher_->ClearRanges();
+  repair_fetcher_->AddRange(offset, length);
+  repair_fetcher_->BeginTransfer(url);
+}
+
+void DownloadAction::RepairComplete(bool successful) {
+  repairing_ = false;
+  vector<char> data;
+  data.swap(*repair_delegate_.data());
+  // The performer only holds on to the data received meanwhile, if any.
+  if (apply_queue_.get())
+    apply_queue_->WaitIdle();
+  if (!delta_performer_->RepairOperationData(
+          successful && !data.empty() ? &data[0] : NULL, data.size(),
+          &code_)) {
+    LOG(ERROR) << "Error " << code_ << " in DeltaPerformer's "
+               << "RepairOperationData method -- Terminating processing";
+    WriterFailed();
+    return;
+  }
+  // The operations after the repaired one may wait for their blob too.
+  ContinueApplying();
 }
 
 void DownloadAction::TransferComplete(HttpFetcher *fetcher, bool successful) {
-  if (writer_) {
-    LOG_IF(WARNING, writer_->Close() != 0) << "Error closing the writer.";
-    writer_ = NULL;
+  if (successful && (waiting_for_input_ || repairing_ ||
+                     (apply_queue_.get() && !apply_queue_->idle()))) {
+    // The spooled payload is applied and verified once the plan is complete,
+    // the rest of the payload once the data blob fetched again is, and the
+    // queued one once it's applied.
+    transfer_complete_pending_ = true;
+    transfer_successful_ = successful;
+    return;
   }
-  if (delegate_) {
-    delegate_->SetDownloadStatus(false);  // Set to inactive.
+  if (successful && apply_queue_.get() && apply_queue_->failed(&code_)) {
+    LOG(ERROR) << "Error " << code_ << " in DeltaPerformer's Write method when "
+               << "applying the queued payload -- Terminating processing";
+    CloseWriter();
+    processor_->ActionComplete(this, code_);
+    return;
   }
+  CloseWriter();
   ActionExitCode code =
       successful ? kActionCodeSuccess : kActionCodeDownloadTransferError;
   if (code == kActionCodeSuccess && delta_performer_.get()) {
@@ -124,12 +446,33 @@ void DownloadAction::TransferComplete(HttpFetcher *fetcher, bool successful) {
         &install_plan_.rootfs_hash)) {
       LOG(ERROR) << "Unable to get new partition hash info.";
       code = kActionCodeDownloadNewPartitionInfoError;
+    } else {
+      delta_performer_->GetNewPartitionChunkHashes(
+          &install_plan_.kernel_hash_chunk_size,
+          &install_plan_.kernel_chunk_hashes,
+          &install_plan_.rootfs_hash_chunk_size,
+          &install_plan_.rootfs_chunk_hashes);
+      delta_performer_->GetVerifiedPartitions(&install_plan_.kernel_verified,
+                                              &install_plan_.rootfs_verified);
+    }
+  }
+
+  if (peer_cache_) {
+    // A payload that fails verification isn't kept, while one whose
+    // transfer failed may still be resumed.
+    if (code == kActionCodeSuccess && peer_cache_->copying()) {
+      if (!peer_cache_->CommitPayload() && spool_only_)
+        code = kActionCodePayloadHashMismatchError;
+    } else {
+      if (code == kActionCodeSuccess && spool_only_)
+        code = kActionCodeDownloadWriteError;
+      peer_cache_->EndPayload(successful);
     }
   }
 
   // Write the path to the output pipe if we're successful.
   if (code == kActionCodeSuccess && HasOutputPipe())
-    SetOutputObject(install_plan_);
+    SwapOutputObject(&install_plan_);
   processor_->ActionComplete(this, code);
 }
 
@@ -10,6 +10,7 @@
 #include <fcntl.h>
 
 #include <string>
+#include <vector>
 
 #include <base/memory/scoped_ptr.h>
 #include <curl/curl.h>
@@ -17,13 +18,21 @@
 
 #include "update_engine/action.h"
 #include "update_engine/delta_performer.h"
+#include "update_engine/file_writer.h"
 #include "update_engine/http_fetcher.h"
 #include "update_engine/install_plan.h"
+#include "update_engine/multi_range_http_fetcher.h"
+#include "update_engine/peer_cache.h"
+#include "update_engine/queued_file_writer.h"
 #include "update_engine/system_state.h"
 
 // The Download Action downloads a specified url to disk. The url should point
 // to an update in a delta payload format. The payload will be piped into a
-// DeltaPerformer that will apply the delta to the disk.
+// DeltaPerformer that will apply the delta to the disk. If the action that
+// passes it the install plan, e.g., the FilesystemCopierAction hashing the
+// source partitions, runs concurrently with it, the payload is held back in
+// a bounded spool until that action completes. The payload may be applied
+// on a thread of its own, see set_apply_on_thread().
 
 namespace chromeos_update_engine {
 
@@ -54,7 +63,8 @@ class ActionTraits<DownloadAction> {
 };
 
 class DownloadAction : public Action<DownloadAction>,
-                       public HttpFetcherDelegate {
+                       public HttpFetcherDelegate,
+                       public QueuedFileWriterDelegate {
  public:
   // Takes ownership of the passed in HttpFetcher. Useful for testing.
   // A good calling pattern is:
@@ -67,6 +77,16 @@ class DownloadAction : public Action<DownloadAction>,
   typedef ActionTraits<DownloadAction>::OutputObjectType OutputObjectType;
   void PerformAction();
   void TerminateProcessing();
+  void ConcurrentActionsCompleted();
+
+  // Pauses the transfer, which also holds off applying the payload once the
+  // operations whose data was received are applied.
+  void SuspendAction();
+  void ResumeAction();
+
+  // The most payload bytes held back while the concurrent actions run. The
+  // download is paused once the spool holds this many.
+  static const size_t kMaxSpoolSize;
 
   // Testing
   void SetTestFileWriter(FileWriter* writer) {
@@ -82,10 +102,19 @@ class DownloadAction : public Action<DownloadAction>,
   // HttpFetcherDelegate methods (see http_fetcher.h)
   virtual void ReceivedBytes(HttpFetcher *fetcher,
                              const char* bytes, int length);
+  virtual char* GetReceiveBuffer(HttpFetcher* fetcher, size_t length);
+  virtual void ReceivedBytesInBuffer(HttpFetcher* fetcher, int length);
   virtual void SeekToOffset(off_t offset);
+  virtual void ReceivedBytesAhead(HttpFetcher* fetcher,
+                                  off_t offset,
+                                  const char* bytes,
+                                  int length);
   virtual void TransferComplete(HttpFetcher *fetcher, bool successful);
   virtual void TransferTerminated(HttpFetcher *fetcher);
 
+  // QueuedFileWriterDelegate method (see queued_file_writer.h)
+  virtual void QueuedWriterUpdated(QueuedFileWriter* writer);
+
   DownloadActionDelegate* delegate() const { return delegate_; }
   void set_delegate(DownloadActionDelegate* delegate) {
     delegate_ = delegate;
@@ -93,7 +122,141 @@ class DownloadAction : public Action<DownloadAction>,
 
   HttpFetcher* http_fetcher() { return http_fetcher_.get(); }
 
+  // Takes ownership of |http_fetcher|, which replaces the one the action was
+  // created with, e.g., to apply a payload that's on disk already. Must be
+  // called before the action starts.
+  void set_http_fetcher(HttpFetcher* http_fetcher) {
+    http_fetcher_.reset(http_fetcher);
+  }
+
+  // Takes ownership of |repair_fetcher|, which the data blobs that fail
+  // their hash check are fetched again with, from the install plan's repair
+  // URL, rather than the update failing or starting over. The transfer is
+  // paused meanwhile. See DeltaPerformer::set_repair_operations(). Must be
+  // called before the action starts.
+  void set_repair_fetcher(MultiRangeHttpFetcher* repair_fetcher) {
+    repair_fetcher_.reset(repair_fetcher);
+  }
+
+  // Makes the action copy the payload to |peer_cache| as it's downloaded,
+  // to be served to the other machines of the network once it's verified.
+  // Not owned.
+  void set_peer_cache(PeerCache* peer_cache) { peer_cache_ = peer_cache; }
+
+  // Makes the action only download the payload to the peer cache, without
+  // applying it, for a later action to apply it from there. The action
+  // fails unless the payload ends up in the cache, where it may be already.
+  // Must be called before the action starts.
+  void set_spool_only(bool spool_only) { spool_only_ = spool_only; }
+
+  // Makes the performer apply up to |num_operations| operations at a time,
+  // and those whose data comes in ahead of the rest, from a fetcher that
+  // downloads several ranges at once, as soon as it does. See
+  // DeltaPerformer::set_apply_ahead(). Must be called before the action
+  // starts.
+  void set_apply_ahead_operations(unsigned num_operations) {
+    apply_ahead_operations_ = num_operations;
+  }
+
+  // Keeps the memory the payload is downloaded and applied with to about
+  // |memory_budget| bytes, spooling large data blobs to |spool_dir|. See
+  // DeltaPerformer::set_memory_budget(). The payload spooled while waiting
+  // for the install plan is limited to half the budget then. Must be called
+  // before the action starts.
+  void set_memory_budget(uint64_t memory_budget,
+                         const std::string& spool_dir) {
+    memory_budget_ = memory_budget;
+    spool_dir_ = spool_dir;
+  }
+
+  // Sets the rates past updates reached, which the performer's estimate of
+  // how long the update takes starts from. See
+  // DeltaPerformer::set_duration_rates(). Must be called before the action
+  // starts.
+  void set_duration_rates(const UpdateDurationEstimator::Rates& rates) {
+    duration_rates_ = rates;
+  }
+
+  // Makes the performer apply the payload on a thread of its own, fed by a
+  // bounded queue, so that the transfer, D-Bus calls and timers go on
+  // meanwhile. The transfer is paused while the queue is full. The data
+  // blobs fetched again and the payload verification wait for the queue to
+  // be applied, and the data received ahead is only passed on while it's
+  // empty. Must be called before the action starts.
+  void set_apply_on_thread(bool apply_on_thread) {
+    apply_on_thread_ = apply_on_thread;
+  }
+
+  // Returns the performer applying the payload, or NULL if the action hasn't
+  // started or a test writer is used.
+  const DeltaPerformer* delta_performer() const {
+    return delta_performer_.get();
+  }
+
  private:
+  // Collects the data blob fetched again by |repair_fetcher_|, which has its
+  // own delegate so that its transfer doesn't count as the payload's.
+  class RepairFetcherDelegate : public HttpFetcherDelegate {
+   public:
+    explicit RepairFetcherDelegate(DownloadAction* action) : action_(action) {}
+
+    virtual void ReceivedBytes(HttpFetcher* fetcher,
+                               const char* bytes,
+                               int length) {
+      data_.insert(data_.end(), bytes, bytes + length);
+    }
+    virtual void TransferComplete(HttpFetcher* fetcher, bool successful) {
+      action_->RepairComplete(successful);
+    }
+    virtual void TransferTerminated(HttpFetcher* fetcher) {}
+
+    std::vector<char>* data() { return &data_; }
+
+   private:
+    DownloadAction* action_;
+    std::vector<char> data_;
+
+    DISALLOW_COPY_AND_ASSIGN(RepairFetcherDelegate);
+  };
+
+  // Fetches the data blob the delta performer waits for, if any, again.
+  void StartRepair();
+
+  // Passes the data blob fetched again to the delta performer, and carries
+  // on with the download.
+  void RepairComplete(bool successful);
+
+  // Passes |length| received bytes at |bytes| to the writer, or commits
+  // them to the writer's buffer if |bytes| is NULL, and terminates
+  // processing if that fails.
+  void WriteReceivedBytes(const char* bytes, int length);
+
+  // Carries on once the data passed to the writer has been applied:
+  // fetches a data blob again, completes the transfer that was left pending
+  // or unpauses it. Does nothing but update the pause while |apply_queue_|
+  // still applies data.
+  void ContinueApplying();
+
+  // Terminates the processing after the writer has failed with |code_|,
+  // completing the action right away if the transfer is complete already.
+  void WriterFailed();
+
+  // Pauses the transfer while the spool or the apply queue is full, a data
+  // blob is fetched again or the action is suspended, and unpauses it
+  // otherwise.
+  void UpdatePause();
+
+  // Stops applying the queued payload and has the performer checkpoint its
+  // progress and exit. Run from the main loop on termination requests.
+  void StopApplyingAndExit();
+
+  // Closes the writer and reports that the download is done.
+  void CloseWriter();
+
+  // Copies the |length| bytes at |bytes|, received at |offset| of the
+  // payload, to the peer cache.
+  void CopyToPeerCache(off_t offset, const char* bytes, int length);
+
   // The InstallPlan passed in
   InstallPlan install_plan_;
 
@@ -120,6 +283,63 @@ class DownloadAction : public Action<DownloadAction>,
   DownloadActionDelegate* delegate_;
   uint64_t bytes_received_;
 
+  // True while the actions run concurrently with this one, which may still
+  // change the install plan, haven't completed. The received bytes are kept
+  // in |spool_| until then, and the transfer is paused if it fills up.
+  bool waiting_for_input_;
+  std::vector<char> spool_;
+  bool spool_full_;
+  // Set while the payload metadata is yet to be received into |spool_|,
+  // where the performer parses it ahead of applying the payload.
+  bool prefetching_metadata_;
+
+  // Whether the action is suspended, and whether the transfer is paused.
+  bool suspended_;
+  bool fetcher_paused_;
+
+  // Set if the transfer completed while waiting for the input, and whether
+  // it succeeded.
+  bool transfer_complete_pending_;
+  bool transfer_successful_;
+
+  // The cache the payload is copied to, or NULL, and whether the copy has
+  // been started.
+  PeerCache* peer_cache_;
+  bool peer_cache_started_;
+
+  // See set_spool_only().
+  bool spool_only_;
+
+  // See set_apply_ahead_operations(). 0 to apply the payload in order.
+  unsigned apply_ahead_operations_;
+
+  // See set_memory_budget(). 0 for no budget.
+  uint64_t memory_budget_;
+  std::string spool_dir_;
+
+  // See set_duration_rates().
+  UpdateDurationEstimator::Rates duration_rates_;
+
+  // See set_apply_on_thread(). |apply_queue_| passes the payload to
+  // |delta_performer_| once the action is started with it, and
+  // |exit_callback_| runs StopApplyingAndExit() while it's open.
+  bool apply_on_thread_;
+  scoped_ptr<QueuedFileWriter> apply_queue_;
+
+  // Counts the payload writes in IoStats, in front of the writer above.
+  scoped_ptr<AccountingFileWriter> payload_writer_;
+  scoped_ptr<google::protobuf::Closure> exit_callback_;
+
+  // The writer's buffer last lent to the fetcher, whose bytes are copied to
+  // the peer cache once they're received.
+  const char* lent_buffer_;
+
+  // See set_repair_fetcher(). |repairing_| is set while it fetches a data
+  // blob.
+  scoped_ptr<MultiRangeHttpFetcher> repair_fetcher_;
+  RepairFetcherDelegate repair_delegate_;
+  bool repairing_;
+
   DISALLOW_COPY_AND_ASSIGN(DownloadAction);
 };
 
@@ -379,6 +379,136 @@ TEST(DownloadActionTest, PassObjectOutTest) {
   EXPECT_EQ(true, test_action.did_run_);
 }
 
+class ConcurrentPlanAction;
+
+template<>
+class ActionTraits<ConcurrentPlanAction> {
+ public:
+  typedef InstallPlan OutputObjectType;
+  typedef NoneType InputObjectType;
+};
+
+// Passes on an install plan right away, and completes it with the source
+// hashes later on, like the FilesystemCopierAction run concurrently with the
+// DownloadAction.
+class ConcurrentPlanAction : public Action<ConcurrentPlanAction> {
+ public:
+  typedef NoneType InputObjectType;
+  typedef InstallPlan OutputObjectType;
+  ConcurrentPlanAction() : written_before_completion_(0) {}
+  void PerformAction() {
+    SetOutputObject(install_plan_);
+    g_timeout_add(100, &ConcurrentPlanAction::StaticComplete, this);
+  }
+  static gboolean StaticComplete(gpointer data) {
+    reinterpret_cast<ConcurrentPlanAction*>(data)->Complete();
+    return FALSE;
+  }
+  void Complete() {
+    vector<char> contents;
+    EXPECT_TRUE(utils::ReadFile(install_plan_.install_path, &contents));
+    written_before_completion_ = contents.size();
+    install_plan_.rootfs_hash.assign(source_hash_.begin(), source_hash_.end());
+    SetOutputObject(install_plan_);
+    processor_->ActionComplete(this, kActionCodeSuccess);
+  }
+  static string StaticType() { return "ConcurrentPlanAction"; }
+  string Type() const { return StaticType(); }
+  InstallPlan install_plan_;
+  string source_hash_;
+  size_t written_before_completion_;
+};
+
+TEST(DownloadActionTest, ConcurrentInputTest) {
+  GMainLoop *loop = g_main_loop_new(g_main_context_default(), FALSE);
+
+  vector<char> data(3 * kMockHttpFetcherChunkSize, 'x');
+  ScopedTempFile output_temp_file;
+  DirectFileWriter writer;
+  ConcurrentPlanAction plan_action;
+  plan_action.install_plan_ = InstallPlan(
+      false,
+      "",
+      data.size(),
+      OmahaHashCalculator::OmahaHashOfBytes(&data[0], data.size()),
+      output_temp_file.GetPath(),
+      "");
+  plan_action.source_hash_ = "source hash";
+  PrefsMock prefs;
+  // takes ownership of passed in HttpFetcher
+  DownloadAction download_action(&prefs, NULL,
+                                 new MockHttpFetcher(&data[0], data.size()));
+  download_action.SetTestFileWriter(&writer);
+  ObjectCollectorAction<InstallPlan> collector_action;
+  BondActions(&plan_action, &download_action);
+  BondActions(&download_action, &collector_action);
+
+  DownloadActionTestProcessorDelegate delegate(kActionCodeSuccess);
+  delegate.loop_ = loop;
+  delegate.expected_data_ = data;
+  delegate.path_ = output_temp_file.GetPath();
+  ActionProcessor processor;
+  processor.set_delegate(&delegate);
+  processor.EnqueueConcurrentAction(&plan_action);
+  processor.EnqueueAction(&download_action);
+  processor.EnqueueAction(&collector_action);
+
+  g_timeout_add(0, &PassObjectOutTestStarter, &processor);
+  g_main_loop_run(loop);
+  g_main_loop_unref(loop);
+
+  // The whole payload was spooled until the plan was complete.
+  EXPECT_EQ(0, plan_action.written_before_completion_);
+  EXPECT_EQ(plan_action.source_hash_,
+            string(collector_action.object().rootfs_hash.begin(),
+                   collector_action.object().rootfs_hash.end()));
+}
+
+TEST(DownloadActionTest, SpoolOnlyTest) {
+  GMainLoop *loop = g_main_loop_new(g_main_context_default(), FALSE);
+
+  string cache_dir;
+  ASSERT_TRUE(utils::MakeTempDirectory("/tmp/DownloadActionTest.XXXXXX",
+                                       &cache_dir));
+  PeerCache peer_cache(cache_dir);
+  vector<char> data(3 * kMockHttpFetcherChunkSize + 10, 'y');
+  const string hash = OmahaHashCalculator::OmahaHashOfBytes(&data[0],
+                                                            data.size());
+  // Nothing is written to the install path.
+  InstallPlan install_plan(false,
+                           "",
+                           data.size(),
+                           hash,
+                           "/fake/path/that/cant/be/created",
+                           "");
+  ObjectFeederAction<InstallPlan> feeder_action;
+  feeder_action.set_obj(install_plan);
+  PrefsMock prefs;
+  // takes ownership of passed in HttpFetcher
+  DownloadAction download_action(&prefs, NULL,
+                                 new MockHttpFetcher(&data[0], data.size()));
+  download_action.set_peer_cache(&peer_cache);
+  download_action.set_spool_only(true);
+  BondActions(&feeder_action, &download_action);
+
+  DownloadActionTestProcessorDelegate delegate(kActionCodeSuccess);
+  delegate.loop_ = loop;
+  delegate.expected_data_ = data;
+  delegate.path_ = cache_dir + "/" + PeerCache::PayloadName(hash);
+  ActionProcessor processor;
+  processor.set_delegate(&delegate);
+  processor.EnqueueAction(&feeder_action);
+  processor.EnqueueAction(&download_action);
+
+  g_timeout_add(0, &PassObjectOutTestStarter, &processor);
+  g_main_loop_run(loop);
+  g_main_loop_unref(loop);
+
+  EXPECT_TRUE(peer_cache.HasPayload(hash));
+  EXPECT_EQ(0, peer_cache.PartialSize(hash));
+  EXPECT_TRUE(utils::RecursiveUnlinkDir(cache_dir));
+}
+
 TEST(DownloadActionTest, BadOutFileTest) {
   GMainLoop *loop = g_main_loop_new(g_main_context_default(), FALSE);
 
@@ -0,0 +1,396 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Compares the encoders the payload generator may pick for the data of an
+// operation over the files of a pair of images, so that its defaults can be
+// chosen on evidence. Every regular file of the new image is compressed with
+// each bzip2 level and xz preset asked for, and diffed with bsdiff and the
+// stream diff against the file at the same path in the old image, if any.
+// The results are decoded through the ExtentWriters and patchers clients
+// apply operations with, checked against the file, and the compressed size
+// and encode and decode throughput of each encoder are reported.
+
+#include <bzlib.h>
+#include <lzma.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include <base/basictypes.h>
+#include <base/command_line.h>
+#include <base/logging.h>
+#include <base/string_number_conversions.h>
+#include <base/string_split.h>
+#include <base/stringprintf.h>
+#include <base/time.h>
+#include <gflags/gflags.h>
+
+#include "update_engine/bsdiff.h"
+#include "update_engine/bspatch.h"
+#include "update_engine/bzip_extent_writer.h"
+#include "update_engine/extent_writer.h"
+#include "update_engine/filesystem_iterator.h"
+#include "update_engine/stream_diff.h"
+#include "update_engine/utils.h"
+#include "update_engine/xz_extent_writer.h"
+
+DEFINE_string(old_dir, "",
+              "Directory where the old rootfs is loop mounted read-only");
+DEFINE_string(new_dir, "",
+              "Directory where the new rootfs is loop mounted read-only");
+DEFINE_string(bzip2_levels, "1,9",
+              "Comma-separated bzip2 block sizes to compress with");
+DEFINE_string(xz_presets, "0,6",
+              "Comma-separated xz presets to compress with");
+DEFINE_bool(diffs, true,
+            "Also diff the files with bsdiff and the stream diff");
+DEFINE_int64(min_file_size, 4096, "Smallest file encoded, in bytes");
+DEFINE_int64(max_file_size, 64 << 20,
+             "Largest file encoded, in bytes. bsdiff needs several times the "
+             "size of the old file in memory");
+DEFINE_int32(max_files, 0, "Most files encoded, or 0 for all of them");
+
+using base::TimeDelta;
+using base::TimeTicks;
+using std::set;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+const double kMiB = 1024.0 * 1024.0;
+const uint32_t kBlockSize = 4096;
+
+// An ExtentWriter that checks that what's written to it is |expected|.
+class CheckingExtentWriter : public ExtentWriter {
+ public:
+  explicit CheckingExtentWriter(const vector<char>& expected)
+      : expected_(expected), offset_(0), mismatch_(false) {}
+
+  bool Init(int fd, const vector<Extent>& extents, uint32_t block_size) {
+    return true;
+  }
+
+  bool Write(const void* bytes, size_t count) {
+    if (offset_ + count > expected_.size() ||
+        memcmp(&expected_[offset_], bytes, count) != 0)
+      mismatch_ = true;
+    offset_ += count;
+    return !mismatch_;
+  }
+
+  bool EndImpl() { return !mismatch_ && offset_ == expected_.size(); }
+
+ private:
+  const vector<char>& expected_;
+  size_t offset_;
+  bool mismatch_;
+
+  DISALLOW_COPY_AND_ASSIGN(CheckingExtentWriter);
+};
+
+// An encoder of the data of an operation and the way clients decode it.
+class Encoder {
+ public:
+  explicit Encoder(const string& name) : name_(name) {}
+  virtual ~Encoder() {}
+
+  const string& name() const { return name_; }
+
+  // Whether the encoder needs the old file.
+  virtual bool is_diff() const { return false; }
+
+  // Encodes |new_data|, or its difference from |old_data|, to |out|.
+  virtual bool Encode(const vector<char>& old_data,
+                      const vector<char>& new_data,
+                      vector<char>* out) = 0;
+
+  // Decodes |encoded| to |writer|, which it Init()s and End()s.
+  virtual bool Decode(const vector<char>& old_data,
+                      const vector<char>& encoded,
+                      uint64_t new_size,
+                      ExtentWriter* writer) = 0;
+
+ private:
+  const string name_;
+
+  DISALLOW_COPY_AND_ASSIGN(Encoder);
+};
+
+// Returns a pointer to the first byte of |data|, or NULL if it's empty.
+const char* DataOrNull(const vector<char>& data) {
+  return data.empty() ? NULL : &data[0];
+}
+
+// Passes |encoded| through a Decoder writing to |writer|.
+template <class Decoder>
+bool DecodeThrough(const vector<char>& encoded, ExtentWriter* writer) {
+  Decoder decoder(writer);
+  TEST_AND_RETURN_FALSE(decoder.Init(-1, vector<Extent>(), kBlockSize));
+  TEST_AND_RETURN_FALSE(encoded.empty() ||
+                        decoder.Write(&encoded[0], encoded.size()));
+  return decoder.End();
+}
+
+// REPLACE_BZ data compressed with a block size of |level| * 100 KiB. The
+// generator compresses with level 9.
+class Bzip2Encoder : public Encoder {
+ public:
+  explicit Bzip2Encoder(int level)
+      : Encoder(StringPrintf("bzip2 -%d", level)), level_(level) {}
+
+  virtual bool Encode(const vector<char>& old_data,
+                      const vector<char>& new_data,
+                      vector<char>* out) {
+    // The bound bzip2 documents for its output.
+    unsigned int out_size = new_data.size() + new_data.size() / 100 + 600;
+    out->resize(out_size);
+    TEST_AND_RETURN_FALSE(BZ2_bzBuffToBuffCompress(
+        &(*out)[0], &out_size, const_cast<char*>(DataOrNull(new_data)),
+        new_data.size(), level_, 0, 0) == BZ_OK);
+    out->resize(out_size);
+    return true;
+  }
+
+  virtual bool Decode(const vector<char>& old_data,
+                      const vector<char>& encoded,
+                      uint64_t new_size,
+                      ExtentWriter* writer) {
+    return DecodeThrough<BzipExtentWriter>(encoded, writer);
+  }
+
+ private:
+  const int level_;
+};
+
+// REPLACE_XZ data compressed with |preset|. The generator uses preset 6.
+class XzEncoder : public Encoder {
+ public:
+  explicit XzEncoder(uint32_t preset)
+      : Encoder(StringPrintf("xz -%u", preset)), preset_(preset) {}
+
+  virtual bool Encode(const vector<char>& old_data,
+                      const vector<char>& new_data,
+                      vector<char>* out) {
+    out->resize(lzma_stream_buffer_bound(new_data.size()));
+    size_t out_pos = 0;
+    TEST_AND_RETURN_FALSE(lzma_easy_buffer_encode(
+        preset_, LZMA_CHECK_NONE, NULL,
+        reinterpret_cast<const uint8_t*>(DataOrNull(new_data)),
+        new_data.size(), reinterpret_cast<uint8_t*>(&(*out)[0]), &out_pos,
+        out->size()) == LZMA_OK);
+    out->resize(out_pos);
+    return true;
+  }
+
+  virtual bool Decode(const vector<char>& old_data,
+                      const vector<char>& encoded,
+                      uint64_t new_size,
+                      ExtentWriter* writer) {
+    return DecodeThrough<XzExtentWriter>(encoded, writer);
+  }
+
+ private:
+  const uint32_t preset_;
+};
+
+// BSDIFF patches.
+class BsdiffEncoder : public Encoder {
+ public:
+  BsdiffEncoder() : Encoder("bsdiff") {}
+
+  virtual bool is_diff() const { return true; }
+
+  virtual bool Encode(const vector<char>& old_data,
+                      const vector<char>& new_data,
+                      vector<char>* out) {
+    return BsdiffBuffers(old_data, new_data, NULL, out);
+  }
+
+  virtual bool Decode(const vector<char>& old_data,
+                      const vector<char>& encoded,
+                      uint64_t new_size,
+                      ExtentWriter* writer) {
+    TEST_AND_RETURN_FALSE(writer->Init(-1, vector<Extent>(), kBlockSize));
+    TEST_AND_RETURN_FALSE(BspatchBuffer(DataOrNull(old_data), old_data.size(),
+                                        DataOrNull(encoded), encoded.size(),
+                                        new_size, writer));
+    return writer->End();
+  }
+};
+
+// STREAM_DIFF patches.
+class StreamDiffEncoder : public Encoder {
+ public:
+  StreamDiffEncoder() : Encoder("stream diff") {}
+
+  virtual bool is_diff() const { return true; }
+
+  virtual bool Encode(const vector<char>& old_data,
+                      const vector<char>& new_data,
+                      vector<char>* out) {
+    return StreamDiffBuffers(DataOrNull(old_data), old_data.size(),
+                             DataOrNull(new_data), new_data.size(), out);
+  }
+
+  virtual bool Decode(const vector<char>& old_data,
+                      const vector<char>& encoded,
+                      uint64_t new_size,
+                      ExtentWriter* writer) {
+    TEST_AND_RETURN_FALSE(writer->Init(-1, vector<Extent>(), kBlockSize));
+    TEST_AND_RETURN_FALSE(StreamPatchBuffer(DataOrNull(old_data),
+                                            old_data.size(),
+                                            DataOrNull(encoded),
+                                            encoded.size(),
+                                            new_size,
+                                            writer));
+    return writer->End();
+  }
+};
+
+// The totals of an encoder over the files.
+struct EncoderStats {
+  EncoderStats() : files(0), bytes_in(0), bytes_out(0) {}
+  int files;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  TimeDelta encode_time;
+  TimeDelta decode_time;
+};
+
+// Encodes and decodes |new_data| with |encoder| and adds the results to
+// |stats|. Returns false if the data doesn't decode back to |new_data|.
+bool RunEncoder(Encoder* encoder,
+                const vector<char>& old_data,
+                const vector<char>& new_data,
+                EncoderStats* stats) {
+  vector<char> encoded;
+  TimeTicks start_time = TimeTicks::Now();
+  TEST_AND_RETURN_FALSE(encoder->Encode(old_data, new_data, &encoded));
+  stats->encode_time += TimeTicks::Now() - start_time;
+
+  CheckingExtentWriter writer(new_data);
+  start_time = TimeTicks::Now();
+  TEST_AND_RETURN_FALSE(
+      encoder->Decode(old_data, encoded, new_data.size(), &writer));
+  stats->decode_time += TimeTicks::Now() - start_time;
+
+  stats->files++;
+  stats->bytes_in += new_data.size();
+  stats->bytes_out += encoded.size();
+  return true;
+}
+
+// Returns |bytes| per |time| in MiB/s.
+double Throughput(uint64_t bytes, const TimeDelta& time) {
+  const double seconds = time.InSecondsF();
+  return seconds > 0 ? bytes / kMiB / seconds : 0.0;
+}
+
+// Returns whether |stbuf| is that of a regular file of a size the encoders
+// are run over.
+bool IsCandidateFile(const struct stat& stbuf) {
+  return S_ISREG(stbuf.st_mode) && stbuf.st_size >= FLAGS_min_file_size &&
+      stbuf.st_size <= FLAGS_max_file_size;
+}
+
+// Appends the comma-separated numbers of |list| to |values|.
+void ParseList(const string& list, vector<int>* values) {
+  vector<string> strings;
+  base::SplitString(list, ',', &strings);
+  for (vector<string>::const_iterator it = strings.begin();
+       it != strings.end(); ++it) {
+    if (it->empty())
+      continue;
+    int value = 0;
+    CHECK(base::StringToInt(*it, &value) && value >= 0) << "Bad value " << *it;
+    values->push_back(value);
+  }
+}
+
+int Main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  CommandLine::Init(argc, argv);
+  CHECK(!FLAGS_new_dir.empty()) << "Must pass --new_dir";
+  CHECK(!FLAGS_diffs || !FLAGS_old_dir.empty())
+      << "Must pass --old_dir, or --nodiffs";
+  CHECK_GE(FLAGS_max_files, 0);
+
+  vector<Encoder*> encoders;
+  vector<int> levels;
+  ParseList(FLAGS_bzip2_levels, &levels);
+  for (size_t i = 0; i < levels.size(); i++) {
+    CHECK(levels[i] >= 1 && levels[i] <= 9) << "Bad bzip2 level";
+    encoders.push_back(new Bzip2Encoder(levels[i]));
+  }
+  vector<int> presets;
+  ParseList(FLAGS_xz_presets, &presets);
+  for (size_t i = 0; i < presets.size(); i++) {
+    CHECK_LE(presets[i], 9) << "Bad xz preset";
+    encoders.push_back(new XzEncoder(presets[i]));
+  }
+  if (FLAGS_diffs) {
+    encoders.push_back(new BsdiffEncoder);
+    encoders.push_back(new StreamDiffEncoder);
+  }
+  vector<EncoderStats> stats(encoders.size());
+
+  int files = 0, failures = 0;
+  for (FilesystemIterator it(FLAGS_new_dir, set<string>());
+       !it.IsEnd() && (FLAGS_max_files == 0 || files < FLAGS_max_files);
+       it.Increment()) {
+    if (!IsCandidateFile(it.GetStat()))
+      continue;
+    vector<char> new_data, old_data;
+    if (!utils::ReadFile(it.GetFullPath(), &new_data)) {
+      LOG(WARNING) << "Unable to read " << it.GetFullPath();
+      continue;
+    }
+    const string old_path = FLAGS_old_dir + it.GetPartialPath();
+    struct stat old_stbuf;
+    const bool has_old = FLAGS_diffs &&
+        lstat(old_path.c_str(), &old_stbuf) == 0 &&
+        IsCandidateFile(old_stbuf) && utils::ReadFile(old_path, &old_data);
+    files++;
+    for (size_t i = 0; i < encoders.size(); i++) {
+      if (encoders[i]->is_diff() && !has_old)
+        continue;
+      if (!RunEncoder(encoders[i], old_data, new_data, &stats[i])) {
+        LOG(ERROR) << encoders[i]->name() << " failed on "
+                   << it.GetPartialPath();
+        failures++;
+      }
+    }
+  }
+
+  printf("%d files\n", files);
+  printf("%-14s %6s %12s %12s %7s %12s %12s\n", "encoder", "files",
+         "bytes in", "bytes out", "ratio", "enc MiB/s", "dec MiB/s");
+  for (size_t i = 0; i < encoders.size(); i++) {
+    const EncoderStats& s = stats[i];
+    printf("%-14s %6d %12llu %12llu %6.2f%% %12.2f %12.2f\n",
+           encoders[i]->name().c_str(), s.files,
+           static_cast<unsigned long long>(s.bytes_in),
+           static_cast<unsigned long long>(s.bytes_out),
+           s.bytes_in > 0 ? 100.0 * s.bytes_out / s.bytes_in : 0.0,
+           Throughput(s.bytes_in, s.encode_time),
+           Throughput(s.bytes_in, s.decode_time));
+    delete encoders[i];
+  }
+  return failures == 0 ? 0 : 1;
+}
+
+}  // namespace {}
+
+}  // namespace chromeos_update_engine
+
+int main(int argc, char** argv) {
+  return chromeos_update_engine::Main(argc, argv);
+}
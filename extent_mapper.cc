@@ -14,12 +14,16 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <linux/fiemap.h>
 #include <linux/fs.h>
 
+#include <algorithm>
+
 #include "update_engine/graph_types.h"
 #include "update_engine/graph_utils.h"
 #include "update_engine/utils.h"
 
+using std::min;
 using std::string;
 using std::vector;
 
@@ -29,6 +33,88 @@ namespace extent_mapper {
 
 namespace {
 const int kBlockSize = 4096;
+
+// The number of extents requested per FIEMAP call.
+const size_t kFiemapExtentCount = 512;
+
+// Extents with these flags aren't made of whole blocks at known locations.
+const uint32_t kFiemapUnusableFlags = FIEMAP_EXTENT_UNKNOWN |
+    FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_ENCODED |
+    FIEMAP_EXTENT_DATA_ENCRYPTED | FIEMAP_EXTENT_NOT_ALIGNED |
+    FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_DATA_TAIL;
+
+}  // namespace {}
+
+bool ExtentsForFileFiemap(const std::string& path, std::vector<Extent>* out) {
+  CHECK(out);
+  int fd = open(path.c_str(), O_RDONLY, 0);
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  ScopedFdCloser fd_closer(&fd);
+  struct stat stbuf;
+  TEST_AND_RETURN_FALSE_ERRNO(fstat(fd, &stbuf) == 0);
+  TEST_AND_RETURN_FALSE(S_ISREG(stbuf.st_mode));
+  const uint64_t block_count = (stbuf.st_size + kBlockSize - 1) / kBlockSize;
+
+  vector<char> fiemap_buffer(sizeof(struct fiemap) +
+                             kFiemapExtentCount * sizeof(struct fiemap_extent));
+  struct fiemap* fiemap = reinterpret_cast<struct fiemap*>(&fiemap_buffer[0]);
+  vector<Extent> extents;
+  // The next block to map.
+  uint64_t next_block = 0;
+  bool last = false;
+  while (!last && next_block < block_count) {
+    memset(fiemap, 0, sizeof(*fiemap));
+    fiemap->fm_start = next_block * kBlockSize;
+    fiemap->fm_length = FIEMAP_MAX_OFFSET - fiemap->fm_start;
+    // Flush delayed allocations so that all extents have a location.
+    fiemap->fm_flags = FIEMAP_FLAG_SYNC;
+    fiemap->fm_extent_count = kFiemapExtentCount;
+    if (ioctl(fd, FS_IOC_FIEMAP, fiemap) != 0) {
+      PLOG(INFO) << "FIEMAP failed on " << path;
+      return false;
+    }
+    if (fiemap->fm_mapped_extents == 0)
+      break;
+    for (uint32_t i = 0; i < fiemap->fm_mapped_extents; i++) {
+      const struct fiemap_extent& fe = fiemap->fm_extents[i];
+      if ((fe.fe_flags & kFiemapUnusableFlags) ||
+          fe.fe_logical % kBlockSize || fe.fe_physical % kBlockSize) {
+        LOG(INFO) << "Extent at " << fe.fe_logical << " of " << path
+                  << " isn't block aligned, flags " << fe.fe_flags;
+        return false;
+      }
+      const uint64_t logical_block = fe.fe_logical / kBlockSize;
+      if (logical_block >= block_count) {
+        // Preallocated past the end of the file.
+        last = true;
+        break;
+      }
+      TEST_AND_RETURN_FALSE(logical_block >= next_block);
+      graph_utils::AppendBlocksToExtents(&extents, kSparseHole,
+                                         logical_block - next_block);
+      const uint64_t num_blocks =
+          min(static_cast<uint64_t>((fe.fe_length + kBlockSize - 1) /
+                                    kBlockSize),
+              block_count - logical_block);
+      graph_utils::AppendBlocksToExtents(&extents,
+                                         fe.fe_physical / kBlockSize,
+                                         num_blocks);
+      next_block = logical_block + num_blocks;
+      if (fe.fe_flags & FIEMAP_EXTENT_LAST)
+        last = true;
+    }
+  }
+  // Anything past the last extent is a hole.
+  graph_utils::AppendBlocksToExtents(&extents, kSparseHole,
+                                     block_count - next_block);
+  out->insert(out->end(), extents.begin(), extents.end());
+  return true;
+}
+
+bool ExtentsForFile(const std::string& path, std::vector<Extent>* out) {
+  if (ExtentsForFileFiemap(path, out))
+    return true;
+  return ExtentsForFileFibmap(path, out);
 }
 
 bool ExtentsForFileFibmap(const std::string& path, std::vector<Extent>* out) {
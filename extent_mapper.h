@@ -14,6 +14,17 @@ namespace chromeos_update_engine {
 
 namespace extent_mapper {
 
+// Gets the extents of a file like ExtentsForFileFibmap(), but with the FIEMAP
+// ioctl, which returns whole extents at a time rather than a block per call
+// and so is much faster on large files. Returns false if that fails, e.g.,
+// because the filesystem doesn't support FIEMAP or the file has extents that
+// aren't made of whole blocks, in which case 'out' is left alone.
+bool ExtentsForFileFiemap(const std::string& path, std::vector<Extent>* out);
+
+// Gets the extents of a file with ExtentsForFileFiemap() if possible, falling
+// back to ExtentsForFileFibmap() otherwise. Returns true on success.
+bool ExtentsForFile(const std::string& path, std::vector<Extent>* out);
+
 // Uses the FIBMAP ioctl to get all blocks used by a file and return them
 // as extents. Blocks are relative to the start of the filesystem. If
 // there is a sparse "hole" in the file, the blocks for that will be
@@ -4,6 +4,7 @@
 
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <set>
 #include <string>
@@ -89,4 +90,57 @@ TEST(ExtentMapperTest, RunAsRootSparseFileTest) {
   EXPECT_NE(extents[2].start_block(), extents[0].start_block());
 }
 
+TEST(ExtentMapperTest, RunAsRootFiemapMatchesFibmapTest) {
+  const string kFilename = "/proc/self/exe";
+  vector<Extent> fiemap_extents;
+  if (!extent_mapper::ExtentsForFileFiemap(kFilename, &fiemap_extents)) {
+    LOG(INFO) << "FIEMAP isn't supported here, skipping.";
+    return;
+  }
+  vector<Extent> fibmap_extents;
+  ASSERT_TRUE(extent_mapper::ExtentsForFileFibmap(kFilename,
+                                                  &fibmap_extents));
+  ASSERT_EQ(fibmap_extents.size(), fiemap_extents.size());
+  for (size_t i = 0; i < fibmap_extents.size(); i++) {
+    EXPECT_EQ(fibmap_extents[i].start_block(),
+              fiemap_extents[i].start_block());
+    EXPECT_EQ(fibmap_extents[i].num_blocks(), fiemap_extents[i].num_blocks());
+  }
+}
+
+TEST(ExtentMapperTest, FiemapSparseFileTest) {
+  // One real block, then two sparse ones, then a real block and a sparse one
+  // at the end.
+  string path;
+  ASSERT_TRUE(utils::MakeTempFile("./ExtentMapperTest.FiemapSparse.XXXXXX",
+                                  &path, NULL));
+  ScopedPathUnlinker path_unlinker(path);
+  uint32_t block_size = 0;
+  EXPECT_TRUE(extent_mapper::GetFilesystemBlockSize(path, &block_size));
+  int fd = open(path.c_str(), O_WRONLY);
+  ASSERT_GE(fd, 0);
+  EXPECT_EQ(1, pwrite(fd, "x", 1, 0));
+  EXPECT_EQ(1, pwrite(fd, "x", 1, 3 * block_size));
+  EXPECT_EQ(0, ftruncate(fd, 5 * block_size));
+  close(fd);
+
+  vector<Extent> extents;
+  if (!extent_mapper::ExtentsForFileFiemap(path, &extents)) {
+    LOG(INFO) << "FIEMAP isn't supported here, skipping.";
+    return;
+  }
+  // Only check the layout if the filesystem block size is the assumed one.
+  if (block_size != 4096)
+    return;
+  ASSERT_EQ(4U, extents.size());
+  EXPECT_EQ(1U, extents[0].num_blocks());
+  EXPECT_EQ(2U, extents[1].num_blocks());
+  EXPECT_EQ(1U, extents[2].num_blocks());
+  EXPECT_EQ(1U, extents[3].num_blocks());
+  EXPECT_NE(kSparseHole, extents[0].start_block());
+  EXPECT_EQ(kSparseHole, extents[1].start_block());
+  EXPECT_NE(kSparseHole, extents[2].start_block());
+  EXPECT_EQ(kSparseHole, extents[3].start_block());
+}
+
 }  // namespace chromeos_update_engine
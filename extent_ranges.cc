@@ -4,15 +4,16 @@
 
 #include "update_engine/extent_ranges.h"
 
-#include <set>
+#include <algorithm>
 #include <utility>
 #include <vector>
 
 #include <base/logging.h>
 
+using std::lower_bound;
 using std::max;
 using std::min;
-using std::set;
+using std::sort;
 using std::vector;
 
 namespace chromeos_update_engine {
@@ -38,147 +39,217 @@ bool ExtentRanges::ExtentsOverlap(const Extent& a, const Extent& b) {
 }
 
 void ExtentRanges::AddBlock(uint64_t block) {
-  AddExtent(ExtentForRange(block, 1));
+  AddRange(block, block + 1);
 }
 
 void ExtentRanges::SubtractBlock(uint64_t block) {
-  SubtractExtent(ExtentForRange(block, 1));
+  SubtractRange(block, block + 1);
 }
 
-namespace {
-
-Extent UnionOverlappingExtents(const Extent& first, const Extent& second) {
-  uint64_t start = min(first.start_block(), second.start_block());
-  uint64_t end = max(first.start_block() + first.num_blocks(),
-                     second.start_block() + second.num_blocks());
-  return ExtentForRange(start, end - start);
+void ExtentRanges::AddExtent(Extent extent) {
+  if (extent.num_blocks() == 0)
+    return;
+  AddRange(extent.start_block(), extent.start_block() + extent.num_blocks());
 }
-  
-}  // namespace {}
 
-void ExtentRanges::AddExtent(Extent extent) {
+void ExtentRanges::SubtractExtent(const Extent& extent) {
   if (extent.num_blocks() == 0)
     return;
+  SubtractRange(extent.start_block(),
+                extent.start_block() + extent.num_blocks());
+}
 
-  ExtentSet::iterator begin_del = extent_set_.end();
-  ExtentSet::iterator end_del = extent_set_.end();
-  uint64_t del_blocks = 0;
-  for (ExtentSet::iterator it = extent_set_.begin(), e = extent_set_.end();
-       it != e; ++it) {
-    if (ExtentsOverlapOrTouch(*it, extent)) {
-      end_del = it;
-      ++end_del;
-      del_blocks += it->num_blocks();
-      if (begin_del == extent_set_.end())
-        begin_del = it;
-
-      extent = UnionOverlappingExtents(extent, *it);
-    }
+void ExtentRanges::AddRange(uint64_t start, uint64_t end) {
+  // The ranges from |first| up to |last| overlap or touch the new one.
+  RangeVector::iterator first =
+      lower_bound(ranges_.begin(), ranges_.end(), start, EndsBefore);
+  RangeVector::iterator last =
+      lower_bound(first, ranges_.end(), end, StartsAtOrBefore);
+  if (first == last) {
+    ranges_.insert(first, BlockRange(start, end));
+    blocks_ += end - start;
+    return;
   }
-  extent_set_.erase(begin_del, end_del);
-  extent_set_.insert(extent);
-  blocks_ -= del_blocks;
-  blocks_ += extent.num_blocks();
+  for (RangeVector::iterator it = first; it != last; ++it)
+    blocks_ -= it->end - it->start;
+  first->start = min(start, first->start);
+  first->end = max(end, (last - 1)->end);
+  blocks_ += first->end - first->start;
+  ranges_.erase(first + 1, last);
 }
 
-namespace {
-// Returns base - subtractee (set subtraction).
-ExtentRanges::ExtentSet SubtractOverlappingExtents(const Extent& base,
-                                                   const Extent& subtractee) {
-  ExtentRanges::ExtentSet ret;
-  if (subtractee.start_block() > base.start_block()) {
-    ret.insert(ExtentForRange(base.start_block(),
-                              subtractee.start_block() - base.start_block()));
+void ExtentRanges::SubtractRange(uint64_t start, uint64_t end) {
+  // The ranges from |first| up to |last| overlap the subtracted one.
+  RangeVector::iterator first =
+      lower_bound(ranges_.begin(), ranges_.end(), start, EndsAtOrBefore);
+  RangeVector::iterator last =
+      lower_bound(first, ranges_.end(), end, StartsBefore);
+  if (first == last)
+    return;
+  // What's left of the first and the last of them.
+  const BlockRange head(first->start, start);
+  const BlockRange tail(end, (last - 1)->end);
+  for (RangeVector::iterator it = first; it != last; ++it)
+    blocks_ -= it->end - it->start;
+  RangeVector::iterator it = ranges_.erase(first, last);
+  if (tail.start < tail.end) {
+    it = ranges_.insert(it, tail);
+    blocks_ += tail.end - tail.start;
   }
-  uint64_t base_end = base.start_block() + base.num_blocks();
-  uint64_t subtractee_end = subtractee.start_block() + subtractee.num_blocks();
-  if (base_end > subtractee_end) {
-    ret.insert(ExtentForRange(subtractee_end, base_end - subtractee_end));
+  if (head.start < head.end) {
+    ranges_.insert(it, head);
+    blocks_ += head.end - head.start;
   }
-  return ret;
 }
-}  // namespace {}
 
-void ExtentRanges::SubtractExtent(const Extent& extent) {
+void ExtentRanges::AppendExtent(const Extent& extent, RangeVector* ranges) {
   if (extent.num_blocks() == 0)
     return;
+  ranges->push_back(BlockRange(extent.start_block(),
+                               extent.start_block() + extent.num_blocks()));
+}
+
+void ExtentRanges::Coalesce(RangeVector* ranges) {
+  if (ranges->empty())
+    return;
+  sort(ranges->begin(), ranges->end(), StartLess);
+  RangeVector::iterator out = ranges->begin();
+  for (RangeVector::const_iterator it = ranges->begin() + 1,
+           e = ranges->end(); it != e; ++it) {
+    if (it->start <= out->end) {
+      out->end = max(out->end, it->end);
+    } else {
+      *++out = *it;
+    }
+  }
+  ranges->erase(out + 1, ranges->end());
+}
+
+void ExtentRanges::AddCoalescedRanges(const RangeVector& ranges) {
+  if (ranges.empty())
+    return;
+  RangeVector merged;
+  merged.reserve(ranges_.size() + ranges.size());
+  RangeVector::const_iterator it = ranges_.begin(), e = ranges_.end();
+  RangeVector::const_iterator jt = ranges.begin(), je = ranges.end();
+  while (it != e || jt != je) {
+    const BlockRange& next =
+        (jt == je || (it != e && it->start < jt->start)) ? *it++ : *jt++;
+    if (!merged.empty() && next.start <= merged.back().end) {
+      merged.back().end = max(merged.back().end, next.end);
+    } else {
+      merged.push_back(next);
+    }
+  }
+  ranges_.swap(merged);
+  blocks_ = 0;
+  for (it = ranges_.begin(), e = ranges_.end(); it != e; ++it)
+    blocks_ += it->end - it->start;
+}
 
-  ExtentSet::iterator begin_del = extent_set_.end();
-  ExtentSet::iterator end_del = extent_set_.end();
-  uint64_t del_blocks = 0;
-  ExtentSet new_extents;
-  for (ExtentSet::iterator it = extent_set_.begin(), e = extent_set_.end();
+void ExtentRanges::SubtractCoalescedRanges(const RangeVector& ranges) {
+  if (ranges.empty())
+    return;
+  RangeVector remaining;
+  remaining.reserve(ranges_.size() + ranges.size());
+  RangeVector::const_iterator jt = ranges.begin(), je = ranges.end();
+  for (RangeVector::const_iterator it = ranges_.begin(), e = ranges_.end();
        it != e; ++it) {
-    if (!ExtentsOverlap(*it, extent))
-      continue;
-    
-    if (begin_del == extent_set_.end())
-      begin_del = it;
-    end_del = it;
-    ++end_del;
-    
-    del_blocks += it->num_blocks();
-
-    ExtentSet subtraction = SubtractOverlappingExtents(*it, extent);
-    for (ExtentSet::iterator jt = subtraction.begin(), je = subtraction.end();
-         jt != je; ++jt) {
-      new_extents.insert(*jt);
-      del_blocks -= jt->num_blocks();
+    uint64_t start = it->start;
+    // Both vectors are sorted, so the subtracted ranges that end before
+    // this one starts end before all the following ones start too.
+    while (jt != je && jt->end <= start)
+      ++jt;
+    for (RangeVector::const_iterator kt = jt;
+         kt != je && kt->start < it->end; ++kt) {
+      if (kt->start > start)
+        remaining.push_back(BlockRange(start, kt->start));
+      start = kt->end;
     }
+    if (start < it->end)
+      remaining.push_back(BlockRange(start, it->end));
+  }
+  ranges_.swap(remaining);
+  blocks_ = 0;
+  for (RangeVector::const_iterator it = ranges_.begin(), e = ranges_.end();
+       it != e; ++it) {
+    blocks_ += it->end - it->start;
   }
-  extent_set_.erase(begin_del, end_del);
-  extent_set_.insert(new_extents.begin(), new_extents.end());
-  blocks_ -= del_blocks;
 }
 
 void ExtentRanges::AddRanges(const ExtentRanges& ranges) {
-  for (ExtentSet::const_iterator it = ranges.extent_set_.begin(),
-           e = ranges.extent_set_.end(); it != e; ++it) {
-    AddExtent(*it);
-  }
+  if (&ranges == this)
+    return;
+  AddCoalescedRanges(ranges.ranges_);
 }
 
 void ExtentRanges::SubtractRanges(const ExtentRanges& ranges) {
-  for (ExtentSet::const_iterator it = ranges.extent_set_.begin(),
-           e = ranges.extent_set_.end(); it != e; ++it) {
-    SubtractExtent(*it);
+  if (&ranges == this) {
+    *this = ExtentRanges();
+    return;
   }
+  SubtractCoalescedRanges(ranges.ranges_);
 }
 
 void ExtentRanges::AddExtents(const vector<Extent>& extents) {
+  RangeVector ranges;
+  ranges.reserve(extents.size());
   for (vector<Extent>::const_iterator it = extents.begin(), e = extents.end();
        it != e; ++it) {
-    AddExtent(*it);
+    AppendExtent(*it, &ranges);
   }
+  Coalesce(&ranges);
+  AddCoalescedRanges(ranges);
 }
 
 void ExtentRanges::SubtractExtents(const vector<Extent>& extents) {
+  RangeVector ranges;
+  ranges.reserve(extents.size());
   for (vector<Extent>::const_iterator it = extents.begin(), e = extents.end();
        it != e; ++it) {
-    SubtractExtent(*it);
+    AppendExtent(*it, &ranges);
   }
+  Coalesce(&ranges);
+  SubtractCoalescedRanges(ranges);
 }
 
 void ExtentRanges::AddRepeatedExtents(
     const ::google::protobuf::RepeatedPtrField<Extent> &exts) {
+  RangeVector ranges;
+  ranges.reserve(exts.size());
   for (int i = 0, e = exts.size(); i != e; ++i) {
-    AddExtent(exts.Get(i));
+    AppendExtent(exts.Get(i), &ranges);
   }
+  Coalesce(&ranges);
+  AddCoalescedRanges(ranges);
 }
 
 void ExtentRanges::SubtractRepeatedExtents(
     const ::google::protobuf::RepeatedPtrField<Extent> &exts) {
+  RangeVector ranges;
+  ranges.reserve(exts.size());
   for (int i = 0, e = exts.size(); i != e; ++i) {
-    SubtractExtent(exts.Get(i));
+    AppendExtent(exts.Get(i), &ranges);
   }
+  Coalesce(&ranges);
+  SubtractCoalescedRanges(ranges);
+}
+
+bool ExtentRanges::OverlapsExtent(const Extent& extent) const {
+  if (extent.num_blocks() == 0)
+    return false;
+  // The first range that ends after |extent| starts is the only candidate.
+  RangeVector::const_iterator it = lower_bound(
+      ranges_.begin(), ranges_.end(), extent.start_block(), EndsAtOrBefore);
+  return it != ranges_.end() &&
+      it->start < extent.start_block() + extent.num_blocks();
 }
 
 void ExtentRanges::Dump() const {
   LOG(INFO) << "ExtentRanges Dump. blocks: " << blocks_;
-  for (ExtentSet::const_iterator it = extent_set_.begin(),
-           e = extent_set_.end();
+  for (RangeVector::const_iterator it = ranges_.begin(), e = ranges_.end();
        it != e; ++it) {
-    LOG(INFO) << "{" << it->start_block() << ", " << it->num_blocks() << "}";
+    LOG(INFO) << "{" << it->start << ", " << it->end - it->start << "}";
   }
 }
 
@@ -196,11 +267,10 @@ std::vector<Extent> ExtentRanges::GetExtentsForBlockCount(
     return out;
   uint64_t out_blocks = 0;
   CHECK(count <= blocks_);
-  for (ExtentSet::const_iterator it = extent_set_.begin(),
-           e = extent_set_.end();
+  for (RangeVector::const_iterator it = ranges_.begin(), e = ranges_.end();
        it != e; ++it) {
     const uint64_t blocks_needed = count - out_blocks;
-    const Extent& extent = *it;
+    const Extent extent = ExtentForRange(it->start, it->end - it->start);
     out.push_back(extent);
     out_blocks += extent.num_blocks();
     if (extent.num_blocks() < blocks_needed)
@@ -6,7 +6,6 @@
 #define CHROMEOS_PLATFORM_UPDATE_ENGINE_EXTENT_RANGES_H__
 
 #include <map>
-#include <set>
 #include <vector>
 
 #include <base/basictypes.h>
@@ -17,7 +16,9 @@
 
 // An ExtentRanges object represents an unordered collection of extents
 // (and therefore blocks). Such an object may be modified by adding or
-// subtracting blocks (think: set addition or set subtraction).
+// subtracting blocks (think: set addition or set subtraction). The blocks
+// are kept as a sorted vector of disjoint ranges, so lookups are binary
+// searches and adding or subtracting many extents at once is one merge.
 
 namespace chromeos_update_engine {
 
@@ -31,8 +32,6 @@ Extent ExtentForRange(uint64_t start_block, uint64_t num_blocks);
 
 class ExtentRanges {
  public:
-  typedef std::set<Extent, ExtentLess> ExtentSet;
-
   ExtentRanges() : blocks_(0) {}
   void AddBlock(uint64_t block);
   void SubtractBlock(uint64_t block);
@@ -47,23 +46,69 @@ class ExtentRanges {
   void AddRanges(const ExtentRanges& ranges);
   void SubtractRanges(const ExtentRanges& ranges);
 
+  // Returns true if any block of |extent| is in this collection.
+  bool OverlapsExtent(const Extent& extent) const;
+
   static bool ExtentsOverlapOrTouch(const Extent& a, const Extent& b);
   static bool ExtentsOverlap(const Extent& a, const Extent& b);
 
   // Dumps contents to the log file. Useful for debugging.
   void Dump() const;
-  
+
   uint64_t blocks() const { return blocks_; }
-  const ExtentSet& extent_set() const { return extent_set_; }
+
+  // Returns the number of disjoint extents the blocks make up.
+  size_t num_extents() const { return ranges_.size(); }
 
   // Returns an ordered vector of extents for |count| blocks,
-  // using extents in extent_set_. The returned extents are not
-  // removed from extent_set_. |count| must be less than or equal to
-  // the number of blocks in this extent set.
+  // using the extents in this collection. The returned extents are not
+  // removed from it. |count| must be less than or equal to the number of
+  // blocks in this collection.
   std::vector<Extent> GetExtentsForBlockCount(uint64_t count) const;
 
  private:
-  ExtentSet extent_set_;
+  // The blocks [start, end).
+  struct BlockRange {
+    BlockRange(uint64_t start_block, uint64_t end_block)
+        : start(start_block), end(end_block) {}
+    uint64_t start;
+    uint64_t end;
+  };
+  typedef std::vector<BlockRange> RangeVector;
+
+  // Comparisons of a range against a block, for the binary searches.
+  static bool EndsBefore(const BlockRange& range, uint64_t block) {
+    return range.end < block;
+  }
+  static bool EndsAtOrBefore(const BlockRange& range, uint64_t block) {
+    return range.end <= block;
+  }
+  static bool StartsBefore(const BlockRange& range, uint64_t block) {
+    return range.start < block;
+  }
+  static bool StartsAtOrBefore(const BlockRange& range, uint64_t block) {
+    return range.start <= block;
+  }
+  static bool StartLess(const BlockRange& a, const BlockRange& b) {
+    return a.start < b.start;
+  }
+
+  // Adds or subtracts the blocks [start, end).
+  void AddRange(uint64_t start, uint64_t end);
+  void SubtractRange(uint64_t start, uint64_t end);
+
+  // Appends the non-empty |extent| to |ranges|.
+  static void AppendExtent(const Extent& extent, RangeVector* ranges);
+
+  // Sorts |ranges| and merges those that overlap or touch.
+  static void Coalesce(RangeVector* ranges);
+
+  // Adds or subtracts the sorted, disjoint |ranges| in a single merge.
+  void AddCoalescedRanges(const RangeVector& ranges);
+  void SubtractCoalescedRanges(const RangeVector& ranges);
+
+  // Sorted, disjoint ranges that don't touch each other.
+  RangeVector ranges_;
   uint64_t blocks_;
 };
 
@@ -2,6 +2,9 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <stdlib.h>
+
+#include <set>
 #include <vector>
 
 #include <gtest/gtest.h>
@@ -9,6 +12,7 @@
 #include "update_engine/extent_ranges.h"
 #include "update_engine/test_utils.h"
 
+using std::set;
 using std::vector;
 
 namespace chromeos_update_engine {
@@ -26,10 +30,14 @@ void ExpectRangeEq(const ExtentRanges& ranges,
   }
   EXPECT_EQ(blocks, ranges.blocks()) << "line: " << line;
 
-  const ExtentRanges::ExtentSet& result = ranges.extent_set();
-  ExtentRanges::ExtentSet::const_iterator it = result.begin();
+  const vector<Extent> result =
+      ranges.GetExtentsForBlockCount(ranges.blocks());
+  EXPECT_EQ(sz / 2, result.size()) << "line: " << line;
+  EXPECT_EQ(sz / 2, ranges.num_extents()) << "line: " << line;
+  vector<Extent>::const_iterator it = result.begin();
   for (size_t i = 0; i < sz; i += 2) {
-    EXPECT_FALSE(it == result.end()) << "line: " << line;
+    if (it == result.end())
+      break;
     EXPECT_EQ(expected[i], it->start_block()) << "line: " << line;
     EXPECT_EQ(expected[i + 1], it->num_blocks()) << "line: " << line;
     ++it;
@@ -234,4 +242,89 @@ TEST(ExtentRangesTest, GetExtentsForBlockCountTest) {
   }
 }
 
+TEST(ExtentRangesTest, OverlapsExtentTest) {
+  ExtentRanges ranges;
+  ranges.AddExtent(ExtentForRange(10, 10));
+  ranges.AddExtent(ExtentForRange(30, 10));
+  EXPECT_TRUE(ranges.OverlapsExtent(ExtentForRange(10, 1)));
+  EXPECT_TRUE(ranges.OverlapsExtent(ExtentForRange(19, 1)));
+  EXPECT_TRUE(ranges.OverlapsExtent(ExtentForRange(0, 11)));
+  EXPECT_TRUE(ranges.OverlapsExtent(ExtentForRange(15, 20)));
+  EXPECT_TRUE(ranges.OverlapsExtent(ExtentForRange(25, 100)));
+  EXPECT_FALSE(ranges.OverlapsExtent(ExtentForRange(0, 10)));
+  EXPECT_FALSE(ranges.OverlapsExtent(ExtentForRange(20, 10)));
+  EXPECT_FALSE(ranges.OverlapsExtent(ExtentForRange(40, 10)));
+  EXPECT_FALSE(ranges.OverlapsExtent(ExtentForRange(15, 0)));
+  EXPECT_FALSE(ExtentRanges().OverlapsExtent(ExtentForRange(0, 100)));
+}
+
+TEST(ExtentRangesTest, RandomOperationsTest) {
+  // Checks adding and subtracting blocks one at a time and in bulk against
+  // a plain set of blocks.
+  const uint64_t kBlockCount = 200;
+  srand(0);
+  ExtentRanges ranges;
+  set<uint64_t> blocks;
+  for (int i = 0; i < 2000; i++) {
+    vector<Extent> extents(1 + rand() % 4);
+    for (size_t j = 0; j < extents.size(); j++) {
+      const uint64_t start = rand() % kBlockCount;
+      extents[j] = ExtentForRange(start, rand() % (kBlockCount - start));
+    }
+    const bool add = rand() % 2;
+    for (size_t j = 0; j < extents.size(); j++) {
+      for (uint64_t block = extents[j].start_block(),
+               end = block + extents[j].num_blocks(); block < end; block++) {
+        if (add)
+          blocks.insert(block);
+        else
+          blocks.erase(block);
+      }
+    }
+    switch (rand() % 3) {
+      case 0:
+        for (size_t j = 0; j < extents.size(); j++) {
+          if (add)
+            ranges.AddExtent(extents[j]);
+          else
+            ranges.SubtractExtent(extents[j]);
+        }
+        break;
+      case 1:
+        if (add)
+          ranges.AddExtents(extents);
+        else
+          ranges.SubtractExtents(extents);
+        break;
+      default: {
+        ExtentRanges other;
+        other.AddExtents(extents);
+        if (add)
+          ranges.AddRanges(other);
+        else
+          ranges.SubtractRanges(other);
+      }
+    }
+
+    ASSERT_EQ(blocks.size(), ranges.blocks());
+    vector<Extent> expected;
+    for (set<uint64_t>::const_iterator it = blocks.begin();
+         it != blocks.end(); ++it) {
+      if (!expected.empty() &&
+          expected.back().start_block() + expected.back().num_blocks() ==
+          *it) {
+        expected.back().set_num_blocks(expected.back().num_blocks() + 1);
+      } else {
+        expected.push_back(ExtentForRange(*it, 1));
+      }
+    }
+    vector<Extent> actual = ranges.GetExtentsForBlockCount(ranges.blocks());
+    ASSERT_EQ(expected.size(), actual.size());
+    for (size_t j = 0; j < expected.size(); j++) {
+      ASSERT_EQ(expected[j].start_block(), actual[j].start_block());
+      ASSERT_EQ(expected[j].num_blocks(), actual[j].num_blocks());
+    }
+  }
+}
+
 }  // namespace chromeos_update_engine
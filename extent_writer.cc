@@ -4,6 +4,10 @@
 
 #include "update_engine/extent_writer.h"
 #include <errno.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <algorithm>
 #include "update_engine/graph_types.h"
@@ -13,11 +17,46 @@ using std::min;
 
 namespace chromeos_update_engine {
 
+namespace {
+
+bool IsZeroBlock(const char* block, size_t size) {
+  return block[0] == 0 && memcmp(block, block + 1, size - 1) == 0;
+}
+
+}  // namespace {}
+
+const size_t DirectExtentWriter::kMinHoleSize;
+
+bool DirectExtentWriter::Init(int fd,
+                              const std::vector<Extent>& extents,
+                              uint32_t block_size) {
+  fd_ = fd;
+  block_size_ = block_size;
+  extents_ = extents;
+  struct stat stbuf;
+  punch_holes_ = block_size > 0 && fstat(fd, &stbuf) == 0 &&
+      S_ISREG(stbuf.st_mode);
+  file_size_ = punch_holes_ ? stbuf.st_size : 0;
+  return true;
+}
+
 bool DirectExtentWriter::Write(const void* bytes, size_t count) {
+  bool success = WriteRuns(reinterpret_cast<const char*>(bytes), count);
+  // The caller's data may go away once this returns.
+  if (caller_data_queued_)
+    success = WaitInFlight() && success;
+  return success;
+}
+
+bool DirectExtentWriter::WriteRuns(const char* c_bytes, size_t count) {
   if (count == 0)
     return true;
-  const char* c_bytes = reinterpret_cast<const char*>(bytes);
   size_t bytes_written = 0;
+  // The data for extents that follow each other on disk is contiguous in
+  // |bytes| too, so it's written in a single run.
+  const char* run = NULL;
+  size_t run_size = 0;
+  off64_t run_offset = 0;
   while (count - bytes_written > 0) {
     TEST_AND_RETURN_FALSE(next_extent_index_ < extents_.size());
     uint64_t bytes_remaining_next_extent =
@@ -33,10 +72,15 @@ bool DirectExtentWriter::Write(const void* bytes, size_t count) {
       const off64_t offset =
           extents_[next_extent_index_].start_block() * block_size_ +
           extent_bytes_written_;
-      TEST_AND_RETURN_FALSE_ERRNO(lseek64(fd_, offset, SEEK_SET) !=
-                                  static_cast<off64_t>(-1));
-      TEST_AND_RETURN_FALSE(
-          utils::WriteAll(fd_, c_bytes + bytes_written, bytes_to_write));
+      if (run && run_offset + static_cast<off64_t>(run_size) == offset) {
+        run_size += bytes_to_write;
+      } else {
+        if (run)
+          TEST_AND_RETURN_FALSE(WriteRun(run, run_size, run_offset));
+        run = c_bytes + bytes_written;
+        run_size = bytes_to_write;
+        run_offset = offset;
+      }
     }
     bytes_written += bytes_to_write;
     extent_bytes_written_ += bytes_to_write;
@@ -49,7 +93,186 @@ bool DirectExtentWriter::Write(const void* bytes, size_t count) {
       next_extent_index_++;
     }
   }
+  if (run)
+    TEST_AND_RETURN_FALSE(WriteRun(run, run_size, run_offset));
+  return true;
+}
+
+bool DirectExtentWriter::EndImpl() {
+  bool success = FlushPending();
+  success = WaitInFlight() && success;
+  ReleasePendingBuffer();
+  return success;
+}
+
+bool DirectExtentWriter::WriteRun(const char* bytes,
+                                  size_t count,
+                                  off64_t offset) {
+  // Positioned writes leave the file offset alone, so several writers
+  // may share |fd_|.
+  if (coalesce_size_ == 0)
+    return WriteOut(fd_, bytes, count, offset, io_ != NULL, true);
+
+  if (pending_size_ > 0 &&
+      pending_offset_ + static_cast<off64_t>(pending_size_) != offset)
+    TEST_AND_RETURN_FALSE(FlushPending());
+  while (count > 0) {
+    size_t chunk_size;
+    if (!pool_ && pending_size_ == 0 && count >= coalesce_size_) {
+      // No point in copying whole chunks, unless they have to be written
+      // from aligned memory.
+      chunk_size = count - count % coalesce_size_;
+      TEST_AND_RETURN_FALSE(WriteOut(fd_, bytes, chunk_size, offset,
+                                     io_ != NULL, true));
+    } else {
+      TEST_AND_RETURN_FALSE(GetPendingBuffer());
+      if (pending_size_ == 0)
+        pending_offset_ = offset;
+      chunk_size = min(count, coalesce_size_ - pending_size_);
+      memcpy(pending_buffer_ + pending_size_, bytes, chunk_size);
+      pending_size_ += chunk_size;
+      if (pending_size_ == coalesce_size_)
+        TEST_AND_RETURN_FALSE(FlushPending());
+    }
+    bytes += chunk_size;
+    count -= chunk_size;
+    offset += chunk_size;
+  }
   return true;
 }
 
+bool DirectExtentWriter::WriteOut(int fd,
+                                  const char* bytes,
+                                  size_t count,
+                                  off64_t offset,
+                                  bool queue,
+                                  bool caller_data) {
+  // The bytes up to |done| are taken care of. Only whole blocks are punched
+  // out, and the runs are looked for from |hole| on.
+  size_t done = 0;
+  size_t hole = (block_size_ - offset % block_size_) % block_size_;
+  while (punch_holes_ && hole + kMinHoleSize <= count) {
+    size_t hole_end = hole;
+    while (hole_end + block_size_ <= count &&
+           IsZeroBlock(bytes + hole_end, block_size_))
+      hole_end += block_size_;
+    // Holes keep the size of the file, so a run that reaches past its end
+    // has its last block written to extend it.
+    if (hole_end > hole && !WithinFile(offset + hole_end))
+      hole_end -= block_size_;
+    if (hole_end - hole < kMinHoleSize) {
+      hole = hole_end + block_size_;
+      continue;
+    }
+    if (!PunchHole(offset + hole, hole_end - hole))
+      break;
+    TEST_AND_RETURN_FALSE(WriteRange(fd, bytes + done, hole - done,
+                                     offset + done, queue, caller_data));
+    done = hole = hole_end;
+  }
+  return WriteRange(fd, bytes + done, count - done, offset + done, queue,
+                    caller_data);
+}
+
+bool DirectExtentWriter::WriteRange(int fd,
+                                    const char* bytes,
+                                    size_t count,
+                                    off64_t offset,
+                                    bool queue,
+                                    bool caller_data) {
+  if (count == 0)
+    return true;
+  if (!queue)
+    return utils::PWriteAll(fd, bytes, count, offset);
+  io_->AddWrite(fd, bytes, count, offset);
+  io_->Submit();
+  if (caller_data)
+    caller_data_queued_ = true;
+  return true;
+}
+
+bool DirectExtentWriter::WithinFile(off64_t end) {
+  if (end <= file_size_)
+    return true;
+  struct stat stbuf;
+  if (fstat(fd_, &stbuf) == 0)
+    file_size_ = stbuf.st_size;
+  return end <= file_size_;
+}
+
+bool DirectExtentWriter::PunchHole(off64_t offset, size_t count) {
+  if (fallocate(fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset,
+                count) == 0)
+    return true;
+  // The zeros are written instead from now on.
+  PLOG(WARNING) << "Unable to punch holes, writing zeros instead";
+  punch_holes_ = false;
+  return false;
+}
+
+bool DirectExtentWriter::GetPendingBuffer() {
+  if (pending_buffer_)
+    return true;
+  if (pool_) {
+    pending_buffer_ = pool_->Get();
+    // Out of memory, the buffers in flight are reused.
+    if (!pending_buffer_ && !in_flight_buffers_.empty()) {
+      TEST_AND_RETURN_FALSE(WaitInFlight());
+      pending_buffer_ = pool_->Get();
+    }
+  }
+  pending_buffer_pooled_ = pending_buffer_ != NULL;
+  if (!pending_buffer_) {
+    pending_storage_.resize(coalesce_size_);
+    pending_buffer_ = &pending_storage_[0];
+  }
+  return true;
+}
+
+bool DirectExtentWriter::FlushPending() {
+  if (pending_size_ == 0)
+    return true;
+  int fd = fd_;
+  if (direct_fd_ >= 0 && pending_buffer_pooled_) {
+    const size_t alignment = pool_->alignment();
+    if (pending_offset_ % alignment == 0 && pending_size_ % alignment == 0)
+      fd = direct_fd_;
+  }
+  if (io_ && pending_buffer_pooled_) {
+    // The buffer stays in flight, and the data that follows goes to another.
+    TEST_AND_RETURN_FALSE(WriteOut(fd, pending_buffer_, pending_size_,
+                                   pending_offset_, true, false));
+    in_flight_buffers_.push_back(pending_buffer_);
+    pending_buffer_ = NULL;
+    pending_buffer_pooled_ = false;
+    pending_size_ = 0;
+    if (in_flight_buffers_.size() >= kMaxInFlightBuffers)
+      TEST_AND_RETURN_FALSE(WaitInFlight());
+    return true;
+  }
+  TEST_AND_RETURN_FALSE(WriteOut(fd, pending_buffer_, pending_size_,
+                                 pending_offset_, false, false));
+  pending_size_ = 0;
+  return true;
+}
+
+bool DirectExtentWriter::WaitInFlight() {
+  bool success = true;
+  if (io_ && io_->num_pending() > 0)
+    success = io_->Wait();
+  caller_data_queued_ = false;
+  for (size_t i = 0; i < in_flight_buffers_.size(); i++)
+    pool_->Put(in_flight_buffers_[i]);
+  in_flight_buffers_.clear();
+  return success;
+}
+
+void DirectExtentWriter::ReleasePendingBuffer() {
+  if (pending_buffer_pooled_)
+    pool_->Put(pending_buffer_);
+  pending_buffer_ = NULL;
+  pending_buffer_pooled_ = false;
+  pending_size_ = 0;
+}
+
 }  // namespace chromeos_update_engine
@@ -7,6 +7,10 @@
 
 #include <vector>
 #include "base/logging.h"
+#include "update_engine/aligned_buffer_pool.h"
+#include "update_engine/block_io.h"
+#include "update_engine/io_stats.h"
+#include "update_engine/omaha_hash_calculator.h"
 #include "update_engine/update_metadata.pb.h"
 #include "update_engine/utils.h"
 
@@ -42,7 +46,9 @@ class ExtentWriter {
 };
 
 // DirectExtentWriter is probably the simplest ExtentWriter implementation.
-// It writes the data directly into the extents.
+// It writes the data directly into the extents. In regular files, e.g., the
+// raw disk images of VMs, the runs of zero blocks of at least kMinHoleSize
+// bytes are punched out rather than written, so that the files stay sparse.
 
 class DirectExtentWriter : public ExtentWriter {
  public:
@@ -50,21 +56,111 @@ class DirectExtentWriter : public ExtentWriter {
       : fd_(-1),
         block_size_(0),
         extent_bytes_written_(0),
-        next_extent_index_(0) {}
-  ~DirectExtentWriter() {}
-
-  bool Init(int fd, const std::vector<Extent>& extents, uint32_t block_size) {
-    fd_ = fd;
-    block_size_ = block_size;
-    extents_ = extents;
-    return true;
+        next_extent_index_(0),
+        coalesce_size_(0),
+        direct_fd_(-1),
+        pool_(NULL),
+        io_(NULL),
+        caller_data_queued_(false),
+        pending_buffer_(NULL),
+        pending_buffer_pooled_(false),
+        pending_size_(0),
+        pending_offset_(0),
+        punch_holes_(false),
+        file_size_(0) {}
+  ~DirectExtentWriter() {
+    WaitInFlight();
+    ReleasePendingBuffer();
   }
+
+  bool Init(int fd, const std::vector<Extent>& extents, uint32_t block_size);
   bool Write(const void* bytes, size_t count);
-  bool EndImpl() {
-    return true;
+  bool EndImpl();
+
+  // Makes the writer gather the data of contiguous blocks, also across
+  // Write() calls, and write it out in chunks of |coalesce_size| bytes, which
+  // should be a multiple of the block size. Whatever is left is written by
+  // End(). With the default of 0, each Write() writes its data right away,
+  // although still with one pwrite() per run of contiguous blocks.
+  void set_coalesce_size(size_t coalesce_size) {
+    coalesce_size_ = coalesce_size;
+  }
+
+  // Makes the writer write its data through |direct_fd|, a descriptor for
+  // the same file as the one passed to Init() but opened with O_DIRECT, so
+  // that the written data doesn't fill the page cache. The data is gathered
+  // in buffers from |pool| and written in chunks of the pool's buffer size,
+  // which must be a multiple of the block size. Chunks that don't meet the
+  // pool's alignment, e.g., the tail of a file, go through the regular
+  // descriptor instead. |pool| must outlive the writer.
+  void set_direct_io(int direct_fd, AlignedBufferPool* pool) {
+    direct_fd_ = direct_fd;
+    pool_ = pool;
+    coalesce_size_ = pool->buffer_size();
   }
 
+  // Makes the writer queue its writes on |io| rather than write them one
+  // by one. With set_direct_io(), the full buffers stay in flight while the
+  // next ones are filled, up to kMaxInFlightBuffers of them; the writes of
+  // the caller's data are waited for before Write() returns. |io| is used
+  // by this writer alone until End().
+  void set_block_io(BlockIo* io) { io_ = io; }
+
+  // How many full buffers from the pool may be in flight at once.
+  static const size_t kMaxInFlightBuffers = 8;
+
+  // The shortest run of zero blocks punched out of regular files.
+  static const size_t kMinHoleSize = 64 * 1024;
+
  private:
+  // Writes the data as Write() does, except that the writes of the caller's
+  // data may still be queued on io_.
+  bool WriteRuns(const char* bytes, size_t count);
+
+  // Writes the |count| bytes at |bytes| at |offset| in fd_, or queues them
+  // in pending_ if coalescing.
+  bool WriteRun(const char* bytes, size_t count, off64_t offset);
+
+  // Writes the |count| bytes at |bytes| at |offset| in |fd|, queueing the
+  // write on io_ if |queue|, except for the runs of zero blocks punched out
+  // of fd_ if punch_holes_. |caller_data| is true if |bytes| is the data
+  // passed to Write().
+  bool WriteOut(int fd,
+                const char* bytes,
+                size_t count,
+                off64_t offset,
+                bool queue,
+                bool caller_data);
+
+  // Like WriteOut(), but writes all the bytes.
+  bool WriteRange(int fd,
+                  const char* bytes,
+                  size_t count,
+                  off64_t offset,
+                  bool queue,
+                  bool caller_data);
+
+  // Returns true if fd_ is at least |end| bytes long. Only looks at the
+  // file again if the size last seen is smaller.
+  bool WithinFile(off64_t end);
+
+  // Punches the |count| bytes at |offset| out of fd_. Returns false, and
+  // turns punch_holes_ off, if fd_ can't have holes punched.
+  bool PunchHole(off64_t offset, size_t count);
+
+  // Sets pending_buffer_ up to receive data. Returns false if out of memory.
+  bool GetPendingBuffer();
+
+  // Writes out the pending data.
+  bool FlushPending();
+
+  // Waits for the writes queued on io_ and gives the buffers in flight back
+  // to pool_. Returns true if all the writes succeeded.
+  bool WaitInFlight();
+
+  // Gives the pending buffer back to pool_, if it came from there.
+  void ReleasePendingBuffer();
+
   int fd_;
 
   size_t block_size_;
@@ -73,27 +169,83 @@ class DirectExtentWriter : public ExtentWriter {
   std::vector<Extent> extents_;
   // The next call to write should correspond to extents_[next_extent_index_]
   std::vector<Extent>::size_type next_extent_index_;
+
+  // If non-zero, the size of the chunks written when coalescing.
+  size_t coalesce_size_;
+  // The O_DIRECT descriptor and buffer pool set by set_direct_io().
+  int direct_fd_;
+  AlignedBufferPool* pool_;
+  // The queue set by set_block_io(), or NULL, whether the data passed to
+  // Write() is queued on it, and the full buffers from pool_ being written.
+  BlockIo* io_;
+  bool caller_data_queued_;
+  std::vector<char*> in_flight_buffers_;
+  // When coalescing, a buffer of coalesce_size_ bytes, from pool_ or else
+  // from pending_storage_, holding pending_size_ bytes to be written at
+  // pending_offset_.
+  char* pending_buffer_;
+  bool pending_buffer_pooled_;
+  std::vector<char> pending_storage_;
+  size_t pending_size_;
+  off64_t pending_offset_;
+  // Whether fd_ is a regular file that holes are punched in, and its size
+  // when last looked at. It only grows while being written.
+  bool punch_holes_;
+  off64_t file_size_;
 };
 
+// Calls the Init() and Write() of |writer| directly when its type is known
+// at compile time, so that the writer above it doesn't go through the vtable
+// and can have them inlined, and through the vtable otherwise.
+template <class Writer>
+inline bool InitThrough(Writer* writer,
+                        int fd,
+                        const std::vector<Extent>& extents,
+                        uint32_t block_size) {
+  return writer->Writer::Init(fd, extents, block_size);
+}
+
+template <>
+inline bool InitThrough<ExtentWriter>(ExtentWriter* writer,
+                                      int fd,
+                                      const std::vector<Extent>& extents,
+                                      uint32_t block_size) {
+  return writer->Init(fd, extents, block_size);
+}
+
+template <class Writer>
+inline bool WriteThrough(Writer* writer, const void* bytes, size_t count) {
+  return writer->Writer::Write(bytes, count);
+}
+
+template <>
+inline bool WriteThrough<ExtentWriter>(ExtentWriter* writer,
+                                       const void* bytes,
+                                       size_t count) {
+  return writer->Write(bytes, count);
+}
+
 // Takes an underlying ExtentWriter to which all operations are delegated.
-// When End() is called, ZeroPadExtentWriter ensures that the total number
+// When End() is called, ZeroPadWriter ensures that the total number
 // of bytes written is a multiple of block_size_. If not, it writes zeros
-// to pad as needed.
+// to pad as needed. The underlying writer is of type |Underlying|, or of any
+// type for a ZeroPadExtentWriter.
 
-class ZeroPadExtentWriter : public ExtentWriter {
+template <class Underlying>
+class ZeroPadWriter : public ExtentWriter {
  public:
-  ZeroPadExtentWriter(ExtentWriter* underlying_extent_writer)
+  ZeroPadWriter(Underlying* underlying_extent_writer)
       : underlying_extent_writer_(underlying_extent_writer),
         block_size_(0),
         bytes_written_mod_block_size_(0) {}
-  ~ZeroPadExtentWriter() {}
+  ~ZeroPadWriter() {}
 
   bool Init(int fd, const std::vector<Extent>& extents, uint32_t block_size) {
     block_size_ = block_size;
-    return underlying_extent_writer_->Init(fd, extents, block_size);
+    return InitThrough(underlying_extent_writer_, fd, extents, block_size);
   }
   bool Write(const void* bytes, size_t count) {
-    if (underlying_extent_writer_->Write(bytes, count)) {
+    if (WriteThrough(underlying_extent_writer_, bytes, count)) {
       bytes_written_mod_block_size_ += count;
       bytes_written_mod_block_size_ %= block_size_;
       return true;
@@ -103,19 +255,96 @@ class ZeroPadExtentWriter : public ExtentWriter {
   bool EndImpl() {
     if (bytes_written_mod_block_size_) {
       const size_t write_size = block_size_ - bytes_written_mod_block_size_;
-      std::vector<char> zeros(write_size, 0);
-      TEST_AND_RETURN_FALSE(underlying_extent_writer_->Write(&zeros[0],
-                                                             write_size));
+      ScopedPoolBuffer zeros(write_size);
+      TEST_AND_RETURN_FALSE(zeros.get());
+      zeros.Clear();
+      TEST_AND_RETURN_FALSE(WriteThrough(underlying_extent_writer_,
+                                         zeros.get(),
+                                         write_size));
     }
     return underlying_extent_writer_->End();
   }
 
  private:
-  ExtentWriter* underlying_extent_writer_;  // The underlying ExtentWriter.
+  Underlying* underlying_extent_writer_;  // The underlying ExtentWriter.
   size_t block_size_;
   size_t bytes_written_mod_block_size_;
 };
 
+typedef ZeroPadWriter<ExtentWriter> ZeroPadExtentWriter;
+
+// Takes an underlying ExtentWriter to which all operations are delegated,
+// and adds all the bytes written through it to |hasher|, which must outlive
+// the writer. Placed below a ZeroPadWriter, it hashes exactly the blocks
+// that end up in the extents. As with ZeroPadWriter, the underlying writer
+// is of type |Underlying|, or of any type for a HashExtentWriter.
+
+template <class Underlying>
+class HashWriter : public ExtentWriter {
+ public:
+  HashWriter(Underlying* underlying_extent_writer,
+             OmahaHashCalculator* hasher)
+      : underlying_extent_writer_(underlying_extent_writer),
+        hasher_(hasher) {}
+  ~HashWriter() {}
+
+  bool Init(int fd, const std::vector<Extent>& extents, uint32_t block_size) {
+    return InitThrough(underlying_extent_writer_, fd, extents, block_size);
+  }
+  bool Write(const void* bytes, size_t count) {
+    TEST_AND_RETURN_FALSE(
+        hasher_->Update(reinterpret_cast<const char*>(bytes), count));
+    return WriteThrough(underlying_extent_writer_, bytes, count);
+  }
+  bool EndImpl() {
+    return underlying_extent_writer_->End();
+  }
+
+ private:
+  Underlying* underlying_extent_writer_;  // The underlying ExtentWriter.
+  OmahaHashCalculator* hasher_;
+};
+
+typedef HashWriter<ExtentWriter> HashExtentWriter;
+
+// Takes an underlying ExtentWriter to which all operations are delegated,
+// and counts the Write() calls made through it, their bytes and the time
+// they took in the IoStats of |subsystem|, which must outlive the writer.
+// End() is counted as a sync, since it's where the writers below flush what
+// they hold. As with ZeroPadWriter, the underlying writer is of type
+// |Underlying|, or of any type for an AccountingExtentWriter.
+
+template <class Underlying>
+class AccountingWriter : public ExtentWriter {
+ public:
+  AccountingWriter(Underlying* underlying_extent_writer,
+                   const char* subsystem)
+      : underlying_extent_writer_(underlying_extent_writer),
+        subsystem_(subsystem) {}
+  ~AccountingWriter() {}
+
+  bool Init(int fd, const std::vector<Extent>& extents, uint32_t block_size) {
+    return InitThrough(underlying_extent_writer_, fd, extents, block_size);
+  }
+  bool Write(const void* bytes, size_t count) {
+    const base::TimeTicks start_time = base::TimeTicks::Now();
+    bool success = WriteThrough(underlying_extent_writer_, bytes, count);
+    IoStats::AddCalls(subsystem_, 1, count,
+                      base::TimeTicks::Now() - start_time);
+    return success;
+  }
+  bool EndImpl() {
+    ScopedIoSync sync(subsystem_);
+    return underlying_extent_writer_->End();
+  }
+
+ private:
+  Underlying* underlying_extent_writer_;  // The underlying ExtentWriter.
+  const char* subsystem_;
+};
+
+typedef AccountingWriter<ExtentWriter> AccountingExtentWriter;
+
 }  // namespace chromeos_update_engine
 
 #endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_EXTENT_WRITER_H__
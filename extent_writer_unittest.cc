@@ -4,13 +4,19 @@
 
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <algorithm>
 #include <string>
 #include <vector>
+#include <base/memory/scoped_ptr.h>
 #include <gtest/gtest.h>
+#include "update_engine/aligned_buffer_pool.h"
+#include "update_engine/block_io.h"
+#include "update_engine/extent_ranges.h"
 #include "update_engine/extent_writer.h"
 #include "update_engine/graph_types.h"
+#include "update_engine/omaha_hash_calculator.h"
 #include "update_engine/test_utils.h"
 #include "update_engine/utils.h"
 
@@ -253,4 +259,216 @@ TEST_F(ExtentWriterTest, SparseFileTest) {
   ExpectVectorsEq(expected_data, resultant_data);
 }
 
+TEST_F(ExtentWriterTest, PunchZeroRunsTest) {
+  // The file starts out full of data, which the zero runs have to replace.
+  const size_t kBlocks = 2 * DirectExtentWriter::kMinHoleSize / kBlockSize;
+  vector<char> old_data(kBlocks * kBlockSize, 'x');
+  ASSERT_TRUE(utils::PWriteAll(fd(), &old_data[0], old_data.size(), 0));
+  ASSERT_EQ(0, fsync(fd()));
+
+  // A long zero run in the middle is punched out, while the short one at the
+  // start is written. The one at the end reaches past the end of the file.
+  vector<char> data((kBlocks + 20) * kBlockSize, 0);
+  FillWithData(&data);
+  memset(&data[0], 0, kBlockSize);
+  memset(&data[4 * kBlockSize], 0, DirectExtentWriter::kMinHoleSize);
+  memset(&data[kBlocks * kBlockSize - 2 * kBlockSize], 0, 22 * kBlockSize);
+  vector<Extent> extents;
+  extents.push_back(ExtentForRange(0, kBlocks + 20));
+
+  DirectExtentWriter direct_writer;
+  EXPECT_TRUE(direct_writer.Init(fd(), extents, kBlockSize));
+  EXPECT_TRUE(direct_writer.Write(&data[0], data.size()));
+  EXPECT_TRUE(direct_writer.End());
+
+  vector<char> result_file;
+  EXPECT_TRUE(utils::ReadFile(path(), &result_file));
+  ExpectVectorsEq(data, result_file);
+}
+
+TEST_F(ExtentWriterTest, CoalescedWriteTest) {
+  // Blocks 1 to 6 are contiguous, apart from the hole, and get written in
+  // two-block chunks; block 0 is written by itself.
+  vector<Extent> extents;
+  extents.push_back(ExtentForRange(1, 2));
+  extents.push_back(ExtentForRange(3, 2));
+  extents.push_back(ExtentForRange(kSparseHole, 1));
+  extents.push_back(ExtentForRange(5, 2));
+  extents.push_back(ExtentForRange(0, 1));
+
+  vector<char> data(kBlockSize * 8);
+  FillWithData(&data);
+
+  DirectExtentWriter direct_writer;
+  direct_writer.set_coalesce_size(kBlockSize * 2);
+  EXPECT_TRUE(direct_writer.Init(fd(), extents, kBlockSize));
+  const size_t kChunkSizes[] = { 7, kBlockSize * 3, 100, kBlockSize };
+  size_t bytes_written = 0;
+  for (size_t i = 0; bytes_written < data.size();
+       i = (i + 1) % arraysize(kChunkSizes)) {
+    size_t bytes_to_write = min(data.size() - bytes_written, kChunkSizes[i]);
+    EXPECT_TRUE(direct_writer.Write(&data[bytes_written], bytes_to_write));
+    bytes_written += bytes_to_write;
+  }
+  EXPECT_TRUE(direct_writer.End());
+
+  vector<char> result_file;
+  EXPECT_TRUE(utils::ReadFile(path(), &result_file));
+
+  vector<char> expected_file;
+  expected_file.insert(expected_file.end(),
+                       data.begin() + kBlockSize * 7, data.end());
+  expected_file.insert(expected_file.end(),
+                       data.begin(), data.begin() + kBlockSize * 4);
+  expected_file.insert(expected_file.end(),
+                       data.begin() + kBlockSize * 5,
+                       data.begin() + kBlockSize * 7);
+  ExpectVectorsEq(expected_file, result_file);
+}
+
+TEST_F(ExtentWriterTest, DirectIOWriteTest) {
+  // Not all file systems support O_DIRECT, in which case the regular
+  // descriptor is used for the aligned writes too.
+  int direct_fd = open(path(), O_WRONLY | O_DIRECT);
+  if (direct_fd < 0)
+    direct_fd = open(path(), O_WRONLY);
+  ASSERT_GE(direct_fd, 0);
+
+  vector<Extent> extents;
+  extents.push_back(ExtentForRange(2, 3));
+  extents.push_back(ExtentForRange(0, 1));
+
+  // Blocks 2 and 3 are written as one aligned chunk and block 4 on its own;
+  // the half block at 0 isn't aligned and goes through the regular fd.
+  vector<char> data(kBlockSize * 3 + kBlockSize / 2);
+  FillWithData(&data);
+
+  AlignedBufferPool pool(kBlockSize * 2, kDirectIOAlignment);
+  {
+    DirectExtentWriter direct_writer;
+    direct_writer.set_direct_io(direct_fd, &pool);
+    EXPECT_TRUE(direct_writer.Init(fd(), extents, kBlockSize));
+    EXPECT_TRUE(direct_writer.Write(&data[0], 100));
+    EXPECT_TRUE(direct_writer.Write(&data[100], data.size() - 100));
+    EXPECT_TRUE(direct_writer.End());
+  }
+  EXPECT_EQ(0, close(direct_fd));
+
+  vector<char> result_file;
+  EXPECT_TRUE(utils::ReadFile(path(), &result_file));
+  EXPECT_EQ(kBlockSize * 5, result_file.size());
+  vector<char> expected_file(kBlockSize * 5);
+  copy(data.begin() + kBlockSize * 3, data.end(), expected_file.begin());
+  copy(data.begin(), data.begin() + kBlockSize * 3,
+       expected_file.begin() + kBlockSize * 2);
+  ExpectVectorsEq(expected_file, result_file);
+}
+
+TEST_F(ExtentWriterTest, BlockIoWriteTest) {
+  int direct_fd = open(path(), O_WRONLY | O_DIRECT);
+  if (direct_fd < 0)
+    direct_fd = open(path(), O_WRONLY);
+  ASSERT_GE(direct_fd, 0);
+
+  // The blocks in reverse order, so that nothing is contiguous and more
+  // buffers than may be in flight at once are filled.
+  const uint64_t kNumBlocks = DirectExtentWriter::kMaxInFlightBuffers * 4;
+  vector<Extent> extents;
+  for (uint64_t i = 0; i < kNumBlocks; i++)
+    extents.push_back(ExtentForRange(kNumBlocks - 1 - i, 1));
+  vector<char> data(kBlockSize * kNumBlocks);
+  FillWithData(&data);
+
+  scoped_ptr<BlockIo> io(BlockIo::CreateThreadPool());
+  ASSERT_TRUE(io.get() != NULL);
+  BlockIo* engines[] = { BlockIo::ForCurrentThread(), io.get() };
+  for (size_t engine = 0; engine < arraysize(engines); engine++) {
+    AlignedBufferPool pool(kBlockSize, kDirectIOAlignment);
+    DirectExtentWriter direct_writer;
+    direct_writer.set_direct_io(direct_fd, &pool);
+    direct_writer.set_block_io(engines[engine]);
+    EXPECT_TRUE(direct_writer.Init(fd(), extents, kBlockSize));
+    EXPECT_TRUE(direct_writer.Write(&data[0], 100));
+    EXPECT_TRUE(direct_writer.Write(&data[100], data.size() - 100));
+    EXPECT_TRUE(direct_writer.End());
+
+    vector<char> result_file;
+    EXPECT_TRUE(utils::ReadFile(path(), &result_file));
+    vector<char> expected_file;
+    for (uint64_t i = 0; i < kNumBlocks; i++) {
+      expected_file.insert(expected_file.end(),
+                           data.begin() + kBlockSize * (kNumBlocks - 1 - i),
+                           data.begin() + kBlockSize * (kNumBlocks - i));
+    }
+    ExpectVectorsEq(expected_file, result_file);
+    EXPECT_EQ(0, ftruncate(fd(), 0));
+  }
+  EXPECT_EQ(0, close(direct_fd));
+}
+
+TEST_F(ExtentWriterTest, HashTest) {
+  vector<Extent> extents;
+  Extent extent;
+  extent.set_start_block(1);
+  extent.set_num_blocks(2);
+  extents.push_back(extent);
+
+  vector<char> data(kBlockSize * 2);
+  FillWithData(&data);
+
+  // The padding is hashed along with the data.
+  OmahaHashCalculator hasher;
+  DirectExtentWriter direct_writer;
+  HashExtentWriter hash_writer(&direct_writer, &hasher);
+  ZeroPadExtentWriter zero_pad_writer(&hash_writer);
+  EXPECT_TRUE(zero_pad_writer.Init(fd(), extents, kBlockSize));
+  ASSERT_TRUE(zero_pad_writer.Write(&data[0], data.size() - 9));
+  EXPECT_TRUE(zero_pad_writer.End());
+  ASSERT_TRUE(hasher.Finalize());
+
+  vector<char> result_file;
+  EXPECT_TRUE(utils::ReadFile(path(), &result_file));
+  ASSERT_EQ(kBlockSize * 3, result_file.size());
+  vector<char> expected_hash;
+  EXPECT_TRUE(OmahaHashCalculator::RawHashOfBytes(&result_file[kBlockSize],
+                                                  kBlockSize * 2,
+                                                  &expected_hash));
+  EXPECT_TRUE(expected_hash == hasher.raw_hash());
+}
+
+
+TEST_F(ExtentWriterTest, ComposedTest) {
+  vector<Extent> extents;
+  Extent extent;
+  extent.set_start_block(0);
+  extent.set_num_blocks(2);
+  extents.push_back(extent);
+
+  vector<char> data(kBlockSize + 10);
+  FillWithData(&data);
+
+  // The stages composed at compile time write and hash what the ones
+  // composed through the vtable do.
+  OmahaHashCalculator hasher;
+  DirectExtentWriter direct_writer;
+  HashWriter<DirectExtentWriter> hash_writer(&direct_writer, &hasher);
+  ZeroPadWriter<HashWriter<DirectExtentWriter> > zero_pad_writer(
+      &hash_writer);
+  EXPECT_TRUE(zero_pad_writer.Init(fd(), extents, kBlockSize));
+  ASSERT_TRUE(zero_pad_writer.Write(&data[0], 7));
+  ASSERT_TRUE(zero_pad_writer.Write(&data[7], data.size() - 7));
+  EXPECT_TRUE(zero_pad_writer.End());
+  ASSERT_TRUE(hasher.Finalize());
+
+  vector<char> result_file;
+  EXPECT_TRUE(utils::ReadFile(path(), &result_file));
+  ASSERT_EQ(kBlockSize * 2, result_file.size());
+  vector<char> expected(data);
+  expected.resize(kBlockSize * 2);
+  ExpectVectorsEq(expected, result_file);
+  vector<char> expected_hash;
+  EXPECT_TRUE(OmahaHashCalculator::RawHashOfData(expected, &expected_hash));
+  EXPECT_TRUE(expected_hash == hasher.raw_hash());
+}
+
 }  // namespace chromeos_update_engine
@@ -0,0 +1,180 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/file_fetcher.h"
+
+#include <errno.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+
+#include "update_engine/utils.h"
+
+using std::min;
+using std::string;
+
+namespace chromeos_update_engine {
+
+// Large enough for the reads to go at disk speed, and small enough for the
+// main loop to stay responsive.
+const size_t FileFetcher::kChunkSize = 1024 * 1024;  // 1 MiB
+
+namespace {
+// How often the end of a file that's being followed is read again.
+const guint kFollowIntervalMs = 500;
+}  // namespace {}
+
+FileFetcher::FileFetcher(SystemState* system_state, int fd)
+    : HttpFetcher(system_state),
+      fd_(fd),
+      offset_(0),
+      has_length_(false),
+      length_(0),
+      follow_(false),
+      active_(false),
+      paused_(false),
+      read_source_id_(0),
+      terminated_source_id_(0),
+      bytes_downloaded_(0) {}
+
+FileFetcher::~FileFetcher() {
+  CancelRead();
+  if (terminated_source_id_)
+    g_source_remove(terminated_source_id_);
+  if (fd_ >= 0)
+    close(fd_);
+}
+
+void FileFetcher::SetOffset(off_t offset) {
+  offset_ = offset;
+  if (delegate_)
+    delegate_->SeekToOffset(offset);
+}
+
+void FileFetcher::SetLength(size_t length) {
+  has_length_ = true;
+  length_ = length;
+}
+
+void FileFetcher::UnsetLength() {
+  has_length_ = false;
+  length_ = 0;
+}
+
+void FileFetcher::BeginTransfer(const string& url) {
+  CHECK(!active_) << "BeginTransfer but already active.";
+  http_response_code_ = 0;
+  active_ = true;
+  if (!paused_)
+    ScheduleRead();
+}
+
+void FileFetcher::TerminateTransfer() {
+  active_ = false;
+  CancelRead();
+  if (!terminated_source_id_) {
+    terminated_source_id_ =
+        g_idle_add(&FileFetcher::StaticTerminatedCallback, this);
+  }
+}
+
+void FileFetcher::Pause() {
+  paused_ = true;
+  CancelRead();
+}
+
+void FileFetcher::Unpause() {
+  paused_ = false;
+  if (active_)
+    ScheduleRead();
+}
+
+void FileFetcher::ScheduleRead() {
+  if (!read_source_id_)
+    read_source_id_ = g_idle_add(&FileFetcher::StaticReadCallback, this);
+}
+
+void FileFetcher::CancelRead() {
+  if (read_source_id_) {
+    g_source_remove(read_source_id_);
+    read_source_id_ = 0;
+  }
+}
+
+gboolean FileFetcher::StaticReadCallback(gpointer data) {
+  reinterpret_cast<FileFetcher*>(data)->ReadCallback();
+  return FALSE;  // The next read, if any, has its own source.
+}
+
+void FileFetcher::ReadCallback() {
+  read_source_id_ = 0;
+  const size_t count = has_length_ ? min(length_, kChunkSize) : kChunkSize;
+  ssize_t rc = 0;
+  char* buffer = NULL;
+  bool lent = false;
+  if (count > 0) {
+    buffer = delegate_ ? delegate_->GetReceiveBuffer(this, count) : NULL;
+    lent = buffer != NULL;
+    if (!lent) {
+      buffer_.resize(kChunkSize);
+      buffer = &buffer_[0];
+    }
+    do {
+      rc = pread(fd_, buffer, count, offset_);
+    } while (rc < 0 && errno == EINTR);
+  }
+  if (rc == 0 && follow_ && (!has_length_ || length_ > 0)) {
+    // The data may still be coming. Once the writer is done, whatever it
+    // wrote last is read before the transfer completes.
+    if (utils::IsFileLockedByOther(fd_)) {
+      read_source_id_ = g_timeout_add(kFollowIntervalMs,
+                                      &FileFetcher::StaticReadCallback, this);
+    } else {
+      follow_ = false;
+      ScheduleRead();
+    }
+    return;
+  }
+  if (rc <= 0) {
+    // The range is complete, or the file ends before it does.
+    PLOG_IF(ERROR, rc < 0) << "Unable to read at offset " << offset_;
+    const bool successful = rc == 0 && (!has_length_ || length_ == 0);
+    active_ = false;
+    http_response_code_ = successful ? kHttpResponseOk : 0;
+    // Note that after the callback returns this object may be destroyed.
+    if (delegate_)
+      delegate_->TransferComplete(this, successful);
+    return;
+  }
+  offset_ += rc;
+  if (has_length_)
+    length_ -= rc;
+  bytes_downloaded_ += rc;
+  if (delegate_) {
+    if (lent)
+      delegate_->ReceivedBytesInBuffer(this, rc);
+    else
+      delegate_->ReceivedBytes(this, buffer, rc);
+  }
+  // The delegate may have paused or terminated the transfer.
+  if (active_ && !paused_)
+    ScheduleRead();
+}
+
+gboolean FileFetcher::StaticTerminatedCallback(gpointer data) {
+  FileFetcher* fetcher = reinterpret_cast<FileFetcher*>(data);
+  fetcher->terminated_source_id_ = 0;
+  fetcher->TerminatedCallback();
+  return FALSE;  // Don't call this callback again.
+}
+
+void FileFetcher::TerminatedCallback() {
+  // Note that after the callback returns this object may be destroyed.
+  if (delegate_)
+    delegate_->TransferTerminated(this);
+}
+
+}  // namespace chromeos_update_engine
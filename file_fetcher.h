@@ -0,0 +1,96 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_FILE_FETCHER_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_FILE_FETCHER_H__
+
+#include <string>
+#include <vector>
+
+#include <glib.h>
+
+#include "update_engine/http_fetcher.h"
+
+// An HttpFetcher that reads a local file, such as a payload spooled to the
+// peer cache, instead of downloading a URL. The file is read with pread()
+// in large chunks, straight into the delegate's buffer when it lends one,
+// one chunk per main loop iteration, so the transfer can still be paused
+// and terminated like a download. A file that another process is writing,
+// like the partial copy of a payload another update_engine instance of the
+// host is downloading to the shared cache, can be followed as it grows.
+
+namespace chromeos_update_engine {
+
+class FileFetcher : public HttpFetcher {
+ public:
+  // The most bytes read and passed to the delegate at a time.
+  static const size_t kChunkSize;
+
+  // Reads the file open at |fd|, which is closed on destruction.
+  FileFetcher(SystemState* system_state, int fd);
+  virtual ~FileFetcher();
+
+  virtual void SetOffset(off_t offset);
+  virtual void SetLength(size_t length);
+  virtual void UnsetLength();
+
+  // Makes the fetcher wait for the file to grow when it reaches its end, for
+  // as long as another process holds an exclusive flock() lock on it, as
+  // PeerCache does on the partial copy it writes. The file is then read to
+  // its end. Must be called before BeginTransfer().
+  void set_follow(bool follow) { follow_ = follow; }
+
+  // Reads the file from the offset set last. The |url| is ignored.
+  virtual void BeginTransfer(const std::string& url);
+
+  virtual void TerminateTransfer();
+  virtual void Pause();
+  virtual void Unpause();
+
+  virtual size_t GetBytesDownloaded() { return bytes_downloaded_; }
+
+ private:
+  // Adds the main loop source that reads the next chunk, unless there's one.
+  void ScheduleRead();
+  void CancelRead();
+
+  // Reads and passes on the next chunk, or completes the transfer at the end
+  // of the file or of the range. See set_follow().
+  static gboolean StaticReadCallback(gpointer data);
+  void ReadCallback();
+
+  static gboolean StaticTerminatedCallback(gpointer data);
+  void TerminatedCallback();
+
+  int fd_;
+
+  // Where the next chunk is read from and, if |has_length_|, how many bytes
+  // are left to read. The file is read to its end otherwise.
+  off_t offset_;
+  bool has_length_;
+  size_t length_;
+
+  // See set_follow(). Cleared once the file is no longer being written.
+  bool follow_;
+
+  // True from BeginTransfer() until the transfer ends.
+  bool active_;
+  bool paused_;
+
+  // The main loop sources, or 0. The reads wait on a timeout at the end of a
+  // file that's being followed.
+  guint read_source_id_;
+  guint terminated_source_id_;
+
+  // The chunk, when the delegate lends no buffer.
+  std::vector<char> buffer_;
+
+  size_t bytes_downloaded_;
+
+  DISALLOW_COPY_AND_ASSIGN(FileFetcher);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_FILE_FETCHER_H__
@@ -0,0 +1,204 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <base/memory/scoped_ptr.h>
+#include <glib.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/file_fetcher.h"
+#include "update_engine/mock_system_state.h"
+#include "update_engine/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+class FileFetcherTestDelegate : public HttpFetcherDelegate {
+ public:
+  FileFetcherTestDelegate()
+      : loop_(g_main_loop_new(g_main_context_default(), FALSE)),
+        lend_buffer_(false),
+        terminate_(false),
+        completed_(false),
+        successful_(false),
+        terminated_(false) {}
+  ~FileFetcherTestDelegate() {
+    g_main_loop_unref(loop_);
+  }
+
+  virtual void ReceivedBytes(HttpFetcher* fetcher,
+                             const char* bytes,
+                             int length) {
+    EXPECT_FALSE(lend_buffer_);
+    data_.insert(data_.end(), bytes, bytes + length);
+    if (terminate_)
+      fetcher->TerminateTransfer();
+  }
+
+  virtual char* GetReceiveBuffer(HttpFetcher* fetcher, size_t length) {
+    if (!lend_buffer_)
+      return NULL;
+    buffer_.resize(length);
+    return &buffer_[0];
+  }
+
+  virtual void ReceivedBytesInBuffer(HttpFetcher* fetcher, int length) {
+    EXPECT_TRUE(lend_buffer_);
+    data_.insert(data_.end(), buffer_.begin(), buffer_.begin() + length);
+  }
+
+  virtual void TransferComplete(HttpFetcher* fetcher, bool successful) {
+    completed_ = true;
+    successful_ = successful;
+    g_main_loop_quit(loop_);
+  }
+
+  virtual void TransferTerminated(HttpFetcher* fetcher) {
+    terminated_ = true;
+    g_main_loop_quit(loop_);
+  }
+
+  void Run(FileFetcher* fetcher) {
+    fetcher->set_delegate(this);
+    fetcher->BeginTransfer("");
+    g_main_loop_run(loop_);
+  }
+
+  GMainLoop* loop_;
+  bool lend_buffer_;
+  bool terminate_;
+  vector<char> buffer_;
+  vector<char> data_;
+  bool completed_;
+  bool successful_;
+  bool terminated_;
+};
+}  // namespace {}
+
+class FileFetcherTest : public ::testing::Test {
+ public:
+  FileFetcherTest() : writer_fd_(-1) {}
+
+  // Writes the data past the first chunk and closes |writer_fd_|, which
+  // releases its lock.
+  void FinishWriting() {
+    EXPECT_TRUE(utils::PWriteAll(writer_fd_,
+                                 &data_[FileFetcher::kChunkSize],
+                                 data_.size() - FileFetcher::kChunkSize,
+                                 FileFetcher::kChunkSize));
+    close(writer_fd_);
+    writer_fd_ = -1;
+  }
+
+ protected:
+  virtual void SetUp() {
+    data_.resize(FileFetcher::kChunkSize * 5 / 2);
+    for (size_t i = 0; i < data_.size(); i++)
+      data_[i] = i * 31 / 7;
+    ASSERT_TRUE(utils::MakeTempFile("/tmp/FileFetcherTest.XXXXXX", &path_,
+                                    NULL));
+    ASSERT_TRUE(utils::WriteFile(path_.c_str(), &data_[0], data_.size()));
+  }
+
+  virtual void TearDown() {
+    if (writer_fd_ >= 0)
+      close(writer_fd_);
+    unlink(path_.c_str());
+  }
+
+  // Returns a fetcher reading the test file.
+  FileFetcher* NewFetcher() {
+    int fd = open(path_.c_str(), O_RDONLY);
+    EXPECT_GE(fd, 0);
+    return new FileFetcher(&mock_system_state_, fd);
+  }
+
+  MockSystemState mock_system_state_;
+  int writer_fd_;
+  string path_;
+  vector<char> data_;
+};
+
+TEST_F(FileFetcherTest, ReadTest) {
+  scoped_ptr<FileFetcher> fetcher(NewFetcher());
+  FileFetcherTestDelegate delegate;
+  delegate.Run(fetcher.get());
+  EXPECT_TRUE(delegate.completed_);
+  EXPECT_TRUE(delegate.successful_);
+  EXPECT_EQ(kHttpResponseOk, fetcher->http_response_code());
+  EXPECT_TRUE(delegate.data_ == data_);
+  EXPECT_EQ(data_.size(), fetcher->GetBytesDownloaded());
+}
+
+TEST_F(FileFetcherTest, RangeTest) {
+  scoped_ptr<FileFetcher> fetcher(NewFetcher());
+  FileFetcherTestDelegate delegate;
+  delegate.lend_buffer_ = true;
+  const size_t kOffset = 100;
+  const size_t kLength = FileFetcher::kChunkSize + 10;
+  fetcher->SetOffset(kOffset);
+  fetcher->SetLength(kLength);
+  delegate.Run(fetcher.get());
+  EXPECT_TRUE(delegate.successful_);
+  EXPECT_TRUE(delegate.data_ == vector<char>(data_.begin() + kOffset,
+                                             data_.begin() + kOffset +
+                                             kLength));
+
+  // A range past the end of the file fails.
+  delegate.data_.clear();
+  fetcher->SetOffset(data_.size() - 10);
+  fetcher->SetLength(20);
+  delegate.Run(fetcher.get());
+  EXPECT_TRUE(delegate.completed_);
+  EXPECT_FALSE(delegate.successful_);
+  EXPECT_EQ(10U, delegate.data_.size());
+}
+
+TEST_F(FileFetcherTest, TerminateTest) {
+  scoped_ptr<FileFetcher> fetcher(NewFetcher());
+  FileFetcherTestDelegate delegate;
+  delegate.terminate_ = true;
+  delegate.Run(fetcher.get());
+  EXPECT_TRUE(delegate.terminated_);
+  EXPECT_FALSE(delegate.completed_);
+  EXPECT_EQ(FileFetcher::kChunkSize, delegate.data_.size());
+}
+
+namespace {
+// Appends the rest of the data to the file the FollowTest fetcher follows
+// and releases the lock on it.
+gboolean FinishWritingCallback(gpointer data) {
+  FileFetcherTest* test = reinterpret_cast<FileFetcherTest*>(data);
+  test->FinishWriting();
+  return FALSE;
+}
+}  // namespace {}
+
+TEST_F(FileFetcherTest, FollowTest) {
+  // The file is written by another process, which holds a lock on it, and
+  // has only the first chunk so far.
+  ASSERT_EQ(0, truncate(path_.c_str(), FileFetcher::kChunkSize));
+  writer_fd_ = open(path_.c_str(), O_WRONLY);
+  ASSERT_GE(writer_fd_, 0);
+  ASSERT_EQ(0, flock(writer_fd_, LOCK_EX));
+  g_timeout_add(100, FinishWritingCallback, this);
+
+  scoped_ptr<FileFetcher> fetcher(NewFetcher());
+  fetcher->set_follow(true);
+  FileFetcherTestDelegate delegate;
+  delegate.Run(fetcher.get());
+  EXPECT_TRUE(delegate.successful_);
+  EXPECT_TRUE(delegate.data_ == data_);
+}
+
+}  // namespace chromeos_update_engine
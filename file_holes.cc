@@ -0,0 +1,96 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/file_holes.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+
+#include "update_engine/utils.h"
+
+using std::make_pair;
+using std::min;
+using std::pair;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+const uint64_t FileHoles::kNoHole = static_cast<uint64_t>(-1);
+
+FileHoles::FileHoles() : block_size_(1), hole_blocks_(0) {}
+
+bool FileHoles::Init(const string& path, uint64_t size, uint64_t block_size) {
+  TEST_AND_RETURN_FALSE(block_size > 0);
+  block_size_ = block_size;
+  holes_.clear();
+  hole_blocks_ = 0;
+  int fd = HANDLE_EINTR(open(path.c_str(), O_RDONLY));
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  ScopedEintrSafeFdCloser fd_closer(&fd);
+
+  off_t offset = 0;
+  while (static_cast<uint64_t>(offset) < size) {
+    off_t data = lseek(fd, offset, SEEK_DATA);
+    if (data < 0) {
+      // No data past |offset| means it's a hole to the end of the file.
+      if (errno == ENXIO) {
+        data = size;
+      } else if (errno == EINVAL && offset == 0) {
+        LOG(INFO) << "Unable to find the holes of " << path;
+        return true;
+      } else {
+        PLOG(ERROR) << "Unable to find the data of " << path << " past "
+                    << offset;
+        return false;
+      }
+    }
+    const uint64_t hole_end = min<uint64_t>(data, size);
+    // Only whole blocks of the hole count.
+    const uint64_t start_block = (offset + block_size - 1) / block_size;
+    const uint64_t end_block = hole_end / block_size;
+    if (end_block > start_block) {
+      holes_.push_back(make_pair(start_block, end_block));
+      hole_blocks_ += end_block - start_block;
+    }
+    if (hole_end >= size)
+      break;
+    offset = lseek(fd, data, SEEK_HOLE);
+    TEST_AND_RETURN_FALSE_ERRNO(offset >= 0);
+  }
+  if (hole_blocks_ > 0) {
+    LOG(INFO) << path << ": " << hole_blocks_ << " blocks in "
+              << holes_.size() << " holes";
+  }
+  return true;
+}
+
+uint64_t FileHoles::HoleBlocksAt(uint64_t block) const {
+  // The last hole starting at or before |block|.
+  vector<pair<uint64_t, uint64_t> >::const_iterator it =
+      std::upper_bound(holes_.begin(), holes_.end(),
+                       make_pair(block, static_cast<uint64_t>(-1)));
+  if (it == holes_.begin())
+    return 0;
+  --it;
+  if (it->second <= block)
+    return 0;
+  return it->second - block;
+}
+
+uint64_t FileHoles::NextHole(uint64_t block) const {
+  if (HoleBlocksAt(block) > 0)
+    return block;
+  vector<pair<uint64_t, uint64_t> >::const_iterator it =
+      std::upper_bound(holes_.begin(), holes_.end(),
+                       make_pair(block, static_cast<uint64_t>(-1)));
+  return it == holes_.end() ? kNoHole : it->first;
+}
+
+}  // namespace chromeos_update_engine
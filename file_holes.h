@@ -0,0 +1,66 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_FILE_HOLES_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_FILE_HOLES_H__
+
+#include <stdint.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <base/basictypes.h>
+
+// The holes of a sparse file, found with lseek(SEEK_DATA/SEEK_HOLE). The
+// images the generator reads are often sparse files with gigabytes of
+// holes, which read as zeros but take no disk space. Knowing where they
+// are, the generator can take them as zeros without reading them.
+
+namespace chromeos_update_engine {
+
+class FileHoles {
+ public:
+  static const uint64_t kNoHole;
+
+  FileHoles();
+
+  // Finds the holes in the first |size| bytes of the file at |path|, only
+  // keeping the whole |block_size|-byte blocks they cover. On filesystems
+  // that don't support SEEK_DATA the file has no holes. Returns true on
+  // success.
+  bool Init(const std::string& path, uint64_t size, uint64_t block_size);
+
+  // Returns the number of hole blocks from |block| on, or 0 if |block|
+  // isn't in a hole.
+  uint64_t HoleBlocksAt(uint64_t block) const;
+
+  // Returns the first hole block from |block| on, or kNoHole if there's
+  // none.
+  uint64_t NextHole(uint64_t block) const;
+
+  // Returns true if the |num_blocks| blocks from |start_block| on are all
+  // in a hole.
+  bool IsHole(uint64_t start_block, uint64_t num_blocks) const {
+    return num_blocks > 0 && HoleBlocksAt(start_block) >= num_blocks;
+  }
+
+  uint64_t block_size() const { return block_size_; }
+
+  // The number of blocks in holes.
+  uint64_t hole_blocks() const { return hole_blocks_; }
+
+ private:
+  uint64_t block_size_;
+
+  // The [start, end) block ranges of the holes, in order and apart.
+  std::vector<std::pair<uint64_t, uint64_t> > holes_;
+  uint64_t hole_blocks_;
+
+  DISALLOW_COPY_AND_ASSIGN(FileHoles);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_FILE_HOLES_H__
@@ -0,0 +1,111 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <base/logging.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/file_holes.h"
+#include "update_engine/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+const uint64_t kHolesBlockSize = 4096;
+}  // namespace {}
+
+class FileHolesTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    ASSERT_TRUE(utils::MakeTempFile("/tmp/FileHolesTest.XXXXXX", &path_,
+                                    NULL));
+  }
+
+  virtual void TearDown() {
+    unlink(path_.c_str());
+  }
+
+  // Writes a block of data at each of |blocks| of a |num_blocks|-block
+  // sparse file.
+  void WriteSparseFile(const vector<uint64_t>& blocks, uint64_t num_blocks) {
+    int fd = open(path_.c_str(), O_WRONLY | O_TRUNC);
+    ASSERT_GE(fd, 0);
+    ScopedFdCloser fd_closer(&fd);
+    const vector<char> data(kHolesBlockSize, 'x');
+    for (size_t i = 0; i < blocks.size(); i++) {
+      ASSERT_EQ(static_cast<ssize_t>(data.size()),
+                pwrite(fd, &data[0], data.size(),
+                       blocks[i] * kHolesBlockSize));
+    }
+    ASSERT_EQ(0, ftruncate(fd, num_blocks * kHolesBlockSize));
+  }
+
+  string path_;
+};
+
+TEST_F(FileHolesTest, SimpleTest) {
+  vector<uint64_t> blocks;
+  blocks.push_back(0);
+  blocks.push_back(40);
+  WriteSparseFile(blocks, 100);
+
+  FileHoles holes;
+  ASSERT_TRUE(holes.Init(path_, 100 * kHolesBlockSize, kHolesBlockSize));
+  // The data is never in a hole.
+  EXPECT_EQ(0, holes.HoleBlocksAt(0));
+  EXPECT_EQ(0, holes.HoleBlocksAt(40));
+  if (holes.hole_blocks() == 0) {
+    LOG(WARNING) << "The filesystem of " << path_ << " reports no holes.";
+    return;
+  }
+  // Filesystems may allocate blocks around the data, so only the middle of
+  // the holes is certain.
+  EXPECT_GE(holes.hole_blocks(), 80);
+  EXPECT_LE(holes.hole_blocks(), 98);
+  EXPECT_GT(holes.HoleBlocksAt(20), 0);
+  EXPECT_LE(holes.HoleBlocksAt(20), 20);
+  EXPECT_EQ(100 - 70, holes.HoleBlocksAt(70));
+  EXPECT_EQ(1, holes.HoleBlocksAt(99));
+  EXPECT_EQ(0, holes.HoleBlocksAt(100));
+  EXPECT_LE(holes.NextHole(1), 20);
+  EXPECT_EQ(70, holes.NextHole(70));
+  EXPECT_GT(holes.NextHole(40), 40);
+  EXPECT_TRUE(holes.IsHole(60, 40));
+  EXPECT_FALSE(holes.IsHole(60, 41));
+  EXPECT_FALSE(holes.IsHole(60, 0));
+}
+
+TEST_F(FileHolesTest, SizeTest) {
+  vector<uint64_t> blocks;
+  blocks.push_back(0);
+  WriteSparseFile(blocks, 100);
+
+  // Only the holes within the size count, and only their whole blocks.
+  FileHoles holes;
+  ASSERT_TRUE(holes.Init(path_, 50 * kHolesBlockSize + 10, kHolesBlockSize));
+  EXPECT_EQ(0, holes.HoleBlocksAt(50));
+  if (holes.hole_blocks() > 0)
+    EXPECT_EQ(50 - 30, holes.HoleBlocksAt(30));
+
+  // A file without holes.
+  blocks.push_back(1);
+  blocks.push_back(2);
+  WriteSparseFile(blocks, 3);
+  ASSERT_TRUE(holes.Init(path_, 3 * kHolesBlockSize, kHolesBlockSize));
+  EXPECT_EQ(0, holes.hole_blocks());
+  EXPECT_EQ(0, holes.HoleBlocksAt(1));
+  EXPECT_EQ(FileHoles::kNoHole, holes.NextHole(0));
+
+  EXPECT_FALSE(holes.Init("/nonexistent-file", 10, kHolesBlockSize));
+}
+
+}  // namespace chromeos_update_engine
@@ -44,4 +44,47 @@ int DirectFileWriter::Close() {
   return rc;
 }
 
+int AccountingFileWriter::Open(const char* path, int flags, mode_t mode) {
+  return writer_->Open(path, flags, mode);
+}
+
+bool AccountingFileWriter::Write(const void* bytes, size_t count) {
+  const base::TimeTicks start_time = base::TimeTicks::Now();
+  bool success = writer_->Write(bytes, count);
+  AddWrite(count, start_time);
+  return success;
+}
+
+bool AccountingFileWriter::Write(const void* bytes,
+                                 size_t count,
+                                 ActionExitCode* error) {
+  const base::TimeTicks start_time = base::TimeTicks::Now();
+  bool success = writer_->Write(bytes, count, error);
+  AddWrite(count, start_time);
+  return success;
+}
+
+char* AccountingFileWriter::GetWriteBuffer(size_t count) {
+  return writer_->GetWriteBuffer(count);
+}
+
+bool AccountingFileWriter::CommitWriteBuffer(size_t count,
+                                             ActionExitCode* error) {
+  const base::TimeTicks start_time = base::TimeTicks::Now();
+  bool success = writer_->CommitWriteBuffer(count, error);
+  AddWrite(count, start_time);
+  return success;
+}
+
+int AccountingFileWriter::Close() {
+  ScopedIoSync sync(subsystem_);
+  return writer_->Close();
+}
+
+void AccountingFileWriter::AddWrite(size_t count,
+                                    base::TimeTicks start_time) {
+  IoStats::AddCalls(subsystem_, 1, count,
+                    base::TimeTicks::Now() - start_time);
+}
+
 }  // namespace chromeos_update_engine
@@ -11,6 +11,7 @@
 #include <unistd.h>
 #include "base/logging.h"
 #include "update_engine/action_processor.h"
+#include "update_engine/io_stats.h"
 #include "update_engine/utils.h"
 
 // FileWriter is a class that is used to (synchronously, for now) write to
@@ -43,6 +44,19 @@ class FileWriter {
      return Write(bytes, count);
   }
 
+  // Optional: writers that keep the data in a buffer of their own may lend
+  // room in it, so that callers can fill it in place instead of passing the
+  // data to Write(). Returns room for at least |count| bytes, or NULL if the
+  // writer doesn't lend buffers or can't take that many bytes right now.
+  virtual char* GetWriteBuffer(size_t count) { return NULL; }
+
+  // Same as Write(), for the first |count| bytes of the room returned by the
+  // last GetWriteBuffer() call.
+  virtual bool CommitWriteBuffer(size_t count, ActionExitCode* error) {
+    *error = kActionCodeDownloadWriteError;
+    return false;
+  }
+
   // Wrapper around close. Returns 0 on success or -errno on error.
   virtual int Close() = 0;
 
@@ -70,6 +84,34 @@ class DirectFileWriter : public FileWriter {
   DISALLOW_COPY_AND_ASSIGN(DirectFileWriter);
 };
 
+// Takes an underlying FileWriter to which all operations are delegated, and
+// counts the writes made through it, their bytes and the time they took in
+// the IoStats of |subsystem|, which must outlive the writer. Close() is
+// counted as a sync. The underlying writer isn't owned.
+
+class AccountingFileWriter : public FileWriter {
+ public:
+  AccountingFileWriter(FileWriter* writer, const char* subsystem)
+      : writer_(writer), subsystem_(subsystem) {}
+  virtual ~AccountingFileWriter() {}
+
+  virtual int Open(const char* path, int flags, mode_t mode);
+  virtual bool Write(const void* bytes, size_t count);
+  virtual bool Write(const void* bytes, size_t count, ActionExitCode* error);
+  virtual char* GetWriteBuffer(size_t count);
+  virtual bool CommitWriteBuffer(size_t count, ActionExitCode* error);
+  virtual int Close();
+
+ private:
+  // Counts a write of |count| bytes that started at |start_time|.
+  void AddWrite(size_t count, base::TimeTicks start_time);
+
+  FileWriter* writer_;
+  const char* subsystem_;
+
+  DISALLOW_COPY_AND_ASSIGN(AccountingFileWriter);
+};
+
 class ScopedFileWriterCloser {
  public:
   explicit ScopedFileWriterCloser(FileWriter* writer) : writer_(writer) {}
@@ -15,12 +15,17 @@
 #include <string>
 #include <vector>
 
+#include <ext2fs/ext2fs.h>
 #include <gio/gio.h>
 #include <gio/gunixinputstream.h>
 #include <gio/gunixoutputstream.h>
 #include <glib.h>
 
 #include "update_engine/filesystem_iterator.h"
+#include "update_engine/io_recorder.h"
+#include "update_engine/memory_tracker.h"
+#include "update_engine/omaha_hash_calculator.h"
+#include "update_engine/probes.h"
 #include "update_engine/subprocess.h"
 #include "update_engine/utils.h"
 
@@ -32,7 +37,37 @@ using std::vector;
 namespace chromeos_update_engine {
 
 namespace {
-const off_t kCopyFileBufferSize = 128 * 1024;
+const size_t kCopyFileBufferSize = 128 * 1024;
+const size_t kCopyQueueDepth = 8;
+
+// Opens |path| for writing with O_DIRECT if |direct_io| is true and the file
+// supports it. Sets |opened_direct_io| accordingly. Returns the descriptor, or
+// a negative value on failure.
+int OpenDestination(const string& path,
+                    bool direct_io,
+                    bool* opened_direct_io) {
+  *opened_direct_io = false;
+  if (direct_io) {
+    int fd = open(path.c_str(), O_WRONLY | O_TRUNC | O_CREAT | O_DIRECT, 0644);
+    if (fd >= 0) {
+      *opened_direct_io = true;
+      return fd;
+    }
+    PLOG(WARNING) << "Unable to open " << path << " with O_DIRECT, writing "
+                  << "it through the page cache";
+  }
+  return open(path.c_str(), O_WRONLY | O_TRUNC | O_CREAT, 0644);
+}
+
+// Returns what the cached hash of the source partition at |path| is prefixed
+// with, which ties it to the partition and to this boot, or "" if the boot
+// can't be told apart from the others.
+string SourceHashPrefix(const string& path) {
+  const string boot_id = utils::GetBootId();
+  if (boot_id.empty())
+    return "";
+  return boot_id + "\n" + path + "\n";
+}
 }  // namespace {}
 
 FilesystemCopierAction::FilesystemCopierAction(
@@ -40,25 +75,30 @@ FilesystemCopierAction::FilesystemCopierAction(
     bool verify_hash)
     : copying_kernel_install_path_(copying_kernel_install_path),
       verify_hash_(verify_hash),
+      hash_only_(false),
+      full_verification_(false),
+      source_hash_cache_(NULL),
+      use_direct_io_(false),
+      dst_direct_io_(false),
       src_stream_(NULL),
       dst_stream_(NULL),
+      buffer_size_(kCopyFileBufferSize),
+      queue_depth_(kCopyQueueDepth),
+      reading_buffer_(NULL),
+      writing_pos_(0),
+      writing_size_(0),
+      read_offset_(0),
+      dst_offset_(0),
+      sparse_copy_(false),
+      block_size_(0),
+      canceller_(NULL),
       read_done_(false),
       failed_(false),
       cancelled_(false),
-      filesystem_size_(kint64max) {
-  // A lot of code works on the implicit assumption that processing is done on
-  // exactly 2 ping-pong buffers.
-  COMPILE_ASSERT(arraysize(buffer_) == 2 &&
-                 arraysize(buffer_state_) == 2 &&
-                 arraysize(buffer_valid_size_) == 2 &&
-                 arraysize(canceller_) == 2,
-                 ping_pong_buffers_not_two);
-  for (int i = 0; i < 2; ++i) {
-    buffer_state_[i] = kBufferStateEmpty;
-    buffer_valid_size_[i] = 0;
-    canceller_[i] = NULL;
-  }
-}
+      suspended_(false),
+      waiting_for_input_(false),
+      complete_pending_(false),
+      filesystem_size_(kint64max) {}
 
 void FilesystemCopierAction::PerformAction() {
   // Will tell the ActionProcessor we've failed if we return.
@@ -68,14 +108,12 @@ void FilesystemCopierAction::PerformAction() {
     LOG(ERROR) << "FilesystemCopierAction missing input object.";
     return;
   }
-  install_plan_ = GetInputObject();
-  if (!verify_hash_ && install_plan_.is_resume) {
-    // No copy or hash verification needed. Done!
-    if (HasOutputPipe())
-      SetOutputObject(install_plan_);
-    abort_action_completer.set_code(kActionCodeSuccess);
-    return;
-  }
+  // The plan isn't read from the input pipe again, but for the hashes of
+  // the other partition if the copier of that one runs concurrently.
+  SwapInputObject(&install_plan_);
+  waiting_for_input_ =
+      !verify_hash_ && processor_->IsRunningEarlierConcurrentActions(this);
+  complete_pending_ = false;
 
   const string destination = copying_kernel_install_path_ ?
       install_plan_.kernel_install_path :
@@ -86,16 +124,68 @@ void FilesystemCopierAction::PerformAction() {
         utils::BootKernelDevice(utils::BootDevice()) :
         utils::BootDevice();
   }
+  if (!verify_hash_) {
+    if (copying_kernel_install_path_)
+      install_plan_.kernel_source_path = source;
+    else
+      install_plan_.source_path = source;
+  }
+  // An action run concurrently with this one starts with the plan as it
+  // is before the source is hashed, or the destination is verified.
+  if (HasOutputPipe())
+    SetOutputObject(install_plan_);
+  if (!verify_hash_ && install_plan_.is_resume) {
+    // No copy or hash verification needed. Done!
+    abort_action_completer.set_should_complete(false);
+    CompleteAction(kActionCodeSuccess);
+    return;
+  }
+  if (verify_hash_ && !full_verification_ &&
+      (copying_kernel_install_path_ ? install_plan_.kernel_verified :
+       install_plan_.rootfs_verified)) {
+    LOG(INFO) << destination << " was verified as it was written, not "
+              << "reading it back.";
+    if (HasOutputPipe())
+      SwapOutputObject(&install_plan_);
+    abort_action_completer.set_code(kActionCodeSuccess);
+    return;
+  }
+  if (!verify_hash_ && hash_only_ && LoadSourceHash(source)) {
+    abort_action_completer.set_should_complete(false);
+    CompleteAction(kActionCodeSuccess);
+    return;
+  }
+  if (buffer_size_ == 0 || buffer_size_ % kDirectIOAlignment != 0 ||
+      queue_depth_ == 0) {
+    LOG(ERROR) << "Invalid copy buffer size " << buffer_size_
+               << " or queue depth " << queue_depth_;
+    return;
+  }
+  if (!buffer_pool_.get()) {
+    buffer_pool_.reset(new AlignedBufferPool(buffer_size_, kDirectIOAlignment));
+    buffer_pool_->set_huge_pages(true);
+  }
+  while (buffers_.size() < queue_depth_) {
+    char* buffer = buffer_pool_->Get();
+    if (!buffer) {
+      LOG(ERROR) << "Unable to allocate the copy buffers.";
+      return;
+    }
+    buffers_.push_back(buffer);
+    empty_buffers_.push_back(buffer);
+  }
+  MemoryTracker::SetBufferSize("copier_buffers",
+                               buffers_.size() * buffer_size_);
+
   int src_fd = open(source.c_str(), O_RDONLY);
   if (src_fd < 0) {
     PLOG(ERROR) << "Unable to open " << source << " for reading:";
     return;
   }
 
-  if (!verify_hash_) {
-    int dst_fd = open(destination.c_str(),
-                      O_WRONLY | O_TRUNC | O_CREAT,
-                    0644);
+  if (!verify_hash_ && !hash_only_) {
+    int dst_fd = OpenDestination(destination, use_direct_io_,
+                                 &dst_direct_io_);
     if (dst_fd < 0) {
       close(src_fd);
       PLOG(ERROR) << "Unable to open " << install_plan_.install_path
@@ -104,15 +194,37 @@ void FilesystemCopierAction::PerformAction() {
     }
 
     dst_stream_ = g_unix_output_stream_new(dst_fd, TRUE);
+    writeback_.Init(dst_fd, IncrementalWriteback::kDefaultChunkSize);
+    IoRecorder::TrackFd(dst_fd, destination);
   }
+  IoRecorder::TrackFd(src_fd, source);
 
   DetermineFilesystemSize(src_fd);
+  if (verify_hash_) {
+    const uint64_t chunk_size = copying_kernel_install_path_ ?
+        install_plan_.kernel_hash_chunk_size :
+        install_plan_.rootfs_hash_chunk_size;
+    if (chunk_size > 0) {
+      hash_pool_.reset(new ThreadPool(0));
+      if (hash_pool_->Init()) {
+        chunk_verifier_.reset(new ChunkHashVerifier(
+            hash_pool_.get(),
+            chunk_size,
+            copying_kernel_install_path_ ?
+            install_plan_.kernel_chunk_hashes :
+            install_plan_.rootfs_chunk_hashes));
+      } else {
+        LOG(WARNING) << "Unable to start the hashing threads, verifying the "
+                     << "hash of the whole partition.";
+        hash_pool_.reset();
+      }
+    }
+  }
+  if (sparse_copy_ && dst_stream_ && !ReadAllocatedBlocks(source))
+    LOG(WARNING) << "Unable to read the block bitmap, copying all blocks.";
   src_stream_ = g_unix_input_stream_new(src_fd, TRUE);
 
-  for (int i = 0; i < 2; i++) {
-    buffer_[i].resize(kCopyFileBufferSize);
-    canceller_[i] = g_cancellable_new();
-  }
+  canceller_ = g_cancellable_new();
 
   // Start the first read.
   SpawnAsyncActions();
@@ -121,71 +233,129 @@ void FilesystemCopierAction::PerformAction() {
 }
 
 void FilesystemCopierAction::TerminateProcessing() {
-  for (int i = 0; i < 2; i++) {
-    if (canceller_[i]) {
-      g_cancellable_cancel(canceller_[i]);
+  if (canceller_) {
+    g_cancellable_cancel(canceller_);
+    // A suspended action has no callback pending to clean up from.
+    if (suspended_ && !reading_buffer_ && !writing_buffer_.data) {
+      cancelled_ = true;
+      Cleanup(kActionCodeError);
     }
   }
 }
 
+void FilesystemCopierAction::SuspendAction() {
+  suspended_ = true;
+}
+
+void FilesystemCopierAction::ResumeAction() {
+  suspended_ = false;
+  // The reads and writes in flight spawn the next ones when they're done.
+  if (src_stream_ && !reading_buffer_ && !writing_buffer_.data)
+    SpawnAsyncActions();
+}
+
 bool FilesystemCopierAction::IsCleanupPending() const {
   return (src_stream_ != NULL);
 }
 
 void FilesystemCopierAction::Cleanup(ActionExitCode code) {
-  for (int i = 0; i < 2; i++) {
-    g_object_unref(canceller_[i]);
-    canceller_[i] = NULL;
-  }
+  g_object_unref(canceller_);
+  canceller_ = NULL;
+  chunk_verifier_.reset();
+  hash_pool_.reset();
+  for (size_t i = 0; i < buffers_.size(); i++)
+    buffer_pool_->Put(buffers_[i]);
+  buffers_.clear();
+  empty_buffers_.clear();
+  full_buffers_.clear();
+  IoRecorder::ForgetFd(
+      g_unix_input_stream_get_fd(G_UNIX_INPUT_STREAM(src_stream_)));
   g_object_unref(src_stream_);
   src_stream_ = NULL;
   if (dst_stream_) {
+    // Most of the partition is on disk already, so this doesn't take long.
+    if (!writeback_.Finish() && code == kActionCodeSuccess)
+      code = kActionCodeError;
+    IoRecorder::ForgetFd(
+        g_unix_output_stream_get_fd(G_UNIX_OUTPUT_STREAM(dst_stream_)));
     g_object_unref(dst_stream_);
     dst_stream_ = NULL;
   }
   if (cancelled_)
     return;
+  CompleteAction(code);
+}
+
+void FilesystemCopierAction::CompleteAction(ActionExitCode code) {
+  if (code == kActionCodeSuccess && waiting_for_input_) {
+    LOG(INFO) << "Waiting for the actions running concurrently with this one.";
+    complete_pending_ = true;
+    return;
+  }
   if (code == kActionCodeSuccess && HasOutputPipe())
-    SetOutputObject(install_plan_);
+    SwapOutputObject(&install_plan_);
   processor_->ActionComplete(this, code);
 }
 
+void FilesystemCopierAction::ConcurrentActionsCompleted() {
+  if (!waiting_for_input_)
+    return;
+  waiting_for_input_ = false;
+  // Picks up the source and the hash of the other partition.
+  const InstallPlan& plan = GetInputObject();
+  if (copying_kernel_install_path_) {
+    install_plan_.source_path = plan.source_path;
+    install_plan_.rootfs_hash = plan.rootfs_hash;
+  } else {
+    install_plan_.kernel_source_path = plan.kernel_source_path;
+    install_plan_.kernel_hash = plan.kernel_hash;
+  }
+  if (complete_pending_) {
+    complete_pending_ = false;
+    CompleteAction(kActionCodeSuccess);
+  }
+}
+
 void FilesystemCopierAction::AsyncReadReadyCallback(GObject *source_object,
                                                     GAsyncResult *res) {
-  int index = buffer_state_[0] == kBufferStateReading ? 0 : 1;
-  CHECK(buffer_state_[index] == kBufferStateReading);
+  CHECK(reading_buffer_);
+  char* buffer = reading_buffer_;
+  reading_buffer_ = NULL;
 
   GError* error = NULL;
-  CHECK(canceller_[index]);
-  cancelled_ = g_cancellable_is_cancelled(canceller_[index]) == TRUE;
+  CHECK(canceller_);
+  cancelled_ = g_cancellable_is_cancelled(canceller_) == TRUE;
 
   ssize_t bytes_read = g_input_stream_read_finish(src_stream_, res, &error);
   if (bytes_read < 0) {
     LOG(ERROR) << "Read failed: " << utils::GetAndFreeGError(&error);
     failed_ = true;
-    buffer_state_[index] = kBufferStateEmpty;
+    empty_buffers_.push_back(buffer);
   } else if (bytes_read == 0) {
     read_done_ = true;
-    buffer_state_[index] = kBufferStateEmpty;
+    empty_buffers_.push_back(buffer);
   } else {
-    buffer_valid_size_[index] = bytes_read;
-    buffer_state_[index] = kBufferStateFull;
+    FullBuffer full_buffer;
+    full_buffer.data = buffer;
+    full_buffer.offset = read_offset_;
+    full_buffer.size = bytes_read;
+    read_offset_ += bytes_read;
     filesystem_size_ -= bytes_read;
-  }
-  SpawnAsyncActions();
-
-  if (bytes_read > 0) {
-    // If read_done_ is set, SpawnAsyncActions may finalize the hash so the hash
-    // update below would happen too late.
-    CHECK(!read_done_);
-    if (!hasher_.Update(buffer_[index].data(), bytes_read)) {
+    // This only queues a copy of the data for the hashing thread(s). A
+    // chunk that doesn't match is reported once all were read.
+    if (chunk_verifier_.get()) {
+      chunk_verifier_->Update(buffer, bytes_read);
+    } else if (!hasher_.Update(buffer, bytes_read)) {
       LOG(ERROR) << "Unable to update the hash.";
       failed_ = true;
     }
-    if (verify_hash_) {
-      buffer_state_[index] = kBufferStateEmpty;
+    if (!dst_stream_) {
+      empty_buffers_.push_back(buffer);
+    } else {
+      full_buffers_.push_back(full_buffer);
     }
   }
+  SpawnAsyncActions();
 }
 
 void FilesystemCopierAction::StaticAsyncReadReadyCallback(
@@ -198,26 +368,32 @@ void FilesystemCopierAction::StaticAsyncReadReadyCallback(
 
 void FilesystemCopierAction::AsyncWriteReadyCallback(GObject *source_object,
                                                      GAsyncResult *res) {
-  int index = buffer_state_[0] == kBufferStateWriting ? 0 : 1;
-  CHECK(buffer_state_[index] == kBufferStateWriting);
-  buffer_state_[index] = kBufferStateEmpty;
+  CHECK(writing_buffer_.data);
 
   GError* error = NULL;
-  CHECK(canceller_[index]);
-  cancelled_ = g_cancellable_is_cancelled(canceller_[index]) == TRUE;
+  CHECK(canceller_);
+  cancelled_ = g_cancellable_is_cancelled(canceller_) == TRUE;
 
   ssize_t bytes_written = g_output_stream_write_finish(dst_stream_,
                                                        res,
                                                        &error);
 
-  if (bytes_written < static_cast<ssize_t>(buffer_valid_size_[index])) {
+  if (bytes_written < static_cast<ssize_t>(writing_size_)) {
     if (bytes_written < 0) {
       LOG(ERROR) << "Write error: " << utils::GetAndFreeGError(&error);
     } else {
       LOG(ERROR) << "Wrote too few bytes: " << bytes_written
-                 << " < " << buffer_valid_size_[index];
+                 << " < " << writing_size_;
     }
     failed_ = true;
+  } else {
+    UE_PROBE1(copier_buffer_done, static_cast<uint64_t>(writing_size_));
+    writeback_.AddWrite(dst_offset_ - writing_size_, writing_size_);
+    writeback_.Writeback();
+  }
+  if (failed_ || cancelled_ || !SpawnWrite()) {
+    empty_buffers_.push_back(writing_buffer_.data);
+    writing_buffer_ = FullBuffer();
   }
 
   SpawnAsyncActions();
@@ -231,55 +407,65 @@ void FilesystemCopierAction::StaticAsyncWriteReadyCallback(
       AsyncWriteReadyCallback(source_object, res);
 }
 
+void FilesystemCopierAction::DisableDirectIO() {
+  // O_DIRECT writes must be a multiple of the block size, which the tail of
+  // the copy may not be.
+  int fd = g_unix_output_stream_get_fd(G_UNIX_OUTPUT_STREAM(dst_stream_));
+  int flags = fcntl(fd, F_GETFL);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags & ~O_DIRECT) < 0)
+    PLOG(WARNING) << "Unable to clear O_DIRECT on the destination";
+  dst_direct_io_ = false;
+}
+
 void FilesystemCopierAction::SpawnAsyncActions() {
-  bool reading = false;
-  bool writing = false;
-  for (int i = 0; i < 2; i++) {
-    if (buffer_state_[i] == kBufferStateReading) {
-      reading = true;
-    }
-    if (buffer_state_[i] == kBufferStateWriting) {
-      writing = true;
+  // Buffers with nothing to copy are done with right away, so they may be
+  // read into again below.
+  while (!failed_ && !cancelled_ && !suspended_ && !writing_buffer_.data &&
+         !full_buffers_.empty()) {
+    writing_buffer_ = full_buffers_.front();
+    writing_pos_ = 0;
+    full_buffers_.pop_front();
+    if (!SpawnWrite()) {
+      empty_buffers_.push_back(writing_buffer_.data);
+      writing_buffer_ = FullBuffer();
     }
   }
   if (failed_ || cancelled_) {
-    if (!reading && !writing) {
+    if (!reading_buffer_ && !writing_buffer_.data) {
       Cleanup(kActionCodeError);
     }
     return;
   }
-  for (int i = 0; i < 2; i++) {
-    if (!reading && !read_done_ && buffer_state_[i] == kBufferStateEmpty) {
-      int64_t bytes_to_read = std::min(static_cast<int64_t>(buffer_[0].size()),
-                                       filesystem_size_);
-      g_input_stream_read_async(
-          src_stream_,
-          buffer_[i].data(),
-          bytes_to_read,
-          G_PRIORITY_DEFAULT,
-          canceller_[i],
-          &FilesystemCopierAction::StaticAsyncReadReadyCallback,
-          this);
-      reading = true;
-      buffer_state_[i] = kBufferStateReading;
-    } else if (!writing && !verify_hash_ &&
-               buffer_state_[i] == kBufferStateFull) {
-      g_output_stream_write_async(
-          dst_stream_,
-          buffer_[i].data(),
-          buffer_valid_size_[i],
-          G_PRIORITY_DEFAULT,
-          canceller_[i],
-          &FilesystemCopierAction::StaticAsyncWriteReadyCallback,
-          this);
-      writing = true;
-      buffer_state_[i] = kBufferStateWriting;
-    }
+  if (suspended_)
+    return;
+  if (!reading_buffer_ && !read_done_ && !empty_buffers_.empty()) {
+    reading_buffer_ = empty_buffers_.front();
+    empty_buffers_.pop_front();
+    int64_t bytes_to_read =
+        std::min(static_cast<int64_t>(buffer_size_), filesystem_size_);
+    IoRecorder::RecordRead(
+        g_unix_input_stream_get_fd(G_UNIX_INPUT_STREAM(src_stream_)),
+        read_offset_, bytes_to_read);
+    g_input_stream_read_async(
+        src_stream_,
+        reading_buffer_,
+        bytes_to_read,
+        G_PRIORITY_DEFAULT,
+        canceller_,
+        &FilesystemCopierAction::StaticAsyncReadReadyCallback,
+        this);
   }
-  if (!reading && !writing) {
+  if (!reading_buffer_ && !writing_buffer_.data) {
     // We're done!
     ActionExitCode code = kActionCodeSuccess;
-    if (hasher_.Finalize()) {
+    if (chunk_verifier_.get()) {
+      if (!chunk_verifier_->Finalize()) {
+        code = copying_kernel_install_path_ ?
+            kActionCodeNewKernelVerificationError :
+            kActionCodeNewRootfsVerificationError;
+        LOG(ERROR) << "New partition chunk hash verification failed.";
+      }
+    } else if (hasher_.Finalize()) {
       LOG(INFO) << "Hash: " << hasher_.hash();
       if (verify_hash_) {
         if (copying_kernel_install_path_) {
@@ -296,8 +482,10 @@ void FilesystemCopierAction::SpawnAsyncActions() {
       } else {
         if (copying_kernel_install_path_) {
           install_plan_.kernel_hash = hasher_.raw_hash();
+          StoreSourceHash(install_plan_.kernel_source_path);
         } else {
           install_plan_.rootfs_hash = hasher_.raw_hash();
+          StoreSourceHash(install_plan_.source_path);
         }
       }
     } else {
@@ -308,6 +496,129 @@ void FilesystemCopierAction::SpawnAsyncActions() {
   }
 }
 
+bool FilesystemCopierAction::SpawnWrite() {
+  // Skips to the next block to copy and extends the write over the blocks
+  // to copy that follow it.
+  const off_t end = writing_buffer_.offset + writing_buffer_.size;
+  off_t start = writing_buffer_.offset + writing_pos_;
+  while (start < end && !IsBlockCopied(start))
+    start = min(end, static_cast<off_t>((start / block_size_ + 1) *
+                                        block_size_));
+  if (start == end)
+    return false;
+  off_t write_end = start;
+  if (allocated_blocks_.empty()) {
+    write_end = end;
+  } else {
+    while (write_end < end && IsBlockCopied(write_end))
+      write_end = min(end, static_cast<off_t>((write_end / block_size_ + 1) *
+                                              block_size_));
+  }
+
+  int fd = g_unix_output_stream_get_fd(G_UNIX_OUTPUT_STREAM(dst_stream_));
+  if (start != dst_offset_ && lseek(fd, start, SEEK_SET) != start) {
+    PLOG(ERROR) << "Unable to seek to " << start << " in the destination";
+    failed_ = true;
+    return false;
+  }
+  writing_pos_ = write_end - writing_buffer_.offset;
+  writing_size_ = write_end - start;
+  dst_offset_ = write_end;
+  IoRecorder::RecordWrite(fd, start, writing_size_);
+  if (dst_direct_io_ && (start % kDirectIOAlignment != 0 ||
+                         writing_size_ % kDirectIOAlignment != 0)) {
+    DisableDirectIO();
+  }
+  g_output_stream_write_async(
+      dst_stream_,
+      writing_buffer_.data + writing_pos_ - writing_size_,
+      writing_size_,
+      G_PRIORITY_DEFAULT,
+      canceller_,
+      &FilesystemCopierAction::StaticAsyncWriteReadyCallback,
+      this);
+  return true;
+}
+
+bool FilesystemCopierAction::LoadSourceHash(const string& source) {
+  if (!source_hash_cache_)
+    return false;
+  const string prefix = SourceHashPrefix(source);
+  string value;
+  if (prefix.empty() ||
+      !source_hash_cache_->GetString(copying_kernel_install_path_ ?
+                                     kPrefsSourceKernelHash :
+                                     kPrefsSourceRootfsHash, &value) ||
+      value.compare(0, prefix.size(), prefix) != 0)
+    return false;
+  vector<char> hash;
+  if (!OmahaHashCalculator::Base64Decode(value.substr(prefix.size()), &hash) ||
+      hash.empty()) {
+    LOG(WARNING) << "Ignoring the invalid cached hash of " << source;
+    return false;
+  }
+  LOG(INFO) << "Using the hash of " << source << " computed earlier in this "
+            << "boot: " << value.substr(prefix.size());
+  if (copying_kernel_install_path_)
+    install_plan_.kernel_hash.swap(hash);
+  else
+    install_plan_.rootfs_hash.swap(hash);
+  return true;
+}
+
+void FilesystemCopierAction::StoreSourceHash(const string& source) {
+  const string prefix = SourceHashPrefix(source);
+  if (!source_hash_cache_ || prefix.empty())
+    return;
+  LOG_IF(WARNING, !source_hash_cache_->SetString(
+      copying_kernel_install_path_ ? kPrefsSourceKernelHash :
+      kPrefsSourceRootfsHash,
+      prefix + hasher_.hash()))
+      << "Unable to cache the hash of " << source;
+}
+
+bool FilesystemCopierAction::IsBlockCopied(off_t offset) const {
+  if (allocated_blocks_.empty())
+    return true;
+  // Whatever is past the file system's last block is copied.
+  off_t block = offset / block_size_;
+  return block >= static_cast<off_t>(allocated_blocks_.size()) ||
+      allocated_blocks_[block];
+}
+
+bool FilesystemCopierAction::ReadAllocatedBlocks(const string& path) {
+  ext2_filsys filsys = NULL;
+  errcode_t error = ext2fs_open(path.c_str(), 0, 0, 0, unix_io_manager,
+                                &filsys);
+  if (error) {
+    LOG(ERROR) << "Unable to open " << path << " as ext2: " << error;
+    return false;
+  }
+  ScopedExt2fsCloser filsys_closer(filsys);
+  error = ext2fs_read_block_bitmap(filsys);
+  if (error) {
+    LOG(ERROR) << "Unable to read the block bitmap of " << path << ": "
+               << error;
+    return false;
+  }
+  // The blocks before the first data block, i.e., the boot block of file
+  // systems with 1 KiB blocks, aren't in the bitmap and are copied.
+  const blk_t block_count = filsys->super->s_blocks_count;
+  allocated_blocks_.assign(block_count, true);
+  size_t num_allocated = filsys->super->s_first_data_block;
+  for (blk_t block = filsys->super->s_first_data_block; block < block_count;
+       block++) {
+    allocated_blocks_[block] =
+        ext2fs_test_block_bitmap(filsys->block_map, block) != 0;
+    if (allocated_blocks_[block])
+      num_allocated++;
+  }
+  block_size_ = filsys->blocksize;
+  LOG(INFO) << "Copying the " << num_allocated << " of " << block_count
+            << " blocks in use.";
+  return true;
+}
+
 void FilesystemCopierAction::DetermineFilesystemSize(int fd) {
   if (verify_hash_) {
     filesystem_size_ = copying_kernel_install_path_ ?
@@ -8,19 +8,27 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <deque>
 #include <string>
 #include <vector>
 
+#include <base/memory/scoped_ptr.h>
 #include <gio/gio.h>
 #include <glib.h>
 #include <gtest/gtest_prod.h>  // for FRIEND_TEST
 
 #include "update_engine/action.h"
+#include "update_engine/aligned_buffer_pool.h"
+#include "update_engine/async_hash_calculator.h"
+#include "update_engine/chunk_hash_verifier.h"
+#include "update_engine/incremental_writeback.h"
 #include "update_engine/install_plan.h"
-#include "update_engine/omaha_hash_calculator.h"
+#include "update_engine/prefs_interface.h"
+#include "update_engine/thread_pool.h"
 
 // This action will only do real work if it's a delta update. It will
-// copy the root partition to install partition, and then terminate.
+// copy the root partition to install partition, or just hash it, and then
+// terminate.
 
 namespace chromeos_update_engine {
 
@@ -46,6 +54,15 @@ class FilesystemCopierAction : public Action<FilesystemCopierAction> {
   void PerformAction();
   void TerminateProcessing();
 
+  // Picks up the hash of the other partition from the input object, once
+  // the copier of that partition, running concurrently with and started
+  // before this one, has completed. This one doesn't complete until then.
+  void ConcurrentActionsCompleted();
+
+  // Holds off the next reads and writes once those in flight are done.
+  void SuspendAction();
+  void ResumeAction();
+
   // Used for testing. Return true if Cleanup() has not yet been called due
   // to a callback upon the completion or cancellation of the copier action.
   // A test should wait until IsCleanupPending() returns false before
@@ -55,6 +72,44 @@ class FilesystemCopierAction : public Action<FilesystemCopierAction> {
   // Used for testing, so we can copy from somewhere other than root
   void set_copy_source(const std::string& path) { copy_source_ = path; }
 
+  // Makes the action only compute the hash of the source partition, without
+  // copying it, for updates that are applied from the source partition
+  // itself. Off by default.
+  void set_hash_only(bool hash_only) { hash_only_ = hash_only; }
+
+  // Makes the action write the destination partition with O_DIRECT, so that
+  // copying it doesn't fill the page cache and evict the running system's
+  // working set. Destinations that don't support O_DIRECT are written as
+  // usual.
+  void set_use_direct_io(bool use_direct_io) { use_direct_io_ = use_direct_io; }
+
+  // Sets the size of the copy buffers, which must be a multiple of
+  // kDirectIOAlignment, and how many of them there are. With more than two,
+  // reading can go on while a slow write is pending, until all the buffers
+  // have been read into. Must be called before the action is started.
+  void set_buffer_size(size_t buffer_size) { buffer_size_ = buffer_size; }
+  void set_queue_depth(size_t queue_depth) { queue_depth_ = queue_depth; }
+
+  // Makes the action write only the blocks the ext2 block bitmap of the
+  // source marks as in use. The rest of the destination is left as it is,
+  // since no update reads it. All of the source is still read and hashed.
+  // Sources without an ext2 file system are copied in full. Off by default.
+  void set_sparse_copy(bool sparse_copy) { sparse_copy_ = sparse_copy; }
+
+  // Makes the action keep the hash of the source partition in |prefs| for
+  // the rest of the boot, and take it from there rather than read the whole
+  // partition again when it only hashes it. The source must not change
+  // until the next boot, as the booted partitions don't. Off by default.
+  void set_source_hash_cache(PrefsInterface* prefs) {
+    source_hash_cache_ = prefs;
+  }
+
+  // Makes the verification read the partition back and hash it even if the
+  // install plan says it was verified as it was written. Off by default.
+  void set_full_verification(bool full_verification) {
+    full_verification_ = full_verification;
+  }
+
   // Debugging/logging
   static std::string StaticType() { return "FilesystemCopierAction"; }
   std::string Type() const { return StaticType(); }
@@ -63,16 +118,6 @@ class FilesystemCopierAction : public Action<FilesystemCopierAction> {
   friend class FilesystemCopierActionTest;
   FRIEND_TEST(FilesystemCopierActionTest, RunAsRootDetermineFilesystemSizeTest);
 
-  // Ping-pong buffers generally cycle through the following states:
-  // Empty->Reading->Full->Writing->Empty. In hash verification mode the state
-  // is never set to Writing.
-  enum BufferState {
-    kBufferStateEmpty,
-    kBufferStateReading,
-    kBufferStateFull,
-    kBufferStateWriting
-  };
-
   // Callbacks from glib when the read/write operation is done.
   void AsyncReadReadyCallback(GObject *source_object, GAsyncResult *res);
   static void StaticAsyncReadReadyCallback(GObject *source_object,
@@ -84,15 +129,41 @@ class FilesystemCopierAction : public Action<FilesystemCopierAction> {
                                             GAsyncResult *res,
                                             gpointer user_data);
 
-  // Based on the state of the ping-pong buffers spawns appropriate read/write
-  // actions asynchronously.
+  // Based on the state of the buffers spawns appropriate read/write actions
+  // asynchronously.
   void SpawnAsyncActions();
 
+  // Issues the write of the next run of blocks to copy from
+  // |writing_buffer_|. Returns false if there are none left.
+  bool SpawnWrite();
+
+  // Sets the source hash in |install_plan_| to the one cached for |source|
+  // during this boot, if any. Returns true if there's one.
+  bool LoadSourceHash(const std::string& source);
+
+  // Caches the source hash in |install_plan_| as the one of |source|.
+  void StoreSourceHash(const std::string& source);
+
+  // Returns true if the block of the source at |offset| has to be copied.
+  bool IsBlockCopied(off_t offset) const;
+
+  // Reads the block bitmap of the ext2 file system at |path| into
+  // |allocated_blocks_|. Returns true on success.
+  bool ReadAllocatedBlocks(const std::string& path);
+
+  // Makes the following writes to |dst_stream_| go through the page cache.
+  void DisableDirectIO();
+
   // Cleans up all the variables we use for async operations and tells the
   // ActionProcessor we're done w/ |code| as passed in. |cancelled_| should be
   // true if TerminateProcessing() was called.
   void Cleanup(ActionExitCode code);
 
+  // Passes the install plan on and tells the ActionProcessor we're done w/
+  // |code|, or waits for ConcurrentActionsCompleted() on success if
+  // |waiting_for_input_|.
+  void CompleteAction(ActionExitCode code);
+
   // Determine, if possible, the source file system size to avoid copying the
   // whole partition. Currently this supports only the root file system assuming
   // it's ext3-compatible.
@@ -107,37 +178,101 @@ class FilesystemCopierAction : public Action<FilesystemCopierAction> {
   // expected value.
   const bool verify_hash_;
 
+  // If true, the source is only hashed; see set_hash_only().
+  bool hash_only_;
+
+  // See set_full_verification().
+  bool full_verification_;
+
+  // See set_source_hash_cache(). NULL for no cache.
+  PrefsInterface* source_hash_cache_;
+
   // The path to copy from. If empty (the default), the source is from the
   // passed in InstallPlan.
   std::string copy_source_;
 
+  // Whether to try writing with O_DIRECT, and whether |dst_stream_|'s
+  // descriptor is currently open that way.
+  bool use_direct_io_;
+  bool dst_direct_io_;
+
   // If non-NULL, these are GUnixInputStream objects for the opened
   // source/destination partitions.
   GInputStream* src_stream_;
   GOutputStream* dst_stream_;
 
-  // Ping-pong buffers for storing data we read/write. Only one buffer is being
-  // read at a time and only one buffer is being written at a time.
-  std::vector<char> buffer_[2];
+  // The size and number of the copy buffers.
+  size_t buffer_size_;
+  size_t queue_depth_;
+
+  // The buffers for storing data we read/write. They come from
+  // |buffer_pool_| so that they can be written with O_DIRECT. A GIO stream
+  // allows only one pending operation, so only one buffer is being read at a
+  // time and only one buffer is being written at a time. The others are
+  // either empty or full, waiting to be written in the order they were read.
+  scoped_ptr<AlignedBufferPool> buffer_pool_;
+  std::vector<char*> buffers_;
+  std::deque<char*> empty_buffers_;
+
+  // A buffer that has been read into: |size| bytes from |offset| on in the
+  // source.
+  struct FullBuffer {
+    FullBuffer() : data(NULL), offset(0), size(0) {}
+    char* data;
+    off_t offset;
+    size_t size;
+  };
+  std::deque<FullBuffer> full_buffers_;
 
-  // The state of each buffer.
-  BufferState buffer_state_[2];
+  // The buffer being read into, or NULL.
+  char* reading_buffer_;
 
-  // Number of valid elements in |buffer_| if its state is kBufferStateFull.
-  std::vector<char>::size_type buffer_valid_size_[2];
+  // The buffer being written from, whose data is NULL if none. The write in
+  // flight is of |writing_size_| bytes ending at |writing_pos_| in it.
+  FullBuffer writing_buffer_;
+  size_t writing_pos_;
+  size_t writing_size_;
 
-  // The cancellable objects for the in-flight async calls.
-  GCancellable* canceller_[2];
+  // The source offset of the next read, and the destination offset the
+  // next write lands at without seeking.
+  off_t read_offset_;
+  off_t dst_offset_;
+
+  // Writes the destination back to disk as the copy goes.
+  IncrementalWriteback writeback_;
+
+  // Whether to copy just the blocks in use, and for each block of the source
+  // file system whether it's in use. All blocks are copied if empty.
+  bool sparse_copy_;
+  std::vector<bool> allocated_blocks_;
+  size_t block_size_;
+
+  // The cancellable object for the in-flight async calls.
+  GCancellable* canceller_;
 
   bool read_done_;  // true if reached EOF on the input stream.
   bool failed_;  // true if the action has failed.
   bool cancelled_;  // true if the action has been cancelled.
+  bool suspended_;  // true if the action has been suspended.
+
+  // True while the actions started concurrently before this one, which
+  // output the other partition's hash, haven't completed, and whether this
+  // one has completed successfully meanwhile.
+  bool waiting_for_input_;
+  bool complete_pending_;
 
   // The install plan we're passed in via the input pipe.
   InstallPlan install_plan_;
 
-  // Calculates the hash of the copied data.
-  OmahaHashCalculator hasher_;
+  // Calculates the hash of the copied data, on a thread of its own so that
+  // hashing isn't in the way of the reads and writes.
+  AsyncHashCalculator hasher_;
+
+  // When verifying a partition the install plan has chunk hashes for, these
+  // check the chunks on a worker per CPU instead of |hasher_| computing the
+  // hash of the whole partition.
+  scoped_ptr<ThreadPool> hash_pool_;
+  scoped_ptr<ChunkHashVerifier> chunk_verifier_;
 
   // Copies and hashes this many bytes from the head of the input stream. This
   // field is initialized when the action is started and decremented as more
@@ -3,7 +3,9 @@
 // found in the LICENSE file.
 
 #include <fcntl.h>
+#include <sys/stat.h>
 
+#include <algorithm>
 #include <set>
 #include <string>
 #include <vector>
@@ -17,12 +19,18 @@
 #include "update_engine/filesystem_copier_action.h"
 #include "update_engine/filesystem_iterator.h"
 #include "update_engine/omaha_hash_calculator.h"
+#include "update_engine/prefs_mock.h"
 #include "update_engine/test_utils.h"
 #include "update_engine/utils.h"
 
+using std::min;
 using std::set;
 using std::string;
 using std::vector;
+using testing::_;
+using testing::DoAll;
+using testing::Return;
+using testing::SetArgumentPointee;
 
 namespace chromeos_update_engine {
 
@@ -36,9 +44,20 @@ class FilesystemCopierActionTest : public ::testing::Test {
               bool use_kernel_partition,
               int verify_hash);
   void SetUp() {
+    buffer_size_ = 0;
+    queue_depth_ = 0;
+    hash_chunk_size_ = 0;
   }
   void TearDown() {
   }
+
+  // If non-zero, the buffer size and queue depth DoTest() copies with.
+  size_t buffer_size_;
+  size_t queue_depth_;
+
+  // If non-zero, DoTest() verifies chunk hashes of this size rather than
+  // the hash of the whole partition.
+  size_t hash_chunk_size_;
 };
 
 class FilesystemCopierActionTestDelegate : public ActionProcessorDelegate {
@@ -185,6 +204,30 @@ bool FilesystemCopierActionTest::DoTest(bool run_out_of_space,
         success = false;
       }
     }
+    if (hash_chunk_size_) {
+      // Only the chunk hashes are checked.
+      vector<vector<char> > chunk_hashes;
+      for (size_t offset = 0; offset < kLoopFileSize;
+           offset += hash_chunk_size_) {
+        chunk_hashes.push_back(vector<char>());
+        if (!OmahaHashCalculator::RawHashOfBytes(
+                &a_loop_data[offset],
+                min(hash_chunk_size_, kLoopFileSize - offset),
+                &chunk_hashes.back())) {
+          ADD_FAILURE();
+          success = false;
+        }
+      }
+      if (use_kernel_partition) {
+        install_plan.kernel_hash.clear();
+        install_plan.kernel_hash_chunk_size = hash_chunk_size_;
+        install_plan.kernel_chunk_hashes = chunk_hashes;
+      } else {
+        install_plan.rootfs_hash.clear();
+        install_plan.rootfs_hash_chunk_size = hash_chunk_size_;
+        install_plan.rootfs_chunk_hashes = chunk_hashes;
+      }
+    }
   } else {
     if (use_kernel_partition) {
       install_plan.kernel_install_path = b_dev;
@@ -212,6 +255,10 @@ bool FilesystemCopierActionTest::DoTest(bool run_out_of_space,
   if (!verify_hash) {
     copier_action.set_copy_source(a_dev);
   }
+  if (buffer_size_)
+    copier_action.set_buffer_size(buffer_size_);
+  if (queue_depth_)
+    copier_action.set_queue_depth(queue_depth_);
   feeder_action.set_obj(install_plan);
 
   StartProcessorCallbackArgs start_callback_args;
@@ -314,6 +361,7 @@ TEST_F(FilesystemCopierActionTest, ResumeTest) {
   InstallPlan install_plan(true, kUrl, 0, "", "", "");
   feeder_action.set_obj(install_plan);
   FilesystemCopierAction copier_action(false, false);
+  copier_action.set_copy_source("/some/source");
   ObjectCollectorAction<InstallPlan> collector_action;
 
   BondActions(&feeder_action, &copier_action);
@@ -327,6 +375,52 @@ TEST_F(FilesystemCopierActionTest, ResumeTest) {
   EXPECT_TRUE(delegate.ran_);
   EXPECT_EQ(kActionCodeSuccess, delegate.code_);
   EXPECT_EQ(kUrl, collector_action.object().download_url);
+  // A resumed update is still applied from the source partition.
+  EXPECT_EQ("/some/source", collector_action.object().source_path);
+}
+
+TEST_F(FilesystemCopierActionTest, SourceHashCacheTest) {
+  const string kSource = "/no/such/source";
+  vector<char> hash;
+  ASSERT_TRUE(OmahaHashCalculator::RawHashOfBytes("source", 6, &hash));
+  const string cached = utils::GetBootId() + "\n" + kSource + "\n" +
+      OmahaHashCalculator::OmahaHashOfString("source");
+  for (int i = 0; i < 2; i++) {
+    // The hash cached for another boot isn't used, and the source is read.
+    const bool this_boot = i == 0;
+    PrefsMock prefs;
+    EXPECT_CALL(prefs, GetString(kPrefsSourceKernelHash, _))
+        .WillOnce(DoAll(SetArgumentPointee<1>(this_boot ? cached :
+                                              "x" + cached),
+                        Return(true)));
+    EXPECT_CALL(prefs, SetString(_, _)).Times(0);
+
+    ActionProcessor processor;
+    FilesystemCopierActionTest2Delegate delegate;
+    processor.set_delegate(&delegate);
+    ObjectFeederAction<InstallPlan> feeder_action;
+    feeder_action.set_obj(InstallPlan());
+    FilesystemCopierAction copier_action(true, false);
+    copier_action.set_copy_source(kSource);
+    copier_action.set_hash_only(true);
+    copier_action.set_source_hash_cache(&prefs);
+    ObjectCollectorAction<InstallPlan> collector_action;
+    BondActions(&feeder_action, &copier_action);
+    BondActions(&copier_action, &collector_action);
+    processor.EnqueueAction(&feeder_action);
+    processor.EnqueueAction(&copier_action);
+    processor.EnqueueAction(&collector_action);
+    processor.StartProcessing();
+    EXPECT_FALSE(processor.IsRunning());
+    EXPECT_TRUE(delegate.ran_);
+    if (this_boot) {
+      EXPECT_EQ(kActionCodeSuccess, delegate.code_);
+      EXPECT_TRUE(collector_action.object().kernel_hash == hash);
+      EXPECT_EQ(kSource, collector_action.object().kernel_source_path);
+    } else {
+      EXPECT_EQ(kActionCodeError, delegate.code_);
+    }
+  }
 }
 
 TEST_F(FilesystemCopierActionTest, NonExistentDriveTest) {
@@ -369,6 +463,29 @@ TEST_F(FilesystemCopierActionTest, RunAsRootVerifyHashFailTest) {
   EXPECT_TRUE(DoTest(false, false, true, 2));
 }
 
+TEST_F(FilesystemCopierActionTest, RunAsRootVerifyChunkHashesTest) {
+  ASSERT_EQ(0, getuid());
+  // The last chunk is a short one.
+  hash_chunk_size_ = 1024 * 1024;
+  EXPECT_TRUE(DoTest(false, false, false, 1));
+  EXPECT_TRUE(DoTest(false, false, true, 1));
+  EXPECT_TRUE(DoTest(false, false, false, 2));
+  EXPECT_TRUE(DoTest(false, false, true, 2));
+}
+
+TEST_F(FilesystemCopierActionTest, RunAsRootQueueDepthTest) {
+  ASSERT_EQ(0, getuid());
+  // A buffer size that doesn't divide the partition size, so the last read
+  // is a short one.
+  buffer_size_ = 3 * 4096;
+  const size_t kQueueDepths[] = { 1, 2, 5 };
+  for (size_t i = 0; i < arraysize(kQueueDepths); i++) {
+    queue_depth_ = kQueueDepths[i];
+    EXPECT_TRUE(DoTest(false, false, false, 1));
+    EXPECT_TRUE(DoTest(false, false, true, 1));
+  }
+}
+
 TEST_F(FilesystemCopierActionTest, RunAsRootNoSpaceTest) {
   ASSERT_EQ(0, getuid());
   EXPECT_TRUE(DoTest(true, false, false, 0));
@@ -379,6 +496,55 @@ TEST_F(FilesystemCopierActionTest, RunAsRootTerminateEarlyTest) {
   EXPECT_TRUE(DoTest(false, true, false, 0));
 }
 
+TEST_F(FilesystemCopierActionTest, RunAsRootSparseCopyTest) {
+  ASSERT_EQ(0, getuid());
+  string src;
+  string dst;
+  ASSERT_TRUE(utils::MakeTempFile("/tmp/src.XXXXXX", &src, NULL));
+  ScopedPathUnlinker src_unlinker(src);
+  ASSERT_TRUE(utils::MakeTempFile("/tmp/dst.XXXXXX", &dst, NULL));
+  ScopedPathUnlinker dst_unlinker(dst);
+  CreateExtImageAtPath(src, NULL);
+  vector<char> src_data;
+  ASSERT_TRUE(utils::ReadFile(src, &src_data));
+
+  GMainLoop *loop = g_main_loop_new(g_main_context_default(), FALSE);
+  InstallPlan install_plan;
+  install_plan.install_path = dst;
+  ActionProcessor processor;
+  ObjectFeederAction<InstallPlan> feeder_action;
+  feeder_action.set_obj(install_plan);
+  FilesystemCopierAction copier_action(false, false);
+  copier_action.set_copy_source(src);
+  copier_action.set_sparse_copy(true);
+  ObjectCollectorAction<InstallPlan> collector_action;
+  BondActions(&feeder_action, &copier_action);
+  BondActions(&copier_action, &collector_action);
+  FilesystemCopierActionTestDelegate delegate(loop, &copier_action);
+  processor.set_delegate(&delegate);
+  processor.EnqueueAction(&feeder_action);
+  processor.EnqueueAction(&copier_action);
+  processor.EnqueueAction(&collector_action);
+  StartProcessorCallbackArgs start_callback_args;
+  start_callback_args.processor = &processor;
+  start_callback_args.filesystem_copier_action = &copier_action;
+  start_callback_args.terminate_early = false;
+  g_timeout_add(0, &StartProcessorInRunLoop, &start_callback_args);
+  g_main_loop_run(loop);
+  g_main_loop_unref(loop);
+  EXPECT_EQ(kActionCodeSuccess, delegate.code());
+
+  // The hash is of all of the source, but the free blocks of the file system
+  // have been skipped, so the copy is smaller yet still checks out.
+  vector<char> hash;
+  EXPECT_TRUE(OmahaHashCalculator::RawHashOfData(src_data, &hash));
+  EXPECT_TRUE(collector_action.object().rootfs_hash == hash);
+  struct stat dst_stat;
+  ASSERT_EQ(0, stat(dst.c_str(), &dst_stat));
+  EXPECT_GT(src_data.size() / 2, dst_stat.st_blocks * 512);
+  EXPECT_EQ(0, System(StringPrintf("e2fsck -fn %s", dst.c_str())));
+}
+
 TEST_F(FilesystemCopierActionTest, RunAsRootDetermineFilesystemSizeTest) {
   string img;
   EXPECT_TRUE(utils::MakeTempFile("/tmp/img.XXXXXX", &img, NULL));
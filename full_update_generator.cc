@@ -12,12 +12,14 @@
 #include <base/string_util.h>
 #include <base/stringprintf.h>
 
-#include "update_engine/bzip.h"
+#include "update_engine/block_scan.h"
+#include "update_engine/delta_diff_generator.h"
+#include "update_engine/file_holes.h"
+#include "update_engine/thread_pool.h"
 #include "update_engine/utils.h"
 
-using std::deque;
 using std::min;
-using std::max;
+using std::pair;
 using std::string;
 using std::tr1::shared_ptr;
 using std::vector;
@@ -26,81 +28,162 @@ namespace chromeos_update_engine {
 
 namespace {
 
-// This class encapsulates a full update chunk processing thread. The processor
-// reads a chunk of data from the input file descriptor and compresses it. The
-// processor needs to be started through Start() then waited on through Wait().
-class ChunkProcessor {
+// This class encapsulates the processing of a full update chunk. The processor
+// reads a chunk of data from the input file descriptor and compresses it. It
+// runs on a ThreadPool.
+class ChunkProcessor : public ThreadPoolTask {
  public:
-  // Read a chunk of |size| bytes from |fd| starting at offset |offset|.
-  ChunkProcessor(int fd, off_t offset, size_t size)
-      : thread_(NULL),
-        fd_(fd),
+  // Read a chunk of |size| bytes from |fd| starting at offset |offset|. A
+  // |hole| chunk lies in a hole of the file, so it's zeros and isn't read.
+  ChunkProcessor(int fd, off_t offset, size_t size, bool hole)
+      : fd_(fd),
         offset_(offset),
-        buffer_in_(size) {}
-  ~ChunkProcessor() { Wait(); }
+        hole_(hole),
+        buffer_in_(size),
+        type_(DeltaArchiveManifest_InstallOperation_Type_REPLACE) {}
 
   off_t offset() const { return offset_; }
   const vector<char>& buffer_in() const { return buffer_in_; }
-  const vector<char>& buffer_compressed() const { return buffer_compressed_; }
+  const vector<char>& buffer_out() const { return buffer_out_; }
+  DeltaArchiveManifest_InstallOperation_Type type() const { return type_; }
 
-  // Starts the processor. Returns true on success, false on failure.
-  bool Start();
-
-  // Waits for the processor to complete. Returns true on success, false on
-  // failure.
-  bool Wait();
-
-  bool ShouldCompress() const {
-    return buffer_compressed_.size() < buffer_in_.size();
-  }
+  // Reads the input data into |buffer_in_| and stores its cheapest encoding
+  // in |buffer_out_| and the matching operation type in |type_|. Returns
+  // true on success, false otherwise.
+  virtual bool Run();
 
  private:
-  // Reads the input data into |buffer_in_| and compresses it into
-  // |buffer_compressed_|. Returns true on success, false otherwise.
-  bool ReadAndCompress();
-  static gpointer ReadAndCompressThread(gpointer data);
-
-  GThread* thread_;
   int fd_;
   off_t offset_;
+  bool hole_;
   vector<char> buffer_in_;
-  vector<char> buffer_compressed_;
+  vector<char> buffer_out_;
+  DeltaArchiveManifest_InstallOperation_Type type_;
 
   DISALLOW_COPY_AND_ASSIGN(ChunkProcessor);
 };
 
-bool ChunkProcessor::Start() {
-  // g_thread_create is deprecated since glib 2.32. Use
-  // g_thread_new instead.
-  thread_ = g_thread_try_new("chunk_proc", ReadAndCompressThread, this, NULL);
-  TEST_AND_RETURN_FALSE(thread_ != NULL);
-  return true;
-}
-
-bool ChunkProcessor::Wait() {
-  if (!thread_) {
-    return false;
+bool ChunkProcessor::Run() {
+  if (!hole_) {
+    ssize_t bytes_read = -1;
+    TEST_AND_RETURN_FALSE(utils::PReadAll(fd_,
+                                          buffer_in_.data(),
+                                          buffer_in_.size(),
+                                          offset_,
+                                          &bytes_read));
+    TEST_AND_RETURN_FALSE(bytes_read ==
+                          static_cast<ssize_t>(buffer_in_.size()));
   }
-  gpointer result = g_thread_join(thread_);
-  thread_ = NULL;
-  TEST_AND_RETURN_FALSE(result == this);
+  TEST_AND_RETURN_FALSE(DeltaDiffGenerator::CompressReplaceData(
+      buffer_in_, &buffer_out_, &type_));
   return true;
 }
 
-gpointer ChunkProcessor::ReadAndCompressThread(gpointer data) {
-  return
-      reinterpret_cast<ChunkProcessor*>(data)->ReadAndCompress() ? data : NULL;
-}
+// The kinds of data chunks are sized for, see FullUpdateGenerator::Run().
+enum DataKind {
+  kDataZero,
+  kDataIncompressible,
+  kDataCompressible,
+};
+
+// This class tells the kind of a unit of data. The classifier reads the unit
+// from the input file descriptor and probes it. It runs on a ThreadPool.
+class UnitClassifier : public ThreadPoolTask {
+ public:
+  // Classify the unit of |size| bytes of |fd| at offset |offset|. A |hole|
+  // unit lies in a hole of the file, so it's zeros and isn't read.
+  UnitClassifier(int fd, off_t offset, size_t size, bool hole)
+      : fd_(fd),
+        offset_(offset),
+        size_(size),
+        hole_(hole),
+        kind_(kDataCompressible) {}
+
+  off_t offset() const { return offset_; }
+  size_t size() const { return size_; }
+  DataKind kind() const { return kind_; }
+
+  // Reads the unit and sets |kind_|. Returns true on success, false
+  // otherwise.
+  virtual bool Run();
 
-bool ChunkProcessor::ReadAndCompress() {
+ private:
+  int fd_;
+  off_t offset_;
+  size_t size_;
+  bool hole_;
+  DataKind kind_;
+
+  DISALLOW_COPY_AND_ASSIGN(UnitClassifier);
+};
+
+bool UnitClassifier::Run() {
+  if (hole_) {
+    kind_ = kDataZero;
+    return true;
+  }
+  vector<char> buffer(size_);
   ssize_t bytes_read = -1;
   TEST_AND_RETURN_FALSE(utils::PReadAll(fd_,
-                                        buffer_in_.data(),
-                                        buffer_in_.size(),
+                                        buffer.data(),
+                                        buffer.size(),
                                         offset_,
                                         &bytes_read));
-  TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(buffer_in_.size()));
-  TEST_AND_RETURN_FALSE(BzipCompress(buffer_in_, &buffer_compressed_));
+  TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(buffer.size()));
+  if (block_scan::IsZeroData(buffer.data(), buffer.size()))
+    kind_ = kDataZero;
+  else if (DeltaDiffGenerator::LooksIncompressible(buffer.data(),
+                                                   buffer.size()))
+    kind_ = kDataIncompressible;
+  return true;
+}
+
+// A chunk of a partition: its offset and its size, in bytes.
+typedef pair<off_t, off_t> Chunk;
+
+// Sets |chunks| to those the |size| bytes of the partition open at |fd|,
+// whose holes are |holes|, are split into, see FullUpdateGenerator::Run().
+// Units are classified on |pool|, with up to |max_pending| at once.
+bool PlanChunks(int fd,
+                off_t size,
+                const FileHoles& holes,
+                off_t chunk_size,
+                off_t min_chunk_size,
+                off_t max_chunk_size,
+                off_t block_size,
+                size_t max_pending,
+                ThreadPool* pool,
+                vector<Chunk>* chunks) {
+  chunks->clear();
+  if (min_chunk_size >= max_chunk_size) {
+    for (off_t offset = 0; offset < size; offset += chunk_size)
+      chunks->push_back(Chunk(offset, min(size - offset, chunk_size)));
+    return true;
+  }
+  OrderedTaskRunner<UnitClassifier> runner(pool, max_pending);
+  DataKind last_kind = kDataCompressible;
+  off_t offset = 0;
+  while (offset < size || !runner.empty()) {
+    while (!runner.full() && offset < size) {
+      const off_t unit_size = min(size - offset, min_chunk_size);
+      runner.Submit(shared_ptr<UnitClassifier>(
+          new UnitClassifier(fd, offset, unit_size,
+                             unit_size % block_size == 0 &&
+                             holes.IsHole(offset / block_size,
+                                          unit_size / block_size))));
+      offset += unit_size;
+    }
+    shared_ptr<UnitClassifier> classifier;
+    TEST_AND_RETURN_FALSE(runner.WaitOldest(&classifier));
+    const off_t limit =
+        classifier->kind() == kDataCompressible ? chunk_size : max_chunk_size;
+    const off_t unit_size = classifier->size();
+    if (chunks->empty() || classifier->kind() != last_kind ||
+        chunks->back().second + unit_size > limit)
+      chunks->push_back(Chunk(classifier->offset(), 0));
+    chunks->back().second += unit_size;
+    last_kind = classifier->kind();
+  }
   return true;
 }
 
@@ -114,14 +197,22 @@ bool FullUpdateGenerator::Run(
     int fd,
     off_t* data_file_size,
     off_t chunk_size,
+    off_t min_chunk_size,
+    off_t max_chunk_size,
     off_t block_size,
     vector<DeltaArchiveManifest_InstallOperation>* kernel_ops,
-    std::vector<Vertex::Index>* final_order) {
+    std::vector<Vertex::Index>* final_order,
+    ThreadPool* pool) {
   TEST_AND_RETURN_FALSE(chunk_size > 0);
   TEST_AND_RETURN_FALSE((chunk_size % block_size) == 0);
+  TEST_AND_RETURN_FALSE(min_chunk_size > 0 && min_chunk_size <= chunk_size &&
+                        chunk_size <= max_chunk_size);
+  TEST_AND_RETURN_FALSE((min_chunk_size % block_size) == 0);
+  TEST_AND_RETURN_FALSE((max_chunk_size % block_size) == 0);
 
-  size_t max_threads = max(sysconf(_SC_NPROCESSORS_ONLN), 4L);
-  LOG(INFO) << "Max threads: " << max_threads;
+  // Keep a few chunks per thread in flight so that a slow chunk at the head
+  // doesn't leave the other threads idle while its output is awaited.
+  const size_t max_pending_chunks = 4 * pool->num_threads();
 
   // Get the sizes early in the function, so we can fail fast if the user
   // passed us bad paths.
@@ -145,25 +236,36 @@ bool FullUpdateGenerator::Run(
     int in_fd = open(path.c_str(), O_RDONLY, 0);
     TEST_AND_RETURN_FALSE(in_fd >= 0);
     ScopedFdCloser in_fd_closer(&in_fd);
-    deque<shared_ptr<ChunkProcessor> > threads;
+    FileHoles holes;
+    TEST_AND_RETURN_FALSE(holes.Init(path, part_sizes[partition], block_size));
+    vector<Chunk> chunks;
+    TEST_AND_RETURN_FALSE(PlanChunks(in_fd, part_sizes[partition], holes,
+                                     chunk_size, min_chunk_size,
+                                     max_chunk_size, block_size,
+                                     max_pending_chunks, pool, &chunks));
+    LOG(INFO) << "split " << path << " into " << chunks.size() << " chunks";
+    OrderedTaskRunner<ChunkProcessor> runner(pool, max_pending_chunks);
     int last_progress_update = INT_MIN;
-    off_t bytes_left = part_sizes[partition], counter = 0, offset = 0;
-    while (bytes_left > 0 || !threads.empty()) {
-      // Check and start new chunk processors if possible.
-      while (threads.size() < max_threads && bytes_left > 0) {
+    off_t counter = 0;
+    size_t next_chunk = 0;
+    while (next_chunk < chunks.size() || !runner.empty()) {
+      // Queue new chunk processors if possible.
+      while (!runner.full() && next_chunk < chunks.size()) {
+        const off_t offset = chunks[next_chunk].first;
+        const off_t size = chunks[next_chunk].second;
         shared_ptr<ChunkProcessor> processor(
-            new ChunkProcessor(in_fd, offset, min(bytes_left, chunk_size)));
-        threads.push_back(processor);
-        TEST_AND_RETURN_FALSE(processor->Start());
-        bytes_left -= chunk_size;
-        offset += chunk_size;
+            new ChunkProcessor(in_fd, offset, size,
+                               size % block_size == 0 &&
+                               holes.IsHole(offset / block_size,
+                                            size / block_size)));
+        runner.Submit(processor);
+        next_chunk++;
       }
 
-      // Need to wait for a chunk processor to complete and process its ouput
-      // before spawning new processors.
-      shared_ptr<ChunkProcessor> processor = threads.front();
-      threads.pop_front();
-      TEST_AND_RETURN_FALSE(processor->Wait());
+      // Need to wait for the oldest chunk processor to complete and process
+      // its ouput before queueing new processors.
+      shared_ptr<ChunkProcessor> processor;
+      TEST_AND_RETURN_FALSE(runner.WaitOldest(&processor));
 
       DeltaArchiveManifest_InstallOperation* op = NULL;
       if (partition == 0) {
@@ -177,19 +279,20 @@ bool FullUpdateGenerator::Run(
         op = &kernel_ops->back();
       }
 
-      const bool compress = processor->ShouldCompress();
-      const vector<char>& use_buf =
-          compress ? processor->buffer_compressed() : processor->buffer_in();
-      op->set_type(compress ?
-                   DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ :
-                   DeltaArchiveManifest_InstallOperation_Type_REPLACE);
-      op->set_data_offset(*data_file_size);
-      TEST_AND_RETURN_FALSE(utils::WriteAll(fd, &use_buf[0], use_buf.size()));
-      *data_file_size += use_buf.size();
-      op->set_data_length(use_buf.size());
+      const vector<char>& use_buf = processor->buffer_out();
+      op->set_type(processor->type());
+      if (processor->type() !=
+          DeltaArchiveManifest_InstallOperation_Type_ZERO) {
+        op->set_data_offset(*data_file_size);
+        TEST_AND_RETURN_FALSE(utils::WriteAll(fd, &use_buf[0],
+                                              use_buf.size()));
+        *data_file_size += use_buf.size();
+        op->set_data_length(use_buf.size());
+      }
       Extent* dst_extent = op->add_dst_extents();
       dst_extent->set_start_block(processor->offset() / block_size);
-      dst_extent->set_num_blocks(chunk_size / block_size);
+      dst_extent->set_num_blocks(
+          (processor->buffer_in().size() + block_size - 1) / block_size);
 
       int progress = static_cast<int>(
           (processor->offset() + processor->buffer_in().size()) * 100.0 /
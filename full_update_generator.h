@@ -11,6 +11,8 @@
 
 namespace chromeos_update_engine {
 
+class ThreadPool;
+
 class FullUpdateGenerator {
  public:
   // Given a new rootfs and kernel (|new_image|, |new_kernel_part|), reads them
@@ -18,7 +20,17 @@ class FullUpdateGenerator {
   // |graph|, |kernel_ops|, and |final_order|, with data about the update
   // operations, and writes relevant data to |fd|, updating |data_file_size| as
   // it does. Only the first |image_size| bytes are read from |new_image|
-  // assuming that this is the actual file system.
+  // assuming that this is the actual file system. Chunks are compressed in
+  // parallel on |pool|.
+  //
+  // If |min_chunk_size| is below |max_chunk_size|, the partitions are first
+  // classified in units of |min_chunk_size| bytes, and the chunks are sized
+  // by the data they cover instead: runs of zeros and of data that's
+  // compressed already, which clients write as is, get chunks of
+  // |max_chunk_size| bytes, which cuts the number of operations, and
+  // compressible data gets chunks of |chunk_size| bytes, which bounds the
+  // memory and time clients take to decompress each. Chunks don't span
+  // units of different kinds.
   static bool Run(
       Graph* graph,
       const std::string& new_kernel_part,
@@ -27,9 +39,12 @@ class FullUpdateGenerator {
       int fd,
       off_t* data_file_size,
       off_t chunk_size,
+      off_t min_chunk_size,
+      off_t max_chunk_size,
       off_t block_size,
       std::vector<DeltaArchiveManifest_InstallOperation>* kernel_ops,
-      std::vector<Vertex::Index>* final_order);
+      std::vector<Vertex::Index>* final_order,
+      ThreadPool* pool);
 
  private:
   // This should never be constructed.
@@ -2,6 +2,9 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <stdlib.h>
+
+#include <algorithm>
 #include <string>
 #include <vector>
 
@@ -9,6 +12,7 @@
 
 #include "update_engine/full_update_generator.h"
 #include "update_engine/test_utils.h"
+#include "update_engine/thread_pool.h"
 
 using std::string;
 using std::vector;
@@ -55,6 +59,8 @@ TEST(FullUpdateGeneratorTest, RunTest) {
   ScopedFdCloser out_blobs_fd_closer(&out_blobs_fd);
 
   off_t out_blobs_length = 0;
+  ThreadPool pool(0);
+  EXPECT_TRUE(pool.Init());
 
   Graph graph;
   vector<DeltaArchiveManifest_InstallOperation> kernel_ops;
@@ -67,9 +73,12 @@ TEST(FullUpdateGeneratorTest, RunTest) {
                                        out_blobs_fd,
                                        &out_blobs_length,
                                        kChunkSize,
+                                       kChunkSize,
+                                       kChunkSize,
                                        kBlockSize,
                                        &kernel_ops,
-                                       &final_order));
+                                       &final_order,
+                                       &pool));
   EXPECT_EQ(new_rootfs_size / kChunkSize, graph.size());
   EXPECT_EQ(new_rootfs_size / kChunkSize, final_order.size());
   EXPECT_EQ(new_kern.size() / kChunkSize, kernel_ops.size());
@@ -88,4 +97,73 @@ TEST(FullUpdateGeneratorTest, RunTest) {
   }
 }
 
+TEST(FullUpdateGeneratorTest, AdaptiveChunksTest) {
+  const off_t kMinChunkSize = 128 * 1024;
+  const off_t kChunkSize = 512 * 1024;
+  const off_t kMaxChunkSize = 2 * 1024 * 1024;
+  // 4 MiB of zeros, then 4 MiB of random data and 3 MiB of text.
+  vector<char> new_root(11 * 1024 * 1024);
+  for (size_t i = 4 * 1024 * 1024; i < 8 * 1024 * 1024; i++)
+    new_root[i] = random();
+  vector<char> text(3 * 1024 * 1024);
+  FillWithData(&text);
+  std::copy(text.begin(), text.end(), new_root.begin() + 8 * 1024 * 1024);
+
+  string new_root_path;
+  EXPECT_TRUE(utils::MakeTempFile("/tmp/NewFullUpdateTest_R.XXXXXX",
+                                  &new_root_path,
+                                  NULL));
+  ScopedPathUnlinker new_root_path_unlinker(new_root_path);
+  EXPECT_TRUE(WriteFileVector(new_root_path, new_root));
+
+  string out_blobs_path;
+  int out_blobs_fd;
+  EXPECT_TRUE(utils::MakeTempFile("/tmp/NewFullUpdateTest_D.XXXXXX",
+                                  &out_blobs_path,
+                                  &out_blobs_fd));
+  ScopedPathUnlinker out_blobs_path_unlinker(out_blobs_path);
+  ScopedFdCloser out_blobs_fd_closer(&out_blobs_fd);
+
+  off_t out_blobs_length = 0;
+  ThreadPool pool(0);
+  EXPECT_TRUE(pool.Init());
+
+  Graph graph;
+  vector<DeltaArchiveManifest_InstallOperation> kernel_ops;
+  vector<Vertex::Index> final_order;
+
+  EXPECT_TRUE(FullUpdateGenerator::Run(&graph,
+                                       "",
+                                       new_root_path,
+                                       new_root.size(),
+                                       out_blobs_fd,
+                                       &out_blobs_length,
+                                       kChunkSize,
+                                       kMinChunkSize,
+                                       kMaxChunkSize,
+                                       kBlockSize,
+                                       &kernel_ops,
+                                       &final_order,
+                                       &pool));
+  // 2 chunks of zeros, 2 of random data and 6 of text.
+  ASSERT_EQ(10, graph.size());
+  EXPECT_EQ(10, final_order.size());
+  EXPECT_TRUE(kernel_ops.empty());
+  uint64_t next_block = 0;
+  for (size_t i = 0; i < graph.size(); ++i) {
+    EXPECT_EQ(i, final_order[i]);
+    ASSERT_EQ(1, graph[i].op.dst_extents_size());
+    EXPECT_EQ(next_block, graph[i].op.dst_extents(0).start_block());
+    EXPECT_EQ((i < 4 ? kMaxChunkSize : kChunkSize) / kBlockSize,
+              graph[i].op.dst_extents(0).num_blocks()) << "i = " << i;
+    next_block += graph[i].op.dst_extents(0).num_blocks();
+  }
+  EXPECT_EQ(new_root.size() / kBlockSize, next_block);
+  // The random data is sent as is.
+  EXPECT_EQ(DeltaArchiveManifest_InstallOperation_Type_REPLACE,
+            graph[2].op.type());
+  EXPECT_EQ(DeltaArchiveManifest_InstallOperation_Type_REPLACE,
+            graph[3].op.type());
+}
+
 }  // namespace chromeos_update_engine
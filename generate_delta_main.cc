@@ -15,13 +15,17 @@
 
 #include <base/command_line.h>
 #include <base/logging.h>
+#include <base/memory/scoped_ptr.h>
 #include <base/string_number_conversions.h>
 #include <base/string_split.h>
 #include <gflags/gflags.h>
 #include <glib.h>
 
+#include "update_engine/apply_cost_model.h"
+#include "update_engine/delta_chain.h"
 #include "update_engine/delta_diff_generator.h"
 #include "update_engine/delta_performer.h"
+#include "update_engine/generator_profile.h"
 #include "update_engine/payload_signer.h"
 #include "update_engine/prefs.h"
 #include "update_engine/subprocess.h"
@@ -40,10 +44,18 @@ DEFINE_string(new_kernel, "", "Path to the new kernel partition image");
 DEFINE_string(in_file, "",
               "Path to input delta payload file used to hash/sign payloads "
               "and apply delta over old_image (for debugging)");
-DEFINE_string(out_file, "", "Path to output delta payload file");
+DEFINE_string(out_file, "",
+              "Path to output delta payload file. To generate deltas from "
+              "several old images to the same new image in one go, use a "
+              "colon-separated list of paths and matching lists in "
+              "old_dir, old_image and old_kernel (which may be left empty)");
 DEFINE_string(out_hash_file, "", "Path to output hash file");
 DEFINE_string(out_metadata_hash_file, "", "Path to output metadata hash file");
-DEFINE_string(private_key, "", "Path to private key in .pem format");
+DEFINE_string(private_key, "",
+              "Path to private key in .pem format. To sign the unsigned "
+              "payload in_file into out_file in one pass, use a "
+              "colon-separated list of private keys, and pass public_key to "
+              "verify the signature as well");
 DEFINE_string(public_key, "", "Path to public key in .pem format");
 DEFINE_int32(public_key_version,
              chromeos_update_engine::kSignatureMessageCurrentVersion,
@@ -61,6 +73,175 @@ DEFINE_string(signature_file, "",
               "e.g. /path/to/sig:/path/to/next:/path/to/last_sig . Each "
               "signature will be assigned a client version, starting from "
               "kSignatureOriginalVersion.");
+DEFINE_int32(threads, 0,
+             "Number of threads used to diff files and compress chunks when "
+             "generating a payload. "
+             "0 means one thread per online CPU");
+DEFINE_string(suffix_array_cache_dir, "",
+              "Directory in which bsdiff suffix arrays of old files are kept, "
+              "so that generating several deltas from the same old image "
+              "sorts each old file only once");
+DEFINE_string(operation_cache_dir, "",
+              "Directory in which the encoded operations of changed files "
+              "are kept, so that generating deltas between images that "
+              "share files encodes each pair of files only once");
+DEFINE_string(checkpoint_dir, "",
+              "Directory in which the generation of a delta is checkpointed "
+              "after its long phases, so that a rerun with the same inputs "
+              "resumes from the last one");
+DEFINE_int64(memory_budget_mb, 0,
+             "MiB of memory the threads diffing a delta may use together, "
+             "with the data of the diffed files kept on disk until it's "
+             "added to the payload. 0 sets no bound");
+DEFINE_bool(apply_from_source, false,
+            "Generate a delta payload that is applied from the old partitions "
+            "rather than patching a copy of them in place. Such payloads are "
+            "only supported by newer clients");
+DEFINE_bool(read_images, false,
+            "Read the files of the old and new images straight from the "
+            "ext2/3/4 images rather than from old_dir and new_dir, which "
+            "then needn't be given. This doesn't need root or loop devices");
+DEFINE_bool(xz_compression, false,
+            "Compress the data of full operations with xz where it does at "
+            "least as well as bzip2. Such payloads are only supported by "
+            "newer clients");
+DEFINE_bool(zero_blocks, false,
+            "Zero the blocks whose new data is all zeros with ZERO operations "
+            "rather than sending compressed zeros. Such payloads are only "
+            "supported by newer clients");
+DEFINE_bool(sample_compression, false,
+            "Try each compressor on samples of the data of large full "
+            "operations first, and skip those that can't beat sending the "
+            "data uncompressed. This is quicker on compressed data but may "
+            "make the payload larger");
+DEFINE_bool(greedy_cycle_breaking, false,
+            "Break the cycles of the delta graph with a greedy heuristic that "
+            "runs in near-linear time, rather than by enumerating them");
+DEFINE_bool(block_deduplication, false,
+            "Turn full operations whose blocks can all be found in the old "
+            "image into moves from there");
+DEFINE_bool(interleave_kernel_blobs, false,
+            "Spread the kernel data over the payload rather than put it "
+            "after the rootfs data, so that clients write the kernel "
+            "partition during the download. Such payloads are only "
+            "supported by newer clients");
+DEFINE_bool(payload_segments, false,
+            "Index the data of each partition in the manifest, so that "
+            "clients can fetch it as ranges of its own. Old clients ignore "
+            "the index");
+DEFINE_bool(source_reuse_hints, false,
+            "Flag the delta operations whose source blocks a later one "
+            "reads again, so that clients only keep those in memory. Old "
+            "clients ignore the flags");
+DEFINE_bool(locality_ordering, false,
+            "Order the delta operations, and their data, so that clients "
+            "write the new partition as sequentially as the dependencies "
+            "between the operations allow");
+DEFINE_bool(similar_files, false,
+            "Diff the new files without an old file at their path against "
+            "the most similar removed old file, e.g., the previous version "
+            "of a renamed library");
+DEFINE_bool(blake3_operation_hashes, false,
+            "Hash the operations' data blobs with BLAKE3 rather than SHA-256, "
+            "which only clients that support it can verify");
+DEFINE_int64(chunk_size, -1,
+             "Diff files larger than this many bytes in chunks of this size, "
+             "each in its own operation, to bound the memory and time taken "
+             "by each diff. Must be a multiple of the block size. "
+             "-1 diffs files whole");
+DEFINE_int64(kernel_chunk_size, -1,
+             "Diff the kernel partition in chunks of this size, each in its "
+             "own operation, in parallel. Must be a multiple of the block "
+             "size. -1 diffs the partition whole");
+DEFINE_int64(partition_hash_chunk_size, 0,
+             "Also list the hashes of the chunks of this many bytes of each "
+             "partition, which newer clients verify in parallel. "
+             "0 lists none");
+DEFINE_int64(operation_fusion_size, 0,
+             "Merge the consecutive full operations that each write less "
+             "than this many bytes, a multiple of the block size, into "
+             "operations of up to this many bytes. 0 merges none.");
+DEFINE_bool(destination_hashes, false,
+            "List the hash of the blocks each operation writes, so that "
+            "newer clients verify the new partitions as they write them "
+            "instead of reading them back");
+DEFINE_bool(rootfs_hash_tree, false,
+            "Describe the dm-verity hash tree that follows the new rootfs "
+            "filesystem, so that newer clients build it as they write the "
+            "partition instead of reading it back");
+DEFINE_string(rootfs_hash_tree_salt, "",
+              "The salt of the rootfs hash tree, in hex");
+DEFINE_bool(compact_manifest, false,
+            "Pack the extents of the operations in the manifest, which "
+            "makes it much smaller and quicker to parse. Such payloads are "
+            "only supported by newer clients");
+DEFINE_int64(apply_cost_download_rate, 0,
+             "Choose the operations clients with this download rate, in "
+             "bytes per second, are estimated to download and apply the "
+             "quickest, rather than the smallest. 0 chooses the smallest");
+DEFINE_int64(apply_cost_bzip2_rate, 8 * 1024 * 1024,
+             "Bytes per second clients decompress bzip2 data at, with "
+             "apply_cost_download_rate");
+DEFINE_int64(apply_cost_xz_rate, 24 * 1024 * 1024,
+             "Bytes per second clients decompress xz data at, with "
+             "apply_cost_download_rate");
+DEFINE_int64(apply_cost_bspatch_rate, 4 * 1024 * 1024,
+             "Bytes per second of old and new data clients apply BSDIFF "
+             "operations at, with apply_cost_download_rate");
+DEFINE_int64(apply_cost_bspatch_memory, 0,
+             "The most bytes of old and new data a BSDIFF operation may "
+             "hold in memory, with apply_cost_download_rate. 0 means "
+             "unlimited");
+DEFINE_int64(apply_cost_stream_patch_rate, 16 * 1024 * 1024,
+             "Bytes per second of new data clients apply STREAM_DIFF "
+             "operations at, with apply_cost_download_rate");
+DEFINE_int32(stream_diff_margin, -1,
+             "Also try STREAM_DIFF operations, which clients apply quicker "
+             "and in less memory than BSDIFF ones, and choose them over a "
+             "BSDIFF if they're at most this many percent bigger. Such "
+             "payloads are only supported by newer clients. -1 generates "
+             "none");
+DEFINE_int32(diff_shard_count, 0,
+             "Split the encoding of the changed files of a delta into this "
+             "many shards, and only encode shard diff_shard_index into "
+             "operation_cache_dir, without writing a payload. Running each "
+             "shard on other machines with a shared operation_cache_dir "
+             "spreads the work, and a final run without sharding builds the "
+             "payload from the cache. 0 doesn't shard");
+DEFINE_int32(diff_shard_index, 0,
+             "The shard to encode, with diff_shard_count");
+DEFINE_int64(xz_dictionary_size, 0,
+             "Train an xz dictionary of up to this many bytes on the small "
+             "files of the new image, carried once in the payload, and "
+             "compress the small files of deltas with it where that's "
+             "smaller. Such payloads are only supported by newer clients. "
+             "0 trains none");
+DEFINE_int64(block_size, 4096,
+             "Block size of full payloads, a power of two from 4096 to the "
+             "size of their operations. Larger blocks make the manifest "
+             "smaller. Deltas always use 4096");
+DEFINE_int64(full_min_chunk_size, 1048576,
+             "Smallest operations of full payloads, a multiple of the block "
+             "size up to 1 MiB. Below full_max_chunk_size, the operations "
+             "are sized by the data they write: runs of zeros and of "
+             "compressed data get operations of full_max_chunk_size bytes, "
+             "compressible data ones of 1 MiB");
+DEFINE_int64(full_max_chunk_size, 1048576,
+             "Largest operations of full payloads, a multiple of the block "
+             "size from 1 MiB on. See full_min_chunk_size");
+DEFINE_string(profile_file, "",
+              "Path to write a JSON report of the time spent in each phase "
+              "of the generation and on encoding the files to");
+DEFINE_int32(profile_slowest_files, 20,
+             "Number of the slowest file operations to list in the "
+             "profile_file report");
+DEFINE_string(chain_payloads, "",
+              "Colon-separated list of the consecutive delta payloads that "
+              "take old_image and old_kernel on to a later release, in "
+              "order. They're applied to copies of the old images, and "
+              "out_file gets a single delta from the old images to the "
+              "result, for clients several releases behind. Needs "
+              "--read_images");
 
 // This file contains a simple program that takes an old path, a new path,
 // and an output file as arguments and the path to an output file and
@@ -161,6 +342,20 @@ void SignPayload() {
             << final_metadata_size;
 }
 
+void SignUnsignedPayload() {
+  LOG(INFO) << "Signing payload with private keys.";
+  LOG_IF(FATAL, FLAGS_out_file.empty())
+      << "Must pass --out_file to sign payload.";
+  vector<string> private_keys;
+  base::SplitString(FLAGS_private_key, ':', &private_keys);
+  uint64_t final_metadata_size;
+  CHECK(PayloadSigner::SignUnsignedPayload(
+      FLAGS_in_file, private_keys, FLAGS_out_file, FLAGS_public_key,
+      FLAGS_public_key_version, &final_metadata_size));
+  LOG(INFO) << "Done signing payload. Final metadata size = "
+            << final_metadata_size;
+}
+
 void VerifySignedPayload() {
   LOG(INFO) << "Verifying signed payload.";
   LOG_IF(FATAL, FLAGS_in_file.empty())
@@ -195,6 +390,7 @@ void ApplyDelta() {
   install_plan.rootfs_hash.assign(root_info.hash().begin(),
                                   root_info.hash().end());
   DeltaPerformer performer(&prefs, NULL, &install_plan);
+  performer.set_file_target(true);
   CHECK_EQ(performer.Open(FLAGS_old_image.c_str(), 0, 0), 0);
   CHECK(performer.OpenKernel(FLAGS_old_kernel.c_str()));
   vector<char> buf(1024 * 1024);
@@ -213,6 +409,49 @@ void ApplyDelta() {
   LOG(INFO) << "Done applying delta.";
 }
 
+// Splits the colon-separated |flag| of a batch of |count| deltas into
+// |paths|. An empty |flag| stands for |count| empty paths.
+void SplitBatchFlag(const string& name,
+                    const string& flag,
+                    size_t count,
+                    vector<string>* paths) {
+  paths->clear();
+  if (flag.empty()) {
+    paths->resize(count);
+    return;
+  }
+  base::SplitString(flag, ':', paths);
+  CHECK_EQ(paths->size(), count) << name << " doesn't list " << count
+                                 << " paths";
+}
+
+// Generates the deltas from each old image listed in the flags to the new
+// image. Returns true on success.
+bool GenerateDeltaBatch(const vector<string>& out_files) {
+  vector<string> old_dirs, old_images, old_kernels;
+  SplitBatchFlag("old_dir", FLAGS_old_dir, out_files.size(), &old_dirs);
+  SplitBatchFlag("old_image", FLAGS_old_image, out_files.size(), &old_images);
+  SplitBatchFlag("old_kernel", FLAGS_old_kernel, out_files.size(),
+                 &old_kernels);
+  CHECK(FLAGS_read_images || IsDir(FLAGS_new_dir.c_str()))
+      << "new_dir not directory";
+  vector<DeltaSource> sources(out_files.size());
+  for (size_t i = 0; i < out_files.size(); i++) {
+    CHECK(!old_images[i].empty()) << "A batch only holds delta updates";
+    CHECK(FLAGS_read_images || IsDir(old_dirs[i].c_str()))
+        << old_dirs[i] << " not directory";
+    sources[i].old_root = old_dirs[i];
+    sources[i].old_image = old_images[i];
+    sources[i].old_kernel_part = old_kernels[i];
+    sources[i].output_path = out_files[i];
+  }
+  return DeltaDiffGenerator::GenerateDeltaUpdateFiles(sources,
+                                                      FLAGS_new_dir,
+                                                      FLAGS_new_image,
+                                                      FLAGS_new_kernel,
+                                                      FLAGS_private_key);
+}
+
 int Main(int argc, char** argv) {
   google::ParseCommandLineFlags(&argc, &argv, true);
   CommandLine::Init(argc, argv);
@@ -242,6 +481,10 @@ int Main(int argc, char** argv) {
     SignPayload();
     return 0;
   }
+  if (!FLAGS_in_file.empty() && !FLAGS_private_key.empty()) {
+    SignUnsignedPayload();
+    return 0;
+  }
   if (!FLAGS_public_key.empty()) {
     VerifySignedPayload();
     return 0;
@@ -250,31 +493,162 @@ int Main(int argc, char** argv) {
     ApplyDelta();
     return 0;
   }
-  CHECK(!FLAGS_new_image.empty());
-  CHECK(!FLAGS_out_file.empty());
-  if (FLAGS_old_image.empty()) {
+  const bool chain = !FLAGS_chain_payloads.empty();
+  CHECK(!FLAGS_new_image.empty() || chain);
+  CHECK(!FLAGS_out_file.empty() || FLAGS_diff_shard_count > 0);
+  vector<string> out_files;
+  base::SplitString(FLAGS_out_file, ':', &out_files);
+  const bool batch = out_files.size() > 1;
+  if (chain) {
+    LOG(INFO) << "Composing a delta update of chained payloads";
+    CHECK(!batch) << "A chain is composed into a single delta";
+    CHECK(!FLAGS_old_image.empty() && !FLAGS_old_kernel.empty())
+        << "Must pass --old_image and --old_kernel to compose a chain";
+    CHECK(FLAGS_read_images)
+        << "Must pass --read_images to compose a chain, as the new images "
+        << "aren't mounted";
+    CHECK_EQ(FLAGS_diff_shard_count, 0) << "A chain can't be sharded";
+  } else if (batch) {
+    LOG(INFO) << "Generating " << out_files.size() << " delta updates";
+  } else if (FLAGS_old_image.empty()) {
     LOG(INFO) << "Generating full update";
   } else {
     LOG(INFO) << "Generating delta update";
-    CHECK(!FLAGS_old_dir.empty());
-    CHECK(!FLAGS_new_dir.empty());
-    if ((!IsDir(FLAGS_old_dir.c_str())) || (!IsDir(FLAGS_new_dir.c_str()))) {
-      LOG(FATAL) << "old_dir or new_dir not directory";
+    if (!FLAGS_read_images) {
+      CHECK(!FLAGS_old_dir.empty());
+      CHECK(!FLAGS_new_dir.empty());
+      if ((!IsDir(FLAGS_old_dir.c_str())) ||
+          (!IsDir(FLAGS_new_dir.c_str()))) {
+        LOG(FATAL) << "old_dir or new_dir not directory";
+      }
     }
   }
-  uint64_t metadata_size;
-  if (!DeltaDiffGenerator::GenerateDeltaUpdateFile(FLAGS_old_dir,
-                                                   FLAGS_old_image,
-                                                   FLAGS_new_dir,
-                                                   FLAGS_new_image,
-                                                   FLAGS_old_kernel,
-                                                   FLAGS_new_kernel,
-                                                   FLAGS_out_file,
-                                                   FLAGS_private_key,
-                                                   &metadata_size)) {
-    return 1;
+  CHECK_GE(FLAGS_threads, 0);
+  DeltaDiffGenerator::SetNumThreads(FLAGS_threads);
+  if (!FLAGS_suffix_array_cache_dir.empty()) {
+    CHECK(IsDir(FLAGS_suffix_array_cache_dir.c_str()))
+        << "suffix_array_cache_dir not a directory";
+    DeltaDiffGenerator::SetSuffixArrayCacheDir(FLAGS_suffix_array_cache_dir);
+  }
+  if (!FLAGS_operation_cache_dir.empty()) {
+    CHECK(IsDir(FLAGS_operation_cache_dir.c_str()))
+        << "operation_cache_dir not a directory";
+    DeltaDiffGenerator::SetOperationCacheDir(FLAGS_operation_cache_dir);
+  }
+  if (!FLAGS_checkpoint_dir.empty()) {
+    CHECK(IsDir(FLAGS_checkpoint_dir.c_str()))
+        << "checkpoint_dir not a directory";
+    DeltaDiffGenerator::SetCheckpointDir(FLAGS_checkpoint_dir);
+  }
+  CHECK_GE(FLAGS_memory_budget_mb, 0);
+  DeltaDiffGenerator::SetMemoryBudget(FLAGS_memory_budget_mb << 20);
+  DeltaDiffGenerator::SetApplyFromSource(FLAGS_apply_from_source);
+  DeltaDiffGenerator::SetReadImages(FLAGS_read_images);
+  DeltaDiffGenerator::SetXzCompression(FLAGS_xz_compression);
+  DeltaDiffGenerator::SetZeroBlocks(FLAGS_zero_blocks);
+  DeltaDiffGenerator::SetSampleCompression(FLAGS_sample_compression);
+  DeltaDiffGenerator::SetGreedyCycleBreaking(FLAGS_greedy_cycle_breaking);
+  DeltaDiffGenerator::SetBlockDeduplication(FLAGS_block_deduplication);
+  DeltaDiffGenerator::SetInterleaveKernelBlobs(FLAGS_interleave_kernel_blobs);
+  DeltaDiffGenerator::SetPayloadSegments(FLAGS_payload_segments);
+  DeltaDiffGenerator::SetSourceReuseHints(FLAGS_source_reuse_hints);
+  DeltaDiffGenerator::SetLocalityOrdering(FLAGS_locality_ordering);
+  DeltaDiffGenerator::SetSimilarFileMatching(FLAGS_similar_files);
+  DeltaDiffGenerator::SetBlake3OperationHashes(
+      FLAGS_blake3_operation_hashes);
+  DeltaDiffGenerator::SetChunkSize(FLAGS_chunk_size);
+  DeltaDiffGenerator::SetKernelChunkSize(FLAGS_kernel_chunk_size);
+  CHECK_GE(FLAGS_partition_hash_chunk_size, 0)
+      << "partition_hash_chunk_size must not be negative";
+  DeltaDiffGenerator::SetPartitionHashChunkSize(
+      FLAGS_partition_hash_chunk_size);
+  DeltaDiffGenerator::SetDestinationHashes(FLAGS_destination_hashes);
+  vector<uint8> hash_tree_salt;
+  CHECK(FLAGS_rootfs_hash_tree_salt.empty() ||
+        base::HexStringToBytes(FLAGS_rootfs_hash_tree_salt, &hash_tree_salt))
+      << "rootfs_hash_tree_salt must be in hex";
+  DeltaDiffGenerator::SetRootfsHashTree(
+      FLAGS_rootfs_hash_tree,
+      vector<char>(hash_tree_salt.begin(), hash_tree_salt.end()));
+  DeltaDiffGenerator::SetOperationFusionSize(FLAGS_operation_fusion_size);
+  DeltaDiffGenerator::SetCompactManifest(FLAGS_compact_manifest);
+  DeltaDiffGenerator::SetStreamDiffMargin(FLAGS_stream_diff_margin);
+  CHECK_GE(FLAGS_diff_shard_count, 0);
+  if (FLAGS_diff_shard_count > 0) {
+    CHECK(!FLAGS_old_image.empty()) << "Only deltas can be sharded";
+    CHECK(!FLAGS_operation_cache_dir.empty())
+        << "Must pass --operation_cache_dir to encode a shard";
+    CHECK(FLAGS_diff_shard_index >= 0 &&
+          FLAGS_diff_shard_index < FLAGS_diff_shard_count)
+        << "diff_shard_index out of range";
+    LOG(INFO) << "Encoding shard " << FLAGS_diff_shard_index << " of "
+              << FLAGS_diff_shard_count;
+  }
+  DeltaDiffGenerator::SetDiffShard(FLAGS_diff_shard_index,
+                                   FLAGS_diff_shard_count);
+  CHECK(FLAGS_block_size == 4096 || FLAGS_old_image.empty())
+      << "Only full payloads may have a block size other than 4096";
+  DeltaDiffGenerator::SetBlockSize(FLAGS_block_size);
+  DeltaDiffGenerator::SetFullChunkSizeBounds(FLAGS_full_min_chunk_size,
+                                             FLAGS_full_max_chunk_size);
+  CHECK_GE(FLAGS_xz_dictionary_size, 0);
+  DeltaDiffGenerator::SetXzDictionarySize(FLAGS_xz_dictionary_size);
+  CHECK_GE(FLAGS_apply_cost_download_rate, 0);
+  if (FLAGS_apply_cost_download_rate > 0) {
+    CHECK_GT(FLAGS_apply_cost_bzip2_rate, 0);
+    CHECK_GT(FLAGS_apply_cost_xz_rate, 0);
+    CHECK_GT(FLAGS_apply_cost_bspatch_rate, 0);
+    CHECK_GE(FLAGS_apply_cost_bspatch_memory, 0);
+    CHECK_GT(FLAGS_apply_cost_stream_patch_rate, 0);
+    ApplyCostModel model;
+    model.download_rate = FLAGS_apply_cost_download_rate;
+    model.bzip2_rate = FLAGS_apply_cost_bzip2_rate;
+    model.xz_rate = FLAGS_apply_cost_xz_rate;
+    model.bspatch_rate = FLAGS_apply_cost_bspatch_rate;
+    model.bspatch_memory = FLAGS_apply_cost_bspatch_memory;
+    model.stream_patch_rate = FLAGS_apply_cost_stream_patch_rate;
+    LOG(INFO) << "Choosing operations with the cost model "
+              << model.ToString();
+    DeltaDiffGenerator::SetApplyCostModel(&model);
+  }
+  scoped_ptr<GeneratorProfile> profile;
+  if (!FLAGS_profile_file.empty()) {
+    CHECK_GE(FLAGS_profile_slowest_files, 0);
+    profile.reset(new GeneratorProfile(FLAGS_profile_slowest_files));
+    DeltaDiffGenerator::SetProfile(profile.get());
+  }
+  bool success;
+  if (chain) {
+    vector<string> payloads;
+    base::SplitString(FLAGS_chain_payloads, ':', &payloads);
+    success = delta_chain::GenerateChainedDelta(payloads,
+                                                FLAGS_old_dir,
+                                                FLAGS_old_image,
+                                                FLAGS_old_kernel,
+                                                FLAGS_private_key,
+                                                FLAGS_out_file);
+  } else if (batch) {
+    success = GenerateDeltaBatch(out_files);
+  } else {
+    uint64_t metadata_size;
+    success = DeltaDiffGenerator::GenerateDeltaUpdateFile(FLAGS_old_dir,
+                                                          FLAGS_old_image,
+                                                          FLAGS_new_dir,
+                                                          FLAGS_new_image,
+                                                          FLAGS_old_kernel,
+                                                          FLAGS_new_kernel,
+                                                          FLAGS_out_file,
+                                                          FLAGS_private_key,
+                                                          &metadata_size);
+  }
+  if (profile.get()) {
+    DeltaDiffGenerator::SetProfile(NULL);
+    if (!profile->WriteJson(FLAGS_profile_file)) {
+      LOG(ERROR) << "Unable to write " << FLAGS_profile_file;
+      success = false;
+    }
   }
-  return 0;
+  return success ? 0 : 1;
 }
 
 }  // namespace {}
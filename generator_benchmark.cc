@@ -0,0 +1,409 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Times the extent and graph algorithms of the payload generator on a
+// synthetic delta much larger than those of the unit tests, so that the ones
+// that don't scale show up before real images reach them. The delta is made
+// of operations that each write a few runs of blocks and read as many runs
+// from nearby, like files moved around a little between images, which makes
+// for block dependencies with many short cycles. The kernels that scan the
+// images' blocks are timed too, in each version the CPU supports.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <base/basictypes.h>
+#include <base/command_line.h>
+#include <base/logging.h>
+#include <base/stringprintf.h>
+#include <base/time.h>
+#include <gflags/gflags.h>
+
+#include "update_engine/block_owners.h"
+#include "update_engine/block_scan.h"
+#include "update_engine/csr_graph.h"
+#include "update_engine/cycle_breaker.h"
+#include "update_engine/delta_diff_generator.h"
+#include "update_engine/extent_ranges.h"
+#include "update_engine/graph_types.h"
+#include "update_engine/graph_utils.h"
+#include "update_engine/tarjan.h"
+#include "update_engine/topological_sort.h"
+
+DEFINE_int32(vertices, 100000, "Number of operations in the graph");
+DEFINE_int32(runs_per_vertex, 4,
+             "Number of runs of blocks each operation writes and reads");
+DEFINE_int32(max_run_blocks, 16, "Largest number of blocks in a run");
+DEFINE_int32(moved_percent, 10,
+             "Percentage of the runs that are read by another operation "
+             "than the one that writes them");
+DEFINE_int32(locality, 64,
+             "How many runs away from where they're read moved runs are "
+             "written");
+DEFINE_int32(extent_operations, 100000,
+             "Number of extents added to, looked up in and subtracted from "
+             "an ExtentRanges");
+DEFINE_int32(scan_mib, 256,
+             "MiB of blocks compared, checked for zeros and hashed by each "
+             "version of the block scanning kernels");
+DEFINE_int32(seed, 1, "Seed of the synthetic graph and extents");
+DEFINE_bool(circuits, true,
+            "Also break the cycles by enumerating the circuits, which may "
+            "take much longer than the greedy heuristic");
+
+using base::TimeDelta;
+using base::TimeTicks;
+using std::set;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Prints how long it lived, along with |result_|, if set.
+class ScopedBenchmark {
+ public:
+  explicit ScopedBenchmark(const string& name)
+      : name_(name), start_time_(TimeTicks::Now()) {}
+
+  ~ScopedBenchmark() {
+    const TimeDelta time = TimeTicks::Now() - start_time_;
+    printf("%-40s %10.3f s  %s\n", name_.c_str(), time.InSecondsF(),
+           result_.c_str());
+    fflush(stdout);
+  }
+
+  void set_result(const string& result) { result_ = result; }
+
+ private:
+  const string name_;
+  const TimeTicks start_time_;
+  string result_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedBenchmark);
+};
+
+// Returns a random number in [0, limit).
+uint64_t RandomBelow(uint64_t limit) {
+  CHECK_GT(limit, static_cast<uint64_t>(0));
+  const uint64_t value = (static_cast<uint64_t>(random()) << 31) | random();
+  return value % limit;
+}
+
+// Returns |count| random extents of up to --max_run_blocks blocks within the
+// first |num_blocks| blocks.
+vector<Extent> RandomExtents(size_t count, uint64_t num_blocks) {
+  vector<Extent> extents;
+  extents.reserve(count);
+  for (size_t i = 0; i < count; i++) {
+    extents.push_back(ExtentForRange(RandomBelow(num_blocks),
+                                     1 + RandomBelow(FLAGS_max_run_blocks)));
+  }
+  return extents;
+}
+
+// Fills |graph| with --vertices operations without edges over a partition of
+// |*num_blocks| blocks cut into runs. Each operation writes
+// --runs_per_vertex consecutive runs and reads as many runs, so that every
+// block has one reader and one writer. Most runs are read by the operation
+// that writes them, but --moved_percent of them are swapped with a run
+// within --locality runs.
+void BuildSyntheticGraph(Graph* graph, uint64_t* num_blocks) {
+  const size_t num_runs =
+      static_cast<size_t>(FLAGS_vertices) * FLAGS_runs_per_vertex;
+  vector<Extent> runs;
+  runs.reserve(num_runs);
+  uint64_t start_block = 0;
+  for (size_t i = 0; i < num_runs; i++) {
+    const uint64_t length = 1 + RandomBelow(FLAGS_max_run_blocks);
+    runs.push_back(ExtentForRange(start_block, length));
+    start_block += length;
+  }
+  *num_blocks = start_block;
+
+  vector<size_t> sources(num_runs);
+  for (size_t i = 0; i < num_runs; i++)
+    sources[i] = i;
+  for (size_t i = 0; i < num_runs; i++) {
+    if (RandomBelow(100) >= static_cast<uint64_t>(FLAGS_moved_percent))
+      continue;
+    const size_t window = std::min(static_cast<size_t>(FLAGS_locality),
+                                   num_runs - i);
+    std::swap(sources[i], sources[i + RandomBelow(window)]);
+  }
+
+  graph->clear();
+  graph->resize(FLAGS_vertices);
+  for (size_t i = 0; i < num_runs; i++) {
+    DeltaArchiveManifest_InstallOperation* op =
+        &(*graph)[i / FLAGS_runs_per_vertex].op;
+    op->set_type(DeltaArchiveManifest_InstallOperation_Type_BSDIFF);
+    *op->add_dst_extents() = runs[i];
+    *op->add_src_extents() = runs[sources[i]];
+  }
+}
+
+void BenchmarkExtentRanges() {
+  // Spreads the extents out so that few of them merge, leaving about as many
+  // ranges as there are extents.
+  const uint64_t num_blocks =
+      static_cast<uint64_t>(FLAGS_extent_operations) * FLAGS_max_run_blocks * 8;
+  if (num_blocks == 0)
+    return;
+  const vector<Extent> added = RandomExtents(FLAGS_extent_operations,
+                                             num_blocks);
+  const vector<Extent> looked_up = RandomExtents(FLAGS_extent_operations,
+                                                 num_blocks);
+  const vector<Extent> subtracted = RandomExtents(FLAGS_extent_operations,
+                                                  num_blocks);
+  ExtentRanges ranges;
+  {
+    ScopedBenchmark benchmark("ExtentRanges::AddExtent");
+    for (vector<Extent>::const_iterator it = added.begin();
+         it != added.end(); ++it)
+      ranges.AddExtent(*it);
+    benchmark.set_result(StringPrintf("%zu extents", ranges.num_extents()));
+  }
+  {
+    ScopedBenchmark benchmark("ExtentRanges::OverlapsExtent");
+    size_t overlaps = 0;
+    for (vector<Extent>::const_iterator it = looked_up.begin();
+         it != looked_up.end(); ++it) {
+      if (ranges.OverlapsExtent(*it))
+        overlaps++;
+    }
+    benchmark.set_result(StringPrintf("%zu overlap", overlaps));
+  }
+  {
+    ScopedBenchmark benchmark("ExtentRanges::SubtractExtent");
+    for (vector<Extent>::const_iterator it = subtracted.begin();
+         it != subtracted.end(); ++it)
+      ranges.SubtractExtent(*it);
+    benchmark.set_result(StringPrintf("%zu extents", ranges.num_extents()));
+  }
+}
+
+// The block size of the images the kernels scan.
+const size_t kScanBlockSize = 4096;
+
+// Returns the throughput of scanning --scan_mib MiB since |start_time|.
+string ScanThroughput(const TimeTicks& start_time) {
+  const double seconds = (TimeTicks::Now() - start_time).InSecondsF();
+  return StringPrintf("%.0f MiB/s",
+                      seconds > 0 ? FLAGS_scan_mib / seconds : 0.0);
+}
+
+// Times each version of the block scanning kernels over --scan_mib MiB of
+// blocks. The blocks compared are equal and those checked for zeros are
+// zero, as those are the ones that are scanned all the way through.
+void BenchmarkBlockScan() {
+  const size_t size = static_cast<size_t>(FLAGS_scan_mib) << 20;
+  if (size == 0)
+    return;
+  vector<char> data(size);
+  for (size_t i = 0; i < size; i++)
+    data[i] = random();
+  const vector<char> copy(data);
+  const vector<char> zeros(size, 0);
+
+  const vector<const BlockScanKernels*> kernels =
+      block_scan::SupportedKernels();
+  for (size_t k = 0; k < kernels.size(); k++) {
+    const BlockScanKernels& kernel = *kernels[k];
+    {
+      ScopedBenchmark benchmark(StringPrintf("block_scan data_equals (%s)",
+                                             kernel.name));
+      const TimeTicks start_time = TimeTicks::Now();
+      size_t equal = 0;
+      for (size_t i = 0; i < size; i += kScanBlockSize) {
+        if (kernel.data_equals(&data[i], &copy[i], kScanBlockSize))
+          equal++;
+      }
+      CHECK_EQ(size / kScanBlockSize, equal);
+      benchmark.set_result(ScanThroughput(start_time));
+    }
+    {
+      ScopedBenchmark benchmark(StringPrintf("block_scan is_zero (%s)",
+                                             kernel.name));
+      const TimeTicks start_time = TimeTicks::Now();
+      size_t zero = 0;
+      for (size_t i = 0; i < size; i += kScanBlockSize) {
+        if (kernel.is_zero(&zeros[i], kScanBlockSize))
+          zero++;
+      }
+      CHECK_EQ(size / kScanBlockSize, zero);
+      benchmark.set_result(ScanThroughput(start_time));
+    }
+    {
+      ScopedBenchmark benchmark(StringPrintf("block_scan hash (%s)",
+                                             kernel.name));
+      const TimeTicks start_time = TimeTicks::Now();
+      uint64_t hashes = 0;
+      for (size_t i = 0; i < size; i += kScanBlockSize)
+        hashes ^= kernel.hash(&data[i], kScanBlockSize);
+      benchmark.set_result(ScanThroughput(start_time) + StringPrintf(
+          ", %016llx", static_cast<unsigned long long>(hashes)));
+    }
+  }
+}
+
+// Adds the edges of |graph| to a copy of it one block at a time.
+void BenchmarkAddReadBeforeDep(const Graph& graph, const BlockOwners& blocks) {
+  Graph copy(graph.size());
+  const vector<BlockOwners::Run> runs = blocks.GetRuns();
+  ScopedBenchmark benchmark("graph_utils::AddReadBeforeDep");
+  uint64_t calls = 0;
+  for (vector<BlockOwners::Run>::const_iterator it = runs.begin();
+       it != runs.end(); ++it) {
+    if (it->reader == Vertex::kInvalidIndex ||
+        it->writer == Vertex::kInvalidIndex || it->reader == it->writer)
+      continue;
+    for (uint64_t block = it->start_block;
+         block < it->start_block + it->num_blocks; block++) {
+      graph_utils::AddReadBeforeDep(&copy[it->writer], it->reader, block);
+      calls++;
+    }
+  }
+  benchmark.set_result(StringPrintf("%llu calls",
+                                    static_cast<unsigned long long>(calls)));
+}
+
+void BenchmarkEdgeRemoval(const Graph& graph, const set<Edge>& cut_edges) {
+  Graph copy(graph);
+  {
+    ScopedBenchmark benchmark("graph_utils::DropIncomingEdgesTo");
+    // The generator drops the edges into the vertex of each cut edge.
+    set<Vertex::Index> dropped;
+    for (set<Edge>::const_iterator it = cut_edges.begin();
+         it != cut_edges.end() && dropped.size() < 1000; ++it) {
+      if (dropped.insert(it->second).second)
+        graph_utils::DropIncomingEdgesTo(&copy, it->second);
+    }
+    benchmark.set_result(StringPrintf("%zu vertices", dropped.size()));
+  }
+  {
+    ScopedBenchmark benchmark("graph_utils::DropWriteBeforeDeps");
+    for (Graph::iterator it = copy.begin(); it != copy.end(); ++it)
+      graph_utils::DropWriteBeforeDeps(&it->out_edges);
+  }
+}
+
+void BreakCycles(const Graph& graph,
+                 CycleBreaker::Algorithm algorithm,
+                 const string& name,
+                 set<Edge>* cut_edges) {
+  CycleBreaker breaker;
+  breaker.set_algorithm(algorithm);
+  ScopedBenchmark benchmark(name);
+  breaker.BreakCycles(graph, cut_edges);
+  benchmark.set_result(StringPrintf(
+      "%zu cut edges, %llu blocks", cut_edges->size(),
+      static_cast<unsigned long long>(breaker.cut_weight())));
+}
+
+int Main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  CommandLine::Init(argc, argv);
+  CHECK_GT(FLAGS_vertices, 0);
+  CHECK_GT(FLAGS_runs_per_vertex, 0);
+  CHECK_GT(FLAGS_max_run_blocks, 0);
+  CHECK_GT(FLAGS_locality, 0);
+  CHECK_GE(FLAGS_moved_percent, 0);
+  CHECK_LE(FLAGS_moved_percent, 100);
+  CHECK_GE(FLAGS_extent_operations, 0);
+  CHECK_GE(FLAGS_scan_mib, 0);
+  srandom(FLAGS_seed);
+
+  Graph graph;
+  uint64_t num_blocks = 0;
+  BuildSyntheticGraph(&graph, &num_blocks);
+  printf("%d vertices, %llu blocks\n", FLAGS_vertices,
+         static_cast<unsigned long long>(num_blocks));
+
+  BenchmarkExtentRanges();
+
+  BlockOwners blocks(num_blocks);
+  {
+    ScopedBenchmark benchmark("BlockOwners::SetReader/SetWriter");
+    for (Vertex::Index i = 0; i < graph.size(); i++) {
+      const DeltaArchiveManifest_InstallOperation& op = graph[i].op;
+      for (int j = 0; j < op.src_extents_size(); j++)
+        CHECK(blocks.SetReader(op.src_extents(j), i, NULL));
+      for (int j = 0; j < op.dst_extents_size(); j++)
+        CHECK(blocks.SetWriter(op.dst_extents(j), i, NULL));
+    }
+  }
+  {
+    ScopedBenchmark benchmark("DeltaDiffGenerator::CreateEdges");
+    DeltaDiffGenerator::CreateEdges(&graph, blocks);
+    size_t num_edges = 0;
+    for (Graph::const_iterator it = graph.begin(); it != graph.end(); ++it)
+      num_edges += it->out_edges.size();
+    benchmark.set_result(StringPrintf("%zu edges", num_edges));
+  }
+  BenchmarkAddReadBeforeDep(graph, blocks);
+  {
+    ScopedBenchmark benchmark("graph_utils::EdgeWeight");
+    uint64_t weight = 0;
+    for (Vertex::Index i = 0; i < graph.size(); i++) {
+      for (Vertex::EdgeMap::const_iterator it = graph[i].out_edges.begin();
+           it != graph[i].out_edges.end(); ++it)
+        weight += graph_utils::EdgeWeight(graph, Edge(i, it->first));
+    }
+    benchmark.set_result(StringPrintf(
+        "%llu blocks", static_cast<unsigned long long>(weight)));
+  }
+
+  CsrGraph csr_graph;
+  {
+    ScopedBenchmark benchmark("CsrGraph::Assign");
+    csr_graph.Assign(graph);
+  }
+  {
+    ScopedBenchmark benchmark("TarjanAlgorithm::ExecuteAll");
+    TarjanAlgorithm tarjan;
+    vector<Vertex::Index> component_ids;
+    tarjan.ExecuteAll(csr_graph, &component_ids);
+    const set<Vertex::Index> components(component_ids.begin(),
+                                        component_ids.end());
+    benchmark.set_result(StringPrintf("%zu components", components.size()));
+  }
+
+  set<Edge> cut_edges;
+  BreakCycles(graph, CycleBreaker::kAlgorithmGreedy,
+              "CycleBreaker::BreakCycles (greedy)", &cut_edges);
+  if (FLAGS_circuits) {
+    set<Edge> circuit_cut_edges;
+    BreakCycles(graph, CycleBreaker::kAlgorithmCircuits,
+                "CycleBreaker::BreakCycles (circuits)", &circuit_cut_edges);
+  }
+  BenchmarkEdgeRemoval(graph, cut_edges);
+
+  vector<Vertex::Index> order;
+  {
+    ScopedBenchmark benchmark("TopologicalSort (Graph)");
+    TopologicalSort(graph, &order);
+  }
+  {
+    ScopedBenchmark benchmark("TopologicalSort (CsrGraph)");
+    TopologicalSort(csr_graph, &order);
+  }
+
+  BenchmarkBlockScan();
+  return 0;
+}
+
+}  // namespace {}
+
+}  // namespace chromeos_update_engine
+
+int main(int argc, char** argv) {
+  return chromeos_update_engine::Main(argc, argv);
+}
@@ -0,0 +1,365 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/generator_checkpoint.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <base/logging.h>
+#include <base/stringprintf.h>
+
+#include "update_engine/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+// The state file starts with this. The version goes up whenever its layout
+// or the state it holds changes.
+const char kStateMagic[] = "CrAUgc01";
+const size_t kStateMagicSize = 8;
+
+// The state is encoded as fixed-size integers in host byte order and
+// length-prefixed strings, and ends with the CRC of what precedes it.
+void PutUint64(uint64_t value, string* out) {
+  out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void PutString(const string& value, string* out) {
+  PutUint64(value.size(), out);
+  out->append(value);
+}
+
+void PutExtents(const vector<Extent>& extents, string* out) {
+  PutUint64(extents.size(), out);
+  for (vector<Extent>::const_iterator it = extents.begin();
+       it != extents.end(); ++it) {
+    PutUint64(it->start_block(), out);
+    PutUint64(it->num_blocks(), out);
+  }
+}
+
+// Reads back what the Put functions wrote, failing past the end.
+class StateReader {
+ public:
+  StateReader(const char* data, size_t size)
+      : data_(data), size_(size), offset_(0) {}
+
+  bool GetUint64(uint64_t* value) {
+    TEST_AND_RETURN_FALSE(size_ - offset_ >= sizeof(*value));
+    memcpy(value, data_ + offset_, sizeof(*value));
+    offset_ += sizeof(*value);
+    return true;
+  }
+
+  bool GetString(string* value) {
+    uint64_t size = 0;
+    TEST_AND_RETURN_FALSE(GetUint64(&size));
+    TEST_AND_RETURN_FALSE(size_ - offset_ >= size);
+    value->assign(data_ + offset_, size);
+    offset_ += size;
+    return true;
+  }
+
+  bool GetExtents(vector<Extent>* extents) {
+    uint64_t count = 0;
+    TEST_AND_RETURN_FALSE(GetUint64(&count));
+    // Each extent takes 16 bytes, which bounds a bad count.
+    TEST_AND_RETURN_FALSE(count <= (size_ - offset_) / 16);
+    extents->resize(count);
+    for (uint64_t i = 0; i < count; i++) {
+      uint64_t start_block = 0, num_blocks = 0;
+      TEST_AND_RETURN_FALSE(GetUint64(&start_block));
+      TEST_AND_RETURN_FALSE(GetUint64(&num_blocks));
+      (*extents)[i].set_start_block(start_block);
+      (*extents)[i].set_num_blocks(num_blocks);
+    }
+    return true;
+  }
+
+  bool GetIndex(Vertex::Index* index) {
+    uint64_t value = 0;
+    TEST_AND_RETURN_FALSE(GetUint64(&value));
+    *index = static_cast<Vertex::Index>(value);
+    return true;
+  }
+
+  bool done() const { return offset_ == size_; }
+
+ private:
+  const char* data_;
+  size_t size_;
+  size_t offset_;
+};
+
+// Syncs the file at |path|. Returns true on success.
+bool SyncFile(const string& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  ScopedFdCloser fd_closer(&fd);
+  TEST_AND_RETURN_FALSE_ERRNO(fsync(fd) == 0);
+  return true;
+}
+
+// Reads the state past the key from |reader|, as Save() writes it. The
+// owner runs are returned as is, and must fit |block_count| blocks.
+bool ReadState(StateReader* reader,
+               uint64_t block_count,
+               uint64_t* phase,
+               uint64_t* data_file_size,
+               Graph* graph,
+               vector<BlockOwners::Run>* runs,
+               vector<DeltaArchiveManifest_InstallOperation>* kernel_ops,
+               Vertex::Index* scratch_vertex,
+               vector<Vertex::Index>* final_order) {
+  TEST_AND_RETURN_FALSE(reader->GetUint64(phase));
+  TEST_AND_RETURN_FALSE(*phase > GeneratorCheckpoint::kPhaseNone &&
+                        *phase <= GeneratorCheckpoint::kPhaseDag);
+  TEST_AND_RETURN_FALSE(reader->GetUint64(data_file_size));
+  TEST_AND_RETURN_FALSE(reader->GetIndex(scratch_vertex));
+
+  uint64_t count = 0;
+  string op;
+  TEST_AND_RETURN_FALSE(reader->GetUint64(&count));
+  for (uint64_t i = 0; i < count; i++) {
+    kernel_ops->push_back(DeltaArchiveManifest_InstallOperation());
+    TEST_AND_RETURN_FALSE(reader->GetString(&op));
+    TEST_AND_RETURN_FALSE(kernel_ops->back().ParsePartialFromString(op));
+  }
+
+  TEST_AND_RETURN_FALSE(reader->GetUint64(&count));
+  for (uint64_t i = 0; i < count; i++) {
+    graph->push_back(Vertex());
+    Vertex* vertex = &graph->back();
+    uint64_t valid = 0, chunk_offset = 0, chunk_size = 0, edge_count = 0;
+    TEST_AND_RETURN_FALSE(reader->GetUint64(&valid));
+    TEST_AND_RETURN_FALSE(reader->GetString(&op));
+    TEST_AND_RETURN_FALSE(vertex->op.ParsePartialFromString(op));
+    TEST_AND_RETURN_FALSE(reader->GetString(&vertex->file_name));
+    TEST_AND_RETURN_FALSE(reader->GetUint64(&chunk_offset));
+    TEST_AND_RETURN_FALSE(reader->GetUint64(&chunk_size));
+    TEST_AND_RETURN_FALSE(reader->GetUint64(&edge_count));
+    vertex->valid = valid != 0;
+    vertex->chunk_offset = chunk_offset;
+    vertex->chunk_size = chunk_size;
+    for (uint64_t j = 0; j < edge_count; j++) {
+      Vertex::Index target = Vertex::kInvalidIndex;
+      EdgeProperties properties;
+      TEST_AND_RETURN_FALSE(reader->GetIndex(&target));
+      TEST_AND_RETURN_FALSE(reader->GetExtents(&properties.extents));
+      TEST_AND_RETURN_FALSE(reader->GetExtents(&properties.write_extents));
+      vertex->out_edges[target] = properties;
+    }
+  }
+
+  uint64_t saved_block_count = 0;
+  TEST_AND_RETURN_FALSE(reader->GetUint64(&saved_block_count));
+  TEST_AND_RETURN_FALSE(saved_block_count == block_count);
+  TEST_AND_RETURN_FALSE(reader->GetUint64(&count));
+  uint64_t next_block = 0;
+  for (uint64_t i = 0; i < count; i++) {
+    BlockOwners::Run run;
+    TEST_AND_RETURN_FALSE(reader->GetUint64(&run.start_block));
+    TEST_AND_RETURN_FALSE(reader->GetUint64(&run.num_blocks));
+    TEST_AND_RETURN_FALSE(reader->GetIndex(&run.reader));
+    TEST_AND_RETURN_FALSE(reader->GetIndex(&run.writer));
+    TEST_AND_RETURN_FALSE(run.start_block == next_block &&
+                          run.num_blocks <= block_count - next_block);
+    next_block += run.num_blocks;
+    runs->push_back(run);
+  }
+
+  TEST_AND_RETURN_FALSE(reader->GetUint64(&count));
+  for (uint64_t i = 0; i < count; i++) {
+    Vertex::Index index = Vertex::kInvalidIndex;
+    TEST_AND_RETURN_FALSE(reader->GetIndex(&index));
+    final_order->push_back(index);
+  }
+  TEST_AND_RETURN_FALSE(reader->done());
+  return true;
+}
+}  // namespace {}
+
+GeneratorCheckpoint::GeneratorCheckpoint(const string& dir) : dir_(dir) {}
+
+string GeneratorCheckpoint::GenerationPath(const string& key,
+                                           const string& suffix) const {
+  // The key saved in the state tells apart generations whose names collide.
+  const uint32_t crc =
+      crc32(0, reinterpret_cast<const Bytef*>(key.data()), key.size());
+  return StringPrintf("%s/%08x.%s", dir_.c_str(), crc, suffix.c_str());
+}
+
+string GeneratorCheckpoint::blobs_path(const string& key) const {
+  return GenerationPath(key, "blobs");
+}
+
+string GeneratorCheckpoint::state_path(const string& key) const {
+  return GenerationPath(key, "state");
+}
+
+bool GeneratorCheckpoint::Save(
+    const string& key,
+    Phase phase,
+    const Graph& graph,
+    const BlockOwners& blocks,
+    const vector<DeltaArchiveManifest_InstallOperation>& kernel_ops,
+    Vertex::Index scratch_vertex,
+    const vector<Vertex::Index>& final_order,
+    off_t data_file_size) {
+  string state(kStateMagic, kStateMagicSize);
+  PutString(key, &state);
+  PutUint64(phase, &state);
+  PutUint64(data_file_size, &state);
+  PutUint64(scratch_vertex, &state);
+
+  string op;
+  PutUint64(kernel_ops.size(), &state);
+  for (size_t i = 0; i < kernel_ops.size(); i++) {
+    TEST_AND_RETURN_FALSE(kernel_ops[i].SerializePartialToString(&op));
+    PutString(op, &state);
+  }
+
+  // The operations of the scratch vertex and of invalidated ones needn't be
+  // complete.
+  PutUint64(graph.size(), &state);
+  for (Graph::const_iterator it = graph.begin(); it != graph.end(); ++it) {
+    PutUint64(it->valid, &state);
+    TEST_AND_RETURN_FALSE(it->op.SerializePartialToString(&op));
+    PutString(op, &state);
+    PutString(it->file_name, &state);
+    PutUint64(it->chunk_offset, &state);
+    PutUint64(it->chunk_size, &state);
+    PutUint64(it->out_edges.size(), &state);
+    for (Vertex::EdgeMap::const_iterator edge = it->out_edges.begin();
+         edge != it->out_edges.end(); ++edge) {
+      PutUint64(edge->first, &state);
+      PutExtents(edge->second.extents, &state);
+      PutExtents(edge->second.write_extents, &state);
+    }
+  }
+
+  const vector<BlockOwners::Run> runs = blocks.GetRuns();
+  PutUint64(blocks.block_count(), &state);
+  PutUint64(runs.size(), &state);
+  for (size_t i = 0; i < runs.size(); i++) {
+    PutUint64(runs[i].start_block, &state);
+    PutUint64(runs[i].num_blocks, &state);
+    PutUint64(runs[i].reader, &state);
+    PutUint64(runs[i].writer, &state);
+  }
+
+  PutUint64(final_order.size(), &state);
+  for (size_t i = 0; i < final_order.size(); i++)
+    PutUint64(final_order[i], &state);
+
+  const uint32_t crc =
+      crc32(0, reinterpret_cast<const Bytef*>(state.data()), state.size());
+  state.append(reinterpret_cast<const char*>(&crc), sizeof(crc));
+
+  // The blobs the state refers to must be on disk before it is.
+  TEST_AND_RETURN_FALSE(SyncFile(blobs_path(key)));
+  string temp_path;
+  int temp_fd = -1;
+  TEST_AND_RETURN_FALSE(
+      utils::MakeTempFile(dir_ + "/.state.XXXXXX", &temp_path, &temp_fd));
+  ScopedPathUnlinker temp_unlinker(temp_path);
+  bool success = utils::WriteAll(temp_fd, state.data(), state.size()) &&
+      fsync(temp_fd) == 0;
+  success = (close(temp_fd) == 0) && success;
+  TEST_AND_RETURN_FALSE_ERRNO(success);
+  TEST_AND_RETURN_FALSE_ERRNO(
+      rename(temp_path.c_str(), state_path(key).c_str()) == 0);
+  temp_unlinker.set_should_remove(false);
+  LOG(INFO) << "Checkpointed the generation after phase " << phase << " with "
+            << data_file_size << " bytes of data blobs";
+  return true;
+}
+
+GeneratorCheckpoint::Phase GeneratorCheckpoint::Load(
+    const string& key,
+    Graph* graph,
+    BlockOwners* blocks,
+    vector<DeltaArchiveManifest_InstallOperation>* kernel_ops,
+    Vertex::Index* scratch_vertex,
+    vector<Vertex::Index>* final_order,
+    off_t* data_file_size) {
+  const string path = state_path(key);
+  string state;
+  if (!utils::ReadFile(path, &state))
+    return kPhaseNone;
+  uint32_t crc = 0;
+  if (state.size() < kStateMagicSize + sizeof(crc) ||
+      memcmp(state.data(), kStateMagic, kStateMagicSize) != 0) {
+    LOG(WARNING) << "Ignoring bad generator checkpoint " << path;
+    return kPhaseNone;
+  }
+  const size_t size = state.size() - sizeof(crc);
+  memcpy(&crc, state.data() + size, sizeof(crc));
+  if (crc != crc32(0, reinterpret_cast<const Bytef*>(state.data()), size)) {
+    LOG(WARNING) << "Ignoring corrupt generator checkpoint " << path;
+    return kPhaseNone;
+  }
+  StateReader reader(state.data() + kStateMagicSize, size - kStateMagicSize);
+  string saved_key;
+  if (!reader.GetString(&saved_key) || saved_key != key) {
+    LOG(INFO) << "Not resuming the checkpoint of another generation";
+    return kPhaseNone;
+  }
+
+  uint64_t phase = kPhaseNone, blobs_size = 0;
+  Graph saved_graph;
+  vector<BlockOwners::Run> runs;
+  vector<DeltaArchiveManifest_InstallOperation> saved_kernel_ops;
+  Vertex::Index saved_scratch_vertex = Vertex::kInvalidIndex;
+  vector<Vertex::Index> saved_final_order;
+  if (!ReadState(&reader, blocks->block_count(), &phase, &blobs_size,
+                 &saved_graph, &runs, &saved_kernel_ops,
+                 &saved_scratch_vertex, &saved_final_order)) {
+    LOG(WARNING) << "Ignoring bad generator checkpoint " << path;
+    return kPhaseNone;
+  }
+
+  // The blobs written after the checkpoint are dropped.
+  const string blobs = blobs_path(key);
+  if (utils::FileSize(blobs) < static_cast<off_t>(blobs_size) ||
+      truncate(blobs.c_str(), blobs_size) != 0) {
+    LOG(WARNING) << "Ignoring generator checkpoint without its data blobs";
+    return kPhaseNone;
+  }
+
+  for (size_t i = 0; i < runs.size(); i++) {
+    Extent extent;
+    extent.set_start_block(runs[i].start_block);
+    extent.set_num_blocks(runs[i].num_blocks);
+    if (runs[i].reader != Vertex::kInvalidIndex)
+      CHECK(blocks->SetReader(extent, runs[i].reader, NULL));
+    if (runs[i].writer != Vertex::kInvalidIndex)
+      CHECK(blocks->SetWriter(extent, runs[i].writer, NULL));
+  }
+  graph->swap(saved_graph);
+  kernel_ops->swap(saved_kernel_ops);
+  final_order->swap(saved_final_order);
+  *scratch_vertex = saved_scratch_vertex;
+  *data_file_size = blobs_size;
+  LOG(INFO) << "Resuming the generation after phase " << phase << " with "
+            << blobs_size << " bytes of data blobs";
+  return static_cast<Phase>(phase);
+}
+
+void GeneratorCheckpoint::Clear(const string& key) {
+  if (unlink(state_path(key).c_str()) != 0 && errno != ENOENT)
+    PLOG(WARNING) << "Unable to remove " << state_path(key);
+  if (unlink(blobs_path(key).c_str()) != 0 && errno != ENOENT)
+    PLOG(WARNING) << "Unable to remove " << blobs_path(key);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,94 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_GENERATOR_CHECKPOINT_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_GENERATOR_CHECKPOINT_H__
+
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+#include <base/basictypes.h>
+
+#include "update_engine/block_owners.h"
+#include "update_engine/graph_types.h"
+#include "update_engine/update_metadata.pb.h"
+
+// GeneratorCheckpoint persists the state of a delta generation at the end
+// of its long phases, so that a generator that's killed resumes from the
+// last one rather than starting over. Each generation is identified by a
+// key of its inputs and settings, and has its own files in the checkpoint
+// directory, so that the deltas of a batch each keep theirs. The data blobs
+// are appended to one of them, which each checkpoint covers up to the data
+// size it records. The state is written to a temporary file that's synced
+// and renamed into place, so a checkpoint is either whole or not there, and
+// it ends with a CRC.
+
+namespace chromeos_update_engine {
+
+class GeneratorCheckpoint {
+ public:
+  // The phases a checkpoint is taken after, in order.
+  enum Phase {
+    kPhaseNone,        // Nothing to resume from.
+    kPhaseOperations,  // The operations and their data blobs were generated.
+    kPhaseEdges,       // The edges between the operations were created.
+    kPhaseDag,         // The cycles were broken and the operations ordered.
+  };
+
+  // Keeps the checkpoint and the data blobs in |dir|, which must exist.
+  explicit GeneratorCheckpoint(const std::string& dir);
+
+  // The file the data blobs of the generation identified by |key| are
+  // appended to.
+  std::string blobs_path(const std::string& key) const;
+
+  // Takes a checkpoint after |phase| of the generation identified by |key|,
+  // with its state in the arguments, once the blobs up to |data_file_size|
+  // are on disk. Returns true on success.
+  bool Save(const std::string& key,
+            Phase phase,
+            const Graph& graph,
+            const BlockOwners& blocks,
+            const std::vector<DeltaArchiveManifest_InstallOperation>&
+                kernel_ops,
+            Vertex::Index scratch_vertex,
+            const std::vector<Vertex::Index>& final_order,
+            off_t data_file_size);
+
+  // Restores the state in the last checkpoint of the generation identified
+  // by |key| into the arguments, and truncates the blobs to its data size.
+  // |blocks| must have no owners yet and span as many blocks as the saved
+  // one. Returns the phase the checkpoint was taken after, or kPhaseNone,
+  // leaving the arguments as they are, if there's no valid checkpoint of
+  // that generation.
+  Phase Load(const std::string& key,
+             Graph* graph,
+             BlockOwners* blocks,
+             std::vector<DeltaArchiveManifest_InstallOperation>* kernel_ops,
+             Vertex::Index* scratch_vertex,
+             std::vector<Vertex::Index>* final_order,
+             off_t* data_file_size);
+
+  // Removes the checkpoint and the data blobs of the generation identified
+  // by |key|, once its payload is written.
+  void Clear(const std::string& key);
+
+ private:
+  // Returns the path of the file of the generation identified by |key| with
+  // |suffix|.
+  std::string GenerationPath(const std::string& key,
+                             const std::string& suffix) const;
+
+  std::string state_path(const std::string& key) const;
+
+  const std::string dir_;
+
+  DISALLOW_COPY_AND_ASSIGN(GeneratorCheckpoint);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_GENERATOR_CHECKPOINT_H__
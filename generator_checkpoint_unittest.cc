@@ -0,0 +1,209 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include <base/memory/scoped_ptr.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/block_owners.h"
+#include "update_engine/extent_ranges.h"
+#include "update_engine/generator_checkpoint.h"
+#include "update_engine/graph_types.h"
+#include "update_engine/test_utils.h"
+#include "update_engine/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+const Vertex::Index kInvalid = Vertex::kInvalidIndex;
+}  // namespace {}
+
+class GeneratorCheckpointTest : public ::testing::Test {
+ protected:
+  GeneratorCheckpointTest() : blocks_(16) {}
+
+  virtual void SetUp() {
+    ASSERT_TRUE(utils::MakeTempDirectory("/tmp/GeneratorCheckpointTest.XXXXXX",
+                                         &dir_));
+    checkpoint_.reset(new GeneratorCheckpoint(dir_));
+  }
+
+  virtual void TearDown() {
+    checkpoint_.reset();
+    EXPECT_TRUE(utils::RecursiveUnlinkDir(dir_));
+  }
+
+  // Returns the path of the state of the generation with key "key".
+  string StatePath() {
+    const string& blobs = checkpoint_->blobs_path("key");
+    return blobs.substr(0, blobs.size() - strlen("blobs")) + "state";
+  }
+
+  // Fills the state of a small generation, with |blobs_size| bytes of
+  // blobs.
+  void MakeState(size_t blobs_size) {
+    graph_.resize(3);
+    graph_[0].op.set_type(DeltaArchiveManifest_InstallOperation_Type_MOVE);
+    *graph_[0].op.add_src_extents() = ExtentForRange(0, 2);
+    *graph_[0].op.add_dst_extents() = ExtentForRange(4, 2);
+    graph_[0].file_name = "/bin/sh";
+    graph_[1].op.set_type(DeltaArchiveManifest_InstallOperation_Type_REPLACE);
+    graph_[1].op.set_data_offset(0);
+    graph_[1].op.set_data_length(blobs_size);
+    *graph_[1].op.add_dst_extents() = ExtentForRange(0, 1);
+    graph_[1].file_name = "/lib/libc.so";
+    graph_[1].chunk_offset = 4096;
+    graph_[1].chunk_size = 4096;
+    graph_[1].out_edges[0].extents.push_back(ExtentForRange(0, 1));
+    graph_[2].valid = false;
+    graph_[2].out_edges[1].write_extents.push_back(ExtentForRange(0, 1));
+
+    Vertex::Index other;
+    EXPECT_TRUE(blocks_.SetReader(ExtentForRange(0, 2), 0, &other));
+    EXPECT_TRUE(blocks_.SetWriter(ExtentForRange(4, 2), 0, &other));
+    EXPECT_TRUE(blocks_.SetWriter(ExtentForRange(0, 1), 1, &other));
+
+    kernel_ops_.resize(1);
+    kernel_ops_[0].set_type(DeltaArchiveManifest_InstallOperation_Type_BSDIFF);
+    *kernel_ops_[0].add_dst_extents() = ExtentForRange(0, 8);
+
+    EXPECT_TRUE(WriteFileString(checkpoint_->blobs_path("key"),
+                                string(blobs_size, 'b')));
+  }
+
+  string dir_;
+  scoped_ptr<GeneratorCheckpoint> checkpoint_;
+  Graph graph_;
+  BlockOwners blocks_;
+  vector<DeltaArchiveManifest_InstallOperation> kernel_ops_;
+};
+
+TEST_F(GeneratorCheckpointTest, RoundTripTest) {
+  MakeState(100);
+  vector<Vertex::Index> final_order;
+  final_order.push_back(1);
+  final_order.push_back(0);
+  EXPECT_TRUE(checkpoint_->Save("key", GeneratorCheckpoint::kPhaseDag,
+                                graph_, blocks_, kernel_ops_, 2, final_order,
+                                60));
+
+  Graph graph;
+  BlockOwners blocks(16);
+  vector<DeltaArchiveManifest_InstallOperation> kernel_ops;
+  Vertex::Index scratch_vertex = kInvalid;
+  vector<Vertex::Index> loaded_order;
+  off_t data_file_size = 0;
+  EXPECT_EQ(GeneratorCheckpoint::kPhaseDag,
+            checkpoint_->Load("key", &graph, &blocks, &kernel_ops,
+                              &scratch_vertex, &loaded_order,
+                              &data_file_size));
+  ASSERT_EQ(graph_.size(), graph.size());
+  for (size_t i = 0; i < graph.size(); i++) {
+    EXPECT_EQ(graph_[i].valid, graph[i].valid);
+    EXPECT_EQ(graph_[i].op.SerializePartialAsString(),
+              graph[i].op.SerializePartialAsString());
+    EXPECT_EQ(graph_[i].file_name, graph[i].file_name);
+    EXPECT_EQ(graph_[i].chunk_offset, graph[i].chunk_offset);
+    EXPECT_EQ(graph_[i].chunk_size, graph[i].chunk_size);
+    EXPECT_TRUE(graph_[i].out_edges == graph[i].out_edges);
+  }
+  for (uint64_t block = 0; block < 16; block++) {
+    EXPECT_EQ(blocks_.reader(block), blocks.reader(block));
+    EXPECT_EQ(blocks_.writer(block), blocks.writer(block));
+  }
+  ASSERT_EQ(1, kernel_ops.size());
+  EXPECT_EQ(kernel_ops_[0].SerializePartialAsString(),
+            kernel_ops[0].SerializePartialAsString());
+  EXPECT_EQ(2, scratch_vertex);
+  EXPECT_TRUE(final_order == loaded_order);
+
+  // The blobs written past the checkpoint are dropped.
+  EXPECT_EQ(60, data_file_size);
+  EXPECT_EQ(60, utils::FileSize(checkpoint_->blobs_path("key")));
+
+  checkpoint_->Clear("key");
+  EXPECT_FALSE(utils::FileExists(checkpoint_->blobs_path("key").c_str()));
+  BlockOwners cleared_blocks(16);
+  EXPECT_EQ(GeneratorCheckpoint::kPhaseNone,
+            checkpoint_->Load("key", &graph, &cleared_blocks, &kernel_ops,
+                              &scratch_vertex, &loaded_order,
+                              &data_file_size));
+}
+
+TEST_F(GeneratorCheckpointTest, OtherGenerationTest) {
+  MakeState(100);
+  EXPECT_TRUE(checkpoint_->Save("key", GeneratorCheckpoint::kPhaseEdges,
+                                graph_, blocks_, kernel_ops_,
+                                kInvalid,
+                                vector<Vertex::Index>(), 100));
+  Graph graph;
+  BlockOwners blocks(16);
+  vector<DeltaArchiveManifest_InstallOperation> kernel_ops;
+  Vertex::Index scratch_vertex = kInvalid;
+  vector<Vertex::Index> final_order;
+  off_t data_file_size = 0;
+  EXPECT_EQ(GeneratorCheckpoint::kPhaseNone,
+            checkpoint_->Load("other key", &graph, &blocks, &kernel_ops,
+                              &scratch_vertex, &final_order,
+                              &data_file_size));
+  // The saved block count must match.
+  BlockOwners other_blocks(32);
+  EXPECT_EQ(GeneratorCheckpoint::kPhaseNone,
+            checkpoint_->Load("key", &graph, &other_blocks, &kernel_ops,
+                              &scratch_vertex, &final_order,
+                              &data_file_size));
+  EXPECT_TRUE(graph.empty());
+  EXPECT_EQ(0, data_file_size);
+
+  EXPECT_EQ(GeneratorCheckpoint::kPhaseEdges,
+            checkpoint_->Load("key", &graph, &blocks, &kernel_ops,
+                              &scratch_vertex, &final_order,
+                              &data_file_size));
+  EXPECT_EQ(3, graph.size());
+  EXPECT_EQ(kInvalid, scratch_vertex);
+  EXPECT_TRUE(final_order.empty());
+}
+
+TEST_F(GeneratorCheckpointTest, CorruptTest) {
+  MakeState(100);
+  EXPECT_TRUE(checkpoint_->Save("key", GeneratorCheckpoint::kPhaseOperations,
+                                graph_, blocks_, kernel_ops_,
+                                kInvalid,
+                                vector<Vertex::Index>(), 100));
+  string state;
+  EXPECT_TRUE(utils::ReadFile(StatePath(), &state));
+  state[state.size() / 2] ^= 1;
+  EXPECT_TRUE(WriteFileString(StatePath(), state));
+
+  Graph graph;
+  BlockOwners blocks(16);
+  vector<DeltaArchiveManifest_InstallOperation> kernel_ops;
+  Vertex::Index scratch_vertex = kInvalid;
+  vector<Vertex::Index> final_order;
+  off_t data_file_size = 0;
+  EXPECT_EQ(GeneratorCheckpoint::kPhaseNone,
+            checkpoint_->Load("key", &graph, &blocks, &kernel_ops,
+                              &scratch_vertex, &final_order,
+                              &data_file_size));
+
+  // Blobs shorter than the checkpoint's are lost too.
+  EXPECT_TRUE(checkpoint_->Save("key", GeneratorCheckpoint::kPhaseOperations,
+                                graph_, blocks_, kernel_ops_,
+                                kInvalid,
+                                vector<Vertex::Index>(), 200));
+  EXPECT_EQ(GeneratorCheckpoint::kPhaseNone,
+            checkpoint_->Load("key", &graph, &blocks, &kernel_ops,
+                              &scratch_vertex, &final_order,
+                              &data_file_size));
+  EXPECT_TRUE(graph.empty());
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,160 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/generator_profile.h"
+
+#include <time.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+#include <base/stringprintf.h>
+
+#include "update_engine/utils.h"
+
+using base::TimeDelta;
+using base::TimeTicks;
+using std::map;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+TimeDelta CpuTime(clockid_t clock) {
+  struct timespec ts;
+  if (clock_gettime(clock, &ts) != 0) {
+    PLOG(ERROR) << "clock_gettime failed";
+    return TimeDelta();
+  }
+  return TimeDelta::FromMicroseconds(
+      static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000);
+}
+
+string JsonSeconds(TimeDelta time) {
+  return StringPrintf("%.6f", time.InSecondsF());
+}
+
+}  // namespace {}
+
+GeneratorProfile::GeneratorProfile(size_t max_slowest_operations)
+    : max_slowest_operations_(max_slowest_operations) {}
+
+void GeneratorProfile::StartPhase(const string& name) {
+  Phase phase;
+  phase.name = open_phases_.empty() ?
+      name : phases_[open_phases_.back()].name + "/" + name;
+  phase.start_time = TimeTicks::Now();
+  phase.start_cpu_time = ProcessCpuTime();
+  open_phases_.push_back(phases_.size());
+  phases_.push_back(phase);
+}
+
+void GeneratorProfile::EndPhase() {
+  CHECK(!open_phases_.empty());
+  Phase* phase = &phases_[open_phases_.back()];
+  open_phases_.pop_back();
+  phase->wall_time = TimeTicks::Now() - phase->start_time;
+  phase->cpu_time = ProcessCpuTime() - phase->start_cpu_time;
+}
+
+void GeneratorProfile::AddOperation(const string& name,
+                                    const string& type,
+                                    TimeDelta cpu_time,
+                                    uint64_t bytes_in,
+                                    uint64_t bytes_out) {
+  OperationTotals* totals = &operation_totals_[type];
+  totals->count++;
+  totals->cpu_time += cpu_time;
+  totals->bytes_in += bytes_in;
+  totals->bytes_out += bytes_out;
+
+  if (max_slowest_operations_ == 0)
+    return;
+  Operation operation;
+  operation.name = name;
+  operation.type = type;
+  operation.cpu_time = cpu_time;
+  operation.bytes_in = bytes_in;
+  operation.bytes_out = bytes_out;
+  if (slowest_operations_.size() == max_slowest_operations_) {
+    if (!SlowerThan(operation, slowest_operations_.front()))
+      return;
+    std::pop_heap(slowest_operations_.begin(), slowest_operations_.end(),
+                  SlowerThan);
+    slowest_operations_.pop_back();
+  }
+  slowest_operations_.push_back(operation);
+  std::push_heap(slowest_operations_.begin(), slowest_operations_.end(),
+                 SlowerThan);
+}
+
+string GeneratorProfile::ToJson() const {
+  string json = "{\n  \"phases\": [";
+  for (vector<Phase>::const_iterator it = phases_.begin();
+       it != phases_.end(); ++it) {
+    json += StringPrintf(
+        "%s\n    {\"name\": %s, \"wall_seconds\": %s, \"cpu_seconds\": %s}",
+        it == phases_.begin() ? "" : ",",
+        utils::JsonString(it->name).c_str(),
+        JsonSeconds(it->wall_time).c_str(),
+        JsonSeconds(it->cpu_time).c_str());
+  }
+
+  json += "\n  ],\n  \"operation_types\": [";
+  for (map<string, OperationTotals>::const_iterator it =
+           operation_totals_.begin(); it != operation_totals_.end(); ++it) {
+    json += StringPrintf(
+        "%s\n    {\"type\": %s, \"count\": %llu, \"cpu_seconds\": %s, "
+        "\"bytes_in\": %llu, \"bytes_out\": %llu}",
+        it == operation_totals_.begin() ? "" : ",",
+        utils::JsonString(it->first).c_str(),
+        static_cast<unsigned long long>(it->second.count),
+        JsonSeconds(it->second.cpu_time).c_str(),
+        static_cast<unsigned long long>(it->second.bytes_in),
+        static_cast<unsigned long long>(it->second.bytes_out));
+  }
+
+  vector<Operation> slowest(slowest_operations_);
+  std::sort(slowest.begin(), slowest.end(), SlowerThan);
+  json += "\n  ],\n  \"slowest_operations\": [";
+  for (vector<Operation>::const_iterator it = slowest.begin();
+       it != slowest.end(); ++it) {
+    json += StringPrintf(
+        "%s\n    {\"name\": %s, \"type\": %s, \"cpu_seconds\": %s, "
+        "\"bytes_in\": %llu, \"bytes_out\": %llu}",
+        it == slowest.begin() ? "" : ",",
+        utils::JsonString(it->name).c_str(),
+        utils::JsonString(it->type).c_str(),
+        JsonSeconds(it->cpu_time).c_str(),
+        static_cast<unsigned long long>(it->bytes_in),
+        static_cast<unsigned long long>(it->bytes_out));
+  }
+  json += "\n  ]\n}\n";
+  return json;
+}
+
+bool GeneratorProfile::WriteJson(const string& path) const {
+  const string json = ToJson();
+  TEST_AND_RETURN_FALSE(utils::WriteFile(path.c_str(), json.data(),
+                                         json.size()));
+  return true;
+}
+
+TimeDelta GeneratorProfile::ThreadCpuTime() {
+  return CpuTime(CLOCK_THREAD_CPUTIME_ID);
+}
+
+TimeDelta GeneratorProfile::ProcessCpuTime() {
+  return CpuTime(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+bool GeneratorProfile::SlowerThan(const Operation& a, const Operation& b) {
+  if (a.cpu_time != b.cpu_time)
+    return a.cpu_time > b.cpu_time;
+  return a.name < b.name;
+}
+
+}  // namespace chromeos_update_engine
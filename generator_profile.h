@@ -0,0 +1,120 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_GENERATOR_PROFILE_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_GENERATOR_PROFILE_H__
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <base/basictypes.h>
+#include <base/time.h>
+
+// Records where the payload generator spends its time: the wall and CPU
+// time of each phase of the generation, and the CPU time and sizes of the
+// operations it encodes, broken down by operation type along with the
+// slowest ones. The profile is written out as a JSON report. It's only
+// updated from the generator's main thread.
+
+namespace chromeos_update_engine {
+
+class GeneratorProfile {
+ public:
+  // Keeps the |max_slowest_operations| operations that took the most CPU
+  // time.
+  explicit GeneratorProfile(size_t max_slowest_operations);
+
+  // Starts timing a phase called |name|. Phases started before this one
+  // ends are reported nested in it.
+  void StartPhase(const std::string& name);
+
+  // Ends the phase started last.
+  void EndPhase();
+
+  // Records an operation of type |type| for |name| that took |cpu_time| to
+  // encode |bytes_in| bytes into a |bytes_out| byte blob.
+  void AddOperation(const std::string& name,
+                    const std::string& type,
+                    base::TimeDelta cpu_time,
+                    uint64_t bytes_in,
+                    uint64_t bytes_out);
+
+  // Returns the report as a JSON object.
+  std::string ToJson() const;
+
+  // Writes the report to |path|. Returns true on success.
+  bool WriteJson(const std::string& path) const;
+
+  // Returns the CPU time used by the calling thread, or by all the threads
+  // of the process.
+  static base::TimeDelta ThreadCpuTime();
+  static base::TimeDelta ProcessCpuTime();
+
+ private:
+  struct Phase {
+    // The names of the enclosing phases and of this one, joined by '/'.
+    std::string name;
+    base::TimeTicks start_time;
+    base::TimeDelta start_cpu_time;
+    base::TimeDelta wall_time;
+    base::TimeDelta cpu_time;
+  };
+
+  struct Operation {
+    std::string name;
+    std::string type;
+    base::TimeDelta cpu_time;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+  };
+
+  struct OperationTotals {
+    OperationTotals() : count(0), bytes_in(0), bytes_out(0) {}
+    uint64_t count;
+    base::TimeDelta cpu_time;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+  };
+
+  // Orders operations by decreasing CPU time, then by name, so that
+  // |slowest_operations_| is a min-heap whose top is the first to go.
+  static bool SlowerThan(const Operation& a, const Operation& b);
+
+  const size_t max_slowest_operations_;
+
+  // All phases in the order they were started, and the indexes of those
+  // that haven't ended.
+  std::vector<Phase> phases_;
+  std::vector<size_t> open_phases_;
+
+  std::map<std::string, OperationTotals> operation_totals_;
+  std::vector<Operation> slowest_operations_;
+
+  DISALLOW_COPY_AND_ASSIGN(GeneratorProfile);
+};
+
+// Times a phase of |profile|, if not NULL, for the lifetime of the object.
+class ScopedGeneratorPhase {
+ public:
+  ScopedGeneratorPhase(GeneratorProfile* profile, const std::string& name)
+      : profile_(profile) {
+    if (profile_)
+      profile_->StartPhase(name);
+  }
+
+  ~ScopedGeneratorPhase() {
+    if (profile_)
+      profile_->EndPhase();
+  }
+
+ private:
+  GeneratorProfile* profile_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedGeneratorPhase);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_GENERATOR_PROFILE_H__
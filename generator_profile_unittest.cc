@@ -0,0 +1,97 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <string>
+
+#include <base/time.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/generator_profile.h"
+#include "update_engine/test_utils.h"
+#include "update_engine/utils.h"
+
+using base::TimeDelta;
+using std::string;
+
+namespace chromeos_update_engine {
+
+TEST(GeneratorProfileTest, PhasesTest) {
+  GeneratorProfile profile(0);
+  {
+    ScopedGeneratorPhase outer(&profile, "Outer");
+    ScopedGeneratorPhase inner(&profile, "Inner");
+  }
+  ScopedGeneratorPhase ignored(NULL, "Ignored");
+  profile.StartPhase("Second");
+  profile.EndPhase();
+
+  const string json = profile.ToJson();
+  const string::size_type outer = json.find("{\"name\": \"Outer\"");
+  const string::size_type inner = json.find("{\"name\": \"Outer/Inner\"");
+  const string::size_type second = json.find("{\"name\": \"Second\"");
+  EXPECT_NE(string::npos, outer);
+  EXPECT_LT(outer, inner);
+  EXPECT_LT(inner, second);
+  EXPECT_EQ(string::npos, json.find("Ignored"));
+  EXPECT_NE(string::npos, json.find("\"slowest_operations\": [\n  ]"));
+}
+
+TEST(GeneratorProfileTest, OperationsTest) {
+  GeneratorProfile profile(2);
+  profile.AddOperation("/fast", "BSDIFF", TimeDelta::FromMilliseconds(1),
+                       100, 10);
+  profile.AddOperation("/slow", "BSDIFF", TimeDelta::FromSeconds(3),
+                       200, 20);
+  profile.AddOperation("/medium", "REPLACE_BZ", TimeDelta::FromSeconds(2),
+                       300, 30);
+  profile.AddOperation("/quote\"d", "MOVE", TimeDelta(), 400, 0);
+
+  const string json = profile.ToJson();
+  EXPECT_NE(string::npos, json.find(
+      "{\"type\": \"BSDIFF\", \"count\": 2, \"cpu_seconds\": 3.001000, "
+      "\"bytes_in\": 300, \"bytes_out\": 30}"));
+  EXPECT_NE(string::npos, json.find(
+      "{\"type\": \"MOVE\", \"count\": 1, \"cpu_seconds\": 0.000000, "
+      "\"bytes_in\": 400, \"bytes_out\": 0}"));
+  // Only the two slowest are listed, slowest first.
+  const string::size_type slow = json.find(
+      "{\"name\": \"/slow\", \"type\": \"BSDIFF\", \"cpu_seconds\": "
+      "3.000000, \"bytes_in\": 200, \"bytes_out\": 20}");
+  const string::size_type medium = json.find("{\"name\": \"/medium\"");
+  EXPECT_NE(string::npos, slow);
+  EXPECT_LT(slow, medium);
+  EXPECT_NE(string::npos, medium);
+  EXPECT_EQ(string::npos, json.find("{\"name\": \"/fast\""));
+  EXPECT_EQ(string::npos, json.find("{\"name\": \"/quote"));
+
+  GeneratorProfile quoted(1);
+  quoted.AddOperation("/quote\"d\\\n", "MOVE", TimeDelta(), 1, 0);
+  EXPECT_NE(string::npos,
+            quoted.ToJson().find("\"/quote\\\"d\\\\\\u000a\""));
+}
+
+TEST(GeneratorProfileTest, WriteJsonTest) {
+  string path;
+  ASSERT_TRUE(utils::MakeTempFile("/tmp/GeneratorProfileTest.XXXXXX", &path,
+                                  NULL));
+  ScopedPathUnlinker path_unlinker(path);
+  GeneratorProfile profile(1);
+  profile.AddOperation("/file", "REPLACE", TimeDelta(), 1, 1);
+  EXPECT_TRUE(profile.WriteJson(path));
+  string contents;
+  EXPECT_TRUE(utils::ReadFile(path, &contents));
+  EXPECT_EQ(profile.ToJson(), contents);
+}
+
+TEST(GeneratorProfileTest, CpuTimeTest) {
+  const TimeDelta start = GeneratorProfile::ThreadCpuTime();
+  volatile uint64_t sum = 0;
+  for (uint64_t i = 0; i < 10000000; i++)
+    sum += i;
+  EXPECT_GT(GeneratorProfile::ThreadCpuTime(), start);
+  EXPECT_GE(GeneratorProfile::ProcessCpuTime(),
+            GeneratorProfile::ThreadCpuTime() - start);
+}
+
+}  // namespace chromeos_update_engine
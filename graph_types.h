@@ -5,6 +5,8 @@
 #ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_GRAPH_TYPES_H__
 #define CHROMEOS_PLATFORM_UPDATE_ENGINE_GRAPH_TYPES_H__
 
+#include <sys/types.h>
+
 #include <map>
 #include <set>
 #include <string>
@@ -37,26 +39,19 @@ struct EdgeProperties {
 };
 
 struct Vertex {
-  Vertex() : valid(true), index(-1), lowlink(-1) {}
+  Vertex() : valid(true), chunk_offset(0), chunk_size(-1) {}
   bool valid;
   
   typedef std::map<std::vector<Vertex>::size_type, EdgeProperties> EdgeMap;
   EdgeMap out_edges;
 
-  // We sometimes wish to consider a subgraph of a graph. A subgraph would have
-  // a subset of the vertices from the graph and a subset of the edges.
-  // When considering this vertex within a subgraph, subgraph_edges stores
-  // the out-edges.
-  typedef std::set<std::vector<Vertex>::size_type> SubgraphEdgeMap;
-  SubgraphEdgeMap subgraph_edges;
-
-  // For Tarjan's algorithm:
-  std::vector<Vertex>::size_type index;
-  std::vector<Vertex>::size_type lowlink;
-
-  // Other Vertex properties:
+  // Vertex properties:
   DeltaArchiveManifest_InstallOperation op;
   std::string file_name;
+  // The part of |file_name| the operation writes: |chunk_size| bytes from
+  // |chunk_offset| on, or everything from there if |chunk_size| is -1.
+  off_t chunk_offset;
+  off_t chunk_size;
 
   typedef std::vector<Vertex>::size_type Index;
   static const Vertex::Index kInvalidIndex = -1;
@@ -4,6 +4,7 @@
 
 #include "update_engine/graph_utils.h"
 
+#include <algorithm>
 #include <string>
 #include <utility>
 #include <vector>
@@ -32,28 +33,163 @@ uint64_t EdgeWeight(const Graph& graph, const Edge& edge) {
   return weight;
 }
 
+uint64_t EdgeWeight(const CsrGraph& graph, const Edge& edge) {
+  CsrGraph::EdgeIndex edge_index = graph.FindEdge(edge.first, edge.second);
+  CHECK_NE(edge_index, CsrGraph::kInvalidEdge);
+  return graph.EdgeWeight(edge_index);
+}
+
 void AppendBlockToExtents(vector<Extent>* extents, uint64_t block) {
+  AppendBlocksToExtents(extents, block, 1);
+}
+
+void AppendExtentToExtents(vector<Extent>* extents, const Extent& extent) {
+  DCHECK_NE(extent.start_block(), kSparseHole);
+  AppendBlocksToExtents(extents, extent.start_block(), extent.num_blocks());
+}
+
+void AppendBlocksToExtents(vector<Extent>* extents,
+                           uint64_t start_block,
+                           uint64_t num_blocks) {
+  if (num_blocks == 0)
+    return;
   if (!extents->empty()) {
-    Extent& extent = extents->back();
-    if (block == kSparseHole) {
-      if (extent.start_block() == kSparseHole) {
-        // Extend sparse hole extent
-        extent.set_num_blocks(extent.num_blocks() + 1);
-        return;
-      } else {
-        // Create new extent below outer 'if'
-      }
-    } else if (extent.start_block() + extent.num_blocks() == block) {
-      extent.set_num_blocks(extent.num_blocks() + 1);
+    Extent& last = extents->back();
+    if (start_block == kSparseHole ?
+        last.start_block() == kSparseHole :
+        (last.start_block() != kSparseHole &&
+         last.start_block() + last.num_blocks() == start_block)) {
+      last.set_num_blocks(last.num_blocks() + num_blocks);
       return;
     }
   }
-  Extent new_extent;
-  new_extent.set_start_block(block);
-  new_extent.set_num_blocks(1);
-  extents->push_back(new_extent);
+  Extent extent;
+  extent.set_start_block(start_block);
+  extent.set_num_blocks(num_blocks);
+  extents->push_back(extent);
+}
+
+template<typename T>
+vector<Extent> MergeExtents(const T& extents) {
+  vector<Extent> merged;
+  for (size_t i = 0, e = static_cast<size_t>(extents.size()); i != e; ++i) {
+    const Extent extent = GetElement(extents, i);
+    AppendBlocksToExtents(&merged, extent.start_block(), extent.num_blocks());
+  }
+  return merged;
+}
+
+template vector<Extent> MergeExtents(const vector<Extent>& extents);
+template vector<Extent> MergeExtents(
+    const google::protobuf::RepeatedPtrField<Extent>& extents);
+
+namespace {
+
+// A run of blocks of the removed extents and the blocks replacing them.
+struct Substitution {
+  uint64_t remove_start;
+  uint64_t num_blocks;
+  uint64_t replace_start;
+
+  bool operator<(const Substitution& other) const {
+    return remove_start < other.remove_start;
+  }
+};
+
+// Returns the runs over which |remove_extents| and |replace_extents| are
+// both contiguous, by the blocks they remove.
+vector<Substitution> Substitutions(const vector<Extent>& remove_extents,
+                                   const vector<Extent>& replace_extents) {
+  CHECK_EQ(BlocksInExtents(remove_extents), BlocksInExtents(replace_extents));
+  vector<Substitution> substitutions;
+  vector<Extent>::const_iterator remove = remove_extents.begin();
+  vector<Extent>::const_iterator replace = replace_extents.begin();
+  uint64_t remove_done = 0, replace_done = 0;
+  while (remove != remove_extents.end() && replace != replace_extents.end()) {
+    const uint64_t num_blocks =
+        std::min(remove->num_blocks() - remove_done,
+                 replace->num_blocks() - replace_done);
+    if (num_blocks > 0) {
+      DCHECK_NE(remove->start_block(), kSparseHole);
+      Substitution substitution;
+      substitution.remove_start = remove->start_block() + remove_done;
+      substitution.num_blocks = num_blocks;
+      substitution.replace_start = replace->start_block() + replace_done;
+      substitutions.push_back(substitution);
+    }
+    remove_done += num_blocks;
+    replace_done += num_blocks;
+    if (remove_done == remove->num_blocks()) {
+      ++remove;
+      remove_done = 0;
+    }
+    if (replace_done == replace->num_blocks()) {
+      ++replace;
+      replace_done = 0;
+    }
+  }
+  std::sort(substitutions.begin(), substitutions.end());
+  return substitutions;
 }
 
+}  // namespace {}
+
+template<typename T>
+vector<Extent> SubstituteExtents(const T& extents,
+                                 const vector<Extent>& remove_extents,
+                                 const vector<Extent>& replace_extents) {
+  const vector<Substitution> substitutions =
+      Substitutions(remove_extents, replace_extents);
+  vector<Extent> result;
+  for (size_t i = 0, e = static_cast<size_t>(extents.size()); i != e; ++i) {
+    const Extent extent = GetElement(extents, i);
+    if (extent.start_block() == kSparseHole) {
+      AppendBlocksToExtents(&result, kSparseHole, extent.num_blocks());
+      continue;
+    }
+    uint64_t block = extent.start_block();
+    const uint64_t end = block + extent.num_blocks();
+    // The first substitution that may cover |block| is the last one that
+    // starts at or before it.
+    Substitution key;
+    key.remove_start = block;
+    vector<Substitution>::const_iterator it =
+        std::upper_bound(substitutions.begin(), substitutions.end(), key);
+    if (it != substitutions.begin())
+      --it;
+    while (block < end) {
+      while (it != substitutions.end() &&
+             it->remove_start + it->num_blocks <= block) {
+        ++it;
+      }
+      if (it == substitutions.end() || it->remove_start >= end) {
+        AppendBlocksToExtents(&result, block, end - block);
+        break;
+      }
+      if (it->remove_start > block) {
+        AppendBlocksToExtents(&result, block, it->remove_start - block);
+        block = it->remove_start;
+      }
+      const uint64_t run_end =
+          std::min(end, it->remove_start + it->num_blocks);
+      AppendBlocksToExtents(&result,
+                            it->replace_start + (block - it->remove_start),
+                            run_end - block);
+      block = run_end;
+    }
+  }
+  return result;
+}
+
+template vector<Extent> SubstituteExtents(
+    const vector<Extent>& extents,
+    const vector<Extent>& remove_extents,
+    const vector<Extent>& replace_extents);
+template vector<Extent> SubstituteExtents(
+    const google::protobuf::RepeatedPtrField<Extent>& extents,
+    const vector<Extent>& remove_extents,
+    const vector<Extent>& replace_extents);
+
 void AddReadBeforeDep(Vertex* src,
                       Vertex::Index dst,
                       uint64_t block) {
@@ -71,15 +207,11 @@ void AddReadBeforeDep(Vertex* src,
 void AddReadBeforeDepExtents(Vertex* src,
                              Vertex::Index dst,
                              const vector<Extent>& extents) {
-  // TODO(adlr): Be more efficient than adding each block individually.
   for (vector<Extent>::const_iterator it = extents.begin(), e = extents.end();
        it != e; ++it) {
-    const Extent& extent = *it;
-    for (uint64_t block = extent.start_block(),
-             block_end = extent.start_block() + extent.num_blocks();
-         block != block_end; ++block) {
-      AddReadBeforeDep(src, dst, block);
-    }
+    if (it->num_blocks() == 0)
+      continue;
+    AppendExtentToExtents(&src->out_edges[dst].extents, *it);
   }
 }
 
@@ -154,6 +286,21 @@ void DumpGraph(const Graph& graph) {
       case DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ:
         type_str = "REPLACE_BZ";
         break;
+      case DeltaArchiveManifest_InstallOperation_Type_REPLACE_XZ:
+        type_str = "REPLACE_XZ";
+        break;
+      case DeltaArchiveManifest_InstallOperation_Type_REPLACE_XZ_DICT:
+        type_str = "REPLACE_XZ_DICT";
+        break;
+      case DeltaArchiveManifest_InstallOperation_Type_ZERO:
+        type_str = "ZERO";
+        break;
+      case DeltaArchiveManifest_InstallOperation_Type_STREAM_DIFF:
+        type_str = "STREAM_DIFF";
+        break;
+      case DeltaArchiveManifest_InstallOperation_Type_DISCARD:
+        type_str = "DISCARD";
+        break;
     }
     LOG(INFO) << i 
               << (graph[i].valid ? "" : "-INV")
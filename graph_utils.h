@@ -7,6 +7,7 @@
 
 #include <vector>
 #include "base/basictypes.h"
+#include "update_engine/csr_graph.h"
 #include "update_engine/graph_types.h"
 #include "update_engine/update_metadata.pb.h"
 
@@ -18,6 +19,7 @@ namespace graph_utils {
 
 // Returns the number of blocks represented by all extents in the edge.
 uint64_t EdgeWeight(const Graph& graph, const Edge& edge);
+uint64_t EdgeWeight(const CsrGraph& graph, const Edge& edge);
 
 // These add a read-before dependency from graph[src] -> graph[dst]. If the dep
 // already exists, the block/s is/are added to the existing edge.
@@ -38,6 +40,34 @@ void DropIncomingEdgesTo(Graph* graph, Vertex::Index index);
 // into an arbitrary place in the extents.
 void AppendBlockToExtents(std::vector<Extent>* extents, uint64_t block);
 
+// Like AppendBlockToExtents(), for all the blocks of |extent|, which
+// mustn't be a sparse hole.
+void AppendExtentToExtents(std::vector<Extent>* extents, const Extent& extent);
+
+// Appends the run of |num_blocks| blocks from |start_block|, which may be
+// kSparseHole, to |extents|, merging it into the last extent if it follows
+// it. Nothing is appended for an empty run.
+void AppendBlocksToExtents(std::vector<Extent>* extents,
+                           uint64_t start_block,
+                           uint64_t num_blocks);
+
+// Returns |extents| with the extents that follow each other merged and the
+// empty ones dropped. The blocks are the same, in the same order, so two
+// collections list the same blocks if and only if their merged extents are
+// equal.
+template<typename T>
+std::vector<Extent> MergeExtents(const T& extents);
+
+// Returns |extents| with each block that's the i-th block of
+// |remove_extents| replaced by the i-th block of |replace_extents|, which
+// lists as many blocks, and the other blocks as they are. The extents are
+// mapped a run at a time, so they're never expanded into blocks.
+template<typename T>
+std::vector<Extent> SubstituteExtents(
+    const T& extents,
+    const std::vector<Extent>& remove_extents,
+    const std::vector<Extent>& replace_extents);
+
 // Get/SetElement are intentionally overloaded so that templated functions
 // can accept either type of collection of Extents.
 Extent GetElement(const std::vector<Extent>& collection, size_t index);
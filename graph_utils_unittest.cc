@@ -64,6 +64,71 @@ TEST(GraphUtilsTest, BlocksInExtentsTest) {
   }
 }
 
+TEST(GraphUtilsTest, AppendBlocksToExtentsTest) {
+  vector<Extent> extents;
+  graph_utils::AppendBlocksToExtents(&extents, 10, 0);
+  EXPECT_TRUE(extents.empty());
+  graph_utils::AppendBlocksToExtents(&extents, 10, 2);
+  graph_utils::AppendBlocksToExtents(&extents, 12, 3);
+  graph_utils::AppendBlocksToExtents(&extents, kSparseHole, 2);
+  graph_utils::AppendBlocksToExtents(&extents, kSparseHole, 1);
+  graph_utils::AppendBlocksToExtents(&extents, 15, 1);
+  ASSERT_EQ(3, extents.size());
+  EXPECT_TRUE(extents[0] == ExtentForRange(10, 5));
+  EXPECT_TRUE(extents[1] == ExtentForRange(kSparseHole, 3));
+  EXPECT_TRUE(extents[2] == ExtentForRange(15, 1));
+}
+
+TEST(GraphUtilsTest, MergeExtentsTest) {
+  google::protobuf::RepeatedPtrField<Extent> extents;
+  *extents.Add() = ExtentForRange(4, 2);
+  *extents.Add() = ExtentForRange(6, 0);
+  *extents.Add() = ExtentForRange(6, 1);
+  *extents.Add() = ExtentForRange(1, 1);
+  *extents.Add() = ExtentForRange(2, 2);
+  vector<Extent> merged = graph_utils::MergeExtents(extents);
+  ASSERT_EQ(2, merged.size());
+  EXPECT_TRUE(merged[0] == ExtentForRange(4, 3));
+  EXPECT_TRUE(merged[1] == ExtentForRange(1, 3));
+  EXPECT_TRUE(graph_utils::MergeExtents(merged) == merged);
+}
+
+TEST(GraphUtilsTest, SubstituteExtentsTest) {
+  // Blocks 2-5 and 10 become 20, 21, 30, 31 and 40.
+  vector<Extent> remove_extents;
+  remove_extents.push_back(ExtentForRange(10, 1));
+  remove_extents.push_back(ExtentForRange(2, 4));
+  vector<Extent> replace_extents;
+  replace_extents.push_back(ExtentForRange(40, 1));
+  replace_extents.push_back(ExtentForRange(20, 2));
+  replace_extents.push_back(ExtentForRange(30, 2));
+
+  vector<Extent> extents;
+  extents.push_back(ExtentForRange(0, 4));
+  extents.push_back(ExtentForRange(kSparseHole, 2));
+  extents.push_back(ExtentForRange(5, 7));
+  vector<Extent> substituted = graph_utils::SubstituteExtents(
+      extents, remove_extents, replace_extents);
+  // The blocks are 0, 1, 20, 21, the hole, 31, 6-9, 40 and 11.
+  ASSERT_EQ(7, substituted.size());
+  EXPECT_TRUE(substituted[0] == ExtentForRange(0, 2));
+  EXPECT_TRUE(substituted[1] == ExtentForRange(20, 2));
+  EXPECT_TRUE(substituted[2] == ExtentForRange(kSparseHole, 2));
+  EXPECT_TRUE(substituted[3] == ExtentForRange(31, 1));
+  EXPECT_TRUE(substituted[4] == ExtentForRange(6, 4));
+  EXPECT_TRUE(substituted[5] == ExtentForRange(40, 1));
+  EXPECT_TRUE(substituted[6] == ExtentForRange(11, 1));
+
+  // Without any blocks to substitute, the extents are merged.
+  google::protobuf::RepeatedPtrField<Extent> field;
+  *field.Add() = ExtentForRange(7, 1);
+  *field.Add() = ExtentForRange(8, 1);
+  substituted = graph_utils::SubstituteExtents(
+      field, vector<Extent>(), vector<Extent>());
+  ASSERT_EQ(1, substituted.size());
+  EXPECT_TRUE(substituted[0] == ExtentForRange(7, 2));
+}
+
 TEST(GraphUtilsTest, DepsTest) {
   Graph graph(3);
   
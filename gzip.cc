@@ -0,0 +1,110 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/gzip.h"
+
+#include <string.h>
+#include <zlib.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+
+#include "update_engine/utils.h"
+
+using std::max;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Adding this to the window bits makes zlib write and read a gzip header and
+// trailer rather than its own.
+const int kGzipWindowBits = 15 + 16;
+
+// The deflate memory level, zlib's default.
+const int kMemLevel = 8;
+
+// Compresses the |in_size| bytes at |in| to |out|.
+bool GzipData(const char* in, size_t in_size, vector<char>* out) {
+  TEST_AND_RETURN_FALSE(out);
+  out->clear();
+  if (in_size == 0)
+    return true;
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  TEST_AND_RETURN_FALSE(deflateInit2(&stream,
+                                     Z_BEST_COMPRESSION,
+                                     Z_DEFLATED,
+                                     kGzipWindowBits,
+                                     kMemLevel,
+                                     Z_DEFAULT_STRATEGY) == Z_OK);
+  // The bound leaves room for the gzip header and trailer, so the whole
+  // stream is written in one call.
+  out->resize(deflateBound(&stream, in_size));
+  stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in));
+  stream.avail_in = in_size;
+  stream.next_out = reinterpret_cast<Bytef*>(&(*out)[0]);
+  stream.avail_out = out->size();
+  int rc = deflate(&stream, Z_FINISH);
+  out->resize(out->size() - stream.avail_out);
+  deflateEnd(&stream);
+  TEST_AND_RETURN_FALSE(rc == Z_STREAM_END);
+  return true;
+}
+
+// Decompresses the |in_size| bytes at |in| to |out|.
+bool GunzipData(const char* in, size_t in_size, vector<char>* out) {
+  TEST_AND_RETURN_FALSE(out);
+  out->clear();
+  if (in_size == 0)
+    return true;
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  TEST_AND_RETURN_FALSE(inflateInit2(&stream, kGzipWindowBits) == Z_OK);
+  stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in));
+  stream.avail_in = in_size;
+  // Try increasing buffer size until it all fits.
+  int rc = Z_OK;
+  while (rc == Z_OK) {
+    size_t out_pos = out->size();
+    out->resize(out_pos + max(in_size, out_pos));
+    stream.next_out = reinterpret_cast<Bytef*>(&(*out)[out_pos]);
+    stream.avail_out = out->size() - out_pos;
+    rc = inflate(&stream, Z_FINISH);
+    // Z_FINISH reports a full output buffer as an error.
+    if (rc == Z_BUF_ERROR && stream.avail_out == 0)
+      rc = Z_OK;
+  }
+  out->resize(out->size() - stream.avail_out);
+  inflateEnd(&stream);
+  TEST_AND_RETURN_FALSE(rc == Z_STREAM_END);
+  return true;
+}
+
+}  // namespace {}
+
+bool GzipDecompress(const vector<char>& in, vector<char>* out) {
+  return GunzipData(in.empty() ? NULL : &in[0], in.size(), out);
+}
+
+bool GzipCompress(const vector<char>& in, vector<char>* out) {
+  return GzipData(in.empty() ? NULL : &in[0], in.size(), out);
+}
+
+bool GzipCompressBytes(const char* in, size_t in_size, vector<char>* out) {
+  return GzipData(in, in_size, out);
+}
+
+bool GzipCompressString(const string& str, vector<char>* out) {
+  return GzipData(str.data(), str.size(), out);
+}
+
+bool GzipDecompressString(const string& str, vector<char>* out) {
+  return GunzipData(str.data(), str.size(), out);
+}
+
+}  // namespace chromeos_update_engine
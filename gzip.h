@@ -0,0 +1,26 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_GZIP_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_GZIP_H__
+
+#include <string>
+#include <vector>
+
+namespace chromeos_update_engine {
+
+// gzip compresses or decompresses str/in to out, as HTTP's gzip content
+// coding. Empty input maps to empty output both ways.
+bool GzipDecompress(const std::vector<char>& in, std::vector<char>* out);
+bool GzipCompress(const std::vector<char>& in, std::vector<char>* out);
+bool GzipCompressString(const std::string& str, std::vector<char>* out);
+bool GzipDecompressString(const std::string& str, std::vector<char>* out);
+
+// gzip compresses the |in_size| bytes at |in| to out.
+bool GzipCompressBytes(const char* in, size_t in_size,
+                       std::vector<char>* out);
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_GZIP_H__
@@ -32,6 +32,9 @@ class HttpFetcher {
  public:
   HttpFetcher(SystemState* system_state)
       : post_data_set_(false),
+        compress_post_data_(false),
+        accept_compressed_response_(false),
+        response_retry_after_(0),
         http_response_code_(0),
         delegate_(NULL),
         system_state_(system_state) {}
@@ -49,6 +52,31 @@ class HttpFetcher {
   // Same without a specified Content-Type.
   void SetPostData(const void* data, size_t size);
 
+  // Optional: Sends the post data gzip compressed, with a Content-Encoding
+  // header. The server must support it.
+  void set_compress_post_data(bool compress) { compress_post_data_ = compress; }
+
+  // Optional: Lets the server compress the response, which is decompressed
+  // as it comes in, before it's passed to the delegate. Transfers resumed
+  // from an offset are never compressed, since the offset is in the
+  // uncompressed response.
+  void set_accept_compressed_response(bool accept) {
+    accept_compressed_response_ = accept;
+  }
+
+  // Optional: Makes the request conditional on the response having changed
+  // since the one with ETag |etag|, or unconditional if it's empty. The
+  // server replies 304 Not Modified otherwise, which completes the transfer
+  // unsuccessfully with that response code.
+  void set_if_none_match(const std::string& etag) { if_none_match_ = etag; }
+
+  // Returns the ETag of the last response, or an empty string.
+  const std::string& response_etag() const { return response_etag_; }
+
+  // Returns the number of seconds the last response asked to wait before
+  // the next request, with a Retry-After header, or 0.
+  int response_retry_after() const { return response_retry_after_; }
+
   // Downloading should resume from this offset
   virtual void SetOffset(off_t offset) = 0;
 
@@ -75,14 +103,16 @@ class HttpFetcher {
   // Unpause() returns
   virtual void Unpause() = 0;
 
-  // These two function are overloaded in LibcurlHttp fetcher to speed
-  // testing.
-  virtual void set_idle_seconds(int seconds) {}
+  // Overloaded in LibcurlHttp fetcher to speed testing.
   virtual void set_retry_seconds(int seconds) {}
 
   // Get the total number of bytes downloaded by fetcher.
   virtual size_t GetBytesDownloaded() = 0;
 
+  // Returns the number of times the fetcher has retried a transfer, over all
+  // of its transfers.
+  virtual int GetRetryCount() { return 0; }
+
   // These are used for testing:
   virtual void SetBuildType(bool is_official) {}
 
@@ -98,6 +128,18 @@ class HttpFetcher {
   bool post_data_set_;
   std::vector<char> post_data_;
   HttpContentType post_content_type_;
+  bool compress_post_data_;
+
+  // Whether the response may be compressed.
+  bool accept_compressed_response_;
+
+  // The ETag the request is conditional on, if any, and the ETag of the
+  // last response.
+  std::string if_none_match_;
+  std::string response_etag_;
+
+  // The Retry-After delay of the last response, in seconds, or 0.
+  int response_retry_after_;
 
   // The server's HTTP response code from the last transfer. This
   // field should be set to 0 when a new transfer is initiated, and
@@ -122,9 +164,32 @@ class HttpFetcherDelegate {
                              const char* bytes,
                              int length) = 0;
 
+  // Optional buffer lending, which saves the fetcher from handing its own
+  // buffer to ReceivedBytes() and the delegate from copying the data out of
+  // it. If this returns room for at least |length| bytes, the fetcher writes
+  // the next |length| or fewer received bytes there and then calls
+  // ReceivedBytesInBuffer() instead of ReceivedBytes(). Returning NULL makes
+  // the fetcher call ReceivedBytes() as usual.
+  virtual char* GetReceiveBuffer(HttpFetcher* fetcher, size_t length) {
+    return NULL;
+  }
+
+  // Called instead of ReceivedBytes() once |length| bytes have been received
+  // into the room returned by the last GetReceiveBuffer() call.
+  virtual void ReceivedBytesInBuffer(HttpFetcher* fetcher, int length) {}
+
   // Called if the fetcher seeks to a particular offset.
   virtual void SeekToOffset(off_t offset) {}
 
+  // Optionally called by fetchers that download several ranges at once, see
+  // MultiRangeHttpFetcher, with the |length| bytes at |offset| received for
+  // a range that's still waiting for the ones before it. They're passed to
+  // ReceivedBytes() again in order.
+  virtual void ReceivedBytesAhead(HttpFetcher* fetcher,
+                                  off_t offset,
+                                  const char* bytes,
+                                  int length) {}
+
   // When a transfer has completed, exactly one of these two methods will be
   // called. TransferTerminated is called when the transfer has been aborted
   // through TerminateTransfer. TransferComplete is called in all other
@@ -217,7 +217,6 @@ class LibcurlHttpFetcherTest : public AnyHttpFetcherTest {
     LibcurlHttpFetcher *ret = new
         LibcurlHttpFetcher(&mock_system_state_);
     // Speed up test execution.
-    ret->set_idle_seconds(1);
     ret->set_retry_seconds(1);
     ret->SetBuildType(false);
     return ret;
@@ -264,7 +263,6 @@ class MultiRangeHttpFetcherTest : public LibcurlHttpFetcherTest {
     ret->ClearRanges();
     ret->AddRange(0);
     // Speed up test execution.
-    ret->set_idle_seconds(1);
     ret->set_retry_seconds(1);
     ret->SetBuildType(false);
     return ret;
@@ -279,6 +277,33 @@ class MultiRangeHttpFetcherTest : public LibcurlHttpFetcherTest {
   virtual bool IsMulti() const { return true; }
 };
 
+class ParallelMultiRangeHttpFetcherTest : public MultiRangeHttpFetcherTest {
+ public:
+  // Necessary to unhide the definition in the base class.
+  using AnyHttpFetcherTest::NewLargeFetcher;
+  virtual HttpFetcher* NewLargeFetcher() {
+    MultiRangeHttpFetcher *ret =
+        new MultiRangeHttpFetcher(
+            new LibcurlHttpFetcher(&mock_system_state_));
+    ret->AddParallelFetcher(new LibcurlHttpFetcher(&mock_system_state_));
+    ret->AddParallelFetcher(new LibcurlHttpFetcher(&mock_system_state_));
+    // Make the ranges ahead pause, too.
+    ret->set_max_buffered_bytes(1000);
+    ret->ClearRanges();
+    ret->AddRange(0);
+    // Speed up test execution.
+    ret->set_retry_seconds(1);
+    ret->SetBuildType(false);
+    return ret;
+  }
+
+  // Necessary to unhide the definition in the base class.
+  using AnyHttpFetcherTest::NewSmallFetcher;
+  virtual HttpFetcher* NewSmallFetcher() {
+    return NewLargeFetcher();
+  }
+};
+
 
 //
 // Infrastructure for type tests of HTTP fetcher.
@@ -302,7 +327,9 @@ class HttpFetcherTest : public ::testing::Test {
 // Test case types list.
 typedef ::testing::Types<LibcurlHttpFetcherTest,
                          MockHttpFetcherTest,
-                         MultiRangeHttpFetcherTest> HttpFetcherTestTypes;
+                         MultiRangeHttpFetcherTest,
+                         ParallelMultiRangeHttpFetcherTest>
+    HttpFetcherTestTypes;
 TYPED_TEST_CASE(HttpFetcherTest, HttpFetcherTestTypes);
 
 
@@ -418,6 +445,79 @@ TYPED_TEST(HttpFetcherTest, SimpleBigTest) {
   g_main_loop_unref(loop);
 }
 
+namespace {
+class LendingHttpFetcherTestDelegate : public HttpFetcherDelegate {
+ public:
+  LendingHttpFetcherTestDelegate() : times_lent_(0) {}
+
+  virtual char* GetReceiveBuffer(HttpFetcher* fetcher, size_t length) {
+    lent_.resize(length);
+    return &lent_[0];
+  }
+
+  virtual void ReceivedBytesInBuffer(HttpFetcher* fetcher, int length) {
+    EXPECT_LE(static_cast<size_t>(length), lent_.size());
+    data_.append(&lent_[0], length);
+    times_lent_++;
+  }
+
+  virtual void ReceivedBytes(HttpFetcher* fetcher,
+                             const char* bytes, int length) {
+    data_.append(bytes, length);
+  }
+
+  virtual void TransferComplete(HttpFetcher* fetcher, bool successful) {
+    EXPECT_TRUE(successful);
+    g_main_loop_quit(loop_);
+  }
+
+  virtual void TransferTerminated(HttpFetcher* fetcher) {
+    ADD_FAILURE();
+  }
+
+  GMainLoop* loop_;
+  vector<char> lent_;
+  string data_;
+  int times_lent_;
+};
+}  // namespace {}
+
+TYPED_TEST(HttpFetcherTest, LendingBufferTest) {
+  if (this->test_.IsMock())
+    return;
+  GMainLoop* loop = g_main_loop_new(g_main_context_default(), FALSE);
+  {
+    LendingHttpFetcherTestDelegate delegate;
+    delegate.loop_ = loop;
+    scoped_ptr<HttpFetcher> fetcher(this->test_.NewLargeFetcher());
+    fetcher->set_delegate(&delegate);
+
+    MockConnectionManager* mock_cm = dynamic_cast<MockConnectionManager*>(
+        fetcher->GetSystemState()->connection_manager());
+    EXPECT_CALL(*mock_cm, GetConnectionType(_,_))
+      .WillRepeatedly(DoAll(SetArgumentPointee<1>(kNetEthernet), Return(true)));
+    EXPECT_CALL(*mock_cm, IsUpdateAllowedOver(kNetEthernet))
+      .WillRepeatedly(Return(true));
+    EXPECT_CALL(*mock_cm, StringForConnectionType(kNetEthernet))
+      .WillRepeatedly(Return(flimflam::kTypeEthernet));
+
+    scoped_ptr<HttpServer> server(this->test_.CreateServer());
+    ASSERT_TRUE(server->started_);
+
+    StartTransferArgs start_xfer_args = {fetcher.get(), this->test_.BigUrl()};
+
+    g_timeout_add(0, StartTransfer, &start_xfer_args);
+    g_main_loop_run(loop);
+
+    // All the data went through the lent buffer.
+    EXPECT_GT(delegate.times_lent_, 0);
+    ASSERT_EQ(static_cast<size_t>(kBigLength), delegate.data_.size());
+    for (int i = 0; i < kBigLength; i++)
+      ASSERT_EQ('a' + i % 10, delegate.data_[i]) << "offset " << i;
+  }
+  g_main_loop_unref(loop);
+}
+
 // Issue #9648: when server returns an error HTTP response, the fetcher needs to
 // terminate transfer prematurely, rather than try to process the error payload.
 TYPED_TEST(HttpFetcherTest, ErrorTest) {
@@ -681,6 +781,51 @@ TYPED_TEST(HttpFetcherTest, FlakyTest) {
   g_main_loop_unref(loop);
 }
 
+TYPED_TEST(HttpFetcherTest, ShapedTest) {
+  if (this->test_.IsMock())
+    return;
+  GMainLoop* loop = g_main_loop_new(g_main_context_default(), FALSE);
+  {
+    LendingHttpFetcherTestDelegate delegate;
+    delegate.loop_ = loop;
+    scoped_ptr<HttpFetcher> fetcher(this->test_.NewLargeFetcher());
+    fetcher->set_delegate(&delegate);
+
+    MockConnectionManager* mock_cm = dynamic_cast<MockConnectionManager*>(
+        fetcher->GetSystemState()->connection_manager());
+    EXPECT_CALL(*mock_cm, GetConnectionType(_,_))
+      .WillRepeatedly(DoAll(SetArgumentPointee<1>(kNetEthernet), Return(true)));
+    EXPECT_CALL(*mock_cm, IsUpdateAllowedOver(kNetEthernet))
+      .WillRepeatedly(Return(true));
+    EXPECT_CALL(*mock_cm, StringForConnectionType(kNetEthernet))
+      .WillRepeatedly(Return(flimflam::kTypeEthernet));
+
+    scoped_ptr<HttpServer> server(this->test_.CreateServer());
+    ASSERT_TRUE(server->started_);
+
+    // 100 ms of latency, 200000 bytes per second and a 100 ms stall halfway
+    // take at least 0.65 s.
+    StartTransferArgs start_xfer_args = {
+      fetcher.get(),
+      LocalServerUrlForPath(StringPrintf("/shaped/%d/100/200000/%d/100",
+                                         kBigLength, kBigLength / 2))
+    };
+
+    const base::TimeTicks start_time = base::TimeTicks::Now();
+    g_timeout_add(0, StartTransfer, &start_xfer_args);
+    g_main_loop_run(loop);
+    EXPECT_GE(base::TimeTicks::Now() - start_time,
+              TimeDelta::FromMilliseconds(600));
+
+    ASSERT_EQ(static_cast<size_t>(kBigLength), delegate.data_.size());
+    for (int i = 0; i < kBigLength; i += 10) {
+      // Assert so that we don't flood the screen w/ EXPECT errors on failure.
+      ASSERT_EQ(delegate.data_.substr(i, 10), "abcdefghij");
+    }
+  }
+  g_main_loop_unref(loop);
+}
+
 namespace {
 class FailureHttpFetcherTestDelegate : public HttpFetcherDelegate {
  public:
@@ -932,7 +1077,8 @@ void MultiTest(HttpFetcher* fetcher_in,
                const vector<pair<off_t, off_t> >& ranges,
                const string& expected_prefix,
                off_t expected_size,
-               HttpResponseCode expected_response_code) {
+               HttpResponseCode expected_response_code,
+               const string& peer_url = "") {
   GMainLoop* loop = g_main_loop_new(g_main_context_default(), FALSE);
   {
     MultiHttpFetcherTestDelegate delegate(expected_response_code);
@@ -964,6 +1110,9 @@ void MultiTest(HttpFetcher* fetcher_in,
       }
       LOG(INFO) << "added range: " << tmp_str;
     }
+    multi_fetcher->ClearPeerUrls();
+    if (!peer_url.empty())
+      multi_fetcher->AddPeerUrl(peer_url);
     multi_fetcher->SetBuildType(false);
     multi_fetcher->set_delegate(&delegate);
 
@@ -1033,6 +1182,51 @@ TYPED_TEST(HttpFetcherTest, MultiHttpFetcherMultiEndTest) {
             kHttpResponsePartialContent);
 }
 
+TYPED_TEST(HttpFetcherTest, MultiHttpFetcherManyRangesTest) {
+  if (!this->test_.IsMulti())
+    return;
+
+  scoped_ptr<HttpServer> server(this->test_.CreateServer());
+  ASSERT_TRUE(server->started_);
+
+  vector<pair<off_t, off_t> > ranges;
+  ranges.push_back(make_pair(0, 5));
+  ranges.push_back(make_pair(10, 5));
+  ranges.push_back(make_pair(20, 5));
+  ranges.push_back(make_pair(30, 0));
+  MultiTest(this->test_.NewLargeFetcher(),
+            this->test_.BigUrl(),
+            ranges,
+            "abcdeabcdeabcdeabcdefghij",
+            15 + kBigLength - 30,
+            kHttpResponsePartialContent);
+}
+
+TYPED_TEST(HttpFetcherTest, MultiHttpFetcherCoalescedRangesTest) {
+  if (!this->test_.IsMulti())
+    return;
+
+  scoped_ptr<HttpServer> server(this->test_.CreateServer());
+  ASSERT_TRUE(server->started_);
+
+  // The first three ranges are downloaded with one request, the last two
+  // with another, and the bytes in between are dropped.
+  HttpFetcher* fetcher = this->test_.NewLargeFetcher();
+  dynamic_cast<MultiRangeHttpFetcher*>(fetcher)->set_coalescing(5, 30);
+  vector<pair<off_t, off_t> > ranges;
+  ranges.push_back(make_pair(0, 5));
+  ranges.push_back(make_pair(10, 5));
+  ranges.push_back(make_pair(20, 7));
+  ranges.push_back(make_pair(30, 5));
+  ranges.push_back(make_pair(40, 0));
+  MultiTest(fetcher,
+            this->test_.BigUrl(),
+            ranges,
+            "abcdeabcdeabcdefgabcdeabcdefghij",
+            22 + kBigLength - 40,
+            kHttpResponsePartialContent);
+}
+
 TYPED_TEST(HttpFetcherTest, MultiHttpFetcherInsufficientTest) {
   if (!this->test_.IsMulti())
     return;
@@ -1054,6 +1248,26 @@ TYPED_TEST(HttpFetcherTest, MultiHttpFetcherInsufficientTest) {
   }
 }
 
+TYPED_TEST(HttpFetcherTest, MultiHttpFetcherPeerFallbackTest) {
+  if (!this->test_.IsMulti())
+    return;
+
+  scoped_ptr<HttpServer> server(this->test_.CreateServer());
+  ASSERT_TRUE(server->started_);
+
+  // The peer fails, and the ranges are fetched from the server instead.
+  vector<pair<off_t, off_t> > ranges;
+  ranges.push_back(make_pair(0, 25));
+  ranges.push_back(make_pair(99, 0));
+  MultiTest(this->test_.NewLargeFetcher(),
+            this->test_.BigUrl(),
+            ranges,
+            "abcdefghijabcdefghijabcdejabcdefghijabcdef",
+            kBigLength - (99 - 25),
+            kHttpResponsePartialContent,
+            this->test_.ErrorUrl());
+}
+
 namespace {
 class BlockedTransferTestDelegate : public HttpFetcherDelegate {
  public:
@@ -0,0 +1,147 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/image_file_tree.h"
+
+#include <sys/stat.h>
+
+#include <string.h>
+
+#include <et/com_err.h>
+#include <ext2fs/ext2_io.h>
+#include <ext2fs/ext2fs.h>
+
+#include <base/logging.h>
+
+#include "update_engine/graph_types.h"
+#include "update_engine/graph_utils.h"
+#include "update_engine/utils.h"
+
+using std::map;
+using std::pair;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The entries of a directory other than "." and "..", as names and inodes.
+typedef vector<pair<string, ext2_ino_t> > DirEntries;
+
+int CollectDirEntry(ext2_ino_t dir,
+                    int entry,
+                    struct ext2_dir_entry* dirent,
+                    int offset,
+                    int blocksize,
+                    char* buf,
+                    void* priv) {
+  const string name(dirent->name, dirent->name_len & 0xff);
+  if (name != "." && name != "..") {
+    static_cast<DirEntries*>(priv)->push_back(
+        std::make_pair(name, dirent->inode));
+  }
+  return 0;
+}
+
+// The data blocks of a file, built as libext2fs walks them in order.
+struct DataBlocks {
+  // The file's blocks past the end of its data, e.g., preallocated ones,
+  // aren't listed.
+  uint64_t block_count;
+  uint64_t next_block;
+  vector<Extent>* extents;
+};
+
+int CollectDataBlock(ext2_filsys fs,
+                     blk_t* blocknr,
+                     e2_blkcnt_t blockcnt,
+                     blk_t ref_blk,
+                     int ref_offset,
+                     void* priv) {
+  DataBlocks* blocks = static_cast<DataBlocks*>(priv);
+  const uint64_t block = blockcnt;
+  if (block < blocks->next_block || block >= blocks->block_count)
+    return 0;
+  graph_utils::AppendBlocksToExtents(blocks->extents, kSparseHole,
+                                     block - blocks->next_block);
+  graph_utils::AppendBlockToExtents(blocks->extents, *blocknr);
+  blocks->next_block = block + 1;
+  return 0;
+}
+
+// Appends the files under the directory at |path| with inode |dir_inode|,
+// which is already in |files|, to |files|, each directory before its
+// entries.
+bool ReadDirectory(ext2_filsys fs,
+                   const string& path,
+                   ext2_ino_t dir_inode,
+                   vector<ImageFileTree::File>* files) {
+  DirEntries entries;
+  TEST_AND_RETURN_FALSE_ERRCODE(ext2fs_dir_iterate2(fs, dir_inode, 0, NULL,
+                                                    CollectDirEntry,
+                                                    &entries));
+  for (DirEntries::const_iterator it = entries.begin(); it != entries.end();
+       ++it) {
+    struct ext2_inode inode;
+    TEST_AND_RETURN_FALSE_ERRCODE(ext2fs_read_inode(fs, it->second, &inode));
+    files->resize(files->size() + 1);
+    ImageFileTree::File& file = files->back();
+    file.path = path + "/" + it->first;
+    file.inode = it->second;
+    file.mode = inode.i_mode;
+    file.size = EXT2_I_SIZE(&inode);
+    if (S_ISREG(inode.i_mode)) {
+      DataBlocks blocks;
+      blocks.block_count = (file.size + fs->blocksize - 1) / fs->blocksize;
+      blocks.next_block = 0;
+      blocks.extents = &file.extents;
+      TEST_AND_RETURN_FALSE_ERRCODE(ext2fs_block_iterate2(
+          fs, it->second, BLOCK_FLAG_DATA_ONLY, NULL,
+          CollectDataBlock, &blocks));
+      graph_utils::AppendBlocksToExtents(
+          &file.extents, kSparseHole, blocks.block_count - blocks.next_block);
+    } else if (S_ISDIR(inode.i_mode)) {
+      // |file| may move as the vector grows.
+      const string dir_path = file.path;
+      TEST_AND_RETURN_FALSE(ReadDirectory(fs, dir_path, it->second, files));
+    }
+  }
+  return true;
+}
+
+}  // namespace {}
+
+bool ImageFileTree::Init(const string& image_path) {
+  image_path_ = image_path;
+  files_.clear();
+  index_.clear();
+
+  ext2_filsys fs;
+  TEST_AND_RETURN_FALSE_ERRCODE(ext2fs_open(image_path.c_str(), 0, 0, 0,
+                                            unix_io_manager, &fs));
+  ScopedExt2fsCloser fs_closer(fs);
+  block_size_ = fs->blocksize;
+
+  File root;
+  root.inode = EXT2_ROOT_INO;
+  struct ext2_inode inode;
+  TEST_AND_RETURN_FALSE_ERRCODE(ext2fs_read_inode(fs, EXT2_ROOT_INO, &inode));
+  root.mode = inode.i_mode;
+  root.size = EXT2_I_SIZE(&inode);
+  files_.push_back(root);
+  TEST_AND_RETURN_FALSE(ReadDirectory(fs, "", EXT2_ROOT_INO, &files_));
+
+  for (size_t i = 0; i < files_.size(); i++)
+    index_[files_[i].path] = i;
+  LOG(INFO) << "Read " << files_.size() << " files from " << image_path;
+  return true;
+}
+
+const ImageFileTree::File* ImageFileTree::Find(const string& path) const {
+  map<string, size_t>::const_iterator it = index_.find(path);
+  return it == index_.end() ? NULL : &files_[it->second];
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,69 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_IMAGE_FILE_TREE_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_IMAGE_FILE_TREE_H__
+
+#include <inttypes.h>
+#include <sys/types.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <base/basictypes.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+// The files of an ext2/3/4 image, read with libext2fs rather than through a
+// mount of the image, so that the generator can run without root and
+// without loop devices. The whole tree and the extents of its regular files
+// are read up front, as libext2fs isn't thread-safe; the file data is then
+// read straight from the image, see MappedFile::InitFromExtents().
+
+namespace chromeos_update_engine {
+
+class ImageFileTree {
+ public:
+  struct File {
+    // The path relative to the root of the image, as
+    // FilesystemIterator::GetPartialPath() returns it: "" for the root
+    // directory and "/a/b" for the others.
+    std::string path;
+    uint64_t inode;
+    mode_t mode;
+    uint64_t size;
+    // The blocks of a regular file's data, in order, with kSparseHole
+    // extents for its holes. Empty for other files.
+    std::vector<Extent> extents;
+  };
+
+  ImageFileTree() : block_size_(0) {}
+
+  // Reads the files of the image at |image_path|. Returns true on success.
+  bool Init(const std::string& image_path);
+
+  const std::string& image_path() const { return image_path_; }
+  uint32_t block_size() const { return block_size_; }
+
+  // All the files, each directory before its entries.
+  const std::vector<File>& files() const { return files_; }
+
+  // Returns the file at |path|, relative to the root of the image like
+  // File::path, or NULL if there's none.
+  const File* Find(const std::string& path) const;
+
+ private:
+  std::string image_path_;
+  uint32_t block_size_;
+  std::vector<File> files_;
+  // The index in |files_| of each path.
+  std::map<std::string, size_t> index_;
+
+  DISALLOW_COPY_AND_ASSIGN(ImageFileTree);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_IMAGE_FILE_TREE_H__
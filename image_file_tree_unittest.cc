@@ -0,0 +1,80 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/extent_mapper.h"
+#include "update_engine/image_file_tree.h"
+#include "update_engine/mapped_file.h"
+#include "update_engine/test_utils.h"
+#include "update_engine/utils.h"
+
+using std::set;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+TEST(ImageFileTreeTest, RunAsRootReadTest) {
+  string image;
+  EXPECT_TRUE(utils::MakeTempFile("/tmp/ImageFileTreeTest.XXXXXX", &image,
+                                  NULL));
+  ScopedPathUnlinker image_unlinker(image);
+  vector<string> expected_paths;
+  CreateExtImageAtPath(image, &expected_paths);
+
+  ImageFileTree tree;
+  ASSERT_TRUE(tree.Init(image));
+  EXPECT_EQ(image, tree.image_path());
+  EXPECT_EQ(4096, tree.block_size());
+  set<string> paths;
+  for (size_t i = 0; i < tree.files().size(); i++)
+    paths.insert(tree.files()[i].path);
+  EXPECT_EQ(set<string>(expected_paths.begin(), expected_paths.end()), paths);
+  EXPECT_TRUE(tree.Find("/does_not_exist") == NULL);
+  ASSERT_TRUE(tree.Find("/testlink") != NULL);
+  ASSERT_TRUE(tree.Find("/some_dir/test") != NULL);
+  EXPECT_EQ(tree.Find("/testlink")->inode, tree.Find("/some_dir/test")->inode);
+
+  // The files match those of the mounted image.
+  string mount_path;
+  ScopedLoopMounter mounter(image, &mount_path, MS_RDONLY);
+  for (size_t i = 0; i < tree.files().size(); i++) {
+    const ImageFileTree::File& file = tree.files()[i];
+    const string path = mount_path + file.path;
+    struct stat stbuf;
+    ASSERT_EQ(0, lstat(path.c_str(), &stbuf)) << path;
+    EXPECT_EQ(stbuf.st_mode, file.mode) << path;
+    EXPECT_EQ(stbuf.st_ino, file.inode) << path;
+    if (!S_ISREG(file.mode)) {
+      EXPECT_TRUE(file.extents.empty()) << path;
+      continue;
+    }
+    EXPECT_EQ(stbuf.st_size, file.size) << path;
+    vector<Extent> extents;
+    EXPECT_TRUE(extent_mapper::ExtentsForFile(path, &extents));
+    ASSERT_EQ(extents.size(), file.extents.size()) << path;
+    for (size_t j = 0; j < extents.size(); j++) {
+      EXPECT_EQ(extents[j].start_block(), file.extents[j].start_block());
+      EXPECT_EQ(extents[j].num_blocks(), file.extents[j].num_blocks());
+    }
+    vector<char> data;
+    EXPECT_TRUE(utils::ReadFile(path, &data));
+    MappedFile mapped;
+    EXPECT_TRUE(mapped.InitFromExtents(image, file.extents, tree.block_size(),
+                                       file.size, 0, -1));
+    ASSERT_EQ(data.size(), mapped.size()) << path;
+    EXPECT_EQ(0, memcmp(&data[0], mapped.data(), data.size())) << path;
+  }
+}
+
+}  // namespace chromeos_update_engine
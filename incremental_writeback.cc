@@ -0,0 +1,109 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/incremental_writeback.h"
+
+#include <errno.h>
+#include <fcntl.h>
+
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+
+#include "update_engine/io_recorder.h"
+#include "update_engine/io_stats.h"
+
+using std::make_pair;
+
+namespace chromeos_update_engine {
+
+const uint64_t IncrementalWriteback::kDefaultChunkSize = 8 * 1024 * 1024;
+
+IncrementalWriteback::IncrementalWriteback()
+    : fd_(-1),
+      chunk_size_(kDefaultChunkSize),
+      recorded_bytes_(0),
+      bytes_written_back_(0) {}
+
+void IncrementalWriteback::Init(int fd, uint64_t chunk_size) {
+  fd_ = fd;
+  chunk_size_ = chunk_size;
+  recorded_.clear();
+  recorded_bytes_ = 0;
+  started_.clear();
+  bytes_written_back_ = 0;
+}
+
+void IncrementalWriteback::AddWrite(off64_t offset, uint64_t length) {
+  if (fd_ < 0 || length == 0)
+    return;
+  if (!recorded_.empty() &&
+      recorded_.back().first +
+      static_cast<off64_t>(recorded_.back().second) == offset) {
+    recorded_.back().second += length;
+  } else {
+    recorded_.push_back(make_pair(offset, length));
+  }
+  recorded_bytes_ += length;
+}
+
+void IncrementalWriteback::Writeback() {
+  if (fd_ >= 0 && recorded_bytes_ >= chunk_size_)
+    WritebackChunk();
+}
+
+bool IncrementalWriteback::Finish() {
+  if (fd_ < 0)
+    return true;
+  // The second pass waits for the chunk the first one started, unless the
+  // first one turned the writeback off.
+  bool success = WritebackChunk() && (fd_ < 0 || WritebackChunk());
+  fd_ = -1;
+  return success;
+}
+
+bool IncrementalWriteback::WritebackChunk() {
+  if (!started_.empty())
+    IoRecorder::RecordSync(fd_);
+  const base::TimeTicks start_time = base::TimeTicks::Now();
+  for (Ranges::const_iterator it = started_.begin(); it != started_.end();
+       ++it) {
+    if (HANDLE_EINTR(sync_file_range(fd_, it->first, it->second,
+                                     SYNC_FILE_RANGE_WAIT_BEFORE |
+                                     SYNC_FILE_RANGE_WRITE |
+                                     SYNC_FILE_RANGE_WAIT_AFTER)) != 0) {
+      PLOG(ERROR) << "Unable to write back " << it->second << " bytes at "
+                  << it->first;
+      fd_ = -1;
+      return false;
+    }
+    // Only a hint, the pages are just kept if it fails.
+    posix_fadvise(fd_, it->first, it->second, POSIX_FADV_DONTNEED);
+  }
+  if (!started_.empty())
+    IoStats::AddSync("writeback", base::TimeTicks::Now() - start_time);
+  started_.clear();
+  for (Ranges::const_iterator it = recorded_.begin(); it != recorded_.end();
+       ++it) {
+    if (HANDLE_EINTR(sync_file_range(fd_, it->first, it->second,
+                                     SYNC_FILE_RANGE_WRITE)) != 0) {
+      // E.g., a character device, which has nothing to write back.
+      if (errno == ESPIPE || errno == EINVAL) {
+        PLOG(WARNING) << "Unable to write back incrementally";
+        fd_ = -1;
+        return true;
+      }
+      PLOG(ERROR) << "Unable to start writing back " << it->second
+                  << " bytes at " << it->first;
+      fd_ = -1;
+      return false;
+    }
+  }
+  started_.swap(recorded_);
+  recorded_.clear();
+  bytes_written_back_ += recorded_bytes_;
+  recorded_bytes_ = 0;
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,78 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_INCREMENTAL_WRITEBACK_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_INCREMENTAL_WRITEBACK_H__
+
+#include <sys/types.h>
+
+#include <utility>
+#include <vector>
+
+#include <base/basictypes.h>
+
+// Writes a partition back to disk as it's being written rather than all at
+// once at the end, so that its dirty pages stay bounded instead of piling
+// up over the whole partition and stalling the rest of the system when
+// they're flushed. Once a chunk of writes is recorded, it's handed to the
+// disk with sync_file_range() without waiting, and the chunk before it,
+// which has had the time of a chunk to get there, is waited for and
+// dropped from the page cache with posix_fadvise(POSIX_FADV_DONTNEED), as
+// the new partition isn't read again until it's verified.
+
+namespace chromeos_update_engine {
+
+class IncrementalWriteback {
+ public:
+  // Writes back every 8 MiB.
+  static const uint64_t kDefaultChunkSize;
+
+  IncrementalWriteback();
+
+  // Starts recording the writes to |fd|, or stops if |fd| is negative.
+  // |chunk_size| bytes are written back at once. Descriptors that can't be
+  // written back, e.g., of character devices, turn the writeback off.
+  void Init(int fd, uint64_t chunk_size);
+
+  // Records that |length| bytes were written at |offset|.
+  void AddWrite(off64_t offset, uint64_t length);
+
+  // Writes back the recorded writes if there's a whole chunk of them. The
+  // writes recorded so far must have completed.
+  void Writeback();
+
+  // Writes back all the recorded writes and waits for them. Returns false
+  // if they couldn't be written.
+  bool Finish();
+
+  // The number of bytes handed to the disk so far.
+  uint64_t bytes_written_back() const { return bytes_written_back_; }
+
+ private:
+  typedef std::vector<std::pair<off64_t, uint64_t> > Ranges;
+
+  // Waits for |started_| and drops it from the page cache, then starts
+  // writing back |recorded_|, which becomes |started_|. Returns false on
+  // error, after which the writes are no longer recorded; the same goes for
+  // files that can't be written back, but that's not an error.
+  bool WritebackChunk();
+
+  int fd_;
+  uint64_t chunk_size_;
+
+  // The writes recorded since the last writeback, contiguous ones merged,
+  // and their size.
+  Ranges recorded_;
+  uint64_t recorded_bytes_;
+  // The writes being written back.
+  Ranges started_;
+
+  uint64_t bytes_written_back_;
+
+  DISALLOW_COPY_AND_ASSIGN(IncrementalWriteback);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_INCREMENTAL_WRITEBACK_H__
@@ -0,0 +1,97 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/incremental_writeback.h"
+#include "update_engine/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class IncrementalWritebackTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    ASSERT_TRUE(utils::MakeTempFile("/tmp/IncrementalWriteback.XXXXXX",
+                                    &path_, &fd_));
+  }
+
+  virtual void TearDown() {
+    close(fd_);
+    unlink(path_.c_str());
+  }
+
+  // Writes |length| bytes of |value| at |offset| and records the write.
+  void Write(IncrementalWriteback* writeback, off_t offset, size_t length,
+             char value) {
+    vector<char> data(length, value);
+    ASSERT_TRUE(utils::PWriteAll(fd_, &data[0], length, offset));
+    writeback->AddWrite(offset, length);
+  }
+
+  string path_;
+  int fd_;
+};
+
+TEST_F(IncrementalWritebackTest, WritesBackChunksTest) {
+  IncrementalWriteback writeback;
+  writeback.Init(fd_, 8192);
+  Write(&writeback, 0, 4096, 'a');
+  writeback.Writeback();
+  EXPECT_EQ(0, writeback.bytes_written_back());
+
+  // Contiguous and scattered writes alike count towards the chunk.
+  Write(&writeback, 4096, 2048, 'b');
+  Write(&writeback, 16384, 2048, 'c');
+  writeback.Writeback();
+  EXPECT_EQ(8192, writeback.bytes_written_back());
+
+  Write(&writeback, 8192, 4096, 'd');
+  writeback.Writeback();
+  EXPECT_EQ(8192, writeback.bytes_written_back());
+  EXPECT_TRUE(writeback.Finish());
+  EXPECT_EQ(12288, writeback.bytes_written_back());
+
+  vector<char> expected(18432, '\0');
+  memset(&expected[0], 'a', 4096);
+  memset(&expected[4096], 'b', 2048);
+  memset(&expected[8192], 'd', 4096);
+  memset(&expected[16384], 'c', 2048);
+  vector<char> contents;
+  EXPECT_TRUE(utils::ReadFile(path_, &contents));
+  EXPECT_TRUE(contents == expected);
+}
+
+TEST_F(IncrementalWritebackTest, DisabledTest) {
+  IncrementalWriteback writeback;
+  writeback.Init(-1, 4096);
+  writeback.AddWrite(0, 8192);
+  writeback.Writeback();
+  EXPECT_TRUE(writeback.Finish());
+  EXPECT_EQ(0, writeback.bytes_written_back());
+}
+
+TEST_F(IncrementalWritebackTest, UnsupportedFileTest) {
+  int fd = open("/dev/null", O_WRONLY);
+  ASSERT_GE(fd, 0);
+  IncrementalWriteback writeback;
+  writeback.Init(fd, 4096);
+  writeback.AddWrite(0, 4096);
+  writeback.Writeback();
+  EXPECT_EQ(0, writeback.bytes_written_back());
+  writeback.AddWrite(4096, 4096);
+  EXPECT_TRUE(writeback.Finish());
+  close(fd);
+}
+
+}  // namespace chromeos_update_engine
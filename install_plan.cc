@@ -4,11 +4,15 @@
 
 #include "update_engine/install_plan.h"
 
+#include <algorithm>
+
 #include "base/logging.h"
+#include "base/string_util.h"
 
 #include "update_engine/utils.h"
 
 using std::string;
+using std::swap;
 
 namespace chromeos_update_engine {
 
@@ -19,6 +23,7 @@ InstallPlan::InstallPlan(bool is_resume,
                          const string& install_path,
                          const string& kernel_install_path)
     : is_resume(is_resume),
+      is_reapply(false),
       download_url(url),
       payload_size(payload_size),
       payload_hash(payload_hash),
@@ -26,12 +31,21 @@ InstallPlan::InstallPlan(bool is_resume,
       kernel_install_path(kernel_install_path),
       kernel_size(0),
       rootfs_size(0),
+      kernel_hash_chunk_size(0),
+      rootfs_hash_chunk_size(0),
+      kernel_verified(false),
+      rootfs_verified(false),
       hash_checks_mandatory(false) {}
 
 InstallPlan::InstallPlan() : is_resume(false),
+                             is_reapply(false),
                              payload_size(0),
                              kernel_size(0),
                              rootfs_size(0),
+                             kernel_hash_chunk_size(0),
+                             rootfs_hash_chunk_size(0),
+                             kernel_verified(false),
+                             rootfs_verified(false),
                              hash_checks_mandatory(false) {}
 
 
@@ -41,21 +55,56 @@ bool InstallPlan::operator==(const InstallPlan& that) const {
           (payload_size == that.payload_size) &&
           (payload_hash == that.payload_hash) &&
           (install_path == that.install_path) &&
-          (kernel_install_path == that.kernel_install_path));
+          (kernel_install_path == that.kernel_install_path) &&
+          (mirror_install_paths == that.mirror_install_paths) &&
+          (kernel_mirror_install_paths == that.kernel_mirror_install_paths));
 }
 
 bool InstallPlan::operator!=(const InstallPlan& that) const {
   return !((*this) == that);
 }
 
+void InstallPlan::Swap(InstallPlan* other) {
+  swap(is_resume, other->is_resume);
+  swap(is_reapply, other->is_reapply);
+  download_url.swap(other->download_url);
+  repair_url.swap(other->repair_url);
+  swap(payload_size, other->payload_size);
+  payload_hash.swap(other->payload_hash);
+  install_path.swap(other->install_path);
+  kernel_install_path.swap(other->kernel_install_path);
+  mirror_install_paths.swap(other->mirror_install_paths);
+  kernel_mirror_install_paths.swap(other->kernel_mirror_install_paths);
+  source_path.swap(other->source_path);
+  kernel_source_path.swap(other->kernel_source_path);
+  swap(kernel_size, other->kernel_size);
+  swap(rootfs_size, other->rootfs_size);
+  kernel_hash.swap(other->kernel_hash);
+  rootfs_hash.swap(other->rootfs_hash);
+  swap(kernel_hash_chunk_size, other->kernel_hash_chunk_size);
+  swap(rootfs_hash_chunk_size, other->rootfs_hash_chunk_size);
+  kernel_chunk_hashes.swap(other->kernel_chunk_hashes);
+  rootfs_chunk_hashes.swap(other->rootfs_chunk_hashes);
+  swap(kernel_verified, other->kernel_verified);
+  swap(rootfs_verified, other->rootfs_verified);
+  swap(hash_checks_mandatory, other->hash_checks_mandatory);
+}
+
 void InstallPlan::Dump() const {
   LOG(INFO) << "InstallPlan: "
             << (is_resume ? ", resume" : ", new_update")
+            << (is_reapply ? ", reapply" : "")
             << ", url: " << download_url
             << ", payload size: " << payload_size
             << ", payload hash: " << payload_hash
             << ", install_path: " << install_path
             << ", kernel_install_path: " << kernel_install_path
+            << ", mirror_install_paths: "
+            << JoinString(mirror_install_paths, ' ')
+            << ", kernel_mirror_install_paths: "
+            << JoinString(kernel_mirror_install_paths, ' ')
+            << ", source_path: " << source_path
+            << ", kernel_source_path: " << kernel_source_path
             << ", hash_checks_mandatory: " << utils::ToString(
                 hash_checks_mandatory);
 }
@@ -31,14 +31,36 @@ struct InstallPlan {
 
   void Dump() const;
 
+  // Exchanges the contents of this plan and |other|, without copying the
+  // paths and hashes. See Action::SwapOutputObject().
+  void Swap(InstallPlan* other);
+
   bool is_resume;
+  // True if an earlier attempt started applying this payload and couldn't be
+  // resumed, so that the operations whose destination blocks it already
+  // wrote can be skipped.
+  bool is_reapply;
   std::string download_url;  // url to download from
+  // The URL the data blobs corrupted on the way are fetched again from,
+  // another one than |download_url| if there are several.
+  std::string repair_url;
 
   uint64_t payload_size;                 // size of the payload
   std::string payload_hash ;             // SHA256 hash of the payload
   std::string install_path;              // path to install device
   std::string kernel_install_path;       // path to kernel install device
 
+  // The devices that mirror the install devices, e.g., the inactive
+  // partitions on a second disk, which get the same writes as them. See
+  // PartitionMirror.
+  std::vector<std::string> mirror_install_paths;
+  std::vector<std::string> kernel_mirror_install_paths;
+
+  // The partitions the update is applied from, i.e., the booted ones. Filled
+  // in by FilesystemCopierAction(verify_hash=false).
+  std::string source_path;
+  std::string kernel_source_path;
+
   // The fields below are used for kernel and rootfs verification. The flow is:
   //
   // 1. FilesystemCopierAction(verify_hash=false) computes and fills in the
@@ -55,11 +77,30 @@ struct InstallPlan {
   std::vector<char> kernel_hash;
   std::vector<char> rootfs_hash;
 
+  // The optional per-chunk hashes of the applied partitions, which step 4
+  // verifies in parallel instead of the whole-partition hashes. A chunk
+  // size of 0 means there are none.
+  uint64_t kernel_hash_chunk_size;
+  uint64_t rootfs_hash_chunk_size;
+  std::vector<std::vector<char> > kernel_chunk_hashes;
+  std::vector<std::vector<char> > rootfs_chunk_hashes;
+
+  // Set by DeltaPerformer::GetVerifiedPartitions() if the applied partitions
+  // were verified as they were written, in which case step 4 needn't read
+  // them back.
+  bool kernel_verified;
+  bool rootfs_verified;
+
   // True if payload hash checks are mandatory based on the system state and
   // the Omaha response.
   bool hash_checks_mandatory;
 };
 
+// Found by argument-dependent lookup, e.g., by ActionPipe::swap_contents().
+inline void swap(InstallPlan& a, InstallPlan& b) {
+  a.Swap(&b);
+}
+
 }  // namespace chromeos_update_engine
 
 #endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_INSTALL_PLAN_H__
@@ -0,0 +1,167 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/io_recorder.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <map>
+#include <sstream>
+
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+#include <base/stringprintf.h>
+#include <base/time.h>
+#include <glib.h>
+
+#include "update_engine/utils.h"
+
+using base::TimeTicks;
+using std::istringstream;
+using std::map;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+const char IoRecorder::kAllPaths[] = "*";
+
+int IoRecorder::fd_ = -1;
+
+namespace {
+
+// A statically allocated GMutex needs no initialization. It protects the
+// variables below.
+GMutex mutex;
+TimeTicks start_time;
+map<int, string> paths;
+
+const char kHeader[] = "# update_engine block I/O trace\n";
+
+}  // namespace {}
+
+bool IoRecorder::Init(const string& path) {
+  Close();
+  int fd = HANDLE_EINTR(open(path.c_str(),
+                             O_WRONLY | O_CREAT | O_TRUNC | O_APPEND |
+                             O_CLOEXEC,
+                             0644));
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  if (!utils::WriteAll(fd, kHeader, strlen(kHeader))) {
+    PLOG(ERROR) << "Unable to write to " << path;
+    close(fd);
+    return false;
+  }
+  g_mutex_lock(&mutex);
+  start_time = TimeTicks::Now();
+  g_mutex_unlock(&mutex);
+  fd_ = fd;
+  return true;
+}
+
+void IoRecorder::Close() {
+  if (fd_ < 0)
+    return;
+  if (close(fd_) != 0)
+    PLOG(ERROR) << "Unable to close the I/O trace";
+  fd_ = -1;
+  g_mutex_lock(&mutex);
+  paths.clear();
+  g_mutex_unlock(&mutex);
+}
+
+void IoRecorder::TrackFd(int fd, const string& path) {
+  if (!enabled() || fd < 0)
+    return;
+  g_mutex_lock(&mutex);
+  paths[fd] = path;
+  g_mutex_unlock(&mutex);
+}
+
+void IoRecorder::ForgetFd(int fd) {
+  if (!enabled())
+    return;
+  g_mutex_lock(&mutex);
+  paths.erase(fd);
+  g_mutex_unlock(&mutex);
+}
+
+void IoRecorder::RecordRead(int fd, uint64_t offset, uint64_t length) {
+  if (enabled())
+    Record(IoRecord::kRead, fd, offset, length);
+}
+
+void IoRecorder::RecordWrite(int fd, uint64_t offset, uint64_t length) {
+  if (enabled())
+    Record(IoRecord::kWrite, fd, offset, length);
+}
+
+void IoRecorder::RecordSync(int fd) {
+  if (enabled())
+    Record(IoRecord::kSync, fd, 0, 0);
+}
+
+void IoRecorder::Record(IoRecord::Type type,
+                        int fd,
+                        uint64_t offset,
+                        uint64_t length) {
+  string line;
+  g_mutex_lock(&mutex);
+  map<int, string>::const_iterator it = paths.find(fd);
+  if (fd < 0 || it != paths.end()) {
+    const string& path = fd < 0 ? kAllPaths : it->second;
+    const int64_t time_us = (TimeTicks::Now() - start_time).InMicroseconds();
+    if (type == IoRecord::kSync) {
+      line = StringPrintf("%" PRId64 " S %s\n", time_us, path.c_str());
+    } else {
+      line = StringPrintf("%" PRId64 " %c %" PRIu64 " %" PRIu64 " %s\n",
+                          time_us, type == IoRecord::kRead ? 'R' : 'W',
+                          offset, length, path.c_str());
+    }
+  }
+  g_mutex_unlock(&mutex);
+  // A single write, so that the records of different threads don't
+  // interleave.
+  if (!line.empty() && !utils::WriteAll(fd_, line.data(), line.size()))
+    PLOG(ERROR) << "Unable to write to the I/O trace";
+}
+
+bool IoRecorder::ReadTrace(const string& path, vector<IoRecord>* records) {
+  string contents;
+  TEST_AND_RETURN_FALSE(utils::ReadFile(path, &contents));
+  records->clear();
+  istringstream stream(contents);
+  string line;
+  while (getline(stream, line)) {
+    if (line.empty() || line[0] == '#')
+      continue;
+    istringstream line_stream(line);
+    IoRecord record;
+    string type;
+    line_stream >> record.time_us >> type;
+    if (type == "R" || type == "W") {
+      record.type = type == "R" ? IoRecord::kRead : IoRecord::kWrite;
+      line_stream >> record.offset >> record.length;
+    } else if (type == "S") {
+      record.type = IoRecord::kSync;
+    } else {
+      LOG(ERROR) << "Bad I/O trace record: " << line;
+      return false;
+    }
+    // The path is the rest of the line.
+    line_stream >> std::ws;
+    getline(line_stream, record.path);
+    if (line_stream.fail() && record.path.empty()) {
+      LOG(ERROR) << "Bad I/O trace record: " << line;
+      return false;
+    }
+    records->push_back(record);
+  }
+  return true;
+}
+
+}  // namespace chromeos_update_engine
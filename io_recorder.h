@@ -0,0 +1,90 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_IO_RECORDER_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_IO_RECORDER_H__
+
+#include <string>
+#include <vector>
+
+#include <base/basictypes.h>
+
+// Records the reads and writes an update issues to the partitions, in the
+// order they're issued, with the points where the data written so far is
+// waited for, so that io_replay can re-issue the same workload against a
+// device to benchmark it. Only the descriptors of the partitions, which
+// DeltaPerformer and FilesystemCopierAction register, are recorded.
+// Recording is off unless Init() is called.
+//
+// The trace is a text file with a record per line:
+//   <microseconds> R <offset> <length> <path>   a read
+//   <microseconds> W <offset> <length> <path>   a write
+//   <microseconds> S <path>                     a sync point of a partition,
+//                                               or of all of them for "*"
+// where the times are since recording started and the paths are those the
+// partitions were opened at. Records may be added from any thread.
+
+namespace chromeos_update_engine {
+
+struct IoRecord {
+  enum Type { kRead, kWrite, kSync };
+
+  IoRecord() : time_us(0), type(kRead), offset(0), length(0) {}
+
+  uint64_t time_us;
+  Type type;
+  uint64_t offset;
+  uint64_t length;
+  std::string path;
+};
+
+class IoRecorder {
+ public:
+  // The path of the sync points of all partitions.
+  static const char kAllPaths[];
+
+  // Starts recording to the file at |path|, replacing it. Returns true on
+  // success.
+  static bool Init(const std::string& path);
+
+  // Stops recording and forgets the descriptors.
+  static void Close();
+
+  // Returns true if I/O is being recorded.
+  static bool enabled() { return fd_ >= 0; }
+
+  // Records the I/O to |fd|, which is open at |path|, until ForgetFd().
+  static void TrackFd(int fd, const std::string& path);
+  static void ForgetFd(int fd);
+
+  // Records a read or write of |length| bytes at |offset| in |fd|, if it's
+  // tracked.
+  static void RecordRead(int fd, uint64_t offset, uint64_t length);
+  static void RecordWrite(int fd, uint64_t offset, uint64_t length);
+
+  // Records that the data written to |fd| so far, or to all the partitions
+  // if |fd| is -1, is waited for.
+  static void RecordSync(int fd);
+
+  // Reads the records of the trace at |path|. Returns true on success.
+  static bool ReadTrace(const std::string& path,
+                        std::vector<IoRecord>* records);
+
+ private:
+  // Records I/O of |type| to |fd| if it's tracked, or to all partitions if
+  // |fd| is -1.
+  static void Record(IoRecord::Type type,
+                     int fd,
+                     uint64_t offset,
+                     uint64_t length);
+
+  // The trace file, or -1 if recording is off.
+  static int fd_;
+
+  DISALLOW_IMPLICIT_CONSTRUCTORS(IoRecorder);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_IO_RECORDER_H__
@@ -0,0 +1,78 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/io_recorder.h"
+#include "update_engine/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class IoRecorderTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    ASSERT_TRUE(utils::MakeTempFile("/tmp/IoRecorderTest.XXXXXX", &path_,
+                                    NULL));
+    ASSERT_TRUE(IoRecorder::Init(path_));
+  }
+
+  virtual void TearDown() {
+    IoRecorder::Close();
+    unlink(path_.c_str());
+  }
+
+  string path_;
+};
+
+TEST_F(IoRecorderTest, RoundTripTest) {
+  EXPECT_TRUE(IoRecorder::enabled());
+  IoRecorder::TrackFd(10, "/dev/sda3");
+  IoRecorder::TrackFd(11, "/dev/sda 2");
+  IoRecorder::RecordRead(10, 4096, 8192);
+  IoRecorder::RecordWrite(11, 0, 512);
+  // Not tracked.
+  IoRecorder::RecordWrite(12, 0, 512);
+  IoRecorder::RecordSync(11);
+  IoRecorder::ForgetFd(10);
+  IoRecorder::RecordRead(10, 0, 4096);
+  IoRecorder::RecordSync(-1);
+  IoRecorder::Close();
+  EXPECT_FALSE(IoRecorder::enabled());
+
+  vector<IoRecord> records;
+  ASSERT_TRUE(IoRecorder::ReadTrace(path_, &records));
+  ASSERT_EQ(4, records.size());
+  EXPECT_EQ(IoRecord::kRead, records[0].type);
+  EXPECT_EQ(4096, records[0].offset);
+  EXPECT_EQ(8192, records[0].length);
+  EXPECT_EQ("/dev/sda3", records[0].path);
+  EXPECT_EQ(IoRecord::kWrite, records[1].type);
+  EXPECT_EQ(0, records[1].offset);
+  EXPECT_EQ(512, records[1].length);
+  EXPECT_EQ("/dev/sda 2", records[1].path);
+  EXPECT_EQ(IoRecord::kSync, records[2].type);
+  EXPECT_EQ("/dev/sda 2", records[2].path);
+  EXPECT_EQ(IoRecord::kSync, records[3].type);
+  EXPECT_EQ(IoRecorder::kAllPaths, records[3].path);
+  for (size_t i = 1; i < records.size(); i++)
+    EXPECT_LE(records[i - 1].time_us, records[i].time_us);
+}
+
+TEST_F(IoRecorderTest, BadTraceTest) {
+  IoRecorder::Close();
+  const char kTrace[] = "# update_engine block I/O trace\n12 X /dev/sda3\n";
+  ASSERT_TRUE(utils::WriteFile(path_.c_str(), kTrace, sizeof(kTrace) - 1));
+  vector<IoRecord> records;
+  EXPECT_FALSE(IoRecorder::ReadTrace(path_, &records));
+}
+
+}  // namespace chromeos_update_engine
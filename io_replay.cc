@@ -0,0 +1,330 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Replays the block I/O trace of an update, as recorded with update_engine
+// --io_trace_file, against devices, to benchmark them with a real update
+// workload. The reads and writes are re-issued in order, as fast as the
+// device takes them, with up to --queue_depth of them in flight; at each
+// sync point, those in flight are waited for and the devices written to are
+// synced. The latency percentiles of each kind of request and the
+// throughput are reported.
+//
+// Writes destroy the data on the devices, so they're only replayed with
+// --allow_writes.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <tr1/memory>
+#include <vector>
+
+#include <base/command_line.h>
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+#include <base/string_split.h>
+#include <base/time.h>
+#include <gflags/gflags.h>
+
+#include "update_engine/io_recorder.h"
+#include "update_engine/thread_pool.h"
+#include "update_engine/utils.h"
+
+DEFINE_string(trace, "", "Path to the I/O trace to replay");
+DEFINE_string(devices, "",
+              "Comma-separated list of recorded_path=replay_path pairs "
+              "mapping the partitions of the trace to the files or devices "
+              "they're replayed against. The I/O to the other partitions is "
+              "skipped");
+DEFINE_int32(queue_depth, 1, "Number of requests in flight at most");
+DEFINE_bool(direct_io, false,
+            "Issue the requests aligned for it with O_DIRECT");
+DEFINE_bool(allow_writes, false,
+            "Replay the writes too, destroying the data on the devices");
+
+using base::TimeDelta;
+using base::TimeTicks;
+using std::map;
+using std::string;
+using std::tr1::shared_ptr;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+const double kMiB = 1024.0 * 1024.0;
+const size_t kAlignment = 4096;
+
+// A device replayed against, with a descriptor that does O_DIRECT if
+// --direct_io is set, for the requests aligned for it.
+struct Device {
+  Device() : fd(-1), direct_fd(-1), written(false) {}
+  int fd;
+  int direct_fd;
+  bool written;
+};
+
+// A read or write re-issued on the thread pool.
+class RequestTask : public ThreadPoolTask {
+ public:
+  RequestTask(int fd, const IoRecord& record, char* write_data)
+      : fd_(fd),
+        record_(record),
+        write_data_(write_data),
+        buffer_(NULL) {}
+
+  virtual ~RequestTask() {
+    free(buffer_);
+  }
+
+  virtual bool Run() {
+    const TimeTicks start_time = TimeTicks::Now();
+    bool success = false;
+    if (record_.type == IoRecord::kWrite) {
+      success = utils::PWriteAll(fd_, write_data_, record_.length,
+                                 record_.offset);
+    } else if (posix_memalign(reinterpret_cast<void**>(&buffer_),
+                              kAlignment, record_.length) == 0) {
+      ssize_t bytes_read = 0;
+      success = utils::PReadAll(fd_, buffer_, record_.length, record_.offset,
+                                &bytes_read);
+    }
+    latency_ = TimeTicks::Now() - start_time;
+    return success;
+  }
+
+  const IoRecord& record() const { return record_; }
+  TimeDelta latency() const { return latency_; }
+
+ private:
+  int fd_;
+  IoRecord record_;
+  // The data written, shared by all writes.
+  char* write_data_;
+  // The data read.
+  char* buffer_;
+  TimeDelta latency_;
+
+  DISALLOW_COPY_AND_ASSIGN(RequestTask);
+};
+
+// The latencies and bytes of a kind of request.
+struct Stats {
+  Stats() : bytes(0) {}
+  vector<TimeDelta> latencies;
+  uint64_t bytes;
+};
+
+void PrintStats(const char* name, Stats* stats, TimeDelta elapsed) {
+  if (stats->latencies.empty())
+    return;
+  sort(stats->latencies.begin(), stats->latencies.end());
+  const double percentiles[] = { 50, 90, 99, 99.9, 100 };
+  printf("%-6s %8zu requests", name, stats->latencies.size());
+  if (stats->bytes > 0) {
+    printf(" %10.1f MiB %8.1f MiB/s", stats->bytes / kMiB,
+           stats->bytes / kMiB / elapsed.InSecondsF());
+  }
+  printf("\n      ");
+  for (size_t i = 0; i < arraysize(percentiles); i++) {
+    size_t index = static_cast<size_t>(
+        percentiles[i] / 100 * (stats->latencies.size() - 1) + 0.5);
+    printf(" p%g %.3f ms", percentiles[i],
+           stats->latencies[index].InMicroseconds() / 1000.0);
+  }
+  printf("\n");
+}
+
+class Replayer {
+ public:
+  Replayer()
+      : pool_(FLAGS_queue_depth),
+        runner_(&pool_, FLAGS_queue_depth),
+        write_data_(NULL),
+        write_data_size_(0) {}
+
+  ~Replayer() {
+    for (map<string, Device>::iterator it = devices_.begin();
+         it != devices_.end(); ++it) {
+      if (it->second.fd >= 0)
+        close(it->second.fd);
+      if (it->second.direct_fd >= 0)
+        close(it->second.direct_fd);
+    }
+    free(write_data_);
+  }
+
+  // Opens the devices the partitions at the recorded paths are mapped to in
+  // |mapping|. Returns true on success.
+  bool Init(const string& mapping) {
+    TEST_AND_RETURN_FALSE(pool_.Init());
+    vector<string> pairs;
+    base::SplitString(mapping, ',', &pairs);
+    for (vector<string>::const_iterator it = pairs.begin();
+         it != pairs.end(); ++it) {
+      const size_t separator = it->find('=');
+      TEST_AND_RETURN_FALSE(separator != string::npos);
+      const string replay_path = it->substr(separator + 1);
+      const int flags = FLAGS_allow_writes ? O_RDWR : O_RDONLY;
+      Device* device = &devices_[it->substr(0, separator)];
+      device->fd = HANDLE_EINTR(open(replay_path.c_str(), flags));
+      TEST_AND_RETURN_FALSE_ERRNO(device->fd >= 0);
+      if (FLAGS_direct_io) {
+        device->direct_fd =
+            HANDLE_EINTR(open(replay_path.c_str(), flags | O_DIRECT));
+        PLOG_IF(WARNING, device->direct_fd < 0)
+            << "Unable to open " << replay_path << " with O_DIRECT";
+      }
+    }
+    return true;
+  }
+
+  // Replays |records|. Returns true on success.
+  bool Replay(const vector<IoRecord>& records) {
+    const TimeTicks start_time = TimeTicks::Now();
+    uint64_t skipped = 0;
+    for (vector<IoRecord>::const_iterator it = records.begin();
+         it != records.end(); ++it) {
+      if (it->type == IoRecord::kSync) {
+        TEST_AND_RETURN_FALSE(Sync(it->path));
+        continue;
+      }
+      map<string, Device>::iterator device = devices_.find(it->path);
+      if (device == devices_.end() ||
+          (it->type == IoRecord::kWrite && !FLAGS_allow_writes)) {
+        skipped++;
+        continue;
+      }
+      if (it->type == IoRecord::kWrite)
+        device->second.written = true;
+      TEST_AND_RETURN_FALSE(Issue(device->second, *it));
+    }
+    TEST_AND_RETURN_FALSE(Sync(IoRecorder::kAllPaths));
+    const TimeDelta elapsed = TimeTicks::Now() - start_time;
+
+    printf("Replayed %zu records in %.3f s with queue depth %d%s, "
+           "skipped %" PRIu64 "\n",
+           records.size(), elapsed.InSecondsF(), FLAGS_queue_depth,
+           FLAGS_direct_io ? " and O_DIRECT" : "", skipped);
+    PrintStats("read", &reads_, elapsed);
+    PrintStats("write", &writes_, elapsed);
+    PrintStats("sync", &syncs_, elapsed);
+    return true;
+  }
+
+ private:
+  // Issues the read or write of |record| to |device|, once fewer than the
+  // queue depth are in flight.
+  bool Issue(const Device& device, const IoRecord& record) {
+    while (runner_.full())
+      TEST_AND_RETURN_FALSE(WaitOldest());
+    const bool aligned = record.offset % kAlignment == 0 &&
+        record.length % kAlignment == 0;
+    const int fd = aligned && device.direct_fd >= 0 ?
+        device.direct_fd : device.fd;
+    char* write_data = NULL;
+    if (record.type == IoRecord::kWrite)
+      TEST_AND_RETURN_FALSE(write_data = WriteData(record.length));
+    runner_.Submit(
+        shared_ptr<RequestTask>(new RequestTask(fd, record, write_data)));
+    return true;
+  }
+
+  // Waits for the oldest request in flight and accounts for it.
+  bool WaitOldest() {
+    shared_ptr<RequestTask> task;
+    const bool success = runner_.WaitOldest(&task);
+    Stats* stats =
+        task->record().type == IoRecord::kWrite ? &writes_ : &reads_;
+    stats->latencies.push_back(task->latency());
+    stats->bytes += task->record().length;
+    if (!success) {
+      LOG(ERROR) << "Unable to replay the request of " << task->record().length
+                 << " bytes at " << task->record().offset << " of "
+                 << task->record().path;
+    }
+    return success;
+  }
+
+  // Waits for the requests in flight and syncs the device at |path|, or all
+  // devices written to for IoRecorder::kAllPaths.
+  bool Sync(const string& path) {
+    while (!runner_.empty())
+      TEST_AND_RETURN_FALSE(WaitOldest());
+    for (map<string, Device>::iterator it = devices_.begin();
+         it != devices_.end(); ++it) {
+      if (!it->second.written ||
+          (path != IoRecorder::kAllPaths && path != it->first))
+        continue;
+      const TimeTicks start_time = TimeTicks::Now();
+      TEST_AND_RETURN_FALSE_ERRNO(
+          HANDLE_EINTR(fdatasync(it->second.fd)) == 0);
+      syncs_.latencies.push_back(TimeTicks::Now() - start_time);
+      it->second.written = false;
+    }
+    return true;
+  }
+
+  // Returns at least |length| bytes of random data to write, aligned for
+  // O_DIRECT, or NULL on error.
+  char* WriteData(size_t length) {
+    if (length > write_data_size_ || !write_data_) {
+      free(write_data_);
+      write_data_ = NULL;
+      write_data_size_ = length;
+      if (posix_memalign(reinterpret_cast<void**>(&write_data_), kAlignment,
+                         length) != 0)
+        return NULL;
+      // Incompressible, so that devices that compress don't do better than
+      // they would with a real payload.
+      for (size_t i = 0; i < length; i++)
+        write_data_[i] = static_cast<char>(random());
+    }
+    return write_data_;
+  }
+
+  ThreadPool pool_;
+  OrderedTaskRunner<RequestTask> runner_;
+  map<string, Device> devices_;
+  char* write_data_;
+  size_t write_data_size_;
+  Stats reads_;
+  Stats writes_;
+  Stats syncs_;
+
+  DISALLOW_COPY_AND_ASSIGN(Replayer);
+};
+
+int Main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  CommandLine::Init(argc, argv);
+  logging::InitLogging("io_replay.log",
+                       logging::LOG_ONLY_TO_SYSTEM_DEBUG_LOG,
+                       logging::DONT_LOCK_LOG_FILE,
+                       logging::APPEND_TO_OLD_LOG_FILE,
+                       logging::DISABLE_DCHECK_FOR_NON_OFFICIAL_RELEASE_BUILDS);
+  CHECK(!FLAGS_trace.empty()) << "Must pass --trace";
+  CHECK(!FLAGS_devices.empty()) << "Must pass --devices";
+  CHECK_GE(FLAGS_queue_depth, 1);
+
+  vector<IoRecord> records;
+  CHECK(IoRecorder::ReadTrace(FLAGS_trace, &records))
+      << "Unable to read " << FLAGS_trace;
+  Replayer replayer;
+  CHECK(replayer.Init(FLAGS_devices)) << "Unable to open the devices";
+  return replayer.Replay(records) ? 0 : 1;
+}
+
+}  // namespace {}
+
+}  // namespace chromeos_update_engine
+
+int main(int argc, char** argv) {
+  return chromeos_update_engine::Main(argc, argv);
+}
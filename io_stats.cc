@@ -0,0 +1,79 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/io_stats.h"
+
+#include <base/string_number_conversions.h>
+#include <base/stringprintf.h>
+#include <glib.h>
+
+using base::TimeDelta;
+using std::map;
+using std::string;
+
+namespace chromeos_update_engine {
+
+const char IoStats::kPread[] = "pread";
+const char IoStats::kPwrite[] = "pwrite";
+
+namespace {
+
+// A statically allocated GMutex needs no initialization. It protects the
+// counts.
+GMutex mutex;
+map<string, IoCounts> counts;
+
+}  // namespace {}
+
+void IoStats::AddCalls(const string& subsystem,
+                       uint64_t calls,
+                       uint64_t bytes,
+                       TimeDelta time) {
+  g_mutex_lock(&mutex);
+  IoCounts* subsystem_counts = &counts[subsystem];
+  subsystem_counts->calls += calls;
+  subsystem_counts->bytes += bytes;
+  subsystem_counts->time += time;
+  g_mutex_unlock(&mutex);
+}
+
+void IoStats::AddSync(const string& subsystem, TimeDelta time) {
+  g_mutex_lock(&mutex);
+  IoCounts* subsystem_counts = &counts[subsystem];
+  subsystem_counts->syncs++;
+  subsystem_counts->time += time;
+  g_mutex_unlock(&mutex);
+}
+
+IoCounts IoStats::Get(const string& subsystem) {
+  IoCounts result;
+  g_mutex_lock(&mutex);
+  map<string, IoCounts>::const_iterator it = counts.find(subsystem);
+  if (it != counts.end())
+    result = it->second;
+  g_mutex_unlock(&mutex);
+  return result;
+}
+
+void IoStats::AddCounters(map<string, string>* counters) {
+  g_mutex_lock(&mutex);
+  for (map<string, IoCounts>::const_iterator it = counts.begin();
+       it != counts.end(); ++it) {
+    const string prefix = "io_" + it->first;
+    (*counters)[prefix + "_calls"] = base::Uint64ToString(it->second.calls);
+    (*counters)[prefix + "_bytes"] = base::Uint64ToString(it->second.bytes);
+    (*counters)[prefix + "_syncs"] = base::Uint64ToString(it->second.syncs);
+    (*counters)[prefix + "_seconds"] =
+        StringPrintf("%.3f", it->second.time.InSecondsF());
+  }
+  g_mutex_unlock(&mutex);
+}
+
+void IoStats::Reset() {
+  g_mutex_lock(&mutex);
+  counts.clear();
+  g_mutex_unlock(&mutex);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,83 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_IO_STATS_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_IO_STATS_H__
+
+#include <map>
+#include <string>
+
+#include <base/basictypes.h>
+#include <base/time.h>
+
+// Counts the I/O an update issues, per subsystem: the calls, the bytes they
+// moved, the syncs and the time spent in both. The raw helpers count each
+// system call, utils::PReadAll() and utils::PWriteAll() under kPread and
+// kPwrite, and the accounting decorators, AccountingFileWriter,
+// AccountingWriter and AccountingHttpFetcher, count the calls made through
+// them under the subsystem they're given. Unit tests can Reset() the counts
+// and bound them afterwards, e.g., the write system calls a payload takes,
+// and the daemon reports them with its performance counters. Counts may be
+// added from any thread.
+
+namespace chromeos_update_engine {
+
+struct IoCounts {
+  IoCounts() : calls(0), bytes(0), syncs(0) {}
+
+  uint64_t calls;
+  uint64_t bytes;
+  uint64_t syncs;
+  base::TimeDelta time;
+};
+
+class IoStats {
+ public:
+  // The subsystems of the raw helpers.
+  static const char kPread[];
+  static const char kPwrite[];
+
+  // Records |calls| calls of |subsystem| that moved |bytes| bytes in |time|.
+  static void AddCalls(const std::string& subsystem,
+                       uint64_t calls,
+                       uint64_t bytes,
+                       base::TimeDelta time);
+
+  // Records a sync of |subsystem| that took |time|.
+  static void AddSync(const std::string& subsystem, base::TimeDelta time);
+
+  // Returns the counts of |subsystem|, zero if nothing was recorded.
+  static IoCounts Get(const std::string& subsystem);
+
+  // Adds the counts to |counters|, by name: io_<subsystem>_calls, _bytes,
+  // _syncs and _seconds.
+  static void AddCounters(std::map<std::string, std::string>* counters);
+
+  // Forgets the counts.
+  static void Reset();
+
+ private:
+  DISALLOW_IMPLICIT_CONSTRUCTORS(IoStats);
+};
+
+// Records a sync of |subsystem| that lasts the lifetime of the object, e.g.,
+// the scope of an fdatasync() call.
+class ScopedIoSync {
+ public:
+  explicit ScopedIoSync(const char* subsystem)
+      : subsystem_(subsystem), start_time_(base::TimeTicks::Now()) {}
+  ~ScopedIoSync() {
+    IoStats::AddSync(subsystem_, base::TimeTicks::Now() - start_time_);
+  }
+
+ private:
+  const char* subsystem_;
+  base::TimeTicks start_time_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedIoSync);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_IO_STATS_H__
@@ -0,0 +1,128 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <base/time.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/extent_writer.h"
+#include "update_engine/file_writer.h"
+#include "update_engine/io_stats.h"
+#include "update_engine/utils.h"
+
+using base::TimeDelta;
+using std::map;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class IoStatsTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    ASSERT_TRUE(utils::MakeTempFile("/tmp/IoStats.XXXXXX", &path_, &fd_));
+    IoStats::Reset();
+  }
+
+  virtual void TearDown() {
+    IoStats::Reset();
+    close(fd_);
+    unlink(path_.c_str());
+  }
+
+  string path_;
+  int fd_;
+};
+
+TEST_F(IoStatsTest, CountsTest) {
+  IoStats::AddCalls("test", 2, 100, TimeDelta::FromMilliseconds(1500));
+  IoStats::AddCalls("test", 1, 28, TimeDelta());
+  IoStats::AddSync("test", TimeDelta::FromMilliseconds(500));
+  IoCounts counts = IoStats::Get("test");
+  EXPECT_EQ(3, counts.calls);
+  EXPECT_EQ(128, counts.bytes);
+  EXPECT_EQ(1, counts.syncs);
+  EXPECT_EQ(2000, counts.time.InMilliseconds());
+  EXPECT_EQ(0, IoStats::Get("other").calls);
+
+  map<string, string> counters;
+  IoStats::AddCounters(&counters);
+  EXPECT_EQ("3", counters["io_test_calls"]);
+  EXPECT_EQ("128", counters["io_test_bytes"]);
+  EXPECT_EQ("1", counters["io_test_syncs"]);
+  EXPECT_EQ("2.000", counters["io_test_seconds"]);
+
+  IoStats::Reset();
+  EXPECT_EQ(0, IoStats::Get("test").calls);
+  counters.clear();
+  IoStats::AddCounters(&counters);
+  EXPECT_TRUE(counters.empty());
+}
+
+TEST_F(IoStatsTest, RawHelpersTest) {
+  vector<char> data(8192, 'a');
+  ASSERT_TRUE(utils::PWriteAll(fd_, &data[0], data.size(), 0));
+  EXPECT_EQ(1, IoStats::Get(IoStats::kPwrite).calls);
+  EXPECT_EQ(data.size(), IoStats::Get(IoStats::kPwrite).bytes);
+
+  // A read past the end takes a second call, which reads nothing.
+  vector<char> buf(2 * data.size());
+  ssize_t bytes_read = 0;
+  ASSERT_TRUE(utils::PReadAll(fd_, &buf[0], buf.size(), 0, &bytes_read));
+  EXPECT_EQ(data.size(), bytes_read);
+  EXPECT_EQ(2, IoStats::Get(IoStats::kPread).calls);
+  EXPECT_EQ(data.size(), IoStats::Get(IoStats::kPread).bytes);
+}
+
+TEST_F(IoStatsTest, AccountingExtentWriterTest) {
+  vector<Extent> extents;
+  Extent extent;
+  extent.set_start_block(0);
+  extent.set_num_blocks(2);
+  extents.push_back(extent);
+  const vector<char> data(4096, 'b');
+
+  DirectExtentWriter direct_writer;
+  AccountingWriter<DirectExtentWriter> writer(&direct_writer, "test");
+  EXPECT_TRUE(writer.Init(fd_, extents, 4096));
+  EXPECT_TRUE(writer.Write(&data[0], data.size()));
+  EXPECT_TRUE(writer.Write(&data[0], data.size()));
+  EXPECT_TRUE(writer.End());
+  IoCounts counts = IoStats::Get("test");
+  EXPECT_EQ(2, counts.calls);
+  EXPECT_EQ(2 * data.size(), counts.bytes);
+  EXPECT_EQ(1, counts.syncs);
+  // The writes may be coalesced below.
+  EXPECT_GE(2, IoStats::Get(IoStats::kPwrite).calls);
+  EXPECT_EQ(2 * data.size(), IoStats::Get(IoStats::kPwrite).bytes);
+}
+
+TEST_F(IoStatsTest, AccountingFileWriterTest) {
+  DirectFileWriter direct_writer;
+  AccountingFileWriter writer(&direct_writer, "test");
+  EXPECT_EQ(0, writer.Open(path_.c_str(), O_WRONLY | O_TRUNC, 0600));
+  const string data = "0123456789";
+  ActionExitCode error = kActionCodeSuccess;
+  EXPECT_TRUE(writer.Write(data.data(), data.size()));
+  EXPECT_TRUE(writer.Write(data.data(), data.size(), &error));
+  // DirectFileWriter doesn't lend buffers.
+  EXPECT_EQ(NULL, writer.GetWriteBuffer(data.size()));
+  EXPECT_EQ(0, writer.Close());
+  IoCounts counts = IoStats::Get("test");
+  EXPECT_EQ(2, counts.calls);
+  EXPECT_EQ(2 * data.size(), counts.bytes);
+  EXPECT_EQ(1, counts.syncs);
+
+  string contents;
+  EXPECT_TRUE(utils::ReadFile(path_, &contents));
+  EXPECT_EQ(data + data, contents);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,322 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/journal_prefs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <base/file_util.h>
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+#include <base/string_number_conversions.h>
+#include <base/string_util.h>
+
+#include "update_engine/io_stats.h"
+#include "update_engine/prefs.h"
+#include "update_engine/utils.h"
+
+using std::map;
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+const char kRecordSet[] = "set";
+const char kRecordDelete[] = "delete";
+const char kRecordCommit[] = "commit\n";
+
+// The journal isn't compacted before it's at least this long.
+const off_t kMinCompactSize = 64 * 1024;
+
+// Reads the next space or newline terminated word of |records| at |*pos|
+// into |word| and moves |*pos| past the terminator, which it returns.
+// Returns '\0' if there's no terminator.
+char ReadWord(const string& records, size_t* pos, string* word) {
+  size_t end = records.find_first_of(" \n", *pos);
+  if (end == string::npos)
+    return '\0';
+  word->assign(records, *pos, end - *pos);
+  *pos = end + 1;
+  return records[end];
+}
+
+// Makes the entries of the directory |dir| durable.
+bool SyncDirectory(const FilePath& dir) {
+  int fd = HANDLE_EINTR(open(dir.value().c_str(), O_RDONLY | O_DIRECTORY));
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  ScopedEintrSafeFdCloser fd_closer(&fd);
+  ScopedIoSync sync("prefs");
+  TEST_AND_RETURN_FALSE_ERRNO(fsync(fd) == 0);
+  return true;
+}
+
+// Waits for the data written to |fd|. Returns true on success.
+bool DataSync(int fd) {
+  ScopedIoSync sync("prefs");
+  return HANDLE_EINTR(fdatasync(fd)) == 0;
+}
+
+}  // namespace {}
+
+JournalPrefs::JournalPrefs()
+    : fd_(-1),
+      size_(0),
+      compact_size_(kMinCompactSize),
+      in_transaction_(false) {}
+
+JournalPrefs::~JournalPrefs() {
+  if (fd_ >= 0)
+    HANDLE_EINTR(close(fd_));
+}
+
+bool JournalPrefs::Init(const FilePath& path) {
+  path_ = path;
+  TEST_AND_RETURN_FALSE(file_util::CreateDirectory(path_.DirName()));
+  const bool existed = file_util::PathExists(path_);
+  string journal;
+  if (existed)
+    TEST_AND_RETURN_FALSE(utils::ReadFile(path_.value(), &journal));
+
+  // The changes of each transaction are applied to |values_| as they're
+  // read, and only kept once its commit line has been read.
+  map<string, string> committed_values;
+  size_t committed_pos = 0;
+  size_t pos = 0;
+  for (;;) {
+    if (journal.compare(pos, strlen(kRecordCommit), kRecordCommit) == 0) {
+      pos += strlen(kRecordCommit);
+      committed_pos = pos;
+      committed_values = values_;
+      continue;
+    }
+    string key, value;
+    bool exists = false;
+    if (!ParseRecord(journal, &pos, &key, &exists, &value))
+      break;
+    if (exists)
+      values_[key] = value;
+    else
+      values_.erase(key);
+  }
+  values_.swap(committed_values);
+
+  TEST_AND_RETURN_FALSE(OpenJournal());
+  if (!existed)
+    TEST_AND_RETURN_FALSE(SyncDirectory(path_.DirName()));
+  if (committed_pos < journal.size()) {
+    LOG(WARNING) << "Discarding " << journal.size() - committed_pos
+                 << " bytes of uncommitted changes in " << path_.value();
+    TEST_AND_RETURN_FALSE_ERRNO(
+        HANDLE_EINTR(ftruncate(fd_, committed_pos)) == 0);
+  }
+  size_ = committed_pos;
+  MaybeCompact();
+  return true;
+}
+
+bool JournalPrefs::GetString(const string& key, string* value) {
+  map<string, string>::const_iterator it = values_.find(key);
+  if (it == values_.end()) {
+    LOG(INFO) << key << " not present in " << path_.value();
+    return false;
+  }
+  *value = it->second;
+  return true;
+}
+
+bool JournalPrefs::SetString(const string& key, const string& value) {
+  TEST_AND_RETURN_FALSE(Prefs::IsValidKey(key));
+  if (in_transaction_) {
+    AppendSetRecord(key, value, &transaction_records_);
+  } else {
+    string records;
+    AppendSetRecord(key, value, &records);
+    TEST_AND_RETURN_FALSE(WriteCommit(records));
+  }
+  values_[key] = value;
+  return true;
+}
+
+bool JournalPrefs::GetInt64(const string& key, int64_t* value) {
+  string str_value;
+  if (!GetString(key, &str_value))
+    return false;
+  TrimWhitespaceASCII(str_value, TRIM_ALL, &str_value);
+  TEST_AND_RETURN_FALSE(base::StringToInt64(str_value, value));
+  return true;
+}
+
+bool JournalPrefs::SetInt64(const string& key, const int64_t value) {
+  return SetString(key, base::Int64ToString(value));
+}
+
+bool JournalPrefs::Exists(const string& key) {
+  TEST_AND_RETURN_FALSE(Prefs::IsValidKey(key));
+  return values_.count(key) > 0;
+}
+
+bool JournalPrefs::Delete(const string& key) {
+  TEST_AND_RETURN_FALSE(Prefs::IsValidKey(key));
+  if (values_.count(key) == 0)
+    return true;
+  if (in_transaction_) {
+    AppendDeleteRecord(key, &transaction_records_);
+  } else {
+    string records;
+    AppendDeleteRecord(key, &records);
+    TEST_AND_RETURN_FALSE(WriteCommit(records));
+  }
+  values_.erase(key);
+  return true;
+}
+
+bool JournalPrefs::BeginTransaction() {
+  TEST_AND_RETURN_FALSE(!in_transaction_);
+  in_transaction_ = true;
+  transaction_records_.clear();
+  transaction_saved_values_ = values_;
+  return true;
+}
+
+bool JournalPrefs::CommitTransaction() {
+  TEST_AND_RETURN_FALSE(in_transaction_);
+  in_transaction_ = false;
+  if (!transaction_records_.empty() && !WriteCommit(transaction_records_)) {
+    values_.swap(transaction_saved_values_);
+    return false;
+  }
+  return true;
+}
+
+void JournalPrefs::AbortTransaction() {
+  if (!in_transaction_)
+    return;
+  in_transaction_ = false;
+  values_.swap(transaction_saved_values_);
+}
+
+void JournalPrefs::AppendSetRecord(const string& key,
+                                   const string& value,
+                                   string* records) {
+  *records += string(kRecordSet) + " " + key + " " +
+      base::Uint64ToString(value.size()) + "\n" + value + "\n";
+}
+
+void JournalPrefs::AppendDeleteRecord(const string& key, string* records) {
+  *records += string(kRecordDelete) + " " + key + "\n";
+}
+
+bool JournalPrefs::ParseRecord(const string& records,
+                               size_t* pos,
+                               string* key,
+                               bool* exists,
+                               string* value) {
+  string type;
+  if (ReadWord(records, pos, &type) != ' ')
+    return false;
+  char terminator = ReadWord(records, pos, key);
+  if (!Prefs::IsValidKey(*key))
+    return false;
+  if (type == kRecordDelete && terminator == '\n') {
+    *exists = false;
+    value->clear();
+    return true;
+  }
+  string size;
+  size_t value_size = 0;
+  if (type != kRecordSet || terminator != ' ' ||
+      ReadWord(records, pos, &size) != '\n' ||
+      !base::StringToSizeT(size, &value_size) ||
+      value_size >= records.size() - *pos ||
+      records[*pos + value_size] != '\n') {
+    return false;
+  }
+  *exists = true;
+  value->assign(records, *pos, value_size);
+  *pos += value_size + 1;
+  return true;
+}
+
+bool JournalPrefs::WriteCommit(const string& records) {
+  TEST_AND_RETURN_FALSE(fd_ >= 0);
+  const string commit = records + kRecordCommit;
+  if (!utils::WriteAll(fd_, commit.data(), commit.size()) ||
+      !DataSync(fd_)) {
+    PLOG(ERROR) << "Unable to write to " << path_.value();
+    // Cuts off what may have been written, so that it isn't committed along
+    // with the next changes.
+    PLOG_IF(ERROR, HANDLE_EINTR(ftruncate(fd_, size_)) != 0)
+        << "Unable to truncate " << path_.value();
+    return false;
+  }
+  size_ += commit.size();
+  MaybeCompact();
+  return true;
+}
+
+void JournalPrefs::MaybeCompact() {
+  if (size_ < compact_size_)
+    return;
+  // Compacts once the journal is more than twice as long as it would be
+  // afterwards.
+  off_t values_size = strlen(kRecordCommit);
+  for (map<string, string>::const_iterator it = values_.begin();
+       it != values_.end(); ++it) {
+    string record;
+    AppendSetRecord(it->first, it->second, &record);
+    values_size += record.size();
+  }
+  if (size_ > 2 * values_size)
+    LOG_IF(ERROR, !Compact()) << "Unable to compact " << path_.value();
+  compact_size_ = std::max(kMinCompactSize, 2 * size_);
+}
+
+bool JournalPrefs::Compact() {
+  string journal;
+  for (map<string, string>::const_iterator it = values_.begin();
+       it != values_.end(); ++it) {
+    AppendSetRecord(it->first, it->second, &journal);
+  }
+  journal += kRecordCommit;
+
+  const string new_path = path_.value() + ".new";
+  int fd = HANDLE_EINTR(open(new_path.c_str(),
+                             O_WRONLY | O_CREAT | O_TRUNC,
+                             0644));
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  bool success = utils::WriteAll(fd, journal.data(), journal.size()) &&
+      DataSync(fd);
+  success = HANDLE_EINTR(close(fd)) == 0 && success;
+  success = success && rename(new_path.c_str(), path_.value().c_str()) == 0;
+  if (!success) {
+    PLOG(ERROR) << "Unable to write " << new_path;
+    unlink(new_path.c_str());
+    return false;
+  }
+  // The new journal is in place, so it's the one to append to from now on
+  // even if the rename can't be made durable yet.
+  size_ = journal.size();
+  TEST_AND_RETURN_FALSE(OpenJournal());
+  TEST_AND_RETURN_FALSE(SyncDirectory(path_.DirName()));
+  return true;
+}
+
+bool JournalPrefs::OpenJournal() {
+  if (fd_ >= 0)
+    HANDLE_EINTR(close(fd_));
+  fd_ = HANDLE_EINTR(open(path_.value().c_str(),
+                          O_WRONLY | O_CREAT | O_APPEND,
+                          0644));
+  TEST_AND_RETURN_FALSE_ERRNO(fd_ >= 0);
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,112 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_JOURNAL_PREFS_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_JOURNAL_PREFS_H__
+
+#include <sys/types.h>
+
+#include <map>
+#include <string>
+
+#include <base/basictypes.h>
+#include <base/file_path.h>
+
+#include "update_engine/prefs_interface.h"
+
+namespace chromeos_update_engine {
+
+// Implements a preference store by appending the changes to a single
+// journal file, which is replayed on startup. Changes are written in
+// transactions, each made durable with a single fdatasync(); outside of a
+// transaction each change is one. Once the journal has grown well past the
+// size of the values it holds, it's compacted: rewritten with just the
+// current values to a new file, which then replaces it.
+//
+// The journal consists of records of the form "set <key> <size>\n<value>\n"
+// and "delete <key>\n", with a "commit\n" line after those of each
+// transaction. Anything after the last commit line is discarded.
+
+class JournalPrefs : public PrefsInterface {
+ public:
+  JournalPrefs();
+  virtual ~JournalPrefs();
+
+  // Initializes the store by replaying the journal at |path|, which is
+  // created if it doesn't exist. Returns true on success, false otherwise.
+  bool Init(const FilePath& path);
+
+  // PrefsInterface methods.
+  bool GetString(const std::string& key, std::string* value);
+  bool SetString(const std::string& key, const std::string& value);
+  bool GetInt64(const std::string& key, int64_t* value);
+  bool SetInt64(const std::string& key, const int64_t value);
+
+  bool Exists(const std::string& key);
+  bool Delete(const std::string& key);
+
+  bool BeginTransaction();
+  bool CommitTransaction();
+  void AbortTransaction();
+
+  // Appends the record setting |key| to |value|, or deleting |key|, to
+  // |records|.
+  static void AppendSetRecord(const std::string& key,
+                              const std::string& value,
+                              std::string* records);
+  static void AppendDeleteRecord(const std::string& key,
+                                 std::string* records);
+
+  // Parses the record at |*pos| in |records|, moving |*pos| past it.
+  // Sets |exists| to false if the record deletes |key|. Returns false,
+  // leaving |*pos| undefined, if there's no well-formed record at |*pos|.
+  static bool ParseRecord(const std::string& records,
+                          size_t* pos,
+                          std::string* key,
+                          bool* exists,
+                          std::string* value);
+
+ private:
+  // Appends |records| and a commit line to the journal and syncs it.
+  // Returns true on success; on failure the journal is left unchanged.
+  bool WriteCommit(const std::string& records);
+
+  // Compacts the journal if it has grown enough since the last time.
+  void MaybeCompact();
+
+  // Replaces the journal with one holding just the current values. Returns
+  // true on success; on failure the journal is left unchanged.
+  bool Compact();
+
+  // Opens the journal for appending, closing the previous descriptor.
+  bool OpenJournal();
+
+  // The path of the journal.
+  FilePath path_;
+
+  // The descriptor the journal is appended with, or -1.
+  int fd_;
+
+  // The length of the journal up to the end of the last commit.
+  off_t size_;
+
+  // The journal length from which on MaybeCompact() checks if it's worth
+  // compacting.
+  off_t compact_size_;
+
+  // The current values, including those of the current transaction.
+  std::map<std::string, std::string> values_;
+
+  // Whether a transaction is in progress, the records of its changes and
+  // the values before it.
+  bool in_transaction_;
+  std::string transaction_records_;
+  std::map<std::string, std::string> transaction_saved_values_;
+
+  DISALLOW_COPY_AND_ASSIGN(JournalPrefs);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_JOURNAL_PREFS_H__
@@ -0,0 +1,147 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <string>
+
+#include "base/basictypes.h"
+#include "base/file_util.h"
+#include "base/memory/scoped_ptr.h"
+#include "base/string_number_conversions.h"
+#include "gtest/gtest.h"
+#include "update_engine/cached_prefs.h"
+#include "update_engine/journal_prefs.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+class JournalPrefsTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    ASSERT_TRUE(file_util::CreateNewTempDirectory("aujournalprefs",
+                                                  &prefs_dir_));
+    journal_path_ = prefs_dir_.Append("prefs.journal");
+    Reopen();
+  }
+
+  virtual void TearDown() {
+    prefs_.reset();
+    file_util::Delete(prefs_dir_, true);  // recursive
+  }
+
+  void Reopen() {
+    prefs_.reset(new JournalPrefs);
+    ASSERT_TRUE(prefs_->Init(journal_path_));
+  }
+
+  string ReadJournal() {
+    string journal;
+    EXPECT_TRUE(file_util::ReadFileToString(journal_path_, &journal));
+    return journal;
+  }
+
+  FilePath prefs_dir_;
+  FilePath journal_path_;
+  scoped_ptr<JournalPrefs> prefs_;
+};
+
+TEST_F(JournalPrefsTest, SetGetDeleteTest) {
+  const string kBinaryValue("a b\nc\0", 6);
+  EXPECT_TRUE(prefs_->SetString("a", kBinaryValue));
+  EXPECT_TRUE(prefs_->SetInt64("b", -10));
+  EXPECT_TRUE(prefs_->SetString("c", ""));
+  EXPECT_TRUE(prefs_->Delete("c"));
+  EXPECT_TRUE(prefs_->Delete("d"));
+  EXPECT_FALSE(prefs_->SetString("e f", "x"));
+  EXPECT_FALSE(prefs_->Exists(""));
+
+  for (int i = 0; i < 2; i++) {
+    string value;
+    int64_t int_value = 0;
+    EXPECT_TRUE(prefs_->GetString("a", &value));
+    EXPECT_EQ(kBinaryValue, value);
+    EXPECT_TRUE(prefs_->GetInt64("b", &int_value));
+    EXPECT_EQ(-10, int_value);
+    EXPECT_FALSE(prefs_->Exists("c"));
+    EXPECT_FALSE(prefs_->GetString("c", &value));
+    Reopen();
+  }
+}
+
+TEST_F(JournalPrefsTest, TransactionTest) {
+  EXPECT_TRUE(prefs_->SetString("a", "1"));
+  const string kJournal = ReadJournal();
+  EXPECT_TRUE(prefs_->BeginTransaction());
+  EXPECT_FALSE(prefs_->BeginTransaction());
+  EXPECT_TRUE(prefs_->SetString("a", "2"));
+  EXPECT_TRUE(prefs_->SetString("b", "3"));
+  EXPECT_TRUE(prefs_->Exists("b"));
+  // Nothing's written before the commit.
+  EXPECT_EQ(kJournal, ReadJournal());
+  prefs_->AbortTransaction();
+  EXPECT_FALSE(prefs_->Exists("b"));
+
+  EXPECT_TRUE(prefs_->BeginTransaction());
+  EXPECT_TRUE(prefs_->SetString("b", "3"));
+  EXPECT_TRUE(prefs_->Delete("a"));
+  EXPECT_TRUE(prefs_->CommitTransaction());
+  EXPECT_FALSE(prefs_->CommitTransaction());
+  EXPECT_EQ(kJournal + "set b 1\n3\ndelete a\ncommit\n", ReadJournal());
+
+  Reopen();
+  string value;
+  EXPECT_FALSE(prefs_->Exists("a"));
+  EXPECT_TRUE(prefs_->GetString("b", &value));
+  EXPECT_EQ("3", value);
+}
+
+TEST_F(JournalPrefsTest, UncommittedChangesTest) {
+  EXPECT_TRUE(prefs_->SetString("a", "1"));
+  const string kJournal = ReadJournal();
+  // A transaction cut short, and a record cut short.
+  const string kTails[] = { "set a 1\n2\nset b 1\n3\n", "set a 5\n12" };
+  for (size_t i = 0; i < arraysize(kTails); i++) {
+    const string journal = kJournal + kTails[i];
+    ASSERT_EQ(static_cast<int>(journal.size()),
+              file_util::WriteFile(journal_path_, journal.data(),
+                                   journal.size()));
+    Reopen();
+    string value;
+    EXPECT_TRUE(prefs_->GetString("a", &value));
+    EXPECT_EQ("1", value);
+    EXPECT_FALSE(prefs_->Exists("b"));
+    EXPECT_EQ(kJournal, ReadJournal());
+  }
+}
+
+TEST_F(JournalPrefsTest, CompactTest) {
+  EXPECT_TRUE(prefs_->SetString("a", "1"));
+  const string kValue(1000, 'x');
+  for (int i = 0; i < 1000; i++)
+    EXPECT_TRUE(prefs_->SetString("b", kValue + base::IntToString(i)));
+  EXPECT_GT(70 * 1024U, ReadJournal().size());
+  EXPECT_FALSE(file_util::PathExists(
+      FilePath(journal_path_.value() + ".new")));
+
+  Reopen();
+  string value;
+  EXPECT_TRUE(prefs_->GetString("a", &value));
+  EXPECT_EQ("1", value);
+  EXPECT_TRUE(prefs_->GetString("b", &value));
+  EXPECT_EQ(kValue + "999", value);
+}
+
+TEST_F(JournalPrefsTest, CachedPrefsTest) {
+  {
+    CachedPrefs cached_prefs(prefs_.get());
+    EXPECT_TRUE(cached_prefs.Init());
+    EXPECT_TRUE(cached_prefs.SetString("a", "1"));
+    EXPECT_TRUE(cached_prefs.SetString("b", "2"));
+    EXPECT_TRUE(cached_prefs.Flush());
+  }
+  // The flush is a single transaction, without a journal of its own.
+  EXPECT_EQ("set a 1\n1\nset b 1\n2\ncommit\n", ReadJournal());
+}
+
+}  // namespace chromeos_update_engine
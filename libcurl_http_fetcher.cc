@@ -4,21 +4,32 @@
 
 #include "update_engine/libcurl_http_fetcher.h"
 
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/socket.h>
+
 #include <algorithm>
 #include <string>
+#include <vector>
 
 #include <base/logging.h>
+#include <base/string_number_conversions.h>
 #include <base/string_util.h>
 #include <base/stringprintf.h>
 
+#include "update_engine/async_logging.h"
 #include "update_engine/certificate_checker.h"
 #include "update_engine/dbus_interface.h"
+#include "update_engine/gzip.h"
+#include "update_engine/probes.h"
+#include "update_engine/transfer_stats.h"
+#include "update_engine/trace.h"
 #include "update_engine/utils.h"
 
 using google::protobuf::NewCallback;
-using std::max;
-using std::make_pair;
 using std::string;
+using std::vector;
 
 // This is a concrete implementation of HttpFetcher that uses libcurl to do the
 // http work.
@@ -28,8 +39,12 @@ namespace chromeos_update_engine {
 namespace {
 const int kNoNetworkRetrySeconds = 10;
 const char kCACertificatesPath[] = "/etc/ssl/certs";
+// How often the messages logged for every chunk received are logged at most.
+const int kChunkLogIntervalSeconds = 10;
 }  // namespace {}
 
+const char LibcurlHttpFetcher::kAltSvcCachePath[] =
+    "/var/lib/update_engine/alt-svc";
 const int LibcurlHttpFetcher::kMaxRedirects = 10;
 const int LibcurlHttpFetcher::kMaxRetryCountOobeComplete = 20;
 const int LibcurlHttpFetcher::kMaxRetryCountOobeNotComplete = 3;
@@ -43,7 +58,9 @@ LibcurlHttpFetcher::~LibcurlHttpFetcher() {
 // On error, returns false.
 bool LibcurlHttpFetcher::IsUpdateAllowedOverCurrentConnection() const {
   NetworkConnectionType type;
-  ConcreteDbusGlib dbus_iface;
+  // The connection manager keeps the interface to watch for changes of the
+  // connection, so it must live as long as the process.
+  static ConcreteDbusGlib dbus_iface;
   ConnectionManager* connection_manager = system_state_->connection_manager();
   TEST_AND_RETURN_FALSE(connection_manager->GetConnectionType(&dbus_iface,
                                                               &type));
@@ -58,12 +75,55 @@ bool LibcurlHttpFetcher::IsOfficialBuild() const {
   return force_build_type_ ? forced_official_build_ : utils::IsOfficialBuild();
 }
 
+CURLSH* LibcurlHttpFetcher::GetShareHandle() {
+  static CURLSH* share_handle = NULL;
+  if (!share_handle) {
+    share_handle = curl_share_init();
+    CHECK(share_handle);
+    CHECK_EQ(curl_share_setopt(share_handle, CURLSHOPT_SHARE,
+                               CURL_LOCK_DATA_DNS),
+             CURLSHE_OK);
+    CHECK_EQ(curl_share_setopt(share_handle, CURLSHOPT_SHARE,
+                               CURL_LOCK_DATA_SSL_SESSION),
+             CURLSHE_OK);
+#if LIBCURL_VERSION_NUM >= 0x073900
+    // The connection cache outlives the per-transfer multi handles only if
+    // it's shared.
+    CHECK_EQ(curl_share_setopt(share_handle, CURLSHOPT_SHARE,
+                               CURL_LOCK_DATA_CONNECT),
+             CURLSHE_OK);
+#endif
+  }
+  return share_handle;
+}
+
+BufferTuner* LibcurlHttpFetcher::GetBufferTuner() {
+  static BufferTuner* buffer_tuner = NULL;
+  if (!buffer_tuner) {
+    buffer_tuner = new BufferTuner();
+    buffer_tuner->LoadAutotuneMaxSize("/proc/sys/net/ipv4/tcp_rmem");
+  }
+  return buffer_tuner;
+}
+
 void LibcurlHttpFetcher::ResumeTransfer(const std::string& url) {
   LOG(INFO) << "Starting/Resuming transfer";
   CHECK(!transfer_in_progress_);
   url_ = url;
   curl_multi_handle_ = curl_multi_init();
   CHECK(curl_multi_handle_);
+  // libcurl tells which sockets to watch and when to call it back as they
+  // change, rather than being asked for all of them on each pass.
+  CHECK_EQ(curl_multi_setopt(curl_multi_handle_, CURLMOPT_SOCKETFUNCTION,
+                             &LibcurlHttpFetcher::StaticLibcurlSocket),
+           CURLM_OK);
+  CHECK_EQ(curl_multi_setopt(curl_multi_handle_, CURLMOPT_SOCKETDATA, this),
+           CURLM_OK);
+  CHECK_EQ(curl_multi_setopt(curl_multi_handle_, CURLMOPT_TIMERFUNCTION,
+                             &LibcurlHttpFetcher::StaticLibcurlTimer),
+           CURLM_OK);
+  CHECK_EQ(curl_multi_setopt(curl_multi_handle_, CURLMOPT_TIMERDATA, this),
+           CURLM_OK);
 
   curl_handle_ = curl_easy_init();
   CHECK(curl_handle_);
@@ -72,13 +132,47 @@ void LibcurlHttpFetcher::ResumeTransfer(const std::string& url) {
                             CURLOPT_ERRORBUFFER,
                             &curl_error_buffer_), CURLE_OK);
 
+  CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_SHARE, share_handle_),
+           CURLE_OK);
+#if LIBCURL_VERSION_NUM >= 0x072f00
+  if (use_http2_ || use_http3_) {
+    // Failing this just means libcurl was built without HTTP/2.
+    LOG_IF(WARNING, curl_easy_setopt(curl_handle_, CURLOPT_HTTP_VERSION,
+                                     CURL_HTTP_VERSION_2TLS) != CURLE_OK)
+        << "HTTP/2 isn't supported, using HTTP/1.1";
+  }
+#endif
+  transfer_allows_http3_ = false;
+#if LIBCURL_VERSION_NUM >= 0x074200
+  // The first connection to a server is over TCP. The Alt-Svc header of its
+  // response makes the next ones use HTTP/3.
+  if (use_http3_ && !http3_failed_ &&
+      (curl_version_info(CURLVERSION_NOW)->features & CURL_VERSION_HTTP3)) {
+    CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_ALTSVC_CTRL,
+                              static_cast<long>(CURLALTSVC_H1 | CURLALTSVC_H2 |
+                                                CURLALTSVC_H3)),
+             CURLE_OK);
+    CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_ALTSVC, kAltSvcCachePath),
+             CURLE_OK);
+    transfer_allows_http3_ = true;
+  }
+#endif
+
   if (post_data_set_) {
+    // The body is sent as is if it can't be compressed.
+    const vector<char>* body = &post_data_;
+    const bool compressed = compress_post_data_ &&
+        GzipCompress(post_data_, &compressed_post_data_);
+    LOG_IF(WARNING, compress_post_data_ && !compressed)
+        << "Unable to compress the post data, sending it uncompressed";
+    if (compressed)
+      body = &compressed_post_data_;
     CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_POST, 1), CURLE_OK);
     CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_POSTFIELDS,
-                              &post_data_[0]),
+                              body->empty() ? "" : &(*body)[0]),
              CURLE_OK);
     CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_POSTFIELDSIZE,
-                              post_data_.size()),
+                              body->size()),
              CURLE_OK);
 
     // Set the Content-Type HTTP header, if one was specifically set.
@@ -89,13 +183,36 @@ void LibcurlHttpFetcher::ResumeTransfer(const std::string& url) {
                            GetHttpContentTypeString(post_content_type_));
       curl_http_headers_ = curl_slist_append(NULL, content_type_attr.c_str());
       CHECK(curl_http_headers_);
-      CHECK_EQ(
-          curl_easy_setopt(curl_handle_, CURLOPT_HTTPHEADER,
-                           curl_http_headers_),
-          CURLE_OK);
     } else {
       LOG(WARNING) << "no content type set, using libcurl default";
     }
+    if (compressed) {
+      curl_http_headers_ = curl_slist_append(curl_http_headers_,
+                                             "Content-Encoding: gzip");
+      CHECK(curl_http_headers_);
+    }
+  }
+  if (!if_none_match_.empty()) {
+    const string if_none_match_attr =
+        base::StringPrintf("If-None-Match: %s", if_none_match_.c_str());
+    curl_http_headers_ = curl_slist_append(curl_http_headers_,
+                                           if_none_match_attr.c_str());
+    CHECK(curl_http_headers_);
+  }
+  if (curl_http_headers_) {
+    CHECK_EQ(
+        curl_easy_setopt(curl_handle_, CURLOPT_HTTPHEADER,
+                         curl_http_headers_),
+        CURLE_OK);
+  }
+
+  // Lets the server compress the response with any coding libcurl decodes,
+  // as the data streams in. A resumed transfer asks for a range of the
+  // uncompressed response instead.
+  if (accept_compressed_response_ && bytes_downloaded_ == 0 &&
+      !download_length_) {
+    CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_ENCODING, ""),
+             CURLE_OK);
   }
 
   if (bytes_downloaded_ > 0 || download_length_) {
@@ -120,6 +237,12 @@ void LibcurlHttpFetcher::ResumeTransfer(const std::string& url) {
              CURLE_OK);
   }
 
+  response_etag_.clear();
+  response_retry_after_ = 0;
+  CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_HEADERDATA, this),
+           CURLE_OK);
+  CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_HEADERFUNCTION,
+                            StaticLibcurlHeader), CURLE_OK);
   CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_WRITEDATA, this), CURLE_OK);
   CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_WRITEFUNCTION,
                             StaticLibcurlWrite), CURLE_OK);
@@ -146,6 +269,29 @@ void LibcurlHttpFetcher::ResumeTransfer(const std::string& url) {
   CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_CONNECTTIMEOUT, 30),
            CURLE_OK);
 
+  // Share the rate of the bandwidth controller with the other transfers.
+  // libcurl keeps the transfer under it by not reading from the socket,
+  // which lets TCP slow the server down.
+  transfer_rate_ = 0;
+  if (bandwidth_controller_) {
+    bandwidth_controller_->TransferStarted();
+    transfer_rate_ = bandwidth_controller_->TransferRate();
+  }
+  CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_MAX_RECV_SPEED_LARGE,
+                            static_cast<curl_off_t>(transfer_rate_)),
+           CURLE_OK);
+
+  // Size the reads, and the receive buffers of new connections, for the
+  // bandwidth-delay product seen so far. Connections reused from the share
+  // handle keep theirs.
+  const long read_buffer_size = GetBufferTuner()->ReadBufferSize();
+  LOG_IF(WARNING, curl_easy_setopt(curl_handle_, CURLOPT_BUFFERSIZE,
+                                   read_buffer_size) != CURLE_OK)
+      << "Unable to set the read buffer size to " << read_buffer_size;
+  CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_SOCKOPTFUNCTION,
+                            &LibcurlHttpFetcher::StaticLibcurlSockopt),
+           CURLE_OK);
+
   // By default, libcurl doesn't follow redirections. Allow up to
   // |kMaxRedirects| redirections.
   CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_FOLLOWLOCATION, 1), CURLE_OK);
@@ -166,6 +312,10 @@ void LibcurlHttpFetcher::ResumeTransfer(const std::string& url) {
 
   CHECK_EQ(curl_multi_add_handle(curl_multi_handle_, curl_handle_), CURLM_OK);
   transfer_in_progress_ = true;
+  transfer_start_time_ = base::Time::Now();
+  transfer_start_bytes_ = bytes_downloaded_;
+  UE_PROBE2(http_transfer_start, url_.c_str(),
+            static_cast<int64_t>(resume_offset_));
 }
 
 // Lock down only the protocol in case of HTTP.
@@ -241,15 +391,17 @@ void LibcurlHttpFetcher::TerminateTransfer() {
   }
 }
 
-void LibcurlHttpFetcher::CurlPerformOnce() {
+void LibcurlHttpFetcher::CurlPerformOnce(curl_socket_t socket, int events) {
   CHECK(transfer_in_progress_);
   int running_handles = 0;
   CURLMcode retcode = CURLM_CALL_MULTI_PERFORM;
 
-  // libcurl may request that we immediately call curl_multi_perform after it
-  // returns, so we do. libcurl promises that curl_multi_perform will not block.
+  // Old versions of libcurl may request that we immediately call
+  // curl_multi_socket_action again after it returns, so we do. libcurl
+  // promises that curl_multi_socket_action will not block.
   while (CURLM_CALL_MULTI_PERFORM == retcode) {
-    retcode = curl_multi_perform(curl_multi_handle_, &running_handles);
+    retcode = curl_multi_socket_action(curl_multi_handle_, socket, events,
+                                       &running_handles);
     if (terminate_requested_) {
       ForceTransferTermination();
       return;
@@ -262,6 +414,12 @@ void LibcurlHttpFetcher::CurlPerformOnce() {
       no_network_retry_count_ = 0;
     } else {
       LOG(ERROR) << "Unable to get http response code: " << curl_error_buffer_;
+      // A QUIC path that's blocked looks like no network at all.
+      if (transfer_allows_http3_ && !http3_failed_) {
+        LOG(WARNING) << "No response with HTTP/3 allowed, the next transfers "
+                     << "go over TCP";
+        http3_failed_ = true;
+      }
     }
 
     // we're done!
@@ -275,6 +433,7 @@ void LibcurlHttpFetcher::CurlPerformOnce() {
         http_response_code_ == 0 &&
         no_network_retry_count_ < no_network_max_retries_) {
       no_network_retry_count_++;
+      total_retry_count_++;
       g_timeout_add_seconds(kNoNetworkRetrySeconds,
                             &LibcurlHttpFetcher::StaticRetryTimeoutCallback,
                             this);
@@ -310,6 +469,7 @@ void LibcurlHttpFetcher::CurlPerformOnce() {
       } else {
         // Need to restart transfer
         LOG(INFO) << "Restarting transfer to download the remaining bytes";
+        total_retry_count_++;
         g_timeout_add_seconds(retry_seconds_,
                               &LibcurlHttpFetcher::StaticRetryTimeoutCallback,
                               this);
@@ -323,11 +483,90 @@ void LibcurlHttpFetcher::CurlPerformOnce() {
       }
     }
   } else {
-    // set up callback
-    SetupMainloopSources();
+    SampleConnection();
+    UpdateTransferRate();
+  }
+}
+
+void LibcurlHttpFetcher::SampleConnection() {
+  const base::TimeTicks now = base::TimeTicks::Now();
+  if (now - last_rtt_sample_time_ < base::TimeDelta::FromSeconds(1))
+    return;
+  last_rtt_sample_time_ = now;
+  // The kernel's smoothed round-trip time of the connection, in
+  // microseconds.
+  long socket = -1;
+  struct tcp_info info;
+  socklen_t info_size = sizeof(info);
+  if (curl_easy_getinfo(curl_handle_, CURLINFO_LASTSOCKET,
+                        &socket) != CURLE_OK ||
+      socket < 0 ||
+      getsockopt(socket, IPPROTO_TCP, TCP_INFO, &info, &info_size) != 0 ||
+      info.tcpi_rtt == 0) {
+    return;
+  }
+  const base::TimeDelta rtt =
+      base::TimeDelta::FromMicroseconds(info.tcpi_rtt);
+  if (bandwidth_controller_)
+    bandwidth_controller_->AddRttSample(rtt, now);
+  // A limited transfer's throughput says nothing about the link.
+  double bytes_per_second = 0;
+  if (transfer_rate_ == 0 &&
+      curl_easy_getinfo(curl_handle_, CURLINFO_SPEED_DOWNLOAD,
+                        &bytes_per_second) == CURLE_OK) {
+    GetBufferTuner()->AddSample(rtt, bytes_per_second);
   }
 }
 
+void LibcurlHttpFetcher::UpdateTransferRate() {
+  if (!bandwidth_controller_)
+    return;
+  const uint64_t rate = bandwidth_controller_->TransferRate();
+  if (rate == transfer_rate_)
+    return;
+  transfer_rate_ = rate;
+  CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_MAX_RECV_SPEED_LARGE,
+                            static_cast<curl_off_t>(rate)),
+           CURLE_OK);
+}
+
+int LibcurlHttpFetcher::StaticLibcurlSockopt(void* data,
+                                             curl_socket_t socket,
+                                             curlsocktype purpose) {
+  const int size = static_cast<int>(GetBufferTuner()->ReceiveBufferSize());
+  if (purpose != CURLSOCKTYPE_IPCXN || size <= 0)
+    return CURL_SOCKOPT_OK;
+  // SO_RCVBUFFORCE goes past net.core.rmem_max, but needs CAP_NET_ADMIN.
+  if (setsockopt(socket, SOL_SOCKET, SO_RCVBUFFORCE, &size,
+                 sizeof(size)) != 0 &&
+      setsockopt(socket, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) != 0) {
+    PLOG(WARNING) << "Unable to set the receive buffer size to " << size;
+  }
+  return CURL_SOCKOPT_OK;
+}
+
+size_t LibcurlHttpFetcher::LibcurlHeader(const char* line, size_t size) {
+  const string header(line, size);
+  // Each response of the transfer, e.g., past a redirect, starts with its
+  // status line.
+  if (StartsWithASCII(header, "HTTP/", true)) {
+    response_etag_.clear();
+    response_retry_after_ = 0;
+  } else if (StartsWithASCII(header, "ETag:", false)) {
+    TrimWhitespaceASCII(header.substr(strlen("ETag:")), TRIM_ALL,
+                        &response_etag_);
+  } else if (StartsWithASCII(header, "Retry-After:", false)) {
+    // Only the delay in seconds is understood, not the HTTP-date form.
+    string delay;
+    TrimWhitespaceASCII(header.substr(strlen("Retry-After:")), TRIM_ALL,
+                        &delay);
+    if (!base::StringToInt(delay, &response_retry_after_) ||
+        response_retry_after_ < 0)
+      response_retry_after_ = 0;
+  }
+  return size;
+}
+
 size_t LibcurlHttpFetcher::LibcurlWrite(void *ptr, size_t size, size_t nmemb) {
   // Update HTTP response first.
   GetHttpResponseCode();
@@ -335,8 +574,10 @@ size_t LibcurlHttpFetcher::LibcurlWrite(void *ptr, size_t size, size_t nmemb) {
 
   // Do nothing if no payload or HTTP response is an error.
   if (payload_size == 0 || !IsHttpResponseSuccess()) {
-    LOG(INFO) << "HTTP response unsuccessful (" << http_response_code_
-              << ") or no payload (" << payload_size << "), nothing to do";
+    // Called for every chunk the server sends.
+    LOG_EVERY_N_SEC(INFO, kChunkLogIntervalSeconds)
+        << "HTTP response unsuccessful (" << http_response_code_
+        << ") or no payload (" << payload_size << "), nothing to do";
     return 0;
   }
 
@@ -352,9 +593,21 @@ size_t LibcurlHttpFetcher::LibcurlWrite(void *ptr, size_t size, size_t nmemb) {
     }
   }
   bytes_downloaded_ += payload_size;
+  UE_PROBE2(http_transfer_progress, static_cast<int64_t>(bytes_downloaded_),
+            static_cast<int64_t>(transfer_size_));
   in_write_callback_ = true;
-  if (delegate_)
-    delegate_->ReceivedBytes(this, reinterpret_cast<char*>(ptr), payload_size);
+  if (delegate_) {
+    // If the delegate lends a buffer, copy the data straight into it rather
+    // than having the delegate copy it out of curl's buffer.
+    char* buffer = delegate_->GetReceiveBuffer(this, payload_size);
+    if (buffer) {
+      memcpy(buffer, ptr, payload_size);
+      delegate_->ReceivedBytesInBuffer(this, payload_size);
+    } else {
+      delegate_->ReceivedBytes(this, reinterpret_cast<char*>(ptr),
+                               payload_size);
+    }
+  }
   in_write_callback_ = false;
   return payload_size;
 }
@@ -371,90 +624,57 @@ void LibcurlHttpFetcher::Unpause() {
   CHECK_EQ(curl_easy_pause(curl_handle_, CURLPAUSE_CONT), CURLE_OK);
 }
 
-// This method sets up callbacks with the glib main loop.
-void LibcurlHttpFetcher::SetupMainloopSources() {
-  fd_set fd_read;
-  fd_set fd_write;
-  fd_set fd_exc;
-
-  FD_ZERO(&fd_read);
-  FD_ZERO(&fd_write);
-  FD_ZERO(&fd_exc);
-
-  int fd_max = 0;
-
-  // Ask libcurl for the set of file descriptors we should track on its
-  // behalf.
-  CHECK_EQ(curl_multi_fdset(curl_multi_handle_, &fd_read, &fd_write,
-                            &fd_exc, &fd_max), CURLM_OK);
-
-  // We should iterate through all file descriptors up to libcurl's fd_max or
-  // the highest one we're tracking, whichever is larger.
-  for (size_t t = 0; t < arraysize(io_channels_); ++t) {
-    if (!io_channels_[t].empty())
-      fd_max = max(fd_max, io_channels_[t].rbegin()->first);
-  }
-
-  // For each fd, if we're not tracking it, track it. If we are tracking it, but
-  // libcurl doesn't care about it anymore, stop tracking it. After this loop,
-  // there should be exactly as many GIOChannel objects in io_channels_[0|1] as
-  // there are read/write fds that we're tracking.
-  for (int fd = 0; fd <= fd_max; ++fd) {
-    // Note that fd_exc is unused in the current version of libcurl so is_exc
-    // should always be false.
-    bool is_exc = FD_ISSET(fd, &fd_exc) != 0;
-    bool must_track[2] = {
-      is_exc || (FD_ISSET(fd, &fd_read) != 0),  // track 0 -- read
-      is_exc || (FD_ISSET(fd, &fd_write) != 0)  // track 1 -- write
-    };
-
-    for (size_t t = 0; t < arraysize(io_channels_); ++t) {
-      bool tracked = io_channels_[t].find(fd) != io_channels_[t].end();
-
-      if (!must_track[t]) {
-        // If we have an outstanding io_channel, remove it.
-        if (tracked) {
-          g_source_remove(io_channels_[t][fd].second);
-          g_io_channel_unref(io_channels_[t][fd].first);
-          io_channels_[t].erase(io_channels_[t].find(fd));
-        }
-        continue;
-      }
-
-      // If we are already tracking this fd, continue -- nothing to do.
-      if (tracked)
-        continue;
-
-      // Set conditions appropriately -- read for track 0, write for track 1.
-      GIOCondition condition = static_cast<GIOCondition>(
-          ((t == 0) ? (G_IO_IN | G_IO_PRI) : G_IO_OUT) | G_IO_ERR | G_IO_HUP);
-
-      // Track a new fd.
-      GIOChannel* io_channel = g_io_channel_unix_new(fd);
-      guint tag =
-          g_io_add_watch(io_channel, condition, &StaticFDCallback, this);
+void LibcurlHttpFetcher::LibcurlSocket(curl_socket_t socket, int what) {
+  SocketWatches::iterator it = socket_watches_.find(socket);
+  if (it != socket_watches_.end() && it->second.what == what)
+    return;
+  RemoveSocketWatch(socket);
+  if (what == CURL_POLL_REMOVE)
+    return;
+
+  int condition = G_IO_ERR | G_IO_HUP;
+  if (what & CURL_POLL_IN)
+    condition |= G_IO_IN | G_IO_PRI;
+  if (what & CURL_POLL_OUT)
+    condition |= G_IO_OUT;
+  SocketWatch watch;
+  watch.channel = g_io_channel_unix_new(socket);
+  watch.tag = g_io_add_watch(watch.channel,
+                             static_cast<GIOCondition>(condition),
+                             &StaticFDCallback, this);
+  watch.what = what;
+  socket_watches_[socket] = watch;
+}
 
-      io_channels_[t][fd] = make_pair(io_channel, tag);
-      static int io_counter = 0;
-      io_counter++;
-      if (io_counter % 50 == 0) {
-        LOG(INFO) << "io_counter = " << io_counter;
-      }
-    }
-  }
+void LibcurlHttpFetcher::RemoveSocketWatch(curl_socket_t socket) {
+  SocketWatches::iterator it = socket_watches_.find(socket);
+  if (it == socket_watches_.end())
+    return;
+  g_source_remove(it->second.tag);
+  g_io_channel_unref(it->second.channel);
+  socket_watches_.erase(it);
+}
 
-  // Set up a timeout callback for libcurl.
-  if (!timeout_source_) {
-    LOG(INFO) << "Setting up timeout source: " << idle_seconds_ << " seconds.";
-    timeout_source_ = g_timeout_source_new_seconds(idle_seconds_);
-    g_source_set_callback(timeout_source_, StaticTimeoutCallback, this, NULL);
-    g_source_attach(timeout_source_, NULL);
+void LibcurlHttpFetcher::LibcurlTimer(long timeout_ms) {
+  if (timer_id_) {
+    g_source_remove(timer_id_);
+    timer_id_ = 0;
   }
+  // -1 means libcurl has nothing to do until one of its sockets is ready.
+  if (timeout_ms >= 0)
+    timer_id_ = g_timeout_add(timeout_ms, &StaticTimeoutCallback, this);
 }
 
 bool LibcurlHttpFetcher::FDCallback(GIOChannel *source,
                                     GIOCondition condition) {
-  CurlPerformOnce();
+  int events = 0;
+  if (condition & (G_IO_IN | G_IO_PRI))
+    events |= CURL_CSELECT_IN;
+  if (condition & G_IO_OUT)
+    events |= CURL_CSELECT_OUT;
+  if (condition & (G_IO_ERR | G_IO_HUP))
+    events |= CURL_CSELECT_ERR;
+  CurlPerformOnce(g_io_channel_unix_get_fd(source), events);
   // We handle removing of this source elsewhere, so we always return true.
   // The docs say, "the function should return FALSE if the event source
   // should be removed."
@@ -469,29 +689,33 @@ gboolean LibcurlHttpFetcher::RetryTimeoutCallback() {
 }
 
 gboolean LibcurlHttpFetcher::TimeoutCallback() {
-  // We always return true, even if we don't want glib to call us back.
-  // We will remove the event source separately if we don't want to
-  // be called back.
-  if (!transfer_in_progress_)
-    return TRUE;
-  CurlPerformOnce();
-  return TRUE;
+  // The timer fires once; libcurl sets the next one while it works.
+  timer_id_ = 0;
+  if (transfer_in_progress_)
+    CurlPerformOnce();
+  return FALSE;
 }
 
 void LibcurlHttpFetcher::CleanUp() {
-  if (timeout_source_) {
-    g_source_destroy(timeout_source_);
-    timeout_source_ = NULL;
+  if (transfer_in_progress_ && curl_handle_)
+    RecordTransferTiming();
+  if (transfer_in_progress_) {
+    UE_PROBE3(http_transfer_end, url_.c_str(), http_response_code_,
+              static_cast<int64_t>(bytes_downloaded_ - transfer_start_bytes_));
   }
-
-  for (size_t t = 0; t < arraysize(io_channels_); ++t) {
-    for (IOChannels::iterator it = io_channels_[t].begin();
-         it != io_channels_[t].end(); ++it) {
-      g_source_remove(it->second.second);
-      g_io_channel_unref(it->second.first);
-    }
-    io_channels_[t].clear();
+  if (transfer_in_progress_ && Trace::enabled()) {
+    TraceArgs args;
+    args["url"] = url_;
+    args["offset"] = StringPrintf(
+        "%lld", static_cast<long long>(transfer_start_bytes_));
+    args["bytes"] = StringPrintf(
+        "%lld",
+        static_cast<long long>(bytes_downloaded_ - transfer_start_bytes_));
+    args["http_response_code"] = StringPrintf("%d", http_response_code_);
+    Trace::AddCompleteEvent("http", "Transfer", transfer_start_time_, args);
   }
+  if (transfer_in_progress_ && bandwidth_controller_)
+    bandwidth_controller_->TransferEnded();
 
   if (curl_http_headers_) {
     curl_slist_free_all(curl_http_headers_);
@@ -509,9 +733,72 @@ void LibcurlHttpFetcher::CleanUp() {
     CHECK_EQ(curl_multi_cleanup(curl_multi_handle_), CURLM_OK);
     curl_multi_handle_ = NULL;
   }
+
+  // Done once libcurl is through with the sockets and the timer, which it
+  // may still update while the handles are cleaned up.
+  if (timer_id_) {
+    g_source_remove(timer_id_);
+    timer_id_ = 0;
+  }
+  while (!socket_watches_.empty())
+    RemoveSocketWatch(socket_watches_.begin()->first);
   transfer_in_progress_ = false;
 }
 
+void LibcurlHttpFetcher::RecordTransferTiming() {
+  TransferTiming timing;
+  long redirects = 0;
+  if (curl_easy_getinfo(curl_handle_, CURLINFO_NAMELOOKUP_TIME,
+                        &timing.name_lookup_seconds) != CURLE_OK ||
+      curl_easy_getinfo(curl_handle_, CURLINFO_CONNECT_TIME,
+                        &timing.connect_seconds) != CURLE_OK ||
+      curl_easy_getinfo(curl_handle_, CURLINFO_APPCONNECT_TIME,
+                        &timing.tls_seconds) != CURLE_OK ||
+      curl_easy_getinfo(curl_handle_, CURLINFO_STARTTRANSFER_TIME,
+                        &timing.first_byte_seconds) != CURLE_OK ||
+      curl_easy_getinfo(curl_handle_, CURLINFO_TOTAL_TIME,
+                        &timing.total_seconds) != CURLE_OK ||
+      curl_easy_getinfo(curl_handle_, CURLINFO_REDIRECT_COUNT,
+                        &redirects) != CURLE_OK) {
+    return;
+  }
+#if LIBCURL_VERSION_NUM >= 0x073200
+  long http_version = 0;
+  if (curl_easy_getinfo(curl_handle_, CURLINFO_HTTP_VERSION,
+                        &http_version) == CURLE_OK) {
+    switch (http_version) {
+      case CURL_HTTP_VERSION_1_0:
+      case CURL_HTTP_VERSION_1_1:
+        timing.http_version = 1;
+        break;
+      case CURL_HTTP_VERSION_2_0:
+        timing.http_version = 2;
+        break;
+#if LIBCURL_VERSION_NUM >= 0x074200
+      case CURL_HTTP_VERSION_3:
+        timing.http_version = 3;
+        break;
+#endif
+    }
+  }
+#endif
+  timing.bytes = bytes_downloaded_ - transfer_start_bytes_;
+  timing.redirects = static_cast<int>(redirects);
+  timing.rate_limited = transfer_rate_ != 0;
+  LOG(INFO) << "Transfer timing: name lookup "
+            << static_cast<int>(timing.name_lookup_seconds * 1000)
+            << " ms, connect "
+            << static_cast<int>(timing.connect_seconds * 1000)
+            << " ms, TLS " << static_cast<int>(timing.tls_seconds * 1000)
+            << " ms, first byte "
+            << static_cast<int>(timing.first_byte_seconds * 1000)
+            << " ms, total " << static_cast<int>(timing.total_seconds * 1000)
+            << " ms, " << timing.bytes << " bytes, "
+            << timing.redirects << " redirects, HTTP/"
+            << timing.http_version;
+  TransferStats::Get()->AddTransfer(url_, timing);
+}
+
 void LibcurlHttpFetcher::GetHttpResponseCode() {
   long http_response_code = 0;
   if (curl_easy_getinfo(curl_handle_,
@@ -7,12 +7,17 @@
 
 #include <map>
 #include <string>
+#include <vector>
 
 #include <base/basictypes.h>
 #include <base/logging.h>
+#include <base/time.h>
 #include <curl/curl.h>
 #include <glib.h>
+#include <gtest/gtest_prod.h>  // for FRIEND_TEST
 
+#include "update_engine/bandwidth_controller.h"
+#include "update_engine/buffer_tuner.h"
 #include "update_engine/certificate_checker.h"
 #include "update_engine/connection_manager.h"
 #include "update_engine/http_fetcher.h"
@@ -35,8 +40,10 @@ class LibcurlHttpFetcher : public HttpFetcher {
         curl_multi_handle_(NULL),
         curl_handle_(NULL),
         curl_http_headers_(NULL),
-        timeout_source_(NULL),
+        share_handle_(GetShareHandle()),
+        timer_id_(0),
         transfer_in_progress_(false),
+        transfer_start_bytes_(0),
         transfer_size_(0),
         bytes_downloaded_(0),
         download_length_(0),
@@ -46,13 +53,19 @@ class LibcurlHttpFetcher : public HttpFetcher {
         retry_seconds_(20),
         no_network_retry_count_(0),
         no_network_max_retries_(0),
-        idle_seconds_(1),
+        total_retry_count_(0),
         force_build_type_(false),
         forced_official_build_(false),
         in_write_callback_(false),
         sent_byte_(false),
         terminate_requested_(false),
-        check_certificate_(CertificateChecker::kNone) {}
+        check_certificate_(CertificateChecker::kNone),
+        use_http2_(false),
+        use_http3_(false),
+        http3_failed_(false),
+        transfer_allows_http3_(false),
+        bandwidth_controller_(NULL),
+        transfer_rate_(0) {}
 
   // Cleans up all internal state. Does not notify delegate
   ~LibcurlHttpFetcher();
@@ -75,17 +88,6 @@ class LibcurlHttpFetcher : public HttpFetcher {
   // Resume the transfer by calling curl_easy_pause(CURLPAUSE_CONT).
   virtual void Unpause();
 
-  // Libcurl sometimes asks to be called back after some time while
-  // leaving that time unspecified. In that case, we pick a reasonable
-  // default of one second, but it can be overridden here. This is
-  // primarily useful for testing.
-  // From http://curl.haxx.se/libcurl/c/curl_multi_timeout.html:
-  //     if libcurl returns a -1 timeout here, it just means that libcurl
-  //     currently has no stored timeout value. You must not wait too long
-  //     (more than a few seconds perhaps) before you call
-  //     curl_multi_perform() again.
-  void set_idle_seconds(int seconds) { idle_seconds_ = seconds; }
-
   // Sets the retry timeout. Useful for testing.
   void set_retry_seconds(int seconds) { retry_seconds_ = seconds; }
 
@@ -103,14 +105,57 @@ class LibcurlHttpFetcher : public HttpFetcher {
     check_certificate_ = check_certificate;
   }
 
+  // Makes the fetcher ask for HTTP/2 on HTTPS connections, falling back to
+  // HTTP/1.1 if the server or libcurl doesn't support it.
+  void set_use_http2(bool use_http2) { use_http2_ = use_http2; }
+
+  // Lets the transfers move to HTTP/3 (QUIC) when a server advertises it
+  // with Alt-Svc, which libcurl remembers in kAltSvcCachePath. Until then,
+  // and after a transfer gets no response with it, they go over TCP with
+  // HTTP/2 or HTTP/1.1. Needs a libcurl built with HTTP/3 support. QUIC
+  // recovers from loss per stream and without the TCP handshake, which
+  // helps on lossy cellular and satellite links.
+  void set_use_http3(bool use_http3) { use_http3_ = use_http3; }
+
+  // Where the Alt-Svc entries are kept from one transfer to the next, and
+  // across restarts.
+  static const char kAltSvcCachePath[];
+
+  // Makes the transfers run at the rate |bandwidth_controller| sets and feed
+  // it the round-trip times of their connections. Not owned; it must outlive
+  // the fetcher. NULL, the default, leaves the rate unlimited.
+  void set_bandwidth_controller(BandwidthController* bandwidth_controller) {
+    bandwidth_controller_ = bandwidth_controller;
+  }
+
   virtual size_t GetBytesDownloaded() {
     return static_cast<size_t>(bytes_downloaded_);
   }
 
+  virtual int GetRetryCount() { return total_retry_count_; }
+
+  // Returns the process-wide tuner of the buffer sizes of the transfers,
+  // which learns from all of them.
+  static BufferTuner* GetBufferTuner();
+
  private:
+  FRIEND_TEST(UpdateAttempterTest, DownloadFetchersTest);
+
+  // Returns the process-wide curl share handle that every transfer uses. It
+  // shares the DNS cache, the TLS sessions and, if libcurl is new enough, the
+  // connections themselves, so that update checks, pings, retries and
+  // payload ranges to the same host don't each redo the DNS lookup and the
+  // TCP and TLS handshakes. Fetchers run on the main loop only, so no locking
+  // callbacks are needed.
+  static CURLSH* GetShareHandle();
+
   // Asks libcurl for the http response code and stores it in the object.
   void GetHttpResponseCode();
 
+  // Logs the timing of the transfer ending as libcurl measured it, and
+  // records it in TransferStats.
+  void RecordTransferTiming();
+
   // Checks whether stored HTTP response is within the success range.
   inline bool IsHttpResponseSuccess() {
     return (http_response_code_ >= 200 && http_response_code_ < 300);
@@ -128,8 +173,9 @@ class LibcurlHttpFetcher : public HttpFetcher {
   virtual void ResumeTransfer(const std::string& url);
 
   // These two methods are for glib main loop callbacks. They are called
-  // when either a file descriptor is ready for work or when a timer
-  // has fired. The static versions are shims for libcurl which has a C API.
+  // when either a socket libcurl watches is ready or when the timer libcurl
+  // asked for has fired. The static versions are shims for glib which has a
+  // C API.
   bool FDCallback(GIOChannel *source, GIOCondition condition);
   static gboolean StaticFDCallback(GIOChannel *source,
                                    GIOCondition condition,
@@ -142,23 +188,50 @@ class LibcurlHttpFetcher : public HttpFetcher {
     return reinterpret_cast<LibcurlHttpFetcher*>(data)->TimeoutCallback();
   }
 
+  // Callbacks called by libcurl when the events it waits for on |socket|
+  // change to |what|, and when the time it may wait until it's called again
+  // changes to |timeout_ms|. They map these onto the watches and the timer
+  // of the glib main loop, which persist until libcurl changes them.
+  void LibcurlSocket(curl_socket_t socket, int what);
+  static int StaticLibcurlSocket(CURL* easy, curl_socket_t socket, int what,
+                                 void* data, void* socket_data) {
+    reinterpret_cast<LibcurlHttpFetcher*>(data)->LibcurlSocket(socket, what);
+    return 0;
+  }
+  void LibcurlTimer(long timeout_ms);
+  static int StaticLibcurlTimer(CURLM* multi, long timeout_ms, void* data) {
+    reinterpret_cast<LibcurlHttpFetcher*>(data)->LibcurlTimer(timeout_ms);
+    return 0;
+  }
+
   gboolean RetryTimeoutCallback();
   static gboolean StaticRetryTimeoutCallback(void* arg) {
     return static_cast<LibcurlHttpFetcher*>(arg)->RetryTimeoutCallback();
   }
 
-  // Calls into curl_multi_perform to let libcurl do its work. Returns after
-  // curl_multi_perform is finished, which may actually be after more than
-  // one call to curl_multi_perform. This method will set up the glib run
-  // loop with sources for future work that libcurl will do.
-  // This method will not block.
-  // Returns true if we should resume immediately after this call.
-  void CurlPerformOnce();
+  // Lets libcurl do the work that |socket| being ready for the |events|
+  // (CURL_CSELECT_* bits) allows, or, by default, the work that's due on
+  // its timer, and handles the end of the transfer. libcurl sets up the glib
+  // main loop sources for its future work through LibcurlSocket() and
+  // LibcurlTimer() meanwhile. This method will not block.
+  void CurlPerformOnce(curl_socket_t socket = CURL_SOCKET_TIMEOUT,
+                       int events = 0);
+
+  // Removes the watch of |socket|, if there's one.
+  void RemoveSocketWatch(curl_socket_t socket);
+
+  // Passes the round-trip time of the connection to the bandwidth controller
+  // and, along with the throughput of an unlimited transfer, to the buffer
+  // tuner, at most once a second.
+  void SampleConnection();
 
-  // Sets up glib main loop sources as needed by libcurl. This is generally
-  // the file descriptor of the socket and a timer in case nothing happens
-  // on the fds.
-  void SetupMainloopSources();
+  // Applies the rate the bandwidth controller sets to the transfer.
+  void UpdateTransferRate();
+
+  // Callback called by libcurl once it has created the socket of a new
+  // connection, to size its receive buffer.
+  static int StaticLibcurlSockopt(void* data, curl_socket_t socket,
+                                  curlsocktype purpose);
 
   // Callback called by libcurl when new data has arrived on the transfer
   size_t LibcurlWrite(void *ptr, size_t size, size_t nmemb);
@@ -168,8 +241,17 @@ class LibcurlHttpFetcher : public HttpFetcher {
         LibcurlWrite(ptr, size, nmemb);
   }
 
+  // Callback called by libcurl for each header line of the response, to
+  // pick up its ETag and Retry-After delay.
+  size_t LibcurlHeader(const char* line, size_t size);
+  static size_t StaticLibcurlHeader(char* ptr, size_t size,
+                                    size_t nmemb, void* data) {
+    return reinterpret_cast<LibcurlHttpFetcher*>(data)->
+        LibcurlHeader(ptr, size * nmemb);
+  }
+
   // Cleans up the following if they are non-null:
-  // curl(m) handles, io_channels_, timeout_source_.
+  // curl(m) handles, socket_watches_, timer_id_.
   void CleanUp();
 
   // Force terminate the transfer. This will invoke the delegate's (if any)
@@ -194,20 +276,33 @@ class LibcurlHttpFetcher : public HttpFetcher {
   CURLM *curl_multi_handle_;
   CURL *curl_handle_;
   struct curl_slist *curl_http_headers_;
-
-  // Lists of all read(0)/write(1) file descriptors that we're waiting on from
-  // the glib main loop. libcurl may open/close descriptors and switch their
-  // directions so maintain two separate lists so that watch conditions can be
-  // set appropriately.
-  typedef std::map<int, std::pair<GIOChannel*, guint> > IOChannels;
-  IOChannels io_channels_[2];
-
-  // if non-NULL, a timer we're waiting on. glib main loop will call us back
-  // when it fires.
-  GSource* timeout_source_;
+  // GetShareHandle(), which the transfers of every fetcher use.
+  CURLSH* share_handle_;
+
+  // The post data, compressed if the fetcher was asked to.
+  std::vector<char> compressed_post_data_;
+
+  // The glib main loop watches of the sockets libcurl waits on, with the
+  // events (CURL_POLL_*) they're watched for.
+  struct SocketWatch {
+    GIOChannel* channel;
+    guint tag;
+    int what;
+  };
+  typedef std::map<curl_socket_t, SocketWatch> SocketWatches;
+  SocketWatches socket_watches_;
+
+  // If non-zero, the timer libcurl asked for. glib main loop will call us
+  // back when it fires.
+  guint timer_id_;
 
   bool transfer_in_progress_;
 
+  // When the current connection started and how many bytes had been
+  // downloaded by then, for the trace.
+  base::Time transfer_start_time_;
+  off_t transfer_start_bytes_;
+
   // The transfer size. -1 if not known.
   off_t transfer_size_;
 
@@ -235,8 +330,8 @@ class LibcurlHttpFetcher : public HttpFetcher {
   int no_network_retry_count_;
   int no_network_max_retries_;
 
-  // Seconds to wait before asking libcurl to "perform".
-  int idle_seconds_;
+  // Number of retries of either kind over all transfers.
+  int total_retry_count_;
 
   // If true, assume the build is official or not, according to
   // forced_official_build_. Useful for testing.
@@ -262,6 +357,22 @@ class LibcurlHttpFetcher : public HttpFetcher {
   // this should be kNone.
   CertificateChecker::ServerToCheck check_certificate_;
 
+  // See set_use_http2().
+  bool use_http2_;
+
+  // See set_use_http3(). |http3_failed_| is set once a transfer that could
+  // use HTTP/3 got no response, which keeps the next ones on TCP.
+  bool use_http3_;
+  bool http3_failed_;
+  // Whether the current transfer may use HTTP/3.
+  bool transfer_allows_http3_;
+
+  // The controller of the rate of the transfers, or NULL, and the rate the
+  // current transfer is limited to, in bytes per second, 0 if unlimited.
+  BandwidthController* bandwidth_controller_;
+  uint64_t transfer_rate_;
+  base::TimeTicks last_rtt_sample_time_;
+
   DISALLOW_COPY_AND_ASSIGN(LibcurlHttpFetcher);
 };
 
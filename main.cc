@@ -9,20 +9,33 @@
 #include <base/command_line.h>
 #include <base/file_util.h>
 #include <base/logging.h>
+#include <base/memory/scoped_ptr.h>
+#include <base/string_split.h>
 #include <base/string_util.h>
 #include <base/stringprintf.h>
+#include <base/time.h>
 #include <gflags/gflags.h>
 #include <glib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#include "update_engine/async_logging.h"
+#include "update_engine/bspatch_worker_pool.h"
 #include "update_engine/certificate_checker.h"
+#include "update_engine/checkpoint_file.h"
 #include "update_engine/dbus_constants.h"
 #include "update_engine/dbus_interface.h"
 #include "update_engine/dbus_service.h"
+#include "update_engine/delta_performer.h"
+#include "update_engine/io_recorder.h"
+#include "update_engine/libcurl_http_fetcher.h"
+#include "update_engine/memory_tracker.h"
+#include "update_engine/multicast_fetcher.h"
 #include "update_engine/real_system_state.h"
+#include "update_engine/release_watcher.h"
 #include "update_engine/subprocess.h"
 #include "update_engine/terminator.h"
+#include "update_engine/trace.h"
 #include "update_engine/update_attempter.h"
 #include "update_engine/update_check_scheduler.h"
 #include "update_engine/utils.h"
@@ -33,16 +46,80 @@ extern "C" {
 
 DEFINE_bool(logtostderr, false,
             "Write logs to stderr instead of to a file in log_dir.");
+DEFINE_bool(async_logging, true,
+            "Write the INFO and WARNING logs from a background thread.");
 DEFINE_bool(foreground, false,
             "Don't daemon()ize; run in foreground.");
 DEFINE_bool(no_connection_manager, false,
             "Don't use a connection manager.");
+DEFINE_bool(serve_peers, false,
+            "Serve the payloads downloaded to the other machines of the "
+            "network.");
+DEFINE_int32(peer_port, chromeos_update_engine::PeerServer::kDefaultPort,
+             "The port to serve the peers on.");
+DEFINE_string(multicast_group, "",
+              "Receive the payloads from this IPv4 multicast group, "
+              "downloading only the data missed from it.");
+DEFINE_int32(multicast_port,
+             chromeos_update_engine::MulticastFetcher::kDefaultPort,
+             "The port to receive the payloads from the multicast group on.");
+DEFINE_string(release_notify_url, "",
+              "Long-poll this URL for the releases of the device's channel, "
+              "and check for updates when there's one rather than "
+              "periodically.");
+DEFINE_int32(bspatch_workers, 0,
+             "Apply the BSDIFF operations in this many worker processes "
+             "rather than in update_engine itself.");
+DEFINE_int32(progress_notify_interval_ms,
+             chromeos_update_engine::UpdateAttempter::
+                 kProgressNotifyMinIntervalMs,
+             "Broadcast the download progress at most once per this many "
+             "milliseconds.");
+DEFINE_int32(memory_budget_mb, 0,
+             "Apply the updates within about this many MiB of memory, "
+             "spooling the large data blobs to disk. 0 means no budget.");
+DEFINE_bool(spool_updates, false,
+            "Only download the payloads of the scheduled updates, to be "
+            "applied from disk by the next update the user asks for.");
+DEFINE_string(shared_payload_cache, "",
+              "Directory where the update_engine instances of the host, "
+              "e.g. of its VMs or containers, cache the payloads, so that "
+              "each one is only downloaded once. Replaces the peer cache.");
+DEFINE_bool(full_verification, false,
+            "Read the new partitions back to verify them even if the "
+            "payload's destination hashes verified them as they were "
+            "written.");
+DEFINE_string(mirror_disks, "",
+              "Comma-separated disks, e.g. /dev/sdb, whose partitions mirror "
+              "those of the boot disk. The updates are written to them too.");
+DEFINE_bool(http2, false,
+            "Download the payloads over HTTP/2 from the HTTPS servers that "
+            "support it, falling back to HTTP/1.1.");
+DEFINE_bool(http3, false,
+            "Download the payloads over HTTP/3 (QUIC) from the servers that "
+            "advertise it, which copes better with lossy links.");
+DEFINE_int32(receive_buffer_kb, 0,
+             "Receive the payloads into socket buffers of this many KiB. "
+             "0 sizes them for the bandwidth-delay product of the link.");
+DEFINE_int32(read_buffer_kb, 0,
+             "Read the payloads in chunks of up to this many KiB. 0 sizes "
+             "them for the bandwidth-delay product of the link.");
+DEFINE_string(trace_file, "",
+              "Append a trace of the update attempts to this file, in the "
+              "Chrome trace event format.");
+DEFINE_string(io_trace_file, "",
+              "Record the reads and writes of the partitions to this file, "
+              "for io_replay to benchmark a device with.");
 
+using base::TimeDelta;
+using base::TimeTicks;
 using std::string;
 using std::vector;
 
 namespace chromeos_update_engine {
 
+const char kCheckpointFile[] = "/var/lib/update_engine/update-checkpoint";
+
 gboolean UpdateBootFlags(void* arg) {
   reinterpret_cast<UpdateAttempter*>(arg)->UpdateBootFlags();
   return FALSE;  // Don't call this callback again
@@ -53,14 +130,103 @@ gboolean BroadcastStatus(void* arg) {
   return FALSE;  // Don't call this callback again
 }
 
+gboolean RunUpdateCheckScheduler(void* arg) {
+  reinterpret_cast<UpdateCheckScheduler*>(arg)->Run();
+  return FALSE;  // Don't call this callback again
+}
+
+gboolean StartReleaseWatcher(void* arg) {
+  reinterpret_cast<ReleaseWatcher*>(arg)->Start();
+  return FALSE;  // Don't call this callback again
+}
+
+gboolean StartPeerServer(void* arg) {
+  LOG_IF(ERROR, !reinterpret_cast<UpdateAttempter*>(arg)->StartPeerServer(
+      FLAGS_peer_port)) << "Unable to serve the peers on port "
+                        << FLAGS_peer_port;
+  return FALSE;  // Don't call this callback again
+}
+
 namespace {
 
-void SetupDbusService(UpdateEngineService* service) {
+// Logs how long each phase of the startup takes, so the time to get on the
+// bus shows in the log of every boot.
+class StartupTimer {
+ public:
+  StartupTimer() : start_(TimeTicks::Now()), phase_start_(start_) {}
+
+  // Ends the phase that started when the last one ended.
+  void EndPhase(const char* phase) {
+    const TimeTicks now = TimeTicks::Now();
+    LOG(INFO) << "Startup: " << phase << " took "
+              << (now - phase_start_).InMilliseconds() << " ms";
+    phase_start_ = now;
+  }
+
+  TimeDelta Elapsed() const { return TimeTicks::Now() - start_; }
+
+ private:
+  TimeTicks start_;
+  TimeTicks phase_start_;
+
+  DISALLOW_COPY_AND_ASSIGN(StartupTimer);
+};
+
+// Runs a main loop of its own on a thread, for the D-Bus service to be
+// served on however busy the main loop is.
+class DbusServiceThread {
+ public:
+  DbusServiceThread()
+      : context_(g_main_context_new()),
+        loop_(g_main_loop_new(context_, FALSE)),
+        thread_(NULL) {}
+
+  ~DbusServiceThread() {
+    Stop();
+    g_main_loop_unref(loop_);
+    g_main_context_unref(context_);
+  }
+
+  GMainContext* context() const { return context_; }
+
+  void Start() {
+    CHECK(!thread_);
+    thread_ = g_thread_new("dbus-service", &DbusServiceThread::Run, loop_);
+  }
+
+  // Quits the loop and joins the thread, then sends what was left to send
+  // on the context, such as the replies to the calls cancelled at shutdown.
+  void Stop() {
+    if (!thread_)
+      return;
+    g_main_loop_quit(loop_);
+    g_thread_join(thread_);
+    thread_ = NULL;
+    while (g_main_context_iteration(context_, FALSE)) {}
+  }
+
+ private:
+  static gpointer Run(gpointer data) {
+    g_main_loop_run(reinterpret_cast<GMainLoop*>(data));
+    return NULL;
+  }
+
+  GMainContext* context_;
+  GMainLoop* loop_;
+  GThread* thread_;
+
+  DISALLOW_COPY_AND_ASSIGN(DbusServiceThread);
+};
+
+// Registers |service| on a private connection to the system bus, whose
+// messages are dispatched on |context|.
+void SetupDbusService(UpdateEngineService* service, GMainContext* context) {
   DBusGConnection *bus;
   DBusGProxy *proxy;
   GError *error = NULL;
 
-  bus = dbus_g_bus_get(DBUS_BUS_SYSTEM, &error);
+  update_engine_service_set_dbus_context(service, context);
+  bus = dbus_g_bus_get_private(DBUS_BUS_SYSTEM, context, &error);
   LOG_IF(FATAL, !bus) << "Failed to get bus: "
                       << utils::GetAndFreeGError(&error);
   proxy = dbus_g_proxy_new_for_name(bus,
@@ -122,7 +288,8 @@ string SetupLogFile(const string& kLogsRoot) {
   return kLogSymlink;
 }
 
-void SetupLogging() {
+// Returns the log file, or "" if logging to stderr.
+string SetupLogging() {
   // Log to stderr initially.
   logging::InitLogging(NULL,
                        logging::LOG_ONLY_TO_SYSTEM_DEBUG_LOG,
@@ -130,7 +297,7 @@ void SetupLogging() {
                        logging::APPEND_TO_OLD_LOG_FILE,
                        logging::DISABLE_DCHECK_FOR_NON_OFFICIAL_RELEASE_BUILDS);
   if (FLAGS_logtostderr) {
-    return;
+    return "";
   }
   const string log_file = SetupLogFile("/var/log");
   logging::InitLogging(log_file.c_str(),
@@ -138,6 +305,7 @@ void SetupLogging() {
                        logging::DONT_LOCK_LOG_FILE,
                        logging::APPEND_TO_OLD_LOG_FILE,
                        logging::DISABLE_DCHECK_FOR_NON_OFFICIAL_RELEASE_BUILDS);
+  return log_file;
 }
 
 }  // namespace {}
@@ -148,15 +316,38 @@ int main(int argc, char** argv) {
   ::g_type_init();
   dbus_threads_init_default();
   base::AtExitManager exit_manager;  // Required for base/rand_util.h.
+  chromeos_update_engine::StartupTimer startup_timer;
   chromeos_update_engine::Terminator::Init();
   chromeos_update_engine::Subprocess::Init();
   google::ParseCommandLineFlags(&argc, &argv, true);
   CommandLine::Init(argc, argv);
-  chromeos_update_engine::SetupLogging();
+  const string log_file = chromeos_update_engine::SetupLogging();
   if (!FLAGS_foreground)
     PLOG_IF(FATAL, daemon(0, 0) == 1) << "daemon() failed";
+  // Forked once daemonized, while there's still a single thread.
+  if (FLAGS_bspatch_workers > 0) {
+    LOG_IF(ERROR, !chromeos_update_engine::BspatchWorkerPool::Init(
+        FLAGS_bspatch_workers)) << "Unable to start the bspatch workers.";
+  }
+  // Started once daemonized, so the trace shows the pid of the daemon.
+  if (!FLAGS_trace_file.empty()) {
+    LOG_IF(ERROR, !chromeos_update_engine::Trace::Init(FLAGS_trace_file))
+        << "Unable to trace to " << FLAGS_trace_file;
+  }
+  if (!FLAGS_io_trace_file.empty()) {
+    LOG_IF(ERROR, !chromeos_update_engine::IoRecorder::Init(
+        FLAGS_io_trace_file)) << "Unable to record the I/O to "
+                              << FLAGS_io_trace_file;
+  }
+  // Likewise started once daemonized, as the writer is a thread.
+  if (FLAGS_async_logging && !log_file.empty()) {
+    LOG_IF(ERROR, !chromeos_update_engine::AsyncLogWriter::Init(
+        log_file, chromeos_update_engine::AsyncLogWriter::kDefaultBufferSize))
+        << "Unable to log asynchronously to " << log_file;
+  }
 
   LOG(INFO) << "CoreOS Update Engine starting";
+  startup_timer.EndPhase("logging and workers");
 
   // Ensure that all written files have safe permissions.
   // This is a mask, so we _block_ execute for the owner, and ALL
@@ -173,6 +364,7 @@ int main(int argc, char** argv) {
   chromeos_update_engine::UpdateAttempter *update_attempter =
       real_system_state.update_attempter();
   CHECK(update_attempter);
+  startup_timer.EndPhase("system state");
 
   // Sets static members for the certificate checker.
   chromeos_update_engine::CertificateChecker::set_system_state(
@@ -181,19 +373,96 @@ int main(int argc, char** argv) {
   chromeos_update_engine::CertificateChecker::set_openssl_wrapper(
       &openssl_wrapper);
 
+  // The update progress is checkpointed to its own file.
+  chromeos_update_engine::CheckpointFile checkpoint_file(
+      chromeos_update_engine::kCheckpointFile);
+  chromeos_update_engine::DeltaPerformer::set_checkpoint_file(
+      &checkpoint_file);
+
   // Create the dbus service object:
   dbus_g_object_type_install_info(UPDATE_ENGINE_TYPE_SERVICE,
                                   &dbus_glib_update_engine_service_object_info);
   UpdateEngineService* service =
       UPDATE_ENGINE_SERVICE(g_object_new(UPDATE_ENGINE_TYPE_SERVICE, NULL));
+  chromeos_update_engine::ConcreteDbusGlib dbus_glib;
   service->system_state_ = &real_system_state;
+  service->dbus_iface_ = &dbus_glib;
   update_attempter->set_dbus_service(service);
-  chromeos_update_engine::SetupDbusService(service);
+  update_attempter->set_progress_notify_interval(
+      base::TimeDelta::FromMilliseconds(FLAGS_progress_notify_interval_ms));
+  if (FLAGS_memory_budget_mb > 0) {
+    update_attempter->set_memory_budget(
+        static_cast<uint64_t>(FLAGS_memory_budget_mb) * 1024 * 1024);
+  }
+  update_attempter->set_spool_updates(FLAGS_spool_updates);
+  if (!FLAGS_shared_payload_cache.empty())
+    update_attempter->set_shared_payload_cache(FLAGS_shared_payload_cache);
+  if (!FLAGS_multicast_group.empty()) {
+    update_attempter->set_multicast_group(FLAGS_multicast_group,
+                                          FLAGS_multicast_port);
+  }
+  update_attempter->set_full_verification(FLAGS_full_verification);
+  if (!FLAGS_mirror_disks.empty()) {
+    vector<string> mirror_disks;
+    base::SplitString(FLAGS_mirror_disks, ',', &mirror_disks);
+    update_attempter->set_mirror_disks(mirror_disks);
+  }
+  update_attempter->set_use_http2(FLAGS_http2);
+  update_attempter->set_use_http3(FLAGS_http3);
+  chromeos_update_engine::BufferTuner* buffer_tuner =
+      chromeos_update_engine::LibcurlHttpFetcher::GetBufferTuner();
+  if (FLAGS_receive_buffer_kb > 0) {
+    buffer_tuner->set_fixed_receive_buffer_size(
+        static_cast<uint64_t>(FLAGS_receive_buffer_kb) * 1024);
+  }
+  if (FLAGS_read_buffer_kb > 0) {
+    buffer_tuner->set_fixed_read_buffer_size(
+        static_cast<size_t>(FLAGS_read_buffer_kb) * 1024);
+  }
+  chromeos_update_engine::DbusServiceThread dbus_service_thread;
+  chromeos_update_engine::SetupDbusService(service,
+                                           dbus_service_thread.context());
+  dbus_service_thread.Start();
+  startup_timer.EndPhase("D-Bus service");
+  LOG(INFO) << "Serving D-Bus requests "
+            << startup_timer.Elapsed().InMilliseconds()
+            << " ms after starting";
+
+  // What isn't needed to answer on the bus is started from the main loop,
+  // once the requests queued while starting have been served.
+  if (FLAGS_serve_peers) {
+    g_idle_add_full(G_PRIORITY_LOW,
+                    &chromeos_update_engine::StartPeerServer,
+                    update_attempter,
+                    NULL);
+  }
 
   // Schedule periodic update checks.
   chromeos_update_engine::UpdateCheckScheduler scheduler(update_attempter,
                                                          &real_system_state);
-  scheduler.Run();
+  g_idle_add_full(G_PRIORITY_LOW,
+                  &chromeos_update_engine::RunUpdateCheckScheduler,
+                  &scheduler,
+                  NULL);
+
+  // Check for updates as the releases come, if the server tells.
+  scoped_ptr<chromeos_update_engine::ReleaseWatcher> release_watcher;
+  if (!FLAGS_release_notify_url.empty()) {
+    chromeos_update_engine::LibcurlHttpFetcher* release_fetcher =
+        new chromeos_update_engine::LibcurlHttpFetcher(&real_system_state);
+    release_fetcher->set_check_certificate(
+        chromeos_update_engine::CertificateChecker::kUpdate);
+    release_watcher.reset(new chromeos_update_engine::ReleaseWatcher(
+        &scheduler, &real_system_state, release_fetcher,
+        FLAGS_release_notify_url));
+    g_idle_add_full(G_PRIORITY_LOW,
+                    &chromeos_update_engine::StartReleaseWatcher,
+                    release_watcher.get(),
+                    NULL);
+  }
+
+  // Sample the memory used by the update every few seconds.
+  chromeos_update_engine::MemoryTracker::StartSampling(5);
 
   // Update boot flags after 45 seconds.
   g_timeout_add_seconds(45,
@@ -209,9 +478,13 @@ int main(int argc, char** argv) {
 
   // Cleanup:
   g_main_loop_unref(loop);
+  update_engine_service_cancel_pending_calls(service);
+  dbus_service_thread.Stop();
   update_attempter->set_dbus_service(NULL);
   g_object_unref(G_OBJECT(service));
+  chromeos_update_engine::BspatchWorkerPool::Shutdown();
 
   LOG(INFO) << "CoreOS Update Engine terminating";
+  chromeos_update_engine::AsyncLogWriter::Shutdown();
   return 0;
 }
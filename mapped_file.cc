@@ -0,0 +1,130 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/mapped_file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+
+#include "update_engine/graph_types.h"
+#include "update_engine/utils.h"
+
+using std::min;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+MappedFile::MappedFile()
+    : mapping_(MAP_FAILED), mapping_size_(0), data_(NULL), size_(0) {}
+
+MappedFile::~MappedFile() {
+  Unmap();
+}
+
+bool MappedFile::Init(const string& path, off_t offset, off_t size) {
+  Unmap();
+  TEST_AND_RETURN_FALSE(offset >= 0);
+  int fd = HANDLE_EINTR(open(path.c_str(), O_RDONLY));
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  ScopedEintrSafeFdCloser fd_closer(&fd);
+  struct stat stbuf;
+  TEST_AND_RETURN_FALSE_ERRNO(fstat(fd, &stbuf) == 0);
+  if (offset >= stbuf.st_size)
+    return true;
+  off_t length = stbuf.st_size - offset;
+  if (size >= 0 && size < length)
+    length = size;
+  if (length == 0)
+    return true;
+
+  // mmap() wants a page aligned offset.
+  const off_t page_size = sysconf(_SC_PAGESIZE);
+  const off_t map_offset = offset - offset % page_size;
+  const size_t map_size = length + (offset - map_offset);
+  void* mapping = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, map_offset);
+  TEST_AND_RETURN_FALSE_ERRNO(mapping != MAP_FAILED);
+  mapping_ = mapping;
+  mapping_size_ = map_size;
+  data_ = static_cast<const char*>(mapping) + (offset - map_offset);
+  size_ = length;
+  return true;
+}
+
+bool MappedFile::InitFromExtents(const string& image_path,
+                                 const vector<Extent>& extents,
+                                 uint32_t block_size,
+                                 off_t file_size,
+                                 off_t offset,
+                                 off_t size) {
+  Unmap();
+  TEST_AND_RETURN_FALSE(offset >= 0);
+  if (offset >= file_size)
+    return true;
+  off_t length = file_size - offset;
+  if (size >= 0 && size < length)
+    length = size;
+  if (length == 0)
+    return true;
+
+  // Find the extent the range starts in.
+  size_t i = 0;
+  off_t extent_offset = offset;
+  while (i < extents.size() &&
+         extent_offset >= static_cast<off_t>(extents[i].num_blocks() *
+                                             block_size)) {
+    extent_offset -= extents[i].num_blocks() * block_size;
+    i++;
+  }
+  TEST_AND_RETURN_FALSE(i < extents.size());
+  if (extents[i].start_block() != kSparseHole &&
+      extent_offset + length <=
+      static_cast<off_t>(extents[i].num_blocks() * block_size)) {
+    return Init(image_path,
+                extents[i].start_block() * block_size + extent_offset,
+                length);
+  }
+
+  int fd = HANDLE_EINTR(open(image_path.c_str(), O_RDONLY));
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  ScopedEintrSafeFdCloser fd_closer(&fd);
+  buffer_.assign(length, 0);
+  for (off_t done = 0; done < length; i++, extent_offset = 0) {
+    TEST_AND_RETURN_FALSE(i < extents.size());
+    const off_t count = min(
+        length - done,
+        static_cast<off_t>(extents[i].num_blocks() * block_size) -
+        extent_offset);
+    if (extents[i].start_block() != kSparseHole) {
+      ssize_t bytes_read = 0;
+      TEST_AND_RETURN_FALSE(utils::PReadAll(
+          fd, &buffer_[done], count,
+          extents[i].start_block() * block_size + extent_offset,
+          &bytes_read));
+      TEST_AND_RETURN_FALSE(bytes_read == count);
+    }
+    done += count;
+  }
+  data_ = &buffer_[0];
+  size_ = length;
+  return true;
+}
+
+void MappedFile::Unmap() {
+  if (mapping_ != MAP_FAILED && munmap(mapping_, mapping_size_) != 0)
+    PLOG(ERROR) << "Unable to unmap " << mapping_size_ << " bytes";
+  mapping_ = MAP_FAILED;
+  mapping_size_ = 0;
+  vector<char>().swap(buffer_);
+  data_ = NULL;
+  size_ = 0;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,68 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_MAPPED_FILE_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_MAPPED_FILE_H__
+
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+#include <base/basictypes.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+// A MappedFile is a read-only memory mapping of a range of a file. The
+// generator reads its input through these rather than copying whole files
+// into the heap, so the data is shared with the page cache and can be
+// dropped by the kernel under memory pressure.
+
+namespace chromeos_update_engine {
+
+class MappedFile {
+ public:
+  MappedFile();
+  ~MappedFile();
+
+  // Maps the |size| bytes of the file at |path| starting at |offset|, or
+  // everything from |offset| on if |size| is negative. The range is clipped
+  // to the end of the file, so it may come out shorter or empty. Returns
+  // true on success.
+  bool Init(const std::string& path, off_t offset, off_t size);
+
+  // Like Init(), for the range of a |file_size|-byte file whose data lies
+  // in the |block_size|-byte |extents| of the image at |image_path|, with
+  // kSparseHole extents reading as zeros. A range within one extent is
+  // mapped from the image; others are read into memory.
+  bool InitFromExtents(const std::string& image_path,
+                       const std::vector<Extent>& extents,
+                       uint32_t block_size,
+                       off_t file_size,
+                       off_t offset,
+                       off_t size);
+
+  // The mapped bytes. data() is NULL if the range is empty.
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  void Unmap();
+
+  // The page aligned mapping the range lies in.
+  void* mapping_;
+  size_t mapping_size_;
+
+  // The data read by InitFromExtents(), if it wasn't mapped.
+  std::vector<char> buffer_;
+
+  const char* data_;
+  size_t size_;
+
+  DISALLOW_COPY_AND_ASSIGN(MappedFile);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_MAPPED_FILE_H__
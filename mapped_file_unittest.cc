@@ -0,0 +1,117 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/extent_ranges.h"
+#include "update_engine/graph_types.h"
+#include "update_engine/mapped_file.h"
+#include "update_engine/test_utils.h"
+#include "update_engine/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class MappedFileTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    ASSERT_TRUE(utils::MakeTempFile("/tmp/MappedFileTest.XXXXXX",
+                                    &path_,
+                                    NULL));
+  }
+
+  virtual void TearDown() {
+    unlink(path_.c_str());
+  }
+
+  string path_;
+};
+
+TEST_F(MappedFileTest, RangesTest) {
+  // Spans a few pages so that the ranges start at unaligned offsets.
+  vector<char> data(3 * 4096 + 100);
+  FillWithData(&data);
+  ASSERT_TRUE(WriteFileVector(path_, data));
+
+  MappedFile file;
+  EXPECT_TRUE(file.Init(path_, 0, -1));
+  ASSERT_EQ(data.size(), file.size());
+  EXPECT_EQ(0, memcmp(&data[0], file.data(), data.size()));
+
+  EXPECT_TRUE(file.Init(path_, 5000, 3000));
+  ASSERT_EQ(3000, file.size());
+  EXPECT_EQ(0, memcmp(&data[5000], file.data(), file.size()));
+
+  // Clipped to the end of the file.
+  EXPECT_TRUE(file.Init(path_, 4097, 100000));
+  ASSERT_EQ(data.size() - 4097, file.size());
+  EXPECT_EQ(0, memcmp(&data[4097], file.data(), file.size()));
+
+  EXPECT_TRUE(file.Init(path_, data.size(), -1));
+  EXPECT_EQ(0, file.size());
+  EXPECT_TRUE(file.data() == NULL);
+  EXPECT_TRUE(file.Init(path_, 10, 0));
+  EXPECT_EQ(0, file.size());
+}
+
+TEST_F(MappedFileTest, ExtentsTest) {
+  // A file of 2.5 blocks laid out in blocks 3, a hole and 1 of the image.
+  vector<char> image(4 * 4096);
+  FillWithData(&image);
+  ASSERT_TRUE(WriteFileVector(path_, image));
+  vector<Extent> extents;
+  extents.push_back(ExtentForRange(3, 1));
+  extents.push_back(ExtentForRange(kSparseHole, 1));
+  extents.push_back(ExtentForRange(1, 1));
+  const off_t kFileSize = 2 * 4096 + 2048;
+  vector<char> data(image.begin() + 3 * 4096, image.end());
+  data.resize(2 * 4096, 0);
+  data.insert(data.end(), image.begin() + 4096, image.begin() + 4096 + 2048);
+
+  MappedFile file;
+  EXPECT_TRUE(file.InitFromExtents(path_, extents, 4096, kFileSize, 0, -1));
+  ASSERT_EQ(data.size(), file.size());
+  EXPECT_EQ(0, memcmp(&data[0], file.data(), data.size()));
+
+  // Within one extent, which is mapped, and across the hole.
+  EXPECT_TRUE(file.InitFromExtents(path_, extents, 4096, kFileSize, 100,
+                                   1000));
+  ASSERT_EQ(1000, file.size());
+  EXPECT_EQ(0, memcmp(&data[100], file.data(), file.size()));
+  EXPECT_TRUE(file.InitFromExtents(path_, extents, 4096, kFileSize, 4000,
+                                   5000));
+  ASSERT_EQ(5000, file.size());
+  EXPECT_EQ(0, memcmp(&data[4000], file.data(), file.size()));
+
+  // Clipped to the end of the file.
+  EXPECT_TRUE(file.InitFromExtents(path_, extents, 4096, kFileSize, 8000,
+                                   -1));
+  ASSERT_EQ(kFileSize - 8000, file.size());
+  EXPECT_EQ(0, memcmp(&data[8000], file.data(), file.size()));
+  EXPECT_TRUE(file.InitFromExtents(path_, extents, 4096, kFileSize,
+                                   kFileSize, -1));
+  EXPECT_EQ(0, file.size());
+
+  // Extents too short for the file.
+  extents.pop_back();
+  EXPECT_FALSE(file.InitFromExtents(path_, extents, 4096, kFileSize, 0, -1));
+}
+
+TEST_F(MappedFileTest, EmptyFileTest) {
+  MappedFile file;
+  EXPECT_TRUE(file.Init(path_, 0, -1));
+  EXPECT_EQ(0, file.size());
+  EXPECT_TRUE(file.data() == NULL);
+  EXPECT_FALSE(file.Init("/this/file/does/not/exist", 0, -1));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,51 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/memory_budget.h"
+
+#include <algorithm>
+
+#include <base/logging.h>
+
+namespace chromeos_update_engine {
+
+MemoryBudget::MemoryBudget(uint64_t bytes)
+    : bytes_(bytes),
+      reserved_(0),
+      peak_reserved_(0) {
+  g_mutex_init(&mutex_);
+  g_cond_init(&released_cond_);
+}
+
+MemoryBudget::~MemoryBudget() {
+  DCHECK_EQ(reserved_, static_cast<uint64_t>(0));
+  g_cond_clear(&released_cond_);
+  g_mutex_clear(&mutex_);
+}
+
+void MemoryBudget::Reserve(uint64_t bytes) {
+  g_mutex_lock(&mutex_);
+  while (reserved_ > 0 && reserved_ + bytes > bytes_)
+    g_cond_wait(&released_cond_, &mutex_);
+  reserved_ += bytes;
+  peak_reserved_ = std::max(peak_reserved_, reserved_);
+  g_mutex_unlock(&mutex_);
+}
+
+void MemoryBudget::Release(uint64_t bytes) {
+  g_mutex_lock(&mutex_);
+  CHECK_LE(bytes, reserved_);
+  reserved_ -= bytes;
+  g_cond_broadcast(&released_cond_);
+  g_mutex_unlock(&mutex_);
+}
+
+uint64_t MemoryBudget::peak_reserved() {
+  g_mutex_lock(&mutex_);
+  const uint64_t peak = peak_reserved_;
+  g_mutex_unlock(&mutex_);
+  return peak;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,73 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_MEMORY_BUDGET_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_MEMORY_BUDGET_H__
+
+#include <glib.h>
+
+#include <base/basictypes.h>
+
+namespace chromeos_update_engine {
+
+// Bounds the memory that tasks running concurrently, e.g., on a ThreadPool,
+// use together. Each reserves the bytes it expects to need before it starts
+// and releases them once done, waiting while the reservations of the others
+// leave too little of the budget. A reservation larger than the whole budget
+// waits until nothing else is reserved and then goes ahead alone, so that
+// no task waits forever.
+class MemoryBudget {
+ public:
+  explicit MemoryBudget(uint64_t bytes);
+  ~MemoryBudget();
+
+  // Blocks until |bytes| can be reserved and reserves them.
+  void Reserve(uint64_t bytes);
+
+  // Releases |bytes| reserved with Reserve().
+  void Release(uint64_t bytes);
+
+  uint64_t bytes() const { return bytes_; }
+
+  // The most bytes reserved at once so far.
+  uint64_t peak_reserved();
+
+ private:
+  const uint64_t bytes_;
+
+  GMutex mutex_;
+  // Signalled when bytes are released.
+  GCond released_cond_;
+  uint64_t reserved_;
+  uint64_t peak_reserved_;
+
+  DISALLOW_COPY_AND_ASSIGN(MemoryBudget);
+};
+
+// Reserves bytes of a MemoryBudget for the lifetime of the object. A NULL
+// budget reserves nothing.
+class ScopedMemoryReservation {
+ public:
+  ScopedMemoryReservation(MemoryBudget* budget, uint64_t bytes)
+      : budget_(budget),
+        bytes_(bytes) {
+    if (budget_)
+      budget_->Reserve(bytes_);
+  }
+
+  ~ScopedMemoryReservation() {
+    if (budget_)
+      budget_->Release(bytes_);
+  }
+
+ private:
+  MemoryBudget* budget_;
+  const uint64_t bytes_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedMemoryReservation);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_MEMORY_BUDGET_H__
@@ -0,0 +1,106 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <algorithm>
+#include <tr1/memory>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/memory_budget.h"
+#include "update_engine/thread_pool.h"
+
+using std::max;
+using std::tr1::shared_ptr;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The bytes the ReserveTasks running hold, and the most they held at once.
+struct Usage {
+  Usage() : bytes(0), peak_bytes(0) {
+    g_mutex_init(&mutex);
+  }
+  ~Usage() {
+    g_mutex_clear(&mutex);
+  }
+  GMutex mutex;
+  uint64_t bytes;
+  uint64_t peak_bytes;
+};
+
+// Holds |bytes| of |budget| for a few milliseconds.
+class ReserveTask : public ThreadPoolTask {
+ public:
+  ReserveTask(MemoryBudget* budget, uint64_t bytes, Usage* usage)
+      : budget_(budget), bytes_(bytes), usage_(usage) {}
+  virtual bool Run() {
+    ScopedMemoryReservation reservation(budget_, bytes_);
+    g_mutex_lock(&usage_->mutex);
+    usage_->bytes += bytes_;
+    usage_->peak_bytes = max(usage_->peak_bytes, usage_->bytes);
+    g_mutex_unlock(&usage_->mutex);
+    g_usleep(2000);
+    g_mutex_lock(&usage_->mutex);
+    usage_->bytes -= bytes_;
+    g_mutex_unlock(&usage_->mutex);
+    return true;
+  }
+ private:
+  MemoryBudget* budget_;
+  uint64_t bytes_;
+  Usage* usage_;
+};
+
+// Runs |sizes.size()| ReserveTasks of |sizes| bytes on 8 threads and
+// returns the most bytes they held at once.
+uint64_t RunTasks(MemoryBudget* budget, const vector<uint64_t>& sizes) {
+  Usage usage;
+  {
+    ThreadPool pool(8);
+    EXPECT_TRUE(pool.Init());
+    vector<shared_ptr<ReserveTask> > tasks;
+    for (size_t i = 0; i < sizes.size(); i++) {
+      shared_ptr<ReserveTask> task(new ReserveTask(budget, sizes[i], &usage));
+      tasks.push_back(task);
+      pool.Submit(task.get());
+    }
+    for (size_t i = 0; i < tasks.size(); i++)
+      EXPECT_TRUE(pool.Wait(tasks[i].get()));
+  }
+  EXPECT_EQ(0U, usage.bytes);
+  return usage.peak_bytes;
+}
+
+}  // namespace {}
+
+TEST(MemoryBudgetTest, BoundsConcurrentUseTest) {
+  MemoryBudget budget(100);
+  EXPECT_EQ(100U, budget.bytes());
+  vector<uint64_t> sizes;
+  for (int i = 0; i < 40; i++)
+    sizes.push_back(10 + i % 4 * 10);
+  const uint64_t peak = RunTasks(&budget, sizes);
+  EXPECT_GT(peak, 40U);
+  EXPECT_LE(peak, budget.peak_reserved());
+  EXPECT_LE(budget.peak_reserved(), 100U);
+}
+
+TEST(MemoryBudgetTest, OversizedReservationRunsAloneTest) {
+  MemoryBudget budget(100);
+  vector<uint64_t> sizes(8, 10);
+  sizes.push_back(250);
+  sizes.insert(sizes.end(), 8, 10);
+  EXPECT_EQ(250U, RunTasks(&budget, sizes));
+  EXPECT_EQ(250U, budget.peak_reserved());
+}
+
+TEST(MemoryBudgetTest, NoBudgetTest) {
+  vector<uint64_t> sizes(8, 1 << 20);
+  EXPECT_GT(RunTasks(NULL, sizes), 0U);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,141 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/memory_tracker.h"
+
+#include <stdio.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+#include <base/string_number_conversions.h>
+
+using std::map;
+using std::max;
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The stage no Action runs in.
+const char kIdleStage[] = "Idle";
+
+// A statically allocated GMutex needs no initialization.
+GMutex mutex;
+string action;
+string operation;
+map<string, uint64_t> stage_peak_kb;
+map<string, uint64_t> buffer_peak_bytes;
+
+// Returns the resident size of the daemon in KiB, or 0 if it can't be read.
+uint64_t ResidentKb() {
+  FILE* file = fopen("/proc/self/statm", "r");
+  if (!file)
+    return 0;
+  unsigned long size = 0, resident = 0;  // NOLINT(runtime/int)
+  const bool read = fscanf(file, "%lu %lu", &size, &resident) == 2;
+  fclose(file);
+  return read ? resident * (getpagesize() / 1024) : 0;
+}
+
+// Returns the peak resident size of |who| in KiB.
+uint64_t PeakResidentKb(int who) {
+  struct rusage usage;
+  if (getrusage(who, &usage) != 0)
+    return 0;
+  return usage.ru_maxrss;
+}
+
+// Returns the name of the stage running. Must be called with |mutex| held.
+string Stage() {
+  if (action.empty())
+    return kIdleStage;
+  return operation.empty() ? action : action + "." + operation;
+}
+
+}  // namespace {}
+
+void MemoryTracker::SetAction(const string& new_action) {
+  // The memory used up to now is counted for the Action that ran.
+  Sample();
+  g_mutex_lock(&mutex);
+  action = new_action;
+  operation.clear();
+  g_mutex_unlock(&mutex);
+}
+
+void MemoryTracker::SetOperation(const string& new_operation) {
+  g_mutex_lock(&mutex);
+  operation = new_operation;
+  g_mutex_unlock(&mutex);
+}
+
+void MemoryTracker::SetBufferSize(const string& name, uint64_t bytes) {
+  g_mutex_lock(&mutex);
+  uint64_t* peak_bytes = &buffer_peak_bytes[name];
+  *peak_bytes = max(*peak_bytes, bytes);
+  g_mutex_unlock(&mutex);
+}
+
+void MemoryTracker::Sample() {
+  const uint64_t resident_kb = ResidentKb();
+  if (resident_kb == 0)
+    return;
+  g_mutex_lock(&mutex);
+  uint64_t* peak_kb = &stage_peak_kb[Stage()];
+  *peak_kb = max(*peak_kb, resident_kb);
+  g_mutex_unlock(&mutex);
+}
+
+void MemoryTracker::StartSampling(int seconds) {
+  g_timeout_add_seconds(seconds, &MemoryTracker::StaticSample, NULL);
+}
+
+gboolean MemoryTracker::StaticSample(gpointer data) {
+  Sample();
+  return TRUE;  // Keeps sampling.
+}
+
+void MemoryTracker::AddCounters(map<string, string>* counters) {
+  (*counters)["memory_peak_kb"] =
+      base::Uint64ToString(PeakResidentKb(RUSAGE_SELF));
+  (*counters)["memory_children_peak_kb"] =
+      base::Uint64ToString(PeakResidentKb(RUSAGE_CHILDREN));
+  g_mutex_lock(&mutex);
+  for (map<string, uint64_t>::const_iterator it = stage_peak_kb.begin();
+       it != stage_peak_kb.end(); ++it) {
+    (*counters)["memory_peak_kb_in_" + it->first] =
+        base::Uint64ToString(it->second);
+  }
+  for (map<string, uint64_t>::const_iterator it = buffer_peak_bytes.begin();
+       it != buffer_peak_bytes.end(); ++it) {
+    (*counters)["memory_peak_kb_of_" + it->first] =
+        base::Uint64ToString((it->second + 1023) / 1024);
+  }
+  g_mutex_unlock(&mutex);
+}
+
+void MemoryTracker::LogHighWaterMarks() {
+  map<string, string> counters;
+  AddCounters(&counters);
+  for (map<string, string>::const_iterator it = counters.begin();
+       it != counters.end(); ++it) {
+    LOG(INFO) << "Memory high-water mark " << it->first << ": "
+              << it->second << " KiB";
+  }
+}
+
+void MemoryTracker::Reset() {
+  g_mutex_lock(&mutex);
+  action.clear();
+  operation.clear();
+  stage_peak_kb.clear();
+  buffer_peak_bytes.clear();
+  g_mutex_unlock(&mutex);
+}
+
+}  // namespace chromeos_update_engine
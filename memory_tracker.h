@@ -0,0 +1,63 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_MEMORY_TRACKER_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_MEMORY_TRACKER_H__
+
+#include <map>
+#include <string>
+
+#include <base/basictypes.h>
+#include <glib.h>
+
+// Keeps the high-water marks of the memory used by the update, so that the
+// stage driving the peak resident size can be told: the resident size of
+// the daemon is sampled periodically and at each Action boundary, and
+// counted for the stage running then, i.e., the Action and, while the
+// payload is applied, the type of install operation. The sizes of the major
+// buffers, e.g., the payload buffer and the copier buffers, are tracked as
+// they change, since their peaks may fall between samples. The peak of the
+// largest child process, e.g., a bspatch worker, is taken from the kernel.
+// Methods may be called from any thread.
+
+namespace chromeos_update_engine {
+
+class MemoryTracker {
+ public:
+  // Sets the type of the Action running, or "" once none is.
+  static void SetAction(const std::string& action);
+
+  // Sets the type of the install operation being applied, or "" between
+  // operations. With operations applied concurrently, the last one started
+  // is the one counted.
+  static void SetOperation(const std::string& operation);
+
+  // Records that the buffer |name| holds |bytes| bytes now.
+  static void SetBufferSize(const std::string& name, uint64_t bytes);
+
+  // Samples the resident size of the daemon for the current stage.
+  static void Sample();
+
+  // Samples every |seconds| seconds from the main loop.
+  static void StartSampling(int seconds);
+
+  // Adds the high-water marks to |counters|, by name. Sizes are in KiB.
+  static void AddCounters(std::map<std::string, std::string>* counters);
+
+  // Logs the high-water marks.
+  static void LogHighWaterMarks();
+
+  // Forgets the high-water marks and the current stage.
+  static void Reset();
+
+ private:
+  // The main loop callback of StartSampling().
+  static gboolean StaticSample(gpointer data);
+
+  DISALLOW_IMPLICIT_CONSTRUCTORS(MemoryTracker);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_MEMORY_TRACKER_H__
@@ -0,0 +1,61 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/memory_tracker.h"
+
+using std::map;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class MemoryTrackerTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    MemoryTracker::Reset();
+  }
+
+  virtual void TearDown() {
+    MemoryTracker::Reset();
+  }
+};
+
+TEST_F(MemoryTrackerTest, BufferPeakTest) {
+  MemoryTracker::SetBufferSize("payload_buffer", 4096);
+  MemoryTracker::SetBufferSize("payload_buffer", 10 * 1024 + 1);
+  MemoryTracker::SetBufferSize("payload_buffer", 0);
+  map<string, string> counters;
+  MemoryTracker::AddCounters(&counters);
+  EXPECT_EQ("11", counters["memory_peak_kb_of_payload_buffer"]);
+  EXPECT_EQ(1, counters.count("memory_peak_kb"));
+  EXPECT_EQ(1, counters.count("memory_children_peak_kb"));
+}
+
+TEST_F(MemoryTrackerTest, StageTest) {
+  MemoryTracker::Sample();
+  MemoryTracker::SetAction("DownloadAction");
+  MemoryTracker::SetOperation("BSDIFF");
+  {
+    // Touches some memory while the operation is applied.
+    vector<char> data(4 * 1024 * 1024, 1);
+    MemoryTracker::Sample();
+  }
+  MemoryTracker::SetOperation("");
+  MemoryTracker::SetAction("");
+
+  map<string, string> counters;
+  MemoryTracker::AddCounters(&counters);
+  EXPECT_EQ(1, counters.count("memory_peak_kb_in_Idle"));
+  EXPECT_EQ(1, counters.count("memory_peak_kb_in_DownloadAction"));
+  EXPECT_EQ(1, counters.count("memory_peak_kb_in_DownloadAction.BSDIFF"));
+  EXPECT_NE("0", counters["memory_peak_kb_in_DownloadAction.BSDIFF"]);
+}
+
+}  // namespace chromeos_update_engine
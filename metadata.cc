@@ -4,6 +4,7 @@
 
 #include <algorithm>
 #include <string>
+#include <tr1/memory>
 #include <vector>
 
 #include <base/string_util.h>
@@ -12,14 +13,18 @@
 #include <ext2fs/ext2_io.h>
 #include <ext2fs/ext2fs.h>
 
-#include "update_engine/bzip.h"
 #include "update_engine/delta_diff_generator.h"
 #include "update_engine/extent_ranges.h"
 #include "update_engine/graph_utils.h"
 #include "update_engine/metadata.h"
+#include "update_engine/stream_diff.h"
+#include "update_engine/thread_pool.h"
 #include "update_engine/utils.h"
 
+using std::max;
 using std::min;
+using std::pair;
+using std::tr1::shared_ptr;
 using std::string;
 using std::vector;
 
@@ -28,7 +33,9 @@ namespace chromeos_update_engine {
 namespace {
 const size_t kBlockSize = 4096;
 
-typedef DeltaDiffGenerator::Block Block;
+// The largest chunk of a block group's metadata that is diffed at once.
+const __u32 kMaxMetadataChunkBlocks = 128;
+
 
 // Read data from the specified extents.
 bool ReadExtentsData(const ext2_filsys fs,
@@ -45,10 +52,10 @@ bool ReadExtentsData(const ext2_filsys fs,
 
   // Read in the data blocks
   const size_t kMaxReadBlocks = 256;
-  vector<Block>::size_type blocks_copied_count = 0;
+  uint64_t blocks_copied_count = 0;
   for (vector<Extent>::const_iterator it = extents.begin();
        it != extents.end(); it++) {
-    vector<Block>::size_type blocks_read = 0;
+    uint64_t blocks_read = 0;
     while (blocks_read < it->num_blocks()) {
       const int copy_block_cnt =
           min(kMaxReadBlocks,
@@ -105,109 +112,233 @@ bool ComputeMetadataBsdiff(const vector<char>& old_metadata,
   return true;
 }
 
-// Add the specified metadata extents to the graph and blocks vector.
-bool AddMetadataExtents(Graph* graph,
-                        vector<Block>* blocks,
-                        const ext2_filsys fs_old,
-                        const ext2_filsys fs_new,
-                        const string& metadata_name,
-                        const vector<Extent>& extents,
-                        int data_fd,
-                        off_t* data_file_size) {
-  vector<char> data;  // Data blob that will be written to delta file.
-  DeltaArchiveManifest_InstallOperation op;
-
-  {
-    // Read in the metadata blocks from the old and new image.
-    vector<char> old_data;
-    TEST_AND_RETURN_FALSE(ReadExtentsData(fs_old, extents, &old_data));
-
-    vector<char> new_data;
-    TEST_AND_RETURN_FALSE(ReadExtentsData(fs_new, extents, &new_data));
-
-    // Determine the best way to compress this.
-    vector<char> new_data_bz;
-    TEST_AND_RETURN_FALSE(BzipCompress(new_data, &new_data_bz));
-    CHECK(!new_data_bz.empty());
-
-    size_t current_best_size = 0;
-    if (new_data.size() <= new_data_bz.size()) {
-      op.set_type(DeltaArchiveManifest_InstallOperation_Type_REPLACE);
-      current_best_size = new_data.size();
-      data = new_data;
-    } else {
-      op.set_type(DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ);
-      current_best_size = new_data_bz.size();
-      data = new_data_bz;
-    }
+// Encodes a chunk of metadata on a ThreadPool worker. The chunk is read on
+// the calling thread, as libext2fs isn't thread-safe.
+class MetadataTask : public ThreadPoolTask {
+ public:
+  MetadataTask(const string& metadata_name, const vector<Extent>& extents)
+      : metadata_name_(metadata_name),
+        extents_(extents),
+        fixed_layout_(false),
+        inode_table_offset_(0),
+        inode_size_(0) {}
+
+  // Tells that the metadata keeps its structures in place: the superblock,
+  // group descriptors and bitmaps before |inode_table_offset| bytes, and
+  // the inode table of |inode_size|-byte inodes from there on. Such
+  // metadata is diffed in place, as a STREAM_DIFF of the changed inodes
+  // and bitmap bytes, rather than with bsdiff.
+  void SetFixedLayout(size_t inode_table_offset, size_t inode_size) {
+    fixed_layout_ = true;
+    inode_table_offset_ = inode_table_offset;
+    inode_size_ = inode_size;
+  }
 
-    if (old_data == new_data) {
+  // Reads the metadata blocks from the old and new image.
+  bool ReadData(const ext2_filsys fs_old, const ext2_filsys fs_new) {
+    TEST_AND_RETURN_FALSE(ReadExtentsData(fs_old, extents_, &old_data_));
+    TEST_AND_RETURN_FALSE(ReadExtentsData(fs_new, extents_, &new_data_));
+    return true;
+  }
+
+  virtual bool Run() {
+    if (old_data_ == new_data_) {
       // No change in data.
-      op.set_type(DeltaArchiveManifest_InstallOperation_Type_MOVE);
-      current_best_size = 0;
-      data.clear();
+      op_.set_type(DeltaArchiveManifest_InstallOperation_Type_MOVE);
     } else {
-      // Try bsdiff of old to new data
-      vector<char> bsdiff_delta;
-      TEST_AND_RETURN_FALSE(ComputeMetadataBsdiff(old_data,
-                                                  new_data,
-                                                  &bsdiff_delta));
-      CHECK_GT(bsdiff_delta.size(), static_cast<vector<char>::size_type>(0));
-
-      if (bsdiff_delta.size() < current_best_size) {
-        op.set_type(DeltaArchiveManifest_InstallOperation_Type_BSDIFF);
-        current_best_size = bsdiff_delta.size();
-        data = bsdiff_delta;
+      // Determine the best way to compress this.
+      DeltaArchiveManifest_InstallOperation_Type type;
+      TEST_AND_RETURN_FALSE(
+          DeltaDiffGenerator::CompressReplaceData(new_data_, &data_, &type));
+      op_.set_type(type);
+
+      // Try a diff of old to new data: in place if the structures stay
+      // where they are, which takes no search, or else with bsdiff.
+      DeltaArchiveManifest_InstallOperation_Type delta_type =
+          DeltaArchiveManifest_InstallOperation_Type_BSDIFF;
+      vector<char> delta;
+      if (fixed_layout_) {
+        delta_type = DeltaArchiveManifest_InstallOperation_Type_STREAM_DIFF;
+        TEST_AND_RETURN_FALSE(ComputeMetadataInPlaceDiff(&delta));
+      } else {
+        TEST_AND_RETURN_FALSE(ComputeMetadataBsdiff(old_data_,
+                                                    new_data_,
+                                                    &delta));
+      }
+      CHECK_GT(delta.size(), static_cast<vector<char>::size_type>(0));
+
+      if (DeltaDiffGenerator::IsCheaperOperation(
+              delta_type,
+              delta.size(),
+              type,
+              data_.size(),
+              old_data_.size(),
+              new_data_.size())) {
+        op_.set_type(delta_type);
+        data_.swap(delta);
       }
     }
 
-    CHECK_EQ(data.size(), current_best_size);
-
     // Set the source and dest extents to be the same since the filesystem
     // structures are identical
-    if (op.type() == DeltaArchiveManifest_InstallOperation_Type_MOVE ||
-        op.type() == DeltaArchiveManifest_InstallOperation_Type_BSDIFF) {
-      DeltaDiffGenerator::StoreExtents(extents, op.mutable_src_extents());
-      op.set_src_length(old_data.size());
+    if (op_.type() == DeltaArchiveManifest_InstallOperation_Type_MOVE ||
+        op_.type() == DeltaArchiveManifest_InstallOperation_Type_BSDIFF ||
+        op_.type() == DeltaArchiveManifest_InstallOperation_Type_STREAM_DIFF) {
+      DeltaDiffGenerator::StoreExtents(extents_, op_.mutable_src_extents());
+      op_.set_src_length(old_data_.size());
     }
 
-    DeltaDiffGenerator::StoreExtents(extents, op.mutable_dst_extents());
-    op.set_dst_length(new_data.size());
+    DeltaDiffGenerator::StoreExtents(extents_, op_.mutable_dst_extents());
+    op_.set_dst_length(new_data_.size());
+
+    vector<char>().swap(old_data_);
+    vector<char>().swap(new_data_);
+    return true;
+  }
+
+  const string& metadata_name() const { return metadata_name_; }
+  const vector<char>& data() const { return data_; }
+  DeltaArchiveManifest_InstallOperation* op() { return &op_; }
+
+ private:
+  // Stores in |delta| the STREAM_DIFF of the metadata of a fixed layout:
+  // each changed inode is sent from its first to its last changed byte, and
+  // the rest as runs of changed bytes.
+  bool ComputeMetadataInPlaceDiff(vector<char>* delta) const {
+    const size_t size = new_data_.size();
+    const size_t inode_table_offset = min(inode_table_offset_, size);
+    vector<pair<size_t, size_t> > changed;
+    AppendChangedRanges(&old_data_[0], &new_data_[0], 0, inode_table_offset,
+                        1, &changed);
+    AppendChangedRanges(&old_data_[0], &new_data_[0], inode_table_offset,
+                        size - inode_table_offset, inode_size_, &changed);
+    return StreamDiffInPlace(&new_data_[0], size, changed, delta);
+  }
+
+  const string metadata_name_;
+  const vector<Extent> extents_;
+  bool fixed_layout_;
+  size_t inode_table_offset_;
+  size_t inode_size_;
+  vector<char> old_data_;
+  vector<char> new_data_;
+  // Data blob that will be written to delta file.
+  vector<char> data_;
+  DeltaArchiveManifest_InstallOperation op_;
+
+  DISALLOW_COPY_AND_ASSIGN(MetadataTask);
+};
+
+// Encodes metadata extents concurrently on a ThreadPool and adds them to the
+// graph and blocks vector in the order they were queued, so that the output
+// doesn't depend on the number of threads.
+class MetadataDiffer {
+ public:
+  MetadataDiffer(Graph* graph,
+                 BlockOwners* blocks,
+                 const ext2_filsys fs_old,
+                 const ext2_filsys fs_new,
+                 int data_fd,
+                 off_t* data_file_size,
+                 bool stream_diff,
+                 ThreadPool* pool)
+      : graph_(graph),
+        blocks_(blocks),
+        fs_old_(fs_old),
+        fs_new_(fs_new),
+        data_fd_(data_fd),
+        data_file_size_(data_file_size),
+        stream_diff_(stream_diff),
+        // Bounds the metadata held in memory while waiting to be added.
+        runner_(pool, 4 * pool->num_threads()) {}
+
+  ext2_filsys fs_old() const { return fs_old_; }
+  ext2_filsys fs_new() const { return fs_new_; }
+
+  // Queues the specified metadata extents to be encoded.
+  bool Add(const string& metadata_name, const vector<Extent>& extents) {
+    shared_ptr<MetadataTask> task(new MetadataTask(metadata_name, extents));
+    return Submit(task);
   }
 
-  // Write data to output file
-  if (op.type() != DeltaArchiveManifest_InstallOperation_Type_MOVE) {
-    op.set_data_offset(*data_file_size);
-    op.set_data_length(data.size());
+  // Queues the specified metadata extents, which keep their structures in
+  // place, to be encoded; see MetadataTask::SetFixedLayout(). They're only
+  // diffed in place if STREAM_DIFF operations may be generated.
+  bool AddFixedLayout(const string& metadata_name,
+                      const vector<Extent>& extents,
+                      size_t inode_table_offset,
+                      size_t inode_size) {
+    shared_ptr<MetadataTask> task(new MetadataTask(metadata_name, extents));
+    if (stream_diff_)
+      task->SetFixedLayout(inode_table_offset, inode_size);
+    return Submit(task);
   }
 
-  TEST_AND_RETURN_FALSE(utils::WriteAll(data_fd, &data[0], data.size()));
-  *data_file_size += data.size();
+  // Adds all the queued metadata.
+  bool Finish() {
+    while (!runner_.empty())
+      TEST_AND_RETURN_FALSE(AddOldestOperation());
+    return true;
+  }
 
-  // Now, insert into graph and blocks vector
-  graph->resize(graph->size() + 1);
-  Vertex::Index vertex = graph->size() - 1;
-  (*graph)[vertex].op = op;
-  CHECK((*graph)[vertex].op.has_type());
-  (*graph)[vertex].file_name = metadata_name;
+ private:
+  // Reads the data of |task| and queues it.
+  bool Submit(const shared_ptr<MetadataTask>& task) {
+    while (runner_.full())
+      TEST_AND_RETURN_FALSE(AddOldestOperation());
+    TEST_AND_RETURN_FALSE(task->ReadData(fs_old_, fs_new_));
+    runner_.Submit(task);
+    return true;
+  }
 
-  TEST_AND_RETURN_FALSE(DeltaDiffGenerator::AddInstallOpToBlocksVector(
-      (*graph)[vertex].op,
-      *graph,
-      vertex,
-      blocks));
+  // Waits for the oldest queued metadata to be encoded and adds it.
+  bool AddOldestOperation() {
+    shared_ptr<MetadataTask> task;
+    TEST_AND_RETURN_FALSE(runner_.WaitOldest(&task));
+    DeltaArchiveManifest_InstallOperation* op = task->op();
+    const vector<char>& data = task->data();
+
+    // Write data to output file
+    if (op->type() != DeltaArchiveManifest_InstallOperation_Type_MOVE &&
+        op->type() != DeltaArchiveManifest_InstallOperation_Type_ZERO) {
+      op->set_data_offset(*data_file_size_);
+      op->set_data_length(data.size());
+    }
 
-  return true;
-}
+    TEST_AND_RETURN_FALSE(utils::WriteAll(data_fd_, &data[0], data.size()));
+    *data_file_size_ += data.size();
+
+    // Now, insert into graph and blocks vector
+    graph_->resize(graph_->size() + 1);
+    Vertex::Index vertex = graph_->size() - 1;
+    (*graph_)[vertex].op = *op;
+    CHECK((*graph_)[vertex].op.has_type());
+    (*graph_)[vertex].file_name = task->metadata_name();
+
+    TEST_AND_RETURN_FALSE(DeltaDiffGenerator::AddInstallOpToBlocksVector(
+        (*graph_)[vertex].op,
+        *graph_,
+        vertex,
+        blocks_));
+    return true;
+  }
+
+  Graph* graph_;
+  BlockOwners* blocks_;
+  const ext2_filsys fs_old_;
+  const ext2_filsys fs_new_;
+  const int data_fd_;
+  off_t* data_file_size_;
+  const bool stream_diff_;
+  OrderedTaskRunner<MetadataTask> runner_;
+
+  DISALLOW_COPY_AND_ASSIGN(MetadataDiffer);
+};
 
 // Reads the file system metadata extents.
-bool ReadFilesystemMetadata(Graph* graph,
-                            vector<Block>* blocks,
-                            const ext2_filsys fs_old,
-                            const ext2_filsys fs_new,
-                            int data_fd,
-                            off_t* data_file_size) {
+bool ReadFilesystemMetadata(MetadataDiffer* differ) {
   LOG(INFO) << "Processing <rootfs-metadata>";
+  const ext2_filsys fs_old = differ->fs_old();
 
   // Read all the extents that belong to the main file system metadata.
   // The metadata blocks are at the start of each block group and goes
@@ -221,9 +352,12 @@ bool ReadFilesystemMetadata(Graph* graph,
                                  (bg * fs_old->super->s_blocks_per_group);
     __u32 bg_start_block = bg * fs_old->super->s_blocks_per_group;
 
-    // Due to bsdiff slowness, we're going to break each block group down
-    // into metadata chunks and feed them to bsdiff.
-    __u32 num_chunks = 10;
+    // The bsdiff time grows faster than the size of its input, so break
+    // each block group down into chunks of about the same size, no larger
+    // than kMaxMetadataChunkBlocks, and feed them to bsdiff.
+    __u32 num_chunks = max<__u32>(
+        1, (num_metadata_blocks + kMaxMetadataChunkBlocks - 1) /
+        kMaxMetadataChunkBlocks);
     __u32 blocks_per_chunk = num_metadata_blocks / num_chunks;
     __u32 curr_block = bg_start_block;
     for (__u32 chunk = 0; chunk < num_chunks; chunk++) {
@@ -244,14 +378,15 @@ bool ReadFilesystemMetadata(Graph* graph,
 
       LOG(INFO) << "Processing " << metadata_name;
 
-      TEST_AND_RETURN_FALSE(AddMetadataExtents(graph,
-                                               blocks,
-                                               fs_old,
-                                               fs_new,
-                                               metadata_name,
-                                               extents,
-                                               data_fd,
-                                               data_file_size));
+      // The inode table ends the metadata of the block group.
+      const __u32 inode_table_blocks =
+          group_desc->bg_inode_table > curr_block ?
+          group_desc->bg_inode_table - curr_block : 0;
+      TEST_AND_RETURN_FALSE(differ->AddFixedLayout(
+          metadata_name,
+          extents,
+          static_cast<size_t>(inode_table_blocks) * kBlockSize,
+          EXT2_INODE_SIZE(fs_old->super)));
 
       curr_block += blocks_per_chunk;
     }
@@ -288,12 +423,9 @@ int ProcessInodeMetadataBlocks(ext2_filsys fs,
 }
 
 // Read inode metadata blocks.
-bool ReadInodeMetadata(Graph* graph,
-                       vector<Block>* blocks,
-                       const ext2_filsys fs_old,
-                       const ext2_filsys fs_new,
-                       int data_fd,
-                       off_t* data_file_size) {
+bool ReadInodeMetadata(MetadataDiffer* differ) {
+  const ext2_filsys fs_old = differ->fs_old();
+  const ext2_filsys fs_new = differ->fs_new();
   TEST_AND_RETURN_FALSE_ERRCODE(ext2fs_read_inode_bitmap(fs_old));
   TEST_AND_RETURN_FALSE_ERRCODE(ext2fs_read_inode_bitmap(fs_new));
 
@@ -409,14 +541,10 @@ bool ReadInodeMetadata(Graph* graph,
     // We have identical inode metadata blocks, we can now add them to
     // our graph and blocks vector
     string metadata_name = StringPrintf("<rootfs-inode-%d-metadata>", ino);
-    TEST_AND_RETURN_FALSE(AddMetadataExtents(graph,
-                                             blocks,
-                                             fs_old,
-                                             fs_new,
-                                             metadata_name,
-                                             old_extents,
-                                             data_fd,
-                                             data_file_size));
+    if (!differ->Add(metadata_name, old_extents)) {
+      ext2fs_close_inode_scan(iscan);
+      return false;
+    }
   }
 
   ext2fs_close_inode_scan(iscan);
@@ -430,16 +558,20 @@ bool ReadInodeMetadata(Graph* graph,
 // the smallest way to encode the metadata for the diff.
 // If there's no change in the metadata, it creates a MOVE
 // operation. If there is a change, the smallest of REPLACE, REPLACE_BZ,
-// or BSDIFF wins. It writes the diff to data_fd and updates data_file_size
-// accordingly. It also adds the required operation to the graph and adds the
-// metadata extents to blocks.
+// REPLACE_XZ or BSDIFF wins, or STREAM_DIFF for the block group metadata
+// if |stream_diff| is set. It writes the diff to data_fd and updates
+// data_file_size accordingly. It also adds the required operation to the
+// graph and adds the metadata extents to blocks. The metadata is encoded
+// concurrently on |pool|.
 // Returns true on success.
 bool Metadata::DeltaReadMetadata(Graph* graph,
-                                 vector<Block>* blocks,
+                                 BlockOwners* blocks,
                                  const string& old_image,
                                  const string& new_image,
                                  int data_fd,
-                                 off_t* data_file_size) {
+                                 off_t* data_file_size,
+                                 bool stream_diff,
+                                 ThreadPool* pool) {
   // Open the two file systems.
   ext2_filsys fs_old;
   TEST_AND_RETURN_FALSE_ERRCODE(ext2fs_open(old_image.c_str(), 0, 0, 0,
@@ -463,23 +595,22 @@ bool Metadata::DeltaReadMetadata(Graph* graph,
     return true;
   }
 
+  MetadataDiffer differ(graph,
+                        blocks,
+                        fs_old,
+                        fs_new,
+                        data_fd,
+                        data_file_size,
+                        stream_diff,
+                        pool);
+
   // Process the main file system metadata (superblock, inode tables, etc)
-  TEST_AND_RETURN_FALSE(ReadFilesystemMetadata(graph,
-                                               blocks,
-                                               fs_old,
-                                               fs_new,
-                                               data_fd,
-                                               data_file_size));
+  TEST_AND_RETURN_FALSE(ReadFilesystemMetadata(&differ));
 
   // Process each inode metadata blocks.
-  TEST_AND_RETURN_FALSE(ReadInodeMetadata(graph,
-                                          blocks,
-                                          fs_old,
-                                          fs_new,
-                                          data_fd,
-                                          data_file_size));
+  TEST_AND_RETURN_FALSE(ReadInodeMetadata(&differ));
 
-  return true;
+  return differ.Finish();
 }
 
 };  // namespace chromeos_update_engine
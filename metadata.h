@@ -10,22 +10,33 @@
 
 namespace chromeos_update_engine {
 
+class ThreadPool;
+
 class Metadata {
  public:
   // Reads metadata from old image and new image and determines
   // the smallest way to encode the metadata for the diff.
   // If there's no change in the metadata, it creates a MOVE
   // operation. If there is a change, the smallest of REPLACE, REPLACE_BZ,
-  // or BSDIFF wins. It writes the diff to data_fd and updates data_file_size
-  // accordingly. It also adds the required operation to the graph and adds the
-  // metadata extents to blocks.
+  // REPLACE_XZ or BSDIFF wins. It writes the diff to data_fd and updates
+  // data_file_size accordingly. It also adds the required operation to the
+  // graph and adds the metadata extents to blocks. The metadata is encoded
+  // concurrently on |pool|, but the operations are added in the same order
+  // whatever its size.
+  // If |stream_diff| is set, the superblocks, group descriptors, bitmaps and
+  // inode tables, which stay in place, are diffed in place as STREAM_DIFF
+  // operations instead of with bsdiff: unchanged inodes and bitmap bytes are
+  // copied, and only the changed ones are sent, which is much quicker to
+  // generate and to apply.
   // Returns true on success.
   static bool DeltaReadMetadata(Graph* graph,
-                                std::vector<DeltaDiffGenerator::Block>* blocks,
+                                BlockOwners* blocks,
                                 const std::string& old_image,
                                 const std::string& new_image,
                                 int data_fd,
-                                off_t* data_file_size);
+                                off_t* data_file_size,
+                                bool stream_diff,
+                                ThreadPool* pool);
 
  private:
   // This should never be constructed.
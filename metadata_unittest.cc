@@ -17,6 +17,7 @@
 #include "update_engine/delta_diff_generator.h"
 #include "update_engine/metadata.h"
 #include "update_engine/test_utils.h"
+#include "update_engine/thread_pool.h"
 #include "update_engine/utils.h"
 
 using std::string;
@@ -24,9 +25,16 @@ using std::vector;
 
 namespace chromeos_update_engine {
 
-typedef DeltaDiffGenerator::Block Block;
 
 class MetadataTest : public ::testing::Test {
+ protected:
+  MetadataTest() : pool_(3) {}
+
+  virtual void SetUp() {
+    ASSERT_TRUE(pool_.Init());
+  }
+
+  ThreadPool pool_;
 };
 
 TEST_F(MetadataTest, RunAsRootReadMetadataDissimilarFileSystems) {
@@ -40,26 +48,29 @@ TEST_F(MetadataTest, RunAsRootReadMetadataDissimilarFileSystems) {
   CreateEmptyExtImageAtPath(b_img, 11534336, 4096);
 
   Graph graph;
-  vector<Block> blocks;
+  BlockOwners blocks(0);
   EXPECT_TRUE(Metadata::DeltaReadMetadata(&graph,
                                           &blocks,
                                           a_img,
                                           b_img,
                                           0,
-                                          NULL));
+                                          NULL,
+                                          false,
+                                          &pool_));
   EXPECT_EQ(graph.size(), 0);
 
   CreateEmptyExtImageAtPath(a_img, 10485759, 4096);
   CreateEmptyExtImageAtPath(b_img, 10485759, 8192);
 
   graph.clear();
-  blocks.clear();
   EXPECT_TRUE(Metadata::DeltaReadMetadata(&graph,
                                           &blocks,
                                           a_img,
                                           b_img,
                                           0,
-                                          NULL));
+                                          NULL,
+                                          false,
+                                          &pool_));
   EXPECT_EQ(graph.size(), 0);
 }
 
@@ -91,20 +102,22 @@ TEST_F(MetadataTest, RunAsRootReadMetadata) {
   ScopedFdCloser fd_closer(&fd);
 
   Graph graph;
-  vector<Block> blocks(image_size / block_size);
+  BlockOwners blocks(image_size / block_size);
   off_t data_file_size;
   EXPECT_TRUE(Metadata::DeltaReadMetadata(&graph,
                                           &blocks,
                                           a_img,
                                           b_img,
                                           fd,
-                                          &data_file_size));
+                                          &data_file_size,
+                                          false,
+                                          &pool_));
 
-  // There are 12 metadata that we look for:
+  // There are 22 metadata that we look for:
   //   - Block group 0 metadata (superblock, group descriptor, bitmaps, etc)
-  //       - Chunk 0, 1, 2, 3
+  //       - Chunks 0 to 8, of at most 128 blocks
   //   - Block group 1 metadata
-  //       - Chunk 0, 1, 2, 3
+  //       - Chunks 0 to 8, of at most 128 blocks
   //   - Root directory (inode 2)
   //   - Journal (inode 8)
   //   - lost+found directory (inode 11)
@@ -114,26 +127,24 @@ TEST_F(MetadataTest, RunAsRootReadMetadata) {
     off_t start_block; // Set to -1 to skip start block verification
     off_t num_blocks; // Set to -1 to skip num blocks verification
   } exp_results[] =
-      {{"<rootfs-bg-0-0-metadata>", 0, 104},
-       {"<rootfs-bg-0-1-metadata>", 104, 104},
-       {"<rootfs-bg-0-2-metadata>", 208, 104},
-       {"<rootfs-bg-0-3-metadata>", 312, 104},
-       {"<rootfs-bg-0-4-metadata>", 416, 104},
-       {"<rootfs-bg-0-5-metadata>", 520, 104},
-       {"<rootfs-bg-0-6-metadata>", 624, 104},
-       {"<rootfs-bg-0-7-metadata>", 728, 104},
-       {"<rootfs-bg-0-8-metadata>", 832, 104},
-       {"<rootfs-bg-0-9-metadata>", 936, 107},
-       {"<rootfs-bg-1-0-metadata>", 32768, 104},
-       {"<rootfs-bg-1-1-metadata>", 32872, 104},
-       {"<rootfs-bg-1-2-metadata>", 32976, 104},
-       {"<rootfs-bg-1-3-metadata>", 33080, 104},
-       {"<rootfs-bg-1-4-metadata>", 33184, 104},
-       {"<rootfs-bg-1-5-metadata>", 33288, 104},
-       {"<rootfs-bg-1-6-metadata>", 33392, 104},
-       {"<rootfs-bg-1-7-metadata>", 33496, 104},
-       {"<rootfs-bg-1-8-metadata>", 33600, 104},
-       {"<rootfs-bg-1-9-metadata>", 33704, 107},
+      {{"<rootfs-bg-0-0-metadata>", 0, 115},
+       {"<rootfs-bg-0-1-metadata>", 115, 115},
+       {"<rootfs-bg-0-2-metadata>", 230, 115},
+       {"<rootfs-bg-0-3-metadata>", 345, 115},
+       {"<rootfs-bg-0-4-metadata>", 460, 115},
+       {"<rootfs-bg-0-5-metadata>", 575, 115},
+       {"<rootfs-bg-0-6-metadata>", 690, 115},
+       {"<rootfs-bg-0-7-metadata>", 805, 115},
+       {"<rootfs-bg-0-8-metadata>", 920, 123},
+       {"<rootfs-bg-1-0-metadata>", 32768, 115},
+       {"<rootfs-bg-1-1-metadata>", 32883, 115},
+       {"<rootfs-bg-1-2-metadata>", 32998, 115},
+       {"<rootfs-bg-1-3-metadata>", 33113, 115},
+       {"<rootfs-bg-1-4-metadata>", 33228, 115},
+       {"<rootfs-bg-1-5-metadata>", 33343, 115},
+       {"<rootfs-bg-1-6-metadata>", 33458, 115},
+       {"<rootfs-bg-1-7-metadata>", 33573, 115},
+       {"<rootfs-bg-1-8-metadata>", 33688, 123},
        {"<rootfs-inode-2-metadata>", -1, 1},
        {"<rootfs-inode-8-metadata>", -1, 4101},
        {"<rootfs-inode-11-metadata>", -1, 4},
@@ -45,6 +45,14 @@ class MockDbusGlib : public DbusGlibInterface {
                                     GType var_arg5, const char* var_arg6,
                                     GType var_arg7));
 
+  MOCK_METHOD1(MethodReturn, void(DBusGMethodInvocation* context));
+
+  MOCK_METHOD2(MethodReturnString, void(DBusGMethodInvocation* context,
+                                        const char* value));
+
+  MOCK_METHOD2(MethodReturnError, void(DBusGMethodInvocation* context,
+                                       const GError* error));
+
   MOCK_METHOD1(ConnectionGetConnection, DBusConnection*(DBusGConnection* gbus));
 
   MOCK_METHOD3(DbusBusAddMatch, void(DBusConnection* connection,
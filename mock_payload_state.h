@@ -23,6 +23,7 @@ class MockPayloadState: public PayloadStateInterface {
   MOCK_METHOD1(DownloadProgress, void(size_t count));
   MOCK_METHOD1(UpdateFailed, void(ActionExitCode error));
   MOCK_METHOD0(ShouldBackoffDownload, bool());
+  MOCK_METHOD1(SelectUrl, void(uint32_t url_index));
 
   // Getters.
   MOCK_METHOD0(GetResponseSignature, std::string());
@@ -2,19 +2,65 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <algorithm>
+
 #include <base/stringprintf.h>
 
 #include "update_engine/multi_range_http_fetcher.h"
 #include "update_engine/utils.h"
 
+using std::vector;
+
 namespace chromeos_update_engine {
 
+const size_t MultiRangeHttpFetcher::kDefaultMaxBufferedBytes =
+    4 * 1024 * 1024;  // 4 MiB
+
+MultiRangeHttpFetcher::MultiRangeHttpFetcher(HttpFetcher* base_fetcher)
+    : HttpFetcher(base_fetcher->GetSystemState()),
+      base_fetcher_active_(false),
+      terminating_(false),
+      failing_(false),
+      paused_(false),
+      max_buffered_bytes_(kDefaultMaxBufferedBytes),
+      max_gap_(0),
+      max_request_size_(0),
+      advancing_(false),
+      notify_source_id_(0),
+      notify_terminated_(false),
+      notify_successful_(false),
+      current_index_(0),
+      next_index_(0),
+      peer_index_(0) {
+  AddParallelFetcher(base_fetcher);
+}
+
+MultiRangeHttpFetcher::~MultiRangeHttpFetcher() {
+  if (notify_source_id_)
+    g_source_remove(notify_source_id_);
+  for (vector<Fetcher>::iterator it = fetchers_.begin(); it != fetchers_.end();
+       ++it) {
+    delete it->fetcher;
+  }
+}
+
+void MultiRangeHttpFetcher::AddParallelFetcher(HttpFetcher* fetcher) {
+  CHECK(!base_fetcher_active_) << "AddParallelFetcher but already active.";
+  Fetcher entry;
+  entry.fetcher = fetcher;
+  entry.active = false;
+  entry.pending_transfer_ended = false;
+  entry.paused = false;
+  entry.range_index = 0;
+  entry.url_index = 0;
+  fetchers_.push_back(entry);
+}
+
 // Begins the transfer to the specified URL.
 // State change: Stopped -> Downloading
 // (corner case: Stopped -> Stopped for an empty request)
 void MultiRangeHttpFetcher::BeginTransfer(const std::string& url) {
   CHECK(!base_fetcher_active_) << "BeginTransfer but already active.";
-  CHECK(!pending_transfer_ended_) << "BeginTransfer but pending.";
   CHECK(!terminating_) << "BeginTransfer but terminating.";
 
   if (ranges_.empty()) {
@@ -24,11 +70,50 @@ void MultiRangeHttpFetcher::BeginTransfer(const std::string& url) {
     return;
   }
   url_ = url;
+  BuildRequests();
   current_index_ = 0;
-  bytes_received_this_range_ = 0;
+  next_index_ = 0;
+  range_states_.clear();
+  peer_index_ = 0;
   LOG(INFO) << "starting first transfer";
-  base_fetcher_->set_delegate(this);
-  StartTransfer();
+  for (vector<Fetcher>::iterator it = fetchers_.begin(); it != fetchers_.end();
+       ++it) {
+    it->fetcher->set_delegate(this);
+  }
+  base_fetcher_active_ = true;
+  if (delegate_)
+    delegate_->SeekToOffset(ranges_[0].offset());
+  StartTransfers();
+}
+
+void MultiRangeHttpFetcher::BuildRequests() {
+  requests_.clear();
+  for (RangesVect::size_type i = 0; i < ranges_.size(); i++) {
+    const Range& range = ranges_[i];
+    if (!requests_.empty() && max_request_size_ > 0) {
+      Request& request = requests_.back();
+      const off_t end = request.range.offset() + request.range.length();
+      // The request's size is unknown if the range has no length, but the
+      // bytes before it are still limited.
+      const off_t request_end =
+          range.HasLength() ? range.offset() + range.length() : range.offset();
+      if (request.range.HasLength() && range.offset() >= end &&
+          static_cast<size_t>(range.offset() - end) <= max_gap_ &&
+          static_cast<size_t>(request_end - request.range.offset()) <=
+          max_request_size_) {
+        request.range = range.HasLength() ?
+            Range(request.range.offset(),
+                  request_end - request.range.offset()) :
+            Range(request.range.offset());
+        request.num_ranges++;
+        continue;
+      }
+    }
+    requests_.push_back(Request(range, i));
+  }
+  LOG_IF(INFO, requests_.size() < ranges_.size())
+      << "Coalesced " << ranges_.size() << " ranges into "
+      << requests_.size() << " requests.";
 }
 
 // State change: Downloading -> Pending transfer ended
@@ -41,57 +126,197 @@ void MultiRangeHttpFetcher::TerminateTransfer() {
     return;
   }
   terminating_ = true;
-    
-  if (!pending_transfer_ended_) {
-    base_fetcher_->TerminateTransfer();
+  if (notify_source_id_) {
+    // All transfers are done already; report them as terminated.
+    notify_terminated_ = true;
+    return;
   }
+  StopTransfers();
 }
 
-// State change: Stopped or Downloading -> Downloading
-void MultiRangeHttpFetcher::StartTransfer() {
-  if (current_index_ >= ranges_.size()) {
-    return;
+void MultiRangeHttpFetcher::Pause() {
+  paused_ = true;
+  for (size_t i = 0; i < fetchers_.size(); i++) {
+    if (fetchers_[i].active)
+      UpdatePause(&fetchers_[i]);
+  }
+}
+
+void MultiRangeHttpFetcher::Unpause() {
+  paused_ = false;
+  for (size_t i = 0; i < fetchers_.size(); i++) {
+    if (fetchers_[i].active)
+      UpdatePause(&fetchers_[i]);
   }
+}
+
+void MultiRangeHttpFetcher::set_retry_seconds(int seconds) {
+  for (size_t i = 0; i < fetchers_.size(); i++)
+    fetchers_[i].fetcher->set_retry_seconds(seconds);
+}
+
+void MultiRangeHttpFetcher::SetBuildType(bool is_official) {
+  for (size_t i = 0; i < fetchers_.size(); i++)
+    fetchers_[i].fetcher->SetBuildType(is_official);
+}
+
+size_t MultiRangeHttpFetcher::GetBytesDownloaded() {
+  size_t bytes_downloaded = 0;
+  for (size_t i = 0; i < fetchers_.size(); i++)
+    bytes_downloaded += fetchers_[i].fetcher->GetBytesDownloaded();
+  return bytes_downloaded;
+}
+
+int MultiRangeHttpFetcher::GetRetryCount() {
+  int retry_count = 0;
+  for (size_t i = 0; i < fetchers_.size(); i++)
+    retry_count += fetchers_[i].fetcher->GetRetryCount();
+  return retry_count;
+}
 
-  Range range = ranges_[current_index_];
-  LOG(INFO) << "starting transfer of range " << range.ToString();
+// State change: Stopped or Downloading -> Downloading
+void MultiRangeHttpFetcher::StartTransfers() {
+  // Fetchers may call back before BeginTransfer() returns, so the state is
+  // checked again for every request.
+  while (!terminating_ && !failing_ && next_index_ < requests_.size() &&
+         next_index_ - current_index_ < fetchers_.size()) {
+    Fetcher* fetcher = NULL;
+    for (size_t i = 0; i < fetchers_.size() && !fetcher; i++) {
+      if (!fetchers_[i].active)
+        fetcher = &fetchers_[i];
+    }
+    if (!fetcher)
+      return;
+
+    const Range& range = requests_[next_index_].range;
+    LOG(INFO) << "starting transfer of range " << range.ToString();
+    fetcher->active = true;
+    fetcher->pending_transfer_ended = false;
+    fetcher->paused = false;
+    fetcher->range_index = next_index_;
+    range_states_.push_back(RangeState());
+    next_index_++;
+    BeginRangeTransfer(fetcher);
+    if (fetcher->active)
+      UpdatePause(fetcher);
+  }
+}
 
-  bytes_received_this_range_ = 0;
-  base_fetcher_->SetOffset(range.offset());
+void MultiRangeHttpFetcher::BeginRangeTransfer(Fetcher* fetcher) {
+  const Range& range = requests_[fetcher->range_index].range;
+  const size_t bytes_received =
+      range_states_[fetcher->range_index - current_index_].bytes_received;
+  fetcher->url_index = peer_index_;
+  fetcher->fetcher->SetOffset(range.offset() + bytes_received);
   if (range.HasLength())
-    base_fetcher_->SetLength(range.length());
+    fetcher->fetcher->SetLength(range.length() - bytes_received);
   else
-    base_fetcher_->UnsetLength();
-  if (delegate_)
-    delegate_->SeekToOffset(range.offset());
-  base_fetcher_active_ = true;
-  base_fetcher_->BeginTransfer(url_);
+    fetcher->fetcher->UnsetLength();
+  fetcher->fetcher->BeginTransfer(
+      peer_index_ < peer_urls_.size() ? peer_urls_[peer_index_] : url_);
+}
+
+MultiRangeHttpFetcher::Fetcher* MultiRangeHttpFetcher::FindFetcher(
+    HttpFetcher* fetcher) {
+  for (size_t i = 0; i < fetchers_.size(); i++) {
+    if (fetchers_[i].fetcher == fetcher)
+      return &fetchers_[i];
+  }
+  return NULL;
+}
+
+bool MultiRangeHttpFetcher::AnyFetcherActive() const {
+  for (size_t i = 0; i < fetchers_.size(); i++) {
+    if (fetchers_[i].active)
+      return true;
+  }
+  return false;
+}
+
+void MultiRangeHttpFetcher::UpdatePause(Fetcher* fetcher) {
+  bool pause = paused_;
+  if (fetcher->range_index != current_index_) {
+    const RangeState& state =
+        range_states_[fetcher->range_index - current_index_];
+    pause = pause || state.buffer.size() >= max_buffered_bytes_;
+  }
+  if (pause == fetcher->paused)
+    return;
+  fetcher->paused = pause;
+  if (pause)
+    fetcher->fetcher->Pause();
+  else
+    fetcher->fetcher->Unpause();
 }
 
 // State change: Downloading -> Downloading or Pending transfer ended
 void MultiRangeHttpFetcher::ReceivedBytes(HttpFetcher* fetcher,
                                           const char* bytes,
                                           int length) {
-  CHECK_LT(current_index_, ranges_.size());
-  CHECK_EQ(fetcher, base_fetcher_.get());
-  CHECK(!pending_transfer_ended_);
+  ReceivedRangeBytes(fetcher, bytes, length);
+}
+
+char* MultiRangeHttpFetcher::GetReceiveBuffer(HttpFetcher* fetcher,
+                                              size_t length) {
+  Fetcher* entry = FindFetcher(fetcher);
+  CHECK(entry);
+  // Only the current request goes straight to the delegate; later ones are
+  // buffered here until it's their turn. Neither do coalesced ones, whose
+  // gaps have to be dropped.
+  if (entry->range_index != current_index_ || !delegate_ ||
+      requests_[entry->range_index].num_ranges > 1)
+    return NULL;
+  return delegate_->GetReceiveBuffer(this, length);
+}
+
+void MultiRangeHttpFetcher::ReceivedBytesInBuffer(HttpFetcher* fetcher,
+                                                  int length) {
+  ReceivedRangeBytes(fetcher, NULL, length);
+}
+
+void MultiRangeHttpFetcher::ReceivedRangeBytes(HttpFetcher* fetcher,
+                                               const char* bytes,
+                                               int length) {
+  Fetcher* entry = FindFetcher(fetcher);
+  CHECK(entry);
+  CHECK(entry->active);
+  CHECK(!entry->pending_transfer_ended);
+  CHECK_LT(entry->range_index, next_index_);
+  RangeState& state = range_states_[entry->range_index - current_index_];
   size_t next_size = length;
-  Range range = ranges_[current_index_];
+  Range range = requests_[entry->range_index].range;
   if (range.HasLength()) {
     next_size = std::min(next_size,
-                         range.length() - bytes_received_this_range_);
+                         range.length() - state.bytes_received);
   }
   LOG_IF(WARNING, next_size <= 0) << "Asked to write length <= 0";
-  if (delegate_) {
-    delegate_->ReceivedBytes(this, bytes, next_size);
+  const size_t request_offset = state.bytes_received;
+  state.bytes_received += length;
+  if (entry->range_index == current_index_) {
+    if (delegate_) {
+      // Bytes past the end of the range fell into the delegate's buffer
+      // too, but aren't committed to it.
+      if (bytes) {
+        DeliverBytes(entry->range_index, request_offset, bytes, next_size,
+                     false);
+      } else {
+        delegate_->ReceivedBytesInBuffer(this, next_size);
+      }
+    }
+  } else {
+    CHECK(bytes);
+    state.buffer.insert(state.buffer.end(), bytes, bytes + next_size);
+    if (delegate_)
+      DeliverBytes(entry->range_index, request_offset, bytes, next_size, true);
+    UpdatePause(entry);
   }
-  bytes_received_this_range_ += length;
-  if (range.HasLength() && bytes_received_this_range_ >= range.length()) {
+  if (range.HasLength() && state.bytes_received >= range.length() &&
+      !entry->pending_transfer_ended) {
     // Terminates the current fetcher. Waits for its TransferTerminated
     // callback before starting the next range so that we don't end up
     // signalling the delegate that the whole multi-transfer is complete
     // before all fetchers are really done and cleaned up.
-    pending_transfer_ended_ = true;
+    entry->pending_transfer_ended = true;
     LOG(INFO) << "terminating transfer";
     fetcher->TerminateTransfer();
   }
@@ -100,49 +325,175 @@ void MultiRangeHttpFetcher::ReceivedBytes(HttpFetcher* fetcher,
 // State change: Downloading or Pending transfer ended -> Stopped
 void MultiRangeHttpFetcher::TransferEnded(HttpFetcher* fetcher,
                                           bool successful) {
-  CHECK(base_fetcher_active_) << "Transfer ended unexpectedly.";
-  CHECK_EQ(fetcher, base_fetcher_.get());
-  pending_transfer_ended_ = false;
-  http_response_code_ = fetcher->http_response_code();
-  LOG(INFO) << "TransferEnded w/ code " << http_response_code_;
-  if (terminating_) {
+  Fetcher* entry = FindFetcher(fetcher);
+  CHECK(entry);
+  CHECK(entry->active) << "Transfer ended unexpectedly.";
+  entry->active = false;
+  entry->pending_transfer_ended = false;
+  entry->paused = false;
+  if (entry->range_index == current_index_)
+    http_response_code_ = fetcher->http_response_code();
+  LOG(INFO) << "TransferEnded w/ code " << fetcher->http_response_code();
+  if (terminating_ || failing_) {
     LOG(INFO) << "Terminating.";
-    Reset();
-    // Note that after the callback returns this object may be destroyed.
-    if (delegate_)
-      delegate_->TransferTerminated(this);
+    MaybeFinishStopping();
     return;
   }
 
   // If we didn't get enough bytes, it's failure
-  Range range = ranges_[current_index_];
+  RangeState& state = range_states_[entry->range_index - current_index_];
+  Range range = requests_[entry->range_index].range;
+  state.done = true;
+  state.http_response_code = fetcher->http_response_code();
+  state.successful = successful;
   if (range.HasLength()) {
-    if (bytes_received_this_range_ < range.length()) {
-      // Failure
-      LOG(INFO) << "Didn't get enough bytes. Ending w/ failure.";
-      Reset();
-      // Note that after the callback returns this object may be destroyed.
-      if (delegate_)
-        delegate_->TransferComplete(this, false);
-      return;
-    }
     // We got enough bytes and there were bytes specified, so this is success.
-    successful = true;
+    state.successful = state.bytes_received >= range.length();
+    LOG_IF(INFO, !state.successful) << "Didn't get enough bytes.";
   }
 
-  // If we have another transfer, do that.
-  if (current_index_ + 1 < ranges_.size()) {
-    current_index_++;
-    LOG(INFO) << "Starting next transfer (" << current_index_ << ").";
-    StartTransfer();
+  if (!state.successful && entry->url_index < peer_urls_.size()) {
+    LOG(INFO) << "Range " << range.ToString() << " failed from peer "
+              << peer_urls_[entry->url_index] << ", trying the next source.";
+    peer_index_ = std::max(peer_index_, entry->url_index + 1);
+    state.done = false;
+    entry->active = true;
+    BeginRangeTransfer(entry);
+    if (entry->active)
+      UpdatePause(entry);
+    return;
+  }
+
+  if (entry->range_index == current_index_)
+    AdvanceCurrentRange();
+  else
+    StartTransfers();
+}
+
+void MultiRangeHttpFetcher::DeliverBytes(size_t index,
+                                         size_t request_offset,
+                                         const char* bytes,
+                                         size_t length,
+                                         bool ahead) {
+  const Request& request = requests_[index];
+  for (RangesVect::size_type i = 0; i < request.num_ranges && length > 0;
+       i++) {
+    const Range& range = ranges_[request.first_range + i];
+    const size_t start = range.offset() - request.range.offset();
+    if (request_offset < start) {
+      const size_t gap = std::min(length, start - request_offset);
+      request_offset += gap;
+      bytes += gap;
+      length -= gap;
+      if (length == 0)
+        break;
+    }
+    size_t count = length;
+    if (range.HasLength()) {
+      if (request_offset >= start + range.length())
+        continue;
+      count = std::min(count, start + range.length() - request_offset);
+    }
+    if (ahead) {
+      delegate_->ReceivedBytesAhead(
+          this, range.offset() + (request_offset - start), bytes, count);
+    } else {
+      if (i > 0 && request_offset == start)
+        delegate_->SeekToOffset(range.offset());
+      delegate_->ReceivedBytes(this, bytes, count);
+    }
+    request_offset += count;
+    bytes += count;
+    length -= count;
+  }
+}
+
+void MultiRangeHttpFetcher::AdvanceCurrentRange() {
+  if (advancing_)
     return;
+  advancing_ = true;
+  while (!terminating_ && !failing_ && !notify_source_id_ &&
+         !range_states_.empty() && range_states_.front().done) {
+    http_response_code_ = range_states_.front().http_response_code;
+    if (!range_states_.front().successful) {
+      LOG(INFO) << "Range " << requests_[current_index_].range.ToString()
+                << " failed. Ending w/ failure.";
+      failing_ = true;
+      StopTransfers();
+      break;
+    }
+    range_states_.pop_front();
+    current_index_++;
+    if (current_index_ == requests_.size()) {
+      LOG(INFO) << "Done w/ all transfers";
+      ScheduleNotifyTransferEnded(false, true);
+      break;
+    }
+
+    LOG(INFO) << "Delivering range " << current_index_ << ".";
+    if (delegate_)
+      delegate_->SeekToOffset(requests_[current_index_].range.offset());
+    if (current_index_ == next_index_)
+      break;  // Not started yet.
+    vector<char> buffer;
+    buffer.swap(range_states_.front().buffer);
+    if (!buffer.empty() && delegate_)
+      DeliverBytes(current_index_, 0, &buffer[0], buffer.size(), false);
+    // The request's data now goes straight to the delegate, so its fetcher
+    // may go on if it was waiting for the buffer to drain.
+    for (size_t i = 0; i < fetchers_.size(); i++) {
+      if (fetchers_[i].active && fetchers_[i].range_index == current_index_)
+        UpdatePause(&fetchers_[i]);
+    }
   }
+  advancing_ = false;
+  StartTransfers();
+}
 
-  LOG(INFO) << "Done w/ all transfers";
+void MultiRangeHttpFetcher::StopTransfers() {
+  // Fetchers may report that they're done before TerminateTransfer() returns,
+  // which is fine since the delegate is only notified from the main loop.
+  for (size_t i = 0; i < fetchers_.size(); i++) {
+    Fetcher* fetcher = &fetchers_[i];
+    if (fetcher->active && !fetcher->pending_transfer_ended) {
+      fetcher->pending_transfer_ended = true;
+      fetcher->fetcher->TerminateTransfer();
+    }
+  }
+  MaybeFinishStopping();
+}
+
+void MultiRangeHttpFetcher::MaybeFinishStopping() {
+  if (notify_source_id_ || AnyFetcherActive())
+    return;
+  ScheduleNotifyTransferEnded(terminating_, false);
+}
+
+void MultiRangeHttpFetcher::ScheduleNotifyTransferEnded(bool terminated,
+                                                        bool successful) {
+  CHECK(!notify_source_id_);
+  notify_terminated_ = terminated;
+  notify_successful_ = successful;
+  notify_source_id_ = g_idle_add(&StaticNotifyTransferEnded, this);
+}
+
+gboolean MultiRangeHttpFetcher::StaticNotifyTransferEnded(gpointer data) {
+  reinterpret_cast<MultiRangeHttpFetcher*>(data)->NotifyTransferEnded();
+  return FALSE;  // Don't call this callback again.
+}
+
+void MultiRangeHttpFetcher::NotifyTransferEnded() {
+  notify_source_id_ = 0;
+  const bool terminated = notify_terminated_;
+  const bool successful = notify_successful_;
   Reset();
   // Note that after the callback returns this object may be destroyed.
-  if (delegate_)
-    delegate_->TransferComplete(this, successful);
+  if (delegate_) {
+    if (terminated)
+      delegate_->TransferTerminated(this);
+    else
+      delegate_->TransferComplete(this, successful);
+  }
 }
 
 void MultiRangeHttpFetcher::TransferComplete(HttpFetcher* fetcher,
@@ -157,9 +508,10 @@ void MultiRangeHttpFetcher::TransferTerminated(HttpFetcher* fetcher) {
 }
 
 void MultiRangeHttpFetcher::Reset() {
-  base_fetcher_active_ = pending_transfer_ended_ = terminating_ = false;
+  base_fetcher_active_ = terminating_ = failing_ = false;
   current_index_ = 0;
-  bytes_received_this_range_ = 0;
+  next_index_ = 0;
+  range_states_.clear();
 }
 
 std::string MultiRangeHttpFetcher::Range::ToString() const {
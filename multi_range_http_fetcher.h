@@ -9,8 +9,6 @@
 #include <utility>
 #include <vector>
 
-#include <base/memory/scoped_ptr.h>
-
 #include "update_engine/http_fetcher.h"
 
 // This class is a simple wrapper around an HttpFetcher. The client
@@ -21,6 +19,16 @@
 // for the last range specified to have unlimited length, tho it is legal for
 // other entries to have unlimited length.
 
+// Ranges that follow each other closely may be downloaded in one request,
+// see set_coalescing(), which saves a round trip for each of them when there
+// are many small ones, e.g., the data blobs fetched again to repair them.
+
+// More fetchers may be added with AddParallelFetcher(), in which case up to
+// one request per fetcher is downloaded at a time. The data of the ranges
+// after the one being delivered is buffered, so the delegate still gets the
+// ranges one after another, in order, just like with a single fetcher. That
+// data is also passed to the delegate's ReceivedBytesAhead() as it comes in.
+
 // There are three states a MultiRangeHttpFetcher object will be in:
 // - Stopped (start state)
 // - Downloading
@@ -32,19 +40,45 @@ namespace chromeos_update_engine {
 
 class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
  public:
+  // The default for set_max_buffered_bytes().
+  static const size_t kDefaultMaxBufferedBytes;
+
   // Takes ownership of the passed in fetcher.
-  explicit MultiRangeHttpFetcher(HttpFetcher* base_fetcher)
-      : HttpFetcher(base_fetcher->GetSystemState()),
-        base_fetcher_(base_fetcher),
-        base_fetcher_active_(false),
-        pending_transfer_ended_(false),
-        terminating_(false),
-        current_index_(0),
-        bytes_received_this_range_(0) {}
-  ~MultiRangeHttpFetcher() {}
+  explicit MultiRangeHttpFetcher(HttpFetcher* base_fetcher);
+  ~MultiRangeHttpFetcher();
+
+  // Takes ownership of |fetcher|, which is used to download a range while the
+  // other fetchers download the ranges before it. Should be called before any
+  // of the setters below, which apply to all fetchers.
+  void AddParallelFetcher(HttpFetcher* fetcher);
+
+  // Pauses the download of a range that's not being delivered yet once this
+  // many bytes of it are buffered.
+  void set_max_buffered_bytes(size_t max_buffered_bytes) {
+    max_buffered_bytes_ = max_buffered_bytes;
+  }
+
+  // Downloads each run of ranges that start at most |max_gap| bytes after
+  // the end of the one before in a single request of up to
+  // |max_request_size| bytes, dropping the bytes between them. The delegate
+  // still gets the ranges one after another, each after SeekToOffset().
+  // Ranges that are out of order or overlap are never coalesced. Off (0) by
+  // default.
+  void set_coalescing(size_t max_gap, size_t max_request_size) {
+    max_gap_ = max_gap;
+    max_request_size_ = max_request_size;
+  }
 
   void ClearRanges() { ranges_.clear(); }
 
+  // Makes the ranges be downloaded from |url|, a peer that may have the
+  // payload, ahead of the URL passed to BeginTransfer() and of the peers
+  // added after it. A range that fails from a peer is downloaded from where
+  // it stopped from the next one, or from that URL, and the peer isn't asked
+  // for the ranges after it.
+  void AddPeerUrl(const std::string& url) { peer_urls_.push_back(url); }
+  void ClearPeerUrls() { peer_urls_.clear(); }
+
   void AddRange(off_t offset, size_t size) {
     CHECK_GT(size, static_cast<size_t>(0));
     ranges_.push_back(Range(offset, size));
@@ -67,25 +101,22 @@ class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
   // State change: Downloading -> Pending transfer ended
   virtual void TerminateTransfer();
 
-  virtual void Pause() { base_fetcher_->Pause(); }
+  virtual void Pause();
 
-  virtual void Unpause() { base_fetcher_->Unpause(); }
+  virtual void Unpause();
 
   // These functions are overloaded in LibcurlHttp fetcher for testing purposes.
-  virtual void set_idle_seconds(int seconds) {
-    base_fetcher_->set_idle_seconds(seconds);
-  }
-  virtual void set_retry_seconds(int seconds) {
-    base_fetcher_->set_retry_seconds(seconds);
-  }
-  virtual void SetBuildType(bool is_official) {
-    base_fetcher_->SetBuildType(is_official);
-  }
-  inline virtual size_t GetBytesDownloaded() {
-    return base_fetcher_->GetBytesDownloaded();
-  }
+  virtual void set_retry_seconds(int seconds);
+  virtual void SetBuildType(bool is_official);
+
+  virtual size_t GetBytesDownloaded();
+
+  // Returns the retries of all the fetchers.
+  virtual int GetRetryCount();
 
  private:
+  friend class UpdateAttempterTest;
+
   // A range object defining the offset and length of a download chunk.  Zero
   // length indicates an unspecified end offset (note that it is impossible to
   // request a zero-length range in HTTP).
@@ -108,13 +139,114 @@ class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
 
   typedef std::vector<Range> RangesVect;
 
+  // A request the ranges are downloaded with: |range| spans the
+  // |num_ranges| ranges from |first_range| on, and the gaps between them.
+  struct Request {
+    Request(const Range& range, RangesVect::size_type first_range)
+        : range(range), first_range(first_range), num_ranges(1) {}
+    Range range;
+    RangesVect::size_type first_range;
+    RangesVect::size_type num_ranges;
+  };
+
+  // The download state of a request that's been started but not delivered
+  // completely yet.
+  struct RangeState {
+    RangeState() : bytes_received(0), done(false), successful(false),
+                   http_response_code(0) {}
+    size_t bytes_received;
+    // Data received while a request before this one was being delivered,
+    // gaps included.
+    std::vector<char> buffer;
+    // Set once the range's transfer has ended.
+    bool done;
+    bool successful;
+    int http_response_code;
+  };
+
+  // One of the fetchers and what it's doing.
+  struct Fetcher {
+    HttpFetcher* fetcher;
+    // True from BeginTransfer() until TransferComplete() or
+    // TransferTerminated().
+    bool active;
+    // True once TerminateTransfer() has been called on the active fetcher.
+    bool pending_transfer_ended;
+    // Whether the fetcher is currently paused.
+    bool paused;
+    // The index of the request being downloaded in requests_, if active.
+    size_t range_index;
+    // The peer it's downloaded from, or peer_urls_.size() if it's the URL
+    // passed to BeginTransfer().
+    size_t url_index;
+  };
+
+  // Sets requests_ for ranges_, see set_coalescing().
+  void BuildRequests();
+
+  // Starts downloading the next requests on the idle fetchers, as far as the
+  // fetchers allow.
   // State change: Stopped or Downloading -> Downloading
-  void StartTransfer();
+  void StartTransfers();
+
+  // Starts downloading what's left of the request of |fetcher| from the
+  // first peer that hasn't failed, or the URL passed to BeginTransfer().
+  void BeginRangeTransfer(Fetcher* fetcher);
+
+  // Returns the Fetcher entry of |fetcher|.
+  Fetcher* FindFetcher(HttpFetcher* fetcher);
+
+  bool AnyFetcherActive() const;
+
+  // Pauses or unpauses |fetcher| as needed by Pause() and by how much data
+  // of its request is buffered.
+  void UpdatePause(Fetcher* fetcher);
+
+  // Passes the |length| bytes at |bytes|, received |request_offset| bytes
+  // into the request at |index| of requests_, to the delegate's
+  // ReceivedBytes(), calling SeekToOffset() before each of its ranges but
+  // the first, or to its ReceivedBytesAhead() if |ahead|. The bytes of the
+  // gaps between the ranges are dropped.
+  void DeliverBytes(size_t index,
+                    size_t request_offset,
+                    const char* bytes,
+                    size_t length,
+                    bool ahead);
+
+  // Delivers the buffered data of the completed requests at the head of the
+  // window and makes the next request the current one, until it finds one
+  // that's still being downloaded. Then starts the next transfers or, if all
+  // requests are done or one failed, ends the whole transfer.
+  void AdvanceCurrentRange();
+
+  // Terminates all active fetchers and, once they're all done, notifies the
+  // delegate that the transfer has been terminated if |terminating_|, or
+  // has failed.
+  void StopTransfers();
+
+  // Schedules the notification for StopTransfers() once no fetcher is active
+  // anymore.
+  void MaybeFinishStopping();
+
+  // Calls NotifyTransferEnded() from the main loop, so that the delegate,
+  // which may delete this object, isn't called back while one of our
+  // methods is on the stack. The delegate's TransferTerminated() is called
+  // if |terminated|, and TransferComplete() with |successful| otherwise.
+  void ScheduleNotifyTransferEnded(bool terminated, bool successful);
+  static gboolean StaticNotifyTransferEnded(gpointer data);
+  void NotifyTransferEnded();
 
   // State change: Downloading -> Downloading or Pending transfer ended
   virtual void ReceivedBytes(HttpFetcher* fetcher,
                              const char* bytes,
                              int length);
+  virtual char* GetReceiveBuffer(HttpFetcher* fetcher, size_t length);
+  virtual void ReceivedBytesInBuffer(HttpFetcher* fetcher, int length);
+  // Does the work of the two methods above. |bytes| is NULL if the
+  // |length| bytes were received into the delegate's buffer.
+  void ReceivedRangeBytes(HttpFetcher* fetcher,
+                          const char* bytes,
+                          int length);
 
   // State change: Pending transfer ended -> Stopped
   void TransferEnded(HttpFetcher* fetcher, bool successful);
@@ -124,23 +256,52 @@ class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
 
   void Reset();
 
-  scoped_ptr<HttpFetcher> base_fetcher_;
+  // The owned fetchers; the first one is the base fetcher.
+  std::vector<Fetcher> fetchers_;
 
-  // If true, do not send any more data or TransferComplete to the delegate.
+  // True while a transfer is in progress.
   bool base_fetcher_active_;
 
-  // If true, the next fetcher needs to be started when TransferTerminated is
-  // received from the current fetcher.
-  bool pending_transfer_ended_;
-
-  // True if we are waiting for base fetcher to terminate b/c we are
-  // ourselves terminating.
+  // True if we are waiting for the fetchers to terminate b/c we are
+  // ourselves terminating, or because a range failed.
   bool terminating_;
+  bool failing_;
+
+  // True if Pause() was called.
+  bool paused_;
+
+  size_t max_buffered_bytes_;
+
+  // See set_coalescing().
+  size_t max_gap_;
+  size_t max_request_size_;
+
+  // True while AdvanceCurrentRange() runs, which makes nested calls return
+  // right away.
+  bool advancing_;
+
+  // If non-zero, the main loop source that calls NotifyTransferEnded(), and
+  // the result to report.
+  guint notify_source_id_;
+  bool notify_terminated_;
+  bool notify_successful_;
 
   RangesVect ranges_;
 
-  RangesVect::size_type current_index_;  // index into ranges_
-  size_t bytes_received_this_range_;
+  // The requests of the current transfer.
+  std::vector<Request> requests_;
+
+  size_t current_index_;  // index into requests_
+  // The next request to start. The requests from current_index_ to it have
+  // been started and not delivered completely yet, and their state is in
+  // range_states_.
+  size_t next_index_;
+  std::deque<RangeState> range_states_;
+
+  // The peers the ranges are downloaded from first, and the first one of
+  // them that hasn't failed in this transfer.
+  std::vector<std::string> peer_urls_;
+  size_t peer_index_;
 
   DISALLOW_COPY_AND_ASSIGN(MultiRangeHttpFetcher);
 };
@@ -0,0 +1,557 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/multicast_fetcher.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+
+#include "update_engine/utils.h"
+
+using std::map;
+using std::min;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+// Packets of 1432 bytes with their header, which fit the usual 1500 byte
+// MTU without fragmenting.
+const size_t MulticastFetcher::kPacketDataSize = 1408;
+// One parity packet per 16 makes up for a loss rate of a few percent for a
+// 1/16 overhead.
+const size_t MulticastFetcher::kGroupPackets = 16;
+const size_t MulticastFetcher::kWindowSize = 8 * 1024 * 1024;  // 8 MiB
+const int MulticastFetcher::kDefaultPort = 7301;
+const int MulticastFetcher::kGapTimeoutMs = 2000;
+
+namespace {
+// The packet header, in network byte order:
+//   0: "UEMC"
+//   4: the type, kPacketTypeData or kPacketTypeParity
+//   5: the number of data packets of the group, for a parity packet
+//   6: the bytes of data that follow the header
+//   8: the offset of the data in the payload, or of the group for a parity
+//      packet
+//  16: the bytes of data of the whole group, for a parity packet
+//  20: reserved, 0
+const char kPacketMagic[] = "UEMC";
+const size_t kPacketHeaderSize = 24;
+const uint8_t kPacketTypeData = 0;
+const uint8_t kPacketTypeParity = 1;
+
+// The most packets read by a main loop iteration, so that a fast sender
+// doesn't hold up the main loop.
+const int kMaxPacketsPerRead = 256;
+
+void AppendUint(uint64_t value, size_t size, string* out) {
+  for (size_t i = size; i > 0; i--)
+    out->push_back(static_cast<char>((value >> (8 * (i - 1))) & 0xff));
+}
+
+uint64_t ReadUint(const char* data, size_t size) {
+  uint64_t value = 0;
+  for (size_t i = 0; i < size; i++)
+    value = (value << 8) | static_cast<uint8_t>(data[i]);
+  return value;
+}
+
+string PacketHeader(uint8_t type,
+                    size_t group_packets,
+                    size_t length,
+                    off_t offset,
+                    size_t group_length) {
+  string header(kPacketMagic, 4);
+  AppendUint(type, 1, &header);
+  AppendUint(group_packets, 1, &header);
+  AppendUint(length, 2, &header);
+  AppendUint(offset, 8, &header);
+  AppendUint(group_length, 4, &header);
+  AppendUint(0, 4, &header);
+  return header;
+}
+
+// XORs the bytes of |data| into |parity|, which is at least as long.
+void XorInto(const char* data, size_t length, string* parity) {
+  for (size_t i = 0; i < length; i++)
+    (*parity)[i] ^= data[i];
+}
+}  // namespace {}
+
+MulticastFetcher::MulticastFetcher(SystemState* system_state,
+                                   const string& group,
+                                   int port,
+                                   HttpFetcher* fallback_fetcher)
+    : HttpFetcher(system_state),
+      group_(group),
+      port_(port),
+      fallback_fetcher_(fallback_fetcher),
+      fallback_delegate_(this),
+      fd_(-1),
+      channel_(NULL),
+      watch_id_(0),
+      listen_failed_(false),
+      payload_size_(0),
+      offset_(0),
+      has_length_(false),
+      length_(0),
+      active_(false),
+      paused_(false),
+      fallback_active_(false),
+      terminating_(false),
+      window_overrun_(false),
+      deliver_source_id_(0),
+      gap_source_id_(0),
+      terminated_source_id_(0),
+      bytes_downloaded_(0) {
+  fallback_fetcher_->set_delegate(&fallback_delegate_);
+}
+
+MulticastFetcher::~MulticastFetcher() {
+  if (deliver_source_id_)
+    g_source_remove(deliver_source_id_);
+  if (gap_source_id_)
+    g_source_remove(gap_source_id_);
+  if (terminated_source_id_)
+    g_source_remove(terminated_source_id_);
+  if (watch_id_)
+    g_source_remove(watch_id_);
+  if (channel_)
+    g_io_channel_unref(channel_);
+  if (fd_ >= 0)
+    close(fd_);
+}
+
+bool MulticastFetcher::Listen() {
+  CHECK_LT(fd_, 0) << "The multicast fetcher is listening already.";
+  listen_failed_ = true;
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port_);
+  if (inet_aton(group_.c_str(), &addr.sin_addr) == 0) {
+    LOG(ERROR) << "Invalid multicast group " << group_;
+    return false;
+  }
+  int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  ScopedFdCloser fd_closer(&fd);
+  // Other receivers of the host may listen to the group too.
+  int reuse = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  // Enough for the packets that come in while the main loop is busy.
+  int buffer_size = kWindowSize / 2;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+  // Bound to the group's address, the socket only gets the group's packets.
+  TEST_AND_RETURN_FALSE_ERRNO(
+      bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == 0);
+  if (IN_MULTICAST(ntohl(addr.sin_addr.s_addr))) {
+    struct ip_mreq membership;
+    memset(&membership, 0, sizeof(membership));
+    membership.imr_multiaddr = addr.sin_addr;
+    membership.imr_interface.s_addr = htonl(INADDR_ANY);
+    TEST_AND_RETURN_FALSE_ERRNO(
+        setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership,
+                   sizeof(membership)) == 0);
+  }
+  socklen_t addr_size = sizeof(addr);
+  TEST_AND_RETURN_FALSE_ERRNO(
+      getsockname(fd, reinterpret_cast<struct sockaddr*>(&addr),
+                  &addr_size) == 0);
+  port_ = ntohs(addr.sin_port);
+
+  fd_closer.set_should_close(false);
+  fd_ = fd;
+  listen_failed_ = false;
+  channel_ = g_io_channel_unix_new(fd_);
+  watch_id_ = g_io_add_watch(channel_, G_IO_IN,
+                             &MulticastFetcher::StaticOnReadable, this);
+  LOG(INFO) << "Receiving the payload from multicast group " << group_
+            << " port " << port_;
+  return true;
+}
+
+void MulticastFetcher::SetOffset(off_t offset) {
+  offset_ = offset;
+  window_overrun_ = false;
+  DropDeliveredPackets();
+  if (delegate_)
+    delegate_->SeekToOffset(offset);
+}
+
+void MulticastFetcher::SetLength(size_t length) {
+  has_length_ = true;
+  length_ = length;
+}
+
+void MulticastFetcher::UnsetLength() {
+  has_length_ = false;
+  length_ = 0;
+}
+
+void MulticastFetcher::BeginTransfer(const string& url) {
+  CHECK(!active_) << "BeginTransfer but already active.";
+  url_ = url;
+  http_response_code_ = 0;
+  active_ = true;
+  terminating_ = false;
+  if (fd_ < 0 && !listen_failed_)
+    Listen();
+  if (ReceivesRange()) {
+    ScheduleDeliver();
+    return;
+  }
+  fallback_active_ = true;
+  fallback_fetcher_->SetOffset(offset_);
+  if (has_length_)
+    fallback_fetcher_->SetLength(length_);
+  else
+    fallback_fetcher_->UnsetLength();
+  fallback_fetcher_->BeginTransfer(url_);
+  if (paused_)
+    fallback_fetcher_->Pause();
+}
+
+void MulticastFetcher::TerminateTransfer() {
+  terminating_ = true;
+  if (deliver_source_id_) {
+    g_source_remove(deliver_source_id_);
+    deliver_source_id_ = 0;
+  }
+  if (gap_source_id_) {
+    g_source_remove(gap_source_id_);
+    gap_source_id_ = 0;
+  }
+  if (fallback_active_) {
+    // Its TransferTerminated() ends the transfer.
+    fallback_fetcher_->TerminateTransfer();
+  } else if (!terminated_source_id_) {
+    terminated_source_id_ =
+        g_idle_add(&MulticastFetcher::StaticOnTerminated, this);
+  }
+}
+
+void MulticastFetcher::Pause() {
+  paused_ = true;
+  if (fallback_active_)
+    fallback_fetcher_->Pause();
+  if (deliver_source_id_) {
+    g_source_remove(deliver_source_id_);
+    deliver_source_id_ = 0;
+  }
+  // The gap timeout starts over once unpaused.
+  if (gap_source_id_) {
+    g_source_remove(gap_source_id_);
+    gap_source_id_ = 0;
+  }
+}
+
+void MulticastFetcher::Unpause() {
+  paused_ = false;
+  if (fallback_active_)
+    fallback_fetcher_->Unpause();
+  else if (active_)
+    ScheduleDeliver();
+}
+
+void MulticastFetcher::EncodePackets(off_t offset,
+                                     const char* data,
+                                     size_t length,
+                                     vector<string>* packets) {
+  const size_t kGroupSize = kPacketDataSize * kGroupPackets;
+  CHECK_EQ(offset % kGroupSize, 0U);
+  for (size_t group = 0; group < length; group += kGroupSize) {
+    const size_t group_length = min(kGroupSize, length - group);
+    const size_t group_packets =
+        (group_length + kPacketDataSize - 1) / kPacketDataSize;
+    string parity(min(kPacketDataSize, group_length), '\0');
+    for (size_t packet = 0; packet < group_length; packet += kPacketDataSize) {
+      const size_t packet_length = min(kPacketDataSize,
+                                       group_length - packet);
+      const char* packet_data = data + group + packet;
+      packets->push_back(PacketHeader(kPacketTypeData, 0, packet_length,
+                                      offset + group + packet, 0));
+      packets->back().append(packet_data, packet_length);
+      XorInto(packet_data, packet_length, &parity);
+    }
+    packets->push_back(PacketHeader(kPacketTypeParity, group_packets,
+                                    parity.size(), offset + group,
+                                    group_length));
+    packets->back().append(parity);
+  }
+}
+
+gboolean MulticastFetcher::StaticOnReadable(GIOChannel* source,
+                                            GIOCondition condition,
+                                            gpointer data) {
+  reinterpret_cast<MulticastFetcher*>(data)->OnReadable();
+  return TRUE;
+}
+
+void MulticastFetcher::OnReadable() {
+  char buffer[kPacketHeaderSize + kPacketDataSize];
+  for (int i = 0; i < kMaxPacketsPerRead; i++) {
+    ssize_t rc = recv(fd_, buffer, sizeof(buffer), 0);
+    if (rc < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        PLOG(WARNING) << "Unable to receive from the multicast group";
+      break;
+    }
+    AddPacket(string(buffer, rc));
+  }
+  if (active_ && ReceivesRange())
+    Deliver();
+}
+
+void MulticastFetcher::AddPacket(const string& packet) {
+  if (packet.size() < kPacketHeaderSize ||
+      packet.compare(0, 4, kPacketMagic) != 0)
+    return;
+  const char* header = packet.data();
+  const uint8_t type = ReadUint(header + 4, 1);
+  const size_t group_packets = ReadUint(header + 5, 1);
+  const size_t length = ReadUint(header + 6, 2);
+  const off_t offset = ReadUint(header + 8, 8);
+  const size_t group_length = ReadUint(header + 16, 4);
+  const size_t kGroupSize = kPacketDataSize * kGroupPackets;
+  if (length == 0 || length > kPacketDataSize ||
+      packet.size() != kPacketHeaderSize + length || offset < 0)
+    return;
+  const off_t group_offset = offset - offset % kGroupSize;
+  // The packets of the groups delivered already aren't needed anymore.
+  if (group_offset < offset_ - offset_ % static_cast<off_t>(kGroupSize))
+    return;
+  if (offset >= offset_ + static_cast<off_t>(kWindowSize)) {
+    window_overrun_ = true;
+    return;
+  }
+  if (type == kPacketTypeData) {
+    if (offset % kPacketDataSize != 0)
+      return;
+    packets_[offset] = packet.substr(kPacketHeaderSize);
+  } else if (type == kPacketTypeParity) {
+    if (offset != group_offset || group_packets == 0 ||
+        group_packets > kGroupPackets ||
+        group_length <= (group_packets - 1) * kPacketDataSize ||
+        group_length > group_packets * kPacketDataSize ||
+        length != min(kPacketDataSize, group_length))
+      return;
+    Parity* parity = &parities_[group_offset];
+    parity->group_packets = group_packets;
+    parity->group_length = group_length;
+    parity->data = packet.substr(kPacketHeaderSize);
+  } else {
+    return;
+  }
+  RecoverGroup(group_offset);
+}
+
+void MulticastFetcher::RecoverGroup(off_t group_offset) {
+  map<off_t, Parity>::iterator parity_it = parities_.find(group_offset);
+  if (parity_it == parities_.end())
+    return;
+  const Parity& parity = parity_it->second;
+  off_t missing_offset = -1;
+  size_t missing_length = 0;
+  string data = parity.data;
+  for (size_t i = 0; i < parity.group_packets; i++) {
+    const off_t offset = group_offset + i * kPacketDataSize;
+    const size_t length = i + 1 < parity.group_packets ? kPacketDataSize :
+        parity.group_length - i * kPacketDataSize;
+    map<off_t, string>::const_iterator packet_it = packets_.find(offset);
+    if (packet_it == packets_.end()) {
+      if (missing_offset >= 0)
+        return;  // Two or more are missing, so far.
+      missing_offset = offset;
+      missing_length = length;
+      continue;
+    }
+    if (packet_it->second.size() != length) {
+      // The packets don't match the parity.
+      parities_.erase(parity_it);
+      return;
+    }
+    XorInto(packet_it->second.data(), length, &data);
+  }
+  if (missing_offset >= 0)
+    packets_[missing_offset] = data.substr(0, missing_length);
+  parities_.erase(parity_it);
+}
+
+void MulticastFetcher::DropDeliveredPackets() {
+  const off_t group_offset = offset_ - offset_ % (kPacketDataSize *
+                                                  kGroupPackets);
+  packets_.erase(packets_.begin(), packets_.lower_bound(group_offset));
+  parities_.erase(parities_.begin(), parities_.lower_bound(group_offset));
+}
+
+bool MulticastFetcher::ReceivesRange() const {
+  return fd_ >= 0 && (has_length_ || payload_size_ > 0);
+}
+
+off_t MulticastFetcher::RangeEnd() const {
+  return has_length_ ? offset_ + length_ : payload_size_;
+}
+
+void MulticastFetcher::Deliver() {
+  if (!active_ || paused_ || fallback_active_ || terminating_)
+    return;
+  const off_t start_offset = offset_;
+  while (active_ && !paused_ && !terminating_) {
+    const off_t end = RangeEnd();
+    if (offset_ >= end) {
+      http_response_code_ = kHttpResponseOk;
+      EndTransfer(false, true);
+      return;
+    }
+    map<off_t, string>::const_iterator it =
+        packets_.find(offset_ - offset_ % kPacketDataSize);
+    if (it == packets_.end())
+      break;
+    const size_t start = offset_ - it->first;
+    if (start >= it->second.size())
+      break;
+    const size_t count = min(it->second.size() - start,
+                             static_cast<size_t>(end - offset_));
+    const char* bytes = it->second.data() + start;
+    offset_ += count;
+    if (has_length_)
+      length_ -= count;
+    bytes_downloaded_ += count;
+    window_overrun_ = false;
+    if (delegate_)
+      delegate_->ReceivedBytes(this, bytes, count);
+    DropDeliveredPackets();
+  }
+  // The delegate may have paused or terminated the transfer.
+  if (!active_ || paused_ || terminating_)
+    return;
+  if (window_overrun_) {
+    // The sender has gone past the missing data already.
+    BeginFallback();
+  } else if (offset_ != start_offset || !gap_source_id_) {
+    UpdateGapTimeout();
+  }
+}
+
+void MulticastFetcher::ScheduleDeliver() {
+  if (!deliver_source_id_)
+    deliver_source_id_ = g_idle_add(&MulticastFetcher::StaticOnDeliver, this);
+}
+
+gboolean MulticastFetcher::StaticOnDeliver(gpointer data) {
+  MulticastFetcher* fetcher = reinterpret_cast<MulticastFetcher*>(data);
+  fetcher->deliver_source_id_ = 0;
+  fetcher->Deliver();
+  return FALSE;  // Don't call this callback again.
+}
+
+void MulticastFetcher::BeginFallback() {
+  if (gap_source_id_) {
+    g_source_remove(gap_source_id_);
+    gap_source_id_ = 0;
+  }
+  off_t end = RangeEnd();
+  map<off_t, string>::const_iterator next = packets_.upper_bound(offset_);
+  if (next != packets_.end())
+    end = min(end, next->first);
+  LOG(INFO) << "Downloading the " << end - offset_ << " bytes at offset "
+            << offset_ << " missed from the multicast group.";
+  fallback_active_ = true;
+  fallback_fetcher_->SetOffset(offset_);
+  fallback_fetcher_->SetLength(end - offset_);
+  fallback_fetcher_->BeginTransfer(url_);
+}
+
+void MulticastFetcher::UpdateGapTimeout() {
+  if (gap_source_id_) {
+    g_source_remove(gap_source_id_);
+    gap_source_id_ = 0;
+  }
+  if (active_ && !paused_ && !fallback_active_ && !terminating_ &&
+      offset_ < RangeEnd()) {
+    gap_source_id_ = g_timeout_add(kGapTimeoutMs,
+                                   &MulticastFetcher::StaticOnGapTimeout,
+                                   this);
+  }
+}
+
+gboolean MulticastFetcher::StaticOnGapTimeout(gpointer data) {
+  MulticastFetcher* fetcher = reinterpret_cast<MulticastFetcher*>(data);
+  fetcher->gap_source_id_ = 0;
+  fetcher->BeginFallback();
+  return FALSE;  // Don't call this callback again.
+}
+
+void MulticastFetcher::EndTransfer(bool terminated, bool successful) {
+  active_ = false;
+  terminating_ = false;
+  if (deliver_source_id_) {
+    g_source_remove(deliver_source_id_);
+    deliver_source_id_ = 0;
+  }
+  if (gap_source_id_) {
+    g_source_remove(gap_source_id_);
+    gap_source_id_ = 0;
+  }
+  // Note that after the callback returns this object may be destroyed.
+  if (!delegate_)
+    return;
+  if (terminated)
+    delegate_->TransferTerminated(this);
+  else
+    delegate_->TransferComplete(this, successful);
+}
+
+gboolean MulticastFetcher::StaticOnTerminated(gpointer data) {
+  MulticastFetcher* fetcher = reinterpret_cast<MulticastFetcher*>(data);
+  fetcher->terminated_source_id_ = 0;
+  fetcher->EndTransfer(true, false);
+  return FALSE;  // Don't call this callback again.
+}
+
+void MulticastFetcher::FallbackDelegate::ReceivedBytes(HttpFetcher* fetcher,
+                                                       const char* bytes,
+                                                       int length) {
+  fetcher_->offset_ += length;
+  if (fetcher_->has_length_)
+    fetcher_->length_ -= min(fetcher_->length_, static_cast<size_t>(length));
+  fetcher_->bytes_downloaded_ += length;
+  fetcher_->DropDeliveredPackets();
+  if (fetcher_->delegate_)
+    fetcher_->delegate_->ReceivedBytes(fetcher_, bytes, length);
+}
+
+void MulticastFetcher::FallbackDelegate::TransferComplete(HttpFetcher* fetcher,
+                                                          bool successful) {
+  fetcher_->fallback_active_ = false;
+  if (fetcher_->terminating_) {
+    fetcher_->EndTransfer(true, false);
+    return;
+  }
+  if (!fetcher_->ReceivesRange() || !successful) {
+    fetcher_->http_response_code_ = fetcher->http_response_code();
+    fetcher_->EndTransfer(false, successful);
+    return;
+  }
+  // Back to the packets of the group.
+  fetcher_->window_overrun_ = false;
+  fetcher_->Deliver();
+}
+
+void MulticastFetcher::FallbackDelegate::TransferTerminated(
+    HttpFetcher* fetcher) {
+  fetcher_->fallback_active_ = false;
+  fetcher_->EndTransfer(true, false);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,214 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_MULTICAST_FETCHER_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_MULTICAST_FETCHER_H__
+
+#include <sys/types.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <base/memory/scoped_ptr.h>
+#include <glib.h>
+
+#include "update_engine/http_fetcher.h"
+
+// An HttpFetcher that receives the payload from a UDP multicast group, to
+// which a sender in the network sends it over and over, so that a rack of
+// machines updating at once costs the server a single stream. The payload
+// is sent in packets of kPacketDataSize bytes at the offsets that are a
+// multiple of it, and every group of up to kGroupPackets of them is followed
+// by a parity packet, the XOR of their data, which makes up for the loss of
+// any one packet of the group. The packets received ahead of the offset
+// being delivered are kept, up to kWindowSize bytes of them, so the
+// delegate gets the data in order. The parts of a range that can't be
+// received, because their packets were lost or went by before the fetcher
+// joined, are downloaded with the fallback fetcher from the URL passed to
+// BeginTransfer(). The data is checked by the payload's own hashes, like
+// any download.
+
+namespace chromeos_update_engine {
+
+class MulticastFetcher : public HttpFetcher {
+ public:
+  // The payload bytes in a packet and the packets in a parity group.
+  static const size_t kPacketDataSize;
+  static const size_t kGroupPackets;
+
+  // The most bytes of packets kept ahead of the offset being delivered.
+  static const size_t kWindowSize;
+
+  // The port the payloads are sent to unless told otherwise.
+  static const int kDefaultPort;
+
+  // How long delivery may stall before the missing data is downloaded with
+  // the fallback fetcher.
+  static const int kGapTimeoutMs;
+
+  // Receives from |group|, an IPv4 multicast address, or a unicast one for
+  // testing, on |port|, and downloads the rest with |fallback_fetcher|,
+  // which it takes ownership of.
+  MulticastFetcher(SystemState* system_state,
+                   const std::string& group,
+                   int port,
+                   HttpFetcher* fallback_fetcher);
+  virtual ~MulticastFetcher();
+
+  // Joins the group. Returns false if that fails, in which case the ranges
+  // are all downloaded with the fallback fetcher. Called by the first
+  // BeginTransfer() otherwise.
+  bool Listen();
+
+  // Returns the port listened on, once listening.
+  int port() const { return port_; }
+
+  // Sets the size of the payload, where the ranges without a length end.
+  // Those are downloaded with the fallback fetcher while it's 0, the
+  // default.
+  void set_payload_size(off_t payload_size) { payload_size_ = payload_size; }
+
+  virtual void SetOffset(off_t offset);
+  virtual void SetLength(size_t length);
+  virtual void UnsetLength();
+
+  // Receives the range set last, downloading what's missing from |url|.
+  virtual void BeginTransfer(const std::string& url);
+
+  virtual void TerminateTransfer();
+  virtual void Pause();
+  virtual void Unpause();
+
+  virtual void set_retry_seconds(int seconds) {
+    fallback_fetcher_->set_retry_seconds(seconds);
+  }
+  virtual void SetBuildType(bool is_official) {
+    fallback_fetcher_->SetBuildType(is_official);
+  }
+
+  virtual size_t GetBytesDownloaded() { return bytes_downloaded_; }
+  virtual int GetRetryCount() { return fallback_fetcher_->GetRetryCount(); }
+
+  // Splits the |length| bytes of |data| at |offset| of the payload, which
+  // must start a parity group, i.e. be a multiple of kPacketDataSize *
+  // kGroupPackets, into the data and parity packets a sender sends, which
+  // are appended to |packets| in order.
+  static void EncodePackets(off_t offset,
+                            const char* data,
+                            size_t length,
+                            std::vector<std::string>* packets);
+
+ private:
+  // Passes the fallback fetcher's data on and resumes receiving once it's
+  // done.
+  class FallbackDelegate : public HttpFetcherDelegate {
+   public:
+    explicit FallbackDelegate(MulticastFetcher* fetcher) : fetcher_(fetcher) {}
+    virtual void ReceivedBytes(HttpFetcher* fetcher,
+                               const char* bytes,
+                               int length);
+    virtual void TransferComplete(HttpFetcher* fetcher, bool successful);
+    virtual void TransferTerminated(HttpFetcher* fetcher);
+
+   private:
+    MulticastFetcher* fetcher_;
+  };
+
+  // A parity packet of a group some of whose data packets are missing.
+  struct Parity {
+    size_t group_packets;
+    size_t group_length;
+    std::string data;
+  };
+
+  static gboolean StaticOnReadable(GIOChannel* source,
+                                   GIOCondition condition,
+                                   gpointer data);
+  void OnReadable();
+
+  // Keeps the packet |packet| if it's in the window, and recovers the
+  // missing packet of its group if it can.
+  void AddPacket(const std::string& packet);
+  void RecoverGroup(off_t group_offset);
+
+  // Drops the packets of the groups before the one of the offset being
+  // delivered. The ones of its group are kept for recovering the others.
+  void DropDeliveredPackets();
+
+  // Returns true if the range is received from the group, and false if it's
+  // all downloaded with the fallback fetcher.
+  bool ReceivesRange() const;
+
+  // Passes the data at the offset being delivered on, as long as it's
+  // there, and then completes the range, or waits for what's missing.
+  void Deliver();
+  void ScheduleDeliver();
+  static gboolean StaticOnDeliver(gpointer data);
+
+  // Downloads the data from the offset being delivered up to the next
+  // packet received, or the end of the range, with the fallback fetcher.
+  void BeginFallback();
+
+  // Removes the gap timeout, if any, and adds one if delivery is stalled.
+  void UpdateGapTimeout();
+  static gboolean StaticOnGapTimeout(gpointer data);
+
+  // Ends the transfer, telling the delegate it's complete or, if
+  // |terminated|, that it was terminated.
+  void EndTransfer(bool terminated, bool successful);
+  static gboolean StaticOnTerminated(gpointer data);
+
+  // Returns where the range being received ends.
+  off_t RangeEnd() const;
+
+  std::string group_;
+  int port_;
+  scoped_ptr<HttpFetcher> fallback_fetcher_;
+  FallbackDelegate fallback_delegate_;
+
+  // The socket, once listening, and its main loop watch.
+  int fd_;
+  GIOChannel* channel_;
+  guint watch_id_;
+  // True once Listen() has failed.
+  bool listen_failed_;
+
+  off_t payload_size_;
+
+  // The next offset delivered and, if |has_length_|, the bytes left in the
+  // range.
+  off_t offset_;
+  bool has_length_;
+  size_t length_;
+
+  std::string url_;
+  bool active_;
+  bool paused_;
+  // True while the fallback fetcher downloads a gap, or the whole range.
+  bool fallback_active_;
+  bool terminating_;
+
+  // The data packets of the group of |offset_| and past it received so far,
+  // by offset, and the parity packets of their groups, by the offset of the
+  // group.
+  std::map<off_t, std::string> packets_;
+  std::map<off_t, Parity> parities_;
+  // Set when a packet past the window is received, which means the missing
+  // data before it won't come before the sender is around again.
+  bool window_overrun_;
+
+  // The main loop sources, or 0.
+  guint deliver_source_id_;
+  guint gap_source_id_;
+  guint terminated_source_id_;
+
+  size_t bytes_downloaded_;
+
+  DISALLOW_COPY_AND_ASSIGN(MulticastFetcher);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_MULTICAST_FETCHER_H__
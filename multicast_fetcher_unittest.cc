@@ -0,0 +1,195 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include <base/memory/scoped_ptr.h>
+#include <glib.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/file_fetcher.h"
+#include "update_engine/mock_system_state.h"
+#include "update_engine/multicast_fetcher.h"
+#include "update_engine/test_utils.h"
+#include "update_engine/utils.h"
+
+using std::set;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+class MulticastFetcherTestDelegate : public HttpFetcherDelegate {
+ public:
+  MulticastFetcherTestDelegate()
+      : loop_(g_main_loop_new(g_main_context_default(), FALSE)),
+        completed_(false),
+        successful_(false) {}
+  ~MulticastFetcherTestDelegate() {
+    g_main_loop_unref(loop_);
+  }
+
+  virtual void ReceivedBytes(HttpFetcher* fetcher,
+                             const char* bytes,
+                             int length) {
+    data_.insert(data_.end(), bytes, bytes + length);
+  }
+
+  virtual void TransferComplete(HttpFetcher* fetcher, bool successful) {
+    completed_ = true;
+    successful_ = successful;
+    g_main_loop_quit(loop_);
+  }
+
+  virtual void TransferTerminated(HttpFetcher* fetcher) {
+    ADD_FAILURE();
+    g_main_loop_quit(loop_);
+  }
+
+  void Run(HttpFetcher* fetcher) {
+    fetcher->set_delegate(this);
+    fetcher->BeginTransfer("");
+    g_main_loop_run(loop_);
+  }
+
+  GMainLoop* loop_;
+  vector<char> data_;
+  bool completed_;
+  bool successful_;
+};
+}  // namespace {}
+
+class MulticastFetcherTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    // Four parity groups and a partial one, which ends with a 10 byte
+    // packet.
+    data_.resize(MulticastFetcher::kPacketDataSize *
+                 MulticastFetcher::kGroupPackets * 9 / 2 + 10);
+    FillWithData(&data_);
+    ASSERT_TRUE(utils::MakeTempFile("/tmp/MulticastFetcherTest.XXXXXX",
+                                    &path_, NULL));
+  }
+
+  virtual void TearDown() {
+    unlink(path_.c_str());
+  }
+
+  // Returns a fetcher receiving from the loopback address, which falls back
+  // to reading |fallback_data| from a file.
+  MulticastFetcher* NewFetcher(const vector<char>& fallback_data) {
+    EXPECT_TRUE(utils::WriteFile(path_.c_str(), &fallback_data[0],
+                                 fallback_data.size()));
+    int fd = open(path_.c_str(), O_RDONLY);
+    EXPECT_GE(fd, 0);
+    MulticastFetcher* fetcher = new MulticastFetcher(
+        &mock_system_state_, "127.0.0.1", 0,
+        new FileFetcher(&mock_system_state_, fd));
+    EXPECT_TRUE(fetcher->Listen());
+    EXPECT_GT(fetcher->port(), 0);
+    return fetcher;
+  }
+
+  // Sends the packets of the payload to |fetcher|, but for the ones whose
+  // index is in |dropped|.
+  void SendPackets(MulticastFetcher* fetcher, const set<size_t>& dropped) {
+    vector<string> packets;
+    MulticastFetcher::EncodePackets(0, &data_[0], data_.size(), &packets);
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    ASSERT_GE(fd, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(fetcher->port());
+    for (size_t i = 0; i < packets.size(); i++) {
+      if (dropped.count(i))
+        continue;
+      EXPECT_EQ(static_cast<ssize_t>(packets[i].size()),
+                sendto(fd, packets[i].data(), packets[i].size(), 0,
+                       reinterpret_cast<struct sockaddr*>(&addr),
+                       sizeof(addr)));
+    }
+    close(fd);
+  }
+
+  MockSystemState mock_system_state_;
+  string path_;
+  vector<char> data_;
+};
+
+TEST_F(MulticastFetcherTest, EncodeTest) {
+  vector<string> packets;
+  MulticastFetcher::EncodePackets(0, &data_[0], data_.size(), &packets);
+  // 73 data packets and a parity packet per group of up to 16.
+  EXPECT_EQ(73U + 5U, packets.size());
+}
+
+TEST_F(MulticastFetcherTest, ParityTest) {
+  // The fallback file's data is wrong, so using it fails the test.
+  scoped_ptr<MulticastFetcher> fetcher(
+      NewFetcher(vector<char>(data_.size(), 'x')));
+  // A packet lost in each group, the first, a middle and the last one.
+  const size_t kGroup = MulticastFetcher::kGroupPackets + 1;
+  set<size_t> dropped;
+  dropped.insert(0);
+  dropped.insert(kGroup + 7);
+  dropped.insert(2 * kGroup + 15);
+  dropped.insert(4 * kGroup + 8);  // the last data packet
+  SendPackets(fetcher.get(), dropped);
+  const off_t kOffset = 100;
+  fetcher->SetOffset(kOffset);
+  fetcher->SetLength(data_.size() - kOffset);
+  MulticastFetcherTestDelegate delegate;
+  delegate.Run(fetcher.get());
+  EXPECT_TRUE(delegate.successful_);
+  EXPECT_TRUE(delegate.data_ == vector<char>(data_.begin() + kOffset,
+                                             data_.end()));
+  EXPECT_EQ(data_.size() - kOffset, fetcher->GetBytesDownloaded());
+}
+
+TEST_F(MulticastFetcherTest, FallbackTest) {
+  scoped_ptr<MulticastFetcher> fetcher(NewFetcher(data_));
+  // Two packets lost in a group, which takes the fallback fetcher.
+  const size_t kGroup = MulticastFetcher::kGroupPackets + 1;
+  set<size_t> dropped;
+  dropped.insert(kGroup + 3);
+  dropped.insert(kGroup + 4);
+  SendPackets(fetcher.get(), dropped);
+  // The range without a length ends with the payload.
+  fetcher->set_payload_size(data_.size());
+  fetcher->SetOffset(0);
+  fetcher->UnsetLength();
+  MulticastFetcherTestDelegate delegate;
+  delegate.Run(fetcher.get());
+  EXPECT_TRUE(delegate.successful_);
+  EXPECT_TRUE(delegate.data_ == data_);
+}
+
+TEST_F(MulticastFetcherTest, UnknownSizeTest) {
+  // Without the payload size, an open-ended range is all downloaded with
+  // the fallback fetcher.
+  scoped_ptr<MulticastFetcher> fetcher(NewFetcher(data_));
+  const off_t kOffset = 10;
+  fetcher->SetOffset(kOffset);
+  fetcher->UnsetLength();
+  MulticastFetcherTestDelegate delegate;
+  delegate.Run(fetcher.get());
+  EXPECT_TRUE(delegate.successful_);
+  EXPECT_EQ(kHttpResponseOk, fetcher->http_response_code());
+  EXPECT_TRUE(delegate.data_ == vector<char>(data_.begin() + kOffset,
+                                             data_.end()));
+}
+
+}  // namespace chromeos_update_engine
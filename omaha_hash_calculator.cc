@@ -6,15 +6,21 @@
 
 #include <fcntl.h>
 
+#include <algorithm>
+#include <tr1/memory>
+
 #include <base/logging.h>
 #include <base/posix/eintr_wrapper.h>
 #include <openssl/bio.h>
 #include <openssl/buffer.h>
 #include <openssl/evp.h>
 
+#include "update_engine/thread_pool.h"
 #include "update_engine/utils.h"
 
+using std::max;
 using std::string;
+using std::tr1::shared_ptr;
 using std::vector;
 
 namespace chromeos_update_engine {
@@ -208,6 +214,93 @@ off_t OmahaHashCalculator::RawHashOfFile(const string& name, off_t length,
   return res;
 }
 
+namespace {
+
+// Hashes the buffers [begin, end) passed to RawHashesOfBytes().
+class HashBuffersTask : public ThreadPoolTask {
+ public:
+  HashBuffersTask(OmahaHashCalculator::HashFunction hash_function,
+                  const vector<const char*>& data,
+                  const vector<size_t>& lengths,
+                  size_t begin,
+                  size_t end,
+                  vector<vector<char> >* out_hashes)
+      : hash_function_(hash_function),
+        data_(data),
+        lengths_(lengths),
+        begin_(begin),
+        end_(end),
+        out_hashes_(out_hashes) {}
+
+  virtual bool Run() {
+    for (size_t i = begin_; i < end_; i++) {
+      TEST_AND_RETURN_FALSE(hash_function_(data_[i], lengths_[i],
+                                           &(*out_hashes_)[i]));
+    }
+    return true;
+  }
+
+ private:
+  const OmahaHashCalculator::HashFunction hash_function_;
+  const vector<const char*>& data_;
+  const vector<size_t>& lengths_;
+  const size_t begin_;
+  const size_t end_;
+  vector<vector<char> >* out_hashes_;
+
+  DISALLOW_COPY_AND_ASSIGN(HashBuffersTask);
+};
+
+}  // namespace {}
+
+bool OmahaHashCalculator::RawHashesOfBytes(const vector<const char*>& data,
+                                           const vector<size_t>& lengths,
+                                           ThreadPool* pool,
+                                           vector<vector<char> >* out_hashes) {
+  return HashesOfBytes(&OmahaHashCalculator::RawHashOfBytes, data, lengths,
+                       pool, out_hashes);
+}
+
+bool OmahaHashCalculator::HashesOfBytes(HashFunction hash_function,
+                                        const vector<const char*>& data,
+                                        const vector<size_t>& lengths,
+                                        ThreadPool* pool,
+                                        vector<vector<char> >* out_hashes) {
+  TEST_AND_RETURN_FALSE(data.size() == lengths.size());
+  out_hashes->assign(data.size(), vector<char>());
+  if (!pool) {
+    return HashBuffersTask(hash_function, data, lengths, 0, data.size(),
+                           out_hashes).Run();
+  }
+
+  // Each task takes a run of consecutive buffers of about the same number
+  // of bytes, a few per worker so that one large buffer doesn't leave the
+  // other workers idle.
+  uint64_t total_bytes = 0;
+  for (size_t i = 0; i < lengths.size(); i++)
+    total_bytes += lengths[i];
+  const uint64_t task_bytes =
+      max<uint64_t>(total_bytes / (4 * pool->num_threads()), 1);
+  vector<shared_ptr<HashBuffersTask> > tasks;
+  size_t begin = 0;
+  uint64_t bytes = 0;
+  for (size_t i = 0; i < data.size(); i++) {
+    bytes += lengths[i];
+    if (bytes < task_bytes && i + 1 < data.size())
+      continue;
+    tasks.push_back(shared_ptr<HashBuffersTask>(
+        new HashBuffersTask(hash_function, data, lengths, begin, i + 1,
+                            out_hashes)));
+    pool->Submit(tasks.back().get());
+    begin = i + 1;
+    bytes = 0;
+  }
+  bool success = true;
+  for (size_t i = 0; i < tasks.size(); i++)
+    success = pool->Wait(tasks[i].get()) && success;
+  return success;
+}
+
 string OmahaHashCalculator::OmahaHashOfBytes(
     const void* data, size_t length) {
   OmahaHashCalculator calc;
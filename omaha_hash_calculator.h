@@ -21,6 +21,8 @@
 
 namespace chromeos_update_engine {
 
+class ThreadPool;
+
 class OmahaHashCalculator {
  public:
   OmahaHashCalculator();
@@ -69,6 +71,26 @@ class OmahaHashCalculator {
   static off_t RawHashOfFile(const std::string& name, off_t length,
                              std::vector<char>* out_hash);
 
+  // Hashes several independent buffers at once: the |lengths[i]| bytes at
+  // |data[i]| hash into |(*out_hashes)[i]|. The buffers are spread over the
+  // workers of |pool|, or hashed on the calling thread if |pool| is NULL.
+  // Returns true on success.
+  static bool RawHashesOfBytes(const std::vector<const char*>& data,
+                               const std::vector<size_t>& lengths,
+                               ThreadPool* pool,
+                               std::vector<std::vector<char> >* out_hashes);
+
+  // Like RawHashesOfBytes(), but hashes each buffer with |hash_function|,
+  // e.g., blake3::RawHashOfBytes().
+  typedef bool (*HashFunction)(const char* data,
+                               size_t length,
+                               std::vector<char>* out_hash);
+  static bool HashesOfBytes(HashFunction hash_function,
+                            const std::vector<const char*>& data,
+                            const std::vector<size_t>& lengths,
+                            ThreadPool* pool,
+                            std::vector<std::vector<char> >* out_hashes);
+
   // Used by tests
   static std::string OmahaHashOfBytes(const void* data, size_t length);
   static std::string OmahaHashOfString(const std::string& str);
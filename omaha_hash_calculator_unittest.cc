@@ -5,16 +5,22 @@
 #include <math.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <string>
 #include <vector>
 
+#include <base/time.h>
 #include <glib.h>
 #include <gtest/gtest.h>
 
 #include "update_engine/libcurl_http_fetcher.h"
 #include "update_engine/omaha_hash_calculator.h"
+#include "update_engine/thread_pool.h"
 #include "update_engine/utils.h"
 
+using base::TimeDelta;
+using base::TimeTicks;
+using std::max;
 using std::string;
 using std::vector;
 
@@ -143,6 +149,81 @@ TEST_F(OmahaHashCalculatorTest, RawHashOfFileSimpleTest) {
   }
 }
 
+TEST_F(OmahaHashCalculatorTest, RawHashesOfBytesTest) {
+  const size_t kLengths[] = { 2, 0, 100000, 1, 4096, 2 };
+  string contents;
+  vector<const char*> data;
+  vector<size_t> lengths(kLengths, kLengths + arraysize(kLengths));
+  for (size_t i = 0; i < lengths.size(); i++)
+    contents.append(lengths[i], 'a' + i);
+  const char* next = contents.data();
+  for (size_t i = 0; i < lengths.size(); i++) {
+    data.push_back(next);
+    next += lengths[i];
+  }
+  data[0] = "hi";
+
+  ThreadPool pool(3);
+  ASSERT_TRUE(pool.Init());
+  ThreadPool* const kPools[] = { NULL, &pool };
+  for (size_t i = 0; i < arraysize(kPools); i++) {
+    vector<vector<char> > hashes;
+    EXPECT_TRUE(OmahaHashCalculator::RawHashesOfBytes(data, lengths,
+                                                      kPools[i], &hashes));
+    ASSERT_EQ(lengths.size(), hashes.size());
+    EXPECT_TRUE(vector<char>(kExpectedRawHash, kExpectedRawHashEnd) ==
+                hashes[0]);
+    for (size_t j = 0; j < lengths.size(); j++) {
+      vector<char> hash;
+      EXPECT_TRUE(OmahaHashCalculator::RawHashOfBytes(data[j], lengths[j],
+                                                      &hash));
+      EXPECT_TRUE(hash == hashes[j]) << "buffer " << j;
+    }
+  }
+
+  vector<vector<char> > hashes(1);
+  EXPECT_TRUE(OmahaHashCalculator::RawHashesOfBytes(vector<const char*>(),
+                                                    vector<size_t>(),
+                                                    &pool,
+                                                    &hashes));
+  EXPECT_TRUE(hashes.empty());
+  lengths.pop_back();
+  EXPECT_FALSE(OmahaHashCalculator::RawHashesOfBytes(data, lengths, &pool,
+                                                     &hashes));
+}
+
+TEST_F(OmahaHashCalculatorTest, RawHashesOfBytesThroughputTest) {
+  // Logs how fast operation-sized blobs are hashed one at a time and on a
+  // pool of one worker per CPU.
+  const size_t kBufferCount = 64;
+  const size_t kBufferSize = 512 * 1024;
+  vector<char> contents(kBufferCount * kBufferSize);
+  for (size_t i = 0; i < contents.size(); i++)
+    contents[i] = i * 7 + i / kBufferSize;
+  vector<const char*> data;
+  vector<size_t> lengths(kBufferCount, kBufferSize);
+  for (size_t i = 0; i < kBufferCount; i++)
+    data.push_back(&contents[i * kBufferSize]);
+
+  ThreadPool pool(0);
+  ASSERT_TRUE(pool.Init());
+  ThreadPool* const kPools[] = { NULL, &pool };
+  vector<vector<char> > hashes[arraysize(kPools)];
+  for (size_t i = 0; i < arraysize(kPools); i++) {
+    const TimeTicks start = TimeTicks::Now();
+    EXPECT_TRUE(OmahaHashCalculator::RawHashesOfBytes(data, lengths,
+                                                      kPools[i],
+                                                      &hashes[i]));
+    const TimeDelta elapsed = TimeTicks::Now() - start;
+    LOG(INFO) << "Hashed " << contents.size() << " bytes on "
+              << (kPools[i] ? kPools[i]->num_threads() : 1) << " threads at "
+              << contents.size() / 1048576.0 /
+                 max(elapsed.InSecondsF(), 1e-6)
+              << " MB/s";
+  }
+  EXPECT_TRUE(hashes[0] == hashes[1]);
+}
+
 TEST_F(OmahaHashCalculatorTest, UpdateFileNonexistentTest) {
   OmahaHashCalculator calc;
   EXPECT_EQ(-1, calc.UpdateFile("/some/non-existent/file", -1));
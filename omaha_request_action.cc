@@ -6,6 +6,7 @@
 
 #include <inttypes.h>
 
+#include <algorithm>
 #include <sstream>
 #include <string>
 
@@ -15,22 +16,27 @@
 #include <base/string_util.h>
 #include <base/stringprintf.h>
 #include <base/time.h>
-#include <libxml/xpath.h>
-#include <libxml/xpathInternals.h>
+#include <libxml/parser.h>
 
 #include "update_engine/action_pipe.h"
+#include "update_engine/memory_tracker.h"
 #include "update_engine/omaha_request_params.h"
+#include "update_engine/omaha_response_parser.h"
 #include "update_engine/payload_state_interface.h"
 #include "update_engine/prefs_interface.h"
+#include "update_engine/transfer_stats.h"
+#include "update_engine/update_duration_estimator.h"
 #include "update_engine/utils.h"
 
 using base::Time;
 using base::TimeDelta;
 using std::string;
+using std::vector;
 
 namespace chromeos_update_engine {
 
 // List of custom pair tags that we interpret in the Omaha Response:
+static const char* kTagApplyBytes = "ApplyBytes";
 static const char* kTagDeadline = "deadline";
 static const char* kTagDisablePayloadBackoff = "DisablePayloadBackoff";
 static const char* kTagDisplayVersion = "DisplayVersion";
@@ -54,32 +60,21 @@ const string kGupdateVersion("CoreOSUpdateEngine-0.1.0.0");
 // This is handy for passing strings into libxml2
 #define ConstXMLStr(x) (reinterpret_cast<const xmlChar*>(x))
 
-// These are for scoped_ptr_malloc, which is like scoped_ptr, but allows
+// This is for scoped_ptr_malloc, which is like scoped_ptr, but allows
 // a custom free() function to be specified.
-class ScopedPtrXmlDocFree {
- public:
-  inline void operator()(void* x) const {
-    xmlFreeDoc(reinterpret_cast<xmlDoc*>(x));
-  }
-};
 class ScopedPtrXmlFree {
  public:
   inline void operator()(void* x) const {
     xmlFree(x);
   }
 };
-class ScopedPtrXmlXPathObjectFree {
- public:
-  inline void operator()(void* x) const {
-    xmlXPathFreeObject(reinterpret_cast<xmlXPathObject*>(x));
-  }
-};
-class ScopedPtrXmlXPathContextFree {
- public:
-  inline void operator()(void* x) const {
-    xmlXPathFreeContext(reinterpret_cast<xmlXPathContext*>(x));
-  }
-};
+
+// The paths of the elements in the response that are looked at.
+const char kUpdateCheckPath[] = "/response/app/updatecheck";
+const char kUrlPath[] = "/response/app/updatecheck/urls/url";
+const char kPackagePath[] =
+    "/response/app/updatecheck/manifest/packages/package";
+const char kActionPath[] = "/response/app/updatecheck/manifest/actions/action";
 
 // Returns an XML ping element if any of the elapsed days need to be
 // sent, or an empty string otherwise.
@@ -87,9 +82,24 @@ string GetPingXml(int ping_active_days, int ping_roll_call_days) {
   return StringPrintf("        <ping active=\"1\"></ping>\n");
 }
 
+// Returns the XML <event> element that reports |event|.
+string GetEventXml(const OmahaEvent& event) {
+  // The error code is an optional attribute so append it only if the result
+  // is not success.
+  string error_code;
+  if (event.result != OmahaEvent::kResultSuccess) {
+    error_code = StringPrintf(" errorcode=\"%d\"", event.error_code);
+  }
+  return StringPrintf(
+      "        <event eventtype=\"%d\" eventresult=\"%d\"%s></event>\n",
+      event.type, event.result, error_code.c_str());
+}
+
 // Returns an XML that goes into the body of the <app> element of the Omaha
-// request based on the given parameters.
+// request based on the given parameters. The |queued_events| are reported
+// after the |event| or update check the request is made for.
 string GetAppBody(const OmahaEvent* event,
+                  const vector<OmahaEvent>& queued_events,
                   const OmahaRequestParams& params,
                   bool ping_only,
                   int ping_active_days,
@@ -131,15 +141,11 @@ string GetAppBody(const OmahaEvent* event,
           << "Unable to reset the previous version.";
     }
   } else {
-    // The error code is an optional attribute so append it only if the result
-    // is not success.
-    string error_code;
-    if (event->result != OmahaEvent::kResultSuccess) {
-      error_code = StringPrintf(" errorcode=\"%d\"", event->error_code);
-    }
-    app_body = StringPrintf(
-        "        <event eventtype=\"%d\" eventresult=\"%d\"%s></event>\n",
-        event->type, event->result, error_code.c_str());
+    app_body = GetEventXml(*event);
+  }
+  for (vector<OmahaEvent>::const_iterator it = queued_events.begin();
+       it != queued_events.end(); ++it) {
+    app_body += GetEventXml(*it);
   }
 
   return app_body;
@@ -148,13 +154,15 @@ string GetAppBody(const OmahaEvent* event,
 // Returns an XML that corresponds to the entire <app> node of the Omaha
 // request based on the given parameters.
 string GetAppXml(const OmahaEvent* event,
+                 const vector<OmahaEvent>& queued_events,
                  const OmahaRequestParams& params,
                  bool ping_only,
                  int ping_active_days,
                  int ping_roll_call_days,
                  SystemState* system_state) {
-  string app_body = GetAppBody(event, params, ping_only, ping_active_days,
-                               ping_roll_call_days, system_state->prefs());
+  string app_body = GetAppBody(event, queued_events, params, ping_only,
+                               ping_active_days, ping_roll_call_days,
+                               system_state->prefs());
 
   string delta_okay_str = params.delta_okay() ? "true" : "false";
 
@@ -192,14 +200,16 @@ string GetOsXml(const OmahaRequestParams& params) {
 // Returns an XML that corresponds to the entire Omaha request based on the
 // given parameters.
 string GetRequestXml(const OmahaEvent* event,
+                     const vector<OmahaEvent>& queued_events,
                      const OmahaRequestParams& params,
                      bool ping_only,
                      int ping_active_days,
                      int ping_roll_call_days,
                      SystemState* system_state) {
   string os_xml = GetOsXml(params);
-  string app_xml = GetAppXml(event, params, ping_only, ping_active_days,
-                             ping_roll_call_days, system_state);
+  string app_xml = GetAppXml(event, queued_events, params, ping_only,
+                             ping_active_days, ping_roll_call_days,
+                             system_state);
 
   string install_source = StringPrintf("installsource=\"%s\" ",
       (params.interactive() ? "ondemandupdate" : "scheduler"));
@@ -244,8 +254,10 @@ OmahaRequestAction::OmahaRequestAction(SystemState* system_state,
       event_(event),
       http_fetcher_(http_fetcher),
       ping_only_(ping_only),
+      event_queue_(NULL),
       ping_active_days_(0),
-      ping_roll_call_days_(0) {
+      ping_roll_call_days_(0),
+      transfer_stats_(TransferStats::Get()) {
   params_ = system_state->request_params();
 }
 
@@ -253,15 +265,38 @@ OmahaRequestAction::~OmahaRequestAction() {}
 
 void OmahaRequestAction::PerformAction() {
   http_fetcher_->set_delegate(this);
+  // The queued events go out with this request, whatever becomes of it,
+  // since events are best effort anyway.
+  vector<OmahaEvent> queued_events;
+  if (event_queue_)
+    queued_events.swap(*event_queue_);
   string request_post(GetRequestXml(event_.get(),
+                                    queued_events,
                                     *params_,
                                     ping_only_,
                                     ping_active_days_,
                                     ping_roll_call_days_,
                                     system_state_));
 
+  response_parser_.reset(new OmahaResponseParser);
+  response_parser_->CollectElements(kUpdateCheckPath);
+  response_parser_->CollectElements(kUrlPath);
+  response_parser_->CollectElements(kPackagePath);
+  response_parser_->CollectElements(kActionPath);
+
   http_fetcher_->SetPostData(request_post.data(), request_post.size(),
                              kHttpContentTypeTextXml);
+  // Servers that don't compress responses ignore the Accept-Encoding header,
+  // but a compressed request must be known to be supported.
+  http_fetcher_->set_compress_post_data(params_->compress_requests());
+  http_fetcher_->set_accept_compressed_response(true);
+  // An update check after one answered with no update asks the server to
+  // just say nothing changed, which skips sending and parsing the response.
+  string etag;
+  if (!IsEvent() && !ping_only_ &&
+      system_state_->prefs()->GetString(kPrefsNoUpdateResponseETag, &etag)) {
+    http_fetcher_->set_if_none_match(etag);
+  }
   LOG(INFO) << "Posting an Omaha request to " << params_->update_url();
   LOG(INFO) << "Request: " << request_post;
   http_fetcher_->BeginTransfer(params_->update_url());
@@ -271,54 +306,28 @@ void OmahaRequestAction::TerminateProcessing() {
   http_fetcher_->TerminateTransfer();
 }
 
-// We just store the response in the buffer. Once we've received all bytes,
-// we'll look in the buffer and decide what to do.
+// We parse the response as it comes in, and also store it in the buffer for
+// logging. Once we've received all bytes, we'll look at what the parser
+// found and decide what to do.
 void OmahaRequestAction::ReceivedBytes(HttpFetcher *fetcher,
                                        const char* bytes,
                                        int length) {
   response_buffer_.reserve(response_buffer_.size() + length);
   response_buffer_.insert(response_buffer_.end(), bytes, bytes + length);
+  MemoryTracker::SetBufferSize("omaha_response", response_buffer_.capacity());
+  if (response_parser_.get())
+    response_parser_->Parse(bytes, length);
 }
 
 namespace {
-// If non-NULL response, caller is responsible for calling xmlXPathFreeObject()
-// on the returned object.
-// This code is roughly based on the libxml tutorial at:
-// http://xmlsoft.org/tutorial/apd.html
-xmlXPathObject* GetNodeSet(xmlDoc* doc, const xmlChar* xpath) {
-  xmlXPathObject* result = NULL;
-
-  scoped_ptr_malloc<xmlXPathContext, ScopedPtrXmlXPathContextFree> context(
-      xmlXPathNewContext(doc));
-  if (!context.get()) {
-    LOG(ERROR) << "xmlXPathNewContext() returned NULL";
-    return NULL;
-  }
-
-  result = xmlXPathEvalExpression(xpath, context.get());
-  if (result == NULL) {
-    LOG(ERROR) << "Unable to find " << xpath << " in XML document";
-    return NULL;
-  }
-  if(xmlXPathNodeSetIsEmpty(result->nodesetval)){
-    LOG(INFO) << "Nodeset is empty for " << xpath;
-    xmlXPathFreeObject(result);
-    return NULL;
-  }
-  return result;
-}
-
-// Returns the string value of a named attribute on a node, or empty string
-// if no such node exists. If the attribute exists and has a value of
-// empty string, there's no way to distinguish that from the attribute
-// not existing.
-string XmlGetProperty(xmlNode* node, const char* name) {
-  if (!xmlHasProp(node, ConstXMLStr(name)))
-    return "";
-  scoped_ptr_malloc<xmlChar, ScopedPtrXmlFree> str(
-      xmlGetProp(node, ConstXMLStr(name)));
-  string ret(reinterpret_cast<const char *>(str.get()));
-  return ret;
+// Returns the string value of a named attribute of an element, or empty
+// string if the element has no such attribute. If the attribute exists and
+// has a value of empty string, there's no way to distinguish that from the
+// attribute not existing.
+string XmlGetProperty(const OmahaResponseParser::Attributes& element,
+                      const char* name) {
+  OmahaResponseParser::Attributes::const_iterator it = element.find(name);
+  return it == element.end() ? "" : it->second;
 }
 
 // Parses a 64 bit base-10 int from a string and returns it. Returns 0
@@ -336,22 +345,17 @@ off_t ParseInt(const string& str) {
 
 }  // namespace {}
 
-bool OmahaRequestAction::ParseResponse(xmlDoc* doc,
+bool OmahaRequestAction::ParseResponse(const OmahaResponseParser& parser,
                                        OmahaResponse* output_object,
                                        ScopedActionCompleter* completer) {
-  static const char* kUpdatecheckNodeXpath("/response/app/updatecheck");
-
-  scoped_ptr_malloc<xmlXPathObject, ScopedPtrXmlXPathObjectFree>
-      xpath_nodeset(GetNodeSet(doc, ConstXMLStr(kUpdatecheckNodeXpath)));
-  if (!xpath_nodeset.get()) {
+  const vector<OmahaResponseParser::Attributes>& update_checks =
+      parser.Elements(kUpdateCheckPath);
+  if (update_checks.empty()) {
+    LOG(ERROR) << "Unable to find " << kUpdateCheckPath << " in the response";
     completer->set_code(kActionCodeOmahaResponseInvalid);
     return false;
   }
-
-  xmlNodeSet* nodeset = xpath_nodeset->nodesetval;
-  CHECK(nodeset) << "XPath missing UpdateCheck NodeSet";
-  CHECK_GE(nodeset->nodeNr, 1);
-  xmlNode* update_check_node = nodeset->nodeTab[0];
+  const OmahaResponseParser::Attributes& update_check = update_checks[0];
 
   // chromium-os:37289: The PollInterval is not supported by Omaha server
   // currently.  But still keeping this existing code in case we ever decide to
@@ -367,21 +371,21 @@ bool OmahaRequestAction::ParseResponse(xmlDoc* doc,
   // account.  Note: The parsing for PollInterval happens even before parsing
   // of the status because we may want to specify the PollInterval even when
   // there's no update.
-  base::StringToInt(XmlGetProperty(update_check_node, "PollInterval"),
+  base::StringToInt(XmlGetProperty(update_check, "PollInterval"),
                     &output_object->poll_interval);
 
-  if (!ParseStatus(update_check_node, output_object, completer))
+  if (!ParseStatus(update_check, output_object, completer))
     return false;
 
   // Note: ParseUrls MUST be called before ParsePackage as ParsePackage
   // appends the package name to the URLs populated in this method.
-  if (!ParseUrls(doc, output_object, completer))
+  if (!ParseUrls(parser, output_object, completer))
     return false;
 
-  if (!ParsePackage(doc, output_object, completer))
+  if (!ParsePackage(parser, output_object, completer))
     return false;
 
-  if (!ParseParams(doc, output_object, completer))
+  if (!ParseParams(parser, output_object, completer))
     return false;
 
   output_object->update_exists = true;
@@ -391,20 +395,53 @@ bool OmahaRequestAction::ParseResponse(xmlDoc* doc,
   return true;
 }
 
-bool OmahaRequestAction::ParseStatus(xmlNode* update_check_node,
-                                     OmahaResponse* output_object,
-                                     ScopedActionCompleter* completer) {
+bool OmahaRequestAction::HandleNotModified(ScopedActionCompleter* completer) {
+  string etag;
+  if (GetHTTPResponseCode() != kHttpResponseNotModified || IsEvent() ||
+      ping_only_ ||
+      !system_state_->prefs()->GetString(kPrefsNoUpdateResponseETag, &etag))
+    return false;
+  LOG(INFO) << "No update, the response is unchanged (" << etag << ").";
+  OmahaResponse output_object;
+  int64_t poll_interval = 0;
+  if (system_state_->prefs()->GetInt64(kPrefsNoUpdatePollInterval,
+                                       &poll_interval))
+    output_object.poll_interval = poll_interval;
+  output_object.update_exists = false;
+  if (HasOutputPipe())
+    SetOutputObject(output_object);
+  completer->set_code(kActionCodeSuccess);
+  return true;
+}
+
+void OmahaRequestAction::CacheNoUpdateResponse(
+    const OmahaResponse& output_object) {
+  const string& etag = http_fetcher_->response_etag();
+  if (etag.empty() || ping_only_)
+    return;
+  PrefsInterface* prefs = system_state_->prefs();
+  // The poll interval isn't sent again with a 304, so it's kept too.
+  if (output_object.poll_interval)
+    prefs->SetInt64(kPrefsNoUpdatePollInterval, output_object.poll_interval);
+  prefs->SetString(kPrefsNoUpdateResponseETag, etag);
+}
+
+bool OmahaRequestAction::ParseStatus(
+    const OmahaResponseParser::Attributes& update_check,
+    OmahaResponse* output_object,
+    ScopedActionCompleter* completer) {
   // Get status.
-  if (!xmlHasProp(update_check_node, ConstXMLStr("status"))) {
+  if (update_check.find("status") == update_check.end()) {
     LOG(ERROR) << "Omaha Response missing status";
     completer->set_code(kActionCodeOmahaResponseInvalid);
     return false;
   }
 
-  const string status(XmlGetProperty(update_check_node, "status"));
+  const string status(XmlGetProperty(update_check, "status"));
   if (status == "noupdate") {
     LOG(INFO) << "No update.";
     output_object->update_exists = false;
+    CacheNoUpdateResponse(*output_object);
     SetOutputObject(*output_object);
     completer->set_code(kActionCodeSuccess);
     return false;
@@ -419,29 +456,22 @@ bool OmahaRequestAction::ParseStatus(xmlNode* update_check_node,
   return true;
 }
 
-bool OmahaRequestAction::ParseUrls(xmlDoc* doc,
+bool OmahaRequestAction::ParseUrls(const OmahaResponseParser& parser,
                                    OmahaResponse* output_object,
                                    ScopedActionCompleter* completer) {
   // Get the update URL.
-  static const char* kUpdateUrlNodeXPath("/response/app/updatecheck/urls/url");
-
-  scoped_ptr_malloc<xmlXPathObject, ScopedPtrXmlXPathObjectFree>
-      xpath_nodeset(GetNodeSet(doc, ConstXMLStr(kUpdateUrlNodeXPath)));
-  if (!xpath_nodeset.get()) {
+  const vector<OmahaResponseParser::Attributes>& urls =
+      parser.Elements(kUrlPath);
+  if (urls.empty()) {
+    LOG(ERROR) << "Unable to find " << kUrlPath << " in the response";
     completer->set_code(kActionCodeOmahaResponseInvalid);
     return false;
   }
 
-  xmlNodeSet* nodeset = xpath_nodeset->nodesetval;
-  CHECK(nodeset) << "XPath missing " << kUpdateUrlNodeXPath;
-  CHECK_GE(nodeset->nodeNr, 1);
-
-  LOG(INFO) << "Found " << nodeset->nodeNr << " url(s)";
+  LOG(INFO) << "Found " << urls.size() << " url(s)";
   output_object->payload_urls.clear();
-  for (int i = 0; i < nodeset->nodeNr; i++) {
-    xmlNode* url_node = nodeset->nodeTab[i];
-
-    const string codebase(XmlGetProperty(url_node, "codebase"));
+  for (size_t i = 0; i < urls.size(); i++) {
+    const string codebase(XmlGetProperty(urls[i], "codebase"));
     if (codebase.empty()) {
       LOG(ERROR) << "Omaha Response URL has empty codebase";
       completer->set_code(kActionCodeOmahaResponseInvalid);
@@ -453,27 +483,23 @@ bool OmahaRequestAction::ParseUrls(xmlDoc* doc,
   return true;
 }
 
-bool OmahaRequestAction::ParsePackage(xmlDoc* doc,
+bool OmahaRequestAction::ParsePackage(const OmahaResponseParser& parser,
                                       OmahaResponse* output_object,
                                       ScopedActionCompleter* completer) {
   // Get the package node.
-  static const char* kPackageNodeXPath(
-      "/response/app/updatecheck/manifest/packages/package");
-
-  scoped_ptr_malloc<xmlXPathObject, ScopedPtrXmlXPathObjectFree>
-      xpath_nodeset(GetNodeSet(doc, ConstXMLStr(kPackageNodeXPath)));
-  if (!xpath_nodeset.get()) {
+  const vector<OmahaResponseParser::Attributes>& packages =
+      parser.Elements(kPackagePath);
+  if (packages.empty()) {
+    LOG(ERROR) << "Unable to find " << kPackagePath << " in the response";
     completer->set_code(kActionCodeOmahaResponseInvalid);
     return false;
   }
 
-  xmlNodeSet* nodeset = xpath_nodeset->nodesetval;
-  CHECK(nodeset) << "XPath missing " << kPackageNodeXPath;
-  CHECK_GE(nodeset->nodeNr, 1);
-
-  // We only care about the first package.
-  LOG(INFO) << "Processing first of " << nodeset->nodeNr << " package(s)";
-  xmlNode* package_node = nodeset->nodeTab[0];
+  // The first package is the one the rest of the response describes. The
+  // others are alternatives to it, see SelectPayload().
+  LOG(INFO) << "Processing first of " << packages.size() << " package(s)";
+  const OmahaResponseParser::Attributes& package_node = packages[0];
+  const vector<string> codebases = output_object->payload_urls;
 
   // Get package properties one by one.
 
@@ -502,50 +528,131 @@ bool OmahaRequestAction::ParsePackage(xmlDoc* doc,
     return false;
   }
   output_object->size = size;
+  output_object->apply_bytes =
+      std::max<off_t>(ParseInt(XmlGetProperty(package_node, kTagApplyBytes)),
+                      0);
 
   LOG(INFO) << "Payload size = " << output_object->size << " bytes";
 
+  // The other packages carry their own hashes and whether they're deltas.
+  output_object->other_payloads.clear();
+  for (size_t i = 1; i < packages.size(); i++) {
+    OmahaPayload payload;
+    const string name(XmlGetProperty(packages[i], "name"));
+    payload.hash = XmlGetProperty(packages[i], kTagSha256);
+    payload.size = ParseInt(XmlGetProperty(packages[i], "size"));
+    if (name.empty() || payload.hash.empty() || payload.size <= 0) {
+      LOG(WARNING) << "Ignoring package " << i << " (" << name
+                   << "), which lacks a name, hash or size";
+      continue;
+    }
+    for (size_t j = 0; j < codebases.size(); j++)
+      payload.payload_urls.push_back(codebases[j] + name);
+    payload.is_delta_payload =
+        XmlGetProperty(packages[i], kTagIsDeltaPayload) == "true";
+    payload.apply_bytes =
+        std::max<off_t>(ParseInt(XmlGetProperty(packages[i], kTagApplyBytes)),
+                        0);
+    output_object->other_payloads.push_back(payload);
+  }
+
   return true;
 }
 
-bool OmahaRequestAction::ParseParams(xmlDoc* doc,
+void OmahaRequestAction::SelectPayload(OmahaResponse* output_object) {
+  if (output_object->other_payloads.empty())
+    return;
+  vector<OmahaPayload> payloads(1);
+  payloads[0].payload_urls.swap(output_object->payload_urls);
+  payloads[0].hash = output_object->hash;
+  payloads[0].size = output_object->size;
+  payloads[0].is_delta_payload = output_object->is_delta_payload;
+  payloads[0].apply_bytes = output_object->apply_bytes;
+  payloads.insert(payloads.end(), output_object->other_payloads.begin(),
+                  output_object->other_payloads.end());
+
+  // An update under way sticks to its payload, so that it can resume.
+  PrefsInterface* prefs = system_state_->prefs();
+  string current_hash;
+  prefs->GetString(kPrefsUpdateCheckResponseHash, &current_hash);
+  UpdateDurationEstimator::Rates rates;
+  UpdateDurationEstimator::LoadRates(prefs, &rates);
+  size_t selected = 0;
+  int64_t selected_seconds = -1;
+  for (size_t i = 0; i < payloads.size(); i++) {
+    const OmahaPayload& payload = payloads[i];
+    // Deltas are out after too many of them failed, see UpdateAttempter.
+    if (payload.is_delta_payload && !params_->delta_okay())
+      continue;
+    if (!current_hash.empty() && payload.hash == current_hash) {
+      LOG(INFO) << "Staying with payload " << i << " of the update under way.";
+      selected = i;
+      break;
+    }
+    // The recent transfers from the payload's host tell its bandwidth
+    // better than past updates do.
+    UpdateDurationEstimator::Rates payload_rates = rates;
+    uint64_t throughput = 0;
+    if (!payload.payload_urls.empty() &&
+        transfer_stats_->GetHostThroughput(payload.payload_urls[0],
+                                           &throughput) &&
+        throughput > 0)
+      payload_rates[UpdateDurationEstimator::kDownloadRate] = throughput;
+    const int64_t seconds = UpdateDurationEstimator::EstimateSeconds(
+        payload_rates, payload.size, payload.apply_bytes);
+    LOG(INFO) << "Payload " << i << (payload.is_delta_payload ? " (delta)" :
+                                     " (full)")
+              << " is estimated to take " << seconds << " seconds.";
+    if (selected_seconds < 0 || seconds < selected_seconds) {
+      selected = i;
+      selected_seconds = seconds;
+    }
+  }
+  LOG(INFO) << "Using payload " << selected << ".";
+
+  const OmahaPayload& payload = payloads[selected];
+  output_object->payload_urls = payload.payload_urls;
+  output_object->hash = payload.hash;
+  output_object->size = payload.size;
+  output_object->is_delta_payload = payload.is_delta_payload;
+  output_object->apply_bytes = payload.apply_bytes;
+  payloads.erase(payloads.begin() + selected);
+  output_object->other_payloads.swap(payloads);
+}
+
+bool OmahaRequestAction::ParseParams(const OmahaResponseParser& parser,
                                      OmahaResponse* output_object,
                                      ScopedActionCompleter* completer) {
   // Get the action node where parameters are present.
-  static const char* kActionNodeXPath(
-      "/response/app/updatecheck/manifest/actions/action");
-
-  scoped_ptr_malloc<xmlXPathObject, ScopedPtrXmlXPathObjectFree>
-      xpath_nodeset(GetNodeSet(doc, ConstXMLStr(kActionNodeXPath)));
-  if (!xpath_nodeset.get()) {
+  const vector<OmahaResponseParser::Attributes>& actions =
+      parser.Elements(kActionPath);
+  if (actions.empty()) {
+    LOG(ERROR) << "Unable to find " << kActionPath << " in the response";
     completer->set_code(kActionCodeOmahaResponseInvalid);
     return false;
   }
 
-  xmlNodeSet* nodeset = xpath_nodeset->nodesetval;
-  CHECK(nodeset) << "XPath missing " << kActionNodeXPath;
-
   // We only care about the action that has event "postinall", because this is
   // where Omaha puts all the generic name/value pairs in the rule.
-  LOG(INFO) << "Found " << nodeset->nodeNr
+  LOG(INFO) << "Found " << actions.size()
             << " action(s). Processing the postinstall action.";
 
-  // pie_action_node holds the action node corresponding to the
+  // pie_action holds the attributes of the action node corresponding to the
   // postinstall event action, if present.
-  xmlNode* pie_action_node = NULL;
-  for (int i = 0; i < nodeset->nodeNr; i++) {
-    xmlNode* action_node = nodeset->nodeTab[i];
-    if (XmlGetProperty(action_node, "event") == "postinstall") {
-      pie_action_node = action_node;
+  const OmahaResponseParser::Attributes* pie_action = NULL;
+  for (size_t i = 0; i < actions.size(); i++) {
+    if (XmlGetProperty(actions[i], "event") == "postinstall") {
+      pie_action = &actions[i];
       break;
     }
   }
 
-  if (!pie_action_node) {
+  if (!pie_action) {
     LOG(ERROR) << "Omaha Response has no postinstall event action";
     completer->set_code(kActionCodeOmahaResponseInvalid);
     return false;
   }
+  const OmahaResponseParser::Attributes& pie_action_node = *pie_action;
 
   output_object->hash = XmlGetProperty(pie_action_node, kTagSha256);
   if (output_object->hash.empty()) {
@@ -578,8 +685,8 @@ bool OmahaRequestAction::ParseParams(xmlDoc* doc,
   return true;
 }
 
-// If the transfer was successful, this uses libxml2 to parse the response
-// and fill in the appropriate fields of the output object. Also, notifies
+// If the transfer was successful, this finishes parsing the response and
+// fills in the appropriate fields of the output object. Also, notifies
 // the processor that we're done.
 void OmahaRequestAction::TransferComplete(HttpFetcher *fetcher,
                                           bool successful) {
@@ -598,6 +705,9 @@ void OmahaRequestAction::TransferComplete(HttpFetcher *fetcher,
     return;
   }
 
+  if (!successful && HandleNotModified(&completer))
+    return;
+
   if (!successful) {
     LOG(ERROR) << "Omaha request network transfer failed.";
     int code = GetHTTPResponseCode();
@@ -610,10 +720,8 @@ void OmahaRequestAction::TransferComplete(HttpFetcher *fetcher,
     return;
   }
 
-  // parse our response and fill the fields in the output object
-  scoped_ptr_malloc<xmlDoc, ScopedPtrXmlDocFree> doc(
-      xmlParseMemory(&response_buffer_[0], response_buffer_.size()));
-  if (!doc.get()) {
+  // Finish parsing our response and fill the fields in the output object.
+  if (!response_parser_.get() || !response_parser_->Finish()) {
     LOG(ERROR) << "Omaha response not valid XML";
     completer.set_code(response_buffer_.empty() ?
                        kActionCodeOmahaRequestEmptyResponseError :
@@ -628,9 +736,13 @@ void OmahaRequestAction::TransferComplete(HttpFetcher *fetcher,
     return;
   }
 
+  // Only a "noupdate" response is cached, by ParseStatus().
+  system_state_->prefs()->Delete(kPrefsNoUpdateResponseETag);
+  system_state_->prefs()->Delete(kPrefsNoUpdatePollInterval);
   OmahaResponse output_object;
-  if (!ParseResponse(doc.get(), &output_object, &completer))
+  if (!ParseResponse(*response_parser_, &output_object, &completer))
     return;
+  SelectPayload(&output_object);
 
   if (params_->update_disabled()) {
     LOG(INFO) << "Ignoring Omaha updates as updates are disabled by policy.";
@@ -14,11 +14,11 @@
 
 #include <base/memory/scoped_ptr.h>
 #include <curl/curl.h>
-#include <libxml/parser.h>
 
 #include "update_engine/action.h"
 #include "update_engine/http_fetcher.h"
 #include "update_engine/omaha_response.h"
+#include "update_engine/omaha_response_parser.h"
 #include "update_engine/utils.h"
 
 // The Omaha Request action makes a request to Omaha and can output
@@ -74,6 +74,7 @@ class NoneType;
 class OmahaRequestAction;
 struct OmahaRequestParams;
 class PrefsInterface;
+class TransferStats;
 
 template<>
 class ActionTraits<OmahaRequestAction> {
@@ -131,6 +132,9 @@ class OmahaRequestAction : public Action<OmahaRequestAction>,
 
   int GetHTTPResponseCode() { return http_fetcher_->http_response_code(); }
 
+  // Returns the Retry-After delay of the response in seconds, or 0.
+  int GetRetryAfter() { return http_fetcher_->response_retry_after(); }
+
   // Debugging/logging
   static std::string StaticType() { return "OmahaRequestAction"; }
   std::string Type() const { return StaticType(); }
@@ -143,6 +147,19 @@ class OmahaRequestAction : public Action<OmahaRequestAction>,
   // Returns true if this is an Event request, false if it's an UpdateCheck.
   bool IsEvent() const { return event_.get() != NULL; }
 
+  // Makes the request also report the events queued in |event_queue|, which
+  // it takes out of the queue when it's performed. Coalescing the events
+  // this way saves a request per event.
+  void set_event_queue(std::vector<OmahaEvent>* event_queue) {
+    event_queue_ = event_queue;
+  }
+
+  // Sets the statistics of the recent transfers the payloads' download rates
+  // are estimated by. TransferStats::Get() by default.
+  void set_transfer_stats(TransferStats* transfer_stats) {
+    transfer_stats_ = transfer_stats;
+  }
+
  private:
   // Returns true if the download of a new update should be deferred.
   // False if the update can be downloaded.
@@ -159,42 +176,59 @@ class OmahaRequestAction : public Action<OmahaRequestAction>,
   // satisfied. False otherwise.
   bool IsUpdateCheckCountBasedWaitingSatisfied();
 
-  // Parses the response from Omaha that's available in |doc| using the other
-  // helper methods below and populates the |output_object| with the relevant
-  // values. Returns true if we should continue the parsing.  False otherwise,
-  // in which case it sets any error code using |completer|.
-  bool ParseResponse(xmlDoc* doc,
+  // Handles a 304 Not Modified reply to a request made conditional on the
+  // last "noupdate" response, as if that response came again. Returns true
+  // if it was handled, in which case it sets the code of |completer|.
+  bool HandleNotModified(ScopedActionCompleter* completer);
+
+  // Keeps the ETag of the "noupdate" response in |output_object|, if it has
+  // one, for the next update check to be conditional on.
+  void CacheNoUpdateResponse(const OmahaResponse& output_object);
+
+  // Parses the response from Omaha that's been collected by |parser| using
+  // the other helper methods below and populates the |output_object| with the
+  // relevant values. Returns true if we should continue the parsing.  False
+  // otherwise, in which case it sets any error code using |completer|.
+  bool ParseResponse(const OmahaResponseParser& parser,
                      OmahaResponse* output_object,
                      ScopedActionCompleter* completer);
 
-  // Parses the status property in the given update_check_node and populates
-  // |output_object| if valid. Returns true if we should continue the parsing.
-  // False otherwise, in which case it sets any error code using |completer|.
-  bool ParseStatus(xmlNode* update_check_node,
+  // Parses the status property in the given |update_check| attributes and
+  // populates |output_object| if valid. Returns true if we should continue the
+  // parsing. False otherwise, in which case it sets any error code using
+  // |completer|.
+  bool ParseStatus(const OmahaResponseParser::Attributes& update_check,
                    OmahaResponse* output_object,
                    ScopedActionCompleter* completer);
 
-  // Parses the URL nodes in the given XML document and populates
+  // Parses the URL nodes collected by |parser| and populates
   // |output_object| if valid. Returns true if we should continue the parsing.
   // False otherwise, in which case it sets any error code using |completer|.
-  bool ParseUrls(xmlDoc* doc,
+  bool ParseUrls(const OmahaResponseParser& parser,
                  OmahaResponse* output_object,
                  ScopedActionCompleter* completer);
 
-  // Parses the package node in the given XML document and populates
+  // Parses the package node collected by |parser| and populates
   // |output_object| if valid. Returns true if we should continue the parsing.
   // False otherwise, in which case it sets any error code using |completer|.
-  bool ParsePackage(xmlDoc* doc,
+  bool ParsePackage(const OmahaResponseParser& parser,
                     OmahaResponse* output_object,
                     ScopedActionCompleter* completer);
 
-  // Parses the other parameters in the given XML document and populates
+  // Parses the other parameters collected by |parser| and populates
   // |output_object| if valid. Returns true if we should continue the parsing.
   // False otherwise, in which case it sets any error code using |completer|.
-  bool ParseParams(xmlDoc* doc,
+  bool ParseParams(const OmahaResponseParser& parser,
                    OmahaResponse* output_object,
                    ScopedActionCompleter* completer);
 
+  // Makes the payload of |output_object| the one of those it offers that's
+  // expected to update the device soonest, with the rates of its past
+  // updates and the throughput of the recent transfers from the payload's
+  // host, leaving out deltas if they're not okay. An update under way keeps
+  // its payload.
+  void SelectPayload(OmahaResponse* output_object);
+
   // Global system context.
   SystemState* system_state_;
 
@@ -210,15 +244,24 @@ class OmahaRequestAction : public Action<OmahaRequestAction>,
   // If true, only include the <ping> element in the request.
   bool ping_only_;
 
+  // The events to report along with the request, or NULL. Not owned.
+  std::vector<OmahaEvent>* event_queue_;
+
   // Stores the response from the omaha server
   std::vector<char> response_buffer_;
 
+  // Parses the response as it comes in. Created by PerformAction().
+  scoped_ptr<OmahaResponseParser> response_parser_;
+
   // Initialized by InitPingDays to values that may be sent to Omaha
   // as part of a ping message. Note that only positive values and -1
   // are sent to Omaha.
   int ping_active_days_;
   int ping_roll_call_days_;
 
+  // The statistics of the recent transfers, see SelectPayload(). Not owned.
+  TransferStats* transfer_stats_;
+
   DISALLOW_COPY_AND_ASSIGN(OmahaRequestAction);
 };
 
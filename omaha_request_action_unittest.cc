@@ -18,6 +18,8 @@
 #include "update_engine/omaha_request_params.h"
 #include "update_engine/prefs.h"
 #include "update_engine/test_utils.h"
+#include "update_engine/transfer_stats.h"
+#include "update_engine/update_duration_estimator.h"
 #include "update_engine/utils.h"
 
 using base::Time;
@@ -197,15 +199,17 @@ class OutputObjectCollectorAction : public Action<OutputObjectCollectorAction> {
 // used. out_response may be NULL. If |fail_http_response_code| is non-negative,
 // the transfer will fail with that code. |ping_only| is passed through to the
 // OmahaRequestAction constructor. out_post_data may be null; if non-null, the
-// post-data received by the mock HttpFetcher is returned.
-bool TestUpdateCheck(PrefsInterface* prefs,
-                     OmahaRequestParams params,
-                     const string& http_response,
-                     int fail_http_response_code,
-                     bool ping_only,
-                     ActionExitCode expected_code,
-                     OmahaResponse* out_response,
-                     vector<char>* out_post_data) {
+// post-data received by the mock HttpFetcher is returned. The payload is
+// picked with the recent transfers in |transfer_stats|.
+bool TestUpdateCheckWithTransferStats(PrefsInterface* prefs,
+                                      OmahaRequestParams params,
+                                      const string& http_response,
+                                      int fail_http_response_code,
+                                      bool ping_only,
+                                      ActionExitCode expected_code,
+                                      OmahaResponse* out_response,
+                                      vector<char>* out_post_data,
+                                      TransferStats* transfer_stats) {
   GMainLoop* loop = g_main_loop_new(g_main_context_default(), FALSE);
   MockHttpFetcher* fetcher = new MockHttpFetcher(http_response.data(),
                                                  http_response.size());
@@ -220,6 +224,7 @@ bool TestUpdateCheck(PrefsInterface* prefs,
                             NULL,
                             fetcher,
                             ping_only);
+  action.set_transfer_stats(transfer_stats);
   OmahaRequestActionTestProcessorDelegate delegate;
   delegate.loop_ = loop;
   delegate.expected_code_ = expected_code;
@@ -242,6 +247,28 @@ bool TestUpdateCheck(PrefsInterface* prefs,
   return collector_action.has_input_object_;
 }
 
+// Same as TestUpdateCheckWithTransferStats(), with no recent transfers, so
+// that the tests don't depend on those of the process.
+bool TestUpdateCheck(PrefsInterface* prefs,
+                     OmahaRequestParams params,
+                     const string& http_response,
+                     int fail_http_response_code,
+                     bool ping_only,
+                     ActionExitCode expected_code,
+                     OmahaResponse* out_response,
+                     vector<char>* out_post_data) {
+  TransferStats transfer_stats;
+  return TestUpdateCheckWithTransferStats(prefs,
+                                          params,
+                                          http_response,
+                                          fail_http_response_code,
+                                          ping_only,
+                                          expected_code,
+                                          out_response,
+                                          out_post_data,
+                                          &transfer_stats);
+}
+
 // Tests Event requests -- they should always succeed. |out_post_data|
 // may be null; if non-null, the post-data received by the mock
 // HttpFetcher is returned.
@@ -282,6 +309,58 @@ TEST(OmahaRequestActionTest, NoUpdateTest) {
   EXPECT_FALSE(response.update_exists);
 }
 
+TEST(OmahaRequestActionTest, NotModifiedTest) {
+  string prefs_dir;
+  EXPECT_TRUE(utils::MakeTempDirectory("/tmp/ue_ut_prefs.XXXXXX",
+                                       &prefs_dir));
+  ScopedDirRemover temp_dir_remover(prefs_dir);
+  Prefs prefs;
+  ASSERT_TRUE(prefs.Init(FilePath(prefs_dir)));
+
+  // Without a cached "noupdate" response, a 304 is an error.
+  OmahaResponse response;
+  ASSERT_FALSE(
+      TestUpdateCheck(&prefs,
+                      kDefaultTestParams,
+                      "",
+                      kHttpResponseNotModified,
+                      false,  // ping_only
+                      static_cast<ActionExitCode>(
+                          kActionCodeOmahaRequestHTTPResponseBase +
+                          kHttpResponseNotModified),
+                      &response,
+                      NULL));
+
+  // With one, it stands for the same response again.
+  ASSERT_TRUE(prefs.SetString(kPrefsNoUpdateResponseETag, "\"etag\""));
+  ASSERT_TRUE(prefs.SetInt64(kPrefsNoUpdatePollInterval, 1234));
+  ASSERT_TRUE(
+      TestUpdateCheck(&prefs,
+                      kDefaultTestParams,
+                      "",
+                      kHttpResponseNotModified,
+                      false,  // ping_only
+                      kActionCodeSuccess,
+                      &response,
+                      NULL));
+  EXPECT_FALSE(response.update_exists);
+  EXPECT_EQ(1234, response.poll_interval);
+
+  // Any parsed response drops the ETag, unless it's a "noupdate" one that
+  // has its own.
+  ASSERT_TRUE(
+      TestUpdateCheck(&prefs,
+                      kDefaultTestParams,
+                      GetNoUpdateResponse(OmahaRequestParams::kAppId),
+                      -1,
+                      false,  // ping_only
+                      kActionCodeSuccess,
+                      &response,
+                      NULL));
+  EXPECT_FALSE(prefs.Exists(kPrefsNoUpdateResponseETag));
+  EXPECT_FALSE(prefs.Exists(kPrefsNoUpdatePollInterval));
+}
+
 TEST(OmahaRequestActionTest, ValidUpdateTest) {
   OmahaResponse response;
   ASSERT_TRUE(
@@ -314,6 +393,131 @@ TEST(OmahaRequestActionTest, ValidUpdateTest) {
   EXPECT_EQ("20101020", response.deadline);
 }
 
+TEST(OmahaRequestActionTest, SelectPayloadTest) {
+  string prefs_dir;
+  EXPECT_TRUE(utils::MakeTempDirectory("/tmp/ue_ut_prefs.XXXXXX",
+                                       &prefs_dir));
+  ScopedDirRemover temp_dir_remover(prefs_dir);
+  Prefs prefs;
+  ASSERT_TRUE(prefs.Init(FilePath(prefs_dir)));
+  UpdateDurationEstimator::Rates rates;
+  rates[UpdateDurationEstimator::kDownloadRate] = 1000;
+  rates[UpdateDurationEstimator::kApplyRate] = 1000;
+  ASSERT_TRUE(UpdateDurationEstimator::SaveRates(&prefs, rates));
+
+  // A delta that writes a lot, a smaller delta from an older version and
+  // the full payload, which take 50, 3 and 10 seconds.
+  string response = GetUpdateResponse(OmahaRequestParams::kAppId,
+                                      "1.2.3.4",  // version
+                                      "http://more/info",
+                                      "true",  // prompt
+                                      "http://code/base/",  // dl url
+                                      "delta1",  // file name
+                                      "HASH1",  // checksum
+                                      "false",  // needs admin
+                                      "1000",  // size
+                                      "");  // deadline
+  ReplaceSubstringsAfterOffset(
+      &response, 0, "size=\"1000\"/>",
+      "size=\"1000\" ApplyBytes=\"50000\"/>"
+      "<package name=\"delta2\" size=\"2000\" sha256=\"HASH2\" "
+      "IsDeltaPayload=\"true\" ApplyBytes=\"3000\"/>"
+      "<package name=\"full\" size=\"10000\" sha256=\"HASH3\" "
+      "ApplyBytes=\"10000\"/>");
+  OmahaRequestParams params = kDefaultTestParams;
+  params.set_delta_okay(true);
+  OmahaResponse out;
+  ASSERT_TRUE(TestUpdateCheck(&prefs, params, response, -1, false,
+                              kActionCodeSuccess, &out, NULL));
+  EXPECT_EQ("http://code/base/delta2", out.payload_urls[0]);
+  EXPECT_EQ("HASH2", out.hash);
+  EXPECT_EQ(2000, out.size);
+  EXPECT_TRUE(out.is_delta_payload);
+  EXPECT_EQ(3000, out.apply_bytes);
+  ASSERT_EQ(2, out.other_payloads.size());
+  EXPECT_EQ("HASH1", out.other_payloads[0].hash);
+  EXPECT_EQ(50000, out.other_payloads[0].apply_bytes);
+  EXPECT_EQ("HASH3", out.other_payloads[1].hash);
+
+  // Without deltas, the full payload.
+  params.set_delta_okay(false);
+  ASSERT_TRUE(TestUpdateCheck(&prefs, params, response, -1, false,
+                              kActionCodeSuccess, &out, NULL));
+  EXPECT_EQ("http://code/base/full", out.payload_urls[0]);
+  EXPECT_EQ("HASH3", out.hash);
+  EXPECT_FALSE(out.is_delta_payload);
+
+  // An update under way keeps its payload.
+  params.set_delta_okay(true);
+  ASSERT_TRUE(prefs.SetString(kPrefsUpdateCheckResponseHash, "HASH1"));
+  ASSERT_TRUE(TestUpdateCheck(&prefs, params, response, -1, false,
+                              kActionCodeSuccess, &out, NULL));
+  EXPECT_EQ("http://code/base/delta1", out.payload_urls[0]);
+  EXPECT_EQ("HASH1", out.hash);
+}
+
+TEST(OmahaRequestActionTest, SelectPayloadHostThroughputTest) {
+  string prefs_dir;
+  EXPECT_TRUE(utils::MakeTempDirectory("/tmp/ue_ut_prefs.XXXXXX",
+                                       &prefs_dir));
+  ScopedDirRemover temp_dir_remover(prefs_dir);
+  Prefs prefs;
+  ASSERT_TRUE(prefs.Init(FilePath(prefs_dir)));
+  UpdateDurationEstimator::Rates rates;
+  rates[UpdateDurationEstimator::kDownloadRate] = 1000;
+  rates[UpdateDurationEstimator::kApplyRate] = 1000;
+  ASSERT_TRUE(UpdateDurationEstimator::SaveRates(&prefs, rates));
+
+  // A delta that takes 20 seconds to apply and a full payload that takes 30
+  // seconds to download at the stored rate, or 3 seconds at 10000 bytes per
+  // second.
+  string response = GetUpdateResponse(OmahaRequestParams::kAppId,
+                                      "1.2.3.4",  // version
+                                      "http://more/info",
+                                      "true",  // prompt
+                                      "http://code/base/",  // dl url
+                                      "delta",  // file name
+                                      "HASH1",  // checksum
+                                      "false",  // needs admin
+                                      "1000",  // size
+                                      "");  // deadline
+  ReplaceSubstringsAfterOffset(
+      &response, 0, "size=\"1000\"/>",
+      "size=\"1000\" ApplyBytes=\"20000\"/>"
+      "<package name=\"full\" size=\"30000\" sha256=\"HASH2\" "
+      "ApplyBytes=\"1000\"/>");
+  OmahaRequestParams params = kDefaultTestParams;
+  params.set_delta_okay(true);
+
+  // Without recent transfers, the stored rate makes the delta quicker.
+  TransferStats transfer_stats;
+  OmahaResponse out;
+  ASSERT_TRUE(TestUpdateCheckWithTransferStats(&prefs, params, response, -1,
+                                               false, kActionCodeSuccess,
+                                               &out, NULL, &transfer_stats));
+  EXPECT_EQ("HASH1", out.hash);
+
+  // Transfers from another host don't count.
+  TransferTiming timing;
+  timing.bytes = 10000;
+  timing.total_seconds = 1;
+  transfer_stats.AddTransfer("http://other/base/file", timing);
+  ASSERT_TRUE(TestUpdateCheckWithTransferStats(&prefs, params, response, -1,
+                                               false, kActionCodeSuccess,
+                                               &out, NULL, &transfer_stats));
+  EXPECT_EQ("HASH1", out.hash);
+
+  // The throughput of the recent transfers from the payloads' host makes
+  // the full payload quicker.
+  transfer_stats.AddTransfer("http://code/base/other", timing);
+  ASSERT_TRUE(TestUpdateCheckWithTransferStats(&prefs, params, response, -1,
+                                               false, kActionCodeSuccess,
+                                               &out, NULL, &transfer_stats));
+  EXPECT_EQ("http://code/base/full", out.payload_urls[0]);
+  EXPECT_EQ("HASH2", out.hash);
+  EXPECT_FALSE(out.is_delta_payload);
+}
+
 TEST(OmahaRequestActionTest, ValidUpdateBlockedByPolicyTest) {
   OmahaResponse response;
   OmahaRequestParams params = kDefaultTestParams;
@@ -995,6 +1199,53 @@ TEST(OmahaRequestActionTest, FormatErrorEventOutputTest) {
   EXPECT_EQ(post_str.find("updatecheck"), string::npos);
 }
 
+TEST(OmahaRequestActionTest, QueuedEventsOutputTest) {
+  GMainLoop* loop = g_main_loop_new(g_main_context_default(), FALSE);
+  string http_response("invalid xml>");
+  MockHttpFetcher* fetcher = new MockHttpFetcher(http_response.data(),
+                                                 http_response.size());
+  MockSystemState mock_system_state;
+  OmahaRequestParams params = kDefaultTestParams;
+  mock_system_state.set_request_params(&params);
+  OmahaRequestAction action(&mock_system_state,
+                            new OmahaEvent(OmahaEvent::kTypeUpdateComplete),
+                            fetcher,
+                            false);
+  vector<OmahaEvent> event_queue;
+  event_queue.push_back(OmahaEvent(OmahaEvent::kTypeUpdateDownloadFinished));
+  event_queue.push_back(OmahaEvent(OmahaEvent::kTypeDownloadComplete,
+                                   OmahaEvent::kResultError,
+                                   kActionCodeError));
+  action.set_event_queue(&event_queue);
+  OmahaRequestActionTestProcessorDelegate delegate;
+  delegate.loop_ = loop;
+  ActionProcessor processor;
+  processor.set_delegate(&delegate);
+  processor.EnqueueAction(&action);
+
+  g_timeout_add(0, &StartProcessorInRunLoop, &processor);
+  g_main_loop_run(loop);
+  g_main_loop_unref(loop);
+
+  // All the events are in the one request, and out of the queue.
+  EXPECT_TRUE(event_queue.empty());
+  string post_str(&fetcher->post_data()[0], fetcher->post_data().size());
+  string expected_events = StringPrintf(
+      "        <event eventtype=\"%d\" eventresult=\"%d\"></event>\n"
+      "        <event eventtype=\"%d\" eventresult=\"%d\"></event>\n"
+      "        <event eventtype=\"%d\" eventresult=\"%d\" "
+      "errorcode=\"%d\"></event>\n",
+      OmahaEvent::kTypeUpdateComplete,
+      OmahaEvent::kResultSuccess,
+      OmahaEvent::kTypeUpdateDownloadFinished,
+      OmahaEvent::kResultSuccess,
+      OmahaEvent::kTypeDownloadComplete,
+      OmahaEvent::kResultError,
+      kActionCodeError);
+  EXPECT_NE(post_str.find(expected_events), string::npos);
+  EXPECT_EQ(post_str.find("updatecheck"), string::npos);
+}
+
 TEST(OmahaRequestActionTest, IsEventTest) {
   string http_response("doesn't matter");
   MockSystemState mock_system_state;
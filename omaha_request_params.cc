@@ -6,6 +6,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <sys/utsname.h>
 
 #include <map>
@@ -13,8 +14,12 @@
 #include <vector>
 
 #include <base/file_util.h>
+#include <base/string_number_conversions.h>
+#include <base/string_split.h>
+#include <base/string_util.h>
 #include <policy/device_policy.h>
 
+#include "update_engine/peer_server.h"
 #include "update_engine/simple_key_value_store.h"
 #include "update_engine/system_state.h"
 #include "update_engine/prefs_interface.h"
@@ -36,9 +41,26 @@ const char* const OmahaRequestParams::kDefaultChannel("stable");
 const char* const kProductionOmahaUrl(
     "https://public.update.core-os.net/v1/update/");
 
+namespace {
+
+// The files GetConfValue() reads, the first one with the key winning.
+const char* const kConfFiles[] = {
+  "/etc/coreos/update.conf",
+  "/usr/share/coreos/update.conf",
+  "/usr/share/coreos/release",
+};
+
+// The files GetOemValue() reads.
+const char* const kOemFiles[] = {
+  "/etc/oem-release",
+};
+
+}  // namespace {}
+
 bool OmahaRequestParams::Init(bool interactive) {
   os_platform_ = OmahaRequestParams::kOsPlatform;
   os_version_ = OmahaRequestParams::kOsVersion;
+  RefreshConfFiles();
   oemid_ = GetOemValue("ID", "");
   oemversion_ = GetOemValue("VERSION_ID", "");
   app_version_ = GetConfValue("COREOS_RELEASE_VERSION", "");
@@ -55,31 +77,81 @@ bool OmahaRequestParams::Init(bool interactive) {
   bootid_ = utils::GetBootId();
   machineid_ = utils::GetMachineId();
   update_url_ = GetConfValue("SERVER", kProductionOmahaUrl);
+  compress_requests_ = GetConfValue("COMPRESS_REQUESTS", "false") == "true";
   interactive_ = interactive;
 
   app_channel_ = GetConfValue("GROUP", kDefaultChannel);
   LOG(INFO) << "Current group set to " << app_channel_;
 
+  // PEERS is a comma-separated list of host[:port], the port defaulting to
+  // the one peers serve on. IPv6 hosts are bracketed.
+  peers_.clear();
+  vector<string> peers;
+  base::SplitString(GetConfValue("PEERS", ""), ',', &peers);
+  for (vector<string>::iterator it = peers.begin(); it != peers.end(); ++it) {
+    string peer;
+    TrimWhitespaceASCII(*it, TRIM_ALL, &peer);
+    if (peer.empty())
+      continue;
+    const size_t host_end = peer.rfind(']');
+    if (peer.find(':', host_end == string::npos ? 0 : host_end) ==
+        string::npos)
+      peer += ":" + base::IntToString(PeerServer::kDefaultPort);
+    peers_.push_back(peer);
+  }
+  LOG_IF(INFO, !peers_.empty()) << "Downloading from " << peers_.size()
+                                << " peer(s) first";
+
   // TODO: deltas can only be enabled if verity is active.
   delta_okay_ = false;
 
   return true;
 }
 
-string OmahaRequestParams::SearchConfValue(const vector<string>& files,
+void OmahaRequestParams::RefreshConfFiles() {
+  for (size_t i = 0; i < arraysize(kConfFiles); i++)
+    RefreshConfFile(kConfFiles[i]);
+  for (size_t i = 0; i < arraysize(kOemFiles); i++)
+    RefreshConfFile(kOemFiles[i]);
+}
+
+void OmahaRequestParams::RefreshConfFile(const string& file) {
+  ConfFile* conf = &conf_files_[file];
+  const string path = root_ + file;
+  struct stat stbuf;
+  if (stat(path.c_str(), &stbuf) != 0) {
+    *conf = ConfFile();
+    return;
+  }
+  if (conf->exists && conf->inode == stbuf.st_ino &&
+      conf->size == stbuf.st_size &&
+      conf->mtime.tv_sec == stbuf.st_mtim.tv_sec &&
+      conf->mtime.tv_nsec == stbuf.st_mtim.tv_nsec) {
+    return;
+  }
+  string file_data;
+  if (!utils::ReadFile(path, &file_data)) {
+    *conf = ConfFile();
+    return;
+  }
+  conf->exists = true;
+  conf->inode = stbuf.st_ino;
+  conf->size = stbuf.st_size;
+  conf->mtime = stbuf.st_mtim;
+  conf->values = simple_key_value_store::ParseString(file_data);
+}
+
+string OmahaRequestParams::SearchConfValue(const char* const* files,
+                                           size_t num_files,
                                            const string& key,
                                            const string& default_value) const {
-  for (vector<string>::const_iterator it = files.begin();
-       it != files.end(); ++it) {
-    string file_data;
-    if (!utils::ReadFile(root_ + *it, &file_data))
+  for (size_t i = 0; i < num_files; i++) {
+    map<string, ConfFile>::const_iterator conf = conf_files_.find(files[i]);
+    if (conf == conf_files_.end())
       continue;
-
-    map<string, string> data = simple_key_value_store::ParseString(file_data);
-    if (utils::MapContainsKey(data, key)) {
-      const string& value = data[key];
-      return value;
-    }
+    map<string, string>::const_iterator value = conf->second.values.find(key);
+    if (value != conf->second.values.end())
+      return value->second;
   }
   // not found
   return default_value;
@@ -87,18 +159,13 @@ string OmahaRequestParams::SearchConfValue(const vector<string>& files,
 
 string OmahaRequestParams::GetConfValue(const string& key,
                                         const string& default_value) const {
-  vector<string> files;
-  files.push_back("/etc/coreos/update.conf");
-  files.push_back("/usr/share/coreos/update.conf");
-  files.push_back("/usr/share/coreos/release");
-  return SearchConfValue(files, key, default_value);
+  return SearchConfValue(kConfFiles, arraysize(kConfFiles), key,
+                         default_value);
 }
 
 string OmahaRequestParams::GetOemValue(const string& key,
                                        const string& default_value) const {
-  vector<string> files;
-  files.push_back("/etc/oem-release");
-  return SearchConfValue(files, key, default_value);
+  return SearchConfValue(kOemFiles, arraysize(kOemFiles), key, default_value);
 }
 
 string OmahaRequestParams::GetMachineType() const {
@@ -111,6 +178,7 @@ string OmahaRequestParams::GetMachineType() const {
 
 void OmahaRequestParams::set_root(const std::string& root) {
   root_ = root;
+  conf_files_.clear();
   Init(false);
 }
 
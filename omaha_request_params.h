@@ -5,6 +5,10 @@
 #ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_OMAHA_REQUEST_PARAMS_H__
 #define CHROMEOS_PLATFORM_UPDATE_ENGINE_OMAHA_REQUEST_PARAMS_H__
 
+#include <sys/types.h>
+#include <time.h>
+
+#include <map>
 #include <string>
 #include <vector>
 
@@ -38,6 +42,7 @@ class OmahaRequestParams {
 	app_channel_(kDefaultChannel),
         delta_okay_(true),
         interactive_(false),
+        compress_requests_(false),
         update_disabled_(false),
         wall_clock_based_wait_enabled_(false),
         update_check_count_wait_enabled_(false),
@@ -74,6 +79,7 @@ class OmahaRequestParams {
         delta_okay_(in_delta_okay),
         interactive_(in_interactive),
         update_url_(in_update_url),
+        compress_requests_(false),
         update_disabled_(in_update_disabled),
         target_version_prefix_(in_target_version_prefix),
         wall_clock_based_wait_enabled_(false),
@@ -111,6 +117,17 @@ class OmahaRequestParams {
   inline void set_update_url(const std::string& url) { update_url_ = url; }
   inline std::string update_url() const { return update_url_; }
 
+  // Whether the requests are sent gzip compressed, which the server must
+  // support.
+  inline void set_compress_requests(bool compress) {
+    compress_requests_ = compress;
+  }
+  inline bool compress_requests() const { return compress_requests_; }
+
+  // The "host:port" addresses of the machines of the network to download
+  // the payload from before the update server.
+  inline const std::vector<std::string>& peers() const { return peers_; }
+
   inline void set_update_disabled(bool disabled) {
     update_disabled_ = disabled;
   }
@@ -183,12 +200,19 @@ class OmahaRequestParams {
   std::string GetOemValue(const std::string& key,
                           const std::string& default_value) const;
 
-  // Common implementation of GetConfValue and GetOemValue.
+  // Common implementation of GetConfValue and GetOemValue, looking the key
+  // up in the snapshot of the |num_files| |files|.
   std::string SearchConfValue(
-      const std::vector<std::string>& files,
+      const char* const* files,
+      size_t num_files,
       const std::string& key,
       const std::string& default_value) const;
 
+  // Rereads and parses the config files that changed since the last call,
+  // so the snapshot the values are looked up in is current.
+  void RefreshConfFiles();
+  void RefreshConfFile(const std::string& file);
+
   // Gets the machine type (e.g. "i686").
   std::string GetMachineType() const;
 
@@ -217,6 +241,13 @@ class OmahaRequestParams {
   // The URL to send the Omaha request to.
   std::string update_url_;
 
+  // From the COMPRESS_REQUESTS key of update.conf.
+  bool compress_requests_;
+
+  // The peers to download the payload from, from the PEERS key of
+  // update.conf.
+  std::vector<std::string> peers_;
+
   // True if we've been told to block updates per enterprise policy.
   bool update_disabled_;
 
@@ -241,6 +272,23 @@ class OmahaRequestParams {
   // When reading files, prepend root_ to the paths. Useful for testing.
   std::string root_;
 
+  // A parsed config file, and what it's reread on a change of.
+  struct ConfFile {
+    ConfFile() : exists(false), inode(0), size(0) {
+      mtime.tv_sec = 0;
+      mtime.tv_nsec = 0;
+    }
+
+    bool exists;
+    ino_t inode;
+    off_t size;
+    struct timespec mtime;
+    std::map<std::string, std::string> values;
+  };
+
+  // The config files last read, keyed by their path under |root_|.
+  std::map<std::string, ConfFile> conf_files_;
+
   // TODO(jaysri): Uncomment this after fixing unit tests, as part of
   // chromium-os:39752
   // DISALLOW_COPY_AND_ASSIGN(OmahaRequestParams);
@@ -3,6 +3,7 @@
 // found in the LICENSE file.
 
 #include <stdio.h>
+#include <unistd.h>
 
 #include <string>
 
@@ -196,4 +197,49 @@ TEST_F(OmahaRequestParamsTest, ValidChannelTest) {
   EXPECT_EQ("http://www.google.com", out.update_url());
 }
 
+TEST_F(OmahaRequestParamsTest, CompressRequestsTest) {
+  ASSERT_TRUE(WriteFileString(
+      kTestDir + "/usr/share/coreos/release",
+      "COREOS_RELEASE_VERSION=0.2.2.3\n"
+      "GROUP=dev-channel"));
+  MockSystemState mock_system_state;
+  OmahaRequestParams out(&mock_system_state);
+  EXPECT_TRUE(DoTest(&out));
+  EXPECT_FALSE(out.compress_requests());
+
+  ASSERT_TRUE(WriteFileString(
+      kTestDir + "/usr/share/coreos/release",
+      "COREOS_RELEASE_VERSION=0.2.2.3\n"
+      "GROUP=dev-channel\n"
+      "COMPRESS_REQUESTS=true"));
+  EXPECT_TRUE(DoTest(&out));
+  EXPECT_TRUE(out.compress_requests());
+}
+
+TEST_F(OmahaRequestParamsTest, ConfChangesTest) {
+  const string conf = kTestDir + "/usr/share/coreos/update.conf";
+  ASSERT_TRUE(WriteFileString(
+      kTestDir + "/usr/share/coreos/release",
+      "COREOS_RELEASE_VERSION=0.2.2.3\n"
+      "GROUP=dev-channel"));
+  ASSERT_TRUE(WriteFileString(conf, "SERVER=http://www.google.com"));
+  MockSystemState mock_system_state;
+  OmahaRequestParams out(&mock_system_state);
+  EXPECT_TRUE(DoTest(&out));
+  EXPECT_EQ("http://www.google.com", out.update_url());
+  EXPECT_EQ("dev-channel", out.app_channel());
+
+  // The files are reread once they change, and dropped once they're gone.
+  ASSERT_TRUE(WriteFileString(conf, "GROUP=beta-channel\n"
+                              "SERVER=http://www.example.com"));
+  EXPECT_TRUE(DoTest(&out));
+  EXPECT_EQ("http://www.example.com", out.update_url());
+  EXPECT_EQ("beta-channel", out.app_channel());
+
+  ASSERT_EQ(0, unlink(conf.c_str()));
+  EXPECT_TRUE(DoTest(&out));
+  EXPECT_EQ(kProductionOmahaUrl, out.update_url());
+  EXPECT_EQ("dev-channel", out.app_channel());
+}
+
 }  // namespace chromeos_update_engine
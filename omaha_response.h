@@ -14,6 +14,20 @@
 
 namespace chromeos_update_engine {
 
+// A payload the response offers besides the one it describes, e.g., a delta
+// from an older version or the full payload, which is used instead if the
+// update is expected to take less time with it.
+struct OmahaPayload {
+  OmahaPayload() : size(0), is_delta_payload(false), apply_bytes(0) {}
+
+  std::vector<std::string> payload_urls;
+  std::string hash;
+  off_t size;
+  bool is_delta_payload;
+  // The bytes the payload's operations write, 0 if unknown.
+  uint64_t apply_bytes;
+};
+
 // This struct encapsulates the data Omaha's response for the request.
 // The strings in this struct are not XML escaped.
 struct OmahaResponse {
@@ -26,6 +40,7 @@ struct OmahaResponse {
         needs_admin(false),
         prompt(false),
         is_delta_payload(false),
+        apply_bytes(0),
         disable_payload_backoff(false) {}
 
   // True iff there is an update to be downloaded.
@@ -57,6 +72,14 @@ struct OmahaResponse {
   // False if it's a full payload.
   bool is_delta_payload;
 
+  // The bytes the operations of the payload write, 0 if unknown.
+  uint64_t apply_bytes;
+
+  // The other payloads the response offers. If one of them is picked, see
+  // OmahaRequestAction, it takes the place of the one above, which joins
+  // them.
+  std::vector<OmahaPayload> other_payloads;
+
   // True if the Omaha rule instructs us to disable the backoff logic
   // on the client altogether. False otherwise.
   bool disable_payload_backoff;
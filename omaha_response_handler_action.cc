@@ -18,6 +18,20 @@ using std::string;
 
 namespace chromeos_update_engine {
 
+namespace {
+
+// Returns the partition of |disk| with the number of |partition|, e.g.,
+// "/dev/sdb4" for "/dev/sdb" and "/dev/sda4", or "/dev/mmcblk1p4" for
+// "/dev/mmcblk1".
+string MirrorPartition(const string& disk, const string& partition) {
+  const string number = utils::PartitionNumber(partition);
+  if (!disk.empty() && IsAsciiDigit(disk[disk.size() - 1]))
+    return disk + "p" + number;
+  return disk + number;
+}
+
+}  // namespace {}
+
 const char OmahaResponseHandlerAction::kDeadlineFile[] =
     "/tmp/update-check-response-deadline";
 
@@ -43,6 +57,8 @@ void OmahaResponseHandlerAction::PerformAction() {
   LOG(INFO) << "Using Url" << url_index << " as the download url this time";
   CHECK(url_index < response.payload_urls.size());
   install_plan_.download_url = response.payload_urls[url_index];
+  install_plan_.repair_url =
+      response.payload_urls[(url_index + 1) % response.payload_urls.size()];
 
   // Fill up the other properties based on the response.
   install_plan_.payload_size = response.size;
@@ -51,6 +67,13 @@ void OmahaResponseHandlerAction::PerformAction() {
   install_plan_.is_resume =
       DeltaPerformer::CanResumeUpdate(system_state_->prefs(), response.hash);
   if (!install_plan_.is_resume) {
+    // The progress of an earlier attempt at the same payload is lost, but
+    // what it wrote isn't.
+    string interrupted_hash;
+    install_plan_.is_reapply =
+        system_state_->prefs()->GetString(kPrefsUpdateCheckResponseHash,
+                                          &interrupted_hash) &&
+        !interrupted_hash.empty() && interrupted_hash == response.hash;
     LOG_IF(WARNING, !DeltaPerformer::ResetUpdateProgress(
         system_state_->prefs(), false))
         << "Unable to reset the update progress.";
@@ -64,6 +87,15 @@ void OmahaResponseHandlerAction::PerformAction() {
       &install_plan_.install_path));
   install_plan_.kernel_install_path =
       utils::BootKernelDevice(install_plan_.install_path);
+  for (size_t i = 0; i < mirror_disks_.size(); i++) {
+    install_plan_.mirror_install_paths.push_back(
+        MirrorPartition(mirror_disks_[i], install_plan_.install_path));
+    if (!install_plan_.kernel_install_path.empty()) {
+      install_plan_.kernel_mirror_install_paths.push_back(
+          MirrorPartition(mirror_disks_[i],
+                          install_plan_.kernel_install_path));
+    }
+  }
 
   TEST_AND_RETURN(HasOutputPipe());
   if (HasOutputPipe())
@@ -114,6 +146,13 @@ bool OmahaResponseHandlerAction::AreHashChecksMandatory(
     return false;
   }
 
+  // The peers are just other machines of the network.
+  if (!system_state_->request_params()->peers().empty()) {
+    LOG(INFO) << "Mandating payload hash checks since the payload may come "
+              << "from peers";
+    return true;
+  }
+
   // TODO(jaysri): VALIDATION: For official builds, we currently waive hash
   // checks for HTTPS until we have rolled out at least once and are confident
   // nothing breaks. chromium-os:37082 tracks turning this on for HTTPS
@@ -6,6 +6,7 @@
 #define CHROMEOS_PLATFORM_UPDATE_ENGINE_OMAHA_RESPONSE_HANDLER_ACTION_H__
 
 #include <string>
+#include <vector>
 
 #include <gtest/gtest_prod.h>  // for FRIEND_TEST
 
@@ -56,6 +57,13 @@ class OmahaResponseHandlerAction : public Action<OmahaResponseHandlerAction> {
   std::string Type() const { return StaticType(); }
   void set_key_path(const std::string& path) { key_path_ = path; }
 
+  // Makes the install plan also write the partitions of the |disks|, e.g.,
+  // "/dev/sdb", with the numbers of those it installs to, which mirror them.
+  // See InstallPlan::mirror_install_paths.
+  void set_mirror_disks(const std::vector<std::string>& disks) {
+    mirror_disks_ = disks;
+  }
+
  private:
   FRIEND_TEST(UpdateAttempterTest, CreatePendingErrorEventResumedTest);
 
@@ -85,6 +93,9 @@ class OmahaResponseHandlerAction : public Action<OmahaResponseHandlerAction> {
   // Public key path to use for payload verification.
   std::string key_path_;
 
+  // See set_mirror_disks().
+  std::vector<std::string> mirror_disks_;
+
   DISALLOW_COPY_AND_ASSIGN(OmahaResponseHandlerAction);
 };
 
@@ -117,6 +117,7 @@ TEST_F(OmahaResponseHandlerActionTest, SimpleTest) {
     InstallPlan install_plan;
     EXPECT_TRUE(DoTest(in, "/dev/sda3", &install_plan));
     EXPECT_EQ(in.payload_urls[0], install_plan.download_url);
+    EXPECT_EQ(in.payload_urls[0], install_plan.repair_url);
     EXPECT_EQ(in.hash, install_plan.payload_hash);
     EXPECT_EQ("/dev/sda4", install_plan.install_path);
     string deadline;
@@ -226,6 +227,7 @@ TEST_F(OmahaResponseHandlerActionTest, HashChecksForBothHttpAndHttpsTest) {
   InstallPlan install_plan;
   EXPECT_TRUE(DoTest(in, "/dev/sda4", &install_plan));
   EXPECT_EQ(in.payload_urls[0], install_plan.download_url);
+  EXPECT_EQ(in.payload_urls[1], install_plan.repair_url);
   EXPECT_EQ(in.hash, install_plan.payload_hash);
   EXPECT_TRUE(install_plan.hash_checks_mandatory);
 }
@@ -0,0 +1,128 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/omaha_response_parser.h"
+
+#include <string.h>
+
+#include <base/logging.h>
+
+using std::map;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Without entity substitution, which would also expand external entities,
+// libxml2 passes an '&' in an attribute value on as this character
+// reference. Everything else is decoded already.
+const char kAmpersandReference[] = "&#38;";
+
+string DecodeAttributeValue(const xmlChar* begin, const xmlChar* end) {
+  string value(reinterpret_cast<const char*>(begin),
+               reinterpret_cast<const char*>(end));
+  const size_t kReferenceLength = strlen(kAmpersandReference);
+  for (size_t pos = value.find(kAmpersandReference); pos != string::npos;
+       pos = value.find(kAmpersandReference, pos + 1)) {
+    value.replace(pos, kReferenceLength, "&");
+  }
+  return value;
+}
+
+}  // namespace {}
+
+OmahaResponseParser::OmahaResponseParser() : failed_(false) {
+  xmlSAXHandler handler;
+  memset(&handler, 0, sizeof(handler));
+  handler.initialized = XML_SAX2_MAGIC;
+  handler.startElementNs = StartElement;
+  handler.endElementNs = EndElement;
+  // The handler is copied into the context.
+  context_ = xmlCreatePushParserCtxt(&handler, this, NULL, 0, NULL);
+  if (context_) {
+    xmlCtxtUseOptions(context_, XML_PARSE_NONET);
+  } else {
+    LOG(ERROR) << "xmlCreatePushParserCtxt() returned NULL";
+    failed_ = true;
+  }
+}
+
+OmahaResponseParser::~OmahaResponseParser() {
+  if (context_)
+    xmlFreeParserCtxt(context_);
+}
+
+void OmahaResponseParser::CollectElements(const string& path) {
+  elements_[path];
+}
+
+bool OmahaResponseParser::Parse(const char* bytes, size_t length) {
+  if (failed_)
+    return false;
+  if (length > 0 && xmlParseChunk(context_, bytes, length, 0) != 0)
+    failed_ = true;
+  return !failed_;
+}
+
+bool OmahaResponseParser::Finish() {
+  if (failed_)
+    return false;
+  if (xmlParseChunk(context_, NULL, 0, 1) != 0 || !context_->wellFormed)
+    failed_ = true;
+  return !failed_;
+}
+
+const vector<OmahaResponseParser::Attributes>& OmahaResponseParser::Elements(
+    const string& path) const {
+  map<string, vector<Attributes> >::const_iterator it = elements_.find(path);
+  CHECK(it != elements_.end()) << "Not collecting the elements at " << path;
+  return it->second;
+}
+
+void OmahaResponseParser::StartElement(void* context,
+                                       const xmlChar* local_name,
+                                       const xmlChar* prefix,
+                                       const xmlChar* uri,
+                                       int num_namespaces,
+                                       const xmlChar** namespaces,
+                                       int num_attributes,
+                                       int num_defaulted,
+                                       const xmlChar** attributes) {
+  OmahaResponseParser* parser =
+      reinterpret_cast<OmahaResponseParser*>(context);
+  parser->path_lengths_.push_back(parser->path_.size());
+  parser->path_ += "/";
+  // Elements in a namespace get a step that no collected path has.
+  if (uri)
+    parser->path_ += string("{") + reinterpret_cast<const char*>(uri) + "}";
+  parser->path_ += reinterpret_cast<const char*>(local_name);
+
+  map<string, vector<Attributes> >::iterator it =
+      parser->elements_.find(parser->path_);
+  if (it == parser->elements_.end())
+    return;
+  it->second.push_back(Attributes());
+  Attributes& element = it->second.back();
+  // Each attribute is given as local name, prefix, URI, value and value end.
+  for (int i = 0; i < num_attributes; i++) {
+    const xmlChar** attribute = attributes + 5 * i;
+    element[reinterpret_cast<const char*>(attribute[0])] =
+        DecodeAttributeValue(attribute[3], attribute[4]);
+  }
+}
+
+void OmahaResponseParser::EndElement(void* context,
+                                     const xmlChar* local_name,
+                                     const xmlChar* prefix,
+                                     const xmlChar* uri) {
+  OmahaResponseParser* parser =
+      reinterpret_cast<OmahaResponseParser*>(context);
+  CHECK(!parser->path_lengths_.empty());
+  parser->path_.resize(parser->path_lengths_.back());
+  parser->path_lengths_.pop_back();
+}
+
+}  // namespace chromeos_update_engine
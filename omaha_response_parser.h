@@ -0,0 +1,80 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_OMAHA_RESPONSE_PARSER_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_OMAHA_RESPONSE_PARSER_H__
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <base/basictypes.h>
+#include <libxml/parser.h>
+
+// A streaming parser for Omaha responses. The response is fed to libxml2's
+// SAX2 push parser as it arrives, and only the attributes of the elements
+// at the paths asked for are kept, so no document tree is built and no
+// XPath queries have to be run over it once the transfer is done.
+
+namespace chromeos_update_engine {
+
+class OmahaResponseParser {
+ public:
+  typedef std::map<std::string, std::string> Attributes;
+
+  OmahaResponseParser();
+  ~OmahaResponseParser();
+
+  // Makes the parser collect the attributes of the elements at |path|,
+  // e.g., "/response/app/updatecheck". Like an XPath expression without
+  // prefixes, |path| only matches elements that aren't in a namespace. Must
+  // be called before the first Parse().
+  void CollectElements(const std::string& path);
+
+  // Parses the next |length| bytes of the response. Returns false if the
+  // response is known not to be well-formed XML, after which the rest of
+  // the response is ignored.
+  bool Parse(const char* bytes, size_t length);
+
+  // Parses whatever is left once the whole response has been passed to
+  // Parse(). Returns true if the response was well-formed XML.
+  bool Finish();
+
+  // Returns the attributes of the elements found at |path| so far, in
+  // document order. |path| must have been passed to CollectElements().
+  const std::vector<Attributes>& Elements(const std::string& path) const;
+
+ private:
+  // libxml2 SAX2 callbacks. |context| is the parser.
+  static void StartElement(void* context,
+                           const xmlChar* local_name,
+                           const xmlChar* prefix,
+                           const xmlChar* uri,
+                           int num_namespaces,
+                           const xmlChar** namespaces,
+                           int num_attributes,
+                           int num_defaulted,
+                           const xmlChar** attributes);
+  static void EndElement(void* context,
+                         const xmlChar* local_name,
+                         const xmlChar* prefix,
+                         const xmlChar* uri);
+
+  xmlParserCtxt* context_;
+  bool failed_;
+
+  // The path of the element being parsed and, for each open element, the
+  // length of |path_| before it was entered.
+  std::string path_;
+  std::vector<size_t> path_lengths_;
+
+  // The elements collected so far, by path.
+  std::map<std::string, std::vector<Attributes> > elements_;
+
+  DISALLOW_COPY_AND_ASSIGN(OmahaResponseParser);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_OMAHA_RESPONSE_PARSER_H__
@@ -0,0 +1,94 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <string.h>
+
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+#include "update_engine/omaha_response_parser.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+const char kResponse[] =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?><response protocol=\"3.0\">"
+    "<app appid=\"x\"><updatecheck status=\"ok\" PollInterval=\"10\">"
+    "<urls><url codebase=\"http://a/\"/><url codebase=\"a&amp;b&lt;\"/>"
+    "</urls><manifest><packages><package name=\"p1\" size=\"1\"/>"
+    "<package name=\"p2\"/></packages></manifest></updatecheck></app>"
+    "<app xmlns=\"urn:other\"><updatecheck status=\"other\"/></app>"
+    "</response>";
+}  // namespace {}
+
+TEST(OmahaResponseParserTest, CollectTest) {
+  OmahaResponseParser parser;
+  parser.CollectElements("/response/app/updatecheck");
+  parser.CollectElements("/response/app/updatecheck/urls/url");
+  parser.CollectElements(
+      "/response/app/updatecheck/manifest/packages/package");
+  parser.CollectElements("/response/app/updatecheck/manifest/actions/action");
+  // Feeding the response a byte at a time makes elements and attributes
+  // straddle the chunks.
+  for (size_t i = 0; i < strlen(kResponse); i++)
+    EXPECT_TRUE(parser.Parse(kResponse + i, 1));
+  EXPECT_TRUE(parser.Finish());
+
+  // The update check in the other namespace isn't at the path.
+  const vector<OmahaResponseParser::Attributes>& update_checks =
+      parser.Elements("/response/app/updatecheck");
+  ASSERT_EQ(1U, update_checks.size());
+  EXPECT_EQ(2U, update_checks[0].size());
+  EXPECT_EQ("ok", update_checks[0].find("status")->second);
+  EXPECT_EQ("10", update_checks[0].find("PollInterval")->second);
+
+  const vector<OmahaResponseParser::Attributes>& urls =
+      parser.Elements("/response/app/updatecheck/urls/url");
+  ASSERT_EQ(2U, urls.size());
+  EXPECT_EQ("http://a/", urls[0].find("codebase")->second);
+  EXPECT_EQ("a&b<", urls[1].find("codebase")->second);
+
+  const vector<OmahaResponseParser::Attributes>& packages =
+      parser.Elements("/response/app/updatecheck/manifest/packages/package");
+  ASSERT_EQ(2U, packages.size());
+  EXPECT_EQ("p1", packages[0].find("name")->second);
+  EXPECT_EQ("p2", packages[1].find("name")->second);
+  EXPECT_TRUE(packages[1].find("size") == packages[1].end());
+
+  EXPECT_TRUE(parser.Elements(
+      "/response/app/updatecheck/manifest/actions/action").empty());
+}
+
+TEST(OmahaResponseParserTest, DecodeTest) {
+  const string response =
+      "<response><app a=\"&amp;#38;&#38;&amp;amp;&#x3A9;\"/></response>";
+  OmahaResponseParser parser;
+  parser.CollectElements("/response/app");
+  EXPECT_TRUE(parser.Parse(response.data(), response.size()));
+  EXPECT_TRUE(parser.Finish());
+  ASSERT_EQ(1U, parser.Elements("/response/app").size());
+  EXPECT_EQ("&#38;&&amp;\xce\xa9",
+            parser.Elements("/response/app")[0].find("a")->second);
+}
+
+TEST(OmahaResponseParserTest, InvalidXmlTest) {
+  const string response = "<response><app></response>";
+  OmahaResponseParser parser;
+  parser.CollectElements("/response/app");
+  parser.Parse(response.data(), response.size());
+  EXPECT_FALSE(parser.Finish());
+  // Once failed, the parser stays failed.
+  EXPECT_FALSE(parser.Parse(response.data(), response.size()));
+}
+
+TEST(OmahaResponseParserTest, EmptyTest) {
+  OmahaResponseParser parser;
+  EXPECT_TRUE(parser.Parse("", 0));
+  EXPECT_FALSE(parser.Finish());
+}
+
+}  // namespace chromeos_update_engine
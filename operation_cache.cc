@@ -0,0 +1,103 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/operation_cache.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <base/logging.h>
+#include <base/string_number_conversions.h>
+
+#include "update_engine/omaha_hash_calculator.h"
+#include "update_engine/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+// Entries start with this, then the operation type byte and the data. The
+// version goes up whenever the encoders change their output.
+const char kEntryMagic[] = "CrAUop01";
+const size_t kEntryMagicSize = 8;
+const size_t kEntryHeaderSize = kEntryMagicSize + 1;
+}  // namespace {}
+
+bool OperationCache::ComputeKey(const char* old_data,
+                                size_t old_size,
+                                const char* new_data,
+                                size_t new_size,
+                                const string& params,
+                                string* key) {
+  vector<char> old_hash, new_hash;
+  if (old_data) {
+    TEST_AND_RETURN_FALSE(
+        OmahaHashCalculator::RawHashOfBytes(old_data, old_size, &old_hash));
+  }
+  TEST_AND_RETURN_FALSE(
+      OmahaHashCalculator::RawHashOfBytes(new_data, new_size, &new_hash));
+  OmahaHashCalculator hasher;
+  TEST_AND_RETURN_FALSE(hasher.Update(kEntryMagic, kEntryMagicSize));
+  // Full operations hash no old data, which can't be confused with the
+  // hash of empty old data.
+  const char has_old = old_data ? 1 : 0;
+  TEST_AND_RETURN_FALSE(hasher.Update(&has_old, 1));
+  if (old_data)
+    TEST_AND_RETURN_FALSE(hasher.Update(&old_hash[0], old_hash.size()));
+  TEST_AND_RETURN_FALSE(hasher.Update(&new_hash[0], new_hash.size()));
+  TEST_AND_RETURN_FALSE(hasher.Update(params.data(), params.size()));
+  TEST_AND_RETURN_FALSE(hasher.Finalize());
+  const vector<char>& hash = hasher.raw_hash();
+  *key = base::HexEncode(&hash[0], hash.size());
+  return true;
+}
+
+bool OperationCache::Get(const string& key,
+                         vector<char>* data,
+                         DeltaArchiveManifest_InstallOperation_Type* type) {
+  const string path = dir_ + "/" + key;
+  vector<char> entry;
+  if (!utils::ReadFile(path, &entry))
+    return false;
+  if (entry.size() < kEntryHeaderSize ||
+      memcmp(&entry[0], kEntryMagic, kEntryMagicSize) != 0 ||
+      !DeltaArchiveManifest_InstallOperation_Type_IsValid(
+          entry[kEntryMagicSize])) {
+    LOG(WARNING) << "Ignoring bad operation cache entry " << path;
+    return false;
+  }
+  *type = static_cast<DeltaArchiveManifest_InstallOperation_Type>(
+      entry[kEntryMagicSize]);
+  data->assign(entry.begin() + kEntryHeaderSize, entry.end());
+  return true;
+}
+
+void OperationCache::Put(const string& key,
+                         const vector<char>& data,
+                         DeltaArchiveManifest_InstallOperation_Type type) {
+  const string path = dir_ + "/" + key;
+  string temp_path;
+  int temp_fd = -1;
+  if (!utils::MakeTempFile(dir_ + "/.op.XXXXXX", &temp_path, &temp_fd)) {
+    LOG(WARNING) << "Unable to store operation in cache " << dir_;
+    return;
+  }
+  ScopedPathUnlinker temp_unlinker(temp_path);
+  char header[kEntryHeaderSize];
+  memcpy(header, kEntryMagic, kEntryMagicSize);
+  header[kEntryMagicSize] = type;
+  bool success = utils::WriteAll(temp_fd, header, sizeof(header)) &&
+      (data.empty() || utils::WriteAll(temp_fd, &data[0], data.size()));
+  success = (close(temp_fd) == 0) && success;
+  if (success && rename(temp_path.c_str(), path.c_str()) == 0) {
+    temp_unlinker.set_should_remove(false);
+  } else {
+    PLOG(WARNING) << "Unable to store operation in cache " << path;
+  }
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,59 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_OPERATION_CACHE_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_OPERATION_CACHE_H__
+
+#include <string>
+#include <vector>
+
+#include <base/basictypes.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+// Stores the data blobs and types of the operations the delta generator
+// encodes on disk, keyed by the SHA-256 hashes of the old and new data and
+// of the settings they were encoded with. Successive builds share most
+// files, so generating their deltas only encodes each pair of files once.
+// Entries are written to a temporary file and renamed into place, so a
+// cache directory may be shared by concurrent generators.
+
+namespace chromeos_update_engine {
+
+class OperationCache {
+ public:
+  explicit OperationCache(const std::string& dir) : dir_(dir) {}
+
+  // Computes into |key| the key of the operation that encodes the
+  // |new_size| bytes at |new_data| from the |old_size| bytes at |old_data|,
+  // which is NULL for a full operation. |params| tells apart the settings
+  // the operation is encoded with. Returns true on success.
+  static bool ComputeKey(const char* old_data,
+                         size_t old_size,
+                         const char* new_data,
+                         size_t new_size,
+                         const std::string& params,
+                         std::string* key);
+
+  // Sets |data| and |type| to the operation stored under |key|. Returns
+  // true if there's one; a bad entry is ignored.
+  bool Get(const std::string& key,
+           std::vector<char>* data,
+           DeltaArchiveManifest_InstallOperation_Type* type);
+
+  // Stores |data| and |type| under |key|. Failing to write the cache is
+  // logged but not an error.
+  void Put(const std::string& key,
+           const std::vector<char>& data,
+           DeltaArchiveManifest_InstallOperation_Type type);
+
+ private:
+  std::string dir_;
+
+  DISALLOW_COPY_AND_ASSIGN(OperationCache);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_OPERATION_CACHE_H__
@@ -0,0 +1,79 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/operation_cache.h"
+#include "update_engine/test_utils.h"
+#include "update_engine/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class OperationCacheTest : public ::testing::Test {};
+
+TEST(OperationCacheTest, ComputeKeyTest) {
+  const char kOld[] = "old data";
+  const char kNew[] = "new data";
+  string key, other_key;
+  EXPECT_TRUE(OperationCache::ComputeKey(kOld, sizeof(kOld), kNew,
+                                         sizeof(kNew), "a", &key));
+  EXPECT_EQ(64, key.size());
+  EXPECT_TRUE(OperationCache::ComputeKey(kOld, sizeof(kOld), kNew,
+                                         sizeof(kNew), "a", &other_key));
+  EXPECT_EQ(key, other_key);
+
+  // Each input changes the key, and no old data is told apart from empty
+  // old data.
+  EXPECT_TRUE(OperationCache::ComputeKey(kOld, sizeof(kOld), kNew,
+                                         sizeof(kNew), "b", &other_key));
+  EXPECT_NE(key, other_key);
+  EXPECT_TRUE(OperationCache::ComputeKey(kOld, sizeof(kOld) - 1, kNew,
+                                         sizeof(kNew), "a", &other_key));
+  EXPECT_NE(key, other_key);
+  EXPECT_TRUE(OperationCache::ComputeKey(kOld, sizeof(kOld), kNew,
+                                         sizeof(kNew) - 1, "a", &other_key));
+  EXPECT_NE(key, other_key);
+  EXPECT_TRUE(OperationCache::ComputeKey(NULL, 0, kNew, sizeof(kNew), "a",
+                                         &key));
+  EXPECT_TRUE(OperationCache::ComputeKey(kOld, 0, kNew, sizeof(kNew), "a",
+                                         &other_key));
+  EXPECT_NE(key, other_key);
+}
+
+TEST(OperationCacheTest, GetPutTest) {
+  string cache_dir;
+  ASSERT_TRUE(utils::MakeTempDirectory("/tmp/OperationCacheTest.XXXXXX",
+                                       &cache_dir));
+  OperationCache cache(cache_dir);
+  vector<char> data;
+  DeltaArchiveManifest_InstallOperation_Type type =
+      DeltaArchiveManifest_InstallOperation_Type_REPLACE;
+  EXPECT_FALSE(cache.Get("key", &data, &type));
+
+  const vector<char> kData(10, 'x');
+  cache.Put("key", kData, DeltaArchiveManifest_InstallOperation_Type_BSDIFF);
+  cache.Put("empty", vector<char>(),
+            DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ);
+  EXPECT_TRUE(cache.Get("key", &data, &type));
+  EXPECT_TRUE(kData == data);
+  EXPECT_EQ(DeltaArchiveManifest_InstallOperation_Type_BSDIFF, type);
+  EXPECT_TRUE(cache.Get("empty", &data, &type));
+  EXPECT_TRUE(data.empty());
+  EXPECT_EQ(DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ, type);
+
+  // Bad entries are ignored.
+  EXPECT_TRUE(WriteFileString(cache_dir + "/bad", "CrAU"));
+  EXPECT_FALSE(cache.Get("bad", &data, &type));
+  EXPECT_TRUE(WriteFileString(cache_dir + "/bad", "CrAUop01\x7f"));
+  EXPECT_FALSE(cache.Get("bad", &data, &type));
+  EXPECT_TRUE(utils::RecursiveUnlinkDir(cache_dir));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,213 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/parallel_filesystem_iterator.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <string.h>
+
+#include <base/logging.h>
+
+#include "update_engine/thread_pool.h"
+#include "update_engine/utils.h"
+
+using std::set;
+using std::string;
+using std::tr1::shared_ptr;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+// Reads the entries of a directory and lstat()s them on a ThreadPool worker.
+class ParallelFilesystemIterator::ListDirectoryTask : public ThreadPoolTask {
+ public:
+  struct Entry {
+    string name;
+    struct stat stbuf;
+  };
+
+  ListDirectoryTask(const string& full_path, const string& partial_path)
+      : full_path_(full_path),
+        partial_path_(partial_path),
+        missing_(false) {}
+
+  virtual bool Run() {
+    DIR* dir = opendir(full_path_.c_str());
+    if (!dir) {
+      if (errno == ENOTDIR || errno == ENOENT) {
+        // Either it's not a dir or it doesn't exist anymore. That's fine,
+        // it's just skipped over.
+        missing_ = true;
+        return true;
+      }
+      PLOG(ERROR) << "opendir " << full_path_ << " failed";
+      return false;
+    }
+    bool success = true;
+    for (;;) {
+      struct dirent dir_entry;
+      struct dirent* dir_entry_pointer;
+      errno = readdir_r(dir, &dir_entry, &dir_entry_pointer);
+      if (errno != 0) {
+        PLOG(ERROR) << "readdir_r " << full_path_ << " failed";
+        success = false;
+        break;
+      }
+      if (!dir_entry_pointer)
+        break;
+      if (!strcmp(dir_entry_pointer->d_name, ".") ||
+          !strcmp(dir_entry_pointer->d_name, ".."))
+        continue;
+      entries_.resize(entries_.size() + 1);
+      Entry* entry = &entries_.back();
+      entry->name = dir_entry_pointer->d_name;
+      const string path = full_path_ + "/" + entry->name;
+      if (lstat(path.c_str(), &entry->stbuf) != 0) {
+        PLOG(ERROR) << "lstat " << path << " failed";
+        success = false;
+        break;
+      }
+    }
+    if (closedir(dir) != 0) {
+      PLOG(ERROR) << "closedir " << full_path_ << " failed";
+      success = false;
+    }
+    return success;
+  }
+
+  const string& partial_path() const { return partial_path_; }
+  const vector<Entry>& entries() const { return entries_; }
+  // Whether the directory couldn't be opened as it wasn't one, or was gone.
+  bool missing() const { return missing_; }
+
+ private:
+  const string full_path_;
+  const string partial_path_;
+  vector<Entry> entries_;
+  bool missing_;
+
+  DISALLOW_COPY_AND_ASSIGN(ListDirectoryTask);
+};
+
+ParallelFilesystemIterator::ParallelFilesystemIterator(
+    const string& path,
+    const set<string>& excl_prefixes,
+    ThreadPool* pool)
+    : pool_(pool),
+      root_path_(utils::NormalizePath(path, true)),
+      excl_prefixes_(excl_prefixes),
+      is_end_(false),
+      is_err_(false) {
+  if (lstat(root_path_.c_str(), &stbuf_) != 0) {
+    PLOG(INFO) << "lstat " << root_path_ << " failed. Aborting";
+    SetError();
+    return;
+  }
+  root_dev_ = stbuf_.st_dev;
+  if (S_ISDIR(stbuf_.st_mode))
+    current_dir_ = SubmitListing(partial_path_);
+}
+
+ParallelFilesystemIterator::~ParallelFilesystemIterator() {
+  if (current_dir_.get())
+    pool_->Wait(current_dir_.get());
+  for (vector<Level>::iterator it = levels_.begin(); it != levels_.end();
+       ++it) {
+    for (vector<shared_ptr<ListDirectoryTask> >::iterator subdir =
+             it->subdirs.begin(); subdir != it->subdirs.end(); ++subdir) {
+      if (subdir->get())
+        pool_->Wait(subdir->get());
+    }
+  }
+}
+
+void ParallelFilesystemIterator::Increment() {
+  CHECK(!is_end_);
+  if (current_dir_.get()) {
+    shared_ptr<ListDirectoryTask> task;
+    task.swap(current_dir_);
+    EnterDirectory(task);
+    if (is_err_)
+      return;
+  }
+  NextEntry();
+}
+
+shared_ptr<ParallelFilesystemIterator::ListDirectoryTask>
+ParallelFilesystemIterator::SubmitListing(const string& partial_path) {
+  shared_ptr<ListDirectoryTask> task(
+      new ListDirectoryTask(root_path_ + partial_path, partial_path));
+  pool_->Submit(task.get());
+  return task;
+}
+
+void ParallelFilesystemIterator::EnterDirectory(
+    const shared_ptr<ListDirectoryTask>& task) {
+  if (!pool_->Wait(task.get())) {
+    LOG(INFO) << "Reading " << root_path_ << task->partial_path()
+              << " failed. Aborting";
+    SetError();
+    return;
+  }
+  if (task->missing()) {
+    LOG(ERROR) << "Can't descend into " << root_path_ << task->partial_path();
+    return;
+  }
+  levels_.resize(levels_.size() + 1);
+  Level* level = &levels_.back();
+  level->task = task;
+  level->next_entry = 0;
+
+  // Start reading the subdirectories right away, so they'll likely be
+  // ready by the time the caller gets to them.
+  const vector<ListDirectoryTask::Entry>& entries = task->entries();
+  level->subdirs.resize(entries.size());
+  for (size_t i = 0; i < entries.size(); i++) {
+    const struct stat& stbuf = entries[i].stbuf;
+    const string partial_path = task->partial_path() + "/" + entries[i].name;
+    if (S_ISDIR(stbuf.st_mode) && stbuf.st_dev == root_dev_ &&
+        !IsExcluded(partial_path))
+      level->subdirs[i] = SubmitListing(partial_path);
+  }
+}
+
+void ParallelFilesystemIterator::NextEntry() {
+  while (!levels_.empty()) {
+    Level* level = &levels_.back();
+    const vector<ListDirectoryTask::Entry>& entries = level->task->entries();
+    if (level->next_entry == entries.size()) {
+      // No more children in this dir. Go up.
+      levels_.pop_back();
+      continue;
+    }
+    const size_t i = level->next_entry++;
+    const string partial_path =
+        level->task->partial_path() + "/" + entries[i].name;
+    if (IsExcluded(partial_path))
+      continue;
+    partial_path_ = partial_path;
+    stbuf_ = entries[i].stbuf;
+    current_dir_.swap(level->subdirs[i]);
+    return;
+  }
+  // Done with the entire iteration.
+  is_end_ = true;
+}
+
+bool ParallelFilesystemIterator::IsExcluded(const string& partial_path) const {
+  for (set<string>::const_iterator it = excl_prefixes_.begin();
+       it != excl_prefixes_.end(); ++it) {
+    if (utils::StringHasPrefix(partial_path, *it))
+      return true;
+  }
+  return false;
+}
+
+void ParallelFilesystemIterator::SetError() {
+  is_end_ = true;
+  is_err_ = true;
+}
+
+}  // namespace chromeos_update_engine
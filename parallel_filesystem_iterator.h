@@ -0,0 +1,125 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_PARALLEL_FILESYSTEM_ITERATOR_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_PARALLEL_FILESYSTEM_ITERATOR_H__
+
+// Walks a filesystem like FilesystemIterator, visiting the same files in the
+// same order, but reads the directories on the workers of a ThreadPool: a
+// directory is listed and its entries are lstat()ed as soon as it's found,
+// while the caller goes on with the entries before it. This hides most of
+// the walk on large trees, where it's dominated by the lstat() calls.
+
+// Unlike FilesystemIterator, a directory may be read before the caller gets
+// to it, so changes made to the tree during the walk may not be seen.
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <set>
+#include <string>
+#include <tr1/memory>
+#include <vector>
+
+#include <base/basictypes.h>
+
+namespace chromeos_update_engine {
+
+class ThreadPool;
+
+class ParallelFilesystemIterator {
+ public:
+  // |pool| isn't owned and must outlive the iterator.
+  ParallelFilesystemIterator(const std::string& path,
+                             const std::set<std::string>& excl_prefixes,
+                             ThreadPool* pool);
+
+  // Waits for the directories being read.
+  ~ParallelFilesystemIterator();
+
+  // Returns stat struct for the current file.
+  struct stat GetStat() const {
+    return stbuf_;
+  }
+
+  // Returns full path for current file.
+  std::string GetFullPath() const {
+    return root_path_ + partial_path_;
+  }
+
+  // Returns the path relative to the root, as
+  // FilesystemIterator::GetPartialPath() does.
+  std::string GetPartialPath() const {
+    return partial_path_;
+  }
+
+  // Increments to the next file.
+  void Increment();
+
+  // If we're at the end. If at the end, do not call GetStat(), etc.
+  bool IsEnd() const {
+    return is_end_;
+  }
+
+  // Returns true if the iterator is in an error state.
+  bool IsErr() const {
+    return is_err_;
+  }
+
+ private:
+  class ListDirectoryTask;
+
+  // A directory being iterated, with the listing tasks of its
+  // subdirectories that haven't been entered yet.
+  struct Level {
+    std::tr1::shared_ptr<ListDirectoryTask> task;
+    std::vector<std::tr1::shared_ptr<ListDirectoryTask> > subdirs;
+    size_t next_entry;
+  };
+
+  // Starts reading the directory at |partial_path| on the pool.
+  std::tr1::shared_ptr<ListDirectoryTask> SubmitListing(
+      const std::string& partial_path);
+
+  // Waits for the listing of |task| and starts iterating it, starting to
+  // read its subdirectories in turn.
+  void EnterDirectory(const std::tr1::shared_ptr<ListDirectoryTask>& task);
+
+  // Moves to the next entry of the innermost directory, going up the tree
+  // when it has no more entries.
+  void NextEntry();
+
+  bool IsExcluded(const std::string& partial_path) const;
+
+  void SetError();
+
+  ThreadPool* pool_;
+
+  // The device of the root path we've been asked to iterate.
+  dev_t root_dev_;
+
+  // The root path we've been asked to iterate.
+  std::string root_path_;
+
+  // Exclude items w/ this prefix.
+  std::set<std::string> excl_prefixes_;
+
+  // The directories from the root to the parent of the current file.
+  std::vector<Level> levels_;
+
+  // The current file, and the listing task of its contents if it's a
+  // directory that will be descended into.
+  std::string partial_path_;
+  struct stat stbuf_;
+  std::tr1::shared_ptr<ListDirectoryTask> current_dir_;
+
+  bool is_end_;
+  bool is_err_;
+
+  DISALLOW_COPY_AND_ASSIGN(ParallelFilesystemIterator);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_PARALLEL_FILESYSTEM_ITERATOR_H__
@@ -0,0 +1,120 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include <base/stringprintf.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/filesystem_iterator.h"
+#include "update_engine/parallel_filesystem_iterator.h"
+#include "update_engine/test_utils.h"
+#include "update_engine/thread_pool.h"
+#include "update_engine/utils.h"
+
+using std::set;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+const char* TestDir() { return "./ParallelFilesystemIteratorTest-dir"; }
+}  // namespace {}
+
+class ParallelFilesystemIteratorTest : public ::testing::Test {
+ protected:
+  ParallelFilesystemIteratorTest() : pool_(3) {}
+
+  virtual void SetUp() {
+    ASSERT_TRUE(pool_.Init());
+    EXPECT_EQ(0, System(StringPrintf("rm -rf %s", TestDir())));
+    EXPECT_EQ(0, System(StringPrintf("mkdir -p %s", TestDir())));
+  }
+
+  virtual void TearDown() {
+    EXPECT_EQ(0, System(StringPrintf("rm -rf %s", TestDir())));
+  }
+
+  ThreadPool pool_;
+};
+
+TEST_F(ParallelFilesystemIteratorTest, SameOrderTest) {
+  const string dir = TestDir();
+  for (int i = 0; i < 20; i++) {
+    const string subdir = StringPrintf("%s/dir%d", dir.c_str(), i);
+    ASSERT_EQ(0, mkdir(subdir.c_str(), 0755));
+    ASSERT_EQ(0, mkdir((subdir + "/nested").c_str(), 0755));
+    for (int j = 0; j < 10; j++) {
+      EXPECT_TRUE(WriteFileString(StringPrintf("%s/nested/file%d",
+                                               subdir.c_str(), j), "x"));
+    }
+    EXPECT_TRUE(WriteFileString(subdir + "/file", "y"));
+  }
+  ASSERT_EQ(0, mkdir((dir + "/lost+found").c_str(), 0755));
+  EXPECT_TRUE(WriteFileString(dir + "/lost+found/file", "z"));
+  ASSERT_EQ(0, symlink("dir0", (dir + "/link").c_str()));
+
+  const set<string> excl_prefixes = utils::SetWithValue<string>("/lost+found");
+  FilesystemIterator expected(dir, excl_prefixes);
+  ParallelFilesystemIterator iter(dir, excl_prefixes, &pool_);
+  int count = 0;
+  while (!expected.IsEnd()) {
+    ASSERT_FALSE(iter.IsEnd());
+    EXPECT_EQ(expected.GetPartialPath(), iter.GetPartialPath());
+    EXPECT_EQ(expected.GetFullPath(), iter.GetFullPath());
+    EXPECT_EQ(expected.GetStat().st_ino, iter.GetStat().st_ino);
+    EXPECT_EQ(expected.GetStat().st_mode, iter.GetStat().st_mode);
+    EXPECT_FALSE(utils::StringHasPrefix(iter.GetPartialPath(),
+                                        "/lost+found"));
+    expected.Increment();
+    iter.Increment();
+    count++;
+  }
+  EXPECT_TRUE(iter.IsEnd());
+  EXPECT_FALSE(iter.IsErr());
+  // The root, 20 * (dir, nested, 10 files, file) and the link.
+  EXPECT_EQ(1 + 20 * 13 + 1, count);
+}
+
+TEST_F(ParallelFilesystemIteratorTest, NegativeTest) {
+  {
+    ParallelFilesystemIterator iter("/non/existent/path", set<string>(),
+                                    &pool_);
+    EXPECT_TRUE(iter.IsEnd());
+    EXPECT_TRUE(iter.IsErr());
+  }
+
+  {
+    const string file = string(TestDir()) + "/file";
+    EXPECT_TRUE(WriteFileString(file, "x"));
+    ParallelFilesystemIterator iter(file, set<string>(), &pool_);
+    EXPECT_FALSE(iter.IsEnd());
+    EXPECT_EQ("", iter.GetPartialPath());
+    EXPECT_TRUE(S_ISREG(iter.GetStat().st_mode));
+    iter.Increment();
+    EXPECT_TRUE(iter.IsEnd());
+    EXPECT_FALSE(iter.IsErr());
+  }
+}
+
+TEST_F(ParallelFilesystemIteratorTest, DestroyMidwayTest) {
+  const string dir = TestDir();
+  for (int i = 0; i < 20; i++)
+    ASSERT_EQ(0, mkdir(StringPrintf("%s/dir%d", dir.c_str(), i).c_str(),
+                       0755));
+  ParallelFilesystemIterator iter(dir, set<string>(), &pool_);
+  iter.Increment();
+  iter.Increment();
+  EXPECT_FALSE(iter.IsEnd());
+  // The destructor waits for the directories still being read.
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,144 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/partition_mirror.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+
+#include "update_engine/aligned_buffer_pool.h"
+#include "update_engine/io_recorder.h"
+#include "update_engine/utils.h"
+
+using std::make_pair;
+using std::max;
+using std::min;
+using std::string;
+using std::tr1::shared_ptr;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The most bytes copied at once.
+const size_t kCopyBufferSize = 1024 * 1024;
+
+}  // namespace {}
+
+PartitionMirror::PartitionMirror() : fd_(-1) {}
+
+PartitionMirror::~PartitionMirror() {
+  CloseMirrors();
+}
+
+bool PartitionMirror::Open(int fd, const vector<string>& paths) {
+  CloseMirrors();
+  fd_ = fd;
+  for (size_t i = 0; i < paths.size(); i++) {
+    shared_ptr<Mirror> mirror(new Mirror);
+    mirror->path = paths[i];
+    mirror->fd = open(paths[i].c_str(), O_WRONLY, 000);
+    if (mirror->fd < 0) {
+      PLOG(ERROR) << "Unable to open mirror " << paths[i];
+      CloseMirrors();
+      return false;
+    }
+    IoRecorder::TrackFd(mirror->fd, mirror->path);
+    mirror->writeback.Init(mirror->fd,
+                           IncrementalWriteback::kDefaultChunkSize);
+    mirrors_.push_back(mirror);
+  }
+  return true;
+}
+
+void PartitionMirror::AddWrite(off64_t offset, uint64_t length) {
+  if (mirrors_.empty() || length == 0)
+    return;
+  if (!recorded_.empty() &&
+      recorded_.back().first +
+      static_cast<off64_t>(recorded_.back().second) == offset) {
+    recorded_.back().second += length;
+  } else {
+    recorded_.push_back(make_pair(offset, length));
+  }
+}
+
+bool PartitionMirror::CopyWrites() {
+  if (recorded_.empty())
+    return true;
+  // Blocks written several times are copied once.
+  std::sort(recorded_.begin(), recorded_.end());
+  Ranges ranges;
+  for (Ranges::const_iterator it = recorded_.begin(); it != recorded_.end();
+       ++it) {
+    if (!ranges.empty() &&
+        ranges.back().first + static_cast<off64_t>(ranges.back().second) >=
+        it->first) {
+      ranges.back().second =
+          max(ranges.back().first + ranges.back().second,
+              it->first + it->second) - ranges.back().first;
+    } else {
+      ranges.push_back(*it);
+    }
+  }
+  recorded_.clear();
+
+  ScopedPoolBuffer buf(kCopyBufferSize);
+  TEST_AND_RETURN_FALSE(buf.get());
+  for (Ranges::const_iterator it = ranges.begin(); it != ranges.end(); ++it) {
+    for (uint64_t done = 0; done < it->second;) {
+      const off64_t offset = it->first + done;
+      const size_t count = min<uint64_t>(it->second - done, buf.size());
+      ssize_t bytes_read = 0;
+      TEST_AND_RETURN_FALSE(utils::PReadAll(fd_, buf.get(), count, offset,
+                                            &bytes_read));
+      // Nothing was written past the end of the partition.
+      if (bytes_read == 0)
+        break;
+      for (size_t i = 0; i < mirrors_.size(); i++) {
+        Mirror* mirror = mirrors_[i].get();
+        if (!utils::PWriteAll(mirror->fd, buf.get(), bytes_read, offset)) {
+          PLOG(ERROR) << "Unable to write " << bytes_read << " bytes at "
+                      << offset << " to mirror " << mirror->path;
+          return false;
+        }
+        mirror->writeback.AddWrite(offset, bytes_read);
+      }
+      done += bytes_read;
+    }
+  }
+  for (size_t i = 0; i < mirrors_.size(); i++)
+    mirrors_[i]->writeback.Writeback();
+  return true;
+}
+
+bool PartitionMirror::Close() {
+  bool success = CopyWrites();
+  for (size_t i = 0; i < mirrors_.size(); i++) {
+    if (!mirrors_[i]->writeback.Finish()) {
+      LOG(ERROR) << "Unable to write back mirror " << mirrors_[i]->path;
+      success = false;
+    }
+  }
+  CloseMirrors();
+  return success;
+}
+
+void PartitionMirror::CloseMirrors() {
+  for (size_t i = 0; i < mirrors_.size(); i++) {
+    IoRecorder::ForgetFd(mirrors_[i]->fd);
+    if (close(mirrors_[i]->fd) != 0)
+      PLOG(ERROR) << "Unable to close mirror " << mirrors_[i]->path;
+  }
+  mirrors_.clear();
+  recorded_.clear();
+  fd_ = -1;
+}
+
+}  // namespace chromeos_update_engine
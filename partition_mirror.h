@@ -0,0 +1,77 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_PARTITION_MIRROR_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_PARTITION_MIRROR_H__
+
+#include <sys/types.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+#include <tr1/memory>
+
+#include <base/basictypes.h>
+
+#include "update_engine/incremental_writeback.h"
+
+// Keeps the devices that mirror a partition, e.g., the inactive partitions
+// of appliances with two disks, identical to it while an update is applied
+// to it, so that the payload is downloaded, decompressed and patched once
+// for all of them. The ranges written to the partition are recorded and,
+// once those writes have completed, copied to each of the mirrors. They're
+// read back from the page cache, where they still are, so only the writes
+// are repeated, and each mirror is written back incrementally, so that the
+// disks write them concurrently.
+
+namespace chromeos_update_engine {
+
+class PartitionMirror {
+ public:
+  PartitionMirror();
+  ~PartitionMirror();
+
+  // Opens the devices at |paths| that mirror the partition written to |fd|.
+  // Returns false if one of them can't be opened, in which case none is.
+  bool Open(int fd, const std::vector<std::string>& paths);
+
+  // Records that |length| bytes were written to the partition at |offset|.
+  void AddWrite(off64_t offset, uint64_t length);
+
+  // Copies the ranges recorded since the last call to the mirrors. The
+  // writes recorded so far must have completed. Returns false on failure.
+  bool CopyWrites();
+
+  // Copies the recorded ranges, writes the mirrors back and closes them.
+  // Returns false on failure.
+  bool Close();
+
+  bool empty() const { return mirrors_.empty(); }
+
+ private:
+  typedef std::vector<std::pair<off64_t, uint64_t> > Ranges;
+
+  struct Mirror {
+    std::string path;
+    int fd;
+    IncrementalWriteback writeback;
+  };
+
+  // Closes the mirrors without writing them back.
+  void CloseMirrors();
+
+  // The partition's descriptor, which isn't owned.
+  int fd_;
+
+  std::vector<std::tr1::shared_ptr<Mirror> > mirrors_;
+
+  // The writes recorded since the last copy, contiguous ones merged.
+  Ranges recorded_;
+
+  DISALLOW_COPY_AND_ASSIGN(PartitionMirror);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_PARTITION_MIRROR_H__
@@ -0,0 +1,93 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/partition_mirror.h"
+#include "update_engine/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class PartitionMirrorTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    ASSERT_TRUE(utils::MakeTempFile("/tmp/PartitionMirror.XXXXXX",
+                                    &path_, &fd_));
+    for (int i = 0; i < 2; i++) {
+      string path;
+      ASSERT_TRUE(utils::MakeTempFile("/tmp/PartitionMirror.XXXXXX",
+                                      &path, NULL));
+      mirror_paths_.push_back(path);
+    }
+  }
+
+  virtual void TearDown() {
+    close(fd_);
+    unlink(path_.c_str());
+    for (size_t i = 0; i < mirror_paths_.size(); i++)
+      unlink(mirror_paths_[i].c_str());
+  }
+
+  // Writes |length| bytes of |value| to the partition at |offset| and
+  // records the write.
+  void Write(PartitionMirror* mirror, off_t offset, size_t length,
+             char value) {
+    vector<char> data(length, value);
+    ASSERT_TRUE(utils::PWriteAll(fd_, &data[0], length, offset));
+    mirror->AddWrite(offset, length);
+  }
+
+  string path_;
+  int fd_;
+  vector<string> mirror_paths_;
+};
+
+TEST_F(PartitionMirrorTest, CopiesWritesTest) {
+  PartitionMirror mirror;
+  ASSERT_TRUE(mirror.Open(fd_, mirror_paths_));
+  EXPECT_FALSE(mirror.empty());
+  Write(&mirror, 4096, 4096, 'a');
+  Write(&mirror, 0, 4096, 'b');
+  // Overwritten blocks are copied as they end up.
+  Write(&mirror, 6144, 4096, 'c');
+  EXPECT_TRUE(mirror.CopyWrites());
+  vector<char> partition;
+  ASSERT_TRUE(utils::ReadFile(path_, &partition));
+  for (size_t i = 0; i < mirror_paths_.size(); i++) {
+    vector<char> mirrored;
+    ASSERT_TRUE(utils::ReadFile(mirror_paths_[i], &mirrored));
+    EXPECT_TRUE(partition == mirrored);
+  }
+
+  // Only the blocks written since are copied, the rest of the mirrors is
+  // left alone.
+  Write(&mirror, 16384, 4096, 'd');
+  ASSERT_TRUE(utils::WriteFile(mirror_paths_[0].c_str(), "x", 1));
+  EXPECT_TRUE(mirror.Close());
+  EXPECT_TRUE(mirror.empty());
+  vector<char> mirrored;
+  ASSERT_TRUE(utils::ReadFile(mirror_paths_[0], &mirrored));
+  ASSERT_EQ(20480, mirrored.size());
+  EXPECT_EQ('x', mirrored[0]);
+  EXPECT_EQ(0, mirrored[4096]);
+  EXPECT_EQ('d', mirrored[16384]);
+}
+
+TEST_F(PartitionMirrorTest, OpenFailureTest) {
+  mirror_paths_.push_back("/nonexistent/mirror");
+  PartitionMirror mirror;
+  EXPECT_FALSE(mirror.Open(fd_, mirror_paths_));
+  EXPECT_TRUE(mirror.empty());
+  mirror_paths_.pop_back();
+}
+
+}  // namespace chromeos_update_engine
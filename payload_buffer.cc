@@ -0,0 +1,88 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/payload_buffer.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+bool PayloadBuffer::Append(const char* bytes, size_t count) {
+  if (count == 0)
+    return true;
+  char* room = PrepareAppend(count);
+  if (!room)
+    return false;
+  memcpy(room, bytes, count);
+  CommitAppend(count);
+  return true;
+}
+
+char* PayloadBuffer::PrepareAppend(size_t count) {
+  if (max_size_ > 0 && size() + count > max_size_) {
+    LOG(ERROR) << "Buffering " << count << " more bytes would exceed the "
+               << max_size_ << " byte payload buffer limit ("
+               << size() << " bytes buffered).";
+    return NULL;
+  }
+  MakeRoom(std::max(count, static_cast<size_t>(1)));
+  return &storage_[tail_];
+}
+
+void PayloadBuffer::CommitAppend(size_t count) {
+  CHECK_LE(tail_ + count, storage_.size());
+  tail_ += count;
+}
+
+void PayloadBuffer::Reserve(size_t size) {
+  if (max_size_ > 0)
+    size = std::min(size, max_size_);
+  if (size > this->size())
+    MakeRoom(size - this->size());
+}
+
+bool PayloadBuffer::Overwrite(size_t offset, const char* bytes, size_t count) {
+  if (offset > size() || count > size() - offset)
+    return false;
+  memcpy(&storage_[head_ + offset], bytes, count);
+  return true;
+}
+
+void PayloadBuffer::Consume(size_t count) {
+  CHECK_LE(count, size());
+  head_ += count;
+  if (head_ == tail_) {
+    // Nothing is left, so the space can be reused right away.
+    head_ = 0;
+    tail_ = 0;
+  }
+}
+
+void PayloadBuffer::Clear() {
+  vector<char>().swap(storage_);
+  head_ = 0;
+  tail_ = 0;
+}
+
+void PayloadBuffer::MakeRoom(size_t count) {
+  // Reclaim the consumed space only once it's at least as large as the data
+  // left, so that the moves are amortized over the consumed bytes.
+  if (head_ > 0 && head_ >= size()) {
+    memmove(&storage_[0], &storage_[head_], size());
+    tail_ -= head_;
+    head_ = 0;
+  }
+  if (storage_.size() - tail_ < count) {
+    // Grow geometrically so that appending in small pieces stays linear.
+    storage_.resize(std::max(tail_ + count, 2 * storage_.size()));
+  }
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,88 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_PAYLOAD_BUFFER_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_PAYLOAD_BUFFER_H__
+
+#include <vector>
+
+#include <base/basictypes.h>
+
+namespace chromeos_update_engine {
+
+// A FIFO byte buffer for payload data received but not applied yet. Bytes
+// are appended at the back and consumed from the front. Consuming doesn't
+// move the remaining data; the consumed space is reclaimed on a later
+// Append() once it is at least as large as the data still buffered, so
+// each byte is moved at most once on average. The buffered data is always
+// contiguous, so install operations can use their data blobs in place.
+//
+// Instead of copying the data in with Append(), a producer may also ask for
+// room at the back with PrepareAppend(), write the data there itself and
+// then make it part of the buffered data with CommitAppend().
+class PayloadBuffer {
+ public:
+  PayloadBuffer() : head_(0), tail_(0), max_size_(0) {}
+
+  // Appends |count| bytes at |bytes|. Returns false, and appends nothing, if
+  // that would grow the buffered data beyond the maximum size.
+  bool Append(const char* bytes, size_t count);
+
+  // Returns room for at least |count| more bytes at the back, or NULL if
+  // that would grow the buffered data beyond the maximum size. The room is
+  // only valid until the next call to a non-const method.
+  char* PrepareAppend(size_t count);
+
+  // Appends the first |count| bytes of the room returned by the last
+  // PrepareAppend() call, which must have been asked for at least |count|.
+  void CommitAppend(size_t count);
+
+  // Makes room for |size| bytes of buffered data in total, so that the data
+  // doesn't have to be moved again until it's grown to that size.
+  void Reserve(size_t size);
+
+  // Overwrites the |count| buffered bytes |offset| bytes past the first one
+  // with those at |bytes|. Returns false, and overwrites nothing, if they
+  // aren't all buffered.
+  bool Overwrite(size_t offset, const char* bytes, size_t count);
+
+  // Discards the first |count| buffered bytes.
+  void Consume(size_t count);
+
+  // Discards all buffered data and releases the memory.
+  void Clear();
+
+  // Returns the first buffered byte. Only valid until the next Append().
+  const char* data() const {
+    return empty() ? NULL : &storage_[head_];
+  }
+  size_t size() const { return tail_ - head_; }
+  // The memory held, buffered data and free space.
+  size_t capacity() const { return storage_.capacity(); }
+  bool empty() const { return size() == 0; }
+
+  // Sets the maximum number of bytes that may be buffered at any time. 0,
+  // the default, means no limit.
+  void set_max_size(size_t max_size) { max_size_ = max_size; }
+  size_t max_size() const { return max_size_; }
+
+ private:
+  // Moves the buffered data to the front of |storage_| if the consumed
+  // space is worth reclaiming and grows |storage_| so that there is room for
+  // |count| more bytes at the back.
+  void MakeRoom(size_t count);
+
+  // The buffered data is [head_, tail_) in |storage_|. The rest of
+  // |storage_| is free space.
+  std::vector<char> storage_;
+  size_t head_;
+  size_t tail_;
+  size_t max_size_;
+
+  DISALLOW_COPY_AND_ASSIGN(PayloadBuffer);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_PAYLOAD_BUFFER_H__
@@ -0,0 +1,112 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <string.h>
+
+#include <string>
+#include <gtest/gtest.h>
+#include "update_engine/payload_buffer.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+TEST(PayloadBufferTest, AppendConsumeTest) {
+  PayloadBuffer buffer;
+  EXPECT_TRUE(buffer.empty());
+  EXPECT_TRUE(buffer.data() == NULL);
+  EXPECT_TRUE(buffer.Append("abcdef", 6));
+  EXPECT_EQ(6U, buffer.size());
+  EXPECT_EQ("abcdef", string(buffer.data(), buffer.size()));
+  buffer.Consume(2);
+  EXPECT_EQ("cdef", string(buffer.data(), buffer.size()));
+  EXPECT_TRUE(buffer.Append("gh", 2));
+  EXPECT_EQ("cdefgh", string(buffer.data(), buffer.size()));
+  buffer.Consume(5);
+  EXPECT_EQ("h", string(buffer.data(), buffer.size()));
+  // The consumed space is reclaimed here.
+  EXPECT_TRUE(buffer.Append("ij", 2));
+  EXPECT_EQ("hij", string(buffer.data(), buffer.size()));
+  buffer.Consume(3);
+  EXPECT_TRUE(buffer.empty());
+  EXPECT_TRUE(buffer.Append("k", 1));
+  EXPECT_EQ("k", string(buffer.data(), buffer.size()));
+  buffer.Clear();
+  EXPECT_TRUE(buffer.empty());
+}
+
+TEST(PayloadBufferTest, ManySmallConsumesTest) {
+  PayloadBuffer buffer;
+  string expected;
+  for (int i = 0; i < 1000; i++) {
+    const string chunk(100, 'a' + i % 26);
+    EXPECT_TRUE(buffer.Append(chunk.data(), chunk.size()));
+    expected += chunk;
+    for (int j = 0; j < 3; j++) {
+      buffer.Consume(30);
+      expected.erase(0, 30);
+    }
+    ASSERT_EQ(expected, string(buffer.data(), buffer.size()));
+  }
+}
+
+TEST(PayloadBufferTest, MaxSizeTest) {
+  PayloadBuffer buffer;
+  buffer.set_max_size(4);
+  EXPECT_EQ(4U, buffer.max_size());
+  EXPECT_TRUE(buffer.Append("abc", 3));
+  EXPECT_FALSE(buffer.Append("de", 2));
+  EXPECT_EQ("abc", string(buffer.data(), buffer.size()));
+  EXPECT_TRUE(buffer.Append("d", 1));
+  buffer.Consume(2);
+  EXPECT_TRUE(buffer.Append("ef", 2));
+  EXPECT_EQ("cdef", string(buffer.data(), buffer.size()));
+}
+
+TEST(PayloadBufferTest, PrepareCommitTest) {
+  PayloadBuffer buffer;
+  EXPECT_TRUE(buffer.Append("ab", 2));
+  char* room = buffer.PrepareAppend(4);
+  ASSERT_TRUE(room != NULL);
+  memcpy(room, "cdef", 4);
+  // Only part of the room may be used.
+  buffer.CommitAppend(3);
+  EXPECT_EQ("abcde", string(buffer.data(), buffer.size()));
+  buffer.Consume(4);
+  room = buffer.PrepareAppend(2);
+  ASSERT_TRUE(room != NULL);
+  memcpy(room, "fg", 2);
+  buffer.CommitAppend(2);
+  EXPECT_EQ("efg", string(buffer.data(), buffer.size()));
+  buffer.set_max_size(4);
+  EXPECT_TRUE(buffer.PrepareAppend(2) == NULL);
+  EXPECT_TRUE(buffer.PrepareAppend(1) != NULL);
+}
+
+TEST(PayloadBufferTest, OverwriteTest) {
+  PayloadBuffer buffer;
+  EXPECT_TRUE(buffer.Append("abcdef", 6));
+  buffer.Consume(2);
+  EXPECT_TRUE(buffer.Overwrite(1, "xy", 2));
+  EXPECT_EQ("cxyf", string(buffer.data(), buffer.size()));
+  EXPECT_TRUE(buffer.Overwrite(4, "z", 0));
+  EXPECT_FALSE(buffer.Overwrite(3, "zz", 2));
+  EXPECT_FALSE(buffer.Overwrite(5, "z", 0));
+  EXPECT_EQ("cxyf", string(buffer.data(), buffer.size()));
+}
+
+TEST(PayloadBufferTest, ReserveTest) {
+  PayloadBuffer buffer;
+  buffer.Reserve(1000);
+  EXPECT_TRUE(buffer.empty());
+  EXPECT_TRUE(buffer.Append("a", 1));
+  const char* data = buffer.data();
+  // Growing up to the reserved size doesn't move the data.
+  for (int i = 1; i < 1000; i++)
+    EXPECT_TRUE(buffer.Append("b", 1));
+  EXPECT_EQ(data, buffer.data());
+  EXPECT_EQ(1000U, buffer.size());
+}
+
+}  // namespace chromeos_update_engine
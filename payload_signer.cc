@@ -4,6 +4,13 @@
 
 #include "update_engine/payload_signer.h"
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <tr1/memory>
+
 #include <base/logging.h>
 #include <base/string_split.h>
 #include <base/string_util.h>
@@ -13,10 +20,14 @@
 #include "update_engine/delta_performer.h"
 #include "update_engine/omaha_hash_calculator.h"
 #include "update_engine/subprocess.h"
+#include "update_engine/thread_pool.h"
 #include "update_engine/update_metadata.pb.h"
 #include "update_engine/utils.h"
 
+using std::max;
+using std::min;
 using std::string;
+using std::tr1::shared_ptr;
 using std::vector;
 
 namespace chromeos_update_engine {
@@ -25,6 +36,9 @@ const uint32_t kSignatureMessageCurrentVersion = 2;
 
 namespace {
 
+// The size of the reads the payload is hashed in.
+const size_t kReadBufferSize = 1024 * 1024;
+
 // The following is a standard PKCS1-v1_5 padding for SHA256 signatures, as
 // defined in RFC3447. It is prepended to the actual signature (32 bytes) to
 // form a sequence of 256 bytes (2048 bits) that is amenable to RSA signing. The
@@ -104,47 +118,110 @@ bool ConvertSignatureToProtobufBlob(const vector<vector<char> >& signatures,
 }
 
 // Given an unsigned payload under |payload_path| and the |signature_blob_size|
-// generates an updated payload that includes a dummy signature op in its
-// manifest. It populates |out_metadata_size| with the size of the final
-// manifest after adding the dummy signature operation.  Returns true on
-// success, false otherwise.
-bool AddSignatureOpToPayload(const string& payload_path,
-                             int signature_blob_size,
-                             vector<char>* out_payload,
-                             uint64_t* out_metadata_size) {
+// generates the metadata of an updated payload that includes a dummy
+// signature op in its manifest into |out_metadata|. The rest of the updated
+// payload is the |out_data_size| bytes at |out_data_offset| of the unsigned
+// one, which aren't read. Returns true on success, false otherwise.
+bool AddSignatureOpToMetadata(const string& payload_path,
+                              int signature_blob_size,
+                              vector<char>* out_metadata,
+                              uint64_t* out_data_offset,
+                              uint64_t* out_data_size) {
   const int kProtobufOffset = 20;
   const int kProtobufSizeOffset = 12;
 
-  // Loads the payload.
-  vector<char> payload;
+  // Loads the metadata.
+  vector<char> metadata;
   DeltaArchiveManifest manifest;
   uint64_t metadata_size;
-  TEST_AND_RETURN_FALSE(PayloadSigner::LoadPayload(
-      payload_path, &payload, &manifest, &metadata_size));
+  uint64_t payload_size;
+  TEST_AND_RETURN_FALSE(PayloadSigner::LoadPayloadMetadata(
+      payload_path, &metadata, &manifest, &metadata_size, &payload_size));
   TEST_AND_RETURN_FALSE(!manifest.has_signatures_offset() &&
                         !manifest.has_signatures_size());
 
   // Updates the manifest to include the signature operation.
-  DeltaDiffGenerator::AddSignatureOp(payload.size() - metadata_size,
+  DeltaDiffGenerator::AddSignatureOp(payload_size - metadata_size,
                                      signature_blob_size,
                                      &manifest);
 
-  // Updates the payload to include the new manifest.
+  // Updates the metadata to include the new manifest.
   string serialized_manifest;
   TEST_AND_RETURN_FALSE(manifest.AppendToString(&serialized_manifest));
   LOG(INFO) << "Updated protobuf size: " << serialized_manifest.size();
-  payload.erase(payload.begin() + kProtobufOffset,
-                payload.begin() + metadata_size);
-  payload.insert(payload.begin() + kProtobufOffset,
-                 serialized_manifest.begin(),
-                 serialized_manifest.end());
+  metadata.resize(kProtobufOffset);
+  metadata.insert(metadata.end(),
+                  serialized_manifest.begin(),
+                  serialized_manifest.end());
 
   // Updates the protobuf size.
   uint64_t size_be = htobe64(serialized_manifest.size());
-  memcpy(&payload[kProtobufSizeOffset], &size_be, sizeof(size_be));
-  LOG(INFO) << "Updated payload size: " << payload.size();
-  out_payload->swap(payload);
-  *out_metadata_size = serialized_manifest.size() + kProtobufOffset;
+  memcpy(&metadata[kProtobufSizeOffset], &size_be, sizeof(size_be));
+  LOG(INFO) << "Updated payload size: "
+            << metadata.size() + payload_size - metadata_size;
+  out_metadata->swap(metadata);
+  *out_data_offset = metadata_size;
+  *out_data_size = payload_size - metadata_size;
+  return true;
+}
+
+// Sets |size| to the size of the signatures made with the RSA private key in
+// |private_key_path|. Returns true on success.
+bool PrivateKeySignatureSize(const string& private_key_path, size_t* size) {
+  FILE* fprivkey = fopen(private_key_path.c_str(), "rb");
+  if (!fprivkey) {
+    LOG(ERROR) << "Unable to open private key file: " << private_key_path;
+    return false;
+  }
+  char dummy_password[] = { ' ', 0 };  // Ensure no password is read from stdin.
+  RSA* rsa = PEM_read_RSAPrivateKey(fprivkey, NULL, NULL, dummy_password);
+  fclose(fprivkey);
+  TEST_AND_RETURN_FALSE(rsa != NULL);
+  *size = RSA_size(rsa);
+  RSA_free(rsa);
+  return true;
+}
+
+// Signs a hash with one private key on a ThreadPool worker.
+class SignHashTask : public ThreadPoolTask {
+ public:
+  SignHashTask(const vector<char>* hash, const string& private_key_path)
+      : hash_(hash), private_key_path_(private_key_path) {}
+
+  virtual bool Run() {
+    return PayloadSigner::SignHash(*hash_, private_key_path_, &signature_);
+  }
+
+  const vector<char>& signature() const { return signature_; }
+
+ private:
+  const vector<char>* hash_;
+  const string private_key_path_;
+  vector<char> signature_;
+
+  DISALLOW_COPY_AND_ASSIGN(SignHashTask);
+};
+
+// Updates |calculator| with the |length| bytes at |offset| of the file at
+// |path|. Returns true on success.
+bool HashFileRange(const string& path,
+                   uint64_t offset,
+                   uint64_t length,
+                   OmahaHashCalculator* calculator) {
+  int fd = open(path.c_str(), O_RDONLY);
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  ScopedFdCloser fd_closer(&fd);
+  vector<char> buf(kReadBufferSize);
+  while (length > 0) {
+    const size_t count = min<uint64_t>(length, buf.size());
+    ssize_t bytes_read = 0;
+    TEST_AND_RETURN_FALSE(utils::PReadAll(fd, &buf[0], count, offset,
+                                          &bytes_read));
+    TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(count));
+    TEST_AND_RETURN_FALSE(calculator->Update(&buf[0], count));
+    offset += count;
+    length -= count;
+  }
   return true;
 }
 }  // namespace {}
@@ -168,6 +245,47 @@ bool PayloadSigner::LoadPayload(const string& payload_path,
   return true;
 }
 
+bool PayloadSigner::LoadPayloadMetadata(const string& payload_path,
+                                        vector<char>* out_metadata,
+                                        DeltaArchiveManifest* out_manifest,
+                                        uint64_t* out_metadata_size,
+                                        uint64_t* out_payload_size) {
+  int fd = open(payload_path.c_str(), O_RDONLY);
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  ScopedFdCloser fd_closer(&fd);
+  struct stat stbuf;
+  TEST_AND_RETURN_FALSE_ERRNO(fstat(fd, &stbuf) == 0);
+  LOG(INFO) << "Payload size: " << stbuf.st_size;
+
+  // Reads the header first to learn the size of the manifest.
+  ActionExitCode error = kActionCodeSuccess;
+  InstallPlan install_plan;
+  DeltaPerformer delta_performer(NULL, NULL, &install_plan);
+  vector<char> metadata(DeltaPerformer::GetManifestOffset());
+  uint64_t metadata_size = 0;
+  for (;;) {
+    ssize_t bytes_read = 0;
+    TEST_AND_RETURN_FALSE(utils::PReadAll(fd, &metadata[0], metadata.size(),
+                                          0, &bytes_read));
+    TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(metadata.size()));
+    DeltaPerformer::MetadataParseResult result =
+        delta_performer.ParsePayloadMetadata(metadata, out_manifest,
+                                             &metadata_size, &error);
+    if (result == DeltaPerformer::kMetadataParseSuccess)
+      break;
+    TEST_AND_RETURN_FALSE(
+        result == DeltaPerformer::kMetadataParseInsufficientData &&
+        metadata.size() < metadata_size &&
+        metadata_size <= static_cast<uint64_t>(stbuf.st_size));
+    metadata.resize(metadata_size);
+  }
+  LOG(INFO) << "Metadata size: " << metadata_size;
+  out_metadata->swap(metadata);
+  *out_metadata_size = metadata_size;
+  *out_payload_size = stbuf.st_size;
+  return true;
+}
+
 bool PayloadSigner::SignHash(const vector<char>& hash,
                              const string& private_key_path,
                              vector<char>* out_signature) {
@@ -209,6 +327,31 @@ bool PayloadSigner::SignHash(const vector<char>& hash,
   return true;
 }
 
+bool PayloadSigner::SignHashWithKeys(const vector<char>& hash,
+                                     const vector<string>& private_key_paths,
+                                     vector<char>* out_signature_blob) {
+  // Each signature takes a run of openssl, so they're made at once.
+  ThreadPool pool(max<size_t>(private_key_paths.size(), 1));
+  TEST_AND_RETURN_FALSE(pool.Init());
+  vector<shared_ptr<SignHashTask> > tasks;
+  for (vector<string>::const_iterator it = private_key_paths.begin(),
+           e = private_key_paths.end(); it != e; ++it) {
+    tasks.push_back(shared_ptr<SignHashTask>(new SignHashTask(&hash, *it)));
+    pool.Submit(tasks.back().get());
+  }
+  bool success = true;
+  vector<vector<char> > signatures;
+  for (size_t i = 0; i < tasks.size(); i++) {
+    // All of the tasks are waited for, as they refer to |hash|.
+    success = pool.Wait(tasks[i].get()) && success;
+    signatures.push_back(tasks[i]->signature());
+  }
+  TEST_AND_RETURN_FALSE(success);
+  TEST_AND_RETURN_FALSE(ConvertSignatureToProtobufBlob(signatures,
+                                                       out_signature_blob));
+  return true;
+}
+
 bool PayloadSigner::SignPayload(const string& unsigned_payload_path,
                                 const vector<string>& private_key_paths,
                                 vector<char>* out_signature_blob) {
@@ -216,33 +359,25 @@ bool PayloadSigner::SignPayload(const string& unsigned_payload_path,
   TEST_AND_RETURN_FALSE(OmahaHashCalculator::RawHashOfFile(
       unsigned_payload_path, -1, &hash_data) ==
                         utils::FileSize(unsigned_payload_path));
-
-  vector<vector<char> > signatures;
-  for (vector<string>::const_iterator it = private_key_paths.begin(),
-           e = private_key_paths.end(); it != e; ++it) {
-    vector<char> signature;
-    TEST_AND_RETURN_FALSE(SignHash(hash_data, *it, &signature));
-    signatures.push_back(signature);
-  }
-  TEST_AND_RETURN_FALSE(ConvertSignatureToProtobufBlob(signatures,
-                                                       out_signature_blob));
-  return true;
+  return SignHashWithKeys(hash_data, private_key_paths, out_signature_blob);
 }
 
 bool PayloadSigner::SignatureBlobLength(const vector<string>& private_key_paths,
                                         uint64_t* out_length) {
   DCHECK(out_length);
 
-  string x_path;
-  TEST_AND_RETURN_FALSE(
-      utils::MakeTempFile("/tmp/signed_data.XXXXXX", &x_path, NULL));
-  ScopedPathUnlinker x_path_unlinker(x_path);
-  TEST_AND_RETURN_FALSE(utils::WriteFile(x_path.c_str(), "x", 1));
-
+  // The blob's length only depends on the sizes of the signatures, which are
+  // those of the keys.
+  vector<vector<char> > signatures;
+  for (vector<string>::const_iterator it = private_key_paths.begin(),
+           e = private_key_paths.end(); it != e; ++it) {
+    size_t size = 0;
+    TEST_AND_RETURN_FALSE(PrivateKeySignatureSize(*it, &size));
+    signatures.push_back(vector<char>(size, 0));
+  }
   vector<char> sig_blob;
-  TEST_AND_RETURN_FALSE(PayloadSigner::SignPayload(x_path,
-                                                   private_key_paths,
-                                                   &sig_blob));
+  TEST_AND_RETURN_FALSE(ConvertSignatureToProtobufBlob(signatures,
+                                                       &sig_blob));
   *out_length = sig_blob.size();
   return true;
 }
@@ -332,26 +467,38 @@ bool PayloadSigner::GetRawHashFromSignature(
 bool PayloadSigner::VerifySignedPayload(const std::string& payload_path,
                                         const std::string& public_key_path,
                                         uint32_t client_key_check_version) {
-  vector<char> payload;
+  // Only the metadata and the signature blob are read into memory; the rest
+  // is hashed from the file.
+  vector<char> metadata;
   DeltaArchiveManifest manifest;
   uint64_t metadata_size;
-  TEST_AND_RETURN_FALSE(LoadPayload(
-      payload_path, &payload, &manifest, &metadata_size));
+  uint64_t payload_size;
+  TEST_AND_RETURN_FALSE(LoadPayloadMetadata(
+      payload_path, &metadata, &manifest, &metadata_size, &payload_size));
   TEST_AND_RETURN_FALSE(manifest.has_signatures_offset() &&
                         manifest.has_signatures_size());
-  CHECK_EQ(payload.size(),
-           metadata_size + manifest.signatures_offset() +
-           manifest.signatures_size());
-  vector<char> signature_blob(
-      payload.begin() + metadata_size + manifest.signatures_offset(),
-      payload.end());
+  const uint64_t signed_size = metadata_size + manifest.signatures_offset();
+  TEST_AND_RETURN_FALSE(payload_size == signed_size +
+                        manifest.signatures_size());
+  vector<char> signature_blob(manifest.signatures_size());
+  {
+    int fd = open(payload_path.c_str(), O_RDONLY);
+    TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+    ScopedFdCloser fd_closer(&fd);
+    ssize_t bytes_read = 0;
+    TEST_AND_RETURN_FALSE(utils::PReadAll(fd, &signature_blob[0],
+                                          signature_blob.size(), signed_size,
+                                          &bytes_read));
+    TEST_AND_RETURN_FALSE(bytes_read ==
+                          static_cast<ssize_t>(signature_blob.size()));
+  }
   vector<char> signed_hash;
   TEST_AND_RETURN_FALSE(VerifySignatureBlob(
       signature_blob, public_key_path, client_key_check_version, &signed_hash));
   TEST_AND_RETURN_FALSE(!signed_hash.empty());
   vector<char> hash;
-  TEST_AND_RETURN_FALSE(OmahaHashCalculator::RawHashOfBytes(
-      payload.data(), metadata_size + manifest.signatures_offset(), &hash));
+  TEST_AND_RETURN_FALSE(OmahaHashCalculator::RawHashOfFile(
+      payload_path, signed_size, &hash) == static_cast<off_t>(signed_size));
   PadRSA2048SHA256Hash(&hash);
   TEST_AND_RETURN_FALSE(hash == signed_hash);
   return true;
@@ -360,9 +507,7 @@ bool PayloadSigner::VerifySignedPayload(const std::string& payload_path,
 bool PayloadSigner::HashPayloadForSigning(const string& payload_path,
                                           const vector<int>& signature_sizes,
                                           vector<char>* out_hash_data) {
-  // TODO(petkov): Reduce memory usage -- the payload is manipulated in memory.
-
-  // Loads the payload and adds the signature op to it.
+  // Generates the metadata with the signature op in it.
   vector<vector<char> > signatures;
   for (vector<int>::const_iterator it = signature_sizes.begin(),
            e = signature_sizes.end(); it != e; ++it) {
@@ -372,32 +517,40 @@ bool PayloadSigner::HashPayloadForSigning(const string& payload_path,
   vector<char> signature_blob;
   TEST_AND_RETURN_FALSE(ConvertSignatureToProtobufBlob(signatures,
                                                        &signature_blob));
-  vector<char> payload;
-  uint64_t final_metadata_size;
-  TEST_AND_RETURN_FALSE(AddSignatureOpToPayload(payload_path,
-                                                signature_blob.size(),
-                                                &payload,
-                                                &final_metadata_size));
-  // Calculates the hash on the updated payload. Note that the payload includes
-  // the signature op but doesn't include the signature blob at the end.
-  TEST_AND_RETURN_FALSE(OmahaHashCalculator::RawHashOfData(payload,
-                                                           out_hash_data));
+  vector<char> metadata;
+  uint64_t data_offset;
+  uint64_t data_size;
+  TEST_AND_RETURN_FALSE(AddSignatureOpToMetadata(payload_path,
+                                                 signature_blob.size(),
+                                                 &metadata,
+                                                 &data_offset,
+                                                 &data_size));
+  // Calculates the hash on the updated payload, streaming the data blobs
+  // from the unsigned one. Note that the payload includes the signature op
+  // but doesn't include the signature blob at the end.
+  OmahaHashCalculator calculator;
+  TEST_AND_RETURN_FALSE(calculator.Update(&metadata[0], metadata.size()));
+  TEST_AND_RETURN_FALSE(HashFileRange(payload_path, data_offset, data_size,
+                                      &calculator));
+  TEST_AND_RETURN_FALSE(calculator.Finalize());
+  *out_hash_data = calculator.raw_hash();
   return true;
 }
 
 bool PayloadSigner::HashMetadataForSigning(const string& payload_path,
                                            vector<char>* out_metadata_hash) {
   // Extract the manifest first.
-  vector<char> payload;
+  vector<char> metadata;
   DeltaArchiveManifest manifest_proto;
   uint64_t metadata_size;
-  TEST_AND_RETURN_FALSE(LoadPayload(
-      payload_path, &payload, &manifest_proto, &metadata_size));
+  uint64_t payload_size;
+  TEST_AND_RETURN_FALSE(LoadPayloadMetadata(
+      payload_path, &metadata, &manifest_proto, &metadata_size,
+      &payload_size));
 
   // Calculates the hash on the manifest.
-  TEST_AND_RETURN_FALSE(OmahaHashCalculator::RawHashOfBytes(&payload[0],
-                                                            metadata_size,
-                                                            out_metadata_hash));
+  TEST_AND_RETURN_FALSE(OmahaHashCalculator::RawHashOfData(metadata,
+                                                           out_metadata_hash));
   return true;
 }
 
@@ -406,24 +559,123 @@ bool PayloadSigner::AddSignatureToPayload(
     const vector<vector<char> >& signatures,
     const string& signed_payload_path,
     uint64_t *out_metadata_size) {
-  // TODO(petkov): Reduce memory usage -- the payload is manipulated in memory.
-
-  // Loads the payload and adds the signature op to it.
+  // Generates the metadata with the signature op in it.
   vector<char> signature_blob;
   TEST_AND_RETURN_FALSE(ConvertSignatureToProtobufBlob(signatures,
                                                        &signature_blob));
-  vector<char> payload;
-  TEST_AND_RETURN_FALSE(AddSignatureOpToPayload(payload_path,
-                                                signature_blob.size(),
-                                                &payload,
-                                                out_metadata_size));
-  // Appends the signature blob to the end of the payload and writes the new
-  // payload.
-  payload.insert(payload.end(), signature_blob.begin(), signature_blob.end());
-  LOG(INFO) << "Signed payload size: " << payload.size();
-  TEST_AND_RETURN_FALSE(utils::WriteFile(signed_payload_path.c_str(),
-                                         payload.data(),
-                                         payload.size()));
+  vector<char> metadata;
+  uint64_t data_offset;
+  uint64_t data_size;
+  TEST_AND_RETURN_FALSE(AddSignatureOpToMetadata(payload_path,
+                                                 signature_blob.size(),
+                                                 &metadata,
+                                                 &data_offset,
+                                                 &data_size));
+
+  // The signed payload is the new metadata, the data blobs copied from the
+  // unsigned payload and the signature blob. It's written next to its final
+  // path and renamed into place, as the two paths may be the same file.
+  int in_fd = open(payload_path.c_str(), O_RDONLY);
+  TEST_AND_RETURN_FALSE_ERRNO(in_fd >= 0);
+  ScopedFdCloser in_fd_closer(&in_fd);
+  string temp_path;
+  int out_fd = -1;
+  TEST_AND_RETURN_FALSE(utils::MakeTempFile(signed_payload_path + ".XXXXXX",
+                                            &temp_path,
+                                            &out_fd));
+  ScopedPathUnlinker temp_path_unlinker(temp_path);
+  ScopedFdCloser out_fd_closer(&out_fd);
+  TEST_AND_RETURN_FALSE(utils::WriteAll(out_fd, &metadata[0],
+                                        metadata.size()));
+  TEST_AND_RETURN_FALSE(utils::SendFileAll(out_fd, in_fd, data_offset,
+                                           data_size));
+  TEST_AND_RETURN_FALSE(utils::WriteAll(out_fd, &signature_blob[0],
+                                        signature_blob.size()));
+  out_fd_closer.set_should_close(false);
+  TEST_AND_RETURN_FALSE_ERRNO(close(out_fd) == 0);
+  TEST_AND_RETURN_FALSE_ERRNO(rename(temp_path.c_str(),
+                                     signed_payload_path.c_str()) == 0);
+  temp_path_unlinker.set_should_remove(false);
+  LOG(INFO) << "Signed payload size: "
+            << metadata.size() + data_size + signature_blob.size();
+  *out_metadata_size = metadata.size();
+  return true;
+}
+
+bool PayloadSigner::SignUnsignedPayload(
+    const string& payload_path,
+    const vector<string>& private_key_paths,
+    const string& signed_payload_path,
+    const string& public_key_path,
+    uint32_t client_key_check_version,
+    uint64_t* out_metadata_size) {
+  // Generates the metadata with the signature op in it.
+  uint64_t signature_blob_length = 0;
+  TEST_AND_RETURN_FALSE(SignatureBlobLength(private_key_paths,
+                                            &signature_blob_length));
+  vector<char> metadata;
+  uint64_t data_offset;
+  uint64_t data_size;
+  TEST_AND_RETURN_FALSE(AddSignatureOpToMetadata(payload_path,
+                                                 signature_blob_length,
+                                                 &metadata,
+                                                 &data_offset,
+                                                 &data_size));
+
+  // The signed payload is written next to its final path and renamed into
+  // place, as in AddSignatureToPayload(), and hashed on the way.
+  int in_fd = open(payload_path.c_str(), O_RDONLY);
+  TEST_AND_RETURN_FALSE_ERRNO(in_fd >= 0);
+  ScopedFdCloser in_fd_closer(&in_fd);
+  string temp_path;
+  int out_fd = -1;
+  TEST_AND_RETURN_FALSE(utils::MakeTempFile(signed_payload_path + ".XXXXXX",
+                                            &temp_path,
+                                            &out_fd));
+  ScopedPathUnlinker temp_path_unlinker(temp_path);
+  ScopedFdCloser out_fd_closer(&out_fd);
+  OmahaHashCalculator calculator;
+  TEST_AND_RETURN_FALSE(calculator.Update(&metadata[0], metadata.size()));
+  TEST_AND_RETURN_FALSE(utils::WriteAll(out_fd, &metadata[0],
+                                        metadata.size()));
+  vector<char> buf(kReadBufferSize);
+  for (uint64_t done = 0; done < data_size;) {
+    const size_t count = min<uint64_t>(data_size - done, buf.size());
+    ssize_t bytes_read = 0;
+    TEST_AND_RETURN_FALSE(utils::PReadAll(in_fd, &buf[0], count,
+                                          data_offset + done, &bytes_read));
+    TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(count));
+    TEST_AND_RETURN_FALSE(calculator.Update(&buf[0], count));
+    TEST_AND_RETURN_FALSE(utils::WriteAll(out_fd, &buf[0], count));
+    done += count;
+  }
+  TEST_AND_RETURN_FALSE(calculator.Finalize());
+
+  vector<char> signature_blob;
+  TEST_AND_RETURN_FALSE(SignHashWithKeys(calculator.raw_hash(),
+                                         private_key_paths,
+                                         &signature_blob));
+  TEST_AND_RETURN_FALSE(signature_blob.size() == signature_blob_length);
+  if (!public_key_path.empty()) {
+    vector<char> signed_hash;
+    TEST_AND_RETURN_FALSE(VerifySignatureBlob(signature_blob,
+                                              public_key_path,
+                                              client_key_check_version,
+                                              &signed_hash));
+    vector<char> hash = calculator.raw_hash();
+    TEST_AND_RETURN_FALSE(PadRSA2048SHA256Hash(&hash));
+    TEST_AND_RETURN_FALSE(hash == signed_hash);
+  }
+  TEST_AND_RETURN_FALSE(utils::WriteAll(out_fd, &signature_blob[0],
+                                        signature_blob.size()));
+  out_fd_closer.set_should_close(false);
+  TEST_AND_RETURN_FALSE_ERRNO(close(out_fd) == 0);
+  TEST_AND_RETURN_FALSE_ERRNO(rename(temp_path.c_str(),
+                                     signed_payload_path.c_str()) == 0);
+  temp_path_unlinker.set_should_remove(false);
+  LOG(INFO) << "Signed payload size: "
+            << metadata.size() + data_size + signature_blob.size();
+  *out_metadata_size = metadata.size();
   return true;
 }
 
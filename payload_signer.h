@@ -26,6 +26,14 @@ class PayloadSigner {
                        const std::string& private_key_path,
                        std::vector<char>* out_signature);
 
+  // Signs the raw |hash| with each of the private keys in
+  // |private_key_paths|, in parallel, and packs the signatures into the
+  // signature blob |out_signature_blob|. Returns true on success.
+  static bool SignHashWithKeys(
+      const std::vector<char>& hash,
+      const std::vector<std::string>& private_key_paths,
+      std::vector<char>* out_signature_blob);
+
   // Given an unsigned payload in |unsigned_payload_path| and private keys in
   // |private_key_path|, calculates the signature blob into
   // |out_signature_blob|. Note that the payload must already have an updated
@@ -36,7 +44,8 @@ class PayloadSigner {
                           std::vector<char>* out_signature_blob);
 
   // Returns the length of out_signature_blob that will result in a call
-  // to SignPayload with the given private keys. Returns true on success.
+  // to SignPayload with the given private keys, from the sizes of the keys
+  // rather than by signing. Returns true on success.
   static bool SignatureBlobLength(
       const std::vector<std::string>& private_key_paths,
       uint64_t* out_length);
@@ -83,6 +92,23 @@ class PayloadSigner {
       const std::string& signed_payload_path,
       uint64_t* out_metadata_size);
 
+  // Signs the unsigned payload in |payload_path| (with no dummy signature op)
+  // with the private keys in |private_key_paths| and stores the signed
+  // payload in |signed_payload_path|, which may be the same file, in a
+  // single pass: the data blobs are read once, and hashed as they're copied
+  // into the signed payload, and the hash is signed with all the keys in
+  // parallel. Unless |public_key_path| is empty, the signature of
+  // |client_key_check_version| is then verified against that hash with it.
+  // Populates |out_metadata_size| with the size of the signed payload's
+  // metadata. Returns true on success, false otherwise.
+  static bool SignUnsignedPayload(
+      const std::string& payload_path,
+      const std::vector<std::string>& private_key_paths,
+      const std::string& signed_payload_path,
+      const std::string& public_key_path,
+      uint32_t client_key_check_version,
+      uint64_t* out_metadata_size);
+
   // Returns false if the payload signature can't be verified. Returns true
   // otherwise and sets |out_hash| to the signed payload hash.
   static bool VerifySignature(const std::vector<char>& signature_blob,
@@ -129,6 +155,15 @@ class PayloadSigner {
                           DeltaArchiveManifest* out_manifest,
                           uint64_t* out_metadata_size);
 
+  // Like LoadPayload(), but reads only the header and the manifest of the
+  // payload into |out_metadata|, and returns the size of the payload file in
+  // |out_payload_size|.
+  static bool LoadPayloadMetadata(const std::string& payload_path,
+                                  std::vector<char>* out_metadata,
+                                  DeltaArchiveManifest* out_manifest,
+                                  uint64_t* out_metadata_size,
+                                  uint64_t* out_payload_size);
+
  private:
   // This should never be constructed
   DISALLOW_IMPLICIT_CONSTRUCTORS(PayloadSigner);
@@ -2,10 +2,13 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <endian.h>
+
 #include <string>
 #include <vector>
 #include <gtest/gtest.h>
 #include "base/logging.h"
+#include "update_engine/omaha_hash_calculator.h"
 #include "update_engine/payload_signer.h"
 #include "update_engine/update_metadata.pb.h"
 #include "update_engine/utils.h"
@@ -99,6 +102,35 @@ void SignSampleData(vector<char>* out_signature_blob) {
       out_signature_blob));
   EXPECT_EQ(length, out_signature_blob->size());
 }
+
+// Writes an unsigned payload with some data blobs to |path|, and its size
+// and its metadata's size to |out_payload_size| and |out_metadata_size|.
+void WriteSamplePayload(const string& path,
+                        uint64_t* out_payload_size,
+                        uint64_t* out_metadata_size) {
+  DeltaArchiveManifest manifest;
+  manifest.set_block_size(4096);
+  const string kBlobs(300000, 'b');
+  DeltaArchiveManifest_InstallOperation* op =
+      manifest.add_install_operations();
+  op->set_type(DeltaArchiveManifest_InstallOperation_Type_REPLACE);
+  op->set_data_offset(0);
+  op->set_data_length(kBlobs.size());
+  string serialized_manifest;
+  ASSERT_TRUE(manifest.SerializeToString(&serialized_manifest));
+  string payload = "CrAU";
+  const uint64_t version_be = htobe64(1);
+  payload.append(reinterpret_cast<const char*>(&version_be),
+                 sizeof(version_be));
+  const uint64_t manifest_size_be = htobe64(serialized_manifest.size());
+  payload.append(reinterpret_cast<const char*>(&manifest_size_be),
+                 sizeof(manifest_size_be));
+  payload += serialized_manifest;
+  *out_metadata_size = payload.size();
+  payload += kBlobs;
+  *out_payload_size = payload.size();
+  ASSERT_TRUE(utils::WriteFile(path.c_str(), payload.data(), payload.size()));
+}
 }
 
 TEST(PayloadSignerTest, SimpleTest) {
@@ -137,4 +169,124 @@ TEST(PayloadSignerTest, VerifySignatureTest) {
   }
 }
 
+TEST(PayloadSignerTest, LoadPayloadMetadataTest) {
+  string payload_path;
+  ASSERT_TRUE(utils::MakeTempFile("/tmp/payload.XXXXXX", &payload_path,
+                                  NULL));
+  ScopedPathUnlinker payload_path_unlinker(payload_path);
+  uint64_t expected_payload_size = 0;
+  uint64_t expected_metadata_size = 0;
+  WriteSamplePayload(payload_path, &expected_payload_size,
+                     &expected_metadata_size);
+
+  vector<char> metadata;
+  DeltaArchiveManifest manifest;
+  uint64_t metadata_size = 0;
+  uint64_t payload_size = 0;
+  EXPECT_TRUE(PayloadSigner::LoadPayloadMetadata(payload_path, &metadata,
+                                                 &manifest, &metadata_size,
+                                                 &payload_size));
+  EXPECT_EQ(expected_metadata_size, metadata_size);
+  EXPECT_EQ(expected_payload_size, payload_size);
+  EXPECT_EQ(1, manifest.install_operations_size());
+  vector<char> payload;
+  ASSERT_TRUE(utils::ReadFile(payload_path, &payload));
+  EXPECT_TRUE(vector<char>(payload.begin(),
+                           payload.begin() + metadata_size) == metadata);
+
+  // A truncated manifest can't be loaded.
+  ASSERT_TRUE(utils::WriteFile(payload_path.c_str(), &payload[0],
+                               metadata_size - 1));
+  EXPECT_FALSE(PayloadSigner::LoadPayloadMetadata(payload_path, &metadata,
+                                                  &manifest, &metadata_size,
+                                                  &payload_size));
+}
+
+TEST(PayloadSignerTest, SignPayloadInPlaceTest) {
+  string payload_path;
+  ASSERT_TRUE(utils::MakeTempFile("/tmp/payload.XXXXXX", &payload_path,
+                                  NULL));
+  ScopedPathUnlinker payload_path_unlinker(payload_path);
+  uint64_t payload_size = 0;
+  uint64_t metadata_size = 0;
+  WriteSamplePayload(payload_path, &payload_size, &metadata_size);
+
+  uint64_t signature_length = 0;
+  ASSERT_TRUE(PayloadSigner::SignatureBlobLength(
+      vector<string>(1, kUnittestPrivateKeyPath), &signature_length));
+  vector<char> hash;
+  ASSERT_TRUE(PayloadSigner::HashPayloadForSigning(
+      payload_path, vector<int>(1, 256), &hash));
+  vector<char> signature;
+  ASSERT_TRUE(PayloadSigner::SignHash(hash, kUnittestPrivateKeyPath,
+                                      &signature));
+  uint64_t signed_metadata_size = 0;
+  EXPECT_TRUE(PayloadSigner::AddSignatureToPayload(
+      payload_path, vector<vector<char> >(1, signature), payload_path,
+      &signed_metadata_size));
+  EXPECT_LT(metadata_size, signed_metadata_size);
+  EXPECT_EQ(payload_size - metadata_size + signed_metadata_size +
+            signature_length,
+            utils::FileSize(payload_path));
+
+  // The hash that was signed covers everything but the signature blob.
+  vector<char> signed_hash;
+  EXPECT_EQ(utils::FileSize(payload_path) - signature_length,
+            OmahaHashCalculator::RawHashOfFile(
+                payload_path,
+                utils::FileSize(payload_path) - signature_length,
+                &signed_hash));
+  EXPECT_TRUE(hash == signed_hash);
+  EXPECT_TRUE(PayloadSigner::VerifySignedPayload(
+      payload_path, kUnittestPublicKeyPath, kSignatureMessageCurrentVersion));
+  EXPECT_FALSE(PayloadSigner::VerifySignedPayload(
+      payload_path, kUnittestPublicKey2Path, kSignatureMessageCurrentVersion));
+}
+
+TEST(PayloadSignerTest, SignUnsignedPayloadTest) {
+  string payload_path;
+  ASSERT_TRUE(utils::MakeTempFile("/tmp/payload.XXXXXX", &payload_path,
+                                  NULL));
+  ScopedPathUnlinker payload_path_unlinker(payload_path);
+  uint64_t payload_size = 0;
+  uint64_t metadata_size = 0;
+  WriteSamplePayload(payload_path, &payload_size, &metadata_size);
+  string signed_path = payload_path + ".signed";
+  ScopedPathUnlinker signed_path_unlinker(signed_path);
+
+  // The signature made with the current version's key is verified on the
+  // way.
+  vector<string> private_keys;
+  private_keys.push_back(kUnittestPrivateKey2Path);
+  private_keys.push_back(kUnittestPrivateKeyPath);
+  uint64_t signed_metadata_size = 0;
+  EXPECT_FALSE(PayloadSigner::SignUnsignedPayload(
+      payload_path, private_keys, signed_path, kUnittestPublicKey2Path,
+      kSignatureMessageCurrentVersion, &signed_metadata_size));
+  EXPECT_TRUE(PayloadSigner::SignUnsignedPayload(
+      payload_path, private_keys, signed_path, kUnittestPublicKeyPath,
+      kSignatureMessageCurrentVersion, &signed_metadata_size));
+
+  // It's signed the same as with the separate steps.
+  uint64_t signature_length = 0;
+  ASSERT_TRUE(PayloadSigner::SignatureBlobLength(private_keys,
+                                                 &signature_length));
+  EXPECT_EQ(payload_size - metadata_size + signed_metadata_size +
+            signature_length,
+            utils::FileSize(signed_path));
+  vector<char> hash;
+  ASSERT_TRUE(PayloadSigner::HashPayloadForSigning(
+      payload_path, vector<int>(2, 256), &hash));
+  vector<char> signed_hash;
+  OmahaHashCalculator::RawHashOfFile(
+      signed_path, utils::FileSize(signed_path) - signature_length,
+      &signed_hash);
+  EXPECT_TRUE(hash == signed_hash);
+  EXPECT_TRUE(PayloadSigner::VerifySignedPayload(
+      signed_path, kUnittestPublicKeyPath, kSignatureMessageCurrentVersion));
+  EXPECT_TRUE(PayloadSigner::VerifySignedPayload(
+      signed_path, kUnittestPublicKey2Path,
+      kSignatureMessageCurrentVersion - 1));
+}
+
 }  // namespace chromeos_update_engine
@@ -25,6 +25,31 @@ static const uint32_t kMaxBackoffDays = 16;
 // We want to randomize retry attempts after the backoff by +/- 6 hours.
 static const uint32_t kMaxBackoffFuzzMinutes = 12 * 60;
 
+namespace {
+
+// Makes the changes to |prefs| in its scope a single transaction, if |prefs|
+// supports them, so that the state changed by an event is persisted as a
+// whole. Stores that don't support them, like CachedPrefs, batch the
+// writes already.
+class ScopedPrefsTransaction {
+ public:
+  explicit ScopedPrefsTransaction(PrefsInterface* prefs)
+      : prefs_(prefs),
+        begun_(prefs->BeginTransaction()) {}
+  ~ScopedPrefsTransaction() {
+    LOG_IF(ERROR, begun_ && !prefs_->CommitTransaction())
+        << "Unable to persist the payload state.";
+  }
+
+ private:
+  PrefsInterface* prefs_;
+  bool begun_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedPrefsTransaction);
+};
+
+}  // namespace {}
+
 bool PayloadState::Initialize(PrefsInterface* prefs) {
   CHECK(prefs);
   prefs_ = prefs;
@@ -37,6 +62,7 @@ bool PayloadState::Initialize(PrefsInterface* prefs) {
 }
 
 void PayloadState::SetResponse(const OmahaResponse& omaha_response) {
+  ScopedPrefsTransaction transaction(prefs_);
   // Always store the latest response.
   response_ = omaha_response;
 
@@ -68,6 +94,7 @@ void PayloadState::SetResponse(const OmahaResponse& omaha_response) {
 
 void PayloadState::DownloadComplete() {
   LOG(INFO) << "Payload downloaded successfully";
+  ScopedPrefsTransaction transaction(prefs_);
   IncrementPayloadAttemptNumber();
 }
 
@@ -104,6 +131,7 @@ void PayloadState::UpdateFailed(ActionExitCode error) {
     return;
   }
 
+  ScopedPrefsTransaction transaction(prefs_);
   switch (base_error) {
     // Errors which are good indicators of a problem with a particular URL or
     // the protocol used in the URL or entities in the communication channel
@@ -194,6 +222,16 @@ void PayloadState::UpdateFailed(ActionExitCode error) {
   }
 }
 
+void PayloadState::SelectUrl(uint32_t url_index) {
+  if (url_index >= GetNumUrls() || url_index == GetUrlIndex())
+    return;
+  LOG(INFO) << "Selecting Url" << url_index << " instead of Url"
+            << GetUrlIndex();
+  ScopedPrefsTransaction transaction(prefs_);
+  SetUrlIndex(url_index);
+  SetUrlFailureCount(0);
+}
+
 bool PayloadState::ShouldBackoffDownload() {
   if (response_.disable_payload_backoff) {
     LOG(INFO) << "Payload backoff logic is disabled. "
@@ -346,7 +384,8 @@ void PayloadState::LoadResponseSignature() {
   string stored_value;
   if (prefs_->Exists(kPrefsCurrentResponseSignature) &&
       prefs_->GetString(kPrefsCurrentResponseSignature, &stored_value)) {
-    SetResponseSignature(stored_value);
+    response_signature_ = stored_value;
+    LOG(INFO) << "Current Response Signature = \n" << response_signature_;
   }
 }
 
@@ -365,9 +404,11 @@ void PayloadState::LoadPayloadAttemptNumber() {
     if (stored_value < 0) {
       LOG(ERROR) << "Invalid payload attempt number (" << stored_value
                  << ") in persisted state. Defaulting to 0";
-      stored_value = 0;
+      SetPayloadAttemptNumber(0);
+      return;
     }
-    SetPayloadAttemptNumber(stored_value);
+    payload_attempt_number_ = stored_value;
+    LOG(INFO) << "Payload Attempt Number = " << payload_attempt_number_;
   }
 }
 
@@ -388,9 +429,11 @@ void PayloadState::LoadUrlIndex() {
     if (stored_value < 0) {
       LOG(ERROR) << "Invalid URL Index (" << stored_value
                  << ") in persisted state. Defaulting to 0";
-      stored_value = 0;
+      SetUrlIndex(0);
+      return;
     }
-    SetUrlIndex(stored_value);
+    url_index_ = stored_value;
+    LOG(INFO) << "Current URL Index = " << url_index_;
   }
 }
 
@@ -409,9 +452,12 @@ void PayloadState::LoadUrlFailureCount() {
     if (stored_value < 0) {
       LOG(ERROR) << "Invalid URL Failure count (" << stored_value
                  << ") in persisted state. Defaulting to 0";
-      stored_value = 0;
+      SetUrlFailureCount(0);
+      return;
     }
-    SetUrlFailureCount(stored_value);
+    url_failure_count_ = stored_value;
+    LOG(INFO) << "Current URL (Url" << GetUrlIndex()
+              << ")'s Failure Count = " << url_failure_count_;
   }
 }
 
@@ -437,9 +483,12 @@ void PayloadState::LoadBackoffExpiryTime() {
     LOG(ERROR) << "Invalid backoff expiry time ("
                << utils::ToString(stored_time)
                << ") in persisted state. Resetting.";
-    stored_time = Time();
+    SetBackoffExpiryTime(Time());
+    return;
   }
-  SetBackoffExpiryTime(stored_time);
+  backoff_expiry_time_ = stored_time;
+  LOG(INFO) << "Backoff Expiry Time = "
+            << utils::ToString(backoff_expiry_time_);
 }
 
 void PayloadState::SetBackoffExpiryTime(const Time& new_time) {
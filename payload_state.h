@@ -31,6 +31,8 @@ class PayloadState : public PayloadStateInterface {
   // Initializes a payload state object using |prefs| for storing the
   // persisted state. It also performs the initial loading of all persisted
   // state into memory and dumps the initial state for debugging purposes.
+  // The state changed by each of the methods below is persisted in a single
+  // transaction, if |prefs| supports them.
   // Note: the other methods should be called only after calling Initialize
   // on this object.
   bool Initialize(PrefsInterface* prefs);
@@ -42,6 +44,7 @@ class PayloadState : public PayloadStateInterface {
   virtual void DownloadProgress(size_t count);
   virtual void UpdateFailed(ActionExitCode error);
   virtual bool ShouldBackoffDownload();
+  virtual void SelectUrl(uint32_t url_index);
 
   virtual inline std::string GetResponseSignature() {
     return response_signature_;
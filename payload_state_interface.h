@@ -61,6 +61,10 @@ class PayloadStateInterface {
   // Returns the current URL's failure count.
   virtual uint32_t GetUrlFailureCount() = 0;
 
+  // Makes the URL at |url_index| the current one, with no failures, e.g.,
+  // because it was measured to be faster than the current one.
+  virtual void SelectUrl(uint32_t url_index) = 0;
+
   // Returns the expiry time for the current backoff period.
   virtual base::Time GetBackoffExpiryTime() = 0;
  };
@@ -4,10 +4,12 @@
 
 #include <glib.h>
 
+#include "base/file_util.h"
 #include "base/stringprintf.h"
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 
+#include "update_engine/journal_prefs.h"
 #include "update_engine/omaha_request_action.h"
 #include "update_engine/payload_state.h"
 #include "update_engine/prefs_mock.h"
@@ -168,6 +170,26 @@ TEST(PayloadStateTest, CanAdvanceUrlIndexCorrectly) {
   EXPECT_EQ(1, payload_state.GetUrlIndex());
 }
 
+TEST(PayloadStateTest, SelectUrlResetsFailureCount) {
+  OmahaResponse response;
+  NiceMock<PrefsMock> prefs;
+  PayloadState payload_state;
+
+  EXPECT_TRUE(payload_state.Initialize(&prefs));
+  SetupPayloadStateWith2Urls("Hash3141", &payload_state, &response);
+  payload_state.UpdateFailed(kActionCodeDownloadTransferError);
+  EXPECT_EQ(0, payload_state.GetUrlIndex());
+  EXPECT_EQ(1, payload_state.GetUrlFailureCount());
+
+  payload_state.SelectUrl(1);
+  EXPECT_EQ(1, payload_state.GetUrlIndex());
+  EXPECT_EQ(0, payload_state.GetUrlFailureCount());
+
+  // An index past the URLs of the response is ignored.
+  payload_state.SelectUrl(2);
+  EXPECT_EQ(1, payload_state.GetUrlIndex());
+}
+
 TEST(PayloadStateTest, NewResponseResetsPayloadState) {
   OmahaResponse response;
   NiceMock<PrefsMock> prefs;
@@ -349,6 +371,53 @@ TEST(PayloadStateTest, SetResponseResetsInvalidUrlIndex) {
   EXPECT_EQ(0, payload_state.GetUrlFailureCount());
 }
 
+TEST(PayloadStateTest, LoadingDoesNotRewriteState) {
+  NiceMock<PrefsMock> prefs;
+  EXPECT_CALL(prefs, Exists(_)).WillRepeatedly(Return(true));
+  EXPECT_CALL(prefs, GetString(kPrefsCurrentResponseSignature, _))
+      .WillOnce(DoAll(SetArgumentPointee<1>(string("sig")), Return(true)));
+  EXPECT_CALL(prefs, GetInt64(kPrefsCurrentUrlIndex, _))
+      .WillOnce(DoAll(SetArgumentPointee<1>(1), Return(true)));
+  EXPECT_CALL(prefs, GetInt64(kPrefsCurrentUrlFailureCount, _))
+      .WillOnce(DoAll(SetArgumentPointee<1>(-1), Return(true)));
+  EXPECT_CALL(prefs, SetString(_, _)).Times(0);
+  EXPECT_CALL(prefs, SetInt64(_, _)).Times(0);
+  // Only the invalid value is written back.
+  EXPECT_CALL(prefs, SetInt64(kPrefsCurrentUrlFailureCount, 0));
+
+  PayloadState payload_state;
+  EXPECT_TRUE(payload_state.Initialize(&prefs));
+  EXPECT_EQ("sig", payload_state.GetResponseSignature());
+  EXPECT_EQ(1, payload_state.GetUrlIndex());
+  EXPECT_EQ(0, payload_state.GetUrlFailureCount());
+}
+
+TEST(PayloadStateTest, ChangesAreCommittedTogether) {
+  FilePath prefs_dir;
+  ASSERT_TRUE(file_util::CreateNewTempDirectory("aupayloadstate",
+                                                &prefs_dir));
+  const FilePath journal_path = prefs_dir.Append("prefs.journal");
+  {
+    JournalPrefs prefs;
+    ASSERT_TRUE(prefs.Init(journal_path));
+    PayloadState payload_state;
+    OmahaResponse response;
+    EXPECT_TRUE(payload_state.Initialize(&prefs));
+    SetupPayloadStateWith2Urls("Hash2718", &payload_state, &response);
+    payload_state.UpdateFailed(kActionCodeDownloadMetadataSignatureMismatch);
+  }
+  // The new response and the failure are a transaction each.
+  string journal;
+  EXPECT_TRUE(file_util::ReadFileToString(journal_path, &journal));
+  size_t commits = 0;
+  for (size_t pos = journal.find("commit\n"); pos != string::npos;
+       pos = journal.find("commit\n", pos + 1)) {
+    commits++;
+  }
+  EXPECT_EQ(2U, commits);
+  file_util::Delete(prefs_dir, true);  // recursive
+}
+
 TEST(PayloadStateTest, NoBackoffForDeltaPayloads) {
   OmahaResponse response;
   response.is_delta_payload = true;
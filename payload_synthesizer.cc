@@ -0,0 +1,454 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/payload_synthesizer.h"
+
+#include <endian.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <set>
+#include <utility>
+
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+
+#include "update_engine/bzip.h"
+#include "update_engine/delta_diff_generator.h"
+#include "update_engine/extent_ranges.h"
+#include "update_engine/file_writer.h"
+#include "update_engine/graph_utils.h"
+#include "update_engine/payload_signer.h"
+#include "update_engine/utils.h"
+#include "update_engine/xz.h"
+
+using google::protobuf::RepeatedPtrField;
+using std::make_pair;
+using std::map;
+using std::max;
+using std::min;
+using std::set;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+const uint64_t kBlockSize = 4096;
+
+// The old partitions are written this many blocks at a time.
+const uint64_t kChunkBlocks = 256;
+
+// Writes an ext2 superblock for a filesystem of |num_blocks| 4 KiB blocks
+// into the first block at |block|, so that the synthetic rootfs has a size
+// utils::GetFilesystemSize() can tell.
+void WriteSuperblock(char* block, uint64_t num_blocks) {
+  const int kSuperblockOffset = 1024;
+  const uint32_t block_count = htole32(num_blocks);
+  // 1024 << 2 bytes.
+  const uint32_t log_block_size = htole32(2);
+  const uint16_t magic = htole16(0xef53);
+  char* superblock = block + kSuperblockOffset;
+  memset(superblock, 0, kSuperblockOffset);
+  memcpy(superblock + 1 * sizeof(uint32_t), &block_count,
+         sizeof(block_count));
+  memcpy(superblock + 6 * sizeof(uint32_t), &log_block_size,
+         sizeof(log_block_size));
+  memcpy(superblock + 14 * sizeof(uint32_t), &magic, sizeof(magic));
+}
+
+// Appends up to |count| of the blocks of |extents| to |out|, from the
+// first. Returns the number appended.
+uint64_t TakeBlocks(const vector<Extent>& extents,
+                    uint64_t count,
+                    vector<Extent>* out) {
+  uint64_t taken = 0;
+  for (vector<Extent>::const_iterator it = extents.begin();
+       it != extents.end() && taken < count; ++it) {
+    const uint64_t num_blocks = min(it->num_blocks(), count - taken);
+    graph_utils::AppendExtentToExtents(
+        out, ExtentForRange(it->start_block(), num_blocks));
+    taken += num_blocks;
+  }
+  return taken;
+}
+
+bool ReadExtents(int fd, const vector<Extent>& extents, vector<char>* out) {
+  out->resize(graph_utils::BlocksInExtents(extents) * kBlockSize);
+  uint64_t offset = 0;
+  for (vector<Extent>::const_iterator it = extents.begin();
+       it != extents.end(); ++it) {
+    const uint64_t length = it->num_blocks() * kBlockSize;
+    ssize_t bytes_read = 0;
+    TEST_AND_RETURN_FALSE(utils::PReadAll(fd, &(*out)[offset], length,
+                                          it->start_block() * kBlockSize,
+                                          &bytes_read));
+    TEST_AND_RETURN_FALSE(static_cast<uint64_t>(bytes_read) == length);
+    offset += length;
+  }
+  return true;
+}
+
+bool WriteExtents(int fd, const vector<Extent>& extents,
+                  const vector<char>& data) {
+  uint64_t offset = 0;
+  for (vector<Extent>::const_iterator it = extents.begin();
+       it != extents.end(); ++it) {
+    const uint64_t length = it->num_blocks() * kBlockSize;
+    TEST_AND_RETURN_FALSE(utils::PWriteAll(fd, &data[offset], length,
+                                           it->start_block() * kBlockSize));
+    offset += length;
+  }
+  return true;
+}
+
+// Diffs |old_data| to |new_data| with bsdiff into |out|. Returns true on
+// success.
+bool Bsdiff(const vector<char>& old_data,
+            const vector<char>& new_data,
+            vector<char>* out) {
+  string old_path, new_path;
+  TEST_AND_RETURN_FALSE(utils::MakeTempFile("/tmp/SyntheticOld.XXXXXX",
+                                            &old_path, NULL));
+  ScopedPathUnlinker old_unlinker(old_path);
+  TEST_AND_RETURN_FALSE(utils::MakeTempFile("/tmp/SyntheticNew.XXXXXX",
+                                            &new_path, NULL));
+  ScopedPathUnlinker new_unlinker(new_path);
+  TEST_AND_RETURN_FALSE(utils::WriteFile(old_path.c_str(), &old_data[0],
+                                         old_data.size()));
+  TEST_AND_RETURN_FALSE(utils::WriteFile(new_path.c_str(), &new_data[0],
+                                         new_data.size()));
+  return DeltaDiffGenerator::BsdiffFiles(old_path, new_path, out);
+}
+
+}  // namespace {}
+
+SyntheticPayloadSpec::SyntheticPayloadSpec()
+    : rootfs_blocks(16384),
+      kernel_blocks(2048),
+      rootfs_operations(1024),
+      kernel_operations(8),
+      max_extents(4),
+      dag_depth(4),
+      compressibility(0.5),
+      diff_ratio(0.01),
+      seed(1) {
+  type_weights[DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ] = 3;
+  type_weights[DeltaArchiveManifest_InstallOperation_Type_MOVE] = 3;
+  type_weights[DeltaArchiveManifest_InstallOperation_Type_BSDIFF] = 3;
+  type_weights[DeltaArchiveManifest_InstallOperation_Type_ZERO] = 1;
+}
+
+PayloadSynthesizer::PayloadSynthesizer(const SyntheticPayloadSpec& spec)
+    : spec_(spec),
+      seed_(spec.seed) {}
+
+bool PayloadSynthesizer::Synthesize(const string& old_image,
+                                    const string& old_kernel,
+                                    const string& new_image,
+                                    const string& new_kernel,
+                                    const string& private_key_path,
+                                    const string& payload_path,
+                                    uint64_t* metadata_size) {
+  for (map<DeltaArchiveManifest_InstallOperation_Type,
+           uint32_t>::const_iterator it = spec_.type_weights.begin();
+       it != spec_.type_weights.end(); ++it) {
+    switch (it->first) {
+      case DeltaArchiveManifest_InstallOperation_Type_REPLACE:
+      case DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ:
+      case DeltaArchiveManifest_InstallOperation_Type_REPLACE_XZ:
+      case DeltaArchiveManifest_InstallOperation_Type_MOVE:
+      case DeltaArchiveManifest_InstallOperation_Type_BSDIFF:
+      case DeltaArchiveManifest_InstallOperation_Type_ZERO:
+        break;
+      default:
+        LOG(ERROR) << "Can't synthesize "
+                   << DeltaArchiveManifest_InstallOperation_Type_Name(
+                       it->first) << " operations";
+        return false;
+    }
+  }
+  TEST_AND_RETURN_FALSE(spec_.max_extents >= 1);
+  TEST_AND_RETURN_FALSE(spec_.dag_depth >= 1);
+  TEST_AND_RETURN_FALSE(spec_.rootfs_blocks <= kint32max);
+
+  string blobs_path;
+  int blobs_fd = -1;
+  TEST_AND_RETURN_FALSE(utils::MakeTempFile("/tmp/SyntheticBlobs.XXXXXX",
+                                            &blobs_path, &blobs_fd));
+  ScopedPathUnlinker blobs_unlinker(blobs_path);
+  ScopedFdCloser blobs_fd_closer(&blobs_fd);
+  uint64_t blobs_size = 0;
+
+  DeltaArchiveManifest manifest;
+  manifest.set_block_size(kBlockSize);
+  TEST_AND_RETURN_FALSE(SynthesizePartition(
+      false,  // is_kernel
+      spec_.rootfs_blocks, spec_.rootfs_operations, old_image, new_image,
+      manifest.mutable_install_operations(), blobs_fd, &blobs_size));
+  TEST_AND_RETURN_FALSE(SynthesizePartition(
+      true,  // is_kernel
+      spec_.kernel_blocks, spec_.kernel_operations, old_kernel, new_kernel,
+      manifest.mutable_kernel_install_operations(), blobs_fd, &blobs_size));
+
+  // Signatures appear at the end of the blobs.
+  if (!private_key_path.empty()) {
+    uint64_t signature_blob_length = 0;
+    TEST_AND_RETURN_FALSE(
+        PayloadSigner::SignatureBlobLength(vector<string>(1, private_key_path),
+                                           &signature_blob_length));
+    DeltaDiffGenerator::AddSignatureOp(blobs_size, signature_blob_length,
+                                       &manifest);
+  }
+  TEST_AND_RETURN_FALSE(DeltaDiffGenerator::InitializePartitionInfo(
+      false, old_image, manifest.mutable_old_rootfs_info()));
+  TEST_AND_RETURN_FALSE(DeltaDiffGenerator::InitializePartitionInfo(
+      false, new_image, manifest.mutable_new_rootfs_info()));
+  TEST_AND_RETURN_FALSE(DeltaDiffGenerator::InitializePartitionInfo(
+      true, old_kernel, manifest.mutable_old_kernel_info()));
+  TEST_AND_RETURN_FALSE(DeltaDiffGenerator::InitializePartitionInfo(
+      true, new_kernel, manifest.mutable_new_kernel_info()));
+
+  DirectFileWriter writer;
+  TEST_AND_RETURN_FALSE_ERRNO(writer.Open(payload_path.c_str(),
+                                          O_WRONLY | O_CREAT | O_TRUNC,
+                                          0644) == 0);
+  ScopedFileWriterCloser writer_closer(&writer);
+  TEST_AND_RETURN_FALSE(DeltaDiffGenerator::WritePayloadHeader(
+      manifest, false, &writer, metadata_size));
+  DeltaDiffGenerator::DataBlobRuns runs;
+  if (blobs_size > 0)
+    runs.push_back(make_pair(0, blobs_size));
+  TEST_AND_RETURN_FALSE(DeltaDiffGenerator::CopyDataBlobs(blobs_path, runs,
+                                                          writer.fd()));
+  if (!private_key_path.empty()) {
+    vector<char> signature_blob;
+    TEST_AND_RETURN_FALSE(PayloadSigner::SignPayload(
+        payload_path,
+        vector<string>(1, private_key_path),
+        &signature_blob));
+    TEST_AND_RETURN_FALSE(writer.Write(&signature_blob[0],
+                                       signature_blob.size()));
+  }
+  LOG(INFO) << "Synthesized a payload of "
+            << manifest.install_operations_size() << " rootfs and "
+            << manifest.kernel_install_operations_size()
+            << " kernel operations with " << blobs_size
+            << " bytes of blobs and metadata size " << *metadata_size;
+  return true;
+}
+
+bool PayloadSynthesizer::SynthesizePartition(
+    bool is_kernel,
+    uint64_t num_blocks,
+    uint64_t num_operations,
+    const string& old_path,
+    const string& new_path,
+    RepeatedPtrField<DeltaArchiveManifest_InstallOperation>* operations,
+    int blobs_fd,
+    uint64_t* blobs_size) {
+  const uint64_t first_block = is_kernel ? 0 : 1;
+  TEST_AND_RETURN_FALSE(num_blocks > first_block);
+  num_operations = min(num_operations, num_blocks - first_block);
+
+  // The new partition starts as a copy of the old one, which the operations
+  // are then applied to.
+  int old_fd = HANDLE_EINTR(open(old_path.c_str(),
+                                 O_WRONLY | O_CREAT | O_TRUNC, 0644));
+  TEST_AND_RETURN_FALSE_ERRNO(old_fd >= 0);
+  ScopedFdCloser old_fd_closer(&old_fd);
+  int new_fd = HANDLE_EINTR(open(new_path.c_str(),
+                                 O_RDWR | O_CREAT | O_TRUNC, 0644));
+  TEST_AND_RETURN_FALSE_ERRNO(new_fd >= 0);
+  ScopedFdCloser new_fd_closer(&new_fd);
+  vector<char> chunk(kChunkBlocks * kBlockSize);
+  for (uint64_t block = 0; block < num_blocks; block += kChunkBlocks) {
+    const size_t size = min(kChunkBlocks, num_blocks - block) * kBlockSize;
+    FillBlocks(&chunk[0], size);
+    if (!is_kernel && block == 0)
+      WriteSuperblock(&chunk[0], num_blocks);
+    TEST_AND_RETURN_FALSE(utils::PWriteAll(old_fd, &chunk[0], size,
+                                           block * kBlockSize));
+    TEST_AND_RETURN_FALSE(utils::PWriteAll(new_fd, &chunk[0], size,
+                                           block * kBlockSize));
+  }
+
+  vector<vector<Extent> > blocks;
+  AssignBlocks(first_block, num_blocks, num_operations, &blocks);
+  vector<uint32_t> depths(num_operations, 1);
+  for (uint64_t i = 0; i < num_operations; i++) {
+    DeltaArchiveManifest_InstallOperation_Type type = PickType();
+    vector<Extent> src_extents;
+    if ((type == DeltaArchiveManifest_InstallOperation_Type_MOVE ||
+         type == DeltaArchiveManifest_InstallOperation_Type_BSDIFF) &&
+        !PickSourceBlocks(blocks, depths, i, &src_extents, &depths[i])) {
+      type = DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ;
+    }
+
+    DeltaArchiveManifest_InstallOperation* op = operations->Add();
+    op->set_type(type);
+    DeltaDiffGenerator::StoreExtents(blocks[i], op->mutable_dst_extents());
+    vector<char> data(graph_utils::BlocksInExtents(blocks[i]) * kBlockSize);
+    vector<char> blob;
+    switch (type) {
+      case DeltaArchiveManifest_InstallOperation_Type_MOVE:
+      case DeltaArchiveManifest_InstallOperation_Type_BSDIFF: {
+        DeltaDiffGenerator::StoreExtents(src_extents,
+                                         op->mutable_src_extents());
+        vector<char> src_data;
+        TEST_AND_RETURN_FALSE(ReadExtents(new_fd, src_extents, &src_data));
+        data = src_data;
+        if (type == DeltaArchiveManifest_InstallOperation_Type_MOVE)
+          break;
+        const uint64_t changes = max<uint64_t>(1, data.size() *
+                                                  spec_.diff_ratio);
+        for (uint64_t j = 0; j < changes; j++)
+          data[Random(data.size())] = Random(256);
+        TEST_AND_RETURN_FALSE(Bsdiff(src_data, data, &blob));
+        op->set_src_length(src_data.size());
+        op->set_dst_length(data.size());
+        break;
+      }
+      case DeltaArchiveManifest_InstallOperation_Type_ZERO:
+        break;
+      default:
+        FillBlocks(&data[0], data.size());
+        if (type == DeltaArchiveManifest_InstallOperation_Type_REPLACE)
+          blob = data;
+        else if (type == DeltaArchiveManifest_InstallOperation_Type_REPLACE_XZ)
+          TEST_AND_RETURN_FALSE(XzCompress(data, &blob));
+        else
+          TEST_AND_RETURN_FALSE(BzipCompress(data, &blob));
+        break;
+    }
+    TEST_AND_RETURN_FALSE(WriteExtents(new_fd, blocks[i], data));
+    if (!blob.empty()) {
+      TEST_AND_RETURN_FALSE(utils::WriteAll(blobs_fd, &blob[0], blob.size()));
+      op->set_data_offset(*blobs_size);
+      op->set_data_length(blob.size());
+      TEST_AND_RETURN_FALSE(DeltaDiffGenerator::AddOperationHash(
+          op, &blob[0], blob.size()));
+      *blobs_size += blob.size();
+    }
+  }
+  return true;
+}
+
+void PayloadSynthesizer::AssignBlocks(uint64_t first_block,
+                                      uint64_t num_blocks,
+                                      uint64_t num_operations,
+                                      vector<vector<Extent> >* blocks) {
+  const uint64_t available = num_blocks - first_block;
+  vector<uint64_t> num_extents(num_operations);
+  uint64_t total_extents = 0;
+  for (uint64_t i = 0; i < num_operations; i++) {
+    num_extents[i] = 1 + Random(spec_.max_extents);
+    total_extents += num_extents[i];
+  }
+  if (total_extents > available) {
+    num_extents.assign(num_operations, 1);
+    total_extents = num_operations;
+  }
+
+  // Cut the blocks into runs at random points and deal the runs out in a
+  // random order.
+  set<uint64_t> cuts;
+  cuts.insert(first_block);
+  while (cuts.size() < total_extents)
+    cuts.insert(first_block + Random(available));
+  cuts.insert(num_blocks);
+  vector<Extent> runs;
+  uint64_t run_start = first_block;
+  for (set<uint64_t>::const_iterator it = cuts.upper_bound(first_block);
+       it != cuts.end(); ++it) {
+    runs.push_back(ExtentForRange(run_start, *it - run_start));
+    run_start = *it;
+  }
+  for (size_t i = runs.size() - 1; i > 0; i--)
+    std::swap(runs[i], runs[Random(i + 1)]);
+
+  blocks->assign(num_operations, vector<Extent>());
+  vector<Extent>::const_iterator run = runs.begin();
+  for (uint64_t i = 0; i < num_operations; i++) {
+    for (uint64_t j = 0; j < num_extents[i]; j++)
+      (*blocks)[i].push_back(*run++);
+  }
+}
+
+bool PayloadSynthesizer::PickSourceBlocks(
+    const vector<vector<Extent> >& blocks,
+    const vector<uint32_t>& depths,
+    size_t index,
+    vector<Extent>* src_extents,
+    uint32_t* depth) {
+  const uint64_t count = graph_utils::BlocksInExtents(blocks[index]);
+  // Read what the operations just before wrote, as long as the chains they
+  // make stay short enough.
+  uint64_t taken = 0;
+  uint32_t max_depth = 0;
+  for (size_t i = index; i > 0 && taken < count &&
+           depths[i - 1] < spec_.dag_depth; i--) {
+    taken += TakeBlocks(blocks[i - 1], count - taken, src_extents);
+    max_depth = max(max_depth, depths[i - 1]);
+  }
+  if (taken == count) {
+    *depth = max_depth + 1;
+    return true;
+  }
+
+  // Otherwise read old data, from blocks that operations after this one
+  // write.
+  src_extents->clear();
+  taken = 0;
+  const size_t num_after = blocks.size() - index - 1;
+  const size_t start = num_after > 0 ? Random(num_after) : 0;
+  for (size_t i = 0; i < num_after && taken < count; i++) {
+    taken += TakeBlocks(blocks[index + 1 + (start + i) % num_after],
+                        count - taken, src_extents);
+  }
+  *depth = 1;
+  return taken == count;
+}
+
+void PayloadSynthesizer::FillBlocks(char* data, size_t size) {
+  const size_t repeated = min<size_t>(kBlockSize,
+                                      kBlockSize * spec_.compressibility);
+  for (size_t offset = 0; offset < size; offset += kBlockSize) {
+    memset(data + offset, Random(256), repeated);
+    for (size_t i = repeated; i < kBlockSize; i++)
+      data[offset + i] = Random(256);
+  }
+}
+
+DeltaArchiveManifest_InstallOperation_Type PayloadSynthesizer::PickType() {
+  uint64_t total = 0;
+  for (map<DeltaArchiveManifest_InstallOperation_Type,
+           uint32_t>::const_iterator it = spec_.type_weights.begin();
+       it != spec_.type_weights.end(); ++it) {
+    total += it->second;
+  }
+  if (total == 0)
+    return DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ;
+  uint64_t pick = Random(total);
+  for (map<DeltaArchiveManifest_InstallOperation_Type,
+           uint32_t>::const_iterator it = spec_.type_weights.begin();
+       it != spec_.type_weights.end(); ++it) {
+    if (pick < it->second)
+      return it->first;
+    pick -= it->second;
+  }
+  NOTREACHED();
+  return DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ;
+}
+
+uint64_t PayloadSynthesizer::Random(uint64_t limit) {
+  const uint64_t value =
+      (static_cast<uint64_t>(rand_r(&seed_)) << 31) | rand_r(&seed_);
+  return value % limit;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,137 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_PAYLOAD_SYNTHESIZER_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_PAYLOAD_SYNTHESIZER_H__
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <base/basictypes.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+// Synthesizes delta payloads of a given shape, with the old partitions they
+// apply to, for benchmarking DeltaPerformer without real images. The old
+// partitions are filled with pseudo-random data, and the operations are
+// made up one after another, each writing blocks that no other writes and
+// reading, for MOVE and BSDIFF, blocks of the partition as the operations
+// before it left them. The new partitions are what applying the operations
+// in order makes of the old ones, so the payload is valid by construction.
+// The same spec and seed always make the same payload.
+
+namespace chromeos_update_engine {
+
+// The shape of a synthetic payload.
+struct SyntheticPayloadSpec {
+  SyntheticPayloadSpec();
+
+  // The size of the partitions, in 4 KiB blocks.
+  uint64_t rootfs_blocks;
+  uint64_t kernel_blocks;
+
+  // The number of operations of each partition. Together with the sizes of
+  // the partitions, this sets how many blocks each operation writes, since
+  // all blocks but the first of the rootfs, which holds the superblock, are
+  // written.
+  uint64_t rootfs_operations;
+  uint64_t kernel_operations;
+
+  // The relative frequency of each operation type. REPLACE, REPLACE_BZ,
+  // REPLACE_XZ, MOVE, BSDIFF and ZERO are supported. Operations that read
+  // data become REPLACE_BZ if there are not enough blocks left to read.
+  std::map<DeltaArchiveManifest_InstallOperation_Type, uint32_t> type_weights;
+
+  // The most extents the blocks an operation writes are split in, from 1
+  // for contiguous operations up.
+  uint32_t max_extents;
+
+  // The longest chain of operations that each read blocks the one before
+  // it wrote, which constrains the order they can be applied in. 1 makes
+  // all operations read old data.
+  uint32_t dag_depth;
+
+  // The fraction of each new block that compresses away, from 0 for random
+  // data to 1 for a single repeated byte. This sets how large the blobs of
+  // the REPLACE_BZ and REPLACE_XZ operations are.
+  double compressibility;
+
+  // The fraction of the bytes a BSDIFF operation changes, which sets how
+  // large its patch is.
+  double diff_ratio;
+
+  uint32_t seed;
+};
+
+class PayloadSynthesizer {
+ public:
+  explicit PayloadSynthesizer(const SyntheticPayloadSpec& spec);
+
+  // Writes the old partitions to |old_image| and |old_kernel|, the new ones
+  // the payload updates them to to |new_image| and |new_kernel|, and the
+  // payload to |payload_path|, signed with the key at |private_key_path|
+  // unless it's empty. Sets |metadata_size| to the size of the metadata of
+  // the payload. Returns true on success.
+  bool Synthesize(const std::string& old_image,
+                  const std::string& old_kernel,
+                  const std::string& new_image,
+                  const std::string& new_kernel,
+                  const std::string& private_key_path,
+                  const std::string& payload_path,
+                  uint64_t* metadata_size);
+
+ private:
+  // Writes a partition of |num_blocks| blocks to |old_path| and its new
+  // version to |new_path|, and adds the |num_operations| operations that
+  // update it to |operations|, with their blobs appended to |blobs_fd| at
+  // |*blobs_size|. The first block of the rootfs is an ext2 superblock that
+  // no operation writes. Returns true on success.
+  bool SynthesizePartition(
+      bool is_kernel,
+      uint64_t num_blocks,
+      uint64_t num_operations,
+      const std::string& old_path,
+      const std::string& new_path,
+      google::protobuf::RepeatedPtrField<DeltaArchiveManifest_InstallOperation>*
+          operations,
+      int blobs_fd,
+      uint64_t* blobs_size);
+
+  // Splits blocks |first_block| to |num_blocks| into the blocks each of
+  // |num_operations| operations writes, in a few shuffled extents each.
+  void AssignBlocks(uint64_t first_block,
+                    uint64_t num_blocks,
+                    uint64_t num_operations,
+                    std::vector<std::vector<Extent> >* blocks);
+
+  // Sets |src_extents| to the blocks the MOVE or BSDIFF operation |index|
+  // of the operations that write |blocks| reads, as many as it writes, and
+  // |depth| to the length of the longest chain of operations it ends, given
+  // the |depths| of those before it. Returns false if there are not enough
+  // blocks to read.
+  bool PickSourceBlocks(const std::vector<std::vector<Extent> >& blocks,
+                        const std::vector<uint32_t>& depths,
+                        size_t index,
+                        std::vector<Extent>* src_extents,
+                        uint32_t* depth);
+
+  // Fills |size| bytes at |data| with blocks of new data.
+  void FillBlocks(char* data, size_t size);
+
+  // Returns an operation type picked by the type weights.
+  DeltaArchiveManifest_InstallOperation_Type PickType();
+
+  // Returns a pseudo-random number below |limit|.
+  uint64_t Random(uint64_t limit);
+
+  const SyntheticPayloadSpec spec_;
+  unsigned int seed_;
+
+  DISALLOW_COPY_AND_ASSIGN(PayloadSynthesizer);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_PAYLOAD_SYNTHESIZER_H__
@@ -0,0 +1,244 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <base/file_path.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/delta_diff_generator.h"
+#include "update_engine/delta_performer.h"
+#include "update_engine/install_plan.h"
+#include "update_engine/payload_signer.h"
+#include "update_engine/payload_synthesizer.h"
+#include "update_engine/prefs.h"
+#include "update_engine/test_utils.h"
+#include "update_engine/utils.h"
+
+using std::map;
+using std::max;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+extern const char* kUnittestPrivateKeyPath;
+extern const char* kUnittestPublicKeyPath;
+
+namespace {
+
+// Returns the length of the longest chain of |operations| that each read a
+// block the one before wrote, and sets |writes| to the number of times each
+// block is written.
+uint32_t ChainDepth(
+    const google::protobuf::RepeatedPtrField<
+        DeltaArchiveManifest_InstallOperation>& operations,
+    map<uint64_t, int>* writes) {
+  map<uint64_t, uint32_t> block_depths;
+  uint32_t max_depth = 0;
+  for (int i = 0; i < operations.size(); i++) {
+    uint32_t depth = 1;
+    const DeltaArchiveManifest_InstallOperation& op = operations.Get(i);
+    for (int j = 0; j < op.src_extents_size(); j++) {
+      for (uint64_t k = 0; k < op.src_extents(j).num_blocks(); k++) {
+        const uint64_t block = op.src_extents(j).start_block() + k;
+        if (block_depths.count(block))
+          depth = max(depth, block_depths[block] + 1);
+      }
+    }
+    for (int j = 0; j < op.dst_extents_size(); j++) {
+      for (uint64_t k = 0; k < op.dst_extents(j).num_blocks(); k++) {
+        const uint64_t block = op.dst_extents(j).start_block() + k;
+        block_depths[block] = depth;
+        (*writes)[block]++;
+      }
+    }
+    max_depth = max(max_depth, depth);
+  }
+  return max_depth;
+}
+
+}  // namespace {}
+
+class PayloadSynthesizerTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    spec_.rootfs_blocks = 512;
+    spec_.kernel_blocks = 64;
+    spec_.rootfs_operations = 64;
+    spec_.kernel_operations = 4;
+    spec_.type_weights.clear();
+    spec_.type_weights[DeltaArchiveManifest_InstallOperation_Type_REPLACE] = 1;
+    spec_.type_weights[
+        DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ] = 1;
+    spec_.type_weights[
+        DeltaArchiveManifest_InstallOperation_Type_REPLACE_XZ] = 1;
+    spec_.type_weights[DeltaArchiveManifest_InstallOperation_Type_MOVE] = 2;
+    spec_.type_weights[DeltaArchiveManifest_InstallOperation_Type_BSDIFF] = 2;
+    spec_.type_weights[DeltaArchiveManifest_InstallOperation_Type_ZERO] = 1;
+    spec_.max_extents = 3;
+    spec_.dag_depth = 3;
+    for (int i = 0; i < kNumPaths; i++) {
+      ASSERT_TRUE(utils::MakeTempFile("/tmp/PayloadSynthesizerTest.XXXXXX",
+                                      &paths_[i], NULL));
+    }
+  }
+
+  virtual void TearDown() {
+    for (int i = 0; i < kNumPaths; i++)
+      unlink(paths_[i].c_str());
+  }
+
+  bool Synthesize(const string& payload_path) {
+    PayloadSynthesizer synthesizer(spec_);
+    return synthesizer.Synthesize(paths_[kOldImage], paths_[kOldKernel],
+                                  paths_[kNewImage], paths_[kNewKernel],
+                                  kUnittestPrivateKeyPath, payload_path,
+                                  &metadata_size_);
+  }
+
+  enum {
+    kOldImage,
+    kOldKernel,
+    kNewImage,
+    kNewKernel,
+    kPayload,
+    kNumPaths
+  };
+
+  SyntheticPayloadSpec spec_;
+  string paths_[kNumPaths];
+  uint64_t metadata_size_;
+};
+
+TEST_F(PayloadSynthesizerTest, ShapeTest) {
+  ASSERT_TRUE(Synthesize(paths_[kPayload]));
+  EXPECT_TRUE(PayloadSigner::VerifySignedPayload(
+      paths_[kPayload], kUnittestPublicKeyPath,
+      kSignatureMessageCurrentVersion));
+
+  vector<char> payload;
+  DeltaArchiveManifest manifest;
+  uint64_t metadata_size = 0;
+  ASSERT_TRUE(PayloadSigner::LoadPayload(paths_[kPayload], &payload,
+                                         &manifest, &metadata_size));
+  EXPECT_EQ(metadata_size_, metadata_size);
+  EXPECT_EQ(spec_.rootfs_operations, manifest.install_operations_size());
+  // And the signature operation.
+  EXPECT_EQ(spec_.kernel_operations + 1,
+            manifest.kernel_install_operations_size());
+  EXPECT_EQ(spec_.rootfs_blocks * 4096, manifest.new_rootfs_info().size());
+  EXPECT_EQ(spec_.kernel_blocks * 4096, manifest.new_kernel_info().size());
+
+  map<DeltaArchiveManifest_InstallOperation_Type, int> types;
+  for (int i = 0; i < manifest.install_operations_size(); i++) {
+    const DeltaArchiveManifest_InstallOperation& op =
+        manifest.install_operations(i);
+    types[op.type()]++;
+    EXPECT_LE(op.dst_extents_size(), spec_.max_extents);
+  }
+  EXPECT_EQ(spec_.type_weights.size(), types.size());
+
+  // Every block but the superblock is written once.
+  map<uint64_t, int> writes;
+  const uint32_t depth = ChainDepth(manifest.install_operations(), &writes);
+  EXPECT_GT(depth, 1);
+  EXPECT_LE(depth, spec_.dag_depth);
+  EXPECT_EQ(spec_.rootfs_blocks - 1, writes.size());
+  EXPECT_EQ(0, writes.count(0));
+  for (map<uint64_t, int>::const_iterator it = writes.begin();
+       it != writes.end(); ++it) {
+    EXPECT_EQ(1, it->second);
+  }
+}
+
+TEST_F(PayloadSynthesizerTest, NoChainsTest) {
+  spec_.dag_depth = 1;
+  ASSERT_TRUE(Synthesize(paths_[kPayload]));
+  vector<char> payload;
+  DeltaArchiveManifest manifest;
+  uint64_t metadata_size = 0;
+  ASSERT_TRUE(PayloadSigner::LoadPayload(paths_[kPayload], &payload,
+                                         &manifest, &metadata_size));
+  map<uint64_t, int> writes;
+  EXPECT_EQ(1, ChainDepth(manifest.install_operations(), &writes));
+  EXPECT_EQ(1, ChainDepth(manifest.kernel_install_operations(), &writes));
+}
+
+TEST_F(PayloadSynthesizerTest, DeterministicTest) {
+  string other_payload;
+  ASSERT_TRUE(utils::MakeTempFile("/tmp/PayloadSynthesizerTest.XXXXXX",
+                                  &other_payload, NULL));
+  ScopedPathUnlinker other_payload_unlinker(other_payload);
+  ASSERT_TRUE(Synthesize(paths_[kPayload]));
+  ASSERT_TRUE(Synthesize(other_payload));
+  vector<char> payload, other;
+  ASSERT_TRUE(utils::ReadFile(paths_[kPayload], &payload));
+  ASSERT_TRUE(utils::ReadFile(other_payload, &other));
+  EXPECT_TRUE(payload == other);
+
+  spec_.seed++;
+  ASSERT_TRUE(Synthesize(other_payload));
+  ASSERT_TRUE(utils::ReadFile(other_payload, &other));
+  EXPECT_FALSE(payload == other);
+}
+
+TEST_F(PayloadSynthesizerTest, ApplyTest) {
+  ASSERT_TRUE(Synthesize(paths_[kPayload]));
+
+  // Update copies of the old partitions in place.
+  string target_image, target_kernel;
+  ASSERT_TRUE(utils::MakeTempFile("/tmp/PayloadSynthesizerTest.XXXXXX",
+                                  &target_image, NULL));
+  ScopedPathUnlinker target_image_unlinker(target_image);
+  ASSERT_TRUE(utils::MakeTempFile("/tmp/PayloadSynthesizerTest.XXXXXX",
+                                  &target_kernel, NULL));
+  ScopedPathUnlinker target_kernel_unlinker(target_kernel);
+  vector<char> data;
+  ASSERT_TRUE(utils::ReadFile(paths_[kOldImage], &data));
+  ASSERT_TRUE(WriteFileVector(target_image, data));
+  ASSERT_TRUE(utils::ReadFile(paths_[kOldKernel], &data));
+  ASSERT_TRUE(WriteFileVector(target_kernel, data));
+
+  string prefs_dir;
+  ASSERT_TRUE(utils::MakeTempDirectory("/tmp/ue_ut_prefs.XXXXXX",
+                                       &prefs_dir));
+  ScopedDirRemover prefs_dir_remover(prefs_dir);
+  Prefs prefs;
+  ASSERT_TRUE(prefs.Init(FilePath(prefs_dir)));
+  InstallPlan install_plan;
+  PartitionInfo info;
+  ASSERT_TRUE(DeltaDiffGenerator::InitializePartitionInfo(
+      false, paths_[kOldImage], &info));
+  install_plan.rootfs_hash.assign(info.hash().begin(), info.hash().end());
+  ASSERT_TRUE(DeltaDiffGenerator::InitializePartitionInfo(
+      true, paths_[kOldKernel], &info));
+  install_plan.kernel_hash.assign(info.hash().begin(), info.hash().end());
+
+  DeltaPerformer performer(&prefs, NULL, &install_plan);
+  performer.set_public_key_path(kUnittestPublicKeyPath);
+  ASSERT_EQ(0, performer.Open(target_image.c_str(), 0, 0));
+  ASSERT_TRUE(performer.OpenKernel(target_kernel.c_str()));
+  vector<char> payload;
+  ASSERT_TRUE(utils::ReadFile(paths_[kPayload], &payload));
+  ActionExitCode error = kActionCodeSuccess;
+  EXPECT_TRUE(performer.Write(&payload[0], payload.size(), &error));
+  EXPECT_EQ(kActionCodeSuccess, error);
+  ASSERT_EQ(0, performer.Close());
+
+  vector<char> expected;
+  ASSERT_TRUE(utils::ReadFile(paths_[kNewImage], &expected));
+  ASSERT_TRUE(utils::ReadFile(target_image, &data));
+  EXPECT_TRUE(expected == data);
+  ASSERT_TRUE(utils::ReadFile(paths_[kNewKernel], &expected));
+  ASSERT_TRUE(utils::ReadFile(target_kernel, &data));
+  EXPECT_TRUE(expected == data);
+}
+
+}  // namespace chromeos_update_engine
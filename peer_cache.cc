@@ -0,0 +1,260 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/peer_cache.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+#include <base/string_number_conversions.h>
+#include <base/string_util.h>
+
+#include "update_engine/omaha_hash_calculator.h"
+#include "update_engine/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+const char kPartialSuffix[] = ".partial";
+
+// The size of a SHA-256 hash.
+const size_t kHashSize = 32;
+}  // namespace {}
+
+PeerCache::PeerCache(const string& dir)
+    : dir_(dir), fd_(-1), size_(0) {}
+
+PeerCache::~PeerCache() {
+  if (copying())
+    EndPayload(false);
+}
+
+string PeerCache::PayloadName(const string& payload_hash) {
+  vector<char> hash;
+  if (!OmahaHashCalculator::Base64Decode(payload_hash, &hash) ||
+      hash.size() != kHashSize)
+    return "";
+  return base::HexEncode(&hash[0], hash.size());
+}
+
+string PeerCache::PayloadPath(const string& name) const {
+  return dir_ + "/" + name;
+}
+
+string PeerCache::PartialPath(const string& name) const {
+  return dir_ + "/" + name + kPartialSuffix;
+}
+
+void PeerCache::EvictAllBut(const string& name) {
+  DIR* dir = opendir(dir_.c_str());
+  if (!dir)
+    return;
+  struct dirent* entry = NULL;
+  while ((entry = readdir(dir)) != NULL) {
+    const string entry_name = entry->d_name;
+    if (entry_name == "." || entry_name == ".." || entry_name == name ||
+        entry_name == name + kPartialSuffix)
+      continue;
+    // Another instance of the host may be copying a payload of its own.
+    const string path = PayloadPath(entry_name);
+    int fd = open(path.c_str(), O_RDONLY | O_LARGEFILE);
+    if (fd >= 0) {
+      const bool locked = utils::IsFileLockedByOther(fd);
+      close(fd);
+      if (locked)
+        continue;
+    }
+    LOG(INFO) << "Evicting " << entry_name << " from the peer cache.";
+    PLOG_IF(WARNING, unlink(path.c_str()) != 0)
+        << "Unable to remove " << entry_name << " from the peer cache";
+  }
+  closedir(dir);
+}
+
+bool PeerCache::BeginPayload(const string& payload_hash, off_t offset) {
+  if (copying())
+    EndPayload(false);
+  const string name = PayloadName(payload_hash);
+  TEST_AND_RETURN_FALSE(!name.empty());
+  if (mkdir(dir_.c_str(), 0755) != 0 && errno != EEXIST) {
+    PLOG(WARNING) << "Unable to create the peer cache " << dir_;
+    return false;
+  }
+  EvictAllBut(name);
+  if (utils::FileExists(PayloadPath(name).c_str())) {
+    LOG(INFO) << "The payload is in the peer cache already.";
+    return false;
+  }
+
+  const string partial_path = PartialPath(name);
+  int fd = open(partial_path.c_str(), O_RDWR | O_CREAT | O_LARGEFILE, 0644);
+  if (fd < 0) {
+    PLOG(WARNING) << "Unable to open " << partial_path;
+    return false;
+  }
+  // Only one instance of the host copies a payload at a time. The partial
+  // copy it locked may have been committed or given up since it was opened.
+  struct stat stbuf, path_stbuf;
+  if (HANDLE_EINTR(flock(fd, LOCK_EX | LOCK_NB)) != 0 ||
+      stat(partial_path.c_str(), &path_stbuf) != 0 ||
+      fstat(fd, &stbuf) != 0 || stbuf.st_ino != path_stbuf.st_ino ||
+      stbuf.st_dev != path_stbuf.st_dev) {
+    LOG(INFO) << "Another instance is copying the payload to the cache.";
+    close(fd);
+    return false;
+  }
+  if (stbuf.st_size < offset) {
+    LOG(INFO) << "Not copying the payload to the peer cache, since the "
+              << "download resumes past the end of its copy.";
+    close(fd);
+    unlink(partial_path.c_str());
+    return false;
+  }
+  LOG(INFO) << "Copying the payload from offset " << offset << " to "
+            << partial_path;
+  payload_hash_ = payload_hash;
+  name_ = name;
+  fd_ = fd;
+  size_ = stbuf.st_size;
+  hasher_.reset(size_ == 0 ? new OmahaHashCalculator() : NULL);
+  return true;
+}
+
+void PeerCache::WritePayload(off_t offset, const char* data, size_t length) {
+  if (!copying())
+    return;
+  if (offset > size_) {
+    LOG(WARNING) << "The payload skips from " << size_ << " to " << offset
+                 << ", giving up its copy.";
+    EndPayload(true);
+    return;
+  }
+  if (hasher_.get() && (offset != size_ || !hasher_->Update(data, length)))
+    hasher_.reset();
+  if (!utils::PWriteAll(fd_, data, length, offset)) {
+    PLOG(WARNING) << "Unable to copy the payload, giving up its copy.";
+    EndPayload(true);
+    return;
+  }
+  size_ = std::max(size_, static_cast<off_t>(offset + length));
+}
+
+bool PeerCache::CommitPayload() {
+  TEST_AND_RETURN_FALSE(copying());
+  const string name = name_;
+  // The copy stays locked until it's been renamed or removed, so that no
+  // other instance starts copying the payload again in the meantime.
+  const bool committed = VerifyAndRenameCopy();
+  EndPayload(!committed);
+  if (committed)
+    LOG(INFO) << "Payload " << name << " is now in the peer cache.";
+  return committed;
+}
+
+bool PeerCache::VerifyAndRenameCopy() {
+  // A copy resumed from an earlier download may be left over from before a
+  // crash, which doesn't guarantee its contents, so it's read back as a
+  // whole.
+  const string partial_path = PartialPath(name_);
+  string hash_string;
+  if (hasher_.get() && hasher_->Finalize()) {
+    hash_string = hasher_->hash();
+  } else {
+    vector<char> hash;
+    TEST_AND_RETURN_FALSE(
+        OmahaHashCalculator::RawHashOfFile(partial_path, -1, &hash) > 0);
+    TEST_AND_RETURN_FALSE(OmahaHashCalculator::Base64Encode(&hash[0],
+                                                            hash.size(),
+                                                            &hash_string));
+  }
+  if (hash_string != payload_hash_) {
+    LOG(ERROR) << "The copy of the payload doesn't match its hash.";
+    return false;
+  }
+  TEST_AND_RETURN_FALSE_ERRNO(
+      rename(partial_path.c_str(), PayloadPath(name_).c_str()) == 0);
+  return true;
+}
+
+void PeerCache::EndPayload(bool discard) {
+  if (!copying())
+    return;
+  PLOG_IF(WARNING, close(fd_) != 0) << "Unable to close the payload copy";
+  fd_ = -1;
+  if (discard)
+    unlink(PartialPath(name_).c_str());
+  payload_hash_.clear();
+  name_.clear();
+  size_ = 0;
+  hasher_.reset();
+}
+
+bool PeerCache::HasPayload(const string& payload_hash) const {
+  const string name = PayloadName(payload_hash);
+  return !name.empty() && utils::FileExists(PayloadPath(name).c_str());
+}
+
+off_t PeerCache::PartialSize(const string& payload_hash) const {
+  const string name = PayloadName(payload_hash);
+  struct stat stbuf;
+  if (name.empty() || stat(PartialPath(name).c_str(), &stbuf) != 0)
+    return 0;
+  return stbuf.st_size;
+}
+
+bool PeerCache::OpenPartialPayload(const string& payload_hash,
+                                   int* fd) const {
+  const string name = PayloadName(payload_hash);
+  if (name.empty())
+    return false;
+  const string partial_path = PartialPath(name);
+  int partial_fd = open(partial_path.c_str(), O_RDONLY | O_LARGEFILE);
+  if (partial_fd < 0)
+    return false;
+  if (!utils::IsFileLockedByOther(partial_fd)) {
+    close(partial_fd);
+    return false;
+  }
+  *fd = partial_fd;
+  return true;
+}
+
+bool PeerCache::OpenPayload(const string& name, int* fd, off_t* size) const {
+  // Only names made by PayloadName() are looked up, so no other file can be
+  // opened.
+  if (name.size() != 2 * kHashSize)
+    return false;
+  for (size_t i = 0; i < name.size(); i++) {
+    if (!IsHexDigit(name[i]) || (name[i] >= 'a' && name[i] <= 'f'))
+      return false;
+  }
+  const string path = PayloadPath(name);
+  int payload_fd = open(path.c_str(), O_RDONLY | O_LARGEFILE);
+  if (payload_fd < 0)
+    return false;
+  struct stat stbuf;
+  if (fstat(payload_fd, &stbuf) != 0) {
+    PLOG(WARNING) << "Unable to stat " << path;
+    close(payload_fd);
+    return false;
+  }
+  *fd = payload_fd;
+  *size = stbuf.st_size;
+  return true;
+}
+
+}  // namespace chromeos_update_engine
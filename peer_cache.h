@@ -0,0 +1,124 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_PEER_CACHE_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_PEER_CACHE_H__
+
+#include <sys/types.h>
+
+#include <string>
+
+#include <base/basictypes.h>
+#include <base/memory/scoped_ptr.h>
+
+#include "update_engine/omaha_hash_calculator.h"
+
+// Keeps a copy of the last payload downloaded, for the PeerServer to hand
+// out to the other machines of the network. The payload is copied as it's
+// downloaded, into a partial file that survives interrupted downloads, and
+// only made available once the download and the copy itself have been
+// verified against the payload hash of the Omaha response. Payloads are
+// named by the hex SHA-256 hash, so the peers ask for the one their own
+// response describes, and they verify what they get anyway.
+//
+// The cache directory may be shared by the update_engine instances of a
+// host, e.g. of its VMs or containers. The instance copying a payload holds
+// an exclusive flock() lock on its partial copy, so that no other one
+// copies it too, and the others can read the copy as it grows instead of
+// downloading the payload themselves.
+
+namespace chromeos_update_engine {
+
+class PeerCache {
+ public:
+  explicit PeerCache(const std::string& dir);
+
+  // Closes the payload being copied, keeping what's been copied for the
+  // download to resume.
+  ~PeerCache();
+
+  // Returns the name the payload whose base64 SHA-256 hash is
+  // |payload_hash| is cached under, or an empty string if the hash is
+  // malformed.
+  static std::string PayloadName(const std::string& payload_hash);
+
+  // Starts copying the payload whose hash is |payload_hash|, whose download
+  // starts at |offset|. Other payloads are evicted, unless another instance
+  // is copying them. Returns false if the payload isn't copied: it's cached
+  // already, another instance is copying it, or the copy from an earlier
+  // download doesn't reach |offset|.
+  bool BeginPayload(const std::string& payload_hash, off_t offset);
+
+  // Copies the |length| bytes at |data| to |offset| of the payload. The copy
+  // is given up, which isn't an error for the download, if it can't be
+  // written or leaves a gap.
+  void WritePayload(off_t offset, const char* data, size_t length);
+
+  // Makes the payload available once the download has been verified, if its
+  // copy matches the hash. Returns true on success.
+  bool CommitPayload();
+
+  // Stops copying the payload. The copy is kept for the download to resume
+  // unless |discard|.
+  void EndPayload(bool discard);
+
+  // Returns true while a payload is being copied.
+  bool copying() const { return fd_ >= 0; }
+
+  // Makes the cache use |dir|, e.g. one shared by the instances of the
+  // host. Must not be called while a payload is being copied.
+  void set_dir(const std::string& dir) { dir_ = dir; }
+
+  // Returns true if the payload whose hash is |payload_hash| is cached.
+  bool HasPayload(const std::string& payload_hash) const;
+
+  // Returns how many bytes from its start the partial copy of the payload
+  // whose hash is |payload_hash| holds, or 0 if there's none. A download
+  // that only fills the cache resumes from there.
+  off_t PartialSize(const std::string& payload_hash) const;
+
+  // If another instance of the host is copying the payload whose hash is
+  // |payload_hash|, opens its partial copy, which grows until that instance
+  // commits or gives up the copy, sets |fd| to the file descriptor, which
+  // the caller closes, and returns true. Returns false otherwise.
+  bool OpenPartialPayload(const std::string& payload_hash, int* fd) const;
+
+  // Opens the payload that's cached under |name| and sets |fd| to the file
+  // descriptor, which the caller closes, and |size| to its size. Returns
+  // false if there's no such payload.
+  bool OpenPayload(const std::string& name, int* fd, off_t* size) const;
+
+ private:
+  // Returns the paths of the payload named |name| and of its partial copy.
+  std::string PayloadPath(const std::string& name) const;
+  std::string PartialPath(const std::string& name) const;
+
+  // Checks the copy of the payload against its hash and, if it matches,
+  // renames it to the name of the payload. Returns true on success.
+  bool VerifyAndRenameCopy();
+
+  // Removes the files of the cache that aren't the payload named |name| or
+  // its partial copy, unless another instance is copying them.
+  void EvictAllBut(const std::string& name);
+
+  std::string dir_;
+
+  // The payload being copied, the file descriptor of its partial copy, or
+  // -1, and how many bytes from the start it holds.
+  std::string payload_hash_;
+  std::string name_;
+  int fd_;
+  off_t size_;
+
+  // The hash of the copy while it's been written in order from its start
+  // since BeginPayload(), or NULL, in which case the copy is hashed from
+  // disk when it's committed.
+  scoped_ptr<OmahaHashCalculator> hasher_;
+
+  DISALLOW_COPY_AND_ASSIGN(PeerCache);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_PEER_CACHE_H__
@@ -0,0 +1,205 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <unistd.h>
+
+#include <string>
+
+#include <base/string_util.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/omaha_hash_calculator.h"
+#include "update_engine/peer_cache.h"
+#include "update_engine/utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+class PeerCacheTest : public ::testing::Test {
+ protected:
+  PeerCacheTest()
+      : payload_("The payload for the peers, in a few pieces."),
+        payload_hash_(OmahaHashCalculator::OmahaHashOfString(payload_)) {}
+
+  virtual void SetUp() {
+    ASSERT_TRUE(utils::MakeTempDirectory("/tmp/PeerCacheTest.XXXXXX",
+                                         &test_dir_));
+    cache_dir_ = test_dir_ + "/cache";
+    cache_.reset(new PeerCache(cache_dir_));
+  }
+
+  virtual void TearDown() {
+    cache_.reset();
+    EXPECT_TRUE(utils::RecursiveUnlinkDir(test_dir_));
+  }
+
+  // Copies the payload from |from| to |to|.
+  void WritePayload(size_t from, size_t to) {
+    cache_->WritePayload(from, payload_.data() + from, to - from);
+  }
+
+  // Returns true if the payload is in the cache, with the right contents.
+  bool IsCached() {
+    int fd = -1;
+    off_t size = 0;
+    if (!cache_->OpenPayload(PeerCache::PayloadName(payload_hash_),
+                             &fd, &size))
+      return false;
+    string contents(size, '\0');
+    const bool read = pread(fd, &contents[0], size, 0) == size;
+    close(fd);
+    return read && contents == payload_;
+  }
+
+  const string payload_;
+  const string payload_hash_;
+  string test_dir_;
+  string cache_dir_;
+  scoped_ptr<PeerCache> cache_;
+};
+
+TEST_F(PeerCacheTest, PayloadNameTest) {
+  const string name = PeerCache::PayloadName(payload_hash_);
+  EXPECT_EQ(64U, name.size());
+  EXPECT_EQ(StringToUpperASCII(name), name);
+  EXPECT_EQ("", PeerCache::PayloadName(""));
+  EXPECT_EQ("", PeerCache::PayloadName("bm90IGEgaGFzaA=="));
+}
+
+TEST_F(PeerCacheTest, CopyTest) {
+  EXPECT_FALSE(IsCached());
+  ASSERT_TRUE(cache_->BeginPayload(payload_hash_, 0));
+  EXPECT_TRUE(cache_->copying());
+  WritePayload(0, 10);
+  WritePayload(10, payload_.size());
+  EXPECT_FALSE(IsCached());
+  EXPECT_TRUE(cache_->CommitPayload());
+  EXPECT_FALSE(cache_->copying());
+  EXPECT_TRUE(IsCached());
+
+  // A payload that's cached isn't copied again.
+  EXPECT_FALSE(cache_->BeginPayload(payload_hash_, 0));
+  EXPECT_TRUE(IsCached());
+}
+
+TEST_F(PeerCacheTest, ResumeTest) {
+  ASSERT_TRUE(cache_->BeginPayload(payload_hash_, 0));
+  WritePayload(0, 10);
+  cache_->EndPayload(false);
+
+  // The download resumes past the copy, which is given up.
+  EXPECT_FALSE(cache_->BeginPayload(payload_hash_, 20));
+
+  ASSERT_TRUE(cache_->BeginPayload(payload_hash_, 0));
+  WritePayload(0, 10);
+  cache_.reset(new PeerCache(cache_dir_));
+
+  // The copy is read back to be verified.
+  ASSERT_TRUE(cache_->BeginPayload(payload_hash_, 5));
+  WritePayload(5, payload_.size());
+  EXPECT_TRUE(cache_->CommitPayload());
+  EXPECT_TRUE(IsCached());
+}
+
+TEST_F(PeerCacheTest, PartialSizeTest) {
+  EXPECT_EQ(0, cache_->PartialSize(payload_hash_));
+  EXPECT_FALSE(cache_->HasPayload(payload_hash_));
+  ASSERT_TRUE(cache_->BeginPayload(payload_hash_, 0));
+  WritePayload(0, 10);
+  cache_->EndPayload(false);
+  EXPECT_EQ(10, cache_->PartialSize(payload_hash_));
+  EXPECT_FALSE(cache_->HasPayload(payload_hash_));
+
+  ASSERT_TRUE(cache_->BeginPayload(payload_hash_, 10));
+  WritePayload(10, payload_.size());
+  EXPECT_TRUE(cache_->CommitPayload());
+  EXPECT_EQ(0, cache_->PartialSize(payload_hash_));
+  EXPECT_TRUE(cache_->HasPayload(payload_hash_));
+  EXPECT_FALSE(cache_->HasPayload(""));
+}
+
+TEST_F(PeerCacheTest, GapTest) {
+  ASSERT_TRUE(cache_->BeginPayload(payload_hash_, 0));
+  WritePayload(0, 10);
+  WritePayload(20, payload_.size());
+  EXPECT_FALSE(cache_->copying());
+  EXPECT_FALSE(cache_->CommitPayload());
+  EXPECT_FALSE(IsCached());
+}
+
+TEST_F(PeerCacheTest, HashMismatchTest) {
+  const string other_hash = OmahaHashCalculator::OmahaHashOfString("other");
+  ASSERT_TRUE(cache_->BeginPayload(other_hash, 0));
+  WritePayload(0, payload_.size());
+  EXPECT_FALSE(cache_->CommitPayload());
+  int fd = -1;
+  off_t size = 0;
+  EXPECT_FALSE(cache_->OpenPayload(PeerCache::PayloadName(other_hash),
+                                   &fd, &size));
+  // Nothing is left behind.
+  EXPECT_TRUE(cache_->BeginPayload(other_hash, 0));
+}
+
+TEST_F(PeerCacheTest, EvictTest) {
+  ASSERT_TRUE(cache_->BeginPayload(payload_hash_, 0));
+  WritePayload(0, payload_.size());
+  ASSERT_TRUE(cache_->CommitPayload());
+  ASSERT_TRUE(IsCached());
+
+  const string other_hash = OmahaHashCalculator::OmahaHashOfString("other");
+  EXPECT_TRUE(cache_->BeginPayload(other_hash, 0));
+  EXPECT_FALSE(IsCached());
+}
+
+TEST_F(PeerCacheTest, OpenPayloadNameTest) {
+  ASSERT_TRUE(cache_->BeginPayload(payload_hash_, 0));
+  WritePayload(0, payload_.size());
+  ASSERT_TRUE(cache_->CommitPayload());
+  const string name = PeerCache::PayloadName(payload_hash_);
+  int fd = -1;
+  off_t size = 0;
+  EXPECT_FALSE(cache_->OpenPayload(StringToLowerASCII(name), &fd, &size));
+  EXPECT_FALSE(cache_->OpenPayload("../cache/" + name, &fd, &size));
+  EXPECT_FALSE(cache_->OpenPayload(name + ".partial", &fd, &size));
+  EXPECT_FALSE(cache_->OpenPayload("", &fd, &size));
+  EXPECT_TRUE(cache_->OpenPayload(name, &fd, &size));
+  EXPECT_EQ(static_cast<off_t>(payload_.size()), size);
+  close(fd);
+}
+
+TEST_F(PeerCacheTest, SharedCacheTest) {
+  // Another instance of the host, sharing the cache directory.
+  PeerCache other(cache_dir_);
+  int fd = -1;
+  EXPECT_FALSE(other.OpenPartialPayload(payload_hash_, &fd));
+  ASSERT_TRUE(cache_->BeginPayload(payload_hash_, 0));
+  WritePayload(0, 10);
+
+  // Only one instance copies the payload, and the others can follow it.
+  EXPECT_FALSE(other.BeginPayload(payload_hash_, 0));
+  EXPECT_FALSE(other.copying());
+  ASSERT_TRUE(other.OpenPartialPayload(payload_hash_, &fd));
+  WritePayload(10, payload_.size());
+  EXPECT_TRUE(cache_->CommitPayload());
+  string contents(payload_.size(), '\0');
+  EXPECT_EQ(static_cast<ssize_t>(payload_.size()),
+            pread(fd, &contents[0], contents.size(), 0));
+  EXPECT_EQ(payload_, contents);
+  close(fd);
+  EXPECT_FALSE(other.OpenPartialPayload(payload_hash_, &fd));
+  EXPECT_TRUE(other.HasPayload(payload_hash_));
+
+  // An instance copying another payload doesn't evict the one being copied.
+  const string other_hash = OmahaHashCalculator::OmahaHashOfString("other");
+  ASSERT_TRUE(other.BeginPayload(other_hash, 0));
+  const string third_hash = OmahaHashCalculator::OmahaHashOfString("third");
+  EXPECT_TRUE(cache_->BeginPayload(third_hash, 0));
+  EXPECT_FALSE(IsCached());
+  EXPECT_TRUE(utils::FileExists(
+      (cache_dir_ + "/" + PeerCache::PayloadName(other_hash) +
+       ".partial").c_str()));
+}
+
+}  // namespace chromeos_update_engine
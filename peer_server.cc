@@ -0,0 +1,356 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/peer_server.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+#include <base/string_number_conversions.h>
+#include <base/string_split.h>
+#include <base/string_util.h>
+#include <base/stringprintf.h>
+
+#include "update_engine/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+const size_t PeerServer::kMaxConnections = 8;
+const int PeerServer::kDefaultPort = 7300;
+
+namespace {
+const char kPayloadPathPrefix[] = "/payload/";
+
+// Requests are a line and a few headers; anything longer isn't from a peer.
+const size_t kMaxRequestSize = 8192;
+
+// The most bytes of a payload sent by a call to sendfile(), so that a fast
+// peer doesn't hold up the main loop.
+const size_t kMaxSendSize = 1024 * 1024;  // 1 MiB
+
+// Parses the "bytes=<first>-<last>" |spec| of a Range header into the range
+// [|start|, |end|) of a payload of |size| bytes. Returns false if it isn't a
+// single satisfiable range.
+bool ParseRange(const string& spec, off_t size, off_t* start, off_t* end) {
+  if (!StartsWithASCII(spec, "bytes=", false))
+    return false;
+  const string range = spec.substr(strlen("bytes="));
+  const size_t dash = range.find('-');
+  if (dash == string::npos || range.find(',') != string::npos)
+    return false;
+  const string first = range.substr(0, dash);
+  const string last = range.substr(dash + 1);
+  int64_t first_value = 0, last_value = 0;
+  if (first.empty()) {
+    // The last |last| bytes.
+    if (!base::StringToInt64(last, &last_value) || last_value <= 0)
+      return false;
+    *start = std::max(static_cast<off_t>(0), size - last_value);
+    *end = size;
+    return size > 0;
+  }
+  if (!base::StringToInt64(first, &first_value) || first_value < 0 ||
+      first_value >= size)
+    return false;
+  *start = first_value;
+  *end = size;
+  if (!last.empty()) {
+    if (!base::StringToInt64(last, &last_value) || last_value < first_value)
+      return false;
+    *end = std::min(size, static_cast<off_t>(last_value + 1));
+  }
+  return true;
+}
+}  // namespace {}
+
+PeerServer::PeerServer(PeerCache* cache)
+    : cache_(cache),
+      listen_fd_(-1),
+      listen_channel_(NULL),
+      listen_watch_id_(0),
+      port_(0) {}
+
+PeerServer::~PeerServer() {
+  while (!connections_.empty())
+    CloseConnection(connections_.back(), false);
+  if (listen_watch_id_)
+    g_source_remove(listen_watch_id_);
+  if (listen_channel_)
+    g_io_channel_unref(listen_channel_);
+  if (listen_fd_ >= 0)
+    close(listen_fd_);
+}
+
+string PeerServer::PayloadPath(const string& name) {
+  return kPayloadPathPrefix + name;
+}
+
+bool PeerServer::Start(int port) {
+  CHECK_LT(listen_fd_, 0) << "The peer server is started already.";
+  int fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd >= 0) {
+    // Takes the IPv4 peers too.
+    int v6only = 0;
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+    struct sockaddr_in6 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons(port);
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (bind(fd, reinterpret_cast<struct sockaddr*>(&addr),
+             sizeof(addr)) != 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  if (fd < 0) {
+    LOG(INFO) << "IPv6 is unavailable, serving the peers over IPv4 only.";
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (bind(fd, reinterpret_cast<struct sockaddr*>(&addr),
+             sizeof(addr)) != 0) {
+      PLOG(ERROR) << "Unable to bind the peer server to port " << port;
+      close(fd);
+      return false;
+    }
+  }
+  ScopedFdCloser fd_closer(&fd);
+  TEST_AND_RETURN_FALSE_ERRNO(listen(fd, SOMAXCONN) == 0);
+
+  struct sockaddr_storage bound_addr;
+  socklen_t bound_addr_size = sizeof(bound_addr);
+  TEST_AND_RETURN_FALSE_ERRNO(
+      getsockname(fd, reinterpret_cast<struct sockaddr*>(&bound_addr),
+                  &bound_addr_size) == 0);
+  if (bound_addr.ss_family == AF_INET6) {
+    port_ = ntohs(
+        reinterpret_cast<struct sockaddr_in6*>(&bound_addr)->sin6_port);
+  } else {
+    port_ = ntohs(
+        reinterpret_cast<struct sockaddr_in*>(&bound_addr)->sin_port);
+  }
+
+  fd_closer.set_should_close(false);
+  listen_fd_ = fd;
+  listen_channel_ = g_io_channel_unix_new(listen_fd_);
+  listen_watch_id_ = g_io_add_watch(listen_channel_, G_IO_IN,
+                                    &PeerServer::StaticOnAccept, this);
+  LOG(INFO) << "Serving the peer cache on port " << port_;
+  return true;
+}
+
+gboolean PeerServer::StaticOnAccept(GIOChannel* source,
+                                    GIOCondition condition,
+                                    gpointer data) {
+  reinterpret_cast<PeerServer*>(data)->OnAccept();
+  return TRUE;
+}
+
+void PeerServer::OnAccept() {
+  while (true) {
+    int fd = accept4(listen_fd_, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        PLOG(WARNING) << "Unable to accept a peer connection";
+      return;
+    }
+    if (connections_.size() >= kMaxConnections) {
+      LOG(INFO) << "Too many peer connections, closing a new one.";
+      close(fd);
+      continue;
+    }
+    Connection* connection = new Connection;
+    connection->server = this;
+    connection->fd = fd;
+    connection->channel = g_io_channel_unix_new(fd);
+    connection->header_sent = 0;
+    connection->file_fd = -1;
+    connection->offset = 0;
+    connection->end = 0;
+    connection->watch_id = g_io_add_watch(
+        connection->channel,
+        static_cast<GIOCondition>(G_IO_IN | G_IO_HUP | G_IO_ERR),
+        &PeerServer::StaticOnReadable,
+        connection);
+    connections_.push_back(connection);
+  }
+}
+
+gboolean PeerServer::StaticOnReadable(GIOChannel* source,
+                                      GIOCondition condition,
+                                      gpointer data) {
+  Connection* connection = reinterpret_cast<Connection*>(data);
+  return connection->server->OnReadable(connection) ? TRUE : FALSE;
+}
+
+gboolean PeerServer::StaticOnWritable(GIOChannel* source,
+                                      GIOCondition condition,
+                                      gpointer data) {
+  Connection* connection = reinterpret_cast<Connection*>(data);
+  return connection->server->OnWritable(connection) ? TRUE : FALSE;
+}
+
+bool PeerServer::OnReadable(Connection* connection) {
+  char buffer[1024];
+  ssize_t size = recv(connection->fd, buffer, sizeof(buffer), 0);
+  if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return true;
+  if (size <= 0) {
+    CloseConnection(connection, true);
+    return false;
+  }
+  connection->request.append(buffer, size);
+  if (connection->request.find("\r\n\r\n") == string::npos) {
+    if (connection->request.size() <= kMaxRequestSize)
+      return true;
+    SetErrorResponse(connection, "400 Bad Request");
+  } else {
+    HandleRequest(connection);
+  }
+  // Nothing more is read; the watch returning FALSE is replaced by one for
+  // sending the response.
+  connection->watch_id = g_io_add_watch(
+      connection->channel,
+      static_cast<GIOCondition>(G_IO_OUT | G_IO_HUP | G_IO_ERR),
+      &PeerServer::StaticOnWritable,
+      connection);
+  return false;
+}
+
+void PeerServer::HandleRequest(Connection* connection) {
+  vector<string> lines;
+  base::SplitStringUsingSubstr(connection->request, "\r\n", &lines);
+  vector<string> request_line;
+  base::SplitString(lines[0], ' ', &request_line);
+  if (request_line.size() != 3 ||
+      !StartsWithASCII(request_line[2], "HTTP/", true)) {
+    SetErrorResponse(connection, "400 Bad Request");
+    return;
+  }
+  const string& method = request_line[0];
+  const string& path = request_line[1];
+  if (method != "GET" && method != "HEAD") {
+    SetErrorResponse(connection, "405 Method Not Allowed");
+    return;
+  }
+  off_t size = 0;
+  if (!StartsWithASCII(path, kPayloadPathPrefix, true) ||
+      !cache_->OpenPayload(path.substr(strlen(kPayloadPathPrefix)),
+                           &connection->file_fd,
+                           &size)) {
+    LOG(INFO) << "Peer asked for " << path << ", which isn't cached.";
+    SetErrorResponse(connection, "404 Not Found");
+    return;
+  }
+
+  off_t start = 0, end = size;
+  bool partial = false;
+  for (size_t i = 1; i < lines.size(); i++) {
+    if (!StartsWithASCII(lines[i], "range:", false))
+      continue;
+    string spec;
+    TrimWhitespaceASCII(lines[i].substr(strlen("range:")), TRIM_ALL, &spec);
+    if (!ParseRange(spec, size, &start, &end)) {
+      SetErrorResponse(connection, "416 Requested Range Not Satisfiable");
+      return;
+    }
+    partial = true;
+  }
+  LOG(INFO) << "Serving bytes " << start << "-" << end << " of " << path
+            << " to a peer.";
+  connection->header = StringPrintf(
+      "HTTP/1.1 %s\r\n"
+      "Content-Type: application/octet-stream\r\n"
+      "Content-Length: %jd\r\n"
+      "Accept-Ranges: bytes\r\n"
+      "Connection: close\r\n",
+      partial ? "206 Partial Content" : "200 OK",
+      static_cast<intmax_t>(end - start));
+  if (partial) {
+    connection->header += StringPrintf("Content-Range: bytes %jd-%jd/%jd\r\n",
+                                       static_cast<intmax_t>(start),
+                                       static_cast<intmax_t>(end - 1),
+                                       static_cast<intmax_t>(size));
+  }
+  connection->header += "\r\n";
+  connection->offset = start;
+  connection->end = method == "HEAD" ? start : end;
+}
+
+void PeerServer::SetErrorResponse(Connection* connection,
+                                  const string& status) {
+  if (connection->file_fd >= 0) {
+    close(connection->file_fd);
+    connection->file_fd = -1;
+  }
+  connection->header = "HTTP/1.1 " + status + "\r\n"
+      "Content-Length: 0\r\n"
+      "Connection: close\r\n"
+      "\r\n";
+}
+
+bool PeerServer::OnWritable(Connection* connection) {
+  while (connection->header_sent < connection->header.size()) {
+    ssize_t sent = send(connection->fd,
+                        connection->header.data() + connection->header_sent,
+                        connection->header.size() - connection->header_sent,
+                        MSG_NOSIGNAL);
+    if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                     errno == EINTR))
+      return true;
+    if (sent <= 0) {
+      CloseConnection(connection, true);
+      return false;
+    }
+    connection->header_sent += sent;
+  }
+  if (connection->file_fd >= 0 && connection->offset < connection->end) {
+    const size_t count = std::min(
+        static_cast<off_t>(kMaxSendSize),
+        connection->end - connection->offset);
+    ssize_t sent = sendfile(connection->fd, connection->file_fd,
+                            &connection->offset, count);
+    if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                     errno == EINTR))
+      return true;
+    if (sent > 0 && connection->offset < connection->end)
+      return true;
+    PLOG_IF(WARNING, sent < 0) << "Unable to send the payload to a peer";
+  }
+  CloseConnection(connection, true);
+  return false;
+}
+
+void PeerServer::CloseConnection(Connection* connection, bool in_watch) {
+  if (!in_watch)
+    g_source_remove(connection->watch_id);
+  g_io_channel_unref(connection->channel);
+  close(connection->fd);
+  if (connection->file_fd >= 0)
+    close(connection->file_fd);
+  connections_.erase(std::find(connections_.begin(), connections_.end(),
+                               connection));
+  delete connection;
+}
+
+}  // namespace chromeos_update_engine
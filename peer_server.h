@@ -0,0 +1,113 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_PEER_SERVER_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_PEER_SERVER_H__
+
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+#include <base/basictypes.h>
+#include <glib.h>
+
+#include "update_engine/peer_cache.h"
+
+// Serves the payloads of a PeerCache over HTTP, so that the other machines
+// of the network download them from this one rather than from the update
+// server. Only GET and HEAD requests for /payload/<name> are answered, with
+// a single byte range at most, and every connection is closed once its
+// response has been sent. The sockets are non-blocking and watched from the
+// glib main loop, and the payload is sent with sendfile(2), so serving takes
+// little of the process.
+
+namespace chromeos_update_engine {
+
+class PeerServer {
+ public:
+  // The most connections being served at once. Others are closed right away,
+  // which makes the peers fall back to the update server.
+  static const size_t kMaxConnections;
+
+  // The port peers are served on unless told otherwise.
+  static const int kDefaultPort;
+
+  // Serves the payloads of |cache|, which must outlive the server.
+  explicit PeerServer(PeerCache* cache);
+  ~PeerServer();
+
+  // Starts listening on |port| of all the addresses, or any free port if
+  // it's 0. Returns true on success.
+  bool Start(int port);
+
+  // Returns the port listened on, once started.
+  int port() const { return port_; }
+
+  // Returns the path the payload named |name| is served at.
+  static std::string PayloadPath(const std::string& name);
+
+ private:
+  // A connection being served.
+  struct Connection {
+    PeerServer* server;
+    int fd;
+    GIOChannel* channel;
+    guint watch_id;
+    // The request, until it's complete.
+    std::string request;
+    // The response header and how much of it has been sent.
+    std::string header;
+    size_t header_sent;
+    // The payload being sent, or -1, and the range of it left to send.
+    int file_fd;
+    off_t offset;
+    off_t end;
+  };
+
+  static gboolean StaticOnAccept(GIOChannel* source,
+                                 GIOCondition condition,
+                                 gpointer data);
+  void OnAccept();
+
+  static gboolean StaticOnReadable(GIOChannel* source,
+                                   GIOCondition condition,
+                                   gpointer data);
+  static gboolean StaticOnWritable(GIOChannel* source,
+                                   GIOCondition condition,
+                                   gpointer data);
+
+  // Read the request and send the response of |connection|. They return
+  // false once the connection is closed.
+  bool OnReadable(Connection* connection);
+  bool OnWritable(Connection* connection);
+
+  // Sets up the response of |connection| to its complete request.
+  void HandleRequest(Connection* connection);
+
+  // Sets the header of the response of |connection| to an error with
+  // |status|, such as "404 Not Found", and no body.
+  void SetErrorResponse(Connection* connection, const std::string& status);
+
+  // Closes |connection| and frees it. Its watch is removed unless
+  // |in_watch|, for when it's closed by the watch's callback returning
+  // FALSE.
+  void CloseConnection(Connection* connection, bool in_watch);
+
+  PeerCache* cache_;
+
+  // The listening socket, or -1, and its watch.
+  int listen_fd_;
+  GIOChannel* listen_channel_;
+  guint listen_watch_id_;
+  int port_;
+
+  std::vector<Connection*> connections_;
+
+  DISALLOW_COPY_AND_ASSIGN(PeerServer);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_PEER_SERVER_H__
@@ -0,0 +1,153 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <string>
+
+#include <base/string_util.h>
+#include <glib.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/omaha_hash_calculator.h"
+#include "update_engine/peer_cache.h"
+#include "update_engine/peer_server.h"
+#include "update_engine/utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+class PeerServerTest : public ::testing::Test {
+ protected:
+  PeerServerTest()
+      : payload_("0123456789abcdefghijklmnopqrstuvwxyz"),
+        payload_name_(PeerCache::PayloadName(
+            OmahaHashCalculator::OmahaHashOfString(payload_))) {}
+
+  virtual void SetUp() {
+    ASSERT_TRUE(utils::MakeTempDirectory("/tmp/PeerServerTest.XXXXXX",
+                                         &cache_dir_));
+    cache_.reset(new PeerCache(cache_dir_));
+    ASSERT_TRUE(cache_->BeginPayload(
+        OmahaHashCalculator::OmahaHashOfString(payload_), 0));
+    cache_->WritePayload(0, payload_.data(), payload_.size());
+    ASSERT_TRUE(cache_->CommitPayload());
+    server_.reset(new PeerServer(cache_.get()));
+    ASSERT_TRUE(server_->Start(0));
+    EXPECT_GT(server_->port(), 0);
+  }
+
+  virtual void TearDown() {
+    server_.reset();
+    cache_.reset();
+    EXPECT_TRUE(utils::RecursiveUnlinkDir(cache_dir_));
+  }
+
+  // Sends |request| to the server and returns its whole response, running
+  // the main loop meanwhile.
+  string Fetch(const string& request) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    EXPECT_GE(fd, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(server_->port());
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int rc = connect(fd, reinterpret_cast<struct sockaddr*>(&addr),
+                     sizeof(addr));
+    EXPECT_TRUE(rc == 0 || errno == EINPROGRESS);
+
+    size_t sent = 0;
+    string response;
+    for (int i = 0; i < 10000; i++) {
+      g_main_context_iteration(NULL, FALSE);
+      if (sent < request.size()) {
+        ssize_t written = send(fd, request.data() + sent,
+                               request.size() - sent, MSG_NOSIGNAL);
+        if (written > 0)
+          sent += written;
+        continue;
+      }
+      char buf[1024];
+      ssize_t received = recv(fd, buf, sizeof(buf), 0);
+      if (received == 0)
+        break;
+      if (received > 0)
+        response.append(buf, received);
+      else
+        usleep(1000);
+    }
+    close(fd);
+    return response;
+  }
+
+  // Returns the body of |response|.
+  static string Body(const string& response) {
+    size_t end = response.find("\r\n\r\n");
+    return end == string::npos ? "" : response.substr(end + 4);
+  }
+
+  const string payload_;
+  const string payload_name_;
+  string cache_dir_;
+  scoped_ptr<PeerCache> cache_;
+  scoped_ptr<PeerServer> server_;
+};
+
+TEST_F(PeerServerTest, GetTest) {
+  string response = Fetch("GET " + PeerServer::PayloadPath(payload_name_) +
+                          " HTTP/1.1\r\nHost: peer\r\n\r\n");
+  EXPECT_TRUE(StartsWithASCII(response, "HTTP/1.1 200 OK\r\n", true));
+  EXPECT_NE(string::npos, response.find("Content-Length: 36\r\n"));
+  EXPECT_EQ(payload_, Body(response));
+}
+
+TEST_F(PeerServerTest, RangeTest) {
+  string response = Fetch("GET " + PeerServer::PayloadPath(payload_name_) +
+                          " HTTP/1.1\r\nRange: bytes=10-19\r\n\r\n");
+  EXPECT_TRUE(StartsWithASCII(response, "HTTP/1.1 206 ", true));
+  EXPECT_NE(string::npos, response.find("Content-Range: bytes 10-19/36\r\n"));
+  EXPECT_EQ(payload_.substr(10, 10), Body(response));
+
+  response = Fetch("GET " + PeerServer::PayloadPath(payload_name_) +
+                   " HTTP/1.1\r\nRange: bytes=30-\r\n\r\n");
+  EXPECT_EQ(payload_.substr(30), Body(response));
+
+  response = Fetch("GET " + PeerServer::PayloadPath(payload_name_) +
+                   " HTTP/1.1\r\nRange: bytes=-4\r\n\r\n");
+  EXPECT_EQ(payload_.substr(32), Body(response));
+
+  response = Fetch("GET " + PeerServer::PayloadPath(payload_name_) +
+                   " HTTP/1.1\r\nRange: bytes=40-50\r\n\r\n");
+  EXPECT_TRUE(StartsWithASCII(response, "HTTP/1.1 416 ", true));
+}
+
+TEST_F(PeerServerTest, HeadTest) {
+  string response = Fetch("HEAD " + PeerServer::PayloadPath(payload_name_) +
+                          " HTTP/1.1\r\n\r\n");
+  EXPECT_TRUE(StartsWithASCII(response, "HTTP/1.1 200 OK\r\n", true));
+  EXPECT_NE(string::npos, response.find("Content-Length: 36\r\n"));
+  EXPECT_EQ("", Body(response));
+}
+
+TEST_F(PeerServerTest, ErrorTest) {
+  string response = Fetch("GET " + PeerServer::PayloadPath(
+      string(64, 'A')) + " HTTP/1.1\r\n\r\n");
+  EXPECT_TRUE(StartsWithASCII(response, "HTTP/1.1 404 ", true));
+
+  response = Fetch("GET /etc/passwd HTTP/1.1\r\n\r\n");
+  EXPECT_TRUE(StartsWithASCII(response, "HTTP/1.1 404 ", true));
+
+  response = Fetch("POST " + PeerServer::PayloadPath(payload_name_) +
+                   " HTTP/1.1\r\n\r\n");
+  EXPECT_TRUE(StartsWithASCII(response, "HTTP/1.1 405 ", true));
+}
+
+}  // namespace chromeos_update_engine
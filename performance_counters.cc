@@ -0,0 +1,116 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/performance_counters.h"
+
+#include <base/string_number_conversions.h>
+#include <base/stringprintf.h>
+
+#include "update_engine/io_stats.h"
+#include "update_engine/memory_tracker.h"
+#include "update_engine/simple_key_value_store.h"
+#include "update_engine/transfer_stats.h"
+
+using base::TimeDelta;
+using base::TimeTicks;
+using std::map;
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+string Seconds(TimeDelta time) {
+  return StringPrintf("%.3f", time.InSecondsF());
+}
+
+string Rate(uint64_t bytes, TimeDelta time) {
+  const double seconds = time.InSecondsF();
+  return base::Uint64ToString(
+      seconds > 0 ? static_cast<uint64_t>(bytes / seconds) : 0);
+}
+
+}  // namespace {}
+
+void PerformanceCounters::SetStatus(const string& status, TimeTicks now) {
+  if (!status_.empty())
+    status_times_[status_] += now - status_start_time_;
+  status_ = status;
+  status_start_time_ = now;
+}
+
+void PerformanceCounters::AddDownload(uint64_t bytes, TimeDelta time) {
+  download_.bytes += bytes;
+  download_.time += time;
+}
+
+void PerformanceCounters::AddOperationStats(
+    const DeltaPerformer::OperationStatsMap& stats) {
+  for (DeltaPerformer::OperationStatsMap::const_iterator it = stats.begin();
+       it != stats.end(); ++it) {
+    Totals* totals =
+        &operations_[DeltaArchiveManifest_InstallOperation_Type_Name(
+            it->first)];
+    totals->count += it->second.count;
+    totals->bytes += it->second.bytes_written;
+    totals->time += it->second.time;
+    apply_.count += it->second.count;
+    apply_.bytes += it->second.bytes_written;
+    apply_.time += it->second.time;
+  }
+}
+
+void PerformanceCounters::AddHashingTime(TimeDelta time) {
+  hashing_time_ += time;
+}
+
+void PerformanceCounters::AddCheckpoints(int checkpoints) {
+  checkpoints_ += checkpoints;
+}
+
+void PerformanceCounters::AddRetries(int retries) {
+  retries_ += retries;
+}
+
+void PerformanceCounters::AddPause(TimeDelta time) {
+  pauses_++;
+  paused_time_ += time;
+}
+
+string PerformanceCounters::ToString(TimeTicks now) const {
+  map<string, string> counters;
+  counters["download_bytes"] = base::Uint64ToString(download_.bytes);
+  counters["download_seconds"] = Seconds(download_.time);
+  counters["download_bytes_per_second"] =
+      Rate(download_.bytes, download_.time);
+  counters["apply_operations"] = base::Uint64ToString(apply_.count);
+  counters["apply_bytes"] = base::Uint64ToString(apply_.bytes);
+  counters["apply_seconds"] = Seconds(apply_.time);
+  counters["apply_bytes_per_second"] = Rate(apply_.bytes, apply_.time);
+  for (map<string, Totals>::const_iterator it = operations_.begin();
+       it != operations_.end(); ++it) {
+    const string prefix = "operation_" + it->first;
+    counters[prefix + "_count"] = base::Uint64ToString(it->second.count);
+    counters[prefix + "_bytes"] = base::Uint64ToString(it->second.bytes);
+    counters[prefix + "_seconds"] = Seconds(it->second.time);
+  }
+  counters["hashing_seconds"] = Seconds(hashing_time_);
+  counters["checkpoints"] = base::Uint64ToString(checkpoints_);
+  counters["retries"] = base::Uint64ToString(retries_);
+  counters["pauses"] = base::Uint64ToString(pauses_);
+  counters["paused_seconds"] = Seconds(paused_time_);
+  map<string, TimeDelta> status_times(status_times_);
+  if (!status_.empty())
+    status_times[status_] += now - status_start_time_;
+  for (map<string, TimeDelta>::const_iterator it = status_times.begin();
+       it != status_times.end(); ++it) {
+    counters["seconds_in_" + it->first] = Seconds(it->second);
+  }
+  MemoryTracker::AddCounters(&counters);
+  IoStats::AddCounters(&counters);
+  TransferStats::Get()->AddCounters(&counters);
+  return simple_key_value_store::AssembleString(counters);
+}
+
+}  // namespace chromeos_update_engine
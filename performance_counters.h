@@ -0,0 +1,87 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_PERFORMANCE_COUNTERS_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_PERFORMANCE_COUNTERS_H__
+
+#include <map>
+#include <string>
+
+#include <base/basictypes.h>
+#include <base/time.h>
+
+#include "update_engine/delta_performer.h"
+
+// Counts where the time of the update attempts goes, so that slow clients
+// and regressions can be spotted from the field without their logs: the
+// download and apply rates, the operations applied by type, the time spent
+// hashing the partitions, checkpoints, retries, the pauses under system
+// pressure and the time spent in each update status. The counters
+// accumulate over all the attempts since the daemon started. They're only
+// updated from the main loop. The memory high-water marks, transfer stats
+// and I/O counts, see IoStats, are reported along with them.
+
+namespace chromeos_update_engine {
+
+class PerformanceCounters {
+ public:
+  PerformanceCounters() : checkpoints_(0), retries_(0), pauses_(0) {}
+
+  // Records that the status changed to |status| at |now|. The time up to
+  // the next change is counted in |status|.
+  void SetStatus(const std::string& status, base::TimeTicks now);
+
+  // Records a download of |bytes| bytes that took |time|.
+  void AddDownload(uint64_t bytes, base::TimeDelta time);
+
+  // Records the operations applied by an attempt.
+  void AddOperationStats(const DeltaPerformer::OperationStatsMap& stats);
+
+  // Records |time| spent hashing the partitions.
+  void AddHashingTime(base::TimeDelta time);
+
+  // Records |checkpoints| checkpoints of the update progress and |retries|
+  // retried transfers.
+  void AddCheckpoints(int checkpoints);
+  void AddRetries(int retries);
+
+  // Records a pause of the update that lasted |time|.
+  void AddPause(base::TimeDelta time);
+
+  // Returns the counters as "name=value" lines, in the format
+  // simple_key_value_store parses, with the current status counted up to
+  // |now|. Times are in seconds and rates in bytes per second.
+  std::string ToString(base::TimeTicks now) const;
+
+ private:
+  struct Totals {
+    Totals() : count(0), bytes(0) {}
+    uint64_t count;
+    uint64_t bytes;
+    base::TimeDelta time;
+  };
+
+  // Download and apply totals. The count of the former is unused.
+  Totals download_;
+  Totals apply_;
+  std::map<std::string, Totals> operations_;
+
+  base::TimeDelta hashing_time_;
+  uint64_t checkpoints_;
+  uint64_t retries_;
+  uint64_t pauses_;
+  base::TimeDelta paused_time_;
+
+  // The time spent in each status, besides the current one since
+  // |status_start_time_|.
+  std::map<std::string, base::TimeDelta> status_times_;
+  std::string status_;
+  base::TimeTicks status_start_time_;
+
+  DISALLOW_COPY_AND_ASSIGN(PerformanceCounters);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_PERFORMANCE_COUNTERS_H__
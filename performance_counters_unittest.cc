@@ -0,0 +1,109 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <map>
+#include <string>
+
+#include <base/time.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/performance_counters.h"
+#include "update_engine/simple_key_value_store.h"
+
+using base::TimeDelta;
+using base::TimeTicks;
+using std::map;
+using std::string;
+
+namespace chromeos_update_engine {
+
+class PerformanceCountersTest : public ::testing::Test {};
+
+TEST(PerformanceCountersTest, EmptyTest) {
+  PerformanceCounters counters;
+  map<string, string> values =
+      simple_key_value_store::ParseString(counters.ToString(TimeTicks()));
+  EXPECT_EQ("0", values["download_bytes"]);
+  EXPECT_EQ("0.000", values["download_seconds"]);
+  EXPECT_EQ("0", values["download_bytes_per_second"]);
+  EXPECT_EQ("0", values["apply_operations"]);
+  EXPECT_EQ("0", values["apply_bytes_per_second"]);
+  EXPECT_EQ("0.000", values["hashing_seconds"]);
+  EXPECT_EQ("0", values["checkpoints"]);
+  EXPECT_EQ("0", values["retries"]);
+  EXPECT_EQ("0", values["pauses"]);
+  EXPECT_EQ("0.000", values["paused_seconds"]);
+}
+
+TEST(PerformanceCountersTest, TotalsTest) {
+  PerformanceCounters counters;
+  counters.AddDownload(3000, TimeDelta::FromSeconds(1));
+  counters.AddDownload(1000, TimeDelta::FromSeconds(1));
+
+  DeltaPerformer::OperationStatsMap stats;
+  stats[DeltaArchiveManifest_InstallOperation_Type_REPLACE].count = 2;
+  stats[DeltaArchiveManifest_InstallOperation_Type_REPLACE].bytes_written =
+      4096;
+  stats[DeltaArchiveManifest_InstallOperation_Type_REPLACE].time =
+      TimeDelta::FromMilliseconds(500);
+  stats[DeltaArchiveManifest_InstallOperation_Type_MOVE].count = 1;
+  stats[DeltaArchiveManifest_InstallOperation_Type_MOVE].bytes_written = 4096;
+  stats[DeltaArchiveManifest_InstallOperation_Type_MOVE].time =
+      TimeDelta::FromMilliseconds(500);
+  counters.AddOperationStats(stats);
+  counters.AddOperationStats(stats);
+
+  counters.AddHashingTime(TimeDelta::FromMilliseconds(1250));
+  counters.AddCheckpoints(3);
+  counters.AddCheckpoints(4);
+  counters.AddRetries(2);
+  counters.AddPause(TimeDelta::FromSeconds(30));
+  counters.AddPause(TimeDelta::FromMilliseconds(500));
+
+  map<string, string> values =
+      simple_key_value_store::ParseString(counters.ToString(TimeTicks()));
+  EXPECT_EQ("4000", values["download_bytes"]);
+  EXPECT_EQ("2.000", values["download_seconds"]);
+  EXPECT_EQ("2000", values["download_bytes_per_second"]);
+  EXPECT_EQ("6", values["apply_operations"]);
+  EXPECT_EQ("16384", values["apply_bytes"]);
+  EXPECT_EQ("2.000", values["apply_seconds"]);
+  EXPECT_EQ("8192", values["apply_bytes_per_second"]);
+  EXPECT_EQ("4", values["operation_REPLACE_count"]);
+  EXPECT_EQ("8192", values["operation_REPLACE_bytes"]);
+  EXPECT_EQ("1.000", values["operation_REPLACE_seconds"]);
+  EXPECT_EQ("2", values["operation_MOVE_count"]);
+  EXPECT_EQ("8192", values["operation_MOVE_bytes"]);
+  EXPECT_EQ("1.000", values["operation_MOVE_seconds"]);
+  EXPECT_EQ(values.end(), values.find("operation_BSDIFF_count"));
+  EXPECT_EQ("1.250", values["hashing_seconds"]);
+  EXPECT_EQ("7", values["checkpoints"]);
+  EXPECT_EQ("2", values["retries"]);
+  EXPECT_EQ("2", values["pauses"]);
+  EXPECT_EQ("30.500", values["paused_seconds"]);
+}
+
+TEST(PerformanceCountersTest, StatusTimesTest) {
+  PerformanceCounters counters;
+  const TimeTicks start = TimeTicks::Now();
+  counters.SetStatus("UPDATE_STATUS_IDLE", start);
+  counters.SetStatus("UPDATE_STATUS_DOWNLOADING",
+                     start + TimeDelta::FromSeconds(2));
+  counters.SetStatus("UPDATE_STATUS_IDLE", start + TimeDelta::FromSeconds(7));
+
+  // The current status is counted up to the time the counters are read.
+  map<string, string> values = simple_key_value_store::ParseString(
+      counters.ToString(start + TimeDelta::FromSeconds(8)));
+  EXPECT_EQ("3.000", values["seconds_in_UPDATE_STATUS_IDLE"]);
+  EXPECT_EQ("5.000", values["seconds_in_UPDATE_STATUS_DOWNLOADING"]);
+  EXPECT_EQ(values.end(), values.find("seconds_in_UPDATE_STATUS_VERIFYING"));
+
+  // Reading them doesn't change them.
+  values = simple_key_value_store::ParseString(
+      counters.ToString(start + TimeDelta::FromSeconds(10)));
+  EXPECT_EQ("5.000", values["seconds_in_UPDATE_STATUS_IDLE"]);
+  EXPECT_EQ("5.000", values["seconds_in_UPDATE_STATUS_DOWNLOADING"]);
+}
+
+}  // namespace chromeos_update_engine
@@ -20,13 +20,42 @@ const char kPostinstallScript[] = "/postinst";
 
 void PostinstallRunnerAction::PerformAction() {
   CHECK(HasInputObject());
-  const InstallPlan install_plan = GetInputObject();
-  const string install_device = install_plan.install_path;
   ScopedActionCompleter completer(processor_, this);
 
   // Make mountpoint.
   TEST_AND_RETURN(utils::MakeTempDirectory("/tmp/au_postint_mount.XXXXXX",
                                            &temp_rootfs_dir_));
+  completer.set_should_complete(false);
+
+  // The new partition isn't mounted before it's verified, as the kernel
+  // would parse a filesystem that may have been tampered with.
+  waiting_for_verification_ =
+      processor_->IsRunningEarlierConcurrentActions(this);
+  if (waiting_for_verification_) {
+    LOG(INFO) << "Waiting for the new partition to be verified.";
+    return;
+  }
+  RunPostinstall();
+}
+
+void PostinstallRunnerAction::ConcurrentActionsCompleted() {
+  if (!waiting_for_verification_)
+    return;
+  waiting_for_verification_ = false;
+  RunPostinstall();
+}
+
+void PostinstallRunnerAction::TerminateProcessing() {
+  CHECK(waiting_for_verification_);
+  waiting_for_verification_ = false;
+  ScopedDirRemover temp_dir_remover(temp_rootfs_dir_);
+}
+
+void PostinstallRunnerAction::RunPostinstall() {
+  // The plan is read once it's verified.
+  const InstallPlan& install_plan = GetInputObject();
+  const string install_device = install_plan.install_path;
+  ScopedActionCompleter completer(processor_, this);
   ScopedDirRemover temp_dir_remover(temp_rootfs_dir_);
 
   unsigned long mountflags = MS_RDONLY;
@@ -78,10 +107,12 @@ void PostinstallRunnerAction::CompletePostinstall(int return_code) {
 
   LOG(INFO) << "Postinst command succeeded";
   CHECK(HasInputObject());
-  const InstallPlan install_plan = GetInputObject();
-
-  if (HasOutputPipe())
-    SetOutputObject(install_plan);
+  if (HasOutputPipe()) {
+    // This is the last action to read the plan, so it's passed on as is.
+    InstallPlan install_plan;
+    SwapInputObject(&install_plan);
+    SwapOutputObject(&install_plan);
+  }
 
   completer.set_code(kActionCodeSuccess);
 }
@@ -7,11 +7,17 @@
 
 #include <string>
 
+#include <gtest/gtest_prod.h>  // for FRIEND_TEST
+
 #include "update_engine/action.h"
 #include "update_engine/install_plan.h"
 
 // The Postinstall Runner Action is responsible for running the postinstall
-// script of a successfully downloaded update.
+// script of a successfully downloaded update. When it's started
+// concurrently with the verification of the new partition, it prepares the
+// mount point while the partition is read back, and only mounts it and runs
+// the script once the verification has completed successfully; see
+// ConcurrentActionsCompleted().
 
 namespace chromeos_update_engine {
 
@@ -29,21 +35,31 @@ class ActionTraits<PostinstallRunnerAction> {
 
 class PostinstallRunnerAction : public Action<PostinstallRunnerAction> {
  public:
-  PostinstallRunnerAction() {}
+  PostinstallRunnerAction() : waiting_for_verification_(false) {}
   typedef ActionTraits<PostinstallRunnerAction>::InputObjectType
       InputObjectType;
   typedef ActionTraits<PostinstallRunnerAction>::OutputObjectType
       OutputObjectType;
   void PerformAction();
 
-  // Note that there's no support for terminating this action currently.
-  void TerminateProcessing() { CHECK(false); }
+  // Mounts the verified partition and runs the postinstall script.
+  void ConcurrentActionsCompleted();
+
+  // Note that there's no support for terminating this action once the
+  // script runs, only while it waits for the verification.
+  void TerminateProcessing();
 
   // Debugging/logging
   static std::string StaticType() { return "PostinstallRunnerAction"; }
   std::string Type() const { return StaticType(); }
 
  private:
+  FRIEND_TEST(PostinstallRunnerActionTest, VerificationFailsTest);
+
+  // Mounts the new partition and starts the postinstall script. Completes
+  // the action on failure.
+  void RunPostinstall();
+
   // Subprocess::Exec callback.
   void CompletePostinstall(int return_code);
   static void StaticCompletePostinstall(int return_code,
@@ -52,6 +68,10 @@ class PostinstallRunnerAction : public Action<PostinstallRunnerAction> {
 
   std::string temp_rootfs_dir_;
 
+  // True while the partition is verified by an action running concurrently
+  // with this one, before it's mounted.
+  bool waiting_for_verification_;
+
   DISALLOW_COPY_AND_ASSIGN(PostinstallRunnerAction);
 };
 
@@ -30,6 +30,29 @@ gboolean StartProcessorInRunLoop(gpointer data) {
 }
 }  // namespace
 
+class VerifierStubAction;
+
+template<>
+class ActionTraits<VerifierStubAction> {
+ public:
+  typedef InstallPlan InputObjectType;
+  typedef InstallPlan OutputObjectType;
+};
+
+// Stands in for the verification of the new partition, which completes when
+// it's told to.
+class VerifierStubAction : public Action<VerifierStubAction> {
+ public:
+  void PerformAction() {
+    SetOutputObject(GetInputObject());
+  }
+  void Complete(ActionExitCode code) {
+    processor_->ActionComplete(this, code);
+  }
+  static std::string StaticType() { return "VerifierStubAction"; }
+  std::string Type() const { return StaticType(); }
+};
+
 class PostinstallRunnerActionTest : public ::testing::Test {
  public:
   void DoTest(bool do_losetup, int err_code);
@@ -178,12 +201,41 @@ void PostinstallRunnerActionTest::DoTest(bool do_losetup, int err_code) {
   ASSERT_EQ(0, System(string("rm -f ") + cwd + "/image.dat"));
 }
 
+TEST_F(PostinstallRunnerActionTest, VerificationFailsTest) {
+  ActionProcessor processor;
+  ObjectFeederAction<InstallPlan> feeder_action;
+  InstallPlan install_plan;
+  install_plan.install_path = "/dev/null";
+  feeder_action.set_obj(install_plan);
+  VerifierStubAction verifier_action;
+  PostinstallRunnerAction runner_action;
+  BondActions(&feeder_action, &verifier_action);
+  BondActions(&verifier_action, &runner_action);
+  processor.EnqueueAction(&feeder_action);
+  processor.EnqueueConcurrentAction(&verifier_action);
+  processor.EnqueueAction(&runner_action);
+  processor.StartProcessing();
+
+  // The mount point is made while the partition is verified, but nothing is
+  // mounted on it.
+  EXPECT_TRUE(runner_action.IsRunning());
+  EXPECT_TRUE(runner_action.waiting_for_verification_);
+  const string mount_point = runner_action.temp_rootfs_dir_;
+  EXPECT_TRUE(utils::FileExists(mount_point.c_str()));
+
+  // Nor is it once the verification fails.
+  verifier_action.Complete(kActionCodeError);
+  EXPECT_FALSE(processor.IsRunning());
+  EXPECT_FALSE(runner_action.IsRunning());
+  EXPECT_FALSE(utils::FileExists(mount_point.c_str()));
+}
+
 // Death tests don't seem to be working on Hardy
 TEST_F(PostinstallRunnerActionTest, DISABLED_RunAsRootDeathTest) {
   ASSERT_EQ(0, getuid());
   PostinstallRunnerAction runner_action;
   ASSERT_DEATH({ runner_action.TerminateProcessing(); },
-               "postinstall_runner_action.h:.*] Check failed");
+               "postinstall_runner_action.cc:.*] Check failed");
 }
 
 }  // namespace chromeos_update_engine
@@ -41,6 +41,11 @@ const char kPrefsCurrentUrlIndex[] = "current-url-index";
 const char kPrefsCurrentUrlFailureCount[] = "current-url-failure-count";
 const char kPrefsBackoffExpiryTime[] = "backoff-expiry-time";
 const char kPrefsAlephVersion[] = "aleph-version";
+const char kPrefsNoUpdateResponseETag[] = "no-update-response-etag";
+const char kPrefsNoUpdatePollInterval[] = "no-update-poll-interval";
+const char kPrefsSourceKernelHash[] = "source-kernel-hash";
+const char kPrefsSourceRootfsHash[] = "source-rootfs-hash";
+const char kPrefsUpdateRates[] = "update-rates";
 
 bool Prefs::Init(const FilePath& prefs_dir) {
   prefs_dir_ = prefs_dir;
@@ -92,7 +97,7 @@ bool Prefs::Delete(const string& key) {
   return file_util::Delete(filename, false);
 }
 
-bool Prefs::GetFileNameForKey(const std::string& key, FilePath* filename) {
+bool Prefs::IsValidKey(const std::string& key) {
   // Allows only non-empty keys containing [A-Za-z0-9_-].
   TEST_AND_RETURN_FALSE(!key.empty());
   for (size_t i = 0; i < key.size(); ++i) {
@@ -100,6 +105,11 @@ bool Prefs::GetFileNameForKey(const std::string& key, FilePath* filename) {
     TEST_AND_RETURN_FALSE(IsAsciiAlpha(c) || IsAsciiDigit(c) ||
                           c == '_' || c == '-');
   }
+  return true;
+}
+
+bool Prefs::GetFileNameForKey(const std::string& key, FilePath* filename) {
+  TEST_AND_RETURN_FALSE(IsValidKey(key));
   *filename = prefs_dir_.Append(key);
   return true;
 }
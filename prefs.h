@@ -33,6 +33,10 @@ class Prefs : public PrefsInterface {
   bool Exists(const std::string& key);
   bool Delete(const std::string& key);
 
+  // Returns true if |key| may be used as a key, i.e., it's non-empty and
+  // contains only [A-Za-z0-9_-].
+  static bool IsValidKey(const std::string& key);
+
  private:
   FRIEND_TEST(PrefsTest, GetFileNameForKey);
   FRIEND_TEST(PrefsTest, GetFileNameForKeyBadCharacter);
@@ -31,6 +31,11 @@ extern const char kPrefsCurrentUrlIndex[];
 extern const char kPrefsCurrentUrlFailureCount[];
 extern const char kPrefsBackoffExpiryTime[];
 extern const char kPrefsAlephVersion[];
+extern const char kPrefsNoUpdateResponseETag[];
+extern const char kPrefsNoUpdatePollInterval[];
+extern const char kPrefsSourceKernelHash[];
+extern const char kPrefsSourceRootfsHash[];
+extern const char kPrefsUpdateRates[];
 
 // The prefs interface allows access to a persistent preferences
 // store. The two reasons for providing this as an interface are
@@ -65,6 +70,22 @@ class PrefsInterface {
   // this key. Calling with non-existent keys does nothing.
   virtual bool Delete(const std::string& key) = 0;
 
+  // Makes sure that the values set so far are persisted, for stores that
+  // don't write them out right away. Returns true on success.
+  virtual bool Flush() { return true; }
+
+  // Starts a transaction: the changes made until CommitTransaction() are
+  // persisted all together or not at all. Returns false if the store
+  // doesn't support transactions, or one is already in progress.
+  virtual bool BeginTransaction() { return false; }
+
+  // Persists the changes made in the current transaction. Returns true on
+  // success; on failure the changes are rolled back.
+  virtual bool CommitTransaction() { return false; }
+
+  // Rolls back the changes made in the current transaction.
+  virtual void AbortTransaction() {}
+
   virtual ~PrefsInterface() {}
 };
 
@@ -0,0 +1,62 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_PROBES_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_PROBES_H__
+
+// Static tracepoints (USDT probes) of the update_engine provider, for
+// attaching bpftrace, perf or SystemTap to a running daemon to see where an
+// update spends its time without restarting it with tracing on. Unlike the
+// events of trace.h, a probe costs a single nop while nothing is attached,
+// so they are always compiled in when <sys/sdt.h> is available (USE_USDT).
+//
+// The probes and their arguments:
+//   action_start(type)                 an action is performed
+//   action_end(type, code)             an action completed with the
+//                                      ActionExitCode |code|, or -1 if it
+//                                      was aborted
+//   http_transfer_start(url, offset)   a transfer starts at byte |offset|
+//   http_transfer_progress(bytes, total)
+//                                      a chunk was received; |total| is -1
+//                                      while the size isn't known
+//   http_transfer_end(url, code, bytes)
+//                                      a transfer ended with the HTTP
+//                                      response |code| after |bytes| bytes
+//   operation_start(index, type, data_length)
+//                                      an install operation is applied
+//   operation_end(index, type, dst_bytes)
+//                                      an install operation was applied,
+//                                      writing |dst_bytes| bytes
+//   checkpoint(next_operation, bytes)  the progress was checkpointed
+//   subprocess_exec(pid, command)      a subprocess was started
+//   subprocess_exit(pid, status)       a subprocess exited
+//   copier_buffer_done(bytes)          the filesystem copier wrote a buffer
+// String arguments are NUL-terminated char pointers.
+//
+// For example, to histogram the time spent applying each type of operation:
+//   bpftrace -e '
+//     usdt:/usr/sbin/update_engine:update_engine:operation_start
+//       { @start[tid] = nsecs; }
+//     usdt:/usr/sbin/update_engine:update_engine:operation_end
+//       /@start[tid]/ { @us[arg1] = hist((nsecs - @start[tid]) / 1000);
+//                       delete(@start[tid]); }'
+
+#ifdef USE_USDT
+
+#include <sys/sdt.h>
+
+#define UE_PROBE1(name, a1) DTRACE_PROBE1(update_engine, name, a1)
+#define UE_PROBE2(name, a1, a2) DTRACE_PROBE2(update_engine, name, a1, a2)
+#define UE_PROBE3(name, a1, a2, a3) \
+    DTRACE_PROBE3(update_engine, name, a1, a2, a3)
+
+#else  // USE_USDT
+
+#define UE_PROBE1(name, a1) do {} while (0)
+#define UE_PROBE2(name, a1, a2) do {} while (0)
+#define UE_PROBE3(name, a1, a2, a3) do {} while (0)
+
+#endif  // USE_USDT
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_PROBES_H__
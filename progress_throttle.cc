@@ -0,0 +1,50 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/progress_throttle.h"
+
+using base::TimeDelta;
+using base::TimeTicks;
+
+namespace chromeos_update_engine {
+
+namespace {
+const double kStepTolerance = 1e-9;
+}  // namespace {}
+
+ProgressThrottle::ProgressThrottle(double step,
+                                   TimeDelta min_interval,
+                                   TimeDelta max_interval)
+    : step_(step),
+      min_interval_(min_interval),
+      max_interval_(max_interval),
+      reported_(false),
+      last_progress_(0.0) {}
+
+bool ProgressThrottle::ShouldReport(double progress,
+                                    bool force,
+                                    TimeTicks now) {
+  if (reported_ && !force && progress < 1.0 && progress >= last_progress_) {
+    const TimeDelta elapsed = now - last_time_;
+    // Tolerates the rounding of steps such as percentages.
+    const bool stepped =
+        progress - last_progress_ + kStepTolerance >= step_ &&
+        elapsed >= min_interval_;
+    const bool stalled =
+        max_interval_ > TimeDelta() && elapsed >= max_interval_;
+    if (!stepped && !stalled)
+      return false;
+  }
+  reported_ = true;
+  last_progress_ = progress;
+  last_time_ = now;
+  return true;
+}
+
+void ProgressThrottle::Reset() {
+  reported_ = false;
+  last_progress_ = 0.0;
+}
+
+}  // namespace chromeos_update_engine
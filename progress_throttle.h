@@ -0,0 +1,55 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_PROGRESS_THROTTLE_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_PROGRESS_THROTTLE_H__
+
+#include <base/basictypes.h>
+#include <base/time.h>
+
+// Coalesces progress updates that come in far more often than they're worth
+// reporting, e.g., one per chunk of a fast download: an update is reported
+// once the progress has advanced by a step since the last reported one, but
+// no sooner than a minimum interval after it, and at least once per maximum
+// interval even if the progress stalls. Completion, a receding progress and
+// forced updates are always reported.
+
+namespace chromeos_update_engine {
+
+class ProgressThrottle {
+ public:
+  // |step| is a share of the whole progress, which goes from 0 to 1. A zero
+  // |min_interval| reports every step, and a zero |max_interval| doesn't
+  // report stalled progress.
+  ProgressThrottle(double step,
+                   base::TimeDelta min_interval,
+                   base::TimeDelta max_interval);
+
+  void set_step(double step) { step_ = step; }
+  void set_min_interval(base::TimeDelta interval) { min_interval_ = interval; }
+  void set_max_interval(base::TimeDelta interval) { max_interval_ = interval; }
+
+  // Returns true if |progress|, at |now|, should be reported, and records it
+  // as the last reported one if so. The first update is always reported,
+  // and so is any if |force|.
+  bool ShouldReport(double progress, bool force, base::TimeTicks now);
+
+  // Forgets the last reported update, so that the next one is reported.
+  void Reset();
+
+ private:
+  double step_;
+  base::TimeDelta min_interval_;
+  base::TimeDelta max_interval_;
+
+  bool reported_;
+  double last_progress_;
+  base::TimeTicks last_time_;
+
+  DISALLOW_COPY_AND_ASSIGN(ProgressThrottle);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_PROGRESS_THROTTLE_H__
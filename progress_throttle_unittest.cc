@@ -0,0 +1,61 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <base/time.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/progress_throttle.h"
+
+using base::TimeDelta;
+using base::TimeTicks;
+
+namespace chromeos_update_engine {
+
+class ProgressThrottleTest : public ::testing::Test {
+ protected:
+  ProgressThrottleTest()
+      : throttle_(0.1, TimeDelta::FromSeconds(1), TimeDelta::FromSeconds(10)),
+        now_(TimeTicks::Now()) {}
+
+  // Advances the clock by |ms| milliseconds and returns whether |progress|
+  // is reported then.
+  bool ReportAfter(int ms, double progress) {
+    now_ = now_ + TimeDelta::FromMilliseconds(ms);
+    return throttle_.ShouldReport(progress, false, now_);
+  }
+
+  ProgressThrottle throttle_;
+  TimeTicks now_;
+};
+
+TEST_F(ProgressThrottleTest, StepTest) {
+  EXPECT_TRUE(ReportAfter(0, 0.0));
+  EXPECT_FALSE(ReportAfter(1000, 0.05));
+  EXPECT_TRUE(ReportAfter(1000, 0.1));
+  // A step taken too soon waits for the minimum interval.
+  EXPECT_FALSE(ReportAfter(500, 0.3));
+  EXPECT_TRUE(ReportAfter(500, 0.3));
+  // Completion is reported right away.
+  EXPECT_TRUE(ReportAfter(1, 1.0));
+}
+
+TEST_F(ProgressThrottleTest, StalledTest) {
+  EXPECT_TRUE(ReportAfter(0, 0.5));
+  EXPECT_FALSE(ReportAfter(9999, 0.5));
+  EXPECT_TRUE(ReportAfter(1, 0.5));
+  throttle_.set_max_interval(TimeDelta());
+  EXPECT_FALSE(ReportAfter(60 * 1000, 0.5));
+}
+
+TEST_F(ProgressThrottleTest, ForcedTest) {
+  EXPECT_TRUE(ReportAfter(0, 0.5));
+  EXPECT_TRUE(throttle_.ShouldReport(0.5, true, now_));
+  // Receding progress is reported too.
+  EXPECT_TRUE(ReportAfter(1, 0.2));
+  EXPECT_FALSE(ReportAfter(1, 0.2));
+  throttle_.Reset();
+  EXPECT_TRUE(ReportAfter(1, 0.2));
+}
+
+}  // namespace chromeos_update_engine
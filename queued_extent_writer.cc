@@ -0,0 +1,153 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/queued_extent_writer.h"
+
+#include <algorithm>
+
+#include <base/logging.h>
+
+using std::min;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+// Data is queued in chunks of up to this size, which the underlying writer
+// gets one at a time.
+const size_t kChunkSize = 256 * 1024;  // 256 KiB
+}  // namespace {}
+
+// Enough for the decompressor to stay a few chunks ahead of the disk.
+const size_t QueuedExtentWriter::kMaxQueuedBytes = 4 * 1024 * 1024;  // 4 MiB
+
+QueuedExtentWriter::QueuedExtentWriter(ExtentWriter* next)
+    : next_(next),
+      thread_(NULL),
+      synchronous_(false),
+      queued_bytes_(0),
+      busy_(false),
+      success_(true),
+      stopping_(false) {
+  g_mutex_init(&mutex_);
+  g_cond_init(&cond_);
+}
+
+QueuedExtentWriter::~QueuedExtentWriter() {
+  StopThread();
+  g_cond_clear(&cond_);
+  g_mutex_clear(&mutex_);
+}
+
+bool QueuedExtentWriter::Init(int fd,
+                              const vector<Extent>& extents,
+                              uint32_t block_size) {
+  WaitIdle();
+  success_ = true;
+  return next_->Init(fd, extents, block_size);
+}
+
+bool QueuedExtentWriter::Write(const void* bytes, size_t count) {
+  if (count == 0)
+    return true;
+  if (!thread_ && !synchronous_) {
+    thread_ = g_thread_try_new("extent_writer", ThreadMain, this, NULL);
+    if (!thread_) {
+      LOG(WARNING) << "Unable to start the writing thread, writing "
+                   << "synchronously.";
+      synchronous_ = true;
+    }
+  }
+  if (synchronous_)
+    return next_->Write(bytes, count);
+
+  const char* data = reinterpret_cast<const char*>(bytes);
+  g_mutex_lock(&mutex_);
+  while (count > 0 && success_) {
+    while (queued_bytes_ >= kMaxQueuedBytes && success_)
+      g_cond_wait(&cond_, &mutex_);
+    // The thread takes chunks off the front, so the back one is never being
+    // written and may still grow.
+    if (chunks_.empty() || chunks_.back().size() == kChunkSize) {
+      chunks_.push_back(vector<char>());
+      if (!free_chunks_.empty()) {
+        chunks_.back().swap(free_chunks_.back());
+        free_chunks_.pop_back();
+      }
+      chunks_.back().reserve(kChunkSize);
+    }
+    vector<char>* chunk = &chunks_.back();
+    const size_t length = min(count, kChunkSize - chunk->size());
+    chunk->insert(chunk->end(), data, data + length);
+    queued_bytes_ += length;
+    data += length;
+    count -= length;
+    g_cond_broadcast(&cond_);
+  }
+  const bool success = success_;
+  g_mutex_unlock(&mutex_);
+  return success;
+}
+
+bool QueuedExtentWriter::EndImpl() {
+  WaitIdle();
+  const bool success = success_;
+  return next_->End() && success;
+}
+
+gpointer QueuedExtentWriter::ThreadMain(gpointer data) {
+  reinterpret_cast<QueuedExtentWriter*>(data)->Run();
+  return NULL;
+}
+
+void QueuedExtentWriter::Run() {
+  g_mutex_lock(&mutex_);
+  for (;;) {
+    while (chunks_.empty() && !stopping_)
+      g_cond_wait(&cond_, &mutex_);
+    if (stopping_)
+      break;
+    vector<char> chunk;
+    chunk.swap(chunks_.front());
+    chunks_.pop_front();
+    busy_ = true;
+    const bool skip = !success_;
+    g_mutex_unlock(&mutex_);
+
+    // Once a write has failed, the rest of the data is dropped.
+    const bool success = skip || next_->Write(&chunk[0], chunk.size());
+
+    g_mutex_lock(&mutex_);
+    busy_ = false;
+    queued_bytes_ -= chunk.size();
+    success_ = success && success_;
+    chunk.clear();
+    free_chunks_.push_back(vector<char>());
+    free_chunks_.back().swap(chunk);
+    g_cond_broadcast(&cond_);
+  }
+  g_mutex_unlock(&mutex_);
+}
+
+void QueuedExtentWriter::StopThread() {
+  if (!thread_)
+    return;
+  g_mutex_lock(&mutex_);
+  stopping_ = true;
+  g_cond_broadcast(&cond_);
+  g_mutex_unlock(&mutex_);
+  g_thread_join(thread_);
+  thread_ = NULL;
+}
+
+void QueuedExtentWriter::WaitIdle() {
+  if (!thread_)
+    return;
+  g_mutex_lock(&mutex_);
+  while (busy_ || !chunks_.empty())
+    g_cond_wait(&cond_, &mutex_);
+  g_mutex_unlock(&mutex_);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,90 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_QUEUED_EXTENT_WRITER_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_QUEUED_EXTENT_WRITER_H__
+
+#include <glib.h>
+
+#include <deque>
+#include <vector>
+
+#include <base/basictypes.h>
+
+#include "update_engine/extent_writer.h"
+
+// An ExtentWriter that passes the data written to it on to an underlying
+// ExtentWriter on a thread of its own. Write() only queues a copy of the
+// data, so that e.g. a decompressing writer above it goes on decoding the
+// next piece while the one before is being written to disk. The queue is
+// bounded, and its buffers are reused from one chunk to the next. End()
+// waits for the queued data to be written. The thread is kept from one
+// Init() to the next, until the writer is destroyed.
+
+namespace chromeos_update_engine {
+
+class QueuedExtentWriter : public ExtentWriter {
+ public:
+  // Write() blocks while this much data is waiting to be written.
+  static const size_t kMaxQueuedBytes;
+
+  explicit QueuedExtentWriter(ExtentWriter* next);
+
+  // Discards any data that hasn't been written yet and stops the thread.
+  ~QueuedExtentWriter();
+
+  // Initializes the underlying writer, on the caller's thread.
+  bool Init(int fd, const std::vector<Extent>& extents, uint32_t block_size);
+
+  // Queues |count| bytes of |bytes| to be written after the data queued
+  // before. Returns false if writing the queued data has failed already.
+  bool Write(const void* bytes, size_t count);
+
+  // Waits for the queued data to be written and ends the underlying writer.
+  bool EndImpl();
+
+  // Makes the writer pass its data to |next| from the next Init() on.
+  void Reset(ExtentWriter* next) { next_ = next; }
+
+ private:
+  static gpointer ThreadMain(gpointer data);
+  void Run();
+
+  // Tells the thread to exit once it's done with the current chunk and
+  // joins it.
+  void StopThread();
+
+  // Waits until the thread has written all the queued data, after which
+  // |next_| may be used without holding |mutex_|.
+  void WaitIdle();
+
+  // The underlying writer. Used by the thread while it's busy and by the
+  // caller otherwise.
+  ExtentWriter* next_;
+
+  // Started by the first Write(). If that fails, the data is written
+  // synchronously instead.
+  GThread* thread_;
+  bool synchronous_;
+
+  GMutex mutex_;
+  // Signalled when data is queued, taken or written, and when stopping.
+  GCond cond_;
+  // The data waiting to be written and the total size of it.
+  std::deque<std::vector<char> > chunks_;
+  size_t queued_bytes_;
+  // The buffers of the chunks written, kept for the next ones.
+  std::vector<std::vector<char> > free_chunks_;
+  // True while the thread is writing a chunk it took off |chunks_|.
+  bool busy_;
+  // False once writing to |next_| has failed, until the next Init().
+  bool success_;
+  bool stopping_;
+
+  DISALLOW_COPY_AND_ASSIGN(QueuedExtentWriter);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_QUEUED_EXTENT_WRITER_H__
@@ -0,0 +1,60 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <algorithm>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/queued_extent_writer.h"
+#include "update_engine/test_utils.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+TEST(QueuedExtentWriterTest, SimpleTest) {
+  vector<char> data(3 * QueuedExtentWriter::kMaxQueuedBytes + 10);
+  FillWithData(&data);
+  MemoryExtentWriter memory_writer;
+  QueuedExtentWriter writer(&memory_writer);
+  // The writer is reused, and ends up with the data of the last stream.
+  for (int i = 0; i < 2; i++) {
+    EXPECT_TRUE(writer.Init(-1, vector<Extent>(), 4096));
+    // Mix small writes, which get merged, with ones bigger than the queue.
+    const size_t kSizes[] = { 1, 100, 4096, 300 * 1024, 5 * 1024 * 1024 };
+    size_t offset = 0;
+    for (size_t j = 0; offset < data.size(); j = (j + 1) % arraysize(kSizes)) {
+      const size_t size = std::min(kSizes[j], data.size() - offset);
+      EXPECT_TRUE(writer.Write(&data[offset], size));
+      offset += size;
+    }
+    EXPECT_TRUE(writer.End());
+    EXPECT_TRUE(memory_writer.data() == data);
+  }
+  EXPECT_EQ(2, memory_writer.init_count());
+}
+
+TEST(QueuedExtentWriterTest, FailureTest) {
+  vector<char> data(1024 * 1024);
+  FillWithData(&data);
+  MemoryExtentWriter memory_writer;
+  memory_writer.set_fail_after(data.size() / 2);
+  QueuedExtentWriter writer(&memory_writer);
+  EXPECT_TRUE(writer.Init(-1, vector<Extent>(), 4096));
+  // The failure is reported by a later Write() or by End().
+  bool success = true;
+  for (size_t offset = 0; offset < data.size(); offset += 4096)
+    success = writer.Write(&data[offset], 4096) && success;
+  EXPECT_FALSE(writer.End() && success);
+
+  // The next stream starts over.
+  memory_writer.set_fail_after(-1);
+  EXPECT_TRUE(writer.Init(-1, vector<Extent>(), 4096));
+  EXPECT_TRUE(writer.Write(&data[0], data.size()));
+  EXPECT_TRUE(writer.End());
+  EXPECT_TRUE(memory_writer.data() == data);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,221 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/queued_file_writer.h"
+
+#include <algorithm>
+
+#include <base/logging.h>
+
+using std::min;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+// Data is queued in chunks of up to this size, which the underlying writer
+// gets one at a time.
+const size_t kChunkSize = 256 * 1024;  // 256 KiB
+}  // namespace {}
+
+// Enough for the transfer to go on while a few large operations are
+// applied.
+const size_t QueuedFileWriter::kMaxQueuedBytes = 8 * 1024 * 1024;  // 8 MiB
+
+QueuedFileWriter::QueuedFileWriter(FileWriter* next,
+                                   QueuedFileWriterDelegate* delegate)
+    : next_(next),
+      delegate_(delegate),
+      thread_(NULL),
+      queued_bytes_(0),
+      full_(false),
+      busy_(false),
+      error_(kActionCodeSuccess),
+      stopping_(false),
+      notify_source_id_(0) {
+  g_mutex_init(&mutex_);
+  g_cond_init(&cond_);
+}
+
+QueuedFileWriter::~QueuedFileWriter() {
+  Stop();
+  g_cond_clear(&cond_);
+  g_mutex_clear(&mutex_);
+}
+
+int QueuedFileWriter::Open(const char* path, int flags, mode_t mode) {
+  Stop();
+  error_ = kActionCodeSuccess;
+  stopping_ = false;
+  const int rc = next_->Open(path, flags, mode);
+  if (rc < 0)
+    return rc;
+  thread_ = g_thread_try_new("file_writer", ThreadMain, this, NULL);
+  LOG_IF(WARNING, !thread_) << "Unable to start the writing thread, "
+                            << "writing synchronously.";
+  return rc;
+}
+
+bool QueuedFileWriter::Write(const void* bytes, size_t count) {
+  ActionExitCode error;
+  return Write(bytes, count, &error);
+}
+
+bool QueuedFileWriter::Write(const void* bytes,
+                             size_t count,
+                             ActionExitCode* error) {
+  if (!thread_) {
+    if (error_ != kActionCodeSuccess) {
+      *error = error_;
+      return false;
+    }
+    if (!next_->Write(bytes, count, error)) {
+      error_ = *error;
+      return false;
+    }
+    return true;
+  }
+
+  const char* data = reinterpret_cast<const char*>(bytes);
+  g_mutex_lock(&mutex_);
+  const bool success = error_ == kActionCodeSuccess;
+  if (success) {
+    while (count > 0) {
+      // The thread takes chunks off the front, so the back one is never
+      // being written and may still grow.
+      if (chunks_.empty() || chunks_.back().size() == kChunkSize) {
+        chunks_.push_back(vector<char>());
+        chunks_.back().reserve(kChunkSize);
+      }
+      vector<char>* chunk = &chunks_.back();
+      const size_t length = min(count, kChunkSize - chunk->size());
+      chunk->insert(chunk->end(), data, data + length);
+      queued_bytes_ += length;
+      data += length;
+      count -= length;
+    }
+    if (queued_bytes_ >= kMaxQueuedBytes)
+      full_ = true;
+    g_cond_broadcast(&cond_);
+  } else {
+    *error = error_;
+  }
+  g_mutex_unlock(&mutex_);
+  return success;
+}
+
+int QueuedFileWriter::Close() {
+  Stop();
+  return next_->Close();
+}
+
+void QueuedFileWriter::Stop() {
+  if (thread_) {
+    g_mutex_lock(&mutex_);
+    stopping_ = true;
+    chunks_.clear();
+    queued_bytes_ = 0;
+    full_ = false;
+    g_cond_broadcast(&cond_);
+    g_mutex_unlock(&mutex_);
+    g_thread_join(thread_);
+    thread_ = NULL;
+  }
+  if (notify_source_id_) {
+    g_source_remove(notify_source_id_);
+    notify_source_id_ = 0;
+  }
+}
+
+void QueuedFileWriter::WaitIdle() {
+  if (!thread_)
+    return;
+  g_mutex_lock(&mutex_);
+  while (busy_ || !chunks_.empty())
+    g_cond_wait(&cond_, &mutex_);
+  g_mutex_unlock(&mutex_);
+}
+
+bool QueuedFileWriter::full() const {
+  g_mutex_lock(&mutex_);
+  const bool full = full_;
+  g_mutex_unlock(&mutex_);
+  return full;
+}
+
+bool QueuedFileWriter::idle() const {
+  g_mutex_lock(&mutex_);
+  const bool idle = chunks_.empty() && !busy_;
+  g_mutex_unlock(&mutex_);
+  return idle;
+}
+
+bool QueuedFileWriter::failed(ActionExitCode* error) const {
+  g_mutex_lock(&mutex_);
+  *error = error_;
+  g_mutex_unlock(&mutex_);
+  return *error != kActionCodeSuccess;
+}
+
+gpointer QueuedFileWriter::ThreadMain(gpointer data) {
+  reinterpret_cast<QueuedFileWriter*>(data)->Run();
+  return NULL;
+}
+
+void QueuedFileWriter::Run() {
+  g_mutex_lock(&mutex_);
+  for (;;) {
+    while (chunks_.empty() && !stopping_)
+      g_cond_wait(&cond_, &mutex_);
+    if (stopping_)
+      break;
+    vector<char> chunk;
+    chunk.swap(chunks_.front());
+    chunks_.pop_front();
+    busy_ = true;
+    const bool skip = error_ != kActionCodeSuccess;
+    g_mutex_unlock(&mutex_);
+
+    // Once a write has failed, the rest of the data is dropped.
+    ActionExitCode error = kActionCodeSuccess;
+    const bool success =
+        skip || next_->Write(&chunk[0], chunk.size(), &error);
+
+    g_mutex_lock(&mutex_);
+    busy_ = false;
+    queued_bytes_ -= min(queued_bytes_, chunk.size());
+    bool notify = chunks_.empty();
+    if (!success && error_ == kActionCodeSuccess) {
+      error_ = error == kActionCodeSuccess ?
+          kActionCodeDownloadWriteError : error;
+      notify = true;
+    }
+    if (full_ && queued_bytes_ <= kMaxQueuedBytes / 2) {
+      full_ = false;
+      notify = true;
+    }
+    if (notify)
+      NotifyDelegate();
+    g_cond_broadcast(&cond_);
+  }
+  g_mutex_unlock(&mutex_);
+}
+
+void QueuedFileWriter::NotifyDelegate() {
+  if (delegate_ && !notify_source_id_ && !stopping_) {
+    notify_source_id_ =
+        g_idle_add(&QueuedFileWriter::StaticNotifyDelegate, this);
+  }
+}
+
+gboolean QueuedFileWriter::StaticNotifyDelegate(gpointer data) {
+  QueuedFileWriter* writer = reinterpret_cast<QueuedFileWriter*>(data);
+  g_mutex_lock(&writer->mutex_);
+  writer->notify_source_id_ = 0;
+  g_mutex_unlock(&writer->mutex_);
+  writer->delegate_->QueuedWriterUpdated(writer);
+  return FALSE;
+}
+
+}  // namespace chromeos_update_engine
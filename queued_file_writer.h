@@ -0,0 +1,120 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_QUEUED_FILE_WRITER_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_QUEUED_FILE_WRITER_H__
+
+#include <glib.h>
+
+#include <deque>
+#include <vector>
+
+#include <base/basictypes.h>
+
+#include "update_engine/file_writer.h"
+
+// A FileWriter that passes the data written to it on to an underlying
+// FileWriter, e.g., the DeltaPerformer, on a thread of its own, so that the
+// glib main loop goes on receiving the payload, handling D-Bus calls and
+// running timers while the data is applied. Write() only queues a copy of
+// the data and never blocks. The queue is bounded softly: the caller stops
+// writing once it's full(), e.g., by pausing the transfer, and is told from
+// the main loop when there's room again, when everything queued has been
+// written and when writing fails.
+
+namespace chromeos_update_engine {
+
+class QueuedFileWriter;
+
+class QueuedFileWriterDelegate {
+ public:
+  // Called from the main loop once |writer| is no longer full(), is idle()
+  // or has failed(). Several changes may be reported by one call.
+  virtual void QueuedWriterUpdated(QueuedFileWriter* writer) = 0;
+};
+
+class QueuedFileWriter : public FileWriter {
+ public:
+  // The queue is full() once this much data is waiting to be written, and
+  // isn't anymore once half of it has been.
+  static const size_t kMaxQueuedBytes;
+
+  // |next| and |delegate| aren't owned.
+  QueuedFileWriter(FileWriter* next, QueuedFileWriterDelegate* delegate);
+
+  // Discards any data that hasn't been written yet and stops the thread.
+  virtual ~QueuedFileWriter();
+
+  // Opens the underlying writer, on the caller's thread, and starts the
+  // thread. If that fails, the data is written synchronously instead.
+  virtual int Open(const char* path, int flags, mode_t mode);
+
+  // Queues |count| bytes of |bytes| to be written after the data queued
+  // before. Returns false, with the error of the underlying writer, if
+  // writing the queued data has failed already.
+  virtual bool Write(const void* bytes, size_t count);
+  virtual bool Write(const void* bytes, size_t count, ActionExitCode* error);
+
+  // Stops the thread, discarding the data that hasn't been written yet, and
+  // closes the underlying writer.
+  virtual int Close();
+
+  // Discards the data that hasn't been written yet and waits for the thread
+  // to finish the chunk it's writing and exit, after which the underlying
+  // writer may be used on the caller's thread.
+  void Stop();
+
+  // Waits until all the data queued has been written, for the rare cases
+  // where the caller can't wait for the delegate to be told.
+  void WaitIdle();
+
+  // True while the caller should hold off writing.
+  bool full() const;
+
+  // True once all the data queued has been written, after which the
+  // underlying writer may be used on the caller's thread until the next
+  // Write().
+  bool idle() const;
+
+  // Returns true, and the error in |error|, if writing the queued data has
+  // failed. The data queued after that is dropped.
+  bool failed(ActionExitCode* error) const;
+
+ private:
+  static gpointer ThreadMain(gpointer data);
+  void Run();
+
+  // Schedules a QueuedWriterUpdated() call from the main loop, unless one
+  // is already. Called with |mutex_| held.
+  void NotifyDelegate();
+  static gboolean StaticNotifyDelegate(gpointer data);
+
+  FileWriter* next_;
+  QueuedFileWriterDelegate* delegate_;
+
+  // NULL if writing synchronously.
+  GThread* thread_;
+
+  mutable GMutex mutex_;
+  // Signalled when data is queued or written, and when stopping.
+  GCond cond_;
+  // The data waiting to be written and the total size of it.
+  std::deque<std::vector<char> > chunks_;
+  size_t queued_bytes_;
+  // Set once the queue fills up, until half of it has been written.
+  bool full_;
+  // True while the thread is writing a chunk it took off |chunks_|.
+  bool busy_;
+  // The error writing to |next_| has failed with, or kActionCodeSuccess.
+  ActionExitCode error_;
+  bool stopping_;
+  // The idle source calling the delegate, or 0 if none is scheduled.
+  guint notify_source_id_;
+
+  DISALLOW_COPY_AND_ASSIGN(QueuedFileWriter);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_QUEUED_FILE_WRITER_H__
@@ -0,0 +1,196 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <glib.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/queued_file_writer.h"
+#include "update_engine/test_utils.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Gathers what's written to it, in order, and fails the writes once it has
+// |fail_after| bytes. Writes block while it's held.
+class MemoryFileWriter : public FileWriter {
+ public:
+  MemoryFileWriter() : fail_after_(-1), held_(false), closed_(false) {
+    g_mutex_init(&mutex_);
+    g_cond_init(&cond_);
+  }
+  ~MemoryFileWriter() {
+    g_cond_clear(&cond_);
+    g_mutex_clear(&mutex_);
+  }
+
+  int Open(const char* path, int flags, mode_t mode) { return 0; }
+  bool Write(const void* bytes, size_t count) {
+    g_mutex_lock(&mutex_);
+    while (held_)
+      g_cond_wait(&cond_, &mutex_);
+    g_mutex_unlock(&mutex_);
+    if (fail_after_ >= 0 &&
+        data_.size() + count > static_cast<size_t>(fail_after_))
+      return false;
+    const char* c_bytes = reinterpret_cast<const char*>(bytes);
+    data_.insert(data_.end(), c_bytes, c_bytes + count);
+    return true;
+  }
+  int Close() {
+    closed_ = true;
+    return 0;
+  }
+
+  void Hold(bool held) {
+    g_mutex_lock(&mutex_);
+    held_ = held;
+    g_cond_broadcast(&cond_);
+    g_mutex_unlock(&mutex_);
+  }
+
+  ssize_t fail_after_;
+  vector<char> data_;
+  bool held_;
+  bool closed_;
+  GMutex mutex_;
+  GCond cond_;
+};
+
+// Lets the writes of the MemoryFileWriter at |data| through after a
+// while.
+gpointer ReleaseSoon(gpointer data) {
+  g_usleep(10 * 1000);
+  reinterpret_cast<MemoryFileWriter*>(data)->Hold(false);
+  return NULL;
+}
+
+// Quits |loop_| once the writer is no longer full and is idle or has
+// failed.
+class QueuedFileWriterTestDelegate : public QueuedFileWriterDelegate {
+ public:
+  explicit QueuedFileWriterTestDelegate(GMainLoop* loop)
+      : loop_(loop), num_calls_(0) {}
+
+  void QueuedWriterUpdated(QueuedFileWriter* writer) {
+    num_calls_++;
+    ActionExitCode error;
+    if (!writer->full() && (writer->idle() || writer->failed(&error)))
+      g_main_loop_quit(loop_);
+  }
+
+  GMainLoop* loop_;
+  int num_calls_;
+};
+
+}  // namespace {}
+
+class QueuedFileWriterTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    loop_ = g_main_loop_new(g_main_context_default(), FALSE);
+  }
+  virtual void TearDown() {
+    g_main_loop_unref(loop_);
+  }
+
+  GMainLoop* loop_;
+};
+
+TEST_F(QueuedFileWriterTest, SimpleTest) {
+  vector<char> data(3 * QueuedFileWriter::kMaxQueuedBytes + 10);
+  FillWithData(&data);
+  MemoryFileWriter memory_writer;
+  QueuedFileWriterTestDelegate delegate(loop_);
+  QueuedFileWriter writer(&memory_writer, &delegate);
+  EXPECT_EQ(0, writer.Open("/dev/null", O_WRONLY, 0644));
+  // Mix small writes, which get merged, with ones bigger than a chunk.
+  const size_t kSizes[] = { 1, 100, 4096, 300 * 1024, 1024 * 1024 };
+  size_t offset = 0;
+  for (size_t i = 0; offset < data.size(); i = (i + 1) % arraysize(kSizes)) {
+    const size_t size = std::min(kSizes[i], data.size() - offset);
+    ActionExitCode error = kActionCodeSuccess;
+    EXPECT_TRUE(writer.Write(&data[offset], size, &error));
+    offset += size;
+  }
+  g_main_loop_run(loop_);
+  EXPECT_TRUE(writer.idle());
+  EXPECT_TRUE(memory_writer.data_ == data);
+  EXPECT_EQ(0, writer.Close());
+  EXPECT_TRUE(memory_writer.closed_);
+}
+
+TEST_F(QueuedFileWriterTest, FullTest) {
+  vector<char> data(QueuedFileWriter::kMaxQueuedBytes);
+  FillWithData(&data);
+  MemoryFileWriter memory_writer;
+  QueuedFileWriterTestDelegate delegate(loop_);
+  QueuedFileWriter writer(&memory_writer, &delegate);
+  EXPECT_EQ(0, writer.Open("/dev/null", O_WRONLY, 0644));
+  memory_writer.Hold(true);
+  EXPECT_TRUE(writer.Write(&data[0], data.size() - 1));
+  EXPECT_FALSE(writer.full());
+  EXPECT_FALSE(writer.idle());
+  EXPECT_TRUE(writer.Write(&data[data.size() - 1], 1));
+  EXPECT_TRUE(writer.full());
+
+  // The delegate is told once there's room and everything is written.
+  memory_writer.Hold(false);
+  g_main_loop_run(loop_);
+  EXPECT_LE(1, delegate.num_calls_);
+  EXPECT_FALSE(writer.full());
+  EXPECT_TRUE(writer.idle());
+  EXPECT_TRUE(memory_writer.data_ == data);
+}
+
+TEST_F(QueuedFileWriterTest, FailureTest) {
+  vector<char> data(1024 * 1024);
+  FillWithData(&data);
+  MemoryFileWriter memory_writer;
+  memory_writer.fail_after_ = data.size() / 2;
+  QueuedFileWriterTestDelegate delegate(loop_);
+  QueuedFileWriter writer(&memory_writer, &delegate);
+  EXPECT_EQ(0, writer.Open("/dev/null", O_WRONLY, 0644));
+  EXPECT_TRUE(writer.Write(&data[0], data.size()));
+  g_main_loop_run(loop_);
+
+  // The underlying writer's error is reported, by failed() and by the
+  // writes after it.
+  ActionExitCode error = kActionCodeSuccess;
+  EXPECT_TRUE(writer.failed(&error));
+  EXPECT_EQ(kActionCodeDownloadWriteError, error);
+  error = kActionCodeSuccess;
+  EXPECT_FALSE(writer.Write(&data[0], 1, &error));
+  EXPECT_EQ(kActionCodeDownloadWriteError, error);
+  EXPECT_GT(data.size(), memory_writer.data_.size());
+}
+
+TEST_F(QueuedFileWriterTest, StopTest) {
+  vector<char> data(4 * 1024 * 1024);
+  FillWithData(&data);
+  MemoryFileWriter memory_writer;
+  QueuedFileWriterTestDelegate delegate(loop_);
+  QueuedFileWriter writer(&memory_writer, &delegate);
+  EXPECT_EQ(0, writer.Open("/dev/null", O_WRONLY, 0644));
+  memory_writer.Hold(true);
+  EXPECT_TRUE(writer.Write(&data[0], data.size()));
+  // The queued data is dropped, once the chunk being written is.
+  GThread* thread = g_thread_new("release", &ReleaseSoon, &memory_writer);
+  writer.Stop();
+  g_thread_join(thread);
+  EXPECT_TRUE(writer.idle());
+  EXPECT_GT(data.size(), memory_writer.data_.size());
+  EXPECT_FALSE(memory_writer.closed_);
+  // Nothing is left to report.
+  EXPECT_FALSE(g_main_context_iteration(NULL, FALSE));
+  EXPECT_EQ(0, delegate.num_calls_);
+}
+
+}  // namespace chromeos_update_engine
@@ -7,6 +7,7 @@
 
 #include <update_engine/system_state.h>
 
+#include <update_engine/cached_prefs.h>
 #include <update_engine/connection_manager.h>
 #include <update_engine/payload_state.h>
 #include <update_engine/prefs.h>
@@ -41,12 +42,12 @@ public:
   }
 
   virtual inline PrefsInterface* prefs() {
-    return &prefs_;
+    return &cached_prefs_;
   }
 
-  virtual inline PayloadStateInterface* payload_state() {
-    return &payload_state_;
-  }
+  // The payload state is loaded from the prefs on first use, as it isn't
+  // needed to answer the D-Bus status queries made at boot.
+  virtual PayloadStateInterface* payload_state();
 
   virtual inline UpdateAttempter* update_attempter() {
     return update_attempter_.get();
@@ -73,9 +74,14 @@ private:
   // Interface for persisted store.
   Prefs prefs_;
 
+  // The in-memory cache in front of |prefs_| that the rest of the code
+  // goes through. It's flushed from the main loop after each change.
+  CachedPrefs cached_prefs_;
+
   // All state pertaining to payload state such as
   // response, URL, backoff states.
   PayloadState payload_state_;
+  bool payload_state_initialized_;
 
   // The dbus object used to initialize the update attempter.
   ConcreteDbusGlib dbus_;
@@ -0,0 +1,107 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/release_watcher.h"
+
+#include <algorithm>
+
+#include <base/logging.h>
+
+#include "update_engine/http_common.h"
+#include "update_engine/omaha_request_params.h"
+
+using base::TimeDelta;
+using base::TimeTicks;
+using std::max;
+using std::min;
+using std::string;
+
+namespace chromeos_update_engine {
+
+// Keeps a server that answers right away, rather than holding the
+// requests, from being flooded.
+const int ReleaseWatcher::kMinPollIntervalSeconds = 15;
+const int ReleaseWatcher::kMinRetryDelaySeconds = 60;
+const int ReleaseWatcher::kMaxRetryDelaySeconds = 30 * 60;
+
+ReleaseWatcher::ReleaseWatcher(UpdateCheckScheduler* scheduler,
+                               SystemState* system_state,
+                               HttpFetcher* fetcher,
+                               const string& url)
+    : scheduler_(scheduler),
+      system_state_(system_state),
+      fetcher_(fetcher),
+      url_(url),
+      min_poll_interval_(kMinPollIntervalSeconds),
+      retry_delay_(kMinRetryDelaySeconds),
+      poll_source_id_(0) {
+  fetcher_->set_delegate(this);
+}
+
+ReleaseWatcher::~ReleaseWatcher() {
+  if (poll_source_id_)
+    g_source_remove(poll_source_id_);
+}
+
+void ReleaseWatcher::Start() {
+  LOG(INFO) << "Watching " << url_ << " for releases.";
+  Poll();
+}
+
+void ReleaseWatcher::Poll() {
+  // A change of channel makes the last release irrelevant.
+  const string channel = system_state_->request_params()->app_channel();
+  if (channel != channel_) {
+    channel_ = channel;
+    etag_.clear();
+  }
+  const char separator = url_.find('?') == string::npos ? '?' : '&';
+  fetcher_->set_if_none_match(etag_);
+  poll_time_ = TimeTicks::Now();
+  fetcher_->BeginTransfer(url_ + separator + "track=" + channel_);
+}
+
+gboolean ReleaseWatcher::StaticPoll(gpointer data) {
+  ReleaseWatcher* watcher = reinterpret_cast<ReleaseWatcher*>(data);
+  watcher->poll_source_id_ = 0;
+  watcher->Poll();
+  return FALSE;  // Don't call this callback again.
+}
+
+void ReleaseWatcher::SchedulePoll(int seconds) {
+  if (!poll_source_id_) {
+    poll_source_id_ = g_timeout_add_seconds(
+        seconds, &ReleaseWatcher::StaticPoll, this);
+  }
+}
+
+void ReleaseWatcher::TransferComplete(HttpFetcher* fetcher, bool successful) {
+  const int code = fetcher->http_response_code();
+  if (code != kHttpResponseOk && code != kHttpResponseNotModified) {
+    // Back to polling until the server answers again.
+    LOG(WARNING) << "Unable to watch for releases (HTTP response code "
+                 << code << "), retrying in " << retry_delay_ << " seconds.";
+    scheduler_->set_push_active(false);
+    SchedulePoll(max(retry_delay_, fetcher->response_retry_after()));
+    retry_delay_ = min(2 * retry_delay_, kMaxRetryDelaySeconds);
+    return;
+  }
+  scheduler_->set_push_active(true);
+  retry_delay_ = kMinRetryDelaySeconds;
+  const string& etag = fetcher->response_etag();
+  if (code == kHttpResponseOk && etag != etag_) {
+    // The first answer is the current release, which the periodic checks
+    // have taken care of.
+    if (!etag_.empty()) {
+      LOG(INFO) << "A new release is available on the " << channel_
+                << " channel.";
+      scheduler_->ReleasePushed();
+    }
+    etag_ = etag;
+  }
+  const int elapsed = (TimeTicks::Now() - poll_time_).InSeconds();
+  SchedulePoll(max(0, min_poll_interval_ - elapsed));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,94 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_RELEASE_WATCHER_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_RELEASE_WATCHER_H__
+
+#include <string>
+
+#include <base/basictypes.h>
+#include <base/memory/scoped_ptr.h>
+#include <base/time.h>
+#include <glib.h>
+
+#include "update_engine/http_fetcher.h"
+#include "update_engine/system_state.h"
+#include "update_engine/update_check_scheduler.h"
+
+// Long-polls the server for the releases of the device's channel, so that
+// the update checks happen when there's a release rather than on a timer.
+// The watcher GETs its URL with the channel as the "track" parameter and,
+// but for the first request, the ETag of the last response in an
+// If-None-Match header. The server holds the request until the channel's
+// release changes, and answers with the new release's ETag, or answers 304
+// Not Modified after about a minute, which must be under the transfers' 90
+// second low speed timeout. Either way the next request follows right away.
+// A changed ETag makes the UpdateCheckScheduler check for the update within
+// a couple of minutes, and it only polls every few hours while the watcher
+// gets answers. Failures are retried with exponential backoff.
+
+namespace chromeos_update_engine {
+
+class ReleaseWatcher : public HttpFetcherDelegate {
+ public:
+  // The shortest time between two requests, and the delays before the
+  // retries of a failed one.
+  static const int kMinPollIntervalSeconds;
+  static const int kMinRetryDelaySeconds;
+  static const int kMaxRetryDelaySeconds;
+
+  // Watches |url| with |fetcher|, which it takes ownership of, and tells
+  // |scheduler|, which must outlive it, about the releases.
+  ReleaseWatcher(UpdateCheckScheduler* scheduler,
+                 SystemState* system_state,
+                 HttpFetcher* fetcher,
+                 const std::string& url);
+  virtual ~ReleaseWatcher();
+
+  // Sends the first request.
+  void Start();
+
+  // Overrides kMinPollIntervalSeconds. Useful for testing.
+  void set_min_poll_interval(int seconds) { min_poll_interval_ = seconds; }
+
+  // HttpFetcherDelegate methods. The response body isn't needed.
+  virtual void ReceivedBytes(HttpFetcher* fetcher,
+                             const char* bytes,
+                             int length) {}
+  virtual void TransferComplete(HttpFetcher* fetcher, bool successful);
+
+ private:
+  // Sends the next request.
+  void Poll();
+  static gboolean StaticPoll(gpointer data);
+
+  // Sends the next request in |seconds|.
+  void SchedulePoll(int seconds);
+
+  UpdateCheckScheduler* scheduler_;
+  SystemState* system_state_;
+  scoped_ptr<HttpFetcher> fetcher_;
+  std::string url_;
+
+  // The channel and the ETag of the last response, which the next request
+  // waits for a change of.
+  std::string channel_;
+  std::string etag_;
+
+  // When the last request was sent.
+  base::TimeTicks poll_time_;
+
+  int min_poll_interval_;
+  // The delay before retrying the next failed request.
+  int retry_delay_;
+
+  // The timeout source that sends the next request, or 0.
+  guint poll_source_id_;
+
+  DISALLOW_COPY_AND_ASSIGN(ReleaseWatcher);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_RELEASE_WATCHER_H__
@@ -0,0 +1,124 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <string>
+
+#include <glib.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/http_common.h"
+#include "update_engine/mock_dbus_interface.h"
+#include "update_engine/mock_system_state.h"
+#include "update_engine/release_watcher.h"
+#include "update_engine/update_attempter_mock.h"
+#include "update_engine/update_check_scheduler.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+// Records the requests and answers them as told.
+class FakeHttpFetcher : public HttpFetcher {
+ public:
+  explicit FakeHttpFetcher(SystemState* system_state)
+      : HttpFetcher(system_state),
+        transfers_(0),
+        loop_(NULL) {}
+
+  virtual void SetOffset(off_t offset) {}
+  virtual void SetLength(size_t length) {}
+  virtual void UnsetLength() {}
+  virtual void BeginTransfer(const string& url) {
+    transfers_++;
+    url_ = url;
+    if (loop_)
+      g_main_loop_quit(loop_);
+  }
+  virtual void TerminateTransfer() {}
+  virtual void Pause() {}
+  virtual void Unpause() {}
+  virtual size_t GetBytesDownloaded() { return 0; }
+
+  // Completes the transfer with |code| and |etag|, and then runs the main
+  // loop until the next one begins.
+  void Answer(int code, const string& etag, bool wait_for_next) {
+    http_response_code_ = code;
+    response_etag_ = etag;
+    const int transfers = transfers_;
+    delegate_->TransferComplete(this, code == kHttpResponseOk);
+    if (wait_for_next && transfers_ == transfers) {
+      loop_ = g_main_loop_new(g_main_context_default(), FALSE);
+      g_main_loop_run(loop_);
+      g_main_loop_unref(loop_);
+      loop_ = NULL;
+    }
+    EXPECT_EQ(wait_for_next, transfers_ > transfers);
+  }
+
+  const string& url() const { return url_; }
+  const string& if_none_match() const { return if_none_match_; }
+
+  int transfers_;
+  GMainLoop* loop_;
+};
+
+// Counts the update checks scheduled, without scheduling them.
+class CountingUpdateCheckScheduler : public UpdateCheckScheduler {
+ public:
+  CountingUpdateCheckScheduler(UpdateAttempter* update_attempter,
+                               SystemState* system_state)
+      : UpdateCheckScheduler(update_attempter, system_state),
+        scheduled_checks_(0) {}
+
+  virtual guint GTimeoutAddSeconds(guint interval, GSourceFunc function) {
+    scheduled_checks_++;
+    return 0;
+  }
+  virtual bool IsBootDeviceRemovable() { return false; }
+  virtual bool IsOfficialBuild() { return true; }
+
+  int scheduled_checks_;
+};
+}  // namespace {}
+
+TEST(ReleaseWatcherTest, WatchTest) {
+  MockSystemState mock_system_state;
+  MockDbusGlib dbus;
+  UpdateAttempterMock attempter(&mock_system_state, &dbus);
+  CountingUpdateCheckScheduler scheduler(&attempter, &mock_system_state);
+  scheduler.Run();
+  EXPECT_EQ(1, scheduler.scheduled_checks_);
+
+  FakeHttpFetcher* fetcher = new FakeHttpFetcher(&mock_system_state);
+  ReleaseWatcher watcher(&scheduler, &mock_system_state, fetcher,
+                         "http://localhost/release?v=1");
+  watcher.set_min_poll_interval(0);
+  watcher.Start();
+  EXPECT_EQ(1, fetcher->transfers_);
+  EXPECT_EQ("http://localhost/release?v=1&track=" +
+            mock_system_state.request_params()->app_channel(),
+            fetcher->url());
+  EXPECT_EQ("", fetcher->if_none_match());
+
+  // The first answer is the current release.
+  fetcher->Answer(kHttpResponseOk, "\"1\"", true);
+  EXPECT_TRUE(scheduler.push_active());
+  EXPECT_EQ("\"1\"", fetcher->if_none_match());
+  fetcher->Answer(kHttpResponseNotModified, "", true);
+  EXPECT_EQ("\"1\"", fetcher->if_none_match());
+  EXPECT_EQ(1, scheduler.scheduled_checks_);
+
+  // A new one brings the update check forward.
+  fetcher->Answer(kHttpResponseOk, "\"2\"", true);
+  EXPECT_EQ("\"2\"", fetcher->if_none_match());
+  EXPECT_EQ(2, scheduler.scheduled_checks_);
+
+  // A failure is retried later on, and the periodic checks take over.
+  fetcher->Answer(kHttpResponseServiceUnavailable, "", false);
+  EXPECT_FALSE(scheduler.push_active());
+  EXPECT_EQ(2, scheduler.scheduled_checks_);
+}
+
+}  // namespace chromeos_update_engine
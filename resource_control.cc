@@ -0,0 +1,263 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/resource_control.h"
+
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <base/logging.h>
+#include <base/string_number_conversions.h>
+#include <base/string_split.h>
+#include <base/string_util.h>
+#include <base/stringprintf.h>
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+const double ResourceControl::kCapIoPressure = 20.0;
+const double ResourceControl::kUncapIoPressure = 5.0;
+// Well above the pressure at which the I/O is capped, which should usually
+// be enough to relieve it.
+const double ResourceControl::kPausePressure = 50.0;
+const double ResourceControl::kResumePressure = 10.0;
+const uint64_t ResourceControl::kCappedIoBytesPerSecond =
+    8 * 1024 * 1024;  // 8 MiB
+const uint64_t ResourceControl::kBackgroundMemoryHigh =
+    512 * 1024 * 1024;  // 512 MiB
+
+namespace {
+const char kCGroupRoot[] = "/sys/fs/cgroup";
+const char kProcDir[] = "/proc";
+
+// Sets |avg10| to the avg10 value of the "some" line of the pressure stall
+// information in |contents|. Returns false if there's none.
+bool ParseSomeAvg10(const string& contents, double* avg10) {
+  vector<string> lines;
+  base::SplitString(contents, '\n', &lines);
+  for (vector<string>::const_iterator it = lines.begin();
+       it != lines.end(); ++it) {
+    if (!StartsWithASCII(*it, "some ", true))
+      continue;
+    const size_t pos = it->find("avg10=");
+    if (pos == string::npos)
+      return false;
+    const char* start = it->c_str() + pos + strlen("avg10=");
+    char* end = NULL;
+    *avg10 = strtod(start, &end);
+    return end != start;
+  }
+  return false;
+}
+}  // namespace {}
+
+ResourceControl::ResourceControl()
+    : cgroup_root_(kCGroupRoot),
+      proc_dir_(kProcDir),
+      shares_(utils::kCpuSharesNormal),
+      io_capped_(false),
+      paused_(false) {
+  FindCGroup();
+}
+
+ResourceControl::ResourceControl(const string& cgroup_root,
+                                 const string& proc_dir)
+    : cgroup_root_(cgroup_root),
+      proc_dir_(proc_dir),
+      shares_(utils::kCpuSharesNormal),
+      io_capped_(false),
+      paused_(false) {
+  FindCGroup();
+}
+
+void ResourceControl::FindCGroup() {
+  struct stat stbuf;
+  if (stat((cgroup_root_ + "/cgroup.controllers").c_str(), &stbuf) != 0)
+    return;
+  // On the unified hierarchy, the process's cgroup is on the "0::" line.
+  string contents;
+  if (!utils::ReadFile(proc_dir_ + "/self/cgroup", &contents)) {
+    LOG(WARNING) << "Unable to find the cgroup of the process.";
+    return;
+  }
+  vector<string> lines;
+  base::SplitString(contents, '\n', &lines);
+  for (vector<string>::const_iterator it = lines.begin();
+       it != lines.end(); ++it) {
+    if (StartsWithASCII(*it, "0::/", true)) {
+      cgroup_dir_ = cgroup_root_ + it->substr(strlen("0::"));
+      // The root cgroup has no weights or limits.
+      if (*it == "0::/")
+        cgroup_dir_.clear();
+      break;
+    }
+  }
+  LOG(INFO) << "Using cgroup v2 directory "
+            << (cgroup_dir_.empty() ? "(none)" : cgroup_dir_);
+}
+
+bool ResourceControl::WriteCGroupFile(const string& name,
+                                      const string& value) {
+  const string path = cgroup_dir_ + "/" + name;
+  if (!utils::WriteFile(path.c_str(), value.data(), value.size())) {
+    LOG(WARNING) << "Unable to write " << value << " to " << path;
+    return false;
+  }
+  return true;
+}
+
+bool ResourceControl::SetProfile(utils::CpuShares shares) {
+  shares_ = shares;
+  if (shares != utils::kCpuSharesLow)
+    paused_ = false;
+  if (cgroup_dir_.empty())
+    return utils::SetCpuShares(shares);
+
+  // The weights range from 1 to 10000, 100 being the default.
+  string weight = "100";
+  string memory_high = "max";
+  if (shares == utils::kCpuSharesLow) {
+    weight = "1";
+    memory_high = base::Uint64ToString(kBackgroundMemoryHigh);
+  } else if (shares == utils::kCpuSharesHigh) {
+    weight = "200";
+  }
+  LOG(INFO) << "Setting the cgroup weights to " << weight
+            << " and memory.high to " << memory_high;
+  bool success = WriteCGroupFile("cpu.weight", weight);
+  success = WriteCGroupFile("io.weight", "default " + weight) && success;
+  success = WriteCGroupFile("memory.high", memory_high) && success;
+  if (shares != utils::kCpuSharesLow && io_capped_)
+    success = SetIoCapped(false) && success;
+  return success;
+}
+
+bool ResourceControl::SetIoDevice(const string& device) {
+  if (io_capped_)
+    SetIoCapped(false);
+  io_device_number_.clear();
+  struct stat stbuf;
+  if (stat(device.c_str(), &stbuf) != 0) {
+    PLOG(WARNING) << "Unable to stat " << device;
+    return false;
+  }
+  io_device_number_ = StringPrintf("%u:%u",
+                                   major(stbuf.st_rdev),
+                                   minor(stbuf.st_rdev));
+  return true;
+}
+
+bool ResourceControl::SetIoCapped(bool capped) {
+  const string limit = capped ?
+      base::Uint64ToString(kCappedIoBytesPerSecond) : string("max");
+  LOG(INFO) << (capped ? "Capping" : "Uncapping") << " the bandwidth of "
+            << io_device_number_;
+  TEST_AND_RETURN_FALSE(WriteCGroupFile(
+      "io.max",
+      io_device_number_ + " rbps=" + limit + " wbps=" + limit));
+  io_capped_ = capped;
+  return true;
+}
+
+bool ResourceControl::ReadForegroundPressure(const string& resource,
+                                             double* pressure) {
+  bool found = false;
+  *pressure = 0.0;
+  string dir = cgroup_dir_;
+  while (dir.size() > cgroup_root_.size()) {
+    const string parent = dir.substr(0, dir.rfind('/'));
+    DIR* parent_dir = opendir(parent.c_str());
+    if (!parent_dir) {
+      PLOG(WARNING) << "Unable to open " << parent;
+      break;
+    }
+    struct dirent* entry = NULL;
+    while ((entry = readdir(parent_dir)) != NULL) {
+      const string child = parent + "/" + entry->d_name;
+      if (entry->d_name[0] == '.' || child == dir)
+        continue;
+      string contents;
+      double avg10 = 0.0;
+      if (utils::ReadFile(child + "/" + resource + ".pressure", &contents) &&
+          ParseSomeAvg10(contents, &avg10)) {
+        found = true;
+        *pressure = std::max(*pressure, avg10);
+      }
+    }
+    closedir(parent_dir);
+    dir = parent;
+  }
+  return found;
+}
+
+bool ResourceControl::ReadPausePressure(double* pressure) {
+  const char* kResources[] = { "cpu", "io", "memory" };
+  bool found = false;
+  *pressure = 0.0;
+  for (size_t i = 0; i < arraysize(kResources); i++) {
+    double resource_pressure = 0.0;
+    if (cgroup_dir_.empty()) {
+      string contents;
+      if (!utils::ReadFile(proc_dir_ + "/pressure/" + kResources[i],
+                           &contents) ||
+          !ParseSomeAvg10(contents, &resource_pressure))
+        continue;
+    } else if (!ReadForegroundPressure(kResources[i], &resource_pressure)) {
+      continue;
+    }
+    found = true;
+    *pressure = std::max(*pressure, resource_pressure);
+  }
+  return found;
+}
+
+void ResourceControl::UpdatePaused() {
+  if (shares_ != utils::kCpuSharesLow) {
+    paused_ = false;
+    return;
+  }
+  double pressure = 0.0;
+  if (!ReadPausePressure(&pressure))
+    return;
+  if (!paused_ && pressure >= kPausePressure) {
+    LOG(INFO) << "The system stalls " << pressure << "% of the time, "
+              << "pausing the update.";
+    paused_ = true;
+  } else if (paused_ && pressure < kResumePressure) {
+    LOG(INFO) << "Resuming the update.";
+    paused_ = false;
+  }
+}
+
+void ResourceControl::UpdateForLoad() {
+  UpdatePaused();
+  if (cgroup_dir_.empty() || io_device_number_.empty())
+    return;
+  if (shares_ != utils::kCpuSharesLow) {
+    if (io_capped_)
+      SetIoCapped(false);
+    return;
+  }
+  double pressure = 0.0;
+  if (!ReadForegroundPressure("io", &pressure))
+    return;
+  if (!io_capped_ && pressure >= kCapIoPressure) {
+    LOG(INFO) << "Other processes stall on I/O " << pressure
+              << "% of the time.";
+    SetIoCapped(true);
+  } else if (io_capped_ && pressure < kUncapIoPressure) {
+    SetIoCapped(false);
+  }
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,131 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_RESOURCE_CONTROL_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_RESOURCE_CONTROL_H__
+
+#include <string>
+
+#include <base/basictypes.h>
+
+#include "update_engine/utils.h"
+
+// Limits the resources taken by update_engine, and by the subprocesses it
+// runs, such as bspatch and the postinstall step, which inherit its cgroup,
+// while an update is applied in the background.
+//
+// On the unified cgroup v2 hierarchy, the cpu.weight, io.weight and
+// memory.high of the cgroup the process is in are set, and while a
+// background update runs, the bandwidth of the disk it's installed to is
+// capped in io.max whenever the pressure stall information of the other
+// cgroups shows them waiting on I/O. On the legacy hierarchy, only the
+// cpu.shares of the update-engine cpu cgroup are set. All the settings are
+// best effort: the cgroup may not be writable, or lack a controller.
+//
+// A background update is also paused altogether while the rest of the
+// system stalls on CPU, I/O or memory most of the time, as the cgroups
+// other than the process's report, or /proc/pressure on the legacy
+// hierarchy, until the pressure has been low for a while.
+
+namespace chromeos_update_engine {
+
+class ResourceControl {
+ public:
+  ResourceControl();
+
+  // Uses the cgroup hierarchy mounted at |cgroup_root| and the procfs
+  // mounted at |proc_dir|, for testing.
+  ResourceControl(const std::string& cgroup_root, const std::string& proc_dir);
+
+  // Applies the profile of |shares|: kCpuSharesLow for background updates,
+  // kCpuSharesNormal for none and kCpuSharesHigh for urgent ones. Returns
+  // true if all of its settings were applied.
+  bool SetProfile(utils::CpuShares shares);
+
+  // Makes |device|, a whole disk, the one whose bandwidth is capped under
+  // I/O pressure. Returns false if it can't be found.
+  bool SetIoDevice(const std::string& device);
+
+  // Caps the bandwidth of the I/O device if the background profile is on
+  // and the other cgroups have been stalling on I/O, or lifts the cap once
+  // they aren't, and likewise pauses or resumes the update for the CPU, I/O
+  // and memory pressure. Meant to be called every few seconds.
+  void UpdateForLoad();
+
+  // Returns true if the bandwidth of the I/O device is capped.
+  bool io_capped() const { return io_capped_; }
+
+  // Returns true if the update should be paused.
+  bool paused() const { return paused_; }
+
+  // The share of the last 10 seconds, in percent, during which some
+  // processes of another cgroup stalled on I/O above which the bandwidth is
+  // capped, and below which it's no longer capped.
+  static const double kCapIoPressure;
+  static const double kUncapIoPressure;
+
+  // The share of the last 10 seconds, in percent, during which some
+  // processes of the rest of the system stalled on CPU, I/O or memory above
+  // which the update is paused, and below which it's resumed.
+  static const double kPausePressure;
+  static const double kResumePressure;
+
+  // The read and write bandwidth the I/O device is capped to.
+  static const uint64_t kCappedIoBytesPerSecond;
+
+  // The memory the process and its children may use before the kernel
+  // throttles them to reclaim it, in the background profile.
+  static const uint64_t kBackgroundMemoryHigh;
+
+ private:
+  // Finds the cgroup v2 directory of the process, if the unified hierarchy
+  // is in use, and sets |cgroup_dir_|.
+  void FindCGroup();
+
+  // Writes |value| to the |name| interface file of the process's cgroup.
+  // Returns true on success.
+  bool WriteCGroupFile(const std::string& name, const std::string& value);
+
+  // Caps the bandwidth of the I/O device if |capped|, or lifts the cap.
+  bool SetIoCapped(bool capped);
+
+  // Sets |pressure| to the highest "some" avg10 pressure of |resource|,
+  // "cpu", "io" or "memory", of the cgroups that are siblings of the
+  // process's cgroup or of one of its ancestors, i.e., of the rest of the
+  // system without the process's own stalls. Returns false if none is
+  // reported.
+  bool ReadForegroundPressure(const std::string& resource, double* pressure);
+
+  // Sets |pressure| to the highest "some" avg10 pressure of the CPU, I/O
+  // and memory of the rest of the system, or of the whole system on the
+  // legacy hierarchy. Returns false if none is reported.
+  bool ReadPausePressure(double* pressure);
+
+  // Pauses the update if the background profile is on and the system is
+  // under pressure, or resumes it once it isn't.
+  void UpdatePaused();
+
+  const std::string cgroup_root_;
+  const std::string proc_dir_;
+
+  // The cgroup v2 directory of the process, or empty on the legacy
+  // hierarchy.
+  std::string cgroup_dir_;
+
+  // The profile in effect.
+  utils::CpuShares shares_;
+
+  // The "MAJ:MIN" number of the I/O device, or empty if none is set.
+  std::string io_device_number_;
+  bool io_capped_;
+
+  // See paused().
+  bool paused_;
+
+  DISALLOW_COPY_AND_ASSIGN(ResourceControl);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_RESOURCE_CONTROL_H__
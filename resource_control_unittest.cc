@@ -0,0 +1,176 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <string>
+
+#include <base/string_number_conversions.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/resource_control.h"
+#include "update_engine/test_utils.h"
+#include "update_engine/utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+// Lays out a unified cgroup hierarchy with the process in
+// /system.slice/update-engine.service, next to foo.service, and a procfs for
+// it.
+class ResourceControlTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    ASSERT_TRUE(utils::MakeTempDirectory("/tmp/ResourceControlTest.XXXXXX",
+                                         &root_));
+    cgroup_root_ = root_ + "/cgroup";
+    cgroup_dir_ = cgroup_root_ + "/system.slice/update-engine.service";
+    foo_dir_ = cgroup_root_ + "/system.slice/foo.service";
+    const char* kDirs[] = { "/cgroup", "/cgroup/system.slice",
+                            "/cgroup/system.slice/update-engine.service",
+                            "/cgroup/system.slice/foo.service",
+                            "/proc", "/proc/self" };
+    for (size_t i = 0; i < arraysize(kDirs); i++)
+      ASSERT_EQ(0, mkdir((root_ + kDirs[i]).c_str(), 0755));
+    ASSERT_TRUE(WriteFileString(cgroup_root_ + "/cgroup.controllers",
+                                "cpu io memory\n"));
+    ASSERT_TRUE(WriteFileString(
+        root_ + "/proc/self/cgroup",
+        "0::/system.slice/update-engine.service\n"));
+  }
+
+  virtual void TearDown() {
+    EXPECT_TRUE(utils::RecursiveUnlinkDir(root_));
+  }
+
+  // Writes the pressure stall information file |path|.
+  void WritePressure(const string& path, const string& avg10) {
+    EXPECT_TRUE(WriteFileString(
+        path,
+        "some avg10=" + avg10 + " avg60=0.00 avg300=0.00 total=0\n"
+        "full avg10=0.00 avg60=0.00 avg300=0.00 total=0\n"));
+  }
+
+  // Sets the I/O pressure of |dir|.
+  void SetIoPressure(const string& dir, const string& avg10) {
+    WritePressure(dir + "/io.pressure", avg10);
+  }
+
+  string ReadCGroupFile(const string& name) {
+    string contents;
+    EXPECT_TRUE(utils::ReadFile(cgroup_dir_ + "/" + name, &contents));
+    return contents;
+  }
+
+  string root_;
+  string cgroup_root_;
+  string cgroup_dir_;
+  string foo_dir_;
+};
+
+TEST_F(ResourceControlTest, ProfilesTest) {
+  ResourceControl control(cgroup_root_, root_ + "/proc");
+  EXPECT_TRUE(control.SetProfile(utils::kCpuSharesLow));
+  EXPECT_EQ("1", ReadCGroupFile("cpu.weight"));
+  EXPECT_EQ("default 1", ReadCGroupFile("io.weight"));
+  EXPECT_EQ(base::Uint64ToString(ResourceControl::kBackgroundMemoryHigh),
+            ReadCGroupFile("memory.high"));
+
+  EXPECT_TRUE(control.SetProfile(utils::kCpuSharesHigh));
+  EXPECT_EQ("200", ReadCGroupFile("cpu.weight"));
+  EXPECT_EQ("default 200", ReadCGroupFile("io.weight"));
+  EXPECT_EQ("max", ReadCGroupFile("memory.high"));
+
+  EXPECT_TRUE(control.SetProfile(utils::kCpuSharesNormal));
+  EXPECT_EQ("100", ReadCGroupFile("cpu.weight"));
+  EXPECT_EQ("default 100", ReadCGroupFile("io.weight"));
+}
+
+TEST_F(ResourceControlTest, IoPressureTest) {
+  ResourceControl control(cgroup_root_, root_ + "/proc");
+  ASSERT_TRUE(control.SetIoDevice("/dev/null"));
+  EXPECT_TRUE(control.SetProfile(utils::kCpuSharesLow));
+
+  // The process's own stalls don't count.
+  SetIoPressure(cgroup_dir_, "90.00");
+  SetIoPressure(foo_dir_, "1.00");
+  control.UpdateForLoad();
+  EXPECT_FALSE(control.io_capped());
+
+  // Another service stalling caps the bandwidth of the device.
+  SetIoPressure(foo_dir_, "30.00");
+  control.UpdateForLoad();
+  EXPECT_TRUE(control.io_capped());
+  const string capped = base::Uint64ToString(
+      ResourceControl::kCappedIoBytesPerSecond);
+  EXPECT_EQ("1:3 rbps=" + capped + " wbps=" + capped,
+            ReadCGroupFile("io.max"));
+
+  // It stays capped until the pressure is well down.
+  SetIoPressure(foo_dir_, "10.00");
+  control.UpdateForLoad();
+  EXPECT_TRUE(control.io_capped());
+  SetIoPressure(foo_dir_, "2.00");
+  control.UpdateForLoad();
+  EXPECT_FALSE(control.io_capped());
+  EXPECT_EQ("1:3 rbps=max wbps=max", ReadCGroupFile("io.max"));
+
+  // Leaving the background profile lifts the cap.
+  SetIoPressure(foo_dir_, "30.00");
+  control.UpdateForLoad();
+  EXPECT_TRUE(control.io_capped());
+  EXPECT_TRUE(control.SetProfile(utils::kCpuSharesNormal));
+  EXPECT_FALSE(control.io_capped());
+  control.UpdateForLoad();
+  EXPECT_FALSE(control.io_capped());
+}
+
+TEST_F(ResourceControlTest, PausePressureTest) {
+  ResourceControl control(cgroup_root_, root_ + "/proc");
+  WritePressure(cgroup_dir_ + "/cpu.pressure", "90.00");
+  WritePressure(foo_dir_ + "/cpu.pressure", "60.00");
+  WritePressure(foo_dir_ + "/memory.pressure", "1.00");
+
+  // Only background updates are paused.
+  control.UpdateForLoad();
+  EXPECT_FALSE(control.paused());
+  EXPECT_TRUE(control.SetProfile(utils::kCpuSharesLow));
+  control.UpdateForLoad();
+  EXPECT_TRUE(control.paused());
+
+  // They're resumed once the pressure is well down.
+  WritePressure(foo_dir_ + "/cpu.pressure", "20.00");
+  control.UpdateForLoad();
+  EXPECT_TRUE(control.paused());
+  WritePressure(foo_dir_ + "/cpu.pressure", "5.00");
+  control.UpdateForLoad();
+  EXPECT_FALSE(control.paused());
+
+  WritePressure(foo_dir_ + "/memory.pressure", "70.00");
+  control.UpdateForLoad();
+  EXPECT_TRUE(control.paused());
+  EXPECT_TRUE(control.SetProfile(utils::kCpuSharesHigh));
+  EXPECT_FALSE(control.paused());
+}
+
+TEST_F(ResourceControlTest, LegacyPausePressureTest) {
+  // Without the unified hierarchy, the pressure of the whole system counts.
+  ASSERT_EQ(0, unlink((cgroup_root_ + "/cgroup.controllers").c_str()));
+  ASSERT_EQ(0, mkdir((root_ + "/proc/pressure").c_str(), 0755));
+  WritePressure(root_ + "/proc/pressure/cpu", "1.00");
+  WritePressure(root_ + "/proc/pressure/io", "55.00");
+  WritePressure(root_ + "/proc/pressure/memory", "0.00");
+  ResourceControl control(cgroup_root_, root_ + "/proc");
+  control.SetProfile(utils::kCpuSharesLow);
+  control.UpdateForLoad();
+  EXPECT_TRUE(control.paused());
+  WritePressure(root_ + "/proc/pressure/io", "9.00");
+  control.UpdateForLoad();
+  EXPECT_FALSE(control.paused());
+}
+
+}  // namespace chromeos_update_engine
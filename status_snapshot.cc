@@ -0,0 +1,65 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/status_snapshot.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+using std::min;
+using std::string;
+
+namespace chromeos_update_engine {
+
+const size_t StatusSnapshot::kMaxVersionSize;
+const size_t StatusSnapshot::kNumWords;
+
+StatusSnapshot::StatusSnapshot() : sequence_(0) {
+  memset(words_, 0, sizeof(words_));
+}
+
+void StatusSnapshot::Publish(int64_t last_checked_time,
+                             double progress,
+                             int status,
+                             const string& new_version,
+                             int64_t new_payload_size) {
+  Status snapshot;
+  memset(&snapshot, 0, sizeof(snapshot));
+  snapshot.last_checked_time = last_checked_time;
+  snapshot.progress = progress;
+  snapshot.status = status;
+  snapshot.new_payload_size = new_payload_size;
+  const size_t version_size = min(new_version.size(), kMaxVersionSize);
+  memcpy(snapshot.new_version, new_version.data(), version_size);
+  uint64_t words[kNumWords];
+  memset(words, 0, sizeof(words));
+  memcpy(words, &snapshot, sizeof(snapshot));
+
+  const uint32_t sequence = __atomic_load_n(&sequence_, __ATOMIC_RELAXED);
+  __atomic_store_n(&sequence_, sequence + 1, __ATOMIC_RELAXED);
+  // The odd sequence number is visible before any of the new words.
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  for (size_t i = 0; i < kNumWords; i++)
+    __atomic_store_n(&words_[i], words[i], __ATOMIC_RELAXED);
+  __atomic_store_n(&sequence_, sequence + 2, __ATOMIC_RELEASE);
+}
+
+void StatusSnapshot::Read(Status* status) const {
+  uint64_t words[kNumWords];
+  for (;;) {
+    const uint32_t sequence = __atomic_load_n(&sequence_, __ATOMIC_ACQUIRE);
+    if (sequence & 1)
+      continue;  // The writer is halfway through.
+    for (size_t i = 0; i < kNumWords; i++)
+      words[i] = __atomic_load_n(&words_[i], __ATOMIC_RELAXED);
+    // The words are read before the sequence number is checked again.
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&sequence_, __ATOMIC_RELAXED) == sequence)
+      break;
+  }
+  memcpy(status, words, sizeof(*status));
+}
+
+}  // namespace chromeos_update_engine
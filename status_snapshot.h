@@ -0,0 +1,62 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_STATUS_SNAPSHOT_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_STATUS_SNAPSHOT_H__
+
+#include <string>
+
+#include <base/basictypes.h>
+
+// The status of the update as GetStatus() reports it, published as a whole
+// by one thread and read by any without taking a lock, through a sequence
+// lock: the writer bumps a sequence number to odd before it changes the
+// fields and to even after, and a reader copies the fields and tries again
+// if the number was odd or changed meanwhile. A reader that catches a write
+// in progress retries until the writer is done, so it may spin for as long
+// as a write takes, or longer if the writer is descheduled in the middle of
+// one, but never blocks on a lock. The writer never waits for readers.
+
+namespace chromeos_update_engine {
+
+class StatusSnapshot {
+ public:
+  // The longest version that's kept whole.
+  static const size_t kMaxVersionSize = 63;
+
+  struct Status {
+    int64_t last_checked_time;
+    double progress;
+    int status;  // An UpdateStatus.
+    int64_t new_payload_size;
+    char new_version[kMaxVersionSize + 1];
+  };
+
+  StatusSnapshot();
+
+  // Replaces the snapshot. Must only be called by one thread at a time.
+  void Publish(int64_t last_checked_time,
+               double progress,
+               int status,
+               const std::string& new_version,
+               int64_t new_payload_size);
+
+  // Copies the last snapshot published into |status|, from any thread.
+  void Read(Status* status) const;
+
+ private:
+  // |status_| as the words it's copied by, each of them atomically, so that
+  // a reader racing the writer only gets a torn copy it throws away.
+  static const size_t kNumWords = (sizeof(Status) + 7) / 8;
+
+  // Odd while the writer changes |words_|.
+  uint32_t sequence_;
+  uint64_t words_[kNumWords];
+
+  DISALLOW_COPY_AND_ASSIGN(StatusSnapshot);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_STATUS_SNAPSHOT_H__
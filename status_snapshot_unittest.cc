@@ -0,0 +1,79 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <glib.h>
+
+#include <string>
+
+#include <base/string_number_conversions.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/status_snapshot.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+const int kNumPublishes = 100000;
+
+// Publishes snapshots whose fields all derive from one number, for the
+// readers to check that they never get a mix of two.
+gpointer PublishSnapshots(gpointer data) {
+  StatusSnapshot* snapshot = reinterpret_cast<StatusSnapshot*>(data);
+  for (int i = 1; i <= kNumPublishes; i++)
+    snapshot->Publish(i, i / 2.0, i % 7, base::IntToString(i), -i);
+  return NULL;
+}
+
+}  // namespace {}
+
+TEST(StatusSnapshotTest, SimpleTest) {
+  StatusSnapshot snapshot;
+  StatusSnapshot::Status status;
+  snapshot.Read(&status);
+  EXPECT_EQ(0, status.last_checked_time);
+  EXPECT_EQ(0.0, status.progress);
+  EXPECT_EQ(0, status.status);
+  EXPECT_EQ(0, status.new_payload_size);
+  EXPECT_EQ("", string(status.new_version));
+
+  snapshot.Publish(1234, 0.5, 3, "1.2.3.4", 5678);
+  snapshot.Read(&status);
+  EXPECT_EQ(1234, status.last_checked_time);
+  EXPECT_EQ(0.5, status.progress);
+  EXPECT_EQ(3, status.status);
+  EXPECT_EQ(5678, status.new_payload_size);
+  EXPECT_EQ("1.2.3.4", string(status.new_version));
+
+  // A version that doesn't fit is cut short.
+  snapshot.Publish(1234, 0.5, 3, string(100, 'v'), 5678);
+  snapshot.Read(&status);
+  EXPECT_EQ(string(StatusSnapshot::kMaxVersionSize, 'v'),
+            string(status.new_version));
+}
+
+TEST(StatusSnapshotTest, ConcurrentTest) {
+  StatusSnapshot snapshot;
+  GThread* thread = g_thread_new("publisher", PublishSnapshots, &snapshot);
+  int64_t last = 0;
+  while (last < kNumPublishes) {
+    StatusSnapshot::Status status;
+    snapshot.Read(&status);
+    const int64_t i = status.last_checked_time;
+    // Snapshots only move forward, and are never torn.
+    ASSERT_LE(last, i);
+    if (i > 0) {
+      ASSERT_EQ(i / 2.0, status.progress);
+      ASSERT_EQ(i % 7, status.status);
+      ASSERT_EQ(base::Int64ToString(i), string(status.new_version));
+      ASSERT_EQ(-i, status.new_payload_size);
+    }
+    last = i;
+  }
+  g_thread_join(thread);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,566 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/stream_diff.h"
+
+#include <bzlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <base/logging.h>
+
+#include "update_engine/bzip.h"
+#include "update_engine/graph_types.h"
+#include "update_engine/utils.h"
+
+using google::protobuf::RepeatedPtrField;
+using std::make_pair;
+using std::min;
+using std::pair;
+using std::upper_bound;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// A patch starts with the magic and the size of the new data, as a 64-bit
+// little-endian integer, followed by the bzip2 compressed instructions. Each
+// instruction is a varint holding its length shifted left by one, with the
+// low bit set for a COPY. A COPY is followed by the zigzag varint offset of
+// the bytes it copies from the end of the previous COPY, and an ADD by its
+// literal bytes.
+const char kStreamDiffMagic[] = "STRDIF01";
+const size_t kStreamDiffMagicSize = 8;
+const size_t kStreamDiffHeaderSize = 16;
+
+// Runs of at least this many bytes are looked up in the old data, and only
+// they are copied. The old data is indexed every kIndexStride bytes, so any
+// run of kMatchSize + kIndexStride - 1 bytes in it can be found.
+const size_t kMatchSize = 32;
+const size_t kIndexStride = 16;
+
+// The base of the polynomial rolling hash of kMatchSize bytes.
+const uint64_t kHashBase = 0x100000001b3ULL;
+
+// The new data is produced and passed to the writer in chunks of this size,
+// and the instructions are decompressed in chunks of this size.
+const size_t kStreamPatchChunkSize = 128 * 1024;
+const size_t kStreamPatchInputSize = 64 * 1024;
+
+uint64_t WindowHash(const unsigned char* data) {
+  uint64_t hash = 0;
+  for (size_t i = 0; i < kMatchSize; i++)
+    hash = hash * kHashBase + data[i];
+  return hash;
+}
+
+// Returns the hash of the window one byte after the one hashing to |hash|,
+// which starts with |out| and is followed by |in|. |base_power| is
+// kHashBase to the power of kMatchSize - 1.
+uint64_t RollHash(uint64_t hash, unsigned char out, unsigned char in,
+                  uint64_t base_power) {
+  return (hash - out * base_power) * kHashBase + in;
+}
+
+void AppendVarint(uint64_t value, vector<char>* out) {
+  while (value >= 0x80) {
+    out->push_back(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+// Changes to data of a fixed layout fewer than this many bytes apart are
+// sent together, as copying the bytes between them would take about as many
+// bytes of instructions.
+const size_t kMinInPlaceCopySize = 8;
+
+// Appends the instructions of a patch to a buffer.
+class InstructionWriter {
+ public:
+  explicit InstructionWriter(vector<char>* instructions)
+      : instructions_(instructions),
+        copy_end_(0) {}
+
+  // The end of the last copy in the old data.
+  size_t copy_end() const { return copy_end_; }
+
+  void Add(const char* literal, size_t length) {
+    if (length == 0)
+      return;
+    AppendVarint(static_cast<uint64_t>(length) << 1, instructions_);
+    instructions_->insert(instructions_->end(), literal, literal + length);
+  }
+
+  void Copy(size_t old_pos, size_t length) {
+    AppendVarint((static_cast<uint64_t>(length) << 1) | 1, instructions_);
+    const int64_t delta =
+        static_cast<int64_t>(old_pos) - static_cast<int64_t>(copy_end_);
+    AppendVarint((static_cast<uint64_t>(delta) << 1) ^
+                 static_cast<uint64_t>(delta >> 63), instructions_);
+    copy_end_ = old_pos + length;
+  }
+
+ private:
+  vector<char>* instructions_;
+  size_t copy_end_;
+
+  DISALLOW_COPY_AND_ASSIGN(InstructionWriter);
+};
+
+// Stores in |out_patch| the patch of the |instructions| that produce
+// |new_size| bytes.
+bool MakePatch(const vector<char>& instructions,
+               uint64_t new_size,
+               vector<char>* out_patch) {
+  vector<char> compressed;
+  TEST_AND_RETURN_FALSE(BzipCompressBytes(
+      instructions.empty() ? NULL : &instructions[0], instructions.size(),
+      &compressed));
+
+  out_patch->assign(kStreamDiffMagic, kStreamDiffMagic + kStreamDiffMagicSize);
+  for (int i = 0; i < 8; i++) {
+    out_patch->push_back(static_cast<char>(new_size & 0xff));
+    new_size >>= 8;
+  }
+  out_patch->insert(out_patch->end(), compressed.begin(), compressed.end());
+  return true;
+}
+
+// Finds copies of the runs of new data in the old data, like xdelta: the old
+// data is indexed by the hashes of its windows of kMatchSize bytes, which the
+// new data is looked up by one byte at a time. Matches are extended both ways
+// as far as the data is the same. The old bytes that follow the last copy
+// are tried before the index, so that a copy interrupted by a few changed
+// bytes carries on from where it would be.
+class StreamDiffEncoder {
+ public:
+  StreamDiffEncoder(const char* old_data, size_t old_size,
+                    const char* new_data, size_t new_size)
+      : old_(reinterpret_cast<const unsigned char*>(old_data)),
+        old_size_(old_size),
+        new_(reinterpret_cast<const unsigned char*>(new_data)),
+        new_size_(new_size),
+        table_shift_(64),
+        writer_(NULL) {}
+
+  void Encode(vector<char>* instructions) {
+    InstructionWriter writer(instructions);
+    writer_ = &writer;
+    BuildIndex();
+    uint64_t base_power = 1;
+    for (size_t i = 1; i < kMatchSize; i++)
+      base_power *= kHashBase;
+
+    size_t literal_start = 0;
+    size_t pos = 0;
+    bool hashed = false;
+    uint64_t hash = 0;
+    while (pos + kMatchSize <= new_size_) {
+      if (!hashed) {
+        hash = WindowHash(new_ + pos);
+        hashed = true;
+      }
+      size_t old_pos = 0;
+      if (FindMatch(pos, writer_->copy_end() + (pos - literal_start), hash,
+                    &old_pos)) {
+        // Takes in the literal bytes just before the match that match too.
+        while (pos > literal_start && old_pos > 0 &&
+               old_[old_pos - 1] == new_[pos - 1]) {
+          pos--;
+          old_pos--;
+        }
+        size_t length = kMatchSize;
+        while (pos + length < new_size_ && old_pos + length < old_size_ &&
+               old_[old_pos + length] == new_[pos + length])
+          length++;
+        EmitAdd(literal_start, pos - literal_start);
+        EmitCopy(old_pos, length);
+        pos += length;
+        literal_start = pos;
+        hashed = false;
+        continue;
+      }
+      if (pos + kMatchSize < new_size_)
+        hash = RollHash(hash, new_[pos], new_[pos + kMatchSize], base_power);
+      pos++;
+    }
+    EmitAdd(literal_start, new_size_ - literal_start);
+    writer_ = NULL;
+  }
+
+ private:
+  void BuildIndex() {
+    if (old_size_ < kMatchSize)
+      return;
+    const size_t windows = (old_size_ - kMatchSize) / kIndexStride + 1;
+    size_t table_size = 1024;
+    table_shift_ = 54;
+    while (table_size < 2 * windows) {
+      table_size *= 2;
+      table_shift_--;
+    }
+    table_.assign(table_size, 0);
+    for (size_t pos = 0; pos + kMatchSize <= old_size_; pos += kIndexStride)
+      table_[Bucket(WindowHash(old_ + pos))] = pos + 1;
+  }
+
+  size_t Bucket(uint64_t hash) const {
+    return (hash * 0x9e3779b97f4a7c15ULL) >> table_shift_;
+  }
+
+  // Returns true if the kMatchSize bytes of new data at |pos|, which hash to
+  // |hash|, are also at |expected| in the old data or at a position the
+  // index has for them, and sets |old_pos| to it.
+  bool FindMatch(size_t pos, size_t expected, uint64_t hash,
+                 size_t* old_pos) const {
+    if (expected <= old_size_ && kMatchSize <= old_size_ - expected &&
+        memcmp(old_ + expected, new_ + pos, kMatchSize) == 0) {
+      *old_pos = expected;
+      return true;
+    }
+    if (table_.empty())
+      return false;
+    const size_t entry = table_[Bucket(hash)];
+    if (entry == 0 || memcmp(old_ + entry - 1, new_ + pos, kMatchSize) != 0)
+      return false;
+    *old_pos = entry - 1;
+    return true;
+  }
+
+  void EmitAdd(size_t start, size_t length) {
+    writer_->Add(reinterpret_cast<const char*>(new_ + start), length);
+  }
+
+  void EmitCopy(size_t old_pos, size_t length) {
+    writer_->Copy(old_pos, length);
+  }
+
+  const unsigned char* const old_;
+  const size_t old_size_;
+  const unsigned char* const new_;
+  const size_t new_size_;
+
+  // The position plus one of a window of old data with each hash bucket, or
+  // 0 for none.
+  vector<size_t> table_;
+  int table_shift_;
+
+  // Where Encode() appends the instructions.
+  InstructionWriter* writer_;
+
+  DISALLOW_COPY_AND_ASSIGN(StreamDiffEncoder);
+};
+
+// Decompresses the instructions of a patch that's entirely in memory, a
+// window at a time.
+class InstructionReader {
+ public:
+  InstructionReader()
+      : initialized_(false),
+        ended_(false),
+        buffer_(kStreamPatchInputSize),
+        pos_(0),
+        end_(0) {
+    memset(&stream_, 0, sizeof(stream_));
+  }
+  ~InstructionReader() {
+    if (initialized_)
+      BZ2_bzDecompressEnd(&stream_);
+  }
+
+  bool Init(const char* data, size_t size) {
+    TEST_AND_RETURN_FALSE(!initialized_);
+    TEST_AND_RETURN_FALSE(BZ2_bzDecompressInit(&stream_, 0, 0) == BZ_OK);
+    initialized_ = true;
+    stream_.next_in = const_cast<char*>(data);
+    stream_.avail_in = size;
+    return true;
+  }
+
+  // Reads exactly |count| bytes into |out|. Returns false if the stream is
+  // corrupt or ends early.
+  bool Read(char* out, size_t count) {
+    while (count > 0) {
+      if (pos_ == end_)
+        TEST_AND_RETURN_FALSE(Fill());
+      const size_t n = min(count, end_ - pos_);
+      memcpy(out, &buffer_[pos_], n);
+      pos_ += n;
+      out += n;
+      count -= n;
+    }
+    return true;
+  }
+
+  bool ReadVarint(uint64_t* value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (pos_ == end_)
+        TEST_AND_RETURN_FALSE(Fill());
+      const unsigned char byte = buffer_[pos_++];
+      *value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      if (!(byte & 0x80))
+        return true;
+    }
+    LOG(ERROR) << "Varint too long";
+    return false;
+  }
+
+  // Returns true if the whole stream has been read.
+  bool AtEnd() {
+    if (pos_ < end_ || (!ended_ && Fill()))
+      return false;
+    return ended_;
+  }
+
+ private:
+  // Decompresses more of the stream into |buffer_|. Returns false if there's
+  // no more of it.
+  bool Fill() {
+    pos_ = end_ = 0;
+    while (!ended_ && end_ == 0) {
+      stream_.next_out = &buffer_[0];
+      stream_.avail_out = buffer_.size();
+      const int rc = BZ2_bzDecompress(&stream_);
+      TEST_AND_RETURN_FALSE(rc == BZ_OK || rc == BZ_STREAM_END);
+      end_ = buffer_.size() - stream_.avail_out;
+      ended_ = rc == BZ_STREAM_END;
+      TEST_AND_RETURN_FALSE(end_ > 0 || ended_ || stream_.avail_in > 0);
+    }
+    return end_ > 0;
+  }
+
+  bz_stream stream_;
+  bool initialized_;
+  bool ended_;
+  vector<char> buffer_;
+  size_t pos_;
+  size_t end_;
+
+  DISALLOW_COPY_AND_ASSIGN(InstructionReader);
+};
+
+// Reads ranges of the old data, either from memory or from the first
+// |length| bytes of extents of a file.
+class OldDataReader {
+ public:
+  OldDataReader(const char* data, uint64_t size)
+      : data_(data), size_(size), fd_(-1), block_size_(0) {}
+
+  OldDataReader(int fd,
+                const RepeatedPtrField<Extent>& extents,
+                uint64_t length,
+                uint32_t block_size)
+      : data_(NULL), size_(0), fd_(fd), block_size_(block_size) {
+    for (int i = 0; i < extents.size() && size_ < length; i++) {
+      extents_.push_back(extents.Get(i));
+      starts_.push_back(size_);
+      size_ += min(length - size_,
+                   extents.Get(i).num_blocks() * block_size);
+    }
+  }
+
+  uint64_t size() const { return size_; }
+
+  // Reads the |count| bytes at |offset| into |out|.
+  bool Read(uint64_t offset, size_t count, char* out) const {
+    TEST_AND_RETURN_FALSE(offset <= size_ && count <= size_ - offset);
+    if (data_) {
+      memcpy(out, data_ + offset, count);
+      return true;
+    }
+    size_t i = upper_bound(starts_.begin(), starts_.end(), offset) -
+        starts_.begin() - 1;
+    while (count > 0) {
+      const uint64_t extent_offset = offset - starts_[i];
+      const uint64_t extent_end =
+          i + 1 < starts_.size() ? starts_[i + 1] : size_;
+      const size_t n = min(static_cast<uint64_t>(count),
+                           extent_end - offset);
+      if (extents_[i].start_block() == kSparseHole) {
+        memset(out, 0, n);
+      } else {
+        ssize_t bytes_read = 0;
+        TEST_AND_RETURN_FALSE(utils::PReadAll(
+            fd_, out, n,
+            extents_[i].start_block() * block_size_ + extent_offset,
+            &bytes_read));
+        TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(n));
+      }
+      offset += n;
+      out += n;
+      count -= n;
+      i++;
+    }
+    return true;
+  }
+
+ private:
+  const char* const data_;
+  uint64_t size_;
+  const int fd_;
+  const uint32_t block_size_;
+  vector<Extent> extents_;
+  // The offset in the old data of each of |extents_|.
+  vector<uint64_t> starts_;
+
+  DISALLOW_COPY_AND_ASSIGN(OldDataReader);
+};
+
+bool StreamPatch(const OldDataReader& old_data,
+                 const char* patch,
+                 size_t patch_size,
+                 uint64_t new_size,
+                 ExtentWriter* writer) {
+  TEST_AND_RETURN_FALSE(patch_size >= kStreamDiffHeaderSize);
+  TEST_AND_RETURN_FALSE(
+      memcmp(patch, kStreamDiffMagic, kStreamDiffMagicSize) == 0);
+  uint64_t header_new_size = 0;
+  for (int i = 7; i >= 0; i--) {
+    header_new_size = (header_new_size << 8) |
+        static_cast<unsigned char>(patch[kStreamDiffMagicSize + i]);
+  }
+  TEST_AND_RETURN_FALSE(header_new_size == new_size);
+  // Empty new data takes no instructions, which aren't even compressed.
+  if (new_size == 0)
+    return patch_size == kStreamDiffHeaderSize;
+
+  InstructionReader reader;
+  TEST_AND_RETURN_FALSE(reader.Init(patch + kStreamDiffHeaderSize,
+                                    patch_size - kStreamDiffHeaderSize));
+  vector<char> chunk(min(static_cast<uint64_t>(kStreamPatchChunkSize),
+                         new_size));
+  uint64_t new_pos = 0;
+  uint64_t copy_end = 0;
+  while (new_pos < new_size) {
+    uint64_t header = 0;
+    TEST_AND_RETURN_FALSE(reader.ReadVarint(&header));
+    const bool copy = header & 1;
+    const uint64_t length = header >> 1;
+    TEST_AND_RETURN_FALSE(length > 0 && length <= new_size - new_pos);
+    uint64_t old_pos = 0;
+    if (copy) {
+      uint64_t zigzag = 0;
+      TEST_AND_RETURN_FALSE(reader.ReadVarint(&zigzag));
+      // A delta out of the old data wraps around to past its end.
+      old_pos = copy_end + ((zigzag >> 1) ^ (0 - (zigzag & 1)));
+      TEST_AND_RETURN_FALSE(old_pos <= old_data.size() &&
+                            length <= old_data.size() - old_pos);
+      copy_end = old_pos + length;
+    }
+    for (uint64_t done = 0; done < length; ) {
+      const size_t count = min(static_cast<uint64_t>(chunk.size()),
+                               length - done);
+      if (copy)
+        TEST_AND_RETURN_FALSE(old_data.Read(old_pos + done, count, &chunk[0]));
+      else
+        TEST_AND_RETURN_FALSE(reader.Read(&chunk[0], count));
+      TEST_AND_RETURN_FALSE(writer->Write(&chunk[0], count));
+      done += count;
+    }
+    new_pos += length;
+  }
+  TEST_AND_RETURN_FALSE(reader.AtEnd());
+  return true;
+}
+
+}  // namespace {}
+
+bool StreamDiffBuffers(const char* old_data,
+                       size_t old_size,
+                       const char* new_data,
+                       size_t new_size,
+                       vector<char>* out_patch) {
+  vector<char> instructions;
+  StreamDiffEncoder encoder(old_data, old_size, new_data, new_size);
+  encoder.Encode(&instructions);
+  return MakePatch(instructions, new_size, out_patch);
+}
+
+void AppendChangedRanges(const char* old_data,
+                         const char* new_data,
+                         size_t offset,
+                         size_t size,
+                         size_t record_size,
+                         vector<pair<size_t, size_t> >* ranges) {
+  CHECK_GT(record_size, 0);
+  const size_t end = offset + size;
+  for (size_t record = offset; record < end; record += record_size) {
+    size_t last = min(record + record_size, end);
+    if (memcmp(old_data + record, new_data + record, last - record) == 0)
+      continue;
+    size_t first = record;
+    while (old_data[first] == new_data[first])
+      first++;
+    while (old_data[last - 1] == new_data[last - 1])
+      last--;
+    if (!ranges->empty() &&
+        first - (ranges->back().first + ranges->back().second) <
+        kMinInPlaceCopySize) {
+      ranges->back().second = last - ranges->back().first;
+    } else {
+      ranges->push_back(make_pair(first, last - first));
+    }
+  }
+}
+
+bool StreamDiffInPlace(const char* new_data,
+                       size_t size,
+                       const vector<pair<size_t, size_t> >& changed,
+                       vector<char>* out_patch) {
+  vector<char> instructions;
+  InstructionWriter writer(&instructions);
+  size_t pos = 0;
+  for (vector<pair<size_t, size_t> >::const_iterator it = changed.begin();
+       it != changed.end(); ++it) {
+    TEST_AND_RETURN_FALSE(it->first >= pos &&
+                          it->second <= size - it->first);
+    if (it->first > pos)
+      writer.Copy(pos, it->first - pos);
+    writer.Add(new_data + it->first, it->second);
+    pos = it->first + it->second;
+  }
+  if (pos < size)
+    writer.Copy(pos, size - pos);
+  return MakePatch(instructions, size, out_patch);
+}
+
+bool StreamPatchBuffer(const char* old_data,
+                       uint64_t old_size,
+                       const char* patch,
+                       size_t patch_size,
+                       uint64_t new_size,
+                       ExtentWriter* writer) {
+  return StreamPatch(OldDataReader(old_data, old_size), patch, patch_size,
+                     new_size, writer);
+}
+
+bool StreamPatchExtents(int fd,
+                        const RepeatedPtrField<Extent>& src_extents,
+                        uint64_t src_length,
+                        uint32_t block_size,
+                        const char* patch,
+                        size_t patch_size,
+                        uint64_t dst_length,
+                        bool read_source_first,
+                        ExtentWriter* writer) {
+  const OldDataReader extents_reader(fd, src_extents, src_length, block_size);
+  TEST_AND_RETURN_FALSE(extents_reader.size() == src_length);
+  if (!read_source_first) {
+    return StreamPatch(extents_reader, patch, patch_size, dst_length,
+                       writer);
+  }
+  vector<char> old_data(src_length);
+  TEST_AND_RETURN_FALSE(extents_reader.Read(
+      0, old_data.size(), old_data.empty() ? NULL : &old_data[0]));
+  return StreamPatchBuffer(old_data.empty() ? NULL : &old_data[0],
+                           old_data.size(), patch, patch_size, dst_length,
+                           writer);
+}
+
+}  // namespace chromeos_update_engine
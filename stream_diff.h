@@ -0,0 +1,93 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_STREAM_DIFF_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_STREAM_DIFF_H__
+
+#include <inttypes.h>
+
+#include <utility>
+#include <vector>
+
+#include <google/protobuf/repeated_field.h>
+
+#include "update_engine/extent_writer.h"
+#include "update_engine/update_metadata.pb.h"
+
+// A delta format that, unlike BSDIFF, clients apply in a single forward pass
+// with bounded memory. A patch is a bzip2 compressed stream of instructions,
+// in the order of the new data, that each COPY a run of bytes from anywhere
+// in the old data or ADD the literal bytes that follow them, as in VCDIFF.
+// Clients read the old data as the copies need it rather than hold all of it,
+// and do nothing but decompress and copy. The patches are larger than BSDIFF
+// ones where the data has many small changes, e.g., code whose addresses
+// shifted, as the changed bytes are sent whole rather than as differences.
+
+namespace chromeos_update_engine {
+
+// Computes a patch that turns the |old_size| bytes at |old_data| into the
+// |new_size| bytes at |new_data| and stores it in |out_patch|. Returns true
+// on success.
+bool StreamDiffBuffers(const char* old_data,
+                       size_t old_size,
+                       const char* new_data,
+                       size_t new_size,
+                       std::vector<char>* out_patch);
+
+// Appends to |ranges| those of the |size| bytes from |offset| on that
+// differ between |old_data| and |new_data|, as (offset, length) pairs, for
+// StreamDiffInPlace(). The data is made of records of |record_size| bytes,
+// e.g., inodes: the bytes of a changed record from its first to its last
+// changed one make a range. Ranges only a few bytes apart are merged.
+// Calls must be made in the order of |offset|.
+void AppendChangedRanges(const char* old_data,
+                         const char* new_data,
+                         size_t offset,
+                         size_t size,
+                         size_t record_size,
+                         std::vector<std::pair<size_t, size_t> >* ranges);
+
+// Computes a patch like StreamDiffBuffers() for data whose structures stay
+// at the same offsets, e.g., filesystem metadata: the |size| bytes at
+// |new_data| differ from as many old bytes only in the sorted, disjoint
+// |changed| ranges, which the patch sends as is, and the rest is copied in
+// place. Nothing is looked up in the old data, so this is much quicker than
+// StreamDiffBuffers(). Returns true on success.
+bool StreamDiffInPlace(
+    const char* new_data,
+    size_t size,
+    const std::vector<std::pair<size_t, size_t> >& changed,
+    std::vector<char>* out_patch);
+
+// Applies the |patch_size|-byte |patch| to the |old_size| bytes at
+// |old_data| and passes the resulting bytes to |writer|, which must already
+// be Init()ed. The caller is responsible for calling End() on |writer|.
+// Fails if the patch is malformed or if the size of the new data it
+// describes isn't |new_size|. Returns true on success.
+bool StreamPatchBuffer(const char* old_data,
+                       uint64_t old_size,
+                       const char* patch,
+                       size_t patch_size,
+                       uint64_t new_size,
+                       ExtentWriter* writer);
+
+// Like StreamPatchBuffer, but reads the old data from the first |src_length|
+// bytes of |src_extents| in |fd|. Extents starting at kSparseHole read as
+// zeros. The old data is read as the patch copies it, so |writer| must not
+// overwrite the source extents, unless |read_source_first| is set: all of the
+// old data is then read before anything is passed to |writer|.
+bool StreamPatchExtents(int fd,
+                        const google::protobuf::RepeatedPtrField<Extent>&
+                            src_extents,
+                        uint64_t src_length,
+                        uint32_t block_size,
+                        const char* patch,
+                        size_t patch_size,
+                        uint64_t dst_length,
+                        bool read_source_first,
+                        ExtentWriter* writer);
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_STREAM_DIFF_H__
@@ -0,0 +1,279 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+#include "update_engine/extent_ranges.h"
+#include "update_engine/extent_writer.h"
+#include "update_engine/graph_types.h"
+#include "update_engine/stream_diff.h"
+#include "update_engine/test_utils.h"
+#include "update_engine/utils.h"
+
+using google::protobuf::RepeatedPtrField;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+const char kPathTemplate[] = "./StreamDiffTest-file.XXXXXX";
+const uint32_t kBlockSize = 4096;
+
+// Diffs |old_data| against |new_data|, applies the resulting patch, checks
+// that it reproduces |new_data| and returns its size.
+size_t ExpectRoundTrip(const vector<char>& old_data,
+                       const vector<char>& new_data) {
+  vector<char> patch;
+  EXPECT_TRUE(StreamDiffBuffers(old_data.empty() ? NULL : &old_data[0],
+                                old_data.size(),
+                                new_data.empty() ? NULL : &new_data[0],
+                                new_data.size(),
+                                &patch));
+  MemoryExtentWriter writer;
+  EXPECT_TRUE(StreamPatchBuffer(old_data.empty() ? NULL : &old_data[0],
+                                old_data.size(),
+                                &patch[0],
+                                patch.size(),
+                                new_data.size(),
+                                &writer));
+  ExpectVectorsEq(new_data, writer.data());
+  return patch.size();
+}
+}  // namespace {}
+
+class StreamDiffTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    srandom(1);
+    memcpy(path_, kPathTemplate, sizeof(kPathTemplate));
+    fd_ = mkstemp(path_);
+    ASSERT_GE(fd_, 0);
+  }
+  virtual void TearDown() {
+    close(fd_);
+    unlink(path_);
+  }
+  int fd() { return fd_; }
+ private:
+  int fd_;
+  char path_[sizeof(kPathTemplate)];
+};
+
+TEST_F(StreamDiffTest, RoundTripTest) {
+  const vector<char> old_data = RandomData(256 * 1024);
+  vector<char> new_data(old_data);
+  // Change a few bytes, insert a run, drop a run and move a run.
+  new_data[10] ^= 0x55;
+  new_data[30000] ^= 0x01;
+  new_data.insert(new_data.begin() + 20000, 500, 'z');
+  new_data.erase(new_data.begin() + 40000, new_data.begin() + 41000);
+  new_data.insert(new_data.begin() + 100000, old_data.begin() + 200000,
+                  old_data.begin() + 210000);
+  const size_t patch_size = ExpectRoundTrip(old_data, new_data);
+  // The changed bytes and the run of 'z's are sent, and little else.
+  EXPECT_LT(patch_size, 1000U);
+
+  // Unrelated data is sent whole.
+  ExpectRoundTrip(old_data, RandomData(100000));
+}
+
+TEST_F(StreamDiffTest, InPlaceTest) {
+  const size_t kRecordSize = 256;
+  const vector<char> old_data = RandomData(64 * kRecordSize);
+  vector<char> new_data(old_data);
+  // Change two bytes of one record and a byte of the one after it, and a
+  // byte of a record further on.
+  new_data[3 * kRecordSize + 10] ^= 0x01;
+  new_data[3 * kRecordSize + 100] ^= 0x02;
+  new_data[4 * kRecordSize + 2] ^= 0x04;
+  new_data[40 * kRecordSize + 255] ^= 0x08;
+
+  // The records are compared a byte at a time up to the fifth, and
+  // whole from there on.
+  vector<std::pair<size_t, size_t> > changed;
+  AppendChangedRanges(&old_data[0], &new_data[0], 0, 5 * kRecordSize, 1,
+                      &changed);
+  AppendChangedRanges(&old_data[0], &new_data[0], 5 * kRecordSize,
+                      new_data.size() - 5 * kRecordSize, kRecordSize,
+                      &changed);
+  ASSERT_EQ(4, changed.size());
+  EXPECT_EQ(std::make_pair(3 * kRecordSize + 10, static_cast<size_t>(1)),
+            changed[0]);
+  EXPECT_EQ(std::make_pair(3 * kRecordSize + 100, static_cast<size_t>(1)),
+            changed[1]);
+  EXPECT_EQ(std::make_pair(4 * kRecordSize + 2, static_cast<size_t>(1)),
+            changed[2]);
+  EXPECT_EQ(std::make_pair(40 * kRecordSize + 255, static_cast<size_t>(1)),
+            changed[3]);
+
+  // Within a record, everything from the first to the last change is
+  // sent.
+  new_data[20 * kRecordSize + 5] ^= 0x10;
+  new_data[20 * kRecordSize + 9] ^= 0x20;
+  changed.clear();
+  AppendChangedRanges(&old_data[0], &new_data[0], 0, new_data.size(),
+                      kRecordSize, &changed);
+  ASSERT_EQ(4, changed.size());
+  EXPECT_EQ(std::make_pair(3 * kRecordSize + 10, static_cast<size_t>(91)),
+            changed[0]);
+  EXPECT_EQ(std::make_pair(20 * kRecordSize + 5, static_cast<size_t>(5)),
+            changed[2]);
+  EXPECT_EQ(std::make_pair(40 * kRecordSize + 255, static_cast<size_t>(1)),
+            changed[3]);
+
+  vector<char> patch;
+  EXPECT_TRUE(StreamDiffInPlace(&new_data[0], new_data.size(), changed,
+                                &patch));
+  EXPECT_LT(patch.size(), 300U);
+  MemoryExtentWriter writer;
+  EXPECT_TRUE(StreamPatchBuffer(&old_data[0],
+                                old_data.size(),
+                                &patch[0],
+                                patch.size(),
+                                new_data.size(),
+                                &writer));
+  ExpectVectorsEq(new_data, writer.data());
+
+  // Ranges out of order or past the data are rejected.
+  std::swap(changed[0], changed[1]);
+  EXPECT_FALSE(StreamDiffInPlace(&new_data[0], new_data.size(), changed,
+                                 &patch));
+  changed.assign(1, std::make_pair(new_data.size() - 1,
+                                   static_cast<size_t>(2)));
+  EXPECT_FALSE(StreamDiffInPlace(&new_data[0], new_data.size(), changed,
+                                 &patch));
+}
+
+TEST_F(StreamDiffTest, EdgeCasesTest) {
+  vector<char> data(1000);
+  FillWithData(&data);
+  ExpectRoundTrip(vector<char>(), data);
+  ExpectRoundTrip(data, vector<char>());
+  ExpectRoundTrip(data, data);
+  ExpectRoundTrip(vector<char>(1, 'a'), vector<char>(1, 'b'));
+  ExpectRoundTrip(vector<char>(5000, 0), vector<char>(7000, 0));
+  // A run that repeats itself in the new data.
+  vector<char> repeated(data);
+  repeated.insert(repeated.end(), data.begin(), data.end());
+  ExpectRoundTrip(data, repeated);
+}
+
+TEST_F(StreamDiffTest, CorruptPatchTest) {
+  const vector<char> old_data = RandomData(10000);
+  vector<char> new_data(old_data);
+  new_data[5000] ^= 1;
+  vector<char> patch;
+  EXPECT_TRUE(StreamDiffBuffers(&old_data[0], old_data.size(), &new_data[0],
+                                new_data.size(), &patch));
+  {
+    // The wrong new size.
+    MemoryExtentWriter writer;
+    EXPECT_FALSE(StreamPatchBuffer(&old_data[0], old_data.size(), &patch[0],
+                                   patch.size(), new_data.size() + 1,
+                                   &writer));
+  }
+  {
+    // A truncated patch.
+    MemoryExtentWriter writer;
+    EXPECT_FALSE(StreamPatchBuffer(&old_data[0], old_data.size(), &patch[0],
+                                   patch.size() - 10, new_data.size(),
+                                   &writer));
+  }
+  {
+    // Old data too short for the copies.
+    MemoryExtentWriter writer;
+    EXPECT_FALSE(StreamPatchBuffer(&old_data[0], old_data.size() / 2,
+                                   &patch[0], patch.size(), new_data.size(),
+                                   &writer));
+  }
+  {
+    // A bad magic.
+    patch[0] = 'X';
+    MemoryExtentWriter writer;
+    EXPECT_FALSE(StreamPatchBuffer(&old_data[0], old_data.size(), &patch[0],
+                                   patch.size(), new_data.size(), &writer));
+  }
+}
+
+TEST_F(StreamDiffTest, ExtentsTest) {
+  // Three blocks of old data in blocks 2, 0 and a sparse hole, of which
+  // 2.5 blocks are used. The new data moves them around and changes a few
+  // bytes, and is written to blocks 3 to 5.
+  const vector<char> file_data = RandomData(3 * kBlockSize);
+  ASSERT_TRUE(utils::PWriteAll(fd(), &file_data[0], file_data.size(), 0));
+  RepeatedPtrField<Extent> src_extents;
+  *src_extents.Add() = ExtentForRange(2, 1);
+  *src_extents.Add() = ExtentForRange(0, 1);
+  *src_extents.Add() = ExtentForRange(kSparseHole, 1);
+  const uint64_t src_length = 2 * kBlockSize + kBlockSize / 2;
+  vector<char> old_data(file_data.begin() + 2 * kBlockSize, file_data.end());
+  old_data.insert(old_data.end(), file_data.begin(),
+                  file_data.begin() + kBlockSize);
+  old_data.resize(src_length, 0);
+
+  vector<char> new_data(old_data.begin() + 1000, old_data.end());
+  new_data.insert(new_data.end(), old_data.begin(), old_data.begin() + 1000);
+  new_data[3000] ^= 1;
+  new_data[7000] ^= 1;
+  vector<char> patch;
+  EXPECT_TRUE(StreamDiffBuffers(&old_data[0], old_data.size(), &new_data[0],
+                                new_data.size(), &patch));
+
+  for (int read_source_first = 0; read_source_first < 2;
+       read_source_first++) {
+    vector<Extent> dst_extents(1, ExtentForRange(3, 3));
+    DirectExtentWriter direct_writer;
+    ZeroPadExtentWriter zero_pad_writer(&direct_writer);
+    EXPECT_TRUE(zero_pad_writer.Init(fd(), dst_extents, kBlockSize));
+    EXPECT_TRUE(StreamPatchExtents(fd(), src_extents, src_length, kBlockSize,
+                                   &patch[0], patch.size(), new_data.size(),
+                                   read_source_first, &zero_pad_writer));
+    EXPECT_TRUE(zero_pad_writer.End());
+
+    vector<char> expected(new_data);
+    expected.resize(3 * kBlockSize, 0);
+    vector<char> actual(3 * kBlockSize);
+    ssize_t bytes_read = 0;
+    EXPECT_TRUE(utils::PReadAll(fd(), &actual[0], actual.size(),
+                                3 * kBlockSize, &bytes_read));
+    EXPECT_EQ(static_cast<ssize_t>(actual.size()), bytes_read);
+    ExpectVectorsEq(expected, actual);
+  }
+}
+
+TEST_F(StreamDiffTest, InPlaceExtentsTest) {
+  // The two blocks of old data are swapped in place, which only works if
+  // all of the source is read first.
+  const vector<char> old_data = RandomData(2 * kBlockSize);
+  ASSERT_TRUE(utils::PWriteAll(fd(), &old_data[0], old_data.size(), 0));
+  RepeatedPtrField<Extent> src_extents;
+  *src_extents.Add() = ExtentForRange(0, 2);
+  vector<char> new_data(old_data.begin() + kBlockSize, old_data.end());
+  new_data.insert(new_data.end(), old_data.begin(),
+                  old_data.begin() + kBlockSize);
+  vector<char> patch;
+  EXPECT_TRUE(StreamDiffBuffers(&old_data[0], old_data.size(), &new_data[0],
+                                new_data.size(), &patch));
+
+  vector<Extent> dst_extents(1, ExtentForRange(0, 2));
+  DirectExtentWriter writer;
+  EXPECT_TRUE(writer.Init(fd(), dst_extents, kBlockSize));
+  EXPECT_TRUE(StreamPatchExtents(fd(), src_extents, old_data.size(),
+                                 kBlockSize, &patch[0], patch.size(),
+                                 new_data.size(), true, &writer));
+  EXPECT_TRUE(writer.End());
+
+  vector<char> actual(2 * kBlockSize);
+  ssize_t bytes_read = 0;
+  EXPECT_TRUE(utils::PReadAll(fd(), &actual[0], actual.size(), 0,
+                              &bytes_read));
+  EXPECT_EQ(static_cast<ssize_t>(actual.size()), bytes_read);
+  ExpectVectorsEq(new_data, actual);
+}
+
+}  // namespace chromeos_update_engine
@@ -4,18 +4,27 @@
 
 #include "update_engine/subprocess.h"
 
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdlib.h>
-#include <string.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <string>
 #include <vector>
 
 #include <base/logging.h>
-#include <base/memory/scoped_ptr.h>
+#include <base/posix/eintr_wrapper.h>
+#include <base/string_number_conversions.h>
 #include <base/string_util.h>
 #include <base/stringprintf.h>
 
+#include "update_engine/probes.h"
+#include "update_engine/trace.h"
 #include "update_engine/utils.h"
 
 using std::string;
@@ -38,6 +47,7 @@ void Subprocess::GChildExitedCallback(GPid pid, gint status, gpointer data) {
   gint use_status = status;
   if (WIFEXITED(status))
     use_status = WEXITSTATUS(status);
+  UE_PROBE2(subprocess_exit, static_cast<int>(pid), use_status);
 
   if (status) {
     LOG(INFO) << "Subprocess status: " << use_status;
@@ -45,16 +55,18 @@ void Subprocess::GChildExitedCallback(GPid pid, gint status, gpointer data) {
   if (!record->stdout.empty()) {
     LOG(INFO) << "Subprocess output:\n" << record->stdout;
   }
+  if (Trace::enabled()) {
+    TraceArgs args;
+    args["command"] = record->command;
+    args["status"] = StringPrintf("%d", use_status);
+    Trace::AddCompleteEvent("subprocess", "Exec", record->start_time, args);
+  }
   if (record->callback) {
     record->callback(use_status, record->stdout, record->callback_data);
   }
   Get().subprocess_records_.erase(record->tag);
 }
 
-void Subprocess::GRedirectStderrToStdout(gpointer user_data) {
-  dup2(1, 2);
-}
-
 gboolean Subprocess::GStdoutWatchCallback(GIOChannel* source,
                                           GIOCondition condition,
                                           gpointer data) {
@@ -73,98 +85,128 @@ gboolean Subprocess::GStdoutWatchCallback(GIOChannel* source,
 }
 
 namespace {
-void FreeArgv(char** argv) {
-  for (int i = 0; argv[i]; i++) {
-    free(argv[i]);
-    argv[i] = NULL;
+// Returns the environment subprocesses run with: only the library and
+// executable search paths of this process.
+vector<string> ChildEnvironment() {
+  const char* keys[] = {"LD_LIBRARY_PATH", "PATH"};
+  vector<string> env;
+  for (size_t i = 0; i < arraysize(keys); i++) {
+    if (getenv(keys[i]))
+      env.push_back(StringPrintf("%s=%s", keys[i], getenv(keys[i])));
   }
+  return env;
 }
 
-void FreeArgvInError(char** argv) {
-  FreeArgv(argv);
-  LOG(ERROR) << "Ran out of memory copying args.";
+// Returns a NULL-terminated array of pointers to the strings of |strings|,
+// which must outlive it.
+vector<char*> CStringArray(const vector<string>& strings) {
+  vector<char*> array;
+  for (size_t i = 0; i < strings.size(); i++)
+    array.push_back(const_cast<char*>(strings[i].c_str()));
+  array.push_back(NULL);
+  return array;
 }
 
-// Note: Caller responsible for free()ing the returned value!
-// Will return NULL on failure and free any allocated memory.
-char** ArgPointer() {
-  const char* keys[] = {"LD_LIBRARY_PATH", "PATH"};
-  char** ret = new char*[arraysize(keys) + 1];
-  int pointer = 0;
-  for (size_t i = 0; i < arraysize(keys); i++) {
-    if (getenv(keys[i])) {
-      ret[pointer] = strdup(StringPrintf("%s=%s", keys[i],
-                                         getenv(keys[i])).c_str());
-      if (!ret[pointer]) {
-        FreeArgv(ret);
-        delete [] ret;
-        return NULL;
-      }
-      ++pointer;
-    }
+// Adds actions to |actions| that close the descriptors of this process in
+// the child, except for the standard ones and |keep_fds|.
+void CloseChildFds(const vector<int>& keep_fds,
+                   posix_spawn_file_actions_t* actions) {
+  DIR* dir = opendir("/proc/self/fd");
+  if (!dir) {
+    PLOG(WARNING) << "Unable to list the open descriptors, so subprocesses "
+                  << "inherit those not marked close-on-exec";
+    return;
   }
-  ret[pointer] = NULL;
-  return ret;
+  const int dir_fd = dirfd(dir);
+  struct dirent* entry = NULL;
+  while ((entry = readdir(dir)) != NULL) {
+    int fd = -1;
+    if (!base::StringToInt(entry->d_name, &fd) || fd <= STDERR_FILENO ||
+        fd == dir_fd ||
+        std::find(keep_fds.begin(), keep_fds.end(), fd) != keep_fds.end())
+      continue;
+    posix_spawn_file_actions_addclose(actions, fd);
+  }
+  closedir(dir);
 }
 
-class ScopedFreeArgPointer {
- public:
-  ScopedFreeArgPointer(char** arr) : arr_(arr) {}
-  ~ScopedFreeArgPointer() {
-    if (!arr_)
-      return;
-    for (int i = 0; arr_[i]; i++)
-      free(arr_[i]);
-    delete[] arr_;
+// Starts |cmd| with posix_spawn(), which doesn't copy the address space of
+// this process the way fork() does, looking the program up in PATH if
+// |search_path|. The descriptors of this process are closed in the child but
+// for |keep_fds|, which mustn't be close-on-exec, and its stdout and stderr
+// go to a pipe whose read end is stored in |stdout_fd|. Returns true on
+// success, storing the child's pid in |pid|.
+bool SpawnChild(const vector<string>& cmd,
+                bool search_path,
+                const vector<int>& keep_fds,
+                pid_t* pid,
+                int* stdout_fd) {
+  TEST_AND_RETURN_FALSE(!cmd.empty());
+  int pipe_fds[2] = { -1, -1 };
+  TEST_AND_RETURN_FALSE_ERRNO(pipe2(pipe_fds, O_CLOEXEC) == 0);
+  ScopedFdCloser pipe_reader_closer(&pipe_fds[0]);
+  ScopedFdCloser pipe_writer_closer(&pipe_fds[1]);
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, pipe_fds[1], STDOUT_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, pipe_fds[1], STDERR_FILENO);
+  // The pipe itself is closed once duplicated, as it would be on exec.
+  CloseChildFds(keep_fds, &actions);
+
+  // The child starts with no blocked signals, and with the default action
+  // for SIGPIPE even if this process ignores it.
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  sigset_t signals;
+  sigemptyset(&signals);
+  posix_spawnattr_setsigmask(&attr, &signals);
+  sigaddset(&signals, SIGPIPE);
+  posix_spawnattr_setsigdefault(&attr, &signals);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK |
+                                  POSIX_SPAWN_SETSIGDEF);
+
+  const vector<string> env = ChildEnvironment();
+  vector<char*> argv = CStringArray(cmd);
+  vector<char*> envp = CStringArray(env);
+  const int rc = search_path ?
+      posix_spawnp(pid, argv[0], &actions, &attr, &argv[0], &envp[0]) :
+      posix_spawn(pid, argv[0], &actions, &attr, &argv[0], &envp[0]);
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+  if (rc != 0) {
+    errno = rc;
+    PLOG(ERROR) << "Unable to run " << cmd[0];
+    return false;
   }
- private:
-  char** arr_;
-  DISALLOW_COPY_AND_ASSIGN(ScopedFreeArgPointer);
-};
+  UE_PROBE2(subprocess_exec, static_cast<int>(*pid), cmd[0].c_str());
+  *stdout_fd = pipe_fds[0];
+  pipe_reader_closer.set_should_close(false);
+  return true;
+}
 }  // namespace {}
 
 uint32_t Subprocess::Exec(const vector<string>& cmd,
                           ExecCallback callback,
                           void* p) {
-  GPid child_pid;
-  scoped_array<char*> argv(new char*[cmd.size() + 1]);
-  for (unsigned int i = 0; i < cmd.size(); i++) {
-    argv[i] = strdup(cmd[i].c_str());
-    if (!argv[i]) {
-      FreeArgvInError(argv.get());  // NULL in argv[i] terminates argv.
-      return 0;
-    }
-  }
-  argv[cmd.size()] = NULL;
-
-  char** argp = ArgPointer();
-  if (!argp) {
-    FreeArgvInError(argv.get());  // NULL in argv[i] terminates argv.
-    return 0;
-  }
-  ScopedFreeArgPointer argp_free(argp);
+  return ExecWithFds(cmd, vector<int>(), callback, p);
+}
 
+uint32_t Subprocess::ExecWithFds(const vector<string>& cmd,
+                                 const vector<int>& keep_fds,
+                                 ExecCallback callback,
+                                 void* p) {
   shared_ptr<SubprocessRecord> record(new SubprocessRecord);
   record->callback = callback;
   record->callback_data = p;
-  gint stdout_fd = -1;
-  bool success = g_spawn_async_with_pipes(
-      NULL,  // working directory
-      argv.get(),
-      argp,
-      G_SPAWN_DO_NOT_REAP_CHILD,  // flags
-      GRedirectStderrToStdout,  // child setup function
-      NULL,  // child setup data pointer
-      &child_pid,
-      NULL,
-      &stdout_fd,
-      NULL,
-      NULL);
-  FreeArgv(argv.get());
-  if (!success) {
-    LOG(ERROR) << "g_spawn_async failed";
-    return 0;
+  if (Trace::enabled()) {
+    record->command = JoinString(cmd, ' ');
+    record->start_time = base::Time::Now();
   }
+  pid_t child_pid = -1;
+  int stdout_fd = -1;
+  if (!SpawnChild(cmd, false, keep_fds, &child_pid, &stdout_fd))
+    return 0;
   record->tag =
       g_child_watch_add(child_pid, GChildExitedCallback, record.get());
   subprocess_records_[record->tag] = record;
@@ -187,64 +229,48 @@ void Subprocess::CancelExec(uint32_t tag) {
   subprocess_records_[tag]->callback = NULL;
 }
 
-bool Subprocess::SynchronousExecFlags(const vector<string>& cmd,
-                                      GSpawnFlags flags,
-                                      int* return_code,
-                                      string* stdout) {
+bool Subprocess::SynchronousExecWithFds(const vector<string>& cmd,
+                                        const vector<int>& keep_fds,
+                                        int* return_code,
+                                        string* stdout) {
   if (stdout) {
     *stdout = "";
   }
-  GError* err = NULL;
-  scoped_array<char*> argv(new char*[cmd.size() + 1]);
-  for (unsigned int i = 0; i < cmd.size(); i++) {
-    argv[i] = strdup(cmd[i].c_str());
-    if (!argv[i]) {
-      FreeArgvInError(argv.get());  // NULL in argv[i] terminates argv.
-      return false;
-    }
-  }
-  argv[cmd.size()] = NULL;
+  ScopedTraceEvent trace_event("subprocess", "SynchronousExec");
+  pid_t child_pid = -1;
+  int stdout_fd = -1;
+  TEST_AND_RETURN_FALSE(SpawnChild(cmd, true, keep_fds, &child_pid,
+                                   &stdout_fd));
+  ScopedFdCloser stdout_closer(&stdout_fd);
+  string child_stdout;
+  char buf[1024];
+  ssize_t bytes_read = 0;
+  while ((bytes_read = HANDLE_EINTR(read(stdout_fd, buf, sizeof(buf)))) > 0)
+    child_stdout.append(buf, bytes_read);
+  PLOG_IF(WARNING, bytes_read < 0) << "Unable to read the subprocess output";
 
-  char** argp = ArgPointer();
-  if (!argp) {
-    FreeArgvInError(argv.get());  // NULL in argv[i] terminates argv.
-    return false;
+  int status = 0;
+  TEST_AND_RETURN_FALSE_ERRNO(HANDLE_EINTR(waitpid(child_pid, &status, 0)) ==
+                              child_pid);
+  *return_code = status;
+  UE_PROBE2(subprocess_exit, static_cast<int>(child_pid),
+            WIFEXITED(status) ? WEXITSTATUS(status) : status);
+  if (Trace::enabled()) {
+    trace_event.AddArg("command", JoinString(cmd, ' '));
+    trace_event.AddArg("status", StringPrintf("%d", *return_code));
   }
-  ScopedFreeArgPointer argp_free(argp);
-
-  char* child_stdout;
-  bool success = g_spawn_sync(
-      NULL,  // working directory
-      argv.get(),
-      argp,
-      static_cast<GSpawnFlags>(G_SPAWN_STDERR_TO_DEV_NULL |
-                               G_SPAWN_SEARCH_PATH | flags),  // flags
-      GRedirectStderrToStdout,  // child setup function
-      NULL,  // data for child setup function
-      &child_stdout,
-      NULL,
-      return_code,
-      &err);
-  FreeArgv(argv.get());
-  LOG_IF(INFO, err) << utils::GetAndFreeGError(&err);
-  if (child_stdout) {
-    if (stdout) {
-      *stdout = child_stdout;
-    } else if (*child_stdout) {
-      LOG(INFO) << "Subprocess output:\n" << child_stdout;
-    }
-    g_free(child_stdout);
+  if (stdout) {
+    stdout->swap(child_stdout);
+  } else if (!child_stdout.empty()) {
+    LOG(INFO) << "Subprocess output:\n" << child_stdout;
   }
-  return success;
+  return true;
 }
 
 bool Subprocess::SynchronousExec(const std::vector<std::string>& cmd,
                                  int* return_code,
                                  std::string* stdout) {
-  return SynchronousExecFlags(cmd,
-                              static_cast<GSpawnFlags>(0),
-                              return_code,
-                              stdout);
+  return SynchronousExecWithFds(cmd, vector<int>(), return_code, stdout);
 }
 
 bool Subprocess::SubprocessInFlight() {
@@ -14,11 +14,17 @@
 
 #include "base/basictypes.h"
 #include "base/logging.h"
+#include "base/time.h"
 
 // The Subprocess class is a singleton. It's used to spawn off a subprocess
 // and get notified when the subprocess exits. The result of Exec() can
 // be saved and used to cancel the callback request. If you know you won't
 // call CancelExec(), you may safely lose the return value from Exec().
+//
+// Subprocesses are started with posix_spawn(), without a shell, so that the
+// address space of update_engine isn't copied for each of them. They only
+// inherit the standard descriptors and those they're explicitly given, with
+// stderr redirected to stdout.
 
 namespace chromeos_update_engine {
 
@@ -38,16 +44,26 @@ class Subprocess {
                 ExecCallback callback,
                 void* p);
 
+  // Like Exec(), but the descriptors in |keep_fds|, which mustn't be
+  // close-on-exec, stay open in the subprocess.
+  uint32_t ExecWithFds(const std::vector<std::string>& cmd,
+                       const std::vector<int>& keep_fds,
+                       ExecCallback callback,
+                       void* p);
+
   // Used to cancel the callback. The process will still run to completion.
   void CancelExec(uint32_t tag);
 
-  // Executes a command synchronously. Returns true on success. If |stdout| is
-  // non-null, the process output is stored in it, otherwise the output is
-  // logged. Note that stderr is redirected to stdout.
-  static bool SynchronousExecFlags(const std::vector<std::string>& cmd,
-                                   GSpawnFlags flags,
-                                   int* return_code,
-                                   std::string* stdout);
+  // Executes a command synchronously, looking it up in PATH. Returns true
+  // on success, storing the wait status of the process in |return_code|. If
+  // |stdout| is non-null, the process output is stored in it, otherwise the
+  // output is logged. Note that stderr is redirected to stdout. The
+  // descriptors in |keep_fds|, which mustn't be close-on-exec, stay open in
+  // the process.
+  static bool SynchronousExecWithFds(const std::vector<std::string>& cmd,
+                                     const std::vector<int>& keep_fds,
+                                     int* return_code,
+                                     std::string* stdout);
   static bool SynchronousExec(const std::vector<std::string>& cmd,
                               int* return_code,
                               std::string* stdout);
@@ -74,6 +90,9 @@ class Subprocess {
     GIOChannel* gioout;
     guint gioout_tag;
     std::string stdout;
+    // The command and when it was started, for the trace.
+    std::string command;
+    base::Time start_time;
   };
 
   Subprocess() {}
@@ -82,10 +101,6 @@ class Subprocess {
   // requested callback.
   static void GChildExitedCallback(GPid pid, gint status, gpointer data);
 
-  // Callback which runs in the child before exec to redirect stderr onto
-  // stdout.
-  static void GRedirectStderrToStdout(gpointer user_data);
-
   // Callback which runs whenever there is input available on the subprocess
   // stdout pipe.
   static gboolean GStdoutWatchCallback(GIOChannel* source,
@@ -2,6 +2,7 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -100,6 +101,29 @@ TEST(SubprocessTest, SynchronousEchoNoOutputTest) {
   EXPECT_EQ(0, rc);
 }
 
+TEST(SubprocessTest, SynchronousKeepFdsTest) {
+  int fd = open("/dev/null", O_RDONLY);
+  ASSERT_GE(fd, 0);
+  vector<string> cmd;
+  cmd.push_back("sh");
+  cmd.push_back("-c");
+  cmd.push_back(StringPrintf("test -e /proc/self/fd/%d", fd));
+  int rc = -1;
+  // Only the descriptors the subprocess is given are inherited.
+  ASSERT_TRUE(Subprocess::SynchronousExec(cmd, &rc, NULL));
+  EXPECT_NE(0, rc);
+  ASSERT_TRUE(Subprocess::SynchronousExecWithFds(cmd, vector<int>(1, fd), &rc,
+                                                 NULL));
+  EXPECT_EQ(0, rc);
+  close(fd);
+}
+
+TEST(SubprocessTest, SynchronousExecFailureTest) {
+  vector<string> cmd(1, "/nonexistent/program");
+  int rc = -1;
+  EXPECT_FALSE(Subprocess::SynchronousExec(cmd, &rc, NULL));
+}
+
 namespace {
 void CallbackBad(int return_code, const string& output, void *p) {
   CHECK(false) << "should never be called.";
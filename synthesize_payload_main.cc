@@ -0,0 +1,155 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Synthesizes a signed delta payload of a given shape, with the old
+// partitions it applies to, for reproducible performance tests, e.g.:
+//
+//   payload_synthesizer --out_file=payload.bin \
+//       --old_image=old_rootfs.img --old_kernel=old_kernel.img \
+//       --rootfs_operations=4096 --operation_types=MOVE:1,BSDIFF:1 \
+//       --private_key=unittest_key.pem
+//   apply_benchmark --payload=payload.bin \
+//       --old_image=old_rootfs.img --old_kernel=old_kernel.img \
+//       --target_image=/dev/loop0 --target_kernel=/dev/loop1
+
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#include <base/command_line.h>
+#include <base/logging.h>
+#include <base/memory/scoped_ptr.h>
+#include <base/string_number_conversions.h>
+#include <base/string_split.h>
+#include <gflags/gflags.h>
+
+#include "update_engine/payload_synthesizer.h"
+#include "update_engine/utils.h"
+
+DEFINE_string(out_file, "", "Path to write the payload to");
+DEFINE_string(old_image, "", "Path to write the old rootfs to");
+DEFINE_string(old_kernel, "", "Path to write the old kernel partition to");
+DEFINE_string(new_image, "",
+              "Path to write the new rootfs the payload makes to, if any");
+DEFINE_string(new_kernel, "",
+              "Path to write the new kernel partition the payload makes to, "
+              "if any");
+DEFINE_string(private_key, "", "Path to the private key to sign with, if any");
+DEFINE_int64(rootfs_blocks, 16384, "Size of the rootfs in 4 KiB blocks");
+DEFINE_int64(kernel_blocks, 2048,
+             "Size of the kernel partition in 4 KiB blocks");
+DEFINE_int64(rootfs_operations, 1024, "Number of rootfs operations");
+DEFINE_int64(kernel_operations, 8, "Number of kernel operations");
+DEFINE_string(operation_types, "REPLACE_BZ:3,MOVE:3,BSDIFF:3,ZERO:1",
+              "Comma-separated TYPE:WEIGHT pairs giving the relative "
+              "frequency of the operation types. REPLACE, REPLACE_BZ, "
+              "REPLACE_XZ, MOVE, BSDIFF and ZERO can be synthesized");
+DEFINE_int32(max_extents, 4,
+             "Most extents the blocks an operation writes are split in");
+DEFINE_int32(dag_depth, 4,
+             "Longest chain of operations that each read blocks the one "
+             "before wrote");
+DEFINE_double(compressibility, 0.5,
+              "Fraction of each new block that compresses away");
+DEFINE_double(diff_ratio, 0.01,
+              "Fraction of the bytes of its source a BSDIFF operation "
+              "changes");
+DEFINE_int32(seed, 1, "Seed of the pseudo-random data and shape");
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Sets the type weights of |spec| from |types|, a comma-separated list of
+// TYPE:WEIGHT pairs. Returns true on success.
+bool ParseOperationTypes(const string& types, SyntheticPayloadSpec* spec) {
+  spec->type_weights.clear();
+  vector<string> pairs;
+  base::SplitString(types, ',', &pairs);
+  for (vector<string>::const_iterator it = pairs.begin(); it != pairs.end();
+       ++it) {
+    vector<string> fields;
+    base::SplitString(*it, ':', &fields);
+    DeltaArchiveManifest_InstallOperation_Type type;
+    unsigned weight = 0;
+    if (fields.size() != 2 ||
+        !DeltaArchiveManifest_InstallOperation_Type_Parse(fields[0], &type) ||
+        !base::StringToUint(fields[1], &weight)) {
+      LOG(ERROR) << "Bad operation type weight " << *it;
+      return false;
+    }
+    spec->type_weights[type] = weight;
+  }
+  return true;
+}
+
+int Main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  CommandLine::Init(argc, argv);
+  logging::InitLogging("payload_synthesizer.log",
+                       logging::LOG_ONLY_TO_SYSTEM_DEBUG_LOG,
+                       logging::DONT_LOCK_LOG_FILE,
+                       logging::APPEND_TO_OLD_LOG_FILE,
+                       logging::DISABLE_DCHECK_FOR_NON_OFFICIAL_RELEASE_BUILDS);
+  CHECK(!FLAGS_out_file.empty()) << "Must pass --out_file";
+  CHECK(!FLAGS_old_image.empty()) << "Must pass --old_image";
+  CHECK(!FLAGS_old_kernel.empty()) << "Must pass --old_kernel";
+  CHECK_GT(FLAGS_rootfs_blocks, 1);
+  CHECK_GT(FLAGS_kernel_blocks, 0);
+  CHECK_GE(FLAGS_rootfs_operations, 0);
+  CHECK_GE(FLAGS_kernel_operations, 0);
+  CHECK_GE(FLAGS_max_extents, 1);
+  CHECK_GE(FLAGS_dag_depth, 1);
+
+  SyntheticPayloadSpec spec;
+  spec.rootfs_blocks = FLAGS_rootfs_blocks;
+  spec.kernel_blocks = FLAGS_kernel_blocks;
+  spec.rootfs_operations = FLAGS_rootfs_operations;
+  spec.kernel_operations = FLAGS_kernel_operations;
+  CHECK(ParseOperationTypes(FLAGS_operation_types, &spec));
+  spec.max_extents = FLAGS_max_extents;
+  spec.dag_depth = FLAGS_dag_depth;
+  spec.compressibility = FLAGS_compressibility;
+  spec.diff_ratio = FLAGS_diff_ratio;
+  spec.seed = FLAGS_seed;
+
+  // Unless asked for, the new partitions are only written to be hashed.
+  string new_image = FLAGS_new_image;
+  string new_kernel = FLAGS_new_kernel;
+  scoped_ptr<ScopedPathUnlinker> new_image_unlinker, new_kernel_unlinker;
+  if (new_image.empty()) {
+    CHECK(utils::MakeTempFile("/tmp/SyntheticRootfs.XXXXXX", &new_image,
+                              NULL));
+    new_image_unlinker.reset(new ScopedPathUnlinker(new_image));
+  }
+  if (new_kernel.empty()) {
+    CHECK(utils::MakeTempFile("/tmp/SyntheticKernel.XXXXXX", &new_kernel,
+                              NULL));
+    new_kernel_unlinker.reset(new ScopedPathUnlinker(new_kernel));
+  }
+
+  PayloadSynthesizer synthesizer(spec);
+  uint64_t metadata_size = 0;
+  if (!synthesizer.Synthesize(FLAGS_old_image, FLAGS_old_kernel, new_image,
+                              new_kernel, FLAGS_private_key, FLAGS_out_file,
+                              &metadata_size)) {
+    LOG(ERROR) << "Unable to synthesize the payload";
+    return 1;
+  }
+  printf("Wrote %s with metadata size %llu\n", FLAGS_out_file.c_str(),
+         static_cast<unsigned long long>(metadata_size));
+  return 0;
+}
+
+}  // namespace {}
+
+}  // namespace chromeos_update_engine
+
+int main(int argc, char** argv) {
+  return chromeos_update_engine::Main(argc, argv);
+}
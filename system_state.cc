@@ -3,6 +3,7 @@
 // found in the LICENSE file.
 
 #include <base/file_util.h>
+#include <base/logging.h>
 
 #include "update_engine/real_system_state.h"
 
@@ -12,6 +13,8 @@ static const char kPrefsDirectory[] = "/var/lib/update_engine/prefs";
 
 RealSystemState::RealSystemState()
     : device_policy_(NULL),
+      cached_prefs_(&prefs_),
+      payload_state_initialized_(false),
       request_params_(this) {}
 
 bool RealSystemState::Initialize(bool enable_connection_manager) {
@@ -19,9 +22,11 @@ bool RealSystemState::Initialize(bool enable_connection_manager) {
     LOG(ERROR) << "Failed to initialize preferences.";
     return false;
   }
-
-  if (!payload_state_.Initialize(&prefs_))
+  if (!cached_prefs_.Init()) {
+    LOG(ERROR) << "Failed to initialize the preferences cache.";
     return false;
+  }
+  cached_prefs_.set_flush_when_idle(true);
 
   if (enable_connection_manager) {
     connection_manager_ = new ConnectionManager(this);
@@ -36,4 +41,13 @@ bool RealSystemState::Initialize(bool enable_connection_manager) {
   return true;
 }
 
+PayloadStateInterface* RealSystemState::payload_state() {
+  if (!payload_state_initialized_) {
+    LOG_IF(ERROR, !payload_state_.Initialize(&cached_prefs_))
+        << "Failed to initialize the payload state.";
+    payload_state_initialized_ = true;
+  }
+  return &payload_state_;
+}
+
 }  // namespace chromeos_update_engine
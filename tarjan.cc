@@ -8,6 +8,7 @@
 #include "update_engine/tarjan.h"
 #include "update_engine/utils.h"
 
+using std::make_pair;
 using std::min;
 using std::vector;
 
@@ -20,51 +21,126 @@ const vector<Vertex>::size_type kInvalidIndex = -1;
 void TarjanAlgorithm::Execute(Vertex::Index vertex,
                               Graph* graph,
                               vector<Vertex::Index>* out) {
-  stack_.clear();
-  components_.clear();
-  index_ = 0;
-  for (Graph::iterator it = graph->begin(); it != graph->end(); ++it)
-    it->index = it->lowlink = kInvalidIndex;
+  CsrGraph csr_graph;
+  csr_graph.Assign(*graph);
+  Execute(vertex, csr_graph, NULL, NULL, out);
+}
+
+void TarjanAlgorithm::Execute(Vertex::Index vertex,
+                              const CsrGraph& graph,
+                              const vector<bool>* removed,
+                              const vector<Vertex::Index>* components,
+                              vector<Vertex::Index>* out) {
+  Reset(graph.size());
   required_vertex_ = vertex;
+  removed_ = removed;
+  within_components_ = components;
+  component_ids_ = NULL;
 
   Tarjan(vertex, graph);
-  if (!components_.empty())
-    out->swap(components_[0]);
+  if (found_component_)
+    out->swap(component_);
 }
 
-void TarjanAlgorithm::Tarjan(Vertex::Index vertex, Graph* graph) {
-  CHECK_EQ((*graph)[vertex].index, kInvalidIndex);
-  (*graph)[vertex].index = index_;
-  (*graph)[vertex].lowlink = index_;
-  index_++;
-  stack_.push_back(vertex);
-  for (Vertex::EdgeMap::iterator it = (*graph)[vertex].out_edges.begin();
-       it != (*graph)[vertex].out_edges.end(); ++it) {
-    Vertex::Index vertex_next = it->first;
-    if ((*graph)[vertex_next].index == kInvalidIndex) {
-      Tarjan(vertex_next, graph);
-      (*graph)[vertex].lowlink = min((*graph)[vertex].lowlink,
-                                     (*graph)[vertex_next].lowlink);
-    } else if (utils::VectorContainsValue(stack_, vertex_next)) {
-      (*graph)[vertex].lowlink = min((*graph)[vertex].lowlink,
-                                     (*graph)[vertex_next].index);
+void TarjanAlgorithm::ExecuteAll(const CsrGraph& graph,
+                                 vector<Vertex::Index>* component_ids) {
+  Reset(graph.size());
+  removed_ = NULL;
+  within_components_ = NULL;
+  component_ids->assign(graph.size(), kInvalidIndex);
+  component_ids_ = component_ids;
+  num_components_ = 0;
+
+  for (Vertex::Index vertex = 0; vertex < graph.size(); vertex++) {
+    if (indexes_[vertex] == kInvalidIndex)
+      Tarjan(vertex, graph);
+  }
+  component_ids_ = NULL;
+}
+
+void TarjanAlgorithm::Reset(Vertex::Index size) {
+  stack_.clear();
+  search_stack_.clear();
+  component_.clear();
+  found_component_ = false;
+  index_ = 0;
+  if (indexes_.size() != size) {
+    indexes_.assign(size, kInvalidIndex);
+    lowlinks_.assign(size, kInvalidIndex);
+    on_stack_.assign(size, false);
+  } else {
+    for (vector<Vertex::Index>::const_iterator it = visited_.begin();
+         it != visited_.end(); ++it) {
+      indexes_[*it] = lowlinks_[*it] = kInvalidIndex;
+      on_stack_[*it] = false;
     }
   }
-  if ((*graph)[vertex].lowlink == (*graph)[vertex].index) {
-    vector<Vertex::Index> component;
-    Vertex::Index other_vertex;
-    do {
-      other_vertex = stack_.back();
-      stack_.pop_back();
-      component.push_back(other_vertex);
-    } while (other_vertex != vertex && !stack_.empty());
-      
-    if (utils::VectorContainsValue(component, required_vertex_)) {
-      components_.resize(components_.size() + 1);
-      component.swap(components_.back());
+  visited_.clear();
+}
+
+void TarjanAlgorithm::Tarjan(Vertex::Index vertex, const CsrGraph& graph) {
+  Visit(vertex, graph);
+  while (!search_stack_.empty()) {
+    Vertex::Index current = search_stack_.back().first;
+    CsrGraph::EdgeIndex edge = search_stack_.back().second;
+    if (edge != graph.EdgesEnd(current)) {
+      search_stack_.back().second++;
+      Vertex::Index vertex_next = graph.EdgeDestination(edge);
+      if (!Follows(vertex_next))
+        continue;
+      if (indexes_[vertex_next] == kInvalidIndex) {
+        // "Recurse" into |vertex_next|; its lowlink is taken into account
+        // once it's done.
+        Visit(vertex_next, graph);
+      } else if (on_stack_[vertex_next]) {
+        lowlinks_[current] = min(lowlinks_[current], indexes_[vertex_next]);
+      }
+      continue;
+    }
+
+    // All of the edges of |current| have been followed.
+    search_stack_.pop_back();
+    if (!search_stack_.empty()) {
+      Vertex::Index parent = search_stack_.back().first;
+      lowlinks_[parent] = min(lowlinks_[parent], lowlinks_[current]);
     }
+    if (lowlinks_[current] == indexes_[current])
+      PopComponent(current);
   }
 }
 
-}  // namespace chromeos_update_engine
+void TarjanAlgorithm::Visit(Vertex::Index vertex, const CsrGraph& graph) {
+  CHECK_EQ(indexes_[vertex], kInvalidIndex);
+  indexes_[vertex] = index_;
+  lowlinks_[vertex] = index_;
+  index_++;
+  visited_.push_back(vertex);
+  stack_.push_back(vertex);
+  on_stack_[vertex] = true;
+  search_stack_.push_back(make_pair(vertex, graph.EdgesBegin(vertex)));
+}
+
+void TarjanAlgorithm::PopComponent(Vertex::Index vertex) {
+  Vertex::Index other_vertex;
+  bool required = false;
+  if (!component_ids_ && !found_component_)
+    component_.clear();
+  do {
+    other_vertex = stack_.back();
+    stack_.pop_back();
+    on_stack_[other_vertex] = false;
+    if (component_ids_) {
+      (*component_ids_)[other_vertex] = num_components_;
+    } else if (!found_component_) {
+      component_.push_back(other_vertex);
+      required = required || other_vertex == required_vertex_;
+    }
+  } while (other_vertex != vertex && !stack_.empty());
 
+  if (component_ids_)
+    num_components_++;
+  else if (required)
+    found_component_ = true;
+}
+
+}  // namespace chromeos_update_engine
@@ -9,29 +9,101 @@
 // Strongly Connected Components in a graph.
 
 // Note: a true Tarjan algorithm would find all strongly connected components
-// in the graph. This implementation will only find the strongly connected
-// component containing the vertex passed in.
+// in the graph. Execute() will only find the strongly connected component
+// containing the vertex passed in, ExecuteAll() finds all of them.
 
+// The depth-first search keeps its own stack of the vertices being visited
+// rather than recursing, so that long dependency chains don't exhaust the
+// call stack, and all per-vertex state is kept in arrays reused across calls.
+
+#include <utility>
 #include <vector>
+#include "update_engine/csr_graph.h"
 #include "update_engine/graph_types.h"
 
 namespace chromeos_update_engine {
 
 class TarjanAlgorithm {
  public:
-  TarjanAlgorithm() : index_(0), required_vertex_(0) {}
+  TarjanAlgorithm()
+      : index_(0),
+        required_vertex_(0),
+        removed_(NULL),
+        within_components_(NULL),
+        component_ids_(NULL),
+        num_components_(0),
+        found_component_(false) {}
 
   // 'out' is set to the result if there is one, otherwise it's untouched.
   void Execute(Vertex::Index vertex,
                Graph* graph,
                std::vector<Vertex::Index>* out);
+
+  // Same as above, but on |graph| without the vertices marked in |removed|,
+  // and, if |components| is set, without those that aren't in the same
+  // component as |vertex| according to ExecuteAll(), which can't change the
+  // result but saves visiting them. Both may be NULL. The per-vertex state is
+  // only reset for the vertices visited by the previous call, so calling this
+  // for many vertices of a large graph doesn't cost time proportional to its
+  // size each time.
+  void Execute(Vertex::Index vertex,
+               const CsrGraph& graph,
+               const std::vector<bool>* removed,
+               const std::vector<Vertex::Index>* components,
+               std::vector<Vertex::Index>* out);
+
+  // Finds all the strongly connected components of |graph| in one pass. Sets
+  // |component_ids| to a number for each vertex that's the same for the
+  // vertices of one component and different for those of different ones.
+  void ExecuteAll(const CsrGraph& graph,
+                  std::vector<Vertex::Index>* component_ids);
+
  private:
-  void Tarjan(Vertex::Index vertex, Graph* graph);
+  // Clears the state left by the previous call for a graph of |size|
+  // vertices.
+  void Reset(Vertex::Index size);
+
+  // Returns true if the search follows edges into |vertex|.
+  bool Follows(Vertex::Index vertex) const {
+    return !(removed_ && (*removed_)[vertex]) &&
+        !(within_components_ &&
+          (*within_components_)[vertex] !=
+          (*within_components_)[required_vertex_]);
+  }
+
+  // Runs the depth-first search from |vertex|.
+  void Tarjan(Vertex::Index vertex, const CsrGraph& graph);
+
+  // Gives |vertex| the next index and pushes it on both stacks.
+  void Visit(Vertex::Index vertex, const CsrGraph& graph);
+
+  // Pops the component whose root is |vertex| off |stack_|.
+  void PopComponent(Vertex::Index vertex);
 
   Vertex::Index index_;
   Vertex::Index required_vertex_;
+  const std::vector<bool>* removed_;
+  const std::vector<Vertex::Index>* within_components_;
+  // Set by ExecuteAll(), which numbers every component rather than keeping
+  // the one with |required_vertex_|.
+  std::vector<Vertex::Index>* component_ids_;
+  Vertex::Index num_components_;
   std::vector<Vertex::Index> stack_;
-  std::vector<std::vector<Vertex::Index> > components_;
+  // The component with |required_vertex_|, once found, and whether it has
+  // been.
+  std::vector<Vertex::Index> component_;
+  bool found_component_;
+
+  // The vertices whose edges are being followed, each with the next edge to
+  // follow: the call stack of the recursive formulation.
+  std::vector<std::pair<Vertex::Index, CsrGraph::EdgeIndex> > search_stack_;
+
+  // The "index" and "lowlink" of each vertex in the paper, whether it's on
+  // |stack_|, and the vertices given an index so far.
+  std::vector<Vertex::Index> indexes_;
+  std::vector<Vertex::Index> lowlinks_;
+  std::vector<bool> on_stack_;
+  std::vector<Vertex::Index> visited_;
 };
 
 }  // namespace chromeos_update_engine
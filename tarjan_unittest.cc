@@ -75,6 +75,50 @@ TEST(TarjanAlgorithmTest, SimpleTest) {
     EXPECT_TRUE(utils::VectorContainsValue(vertex_indexes, n_g));
     EXPECT_TRUE(utils::VectorContainsValue(vertex_indexes, n_h));
   }
+
+  CsrGraph csr_graph;
+  csr_graph.Assign(graph);
+  vector<Vertex::Index> component_ids;
+  tarjan.ExecuteAll(csr_graph, &component_ids);
+  ASSERT_EQ(kNodeCount, component_ids.size());
+  for (Vertex::Index i = n_b; i <= n_e; i++)
+    EXPECT_EQ(component_ids[n_a], component_ids[i]);
+  EXPECT_NE(component_ids[n_a], component_ids[n_f]);
+  EXPECT_NE(component_ids[n_a], component_ids[n_g]);
+  EXPECT_NE(component_ids[n_f], component_ids[n_g]);
+  EXPECT_EQ(component_ids[n_g], component_ids[n_h]);
+}
+
+TEST(TarjanAlgorithmTest, DeepChainTest) {
+  // A cycle far deeper than the call stack would allow a recursive search.
+  const Graph::size_type kNodeCount = 100000;
+  Graph graph(kNodeCount);
+  for (Vertex::Index i = 0; i < kNodeCount; i++) {
+    graph[i].out_edges.insert(make_pair((i + 1) % kNodeCount,
+                                        EdgeProperties()));
+  }
+  CsrGraph csr_graph;
+  csr_graph.Assign(graph);
+
+  TarjanAlgorithm tarjan;
+  vector<Vertex::Index> component_ids;
+  tarjan.ExecuteAll(csr_graph, &component_ids);
+  ASSERT_EQ(kNodeCount, component_ids.size());
+  for (Vertex::Index i = 1; i < kNodeCount; i++)
+    ASSERT_EQ(component_ids[0], component_ids[i]);
+
+  vector<Vertex::Index> vertex_indexes;
+  tarjan.Execute(kNodeCount / 2, csr_graph, NULL, &component_ids,
+                 &vertex_indexes);
+  EXPECT_EQ(kNodeCount, vertex_indexes.size());
+
+  // Without one of its vertices, the cycle falls apart.
+  vector<bool> removed(kNodeCount, false);
+  removed[0] = true;
+  vertex_indexes.clear();
+  tarjan.Execute(1, csr_graph, &removed, &component_ids, &vertex_indexes);
+  ASSERT_EQ(1, vertex_indexes.size());
+  EXPECT_EQ(1, vertex_indexes[0]);
 }
 
 }  // namespace chromeos_update_engine
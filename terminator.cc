@@ -4,17 +4,37 @@
 
 #include "update_engine/terminator.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+
 #include <cstdlib>
 
+#include <base/logging.h>
+
 namespace chromeos_update_engine {
 
 volatile sig_atomic_t Terminator::exit_status_ = 1;  // default exit status
 volatile sig_atomic_t Terminator::exit_blocked_ = 0;
 volatile sig_atomic_t Terminator::exit_requested_ = 0;
+volatile sig_atomic_t Terminator::exit_deferred_ = 0;
+google::protobuf::Closure* Terminator::exit_callback_ = NULL;
+int Terminator::exit_pipe_[2] = { -1, -1 };
 
 void Terminator::Init() {
   exit_blocked_ = 0;
   exit_requested_ = 0;
+  set_exit_callback(NULL);
+  if (exit_pipe_[0] < 0) {
+    if (pipe2(exit_pipe_, O_CLOEXEC | O_NONBLOCK) == 0) {
+      GIOChannel* channel = g_io_channel_unix_new(exit_pipe_[0]);
+      g_io_add_watch(channel, G_IO_IN, StaticExitRequested, NULL);
+      g_io_channel_unref(channel);
+    } else {
+      PLOG(WARNING) << "Unable to create the exit pipe, exiting right away "
+                    << "on termination requests.";
+      exit_pipe_[0] = exit_pipe_[1] = -1;
+    }
+  }
   signal(SIGTERM, HandleSignal);
 }
 
@@ -27,16 +47,47 @@ void Terminator::Exit() {
   exit(exit_status_);
 }
 
+void Terminator::set_exit_callback(google::protobuf::Closure* callback) {
+  exit_deferred_ = 0;
+  exit_callback_ = callback;
+  exit_deferred_ = callback && exit_pipe_[1] >= 0 ? 1 : 0;
+}
+
 void Terminator::HandleSignal(int signum) {
-  if (exit_blocked_ == 0) {
+  if (exit_blocked_ == 0 && exit_deferred_ == 0) {
     Exit();
   }
   exit_requested_ = 1;
+  if (exit_deferred_) {
+    const char kByte = 0;
+    // The main loop only needs to wake up once, so a full pipe is fine.
+    if (write(exit_pipe_[1], &kByte, 1) < 0) {}
+  }
+}
+
+gboolean Terminator::StaticExitRequested(GIOChannel* source,
+                                         GIOCondition condition,
+                                         gpointer data) {
+  char buffer[16];
+  while (read(exit_pipe_[0], buffer, sizeof(buffer)) > 0) {}
+  if (!exit_requested_)
+    return TRUE;  // Keep watching.
+  // The operations that block exit complete before the main loop runs
+  // again, so the callback can't interrupt one.
+  if (exit_callback_) {
+    LOG(INFO) << "Termination requested, saving the progress first.";
+    exit_callback_->Run();
+  } else if (!exit_blocked_) {
+    Exit();
+  }
+  return TRUE;  // Keep watching.
 }
 
 ScopedTerminatorExitUnblocker::~ScopedTerminatorExitUnblocker() {
   Terminator::set_exit_blocked(false);
-  if (Terminator::exit_requested()) {
+  // A deferred exit is left to the callback, which the signal handler has
+  // woken the main loop up for.
+  if (Terminator::exit_requested() && !Terminator::exit_deferred_) {
     Terminator::Exit();
   }
 }
@@ -7,6 +7,8 @@
 
 #include <signal.h>
 
+#include <glib.h>
+#include <google/protobuf/stubs/common.h>
 #include <gtest/gtest_prod.h>  // for FRIEND_TEST
 
 namespace chromeos_update_engine {
@@ -27,20 +29,43 @@ class Terminator {
   static bool exit_blocked() { return exit_blocked_ != 0; }
 
   // Returns true if the system is trying to terminate the process, false
-  // otherwise. Returns true only if exit was blocked when the termination
-  // request arrived.
+  // otherwise. Returns true only if exit was blocked or deferred when the
+  // termination request arrived.
   static bool exit_requested() { return exit_requested_ != 0; }
 
+  // Defers the exit on a termination request to |callback|, which is run
+  // from the main loop, once exit is no longer blocked, e.g., to save the
+  // progress of the work in progress first. |callback| must call Exit()
+  // when it's done. Set to NULL, the default, to exit right away again.
+  // Not owned.
+  static void set_exit_callback(google::protobuf::Closure* callback);
+
  private:
+  friend class ScopedTerminatorExitUnblocker;
   FRIEND_TEST(TerminatorTest, HandleSignalTest);
+  FRIEND_TEST(TerminatorTest, ExitCallbackTest);
   FRIEND_TEST(TerminatorDeathTest, ScopedTerminatorExitUnblockerExitTest);
 
   // The signal handler.
   static void HandleSignal(int signum);
 
+  // Runs the exit callback from the main loop once the signal handler has
+  // written to |exit_pipe_|.
+  static gboolean StaticExitRequested(GIOChannel* source,
+                                      GIOCondition condition,
+                                      gpointer data);
+
   static volatile sig_atomic_t exit_status_;
   static volatile sig_atomic_t exit_blocked_;
   static volatile sig_atomic_t exit_requested_;
+
+  // Set while there's an exit callback, so that the signal handler doesn't
+  // have to read |exit_callback_|.
+  static volatile sig_atomic_t exit_deferred_;
+  static google::protobuf::Closure* exit_callback_;
+
+  // The pipe the signal handler wakes up the main loop through.
+  static int exit_pipe_[2];
 };
 
 class ScopedTerminatorExitUnblocker {
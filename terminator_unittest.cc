@@ -2,6 +2,9 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <base/memory/scoped_ptr.h>
+#include <glib.h>
+#include <google/protobuf/stubs/common.h>
 #include <gtest/gtest.h>
 #include <gtest/gtest-spi.h>
 
@@ -36,6 +39,10 @@ void UnblockExitThroughUnblocker() {
 void RaiseSIGTERM() {
   ASSERT_EXIT(raise(SIGTERM), ExitedWithCode(2), "");
 }
+
+void CountCall(int* calls) {
+  (*calls)++;
+}
 }  // namespace {}
 
 TEST_F(TerminatorTest, HandleSignalTest) {
@@ -53,6 +60,33 @@ TEST_F(TerminatorTest, ScopedTerminatorExitUnblockerTest) {
   ASSERT_FALSE(Terminator::exit_requested());
 }
 
+TEST_F(TerminatorTest, ExitCallbackTest) {
+  int calls = 0;
+  scoped_ptr<google::protobuf::Closure> callback(
+      google::protobuf::NewPermanentCallback(&CountCall, &calls));
+  Terminator::set_exit_callback(callback.get());
+  while (g_main_context_iteration(NULL, FALSE)) {}
+
+  // The exit is left to the callback, run from the main loop, even once
+  // exit is no longer blocked.
+  Terminator::set_exit_blocked(true);
+  Terminator::HandleSignal(SIGTERM);
+  EXPECT_TRUE(Terminator::exit_requested());
+  UnblockExitThroughUnblocker();
+  EXPECT_EQ(0, calls);
+  while (g_main_context_iteration(NULL, FALSE)) {}
+  EXPECT_EQ(1, calls);
+}
+
+TEST_F(TerminatorDeathTest, ExitCallbackDeathTest) {
+  int calls = 0;
+  scoped_ptr<google::protobuf::Closure> callback(
+      google::protobuf::NewPermanentCallback(&CountCall, &calls));
+  Terminator::set_exit_callback(callback.get());
+  Terminator::set_exit_callback(NULL);
+  RaiseSIGTERM();
+}
+
 TEST_F(TerminatorDeathTest, ExitTest) {
   ASSERT_EXIT(Terminator::Exit(), ExitedWithCode(2), "");
   Terminator::set_exit_blocked(true);
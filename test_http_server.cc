@@ -8,16 +8,33 @@
 // handles very slow data transfers.
 
 // To use this, simply make an HTTP connection to localhost:port and
-// GET a url.
+// GET a url. POST requests are served the same way once their body has been
+// read, so that the server can stand in for Omaha too.
+
+// It also serves large responses under shaped network conditions, so that
+// the fetchers can be benchmarked reproducibly:
+//
+//   /shaped/<length>/<latency_ms>/<bytes_per_sec>/<stall_every>/<stall_ms>
+//   /shaped-file/<name>/<latency_ms>/<bytes_per_sec>/<stall_every>/<stall_ms>
+//
+// serve <length> bytes of the default payload, or the file <name> of the
+// directory given with --files_dir=<dir>, after waiting <latency_ms>. The
+// body is sent at no more than <bytes_per_sec> and stalls for <stall_ms>
+// after every <stall_every> bytes; 0 disables either. Range requests are
+// supported, and these responses are served from a process of their own so
+// that many can be in progress at the same time.
 
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <netinet/in.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -29,6 +46,7 @@
 #include <base/string_split.h>
 #include <base/string_util.h>
 #include <base/stringprintf.h>
+#include <base/time.h>
 
 #include "update_engine/http_common.h"
 #include "update_engine/http_fetcher_unittest.h"
@@ -37,6 +55,8 @@
 // HTTP end-of-line delimiter; sorry, this needs to be a macro.
 #define EOL "\r\n"
 
+using base::TimeDelta;
+using base::TimeTicks;
 using std::min;
 using std::string;
 using std::vector;
@@ -64,7 +84,11 @@ bool ParseRequest(int fd, HttpRequest* request) {
       exit(1);
     }
     headers.append(buf, r);
-  } while (!EndsWith(headers, EOL EOL, true));
+  } while (headers.find(EOL EOL) == string::npos);
+  // Any bytes after the headers are the start of the body of a POST.
+  const string::size_type headers_end = headers.find(EOL EOL);
+  size_t body_read = headers.size() - headers_end - strlen(EOL EOL);
+  headers.resize(headers_end + strlen(EOL EOL));
 
   LOG(INFO) << "got headers:\n--8<------8<------8<------8<----\n"
             << headers
@@ -79,11 +103,13 @@ bool ParseRequest(int fd, HttpRequest* request) {
   std::vector<string> terms;
   base::SplitStringAlongWhitespace(lines[0], &terms);
   CHECK_EQ(terms.size(), static_cast<vector<string>::size_type>(3));
-  CHECK_EQ(terms[0], "GET");
+  CHECK(terms[0] == "GET" || terms[0] == "POST") << terms[0];
   request->url = terms[1];
   LOG(INFO) << "URL: " << request->url;
 
   // Decode remaining lines.
+  size_t body_length = 0;
+  bool expect_continue = false;
   size_t i;
   for (i = 1; i < lines.size(); i++) {
     std::vector<string> terms;
@@ -112,11 +138,33 @@ bool ParseRequest(int fd, HttpRequest* request) {
       CHECK_EQ(terms.size(), static_cast<vector<string>::size_type>(2));
       request->host = terms[1];
       LOG(INFO) << "host attribute: " << request->host;
+    } else if (terms[0] == "Content-Length:") {
+      CHECK_EQ(terms.size(), static_cast<vector<string>::size_type>(2));
+      body_length = atoll(terms[1].c_str());
+    } else if (terms[0] == "Expect:") {
+      expect_continue = (terms.size() == 2 && terms[1] == "100-continue");
     } else {
       LOG(WARNING) << "ignoring HTTP attribute: `" << lines[i] << "'";
     }
   }
 
+  // The body isn't used, but it's read so that the client doesn't see the
+  // connection reset when the response is complete.
+  if (expect_continue && body_read < body_length) {
+    const char kContinue[] = "HTTP/1.1 100 Continue" EOL EOL;
+    if (write(fd, kContinue, strlen(kContinue)) < 0)
+      perror("write");
+  }
+  while (body_read < body_length) {
+    char buf[1024];
+    ssize_t r = read(fd, buf, std::min(sizeof(buf), body_length - body_read));
+    if (r <= 0) {
+      perror("read");
+      exit(1);
+    }
+    body_read += r;
+  }
+
   return true;
 }
 
@@ -345,6 +393,134 @@ ssize_t HandleGet(int fd, const HttpRequest& request,
   return HandleGet(fd, request, total_length, 0, 0, 0);
 }
 
+// Limits the rate at which a response body is sent and makes it stall
+// periodically.
+class TrafficShaper {
+ public:
+  TrafficShaper(size_t bytes_per_sec, size_t stall_every, int stall_ms)
+      : bytes_per_sec_(bytes_per_sec),
+        stall_every_(stall_every),
+        stall_ms_(stall_ms),
+        sent_(0),
+        next_stall_(stall_every) {}
+
+  // Sleeps until more of the body may be sent, and returns how much of the
+  // next |count| bytes may be sent then.
+  size_t Wait(size_t count) {
+    // The pace is set from when the body starts to be sent.
+    if (start_time_.is_null())
+      start_time_ = TimeTicks::Now();
+    if (stall_every_ > 0)
+      count = min(count, next_stall_ - sent_);
+    if (bytes_per_sec_ > 0) {
+      // Send about twenty pieces a second to keep the rate smooth.
+      count = min(count, std::max(bytes_per_sec_ / 20, static_cast<size_t>(1)));
+      const TimeTicks send_time = start_time_ + TimeDelta::FromMicroseconds(
+          static_cast<int64_t>(sent_) * 1000000 / bytes_per_sec_);
+      const TimeDelta wait = send_time - TimeTicks::Now();
+      if (wait > TimeDelta())
+        usleep(wait.InMicroseconds());
+    }
+    return count;
+  }
+
+  // Records that |count| bytes were sent, and stalls if it's time to.
+  void Sent(size_t count) {
+    sent_ += count;
+    if (stall_every_ > 0 && sent_ >= next_stall_) {
+      next_stall_ += stall_every_;
+      usleep(stall_ms_ * 1000);
+      // Don't make up for the stall by sending faster afterwards.
+      start_time_ = start_time_ + TimeDelta::FromMilliseconds(stall_ms_);
+    }
+  }
+
+ private:
+  const size_t bytes_per_sec_;
+  const size_t stall_every_;
+  const int stall_ms_;
+  size_t sent_;
+  size_t next_stall_;
+  TimeTicks start_time_;
+};
+
+// Sends the bytes [start_offset, end_offset) of the file |file_fd| with
+// sendfile(), or of the default payload if |file_fd| is -1, at the pace set
+// by |shaper|. Returns the number of bytes sent.
+size_t WriteShapedPayload(int fd, int file_fd, off_t start_offset,
+                          off_t end_offset, TrafficShaper* shaper) {
+  const size_t kMaxWriteSize = 1024 * 1024;
+  const size_t kLineLength = 10;
+  string lines;
+  if (file_fd < 0) {
+    // Lines of 'abcdefghij' that can be written from any offset within a
+    // line.
+    lines.reserve(kMaxWriteSize + kLineLength);
+    while (lines.size() < kMaxWriteSize + kLineLength)
+      lines += "abcdefghij";
+  }
+
+  off_t offset = start_offset;
+  while (offset < end_offset) {
+    const size_t count = shaper->Wait(
+        min(static_cast<off_t>(kMaxWriteSize), end_offset - offset));
+    ssize_t written;
+    if (file_fd >= 0) {
+      off_t file_offset = offset;
+      written = sendfile(fd, file_fd, &file_offset, count);
+    } else {
+      written = write(fd, lines.data() + offset % kLineLength, count);
+    }
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0) {
+      PLOG(INFO) << "failed to send the payload";
+      break;
+    }
+    offset += written;
+    shaper->Sent(written);
+  }
+  return offset - start_offset;
+}
+
+// Generates a response with the bytes of the file |file_fd|, or of the
+// default payload if |file_fd| is -1, that the request asks for out of
+// |total_length|, after waiting |latency_ms|. |shaper| paces the body.
+// Returns the total number of bytes delivered or -1 for error.
+ssize_t HandleShapedGet(int fd, const HttpRequest& request, int file_fd,
+                        off_t total_length, int latency_ms,
+                        TrafficShaper* shaper) {
+  usleep(latency_ms * 1000);
+  const off_t start_offset = request.start_offset;
+  if (start_offset >= total_length) {
+    LOG(WARNING) << "start offset (" << start_offset
+                 << ") exceeds total length (" << total_length
+                 << "), generating error response ("
+                 << kHttpResponseReqRangeNotSat << ")";
+    return WriteHeaders(fd, total_length, total_length,
+                        kHttpResponseReqRangeNotSat);
+  }
+  off_t end_offset = (request.end_offset > 0 ?
+                      min(request.end_offset, total_length) : total_length);
+  if (end_offset < start_offset) {
+    LOG(WARNING) << "end offset (" << end_offset << ") precedes start offset ("
+                 << start_offset << "), generating error response";
+    return WriteHeaders(fd, 0, 0, kHttpResponseBadRequest);
+  }
+
+  ssize_t written = WriteHeaders(fd, start_offset, end_offset,
+                                 request.return_code);
+  if (written < 0)
+    return -1;
+  const TimeTicks start_time = TimeTicks::Now();
+  const size_t payload_written = WriteShapedPayload(fd, file_fd, start_offset,
+                                                    end_offset, shaper);
+  const double seconds = (TimeTicks::Now() - start_time).InSecondsF();
+  LOG(INFO) << payload_written << " payload bytes written in " << seconds
+            << " seconds";
+  return written + payload_written;
+}
+
 // Handles /redirect/<code>/<url> requests by returning the specified
 // redirect <code> with a location pointing to /<url>.
 void HandleRedirect(int fd, const HttpRequest& request) {
@@ -463,11 +639,55 @@ class UrlTerms {
   inline long GetLong(const off_t index) const {
     return atol(GetCStr(index));
   }
+  inline int64_t GetInt64(const off_t index) const {
+    return atoll(GetCStr(index));
+  }
 
  private:
   std::vector<string> terms;
 };
 
+// The directory /shaped-file/ requests are served from.
+string files_dir;
+
+// Forks a process to serve |request| with HandleShapedGet(), with the
+// shaping parameters in the last four |terms|. Returns in the parent.
+void ForkShapedGet(int fd, const HttpRequest& request, const UrlTerms& terms,
+                   int file_fd, off_t total_length) {
+  const pid_t pid = fork();
+  if (pid < 0) {
+    PLOG(ERROR) << "fork failed";
+    return;
+  }
+  if (pid > 0)
+    return;
+  TrafficShaper shaper(terms.GetInt64(3), terms.GetInt64(4), terms.GetInt(5));
+  HandleShapedGet(fd, request, file_fd, total_length, terms.GetInt(2),
+                  &shaper);
+  _exit(0);
+}
+
+void HandleShapedFile(int fd, const HttpRequest& request,
+                      const UrlTerms& terms) {
+  const string name = terms.Get(1);
+  if (files_dir.empty() || name.empty() || name == "." || name == "..") {
+    HandleError(fd, request);
+    return;
+  }
+  const string path = files_dir + "/" + name;
+  int file_fd = open(path.c_str(), O_RDONLY);
+  struct stat stbuf;
+  if (file_fd < 0 || fstat(file_fd, &stbuf) != 0) {
+    PLOG(ERROR) << "unable to open " << path;
+    if (file_fd >= 0)
+      close(file_fd);
+    HandleError(fd, request);
+    return;
+  }
+  ForkShapedGet(fd, request, terms, file_fd, stbuf.st_size);
+  close(file_fd);
+}
+
 void HandleConnection(int fd) {
   HttpRequest request;
   ParseRequest(fd, &request);
@@ -483,6 +703,12 @@ void HandleConnection(int fd) {
     const UrlTerms terms(url, 5);
     HandleGet(fd, request, terms.GetLong(1), terms.GetLong(2), terms.GetLong(3),
               terms.GetLong(4));
+  } else if (StartsWithASCII(url, "/shaped/", true)) {
+    const UrlTerms terms(url, 6);
+    ForkShapedGet(fd, request, terms, -1, terms.GetInt64(1));
+  } else if (StartsWithASCII(url, "/shaped-file/", true)) {
+    const UrlTerms terms(url, 6);
+    HandleShapedFile(fd, request, terms);
   } else if (url.find("/redirect/") == 0) {
     HandleRedirect(fd, request);
   } else if (url == "/error") {
@@ -504,6 +730,16 @@ using namespace chromeos_update_engine;
 int main(int argc, char** argv) {
   // Ignore SIGPIPE on write() to sockets.
   signal(SIGPIPE, SIG_IGN);
+  // Let the processes serving shaped responses be reaped automatically.
+  signal(SIGCHLD, SIG_IGN);
+
+  const char kFilesDirFlag[] = "--files_dir=";
+  for (int i = 1; i < argc; i++) {
+    if (StartsWithASCII(argv[i], kFilesDirFlag, true))
+      files_dir = argv[i] + strlen(kFilesDirFlag);
+    else
+      LOG(FATAL) << "unknown argument " << argv[i];
+  }
 
   socklen_t clilen;
   struct sockaddr_in server_addr;
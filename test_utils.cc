@@ -182,6 +182,22 @@ void FillWithData(vector<char>* buffer) {
   }
 }
 
+bool MemoryExtentWriter::Write(const void* bytes, size_t count) {
+  if (fail_after_ >= 0 &&
+      data_.size() + count > static_cast<size_t>(fail_after_))
+    return false;
+  const char* c_bytes = reinterpret_cast<const char*>(bytes);
+  data_.insert(data_.end(), c_bytes, c_bytes + count);
+  return true;
+}
+
+vector<char> RandomData(size_t size) {
+  vector<char> data(size);
+  for (size_t i = 0; i < size; i++)
+    data[i] = random();
+  return data;
+}
+
 void CreateEmptyExtImageAtPath(const string& path,
                                size_t size,
                                int block_size) {
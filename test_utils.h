@@ -13,6 +13,7 @@
 #include <gtest/gtest.h>
 
 #include "update_engine/action.h"
+#include "update_engine/extent_writer.h"
 #include "update_engine/subprocess.h"
 #include "update_engine/utils.h"
 
@@ -48,6 +49,9 @@ inline int System(const std::string& cmd) {
 
 void FillWithData(std::vector<char>* buffer);
 
+// Returns |size| bytes from random(), which don't compress.
+std::vector<char> RandomData(size_t size);
+
 namespace {
 // 300 byte pseudo-random string. Not null terminated.
 // This does not gzip compress well.
@@ -168,6 +172,37 @@ class ScopedTempFile {
   scoped_ptr<ScopedPathUnlinker> unlinker_;
 };
 
+// An ExtentWriter that gathers what's written to it in memory, in order.
+// Init() starts over. Once set_fail_after() is given a size, the writes
+// fail once the data would grow past it.
+class MemoryExtentWriter : public ExtentWriter {
+ public:
+  MemoryExtentWriter() : fail_after_(-1), init_count_(0) {}
+
+  virtual bool Init(int fd,
+                    const std::vector<Extent>& extents,
+                    uint32_t block_size) {
+    init_count_++;
+    data_.clear();
+    return true;
+  }
+  virtual bool Write(const void* bytes, size_t count);
+  virtual bool EndImpl() { return true; }
+
+  const std::vector<char>& data() const { return data_; }
+  // The number of times Init() was called.
+  int init_count() const { return init_count_; }
+  // -1, the default, never fails the writes.
+  void set_fail_after(ssize_t fail_after) { fail_after_ = fail_after; }
+
+ private:
+  ssize_t fail_after_;
+  int init_count_;
+  std::vector<char> data_;
+
+  DISALLOW_COPY_AND_ASSIGN(MemoryExtentWriter);
+};
+
 // Useful actions for test
 
 class NoneType;
@@ -0,0 +1,152 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/thread_pool.h"
+
+#include <unistd.h>
+
+#include <base/logging.h>
+
+#include "update_engine/utils.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+ThreadPool::ThreadPool(unsigned num_threads)
+    : num_threads_(num_threads),
+      next_worker_(0),
+      num_queued_(0),
+      stopping_(false) {
+  if (num_threads_ == 0) {
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    num_threads_ = num_cpus > 0 ? num_cpus : 1;
+  }
+  g_mutex_init(&mutex_);
+  g_cond_init(&work_cond_);
+  g_cond_init(&done_cond_);
+  for (unsigned i = 0; i < num_threads_; i++) {
+    Worker* worker = new Worker;
+    worker->pool = this;
+    worker->index = i;
+    worker->thread = NULL;
+    g_mutex_init(&worker->mutex);
+    workers_.push_back(worker);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  g_mutex_lock(&mutex_);
+  stopping_ = true;
+  g_cond_broadcast(&work_cond_);
+  g_mutex_unlock(&mutex_);
+  // The workers steal from each other's queues, so none is freed before
+  // all have stopped.
+  for (vector<Worker*>::iterator it = workers_.begin(); it != workers_.end();
+       ++it) {
+    if ((*it)->thread)
+      g_thread_join((*it)->thread);
+  }
+  for (vector<Worker*>::iterator it = workers_.begin(); it != workers_.end();
+       ++it) {
+    g_mutex_clear(&(*it)->mutex);
+    delete *it;
+  }
+  g_cond_clear(&done_cond_);
+  g_cond_clear(&work_cond_);
+  g_mutex_clear(&mutex_);
+}
+
+bool ThreadPool::Init() {
+  for (vector<Worker*>::iterator it = workers_.begin(); it != workers_.end();
+       ++it) {
+    TEST_AND_RETURN_FALSE((*it)->thread == NULL);
+    (*it)->thread =
+        g_thread_try_new("pool_worker", WorkerThread, *it, NULL);
+    TEST_AND_RETURN_FALSE((*it)->thread != NULL);
+  }
+  return true;
+}
+
+void ThreadPool::Submit(ThreadPoolTask* task) {
+  g_mutex_lock(&mutex_);
+  CHECK(!stopping_);
+  task->done_ = false;
+  Worker* worker = workers_[next_worker_];
+  next_worker_ = (next_worker_ + 1) % num_threads_;
+  g_mutex_unlock(&mutex_);
+
+  g_mutex_lock(&worker->mutex);
+  worker->tasks.push_back(task);
+  g_mutex_unlock(&worker->mutex);
+
+  g_mutex_lock(&mutex_);
+  num_queued_++;
+  g_cond_signal(&work_cond_);
+  g_mutex_unlock(&mutex_);
+}
+
+bool ThreadPool::Wait(ThreadPoolTask* task) {
+  g_mutex_lock(&mutex_);
+  while (!task->done_)
+    g_cond_wait(&done_cond_, &mutex_);
+  bool result = task->result_;
+  g_mutex_unlock(&mutex_);
+  return result;
+}
+
+gpointer ThreadPool::WorkerThread(gpointer data) {
+  Worker* worker = reinterpret_cast<Worker*>(data);
+  worker->pool->RunWorker(worker);
+  return NULL;
+}
+
+ThreadPoolTask* ThreadPool::TakeTask(Worker* worker) {
+  ThreadPoolTask* task = NULL;
+  g_mutex_lock(&worker->mutex);
+  if (!worker->tasks.empty()) {
+    task = worker->tasks.front();
+    worker->tasks.pop_front();
+  }
+  g_mutex_unlock(&worker->mutex);
+  for (unsigned i = 1; !task && i < num_threads_; i++) {
+    Worker* victim = workers_[(worker->index + i) % num_threads_];
+    g_mutex_lock(&victim->mutex);
+    if (!victim->tasks.empty()) {
+      task = victim->tasks.back();
+      victim->tasks.pop_back();
+    }
+    g_mutex_unlock(&victim->mutex);
+  }
+  return task;
+}
+
+void ThreadPool::RunWorker(Worker* worker) {
+  for (;;) {
+    ThreadPoolTask* task = TakeTask(worker);
+    if (!task) {
+      g_mutex_lock(&mutex_);
+      while (num_queued_ <= 0 && !stopping_)
+        g_cond_wait(&work_cond_, &mutex_);
+      // Drain the queues before honoring a stop request.
+      bool stop = num_queued_ <= 0;
+      g_mutex_unlock(&mutex_);
+      if (stop)
+        return;
+      continue;
+    }
+
+    g_mutex_lock(&mutex_);
+    num_queued_--;
+    g_mutex_unlock(&mutex_);
+    bool result = task->Run();
+    g_mutex_lock(&mutex_);
+    task->result_ = result;
+    task->done_ = true;
+    g_cond_broadcast(&done_cond_);
+    g_mutex_unlock(&mutex_);
+  }
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,155 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_THREAD_POOL_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_THREAD_POOL_H__
+
+#include <glib.h>
+
+#include <deque>
+#include <tr1/memory>
+#include <vector>
+
+#include <base/basictypes.h>
+#include <base/logging.h>
+
+// A fixed-size pool of glib worker threads used by the payload generator to
+// spread independent, CPU-bound work across cores. Each worker has its own
+// task queue; submitted tasks are spread over the queues round-robin and a
+// worker whose queue runs dry steals from the back of the others, so a few
+// slow tasks don't leave the remaining workers idle.
+
+namespace chromeos_update_engine {
+
+class ThreadPool;
+
+// A unit of work to run on a ThreadPool. Subclasses implement Run() and keep
+// their inputs and outputs as members.
+class ThreadPoolTask {
+ public:
+  ThreadPoolTask() : done_(false), result_(false) {}
+  virtual ~ThreadPoolTask() {}
+
+  // Performs the work. Called on a worker thread. Returns true on success.
+  virtual bool Run() = 0;
+
+ private:
+  friend class ThreadPool;
+
+  // Protected by the owning pool's mutex.
+  bool done_;
+  bool result_;
+
+  DISALLOW_COPY_AND_ASSIGN(ThreadPoolTask);
+};
+
+class ThreadPool {
+ public:
+  // Creates a pool of |num_threads| workers. A |num_threads| of 0 means one
+  // worker per online CPU.
+  explicit ThreadPool(unsigned num_threads);
+
+  // Waits for all submitted tasks to run and stops the workers.
+  ~ThreadPool();
+
+  // Starts the worker threads. Returns true on success.
+  bool Init();
+
+  // Queues |task| to be run by one of the workers. |task| isn't owned and
+  // must stay alive until Wait() on it returns.
+  void Submit(ThreadPoolTask* task);
+
+  // Blocks until |task| has run and returns the value its Run() returned.
+  bool Wait(ThreadPoolTask* task);
+
+  unsigned num_threads() const { return num_threads_; }
+
+ private:
+  struct Worker {
+    ThreadPool* pool;
+    unsigned index;
+    GThread* thread;
+    // Protects |tasks|.
+    GMutex mutex;
+    std::deque<ThreadPoolTask*> tasks;
+  };
+
+  static gpointer WorkerThread(gpointer data);
+  void RunWorker(Worker* worker);
+
+  // Pops the next task off the front of |worker|'s queue or, failing that,
+  // steals one off the back of another worker's queue. Returns NULL if all
+  // queues are empty.
+  ThreadPoolTask* TakeTask(Worker* worker);
+
+  unsigned num_threads_;
+  std::vector<Worker*> workers_;
+  // The worker whose queue receives the next submitted task.
+  unsigned next_worker_;
+
+  GMutex mutex_;
+  // Signalled when a task is queued or the pool is stopping.
+  GCond work_cond_;
+  // Signalled when a task completes.
+  GCond done_cond_;
+  // Number of queued tasks that no worker has taken yet. May briefly go
+  // negative as a task can be taken before Submit() accounts for it.
+  int num_queued_;
+  bool stopping_;
+
+  DISALLOW_COPY_AND_ASSIGN(ThreadPool);
+};
+
+// Reorder buffer for tasks of type T: tasks run on a ThreadPool in any order
+// but are handed back in the order they were submitted, which is what
+// callers need to produce deterministic output. Up to |max_pending| tasks
+// may be in flight, so keep it a few times the pool's size to hide slow
+// tasks at the head.
+template<typename T>
+class OrderedTaskRunner {
+ public:
+  OrderedTaskRunner(ThreadPool* pool, size_t max_pending)
+      : pool_(pool),
+        max_pending_(max_pending) {
+    CHECK_GT(max_pending_, static_cast<size_t>(0));
+  }
+
+  // Waits for outstanding tasks, since they reference the caller's tasks.
+  ~OrderedTaskRunner() {
+    while (!pending_.empty()) {
+      pool_->Wait(pending_.front().get());
+      pending_.pop_front();
+    }
+  }
+
+  // Returns true if no more tasks should be submitted before the oldest one
+  // is taken out with WaitOldest().
+  bool full() const { return pending_.size() >= max_pending_; }
+  bool empty() const { return pending_.empty(); }
+
+  void Submit(const std::tr1::shared_ptr<T>& task) {
+    pending_.push_back(task);
+    pool_->Submit(task.get());
+  }
+
+  // Waits for the oldest pending task to complete and removes it into
+  // |task|. Returns the value its Run() returned.
+  bool WaitOldest(std::tr1::shared_ptr<T>* task) {
+    CHECK(!pending_.empty());
+    *task = pending_.front();
+    pending_.pop_front();
+    return pool_->Wait(task->get());
+  }
+
+ private:
+  ThreadPool* pool_;
+  const size_t max_pending_;
+  std::deque<std::tr1::shared_ptr<T> > pending_;
+
+  DISALLOW_COPY_AND_ASSIGN(OrderedTaskRunner);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_THREAD_POOL_H__
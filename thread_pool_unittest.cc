@@ -0,0 +1,147 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <unistd.h>
+#include <tr1/memory>
+#include <vector>
+#include <gtest/gtest.h>
+#include "update_engine/thread_pool.h"
+
+using std::tr1::shared_ptr;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+// Sums the integers in [begin, end) and fails if |fail| is set.
+class SumTask : public ThreadPoolTask {
+ public:
+  SumTask(int begin, int end, bool fail)
+      : begin_(begin), end_(end), fail_(fail), sum_(0) {}
+  virtual bool Run() {
+    for (int i = begin_; i < end_; i++)
+      sum_ += i;
+    return !fail_;
+  }
+  int64_t sum() const { return sum_; }
+ private:
+  int begin_;
+  int end_;
+  bool fail_;
+  int64_t sum_;
+};
+
+// Sleeps for |sleep_ms| milliseconds and records the order of completion.
+class SleepTask : public ThreadPoolTask {
+ public:
+  SleepTask(int sleep_ms, GMutex* mutex, vector<int>* log, int id)
+      : sleep_ms_(sleep_ms), mutex_(mutex), log_(log), id_(id) {}
+  virtual bool Run() {
+    g_usleep(sleep_ms_ * 1000);
+    g_mutex_lock(mutex_);
+    log_->push_back(id_);
+    g_mutex_unlock(mutex_);
+    return true;
+  }
+  int id() const { return id_; }
+ private:
+  int sleep_ms_;
+  GMutex* mutex_;
+  vector<int>* log_;
+  int id_;
+};
+}  // namespace {}
+
+TEST(ThreadPoolTest, RunsAllTasksTest) {
+  ThreadPool pool(4);
+  EXPECT_EQ(4U, pool.num_threads());
+  ASSERT_TRUE(pool.Init());
+  vector<shared_ptr<SumTask> > tasks;
+  for (int i = 0; i < 100; i++) {
+    shared_ptr<SumTask> task(new SumTask(0, i * 1000, i == 50));
+    tasks.push_back(task);
+    pool.Submit(task.get());
+  }
+  for (int i = 0; i < 100; i++) {
+    EXPECT_EQ(i != 50, pool.Wait(tasks[i].get()));
+    const int64_t n = i * 1000;
+    EXPECT_EQ(n * (n - 1) / 2, tasks[i]->sum());
+  }
+}
+
+TEST(ThreadPoolTest, DefaultSizeTest) {
+  ThreadPool pool(0);
+  const long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  EXPECT_EQ(static_cast<unsigned>(num_cpus > 0 ? num_cpus : 1),
+            pool.num_threads());
+}
+
+TEST(ThreadPoolTest, DestructorDrainsQueueTest) {
+  vector<shared_ptr<SumTask> > tasks;
+  {
+    ThreadPool pool(2);
+    ASSERT_TRUE(pool.Init());
+    for (int i = 0; i < 10; i++) {
+      shared_ptr<SumTask> task(new SumTask(0, 100000, false));
+      tasks.push_back(task);
+      pool.Submit(task.get());
+    }
+  }
+  for (size_t i = 0; i < tasks.size(); i++)
+    EXPECT_EQ(4999950000LL, tasks[i]->sum());
+}
+
+TEST(ThreadPoolTest, DestructorWhileStealingTest) {
+  // The workers that finish their queues first keep stealing from the
+  // others while the pool is destroyed, which mustn't free any of them
+  // before all have stopped. Run under ASan, this catches the difference.
+  for (int round = 0; round < 20; round++) {
+    vector<shared_ptr<SumTask> > tasks;
+    {
+      ThreadPool pool(8);
+      ASSERT_TRUE(pool.Init());
+      for (int i = 0; i < 200; i++) {
+        shared_ptr<SumTask> task(new SumTask(0, i % 7 == 0 ? 100000 : 10,
+                                             false));
+        tasks.push_back(task);
+        pool.Submit(task.get());
+      }
+    }
+    for (size_t i = 0; i < tasks.size(); i++) {
+      const int64_t n = i % 7 == 0 ? 100000 : 10;
+      EXPECT_EQ(n * (n - 1) / 2, tasks[i]->sum());
+    }
+  }
+}
+
+TEST(ThreadPoolTest, OrderedTaskRunnerTest) {
+  ThreadPool pool(2);
+  ASSERT_TRUE(pool.Init());
+  GMutex mutex;
+  g_mutex_init(&mutex);
+  vector<int> completion_log;
+  {
+    OrderedTaskRunner<SleepTask> runner(&pool, 8);
+    EXPECT_TRUE(runner.empty());
+    // The first task is slow. Tasks queued behind it on the same worker get
+    // stolen by the other one, so they all complete before it does.
+    for (int i = 0; i < 8; i++) {
+      shared_ptr<SleepTask> task(
+          new SleepTask(i == 0 ? 200 : 1, &mutex, &completion_log, i));
+      runner.Submit(task);
+    }
+    EXPECT_TRUE(runner.full());
+    for (int i = 0; i < 8; i++) {
+      shared_ptr<SleepTask> task;
+      EXPECT_TRUE(runner.WaitOldest(&task));
+      EXPECT_EQ(i, task->id());
+    }
+    EXPECT_TRUE(runner.empty());
+  }
+  ASSERT_EQ(8U, completion_log.size());
+  EXPECT_EQ(0, completion_log.back());
+  g_mutex_clear(&mutex);
+}
+
+}  // namespace chromeos_update_engine
@@ -3,36 +3,62 @@
 // found in the LICENSE file.
 
 #include "update_engine/topological_sort.h"
-#include <set>
+#include <utility>
 #include <vector>
 #include "base/logging.h"
 
-using std::set;
+using std::make_pair;
+using std::pair;
 using std::vector;
 
 namespace chromeos_update_engine {
 
 namespace {
-void TopologicalSortVisit(const Graph& graph,
-                          set<Vertex::Index>* visited_nodes,
+// Appends the unvisited nodes reachable from |root| to |nodes|, each after
+// all of its children, as a depth-first search does. The path from |root| is
+// kept on a stack of its own rather than on the call stack, which very long
+// dependency chains would overflow.
+void TopologicalSortVisit(const CsrGraph& graph,
+                          vector<bool>* visited_nodes,
                           vector<Vertex::Index>* nodes,
-                          Vertex::Index node) {
-  if (visited_nodes->find(node) != visited_nodes->end())
+                          Vertex::Index root) {
+  if ((*visited_nodes)[root])
     return;
 
-  visited_nodes->insert(node);
-  // Visit all children.
-  for (Vertex::EdgeMap::const_iterator it = graph[node].out_edges.begin();
-       it != graph[node].out_edges.end(); ++it) {
-    TopologicalSortVisit(graph, visited_nodes, nodes, it->first);
+  // Each node on the path and its next edge to follow.
+  vector<pair<Vertex::Index, CsrGraph::EdgeIndex> > path;
+  (*visited_nodes)[root] = true;
+  path.push_back(make_pair(root, graph.EdgesBegin(root)));
+  while (!path.empty()) {
+    const Vertex::Index node = path.back().first;
+    CsrGraph::EdgeIndex* edge = &path.back().second;
+    // Visit the next unvisited child.
+    for (; *edge != graph.EdgesEnd(node); ++*edge) {
+      const Vertex::Index child = graph.EdgeDestination(*edge);
+      if (!(*visited_nodes)[child])
+        break;
+    }
+    if (*edge != graph.EdgesEnd(node)) {
+      const Vertex::Index child = graph.EdgeDestination((*edge)++);
+      (*visited_nodes)[child] = true;
+      path.push_back(make_pair(child, graph.EdgesBegin(child)));
+      continue;
+    }
+    // Visit this node.
+    nodes->push_back(node);
+    path.pop_back();
   }
-  // Visit this node.
-  nodes->push_back(node);
 }
 }  // namespace {}
 
 void TopologicalSort(const Graph& graph, vector<Vertex::Index>* out) {
-  set<Vertex::Index> visited_nodes;
+  CsrGraph csr_graph;
+  csr_graph.Assign(graph);
+  TopologicalSort(csr_graph, out);
+}
+
+void TopologicalSort(const CsrGraph& graph, vector<Vertex::Index>* out) {
+  vector<bool> visited_nodes(graph.size(), false);
 
   for (Vertex::Index i = 0; i < graph.size(); i++) {
     TopologicalSortVisit(graph, &visited_nodes, out, i);
@@ -7,6 +7,7 @@
 
 
 #include <vector>
+#include "update_engine/csr_graph.h"
 #include "update_engine/graph_types.h"
 
 namespace chromeos_update_engine {
@@ -22,8 +23,11 @@ namespace chromeos_update_engine {
 // out[1] = B
 // out[2] = C
 // out[3] = A
+// The nodes are visited in index order, so the result only depends on the
+// graph. The visit doesn't recurse, so the graph can be arbitrarily deep.
 // Note: results are undefined if there is a cycle in the graph.
 void TopologicalSort(const Graph& graph, std::vector<Vertex::Index>* out);
+void TopologicalSort(const CsrGraph& graph, std::vector<Vertex::Index>* out);
 
 }  // namespace chromeos_update_engine
 
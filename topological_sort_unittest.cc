@@ -77,4 +77,18 @@ TEST(TopologicalSortTest, SimpleTest) {
   }
 }
 
+TEST(TopologicalSortTest, DeepChainTest) {
+  // A chain much deeper than a recursive visit could go on the stack.
+  const Graph::size_type kNodeCount = 1 << 17;
+  Graph graph(kNodeCount);
+  for (Vertex::Index i = 0; i + 1 < kNodeCount; i++)
+    graph[i].out_edges.insert(make_pair(i + 1, EdgeProperties()));
+
+  vector<Vertex::Index> sorted;
+  TopologicalSort(graph, &sorted);
+  ASSERT_EQ(kNodeCount, sorted.size());
+  for (Vertex::Index i = 0; i < kNodeCount; i++)
+    EXPECT_EQ(kNodeCount - 1 - i, sorted[i]);
+}
+
 }  // namespace chromeos_update_engine
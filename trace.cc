@@ -0,0 +1,133 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/trace.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+#include <base/stringprintf.h>
+
+#include "update_engine/utils.h"
+
+using base::Time;
+using base::TimeDelta;
+using std::string;
+
+namespace chromeos_update_engine {
+
+int Trace::fd_ = -1;
+
+bool Trace::Init(const string& path) {
+  Close();
+  int fd = HANDLE_EINTR(open(path.c_str(),
+                             O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                             0644));
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  struct stat stbuf;
+  if (fstat(fd, &stbuf) != 0) {
+    PLOG(ERROR) << "fstat failed on " << path;
+    close(fd);
+    return false;
+  }
+  // The closing bracket of the array is optional, so the file is a valid
+  // trace after every event.
+  if (stbuf.st_size == 0 && !utils::WriteAll(fd, "[\n", 2)) {
+    PLOG(ERROR) << "Unable to write to " << path;
+    close(fd);
+    return false;
+  }
+  fd_ = fd;
+
+  TraceArgs args;
+  args["name"] = "update_engine";
+  AddEvent("M", "__metadata", "process_name", Time::Now(), TimeDelta(), args);
+  args["labels"] = "boot " + utils::GetBootId();
+  args.erase("name");
+  AddEvent("M", "__metadata", "process_labels", Time::Now(), TimeDelta(),
+           args);
+  return true;
+}
+
+void Trace::Close() {
+  if (fd_ < 0)
+    return;
+  if (close(fd_) != 0)
+    PLOG(ERROR) << "Unable to close the trace file";
+  fd_ = -1;
+}
+
+void Trace::AddCompleteEvent(const char* category,
+                             const string& name,
+                             Time start_time,
+                             const TraceArgs& args) {
+  if (!enabled())
+    return;
+  // The wall clock may have been set back since the event started.
+  TimeDelta duration = std::max(Time::Now() - start_time, TimeDelta());
+  AddEvent("X", category, name, start_time, duration, args);
+}
+
+void Trace::AddInstantEvent(const char* category,
+                            const string& name,
+                            const TraceArgs& args) {
+  if (!enabled())
+    return;
+  AddEvent("i", category, name, Time::Now(), TimeDelta(), args);
+}
+
+void Trace::AddEvent(const char* phase,
+                     const char* category,
+                     const string& name,
+                     Time time,
+                     TimeDelta duration,
+                     const TraceArgs& args) {
+  string event = StringPrintf(
+      "{\"name\": %s, \"cat\": \"%s\", \"ph\": \"%s\", \"ts\": %lld, ",
+      utils::JsonString(name).c_str(),
+      category,
+      phase,
+      static_cast<long long>((time - Time::UnixEpoch()).InMicroseconds()));
+  if (phase[0] == 'X') {
+    event += StringPrintf("\"dur\": %lld, ",
+                          static_cast<long long>(duration.InMicroseconds()));
+  } else if (phase[0] == 'i') {
+    // Instant events span only their thread.
+    event += "\"s\": \"t\", ";
+  }
+  event += StringPrintf("\"pid\": %d, \"tid\": %ld, \"args\": {",
+                        getpid(),
+                        syscall(SYS_gettid));
+  for (TraceArgs::const_iterator it = args.begin(); it != args.end(); ++it) {
+    if (it != args.begin())
+      event += ", ";
+    event += utils::JsonString(it->first) + ": " +
+        utils::JsonString(it->second);
+  }
+  event += "}},\n";
+  LOG_IF(ERROR, !utils::WriteAll(fd_, event.data(), event.size()))
+      << "Unable to write a trace event";
+}
+
+ScopedTraceEvent::ScopedTraceEvent(const char* category, const string& name)
+    : category_(category),
+      name_(name) {
+  if (Trace::enabled())
+    start_time_ = Time::Now();
+}
+
+ScopedTraceEvent::~ScopedTraceEvent() {
+  // Tracing may have been turned on since the event started.
+  if (Trace::enabled() && !start_time_.is_null())
+    Trace::AddCompleteEvent(category_, name_, start_time_, args_);
+}
+
+}  // namespace chromeos_update_engine
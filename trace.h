@@ -0,0 +1,93 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_TRACE_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_TRACE_H__
+
+#include <map>
+#include <string>
+
+#include <base/basictypes.h>
+#include <base/time.h>
+
+// Writes a trace of the update attempts in the JSON array format of Chrome
+// trace events, which chrome://tracing and Perfetto load: the actions run by
+// the ActionProcessor, the HTTP transfers, the install operations and
+// checkpoints of DeltaPerformer, and the subprocesses run. Tracing is off
+// unless Init() is called.
+//
+// Events are appended to the file one per line as they end, so the trace is
+// readable up to the last event if the daemon dies. A restarted daemon
+// appends to the same file, so the trace of an interrupted update continues
+// where it stopped: timestamps are wall-clock times, and each process shows
+// up under its own pid, labeled with the boot ID. Events may be added from
+// any thread.
+
+namespace chromeos_update_engine {
+
+// The arguments shown with an event, by name.
+typedef std::map<std::string, std::string> TraceArgs;
+
+class Trace {
+ public:
+  // Starts appending events to the file at |path|, creating it if needed.
+  // Returns true on success.
+  static bool Init(const std::string& path);
+
+  // Stops tracing.
+  static void Close();
+
+  // Returns true if events are being written.
+  static bool enabled() { return fd_ >= 0; }
+
+  // Adds an event of |category| called |name| that started at |start_time|
+  // and ends now.
+  static void AddCompleteEvent(const char* category,
+                               const std::string& name,
+                               base::Time start_time,
+                               const TraceArgs& args);
+
+  // Adds an event of |category| called |name| that happens now.
+  static void AddInstantEvent(const char* category,
+                              const std::string& name,
+                              const TraceArgs& args);
+
+ private:
+  // Appends |phase| event |name| at |time| to the file in a single write, so
+  // that events added by different threads don't interleave. The event
+  // lasts |duration| if it's a complete event.
+  static void AddEvent(const char* phase,
+                       const char* category,
+                       const std::string& name,
+                       base::Time time,
+                       base::TimeDelta duration,
+                       const TraceArgs& args);
+
+  // The trace file, or -1 if tracing is off.
+  static int fd_;
+};
+
+// Adds a complete event for the lifetime of the object, if tracing is on.
+class ScopedTraceEvent {
+ public:
+  ScopedTraceEvent(const char* category, const std::string& name);
+  ~ScopedTraceEvent();
+
+  // Adds an argument to show with the event.
+  void AddArg(const std::string& name, const std::string& value) {
+    args_[name] = value;
+  }
+
+ private:
+  const char* category_;
+  std::string name_;
+  base::Time start_time_;
+  TraceArgs args_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedTraceEvent);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_TRACE_H__
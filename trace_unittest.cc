@@ -0,0 +1,102 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <string>
+#include <vector>
+
+#include <base/string_split.h>
+#include <base/string_util.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/trace.h"
+#include "update_engine/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class TraceTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    ASSERT_TRUE(utils::MakeTempFile("/tmp/trace.XXXXXX", &path_, NULL));
+  }
+
+  virtual void TearDown() {
+    Trace::Close();
+    unlink(path_.c_str());
+  }
+
+  // Returns the lines of the trace file.
+  vector<string> ReadLines() {
+    string contents;
+    EXPECT_TRUE(utils::ReadFile(path_, &contents));
+    vector<string> lines;
+    base::SplitString(contents, '\n', &lines);
+    return lines;
+  }
+
+  string path_;
+};
+
+TEST_F(TraceTest, DisabledTest) {
+  EXPECT_FALSE(Trace::enabled());
+  Trace::AddInstantEvent("test", "Instant", TraceArgs());
+  {
+    ScopedTraceEvent event("test", "Scoped");
+  }
+  EXPECT_TRUE(ReadLines().empty());
+}
+
+TEST_F(TraceTest, EventsTest) {
+  ASSERT_TRUE(Trace::Init(path_));
+  EXPECT_TRUE(Trace::enabled());
+  TraceArgs args;
+  args["url"] = "http://host/\"path\"";
+  Trace::AddInstantEvent("test", "Instant", args);
+  {
+    ScopedTraceEvent event("test", "Scoped");
+    event.AddArg("status", "0");
+  }
+  Trace::Close();
+  EXPECT_FALSE(Trace::enabled());
+
+  vector<string> lines = ReadLines();
+  // The opening bracket, the two metadata events and the two events.
+  ASSERT_EQ(6, lines.size());
+  EXPECT_EQ("[", lines[0]);
+  EXPECT_NE(string::npos, lines[1].find("\"name\": \"process_name\""));
+  EXPECT_NE(string::npos, lines[2].find("\"name\": \"process_labels\""));
+  EXPECT_NE(string::npos, lines[3].find("\"name\": \"Instant\""));
+  EXPECT_NE(string::npos, lines[3].find("\"ph\": \"i\""));
+  EXPECT_NE(string::npos,
+            lines[3].find("\"args\": {\"url\": \"http://host/\\\"path\\\"\"}"));
+  EXPECT_NE(string::npos, lines[4].find("\"name\": \"Scoped\""));
+  EXPECT_NE(string::npos, lines[4].find("\"ph\": \"X\""));
+  EXPECT_NE(string::npos, lines[4].find("\"dur\": "));
+  EXPECT_NE(string::npos, lines[4].find("\"args\": {\"status\": \"0\"}"));
+  for (size_t i = 1; i < 5; i++) {
+    EXPECT_TRUE(StartsWithASCII(lines[i], "{", true)) << lines[i];
+    EXPECT_TRUE(EndsWith(lines[i], "}},", true)) << lines[i];
+  }
+  EXPECT_EQ("", lines[5]);
+}
+
+TEST_F(TraceTest, RestartTest) {
+  ASSERT_TRUE(Trace::Init(path_));
+  Trace::AddInstantEvent("test", "First", TraceArgs());
+  ASSERT_TRUE(Trace::Init(path_));
+  Trace::AddInstantEvent("test", "Second", TraceArgs());
+  Trace::Close();
+
+  // The events of the second run are appended to the same array.
+  vector<string> lines = ReadLines();
+  ASSERT_EQ(8, lines.size());
+  EXPECT_EQ("[", lines[0]);
+  EXPECT_NE(string::npos, lines[3].find("\"name\": \"First\""));
+  EXPECT_NE(string::npos, lines[4].find("\"name\": \"process_name\""));
+  EXPECT_NE(string::npos, lines[6].find("\"name\": \"Second\""));
+}
+
+}  // namespace chromeos_update_engine
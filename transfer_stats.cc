@@ -0,0 +1,176 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/transfer_stats.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <base/string_number_conversions.h>
+#include <base/stringprintf.h>
+
+using std::map;
+using std::nth_element;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+const size_t TransferStats::kWindowSize;
+
+namespace {
+
+// The histogram buckets go from below 16 KiB/s to below 1 GiB/s.
+const int kMinBucketShift = 14;
+const int kMaxBucketShift = 30;
+
+// Transfers shorter than this say more about latency than throughput.
+const double kMinThroughputSeconds = 0.1;
+
+bool CountsForThroughput(const TransferTiming& timing) {
+  return !timing.rate_limited && timing.bytes > 0 &&
+      timing.total_seconds >= kMinThroughputSeconds;
+}
+
+uint64_t Throughput(const TransferTiming& timing) {
+  return static_cast<uint64_t>(timing.bytes / timing.total_seconds);
+}
+
+string Milliseconds(double total_seconds, size_t count) {
+  return base::Uint64ToString(
+      static_cast<uint64_t>(total_seconds * 1000 / count + 0.5));
+}
+
+string BucketName(int shift) {
+  if (shift >= 30)
+    return StringPrintf("%dG", 1 << (shift - 30));
+  if (shift >= 20)
+    return StringPrintf("%dM", 1 << (shift - 20));
+  return StringPrintf("%dK", 1 << (shift - 10));
+}
+
+}  // namespace {}
+
+TransferStats* TransferStats::Get() {
+  static TransferStats* stats = new TransferStats;
+  return stats;
+}
+
+void TransferStats::AddTransfer(const string& url,
+                                const TransferTiming& timing) {
+  AddToWindow(timing, &urls_[url]);
+  AddToWindow(timing, &hosts_[HostOfUrl(url)]);
+}
+
+bool TransferStats::GetUrlThroughput(const string& url,
+                                     uint64_t* bytes_per_second) const {
+  map<string, Window>::const_iterator it = urls_.find(url);
+  return it != urls_.end() && MedianThroughput(it->second, bytes_per_second);
+}
+
+bool TransferStats::GetHostThroughput(const string& url,
+                                      uint64_t* bytes_per_second) const {
+  map<string, Window>::const_iterator it = hosts_.find(HostOfUrl(url));
+  return it != hosts_.end() &&
+      MedianThroughput(it->second, bytes_per_second);
+}
+
+void TransferStats::AddCounters(map<string, string>* counters) const {
+  for (map<string, Window>::const_iterator it = hosts_.begin();
+       it != hosts_.end(); ++it) {
+    const Window& window = it->second;
+    const string prefix = "http_" + it->first + "_";
+    TransferTiming totals;
+    size_t http3_transfers = 0;
+    vector<size_t> buckets(kMaxBucketShift + 1, 0);
+    for (Window::const_iterator transfer = window.begin();
+         transfer != window.end(); ++transfer) {
+      totals.name_lookup_seconds += transfer->name_lookup_seconds;
+      totals.connect_seconds += transfer->connect_seconds;
+      totals.tls_seconds += transfer->tls_seconds;
+      totals.first_byte_seconds += transfer->first_byte_seconds;
+      totals.total_seconds += transfer->total_seconds;
+      totals.redirects += transfer->redirects;
+      if (transfer->http_version == 3)
+        http3_transfers++;
+      if (!CountsForThroughput(*transfer))
+        continue;
+      const uint64_t throughput = Throughput(*transfer);
+      int shift = kMinBucketShift;
+      while (shift < kMaxBucketShift && throughput >= (1ULL << shift))
+        shift++;
+      buckets[shift]++;
+    }
+    (*counters)[prefix + "transfers"] = base::Uint64ToString(window.size());
+    (*counters)[prefix + "name_lookup_ms"] =
+        Milliseconds(totals.name_lookup_seconds, window.size());
+    (*counters)[prefix + "connect_ms"] =
+        Milliseconds(totals.connect_seconds, window.size());
+    (*counters)[prefix + "tls_ms"] =
+        Milliseconds(totals.tls_seconds, window.size());
+    (*counters)[prefix + "first_byte_ms"] =
+        Milliseconds(totals.first_byte_seconds, window.size());
+    (*counters)[prefix + "total_ms"] =
+        Milliseconds(totals.total_seconds, window.size());
+    (*counters)[prefix + "redirects"] = base::IntToString(totals.redirects);
+    (*counters)[prefix + "http3_transfers"] =
+        base::Uint64ToString(http3_transfers);
+    uint64_t median = 0;
+    if (MedianThroughput(window, &median))
+      (*counters)[prefix + "bytes_per_second"] = base::Uint64ToString(median);
+    string histogram;
+    for (int shift = kMinBucketShift; shift <= kMaxBucketShift; shift++) {
+      if (buckets[shift] == 0)
+        continue;
+      if (!histogram.empty())
+        histogram += " ";
+      histogram += BucketName(shift) + ":" +
+          base::Uint64ToString(buckets[shift]);
+    }
+    if (!histogram.empty())
+      (*counters)[prefix + "throughput_histogram"] = histogram;
+  }
+}
+
+void TransferStats::Reset() {
+  urls_.clear();
+  hosts_.clear();
+}
+
+string TransferStats::HostOfUrl(const string& url) {
+  size_t start = url.find("://");
+  start = start == string::npos ? 0 : start + 3;
+  const size_t end = url.find_first_of("/?#", start);
+  string host = url.substr(start, end == string::npos ? end : end - start);
+  // Drops any credentials.
+  const size_t at = host.rfind('@');
+  if (at != string::npos)
+    host.erase(0, at + 1);
+  return host;
+}
+
+void TransferStats::AddToWindow(const TransferTiming& timing,
+                                Window* window) {
+  window->push_back(timing);
+  if (window->size() > kWindowSize)
+    window->pop_front();
+}
+
+bool TransferStats::MedianThroughput(const Window& window,
+                                     uint64_t* bytes_per_second) {
+  vector<uint64_t> throughputs;
+  for (Window::const_iterator it = window.begin(); it != window.end(); ++it) {
+    if (CountsForThroughput(*it))
+      throughputs.push_back(Throughput(*it));
+  }
+  if (throughputs.empty())
+    return false;
+  vector<uint64_t>::iterator median =
+      throughputs.begin() + throughputs.size() / 2;
+  nth_element(throughputs.begin(), median, throughputs.end());
+  *bytes_per_second = *median;
+  return true;
+}
+
+}  // namespace chromeos_update_engine
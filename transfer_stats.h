@@ -0,0 +1,104 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_TRANSFER_STATS_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_TRANSFER_STATS_H__
+
+#include <deque>
+#include <map>
+#include <string>
+
+#include <base/basictypes.h>
+
+// Keeps the timing of the recent HTTP transfers, as libcurl measured it,
+// by URL and by host: how long name lookup, connecting, the TLS handshake
+// and the first byte took, and the throughput. The throughputs of the last
+// transfers make a rolling histogram for each host, for tuning the CDNs and
+// spotting slow devices from the field, and the payload URL is picked by
+// them when probing tells nothing. Only used from the main loop.
+
+namespace chromeos_update_engine {
+
+// The timing of a single transfer. Times are from the start of the
+// transfer, in seconds, and 0 if the step didn't happen.
+struct TransferTiming {
+  TransferTiming()
+      : name_lookup_seconds(0),
+        connect_seconds(0),
+        tls_seconds(0),
+        first_byte_seconds(0),
+        total_seconds(0),
+        bytes(0),
+        redirects(0),
+        http_version(0),
+        rate_limited(false) {}
+
+  double name_lookup_seconds;
+  double connect_seconds;
+  double tls_seconds;
+  double first_byte_seconds;
+  double total_seconds;
+  uint64_t bytes;
+  int redirects;
+  // The major HTTP version the response came with, 0 if unknown.
+  int http_version;
+  // A transfer held back by the bandwidth controller says nothing about the
+  // throughput of the link, so it isn't counted in the histograms.
+  bool rate_limited;
+};
+
+class TransferStats {
+ public:
+  // The number of transfers from each URL and host kept.
+  static const size_t kWindowSize = 32;
+
+  TransferStats() {}
+
+  // Returns the statistics of the transfers of the daemon.
+  static TransferStats* Get();
+
+  // Records a transfer from |url|.
+  void AddTransfer(const std::string& url, const TransferTiming& timing);
+
+  // Sets |bytes_per_second| to the median throughput of the recent
+  // transfers from |url|, or from its host. Returns false if there's none.
+  bool GetUrlThroughput(const std::string& url,
+                        uint64_t* bytes_per_second) const;
+  bool GetHostThroughput(const std::string& url,
+                         uint64_t* bytes_per_second) const;
+
+  // Adds the statistics of each host to |counters|, by name. Times are in
+  // milliseconds and throughputs in bytes per second, and the transfers
+  // over HTTP/3 are counted apart. The histogram of a
+  // host lists the number of transfers whose throughput is below each
+  // power of two, e.g., "64K:3 128K:5" for three transfers at 32 to 64 KiB/s
+  // and five at 64 to 128 KiB/s.
+  void AddCounters(std::map<std::string, std::string>* counters) const;
+
+  // Forgets all the transfers.
+  void Reset();
+
+  // Returns the host, and port if any, of |url|.
+  static std::string HostOfUrl(const std::string& url);
+
+ private:
+  // The last transfers from a URL or host, oldest first.
+  typedef std::deque<TransferTiming> Window;
+
+  static void AddToWindow(const TransferTiming& timing, Window* window);
+
+  // Sets |bytes_per_second| to the median throughput of the transfers in
+  // |window| that count. Returns false if none does.
+  static bool MedianThroughput(const Window& window,
+                               uint64_t* bytes_per_second);
+
+  std::map<std::string, Window> urls_;
+  std::map<std::string, Window> hosts_;
+
+  DISALLOW_COPY_AND_ASSIGN(TransferStats);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_TRANSFER_STATS_H__
@@ -0,0 +1,93 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <map>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/transfer_stats.h"
+
+using std::map;
+using std::string;
+
+namespace chromeos_update_engine {
+
+class TransferStatsTest : public ::testing::Test {
+ protected:
+  // Records a transfer of |bytes| bytes in |seconds| seconds from |url|
+  // over HTTP/|http_version|.
+  void AddTransfer(const string& url, uint64_t bytes, double seconds,
+                   int http_version = 1) {
+    TransferTiming timing;
+    timing.name_lookup_seconds = 0.01;
+    timing.connect_seconds = 0.02;
+    timing.tls_seconds = 0.05;
+    timing.first_byte_seconds = 0.1;
+    timing.total_seconds = seconds;
+    timing.bytes = bytes;
+    timing.http_version = http_version;
+    stats_.AddTransfer(url, timing);
+  }
+
+  TransferStats stats_;
+};
+
+TEST_F(TransferStatsTest, HostOfUrlTest) {
+  EXPECT_EQ("example.com", TransferStats::HostOfUrl("http://example.com"));
+  EXPECT_EQ("example.com:8080",
+            TransferStats::HostOfUrl("https://example.com:8080/a/b?c=d"));
+  EXPECT_EQ("example.com",
+            TransferStats::HostOfUrl("http://user:pw@example.com/payload"));
+  EXPECT_EQ("example.com", TransferStats::HostOfUrl("example.com/payload"));
+}
+
+TEST_F(TransferStatsTest, ThroughputTest) {
+  uint64_t throughput = 0;
+  EXPECT_FALSE(stats_.GetUrlThroughput("http://a/payload", &throughput));
+  AddTransfer("http://a/payload", 100 * 1024, 1);
+  AddTransfer("http://a/payload", 300 * 1024, 1);
+  AddTransfer("http://a/payload", 200 * 1024, 1);
+  // Too short to tell the throughput.
+  AddTransfer("http://a/payload", 64 * 1024, 0.01);
+  EXPECT_TRUE(stats_.GetUrlThroughput("http://a/payload", &throughput));
+  EXPECT_EQ(200 * 1024, throughput);
+
+  EXPECT_FALSE(stats_.GetUrlThroughput("http://a/other", &throughput));
+  EXPECT_TRUE(stats_.GetHostThroughput("http://a/other", &throughput));
+  EXPECT_EQ(200 * 1024, throughput);
+  EXPECT_FALSE(stats_.GetHostThroughput("http://b/payload", &throughput));
+}
+
+TEST_F(TransferStatsTest, WindowTest) {
+  AddTransfer("http://a/payload", 1024 * 1024, 1);
+  for (size_t i = 0; i < TransferStats::kWindowSize; i++)
+    AddTransfer("http://a/payload", 10 * 1024, 1);
+  uint64_t throughput = 0;
+  EXPECT_TRUE(stats_.GetUrlThroughput("http://a/payload", &throughput));
+  EXPECT_EQ(10 * 1024, throughput);
+}
+
+TEST_F(TransferStatsTest, CountersTest) {
+  AddTransfer("http://a/payload", 40 * 1024, 1);
+  AddTransfer("http://a/payload", 100 * 1024, 1);
+  AddTransfer("http://a/payload", 120 * 1024, 1, 3);
+  map<string, string> counters;
+  stats_.AddCounters(&counters);
+  EXPECT_EQ("3", counters["http_a_transfers"]);
+  EXPECT_EQ("10", counters["http_a_name_lookup_ms"]);
+  EXPECT_EQ("50", counters["http_a_tls_ms"]);
+  EXPECT_EQ("1000", counters["http_a_total_ms"]);
+  EXPECT_EQ("0", counters["http_a_redirects"]);
+  EXPECT_EQ("1", counters["http_a_http3_transfers"]);
+  EXPECT_EQ("102400", counters["http_a_bytes_per_second"]);
+  EXPECT_EQ("64K:1 128K:2", counters["http_a_throughput_histogram"]);
+
+  stats_.Reset();
+  counters.clear();
+  stats_.AddCounters(&counters);
+  EXPECT_TRUE(counters.empty());
+}
+
+}  // namespace chromeos_update_engine
@@ -10,6 +10,7 @@
 #endif  // _POSIX_C_SOURCE
 #include <time.h>
 
+#include <algorithm>
 #include <string>
 #include <tr1/memory>
 #include <vector>
@@ -20,12 +21,17 @@
 #include <policy/libpolicy.h>
 #include <policy/device_policy.h>
 
+#include "update_engine/accounting_http_fetcher.h"
 #include "update_engine/certificate_checker.h"
 #include "update_engine/dbus_service.h"
+#include "update_engine/delta_performer.h"
 #include "update_engine/download_action.h"
+#include "update_engine/file_fetcher.h"
 #include "update_engine/filesystem_copier_action.h"
 #include "update_engine/libcurl_http_fetcher.h"
+#include "update_engine/memory_tracker.h"
 #include "update_engine/multi_range_http_fetcher.h"
+#include "update_engine/multicast_fetcher.h"
 #include "update_engine/omaha_request_action.h"
 #include "update_engine/omaha_request_params.h"
 #include "update_engine/omaha_response_handler_action.h"
@@ -35,11 +41,14 @@
 #include "update_engine/subprocess.h"
 #include "update_engine/system_state.h"
 #include "update_engine/update_check_scheduler.h"
+#include "update_engine/update_duration_estimator.h"
+#include "update_engine/url_prober_action.h"
 
 using base::TimeDelta;
 using base::TimeTicks;
 using google::protobuf::NewPermanentCallback;
 using std::make_pair;
+using std::min;
 using std::tr1::shared_ptr;
 using std::set;
 using std::string;
@@ -48,10 +57,24 @@ using std::vector;
 namespace chromeos_update_engine {
 
 const int UpdateAttempter::kMaxDeltaUpdateFailures = 3;
+const double UpdateAttempter::kProgressNotifyStep = 0.01;  // 1%
+const int UpdateAttempter::kProgressNotifyMinIntervalMs = 500;
+const int UpdateAttempter::kProgressNotifyMaxIntervalSeconds = 10;
+const int UpdateAttempter::kNumDownloadFetchers = 3;
+const uint64_t UpdateAttempter::kDownloadSegmentSize =
+    16 * 1024 * 1024;  // 16 MiB
+const size_t UpdateAttempter::kDownloadCoalesceGap = 64 * 1024;  // 64 KiB
+const unsigned UpdateAttempter::kNumApplyOperations = 2;
 
 const char* kUpdateCompletedMarker =
     "/var/run/update_engine_autoupdate_completed";
 
+const char* kPeerCacheDir = "/var/lib/update_engine/peer-cache";
+
+// The large data blobs are spooled on the stateful partition, since /tmp is
+// in memory.
+const char* kBlobSpoolDir = "/var/lib/update_engine";
+
 const char* UpdateStatusToString(UpdateStatus status) {
   switch (status) {
     case UPDATE_STATUS_IDLE:
@@ -99,7 +122,20 @@ ActionExitCode GetErrorCodeForAction(AbstractAction* action,
 
 UpdateAttempter::UpdateAttempter(SystemState* system_state,
                                  DbusGlibInterface* dbus_iface)
-    : processor_(new ActionProcessor()),
+    : progress_throttle_(
+          kProgressNotifyStep,
+          TimeDelta::FromMilliseconds(kProgressNotifyMinIntervalMs),
+          TimeDelta::FromSeconds(kProgressNotifyMaxIntervalSeconds)),
+      memory_budget_(0),
+      spool_updates_(false),
+      spooling_(false),
+      full_verification_(false),
+      use_http2_(false),
+      use_http3_(false),
+      peer_cache_(kPeerCacheDir),
+      shared_payload_cache_(false),
+      multicast_port_(0),
+      processor_(new ActionProcessor()),
       system_state_(system_state),
       dbus_service_(NULL),
       update_check_scheduler_(NULL),
@@ -107,12 +143,15 @@ UpdateAttempter::UpdateAttempter(SystemState* system_state,
       http_response_code_(0),
       shares_(utils::kCpuSharesNormal),
       manage_shares_source_(NULL),
+      resource_load_source_(NULL),
       download_active_(false),
+      download_bytes_received_(0),
       status_(UPDATE_STATUS_IDLE),
       download_progress_(0.0),
       last_checked_time_(0),
       new_version_("0.0.0.0"),
       new_payload_size_(0),
+      eta_seconds_(-1),
       updated_boot_flags_(false),
       update_boot_flags_running_(false),
       start_action_processor_(false),
@@ -121,6 +160,9 @@ UpdateAttempter::UpdateAttempter(SystemState* system_state,
   omaha_request_params_ = system_state->request_params();
   if (utils::FileExists(kUpdateCompletedMarker))
     status_ = UPDATE_STATUS_UPDATED_NEED_REBOOT;
+  performance_counters_.SetStatus(UpdateStatusToString(status_),
+                                  TimeTicks::Now());
+  PublishStatus();
 }
 
 UpdateAttempter::~UpdateAttempter() {
@@ -357,8 +399,11 @@ void UpdateAttempter::BuildUpdateActions(bool interactive) {
                              NULL,
                              update_check_fetcher,  // passes ownership
                              false));
+  shared_ptr<UrlProberAction> url_prober_action(
+      new UrlProberAction(system_state_));
   shared_ptr<OmahaResponseHandlerAction> response_handler_action(
       new OmahaResponseHandlerAction(system_state_));
+  response_handler_action->set_mirror_disks(mirror_disks_);
   shared_ptr<FilesystemCopierAction> filesystem_copier_action(
       new FilesystemCopierAction(false, false));
   shared_ptr<FilesystemCopierAction> kernel_filesystem_copier_action(
@@ -369,24 +414,59 @@ void UpdateAttempter::BuildUpdateActions(bool interactive) {
                                  OmahaEvent::kTypeUpdateDownloadStarted),
                              new LibcurlHttpFetcher(system_state_),
                              false));
-  LibcurlHttpFetcher* download_fetcher =
-      new LibcurlHttpFetcher(system_state_);
-  download_fetcher->set_check_certificate(CertificateChecker::kDownload);
+  LibcurlHttpFetcher* download_fetcher = NewDownloadFetcher();
+  download_fetcher->set_bandwidth_controller(&bandwidth_controller_);
+  // An update the user asked for downloads flat out, while a scheduled one
+  // yields to the other traffic of the network.
+  bandwidth_controller_.set_adaptive(!interactive);
+  // The download's transfers are counted in IoStats.
+  MultiRangeHttpFetcher* multi_range_fetcher =
+      new MultiRangeHttpFetcher(
+          new AccountingHttpFetcher(download_fetcher,
+                                    "download"));  // passes ownership
+  for (int i = 1; i < kNumDownloadFetchers; i++) {
+    LibcurlHttpFetcher* parallel_fetcher = NewDownloadFetcher();
+    parallel_fetcher->set_bandwidth_controller(&bandwidth_controller_);
+    multi_range_fetcher->AddParallelFetcher(
+        new AccountingHttpFetcher(parallel_fetcher,
+                                  "download"));  // passes ownership
+  }
+  // E.g., the metadata and the data left to download when resuming. The
+  // segments stay apart, so they're still downloaded in parallel.
+  multi_range_fetcher->set_coalescing(kDownloadCoalesceGap,
+                                      kDownloadSegmentSize);
   shared_ptr<DownloadAction> download_action(
       new DownloadAction(prefs_,
                          system_state_,
-                         new MultiRangeHttpFetcher(
-                             download_fetcher)));  // passes ownership
-  shared_ptr<OmahaRequestAction> download_finished_action(
-      new OmahaRequestAction(system_state_,
-                             new OmahaEvent(
-                                 OmahaEvent::kTypeUpdateDownloadFinished),
-                             new LibcurlHttpFetcher(system_state_),
-                             false));
+                         multi_range_fetcher));  // passes ownership
+  // A scheduled update may only be spooled, to be applied later on.
+  spooling_ = spool_updates_ && !interactive;
+  if (peer_server_.get() || spooling_ || shared_payload_cache_)
+    download_action->set_peer_cache(&peer_cache_);
+  download_action->set_spool_only(spooling_);
+  download_action->set_apply_ahead_operations(kNumApplyOperations);
+  // Keeps the main loop responsive while the operations are applied.
+  download_action->set_apply_on_thread(true);
+  // A data blob corrupted on the way is fetched again on its own, from
+  // another URL of the response if there are several.
+  download_action->set_repair_fetcher(
+      new MultiRangeHttpFetcher(NewDownloadFetcher()));  // passes ownership
+  UpdateDurationEstimator::Rates duration_rates;
+  UpdateDurationEstimator::LoadRates(prefs_, &duration_rates);
+  download_action->set_duration_rates(duration_rates);
+  if (memory_budget_ > 0) {
+    download_action->set_memory_budget(memory_budget_, kBlobSpoolDir);
+    // The ranges downloaded ahead are buffered until they're delivered.
+    multi_range_fetcher->set_max_buffered_bytes(
+        min<uint64_t>(MultiRangeHttpFetcher::kDefaultMaxBufferedBytes,
+                      memory_budget_ / (4 * kNumDownloadFetchers)));
+  }
   shared_ptr<FilesystemCopierAction> filesystem_verifier_action(
       new FilesystemCopierAction(false, true));
   shared_ptr<FilesystemCopierAction> kernel_filesystem_verifier_action(
       new FilesystemCopierAction(true, true));
+  filesystem_verifier_action->set_full_verification(full_verification_);
+  kernel_filesystem_verifier_action->set_full_verification(full_verification_);
   shared_ptr<PostinstallRunnerAction> postinstall_runner_action(
       new PostinstallRunnerAction);
   shared_ptr<OmahaRequestAction> update_complete_action(
@@ -394,32 +474,76 @@ void UpdateAttempter::BuildUpdateActions(bool interactive) {
                              new OmahaEvent(OmahaEvent::kTypeUpdateComplete),
                              new LibcurlHttpFetcher(system_state_),
                              false));
-
+  // The events queued during the update, such as the download being
+  // finished, are reported with the update check or the update completion,
+  // or with the error event if the update fails.
+  update_check_action->set_event_queue(&queued_events_);
+  update_complete_action->set_event_queue(&queued_events_);
+
+  // Delta updates are applied from the source partitions, copying them to
+  // the new ones first only if the payload was generated for patching them
+  // in place, so here they're just hashed for the source verification.
+  filesystem_copier_action->set_hash_only(true);
+  kernel_filesystem_copier_action->set_hash_only(true);
+  // The booted partitions don't change, so they're hashed once per boot.
+  filesystem_copier_action->set_source_hash_cache(prefs_);
+  kernel_filesystem_copier_action->set_source_hash_cache(prefs_);
   download_action->set_delegate(this);
   response_handler_action_ = response_handler_action;
   download_action_ = download_action;
 
   actions_.push_back(shared_ptr<AbstractAction>(update_check_action));
+  actions_.push_back(shared_ptr<AbstractAction>(url_prober_action));
   actions_.push_back(shared_ptr<AbstractAction>(response_handler_action));
-  actions_.push_back(shared_ptr<AbstractAction>(filesystem_copier_action));
   actions_.push_back(shared_ptr<AbstractAction>(download_started_action));
-  actions_.push_back(shared_ptr<AbstractAction>(download_action));
-  actions_.push_back(shared_ptr<AbstractAction>(download_finished_action));
-  actions_.push_back(shared_ptr<AbstractAction>(filesystem_verifier_action));
-  actions_.push_back(shared_ptr<AbstractAction>(postinstall_runner_action));
-  actions_.push_back(shared_ptr<AbstractAction>(update_complete_action));
+  if (spooling_) {
+    actions_.push_back(shared_ptr<AbstractAction>(download_action));
+  } else {
+    actions_.push_back(
+        shared_ptr<AbstractAction>(kernel_filesystem_copier_action));
+    actions_.push_back(shared_ptr<AbstractAction>(filesystem_copier_action));
+    actions_.push_back(shared_ptr<AbstractAction>(download_action));
+    actions_.push_back(shared_ptr<AbstractAction>(filesystem_verifier_action));
+    actions_.push_back(shared_ptr<AbstractAction>(postinstall_runner_action));
+    actions_.push_back(shared_ptr<AbstractAction>(update_complete_action));
+  }
 
-  // Enqueue the actions
+  // Enqueue the actions. Hashing the source is disk-bound and downloading is
+  // network-bound, so the source is hashed while the download starts. The
+  // payload is held back until the hash is known; see DownloadAction. The
+  // download starts as soon as the response is handled, and it reuses the
+  // name lookups, TLS sessions and connections of the URL probes through the
+  // share handle of LibcurlHttpFetcher, so no connection is set up after the
+  // source is hashed. The kernel and the rootfs are on separate partitions,
+  // so they're hashed concurrently too, and the smaller kernel is hidden
+  // behind the rootfs. The rootfs copier picks up the kernel hash when the
+  // kernel copier completes, and only then completes itself. Likewise, the
+  // postinstall runner prepares its mount point while the new rootfs is
+  // read back for the verification, and mounts it once it's verified.
   for (vector<shared_ptr<AbstractAction> >::iterator it = actions_.begin();
        it != actions_.end(); ++it) {
-    processor_->EnqueueAction(it->get());
+    if (it->get() == kernel_filesystem_copier_action.get() ||
+        it->get() == filesystem_copier_action.get() ||
+        it->get() == filesystem_verifier_action.get())
+      processor_->EnqueueConcurrentAction(it->get());
+    else
+      processor_->EnqueueAction(it->get());
   }
 
   // Bond them together. We have to use the leaf-types when calling
   // BondActions().
   BondActions(update_check_action.get(),
+              url_prober_action.get());
+  BondActions(url_prober_action.get(),
               response_handler_action.get());
+  if (spooling_) {
+    BondActions(response_handler_action.get(),
+                download_action.get());
+    return;
+  }
   BondActions(response_handler_action.get(),
+              kernel_filesystem_copier_action.get());
+  BondActions(kernel_filesystem_copier_action.get(),
               filesystem_copier_action.get());
   BondActions(filesystem_copier_action.get(),
               download_action.get());
@@ -429,6 +553,14 @@ void UpdateAttempter::BuildUpdateActions(bool interactive) {
               postinstall_runner_action.get());
 }
 
+LibcurlHttpFetcher* UpdateAttempter::NewDownloadFetcher() {
+  LibcurlHttpFetcher* fetcher = new LibcurlHttpFetcher(system_state_);
+  fetcher->set_check_certificate(CertificateChecker::kDownload);
+  fetcher->set_use_http2(use_http2_);
+  fetcher->set_use_http3(use_http3_);
+  return fetcher;
+}
+
 void UpdateAttempter::CheckForUpdate(bool interactive) {
   LOG(INFO) << "New update check requested";
 
@@ -459,6 +591,7 @@ void UpdateAttempter::ProcessingDone(const ActionProcessor* processor,
   CHECK(response_handler_action_);
   LOG(INFO) << "Processing Done.";
   actions_.clear();
+  MemoryTracker::LogHighWaterMarks();
 
   // Reset cpu shares back to normal.
   CleanupCpuSharesManagement();
@@ -476,6 +609,13 @@ void UpdateAttempter::ProcessingDone(const ActionProcessor* processor,
         "so requesting reboot from user.";
   }
 
+  if (code == kActionCodeSuccess && spooling_) {
+    LOG(INFO) << "Update downloaded to the peer cache, to be applied by the "
+              << "next update the user asks for.";
+    SetStatusAndNotify(UPDATE_STATUS_IDLE, kUpdateNoticeUnspecified);
+    return;
+  }
+
   if (code == kActionCodeSuccess) {
     utils::WriteFile(kUpdateCompletedMarker, "", 0);
     prefs_->SetInt64(kPrefsDeltaUpdateFailures, 0);
@@ -513,6 +653,7 @@ void UpdateAttempter::ProcessingStopped(const ActionProcessor* processor) {
   // Reset cpu shares back to normal.
   CleanupCpuSharesManagement();
   download_progress_ = 0.0;
+  __atomic_store_n(&eta_seconds_, -1, __ATOMIC_RELAXED);
   SetStatusAndNotify(UPDATE_STATUS_IDLE, kUpdateNoticeUnspecified);
   actions_.clear();
   error_event_.reset(NULL);
@@ -528,24 +669,45 @@ void UpdateAttempter::ActionCompleted(ActionProcessor* processor,
   // actions (update download as well as the initial update check
   // actions).
   const string type = action->Type();
+  const TimeTicks now = TimeTicks::Now();
   if (type == DownloadAction::StaticType()) {
     download_progress_ = 0.0;
+    __atomic_store_n(&eta_seconds_, -1, __ATOMIC_RELAXED);
+    PublishStatus();
     DownloadAction* download_action = dynamic_cast<DownloadAction*>(action);
     http_response_code_ = download_action->GetHTTPResponseCode();
+    const DeltaPerformer* performer = download_action->delta_performer();
+    if (performer) {
+      performance_counters_.AddOperationStats(performer->operation_stats());
+      performance_counters_.AddCheckpoints(performer->checkpoint_count());
+      // The rates of an update that failed may not be the device's.
+      if (code == kActionCodeSuccess) {
+        LOG_IF(WARNING, !UpdateDurationEstimator::SaveRates(
+            prefs_, performer->duration_estimator().UpdatedRates()))
+            << "Unable to save the update rates.";
+      }
+    }
+    performance_counters_.AddRetries(
+        download_action->http_fetcher()->GetRetryCount());
+  } else if (type == FilesystemCopierAction::StaticType()) {
+    performance_counters_.AddHashingTime(now - last_action_completed_time_);
   } else if (type == OmahaRequestAction::StaticType()) {
     OmahaRequestAction* omaha_request_action =
         dynamic_cast<OmahaRequestAction*>(action);
     // If the request is not an event, then it's the update-check.
     if (!omaha_request_action->IsEvent()) {
       http_response_code_ = omaha_request_action->GetHTTPResponseCode();
-      // Forward the server-dictated poll interval to the update check
-      // scheduler, if any.
+      // Forward the server-dictated poll interval and retry delay to the
+      // update check scheduler, if any.
       if (update_check_scheduler_) {
         update_check_scheduler_->set_poll_interval(
             omaha_request_action->GetOutputObject().poll_interval);
+        update_check_scheduler_->set_retry_after(
+            omaha_request_action->GetRetryAfter());
       }
     }
   }
+  last_action_completed_time_ = now;
   if (code != kActionCodeSuccess) {
     // If the current state is at or past the download phase, count the failure
     // in case a switch to full update becomes necessary. Ignore network
@@ -570,11 +732,18 @@ void UpdateAttempter::ActionCompleted(ActionProcessor* processor,
     // TODO(adlr): put version in InstallPlan
     new_version_ = "0.0.0.0";
     new_payload_size_ = plan.payload_size;
+    PublishStatus();
     SetupDownload();
+    // The update is written to the disk of the install partition.
+    const string install_disk = utils::RootDevice(plan.install_path);
+    if (!install_disk.empty())
+      resource_control_.SetIoDevice(install_disk);
     SetupCpuSharesManagement();
     SetStatusAndNotify(UPDATE_STATUS_UPDATE_AVAILABLE,
                        kUpdateNoticeUnspecified);
   } else if (type == DownloadAction::StaticType()) {
+    queued_events_.push_back(
+        OmahaEvent(OmahaEvent::kTypeUpdateDownloadFinished));
     SetStatusAndNotify(UPDATE_STATUS_FINALIZING, kUpdateNoticeUnspecified);
   }
 }
@@ -593,6 +762,14 @@ void UpdateAttempter::ResumeUpdating() {
 }
 
 void UpdateAttempter::SetDownloadStatus(bool active) {
+  if (active) {
+    download_start_time_ = TimeTicks::Now();
+    download_bytes_received_ = 0;
+    progress_throttle_.Reset();
+  } else if (download_active_) {
+    performance_counters_.AddDownload(
+        download_bytes_received_, TimeTicks::Now() - download_start_time_);
+  }
   download_active_ = active;
   LOG(INFO) << "Download status: " << (active ? "active" : "inactive");
 }
@@ -602,18 +779,20 @@ void UpdateAttempter::BytesReceived(uint64_t bytes_received, uint64_t total) {
     LOG(ERROR) << "BytesReceived called while not downloading.";
     return;
   }
-  double progress = static_cast<double>(bytes_received) /
+  download_bytes_received_ = bytes_received;
+  // GetStatus() always gets the latest progress, while the notifications
+  // are coalesced.
+  download_progress_ = static_cast<double>(bytes_received) /
       static_cast<double>(total);
-  // Self throttle based on progress. Also send notifications if
-  // progress is too slow.
-  const double kDeltaPercent = 0.01;  // 1%
-  if (status_ != UPDATE_STATUS_DOWNLOADING ||
-      bytes_received == total ||
-      progress - download_progress_ >= kDeltaPercent ||
-      TimeTicks::Now() - last_notify_time_ >= TimeDelta::FromSeconds(10)) {
-    download_progress_ = progress;
+  const DeltaPerformer* performer =
+      download_action_.get() ? download_action_->delta_performer() : NULL;
+  __atomic_store_n(&eta_seconds_, performer ? performer->eta_seconds() : -1,
+                   __ATOMIC_RELAXED);
+  PublishStatus();
+  if (progress_throttle_.ShouldReport(download_progress_,
+                                      status_ != UPDATE_STATUS_DOWNLOADING,
+                                      TimeTicks::Now()))
     SetStatusAndNotify(UPDATE_STATUS_DOWNLOADING, kUpdateNoticeUnspecified);
-  }
 }
 
 bool UpdateAttempter::ResetStatus() {
@@ -627,6 +806,9 @@ bool UpdateAttempter::ResetStatus() {
 
     case UPDATE_STATUS_UPDATED_NEED_REBOOT:  {
       status_ = UPDATE_STATUS_IDLE;
+      performance_counters_.SetStatus(UpdateStatusToString(status_),
+                                      TimeTicks::Now());
+      PublishStatus();
       LOG(INFO) << "Reset Successful";
 
       // also remove the reboot marker so that if the machine is rebooted
@@ -647,11 +829,33 @@ bool UpdateAttempter::GetStatus(int64_t* last_checked_time,
                                 string* current_operation,
                                 string* new_version,
                                 int64_t* new_payload_size) {
-  *last_checked_time = last_checked_time_;
-  *progress = download_progress_;
-  *current_operation = UpdateStatusToString(status_);
-  *new_version = new_version_;
-  *new_payload_size = new_payload_size_;
+  StatusSnapshot::Status status;
+  status_snapshot_.Read(&status);
+  *last_checked_time = status.last_checked_time;
+  *progress = status.progress;
+  *current_operation =
+      UpdateStatusToString(static_cast<UpdateStatus>(status.status));
+  *new_version = status.new_version;
+  *new_payload_size = status.new_payload_size;
+  return true;
+}
+
+int64_t UpdateAttempter::GetUpdateEta() const {
+  return __atomic_load_n(&eta_seconds_, __ATOMIC_RELAXED);
+}
+
+string UpdateAttempter::GetPerformanceCounters() const {
+  return performance_counters_.ToString(TimeTicks::Now());
+}
+
+void UpdateAttempter::SetDownloadRateLimit(uint64_t bytes_per_second) {
+  bandwidth_controller_.set_max_rate(bytes_per_second);
+}
+
+bool UpdateAttempter::StartPeerServer(int port) {
+  scoped_ptr<PeerServer> server(new PeerServer(&peer_cache_));
+  TEST_AND_RETURN_FALSE(server->Start(port));
+  peer_server_.reset(server.release());
   return true;
 }
 
@@ -693,11 +897,15 @@ void UpdateAttempter::StaticCompleteUpdateBootFlags(
   reinterpret_cast<UpdateAttempter*>(p)->CompleteUpdateBootFlags(return_code);
 }
 
+void UpdateAttempter::PublishStatus() {
+  status_snapshot_.Publish(last_checked_time_, download_progress_, status_,
+                           new_version_, new_payload_size_);
+}
+
 void UpdateAttempter::BroadcastStatus() {
   if (!dbus_service_) {
     return;
   }
-  last_notify_time_ = TimeTicks::Now();
   update_engine_service_emit_status_update(
       dbus_service_,
       last_checked_time_,
@@ -729,6 +937,9 @@ uint32_t UpdateAttempter::GetErrorCodeFlags()  {
 void UpdateAttempter::SetStatusAndNotify(UpdateStatus status,
                                          UpdateNotice notice) {
   status_ = status;
+  performance_counters_.SetStatus(UpdateStatusToString(status_),
+                                  TimeTicks::Now());
+  PublishStatus();
   if (update_check_scheduler_) {
     update_check_scheduler_->SetUpdateStatus(status_, notice);
   }
@@ -793,6 +1004,7 @@ bool UpdateAttempter::ScheduleErrorEventAction() {
                              error_event_.release(),  // Pass ownership.
                              new LibcurlHttpFetcher(system_state_),
                              false));
+  error_event_action->set_event_queue(&queued_events_);
   actions_.push_back(shared_ptr<AbstractAction>(error_event_action));
   processor_->EnqueueAction(error_event_action.get());
   SetStatusAndNotify(UPDATE_STATUS_REPORTING_ERROR_EVENT,
@@ -805,14 +1017,14 @@ void UpdateAttempter::SetCpuShares(utils::CpuShares shares) {
   if (shares_ == shares) {
     return;
   }
-  if (utils::SetCpuShares(shares)) {
+  if (resource_control_.SetProfile(shares)) {
     shares_ = shares;
     LOG(INFO) << "CPU shares = " << shares_;
   }
 }
 
 void UpdateAttempter::SetupCpuSharesManagement() {
-  if (manage_shares_source_) {
+  if (manage_shares_source_ || resource_load_source_) {
     LOG(ERROR) << "Cpu shares timeout source hasn't been destroyed.";
     CleanupCpuSharesManagement();
   }
@@ -824,6 +1036,14 @@ void UpdateAttempter::SetupCpuSharesManagement() {
                         NULL);
   g_source_attach(manage_shares_source_, NULL);
   SetCpuShares(utils::kCpuSharesLow);
+
+  const int kResourceLoadInterval = 10;  // 10 seconds
+  resource_load_source_ = g_timeout_source_new_seconds(kResourceLoadInterval);
+  g_source_set_callback(resource_load_source_,
+                        StaticUpdateResourcesForLoad,
+                        this,
+                        NULL);
+  g_source_attach(resource_load_source_, NULL);
 }
 
 void UpdateAttempter::CleanupCpuSharesManagement() {
@@ -831,13 +1051,43 @@ void UpdateAttempter::CleanupCpuSharesManagement() {
     g_source_destroy(manage_shares_source_);
     manage_shares_source_ = NULL;
   }
+  if (resource_load_source_) {
+    g_source_destroy(resource_load_source_);
+    resource_load_source_ = NULL;
+  }
   SetCpuShares(utils::kCpuSharesNormal);
+  SetProcessingSuspended(false);
 }
 
 gboolean UpdateAttempter::StaticManageCpuSharesCallback(gpointer data) {
   return reinterpret_cast<UpdateAttempter*>(data)->ManageCpuSharesCallback();
 }
 
+gboolean UpdateAttempter::StaticUpdateResourcesForLoad(gpointer data) {
+  reinterpret_cast<UpdateAttempter*>(data)->UpdateResourcesForLoad();
+  return TRUE;  // Keep checking the load.
+}
+
+void UpdateAttempter::UpdateResourcesForLoad() {
+  resource_control_.UpdateForLoad();
+  SetProcessingSuspended(resource_control_.paused());
+}
+
+void UpdateAttempter::SetProcessingSuspended(bool suspended) {
+  if (suspended == processor_->suspended())
+    return;
+  if (suspended) {
+    processor_->SuspendProcessing();
+    suspend_time_ = TimeTicks::Now();
+  } else {
+    processor_->ResumeProcessing();
+    const TimeDelta paused_time = TimeTicks::Now() - suspend_time_;
+    LOG(INFO) << "The update was paused for " << paused_time.InSeconds()
+              << " seconds.";
+    performance_counters_.AddPause(paused_time);
+  }
+}
+
 gboolean UpdateAttempter::StaticStartProcessing(gpointer data) {
   reinterpret_cast<UpdateAttempter*>(data)->processor_->StartProcessing();
   return FALSE;  // Don't call this callback again.
@@ -880,7 +1130,80 @@ void UpdateAttempter::SetupDownload() {
   MultiRangeHttpFetcher* fetcher =
       dynamic_cast<MultiRangeHttpFetcher*>(download_action_->http_fetcher());
   fetcher->ClearRanges();
-  if (response_handler_action_->install_plan().is_resume) {
+  const InstallPlan& plan = response_handler_action_->install_plan();
+  const uint64_t payload_size = plan.payload_size;
+
+  fetcher->ClearPeerUrls();
+  const string payload_name = PeerCache::PayloadName(plan.payload_hash);
+  int payload_fd = -1;
+  off_t cached_size = 0;
+  if (spooling_) {
+    // Only the peer cache's partial copy matters for resuming the download.
+    off_t offset = peer_cache_.PartialSize(plan.payload_hash);
+    if (static_cast<uint64_t>(offset) >= payload_size)
+      offset = 0;
+    AddPeerUrls(fetcher, payload_name);
+    AddPayloadRanges(fetcher, offset, payload_size, vector<uint64_t>());
+    return;
+  }
+  if (!payload_name.empty() &&
+      peer_cache_.OpenPayload(payload_name, &payload_fd, &cached_size)) {
+    // The payload was spooled or served to the peers already, so it's
+    // applied from the disk, with the same ranges as a download would be.
+    LOG(INFO) << "Applying the " << cached_size << " byte payload from the "
+              << "peer cache.";
+    fetcher = new MultiRangeHttpFetcher(new FileFetcher(system_state_,
+                                                        payload_fd));
+    download_action_->set_http_fetcher(fetcher);  // passes ownership
+  } else if (shared_payload_cache_ &&
+             peer_cache_.OpenPartialPayload(plan.payload_hash, &payload_fd)) {
+    // Another instance of the host is downloading the payload, so it's read
+    // from the cache as it comes in. Should that instance give up, the
+    // download fails and the next attempt fetches the payload itself.
+    LOG(INFO) << "Following the download of the payload by another "
+              << "instance.";
+    FileFetcher* file_fetcher = new FileFetcher(system_state_, payload_fd);
+    file_fetcher->set_follow(true);
+    fetcher = new MultiRangeHttpFetcher(file_fetcher);
+    download_action_->set_http_fetcher(fetcher);  // passes ownership
+  } else if (!multicast_group_.empty()) {
+    // The payload is received from the multicast group, and the data missed
+    // from it is downloaded from the peers or the update server, range by
+    // range as usual.
+    LibcurlHttpFetcher* fallback_fetcher =
+        new LibcurlHttpFetcher(system_state_);
+    fallback_fetcher->set_check_certificate(CertificateChecker::kDownload);
+    fallback_fetcher->set_bandwidth_controller(&bandwidth_controller_);
+    MulticastFetcher* multicast_fetcher =
+        new MulticastFetcher(system_state_, multicast_group_,
+                             multicast_port_, fallback_fetcher);
+    multicast_fetcher->set_payload_size(payload_size);
+    fetcher = new MultiRangeHttpFetcher(multicast_fetcher);
+    download_action_->set_http_fetcher(fetcher);  // passes ownership
+    AddPeerUrls(fetcher, payload_name);
+  } else {
+    AddPeerUrls(fetcher, payload_name);
+  }
+  vector<char> metadata;
+  if (plan.is_resume &&
+      DeltaPerformer::ReadLocalMetadata(prefs_, plan, &metadata)) {
+    // DeltaPerformer has the manifest metadata already, so only the data
+    // blobs past the checkpoint are fetched.
+    UpdateCheckpoint checkpoint;
+    DeltaPerformer::LoadCheckpoint(prefs_, &checkpoint);
+    // Its segment index, if any, splits the ranges by partition.
+    vector<uint64_t> boundaries;
+    DeltaArchiveManifest manifest;
+    const uint64_t manifest_offset = DeltaPerformer::GetManifestOffset();
+    if (metadata.size() > manifest_offset &&
+        manifest.ParseFromArray(&metadata[manifest_offset],
+                                metadata.size() - manifest_offset)) {
+      DeltaPerformer::GetPayloadSegmentBoundaries(manifest, metadata.size(),
+                                                  &boundaries);
+    }
+    AddPayloadRanges(fetcher, metadata.size() + checkpoint.next_data_offset,
+                     payload_size, boundaries);
+  } else if (plan.is_resume) {
     // Resuming an update so fetch the update manifest metadata first.
     int64_t manifest_metadata_size = 0;
     prefs_->GetInt64(kPrefsManifestMetadataSize, &manifest_metadata_size);
@@ -888,15 +1211,54 @@ void UpdateAttempter::SetupDownload() {
     // If there're remaining unprocessed data blobs, fetch them. Be careful not
     // to request data beyond the end of the payload to avoid 416 HTTP response
     // error codes.
+    UpdateCheckpoint checkpoint;
     int64_t next_data_offset = 0;
-    prefs_->GetInt64(kPrefsUpdateStateNextDataOffset, &next_data_offset);
-    uint64_t resume_offset = manifest_metadata_size + next_data_offset;
-    if (resume_offset < response_handler_action_->install_plan().payload_size) {
-      fetcher->AddRange(resume_offset);
+    if (DeltaPerformer::LoadCheckpoint(prefs_, &checkpoint) &&
+        checkpoint.next_data_offset > 0) {
+      next_data_offset = checkpoint.next_data_offset;
     }
+    uint64_t resume_offset = manifest_metadata_size + next_data_offset;
+    if (resume_offset < payload_size)
+      AddPayloadRanges(fetcher, resume_offset, payload_size,
+                       vector<uint64_t>());
   } else {
-    fetcher->AddRange(0);
+    AddPayloadRanges(fetcher, 0, payload_size, vector<uint64_t>());
+  }
+}
+
+void UpdateAttempter::AddPeerUrls(MultiRangeHttpFetcher* fetcher,
+                                  const string& payload_name) {
+  // The peers serve the payload under the name of its hash.
+  const vector<string>& peers = omaha_request_params_->peers();
+  for (vector<string>::const_iterator it = peers.begin();
+       it != peers.end() && !payload_name.empty(); ++it) {
+    fetcher->AddPeerUrl("http://" + *it +
+                        PeerServer::PayloadPath(payload_name));
+  }
+}
+
+void UpdateAttempter::AddPayloadRanges(MultiRangeHttpFetcher* fetcher,
+                                       uint64_t offset,
+                                       uint64_t payload_size,
+                                       const vector<uint64_t>& boundaries) {
+  // The segments are delivered in order, so DeltaPerformer checkpoints and
+  // resumes exactly as with a single range. The last one is left open-ended
+  // in case the payload size from the response is off.
+  if (kNumDownloadFetchers > 1) {
+    vector<uint64_t>::const_iterator boundary = boundaries.begin();
+    while (true) {
+      while (boundary != boundaries.end() && *boundary <= offset)
+        ++boundary;
+      uint64_t end = offset + kDownloadSegmentSize;
+      if (boundary != boundaries.end() && *boundary < end)
+        end = *boundary;
+      if (end >= payload_size)
+        break;
+      fetcher->AddRange(offset, end - offset);
+      offset = end;
+    }
   }
+  fetcher->AddRange(offset);
 }
 
 void UpdateAttempter::PingOmaha() {
@@ -906,6 +1268,7 @@ void UpdateAttempter::PingOmaha() {
                                NULL,
                                new LibcurlHttpFetcher(system_state_),
                                true));
+    ping_action->set_event_queue(&queued_events_);
     actions_.push_back(shared_ptr<OmahaRequestAction>(ping_action));
     processor_->set_delegate(NULL);
     processor_->EnqueueAction(ping_action.get());
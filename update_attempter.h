@@ -16,10 +16,17 @@
 #include <gtest/gtest_prod.h>  // for FRIEND_TEST
 
 #include "update_engine/action_processor.h"
+#include "update_engine/bandwidth_controller.h"
 #include "update_engine/dbus_interface.h"
 #include "update_engine/download_action.h"
 #include "update_engine/omaha_request_params.h"
 #include "update_engine/omaha_response_handler_action.h"
+#include "update_engine/peer_cache.h"
+#include "update_engine/peer_server.h"
+#include "update_engine/performance_counters.h"
+#include "update_engine/progress_throttle.h"
+#include "update_engine/resource_control.h"
+#include "update_engine/status_snapshot.h"
 #include "update_engine/system_state.h"
 
 struct UpdateEngineService;
@@ -30,6 +37,8 @@ namespace policy {
 
 namespace chromeos_update_engine {
 
+class LibcurlHttpFetcher;
+class MultiRangeHttpFetcher;
 class UpdateCheckScheduler;
 
 extern const char* kUpdateCompletedMarker;
@@ -57,6 +66,34 @@ class UpdateAttempter : public ActionProcessorDelegate,
  public:
   static const int kMaxDeltaUpdateFailures;
 
+  // See set_progress_notify_interval().
+  static const double kProgressNotifyStep;
+  static const int kProgressNotifyMinIntervalMs;
+  static const int kProgressNotifyMaxIntervalSeconds;
+
+  // The payload is downloaded over this many connections at a time, in
+  // segments of kDownloadSegmentSize bytes.
+  static const int kNumDownloadFetchers;
+  static const uint64_t kDownloadSegmentSize;
+
+  // Ranges of the payload this close to each other are downloaded with a
+  // single request.
+  static const size_t kDownloadCoalesceGap;
+
+  // The payload operations are applied on up to this many worker threads,
+  // each as soon as its data is in when no other one writes its blocks.
+  static const unsigned kNumApplyOperations;
+
+  // Adds the ranges to download the |payload_size|-byte payload from
+  // |offset| to its end to |fetcher|, split into segments that are
+  // downloaded in parallel. The segments also end at |boundaries|, payload
+  // offsets in order, e.g., where the data of one partition gives way to the
+  // other's, so that each partition's data is fetched as ranges of its own.
+  static void AddPayloadRanges(MultiRangeHttpFetcher* fetcher,
+                               uint64_t offset,
+                               uint64_t payload_size,
+                               const std::vector<uint64_t>& boundaries);
+
   UpdateAttempter(SystemState* system_state,
                   DbusGlibInterface* dbus_iface);
   virtual ~UpdateAttempter();
@@ -84,15 +121,35 @@ class UpdateAttempter : public ActionProcessorDelegate,
   // having to reboot once the previous update has reached
   // UPDATE_STATUS_UPDATED_NEED_REBOOT state. This is used only
   // for testing purposes.
-  bool ResetStatus();
+  virtual bool ResetStatus();
 
-  // Returns the current status in the out params. Returns true on success.
+  // Returns the current status in the out params, from the last snapshot
+  // published, so that it may be called from any thread without waiting
+  // for the main loop. Returns true on success.
   bool GetStatus(int64_t* last_checked_time,
                  double* progress,
                  std::string* current_operation,
                  std::string* new_version,
                  int64_t* new_size);
 
+  // Returns the estimated seconds left until the payload being downloaded
+  // is applied, or -1 if there's none or its manifest isn't parsed yet. May
+  // be called from any thread.
+  int64_t GetUpdateEta() const;
+
+  // Returns the performance counters of the update attempts since the
+  // daemon started, as formatted by PerformanceCounters::ToString().
+  virtual std::string GetPerformanceCounters() const;
+
+  // Caps the rate of the payload downloads at |bytes_per_second|, or lifts
+  // the cap if it's 0. Background downloads still yield to other traffic
+  // below the cap.
+  virtual void SetDownloadRateLimit(uint64_t bytes_per_second);
+
+  // Keeps a copy of the payloads downloaded from now on and serves it to the
+  // other machines of the network on |port|. Returns true on success.
+  bool StartPeerServer(int port);
+
   // Runs coreos-setgootroot, whose responsibility it is to mark the
   // currently booted partition has high priority/permanent/etc. The execution
   // is asynchronous. On completion, the action processor may be started
@@ -115,6 +172,69 @@ class UpdateAttempter : public ActionProcessorDelegate,
     dbus_service_ = dbus_service;
   }
 
+  // The download progress is broadcast when it has advanced by
+  // kProgressNotifyStep, but at most once per |interval|, by default
+  // kProgressNotifyMinIntervalMs, and at least every
+  // kProgressNotifyMaxIntervalSeconds.
+  void set_progress_notify_interval(base::TimeDelta interval) {
+    progress_throttle_.set_min_interval(interval);
+  }
+
+  // Downloads and applies the updates within about |memory_budget| bytes of
+  // memory. See DownloadAction::set_memory_budget(). 0, the default, means
+  // no budget.
+  void set_memory_budget(uint64_t memory_budget) {
+    memory_budget_ = memory_budget;
+  }
+
+  // Makes the scheduled updates only download their payload to the peer
+  // cache, to be applied from there, at disk speed, by the next update the
+  // user asks for. Off by default.
+  void set_spool_updates(bool spool_updates) {
+    spool_updates_ = spool_updates;
+  }
+
+  // Makes the peer cache live in |dir|, which the update_engine instances of
+  // the host, e.g. of its VMs or containers, share, and makes every download
+  // fill it. The payloads are then downloaded by a single instance, and the
+  // others apply them from the cache, following the copy of the one being
+  // downloaded as it grows. Must be called before the first update.
+  void set_shared_payload_cache(const std::string& dir) {
+    peer_cache_.set_dir(dir);
+    shared_payload_cache_ = true;
+  }
+
+  // Makes the payloads be received from the UDP multicast group |group| on
+  // |port|, to which a sender of the network sends them, rather than be
+  // downloaded. Only what's missed from the group is downloaded. See
+  // MulticastFetcher.
+  void set_multicast_group(const std::string& group, int port) {
+    multicast_group_ = group;
+    multicast_port_ = port;
+  }
+
+  // Makes the updates read the new partitions back to verify them even when
+  // the payload's destination hashes verified them as they were written.
+  // See FilesystemCopierAction::set_full_verification(). Off by default.
+  void set_full_verification(bool full_verification) {
+    full_verification_ = full_verification;
+  }
+
+  // Makes the updates also write the partitions of the |disks|, e.g.,
+  // "/dev/sdb", that mirror those of the boot disk. See
+  // OmahaResponseHandlerAction::set_mirror_disks().
+  void set_mirror_disks(const std::vector<std::string>& disks) {
+    mirror_disks_ = disks;
+  }
+
+  // Makes the payload downloads ask for HTTP/2 over HTTPS. See
+  // LibcurlHttpFetcher::set_use_http2(). Off by default.
+  void set_use_http2(bool use_http2) { use_http2_ = use_http2; }
+
+  // Lets the payload downloads move to HTTP/3 where the server offers it.
+  // See LibcurlHttpFetcher::set_use_http3(). Off by default.
+  void set_use_http3(bool use_http3) { use_http3_ = use_http3; }
+
   UpdateCheckScheduler* update_check_scheduler() const {
     return update_check_scheduler_;
   }
@@ -125,7 +245,7 @@ class UpdateAttempter : public ActionProcessorDelegate,
   // This is the internal entry point for going through an
   // update. If the current status is idle invokes Update.
   // This is called by the DBus implementation.
-  void CheckForUpdate(bool interactive);
+  virtual void CheckForUpdate(bool interactive);
 
   // Initiates a reboot if the current state is
   // UPDATED_NEED_REBOOT. Returns true on sucess, false otherwise.
@@ -138,6 +258,10 @@ class UpdateAttempter : public ActionProcessorDelegate,
   // Broadcasts the current status over D-Bus.
   void BroadcastStatus();
 
+  // Publishes the status fields to |status_snapshot_|. Called whenever one
+  // of them changes.
+  void PublishStatus();
+
   // Returns the special flags to be added to ActionExitCode values based on the
   // parameters used in the current update attempt.
   uint32_t GetErrorCodeFlags();
@@ -150,6 +274,8 @@ class UpdateAttempter : public ActionProcessorDelegate,
   FRIEND_TEST(UpdateAttempterTest, CreatePendingErrorEventTest);
   FRIEND_TEST(UpdateAttempterTest, CreatePendingErrorEventResumedTest);
   FRIEND_TEST(UpdateAttempterTest, DisableDeltaUpdateIfNeededTest);
+  FRIEND_TEST(UpdateAttempterTest, DownloadFetchersTest);
+  FRIEND_TEST(UpdateAttempterTest, GetStatusTest);
   FRIEND_TEST(UpdateAttempterTest, MarkDeltaUpdateFailureTest);
   FRIEND_TEST(UpdateAttempterTest, ReadTrackFromPolicy);
   FRIEND_TEST(UpdateAttempterTest, PingOmahaTest);
@@ -165,6 +291,11 @@ class UpdateAttempter : public ActionProcessorDelegate,
   // Sets up the download parameters after receiving the update check response.
   void SetupDownload();
 
+  // Makes |fetcher| download the payload named |payload_name| in the peer
+  // cache from the peers of the update check, if any, first.
+  void AddPeerUrls(MultiRangeHttpFetcher* fetcher,
+                   const std::string& payload_name);
+
   // Creates an error event object in |error_event_| to be included in an
   // OmahaRequestAction once the current action processor is done.
   void CreatePendingErrorEvent(AbstractAction* action, ActionExitCode code);
@@ -175,12 +306,13 @@ class UpdateAttempter : public ActionProcessorDelegate,
   // otherwise.
   bool ScheduleErrorEventAction();
 
-  // Sets the cpu shares to |shares| and updates |shares_| if the new
-  // |shares| is different than the current |shares_|, otherwise simply
+  // Applies the resource profile of |shares| and updates |shares_| if the
+  // new |shares| is different than the current |shares_|, otherwise simply
   // returns.
   void SetCpuShares(utils::CpuShares shares);
 
-  // Sets the cpu shares to low and sets up timeout events to increase it.
+  // Sets the cpu shares to low and sets up timeout events to increase it,
+  // and to adapt the resource limits to the load of the system.
   void SetupCpuSharesManagement();
 
   // Resets the cpu shares to normal and destroys any scheduled timeout
@@ -192,6 +324,18 @@ class UpdateAttempter : public ActionProcessorDelegate,
   static gboolean StaticManageCpuSharesCallback(gpointer data);
   bool ManageCpuSharesCallback();
 
+  // The resource load timeout source callback adapts the resource limits to
+  // the load of the system. Returns true so that it keeps being called.
+  static gboolean StaticUpdateResourcesForLoad(gpointer data);
+
+  // Adapts the resource limits to the load of the system, and suspends the
+  // update's actions while the system is under pressure.
+  void UpdateResourcesForLoad();
+
+  // Suspends the actions if |suspended|, or resumes them, counting the time
+  // they were suspended.
+  void SetProcessingSuspended(bool suspended);
+
   // Callback to start the action processor.
   static gboolean StaticStartProcessing(gpointer data);
 
@@ -235,14 +379,51 @@ class UpdateAttempter : public ActionProcessorDelegate,
   // Update() method for the meaning of the parametes.
   void BuildUpdateActions(bool interactive);
 
+  // Returns a new fetcher for the payload downloads of an update, which
+  // checks the download server's certificate and uses the HTTP versions
+  // set with set_use_http2() and set_use_http3().
+  LibcurlHttpFetcher* NewDownloadFetcher();
+
   // Decrements the count in the kUpdateCheckCountFilePath.
   // Returns True if successfully decremented, false otherwise.
   bool DecrementUpdateCheckCount();
 
-  // Last status notification timestamp used for throttling. Use monotonic
-  // TimeTicks to ensure that notifications are sent even if the system clock is
-  // set back in the middle of an update.
-  base::TimeTicks last_notify_time_;
+  // Coalesces the download progress notifications. It's fed monotonic
+  // TimeTicks so that notifications are sent even if the system clock is set
+  // back in the middle of an update.
+  ProgressThrottle progress_throttle_;
+
+  // See set_memory_budget().
+  uint64_t memory_budget_;
+
+  // See set_spool_updates(), and whether the current attempt only downloads
+  // the payload.
+  bool spool_updates_;
+  bool spooling_;
+
+  // See set_full_verification().
+  bool full_verification_;
+
+  // See set_mirror_disks().
+  std::vector<std::string> mirror_disks_;
+
+  // See set_use_http2() and set_use_http3().
+  bool use_http2_;
+  bool use_http3_;
+
+  // Sets the rate of the payload downloads. Declared ahead of the actions so
+  // that it outlives the fetchers that use it.
+  BandwidthController bandwidth_controller_;
+
+  // The copy of the last payload downloaded, and its server to the other
+  // machines of the network, if started. See also set_shared_payload_cache().
+  PeerCache peer_cache_;
+  bool shared_payload_cache_;
+  scoped_ptr<PeerServer> peer_server_;
+
+  // See set_multicast_group(). Empty if the payloads aren't multicast.
+  std::string multicast_group_;
+  int multicast_port_;
 
   std::vector<std::tr1::shared_ptr<AbstractAction> > actions_;
   scoped_ptr<ActionProcessor> processor_;
@@ -272,6 +453,10 @@ class UpdateAttempter : public ActionProcessorDelegate,
   // Pending error event, if any.
   scoped_ptr<OmahaEvent> error_event_;
 
+  // Events that are reported along with the next Omaha request, rather than
+  // with a request of their own.
+  std::vector<OmahaEvent> queued_events_;
+
   // If we should request a reboot even tho we failed the update
   bool fake_update_success_;
 
@@ -284,16 +469,41 @@ class UpdateAttempter : public ActionProcessorDelegate,
   // The cpu shares management timeout source.
   GSource* manage_shares_source_;
 
+  // Applies the cpu shares, and the other resource limits that go with them.
+  ResourceControl resource_control_;
+
+  // The timeout source that periodically adapts the resource limits to the
+  // load of the system, while the cpu shares are low.
+  GSource* resource_load_source_;
+
+  // When the actions were suspended under system pressure, if they are.
+  base::TimeTicks suspend_time_;
+
   // Set to true if an update download is active (and BytesReceived
   // will be called), set to false otherwise.
   bool download_active_;
 
+  // When the current download started, and the bytes it has received.
+  base::TimeTicks download_start_time_;
+  uint64_t download_bytes_received_;
+
+  // When the last action completed. The actions that hash the partitions
+  // always follow another one, so they're timed from its completion.
+  base::TimeTicks last_action_completed_time_;
+
+  PerformanceCounters performance_counters_;
+
   // For status:
   UpdateStatus status_;
   double download_progress_;
   int64_t last_checked_time_;
   std::string new_version_;
   int64_t new_payload_size_;
+  // The status fields above as GetStatus() reads them. See PublishStatus().
+  StatusSnapshot status_snapshot_;
+  // The estimate of the download action's performer, as GetUpdateEta()
+  // reads it. Updated as bytes are received.
+  int64_t eta_seconds_;
 
   // Common parameters for all Omaha requests.
   OmahaRequestParams* omaha_request_params_;
@@ -22,6 +22,10 @@ class UpdateAttempterMock : public UpdateAttempter {
       : UpdateAttempter(mock_system_state, dbus) {}
 
   MOCK_METHOD1(Update, void(bool interactive));
+  MOCK_METHOD1(CheckForUpdate, void(bool interactive));
+  MOCK_METHOD0(ResetStatus, bool());
+  MOCK_CONST_METHOD0(GetPerformanceCounters, std::string());
+  MOCK_METHOD1(SetDownloadRateLimit, void(uint64_t bytes_per_second));
 };
 
 }  // namespace chromeos_update_engine
@@ -10,18 +10,24 @@
 #include "update_engine/action_mock.h"
 #include "update_engine/action_processor_mock.h"
 #include "update_engine/filesystem_copier_action.h"
+#include "update_engine/libcurl_http_fetcher.h"
 #include "update_engine/mock_dbus_interface.h"
 #include "update_engine/mock_http_fetcher.h"
 #include "update_engine/mock_payload_state.h"
 #include "update_engine/mock_system_state.h"
+#include "update_engine/multi_range_http_fetcher.h"
 #include "update_engine/postinstall_runner_action.h"
 #include "update_engine/prefs.h"
 #include "update_engine/prefs_mock.h"
 #include "update_engine/test_utils.h"
 #include "update_engine/update_attempter.h"
 #include "update_engine/update_check_scheduler.h"
+#include "update_engine/url_prober_action.h"
 
+using std::make_pair;
+using std::pair;
 using std::string;
+using std::vector;
 using testing::_;
 using testing::DoAll;
 using testing::InSequence;
@@ -58,6 +64,7 @@ class UpdateAttempterTest : public ::testing::Test {
     EXPECT_EQ(0, attempter_.http_response_code_);
     EXPECT_EQ(utils::kCpuSharesNormal, attempter_.shares_);
     EXPECT_EQ(NULL, attempter_.manage_shares_source_);
+    EXPECT_EQ(NULL, attempter_.resource_load_source_);
     EXPECT_FALSE(attempter_.download_active_);
     EXPECT_EQ(UPDATE_STATUS_IDLE, attempter_.status_);
     EXPECT_EQ(0.0, attempter_.download_progress_);
@@ -72,6 +79,18 @@ class UpdateAttempterTest : public ::testing::Test {
   void QuitMainLoop();
   static gboolean StaticQuitMainLoop(gpointer data);
 
+  // Returns the ranges |fetcher| downloads as (offset, length) pairs, with
+  // length 0 for one that runs to the end.
+  static vector<pair<off_t, size_t> > RangesOf(
+      const MultiRangeHttpFetcher& fetcher) {
+    vector<pair<off_t, size_t> > ranges;
+    for (size_t i = 0; i < fetcher.ranges_.size(); i++) {
+      ranges.push_back(make_pair(fetcher.ranges_[i].offset(),
+                                 fetcher.ranges_[i].length()));
+    }
+    return ranges;
+  }
+
   void UpdateTestStart();
   void UpdateTestVerify();
   static gboolean StaticUpdateTestStart(gpointer data);
@@ -209,6 +228,115 @@ TEST_F(UpdateAttempterTest, DisableDeltaUpdateIfNeededTest) {
   EXPECT_FALSE(attempter_.omaha_request_params_->delta_okay());
 }
 
+TEST_F(UpdateAttempterTest, DownloadFetchersTest) {
+  // The payload fetchers of an attempt use the HTTP versions they're set to
+  // and share their connections, TLS sessions and DNS cache with each other
+  // and with the update check's fetcher.
+  attempter_.set_use_http2(true);
+  scoped_ptr<LibcurlHttpFetcher> check_fetcher(
+      new LibcurlHttpFetcher(&mock_system_state_));
+  ASSERT_TRUE(check_fetcher->share_handle_ != NULL);
+  for (int i = 0; i < 3; i++) {
+    scoped_ptr<LibcurlHttpFetcher> fetcher(attempter_.NewDownloadFetcher());
+    EXPECT_EQ(check_fetcher->share_handle_, fetcher->share_handle_);
+    EXPECT_EQ(CertificateChecker::kDownload, fetcher->check_certificate_);
+    EXPECT_TRUE(fetcher->use_http2_);
+    EXPECT_FALSE(fetcher->use_http3_);
+  }
+  attempter_.set_use_http2(false);
+  attempter_.set_use_http3(true);
+  scoped_ptr<LibcurlHttpFetcher> fetcher(attempter_.NewDownloadFetcher());
+  EXPECT_EQ(check_fetcher->share_handle_, fetcher->share_handle_);
+  EXPECT_FALSE(fetcher->use_http2_);
+  EXPECT_TRUE(fetcher->use_http3_);
+}
+
+TEST_F(UpdateAttempterTest, AddPayloadRangesTest) {
+  ASSERT_EQ(3, UpdateAttempter::kNumDownloadFetchers);
+  const off_t kSegment = UpdateAttempter::kDownloadSegmentSize;
+  MultiRangeHttpFetcher fetcher(new MockHttpFetcher("", 0));
+  vector<pair<off_t, size_t> > expected;
+
+  // A resumed download is split into segments from where it resumes, and
+  // the last one is left open-ended.
+  const off_t kResume = kSegment / 2 + 5;
+  UpdateAttempter::AddPayloadRanges(&fetcher, kResume, 3 * kSegment,
+                                    vector<uint64_t>());
+  expected.push_back(make_pair(kResume, kSegment));
+  expected.push_back(make_pair(kResume + kSegment, kSegment));
+  expected.push_back(make_pair(kResume + 2 * kSegment, 0));
+  EXPECT_TRUE(RangesOf(fetcher) == expected);
+
+  // The last segment of a payload whose size isn't a multiple of the
+  // segment size takes the rest, and so does one of a payload that is.
+  fetcher.ClearRanges();
+  expected.clear();
+  UpdateAttempter::AddPayloadRanges(&fetcher, 0, 2 * kSegment + 100,
+                                    vector<uint64_t>());
+  expected.push_back(make_pair(0, kSegment));
+  expected.push_back(make_pair(kSegment, kSegment));
+  expected.push_back(make_pair(2 * kSegment, 0));
+  EXPECT_TRUE(RangesOf(fetcher) == expected);
+  fetcher.ClearRanges();
+  expected.clear();
+  UpdateAttempter::AddPayloadRanges(&fetcher, 0, 2 * kSegment,
+                                    vector<uint64_t>());
+  expected.push_back(make_pair(0, kSegment));
+  expected.push_back(make_pair(kSegment, 0));
+  EXPECT_TRUE(RangesOf(fetcher) == expected);
+
+  // A payload smaller than a segment is a single open-ended range.
+  fetcher.ClearRanges();
+  expected.clear();
+  UpdateAttempter::AddPayloadRanges(&fetcher, 0, 1000, vector<uint64_t>());
+  expected.push_back(make_pair(0, 0));
+  EXPECT_TRUE(RangesOf(fetcher) == expected);
+
+  // The segments also end at the boundaries, skipping those before the
+  // offset.
+  fetcher.ClearRanges();
+  expected.clear();
+  vector<uint64_t> boundaries;
+  boundaries.push_back(kSegment / 4);
+  boundaries.push_back(kSegment / 2);
+  boundaries.push_back(2 * kSegment);
+  UpdateAttempter::AddPayloadRanges(&fetcher, kSegment / 4, 3 * kSegment,
+                                    boundaries);
+  expected.push_back(make_pair(kSegment / 4, kSegment / 4));
+  expected.push_back(make_pair(kSegment / 2, kSegment));
+  expected.push_back(make_pair(3 * kSegment / 2, kSegment / 2));
+  expected.push_back(make_pair(2 * kSegment, 0));
+  EXPECT_TRUE(RangesOf(fetcher) == expected);
+}
+
+TEST_F(UpdateAttempterTest, GetStatusTest) {
+  attempter_.new_payload_size_ = 1234;
+  attempter_.download_progress_ = 0.25;
+  // GetStatus() only sees the fields once they're published.
+  int64_t last_checked_time = -1;
+  double progress = -1;
+  string current_operation;
+  string new_version;
+  int64_t new_size = -1;
+  EXPECT_TRUE(attempter_.GetStatus(&last_checked_time, &progress,
+                                   &current_operation, &new_version,
+                                   &new_size));
+  EXPECT_EQ(0, last_checked_time);
+  EXPECT_EQ(0.0, progress);
+  EXPECT_EQ("UPDATE_STATUS_IDLE", current_operation);
+  EXPECT_EQ("0.0.0.0", new_version);
+  EXPECT_EQ(0, new_size);
+
+  attempter_.SetStatusAndNotify(UPDATE_STATUS_DOWNLOADING,
+                                kUpdateNoticeUnspecified);
+  EXPECT_TRUE(attempter_.GetStatus(&last_checked_time, &progress,
+                                   &current_operation, &new_version,
+                                   &new_size));
+  EXPECT_EQ(0.25, progress);
+  EXPECT_EQ("UPDATE_STATUS_DOWNLOADING", current_operation);
+  EXPECT_EQ(1234, new_size);
+}
+
 TEST_F(UpdateAttempterTest, MarkDeltaUpdateFailureTest) {
   EXPECT_CALL(*prefs_, GetInt64(kPrefsDeltaUpdateFailures, _))
       .WillOnce(Return(false))
@@ -339,12 +467,12 @@ gboolean UpdateAttempterTest::StaticNoScatteringDoneDuringManualUpdateTestStart(
 namespace {
 const string kActionTypes[] = {
   OmahaRequestAction::StaticType(),
+  UrlProberAction::StaticType(),
   OmahaResponseHandlerAction::StaticType(),
+  OmahaRequestAction::StaticType(),
   FilesystemCopierAction::StaticType(),
   FilesystemCopierAction::StaticType(),
-  OmahaRequestAction::StaticType(),
   DownloadAction::StaticType(),
-  OmahaRequestAction::StaticType(),
   FilesystemCopierAction::StaticType(),
   FilesystemCopierAction::StaticType(),
   PostinstallRunnerAction::StaticType(),
@@ -0,0 +1,544 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Measures the time a whole update takes, from the update check until the
+// client is ready to reboot, by running the same actions UpdateAttempter
+// does against a test_http_server that stands in for Omaha and serves the
+// payload, optionally under shaped network conditions. The update is
+// applied from --boot_device onto its partner partition, as on a real
+// client, so a disk image with the partitions of a reference image, e.g.,
+// set up with losetup -P, can be used. Must be run as root to mount the new
+// rootfs for the postinstall step.
+//
+// Every stage reports its wall time and how busy the CPU (100% being one
+// core), the disk holding the partitions and the network were, so that a
+// change that moves the bottleneck between them shows up. When the busy
+// times add up to more than 100%, the resources were used at the same time
+// for at least the excess of the stage, which is reported as its overlap.
+// The network is only counted busy when its rate is limited. A stage starts
+// when the previous one completes, so the start of the download, which
+// overlaps the source hashing, is counted in the hashing stage.
+
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <base/at_exit.h>
+#include <base/command_line.h>
+#include <base/file_path.h>
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+#include <base/string_number_conversions.h>
+#include <base/string_split.h>
+#include <base/string_util.h>
+#include <base/stringprintf.h>
+#include <base/time.h>
+#include <gflags/gflags.h>
+#include <glib.h>
+
+#include "update_engine/action_processor.h"
+#include "update_engine/connection_manager.h"
+#include "update_engine/delta_performer.h"
+#include "update_engine/download_action.h"
+#include "update_engine/filesystem_copier_action.h"
+#include "update_engine/http_fetcher_unittest.h"
+#include "update_engine/libcurl_http_fetcher.h"
+#include "update_engine/multi_range_http_fetcher.h"
+#include "update_engine/omaha_hash_calculator.h"
+#include "update_engine/omaha_request_action.h"
+#include "update_engine/omaha_request_params.h"
+#include "update_engine/omaha_response_handler_action.h"
+#include "update_engine/payload_state.h"
+#include "update_engine/postinstall_runner_action.h"
+#include "update_engine/prefs.h"
+#include "update_engine/subprocess.h"
+#include "update_engine/system_state.h"
+#include "update_engine/terminator.h"
+#include "update_engine/update_attempter.h"
+#include "update_engine/utils.h"
+
+DEFINE_string(payload, "", "Path to the payload to apply");
+DEFINE_string(boot_device, "",
+              "The rootfs partition the update is applied from, e.g., "
+              "/dev/loop0p3. The update is installed on its partner "
+              "partition");
+DEFINE_string(http_server, "./test_http_server",
+              "Path to the test_http_server program");
+DEFINE_int32(latency_ms, 0, "Latency of the payload download");
+DEFINE_int64(bytes_per_sec, 0,
+             "Rate the payload is served at, 0 meaning unlimited");
+DEFINE_int64(stall_every, 0,
+             "Number of bytes after which the payload download stalls, 0 "
+             "meaning never");
+DEFINE_int32(stall_ms, 0, "Duration of every stall of the payload download");
+DEFINE_int32(download_fetchers,
+             chromeos_update_engine::UpdateAttempter::kNumDownloadFetchers,
+             "Number of connections the payload is downloaded over");
+DEFINE_bool(postinstall, true, "Run the postinstall step of the new rootfs");
+DEFINE_string(prefs_dir, "/tmp/update_benchmark_prefs",
+              "Preferences directory the update progress is kept in");
+
+using base::TimeDelta;
+using base::TimeTicks;
+using std::map;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+const double kMiB = 1024.0 * 1024.0;
+const char kResponseName[] = "omaha_response.xml";
+const char kPayloadName[] = "payload";
+
+// The system state of a client that has no D-Bus services, device policy or
+// update attempter, which the actions run here don't need.
+class BenchmarkSystemState : public SystemState {
+ public:
+  BenchmarkSystemState()
+      : connection_manager_(this),
+        request_params_(this) {}
+
+  bool Initialize(const string& update_url) {
+    TEST_AND_RETURN_FALSE(prefs_.Init(FilePath(FLAGS_prefs_dir)));
+    TEST_AND_RETURN_FALSE(payload_state_.Initialize(&prefs_));
+    TEST_AND_RETURN_FALSE(request_params_.Init(false));
+    request_params_.set_update_url(update_url);
+    // Every run starts a new update rather than resuming the last one.
+    TEST_AND_RETURN_FALSE(DeltaPerformer::ResetUpdateProgress(&prefs_,
+                                                              false));
+    return true;
+  }
+
+  virtual void set_device_policy(const policy::DevicePolicy* device_policy) {}
+  virtual const policy::DevicePolicy* device_policy() const { return NULL; }
+  virtual ConnectionManager* connection_manager() {
+    return &connection_manager_;
+  }
+  virtual PrefsInterface* prefs() { return &prefs_; }
+  virtual PayloadStateInterface* payload_state() { return &payload_state_; }
+  virtual UpdateAttempter* update_attempter() { return NULL; }
+  virtual OmahaRequestParams* request_params() { return &request_params_; }
+
+ private:
+  NoopConnectionManager connection_manager_;
+  Prefs prefs_;
+  PayloadState payload_state_;
+  OmahaRequestParams request_params_;
+  DISALLOW_COPY_AND_ASSIGN(BenchmarkSystemState);
+};
+
+// The resources used by the process, and the children it has waited for, up
+// to a point in time.
+struct ResourceSample {
+  ResourceSample() : read_bytes(0), write_bytes(0), disk_busy_ms(0) {}
+
+  TimeTicks time;
+  TimeDelta cpu_time;
+  // Bytes the process read from and wrote to storage.
+  uint64_t read_bytes;
+  uint64_t write_bytes;
+  // Milliseconds the disk has been busy for.
+  uint64_t disk_busy_ms;
+};
+
+// Reads the storage I/O of the process from /proc/self/io. Returns true on
+// success.
+bool GetStorageBytes(uint64_t* read_bytes, uint64_t* write_bytes) {
+  string io;
+  TEST_AND_RETURN_FALSE(utils::ReadFile("/proc/self/io", &io));
+  vector<string> lines;
+  base::SplitString(io, '\n', &lines);
+  bool found_reads = false, found_writes = false;
+  for (vector<string>::const_iterator it = lines.begin(); it != lines.end();
+       ++it) {
+    vector<string> fields;
+    base::SplitString(*it, ':', &fields);
+    if (fields.size() != 2)
+      continue;
+    if (fields[0] == "read_bytes")
+      found_reads = base::StringToUint64(fields[1], read_bytes);
+    else if (fields[0] == "write_bytes")
+      found_writes = base::StringToUint64(fields[1], write_bytes);
+  }
+  TEST_AND_RETURN_FALSE(found_reads && found_writes);
+  return true;
+}
+
+// Reads the milliseconds the disk has been busy for, the tenth field of its
+// statistics file |stat_path|. Returns true on success.
+bool GetDiskBusyMs(const string& stat_path, uint64_t* busy_ms) {
+  string stat;
+  TEST_AND_RETURN_FALSE(utils::ReadFile(stat_path, &stat));
+  vector<string> fields;
+  base::SplitStringAlongWhitespace(stat, &fields);
+  TEST_AND_RETURN_FALSE(fields.size() >= 10);
+  TEST_AND_RETURN_FALSE(base::StringToUint64(fields[9], busy_ms));
+  return true;
+}
+
+// Returns the statistics file of the disk holding |device|, which is that of
+// its parent device if it's a partition.
+string DiskStatPath(const string& device) {
+  const string sys_path =
+      "/sys/class/block/" + FilePath(device).BaseName().value();
+  if (utils::FileExists((sys_path + "/partition").c_str()))
+    return sys_path + "/../stat";
+  return sys_path + "/stat";
+}
+
+ResourceSample TakeSample(const string& disk_stat_path) {
+  ResourceSample sample;
+  sample.time = TimeTicks::Now();
+  struct rusage self, children;
+  PCHECK(getrusage(RUSAGE_SELF, &self) == 0);
+  PCHECK(getrusage(RUSAGE_CHILDREN, &children) == 0);
+  const struct timeval* times[4] = {
+    &self.ru_utime, &self.ru_stime, &children.ru_utime, &children.ru_stime
+  };
+  for (size_t i = 0; i < arraysize(times); i++) {
+    sample.cpu_time += TimeDelta::FromSeconds(times[i]->tv_sec) +
+        TimeDelta::FromMicroseconds(times[i]->tv_usec);
+  }
+  LOG_IF(WARNING, !GetStorageBytes(&sample.read_bytes, &sample.write_bytes))
+      << "Unable to read the storage I/O of the process";
+  LOG_IF(WARNING, !GetDiskBusyMs(disk_stat_path, &sample.disk_busy_ms))
+      << "Unable to read " << disk_stat_path;
+  return sample;
+}
+
+// Records the resources every action of the update uses, and quits the main
+// loop when the update is done. Like UpdateAttempter, sets up the ranges of
+// the payload download once the install plan is known.
+class StageRecorder : public ActionProcessorDelegate,
+                      public DownloadActionDelegate {
+ public:
+  StageRecorder(GMainLoop* loop, const string& disk_stat_path)
+      : loop_(loop),
+        disk_stat_path_(disk_stat_path),
+        response_handler_action_(NULL),
+        fetcher_(NULL),
+        code_(kActionCodeError),
+        bytes_received_(0) {}
+
+  void set_download(const OmahaResponseHandlerAction* response_handler_action,
+                    MultiRangeHttpFetcher* fetcher) {
+    response_handler_action_ = response_handler_action;
+    fetcher_ = fetcher;
+  }
+
+  // Names the stage of |action| in the report.
+  void AddStage(AbstractAction* action, const string& name) {
+    names_[action] = name;
+  }
+
+  // Starts the clock of the first stage.
+  void Start() {
+    last_sample_ = TakeSample(disk_stat_path_);
+  }
+
+  virtual void ProcessingDone(const ActionProcessor* processor,
+                              ActionExitCode code) {
+    code_ = code;
+    g_main_loop_quit(loop_);
+  }
+
+  virtual void ActionCompleted(ActionProcessor* processor,
+                               AbstractAction* action,
+                               ActionExitCode code) {
+    Stage stage;
+    stage.name = names_[action];
+    stage.code = code;
+    stage.start = last_sample_;
+    stage.end = TakeSample(disk_stat_path_);
+    stage.network_bytes = bytes_received_;
+    bytes_received_ = 0;
+    stages_.push_back(stage);
+    last_sample_ = stage.end;
+    if (action == response_handler_action_ && code == kActionCodeSuccess) {
+      UpdateAttempter::AddPayloadRanges(
+          fetcher_, 0, response_handler_action_->install_plan().payload_size,
+          vector<uint64_t>());
+    }
+  }
+
+  virtual void SetDownloadStatus(bool active) {}
+
+  virtual void BytesReceived(uint64_t bytes_received, uint64_t total) {
+    bytes_received_ = bytes_received;
+  }
+
+  // Prints the report of the update. Returns the exit code of the update.
+  ActionExitCode Report() const;
+
+ private:
+  struct Stage {
+    string name;
+    ActionExitCode code;
+    ResourceSample start;
+    ResourceSample end;
+    uint64_t network_bytes;
+  };
+
+  GMainLoop* loop_;
+  const string disk_stat_path_;
+  const OmahaResponseHandlerAction* response_handler_action_;
+  MultiRangeHttpFetcher* fetcher_;
+  map<AbstractAction*, string> names_;
+  vector<Stage> stages_;
+  ResourceSample last_sample_;
+  ActionExitCode code_;
+  uint64_t bytes_received_;
+  DISALLOW_COPY_AND_ASSIGN(StageRecorder);
+};
+
+ActionExitCode StageRecorder::Report() const {
+  printf("%-20s %9s %6s %6s %6s %8s %10s %10s %8s\n",
+         "stage", "wall (s)", "cpu", "disk", "net", "overlap", "read MiB",
+         "write MiB", "bound");
+  TimeDelta total_time;
+  for (vector<Stage>::const_iterator it = stages_.begin();
+       it != stages_.end(); ++it) {
+    const TimeDelta wall_time = it->end.time - it->start.time;
+    const double wall_ms = std::max(wall_time.InMillisecondsF(), 1.0);
+    total_time += wall_time;
+    const double cpu_busy = std::min(
+        100.0, (it->end.cpu_time - it->start.cpu_time).InMillisecondsF() /
+        wall_ms * 100);
+    const double disk_busy = std::min(
+        100.0, (it->end.disk_busy_ms - it->start.disk_busy_ms) / wall_ms * 100);
+    double network_busy = 0;
+    if (FLAGS_bytes_per_sec > 0) {
+      network_busy = std::min(
+          100.0, it->network_bytes / (wall_ms / 1000) / FLAGS_bytes_per_sec *
+          100);
+    }
+    const char* bound = "cpu";
+    if (disk_busy > cpu_busy && disk_busy >= network_busy)
+      bound = "disk";
+    else if (network_busy > cpu_busy && network_busy > disk_busy)
+      bound = "network";
+    printf("%-20s %9.3f %5.0f%% %5.0f%% %5.0f%% %7.0f%% %10.1f %10.1f %8s\n",
+           it->name.c_str(),
+           wall_time.InSecondsF(),
+           cpu_busy,
+           disk_busy,
+           network_busy,
+           std::max(0.0, cpu_busy + disk_busy + network_busy - 100),
+           (it->end.read_bytes - it->start.read_bytes) / kMiB,
+           (it->end.write_bytes - it->start.write_bytes) / kMiB,
+           it->code == kActionCodeSuccess ? bound : "failed");
+  }
+  if (code_ == kActionCodeSuccess)
+    printf("Ready to reboot after %.3f s\n", total_time.InSecondsF());
+  else
+    printf("The update failed with error %d\n", code_);
+  fflush(stdout);
+  return code_;
+}
+
+// Writes an Omaha response offering the payload, named |payload_name| on the
+// server at |codebase|, to |path|. Returns true on success.
+bool WriteOmahaResponse(const string& path,
+                        const string& app_id,
+                        const string& codebase,
+                        const string& payload_name) {
+  OmahaHashCalculator calculator;
+  const off_t size = calculator.UpdateFile(FLAGS_payload, -1);
+  TEST_AND_RETURN_FALSE(size > 0);
+  TEST_AND_RETURN_FALSE(calculator.Finalize());
+  const string response = StringPrintf(
+      "<?xml version=\"1.0\" encoding=\"UTF-8\"?><response protocol=\"3.0\">"
+      "<daystart elapsed_seconds=\"100\"/>"
+      "<app appid=\"%s\" status=\"ok\"><updatecheck status=\"ok\">"
+      "<urls><url codebase=\"%s\"/></urls>"
+      "<manifest version=\"9999.0.0\"><packages>"
+      "<package hash=\"not-used\" name=\"%s\" size=\"%jd\"/></packages>"
+      "<actions><action event=\"postinstall\" sha256=\"%s\"/></actions>"
+      "</manifest></updatecheck></app></response>",
+      app_id.c_str(),
+      codebase.c_str(),
+      payload_name.c_str(),
+      static_cast<intmax_t>(size),
+      calculator.hash().c_str());
+  TEST_AND_RETURN_FALSE(utils::WriteFile(path.c_str(), response.data(),
+                                         response.size()));
+  return true;
+}
+
+// Starts test_http_server serving the files of |files_dir| and waits until
+// it accepts connections. Returns its process ID, or -1 on failure.
+pid_t StartHttpServer(const string& files_dir) {
+  const string files_dir_flag = "--files_dir=" + files_dir;
+  const pid_t pid = fork();
+  if (pid < 0) {
+    PLOG(ERROR) << "fork failed";
+    return -1;
+  }
+  if (pid == 0) {
+    execl(FLAGS_http_server.c_str(), FLAGS_http_server.c_str(),
+          files_dir_flag.c_str(), static_cast<char*>(NULL));
+    PLOG(ERROR) << "Unable to run " << FLAGS_http_server;
+    _exit(1);
+  }
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(kServerPort);
+  for (int attempt = 0; attempt < 100; attempt++) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    PCHECK(fd >= 0);
+    const bool connected =
+        connect(fd, reinterpret_cast<struct sockaddr*>(&addr),
+                sizeof(addr)) == 0;
+    close(fd);
+    if (connected)
+      return pid;
+    int status = 0;
+    if (waitpid(pid, &status, WNOHANG) == pid) {
+      LOG(ERROR) << FLAGS_http_server << " exited with status " << status;
+      return -1;
+    }
+    usleep(100 * 1000);
+  }
+  LOG(ERROR) << FLAGS_http_server << " isn't accepting connections";
+  kill(pid, SIGTERM);
+  HANDLE_EINTR(waitpid(pid, NULL, 0));
+  return -1;
+}
+
+// Runs the update and prints its report. Returns true if the update
+// succeeded.
+bool RunUpdate(BenchmarkSystemState* system_state) {
+  GMainLoop* loop = g_main_loop_new(g_main_context_default(), FALSE);
+  StageRecorder recorder(loop, DiskStatPath(FLAGS_boot_device));
+
+  // The same actions UpdateAttempter::BuildUpdateActions() runs, without
+  // the event requests, which Omaha doesn't answer.
+  OmahaRequestAction update_check_action(system_state,
+                                         NULL,
+                                         new LibcurlHttpFetcher(system_state),
+                                         false);
+  OmahaResponseHandlerAction response_handler_action(system_state);
+  response_handler_action.set_boot_device(FLAGS_boot_device);
+  FilesystemCopierAction filesystem_copier_action(false, false);
+  filesystem_copier_action.set_copy_source(FLAGS_boot_device);
+  filesystem_copier_action.set_hash_only(true);
+  MultiRangeHttpFetcher* multi_range_fetcher =
+      new MultiRangeHttpFetcher(new LibcurlHttpFetcher(system_state));
+  for (int i = 1; i < FLAGS_download_fetchers; i++) {
+    multi_range_fetcher->AddParallelFetcher(
+        new LibcurlHttpFetcher(system_state));
+  }
+  DownloadAction download_action(system_state->prefs(),
+                                 system_state,
+                                 multi_range_fetcher);  // passes ownership
+  download_action.set_delegate(&recorder);
+  recorder.set_download(&response_handler_action, multi_range_fetcher);
+  FilesystemCopierAction filesystem_verifier_action(false, true);
+  PostinstallRunnerAction postinstall_runner_action;
+
+  recorder.AddStage(&update_check_action, "update check");
+  recorder.AddStage(&response_handler_action, "response handling");
+  recorder.AddStage(&filesystem_copier_action, "source hashing");
+  recorder.AddStage(&download_action, "download and apply");
+  recorder.AddStage(&filesystem_verifier_action, "verification");
+  recorder.AddStage(&postinstall_runner_action, "postinstall");
+
+  ActionProcessor processor;
+  processor.set_delegate(&recorder);
+  processor.EnqueueAction(&update_check_action);
+  processor.EnqueueAction(&response_handler_action);
+  processor.EnqueueConcurrentAction(&filesystem_copier_action);
+  processor.EnqueueAction(&download_action);
+  processor.EnqueueAction(&filesystem_verifier_action);
+  if (FLAGS_postinstall)
+    processor.EnqueueAction(&postinstall_runner_action);
+  BondActions(&update_check_action, &response_handler_action);
+  BondActions(&response_handler_action, &filesystem_copier_action);
+  BondActions(&filesystem_copier_action, &download_action);
+  BondActions(&download_action, &filesystem_verifier_action);
+  BondActions(&filesystem_verifier_action, &postinstall_runner_action);
+
+  recorder.Start();
+  processor.StartProcessing();
+  g_main_loop_run(loop);
+  g_main_loop_unref(loop);
+  return recorder.Report() == kActionCodeSuccess;
+}
+
+int Main(int argc, char** argv) {
+  ::g_type_init();
+  base::AtExitManager exit_manager;  // Required for base/rand_util.h.
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  CommandLine::Init(argc, argv);
+  Terminator::Init();
+  Subprocess::Init();
+  logging::InitLogging("update_benchmark.log",
+                       logging::LOG_ONLY_TO_SYSTEM_DEBUG_LOG,
+                       logging::DONT_LOCK_LOG_FILE,
+                       logging::APPEND_TO_OLD_LOG_FILE,
+                       logging::DISABLE_DCHECK_FOR_NON_OFFICIAL_RELEASE_BUILDS);
+  CHECK(!FLAGS_payload.empty()) << "Must pass --payload";
+  CHECK(!FLAGS_boot_device.empty()) << "Must pass --boot_device";
+  CHECK_GE(FLAGS_download_fetchers, 1);
+
+  // The server serves the payload and the Omaha response from a directory
+  // of their own.
+  char payload_path[PATH_MAX];
+  PCHECK(realpath(FLAGS_payload.c_str(), payload_path)) << FLAGS_payload;
+  string files_dir;
+  CHECK(utils::MakeTempDirectory("/tmp/update_benchmark.XXXXXX",
+                                 &files_dir));
+  ScopedDirRemover files_dir_remover(files_dir);
+  const string payload_link = files_dir + "/" + kPayloadName;
+  PCHECK(symlink(payload_path, payload_link.c_str()) == 0);
+  ScopedPathUnlinker payload_link_unlinker(payload_link);
+  const string response_path = files_dir + "/" + kResponseName;
+  ScopedPathUnlinker response_unlinker(response_path);
+  const string server_url =
+      StringPrintf("http://127.0.0.1:%d/shaped-file/", kServerPort);
+  const string payload_name = StringPrintf(
+      "%s/%d/%lld/%lld/%d", kPayloadName, FLAGS_latency_ms,
+      static_cast<long long>(FLAGS_bytes_per_sec),
+      static_cast<long long>(FLAGS_stall_every), FLAGS_stall_ms);
+  BenchmarkSystemState system_state;
+  CHECK(system_state.Initialize(server_url + kResponseName + "/0/0/0/0"));
+  CHECK(WriteOmahaResponse(response_path,
+                           system_state.request_params()->app_id(),
+                           server_url,
+                           payload_name));
+
+  const pid_t server_pid = StartHttpServer(files_dir);
+  CHECK_GT(server_pid, 0);
+  const bool success = RunUpdate(&system_state);
+  kill(server_pid, SIGTERM);
+  HANDLE_EINTR(waitpid(server_pid, NULL, 0));
+  return success ? 0 : 1;
+}
+
+}  // namespace {}
+
+}  // namespace chromeos_update_engine
+
+int main(int argc, char** argv) {
+  return chromeos_update_engine::Main(argc, argv);
+}
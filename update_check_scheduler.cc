@@ -4,6 +4,8 @@
 
 #include "update_engine/update_check_scheduler.h"
 
+#include <algorithm>
+
 #include "update_engine/certificate_checker.h"
 #include "update_engine/http_common.h"
 #include "update_engine/system_state.h"
@@ -18,14 +20,19 @@ const int UpdateCheckScheduler::kTimeoutPeriodicInterval   = 45 * 60;
 const int UpdateCheckScheduler::kTimeoutQuickInterval      =  1 * 60;
 const int UpdateCheckScheduler::kTimeoutMaxBackoffInterval =  4 * 60 * 60;
 const int UpdateCheckScheduler::kTimeoutRegularFuzz        = 10 * 60;
+const int UpdateCheckScheduler::kTimeoutPushPeriodicInterval =  4 * 60 * 60;
+const int UpdateCheckScheduler::kTimeoutPushedFuzz         =  2 * 60;
 
 UpdateCheckScheduler::UpdateCheckScheduler(UpdateAttempter* update_attempter,
                                            SystemState* system_state)
     : update_attempter_(update_attempter),
       enabled_(false),
       scheduled_(false),
+      timeout_id_(0),
       last_interval_(0),
       poll_interval_(0),
+      retry_after_(0),
+      push_active_(false),
       system_state_(system_state) {}
 
 UpdateCheckScheduler::~UpdateCheckScheduler() {}
@@ -77,7 +84,7 @@ void UpdateCheckScheduler::ScheduleCheck(int interval, int fuzz) {
   if (interval < 0) {
     interval = 0;
   }
-  GTimeoutAddSeconds(interval, StaticCheck);
+  timeout_id_ = GTimeoutAddSeconds(interval, StaticCheck);
   scheduled_ = true;
   LOG(INFO) << "Next update check in " << utils::FormatSecs(interval);
 }
@@ -86,6 +93,7 @@ gboolean UpdateCheckScheduler::StaticCheck(void* scheduler) {
   UpdateCheckScheduler* me = reinterpret_cast<UpdateCheckScheduler*>(scheduler);
   CHECK(me->scheduled_);
   me->scheduled_ = false;
+  me->timeout_id_ = 0;
 
   // Before updating, we flush any previously generated UMA reports.
   CertificateChecker::FlushReport();
@@ -131,9 +139,12 @@ void UpdateCheckScheduler::ComputeNextIntervalAndFuzz(const int forced_interval,
 
     // Ensures that under normal conditions the regular update check interval
     // and fuzz are used. Also covers the case where backoff is required based
-    // on the initial update check.
-    if (interval < kTimeoutPeriodicInterval) {
-      interval = kTimeoutPeriodicInterval;
+    // on the initial update check. The releases pushed to the device are
+    // checked for as they come, so the regular checks are then rare.
+    const int periodic_interval =
+        push_active_ ? kTimeoutPushPeriodicInterval : kTimeoutPeriodicInterval;
+    if (interval < periodic_interval) {
+      interval = periodic_interval;
       fuzz = kTimeoutRegularFuzz;
     }
   }
@@ -142,6 +153,19 @@ void UpdateCheckScheduler::ComputeNextIntervalAndFuzz(const int forced_interval,
   if (fuzz == 0)
     fuzz = interval;
 
+  // A server shedding load asks the clients to come back no sooner than
+  // some delay. The checks deferred that way are spread over as long again,
+  // so that they don't all come back at once when the delay is over.
+  if (forced_interval == 0 && retry_after_ > 0) {
+    int min_interval = std::min(retry_after_, kTimeoutMaxBackoffInterval);
+    if (interval - fuzz / 2 < min_interval) {
+      LOG(WARNING) << "Deferring the update check by the server-dictated "
+                   << "retry delay: " << min_interval;
+      interval = min_interval + min_interval / 2;
+      fuzz = min_interval;
+    }
+  }
+
   *next_interval = interval;
   *next_fuzz = fuzz;
 }
@@ -153,6 +177,17 @@ void UpdateCheckScheduler::ScheduleNextCheck(bool is_force_quick) {
   ScheduleCheck(interval, fuzz);
 }
 
+void UpdateCheckScheduler::ReleasePushed() {
+  if (!enabled_ || !scheduled_)
+    return;
+  LOG(INFO) << "A release was pushed, checking for an update sooner.";
+  if (timeout_id_)
+    g_source_remove(timeout_id_);
+  timeout_id_ = 0;
+  scheduled_ = false;
+  ScheduleCheck(kTimeoutPushedFuzz / 2, kTimeoutPushedFuzz);
+}
+
 void UpdateCheckScheduler::SetUpdateStatus(UpdateStatus status,
                                            UpdateNotice notice) {
   // We want to schedule the update checks for when we're idle as well as
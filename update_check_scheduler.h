@@ -34,6 +34,11 @@ namespace chromeos_update_engine {
 // |   v
 // |  ScheduleNextCheck (invoked when UpdateAttempter becomes idle)
 // \---/
+//
+// A ReleaseWatcher may also tell the scheduler that a release is available,
+// which brings the scheduled check forward to within a couple of minutes.
+// While it's connected to the server, the periodic checks are only a safety
+// net and come much less often.
 class UpdateCheckScheduler {
  public:
   static const int kTimeoutInitialInterval;
@@ -41,6 +46,8 @@ class UpdateCheckScheduler {
   static const int kTimeoutQuickInterval;
   static const int kTimeoutRegularFuzz;
   static const int kTimeoutMaxBackoffInterval;
+  static const int kTimeoutPushPeriodicInterval;
+  static const int kTimeoutPushedFuzz;
 
   UpdateCheckScheduler(UpdateAttempter* update_attempter,
                        SystemState* system_state);
@@ -57,16 +64,37 @@ class UpdateCheckScheduler {
   void set_poll_interval(int interval) { poll_interval_ = interval; }
   int poll_interval() const { return poll_interval_; }
 
+  // Sets the delay in seconds the server asked for before the next update
+  // check, with the Retry-After header of its last response, if positive.
+  void set_retry_after(int delay) { retry_after_ = delay; }
+  int retry_after() const { return retry_after_; }
+
+  // Sets whether the server pushes the releases to a ReleaseWatcher, in
+  // which case the periodic checks come every kTimeoutPushPeriodicInterval
+  // seconds rather than every kTimeoutPeriodicInterval.
+  void set_push_active(bool active) { push_active_ = active; }
+  bool push_active() const { return push_active_; }
+
+  // Brings the scheduled update check forward to a random time within the
+  // next kTimeoutPushedFuzz seconds, which spreads the checks of the devices
+  // told about a release at once. Does nothing if no check is scheduled,
+  // i.e. if periodic checks are disabled or an update is in progress.
+  void ReleasePushed();
+
  private:
   friend class UpdateCheckSchedulerTest;
   FRIEND_TEST(UpdateCheckSchedulerTest, CanScheduleTest);
   FRIEND_TEST(UpdateCheckSchedulerTest, ComputeNextIntervalAndFuzzBackoffTest);
   FRIEND_TEST(UpdateCheckSchedulerTest, ComputeNextIntervalAndFuzzPollTest);
   FRIEND_TEST(UpdateCheckSchedulerTest, ComputeNextIntervalAndFuzzPriorityTest);
+  FRIEND_TEST(UpdateCheckSchedulerTest, ComputeNextIntervalAndFuzzPushTest);
+  FRIEND_TEST(UpdateCheckSchedulerTest,
+              ComputeNextIntervalAndFuzzRetryAfterTest);
   FRIEND_TEST(UpdateCheckSchedulerTest, ComputeNextIntervalAndFuzzTest);
   FRIEND_TEST(UpdateCheckSchedulerTest, GTimeoutAddSecondsTest);
   FRIEND_TEST(UpdateCheckSchedulerTest, IsBootDeviceRemovableTest);
   FRIEND_TEST(UpdateCheckSchedulerTest, IsOfficialBuildTest);
+  FRIEND_TEST(UpdateCheckSchedulerTest, ReleasePushedTest);
   FRIEND_TEST(UpdateCheckSchedulerTest, RunBootDeviceRemovableTest);
   FRIEND_TEST(UpdateCheckSchedulerTest, RunNonOfficialBuildTest);
   FRIEND_TEST(UpdateCheckSchedulerTest, RunTest);
@@ -106,8 +134,9 @@ class UpdateCheckScheduler {
 
   // Computes the timeout interval along with its random fuzz range for the next
   // update check by taking into account the last timeout interval as well as
-  // the last update status. A nonzero |forced_interval|, however, will override
-  // all other considerations.
+  // the last update status. The interval is stretched so that the check comes
+  // no sooner than the server's Retry-After delay, if any. A nonzero
+  // |forced_interval|, however, will override all other considerations.
   void ComputeNextIntervalAndFuzz(const int forced_interval,
                                   int* next_interval, int* next_fuzz);
 
@@ -117,8 +146,10 @@ class UpdateCheckScheduler {
   // True if automatic update checks should be scheduled, false otherwise.
   bool enabled_;
 
-  // True if there's an update check scheduled already, false otherwise.
+  // True if there's an update check scheduled already, false otherwise, and
+  // its timeout source.
   bool scheduled_;
+  guint timeout_id_;
 
   // The timeout interval (before fuzzing) for the last update check.
   int last_interval_;
@@ -126,6 +157,13 @@ class UpdateCheckScheduler {
   // Server dictated poll interval in seconds, if positive.
   int poll_interval_;
 
+  // Server dictated minimum delay before the next check in seconds, if
+  // positive.
+  int retry_after_;
+
+  // See set_push_active().
+  bool push_active_;
+
   // The external state of the system outside the update_engine process.
   SystemState* system_state_;
 
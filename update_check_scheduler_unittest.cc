@@ -135,6 +135,54 @@ TEST_F(UpdateCheckSchedulerTest, ComputeNextIntervalAndFuzzPollTest) {
   EXPECT_EQ(UpdateCheckScheduler::kTimeoutRegularFuzz, fuzz);
 }
 
+TEST_F(UpdateCheckSchedulerTest, ComputeNextIntervalAndFuzzPushTest) {
+  int interval, fuzz;
+  scheduler_.set_push_active(true);
+  scheduler_.ComputeNextIntervalAndFuzz(0, &interval, &fuzz);
+  EXPECT_EQ(UpdateCheckScheduler::kTimeoutPushPeriodicInterval, interval);
+  EXPECT_EQ(UpdateCheckScheduler::kTimeoutRegularFuzz, fuzz);
+
+  // A forced interval is kept.
+  scheduler_.ComputeNextIntervalAndFuzz(
+      UpdateCheckScheduler::kTimeoutQuickInterval, &interval, &fuzz);
+  EXPECT_EQ(UpdateCheckScheduler::kTimeoutQuickInterval, interval);
+}
+
+TEST_F(UpdateCheckSchedulerTest, ComputeNextIntervalAndFuzzRetryAfterTest) {
+  int interval, fuzz;
+  // A delay within the regular fuzz leaves the check as it is.
+  scheduler_.set_retry_after(60);
+  scheduler_.ComputeNextIntervalAndFuzz(0, &interval, &fuzz);
+  EXPECT_EQ(UpdateCheckScheduler::kTimeoutPeriodicInterval, interval);
+  EXPECT_EQ(UpdateCheckScheduler::kTimeoutRegularFuzz, fuzz);
+
+  // A longer one defers it past the delay, fuzzed over as long again.
+  int retry_after = UpdateCheckScheduler::kTimeoutPeriodicInterval + 50;
+  scheduler_.set_retry_after(retry_after);
+  scheduler_.ComputeNextIntervalAndFuzz(0, &interval, &fuzz);
+  EXPECT_EQ(retry_after + retry_after / 2, interval);
+  EXPECT_EQ(retry_after, fuzz);
+
+  // The delay takes precedence over a shorter poll interval.
+  scheduler_.set_poll_interval(
+      UpdateCheckScheduler::kTimeoutPeriodicInterval + 10);
+  scheduler_.ComputeNextIntervalAndFuzz(0, &interval, &fuzz);
+  EXPECT_EQ(retry_after + retry_after / 2, interval);
+  EXPECT_EQ(retry_after, fuzz);
+
+  // The delay can't exceed the maximum backoff.
+  retry_after = UpdateCheckScheduler::kTimeoutMaxBackoffInterval;
+  scheduler_.set_retry_after(retry_after + 1);
+  scheduler_.ComputeNextIntervalAndFuzz(0, &interval, &fuzz);
+  EXPECT_EQ(retry_after + retry_after / 2, interval);
+  EXPECT_EQ(retry_after, fuzz);
+
+  // A forced interval isn't deferred.
+  scheduler_.ComputeNextIntervalAndFuzz(
+      UpdateCheckScheduler::kTimeoutQuickInterval, &interval, &fuzz);
+  EXPECT_EQ(UpdateCheckScheduler::kTimeoutQuickInterval, interval);
+}
+
 TEST_F(UpdateCheckSchedulerTest, ComputeNextIntervalAndFuzzPriorityTest) {
   int interval, fuzz;
   attempter_.set_http_response_code(500);
@@ -173,6 +221,25 @@ TEST_F(UpdateCheckSchedulerTest, IsOfficialBuildTest) {
   EXPECT_TRUE(scheduler_.UpdateCheckScheduler::IsOfficialBuild());
 }
 
+TEST_F(UpdateCheckSchedulerTest, ReleasePushedTest) {
+  // Nothing is scheduled while the checks are disabled or one is underway.
+  EXPECT_CALL(scheduler_, GTimeoutAddSeconds(_, _)).Times(0);
+  scheduler_.ReleasePushed();
+  scheduler_.enabled_ = true;
+  scheduler_.ReleasePushed();
+  EXPECT_FALSE(scheduler_.scheduled_);
+
+  // The scheduled check is brought forward.
+  testing::Mock::VerifyAndClearExpectations(&scheduler_);
+  EXPECT_CALL(scheduler_,
+              GTimeoutAddSeconds(
+                  AllOf(Ge(0), Le(UpdateCheckScheduler::kTimeoutPushedFuzz)),
+                  scheduler_.StaticCheck)).Times(1);
+  scheduler_.scheduled_ = true;
+  scheduler_.ReleasePushed();
+  EXPECT_TRUE(scheduler_.scheduled_);
+}
+
 TEST_F(UpdateCheckSchedulerTest, RunBootDeviceRemovableTest) {
   scheduler_.enabled_ = true;
   EXPECT_CALL(scheduler_, IsOfficialBuild()).Times(1).WillOnce(Return(true));
@@ -0,0 +1,229 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/update_duration_estimator.h"
+
+#include <math.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+#include <base/string_number_conversions.h>
+
+#include "update_engine/apply_cost_model.h"
+#include "update_engine/prefs_interface.h"
+#include "update_engine/simple_key_value_store.h"
+
+using base::TimeDelta;
+using base::TimeTicks;
+using std::map;
+using std::max;
+using std::min;
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// How many seconds of measurements a stored or modeled rate is worth. The
+// rates an update reaches take over from the stored ones once it has been
+// measured for much longer than that.
+const double kPriorSeconds = 10.0;
+
+// Bytes per second the new data is assumed to be written at, which
+// ApplyCostModel doesn't count.
+const double kModelWriteRate = 32.0 * 1024 * 1024;
+
+uint64_t BytesInExtents(
+    const google::protobuf::RepeatedPtrField<Extent>& extents,
+    uint64_t block_size) {
+  uint64_t bytes = 0;
+  for (int i = 0; i < extents.size(); i++)
+    bytes += extents.Get(i).num_blocks() * block_size;
+  return bytes;
+}
+
+}  // namespace {}
+
+const char UpdateDurationEstimator::kDownloadRate[] = "download";
+const char UpdateDurationEstimator::kApplyRate[] = "apply";
+
+UpdateDurationEstimator::UpdateDurationEstimator()
+    : initialized_(false),
+      block_size_(0),
+      payload_size_(0),
+      bytes_received_(0),
+      measured_bytes_received_(0) {}
+
+void UpdateDurationEstimator::LoadRates(PrefsInterface* prefs, Rates* rates) {
+  rates->clear();
+  string value;
+  if (!prefs->GetString(kPrefsUpdateRates, &value))
+    return;
+  const map<string, string> entries =
+      simple_key_value_store::ParseString(value);
+  for (map<string, string>::const_iterator it = entries.begin();
+       it != entries.end(); ++it) {
+    int64_t rate = 0;
+    if (base::StringToInt64(it->second, &rate) && rate > 0)
+      (*rates)[it->first] = rate;
+  }
+}
+
+bool UpdateDurationEstimator::SaveRates(PrefsInterface* prefs,
+                                        const Rates& rates) {
+  map<string, string> entries;
+  for (Rates::const_iterator it = rates.begin(); it != rates.end(); ++it) {
+    entries[it->first] =
+        base::Int64ToString(static_cast<int64_t>(it->second + 0.5));
+  }
+  return prefs->SetString(kPrefsUpdateRates,
+                          simple_key_value_store::AssembleString(entries));
+}
+
+int64_t UpdateDurationEstimator::EstimateSeconds(const Rates& rates,
+                                                 uint64_t payload_size,
+                                                 uint64_t apply_bytes) {
+  Rates::const_iterator download_rate = rates.find(kDownloadRate);
+  Rates::const_iterator apply_rate = rates.find(kApplyRate);
+  const double download_seconds = payload_size /
+      (download_rate != rates.end() ? download_rate->second :
+       ApplyCostModel().download_rate);
+  const double apply_seconds = apply_bytes /
+      (apply_rate != rates.end() ? apply_rate->second : kModelWriteRate);
+  return static_cast<int64_t>(ceil(max(download_seconds, apply_seconds)));
+}
+
+void UpdateDurationEstimator::Init(const DeltaArchiveManifest& manifest,
+                                   uint64_t block_size,
+                                   uint64_t payload_size,
+                                   uint64_t bytes_received) {
+  block_size_ = block_size;
+  payload_size_ = payload_size;
+  bytes_received_ = bytes_received;
+  work_.clear();
+  const ApplyCostModel model;
+  map<DeltaArchiveManifest_InstallOperation_Type, double> model_seconds;
+  for (int i = 0; i < 2; i++) {
+    const google::protobuf::RepeatedPtrField<
+        DeltaArchiveManifest_InstallOperation>& operations =
+        i == 0 ? manifest.install_operations() :
+        manifest.kernel_install_operations();
+    for (int j = 0; j < operations.size(); j++) {
+      const DeltaArchiveManifest_InstallOperation& op = operations.Get(j);
+      Work* work = &work_[op.type()];
+      const uint64_t bytes_read = BytesInExtents(op.src_extents(), block_size);
+      const uint64_t bytes_written =
+          BytesInExtents(op.dst_extents(), block_size);
+      work->bytes_read += bytes_read;
+      work->bytes_written += bytes_written;
+      work->bytes_left += bytes_written;
+      // The download is estimated on its own.
+      model_seconds[op.type()] +=
+          model.Cost(op.type(), 0, bytes_read, bytes_written) +
+          bytes_written / kModelWriteRate;
+    }
+  }
+  uint64_t bytes_read = 0, bytes_written = 0;
+  for (WorkMap::iterator it = work_.begin(); it != work_.end(); ++it) {
+    const double seconds = model_seconds[it->first];
+    it->second.model_rate = seconds > 0 && it->second.bytes_written > 0 ?
+        it->second.bytes_written / seconds : kModelWriteRate;
+    bytes_read += it->second.bytes_read;
+    bytes_written += it->second.bytes_written;
+  }
+  initialized_ = true;
+  LOG(INFO) << "The update fetches " << payload_size_ - min(payload_size_,
+                                                            bytes_received_)
+            << " bytes, reads " << bytes_read << " bytes and writes "
+            << bytes_written << " bytes, which is estimated to take "
+            << SecondsLeft() << " seconds";
+}
+
+void UpdateDurationEstimator::BytesReceived(uint64_t count, TimeTicks now) {
+  bytes_received_ += count;
+  // The first bytes only start the clock.
+  if (first_receive_time_.is_null())
+    first_receive_time_ = now;
+  else
+    measured_bytes_received_ += count;
+  last_receive_time_ = now;
+}
+
+void UpdateDurationEstimator::OperationApplied(
+    const DeltaArchiveManifest_InstallOperation& operation,
+    TimeDelta time) {
+  WorkMap::iterator it = work_.find(operation.type());
+  if (it == work_.end())
+    return;
+  const uint64_t bytes = BytesInExtents(operation.dst_extents(), block_size_);
+  it->second.bytes_left -= min(it->second.bytes_left, bytes);
+  if (time > TimeDelta()) {
+    it->second.measured_bytes += bytes;
+    it->second.measured_time += time;
+  }
+}
+
+int64_t UpdateDurationEstimator::SecondsLeft() const {
+  if (!initialized_)
+    return -1;
+  double download_seconds = 0;
+  if (payload_size_ > bytes_received_)
+    download_seconds = (payload_size_ - bytes_received_) / DownloadRate();
+  double apply_seconds = 0;
+  for (WorkMap::const_iterator it = work_.begin(); it != work_.end(); ++it) {
+    if (it->second.bytes_left == 0)
+      continue;
+    apply_seconds += it->second.bytes_left /
+        Rate(DeltaArchiveManifest_InstallOperation_Type_Name(it->first),
+             it->second.model_rate,
+             it->second.measured_bytes,
+             it->second.measured_time);
+  }
+  return static_cast<int64_t>(ceil(max(download_seconds, apply_seconds)));
+}
+
+UpdateDurationEstimator::Rates UpdateDurationEstimator::UpdatedRates() const {
+  Rates rates = stored_rates_;
+  uint64_t measured_bytes = 0;
+  TimeDelta measured_time;
+  for (WorkMap::const_iterator it = work_.begin(); it != work_.end(); ++it) {
+    if (it->second.measured_time <= TimeDelta())
+      continue;
+    const string name =
+        DeltaArchiveManifest_InstallOperation_Type_Name(it->first);
+    rates[name] = Rate(name,
+                       it->second.model_rate,
+                       it->second.measured_bytes,
+                       it->second.measured_time);
+    measured_bytes += it->second.measured_bytes;
+    measured_time += it->second.measured_time;
+  }
+  if (measured_time > TimeDelta())
+    rates[kApplyRate] = Rate(kApplyRate, kModelWriteRate, measured_bytes,
+                             measured_time);
+  if (last_receive_time_ > first_receive_time_)
+    rates[kDownloadRate] = DownloadRate();
+  return rates;
+}
+
+double UpdateDurationEstimator::Rate(const string& name,
+                                     double model_rate,
+                                     uint64_t measured_bytes,
+                                     TimeDelta measured_time) const {
+  Rates::const_iterator stored = stored_rates_.find(name);
+  const double prior_rate = stored != stored_rates_.end() ?
+      stored->second : model_rate;
+  return (prior_rate * kPriorSeconds + measured_bytes) /
+      (kPriorSeconds + measured_time.InSecondsF());
+}
+
+double UpdateDurationEstimator::DownloadRate() const {
+  return Rate(kDownloadRate,
+              ApplyCostModel().download_rate,
+              measured_bytes_received_,
+              last_receive_time_ - first_receive_time_);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,130 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_UPDATE_DURATION_ESTIMATOR_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_UPDATE_DURATION_ESTIMATOR_H__
+
+#include <map>
+#include <string>
+
+#include <base/basictypes.h>
+#include <base/time.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+// Estimates how long an update takes from the work its manifest describes,
+// so that it can be scheduled before it starts: the bytes of the payload to
+// fetch and, for each operation type, the bytes the operations read and
+// write. The work is timed with the rates the device reached in past
+// updates, which are kept in a pref, or without any with the rates of
+// ApplyCostModel. As the update goes on, the rates it reaches itself take
+// over from them. Downloading and applying overlap, so the estimate is
+// whichever of the two is expected to end last.
+
+namespace chromeos_update_engine {
+
+class PrefsInterface;
+
+class UpdateDurationEstimator {
+ public:
+  // Rates in bytes per second, by name: "download" for the download, the
+  // operation type names for the bytes the operations of a type write per
+  // second they take and "apply" for those of all the operations.
+  typedef std::map<std::string, double> Rates;
+
+  // The names of the download and the overall apply rates.
+  static const char kDownloadRate[];
+  static const char kApplyRate[];
+
+  UpdateDurationEstimator();
+
+  // Sets |rates| to the rates stored in |prefs|, if any.
+  static void LoadRates(PrefsInterface* prefs, Rates* rates);
+
+  // Stores |rates| in |prefs|. Returns true on success.
+  static bool SaveRates(PrefsInterface* prefs, const Rates& rates);
+
+  // Returns the estimated seconds an update takes with |rates| that fetches
+  // a |payload_size|-byte payload whose operations write |apply_bytes|
+  // bytes, 0 if unknown, in which case only the download is counted. For
+  // choosing between payloads before any of their manifests is at hand.
+  static int64_t EstimateSeconds(const Rates& rates,
+                                 uint64_t payload_size,
+                                 uint64_t apply_bytes);
+
+  // Sets the rates of past updates, see LoadRates().
+  void set_stored_rates(const Rates& rates) { stored_rates_ = rates; }
+
+  // Sets the work of the update from |manifest|, whose operations write
+  // |block_size|-byte blocks, of a |payload_size|-byte payload, 0 if
+  // unknown, of which |bytes_received| are already received.
+  void Init(const DeltaArchiveManifest& manifest,
+            uint64_t block_size,
+            uint64_t payload_size,
+            uint64_t bytes_received);
+
+  // Records that |count| bytes of the payload were received at |now|.
+  void BytesReceived(uint64_t count, base::TimeTicks now);
+
+  // Records that |operation| was applied in |time|, which is zero for the
+  // operations applied by an earlier attempt.
+  void OperationApplied(const DeltaArchiveManifest_InstallOperation& operation,
+                        base::TimeDelta time);
+
+  // Returns the estimated seconds left, or -1 before Init().
+  int64_t SecondsLeft() const;
+
+  // Returns the stored rates updated with the rates this update reached, to
+  // be stored for the next one.
+  Rates UpdatedRates() const;
+
+ private:
+  // The work of the operations of a type.
+  struct Work {
+    Work() : bytes_read(0), bytes_written(0), bytes_left(0),
+             model_rate(0), measured_bytes(0) {}
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    // The bytes the operations not yet applied write.
+    uint64_t bytes_left;
+    // The rate ApplyCostModel gives the operations.
+    double model_rate;
+    // The bytes the operations applied by this attempt wrote and the time
+    // they took.
+    uint64_t measured_bytes;
+    base::TimeDelta measured_time;
+  };
+
+  typedef std::map<DeltaArchiveManifest_InstallOperation_Type, Work> WorkMap;
+
+  // Returns the rate |name| was stored with, or |model_rate| if there's
+  // none, updated with |measured_bytes| done in |measured_time|.
+  double Rate(const std::string& name,
+              double model_rate,
+              uint64_t measured_bytes,
+              base::TimeDelta measured_time) const;
+
+  // Returns the estimated rate of the download.
+  double DownloadRate() const;
+
+  Rates stored_rates_;
+
+  bool initialized_;
+  uint64_t block_size_;
+  WorkMap work_;
+  uint64_t payload_size_;
+  uint64_t bytes_received_;
+
+  // The bytes this attempt received, from when the first to when the last
+  // of them came.
+  uint64_t measured_bytes_received_;
+  base::TimeTicks first_receive_time_;
+  base::TimeTicks last_receive_time_;
+
+  DISALLOW_COPY_AND_ASSIGN(UpdateDurationEstimator);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_UPDATE_DURATION_ESTIMATOR_H__
@@ -0,0 +1,156 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <string>
+
+#include <base/file_path.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/prefs.h"
+#include "update_engine/test_utils.h"
+#include "update_engine/update_duration_estimator.h"
+#include "update_engine/utils.h"
+
+using base::TimeDelta;
+using base::TimeTicks;
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+const uint64_t kBlockSize = 4096;
+const double kMiB = 1024 * 1024;
+
+// Adds an operation of |type| to |manifest| that reads |src_blocks| and
+// writes |dst_blocks| blocks.
+DeltaArchiveManifest_InstallOperation* AddOperation(
+    DeltaArchiveManifest* manifest,
+    DeltaArchiveManifest_InstallOperation_Type type,
+    uint64_t src_blocks,
+    uint64_t dst_blocks) {
+  DeltaArchiveManifest_InstallOperation* op =
+      manifest->add_install_operations();
+  op->set_type(type);
+  if (src_blocks > 0) {
+    Extent* extent = op->add_src_extents();
+    extent->set_start_block(0);
+    extent->set_num_blocks(src_blocks);
+  }
+  Extent* extent = op->add_dst_extents();
+  extent->set_start_block(0);
+  extent->set_num_blocks(dst_blocks);
+  return op;
+}
+
+// The rates of a device that downloads and replaces 1 MiB/s and moves
+// 2 MiB/s.
+UpdateDurationEstimator::Rates StoredRates() {
+  UpdateDurationEstimator::Rates rates;
+  rates[UpdateDurationEstimator::kDownloadRate] = kMiB;
+  rates["REPLACE"] = kMiB;
+  rates["MOVE"] = 2 * kMiB;
+  return rates;
+}
+
+}  // namespace {}
+
+TEST(UpdateDurationEstimatorTest, NotInitializedTest) {
+  UpdateDurationEstimator estimator;
+  EXPECT_EQ(-1, estimator.SecondsLeft());
+  EXPECT_TRUE(estimator.UpdatedRates().empty());
+}
+
+TEST(UpdateDurationEstimatorTest, ModelEstimateTest) {
+  DeltaArchiveManifest manifest;
+  AddOperation(&manifest, DeltaArchiveManifest_InstallOperation_Type_REPLACE,
+               0, 256);
+  UpdateDurationEstimator estimator;
+  estimator.Init(manifest, kBlockSize, 4 * kMiB, 0);
+  EXPECT_GT(estimator.SecondsLeft(), 0);
+}
+
+TEST(UpdateDurationEstimatorTest, StoredRatesTest) {
+  DeltaArchiveManifest manifest;
+  DeltaArchiveManifest_InstallOperation* replace = AddOperation(
+      &manifest, DeltaArchiveManifest_InstallOperation_Type_REPLACE, 0, 256);
+  AddOperation(&manifest, DeltaArchiveManifest_InstallOperation_Type_MOVE,
+               256, 256);
+  UpdateDurationEstimator estimator;
+  estimator.set_stored_rates(StoredRates());
+  estimator.Init(manifest, kBlockSize, 4 * kMiB, 0);
+  // The 4 MiB download takes longer than the 1.5 seconds of applying.
+  EXPECT_EQ(4, estimator.SecondsLeft());
+
+  // The first bytes only start the clock of the download rate.
+  estimator.BytesReceived(4 * kMiB, TimeTicks::Now());
+  EXPECT_EQ(2, estimator.SecondsLeft());
+
+  // Operations applied by an earlier attempt aren't timed.
+  estimator.OperationApplied(*replace, TimeDelta());
+  EXPECT_EQ(1, estimator.SecondsLeft());
+  EXPECT_EQ(StoredRates(), estimator.UpdatedRates());
+}
+
+TEST(UpdateDurationEstimatorTest, MeasuredRatesTest) {
+  DeltaArchiveManifest manifest;
+  DeltaArchiveManifest_InstallOperation* replace = AddOperation(
+      &manifest, DeltaArchiveManifest_InstallOperation_Type_REPLACE, 0, 512);
+  UpdateDurationEstimator estimator;
+  estimator.set_stored_rates(StoredRates());
+  estimator.Init(manifest, kBlockSize, 0, 0);
+  const TimeTicks start = TimeTicks::Now();
+  estimator.BytesReceived(kMiB, start);
+  estimator.BytesReceived(12 * kMiB, start + TimeDelta::FromSeconds(2));
+
+  // Half the work, 1 MiB, in 10 seconds halves the rate after 10 seconds of
+  // the stored one.
+  DeltaArchiveManifest_InstallOperation half = *replace;
+  half.mutable_dst_extents(0)->set_num_blocks(256);
+  estimator.OperationApplied(half, TimeDelta::FromSeconds(10));
+  // The other 1 MiB at 0.55 MiB/s.
+  EXPECT_EQ(2, estimator.SecondsLeft());
+
+  UpdateDurationEstimator::Rates rates = estimator.UpdatedRates();
+  EXPECT_DOUBLE_EQ(0.55 * kMiB, rates["REPLACE"]);
+  EXPECT_DOUBLE_EQ(22 * kMiB / 12,
+                   rates[UpdateDurationEstimator::kDownloadRate]);
+  EXPECT_DOUBLE_EQ(2 * kMiB, rates["MOVE"]);
+  // All the operations together, from the 32 MiB/s of the model.
+  EXPECT_DOUBLE_EQ((32 * kMiB * 10 + kMiB) / 20,
+                   rates[UpdateDurationEstimator::kApplyRate]);
+}
+
+TEST(UpdateDurationEstimatorTest, EstimateSecondsTest) {
+  UpdateDurationEstimator::Rates rates = StoredRates();
+  rates[UpdateDurationEstimator::kApplyRate] = 2 * kMiB;
+  // Whichever of the download and applying takes longer.
+  EXPECT_EQ(4, UpdateDurationEstimator::EstimateSeconds(rates, 4 * kMiB,
+                                                        6 * kMiB));
+  EXPECT_EQ(5, UpdateDurationEstimator::EstimateSeconds(rates, 4 * kMiB,
+                                                        10 * kMiB));
+  EXPECT_EQ(3, UpdateDurationEstimator::EstimateSeconds(rates, 3 * kMiB, 0));
+  // Without rates, those of the model.
+  EXPECT_GT(UpdateDurationEstimator::EstimateSeconds(
+      UpdateDurationEstimator::Rates(), 4 * kMiB, 0), 0);
+}
+
+TEST(UpdateDurationEstimatorTest, SaveLoadRatesTest) {
+  string prefs_dir;
+  ASSERT_TRUE(utils::MakeTempDirectory("/tmp/ue_ut_prefs.XXXXXX",
+                                       &prefs_dir));
+  ScopedDirRemover prefs_dir_remover(prefs_dir);
+  Prefs prefs;
+  ASSERT_TRUE(prefs.Init(FilePath(prefs_dir)));
+
+  UpdateDurationEstimator::Rates rates;
+  UpdateDurationEstimator::LoadRates(&prefs, &rates);
+  EXPECT_TRUE(rates.empty());
+
+  EXPECT_TRUE(UpdateDurationEstimator::SaveRates(&prefs, StoredRates()));
+  UpdateDurationEstimator::LoadRates(&prefs, &rates);
+  EXPECT_EQ(StoredRates(), rates);
+}
+
+}  // namespace chromeos_update_engine
@@ -24,7 +24,15 @@ using chromeos_update_engine::utils::GetAndFreeGError;
 using std::string;
 
 DEFINE_bool(check_for_update, false, "Initiate check for updates.");
+DEFINE_int64(download_rate_limit, -1,
+             "Cap the rate of the update downloads at this many bytes per "
+             "second, or lift the cap if 0.");
+DEFINE_bool(eta, false,
+            "Print the estimated seconds left until the update is applied, "
+            "or -1 if unknown, to stdout.");
 DEFINE_bool(status, false, "Print the status to stdout.");
+DEFINE_bool(performance_counters, false,
+            "Print the performance counters of the updates to stdout.");
 DEFINE_bool(reset_status, false, "Sets the status in update_engine to idle.");
 DEFINE_bool(update, false, "Forces an update and waits for its completion. "
             "Exit status is 0 if the update succeeded, and 1 otherwise.");
@@ -208,6 +216,64 @@ void CompleteUpdate() {
 
 }  // namespace {}
 
+bool GetPerformanceCounters() {
+  DBusGProxy* proxy;
+  GError* error = NULL;
+
+  CHECK(GetProxy(&proxy));
+
+  char* counters = NULL;
+  gboolean rc = com_coreos_update1_Manager_get_performance_counters(
+      proxy,
+      &counters,
+      &error);
+  if (rc == FALSE) {
+    LOG(ERROR) << "Error getting performance counters: "
+               << GetAndFreeGError(&error);
+    return false;
+  }
+  printf("%s", counters);
+  g_free(counters);
+  return true;
+}
+
+bool GetUpdateEta() {
+  DBusGProxy* proxy;
+  GError* error = NULL;
+
+  CHECK(GetProxy(&proxy));
+
+  gint64 eta_seconds = -1;
+  gboolean rc = com_coreos_update1_Manager_get_update_eta(proxy,
+                                                         &eta_seconds,
+                                                         &error);
+  if (rc == FALSE) {
+    LOG(ERROR) << "Error getting the update ETA: "
+               << GetAndFreeGError(&error);
+    return false;
+  }
+  printf("%" G_GINT64_FORMAT "\n", eta_seconds);
+  return true;
+}
+
+bool SetDownloadRateLimit(int64_t bytes_per_second) {
+  DBusGProxy* proxy;
+  GError* error = NULL;
+
+  CHECK(GetProxy(&proxy));
+
+  gboolean rc = com_coreos_update1_Manager_set_download_rate_limit(
+      proxy,
+      bytes_per_second,
+      &error);
+  if (rc == FALSE) {
+    LOG(ERROR) << "Error setting the download rate limit: "
+               << GetAndFreeGError(&error);
+    return false;
+  }
+  return true;
+}
+
 int main(int argc, char** argv) {
   // Boilerplate init commands.
   // FIXME: g_type_init is deprecated, remove once updated to glib >= 3.36
@@ -240,6 +306,34 @@ int main(int argc, char** argv) {
     return 0;
   }
 
+  if (FLAGS_eta) {
+    LOG(INFO) << "Querying the update ETA...";
+    if (!GetUpdateEta()) {
+      LOG(ERROR) << "GetUpdateEta failed.";
+      return 1;
+    }
+    return 0;
+  }
+
+  if (FLAGS_performance_counters) {
+    LOG(INFO) << "Querying Update Engine performance counters...";
+    if (!GetPerformanceCounters()) {
+      LOG(ERROR) << "GetPerformanceCounters failed.";
+      return 1;
+    }
+    return 0;
+  }
+
+  if (FLAGS_download_rate_limit >= 0) {
+    LOG(INFO) << "Setting the download rate limit to "
+              << FLAGS_download_rate_limit << " bytes/s...";
+    if (!SetDownloadRateLimit(FLAGS_download_rate_limit)) {
+      LOG(ERROR) << "SetDownloadRateLimit failed.";
+      return 1;
+    }
+    return 0;
+  }
+
   // Initiate an update check, if necessary.
   if (FLAGS_check_for_update || FLAGS_update) {
     LOG(INFO) << "Initiating update check and install.";
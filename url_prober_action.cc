@@ -0,0 +1,222 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/url_prober_action.h"
+
+#include <base/logging.h>
+
+#include "update_engine/certificate_checker.h"
+#include "update_engine/libcurl_http_fetcher.h"
+#include "update_engine/payload_state_interface.h"
+
+using base::TimeDelta;
+using base::TimeTicks;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+const size_t UrlProberAction::kProbeSize = 64 * 1024;
+const int UrlProberAction::kProbeTimeoutSeconds = 10;
+
+namespace {
+// The current URL is kept unless it took this many times as long as the
+// fastest one, and longer by at least kMinProbeGainMs. The earlier URLs of
+// a response are preferred, e.g., because they're closer, so a URL that's
+// only a little faster isn't worth switching to.
+const int kSwitchFactor = 2;
+const int kMinProbeGainMs = 100;
+}  // namespace {}
+
+UrlProberAction::UrlProberAction(SystemState* system_state)
+    : system_state_(system_state),
+      num_running_(0),
+      timeout_id_(0),
+      stopping_(false),
+      transfer_stats_(TransferStats::Get()) {}
+
+UrlProberAction::~UrlProberAction() {
+  if (timeout_id_)
+    g_source_remove(timeout_id_);
+  for (vector<Probe>::iterator it = probes_.begin(); it != probes_.end();
+       ++it) {
+    delete it->fetcher;
+  }
+}
+
+HttpFetcher* UrlProberAction::NewFetcher() {
+  LibcurlHttpFetcher* fetcher = new LibcurlHttpFetcher(system_state_);
+  fetcher->set_check_certificate(CertificateChecker::kDownload);
+  return fetcher;
+}
+
+void UrlProberAction::PerformAction() {
+  CHECK(HasInputObject());
+  const OmahaResponse& response = GetInputObject();
+  if (HasOutputPipe())
+    SetOutputObject(response);
+  if (!response.update_exists || response.payload_urls.size() < 2) {
+    processor_->ActionComplete(this, kActionCodeSuccess);
+    return;
+  }
+
+  LOG(INFO) << "Probing " << response.payload_urls.size() << " payload URLs";
+  for (size_t i = 0; i < response.payload_urls.size(); i++) {
+    Probe probe;
+    probe.fetcher = NewFetcher();
+    probe.bytes_received = 0;
+    probe.done = false;
+    probe.succeeded = false;
+    probe.fetcher->set_delegate(this);
+    probes_.push_back(probe);
+  }
+  // All the probes are accounted for before any is started, since a probe
+  // may end as soon as it starts.
+  num_running_ = probes_.size();
+  start_time_ = TimeTicks::Now();
+  timeout_id_ = g_timeout_add_seconds(kProbeTimeoutSeconds, StaticTimeout,
+                                      this);
+  for (size_t i = 0; i < probes_.size(); i++) {
+    HttpFetcher* fetcher = probes_[i].fetcher;
+    fetcher->SetOffset(0);
+    fetcher->SetLength(kProbeSize);
+    fetcher->BeginTransfer(response.payload_urls[i]);
+  }
+}
+
+void UrlProberAction::TerminateProcessing() {
+  stopping_ = true;
+  if (timeout_id_) {
+    g_source_remove(timeout_id_);
+    timeout_id_ = 0;
+  }
+  for (size_t i = 0; i < probes_.size(); i++) {
+    if (!probes_[i].done)
+      probes_[i].fetcher->TerminateTransfer();
+  }
+}
+
+void UrlProberAction::ReceivedBytes(HttpFetcher* fetcher,
+                                    const char* bytes,
+                                    int length) {
+  for (size_t i = 0; i < probes_.size(); i++) {
+    Probe* probe = &probes_[i];
+    if (probe->fetcher != fetcher || probe->done)
+      continue;
+    probe->bytes_received += length;
+    // The server may not honor the range, so the probe is stopped rather
+    // than left to fetch the whole payload.
+    if (probe->bytes_received >= kProbeSize)
+      fetcher->TerminateTransfer();
+    return;
+  }
+}
+
+void UrlProberAction::TransferComplete(HttpFetcher* fetcher,
+                                       bool successful) {
+  // A payload smaller than the probe is fetched whole.
+  for (size_t i = 0; i < probes_.size(); i++) {
+    if (probes_[i].fetcher == fetcher) {
+      EndProbe(fetcher, successful && probes_[i].bytes_received > 0);
+      return;
+    }
+  }
+}
+
+void UrlProberAction::TransferTerminated(HttpFetcher* fetcher) {
+  for (size_t i = 0; i < probes_.size(); i++) {
+    if (probes_[i].fetcher == fetcher) {
+      EndProbe(fetcher, probes_[i].bytes_received >= kProbeSize);
+      return;
+    }
+  }
+}
+
+void UrlProberAction::EndProbe(HttpFetcher* fetcher, bool succeeded) {
+  for (size_t i = 0; i < probes_.size(); i++) {
+    Probe* probe = &probes_[i];
+    if (probe->fetcher != fetcher || probe->done)
+      continue;
+    probe->done = true;
+    probe->succeeded = succeeded;
+    probe->duration = TimeTicks::Now() - start_time_;
+    LOG(INFO) << "Probe of Url" << i << (succeeded ? " took " : " failed in ")
+              << probe->duration.InMilliseconds() << " ms";
+    CHECK_GT(num_running_, 0U);
+    num_running_--;
+    if (num_running_ == 0 && !stopping_)
+      Finish();
+    return;
+  }
+}
+
+void UrlProberAction::Finish() {
+  if (timeout_id_) {
+    g_source_remove(timeout_id_);
+    timeout_id_ = 0;
+  }
+
+  size_t fastest = probes_.size();
+  for (size_t i = 0; i < probes_.size(); i++) {
+    if (probes_[i].succeeded &&
+        (fastest == probes_.size() ||
+         probes_[i].duration < probes_[fastest].duration)) {
+      fastest = i;
+    }
+  }
+  PayloadStateInterface* payload_state = system_state_->payload_state();
+  const size_t current = payload_state->GetUrlIndex();
+  if (fastest == probes_.size() && current < probes_.size()) {
+    SelectUrlByHistory(current);
+    processor_->ActionComplete(this, kActionCodeSuccess);
+    return;
+  }
+  if (fastest < probes_.size() && current < probes_.size() &&
+      fastest != current) {
+    const Probe& current_probe = probes_[current];
+    const TimeDelta gain = current_probe.duration - probes_[fastest].duration;
+    if (!current_probe.succeeded ||
+        (current_probe.duration > probes_[fastest].duration * kSwitchFactor &&
+         gain.InMilliseconds() >= kMinProbeGainMs)) {
+      LOG(INFO) << "Switching from Url" << current << " to the faster Url"
+                << fastest;
+      payload_state->SelectUrl(fastest);
+    }
+  }
+  processor_->ActionComplete(this, kActionCodeSuccess);
+}
+
+void UrlProberAction::SelectUrlByHistory(size_t current) {
+  const vector<string>& urls = GetInputObject().payload_urls;
+  vector<uint64_t> throughputs(urls.size(), 0);
+  size_t fastest = urls.size();
+  for (size_t i = 0; i < urls.size(); i++) {
+    if (!transfer_stats_->GetUrlThroughput(urls[i], &throughputs[i]) &&
+        !transfer_stats_->GetHostThroughput(urls[i], &throughputs[i]))
+      continue;
+    if (fastest == urls.size() || throughputs[i] > throughputs[fastest])
+      fastest = i;
+  }
+  if (fastest == urls.size() || fastest == current ||
+      throughputs[fastest] <= throughputs[current] * kSwitchFactor)
+    return;
+  LOG(INFO) << "No probe succeeded; switching from Url" << current
+            << " to Url" << fastest << ", which was faster lately";
+  system_state_->payload_state()->SelectUrl(fastest);
+}
+
+gboolean UrlProberAction::StaticTimeout(gpointer data) {
+  UrlProberAction* me = reinterpret_cast<UrlProberAction*>(data);
+  me->timeout_id_ = 0;
+  LOG(WARNING) << "Giving up on the " << me->num_running_
+               << " probes still running";
+  // Ending the last probe completes the action.
+  for (size_t i = 0; i < me->probes_.size(); i++) {
+    if (!me->probes_[i].done)
+      me->probes_[i].fetcher->TerminateTransfer();
+  }
+  return FALSE;  // Don't run again.
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,131 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_URL_PROBER_ACTION_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_URL_PROBER_ACTION_H__
+
+#include <string>
+#include <vector>
+
+#include <base/time.h>
+#include <glib.h>
+
+#include "update_engine/action.h"
+#include "update_engine/http_fetcher.h"
+#include "update_engine/omaha_request_action.h"
+#include "update_engine/system_state.h"
+#include "update_engine/transfer_stats.h"
+
+// UrlProberAction races the payload URLs of an Omaha response before the
+// download starts. It fetches the first few bytes of the payload from each
+// of them at once, and makes the payload state use the one that's done
+// first if the current one is much slower or doesn't work. The response is
+// passed through unchanged, and the action always succeeds: probing is only
+// a hint.
+
+namespace chromeos_update_engine {
+
+class UrlProberAction;
+
+template<>
+class ActionTraits<UrlProberAction> {
+ public:
+  typedef OmahaResponse InputObjectType;
+  typedef OmahaResponse OutputObjectType;
+};
+
+class UrlProberAction : public Action<UrlProberAction>,
+                        public HttpFetcherDelegate {
+ public:
+  // The number of bytes fetched from each URL.
+  static const size_t kProbeSize;
+
+  // How long the probes may take in all, in seconds. The URLs that haven't
+  // been probed by then are taken as not working.
+  static const int kProbeTimeoutSeconds;
+
+  explicit UrlProberAction(SystemState* system_state);
+  virtual ~UrlProberAction();
+  typedef ActionTraits<UrlProberAction>::InputObjectType InputObjectType;
+  typedef ActionTraits<UrlProberAction>::OutputObjectType OutputObjectType;
+  void PerformAction();
+  void TerminateProcessing();
+
+  // Sets the statistics the URLs are compared by when no probe succeeds.
+  // TransferStats::Get() by default.
+  void set_transfer_stats(TransferStats* transfer_stats) {
+    transfer_stats_ = transfer_stats;
+  }
+
+  // Debugging/logging
+  static std::string StaticType() { return "UrlProberAction"; }
+  std::string Type() const { return StaticType(); }
+
+  // HttpFetcherDelegate methods.
+  virtual void ReceivedBytes(HttpFetcher* fetcher,
+                             const char* bytes,
+                             int length);
+  virtual void TransferComplete(HttpFetcher* fetcher, bool successful);
+  virtual void TransferTerminated(HttpFetcher* fetcher);
+
+ protected:
+  // Returns a new fetcher for a probe. Virtual so that it can be mocked in
+  // tests.
+  virtual HttpFetcher* NewFetcher();
+
+ private:
+  struct Probe {
+    HttpFetcher* fetcher;
+    size_t bytes_received;
+    // True once the probe is over, and if it fetched the bytes.
+    bool done;
+    bool succeeded;
+    // How long the probe took, if it succeeded.
+    base::TimeDelta duration;
+  };
+
+  // Ends the probe that |fetcher| runs, whether it |succeeded| or not, and
+  // completes the action if it was the last one.
+  void EndProbe(HttpFetcher* fetcher, bool succeeded);
+
+  // Selects the URL to download from, based on the probes, and completes
+  // the action.
+  void Finish();
+
+  // Selects the URL that was much faster than the |current| one in the
+  // recent transfers, if any, when no probe succeeded.
+  void SelectUrlByHistory(size_t current);
+
+  // GLib timeout source callback, which gives up on the probes that are
+  // still running.
+  static gboolean StaticTimeout(gpointer data);
+
+  // Global system context.
+  SystemState* system_state_;
+
+  // The probes, one per payload URL, in the order of the URLs.
+  std::vector<Probe> probes_;
+
+  // The number of probes that aren't done.
+  size_t num_running_;
+
+  // When the probes started.
+  base::TimeTicks start_time_;
+
+  // The source of the probe timeout, or 0.
+  guint timeout_id_;
+
+  // True while the probes are being stopped, when they're no longer
+  // accounted for.
+  bool stopping_;
+
+  // The throughput of the recent transfers.
+  TransferStats* transfer_stats_;
+
+  DISALLOW_COPY_AND_ASSIGN(UrlProberAction);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_URL_PROBER_ACTION_H__
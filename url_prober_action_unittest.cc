@@ -0,0 +1,168 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <string>
+#include <vector>
+
+#include <glib.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/action_processor.h"
+#include "update_engine/mock_http_fetcher.h"
+#include "update_engine/mock_system_state.h"
+#include "update_engine/test_utils.h"
+#include "update_engine/url_prober_action.h"
+
+using std::string;
+using std::vector;
+using testing::_;
+using testing::Return;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// A prober that probes with the mock fetchers it's given, in order.
+class TestUrlProberAction : public UrlProberAction {
+ public:
+  explicit TestUrlProberAction(SystemState* system_state)
+      : UrlProberAction(system_state) {}
+
+  void AddFetcher(HttpFetcher* fetcher) { fetchers_.push_back(fetcher); }
+  size_t num_fetchers() const { return fetchers_.size(); }
+
+ protected:
+  virtual HttpFetcher* NewFetcher() {
+    CHECK(!fetchers_.empty());
+    HttpFetcher* fetcher = fetchers_.front();
+    fetchers_.erase(fetchers_.begin());
+    return fetcher;
+  }
+
+ private:
+  vector<HttpFetcher*> fetchers_;
+};
+
+class UrlProberActionTestDelegate : public ActionProcessorDelegate {
+ public:
+  explicit UrlProberActionTestDelegate(GMainLoop* loop) : loop_(loop) {}
+  virtual void ProcessingDone(const ActionProcessor* processor,
+                              ActionExitCode code) {
+    g_main_loop_quit(loop_);
+  }
+
+ private:
+  GMainLoop* loop_;
+};
+
+gboolean StartProcessorInRunLoop(gpointer data) {
+  reinterpret_cast<ActionProcessor*>(data)->StartProcessing();
+  return FALSE;
+}
+
+}  // namespace {}
+
+class UrlProberActionTest : public ::testing::Test {
+ protected:
+  UrlProberActionTest() : prober_(&mock_system_state_) {
+    response_.update_exists = true;
+    response_.payload_urls.push_back("http://url0/payload");
+    response_.payload_urls.push_back("http://url1/payload");
+    prober_.set_transfer_stats(&transfer_stats_);
+  }
+
+  // Records a past transfer of |bytes| bytes in a second from |url|.
+  void AddTransfer(const string& url, uint64_t bytes) {
+    TransferTiming timing;
+    timing.total_seconds = 1;
+    timing.bytes = bytes;
+    transfer_stats_.AddTransfer(url, timing);
+  }
+
+  // Adds a mock fetcher that serves |size| bytes, or fails if |size| is 0.
+  void AddFetcher(size_t size) {
+    vector<char> data(size, 'x');
+    MockHttpFetcher* fetcher = new MockHttpFetcher(size ? &data[0] : NULL,
+                                                   size);
+    if (size == 0)
+      fetcher->FailTransfer(404);
+    prober_.AddFetcher(fetcher);
+  }
+
+  // Runs the prober on |response_| and checks that it's passed through.
+  void Run() {
+    GMainLoop* loop = g_main_loop_new(g_main_context_default(), FALSE);
+    ObjectFeederAction<OmahaResponse> feeder;
+    feeder.set_obj(response_);
+    ObjectCollectorAction<OmahaResponse> collector;
+    BondActions(&feeder, &prober_);
+    BondActions(&prober_, &collector);
+    ActionProcessor processor;
+    UrlProberActionTestDelegate delegate(loop);
+    processor.set_delegate(&delegate);
+    processor.EnqueueAction(&feeder);
+    processor.EnqueueAction(&prober_);
+    processor.EnqueueAction(&collector);
+    g_timeout_add(0, &StartProcessorInRunLoop, &processor);
+    g_main_loop_run(loop);
+    g_main_loop_unref(loop);
+    EXPECT_EQ(response_.payload_urls, collector.object().payload_urls);
+  }
+
+  MockSystemState mock_system_state_;
+  TransferStats transfer_stats_;
+  TestUrlProberAction prober_;
+  OmahaResponse response_;
+};
+
+TEST_F(UrlProberActionTest, SingleUrlTest) {
+  response_.payload_urls.resize(1);
+  EXPECT_CALL(*mock_system_state_.mock_payload_state(), SelectUrl(_))
+      .Times(0);
+  Run();
+}
+
+TEST_F(UrlProberActionTest, KeepUrlTest) {
+  AddFetcher(UrlProberAction::kProbeSize);
+  AddFetcher(UrlProberAction::kProbeSize);
+  EXPECT_CALL(*mock_system_state_.mock_payload_state(), GetUrlIndex())
+      .WillRepeatedly(Return(0));
+  EXPECT_CALL(*mock_system_state_.mock_payload_state(), SelectUrl(_))
+      .Times(0);
+  Run();
+  EXPECT_EQ(0U, prober_.num_fetchers());
+}
+
+TEST_F(UrlProberActionTest, FailedUrlTest) {
+  AddFetcher(0);
+  // More than the probe is served, as if the range were ignored.
+  AddFetcher(UrlProberAction::kProbeSize * 4);
+  EXPECT_CALL(*mock_system_state_.mock_payload_state(), GetUrlIndex())
+      .WillRepeatedly(Return(0));
+  EXPECT_CALL(*mock_system_state_.mock_payload_state(), SelectUrl(1));
+  Run();
+}
+
+TEST_F(UrlProberActionTest, AllUrlsFailedTest) {
+  AddFetcher(0);
+  AddFetcher(0);
+  EXPECT_CALL(*mock_system_state_.mock_payload_state(), SelectUrl(_))
+      .Times(0);
+  Run();
+}
+
+TEST_F(UrlProberActionTest, AllUrlsFailedHistoryTest) {
+  AddFetcher(0);
+  AddFetcher(0);
+  AddTransfer("http://url0/payload", 100 * 1024);
+  // Only the host of the second URL has been seen, and was much faster.
+  AddTransfer("http://url1/other_payload", 1024 * 1024);
+  EXPECT_CALL(*mock_system_state_.mock_payload_state(), GetUrlIndex())
+      .WillRepeatedly(Return(0));
+  EXPECT_CALL(*mock_system_state_.mock_payload_state(), SelectUrl(1));
+  Run();
+}
+
+}  // namespace chromeos_update_engine
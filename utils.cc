@@ -4,8 +4,10 @@
 
 #include "update_engine/utils.h"
 
+#include <sys/file.h>
 #include <sys/mount.h>
 #include <sys/resource.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -31,6 +33,8 @@
 #include <google/protobuf/stubs/common.h>
 
 #include "update_engine/file_writer.h"
+#include "update_engine/io_recorder.h"
+#include "update_engine/io_stats.h"
 #include "update_engine/omaha_request_params.h"
 #include "update_engine/subprocess.h"
 #include "update_engine/system_state.h"
@@ -133,13 +137,17 @@ bool WriteAll(int fd, const void* buf, size_t count) {
 }
 
 bool PWriteAll(int fd, const void* buf, size_t count, off_t offset) {
+  IoRecorder::RecordWrite(fd, offset, count);
   const char* c_buf = static_cast<const char*>(buf);
   size_t bytes_written = 0;
   int num_attempts = 0;
   while (bytes_written < count) {
     num_attempts++;
+    const base::TimeTicks start_time = base::TimeTicks::Now();
     ssize_t rc = pwrite(fd, c_buf + bytes_written, count - bytes_written,
                         offset + bytes_written);
+    IoStats::AddCalls(IoStats::kPwrite, 1, rc > 0 ? rc : 0,
+                      base::TimeTicks::Now() - start_time);
     // TODO(garnold) for debugging failure in chromium-os:31077; to be removed.
     if (rc < 0) {
       PLOG(ERROR) << "pwrite error; num_attempts=" << num_attempts
@@ -154,11 +162,15 @@ bool PWriteAll(int fd, const void* buf, size_t count, off_t offset) {
 
 bool PReadAll(int fd, void* buf, size_t count, off_t offset,
               ssize_t* out_bytes_read) {
+  IoRecorder::RecordRead(fd, offset, count);
   char* c_buf = static_cast<char*>(buf);
   ssize_t bytes_read = 0;
   while (bytes_read < static_cast<ssize_t>(count)) {
+    const base::TimeTicks start_time = base::TimeTicks::Now();
     ssize_t rc = pread(fd, c_buf + bytes_read, count - bytes_read,
                        offset + bytes_read);
+    IoStats::AddCalls(IoStats::kPread, 1, rc > 0 ? rc : 0,
+                      base::TimeTicks::Now() - start_time);
     TEST_AND_RETURN_FALSE_ERRNO(rc >= 0);
     if (rc == 0) {
       break;
@@ -170,6 +182,33 @@ bool PReadAll(int fd, void* buf, size_t count, off_t offset,
 
 }
 
+bool SendFileAll(int out_fd, int in_fd, off_t offset, size_t count) {
+  size_t bytes_sent = 0;
+  while (bytes_sent < count) {
+    off_t in_offset = offset + bytes_sent;
+    ssize_t rc = HANDLE_EINTR(
+        sendfile(out_fd, in_fd, &in_offset, count - bytes_sent));
+    if (rc < 0 && (errno == EINVAL || errno == ENOSYS))
+      break;
+    TEST_AND_RETURN_FALSE_ERRNO(rc >= 0);
+    TEST_AND_RETURN_FALSE(rc > 0);
+    bytes_sent += rc;
+  }
+
+  // The kernel doesn't support sendfile() between these files.
+  vector<char> buf(min(count - bytes_sent, static_cast<size_t>(1024 * 1024)));
+  while (bytes_sent < count) {
+    const size_t bytes_to_copy = min(count - bytes_sent, buf.size());
+    ssize_t bytes_read = 0;
+    TEST_AND_RETURN_FALSE(PReadAll(in_fd, &buf[0], bytes_to_copy,
+                                   offset + bytes_sent, &bytes_read));
+    TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(bytes_to_copy));
+    TEST_AND_RETURN_FALSE(WriteAll(out_fd, &buf[0], bytes_to_copy));
+    bytes_sent += bytes_to_copy;
+  }
+  return true;
+}
+
 // Append |nbytes| of content from |buf| to the vector pointed to by either
 // |vec_p| or |str_p|.
 static void AppendBytes(const char* buf, size_t nbytes,
@@ -228,6 +267,32 @@ bool ReadFile(const std::string& path, std::string* out_p) {
   return ReadFileAndAppend(path, out_p);
 }
 
+bool ReadFileChunk(const std::string& path,
+                   off_t offset,
+                   off_t size,
+                   std::vector<char>* out_p) {
+  int fd = HANDLE_EINTR(open(path.c_str(), O_RDONLY));
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  ScopedFdCloser fd_closer(&fd);
+  struct stat stbuf;
+  TEST_AND_RETURN_FALSE_ERRNO(fstat(fd, &stbuf) == 0);
+  if (offset >= stbuf.st_size)
+    return true;
+  off_t bytes_left = stbuf.st_size - offset;
+  if (size >= 0)
+    bytes_left = min(bytes_left, size);
+  const size_t start = out_p->size();
+  out_p->resize(start + bytes_left);
+  ssize_t bytes_read = 0;
+  if (bytes_left > 0) {
+    TEST_AND_RETURN_FALSE(PReadAll(fd, &(*out_p)[start], bytes_left, offset,
+                                   &bytes_read));
+  }
+  // The file may have been truncated meanwhile.
+  out_p->resize(start + bytes_read);
+  return true;
+}
+
 bool ReadPipe(const std::string& cmd, std::vector<char>* out_p) {
   return ReadPipeAndAppend(cmd, out_p);
 }
@@ -413,6 +478,15 @@ bool IsSymlink(const char* path) {
   return lstat(path, &stbuf) == 0 && S_ISLNK(stbuf.st_mode) != 0;
 }
 
+bool IsFileLockedByOther(int fd) {
+  // A shared lock is only refused while someone holds an exclusive one.
+  if (HANDLE_EINTR(flock(fd, LOCK_SH | LOCK_NB)) == 0) {
+    flock(fd, LOCK_UN);
+    return false;
+  }
+  return errno == EWOULDBLOCK;
+}
+
 std::string TempFilename(string path) {
   static const string suffix("XXXXXX");
   CHECK(StringHasSuffix(path, suffix));
@@ -712,6 +786,22 @@ string ToString(bool b) {
   return (b ? "true" : "false");
 }
 
+string JsonString(const string& str) {
+  string ret = "\"";
+  for (string::const_iterator it = str.begin(); it != str.end(); ++it) {
+    const unsigned char c = *it;
+    if (c == '"' || c == '\\') {
+      ret += '\\';
+      ret += c;
+    } else if (c < 0x20) {
+      ret += StringPrintf("\\u%04x", c);
+    } else {
+      ret += c;
+    }
+  }
+  return ret + "\"";
+}
+
 ActionExitCode GetBaseErrorCode(ActionExitCode code) {
   // Ignore the higher order bits in the code by applying the mask as
   // we want the enumerations to be in the small contiguous range
@@ -56,6 +56,12 @@ bool PWriteAll(int fd, const void* buf, size_t count, off_t offset);
 bool PReadAll(int fd, void* buf, size_t count, off_t offset,
               ssize_t* out_bytes_read);
 
+// Copies |count| bytes of |in_fd| starting at |offset| to the current
+// position of |out_fd| in the kernel with sendfile(), or through a buffer
+// where sendfile() can't copy between the two. Returns true on success;
+// running into the end of |in_fd| is a failure.
+bool SendFileAll(int out_fd, int in_fd, off_t offset, size_t count);
+
 // Opens |path| for reading and appends its entire content to the container
 // pointed to by |out_p|. Returns true upon successfully reading all of the
 // file's content, false otherwise, in which case the state of the output
@@ -63,6 +69,15 @@ bool PReadAll(int fd, void* buf, size_t count, off_t offset,
 bool ReadFile(const std::string& path, std::vector<char>* out_p);
 bool ReadFile(const std::string& path, std::string* out_p);
 
+// Opens |path| for reading and appends up to |size| bytes of its content
+// starting at |offset| to |out_p|, or everything from |offset| on if |size|
+// is negative. Fewer bytes are appended if the file ends earlier. Returns
+// true on success, false otherwise.
+bool ReadFileChunk(const std::string& path,
+                   off_t offset,
+                   off_t size,
+                   std::vector<char>* out_p);
+
 // Invokes |cmd| in a pipe and appends its stdout to the container pointed to by
 // |out_p|. Returns true upon successfully reading all of the output, false
 // otherwise, in which case the state of the output container is unknown.
@@ -86,6 +101,10 @@ bool FileExists(const char* path);
 // Returns true if |path| exists and is a symbolic link.
 bool IsSymlink(const char* path);
 
+// Returns true if another open file description of the file open at |fd|,
+// e.g. in another process, holds an exclusive flock() lock on it.
+bool IsFileLockedByOther(int fd);
+
 // The last 6 chars of path must be XXXXXX. They will be randomly changed
 // and a non-existent path will be returned. Intentionally makes a copy
 // of the string passed in.
@@ -156,6 +175,9 @@ std::string ToString(const base::Time utc_time);
 // Returns true or false depending on the value of b.
 std::string ToString(bool b);
 
+// Returns |str| as a JSON string literal, quotes included.
+std::string JsonString(const std::string& str);
+
 enum BootLoader {
   BootLoader_SYSLINUX = 0,
   BootLoader_CHROME_FIRMWARE = 1
@@ -5,6 +5,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <errno.h>
+#include <fcntl.h>
 
 #include <map>
 #include <string>
@@ -69,6 +70,56 @@ TEST(UtilsTest, ReadFileFailure) {
   EXPECT_FALSE(utils::ReadFile("/this/doesn't/exist", &empty));
 }
 
+TEST(UtilsTest, ReadFileChunkTest) {
+  string path;
+  ASSERT_TRUE(utils::MakeTempFile("/tmp/ReadFileChunkTest.XXXXXX",
+                                  &path,
+                                  NULL));
+  ScopedPathUnlinker path_unlinker(path);
+  ASSERT_TRUE(WriteFileString(path, "0123456789"));
+
+  vector<char> data(1, 'x');
+  EXPECT_TRUE(utils::ReadFileChunk(path, 2, 3, &data));
+  EXPECT_EQ("x234", string(data.begin(), data.end()));
+  data.clear();
+  EXPECT_TRUE(utils::ReadFileChunk(path, 8, 5, &data));
+  EXPECT_EQ("89", string(data.begin(), data.end()));
+  data.clear();
+  EXPECT_TRUE(utils::ReadFileChunk(path, 4, -1, &data));
+  EXPECT_EQ("456789", string(data.begin(), data.end()));
+  data.clear();
+  EXPECT_TRUE(utils::ReadFileChunk(path, 10, 5, &data));
+  EXPECT_TRUE(data.empty());
+  EXPECT_FALSE(utils::ReadFileChunk("/this/doesn't/exist", 0, -1, &data));
+}
+
+TEST(UtilsTest, SendFileAllTest) {
+  string in_path, out_path;
+  ASSERT_TRUE(utils::MakeTempFile("/tmp/SendFileAllTest.in.XXXXXX",
+                                  &in_path,
+                                  NULL));
+  ScopedPathUnlinker in_path_unlinker(in_path);
+  ASSERT_TRUE(WriteFileString(in_path, "0123456789"));
+  int out_fd = -1;
+  ASSERT_TRUE(utils::MakeTempFile("/tmp/SendFileAllTest.out.XXXXXX",
+                                  &out_path,
+                                  &out_fd));
+  ScopedPathUnlinker out_path_unlinker(out_path);
+  ScopedFdCloser out_fd_closer(&out_fd);
+  int in_fd = open(in_path.c_str(), O_RDONLY);
+  ASSERT_GE(in_fd, 0);
+  ScopedFdCloser in_fd_closer(&in_fd);
+
+  EXPECT_TRUE(utils::WriteAll(out_fd, "ab", 2));
+  EXPECT_TRUE(utils::SendFileAll(out_fd, in_fd, 3, 4));
+  EXPECT_TRUE(utils::SendFileAll(out_fd, in_fd, 0, 1));
+  EXPECT_TRUE(utils::SendFileAll(out_fd, in_fd, 9, 0));
+  EXPECT_FALSE(utils::SendFileAll(out_fd, in_fd, 8, 3));
+  vector<char> data;
+  EXPECT_TRUE(utils::ReadFileChunk(out_path, 0, 7, &data));
+  EXPECT_EQ("ab34560", string(data.begin(), data.end()));
+}
+
 TEST(UtilsTest, ErrnoNumberAsStringTest) {
   EXPECT_EQ("No such file or directory", utils::ErrnoNumberAsString(ENOENT));
 }
@@ -231,4 +282,11 @@ TEST(UtilsTest, RunAsRootGetFilesystemSizeTest) {
   EXPECT_EQ(10 * 1024 * 1024 / 4096, block_count);
 }
 
+TEST(UtilsTest, JsonStringTest) {
+  EXPECT_EQ("\"\"", utils::JsonString(""));
+  EXPECT_EQ("\"abc\"", utils::JsonString("abc"));
+  EXPECT_EQ("\"a\\\"b\\\\c\"", utils::JsonString("a\"b\\c"));
+  EXPECT_EQ("\"a\\u000ab\"", utils::JsonString("a\nb"));
+}
+
 }  // namespace chromeos_update_engine
@@ -0,0 +1,178 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/verity_tree_builder.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+
+#include "update_engine/utils.h"
+
+using std::min;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The most bytes read from the partition at once.
+const uint64_t kReadSize = 1024 * 1024;
+
+// Returns the number of hashes of each level of the tree of |data_blocks|
+// blocks, from the bottom one up.
+vector<uint64_t> LevelHashes(uint64_t data_blocks, uint32_t hashes_per_block) {
+  vector<uint64_t> level_hashes(1, data_blocks);
+  while (level_hashes.back() > hashes_per_block) {
+    level_hashes.push_back(
+        (level_hashes.back() + hashes_per_block - 1) / hashes_per_block);
+  }
+  return level_hashes;
+}
+
+}  // namespace {}
+
+VerityTreeBuilder::VerityTreeBuilder()
+    : block_size_(0),
+      hashes_per_block_(0),
+      missing_blocks_(0) {}
+
+bool VerityTreeBuilder::Init(uint64_t data_blocks,
+                             uint32_t block_size,
+                             const vector<char>& salt) {
+  TEST_AND_RETURN_FALSE(data_blocks > 0);
+  TEST_AND_RETURN_FALSE(block_size >= 2 * SHA256_DIGEST_LENGTH &&
+                        (block_size & (block_size - 1)) == 0);
+  block_size_ = block_size;
+  hashes_per_block_ = block_size / SHA256_DIGEST_LENGTH;
+  TEST_AND_RETURN_FALSE(SHA256_Init(&salted_ctx_) == 1);
+  TEST_AND_RETURN_FALSE(salt.empty() ||
+                        SHA256_Update(&salted_ctx_, &salt[0],
+                                      salt.size()) == 1);
+  level_hashes_ = LevelHashes(data_blocks, hashes_per_block_);
+  levels_.clear();
+  hashes_set_.clear();
+  for (size_t i = 0; i < level_hashes_.size(); i++) {
+    const uint64_t blocks =
+        (level_hashes_[i] + hashes_per_block_ - 1) / hashes_per_block_;
+    levels_.push_back(vector<char>(blocks * block_size_, 0));
+    hashes_set_.push_back(vector<uint32_t>(blocks, 0));
+  }
+  block_hashed_.assign(data_blocks, false);
+  missing_blocks_ = data_blocks;
+  root_hash_.clear();
+  return true;
+}
+
+void VerityTreeBuilder::AddBlocks(uint64_t first_block,
+                                  const char* data,
+                                  uint64_t num_blocks) {
+  const uint64_t data_blocks = block_hashed_.size();
+  for (uint64_t i = 0; i < num_blocks && first_block + i < data_blocks; i++) {
+    const uint64_t block = first_block + i;
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    HashBlock(data + i * block_size_, hash);
+    const bool replaced = block_hashed_[block];
+    if (!replaced) {
+      block_hashed_[block] = true;
+      missing_blocks_--;
+    }
+    SetHash(0, block, hash, replaced);
+  }
+}
+
+bool VerityTreeBuilder::ReadBlocks(int fd,
+                                   uint64_t first_block,
+                                   uint64_t num_blocks) {
+  const uint64_t data_blocks = block_hashed_.size();
+  if (first_block >= data_blocks)
+    return true;
+  num_blocks = min(num_blocks, data_blocks - first_block);
+  const uint64_t chunk_blocks = std::max<uint64_t>(kReadSize / block_size_, 1);
+  vector<char> buf;
+  for (uint64_t done = 0; done < num_blocks;) {
+    const uint64_t count = min(num_blocks - done, chunk_blocks);
+    buf.resize(count * block_size_);
+    ssize_t bytes_read = 0;
+    TEST_AND_RETURN_FALSE(utils::PReadAll(
+        fd, &buf[0], buf.size(), (first_block + done) * block_size_,
+        &bytes_read));
+    TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(buf.size()));
+    AddBlocks(first_block + done, &buf[0], count);
+    done += count;
+  }
+  return true;
+}
+
+bool VerityTreeBuilder::ReadMissingBlocks(int fd) {
+  const uint64_t data_blocks = block_hashed_.size();
+  for (uint64_t block = 0; block < data_blocks && missing_blocks_ > 0;) {
+    if (block_hashed_[block]) {
+      block++;
+      continue;
+    }
+    uint64_t end = block + 1;
+    while (end < data_blocks && !block_hashed_[end])
+      end++;
+    TEST_AND_RETURN_FALSE(ReadBlocks(fd, block, end - block));
+    block = end;
+  }
+  return complete();
+}
+
+bool VerityTreeBuilder::WriteTree(int fd, off_t offset) const {
+  TEST_AND_RETURN_FALSE(complete());
+  for (size_t i = levels_.size(); i-- > 0;) {
+    const vector<char>& level = levels_[i];
+    TEST_AND_RETURN_FALSE(utils::PWriteAll(fd, &level[0], level.size(),
+                                           offset));
+    offset += level.size();
+  }
+  return true;
+}
+
+uint64_t VerityTreeBuilder::TreeBlocks(uint64_t data_blocks,
+                                       uint32_t block_size) {
+  const uint32_t hashes_per_block = block_size / SHA256_DIGEST_LENGTH;
+  const vector<uint64_t> level_hashes =
+      LevelHashes(data_blocks, hashes_per_block);
+  uint64_t blocks = 0;
+  for (size_t i = 0; i < level_hashes.size(); i++)
+    blocks += (level_hashes[i] + hashes_per_block - 1) / hashes_per_block;
+  return blocks;
+}
+
+void VerityTreeBuilder::SetHash(size_t level,
+                                uint64_t index,
+                                const unsigned char* hash,
+                                bool replaced) {
+  vector<char>& hashes = levels_[level];
+  memcpy(&hashes[index * SHA256_DIGEST_LENGTH], hash, SHA256_DIGEST_LENGTH);
+  const uint64_t block = index / hashes_per_block_;
+  if (!replaced)
+    hashes_set_[level][block]++;
+  const uint64_t block_hashes = min<uint64_t>(
+      hashes_per_block_, level_hashes_[level] - block * hashes_per_block_);
+  if (hashes_set_[level][block] < block_hashes)
+    return;
+  // A block that had all its hashes before had its own hash set then too.
+  unsigned char block_hash[SHA256_DIGEST_LENGTH];
+  HashBlock(&hashes[block * block_size_], block_hash);
+  if (level + 1 == levels_.size()) {
+    root_hash_.assign(block_hash, block_hash + SHA256_DIGEST_LENGTH);
+    return;
+  }
+  SetHash(level + 1, block, block_hash, replaced);
+}
+
+void VerityTreeBuilder::HashBlock(const char* data,
+                                  unsigned char* hash) const {
+  SHA256_CTX ctx = salted_ctx_;
+  SHA256_Update(&ctx, data, block_size_);
+  SHA256_Final(hash, &ctx);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,102 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_VERITY_TREE_BUILDER_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_VERITY_TREE_BUILDER_H__
+
+#include <sys/types.h>
+
+#include <vector>
+
+#include <base/basictypes.h>
+#include <openssl/sha.h>
+
+// Builds the dm-verity hash tree of a partition from its blocks as they're
+// written, in any order, so that it needn't be read back once it's
+// complete. The tree is the one veritysetup formats (version 1): each block
+// is hashed with SHA-256 after the salt, the hashes are packed into blocks
+// of the same size, zero padded, which are hashed the same way into the
+// level above, up to a level of a single block, whose hash is the root
+// hash. The levels are stored from the top one down.
+//
+// A bitmap records which blocks were hashed. A block of hashes is hashed
+// into the level above as soon as it has all of them, so the tree fills in
+// as the partition is written rather than all at the end.
+
+namespace chromeos_update_engine {
+
+class VerityTreeBuilder {
+ public:
+  VerityTreeBuilder();
+
+  // Starts a tree of the first |data_blocks| blocks of |block_size| bytes
+  // of a partition, hashed with |salt|. |block_size| must be a power of two
+  // of at least 2 hashes.
+  bool Init(uint64_t data_blocks,
+            uint32_t block_size,
+            const std::vector<char>& salt);
+
+  // Hashes the |num_blocks| blocks at |data|, the first of which is the
+  // |first_block|th of the partition. Blocks past the data blocks are
+  // ignored. Blocks hashed before, e.g., written again, are hashed again.
+  void AddBlocks(uint64_t first_block, const char* data, uint64_t num_blocks);
+
+  // Like AddBlocks(), but reads the blocks from |fd|, best right after they
+  // were written, while they're still in the page cache.
+  bool ReadBlocks(int fd, uint64_t first_block, uint64_t num_blocks);
+
+  // Reads the blocks that weren't hashed yet, e.g., those written before an
+  // interrupted update was resumed, from |fd|, which completes the tree.
+  bool ReadMissingBlocks(int fd);
+
+  // Writes the complete tree to |fd| at |offset|.
+  bool WriteTree(int fd, off_t offset) const;
+
+  // The number of blocks of |block_size| bytes the tree of |data_blocks|
+  // blocks takes.
+  static uint64_t TreeBlocks(uint64_t data_blocks, uint32_t block_size);
+
+  bool complete() const { return missing_blocks_ == 0; }
+  uint64_t missing_blocks() const { return missing_blocks_; }
+
+  // The root hash, once the tree is complete.
+  const std::vector<char>& root_hash() const { return root_hash_; }
+
+ private:
+  // Sets the |index|th hash of |level|, 0 being the hashes of the data
+  // blocks, to the |hash| of its block. |replaced| tells whether it was set
+  // before. Hashes the block of hashes it's in into the level above if that
+  // has them all now.
+  void SetHash(size_t level,
+               uint64_t index,
+               const unsigned char* hash,
+               bool replaced);
+
+  // Sets |hash| to the salted hash of the block at |data|.
+  void HashBlock(const char* data, unsigned char* hash) const;
+
+  uint32_t block_size_;
+  uint32_t hashes_per_block_;
+
+  // The hash context after the salt, which each block's hash starts from.
+  SHA256_CTX salted_ctx_;
+
+  // The hash blocks of each level, from the bottom one up, the number of
+  // hashes each of them has, and how many of those were set in each block.
+  std::vector<std::vector<char> > levels_;
+  std::vector<uint64_t> level_hashes_;
+  std::vector<std::vector<uint32_t> > hashes_set_;
+
+  // Which data blocks were hashed, and how many weren't.
+  std::vector<bool> block_hashed_;
+  uint64_t missing_blocks_;
+
+  std::vector<char> root_hash_;
+
+  DISALLOW_COPY_AND_ASSIGN(VerityTreeBuilder);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_VERITY_TREE_BUILDER_H__
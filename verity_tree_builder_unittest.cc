@@ -0,0 +1,167 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <openssl/sha.h>
+
+#include "update_engine/test_utils.h"
+#include "update_engine/utils.h"
+#include "update_engine/verity_tree_builder.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+const uint32_t kBlockSize = 256;  // 8 hashes per block, for deep trees.
+
+void AppendSaltedHash(const vector<char>& salt, const char* block,
+                      vector<char>* out) {
+  SHA256_CTX ctx;
+  SHA256_Init(&ctx);
+  SHA256_Update(&ctx, salt.empty() ? NULL : &salt[0], salt.size());
+  SHA256_Update(&ctx, block, kBlockSize);
+  unsigned char hash[SHA256_DIGEST_LENGTH];
+  SHA256_Final(hash, &ctx);
+  out->insert(out->end(), hash, hash + sizeof(hash));
+}
+
+// Sets |tree| and |root_hash| to those of |data|, computed a level at a
+// time, the way veritysetup does.
+void ReferenceTree(const vector<char>& data, const vector<char>& salt,
+                   vector<char>* tree, vector<char>* root_hash) {
+  vector<vector<char> > levels;
+  vector<char> below = data;
+  do {
+    vector<char> level;
+    for (size_t i = 0; i < below.size(); i += kBlockSize)
+      AppendSaltedHash(salt, &below[i], &level);
+    level.resize((level.size() + kBlockSize - 1) / kBlockSize * kBlockSize);
+    levels.push_back(level);
+    below = level;
+  } while (below.size() > kBlockSize);
+  root_hash->clear();
+  AppendSaltedHash(salt, &below[0], root_hash);
+  tree->clear();
+  for (size_t i = levels.size(); i-- > 0;)
+    tree->insert(tree->end(), levels[i].begin(), levels[i].end());
+}
+
+}  // namespace {}
+
+class VerityTreeBuilderTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    ASSERT_TRUE(utils::MakeTempFile("/tmp/VerityTreeBuilder.XXXXXX",
+                                    &path_, &fd_));
+  }
+
+  virtual void TearDown() {
+    close(fd_);
+    unlink(path_.c_str());
+  }
+
+  // Returns the tree |builder| writes out.
+  vector<char> WrittenTree(const VerityTreeBuilder& builder,
+                           uint64_t data_blocks) {
+    const size_t size =
+        VerityTreeBuilder::TreeBlocks(data_blocks, kBlockSize) * kBlockSize;
+    EXPECT_TRUE(builder.WriteTree(fd_, 0));
+    vector<char> tree(size);
+    ssize_t bytes_read = 0;
+    EXPECT_TRUE(utils::PReadAll(fd_, &tree[0], size, 0, &bytes_read));
+    EXPECT_EQ(size, bytes_read);
+    return tree;
+  }
+
+  string path_;
+  int fd_;
+};
+
+TEST_F(VerityTreeBuilderTest, OutOfOrderBlocksTest) {
+  const uint64_t kDataBlocks = 100;  // 100, 13 and 2 hashes.
+  const vector<char> data = RandomData(kDataBlocks * kBlockSize);
+  const vector<char> salt = RandomData(32);
+  vector<char> expected_tree, expected_root_hash;
+  ReferenceTree(data, salt, &expected_tree, &expected_root_hash);
+  EXPECT_EQ(expected_tree.size() / kBlockSize,
+            VerityTreeBuilder::TreeBlocks(kDataBlocks, kBlockSize));
+
+  vector<uint64_t> order;
+  for (uint64_t i = 0; i < kDataBlocks; i++)
+    order.push_back(i);
+  std::random_shuffle(order.begin(), order.end());
+  VerityTreeBuilder builder;
+  ASSERT_TRUE(builder.Init(kDataBlocks, kBlockSize, salt));
+  for (size_t i = 0; i < order.size(); i++) {
+    EXPECT_FALSE(builder.complete());
+    EXPECT_TRUE(builder.root_hash().empty());
+    builder.AddBlocks(order[i], &data[order[i] * kBlockSize], 1);
+  }
+  EXPECT_TRUE(builder.complete());
+  EXPECT_EQ(expected_root_hash, builder.root_hash());
+  EXPECT_EQ(expected_tree, WrittenTree(builder, kDataBlocks));
+}
+
+TEST_F(VerityTreeBuilderTest, RewrittenBlocksTest) {
+  const uint64_t kDataBlocks = 64;
+  vector<char> data = RandomData(kDataBlocks * kBlockSize);
+  const vector<char> salt;
+  VerityTreeBuilder builder;
+  ASSERT_TRUE(builder.Init(kDataBlocks, kBlockSize, salt));
+  // Blocks past the data aren't part of the tree.
+  builder.AddBlocks(0, &data[0], kDataBlocks);
+  const vector<char> extra = RandomData(kBlockSize);
+  builder.AddBlocks(kDataBlocks, &extra[0], 1);
+  EXPECT_TRUE(builder.complete());
+
+  // A block written again changes the tree all the way up.
+  const vector<char> block = RandomData(kBlockSize);
+  std::copy(block.begin(), block.end(), data.begin() + 10 * kBlockSize);
+  builder.AddBlocks(10, &block[0], 1);
+  EXPECT_TRUE(builder.complete());
+  vector<char> expected_tree, expected_root_hash;
+  ReferenceTree(data, salt, &expected_tree, &expected_root_hash);
+  EXPECT_EQ(expected_root_hash, builder.root_hash());
+  EXPECT_EQ(expected_tree, WrittenTree(builder, kDataBlocks));
+}
+
+TEST_F(VerityTreeBuilderTest, ReadMissingBlocksTest) {
+  const uint64_t kDataBlocks = 5;  // A single level.
+  const vector<char> data = RandomData(kDataBlocks * kBlockSize);
+  ASSERT_TRUE(utils::PWriteAll(fd_, &data[0], data.size(), 0));
+  const vector<char> salt = RandomData(8);
+  VerityTreeBuilder builder;
+  ASSERT_TRUE(builder.Init(kDataBlocks, kBlockSize, salt));
+  ASSERT_TRUE(builder.ReadBlocks(fd_, 1, 2));
+  EXPECT_EQ(3, builder.missing_blocks());
+  EXPECT_FALSE(builder.WriteTree(fd_, data.size()));
+
+  ASSERT_TRUE(builder.ReadMissingBlocks(fd_));
+  EXPECT_TRUE(builder.complete());
+  vector<char> expected_tree, expected_root_hash;
+  ReferenceTree(data, salt, &expected_tree, &expected_root_hash);
+  EXPECT_EQ(expected_root_hash, builder.root_hash());
+  EXPECT_EQ(1, VerityTreeBuilder::TreeBlocks(kDataBlocks, kBlockSize));
+}
+
+TEST(VerityTreeBuilderInitTest, InvalidParametersTest) {
+  VerityTreeBuilder builder;
+  const vector<char> salt;
+  EXPECT_FALSE(builder.Init(0, 4096, salt));
+  EXPECT_FALSE(builder.Init(1, 32, salt));
+  EXPECT_FALSE(builder.Init(1, 1000, salt));
+  EXPECT_TRUE(builder.Init(1, 4096, salt));
+}
+
+}  // namespace chromeos_update_engine
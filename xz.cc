@@ -0,0 +1,159 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/xz.h"
+
+#include <lzma.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+
+#include "update_engine/utils.h"
+
+using std::max;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The xz preset the data is compressed with. Higher presets only differ in
+// the dictionary size, which clients would have to allocate to decompress, so
+// they don't pay off for the file and chunk sized blobs of a payload.
+const uint32_t kXzPreset = 6;
+
+// Compresses the |in_size| bytes at |in| to |out|.
+bool XzData(const char* in, size_t in_size, vector<char>* out) {
+  TEST_AND_RETURN_FALSE(out);
+  out->clear();
+  if (in_size == 0)
+    return true;
+  // The payload verifies the data already, so there's no need for a check
+  // in the stream.
+  out->resize(lzma_stream_buffer_bound(in_size));
+  size_t out_pos = 0;
+  lzma_ret rc = lzma_easy_buffer_encode(kXzPreset,
+                                        LZMA_CHECK_NONE,
+                                        NULL,
+                                        reinterpret_cast<const uint8_t*>(in),
+                                        in_size,
+                                        reinterpret_cast<uint8_t*>(&(*out)[0]),
+                                        &out_pos,
+                                        out->size());
+  TEST_AND_RETURN_FALSE(rc == LZMA_OK);
+  out->resize(out_pos);
+  return true;
+}
+
+// Decompresses the |in_size| bytes at |in| to |out|: an xz stream, or a raw
+// LZMA2 stream compressed with |dictionary| if it isn't NULL.
+bool UnxzData(const char* in,
+              size_t in_size,
+              const string* dictionary,
+              vector<char>* out) {
+  TEST_AND_RETURN_FALSE(out);
+  out->clear();
+  if (in_size == 0)
+    return true;
+  lzma_stream stream = LZMA_STREAM_INIT;
+  if (dictionary) {
+    lzma_options_lzma options;
+    TEST_AND_RETURN_FALSE(XzDictionaryOptions(*dictionary, &options));
+    const lzma_filter filters[] = {
+      { LZMA_FILTER_LZMA2, &options },
+      { LZMA_VLI_UNKNOWN, NULL }
+    };
+    TEST_AND_RETURN_FALSE(lzma_raw_decoder(&stream, filters) == LZMA_OK);
+  } else {
+    TEST_AND_RETURN_FALSE(lzma_stream_decoder(&stream, UINT64_MAX, 0) ==
+                          LZMA_OK);
+  }
+  stream.next_in = reinterpret_cast<const uint8_t*>(in);
+  stream.avail_in = in_size;
+  // Try increasing buffer size until it all fits.
+  lzma_ret rc = LZMA_OK;
+  while (rc == LZMA_OK) {
+    size_t out_pos = out->size();
+    out->resize(out_pos + max(in_size, out_pos));
+    stream.next_out = reinterpret_cast<uint8_t*>(&(*out)[out_pos]);
+    stream.avail_out = out->size() - out_pos;
+    rc = lzma_code(&stream, LZMA_FINISH);
+  }
+  out->resize(out->size() - stream.avail_out);
+  lzma_end(&stream);
+  TEST_AND_RETURN_FALSE(rc == LZMA_STREAM_END);
+  return true;
+}
+
+}  // namespace {}
+
+bool XzDecompress(const vector<char>& in, vector<char>* out) {
+  return UnxzData(in.empty() ? NULL : &in[0], in.size(), NULL, out);
+}
+
+bool XzCompress(const vector<char>& in, vector<char>* out) {
+  return XzData(in.empty() ? NULL : &in[0], in.size(), out);
+}
+
+bool XzCompressBytes(const char* in, size_t in_size, vector<char>* out) {
+  return XzData(in, in_size, out);
+}
+
+bool XzCompressString(const string& str, vector<char>* out) {
+  return XzData(str.data(), str.size(), out);
+}
+
+bool XzDecompressString(const string& str, vector<char>* out) {
+  return UnxzData(str.data(), str.size(), NULL, out);
+}
+
+bool XzDictionaryOptions(const string& dictionary,
+                         lzma_options_lzma* options) {
+  TEST_AND_RETURN_FALSE(dictionary.size() < kXzDictionaryWindowSize);
+  TEST_AND_RETURN_FALSE(lzma_lzma_preset(options, kXzPreset) == 0);
+  options->dict_size = kXzDictionaryWindowSize;
+  options->preset_dict = dictionary.empty() ? NULL :
+      reinterpret_cast<const uint8_t*>(dictionary.data());
+  options->preset_dict_size = dictionary.size();
+  return true;
+}
+
+bool XzCompressWithDictionary(const char* in,
+                              size_t in_size,
+                              const string& dictionary,
+                              vector<char>* out) {
+  TEST_AND_RETURN_FALSE(out);
+  out->clear();
+  if (in_size == 0)
+    return true;
+  lzma_options_lzma options;
+  TEST_AND_RETURN_FALSE(XzDictionaryOptions(dictionary, &options));
+  const lzma_filter filters[] = {
+    { LZMA_FILTER_LZMA2, &options },
+    { LZMA_VLI_UNKNOWN, NULL }
+  };
+  // A raw stream is never larger than an xz stream of the same data.
+  out->resize(lzma_stream_buffer_bound(in_size));
+  size_t out_pos = 0;
+  lzma_ret rc = lzma_raw_buffer_encode(filters,
+                                       NULL,
+                                       reinterpret_cast<const uint8_t*>(in),
+                                       in_size,
+                                       reinterpret_cast<uint8_t*>(&(*out)[0]),
+                                       &out_pos,
+                                       out->size());
+  TEST_AND_RETURN_FALSE(rc == LZMA_OK);
+  out->resize(out_pos);
+  return true;
+}
+
+bool XzDecompressWithDictionary(const vector<char>& in,
+                                const string& dictionary,
+                                vector<char>* out) {
+  return UnxzData(in.empty() ? NULL : &in[0], in.size(), &dictionary, out);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,50 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_XZ_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_XZ_H__
+
+#include <lzma.h>
+
+#include <string>
+#include <vector>
+
+namespace chromeos_update_engine {
+
+// xz compresses or decompresses str/in to out. Empty input maps to empty
+// output both ways.
+bool XzDecompress(const std::vector<char>& in, std::vector<char>* out);
+bool XzCompress(const std::vector<char>& in, std::vector<char>* out);
+bool XzCompressString(const std::string& str, std::vector<char>* out);
+bool XzDecompressString(const std::string& str, std::vector<char>* out);
+
+// xz compresses the |in_size| bytes at |in| to out.
+bool XzCompressBytes(const char* in, size_t in_size, std::vector<char>* out);
+
+// The data of REPLACE_XZ_DICT operations is a raw LZMA2 stream, without
+// the xz container, compressed with the manifest's xz_dictionary as its
+// preset dictionary: matches may refer back into the dictionary as if it
+// preceded the data. The size of the window both ends use, which holds the
+// dictionary and the data, is fixed so that clients know how much memory
+// to allocate.
+const uint32_t kXzDictionaryWindowSize = 1024 * 1024;  // 1 MiB
+
+// Sets |options| to the LZMA2 options of the streams compressed with
+// |dictionary|, which must outlive their use.
+bool XzDictionaryOptions(const std::string& dictionary,
+                         lzma_options_lzma* options);
+
+// Compresses the |in_size| bytes at |in| to a raw LZMA2 stream with
+// |dictionary| in |out|, or decompresses such a stream |in| to |out|.
+bool XzCompressWithDictionary(const char* in,
+                              size_t in_size,
+                              const std::string& dictionary,
+                              std::vector<char>* out);
+bool XzDecompressWithDictionary(const std::vector<char>& in,
+                                const std::string& dictionary,
+                                std::vector<char>* out);
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_XZ_H__
@@ -0,0 +1,101 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/xz_extent_writer.h"
+
+#include "update_engine/xz.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+const size_t kOutputBufferLength = 1024 * 1024;
+}
+
+XzExtentWriter::~XzExtentWriter() {
+  lzma_end(&stream_);
+  if (output_buffer_) {
+    SharedBufferPool(kOutputBufferLength)->Put(
+        reinterpret_cast<char*>(output_buffer_));
+  }
+}
+
+bool XzExtentWriter::Init(int fd,
+                          const vector<Extent>& extents,
+                          uint32_t block_size) {
+  // The generator limits the dictionary size, so there's no need for a
+  // memory limit here. The memory of the last stream decoded is reused.
+  lzma_ret rc;
+  if (dictionary_) {
+    // The dictionary is loaded into the window as the stream starts.
+    lzma_options_lzma options;
+    TEST_AND_RETURN_FALSE(XzDictionaryOptions(*dictionary_, &options));
+    const lzma_filter filters[] = {
+      { LZMA_FILTER_LZMA2, &options },
+      { LZMA_VLI_UNKNOWN, NULL }
+    };
+    rc = lzma_raw_decoder(&stream_, filters);
+  } else {
+    rc = lzma_stream_decoder(&stream_, UINT64_MAX, 0);
+  }
+  TEST_AND_RETURN_FALSE(rc == LZMA_OK);
+  stream_end_ = false;
+  if (!output_buffer_) {
+    output_buffer_ = reinterpret_cast<uint8_t*>(
+        SharedBufferPool(kOutputBufferLength)->Get());
+    TEST_AND_RETURN_FALSE(output_buffer_);
+  }
+
+  return next_->Init(fd, extents, block_size);
+}
+
+bool XzExtentWriter::Write(const void* bytes, size_t count) {
+  // liblzma keeps what it can't decode yet in its own state, so all of the
+  // input is consumed by each call.
+  stream_.next_in = reinterpret_cast<const uint8_t*>(bytes);
+  stream_.avail_in = count;
+  return Decode(LZMA_RUN);
+}
+
+bool XzExtentWriter::EndImpl() {
+  if (!stream_end_) {
+    stream_.next_in = NULL;
+    stream_.avail_in = 0;
+    TEST_AND_RETURN_FALSE(Decode(LZMA_FINISH));
+  }
+  TEST_AND_RETURN_FALSE(stream_end_);
+  return next_->End();
+}
+
+bool XzExtentWriter::Decode(lzma_action action) {
+  for (;;) {
+    stream_.next_out = output_buffer_;
+    stream_.avail_out = kOutputBufferLength;
+
+    lzma_ret rc = stream_end_ ? LZMA_STREAM_END : lzma_code(&stream_, action);
+    TEST_AND_RETURN_FALSE(rc == LZMA_OK || rc == LZMA_STREAM_END ||
+                          rc == LZMA_BUF_ERROR);
+    size_t produced = kOutputBufferLength - stream_.avail_out;
+    if (produced > 0)
+      TEST_AND_RETURN_FALSE(next_->Write(output_buffer_, produced));
+
+    if (rc == LZMA_STREAM_END) {
+      // Data past the end of the stream is an error.
+      stream_end_ = true;
+      TEST_AND_RETURN_FALSE(stream_.avail_in == 0);
+      return true;
+    }
+    if (rc == LZMA_BUF_ERROR) {
+      // No progress is possible: with LZMA_FINISH the input is truncated.
+      TEST_AND_RETURN_FALSE(action == LZMA_RUN);
+      return true;
+    }
+    if (stream_.avail_in == 0 && stream_.avail_out > 0 &&
+        action == LZMA_RUN)
+      return true;  // all input consumed and all output flushed
+  }
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,61 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_XZ_EXTENT_WRITER_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_XZ_EXTENT_WRITER_H__
+
+#include <string>
+#include <vector>
+#include <lzma.h>
+#include "update_engine/extent_writer.h"
+#include "update_engine/utils.h"
+
+// XzExtentWriter is a concrete ExtentWriter subclass that xz-decompresses
+// what it's given in Write. It passes the decompressed data to an underlying
+// ExtentWriter.
+
+namespace chromeos_update_engine {
+
+class XzExtentWriter : public ExtentWriter {
+ public:
+  XzExtentWriter(ExtentWriter* next)
+      : next_(next), dictionary_(NULL), stream_end_(false),
+        output_buffer_(NULL) {
+    lzma_stream stream = LZMA_STREAM_INIT;
+    stream_ = stream;
+  }
+  ~XzExtentWriter();
+
+  bool Init(int fd, const std::vector<Extent>& extents, uint32_t block_size);
+  bool Write(const void* bytes, size_t count);
+  bool EndImpl();
+
+  // Makes the writer pass its output to |next| from the next Init() on. The
+  // decoder and the buffer, which comes from the shared buffer pools, are
+  // kept from one stream to the next, and are only freed with the writer.
+  void Reset(ExtentWriter* next) { next_ = next; }
+
+  // Makes the writer decompress raw LZMA2 streams compressed with
+  // |dictionary|, see XzDictionaryOptions(), from the next Init() on, or xz
+  // streams if it's NULL, the default. |dictionary| isn't owned.
+  void set_dictionary(const std::string* dictionary) {
+    dictionary_ = dictionary;
+  }
+
+ private:
+  // Decompresses the stream's pending input with |action| and passes the
+  // output on to |next_|.
+  bool Decode(lzma_action action);
+
+  ExtentWriter* next_;  // The underlying ExtentWriter.
+  const std::string* dictionary_;
+  lzma_stream stream_;  // the liblzma stream
+  bool stream_end_;  // whether the end of the xz stream has been decoded
+  // The decompression window, from SharedBufferPool(kOutputBufferLength).
+  uint8_t* output_buffer_;
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_XZ_EXTENT_WRITER_H__
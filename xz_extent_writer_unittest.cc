@@ -0,0 +1,198 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <base/stringprintf.h>
+#include <gtest/gtest.h>
+#include "update_engine/test_utils.h"
+#include "update_engine/utils.h"
+#include "update_engine/xz.h"
+#include "update_engine/xz_extent_writer.h"
+
+using std::min;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+const char kPathTemplate[] = "./XzExtentWriterTest-file.XXXXXX";
+const uint32_t kBlockSize = 4096;
+}
+
+class XzExtentWriterTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    memcpy(path_, kPathTemplate, sizeof(kPathTemplate));
+    fd_ = mkstemp(path_);
+    ASSERT_GE(fd_, 0);
+  }
+  virtual void TearDown() {
+    close(fd_);
+    unlink(path_);
+  }
+  int fd() { return fd_; }
+  // Writes |compressed| in chunks of |chunk_size| bytes through an
+  // XzExtentWriter to the blocks |decompressed_size| needs. Returns the
+  // result of End().
+  bool WriteChunked(const vector<char>& compressed,
+                    size_t chunk_size,
+                    size_t decompressed_size);
+ private:
+  int fd_;
+  char path_[sizeof(kPathTemplate)];
+};
+
+bool XzExtentWriterTest::WriteChunked(const vector<char>& compressed,
+                                      size_t chunk_size,
+                                      size_t decompressed_size) {
+  vector<Extent> extents;
+  Extent extent;
+  extent.set_start_block(0);
+  extent.set_num_blocks(decompressed_size / kBlockSize + 1);
+  extents.push_back(extent);
+
+  DirectExtentWriter direct_writer;
+  XzExtentWriter xz_writer(&direct_writer);
+  EXPECT_TRUE(xz_writer.Init(fd(), extents, kBlockSize));
+  for (vector<char>::size_type i = 0; i < compressed.size();
+       i += chunk_size) {
+    size_t this_chunk_size = min(chunk_size, compressed.size() - i);
+    if (!xz_writer.Write(&compressed[i], this_chunk_size))
+      return false;
+  }
+  return xz_writer.End();
+}
+
+TEST_F(XzExtentWriterTest, SimpleTest) {
+  const string kUncompressed = "test\n";
+  vector<char> compressed;
+  EXPECT_TRUE(XzCompressString(kUncompressed, &compressed));
+  EXPECT_TRUE(WriteChunked(compressed, compressed.size(),
+                           kUncompressed.size()));
+
+  char buf[16];
+  memset(buf, 0, sizeof(buf));
+  ssize_t bytes_read = pread(fd(), buf, sizeof(buf) - 1, 0);
+  EXPECT_EQ(kUncompressed.size(), bytes_read);
+  EXPECT_EQ(kUncompressed, string(buf));
+}
+
+TEST_F(XzExtentWriterTest, ChunkedTest) {
+  const vector<char>::size_type kDecompressedLength = 2048 * 1024;  // 2 MiB
+  const size_t kChunkSize = 3;
+
+  vector<char> decompressed_data(kDecompressedLength);
+  FillWithData(&decompressed_data);
+  vector<char> compressed_data;
+  EXPECT_TRUE(XzCompress(decompressed_data, &compressed_data));
+  EXPECT_TRUE(WriteChunked(compressed_data, kChunkSize, kDecompressedLength));
+
+  vector<char> output(kDecompressedLength + 1);
+  ssize_t bytes_read = pread(fd(), &output[0], output.size(), 0);
+  EXPECT_EQ(kDecompressedLength, bytes_read);
+  output.resize(kDecompressedLength);
+  ExpectVectorsEq(decompressed_data, output);
+}
+
+TEST_F(XzExtentWriterTest, TruncatedTest) {
+  vector<char> decompressed_data(64 * 1024);
+  FillWithData(&decompressed_data);
+  vector<char> compressed_data;
+  EXPECT_TRUE(XzCompress(decompressed_data, &compressed_data));
+
+  vector<char> truncated(compressed_data.begin(), compressed_data.end() - 1);
+  EXPECT_FALSE(WriteChunked(truncated, 1024, decompressed_data.size()));
+
+  vector<char> trailing(compressed_data);
+  trailing.push_back('\0');
+  EXPECT_FALSE(WriteChunked(trailing, 1024, decompressed_data.size()));
+}
+
+TEST_F(XzExtentWriterTest, ReuseTest) {
+  const string kFirst = "first stream\n";
+  const string kSecond = "second stream\n";
+  vector<char> first, second;
+  EXPECT_TRUE(XzCompressString(kFirst, &first));
+  EXPECT_TRUE(XzCompressString(kSecond, &second));
+
+  vector<Extent> extents(1);
+  extents[0].set_num_blocks(1);
+
+  // A stream that fails part way doesn't keep the writer from decoding the
+  // next one.
+  DirectExtentWriter failed_writer;
+  XzExtentWriter xz_writer(&failed_writer);
+  EXPECT_TRUE(xz_writer.Init(fd(), extents, kBlockSize));
+  EXPECT_TRUE(xz_writer.Write(&first[0], first.size() / 2));
+  EXPECT_TRUE(failed_writer.End());
+
+  DirectExtentWriter first_writer;
+  xz_writer.Reset(&first_writer);
+  EXPECT_TRUE(xz_writer.Init(fd(), extents, kBlockSize));
+  EXPECT_TRUE(xz_writer.Write(&first[0], first.size()));
+  EXPECT_TRUE(xz_writer.End());
+
+  DirectExtentWriter second_writer;
+  xz_writer.Reset(&second_writer);
+  extents[0].set_start_block(1);
+  EXPECT_TRUE(xz_writer.Init(fd(), extents, kBlockSize));
+  EXPECT_TRUE(xz_writer.Write(&second[0], second.size()));
+  EXPECT_TRUE(xz_writer.End());
+
+  char buf[kBlockSize];
+  EXPECT_EQ(kFirst.size(), pread(fd(), buf, kFirst.size(), 0));
+  EXPECT_EQ(kFirst, string(buf, kFirst.size()));
+  EXPECT_EQ(kSecond.size(), pread(fd(), buf, kSecond.size(), kBlockSize));
+  EXPECT_EQ(kSecond, string(buf, kSecond.size()));
+}
+
+TEST_F(XzExtentWriterTest, DictionaryTest) {
+  string dictionary;
+  for (int i = 0; i < 100; i++)
+    dictionary += StringPrintf("setting_%d=value %d\n", i, i * i);
+  const string kUncompressed =
+      "setting_7=value 49\nsetting_42=value 1764\nsetting_3=value 9\n";
+  vector<char> compressed, plain;
+  EXPECT_TRUE(XzCompressWithDictionary(kUncompressed.data(),
+                                       kUncompressed.size(),
+                                       dictionary,
+                                       &compressed));
+  EXPECT_TRUE(XzCompressString(kUncompressed, &plain));
+  EXPECT_LT(compressed.size(), plain.size());
+  vector<char> decompressed;
+  EXPECT_TRUE(XzDecompressWithDictionary(compressed, dictionary,
+                                         &decompressed));
+  EXPECT_EQ(kUncompressed, string(decompressed.begin(), decompressed.end()));
+
+  vector<Extent> extents(1);
+  extents[0].set_num_blocks(1);
+  DirectExtentWriter dictionary_writer;
+  XzExtentWriter xz_writer(&dictionary_writer);
+  xz_writer.set_dictionary(&dictionary);
+  EXPECT_TRUE(xz_writer.Init(fd(), extents, kBlockSize));
+  EXPECT_TRUE(xz_writer.Write(&compressed[0], compressed.size()));
+  EXPECT_TRUE(xz_writer.End());
+
+  // The same writer goes back to xz streams.
+  DirectExtentWriter plain_writer;
+  xz_writer.Reset(&plain_writer);
+  xz_writer.set_dictionary(NULL);
+  extents[0].set_start_block(1);
+  EXPECT_TRUE(xz_writer.Init(fd(), extents, kBlockSize));
+  EXPECT_TRUE(xz_writer.Write(&plain[0], plain.size()));
+  EXPECT_TRUE(xz_writer.End());
+
+  char buf[kBlockSize];
+  for (int i = 0; i < 2; i++) {
+    EXPECT_EQ(kUncompressed.size(),
+              pread(fd(), buf, kUncompressed.size(), i * kBlockSize));
+    EXPECT_EQ(kUncompressed, string(buf, kUncompressed.size()));
+  }
+}
+
+}  // namespace chromeos_update_engine
@@ -11,8 +11,10 @@
 #include <gtest/gtest.h>
 
 #include "update_engine/bzip.h"
+#include "update_engine/gzip.h"
 #include "update_engine/test_utils.h"
 #include "update_engine/utils.h"
+#include "update_engine/xz.h"
 
 using std::string;
 using std::vector;
@@ -30,6 +32,9 @@ class ZipTest : public ::testing::Test {
                          std::vector<char>* out) const = 0;
   bool ZipDecompressString(const std::string& str,
                            std::vector<char>* out) const = 0;
+  bool ZipCompressBytes(const char* in,
+                        size_t in_size,
+                        std::vector<char>* out) const = 0;
 };
 
 class BzipTest {};
@@ -53,9 +58,70 @@ class ZipTest<BzipTest> : public ::testing::Test {
                            std::vector<char>* out) const {
     return BzipDecompressString(str, out);
   }
+  bool ZipCompressBytes(const char* in,
+                        size_t in_size,
+                        std::vector<char>* out) const {
+    return BzipCompressBytes(in, in_size, out);
+  }
 };
 
-typedef ::testing::Types<BzipTest> ZipTestTypes;
+class GzipTest {};
+
+template <>
+class ZipTest<GzipTest> : public ::testing::Test {
+ public:
+  bool ZipDecompress(const std::vector<char>& in,
+                     std::vector<char>* out) const {
+    return GzipDecompress(in, out);
+  }
+  bool ZipCompress(const std::vector<char>& in,
+                   std::vector<char>* out) const {
+    return GzipCompress(in, out);
+  }
+  bool ZipCompressString(const std::string& str,
+                         std::vector<char>* out) const {
+    return GzipCompressString(str, out);
+  }
+  bool ZipDecompressString(const std::string& str,
+                           std::vector<char>* out) const {
+    return GzipDecompressString(str, out);
+  }
+  bool ZipCompressBytes(const char* in,
+                        size_t in_size,
+                        std::vector<char>* out) const {
+    return GzipCompressBytes(in, in_size, out);
+  }
+};
+
+class XzTest {};
+
+template <>
+class ZipTest<XzTest> : public ::testing::Test {
+ public:
+  bool ZipDecompress(const std::vector<char>& in,
+                     std::vector<char>* out) const {
+    return XzDecompress(in, out);
+  }
+  bool ZipCompress(const std::vector<char>& in,
+                   std::vector<char>* out) const {
+    return XzCompress(in, out);
+  }
+  bool ZipCompressString(const std::string& str,
+                         std::vector<char>* out) const {
+    return XzCompressString(str, out);
+  }
+  bool ZipDecompressString(const std::string& str,
+                           std::vector<char>* out) const {
+    return XzDecompressString(str, out);
+  }
+  bool ZipCompressBytes(const char* in,
+                        size_t in_size,
+                        std::vector<char>* out) const {
+    return XzCompressBytes(in, in_size, out);
+  }
+};
+
+typedef ::testing::Types<BzipTest, GzipTest, XzTest> ZipTestTypes;
 TYPED_TEST_CASE(ZipTest, ZipTestTypes);
 
 
@@ -97,6 +163,20 @@ TYPED_TEST(ZipTest, MalformedZipTest) {
   EXPECT_FALSE(this->ZipDecompressString(in, &out));
 }
 
+TYPED_TEST(ZipTest, CompressBytesTest) {
+  // Compresses part of a buffer in place.
+  string in("xxxx this should compress well xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx"
+            "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx");
+  vector<char> out;
+  EXPECT_TRUE(this->ZipCompressBytes(in.data() + 5, in.size() - 5, &out));
+  vector<char> decompressed;
+  EXPECT_TRUE(this->ZipDecompress(out, &decompressed));
+  EXPECT_EQ(in.substr(5), string(decompressed.begin(), decompressed.end()));
+
+  EXPECT_TRUE(this->ZipCompressBytes(NULL, 0, &out));
+  EXPECT_EQ(0, out.size());
+}
+
 TYPED_TEST(ZipTest, EmptyInputsTest) {
   string in;
   vector<char> out;